@@ -0,0 +1,301 @@
+#include "audio_import.h"
+#include "audio_stream.h"
+#include "note_store.h"
+#include "note_writer.h"
+#include "settings.h"
+#include "transcription_engine.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Shorter files are not split into sections (see transcribeChunked), so
+// several of them share a job instead
+const double SHORT_SECONDS = 240.0;
+// Threads one short file still makes good use of
+const int FILE_THREADS = 4;
+// Copied files are queued in batches this size, so transcription starts
+// while a large folder is still being copied
+const std::size_t BATCH = 16;
+
+std::string notesDir() {
+    std::string dir = Settings::voice_notes_path;
+    if (!dir.empty() && dir.back() != '/' && dir.back() != '\\') dir.push_back('/');
+    return dir;
+}
+
+std::string lowerExt(const fs::path& p) {
+    std::string ext = p.extension().string();
+    for (char& c : ext) c = (char) std::tolower((unsigned char) c);
+    return ext;
+}
+
+bool isAudio(const fs::path& p) {
+    const std::string ext = lowerExt(p);
+    return ext == ".wav" || ext == ".flac" || ext == ".ogg" || ext == ".mp3";
+}
+
+// note_<write time>, in the format of recorded notes
+std::string baseFor(const fs::path& p) {
+    std::error_code ec;
+    const auto ftime = fs::last_write_time(p, ec);
+    std::time_t t = std::time(nullptr);
+    if (!ec) {
+        const auto sys = std::chrono::system_clock::now() +
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(ftime - fs::file_time_type::clock::now());
+        t = std::chrono::system_clock::to_time_t(sys);
+    }
+    std::tm local{};
+#if defined(_WIN32)
+    localtime_s(&local, &t);
+#else
+    local = *std::localtime(&t);
+#endif
+    char buf[32];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%d_%H-%M-%S", &local);
+    return std::string("note_") + buf;
+}
+
+// 0 when the file cannot be decoded
+double durationOf(const std::string& path) {
+    sf::InputSoundFile probe;
+    if (!probe.openFromFile(path) || probe.getChannelCount() == 0 || probe.getSampleRate() == 0) return 0.0;
+    return (double) probe.getSampleCount() / probe.getChannelCount() / probe.getSampleRate();
+}
+
+bool baseTaken(const std::string& dir, const std::string& base) {
+    std::error_code ec;
+    for (const char* ext : {".txt", ".wav", ".flac", ".ogg", ".mp3"}) {
+        if (fs::exists(dir + base + ext, ec)) return true;
+    }
+    std::string packedBase;
+    NoteStore::Record rec;
+    auto store = NoteStore::forPath(dir + base + ".txt", packedBase);
+    return store && store->find(packedBase, rec);
+}
+
+} // namespace
+
+AudioImporter& AudioImporter::instance() {
+    static AudioImporter importer;
+    return importer;
+}
+
+AudioImporter::~AudioImporter() {
+    shutdown();
+}
+
+void AudioImporter::import(const std::vector<std::string>& paths) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (stopping) return;
+        incoming.insert(incoming.end(), paths.begin(), paths.end());
+        if (!worker.joinable()) worker = std::thread([this]{ run(); });
+    }
+    cv.notify_all();
+}
+
+void AudioImporter::resume() {
+    const std::string dir = notesDir();
+    std::set<std::string> listed;
+    {
+        std::ifstream f(dir + ".import_queue");
+        std::string line;
+        while (std::getline(f, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) listed.insert(line);
+        }
+    }
+    std::vector<Item> items;
+    for (const std::string& audio : listed) {
+        Item it;
+        it.audioPath = audio;
+        it.textPath = fs::path(audio).replace_extension(".txt").string();
+        // gone, or transcribed before the journal was updated
+        if (!fs::exists(audio) || !readNoteText(it.textPath).empty()) continue;
+        it.seconds = durationOf(audio);
+        items.push_back(std::move(it));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        journalDir = dir;
+        queued.clear();
+        saveJournalLocked();   // enqueue() lists the items again
+    }
+    if (!items.empty()) std::cout << "Resuming " << items.size() << " imports\n";
+    enqueue(std::move(items));
+}
+
+void AudioImporter::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+        incoming.clear();
+    }
+    cv.notify_all();
+    if (worker.joinable()) worker.join();
+}
+
+void AudioImporter::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    for (;;) {
+        cv.wait(lock, [this]{ return stopping || !incoming.empty(); });
+        if (stopping) break;
+        const std::string path = std::move(incoming.front());
+        incoming.pop_front();
+        lock.unlock();
+
+        std::vector<fs::path> files;
+        std::error_code ec;
+        if (fs::is_directory(path, ec)) {
+            for (auto it = fs::recursive_directory_iterator(path, fs::directory_options::skip_permission_denied, ec);
+                 !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+                if (it->is_regular_file(ec) && isAudio(it->path())) files.push_back(it->path());
+            }
+            std::sort(files.begin(), files.end());
+        } else if (isAudio(path)) {
+            files.push_back(path);
+        }
+
+        std::vector<Item> batch;
+        for (const fs::path& f : files) {
+            {
+                std::lock_guard<std::mutex> stop(mtx);
+                if (stopping) break;
+            }
+            copyIn(f.string(), batch);
+            if (batch.size() >= BATCH) enqueue(std::exchange(batch, {}));
+        }
+        enqueue(std::move(batch));
+        lock.lock();
+    }
+}
+
+void AudioImporter::copyIn(const std::string& source, std::vector<Item>& out) {
+    const std::string dir = notesDir();
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    const fs::path src(source);
+    Item it;
+    bool copied = false;
+    if (fs::equivalent(src.parent_path(), dir, ec)) {
+        // a recording of the folder itself: transcribe it in place
+        it.audioPath = source;
+    } else {
+        std::string base = baseFor(src);
+        for (int n = 2; baseTaken(dir, base); ++n) base = baseFor(src) + "_" + std::to_string(n);
+        it.audioPath = dir + base + lowerExt(src);
+        if (!fs::copy_file(src, it.audioPath, ec)) {
+            std::cerr << "Failed to import " << source << ": " << ec.message() << "\n";
+            return;
+        }
+        copied = true;
+    }
+    it.textPath = fs::path(it.audioPath).replace_extension(".txt").string();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (queued.count(it.audioPath)) return;
+    }
+    if (!readNoteText(it.textPath).empty()) return; // already has its text
+
+    it.seconds = durationOf(it.audioPath);
+    if (it.seconds <= 0.0) {
+        std::cerr << "Cannot decode " << source << "\n";
+        if (copied) fs::remove(it.audioPath, ec);
+        return;
+    }
+    // the note shows in the list at once
+    writeNoteText(it.textPath, "");
+    out.push_back(std::move(it));
+}
+
+void AudioImporter::enqueue(std::vector<Item> items) {
+    if (items.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (journalDir.empty()) journalDir = notesDir();
+        for (const Item& it : items) queued.insert(it.audioPath);
+        saveJournalLocked();
+    }
+
+    const TranscriptionEngine::ThreadPlan plan =
+        TranscriptionEngine::threadPlan(TranscriptionEngine::Priority::Background);
+    const std::size_t share = plan.efficient ? 1 : (std::size_t) std::max(1, plan.threads / FILE_THREADS);
+
+    std::vector<std::vector<Item>> jobs;
+    std::vector<Item> shorts;
+    for (Item& it : items) {
+        if (it.seconds >= SHORT_SECONDS || share == 1) {
+            jobs.push_back({std::move(it)});
+            continue;
+        }
+        shorts.push_back(std::move(it));
+        if (shorts.size() == share) jobs.push_back(std::exchange(shorts, {}));
+    }
+    if (!shorts.empty()) jobs.push_back(std::move(shorts));
+
+    for (auto& group : jobs) {
+        const std::string key = group.front().textPath;
+        auto files = std::make_shared<std::vector<Item>>(std::move(group));
+        TranscriptionEngine::instance().enqueue(key, [files](const std::atomic<bool>& cancel) {
+            AudioImporter& self = AudioImporter::instance();
+            // a preempted job starts over: skip the files it already finished
+            std::vector<const Item*> todo;
+            {
+                std::lock_guard<std::mutex> lock(self.mtx);
+                for (const Item& it : *files) if (self.queued.count(it.audioPath)) todo.push_back(&it);
+            }
+            std::vector<int> rcs(todo.size(), 0);
+            std::vector<std::thread> threads;
+            for (std::size_t i = 1; i < todo.size(); ++i) {
+                threads.emplace_back([&, i]{
+                    rcs[i] = sendAudioFileToWhisper(todo[i]->audioPath, todo[i]->textPath, &cancel, (int) todo.size());
+                });
+            }
+            if (!todo.empty()) {
+                rcs[0] = sendAudioFileToWhisper(todo[0]->audioPath, todo[0]->textPath, &cancel, (int) todo.size());
+            }
+            for (auto& t : threads) t.join();
+
+            int rc = 0;
+            for (std::size_t i = 0; i < todo.size(); ++i) {
+                // a file that cannot be transcribed is not retried; a cancelled one is
+                if (rcs[i] == 0 || !cancel) self.finished(*todo[i]);
+                if (rcs[i] != 0) rc = rcs[i];
+            }
+            return rc;
+        }, TranscriptionEngine::Priority::Background);
+    }
+}
+
+void AudioImporter::finished(const Item& item) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (queued.erase(item.audioPath)) saveJournalLocked();
+}
+
+void AudioImporter::saveJournalLocked() {
+    if (journalDir.empty()) return;
+    const std::string path = journalDir + ".import_queue";
+    if (queued.empty()) {
+        std::error_code ec;
+        fs::remove(path, ec);
+        return;
+    }
+    std::string data;
+    for (const std::string& audio : queued) data += audio + "\n";
+    if (!writeFileAtomic(path, data)) std::cerr << "Failed to save " << path << "\n";
+}
@@ -0,0 +1,61 @@
+#ifndef AUDIO_IMPORT_H
+#define AUDIO_IMPORT_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bulk import of existing recordings (.wav, .flac, .ogg, .mp3), dropped on
+// the window or passed on the command line. Each file, or every one under a
+// folder, is copied into the notes folder as a new note named after its
+// write time and transcribed by a background TranscriptionEngine job, so
+// recordings and interactive work go first and the threads follow the power
+// policy. Short files share a job, several side by side on a share of the
+// threads each (a short file cannot use many); long ones are split into
+// sections by the engine path itself.
+//
+// Queued files are listed in <notes>/.import_queue until their job finished,
+// so an import cut short by quitting resumes on the next start.
+class AudioImporter {
+public:
+    static AudioImporter& instance();
+
+    // Files and folders; copying and queueing run on a background thread
+    void import(const std::vector<std::string>& paths);
+    // Queue what the journal of the notes folder still lists
+    void resume();
+
+    void shutdown();
+
+private:
+    AudioImporter() = default;
+    ~AudioImporter();
+    AudioImporter(const AudioImporter&) = delete;
+    AudioImporter& operator=(const AudioImporter&) = delete;
+
+    struct Item {
+        std::string audioPath;   // the copy in the notes folder
+        std::string textPath;
+        double seconds = 0.0;
+    };
+
+    void run();
+    void copyIn(const std::string& source, std::vector<Item>& out);
+    void enqueue(std::vector<Item> items);
+    void finished(const Item& item);
+    void saveJournalLocked();
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::string> incoming;    // dropped paths not copied yet
+    std::thread worker;
+    bool stopping = false;
+    std::string journalDir;              // notes folder the journal belongs to
+    std::set<std::string> queued;        // audio paths in the journal
+};
+
+#endif // AUDIO_IMPORT_H
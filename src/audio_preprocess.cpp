@@ -0,0 +1,251 @@
+#include "audio_preprocess.h"
+#include "whisper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <utility>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <immintrin.h>
+  #define AP_SSE2 1
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+  #include <arm_neon.h>
+  #define AP_NEON 1
+#endif
+
+// ---------- int16 -> mono float ----------
+
+void int16ToMonoFloat(const std::int16_t* in, std::size_t frames, unsigned channels, float* out) {
+    if (channels == 0) return;
+    std::size_t i = 0;
+
+    if (channels == 1) {
+        const float scale = 1.0f / 32768.0f;
+#if defined(__AVX2__)
+        const __m256 vs = _mm256_set1_ps(scale);
+        for (; i + 8 <= frames; i += 8) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(x));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(f, vs));
+        }
+#elif defined(AP_SSE2)
+        const __m128 vs = _mm_set1_ps(scale);
+        for (; i + 8 <= frames; i += 8) {
+            __m128i x  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16); // sign-extend
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+            _mm_storeu_ps(out + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), vs));
+            _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vs));
+        }
+#elif defined(AP_NEON)
+        const float32x4_t vs = vdupq_n_f32(scale);
+        for (; i + 8 <= frames; i += 8) {
+            int16x8_t x = vld1q_s16(in + i);
+            vst1q_f32(out + i,     vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))),  vs));
+            vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), vs));
+        }
+#endif
+        for (; i < frames; ++i) out[i] = static_cast<float>(in[i]) * scale;
+        return;
+    }
+
+    if (channels == 2) {
+        // (l + r) / 2 / 32768; pairwise sums come for free from madd with ones
+        const float scale = 1.0f / 65536.0f;
+#if defined(__AVX2__)
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256 vs = _mm256_set1_ps(scale);
+        for (; i + 8 <= frames; i += 8) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i));
+            __m256 f = _mm256_cvtepi32_ps(_mm256_madd_epi16(x, ones));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(f, vs));
+        }
+#elif defined(AP_SSE2)
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128 vs = _mm_set1_ps(scale);
+        for (; i + 4 <= frames; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+            __m128 f = _mm_cvtepi32_ps(_mm_madd_epi16(x, ones));
+            _mm_storeu_ps(out + i, _mm_mul_ps(f, vs));
+        }
+#elif defined(AP_NEON)
+        const float32x4_t vs = vdupq_n_f32(scale);
+        for (; i + 4 <= frames; i += 4) {
+            int16x4x2_t lr = vld2_s16(in + 2 * i);
+            int32x4_t sum = vaddl_s16(lr.val[0], lr.val[1]);
+            vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(sum), vs));
+        }
+#endif
+        for (; i < frames; ++i) {
+            out[i] = static_cast<float>(in[2 * i] + in[2 * i + 1]) * scale;
+        }
+        return;
+    }
+
+    const float scale = 1.0f / (static_cast<float>(channels) * 32768.0f);
+    for (; i < frames; ++i) {
+        int32_t acc = 0;
+        for (unsigned ch = 0; ch < channels; ++ch) acc += in[i * channels + ch];
+        out[i] = static_cast<float>(acc) * scale;
+    }
+}
+
+// ---------- polyphase resampler ----------
+
+static constexpr int TAPS_PER_PHASE = 32; // multiple of 8 for the SIMD dot product
+
+struct Resampler::Taps {
+    unsigned up = 1;
+    std::vector<float> coeffs; // [phase][TAPS_PER_PHASE], reversed so they run forward over the input
+};
+
+static float dot(const float* a, const float* b) {
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (int k = 0; k < TAPS_PER_PHASE; k += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(b + k), acc);
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+#elif defined(AP_SSE2)
+    __m128 acc = _mm_setzero_ps();
+    for (int k = 0; k < TAPS_PER_PHASE; k += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc);
+#elif defined(AP_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (int k = 0; k < TAPS_PER_PHASE; k += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(a + k), vld1q_f32(b + k));
+    }
+    float32x2_t s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+#else
+    float acc = 0.0f;
+    for (int k = 0; k < TAPS_PER_PHASE; ++k) acc += a[k] * b[k];
+    return acc;
+#endif
+}
+
+// Blackman-windowed sinc low-pass at the upsampled rate, split into L phases.
+// Cached per ratio: 44.1k->16k and 48k->16k are computed once per process.
+static std::shared_ptr<const Resampler::Taps> tapsFor(unsigned up, unsigned down) {
+    static std::mutex mtx;
+    static std::map<std::pair<unsigned, unsigned>, std::shared_ptr<const Resampler::Taps>> cache;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = cache.find({up, down});
+    if (it != cache.end()) return it->second;
+
+    auto taps = std::make_shared<Resampler::Taps>();
+    taps->up = up;
+
+    const int n = TAPS_PER_PHASE * (int)up;
+    const double center = (n - 1) / 2.0;
+    const double fc = 0.475 / (double)std::max(up, down); // cycles per upsampled sample, just under Nyquist
+    const double pi = 3.14159265358979323846;
+
+    std::vector<double> h(n);
+    double sum = 0.0;
+    for (int i = 0; i < n; ++i) {
+        const double t = i - center;
+        const double sinc = (t == 0.0) ? 2.0 * fc : std::sin(2.0 * pi * fc * t) / (pi * t);
+        const double w = 0.42 - 0.5 * std::cos(2.0 * pi * i / (n - 1)) + 0.08 * std::cos(4.0 * pi * i / (n - 1));
+        h[i] = sinc * w;
+        sum += h[i];
+    }
+
+    // unity DC gain per output sample (each phase sees every L-th tap)
+    const double gain = (double)up / sum;
+    taps->coeffs.resize((size_t)n);
+    for (unsigned p = 0; p < up; ++p) {
+        for (int k = 0; k < TAPS_PER_PHASE; ++k) {
+            // output uses x[base - k] * h[p + k*L]; store reversed for a forward dot over x[base-K+1 .. base]
+            taps->coeffs[(size_t)p * TAPS_PER_PHASE + (TAPS_PER_PHASE - 1 - k)] =
+                static_cast<float>(h[p + (size_t)k * up] * gain);
+        }
+    }
+
+    cache[{up, down}] = taps;
+    return taps;
+}
+
+Resampler::Resampler(unsigned inRate, unsigned outRate) {
+    if (inRate == 0 || outRate == 0) return;
+    const unsigned g = std::gcd(inRate, outRate);
+    up   = outRate / g;
+    down = inRate  / g;
+    if (!passthrough()) taps = tapsFor(up, down);
+    reset();
+}
+
+void Resampler::reset() {
+    buf.assign(TAPS_PER_PHASE - 1, 0.0f);
+    pos = 0;
+}
+
+void Resampler::process(const float* in, std::size_t n, std::vector<float>& out) {
+    if (n == 0) return;
+    if (passthrough()) {
+        out.insert(out.end(), in, in + n);
+        return;
+    }
+
+    // buf = [K-1 samples of history][n new samples]
+    buf.insert(buf.end(), in, in + n);
+
+    const float* coeffs = taps->coeffs.data();
+    const std::uint64_t end = (std::uint64_t)n * up;
+    out.reserve(out.size() + (std::size_t)(end / down) + 1);
+    for (; pos < end; pos += down) {
+        const std::size_t base  = (std::size_t)(pos / up);
+        const std::size_t phase = (std::size_t)(pos % up);
+        out.push_back(dot(coeffs + phase * TAPS_PER_PHASE, buf.data() + base));
+    }
+    pos -= end;
+
+    buf.erase(buf.begin(), buf.end() - (TAPS_PER_PHASE - 1));
+}
+
+// ---------- int16 stream -> whisper input ----------
+
+PcmConverter::PcmConverter(unsigned inRate, unsigned channels_, unsigned outRate)
+    : channels(channels_ ? channels_ : 1), resampler(inRate, outRate) {}
+
+void PcmConverter::push(const std::int16_t* samples, std::size_t sampleCount, std::vector<float>& out) {
+    if (!samples) return;
+    const std::size_t frames = sampleCount / channels;
+
+    // bounded scratch: long recordings never get a full-length mono copy
+    constexpr std::size_t BLOCK = 1 << 15;
+    for (std::size_t f = 0; f < frames; f += BLOCK) {
+        const std::size_t nf = std::min(BLOCK, frames - f);
+        if (resampler.passthrough()) {
+            const std::size_t base = out.size();
+            out.resize(base + nf);
+            int16ToMonoFloat(samples + f * channels, nf, channels, out.data() + base);
+        } else {
+            mono.resize(nf);
+            int16ToMonoFloat(samples + f * channels, nf, channels, mono.data());
+            resampler.process(mono.data(), nf, out);
+        }
+    }
+}
+
+std::vector<float> convertToWhisperPcm(const std::int16_t* samples, std::size_t sampleCount,
+                                       unsigned sampleRate, unsigned channelCount) {
+    std::vector<float> pcmf32;
+    if (!samples || channelCount == 0 || sampleRate == 0) return pcmf32;
+
+    PcmConverter conv(sampleRate, channelCount, WHISPER_SAMPLE_RATE);
+    pcmf32.reserve((std::size_t)((double)(sampleCount / channelCount) * WHISPER_SAMPLE_RATE / sampleRate) + 1);
+    conv.push(samples, sampleCount, pcmf32);
+    return pcmf32;
+}
@@ -0,0 +1,58 @@
+#ifndef AUDIO_PREPROCESS_H
+#define AUDIO_PREPROCESS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Capture-path audio preprocessing: 16-bit interleaved PCM -> mono float at
+// whisper's rate. Used for recordings, live transcription and imports.
+
+// Downmix interleaved int16 frames to mono float in [-1, 1).
+// Vectorized for mono and stereo (SSE2/AVX2/NEON), scalar otherwise.
+void int16ToMonoFloat(const std::int16_t* in, std::size_t frames, unsigned channels, float* out);
+
+// Streaming polyphase windowed-sinc resampler for a rational ratio.
+// Filter taps are computed once per ratio and shared between instances;
+// state carries across process() calls so chunk boundaries are seamless.
+class Resampler {
+public:
+    Resampler(unsigned inRate, unsigned outRate);
+
+    // Appends the resampled output of `n` input samples to `out`
+    void process(const float* in, std::size_t n, std::vector<float>& out);
+    void reset();
+
+    bool passthrough() const { return up == down; }
+
+    struct Taps;
+
+private:
+    unsigned up = 1;    // L
+    unsigned down = 1;  // M
+    std::shared_ptr<const Taps> taps;
+    std::vector<float> buf;   // tapsPerPhase-1 samples of history + current input
+    std::uint64_t pos = 0;    // next output position (units of 1/L input samples)
+};
+
+// Block-wise int16 -> mono float -> resampled, without a full-length
+// intermediate buffer; keep one per stream.
+class PcmConverter {
+public:
+    PcmConverter(unsigned inRate, unsigned channels, unsigned outRate);
+
+    // `sampleCount` counts interleaved samples (frames * channels)
+    void push(const std::int16_t* samples, std::size_t sampleCount, std::vector<float>& out);
+
+private:
+    unsigned channels;
+    Resampler resampler;
+    std::vector<float> mono;
+};
+
+// One-shot conversion of a whole recording to whisper input
+std::vector<float> convertToWhisperPcm(const std::int16_t* samples, std::size_t sampleCount,
+                                       unsigned sampleRate, unsigned channelCount);
+
+#endif // AUDIO_PREPROCESS_H
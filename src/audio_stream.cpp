@@ -1,6 +1,8 @@
+#include "audio_stream.h"
 #include "whisper.h"
-#include <SFML/Audio/SoundBufferRecorder.hpp>
-#include <SFML/Audio/SoundBuffer.hpp>
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <string>
 #include <thread>
@@ -11,10 +13,61 @@
 #include <cmath>
 #include <vector>
 #include <fstream>
+#include <algorithm>
 #include "settings.h"
+#include "transcription_engine.h"
+#include "live_transcriber.h"
+#include "note_refiner.h"
+#include "note_summarizer.h"
+#include "note_store.h"
+#include "recording_writer.h"
+#include "audio_preprocess.h"
+#include "speech_gate.h"
+#include "transcript.h"
+#include "transcription_ledger.h"
+#include "capture_devices.h"
+#include "model_catalog.h"
+#include "perf_trace.h"
+#include <SFML/Audio/SoundRecorder.hpp>
+#include <future>
+#include <filesystem>
+#include <memory>
+#include <mutex>
 
 using namespace std;
 
+// whisper's native window; longer audio is decoded chunk by chunk
+static const int CHUNK_SECONDS = 30;
+// Long notes are split so each section gets at least this much audio and
+// this many threads
+static const int MIN_SECTION_SECONDS = 120;
+static const int MIN_SECTION_THREADS = 4;
+// Raw audio handed to the VAD per call
+static const std::size_t VAD_BLOCK = 10 * WHISPER_SAMPLE_RATE;
+
+static std::future<void> quantizer;   // background quantization, at most one
+
+// The configured model, or its variant for Settings::model_preference
+static std::string activeModelPath() {
+    return resolveModelPath(Settings::whisper_model_path, Settings::model_preference);
+}
+
+void preloadWhisperModel() {
+    // First run with quantize_models: build the preferred variant while the
+    // full model serves (quantized as it loads); the variant saves that work
+    // on later loads, which pick it up via activeModelPath()
+    const std::string quant = preferredQuant(Settings::model_preference);
+    const std::string target = quantizedPath(Settings::whisper_model_path, quant);
+    const bool busy = quantizer.valid() && quantizer.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+    if (Settings::quantize_models && !quant.empty() && !busy && target != Settings::whisper_model_path &&
+        std::filesystem::exists(Settings::whisper_model_path) && !std::filesystem::exists(target)) {
+        const std::string src = Settings::whisper_model_path;
+        quantizer = std::async(std::launch::async, [src, target, quant]{ quantizeModel(src, target, quant); });
+    }
+
+    TranscriptionEngine::instance().loadAsync(activeModelPath());
+}
+
 string getTimestamp() {
     time_t now = time(nullptr);
     tm local{};
@@ -28,157 +81,867 @@ string getTimestamp() {
     return string(buf);
 }
 
-int sendAudioFileToWhisper(std::string audioPath, std::string textPath) {
-    // Load the recorded WAV file saved by stopRecordAudioFromMicrophone()
-    sf::SoundBuffer buffer;
-    if (!buffer.loadFromFile(audioPath)) {
-        std::cerr << "Failed to load record.wav\n";
-        return 1;
-    }
+// Appends up to `max` 16 kHz mono samples; returns false once exhausted
+using PcmReader = std::function<bool(std::vector<float>&, std::size_t)>;
+// Opens a reader over [begin, end) of a recording, in 16 kHz samples;
+// returns an empty function when the audio cannot be read
+using PcmSource = std::function<PcmReader(std::size_t, std::size_t)>;
 
-    auto samples16 = buffer.getSamples();
-    const std::size_t sampleCount = buffer.getSampleCount(); // total samples (frames * channels)
-    const unsigned sampleRate = buffer.getSampleRate();
-    const unsigned channelCount = buffer.getChannelCount();
+// Pulls up to `frames` interleaved frames from `pull` and resamples them for whisper
+static PcmReader makePcmReader(unsigned rate, unsigned channels, std::uint64_t frames,
+                               std::function<std::size_t(std::int16_t*, std::size_t)> pull) {
+    struct State {
+        PcmConverter conv;
+        std::vector<std::int16_t> block;
+        std::uint64_t left;
+        std::function<std::size_t(std::int16_t*, std::size_t)> pull;
+    };
+    auto st = std::make_shared<State>(State{PcmConverter(rate, channels, WHISPER_SAMPLE_RATE), {}, frames, std::move(pull)});
 
-    // Convert to mono float [-1,1], downmix if needed (at the source sample rate)
-    const std::size_t frames = sampleCount / channelCount;
-    std::vector<float> pcmf32;
-    pcmf32.resize(frames);
+    return [st, rate, channels](std::vector<float>& out, std::size_t max) {
+        const std::size_t target = out.size() + max;
+        while (out.size() < target) {
+            if (st->left == 0) return false;
+            // input frames for what is still missing, at least one block
+            const std::size_t want = (std::size_t) std::min<std::uint64_t>(
+                st->left, std::max<std::size_t>(4096, (target - out.size()) * rate / WHISPER_SAMPLE_RATE + 1));
+            st->block.resize(want * channels);
+            const std::size_t got = st->pull(st->block.data(), want);
+            if (got == 0) { st->left = 0; return false; }
+            st->left -= got;
+            st->conv.push(st->block.data(), got * channels, out);
+        }
+        return st->left > 0;
+    };
+}
+
+// Shared by the sections of one transcription
+struct ChunkedJob {
+    whisper_context* ctx = nullptr;
+    std::string textPath;
+    std::size_t total = 0;               // 16 kHz samples in the recording
+    std::atomic<std::size_t> done{0};    // samples committed by all sections
+    bool quiet = false;                  // post no events (background refinement)
+    const std::atomic<bool>* abort = nullptr; // stops decoding when set
+};
+
+// A contiguous stretch of the recording decoded by one state/thread
+struct Section {
+    std::size_t begin = 0, end = 0;
+    whisper_state* state = nullptr;
+    int threads = 4;
+    std::ofstream* file = nullptr;       // the first section streams into the note
+    std::vector<std::string> lines;      // later ones hold their text until it is done
+    TranscriptBuilder transcript;        // timings and tokens of the committed segments
+    std::shared_ptr<SpeechGate> gate;    // section-relative speech map
+    std::uint64_t reported = 0;          // original samples added to job.done
+    int rc = 0;
+};
+
+// Progress of one chunk mapped onto the whole recording
+struct ChunkProgress {
+    ChunkedJob* job;
+    double base;    // samples done before this chunk
+    double span;    // original samples this chunk covers
+};
+
+static void postProgress(const ChunkedJob& job, double samples) {
+    if (job.total) PerfTrace::instance().jobProgress(samples / (double) job.total);
+    if (job.quiet) return;
+    TranscriptionEvent ev;
+    ev.type = TranscriptionEvent::Type::Progress;
+    ev.textPath = job.textPath;
+    ev.progress = job.total ? std::min(100, static_cast<int>(100.0 * samples / (double) job.total)) : 0;
+    TranscriptionEngine::instance().postEvent(std::move(ev));
+}
+
+static void onChunkProgress(struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, int progress, void * user_data) {
+    const ChunkProgress& p = *static_cast<const ChunkProgress*>(user_data);
+    postProgress(*p.job, p.base + p.span * progress / 100.0);
+}
+
+static void postSegment(const ChunkedJob& job, std::ofstream& file, const std::string& text) {
+    file << text << '\n';
+    TranscriptionEvent ev;
+    ev.type = TranscriptionEvent::Type::Segment;
+    ev.textPath = job.textPath;
+    ev.text = text;
+    TranscriptionEngine::instance().postEvent(std::move(ev));
+}
 
-    for (std::size_t i = 0; i < frames; ++i) {
-        int32_t acc = 0;
-        for (unsigned ch = 0; ch < channelCount; ++ch) {
-            acc += samples16[i * channelCount + ch];
+// whisper sees at most CHUNK_SECONDS of audio at a time, with the previous
+// chunk's tokens as prompt. The last segment of a chunk is usually cut
+// mid-word, so it is re-decoded at the start of the next one.
+static void transcribeSection(ChunkedJob& job, Section& sec, const PcmReader& read, bool fineProgress) {
+    const std::size_t CHUNK = (std::size_t) CHUNK_SECONDS * WHISPER_SAMPLE_RATE;
+
+    std::vector<float> window;
+    window.reserve(CHUNK);
+    std::vector<whisper_token> prompt;
+    std::uint64_t windowStart = 0;       // gated samples before window[0]
+    bool more = true;
+
+    // whisper times are 10 ms units from the window start, the transcript
+    // keeps ms of the recording
+    const TranscriptBuilder::TimeMap toMs = [&](std::int64_t t) {
+        const std::uint64_t gated = windowStart + (std::uint64_t) std::max<std::int64_t>(0, t) * WHISPER_SAMPLE_RATE / 100;
+        return (std::uint32_t) ((sec.begin + sec.gate->toOriginal(gated)) * 1000 / WHISPER_SAMPLE_RATE);
+    };
+
+    while (more || !window.empty()) {
+        if (job.abort && job.abort->load()) {
+            sec.rc = 6;
+            return;
         }
-        float f = static_cast<float>(acc) / (static_cast<float>(channelCount) * 32768.0f);
-        if (f > 1.0f) f = 1.0f;
-        if (f < -1.0f) f = -1.0f;
-        pcmf32[i] = f;
-    }
+        if (more && window.size() < CHUNK) more = read(window, CHUNK - window.size());
+        if (window.empty()) break;
 
-    // If sample rate differs, resample to WHISPER_SAMPLE_RATE using linear interpolation
-    std::vector<float> pcmf32_resampled;
-    if (sampleRate != WHISPER_SAMPLE_RATE) {
-        const int in_rate = static_cast<int>(sampleRate);
-        const int out_rate = WHISPER_SAMPLE_RATE;
-        const std::size_t in_frames = pcmf32.size();
-        if (in_frames == 0) {
-            std::cerr << "No audio frames to resample\n";
-            return 2;
+        ChunkProgress progress{&job, (double) job.done.load(), (double) (sec.gate->consumed() - sec.reported)};
+        struct whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        wparams.n_threads = sec.threads;
+        // a short note or the last chunk does not need the full 30 s encoder
+        wparams.audio_ctx_auto = true;
+        wparams.token_timestamps = true;
+        if (fineProgress) {
+            wparams.progress_callback = onChunkProgress;
+            wparams.progress_callback_user_data = &progress;
+        }
+        wparams.prompt_tokens = prompt.empty() ? nullptr : prompt.data();
+        wparams.prompt_n_tokens = (int) prompt.size();
+        if (job.abort) {
+            wparams.abort_callback = [](void* flag) { return static_cast<const std::atomic<bool>*>(flag)->load(); };
+            wparams.abort_callback_user_data = (void*) job.abort;
         }
 
-        const std::size_t out_frames = static_cast<std::size_t>( (double)in_frames * out_rate / in_rate + 0.5 );
-        pcmf32_resampled.resize(out_frames);
+        int rc;
+        {
+            PerfTrace::WhisperCall traced(sec.state, "whisper_full");
+            rc = whisper_full_with_state(job.ctx, sec.state, wparams, window.data(), (int) window.size());
+        }
+        if (rc != 0) {
+            std::fprintf(stderr, "whisper_full failed\n");
+            sec.rc = 5;
+            return;
+        }
 
-        const double rate_ratio = static_cast<double>(in_rate) / static_cast<double>(out_rate);
-        for (std::size_t i = 0; i < out_frames; ++i) {
-            double src = i * rate_ratio;
-            std::size_t idx = static_cast<std::size_t>(std::floor(src));
-            double frac = src - (double)idx;
-            float v0 = pcmf32[idx];
-            float v1 = (idx + 1 < in_frames) ? pcmf32[idx + 1] : v0;
-            pcmf32_resampled[i] = static_cast<float>(v0 * (1.0 - frac) + v1 * frac);
+        // Hold back the trailing segment while more audio follows
+        const int n_segments = whisper_full_n_segments_from_state(sec.state);
+        int n_commit = n_segments;
+        std::size_t keepFrom = window.size();
+        if (more && n_segments > 1) {
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(sec.state, n_segments - 2); // 10 ms units
+            const std::size_t cut = (std::size_t) std::max<int64_t>(0, t1) * WHISPER_SAMPLE_RATE / 100;
+            if (cut > 0 && cut < window.size()) {
+                n_commit = n_segments - 1;
+                keepFrom = cut;
+            }
         }
-        std::cout << "Resampled audio: " << in_frames << " -> " << out_frames << " frames (" << sampleRate << " -> " << WHISPER_SAMPLE_RATE << " Hz)\n";
-    } else {
-        pcmf32_resampled.swap(pcmf32);
+
+        prompt.clear();
+        for (int i = 0; i < n_commit; ++i) {
+            const char *seg_text = whisper_full_get_segment_text_from_state(sec.state, i);
+            const std::string text = seg_text ? seg_text : "";
+            if (sec.file) postSegment(job, *sec.file, text);
+            else sec.lines.push_back(text);
+
+            const int n_tokens = whisper_full_n_tokens_from_state(sec.state, i);
+            for (int j = 0; j < n_tokens; ++j) prompt.push_back(whisper_full_get_token_id_from_state(sec.state, i, j));
+        }
+        sec.transcript.addSegments(job.ctx, sec.state, n_commit, toMs);
+        if (sec.file) sec.file->flush();
+
+        // progress follows the original timeline, silences included
+        const std::uint64_t now = sec.gate->consumed();
+        postProgress(job, (double) (job.done += (std::size_t) (now - sec.reported)));
+        sec.reported = now;
+        window.erase(window.begin(), window.begin() + (std::ptrdiff_t) keepFrom);
+        windowStart += keepFrom;
+    }
+}
+
+// Reads the section in VAD-sized blocks and yields only its speech
+static PcmReader gatedReader(PcmReader raw, std::shared_ptr<SpeechGate> gate) {
+    auto block = std::make_shared<std::vector<float>>();
+    auto more = std::make_shared<bool>(true);
+    return [raw, gate, block, more](std::vector<float>& out, std::size_t max) {
+        const std::size_t target = out.size() + max;
+        while (out.size() < target && *more) {
+            block->clear();
+            *more = raw(*block, VAD_BLOCK);
+            gate->push(block->data(), block->size(), out);
+        }
+        return *more;
+    };
+}
+
+// Middle of the quietest 20 ms within 2 s of `at`, so sections split between words
+static std::size_t quietPointNear(const PcmSource& source, std::size_t at, std::size_t total) {
+    const std::size_t reach = 2 * WHISPER_SAMPLE_RATE, frame = WHISPER_SAMPLE_RATE / 50;
+    const std::size_t begin = at > reach ? at - reach : 0;
+    const std::size_t end = std::min(total, at + reach);
+    PcmReader read = source(begin, end);
+    if (!read) return at;
+
+    std::vector<float> pcm;
+    read(pcm, end - begin);
+    double best = HUGE_VAL;
+    std::size_t pos = at;
+    for (std::size_t f = 0; f + frame <= pcm.size(); f += frame) {
+        double e = 0.0;
+        for (std::size_t k = f; k < f + frame; ++k) e += (double) pcm[k] * pcm[k];
+        if (e < best) { best = e; pos = begin + f + frame / 2; }
     }
+    return pos;
+}
 
-    // Initialize model/context
-    whisper_context_params cparams = whisper_context_default_params();
-    struct whisper_context * ctx = whisper_init_from_file_with_params("whisper/models/ggml-base.en.bin", cparams);
-    if (!ctx) {
-        std::cerr << "Failed to load model 'whisper/models/ggml-base.en.bin'\n";
+// Long-form driver. Long notes are split into sections decoded in parallel
+// (like whisper_full_parallel, but on pooled states and streamed audio);
+// each thread only holds one chunk of audio, and with a VAD model only its
+// speech reaches the encoder. Text is appended to the note as
+// the first section progresses and the other sections follow once it is done.
+static int transcribeChunked(const PcmSource& source, std::size_t totalSamples, const std::string& textPath,
+                             const std::atomic<bool>* cancel, int threadShare = 1) {
+    if (totalSamples == 0) {
+        std::cerr << "No audio frames to transcribe\n";
+        return 2;
+    }
+
+    // Borrow the shared model (loaded once per process) and pooled states
+    TranscriptionEngine& engine = TranscriptionEngine::instance();
+    const std::string modelPath = activeModelPath();
+    if (!engine.load(modelPath)) {
+        std::cerr << "Failed to load model '" << modelPath << "'\n";
         return 3;
     }
 
-    struct whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-    wparams.n_threads = 4; // TODO: tune as appropriate
+    const TranscriptionEngine::ThreadPlan plan = TranscriptionEngine::threadPlan(engine.currentPriority());
+    const int threads = std::max(1, plan.threads / std::max(1, threadShare));
+    int n_sections = Settings::transcription_processors;
+    if (plan.efficient) {
+        // one section on the efficiency cores
+        n_sections = 1;
+    } else if (n_sections <= 0) {
+        n_sections = std::min<int>(threads / MIN_SECTION_THREADS,
+                                   (int) (totalSamples / ((std::size_t) MIN_SECTION_SECONDS * WHISPER_SAMPLE_RATE)));
+    }
+    // never split below one whisper window
+    n_sections = std::clamp(n_sections, 1,
+                            std::max(1, (int) (totalSamples / ((std::size_t) CHUNK_SECONDS * WHISPER_SAMPLE_RATE))));
+
+    std::vector<std::unique_ptr<StateLease>> leases;
+    std::vector<Section> sections(n_sections);
+    for (int i = 0; i < n_sections; ++i) {
+        leases.push_back(std::make_unique<StateLease>(engine));
+        if (!*leases.back()) {
+            std::cerr << "Failed to create whisper state\n";
+            return 4;
+        }
+        Section& sec = sections[i];
+        sec.state = leases.back()->get();
+        sec.threads = std::max(1, threads / n_sections);
+        sec.gate = std::make_shared<SpeechGate>();
+        sec.gate->open(Settings::vad_model_path, sec.threads);
+        sec.begin = i == 0 ? 0 : quietPointNear(source, totalSamples * i / n_sections, totalSamples);
+        if (i > 0) sections[i - 1].end = sec.begin;
+    }
+    sections.back().end = totalSamples;
+    // released before the lease, on the thread that computes section 0
+    std::unique_ptr<EfficientThreads> efficient;
+    if (plan.efficient) efficient = std::make_unique<EfficientThreads>(sections[0].state, threads);
+
+    PerfTrace::Job timed((double) totalSamples / WHISPER_SAMPLE_RATE);
+    ChunkedJob job;
+    job.ctx = engine.context();
+    job.textPath = textPath;
+    job.total = totalSamples;
+    job.abort = cancel;
+
+    ofstream audioTextFile(textPath, std::ios::trunc);
+    sections[0].file = &audioTextFile;
 
-    std::cout << "starting whisper transcription\n";
+    std::cout << "starting whisper transcription (" << n_sections << " x " << sections[0].threads << " threads)\n";
 
-    // run transcription
-    const int n_samples = static_cast<int>(pcmf32_resampled.size());
-    if (whisper_full(ctx, wparams, pcmf32_resampled.data(), n_samples) != 0) {
-        std::fprintf(stderr, "whisper_full failed\n");
-        whisper_free(ctx);
-        return 5;
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_sections; ++i) {
+        workers.emplace_back([&job, &source, &sec = sections[i]]{
+            PcmReader read = source(sec.begin, sec.end);
+            if (!read) { sec.rc = 1; return; }
+            transcribeSection(job, sec, gatedReader(read, sec.gate), false);
+        });
+    }
+    {
+        PcmReader read = source(sections[0].begin, sections[0].end);
+        if (read) transcribeSection(job, sections[0], gatedReader(read, sections[0].gate), n_sections == 1);
+        else sections[0].rc = 1;
     }
+    for (auto& w : workers) w.join();
 
-    std::cout << "transcription completed, writing text file\n";
+    for (const Section& sec : sections) {
+        if (sec.rc != 0) return sec.rc;
+    }
+    for (std::size_t i = 1; i < sections.size(); ++i) {
+        for (const std::string& text : sections[i].lines) postSegment(job, audioTextFile, text);
+        sections[0].transcript.append(sections[i].transcript);
+    }
+    audioTextFile.flush();
+    sections[0].transcript.save(transcriptPath(textPath));
 
-    // print segments to text file
-    ofstream audioTextFile;
-    audioTextFile.open(textPath);
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char *seg_text = whisper_full_get_segment_text(ctx, i);
-        audioTextFile << (seg_text ? seg_text : "") << '\n';
+    if (sections[0].gate->active()) {
+        std::vector<SpeechSpan> speech;
+        for (const Section& sec : sections) {
+            for (SpeechSpan s : sec.gate->speech()) {
+                s.begin += sec.begin;
+                s.end += sec.begin;
+                speech.push_back(s);
+            }
+        }
+        saveSpeechMap(speechMapPath(textPath), speech);
     }
-    
+
+    // a packed folder takes the finished text into its store
     audioTextFile.close();
-    whisper_free(ctx);
+    absorbNoteFile(textPath);
+
+    std::cout << "transcription completed\n";
     return 0;
 }
 
-sf::SoundBufferRecorder recorder;
+// Streams a recording from disk; only one chunk of decoded audio per
+// section is ever in memory. Returns an empty source on failure.
+static PcmSource fileSource(const std::string& audioPath, std::size_t& totalSamples) {
+    sf::InputSoundFile probe;
+    if (!probe.openFromFile(audioPath)) {
+        std::cerr << "Failed to load " << audioPath << "\n";
+        return {};
+    }
+    const unsigned channels = probe.getChannelCount();
+    const unsigned rate = probe.getSampleRate();
+    if (channels == 0 || rate == 0) return {};
+    const std::uint64_t frameCount = probe.getSampleCount() / channels;
+    totalSamples = (std::size_t) (frameCount * WHISPER_SAMPLE_RATE / rate);
 
-int startRecordAudioFromMicrophone() {
-    bool recordLoop = true;
-    string recordTextInput;
+    return [audioPath, rate, channels, frameCount](std::size_t begin, std::size_t end) -> PcmReader {
+        auto file = std::make_shared<sf::InputSoundFile>();
+        if (!file->openFromFile(audioPath)) return {};
+        const std::uint64_t first = std::min<std::uint64_t>(frameCount, (std::uint64_t) begin * rate / WHISPER_SAMPLE_RATE);
+        const std::uint64_t last = std::min<std::uint64_t>(frameCount, (std::uint64_t) end * rate / WHISPER_SAMPLE_RATE);
+        file->seek(first * channels); // SFML counts interleaved samples
+        return makePcmReader(rate, channels, last - first, [file, channels](std::int16_t* dst, std::size_t frames) {
+            return (std::size_t) (file->read(dst, frames * channels) / channels);
+        });
+    };
+}
+
+int sendAudioFileToWhisper(std::string audioPath, std::string textPath, const std::atomic<bool>* cancel,
+                           int threadShare) {
+    // Imports and re-transcription. Audio this model already transcribed
+    // (the note itself, or the same recording under another name) is not
+    // decoded again: its text is reused
+    TranscriptionLedger& ledger = TranscriptionLedger::instance();
+    const std::string key = TranscriptionLedger::modelKey(activeModelPath());
+    const std::string hash = ledger.audioHash(audioPath);
+    const std::string done = ledger.find(hash, key, textPath);
+    if (!done.empty()) {
+        std::cout << "Already transcribed (" << done << "), skipping " << audioPath << "\n";
+        if (!TranscriptionLedger::copyNote(done, textPath)) return 1;
+        ledger.record(hash, key, textPath);
+        return 0;
+    }
+
+    std::size_t total = 0;
+    PcmSource source = fileSource(audioPath, total);
+    if (!source) return 1;
+    const int rc = transcribeChunked(source, total, textPath, cancel, threadShare);
+    if (rc == 0) ledger.record(hash, key, textPath);
+    return rc;
+}
+
+int refineAudioFile(whisper_context* ctx, whisper_state* state, const std::string& audioPath, int threads,
+                    const std::atomic<bool>& abort, std::string& text, TranscriptBuilder& transcript) {
+    std::size_t total = 0;
+    PcmSource source = fileSource(audioPath, total);
+    if (!source) return 1;
+    PcmReader read = source(0, total);
+    if (!read) return 1;
+
+    PerfTrace::Job timed((double) total / WHISPER_SAMPLE_RATE);
+    ChunkedJob job;
+    job.ctx = ctx;
+    job.total = total;
+    job.quiet = true;
+    job.abort = &abort;
+
+    // one section: the refinement runs in the background on few threads anyway
+    Section sec;
+    sec.end = total;
+    sec.state = state;
+    sec.threads = threads;
+    sec.gate = std::make_shared<SpeechGate>();
+    sec.gate->open(Settings::vad_model_path, threads);
+    transcribeSection(job, sec, gatedReader(read, sec.gate), false);
+    if (sec.rc != 0) return sec.rc;
+
+    text.clear();
+    for (const std::string& line : sec.lines) text += line + "\n";
+    transcript = std::move(sec.transcript);
+    return 0;
+}
+
+// Audio decoded beyond the first and last segment of a run, for the words
+// at its edges, and how much of the text before a run is its prompt
+static const std::uint32_t RUN_MARGIN_MS = 200;
+static const std::size_t RUN_PROMPT_CHARS = 200;
+
+int refineAudioSegments(whisper_context* ctx, whisper_state* state, const std::string& audioPath,
+                        const TranscriptView& draft, const std::vector<std::pair<std::uint32_t, std::uint32_t>>& runs,
+                        int threads, const std::atomic<bool>& abort, std::string& text, TranscriptBuilder& transcript) {
+    std::size_t total = 0;
+    PcmSource source = fileSource(audioPath, total);
+    if (!source) return 1;
+
+    const TranscriptSegment* segs = draft.segments();
+    auto keep = [&](std::uint32_t i) {
+        text += std::string(draft.text(segs[i].text, segs[i].textLength)) + "\n";
+        transcript.addSegment(draft, i);
+    };
+
+    double seconds = 0.0;
+    for (const auto& [first, end] : runs) seconds += (segs[end - 1].t1Ms - segs[first].t0Ms) / 1000.0;
+    PerfTrace::Job timed(seconds);
+
+    text.clear();
+    std::uint32_t next = 0;
+    for (const auto& [first, end] : runs) {
+        if (abort.load()) return 6;
+        while (next < first) keep(next++);
+
+        const std::uint32_t t0Ms = segs[first].t0Ms > RUN_MARGIN_MS ? segs[first].t0Ms - RUN_MARGIN_MS : 0;
+        const std::uint32_t t1Ms = segs[end - 1].t1Ms + RUN_MARGIN_MS;
+        const std::size_t begin = std::min(total, (std::size_t) t0Ms * WHISPER_SAMPLE_RATE / 1000);
+        const std::size_t last = std::min(total, (std::size_t) t1Ms * WHISPER_SAMPLE_RATE / 1000);
+        PcmReader read = source(begin, last);
+        if (!read) return 1;
+        std::vector<float> pcm;
+        read(pcm, last - begin);
+
+        // the words before the run, from a word boundary
+        std::string prompt = text.substr(text.size() - std::min(text.size(), RUN_PROMPT_CHARS));
+        if (prompt.size() < text.size()) prompt.erase(0, std::min(prompt.size(), prompt.find(' ')));
+        std::replace(prompt.begin(), prompt.end(), '\n', ' ');
+
+        struct whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH);
+        wparams.n_threads = threads;
+        wparams.audio_ctx_auto = true;
+        wparams.token_timestamps = true;
+        wparams.no_context = true;
+        wparams.initial_prompt = prompt.c_str();
+        wparams.abort_callback = [](void* flag) { return static_cast<const std::atomic<bool>*>(flag)->load(); };
+        wparams.abort_callback_user_data = (void*) &abort;
+
+        int rc;
+        {
+            PerfTrace::WhisperCall traced(state, "whisper_full");
+            rc = whisper_full_with_state(ctx, state, wparams, pcm.data(), (int) pcm.size());
+        }
+        if (rc != 0) {
+            if (abort.load()) return 6;
+            std::fprintf(stderr, "whisper_full failed\n");
+            return 5;
+        }
+
+        const int n_segments = whisper_full_n_segments_from_state(state);
+        if (n_segments == 0) {
+            // nothing heard where the draft has words: keep them
+            while (next < end) keep(next++);
+            continue;
+        }
+        for (int i = 0; i < n_segments; ++i) {
+            const char* seg = whisper_full_get_segment_text_from_state(state, i);
+            text += std::string(seg ? seg : "") + "\n";
+        }
+        transcript.addSegments(ctx, state, n_segments, [t0Ms](std::int64_t t) {
+            return t0Ms + (std::uint32_t) std::max<std::int64_t>(0, t) * 10;
+        });
+        next = end;
+    }
+    while (next < draft.segmentCount()) keep(next++);
+    return 0;
+}
+
+int sendAudioSamplesToWhisper(const std::int16_t* samples, std::size_t sampleCount,
+                              unsigned sampleRate, unsigned channelCount, std::string textPath,
+                              const std::atomic<bool>* cancel) {
+    if (!samples || sampleRate == 0 || channelCount == 0) return 2;
+
+    // Convert lazily, chunk by chunk, rather than the whole take up front
+    const std::uint64_t frameCount = sampleCount / channelCount;
+    PcmSource source = [=](std::size_t begin, std::size_t end) -> PcmReader {
+        const std::uint64_t first = std::min<std::uint64_t>(frameCount, (std::uint64_t) begin * sampleRate / WHISPER_SAMPLE_RATE);
+        const std::uint64_t last = std::min<std::uint64_t>(frameCount, (std::uint64_t) end * sampleRate / WHISPER_SAMPLE_RATE);
+        auto pos = std::make_shared<std::uint64_t>(first);
+        return makePcmReader(sampleRate, channelCount, last - first, [=](std::int16_t* dst, std::size_t frames) {
+            const std::size_t n = (std::size_t) std::min<std::uint64_t>(frames, last - *pos);
+            std::copy(samples + *pos * channelCount, samples + (*pos + n) * channelCount, dst);
+            *pos += n;
+            return n;
+        });
+    };
+
+    return transcribeChunked(source, (std::size_t) (frameCount * WHISPER_SAMPLE_RATE / sampleRate), textPath, cancel);
+}
+
+// Captures from the microphone and streams every chunk to the live
+// transcriber and to the audio file; nothing of the take stays in memory.
+// Between notes an armed recorder keeps running and holds the last
+// Settings::preroll_seconds in a ring, which opens the next note.
+class StreamingRecorder : public sf::SoundRecorder {
+public:
+    ~StreamingRecorder() override { stop(); }
+
+    // Interleaved samples kept while no note is attached (0 = none)
+    void setPreroll(std::size_t samples) {
+        std::lock_guard<std::mutex> lock(mutex);
+        preroll.assign(samples, 0);
+        prerollHead = prerollFill = 0;
+    }
+
+    // Starts feeding a note, pre-roll first; returns the pre-roll samples fed
+    std::size_t attach(LiveTranscriber* l, RecordingWriter* w) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::size_t fed = prerollFill;
+        // oldest part of the ring first
+        const std::size_t first = (prerollHead + preroll.size() - prerollFill) % std::max<std::size_t>(1, preroll.size());
+        const std::size_t tail = std::min(prerollFill, preroll.size() - first);
+        for (auto [from, n] : {std::pair{first, tail}, std::pair{std::size_t(0), prerollFill - tail}}) {
+            if (n == 0) continue;
+            if (w) w->feed(preroll.data() + from, n);
+            if (l) l->feed(preroll.data() + from, n);
+        }
+        prerollHead = prerollFill = 0;
+        live = l;
+        writer = w;
+        return fed;
+    }
+
+    // Stops feeding the note; once this returns the capture thread no longer touches it
+    void detach() {
+        std::lock_guard<std::mutex> lock(mutex);
+        live = nullptr;
+        writer = nullptr;
+    }
+
+protected:
+    // Runs on SFML's capture thread
+    bool onProcessSamples(const std::int16_t* data, std::size_t count) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (writer) writer->feed(data, count);
+        if (live) live->feed(data, count);
+        if (!live && !writer && !preroll.empty()) {
+            for (std::size_t i = 0; i < count; ++i) {
+                preroll[prerollHead] = data[i];
+                prerollHead = (prerollHead + 1) % preroll.size();
+            }
+            prerollFill = std::min(preroll.size(), prerollFill + count);
+        }
+        return true;
+    }
+
+private:
+    // Held by the capture thread for one chunk at a time, and by attach/detach
+    std::mutex mutex;
+    LiveTranscriber* live = nullptr;
+    RecordingWriter* writer = nullptr;
+    std::vector<std::int16_t> preroll;
+    std::size_t prerollHead = 0;         // next write position
+    std::size_t prerollFill = 0;         // valid samples before prerollHead
+};
 
+static StreamingRecorder recorder;
+static std::unique_ptr<LiveTranscriber> live;                   // session of the current recording
+// Second source of the current recording (Settings::audio_loopback_device):
+// transcribed on its own state next to `live`, merged in a CaptureTimeline
+static StreamingRecorder loopback;
+static std::unique_ptr<LiveTranscriber> loopbackLive;
+static std::shared_ptr<RecordingWriter> loopbackWriter;        // <notes>/sources/<base>.<ext>
+static const char* const SOURCE_LABELS[] = {"Me", "Others"};
+static std::vector<std::unique_ptr<LiveTranscriber>> finishing; // stopped, still writing their note
+static std::shared_ptr<RecordingWriter> writer;                 // audio file of the current recording
+static std::vector<std::shared_ptr<RecordingWriter>> closing;   // stopped, still writing their tail
+static std::string recordingBase;
+static int armedSeconds = 0;                                    // capture runs between notes for this pre-roll; 0 = stopped
+
+static std::string recordingDir() {
+    std::string dir = Settings::voice_notes_path;
+    if (!dir.empty() && (dir.back() != '/' && dir.back() != '\\')) dir.push_back('/');
+    return dir;
+}
+
+// SFML picks the encoder from the extension: FLAC is lossless, Ogg Vorbis
+// is smallest; anything else falls back to plain WAV
+static std::string recordingExtension() {
+    if (Settings::audio_format == "flac") return ".flac";
+    if (Settings::audio_format == "ogg")  return ".ogg";
+    return ".wav";
+}
+
+static void reapClosedWriters() {
+    closing.erase(std::remove_if(closing.begin(), closing.end(),
+                                 [](const std::shared_ptr<RecordingWriter>& w){ return w->isDone(); }),
+                  closing.end());
+}
+
+static void reapFinishedSessions() {
+    finishing.erase(std::remove_if(finishing.begin(), finishing.end(),
+                                   [](const std::unique_ptr<LiveTranscriber>& t){ return t->isDone(); }),
+                    finishing.end());
+}
+
+std::string activeRecordingTextPath() {
+    return live ? live->textPath() : std::string();
+}
+
+// Asking the system for its capture devices costs milliseconds to seconds,
+// so a start goes by CaptureDevices' last (background) enumeration and only
+// queries the system while there has been none yet
+static bool captureAvailable() {
+    CaptureDevices& devices = CaptureDevices::instance();
+    if (devices.ready()) return !devices.list().empty();
+    return sf::SoundRecorder::isAvailable();
+}
+
+// The configured device when it is present, else the system default
+static std::string resolvedDevice() {
+    CaptureDevices& devices = CaptureDevices::instance();
+    if (!devices.ready()) return Settings::audio_input_device;
+    std::string fallback;
+    const std::vector<std::string> names = devices.list(&fallback);
+    if (std::find(names.begin(), names.end(), Settings::audio_input_device) != names.end()) {
+        return Settings::audio_input_device;
+    }
+    return fallback;
+}
+
+// start the capture: ask for whisper's format directly so neither the
+// live session nor the WAV needs resampling; fall back to 44.1 kHz and
+// the resampler when the device refuses
+static bool startCapture() {
+    // SFML validates a new device name against a fresh enumeration; the
+    // recorder keeps the one it accepted, so only a change is passed on
+    static std::string deviceApplied;
+    const std::string device = resolvedDevice();
+    if (!device.empty() && device != deviceApplied) {
+        if (recorder.setDevice(device)) deviceApplied = device;  // on failure SFML keeps the current one
+        PerfTrace::instance().pathStep("device");
+    }
+    recorder.setChannelCount(1);
+    const bool started = recorder.start(WHISPER_SAMPLE_RATE) || recorder.start(44100);
+    PerfTrace::instance().pathStep("capture");
+    return started;
+}
+
+// start the second source with whatever format it offers; a device that
+// is not present is not replaced by the default (that is the microphone)
+static bool startLoopbackCapture() {
+    const std::string& device = Settings::audio_loopback_device;
+    CaptureDevices& devices = CaptureDevices::instance();
+    if (devices.ready()) {
+        const std::vector<std::string> names = devices.list();
+        if (std::find(names.begin(), names.end(), device) == names.end()) return false;
+    }
+    if (loopback.getDevice() != device && !loopback.setDevice(device)) return false;
+    loopback.setChannelCount(1);
+    return loopback.start(WHISPER_SAMPLE_RATE) || loopback.start(44100);
+}
+
+// Stops the second source; its session writes the note if it finishes last
+static void stopLoopback(bool keep) {
+    if (!loopbackLive) return;
+    loopback.stop();
+    loopback.detach();
+    if (!keep) {
+        loopbackLive.reset();
+        loopbackWriter.reset();
+        return;
+    }
+    if (loopbackWriter) {
+        loopbackWriter->finish();
+        closing.push_back(std::move(loopbackWriter));
+    }
+    loopbackLive->finish();
+    finishing.push_back(std::move(loopbackLive));
+}
+
+void armAudioCapture() {
+    if (live) return; // applied when the note stops
+
+    const int seconds = Settings::preroll_seconds;
+    if (armedSeconds > 0) recorder.stop();
+    armedSeconds = 0;
+    recorder.setPreroll(0);
+    if (seconds <= 0 || !captureAvailable()) return;
+
+    // (re)started, so a changed device takes effect too
+    if (!startCapture()) {
+        cout << "failed to start audio capture";
+        return;
+    }
+    armedSeconds = seconds;
+    recorder.setPreroll((std::size_t) seconds * recorder.getSampleRate() * recorder.getChannelCount());
+}
+
+int startRecordAudioFromMicrophone() {
     // first check if an input audio device is available on the system
-    if (!sf::SoundBufferRecorder::isAvailable())
+    if (!captureAvailable())
     {
         // error: audio capture is not available on this system
         cout << "audio capture device is not found";
         return 1;
     }
 
-    if (!Settings::audio_input_device.empty()) {
-        recorder.setDevice(Settings::audio_input_device); // ignore failure -> SFML will keep current
+    reapFinishedSessions();
+    reapClosedWriters();
+
+    recordingBase = "note_" + getTimestamp();
+    std::string textPath = recordingDir() + recordingBase + ".txt";
+
+    live = std::make_unique<LiveTranscriber>();
+    writer = std::make_shared<RecordingWriter>();
+
+    // The system audio goes first: the note only becomes multi-source once
+    // that capture runs, and a session of it must not wait for one that never starts
+    if (!Settings::audio_loopback_device.empty()) {
+        loopbackLive = std::make_unique<LiveTranscriber>();
+        loopbackWriter = std::make_shared<RecordingWriter>();
+        loopback.attach(loopbackLive.get(), loopbackWriter.get());
+        if (startLoopbackCapture()) {
+            auto timeline = std::make_shared<CaptureTimeline>(std::vector<std::string>(std::begin(SOURCE_LABELS), std::end(SOURCE_LABELS)));
+            live->timeline = timeline;
+            loopbackLive->timeline = timeline;
+            loopbackLive->source = 1;
+        } else {
+            cout << "failed to start system audio capture: " << Settings::audio_loopback_device << "\n";
+            stopLoopback(false);
+        }
     }
-    // start the capture
 
-    if (!recorder.start()) {
-        // error: failed to start audio capture
-        cout << "failed to start audio capture";
-        return 1;
+    // The audio goes to disk as it is captured, so a crash keeps what was recorded
+    const std::string audioPath = recordingDir() + recordingBase + recordingExtension();
+    auto startWriter = [&] {
+        std::filesystem::create_directories(Settings::voice_notes_path);
+        if (!writer->start(audioPath, recorder.getSampleRate(), recorder.getChannelCount(), recorder.getChannelMap())) {
+            cerr << "Failed to save audio.\n";
+        }
+    };
+
+    std::size_t prerollSamples = 0;
+    if (armedSeconds > 0) {
+        // the device is already running: the note opens with the pre-roll,
+        // which can outgrow the rings, so both sessions drain them already
+        startWriter();
+        live->start(textPath, recorder.getSampleRate(), recorder.getChannelCount());
+        prerollSamples = recorder.attach(live.get(), writer.get());
+    } else {
+        // The rings accept samples before the sessions start, so nothing from
+        // the first callback is lost while the capture format is negotiated
+        recorder.attach(live.get(), writer.get());
+        if (!startCapture()) {
+            // error: failed to start audio capture
+            cout << "failed to start audio capture";
+            recorder.detach();
+            live.reset();
+            writer.reset();
+            stopLoopback(false);
+            return 1;
+        }
+        live->start(textPath, recorder.getSampleRate(), recorder.getChannelCount());
+        startWriter();
+    }
+
+    // The microphone's take opens with the pre-roll, the system audio's
+    // when the note started
+    if (loopbackLive) {
+        loopbackLive->timeOffsetMs = (std::uint32_t) (prerollSamples * 1000 / recorder.getChannelCount() / recorder.getSampleRate());
+        loopbackLive->start(textPath, loopback.getSampleRate(), loopback.getChannelCount());
+    }
+
+    // The note exists from the first word on so live text has somewhere to
+    // go; written once the capture runs, which the disk must not hold up
+    writeNoteText(textPath, "");
+
+    // the system audio next to it, out of the notes list
+    if (loopbackWriter) {
+        std::error_code ec;
+        std::filesystem::create_directories(recordingDir() + "sources", ec);
+        const std::string sourcePath = recordingDir() + "sources/" + recordingBase + recordingExtension();
+        if (!loopbackWriter->start(sourcePath, loopback.getSampleRate(), loopback.getChannelCount(), loopback.getChannelMap())) {
+            cerr << "Failed to save system audio.\n";
+        }
     }
 
+    // background jobs give the cores to the live pass until the note stops
+    TranscriptionEngine::instance().holdBackground(true);
+    NoteRefiner::instance().setRecording(true);
+    PerfTrace::instance().endPath("files");
     cout << "Recording..." << endl;
 
     return 0;
 }
 
 int stopRecordAudioFromMicrophone() {    
-    // stop the capture
-    recorder.stop();
-    
-    // retrieve the buffer that contains the captured audio data
-    const sf::SoundBuffer& buffer = recorder.getBuffer();
-
-    // Save .wav
-    string baseName = "note_" + getTimestamp();
-    std::string dir = Settings::voice_notes_path;
-    if (!dir.empty() && (dir.back() != '/' && dir.back() != '\\')) dir.push_back('/');
-    std::string audioPath = dir + baseName + ".wav";
-    std::string textPath  = dir + baseName + ".txt";
+    // an armed capture keeps running for the next pre-roll; otherwise stop it
+    // (joins SFML's capture thread). Either way the note has all its samples
+    // once it is detached
+    if (armedSeconds == 0) recorder.stop();
+    recorder.detach();
 
+    if (!live) return 1;
 
-    std::filesystem::create_directories(Settings::voice_notes_path);
-    if (!buffer.saveToFile(audioPath)) {
-        cerr << "Failed to save audio.\n";
-        return 1;
+    // A multi-source note is refined from neither recording alone
+    const bool multiSource = live->timeline != nullptr;
+    stopLoopback(true);
+
+    std::string dir = recordingDir();
+
+    // The file already holds all but the last moments of the take; its writer
+    // appends them and closes it in the background
+    reapClosedWriters();
+    std::shared_ptr<RecordingWriter> audio = writer;
+    if (writer) {
+        writer->finish();
+        closing.push_back(std::move(writer));
+    }
+
+    // The live text is the draft; a larger model replaces it later, when idle
+    if (audio && !multiSource && !Settings::refine_model_path.empty()) {
+        live->onWritten = [audio, textPath = live->textPath()](const std::string& draft) {
+            NoteRefiner::instance().enqueue(audio->audioPath(), textPath, draft,
+                                            [audio]{ return audio->isDone(); });
+        };
     }
-    cout << "Saved: " << audioPath << "\n";
+    NoteRefiner::instance().setRecording(false);
+    TranscriptionEngine::instance().holdBackground(false);
 
-    // Save empty txt file
-    ofstream out(textPath);
-    cout<<"Saved: " << textPath << "\n";
+    // The live session already transcribed everything it was fed; it only
+    // has to finish the last window and write the .txt
+    live->finish();
+    finishing.push_back(std::move(live));
+    cout << "Saved: " << dir + recordingBase + ".txt" << "\n";
 
-    sendAudioFileToWhisper(audioPath, textPath);
+    // the pre-roll setting may have changed during the note
+    if (armedSeconds != Settings::preroll_seconds) armAudioCapture();
 
     return 0;
-}
\ No newline at end of file
+}
+
+void shutdownAudio() {
+    if (live) stopRecordAudioFromMicrophone();
+    if (armedSeconds > 0) recorder.stop();
+    armedSeconds = 0;
+    // Destroying a session waits for it to write its note
+    finishing.clear();
+    // Destroying a writer waits for it to close its file
+    closing.clear();
+    NoteRefiner::instance().shutdown();
+    NoteSummarizer::instance().shutdown();
+    TranscriptionEngine::instance().shutdown();
+}
\ No newline at end of file
@@ -1,10 +1,44 @@
 #ifndef AUDIO_STREAM_H
 #define AUDIO_STREAM_H
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <utility>
+#include <vector>
+
+class TranscriptBuilder;
+class TranscriptView;
 
 int startRecordAudioFromMicrophone();
 int stopRecordAudioFromMicrophone();
-int sendAudioFileToWhisper(std::string audioPath, std::string textPath);
+// `cancel` (TranscriptionEngine jobs) stops the transcription early with a non-zero result;
+// with `threadShare` n the job takes 1/n of the threads (n files run side by side)
+int sendAudioFileToWhisper(std::string audioPath, std::string textPath, const std::atomic<bool>* cancel = nullptr,
+                           int threadShare = 1);
+// Transcribe a recording with the given model into `text` and `transcript`,
+// posting no events; returns non-zero on failure or when `abort` was set
+int refineAudioFile(struct whisper_context* ctx, struct whisper_state* state, const std::string& audioPath, int threads,
+                    const std::atomic<bool>& abort, std::string& text, TranscriptBuilder& transcript);
+// Decode only the stretches of the recording under the segment runs of
+// `draft` (TranscriptView::lowConfidenceRuns()) again, with beam search and
+// the text before each as prompt; the other segments are kept as they are
+int refineAudioSegments(struct whisper_context* ctx, struct whisper_state* state, const std::string& audioPath,
+                        const TranscriptView& draft, const std::vector<std::pair<std::uint32_t, std::uint32_t>>& runs,
+                        int threads, const std::atomic<bool>& abort, std::string& text, TranscriptBuilder& transcript);
+// Transcribe 16-bit PCM already in memory (no WAV round trip)
+int sendAudioSamplesToWhisper(const std::int16_t* samples, std::size_t sampleCount,
+                              unsigned sampleRate, unsigned channelCount, std::string textPath,
+                              const std::atomic<bool>* cancel = nullptr);
+// Path of the .txt the current recording is transcribed into ("" when idle)
+std::string activeRecordingTextPath();
+// Start loading the whisper model in the background so the first note is fast
+void preloadWhisperModel();
+// With Settings::preroll_seconds, keep the microphone open between notes so a
+// note starts at once with the seconds before the hotkey; stops it otherwise
+void armAudioCapture();
+// Stop capture, let live sessions finish their notes and release the model
+void shutdownAudio();
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "capture_devices.h"
+
+#include <SFML/Audio/SoundRecorder.hpp>
+
+CaptureDevices& CaptureDevices::instance() {
+    static CaptureDevices d;
+    return d;
+}
+
+CaptureDevices::~CaptureDevices() {
+    if (worker.joinable()) worker.join();
+}
+
+void CaptureDevices::refresh() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (running) return;
+    if (worker.joinable()) worker.join();   // finished; running is false
+    running = true;
+    worker = std::thread([this]{
+        std::vector<std::string> found;
+        std::string def;
+        if (sf::SoundRecorder::isAvailable()) {
+            found = sf::SoundRecorder::getAvailableDevices();
+            def = sf::SoundRecorder::getDefaultDevice();
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!done || found != devices || def != defaultName) {
+            devices = std::move(found);
+            defaultName = std::move(def);
+            ++gen;
+        }
+        done = true;
+        running = false;
+    });
+}
+
+std::vector<std::string> CaptureDevices::list(std::string* defaultDevice) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (defaultDevice) *defaultDevice = defaultName;
+    return devices;
+}
+
+unsigned CaptureDevices::generation() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return gen;
+}
+
+bool CaptureDevices::ready() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return done;
+}
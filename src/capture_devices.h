@@ -0,0 +1,40 @@
+#ifndef CAPTURE_DEVICES_H
+#define CAPTURE_DEVICES_H
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Capture device names, enumerated off the UI thread (asking the system can
+// take seconds with many endpoints). list() returns the last enumeration at
+// once; refresh() starts another in the background, and generation() moves
+// when one finds a different set of devices, so an open settings dialog
+// notices devices being plugged in or removed.
+class CaptureDevices {
+public:
+    static CaptureDevices& instance();
+
+    // No-op while an enumeration is running
+    void refresh();
+    // Empty until the first enumeration finished
+    std::vector<std::string> list(std::string* defaultDevice = nullptr) const;
+    unsigned generation() const;
+    bool ready() const;
+
+private:
+    CaptureDevices() = default;
+    ~CaptureDevices();
+    CaptureDevices(const CaptureDevices&) = delete;
+    CaptureDevices& operator=(const CaptureDevices&) = delete;
+
+    mutable std::mutex mtx;
+    std::thread worker;
+    bool running = false;
+    bool done = false;                   // at least one enumeration finished
+    unsigned gen = 0;
+    std::vector<std::string> devices;
+    std::string defaultName;
+};
+
+#endif // CAPTURE_DEVICES_H
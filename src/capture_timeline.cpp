@@ -0,0 +1,37 @@
+#include "capture_timeline.h"
+
+#include <algorithm>
+
+CaptureTimeline::CaptureTimeline(std::vector<std::string> labels)
+    : names(std::move(labels)), finished(names.size(), false) {}
+
+void CaptureTimeline::add(int source, std::uint32_t t0Ms, const std::string& text) {
+    if (text.empty()) return;
+    std::lock_guard<std::mutex> lock(mtx);
+    lines.push_back({t0Ms, source, text});
+}
+
+bool CaptureTimeline::finish(int source) {
+    std::lock_guard<std::mutex> lock(mtx);
+    finished[source] = true;
+    return std::all_of(finished.begin(), finished.end(), [](bool f) { return f; });
+}
+
+std::string CaptureTimeline::text() const {
+    std::vector<Line> sorted;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        sorted = lines;
+    }
+    // windows of one source are committed in order; the sources interleave by time
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Line& a, const Line& b) { return a.t0Ms < b.t0Ms; });
+
+    std::string out;
+    for (const Line& l : sorted) {
+        // whisper's text starts with a space
+        const std::size_t first = l.text.find_first_not_of(' ');
+        if (first == std::string::npos) continue;
+        out += names[l.source] + ": " + l.text.substr(first) + "\n";
+    }
+    return out;
+}
@@ -0,0 +1,45 @@
+#ifndef CAPTURE_TIMELINE_H
+#define CAPTURE_TIMELINE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// One note captured from several sources at once: the microphone and the
+// system audio loopback (Settings::audio_loopback_device) in a meeting.
+// Every source runs its own LiveTranscriber on its own whisper_state over
+// the shared context, so the sources are transcribed in parallel and each
+// one's speaker is known without diarization. The sessions commit their
+// windows here with the time they start at; the last one to finish writes
+// the note, lines ordered by time and prefixed by their source's label.
+//
+// Thread-safe: called from the sessions' worker threads.
+class CaptureTimeline {
+public:
+    explicit CaptureTimeline(std::vector<std::string> labels);
+
+    int sources() const { return (int) names.size(); }
+    const std::string& label(int source) const { return names[source]; }
+
+    // A window of `source` starting at t0Ms of the take was committed
+    void add(int source, std::uint32_t t0Ms, const std::string& text);
+    // Source done; true for the last one, which writes the note
+    bool finish(int source);
+    // "label: text" lines of every source, by time
+    std::string text() const;
+
+private:
+    struct Line {
+        std::uint32_t t0Ms;
+        int source;
+        std::string text;
+    };
+
+    mutable std::mutex mtx;
+    std::vector<std::string> names;
+    std::vector<Line> lines;
+    std::vector<bool> finished;
+};
+
+#endif // CAPTURE_TIMELINE_H
@@ -0,0 +1,301 @@
+#include "live_transcriber.h"
+#include "note_store.h"
+#include "audio_stream.h"
+#include "transcription_engine.h"
+#include "settings.h"
+#include "perf_trace.h"
+#include "remote_whisper.h"
+#include "whisper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <optional>
+
+// out of line: RemoteStream is incomplete in the header
+LiveTranscriber::LiveTranscriber() = default;
+
+LiveTranscriber::~LiveTranscriber() {
+    finish();
+    if (worker.joinable()) worker.join();
+}
+
+void LiveTranscriber::start(const std::string& textPath, unsigned sampleRate, unsigned channelCount) {
+    path = textPath;
+    inRate = sampleRate;
+    inChannels = channelCount ? channelCount : 1;
+    converter = std::make_unique<PcmConverter>(inRate, inChannels, WHISPER_SAMPLE_RATE);
+    worker = std::thread([this]{ run(); });
+}
+
+void LiveTranscriber::feed(const std::int16_t* samples, std::size_t count) {
+    // Blocking the capture thread is never an option; if the ring is full the
+    // worker is badly behind and we keep spinning only until room opens up.
+    std::size_t written = 0;
+    while (written < count) {
+        written += ring.push(samples + written, count - written);
+        if (written < count) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void LiveTranscriber::finish() {
+    finishing = true;
+}
+
+void LiveTranscriber::drainRing() {
+    // keep whole frames so the downmix stays aligned
+    std::size_t avail = ring.size();
+    avail -= avail % inChannels;
+    if (avail == 0) return;
+
+    scratch.resize(avail);
+    const std::size_t n = ring.pop(scratch.data(), avail);
+    converter->push(scratch.data(), n, ungated);
+}
+
+std::string LiveTranscriber::transcribeWindow(whisper_context* ctx, whisper_state* state) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.n_threads        = threads;
+    wparams.print_progress   = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+    wparams.no_timestamps    = true;
+    wparams.single_segment   = true;
+    wparams.token_timestamps = true;
+    wparams.audio_ctx_auto   = true;   // the window is usually far below 30 s
+    wparams.prompt_tokens    = promptTokens.empty() ? nullptr : promptTokens.data();
+    wparams.prompt_n_tokens  = (int) promptTokens.size();
+
+    const auto t0 = std::chrono::steady_clock::now();
+    int rc;
+    {
+        PerfTrace::WhisperCall traced(state, "live window");
+        rc = whisper_full_with_state(ctx, state, wparams, window.data(), (int) window.size());
+    }
+    RemoteWhisper::recordLocal((double) window.size() / WHISPER_SAMPLE_RATE,
+                               std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    if (rc != 0) {
+        std::cerr << "Live transcription step failed\n";
+        return {};
+    }
+
+    std::string text;
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    for (int i = 0; i < n_segments; ++i) {
+        const char* seg = whisper_full_get_segment_text_from_state(state, i);
+        if (seg) text += seg;
+    }
+    return text;
+}
+
+void LiveTranscriber::commitWindow(whisper_context* ctx, whisper_state* state, const std::string& text) {
+    if (!text.empty()) {
+        // the note's audio (and so its .transcript) is source 0's recording
+        if (source == 0) {
+            transcript.addSegments(ctx, state, whisper_full_n_segments_from_state(state), [this](std::int64_t t) {
+                const std::uint64_t kept = windowStart + (std::uint64_t) std::max<std::int64_t>(0, t) * WHISPER_SAMPLE_RATE / 100;
+                return (std::uint32_t) (gate.toOriginal(kept) * 1000 / WHISPER_SAMPLE_RATE);
+            });
+        }
+        postSegment(text, windowStart);
+    }
+
+    // Condition the next window on what we just committed
+    promptTokens.clear();
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    for (int i = 0; i < n_segments; ++i) {
+        const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+        for (int j = 0; j < n_tokens; ++j) {
+            promptTokens.push_back(whisper_full_get_token_id_from_state(state, i, j));
+        }
+    }
+
+    // keep a little audio to mitigate word boundary issues
+    const std::size_t nKeep = std::min(window.size(), (std::size_t) keepMs * WHISPER_SAMPLE_RATE / 1000);
+    windowStart += window.size() - nKeep;
+    window.erase(window.begin(), window.end() - nKeep);
+    windowNew = 0;
+}
+
+void LiveTranscriber::postSegment(const std::string& text, std::uint64_t start) {
+    committed += text + "\n";
+
+    TranscriptionEvent ev;
+    ev.type = TranscriptionEvent::Type::Segment;
+    ev.textPath = path;
+    ev.text = text;
+    if (timeline) {
+        const std::uint32_t t0Ms = timeOffsetMs + (std::uint32_t) (gate.toOriginal(start) * 1000 / WHISPER_SAMPLE_RATE);
+        timeline->add(source, t0Ms, text);
+        ev.text = timeline->label(source) + ":" + text;
+    }
+    TranscriptionEngine::instance().postEvent(std::move(ev));
+}
+
+bool LiveTranscriber::remoteStep(bool last) {
+    // the window keeps what the server has not finalized, to go on locally if it fails
+    window.insert(window.end(), pending.begin(), pending.end());
+    windowNew += pending.size();
+
+    const auto t0 = std::chrono::steady_clock::now();
+    RemoteStream::Reply reply;
+    const bool ok = remote->send(pending.data(), pending.size(), last, reply);
+    pending.clear();
+    if (!ok) return false;
+
+    if (reply.transcribed) {
+        RemoteWhisper::recordRemote((double) window.size() / WHISPER_SAMPLE_RATE,
+                                    std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    }
+
+    auto toSample = [](double sec) { return (std::uint64_t) std::llround(std::max(0.0, sec) * WHISPER_SAMPLE_RATE); };
+    auto toMs = [this](std::uint64_t kept) { return (std::uint32_t) (gate.toOriginal(kept) * 1000 / WHISPER_SAMPLE_RATE); };
+
+    for (const RemoteStream::Segment& seg : reply.segments) {
+        if (source == 0) transcript.addSegment(toMs(toSample(seg.start)), toMs(toSample(seg.end)), seg.text);
+        postSegment(seg.text, toSample(seg.start));
+    }
+    if (reply.transcribed && reply.segments.empty() && source == 0) {
+        TranscriptionEvent ev;
+        ev.type = TranscriptionEvent::Type::Partial;
+        ev.textPath = path;
+        ev.text = reply.partial;
+        TranscriptionEngine::instance().postEvent(std::move(ev));
+    }
+
+    // the server moved on past its finalized windows (also those without text)
+    const std::uint64_t start = std::max(windowStart, toSample(reply.windowStart));
+    const std::size_t drop = (std::size_t) std::min<std::uint64_t>(start - windowStart, window.size());
+    window.erase(window.begin(), window.begin() + drop);
+    windowStart += drop;
+    windowNew = window.size();
+    return true;
+}
+
+void LiveTranscriber::run() {
+    TranscriptionEngine& engine = TranscriptionEngine::instance();
+
+    // the other sources of a multi-source note share its events
+    const bool primary = source == 0;
+    if (primary) {
+        TranscriptionEvent started;
+        started.type = TranscriptionEvent::Type::Started;
+        started.textPath = path;
+        engine.postEvent(started);
+    }
+
+    const std::size_t nStep = (std::size_t) stepMs   * WHISPER_SAMPLE_RATE / 1000;
+    const std::size_t nLen  = (std::size_t) lengthMs * WHISPER_SAMPLE_RATE / 1000;
+
+    // Offload to the transcription server if it answers sooner (or the
+    // local model is not loaded yet)
+    if (RemoteWhisper::preferRemote(lengthMs / 2000.0)) {
+        remote = std::make_unique<RemoteStream>();
+        if (!remote->open(stepMs, lengthMs, keepMs)) {
+            RemoteWhisper::markUnreachable();
+            remote.reset();
+        }
+    }
+    bool served = false;   // the server finalized the whole session
+
+    // The model may still be loading when recording starts; audio just queues up
+    bool ready = false;
+    std::optional<StateLease> state;
+    whisper_context* ctx = nullptr;
+    auto goLocal = [&] {
+        ready = engine.waitUntilReady();
+        state.emplace(engine);
+        ctx = engine.context();
+    };
+    if (!remote) goLocal();
+    gate.open(Settings::vad_model_path, 2);
+    threads = TranscriptionEngine::threadPlan(TranscriptionEngine::Priority::Interactive).threads;
+    // sources run side by side, each on its share of the cores
+    if (timeline) threads = std::max(1, threads / timeline->sources());
+
+    for (;;) {
+        const bool last = finishing.load() && ring.size() == 0;
+        drainRing();
+        // VAD works on whole steps; the tail goes through once capture stopped
+        if (ungated.size() >= nStep || (last && !ungated.empty())) {
+            gate.push(ungated.data(), ungated.size(), pending);
+            ungated.clear();
+        }
+
+        if (remote) {
+            if (pending.size() < nStep && !last) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                continue;
+            }
+            if (remoteStep(last)) {
+                if (!last) continue;
+                served = true;
+                break;
+            }
+            // the server is gone: what it has not finalized is transcribed here,
+            // a window at a time
+            std::cerr << "Continuing the transcription of " << path << " locally\n";
+            RemoteWhisper::markUnreachable();
+            remote.reset();
+            if (window.size() > nLen) {
+                pending.insert(pending.begin(), window.begin() + nLen, window.end());
+                window.resize(nLen);
+            }
+            goLocal();
+        }
+
+        if (!ready || !state || !*state) {
+            if (last) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            continue;
+        }
+
+        if (pending.size() < nStep && !(last && (!pending.empty() || windowNew > 0))) {
+            if (last) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            continue;
+        }
+
+        // Grow the window by the new audio, never past length_ms
+        const std::size_t room = nLen > window.size() ? nLen - window.size() : 0;
+        const std::size_t take = std::min(pending.size(), std::max<std::size_t>(room, 1));
+        window.insert(window.end(), pending.begin(), pending.begin() + take);
+        pending.erase(pending.begin(), pending.begin() + take);
+        windowNew += take;
+
+        const std::string text = transcribeWindow(ctx, state->get());
+
+        if (window.size() >= nLen || (last && pending.empty())) {
+            commitWindow(ctx, state->get(), text);
+        } else if (primary) {
+            TranscriptionEvent ev;
+            ev.type = TranscriptionEvent::Type::Partial;
+            ev.textPath = path;
+            ev.text = text;
+            engine.postEvent(std::move(ev));
+        }
+
+        if (last && pending.empty() && windowNew == 0) break;
+    }
+
+    if (primary) {
+        if (gate.active()) saveSpeechMap(speechMapPath(path), gate.speech());
+        transcript.save(transcriptPath(path));
+    }
+    // of a multi-source note, the last source to finish writes it
+    if (timeline && !timeline->finish(source)) {
+        done = true;
+        return;
+    }
+
+    const std::string text = timeline ? timeline->text() : committed;
+    if (!writeNoteText(path, text)) std::cerr << "Failed to save " << path << "\n";
+    if (onWritten) onWritten(text);
+
+    TranscriptionEvent doneEv;
+    doneEv.type = (served || (ready && state && *state)) ? TranscriptionEvent::Type::Finished : TranscriptionEvent::Type::Failed;
+    doneEv.textPath = path;
+    engine.postEvent(doneEv);
+    done = true;
+}
@@ -0,0 +1,102 @@
+#ifndef LIVE_TRANSCRIBER_H
+#define LIVE_TRANSCRIBER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio_preprocess.h"
+#include "capture_timeline.h"
+#include "speech_gate.h"
+#include "spsc_ring.h"
+#include "transcript.h"
+
+class RemoteStream;
+
+// Sliding-window transcription while the user is still talking, modelled on
+// whisper/examples/stream (step_ms / length_ms / keep_ms).
+//
+// The capture thread feeds raw 16-bit PCM into a lock-free ring; a worker
+// thread drains it, re-transcribes the current window every step and posts
+// Partial events, and commits the window as a Segment once it reaches
+// length_ms. Audio is never dropped: if decoding falls behind, the backlog
+// is worked off (and after stop, finished) before the note is written.
+// Long silences are: a SpeechGate cuts them before they reach the window, so
+// a quiet room costs no decoder passes, and the speech map is saved with it.
+// The committed windows' segment and token timings go to the note's
+// .transcript once it is written.
+// The session may run on a whisper-server instead (RemoteWhisper decides at
+// start()): the gated audio is posted to its /stream endpoint, which keeps
+// the same windows. If the server fails, the audio it has not finalized is
+// transcribed locally and the session stays local.
+// With a CaptureTimeline the session is one source of a multi-source note:
+// its windows go to the timeline, and only source 0 (the microphone, whose
+// recording is the note's audio) posts Started/Partial events and saves the
+// speech map and .transcript.
+class LiveTranscriber {
+public:
+    int stepMs   = 3000;
+    int lengthMs = 10000;
+    int keepMs   = 200;
+    // Called on the worker thread once the .txt holds the live text
+    std::function<void(const std::string& text)> onWritten;
+    // Multi-source note (set before start()): the shared timeline, this
+    // session's source in it, and where its capture began in the take
+    std::shared_ptr<CaptureTimeline> timeline;
+    int source = 0;
+    std::uint32_t timeOffsetMs = 0;
+
+    LiveTranscriber();
+    ~LiveTranscriber();
+    LiveTranscriber(const LiveTranscriber&) = delete;
+    LiveTranscriber& operator=(const LiveTranscriber&) = delete;
+
+    // Begin a session for the note at textPath; input format of feed()
+    void start(const std::string& textPath, unsigned sampleRate, unsigned channelCount);
+    // Capture thread only
+    void feed(const std::int16_t* samples, std::size_t count);
+    // Recording stopped: transcribe what is left, write the .txt, post Finished
+    void finish();
+    // True once the session finished writing the note
+    bool isDone() const { return done.load(); }
+    const std::string& textPath() const { return path; }
+
+private:
+    void run();
+    void drainRing();
+    std::string transcribeWindow(struct whisper_context* ctx, struct whisper_state* state);
+    void commitWindow(struct whisper_context* ctx, struct whisper_state* state, const std::string& text);
+    // Adds committed text that starts at gated sample `start`, posts its Segment event
+    void postSegment(const std::string& text, std::uint64_t start);
+    // Posts the pending audio to the server; false if it failed
+    bool remoteStep(bool last);
+
+    std::string path;
+    unsigned inRate = 0;
+    unsigned inChannels = 1;
+    int threads = 4;                     // per the power policy, fixed for the session
+
+    SpscRing<std::int16_t> ring{1 << 21}; // ~47 s at 44.1 kHz mono of headroom
+    std::thread worker;
+    std::atomic<bool> finishing{false};
+    std::atomic<bool> done{false};
+
+    std::vector<std::int16_t> scratch;   // drained raw samples
+    std::unique_ptr<PcmConverter> converter; // keeps resampler state across drains
+    std::vector<float> ungated;          // 16 kHz mono, waiting for the VAD
+    SpeechGate gate;
+    std::vector<float> pending;          // 16 kHz mono, not yet in the window
+    std::vector<float> window;           // audio fed to whisper each step
+    std::size_t windowNew = 0;           // samples added since the last commit
+    std::vector<std::int32_t> promptTokens; // tokens of the last committed window (whisper_token)
+    std::string committed;               // text of all committed windows
+    TranscriptBuilder transcript;        // timings and tokens of the committed windows
+    std::uint64_t windowStart = 0;       // gated samples before window[0]
+    std::unique_ptr<RemoteStream> remote; // while the session runs on the server; window mirrors its window
+};
+
+#endif // LIVE_TRANSCRIBER_H
@@ -13,6 +13,23 @@
 */
 
 #include "audio_stream.h"
+#include "transcription_engine.h"
+#include "note_index.h"
+#include "text_layout.h"
+#include "ui_batch.h"
+#include "note_writer.h"
+#include "note_store.h"
+#include "search_index.h"
+#include "speech_gate.h"
+#include "transcript.h"
+#include "waveform.h"
+#include "ui_wake.h"
+#include "capture_devices.h"
+#include "note_cache.h"
+#include "audio_import.h"
+#include "model_catalog.h"
+#include "perf_trace.h"
+#include "note_summarizer.h"
 #include <SFML/Graphics.hpp>
 #include <SFML/Window.hpp>
 #include <optional>
@@ -24,22 +41,29 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath> // std::floor
+#include <cctype>
 #include "settings.h"
 #include <iostream>
 #include <SFML/Audio/SoundRecorder.hpp>
 #include <filesystem>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <thread>
+#include <future>
+#include <iterator>
 #include <atomic>
+#include <memory>
+#include <mutex>
 
-#include "SFML/Audio/Sound.hpp"
-#include "SFML/Audio/SoundBuffer.hpp"
+#include "SFML/Audio/Music.hpp"
 
 #if defined(_WIN32)
   #ifndef NOMINMAX
   #define NOMINMAX
   #endif
   #include <windows.h>
+  #include <shellapi.h>
   #include <SFML/Config.hpp>
 #endif
 
@@ -47,6 +71,8 @@
 static constexpr unsigned HUB_W = 380;
 static constexpr unsigned HUB_H = 520;
 static const char* FONT_PATH = "C:/Windows/Fonts/segoeui.ttf"; // <-- change if needed
+static const char* SEARCH_INDEX_PATH = "search_index.bin";         // next to settings.txt
+static const double TRACE_SECONDS = 10.0;                          // what F4 writes out
 // static const char* SAVE_PATH = "notes.json";
 
 // helper: SFML 3 FloatRect = {position, size}
@@ -83,9 +109,41 @@ static sf::Vector2i rightEdgeStart(unsigned w, unsigned h, int marginX = 16, int
     if (h > static_cast<unsigned>(screenH)) h = static_cast<unsigned>(screenH);
     return {x, y};
 }
+
+// SFML has no drop event: WM_DROPFILES is taken in front of SFML's window
+// procedure and the files / folders go to the importer
+static WNDPROC sfmlWndProc = nullptr;
+
+static LRESULT CALLBACK dropWndProc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
+{
+    if (msg == WM_DROPFILES) {
+        HDROP drop = reinterpret_cast<HDROP>(wp);
+        std::vector<std::string> paths;
+        const UINT count = DragQueryFileW(drop, 0xFFFFFFFF, nullptr, 0);
+        for (UINT i = 0; i < count; ++i) {
+            std::wstring name(DragQueryFileW(drop, i, nullptr, 0), L'\0');
+            DragQueryFileW(drop, i, name.data(), static_cast<UINT>(name.size() + 1));
+            paths.push_back(std::filesystem::path(name).string());
+        }
+        DragFinish(drop);
+        AudioImporter::instance().import(paths);
+        return 0;
+    }
+    return CallWindowProcW(sfmlWndProc, hwnd, msg, wp, lp);
+}
+
+static void acceptDroppedFiles(sf::Window& window)
+{
+    HWND hwnd = static_cast<HWND>(window.getNativeHandle());
+    if (!hwnd || sfmlWndProc) return;
+    DragAcceptFiles(hwnd, TRUE);
+    sfmlWndProc = reinterpret_cast<WNDPROC>(
+        SetWindowLongPtrW(hwnd, GWLP_WNDPROC, reinterpret_cast<LONG_PTR>(dropWndProc)));
+}
 #else
 static void setAlwaysOnTop(sf::Window&, bool) {}
 static sf::Vector2i rightEdgeStart(unsigned, unsigned, int = 16, int = 64) { return {50, 50}; }
+static void acceptDroppedFiles(sf::Window&) {}
 #endif
 
 // ---- Hotkey parsing helpers ----
@@ -171,11 +229,105 @@ static bool matchHotkey(const sf::Event::KeyPressed& e, const Hotkey& h) {
 struct Note {
     std::string base;      // e.g., "note_2025-11-09_18-12-30"
     std::string txtPath;   // full path to .txt
-    std::string wavPath;   // full path to .wav (may not exist)
-    std::string text;      // full text
+    std::string wavPath;   // full path to the recording (.wav/.flac/.ogg/.mp3, may not exist)
+    std::string text;      // full text (only once loaded)
     std::string created;   // derived from filename or file time
+    std::string title;     // first line, from the index until the body is loaded
+    std::int64_t mtime = 0; // .txt (or .wav) write time, from the index
+    std::uint64_t size = 0; // .txt size, from the index
+    bool loaded = false;   // text holds the file's contents
+    unsigned edits = 0;      // bumped on every edit
+    unsigned savedEdits = 0; // value of edits when the text was last handed to the writer
+    bool dirty() const { return edits != savedEdits; }
+};
+
+// Glyph quads for one row of the notes list. Kept across frames so they are
+// only rebuilt when the shown title or timestamp changes; every frame just
+// copies the visible rows into the list's batches.
+struct ListRow {
+    std::string title;
+    std::string created;
+    std::vector<sf::Vertex> titleQuads;  // 14 px, at the origin
+    std::vector<sf::Vertex> timeQuads;   // 12 px, at the origin
+    float timeWidth = 0.f;
+};
+
+// Waveform strip under the editor. The overview of the selected note is
+// loaded off the UI thread (and built from the recording once for notes
+// that have no .peaks yet); the strip's lines are rebuilt only when the
+// note or the width changes, one min/max line per pixel.
+struct WaveLoad {
+    std::mutex m;
+    bool done = false;
+    std::shared_ptr<WaveformPyramid> result;   // null if the recording is unreadable
+};
+
+struct WaveStrip {
+    std::string audioPath;                     // recording shown (or loading)
+    std::shared_ptr<WaveLoad> loading;
+    std::shared_ptr<WaveformPyramid> wave;
+    sf::VertexArray lines{sf::PrimitiveType::Lines};
+    float builtWidth = -1.f;                   // width `lines` was built for
 };
 
+static std::shared_ptr<WaveLoad> loadWaveform(const std::string& audioPath) {
+    auto load = std::make_shared<WaveLoad>();
+    std::thread([load, audioPath]{
+        auto wave = std::make_shared<WaveformPyramid>();
+        const std::string cache = peaksPath(audioPath);
+        if (!wave->load(cache)) {
+            if (wave->buildFromFile(audioPath)) wave->save(cache);
+            else wave.reset();
+        }
+        std::lock_guard<std::mutex> lock(load->m);
+        load->result = std::move(wave);
+        load->done = true;
+        UiWake::instance().wake();
+    }).detach();
+    return load;
+}
+
+static void buildWaveLines(WaveStrip& strip, float width, float height, sf::Color color) {
+    strip.lines.clear();
+    strip.builtWidth = width;
+    if (!strip.wave || strip.wave->empty() || width < 1.f) return;
+
+    const WaveformPyramid& w = *strip.wave;
+    const unsigned px = static_cast<unsigned>(width);
+    const float mid = height * 0.5f, scale = (height * 0.5f - 2.f) / 32768.f;
+    strip.lines.resize(2 * px);
+    for (unsigned x = 0; x < px; ++x) {
+        const WaveformPyramid::Peak p = w.range(w.frames() * x / px, w.frames() * (x + 1) / px);
+        // at least a pixel tall so silence still shows as a line
+        const float top = std::min(mid - 0.5f, mid - p.max * scale);
+        const float bottom = std::max(mid + 0.5f, mid - p.min * scale);
+        strip.lines[2 * x]     = sf::Vertex{sf::Vector2f(x + 0.5f, top), color};
+        strip.lines[2 * x + 1] = sf::Vertex{sf::Vector2f(x + 0.5f, bottom), color};
+    }
+}
+
+// The transcript segment a line of the note shows: the segment of the same
+// index while the text still lines up with the transcript, else the first
+// segment with that text; -1 if none
+static int segmentForLine(const TranscriptView& tv, std::size_t line, const std::string& text) {
+    auto trim = [](std::string_view v) {
+        while (!v.empty() && std::isspace(static_cast<unsigned char>(v.front()))) v.remove_prefix(1);
+        while (!v.empty() && std::isspace(static_cast<unsigned char>(v.back()))) v.remove_suffix(1);
+        return v;
+    };
+    const std::string_view want = trim(text);
+    if (want.empty()) return -1;
+    auto same = [&](std::uint32_t i) {
+        const TranscriptSegment& seg = tv.segments()[i];
+        return trim(tv.text(seg.text, seg.textLength)) == want;
+    };
+    if (line < tv.segmentCount() && same(static_cast<std::uint32_t>(line))) return static_cast<int>(line);
+    for (std::uint32_t i = 0; i < tv.segmentCount(); ++i) {
+        if (same(i)) return static_cast<int>(i);
+    }
+    return -1;
+}
+
 static std::string nowShort()
 {
     using namespace std::chrono;
@@ -230,8 +382,6 @@ static bool hotkeyToWin32(const Hotkey& h, UINT& mods, UINT& vk) {
 struct GlobalHotkeyListener {
     std::thread th;
     std::atomic_bool running{false};
-    std::atomic_bool trigRecord{false};
-    std::atomic_bool trigFocus{false};
     UINT idRecord{1};
     UINT idFocus{2};
 
@@ -253,8 +403,12 @@ struct GlobalHotkeyListener {
                 BOOL r = GetMessage(&msg, nullptr, 0, 0);
                 if (r <= 0) break;
                 if (msg.message == WM_HOTKEY) {
-                    if (msg.wParam == idRecord) trigRecord.store(true);
-                    if (msg.wParam == idFocus)  trigFocus.store(true);
+                    if (msg.wParam == idRecord) {
+                        // msg.time: when the system queued the press (ms since boot)
+                        PerfTrace::instance().beginPath("hotkey", (std::int64_t) (GetTickCount() - msg.time) * 1000);
+                        UiWake::instance().post(UiWake::Message::ToggleRecording);
+                    }
+                    if (msg.wParam == idFocus)  UiWake::instance().post(UiWake::Message::ShowWindow);
                 }
             }
 
@@ -284,99 +438,67 @@ static std::string normalizedVoiceDir() {
     return dir;
 }
 
-// Read a whole file into string (UTF-8 ok)
+// Read a whole note into string (UTF-8 ok); plain file or packed store
 static std::string slurp(const std::string& path) {
-    std::ifstream f(path, std::ios::binary);
-    if (!f) return {};
-    return std::string((std::istreambuf_iterator<char>(f)),
-                        std::istreambuf_iterator<char>());
+    return readNoteText(path);
 }
 
 static bool spit(const std::string& path, const std::string& data) {
-    std::ofstream f(path, std::ios::binary | std::ios::trunc);
-    if (!f) return false;
-    f.write(data.data(), (std::streamsize)data.size());
-    return true;
+    return writeNoteText(path, data);
 }
 
-// Scan Settings::voice_notes_path for note_*.txt/ .wav and produce list
-static std::vector<Note> scanVoiceNotes() {
+// Build the list from the note index; bodies are loaded when a note is opened
+static std::vector<Note> notesFromIndex(const NoteIndex& index) {
     std::vector<Note> out;
-    std::string dir = normalizedVoiceDir();
-    // Ensure directory exists or bail out safely (no throw)
-    std::error_code ec;
-    if (!std::filesystem::exists(dir, ec)) {
-        std::filesystem::create_directories(dir, ec);
-        return out; // empty
+    for (auto& e : index.entries()) {
+        Note n;
+        n.base    = e.base;
+        n.txtPath = e.txtPath;
+        n.wavPath = e.wavPath;
+        n.created = e.created;
+        n.title   = e.title;
+        n.mtime   = e.mtime;
+        n.size    = e.size;
+        out.push_back(std::move(n));
     }
+    return out;
+}
 
-    std::unordered_map<std::string, Note> map; // base -> Note
-    try {
-        for (auto& p : std::filesystem::directory_iterator(dir)) {
-            if (!p.is_regular_file()) continue;
-            auto path = p.path().string();
-            auto ext  = p.path().extension().string();
-            auto stem = p.path().stem().string();   // base name without extension
-
-            if (ext == ".txt" || ext == ".TXT") {
-                Note& n = map[stem];
-                n.base    = stem;
-                n.txtPath = path;
-            } else if (ext == ".wav" || ext == ".WAV") {
-                Note& n = map[stem];
-                n.base    = stem;
-                n.wavPath = path;
-            }
-        }
-    } catch (...) {
-        // Folder got deleted/locked mid-scan; return gracefully
-        std::cerr << "Error scanning voice notes directory.\n";
-        return out;
+// Rebuild the list after the index changed, keeping loaded bodies and the selection
+static void syncNotes(std::vector<Note>& notes, int& selected, const NoteIndex& index) {
+    std::string selBase = (selected >= 0 && selected < (int)notes.size()) ? notes[selected].base : "";
+    std::unordered_map<std::string, Note> loaded;
+    for (auto& n : notes) {
+        if (n.loaded) loaded.emplace(n.base, std::move(n));
     }
 
-    // load text + created
-    for (auto& kv : map) {
-        Note n = kv.second;
-        if (!n.txtPath.empty()) {
-            n.text = slurp(n.txtPath);
+    notes = notesFromIndex(index);
+    selected = 0;
+    for (int i = 0; i < (int)notes.size(); ++i) {
+        Note& n = notes[i];
+        auto it = loaded.find(n.base);
+        if (it != loaded.end()) {
+            // in-memory text wins: it may hold edits not yet autosaved
+            n.text       = std::move(it->second.text);
+            n.created    = it->second.created;
+            n.loaded     = true;
+            n.edits      = it->second.edits;
+            n.savedEdits = it->second.savedEdits;
         }
-        // derive "created" from filename if matches note_YYYY-mm-dd_HH-MM-SS
-        // else use file write time or blank
-        n.created = nowShort();
-        try {
-            auto ftime = std::filesystem::last_write_time(n.txtPath.empty() ? (n.wavPath.empty() ? "" : n.wavPath) : n.txtPath);
-            if (!n.txtPath.empty() || !n.wavPath.empty()) {
-                auto sctp = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
-                    ftime - std::filesystem::file_time_type::clock::now()
-                    + std::chrono::system_clock::now()
-                );
-                std::time_t tt = std::chrono::system_clock::to_time_t(sctp);
-                std::tm tm{};
-            #if defined(_WIN32)
-                localtime_s(&tm, &tt);
-            #else
-                localtime_r(&tt, &tm);
-            #endif
-                char buf[6];
-                std::strftime(buf, sizeof(buf), "%H:%M", &tm);
-                n.created = buf;
-            }
-        } catch (...) {}
-
-        out.push_back(std::move(n));
+        if (n.base == selBase) selected = i;
     }
+}
 
-    // sort newest-first by base name (timestamp in name) or by path time
-    std::sort(out.begin(), out.end(), [](const Note& a, const Note& b){
-        return a.base > b.base;
-    });
-
-    return out;
+// Before editing: a body still being read in the background is read now
+static void ensureLoaded(Note& n, NoteCache& cache) {
+    if (n.loaded) return;
+    if (!n.txtPath.empty()) n.text = cache.load(n.txtPath, n.mtime, n.size);
+    n.loaded = true;
 }
 
 // Save current editor text back to its file
 static bool saveNoteText(const Note& n) {
-    if (n.txtPath.empty()) return false;
+    if (n.txtPath.empty() || !n.loaded) return false; // never overwrite a body we haven't read
     return spit(n.txtPath, n.text);
 }
 
@@ -412,6 +534,7 @@ static Note createNewTextNote() {
     n.wavPath = wav;
     n.text    = initial;
     n.created = nowShort();
+    n.loaded  = true;
     return n;
 }
 
@@ -423,6 +546,14 @@ static std::string firstLine(const std::string& s)
     return (p == std::string::npos) ? s : s.substr(0, p);
 }
 
+// The summarizer's title when the note has one, else its first line
+static std::string noteTitle(const Note& n, const std::map<std::string, std::string>& summaries)
+{
+    auto it = summaries.find(n.base);
+    if (it != summaries.end()) return it->second;
+    return n.loaded ? firstLine(n.text) : n.title;
+}
+
 // clamp
 template <typename T>
 static T clamp(T v, T lo, T hi) { return std::max(lo, std::min(v, hi)); }
@@ -436,7 +567,7 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
     const sf::Color textCol(230,230,230);
 
     // Window (w,h)
-    sf::RenderWindow win(sf::VideoMode({560u, 500u}), "Settings",
+    sf::RenderWindow win(sf::VideoMode({560u, 710u}), "Settings",
                          sf::Style::Titlebar | sf::Style::Close);
 
                          sf::Image gearIcon;
@@ -474,23 +605,36 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
     std::string v_hot_notes  = Settings::keybinding_open_notes_window;
     bool        v_topmost    = Settings::always_on_top;
     bool        v_hide_tb    = Settings::hide_in_taskbar;
+    std::string v_model      = Settings::whisper_model_path;
+    std::string v_device     = Settings::whisper_device;
+    bool        v_flash      = Settings::flash_attention;
+    std::string v_quality    = Settings::model_preference;
+    bool        v_quantize   = Settings::quantize_models;
+
+    // Installed models; clicking the list box steps through them
+    const std::string modelDir = std::filesystem::path(v_model).parent_path().string();
+    std::vector<ModelFile> installed = discoverModels(modelDir.empty() ? "whisper/models" : modelDir);
+    const std::vector<std::string> qualityOptions = {"speed", "balanced", "accuracy"};
+
+    // Backends whisper can run on; clicking the box cycles through them
+    std::vector<std::string> backendOptions = {"auto", "cpu"};
+    for (const auto& d : TranscriptionEngine::gpuDevices()) backendOptions.push_back(d);
+    if (std::find(backendOptions.begin(), backendOptions.end(), v_device) == backendOptions.end()) {
+        backendOptions.push_back(v_device); // configured device not present right now
+    }
 
     // ------- Mic devices (dropdown) -------
+    // Enumerated in the background (slow with many endpoints); the list is
+    // the cached one until a refresh finds a different set
+    CaptureDevices& capture = CaptureDevices::instance();
+    capture.refresh();
+    auto lastDeviceRefresh = std::chrono::steady_clock::now();
     std::vector<std::string> devices;
-    if (sf::SoundRecorder::isAvailable())
-        devices = sf::SoundRecorder::getAvailableDevices();
-    if (devices.empty()) devices.push_back("No capture devices found");
-    std::string defaultDev = sf::SoundRecorder::getDefaultDevice();
-
+    unsigned devicesGen = 0;
+    bool devicesReal = false;            // false: `devices` holds a placeholder line
+    bool devicePicked = false;           // the user chose from the list
     int selectedDev = 0;
-    if (!Settings::audio_input_device.empty()) {
-        for (int i=0;i<(int)devices.size();++i)
-            if (devices[i] == Settings::audio_input_device) { selectedDev = i; break; }
-    } else {
-        for (int i=0;i<(int)devices.size();++i)
-            if (devices[i] == defaultDev) { selectedDev = i; break; }
-    }
-    std::string v_input_dev = devices[selectedDev];
+    std::string v_input_dev = Settings::audio_input_device;
     bool dropdownOpen = false;
 
     // ------- Text fields layout (added spacing) -------
@@ -513,14 +657,46 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
     sf::FloatRect dd_label({24.f, y - 16.f}, {512.f, 14.f});
     sf::FloatRect dd_box  ({24.f, y},        {512.f, 34.f});
     const float rowH = 28.f;
-    int dropRows = std::min<int>((int)devices.size(), 8);
+    int dropRows = 1;
     sf::FloatRect dd_drop({dd_box.position.x, dd_box.position.y + dd_box.size.y + 2.f},
-                          {dd_box.size.x, dropRows * rowH});
+                          {dd_box.size.x, rowH});
     y += gap;
+
+    auto syncDevices = [&]() {
+        std::string defaultDev;
+        devices = capture.list(&defaultDev);
+        devicesGen = capture.generation();
+        devicesReal = !devices.empty();
+        if (!devicesReal) devices.push_back(capture.ready() ? "No capture devices found" : "Looking for devices...");
+
+        const std::string& want = (devicePicked || !Settings::audio_input_device.empty()) ? v_input_dev : defaultDev;
+        selectedDev = 0;
+        for (int i=0;i<(int)devices.size();++i)
+            if (devices[i] == want) { selectedDev = i; break; }
+        // a configured device that is gone (or "default") falls back to the first one
+        if (devicesReal && !devicePicked) v_input_dev = devices[selectedDev];
+
+        dropRows = std::min<int>((int)devices.size(), 8);
+        dd_drop.size.y = dropRows * rowH;
+    };
+    syncDevices();
     
     // Shortcuts
     fields.push_back({ &v_hot_rec,   makeBox(y), "Shortcut: Start/Stop Recording" }); y += gap;
     fields.push_back({ &v_hot_notes, makeBox(y), "Shortcut: Open Notes Window"    }); y += gap;
+    fields.push_back({ &v_model,     makeBox(y), "Whisper model file"             }); y += gap;
+
+    // Transcription backend
+    sf::FloatRect box_backend({24.f, y},       {248.f, 28.f});
+    sf::FloatRect box_flash({288.f, y},        {248.f, 28.f});
+    y += 46.f;
+
+    // Model manager: installed files, and how to trade accuracy for speed
+    sf::FloatRect box_models({24.f, y},        {512.f, 28.f});
+    y += 46.f;
+    sf::FloatRect box_quality({24.f, y},       {248.f, 28.f});
+    sf::FloatRect box_quantize({288.f, y},     {248.f, 28.f});
+    y += 46.f;
     
     // Toggles
     sf::FloatRect box_topmost({24.f, y},       {248.f, 28.f});
@@ -581,6 +757,12 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
             caretOn = !caretOn;
             lastBlink = now;
         }
+        // pick up devices plugged in or removed while the dialog is open
+        if (now - lastDeviceRefresh > std::chrono::seconds(3)) {
+            capture.refresh();
+            lastDeviceRefresh = now;
+        }
+        if (capture.generation() != devicesGen) syncDevices();
 
         while (const std::optional ev = win.pollEvent()) {
             if (ev->is<sf::Event::Closed>()) { win.close(); return false; }
@@ -597,8 +779,11 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
                     } else if (dropdownOpen && dd_drop.contains(mp)) {
                         int idx = (int)((mp.y - dd_drop.position.y) / rowH);
                         idx = clamp(idx, 0, (int)devices.size() - 1);
-                        selectedDev = idx;
-                        v_input_dev = devices[selectedDev];
+                        if (devicesReal) {
+                            selectedDev = idx;
+                            v_input_dev = devices[selectedDev];
+                            devicePicked = true;
+                        }
                         dropdownOpen = false;
                     } else {
                         // Close dropdown if click elsewhere
@@ -613,6 +798,24 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
                         // Toggles
                         if (box_topmost.contains(mp)) v_topmost = !v_topmost;
                         if (box_hideTB.contains(mp)) v_hide_tb = !v_hide_tb;
+                        if (box_flash.contains(mp)) v_flash = !v_flash;
+                        if (box_quantize.contains(mp)) v_quantize = !v_quantize;
+                        if (box_quality.contains(mp)) {
+                            auto it = std::find(qualityOptions.begin(), qualityOptions.end(), v_quality);
+                            const std::size_t i = it == qualityOptions.end() ? 0 : (std::size_t) (it - qualityOptions.begin()) + 1;
+                            v_quality = qualityOptions[i % qualityOptions.size()];
+                        }
+                        if (box_models.contains(mp) && !installed.empty()) {
+                            auto it = std::find_if(installed.begin(), installed.end(),
+                                                   [&](const ModelFile& m){ return m.path == v_model; });
+                            const std::size_t i = it == installed.end() ? 0 : (std::size_t) (it - installed.begin()) + 1;
+                            v_model = installed[i % installed.size()].path;
+                        }
+                        if (box_backend.contains(mp)) {
+                            auto it = std::find(backendOptions.begin(), backendOptions.end(), v_device);
+                            const std::size_t i = it == backendOptions.end() ? 0 : (std::size_t) (it - backendOptions.begin()) + 1;
+                            v_device = backendOptions[i % backendOptions.size()];
+                        }
 
                         // Buttons
                         if (btn_ok.contains(mp)) {
@@ -629,6 +832,11 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
                                 Settings::keybinding_open_notes_window   = v_hot_notes;
                                 Settings::always_on_top   = v_topmost;
                                 Settings::hide_in_taskbar = v_hide_tb;
+                                Settings::whisper_model_path = v_model;
+                                Settings::whisper_device = v_device;
+                                Settings::flash_attention = v_flash;
+                                Settings::model_preference = v_quality;
+                                Settings::quantize_models = v_quantize;
 
                                 if (!mgr.writeSettings(mgr.getSettings())) {
                                     std::cerr << "Failed writing settings file.\n";
@@ -649,12 +857,14 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
                 if (k->scancode == sf::Keyboard::Scancode::Escape) { win.close(); return false; }
 
                 if (dropdownOpen) {
-                    if (k->scancode == sf::Keyboard::Scancode::Up) {
+                    if (k->scancode == sf::Keyboard::Scancode::Up && devicesReal) {
                         selectedDev = std::max(0, selectedDev - 1);
                         v_input_dev = devices[selectedDev];
-                    } else if (k->scancode == sf::Keyboard::Scancode::Down) {
+                        devicePicked = true;
+                    } else if (k->scancode == sf::Keyboard::Scancode::Down && devicesReal) {
                         selectedDev = std::min((int)devices.size() - 1, selectedDev + 1);
                         v_input_dev = devices[selectedDev];
+                        devicePicked = true;
                     } else if (k->scancode == sf::Keyboard::Scancode::Enter) {
                         dropdownOpen = false;
                     }
@@ -675,6 +885,11 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
                         Settings::keybinding_open_notes_window   = v_hot_notes;
                         Settings::always_on_top   = v_topmost;
                         Settings::hide_in_taskbar = v_hide_tb;
+                        Settings::whisper_model_path = v_model;
+                        Settings::whisper_device = v_device;
+                        Settings::flash_attention = v_flash;
+                        Settings::model_preference = v_quality;
+                        Settings::quantize_models = v_quantize;
 
                         if (!mgr.writeSettings(mgr.getSettings())) {
                             std::cerr << "Failed writing settings file.\n";
@@ -732,7 +947,7 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
                 sf::Text tmp(font, s, 16);
                 return tmp.getLocalBounds().size.x <= dd_box.size.x - 16.f;
             };
-            std::string shown = v_input_dev;
+            std::string shown = devicesReal || !v_input_dev.empty() ? v_input_dev : devices[0];
             if (!fits(shown)) {
                 while (!shown.empty() && !fits(shown + "...")) shown.pop_back();
                 shown += "...";
@@ -755,6 +970,27 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
         drawBox(box_hideTB, false);
         labelText(std::string("Hide in Taskbar: ") + (v_hide_tb ? "true" : "false"),
                   box_hideTB.position.x + 8.f, box_hideTB.position.y + 4.f, 16);
+        drawBox(box_backend, false);
+        labelText("Backend: " + v_device, box_backend.position.x + 8.f, box_backend.position.y + 4.f, 16);
+        drawBox(box_models, false);
+        {
+            std::string shown = installed.empty() ? "Installed: none found"
+                                                  : "Installed: " + std::to_string(installed.size()) + " models (click to pick)";
+            for (const ModelFile& m : installed) {
+                if (m.path != v_model) continue;
+                shown = "Installed: " + m.name + (m.quant.empty() ? "" : " " + m.quant) +
+                        " (" + std::to_string(m.size >> 20) + " MB, " + std::to_string(installed.size()) + " total)";
+            }
+            labelText(shown, box_models.position.x + 8.f, box_models.position.y + 4.f, 16);
+        }
+        drawBox(box_quality, false);
+        labelText("Quality: " + v_quality, box_quality.position.x + 8.f, box_quality.position.y + 4.f, 16);
+        drawBox(box_quantize, false);
+        labelText(std::string("Auto-Quantize: ") + (v_quantize ? "true" : "false"),
+                  box_quantize.position.x + 8.f, box_quantize.position.y + 4.f, 16);
+        drawBox(box_flash, false);
+        labelText(std::string("Flash Attention: ") + (v_flash ? "true" : "false"),
+                  box_flash.position.x + 8.f, box_flash.position.y + 4.f, 16);
 
         // Buttons
         drawBtn(btn_ok, "OK");
@@ -801,38 +1037,23 @@ static bool openSettingsWindow(sf::Window& parent, SettingsManager& mgr) {
 
 
 // ---------- App ----------
-int main()
+// Recordings (files or folders) given on the command line are imported
+int main(int argc, char** argv)
 {
+    // Staged startup: the window shows its empty panels first; the icons, the
+    // font and the search index are read on worker threads while the model
+    // starts loading and the note index opens, and the first full frame
+    // follows once those are in
+
     // Window
     sf::RenderWindow win(sf::VideoMode({HUB_W, HUB_H}), "Voice Notes", sf::Style::None);
-    // Window / taskbar icon
-    sf::Image appIcon;
-    if (appIcon.loadFromFile("assets/icon.png")) {
-        win.setIcon(appIcon.getSize(), appIcon.getPixelsPtr());
-    } else {
-        std::cerr << "Missing assets/icon.png for window icon\n";
-    }
     // Settings
     SettingsManager settingsMgr("settings.txt");
     settingsMgr.applySettings();                     // load on start (reads file or creates defaults)
     setAlwaysOnTop(win, Settings::always_on_top);    // honor setting immediately
-
-    // Parse hotkeys from settings
-    Hotkey hkRecord = parseHotkey(Settings::keybinding_start_stop_recording);
-    Hotkey hkOpenNotes = parseHotkey(Settings::keybinding_open_notes_window);
-
-    #if defined(_WIN32)
-    GlobalHotkeyListener gh;
-    gh.start(hkRecord, hkOpenNotes);
-    #endif
-
     win.setFramerateLimit(144);
     win.setPosition(rightEdgeStart(HUB_W, HUB_H));
 
-    // Dragging by header
-    bool dragging = false;
-    sf::Vector2i dragOffset{0,0};
-
     // Colors
     const sf::Color bg(27,27,27);
     const sf::Color panel(38,38,38);
@@ -846,6 +1067,7 @@ int main()
     const float headerH = 36.f;
     const float listW   = 180.f;
     const float itemH   = 56.f;
+    const float waveH   = 44.f;   // waveform strip at the bottom of the editor
 
     // Geometry
     sf::RectangleShape headerRect({static_cast<float>(HUB_W), headerH});
@@ -860,9 +1082,56 @@ int main()
     editorRect.setPosition(sf::Vector2f(listW, headerH));
     editorRect.setFillColor(bg);
 
-    // Font
+    // Skeleton frame: the hub is on screen before anything is read from disk
+    win.clear(bg);
+    win.draw(headerRect);
+    win.draw(listRect);
+    win.draw(editorRect);
+    win.display();
+
+    // Window / taskbar icon, header icons and the font decode in parallel
+    auto appIconLoad = std::async(std::launch::async, []{
+        sf::Image img;
+        if (!img.loadFromFile("assets/icon.png")) std::cerr << "Missing assets/icon.png for window icon\n";
+        return img;
+    });
+    auto iconLoad = std::async(std::launch::async, []{
+        return IconAtlas::decode({"assets/play.png", "assets/pause.png", "assets/mic_off.png", "assets/mic_on.png",
+                                  "assets/gear.png", "assets/add.png"});
+    });
+    auto fontLoad = std::async(std::launch::async, []{
+        std::ifstream in(FONT_PATH, std::ios::binary);
+        return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    });
+
+    // Pick the CPU kernels and GPU backends this machine supports, report
+    // what the model could be offloaded to, then load it once, in the
+    // background, while the UI comes up
+    TranscriptionEngine::loadBackends();
+    for (const auto& dev : TranscriptionEngine::gpuDevices()) {
+        std::cout << "Whisper backend device: " << dev << "\n";
+    }
+    preloadWhisperModel();
+    armAudioCapture();
+    CaptureDevices::instance().refresh();   // warm the list for the settings dialog
+
+    // Parse hotkeys from settings
+    Hotkey hkRecord = parseHotkey(Settings::keybinding_start_stop_recording);
+    Hotkey hkOpenNotes = parseHotkey(Settings::keybinding_open_notes_window);
+
+    #if defined(_WIN32)
+    GlobalHotkeyListener gh;
+    gh.start(hkRecord, hkOpenNotes);
+    #endif
+
+    // Dragging by header
+    bool dragging = false;
+    sf::Vector2i dragOffset{0,0};
+
+    // Font (sf::Font reads from the buffer as glyphs are needed)
+    const std::vector<char> fontData = fontLoad.get();
     sf::Font font;
-    bool ok = font.openFromFile(FONT_PATH); (void)ok; // avoid nodiscard warning
+    bool ok = !fontData.empty() && font.openFromMemory(fontData.data(), fontData.size()); (void)ok;
 
     // Text UI
     sf::Text titleText(font, "Voice Notes", 16);
@@ -881,26 +1150,21 @@ int main()
     bool isRecording = false;            // replaces string check "mic"/"stop"
 
 
-    // Load textures
-    sf::Texture texGear, texMicOff, texMicOn, texPlay, texPause;
-    if (!texGear.loadFromFile("assets/gear.png"))     std::cerr << "Missing assets/gear.png\n";
-    if (!texMicOff.loadFromFile("assets/mic_off.png"))std::cerr << "Missing assets/mic_off.png\n";
-    if (!texMicOn.loadFromFile("assets/mic_on.png"))  std::cerr << "Missing assets/mic_on.png\n";
-    if (!texPlay.loadFromFile("assets/play.png"))     std::cerr << "Missing assets/play.png\n";
-    if (!texPause.loadFromFile("assets/pause.png"))   std::cerr << "Missing assets/pause.png\n";
-
-    texGear.setSmooth(true);
-    texMicOff.setSmooth(true);
-    texMicOn.setSmooth(true);
-    texPlay.setSmooth(true);
-    texPause.setSmooth(true);
-
-    // Helper: scale a sprite so its longest side = ICON_PX
-    auto fitIcon = [](sf::Sprite& sp, float ICON_PX) {
-        sf::Vector2u sz = sp.getTexture().getSize();
-        if (sz.x == 0 || sz.y == 0) return;
-        float scale = ICON_PX / static_cast<float>(std::max(sz.x, sz.y));
-        sp.setScale(sf::Vector2f(scale, scale));
+    // Header icons share one texture, so the header draws them in one call
+    enum Icon { ICON_PLAY, ICON_PAUSE, ICON_MIC_OFF, ICON_MIC_ON, ICON_GEAR, ICON_ADD };
+    IconAtlas icons;
+    icons.build(iconLoad.get());
+    {
+        const sf::Image appIcon = appIconLoad.get();
+        if (appIcon.getSize().x > 0) win.setIcon(appIcon.getSize(), appIcon.getPixelsPtr());
+    }
+
+    // Helper: place an icon so its longest side = ICON_PX
+    auto fitIcon = [&](Icon icon, sf::Vector2f pos, float ICON_PX) {
+        const sf::Vector2i sz = icons.rect(icon).size;
+        if (sz.x <= 0 || sz.y <= 0) return sf::FloatRect(pos, {ICON_PX, ICON_PX});
+        const float scale = ICON_PX / static_cast<float>(std::max(sz.x, sz.y));
+        return sf::FloatRect(pos, {sz.x * scale, sz.y * scale});
     };
 
     const float ICON_PX = 32.0f;               // uniform intended pixel size
@@ -910,33 +1174,29 @@ int main()
     const float X_MIC   = static_cast<float>(HUB_W) - 160.0f;
     const float X_GEAR  = static_cast<float>(HUB_W) - 125.0f;
 
-    // Add icon
-    sf::Texture texAdd;
-    if (!texAdd.loadFromFile("assets/add.png")) std::cerr << "Missing assets/add.png\n";
-    texAdd.setSmooth(true);
-
-    sf::Sprite spAdd(texAdd);
-    fitIcon(spAdd, ICON_PX);
-    spAdd.setPosition({ static_cast<float>(HUB_W) - 88.f, ICON_Y });
-    sf::FloatRect addBounds = spAdd.getGlobalBounds();
-
-    sf::Sprite spPlay(texPlay);
-    fitIcon(spPlay, ICON_PX);
-    spPlay.setPosition({ X_PLAY, ICON_Y });
-    sf::FloatRect playBounds = spPlay.getGlobalBounds();
-
-    sf::Sprite spMic(texMicOff);
-    fitIcon(spMic, ICON_PX);
-    spMic.setPosition({ X_MIC, ICON_Y });
-    sf::FloatRect micBounds = spMic.getGlobalBounds();
-
-    sf::Sprite spGear(texGear);
-    fitIcon(spGear, ICON_PX+1.f); // gear looks smaller, give a bit more size
-    spGear.setPosition({ X_GEAR, ICON_Y });
-    sf::FloatRect gearBounds = spGear.getGlobalBounds();
+    sf::FloatRect addBounds  = fitIcon(ICON_ADD, { static_cast<float>(HUB_W) - 88.f, ICON_Y }, ICON_PX);
+    sf::FloatRect playBounds = fitIcon(ICON_PLAY, { X_PLAY, ICON_Y }, ICON_PX);
+    sf::FloatRect micBounds  = fitIcon(ICON_MIC_OFF, { X_MIC, ICON_Y }, ICON_PX);
+    sf::FloatRect gearBounds = fitIcon(ICON_GEAR, { X_GEAR, ICON_Y }, ICON_PX+1.f); // gear looks smaller, give a bit more size
+    Icon playIcon = ICON_PLAY;
+    Icon micIcon  = ICON_MIC_OFF;
 
     // Notes
-    std::vector<Note> notes = scanVoiceNotes();
+    NoteIndex noteIndex;
+    NoteWriter noteWriter;               // autosaves run on its I/O thread
+    NoteCache noteCache;                 // bodies, read in the background
+    std::string bodyBase;                // selection whose body was last asked for
+    std::int64_t bodyMtime = 0;          // ... and its mtime then
+    // the search index loads meanwhile
+    SearchIndex searchIndex;
+    auto searchLoad = std::async(std::launch::async, [&searchIndex]{ searchIndex.load(SEARCH_INDEX_PATH); });
+    noteIndex.open(normalizedVoiceDir(), Settings::note_store == "packed");
+    std::map<std::string, std::string> summaryTitles = NoteSummarizer::titles(normalizedVoiceDir());
+    // Imports cut short last time, then the ones asked for now
+    AudioImporter::instance().resume();
+    if (argc > 1) AudioImporter::instance().import(std::vector<std::string>(argv + 1, argv + argc));
+    acceptDroppedFiles(win);
+    std::vector<Note> notes = notesFromIndex(noteIndex);
     if (notes.empty()) {
         auto n = createNewTextNote();      // creates a new .txt on disk
         n.text = "Take a note...\n";       // override initial content
@@ -945,64 +1205,152 @@ int main()
     }
 
     int selected = 0;
+    std::unordered_map<std::string, ListRow> listRows; // note base -> cached row; cleared on resync
+
+    // Full-text search: the index is caught up with the note list a few
+    // files at a time from the main loop, and persisted between runs
+    struct SearchTodo { std::string base, txtPath; std::int64_t mtime; };
+    searchLoad.get();
+    std::vector<SearchTodo> searchBacklog;
+    auto searchSavedAt = std::chrono::steady_clock::now();
+    bool searchActive = false;           // search box open (takes the keyboard)
+    std::string searchQuery;
+    std::vector<int> searchHits;         // indices into notes, best first
+
+    auto runSearch = [&](){
+        searchHits.clear();
+        if (searchQuery.empty()) return;
+        std::unordered_map<std::string, int> byBase;
+        for (int i = 0; i < (int)notes.size(); ++i) byBase[notes[i].base] = i;
+        for (const auto& h : searchIndex.search(searchQuery, 200)) {
+            auto it = byBase.find(h.base);
+            if (it != byBase.end()) searchHits.push_back(it->second);
+        }
+    };
+
+    // Call whenever `notes` was rebuilt
+    auto notesChanged = [&](){
+        listRows.clear();
+        std::unordered_set<std::string> live;
+        searchBacklog.clear();
+        for (const auto& n : notes) {
+            if (n.txtPath.empty()) continue;
+            live.insert(n.base);
+            if (!searchIndex.isCurrent(n.base, n.mtime)) searchBacklog.push_back({n.base, n.txtPath, n.mtime});
+        }
+        searchIndex.retain(live);
+        if (searchActive) runSearch();
+    };
+    notesChanged();
+
+    // Scrolling
+    float listScroll = 0.f;
+    float editorScroll = 0.f;
+
+    // Background transcription status (shown in the header)
+    int transcribeProgress = -1;         // -1 while idle
+    auto updateTitle = [&](){
+        if (transcribeProgress < 0) {
+            titleText.setString("Voice Notes");
+        } else {
+            size_t queued = TranscriptionEngine::instance().pendingJobs();
+            std::string s = "Transcribing " + std::to_string(transcribeProgress) + "%";
+            if (queued > 1) s += " (+" + std::to_string(queued - 1) + ")";
+            titleText.setString(s);
+        }
+    };
 
     // Button actions
+    // Live transcription of the note being recorded
+    std::string livePath;                // txtPath of the note receiving live text
+    std::string livePartial;             // tentative text of the current window
+
     auto toggleRecording = [&](){
         if (!isRecording) {
-            startRecordAudioFromMicrophone();
+            if (startRecordAudioFromMicrophone() != 0) return;
             isRecording = true;
-            spMic.setTexture(texMicOn);
+            micIcon = ICON_MIC_ON;
+            // The note is created when recording starts; select it so live text shows up
+            livePath = activeRecordingTextPath();
+            livePartial.clear();
+            noteIndex.refresh(std::filesystem::path(livePath).stem().string());
+            syncNotes(notes, selected, noteIndex);
+            notesChanged();
+            for (int i = 0; i < (int)notes.size(); ++i) {
+                if (notes[i].txtPath == livePath) { selected = i; break; }
+            }
+            editorScroll = 0.f;
         } else {
             stopRecordAudioFromMicrophone();
+            PerfTrace::instance().endPath("stopped");
             isRecording = false;
-            spMic.setTexture(texMicOff);
-            // Refresh newest notes after recording/transcription
-            notes = scanVoiceNotes();
-            if (!notes.empty()) selected = 0;
+            micIcon = ICON_MIC_OFF;
+            // the next start goes by a fresh device list
+            CaptureDevices::instance().refresh();
         }
     };
 
-    // Simple audio player state
-    sf::SoundBuffer playBuffer;
-    std::optional<sf::Sound> player;
+    // Simple audio player state; sf::Music streams from disk, so long
+    // notes start at once, seek without decoding what lies before, and
+    // never sit decoded in memory
+    std::optional<sf::Music> player;
+    std::string     playingPath;          // recording the player has open
     bool            isPlaying = false;
+    std::vector<SpeechSpan> playSpeech;   // speech map of the playing note, if any
 
-    auto playSelected = [&](){
+    // Play the selected note's recording from `ms`
+    auto playAt = [&](std::uint32_t ms){
         if (selected < 0 || selected >= static_cast<int>(notes.size())) return;
         const auto& n = notes[selected];
         if (n.wavPath.empty()) return;
         if (!std::filesystem::exists(n.wavPath)) return;
 
+        // Open a stream for this note unless it is open already
+        if (!player || playingPath != n.wavPath) {
+            player.emplace();
+            playingPath.clear();
+            if (!player->openFromFile(n.wavPath)) {
+                std::cerr << "Failed to load " << n.wavPath << "\n";
+                player.reset();
+                return;
+            }
+            playingPath = n.wavPath;
+            if (!Settings::skip_silence_on_playback || !loadSpeechMap(speechMapPath(n.wavPath), playSpeech)) {
+                playSpeech.clear();
+            }
+        }
+        player->setPlayingOffset(sf::milliseconds(static_cast<std::int32_t>(ms)));
+        player->play();
+        isPlaying = true;
+        playIcon = ICON_PAUSE;
+    };
+
+    auto playSelected = [&](){
         // If already playing, stop and toggle UI
         if (isPlaying && player) {
             player->stop();
             isPlaying = false;
-            spPlay.setTexture(texPlay);
+            playIcon = ICON_PLAY;
             return;
         }
-
-        // Load buffer for this note and (re)construct the sound
-        if (!playBuffer.loadFromFile(n.wavPath)) {
-            std::cerr << "Failed to load " << n.wavPath << "\n";
-            return;
-        }
-        player.emplace(playBuffer);
-        player->play();
-        isPlaying = true;
-        spPlay.setTexture(texPause);
+        playAt(0);
     };
 
-    // Scrolling
-    float listScroll = 0.f;
-    float editorScroll = 0.f;
+    WaveStrip waveStrip;
 
-    // Text rendering objects
-    sf::Text listLine(font, "", 14);
-    listLine.setFillColor(textCol);
+    // Jump over the silences the VAD cut from the transcript
+    auto skipSilence = [&](){
+        if (!isPlaying || !player || playSpeech.empty()) return;
+        const std::uint64_t pos = (std::uint64_t) player->getPlayingOffset().asMilliseconds() * 16000 / 1000;
+        auto it = std::find_if(playSpeech.begin(), playSpeech.end(),
+                               [pos](const SpeechSpan& s){ return s.end > pos; });
+        if (it == playSpeech.end()) player->stop();  // only silence left
+        else if (it->begin > pos) player->setPlayingOffset(sf::milliseconds((std::int32_t) (it->begin * 1000 / 16000)));
+    };
 
-    sf::Text editorText(font, "", 16);
-    editorText.setFillColor(textCol);
-    editorText.setLineSpacing(1.2f);
+    // Text rendering objects
+    TextLayout editorText(font, 16, 1.2f, textCol);
+    sf::Text searchText(font, "", 14);
 
     // Views for clipping/scroll
     sf::View listView(makeRect(0.f, 0.f, listW, static_cast<float>(HUB_H) - headerH));
@@ -1012,30 +1360,195 @@ int main()
 
     sf::View editorView(makeRect(0.f, 0.f,
                                  static_cast<float>(HUB_W) - listW,
-                                 static_cast<float>(HUB_H) - headerH));
+                                 static_cast<float>(HUB_H) - headerH - waveH));
     editorView.setViewport(makeRect(listW / static_cast<float>(HUB_W), headerH / HUB_H,
                                     (static_cast<float>(HUB_W) - listW) / HUB_W,
-                                    (static_cast<float>(HUB_H) - headerH) / HUB_H));
-
-    auto requestSaveAt = std::chrono::steady_clock::now();
+                                    (static_cast<float>(HUB_H) - headerH - waveH) / HUB_H));
+
+    // Autosave: edits coalesce until typing pauses (or 5 s at the latest),
+    // then changed notes go to the writer thread; unchanged ones are skipped
+    auto requestSaveAt = std::chrono::steady_clock::now();   // last edit
+    auto lastSaveAt = std::chrono::steady_clock::now();
+    auto saveIfDirty = [&](Note& n){
+        if (!n.loaded || n.txtPath.empty() || !n.dirty()) return;
+        noteWriter.save(n.txtPath, n.text);
+        n.savedEdits = n.edits;
+    };
+    auto saveAllDirty = [&](){
+        for (auto& n : notes) saveIfDirty(n);
+        lastSaveAt = std::chrono::steady_clock::now();
+    };
     auto maybeAutosave = [&](){
         auto now = std::chrono::steady_clock::now();
-        if (now - requestSaveAt > std::chrono::seconds(3)) {
-            if (selected >= 0 && selected < (int)notes.size()) {
-                saveNoteText(notes[selected]);
-            }
-            requestSaveAt = now;
+        if (requestSaveAt < lastSaveAt) return; // nothing edited since the last pass
+        if (now - requestSaveAt > std::chrono::seconds(1) || now - lastSaveAt > std::chrono::seconds(5)) {
+            saveAllDirty();
         }
     };
 
+    // Per-frame batches, kept to reuse their vertex storage
+    QuadBatch headerIcons, listRects, listTitles, listTimes;
+
+    // On-demand rendering: the loop sleeps in waitEvent and only redraws
+    // when something visible changed
+    bool needsRedraw = true;
+    bool caretOn = true;
+    bool modelLoading = true;            // shown as a dot on the mic button
+    auto caretFlip = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+
+    // Performance overlay (F3), refreshed every 250 ms while shown; F4
+    // writes a trace of the last seconds
+    bool perfHud = false;
+    auto hudRefresh = std::chrono::steady_clock::now();
+    float frameMs = 0.f, frameMaxMs = 0.f;
+    unsigned frameDraws = 0;
+    sf::Text hudText(font, "", 12);
+
     while (win.isOpen())
     {
-        while (const std::optional ev = win.pollEvent())
+        // Follow changes in the notes folder; a body is read when first needed
+        if (noteIndex.poll()) {
+            syncNotes(notes, selected, noteIndex);
+            if (notes.empty()) {
+                notes.push_back(createNewTextNote());
+                selected = 0;
+            }
+            notesChanged();
+            needsRedraw = true;
+        }
+
+        // Search indexing gets a small time slice per pass; the file is
+        // rewritten at most once a minute (and on exit)
+        if (!searchBacklog.empty()) {
+            const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(8);
+            while (!searchBacklog.empty() && std::chrono::steady_clock::now() < until) {
+                SearchTodo t = std::move(searchBacklog.back());
+                searchBacklog.pop_back();
+                searchIndex.update(t.base, t.mtime, slurp(t.txtPath));
+            }
+            if (searchBacklog.empty() && searchActive) {
+                runSearch();
+                needsRedraw = true;
+            }
+        }
+        if (searchIndex.unsaved() && std::chrono::steady_clock::now() - searchSavedAt > std::chrono::minutes(1)) {
+            searchIndex.save(SEARCH_INDEX_PATH);
+            searchSavedAt = std::chrono::steady_clock::now();
+        }
+        // Body of the selection from the cache, else read in the background
+        // along with its neighbours; again when the file changes on disk.
+        // Our own edits (typed or queued for the writer) are never replaced.
+        if (selected >= 0 && selected < (int)notes.size()) {
+            Note& sel = notes[selected];
+            if (sel.base != bodyBase || sel.mtime != bodyMtime) {
+                bodyBase = sel.base;
+                bodyMtime = sel.mtime;
+                for (int i : {selected, selected - 1, selected + 1}) {
+                    if (i < 0 || i >= (int)notes.size() || notes[i].txtPath.empty()) continue;
+                    Note& n = notes[i];
+                    if (n.dirty() || noteWriter.isPending(n.txtPath)) continue;
+                    std::string text;
+                    if (i == selected && noteCache.get(n.txtPath, n.mtime, n.size, text)) {
+                        if (!n.loaded || text != n.text) { n.text = std::move(text); needsRedraw = true; }
+                        n.loaded = true;
+                    } else {
+                        noteCache.prefetch(n.txtPath, n.mtime, n.size);
+                    }
+                }
+            }
+            for (const std::string& path : noteCache.takeReady()) {
+                if (path != sel.txtPath || sel.dirty() || noteWriter.isPending(path)) continue;
+                std::string text;
+                if (noteCache.get(path, sel.mtime, sel.size, text)) {
+                    if (!sel.loaded || text != sel.text) { sel.text = std::move(text); needsRedraw = true; }
+                    sel.loaded = true;
+                }
+            }
+            if (sel.txtPath.empty()) sel.loaded = true;
+        }
+
+        // Waveform of the selected note; none while it is still being recorded
+        {
+            std::string audio;
+            if (selected >= 0 && selected < (int)notes.size() && notes[selected].txtPath != livePath) {
+                audio = notes[selected].wavPath;
+            }
+            if (audio != waveStrip.audioPath) {
+                waveStrip.audioPath = audio;
+                waveStrip.wave.reset();
+                waveStrip.builtWidth = -1.f;
+                waveStrip.loading = audio.empty() ? nullptr : loadWaveform(audio);
+                needsRedraw = true;
+            }
+            if (waveStrip.loading) {
+                bool done = false;
+                {
+                    std::lock_guard<std::mutex> lock(waveStrip.loading->m);
+                    done = waveStrip.loading->done;
+                    if (done) waveStrip.wave = std::move(waveStrip.loading->result);
+                }
+                if (done) {
+                    waveStrip.loading.reset();
+                    waveStrip.builtWidth = -1.f;
+                    needsRedraw = true;
+                }
+            }
+        }
+
+        // Sleep until input, a wake from a background thread (hotkeys,
+        // transcription events, waveform loads), the next caret blink or the
+        // autosave deadline; only playback and search indexing need a tick
+        auto waitStart = std::chrono::steady_clock::now();
+        const bool busy = isPlaying || !searchBacklog.empty();
+        auto wakeAt = caretFlip;
+        if (busy) wakeAt = std::min(wakeAt, waitStart + std::chrono::milliseconds(33));
+        if (perfHud) wakeAt = std::min(wakeAt, hudRefresh);
+        if (requestSaveAt >= lastSaveAt) {
+            wakeAt = std::min({wakeAt, requestSaveAt + std::chrono::milliseconds(1001), lastSaveAt + std::chrono::milliseconds(5001)});
+        }
+        const auto waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(wakeAt - waitStart);
+
+        for (std::optional<sf::Event> ev = needsRedraw ? win.pollEvent() : UiWake::instance().wait(win, waitMs);
+             ev; ev = win.pollEvent())
         {
+            if (!ev->is<sf::Event::MouseMoved>()) needsRedraw = true;
+
             if (ev->is<sf::Event::Closed>()) win.close();
 
             if (ev->is<sf::Event::KeyPressed>()) {
                 auto k = ev->getIf<sf::Event::KeyPressed>();
+
+                // The search box takes Escape/Backspace/Enter while open
+                if (searchActive) {
+                    if (k->scancode == sf::Keyboard::Scancode::Escape) {
+                        searchActive = false;
+                        listScroll = 0.f;
+                        continue;
+                    }
+                    if (k->scancode == sf::Keyboard::Scancode::Backspace) {
+                        if (!searchQuery.empty()) searchQuery.pop_back();
+                        runSearch();
+                        listScroll = 0.f;
+                        continue;
+                    }
+                    if (k->scancode == sf::Keyboard::Scancode::Enter) {
+                        if (!searchHits.empty()) {
+                            selected = searchHits.front();
+                            editorScroll = 0.f;
+                        }
+                        searchActive = false;
+                        listScroll = 0.f;
+                        continue;
+                    }
+                }
+                // Ctrl+F: search all notes
+                if (k->control && k->scancode == sf::Keyboard::Scancode::F) {
+                    searchActive = true;
+                    searchQuery.clear();
+                    searchHits.clear();
+                    listScroll = 0.f;
+                }
+
                 if (k->scancode == sf::Keyboard::Scancode::Escape) {
                     win.close();
                 }
@@ -1047,16 +1560,26 @@ int main()
                     editorScroll = 0.f;
                     requestSaveAt = std::chrono::steady_clock::now() - std::chrono::seconds(10);
                 }
+                // F3: performance overlay; F4: save a trace (chrome://tracing)
+                if (k->scancode == sf::Keyboard::Scancode::F3) {
+                    perfHud = !perfHud;
+                    frameMaxMs = 0.f;
+                }
+                if (k->scancode == sf::Keyboard::Scancode::F4) {
+                    const std::string path = "trace_" + makeTimestampBase().substr(5) + ".json";
+                    if (PerfTrace::instance().dump(path, TRACE_SECONDS)) std::cout << "Trace written to " << path << "\n";
+                    else std::cerr << "Could not write " << path << "\n";
+                }
                 // Ctrl+S: save selected note to its .txt
                 if (k->control && k->scancode == sf::Keyboard::Scancode::S) {
                     if (selected >= 0 && selected < (int)notes.size()) {
-                        saveNoteText(notes[selected]);
+                        saveIfDirty(notes[selected]);
                     }
-                    requestSaveAt = std::chrono::steady_clock::now();
                 }
 
                 // Settings-defined: Start/Stop Recording
                 if (matchHotkey(*k, hkRecord)) {
+                    PerfTrace::instance().beginPath("key");
                     toggleRecording();
                 }
 
@@ -1068,16 +1591,20 @@ int main()
 
                 // Backspace handling (editor only)
                 if (k->scancode == sf::Keyboard::Scancode::Backspace) {
+                    ensureLoaded(notes[selected], noteCache);
                     if (!notes[selected].text.empty()) {
                         notes[selected].text.pop_back();
                         notes[selected].created = nowShort();
+                        notes[selected].edits++;
                         requestSaveAt = std::chrono::steady_clock::now();
                     }
                 }
                 // Enter -> newline
                 if (k->scancode == sf::Keyboard::Scancode::Enter) {
+                    ensureLoaded(notes[selected], noteCache);
                     notes[selected].text.push_back('\n');
                     notes[selected].created = nowShort();
+                    notes[selected].edits++;
                     requestSaveAt = std::chrono::steady_clock::now();
                 }
             }
@@ -1086,9 +1613,17 @@ int main()
             if (ev->is<sf::Event::TextEntered>()) {
                 auto t = ev->getIf<sf::Event::TextEntered>();
                 uint32_t uc = t->unicode;
-                if (uc >= 32 && uc != 127) { // skip control chars
+                if (searchActive) {
+                    if (uc >= 32 && uc != 127) {
+                        searchQuery += static_cast<char>(uc);
+                        runSearch();
+                        listScroll = 0.f;
+                    }
+                } else if (uc >= 32 && uc != 127) { // skip control chars
+                    ensureLoaded(notes[selected], noteCache);
                     notes[selected].text += static_cast<char>(uc);
                     notes[selected].created = nowShort();
+                    notes[selected].edits++;
                     requestSaveAt = std::chrono::steady_clock::now();
                 }
             }
@@ -1116,7 +1651,7 @@ int main()
                     if (headerRect.getGlobalBounds().contains(mp)) {
                         if (closeBounds.contains(mp)) { win.close(); }
                         else if (addBounds.contains(mp)) {
-                            notes.push_back({std::string("New note\n"), nowShort()});
+                            notes.push_back(createNewTextNote());
                             selected = static_cast<int>(notes.size()) - 1;
                             editorScroll = 0.f;
                             requestSaveAt = std::chrono::steady_clock::now() - std::chrono::seconds(10);                        
@@ -1127,10 +1662,27 @@ int main()
                             // Re-apply main window top-most according to current setting
                             setAlwaysOnTop(win, Settings::always_on_top);
                     
-                            if (changed) {
-                                // Refresh based on new folder / device, etc.
+                            // Apply only what changed: a toggle must not rescan
+                            // the notes folder or restart the hotkey thread
+                            const std::set<std::string> delta = changed ? settingsMgr.takeChanges() : std::set<std::string>{};
+                            auto touched = [&](std::initializer_list<const char*> keys) {
+                                for (const char* k : keys) if (delta.count(k)) return true;
+                                return false;
+                            };
+                            if (touched({"whisper_model_path", "model_preference", "quantize_models", "whisper_device", "flash_attention"})) {
+                                preloadWhisperModel();
+                            }
+                            if (touched({"audio_input_device", "preroll_seconds"})) {
+                                armAudioCapture();
+                            }
+                            if (touched({"voice_notes_path", "note_store"})) {
                                 auto prevSel = selected;
-                                auto v = scanVoiceNotes();
+                                saveAllDirty();
+                                noteWriter.flush();
+                                noteIndex.open(normalizedVoiceDir(), Settings::note_store == "packed");
+                                summaryTitles = NoteSummarizer::titles(normalizedVoiceDir());
+                                AudioImporter::instance().resume();
+                                auto v = notesFromIndex(noteIndex);
                                 if (!v.empty()) {
                                     notes = std::move(v);
                                     if (prevSel >= (int)notes.size()) prevSel = (int)notes.size() - 1;
@@ -1142,52 +1694,27 @@ int main()
                                     notes.push_back(std::move(n));
                                     selected = 0;
                                 }
-                                // Re-parse hotkeys if user changed them
+                                notesChanged();
+                            }
+                            if (touched({"keybinding_start_stop_recording", "keybinding_open_notes_window"})) {
                                 hkRecord   = parseHotkey(Settings::keybinding_start_stop_recording);
                                 hkOpenNotes= parseHotkey(Settings::keybinding_open_notes_window);
                                 #if defined(_WIN32)
                                 gh.start(hkRecord, hkOpenNotes);
                                 #endif
-
                             }
                         }
                         else if (playBounds.contains(mp)) {
                             // Toggle play/pause for selected note
                             if (selected < 0 || selected >= static_cast<int>(notes.size())) {
                                 // nothing
-                            } else if (!notes[selected].wavPath.empty() && std::filesystem::exists(notes[selected].wavPath)) {
-                                // If already playing, stop
-                                if (isPlaying && player) {
-                                    player->stop();
-                                    isPlaying = false;
-                                    spPlay.setTexture(texPlay);
-                                } else {
-                                    if (!playBuffer.loadFromFile(notes[selected].wavPath)) {
-                                        std::cerr << "Failed to load " << notes[selected].wavPath << "\n";
-                                    } else {
-                                        player.emplace(playBuffer);
-                                        player->play();
-                                        isPlaying = true;
-                                        spPlay.setTexture(texPause);
-                                    }
-                                }
+                            } else {
+                                playSelected();
                             }
                         }
                         else if (micBounds.contains(mp)) {
-                            if (!isRecording) {
-                                startRecordAudioFromMicrophone();
-                                isRecording = true;
-                                spMic.setTexture(texMicOn);
-                            } else {
-                                stopRecordAudioFromMicrophone();
-                                isRecording = false;
-                                spMic.setTexture(texMicOff);
-                    
-                                // Refresh newest notes after recording/transcription
-                                notes = scanVoiceNotes();
-                                if (!notes.empty()) selected = 0;
-                            }
-                    
+                            PerfTrace::instance().beginPath("click");
+                            toggleRecording();
                         } else {
                             dragging = true;
                             sf::Vector2i mouseScreen = sf::Mouse::getPosition();
@@ -1199,22 +1726,46 @@ int main()
                     if (listRect.getGlobalBounds().contains(mp)) {
                         float y = mp.y - listRect.getPosition().y + listScroll;
                         int idx = static_cast<int>(std::floor(y / itemH));
+                        if (searchActive && !searchQuery.empty()) {
+                            // rows are search hits; picking one closes the search
+                            idx = (idx >= 0 && idx < (int)searchHits.size()) ? searchHits[idx] : -1;
+                            if (idx >= 0) { searchActive = false; listScroll = 0.f; }
+                        }
                         if (idx >= 0 && idx < static_cast<int>(notes.size())) {
                             selected = idx;
-                            // refresh text from disk
-                            if (!notes[selected].txtPath.empty()) {
-                                notes[selected].text = slurp(notes[selected].txtPath);
-                            }
+                            // the body comes from the note cache (see the top of the loop)
+                            bodyBase.clear();
                             editorScroll = 0.f;
                             // stop playback if switching notes
                             if (isPlaying) {
                                 player->stop();
                                 isPlaying = false;
-                                spPlay.setTexture(texPlay);
+                                playIcon = ICON_PLAY;
                             }
                         }
 
                     }
+
+                    // Editor: the waveform strip seeks to where it was clicked,
+                    // a transcribed line to the start of its segment
+                    if (editorRect.getGlobalBounds().contains(mp) && selected >= 0 && selected < (int)notes.size() &&
+                        !notes[selected].wavPath.empty()) {
+                        const float stripTop = editorRect.getPosition().y + editorRect.getSize().y - waveH;
+                        if (mp.y >= stripTop) {
+                            if (waveStrip.wave && waveStrip.wave->sampleRate() > 0 && editorRect.getSize().x > 0.f) {
+                                const double at = (mp.x - editorRect.getPosition().x) / editorRect.getSize().x;
+                                const double lengthMs = 1000.0 * static_cast<double>(waveStrip.wave->frames()) / waveStrip.wave->sampleRate();
+                                playAt(static_cast<std::uint32_t>(std::clamp(at, 0.0, 1.0) * lengthMs));
+                            }
+                        } else if (notes[selected].txtPath != livePath) {
+                            TranscriptView tv;
+                            if (tv.open(transcriptPath(notes[selected].wavPath))) {
+                                const std::size_t line = editorText.lineAt(mp.y - editorRect.getPosition().y - 8.f + editorScroll);
+                                const int seg = segmentForLine(tv, line, editorText.lineText(line));
+                                if (seg >= 0) playAt(tv.segments()[seg].t0Ms);
+                            }
+                        }
+                    }
                 }
             }
             if (ev->is<sf::Event::MouseButtonReleased>()) {
@@ -1242,127 +1793,320 @@ int main()
 
                 setViewFromRect(editorView, makeRect(0.f, 0.f,
                                                      static_cast<float>(sz.x) - listW,
-                                                     static_cast<float>(sz.y) - headerH));
+                                                     static_cast<float>(sz.y) - headerH - waveH));
                 editorView.setViewport(makeRect(listW / static_cast<float>(sz.x), headerH / sz.y,
                                                 (static_cast<float>(sz.x) - listW) / sz.x,
-                                                (static_cast<float>(sz.y) - headerH) / sz.y));
+                                                (static_cast<float>(sz.y) - headerH - waveH) / sz.y));
             }
         }
 
-        // ---- Global hotkeys (Windows) ----
-        #if defined(_WIN32)
-        // Fire actions if a global hotkey thread flagged them:
-        if (gh.trigRecord.exchange(false)) {
-            toggleRecording();
+        // ---- Messages from other threads (global hotkeys) ----
+        for (UiWake::Message msg; UiWake::instance().take(msg); ) {
+            switch (msg) {
+                case UiWake::Message::ToggleRecording:
+                    PerfTrace::instance().pathStep("ui");
+                    toggleRecording();
+                    break;
+                case UiWake::Message::ShowWindow:
+                    #if defined(_WIN32)
+                    {
+                        // Bring window to front
+                        setAlwaysOnTop(win, true); // ensure top-most (your setting may keep it)
+                        HWND hwnd = (HWND)win.getNativeHandle();
+                        ShowWindow(hwnd, SW_SHOW);
+                        SetForegroundWindow(hwnd);
+                        // If you don't want permanent top-most, drop it back according to settings:
+                        if (!Settings::always_on_top) setAlwaysOnTop(win, false);
+                    }
+                    #endif
+                    break;
+            }
+            needsRedraw = true;
         }
-        #endif
-        #if defined(_WIN32)
-        if (gh.trigFocus.exchange(false)) {
-            // Bring window to front
-            setAlwaysOnTop(win, true); // ensure top-most (your setting may keep it)
-            HWND hwnd = (HWND)win.getNativeHandle();
-            ShowWindow(hwnd, SW_SHOW);
-            SetForegroundWindow(hwnd);
-            // If you don't want permanent top-most, drop it back according to settings:
-            if (!Settings::always_on_top) setAlwaysOnTop(win, false);
+
+        // ---- Background transcription events ----
+        {
+            TranscriptionEvent tev;
+            while (TranscriptionEngine::instance().pollEvent(tev)) {
+                Note* target = nullptr;
+                for (auto& n : notes) {
+                    if (n.txtPath == tev.textPath) { target = &n; break; }
+                }
+                switch (tev.type) {
+                    case TranscriptionEvent::Type::Started:
+                        transcribeProgress = 0;
+                        if (target) { target->text.clear(); target->loaded = true; }
+                        break;
+                    case TranscriptionEvent::Type::Progress:
+                        transcribeProgress = tev.progress;
+                        break;
+                    case TranscriptionEvent::Type::Segment:
+                        // Show text as it is decoded; the file is written when the job ends
+                        if (target) target->text += tev.text + "\n";
+                        if (tev.textPath == livePath) livePartial.clear();
+                        break;
+                    case TranscriptionEvent::Type::Partial:
+                        if (tev.textPath == livePath) livePartial = tev.text;
+                        break;
+                    case TranscriptionEvent::Type::Finished:
+                    case TranscriptionEvent::Type::Failed:
+                        if (tev.textPath == livePath) { livePath.clear(); livePartial.clear(); }
+                        if (target && !target->txtPath.empty()) { target->text = slurp(target->txtPath); target->loaded = true; }
+                        transcribeProgress = TranscriptionEngine::instance().pendingJobs() > 0 ? 0 : -1;
+                        break;
+                    case TranscriptionEvent::Type::Refined:
+                        // the file already holds the refined text; keep what the user typed meanwhile
+                        if (target && !target->dirty() && !noteWriter.isPending(target->txtPath)) {
+                            target->text = tev.text;
+                            target->loaded = true;
+                        }
+                        break;
+                    case TranscriptionEvent::Type::Summarized:
+                        if (target) summaryTitles[target->base] = tev.text;
+                        break;
+                }
+                updateTitle();
+                needsRedraw = true;
+            }
         }
-        #endif
 
         // Autosave throttle
         maybeAutosave();
 
+        skipSilence();
+        // keep the play position on the waveform moving
+        if (isPlaying && waveStrip.wave && playingPath == waveStrip.audioPath) needsRedraw = true;
+
+        // If finished playing, reset icon
+        if (isPlaying && player && player->getStatus() != sf::SoundSource::Status::Playing) {
+            isPlaying = false;
+            playIcon = ICON_PLAY;
+            needsRedraw = true;
+        }
+
+        // simple caret (blink)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= caretFlip) {
+                caretOn = !caretOn;
+                caretFlip = now + std::chrono::milliseconds(500);
+                needsRedraw = true;
+            }
+        }
+
+        if (TranscriptionEngine::instance().isLoading() != modelLoading) {
+            modelLoading = !modelLoading;
+            needsRedraw = true;
+        }
+
+        if (perfHud && std::chrono::steady_clock::now() >= hudRefresh) {
+            hudRefresh = std::chrono::steady_clock::now() + std::chrono::milliseconds(250);
+            needsRedraw = true;
+        }
+
+        if (!needsRedraw) continue;
+        needsRedraw = false;
+
         // ---------- Draw ----------
+        const std::int64_t frameStart = PerfTrace::nowUs();
+        unsigned drawCalls = 0;
+        auto drawItem = [&](const sf::Drawable& d, const sf::RenderStates& states = sf::RenderStates::Default) {
+            win.draw(d, states);
+            ++drawCalls;
+        };
         win.clear(bg);
 
         // Header
-        win.draw(headerRect);
-
-        // sprites don’t depend on font — always draw them
-        win.draw(spPlay);
-        win.draw(spGear);
-        win.draw(spMic);
-        win.draw(spAdd);
+        drawItem(headerRect);
+
+        // icons don’t depend on font — always draw them
+        headerIcons.clear();
+        headerIcons.image(playBounds, icons.rect(playIcon));
+        headerIcons.image(gearBounds, icons.rect(ICON_GEAR));
+        headerIcons.image(micBounds, icons.rect(micIcon));
+        headerIcons.image(addBounds, icons.rect(ICON_ADD));
+        drawCalls += headerIcons.draw(win, &icons.texture());
+        if (modelLoading) {
+            // the model is still loading: recording works, text follows later
+            sf::CircleShape dot(3.5f);
+            dot.setFillColor(sf::Color(230, 160, 40));
+            dot.setPosition(sf::Vector2f(micBounds.position.x + micBounds.size.x - 6.f, micBounds.position.y + 2.f));
+            drawItem(dot);
+        }
 
         // text only if font is available
         if (font.getInfo().family.size()) {
-            win.draw(titleText);
-            win.draw(closeX);
+            if (searchActive) {
+                sf::RectangleShape box(sf::Vector2f(X_PLAY - 16.f, headerH - 12.f));
+                box.setPosition(sf::Vector2f(8.f, 6.f));
+                box.setFillColor(panel);
+                box.setOutlineColor(accent);
+                box.setOutlineThickness(1.f);
+                drawItem(box);
+
+                searchText.setString(searchQuery.empty() ? std::string("Search notes") : searchQuery);
+                searchText.setFillColor(searchQuery.empty() ? muted : textCol);
+                searchText.setPosition(sf::Vector2f(14.f, 9.f));
+                drawItem(searchText);
+                if (caretOn) {
+                    float x = searchQuery.empty() ? 14.f : searchText.findCharacterPos(searchQuery.size()).x;
+                    sf::RectangleShape caret(sf::Vector2f(1.5f, 18.f));
+                    caret.setFillColor(accent);
+                    caret.setPosition(sf::Vector2f(x, 9.f));
+                    drawItem(caret);
+                }
+            } else {
+                drawItem(titleText);
+            }
+            drawItem(closeX);
         }
 
         // List panel
-        win.draw(listRect);
+        drawItem(listRect);
         win.setView(listView);
         {
-            float y0 = -listScroll;
-            for (size_t i = 0; i < notes.size(); ++i) {
-                sf::FloatRect row = makeRect(0.f, y0 + static_cast<float>(i) * itemH, listW, itemH - 1.f);
-
-                sf::RectangleShape rowBg(sf::Vector2f(row.size.x, row.size.y));
-                rowBg.setPosition(sf::Vector2f(row.position.x, row.position.y));
-                rowBg.setFillColor(static_cast<int>(i) == selected ? sel : panel);
-                win.draw(rowBg);
+            // Only rows inside the view are touched
+            const float viewH = listView.getSize().y;
+            const size_t first = static_cast<size_t>(std::max(0.f, std::floor(listScroll / itemH)));
+            const bool showHits = searchActive && !searchQuery.empty();
+            const size_t rowCount = showHits ? searchHits.size() : notes.size();
+            const size_t last  = std::min(rowCount, static_cast<size_t>(std::ceil((listScroll + viewH) / itemH)) + 1);
+
+            // three draw calls whatever the number of rows: backgrounds,
+            // titles, timestamps
+            listRects.clear();
+            listTitles.clear();
+            listTimes.clear();
+            for (size_t i = first; i < last; ++i) {
+                const float rowY = static_cast<float>(i) * itemH - listScroll;
+                const size_t ni = showHits ? static_cast<size_t>(searchHits[i]) : i;
+
+                listRects.rect(sf::FloatRect({0.f, rowY}, {listW, itemH - 1.f}), static_cast<int>(ni) == selected ? sel : panel);
 
                 if (font.getInfo().family.size()) {
-                    std::string ttl = firstLine(notes[i].text);
+                    std::string ttl = noteTitle(notes[ni], summaryTitles);
                     if (ttl.empty()) ttl = "(empty)";
                     if (ttl.size() > 20) ttl = ttl.substr(0, 20) + "...";
 
-                    listLine.setString(ttl);
-                    listLine.setPosition(sf::Vector2f(8.f, row.position.y + 8.f));
-                    listLine.setFillColor(textCol);
-                    win.draw(listLine);
+                    ListRow& r = listRows[notes[ni].base];
+                    if (r.title != ttl) {
+                        r.title = ttl;
+                        r.titleQuads.clear();
+                        appendText(r.titleQuads, font, 14, sf::String(ttl), textCol);
+                    }
+                    if (r.created != notes[ni].created) {
+                        r.created = notes[ni].created;
+                        r.timeQuads.clear();
+                        r.timeWidth = appendText(r.timeQuads, font, 12, sf::String(r.created), muted);
+                    }
 
+                    listTitles.append(r.titleQuads, sf::Vector2f(8.f, rowY + 8.f));
                     // timestamp (muted, right-aligned)
-                    sf::Text ts(font, notes[i].created, 12);
-                    ts.setFillColor(muted);
-                    auto bounds = ts.getLocalBounds(); // position/size
-                    ts.setPosition(sf::Vector2f(row.position.x + row.size.x - bounds.size.x - 8.f,
-                                                row.position.y + 6.f));
-                    win.draw(ts);
+                    listTimes.append(r.timeQuads, sf::Vector2f(listW - r.timeWidth - 8.f, rowY + 6.f));
                 }
             }
+            drawCalls += listRects.draw(win);
+            if (font.getInfo().family.size()) {
+                drawCalls += listTitles.draw(win, &font.getTexture(14));
+                drawCalls += listTimes.draw(win, &font.getTexture(12));
+            }
         }
         win.setView(win.getDefaultView());
 
         // Editor panel
-        win.draw(editorRect);
+        drawItem(editorRect);
         win.setView(editorView);
         {
-            if (font.getInfo().family.size()) {
-                if (notes.empty() || selected < 0 || selected >= (int)notes.size()) {
-                    continue;
+            if (font.getInfo().family.size() && selected >= 0 && selected < (int)notes.size()) {
+                if (!livePartial.empty() && notes[selected].txtPath == livePath) {
+                    editorText.update(notes[selected].text + livePartial);
+                } else {
+                    editorText.update(notes[selected].text);
                 }
-                editorText.setString(notes[selected].text);
-                editorText.setPosition(sf::Vector2f(8.f, 8.f - editorScroll));
-                win.draw(editorText);
-
-                // simple caret (blink)
-                static bool on = true;
-                static auto last = std::chrono::steady_clock::now();
-                auto now = std::chrono::steady_clock::now();
-                if (now - last > std::chrono::milliseconds(500)) { on = !on; last = now; }
-                if (on) {
-                    auto b = editorText.getGlobalBounds(); // position/size
-                    sf::RectangleShape caret(sf::Vector2f(1.5f, editorText.getCharacterSize() * 1.25f));
+                drawCalls += editorText.draw(win, sf::Vector2f(8.f, 8.f), editorScroll, editorView.getSize().y);
+
+                if (caretOn) {
+                    // typing always happens at the end of the note
+                    sf::Vector2f end = editorText.endPosition();
+                    sf::RectangleShape caret(sf::Vector2f(1.5f, 16.f * 1.25f));
                     caret.setFillColor(accent);
-                    caret.setPosition(sf::Vector2f(8.f + b.size.x, 8.f - editorScroll + 2.f));
-                    win.draw(caret);
+                    caret.setPosition(sf::Vector2f(8.f + end.x, 8.f - editorScroll + end.y + 2.f));
+                    drawItem(caret);
                 }
             }
         }
         win.setView(win.getDefaultView());
 
-        // If finished playing, reset icon
-        if (isPlaying && player && player->getStatus() != sf::Sound::Status::Playing) {
-            isPlaying = false;
-            spPlay.setTexture(texPlay);
-        }        
+        // Waveform strip with the play position
+        {
+            const sf::Vector2f stripPos(editorRect.getPosition().x, editorRect.getPosition().y + editorRect.getSize().y - waveH);
+            const float stripW = editorRect.getSize().x;
+            sf::RectangleShape stripBg(sf::Vector2f(stripW, waveH));
+            stripBg.setPosition(stripPos);
+            stripBg.setFillColor(panel);
+            drawItem(stripBg);
+
+            if (waveStrip.wave) {
+                if (waveStrip.builtWidth != stripW) buildWaveLines(waveStrip, stripW, waveH, muted);
+                sf::RenderStates states;
+                states.transform.translate(stripPos);
+                drawItem(waveStrip.lines, states);
+
+                if (player && playingPath == waveStrip.audioPath && player->getStatus() != sf::SoundSource::Status::Stopped) {
+                    const float length = player->getDuration().asSeconds();
+                    const float at = length > 0.f ? player->getPlayingOffset().asSeconds() / length : 0.f;
+                    sf::RectangleShape head(sf::Vector2f(2.f, waveH));
+                    head.setPosition(sf::Vector2f(stripPos.x + std::clamp(at, 0.f, 1.f) * stripW - 1.f, stripPos.y));
+                    head.setFillColor(accent);
+                    drawItem(head);
+                }
+            }
+        }
+
+        if (perfHud && font.getInfo().family.size()) {
+            const PerfTrace::Stages st = PerfTrace::instance().stages();
+            const double rtf = PerfTrace::instance().realtimeFactor();
+            const std::string lastPath = PerfTrace::instance().lastPath();
+            std::ostringstream os;
+            os << std::fixed << std::setprecision(1)
+               << "frame " << frameMs << " ms (max " << frameMaxMs << ")\n"
+               << "draws " << frameDraws << "\n"
+               << "queue " << TranscriptionEngine::instance().pendingJobs() << "\n"
+               << "rtf " << rtf << "x\n"
+               << "mel " << st.mel / 1000.0 << "  enc " << st.encode / 1000.0 << "  dec " << st.decode / 1000.0
+               << "  batch " << st.batchd / 1000.0 << " ms\n"
+               << "rss " << PerfTrace::residentBytes() / (1024.0 * 1024.0) << " MB\n"
+               << (lastPath.empty() ? lastPath : lastPath + "\n")
+               << "F4: save trace";
+            hudText.setString(os.str());
+            hudText.setFillColor(textCol);
+            const sf::FloatRect tb = hudText.getLocalBounds();
+            const sf::Vector2f at(editorRect.getPosition().x + editorRect.getSize().x - tb.size.x - 20.f,
+                                  editorRect.getPosition().y + 8.f);
+            sf::RectangleShape box(tb.size + sf::Vector2f(12.f, 12.f));
+            box.setPosition(at);
+            box.setFillColor(sf::Color(0, 0, 0, 170));
+            drawItem(box);
+            hudText.setPosition(at + sf::Vector2f(6.f, 6.f - tb.position.y));
+            drawItem(hudText);
+        }
 
         win.display();
+
+        const std::int64_t frameEnd = PerfTrace::nowUs();
+        PerfTrace::instance().span("ui", "frame", frameStart, frameEnd);
+        frameMs = (float) (frameEnd - frameStart) / 1000.f;
+        frameMaxMs = std::max(frameMaxMs, frameMs);
+        frameDraws = drawCalls;
     }
     #if defined(_WIN32)
     gh.stop();
     #endif
+    saveAllDirty();
+    noteWriter.flush();
+    if (searchIndex.unsaved()) searchIndex.save(SEARCH_INDEX_PATH);
+    AudioImporter::instance().shutdown();   // what is left resumes next start
+    shutdownAudio();
 
     return 0;
 }
@@ -0,0 +1,106 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <filesystem>
+
+#if defined(_WIN32)
+  #define WIN32_LEAN_AND_MEAN
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+bool MappedFile::open(const std::string& path, bool w, std::size_t minSize) {
+    close();
+    writable = w;
+#if defined(_WIN32)
+    HANDLE h = CreateFileW(std::filesystem::path(path).wstring().c_str(),
+                           writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                           nullptr, writable ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    file = h;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(h, &size)) {
+        close();
+        return false;
+    }
+    len = (std::size_t) size.QuadPart;
+#else
+    fd = ::open(path.c_str(), (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close();
+        return false;
+    }
+    len = (std::size_t) st.st_size;
+#endif
+    const bool ok = writable ? resize(std::max(len, minSize)) : len > 0 && map();
+    if (!ok) close();
+    return ok;
+}
+
+bool MappedFile::resize(std::size_t newSize) {
+    if (!writable) return false;
+    unmap();
+#if defined(_WIN32)
+    if (newSize != len) {
+        LARGE_INTEGER size;
+        size.QuadPart = (LONGLONG) newSize;
+        if (!SetFilePointerEx(file, size, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) return false;
+    }
+#else
+    if (newSize != len && ftruncate(fd, (off_t) newSize) != 0) return false;
+#endif
+    len = newSize;
+    return map();
+}
+
+bool MappedFile::map() {
+#if defined(_WIN32)
+    mapping = CreateFileMappingW(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) return false;
+    ptr = static_cast<char*>(MapViewOfFile(mapping, writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, len));
+    return ptr != nullptr;
+#else
+    void* p = mmap(nullptr, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) return false;
+    ptr = static_cast<char*>(p);
+    return true;
+#endif
+}
+
+void MappedFile::flush() {
+    if (!ptr || !writable) return;
+#if defined(_WIN32)
+    FlushViewOfFile(ptr, 0);
+#else
+    msync(ptr, len, MS_ASYNC);
+#endif
+}
+
+void MappedFile::unmap() {
+#if defined(_WIN32)
+    if (ptr) UnmapViewOfFile(ptr);
+    if (mapping) CloseHandle(mapping);
+    mapping = nullptr;
+#else
+    if (ptr) munmap(ptr, len);
+#endif
+    ptr = nullptr;
+}
+
+void MappedFile::close() {
+    unmap();
+#if defined(_WIN32)
+    if (file) CloseHandle(file);
+    file = nullptr;
+#else
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+#endif
+    len = 0;
+}
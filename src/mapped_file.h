@@ -0,0 +1,46 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+// A whole file mapped into memory (mmap / MapViewOfFile), read-only or
+// shared read-write. Resizing remaps it, so pointers into data() are only
+// good until the next resize() or close().
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Writable: the file is created if missing and grown to at least minSize.
+    // Read-only: fails for a missing or empty file
+    bool open(const std::string& path, bool writable, std::size_t minSize = 0);
+    // Writable mappings only
+    bool resize(std::size_t newSize);
+    // Start writing dirty pages back; does not wait for them
+    void flush();
+    void close();
+
+    char* data() { return ptr; }
+    const char* data() const { return ptr; }
+    std::size_t size() const { return len; }
+    bool isOpen() const { return ptr != nullptr; }
+
+private:
+    bool map();
+    void unmap();
+
+    char* ptr = nullptr;
+    std::size_t len = 0;
+    bool writable = false;
+#if defined(_WIN32)
+    void* file = nullptr;       // HANDLE
+    void* mapping = nullptr;    // HANDLE
+#else
+    int fd = -1;
+#endif
+};
+
+#endif // MAPPED_FILE_H
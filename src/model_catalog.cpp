@@ -0,0 +1,178 @@
+#include "model_catalog.h"
+#include "common-ggml.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+// "base.en-q5_0" -> {"base.en", "q5_0"}
+static void splitModelStem(const std::string& stem, std::string& name, std::string& quant) {
+    name = stem;
+    quant.clear();
+    const std::size_t dash = stem.rfind('-');
+    if (dash == std::string::npos) return;
+    const std::string tail = stem.substr(dash + 1);
+    if (tail.size() >= 4 && tail[0] == 'q' && std::isdigit((unsigned char) tail[1]) && tail[2] == '_') {
+        name = stem.substr(0, dash);
+        quant = tail;
+    }
+}
+
+static bool parseModelFile(const fs::path& p, ModelFile& out) {
+    const std::string file = p.filename().string();
+    if (file.size() <= 9 || file.compare(0, 5, "ggml-") != 0 || p.extension() != ".bin") return false;
+    const std::string stem = file.substr(5, file.size() - 9);
+    if (stem.compare(0, 6, "silero") == 0) return false;
+
+    out.path = p.string();
+    splitModelStem(stem, out.name, out.quant);
+    std::error_code ec;
+    out.size = fs::file_size(p, ec);
+    return !ec;
+}
+
+std::vector<ModelFile> discoverModels(const std::string& dir) {
+    std::vector<ModelFile> out;
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        ModelFile m;
+        if (it->is_regular_file(ec) && parseModelFile(it->path(), m)) out.push_back(std::move(m));
+    }
+    std::sort(out.begin(), out.end(), [](const ModelFile& a, const ModelFile& b){
+        return a.name != b.name ? a.name < b.name : a.quant < b.quant;
+    });
+    return out;
+}
+
+std::string preferredQuant(const std::string& preference) {
+    if (preference == "speed") return "q5_0";
+    if (preference == "accuracy") return "";
+    return "q8_0";
+}
+
+std::string quantizedPath(const std::string& model, const std::string& quant) {
+    fs::path p(model);
+    std::string name, q;
+    splitModelStem(p.stem().string(), name, q);
+    std::string file = name + (quant.empty() ? "" : "-" + quant) + ".bin";
+    return (p.parent_path() / file).string();
+}
+
+std::string resolveModelPath(const std::string& configured, const std::string& preference) {
+    ModelFile self;
+    if (!parseModelFile(fs::path(configured), self)) return configured;
+
+    // acceptable quant types, best first
+    std::vector<std::string> order;
+    if (preference == "speed")         order = {"q5_0", "q5_1", "q4_0", "q4_1", "q8_0"};
+    else if (preference == "accuracy") order = {""};
+    else                               order = {"q8_0", "q5_1", "q5_0"};
+
+    const std::vector<ModelFile> all = discoverModels(fs::path(configured).parent_path().string());
+    for (const std::string& q : order) {
+        for (const ModelFile& m : all) {
+            if (m.name == self.name && m.quant == q) return m.path;
+        }
+    }
+    return configured;
+}
+
+// The body of quantizeModel(), written to `out`
+static bool writeQuantized(const std::string& src, const std::string& out, ggml_ftype ftype) {
+    std::ifstream finp(src, std::ios::binary);
+    std::ofstream fout(out, std::ios::binary | std::ios::trunc);
+    if (!finp || !fout) return false;
+
+    auto copy = [&](std::size_t n) {
+        std::vector<char> buf(n);
+        finp.read(buf.data(), (std::streamsize) n);
+        fout.write(buf.data(), (std::streamsize) n);
+        return (bool) finp;
+    };
+    auto readI32 = [&](std::int32_t& v) {
+        finp.read((char*) &v, sizeof(v));
+        return (bool) finp;
+    };
+
+    std::uint32_t magic = 0;
+    finp.read((char*) &magic, sizeof(magic));
+    if (!finp || magic != GGML_FILE_MAGIC) {
+        std::cerr << "Not a ggml model: " << src << "\n";
+        return false;
+    }
+    fout.write((const char*) &magic, sizeof(magic));
+
+    // 10 hparams, then ftype rewritten for the quantized file
+    if (!copy(10 * sizeof(std::int32_t))) return false;
+    std::int32_t ftypeSrc = 0;
+    if (!readI32(ftypeSrc)) return false;
+    if (ftypeSrc % GGML_QNT_VERSION_FACTOR > 1) {
+        std::cerr << "Already quantized: " << src << "\n";   // only f32/f16 sources
+        return false;
+    }
+    const std::int32_t ftypeDst = GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + ftype;
+    fout.write((const char*) &ftypeDst, sizeof(ftypeDst));
+
+    // mel filters
+    std::int32_t nMel = 0, nFft = 0;
+    if (!readI32(nMel) || !readI32(nFft) || nMel < 0 || nFft < 0) return false;
+    fout.write((const char*) &nMel, sizeof(nMel));
+    fout.write((const char*) &nFft, sizeof(nFft));
+    if (!copy((std::size_t) nMel * (std::size_t) nFft * sizeof(float))) return false;
+
+    // vocabulary
+    std::int32_t nVocab = 0;
+    if (!readI32(nVocab) || nVocab < 0) return false;
+    fout.write((const char*) &nVocab, sizeof(nVocab));
+    for (std::int32_t i = 0; i < nVocab; ++i) {
+        std::uint32_t len = 0;
+        finp.read((char*) &len, sizeof(len));
+        if (!finp || len > 1024) return false;
+        fout.write((const char*) &len, sizeof(len));
+        if (!copy(len)) return false;
+    }
+
+    // same tensors left alone as examples/quantize
+    const std::vector<std::string> toSkip = {
+        "encoder.conv1.bias",
+        "encoder.conv2.bias",
+        "encoder.positional_embedding",
+        "decoder.positional_embedding",
+    };
+    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, toSkip)) {
+        std::cerr << "Failed to quantize " << src << "\n";
+        return false;
+    }
+    return (bool) fout;
+}
+
+bool quantizeModel(const std::string& src, const std::string& dst, const std::string& quant) {
+    const ggml_ftype ftype = ggml_parse_ftype(quant.c_str());
+    if (ftype == GGML_FTYPE_UNKNOWN) return false;
+
+    // initializes the f16 tables the quantizer reads
+    {
+        struct ggml_init_params params = { 0, NULL, false };
+        ggml_free(ggml_init(params));
+    }
+
+    const std::string tmp = dst + ".tmp";
+    std::error_code ec;
+    if (!writeQuantized(src, tmp, ftype)) {
+        fs::remove(tmp, ec);
+        return false;
+    }
+
+    fs::rename(tmp, dst, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+        return false;
+    }
+    std::cout << "Quantized " << src << " -> " << dst << "\n";
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef MODEL_CATALOG_H
+#define MODEL_CATALOG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A ggml whisper model on disk: ggml-<name>[-<quant>].bin
+struct ModelFile {
+    std::string path;
+    std::string name;        // "base.en", "large-v3-turbo", ...
+    std::string quant;       // "" for f16/f32 weights, else "q5_0", "q8_0", ...
+    std::uint64_t size = 0;
+};
+
+// Whisper models in dir (VAD models are skipped), by name, then quant
+std::vector<ModelFile> discoverModels(const std::string& dir);
+
+// What to load for the configured model: with preference "speed" a q5
+// variant, with "balanced" a q8_0 variant, with "accuracy" the full weights;
+// each falls back to the configured file if no such sibling exists
+std::string resolveModelPath(const std::string& configured, const std::string& preference);
+
+// Quant type whose file resolveModelPath() prefers ("" for accuracy)
+std::string preferredQuant(const std::string& preference);
+
+// The path a quantized variant of model would have
+std::string quantizedPath(const std::string& model, const std::string& quant);
+
+// Same as examples/quantize: copy the header and vocabulary, quantize the
+// weights. Blocking (seconds for base, minutes for large); writes through a
+// temporary file so a half-written model is never picked up.
+bool quantizeModel(const std::string& src, const std::string& dst, const std::string& quant);
+
+#endif // MODEL_CATALOG_H
@@ -0,0 +1,112 @@
+#include "note_cache.h"
+#include "note_store.h"
+#include "ui_wake.h"
+
+#include <algorithm>
+
+// Oldest prefetches are dropped beyond this; the user has moved on
+static const std::size_t MAX_REQUESTS = 8;
+
+NoteCache::NoteCache(std::size_t capacityBytes) : capacity(capacityBytes) {}
+
+NoteCache::~NoteCache() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) worker.join();
+}
+
+bool NoteCache::get(const std::string& path, std::int64_t mtime, std::uint64_t size, std::string& text) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = entries.find(path);
+    if (it == entries.end() || it->second.mtime != mtime || it->second.size != size) return false;
+    lru.splice(lru.begin(), lru, it->second.lru);
+    text = it->second.text;
+    return true;
+}
+
+void NoteCache::prefetch(const std::string& path, std::int64_t mtime, std::uint64_t size) {
+    if (path.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(path);
+        if (it != entries.end() && it->second.mtime == mtime && it->second.size == size) return;
+        requests.erase(std::remove_if(requests.begin(), requests.end(),
+                                      [&](const Request& r){ return r.path == path; }),
+                       requests.end());
+        requests.push_front({path, mtime, size});
+        if (requests.size() > MAX_REQUESTS) requests.pop_back();
+        if (!worker.joinable()) worker = std::thread([this]{ run(); });
+    }
+    cv.notify_all();
+}
+
+std::string NoteCache::load(const std::string& path, std::int64_t mtime, std::uint64_t size) {
+    std::string text;
+    if (get(path, mtime, size, text)) return text;
+    text = readNoteText(path);
+    std::lock_guard<std::mutex> lock(mtx);
+    putLocked(path, mtime, size, text);
+    return text;
+}
+
+void NoteCache::clear() {
+    std::lock_guard<std::mutex> lock(mtx);
+    entries.clear();
+    lru.clear();
+    requests.clear();
+    bytes = 0;
+}
+
+std::vector<std::string> NoteCache::takeReady() {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<std::string> out;
+    out.swap(ready);
+    return out;
+}
+
+void NoteCache::putLocked(const std::string& path, std::int64_t mtime, std::uint64_t size, std::string text) {
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        bytes -= it->second.text.size();
+        lru.erase(it->second.lru);
+        entries.erase(it);
+    }
+    if (text.size() > capacity) return;
+
+    lru.push_front(path);
+    Entry& e = entries[path];
+    e.mtime = mtime;
+    e.size = size;
+    e.text = std::move(text);
+    e.lru = lru.begin();
+    bytes += e.text.size();
+
+    while (bytes > capacity && !lru.empty()) {
+        auto victim = entries.find(lru.back());
+        bytes -= victim->second.text.size();
+        entries.erase(victim);
+        lru.pop_back();
+    }
+}
+
+void NoteCache::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    for (;;) {
+        cv.wait(lock, [this]{ return stopping || !requests.empty(); });
+        if (stopping) break;
+
+        Request r = std::move(requests.front());
+        requests.pop_front();
+
+        lock.unlock();
+        std::string text = readNoteText(r.path);
+        lock.lock();
+
+        putLocked(r.path, r.mtime, r.size, std::move(text));
+        ready.push_back(r.path);
+        UiWake::instance().wake();
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef NOTE_CACHE_H
+#define NOTE_CACHE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Bounded LRU cache of note bodies, keyed by .txt path. A body is only
+// handed out for the (mtime, size) it was read at, as the note index
+// reports them, so a note changed on disk is read again. Reads run on a
+// background thread: the UI prefetches the selected note and its neighbours
+// and picks the bodies up with takeReady(), so clicking through a folder on
+// a slow (network) drive doesn't block the loop.
+class NoteCache {
+public:
+    explicit NoteCache(std::size_t capacityBytes = 16u << 20);
+    ~NoteCache();
+    NoteCache(const NoteCache&) = delete;
+    NoteCache& operator=(const NoteCache&) = delete;
+
+    // Cached body of path at (mtime, size); marks it recently used
+    bool get(const std::string& path, std::int64_t mtime, std::uint64_t size, std::string& text);
+    // Read path in the background unless it is cached (or queued) at (mtime, size)
+    void prefetch(const std::string& path, std::int64_t mtime, std::uint64_t size);
+    // Read now on the calling thread (and cache the result)
+    std::string load(const std::string& path, std::int64_t mtime, std::uint64_t size);
+    void clear();
+    // Paths whose background read finished since the last call
+    std::vector<std::string> takeReady();
+
+private:
+    struct Entry {
+        std::int64_t mtime = 0;
+        std::uint64_t size = 0;
+        std::string text;
+        std::list<std::string>::iterator lru;
+    };
+    struct Request {
+        std::string path;
+        std::int64_t mtime = 0;
+        std::uint64_t size = 0;
+    };
+
+    void run();
+    void putLocked(const std::string& path, std::int64_t mtime, std::uint64_t size, std::string text);
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::size_t capacity;
+    std::size_t bytes = 0;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;          // most recently used first
+    std::deque<Request> requests;        // newest first
+    std::vector<std::string> ready;
+    bool stopping = false;
+    std::thread worker;
+};
+
+#endif // NOTE_CACHE_H
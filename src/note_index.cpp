@@ -0,0 +1,402 @@
+#include "note_index.h"
+#include "note_store.h"
+
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+#if defined(_WIN32)
+  #define WIN32_LEAN_AND_MEAN
+  #include <windows.h>
+#elif defined(__linux__)
+  #include <sys/inotify.h>
+  #include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static const char* INDEX_FILE = ".notes_index";
+static const char* INDEX_MAGIC = "notes-index 1";
+
+// ---------- DirWatcher ----------
+
+struct DirWatcher::Impl {
+#if defined(_WIN32)
+    HANDLE dir = INVALID_HANDLE_VALUE;
+    OVERLAPPED ov{};
+    alignas(DWORD) char buf[64 * 1024];
+
+    bool issue() {
+        return ReadDirectoryChangesW(dir, buf, sizeof(buf), FALSE,
+                                     FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE,
+                                     nullptr, &ov, nullptr) != 0;
+    }
+#elif defined(__linux__)
+    int fd = -1;
+#else
+    std::string path;
+    fs::file_time_type last{};
+#endif
+};
+
+DirWatcher::DirWatcher() = default;
+DirWatcher::~DirWatcher() { stop(); }
+
+void DirWatcher::start(const std::string& dir) {
+    stop();
+    auto w = std::make_unique<Impl>();
+#if defined(_WIN32)
+    w->dir = CreateFileW(fs::path(dir).wstring().c_str(), FILE_LIST_DIRECTORY,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                         FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+    if (w->dir == INVALID_HANDLE_VALUE) return;
+    w->ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!w->ov.hEvent || !w->issue()) {
+        if (w->ov.hEvent) CloseHandle(w->ov.hEvent);
+        CloseHandle(w->dir);
+        return;
+    }
+#elif defined(__linux__)
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0) return;
+    if (inotify_add_watch(w->fd, dir.c_str(),
+                          IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF) < 0) {
+        close(w->fd);
+        return;
+    }
+#else
+    std::error_code ec;
+    w->path = dir;
+    w->last = fs::last_write_time(dir, ec);
+#endif
+    impl = std::move(w);
+}
+
+void DirWatcher::stop() {
+    if (!impl) return;
+#if defined(_WIN32)
+    CancelIo(impl->dir);
+    CloseHandle(impl->ov.hEvent);
+    CloseHandle(impl->dir);
+#elif defined(__linux__)
+    close(impl->fd);
+#endif
+    impl.reset();
+}
+
+bool DirWatcher::poll(std::vector<std::string>& names) {
+    if (!impl) return false;
+#if defined(_WIN32)
+    DWORD bytes = 0;
+    if (!GetOverlappedResult(impl->dir, &impl->ov, &bytes, FALSE)) {
+        return GetLastError() == ERROR_IO_INCOMPLETE; // nothing yet
+    }
+    bool ok = bytes != 0; // 0 bytes: the buffer overflowed
+    for (DWORD off = 0; ok;) {
+        auto* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(impl->buf + off);
+        std::wstring name(info->FileName, info->FileNameLength / sizeof(WCHAR));
+        names.push_back(fs::path(name).string());
+        if (info->NextEntryOffset == 0) break;
+        off += info->NextEntryOffset;
+    }
+    ResetEvent(impl->ov.hEvent);
+    if (!impl->issue()) {
+        stop();
+        return false;
+    }
+    return ok;
+#elif defined(__linux__)
+    alignas(struct inotify_event) char buf[16 * 1024];
+    bool ok = true;
+    for (;;) {
+        const ssize_t n = read(impl->fd, buf, sizeof(buf));
+        if (n <= 0) break; // EAGAIN: drained
+        for (ssize_t off = 0; off < n;) {
+            auto* ev = reinterpret_cast<const struct inotify_event*>(buf + off);
+            if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF)) ok = false;
+            else if (ev->len > 0) names.emplace_back(ev->name);
+            off += (ssize_t) sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (!ok) stop();
+    return ok;
+#else
+    std::error_code ec;
+    auto now = fs::last_write_time(impl->path, ec);
+    if (ec || now == impl->last) return true;
+    impl->last = now;
+    return false;
+#endif
+}
+
+// ---------- NoteIndex ----------
+
+static std::string formatCreated(fs::file_time_type ftime) {
+    auto sctp = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+        ftime - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
+    std::time_t tt = std::chrono::system_clock::to_time_t(sctp);
+    std::tm tm{};
+#if defined(_WIN32)
+    localtime_s(&tm, &tt);
+#else
+    localtime_r(&tt, &tm);
+#endif
+    char buf[6];
+    std::strftime(buf, sizeof(buf), "%H:%M", &tm);
+    return buf;
+}
+
+// Only the first line is read; the body is loaded when the note is opened
+static std::string readTitle(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    std::string line;
+    std::getline(f, line);
+    for (char& c : line) if (c == '\t' || c == '\r') c = ' ';
+    while (!line.empty() && line.back() == ' ') line.pop_back();
+    return line;
+}
+
+static const char* const TEXT_EXTS[]  = {".txt", ".TXT"};
+static const char* const AUDIO_EXTS[] = {".wav", ".WAV", ".flac", ".FLAC", ".ogg", ".OGG", ".mp3", ".MP3"};
+
+static bool isNoteFile(const std::string& ext) {
+    for (const char* e : TEXT_EXTS)  if (ext == e) return true;
+    for (const char* e : AUDIO_EXTS) if (ext == e) return true;
+    return false;
+}
+
+template <std::size_t N>
+static std::string findWithExt(const std::string& dir, const std::string& base, const char* const (&exts)[N]) {
+    std::error_code ec;
+    for (const char* ext : exts) {
+        std::string p = dir + base + ext;
+        if (fs::is_regular_file(p, ec)) return p;
+    }
+    return {};
+}
+
+NoteIndex::~NoteIndex() {
+    save();
+    if (store) NoteStore::activate(nullptr);
+}
+
+void NoteIndex::open(const std::string& d, bool packed) {
+    save();
+    watcher.stop();
+    notes.clear();
+    if (store) NoteStore::activate(nullptr);
+    store.reset();
+    dir = d;
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    if (packed && openPacked()) return;
+    if (!packed && NoteStore::exists(dir)) {
+        // back to one file per note; the store goes once every note is out
+        NoteStore old;
+        if (old.open(dir) && old.exportFiles()) old.removeFiles();
+        else std::cerr << "Failed to export the packed notes of " << dir << "\n";
+    }
+
+    // Cached entries only save work: every one is re-checked against the disk
+    std::ifstream in(dir + INDEX_FILE, std::ios::binary);
+    std::string line;
+    if (in && std::getline(in, line) && line == INDEX_MAGIC) {
+        while (std::getline(in, line)) {
+            std::istringstream ss(line);
+            NoteEntry e;
+            std::string txtName, wavName, mtime, size;
+            if (!std::getline(ss, e.base, '\t') || !std::getline(ss, txtName, '\t') ||
+                !std::getline(ss, wavName, '\t') || !std::getline(ss, mtime, '\t') ||
+                !std::getline(ss, size, '\t') || !std::getline(ss, e.created, '\t')) continue;
+            std::getline(ss, e.title);
+            if (!txtName.empty()) e.txtPath = dir + txtName;
+            if (!wavName.empty()) e.wavPath = dir + wavName;
+            try {
+                e.mtime = std::stoll(mtime);
+                e.size = std::stoull(size);
+            } catch (...) { continue; }
+            notes[e.base] = std::move(e);
+        }
+    }
+
+    // Watch first so nothing written during the scan is missed
+    watcher.start(dir);
+    rescan();
+    save();
+}
+
+bool NoteIndex::openPacked() {
+    auto s = std::make_shared<NoteStore>();
+    const bool fresh = !NoteStore::exists(dir);
+    if (!s->open(dir)) {
+        std::cerr << "Failed to open the packed notes of " << dir << ", using plain files.\n";
+        return false;
+    }
+    if (fresh) {
+        const std::size_t imported = s->importFiles();
+        if (imported) std::cout << "Packed " << imported << " notes into " << dir << "\n";
+    }
+    s->compact();
+    store = s;
+    NoteStore::activate(store);
+
+    watcher.start(dir);
+    for (const NoteStore::Record& r : store->records()) {
+        if (!r.hasText && r.audioExt.empty()) continue;
+        NoteEntry e;
+        e.base = r.base;
+        if (r.hasText) e.txtPath = dir + r.base + ".txt";
+        if (!r.audioExt.empty()) e.wavPath = dir + r.base + r.audioExt;
+        e.title = r.title;
+        e.mtime = r.mtime;
+        e.size = r.size;
+        e.created = formatCreated(fs::file_time_type(fs::file_time_type::duration(r.mtime)));
+        notes[e.base] = std::move(e);
+    }
+    return true;
+}
+
+bool NoteIndex::rescan() {
+    std::unordered_set<std::string> seen;
+    if (store) {
+        for (const NoteStore::Record& r : store->records()) seen.insert(r.base);
+    }
+    try {
+        for (auto& p : fs::directory_iterator(dir)) {
+            if (!p.is_regular_file()) continue;
+            auto ext = p.path().extension().string();
+            if (isNoteFile(ext)) {
+                seen.insert(p.path().stem().string());
+            }
+        }
+    } catch (...) {
+        // Folder got deleted/locked mid-scan; keep what we have
+        std::cerr << "Error scanning voice notes directory.\n";
+        return false;
+    }
+
+    bool changed = false;
+    for (auto it = notes.begin(); it != notes.end();) {
+        if (!seen.count(it->first)) { it = notes.erase(it); changed = true; }
+        else ++it;
+    }
+    for (const auto& base : seen) changed |= update(base);
+    if (changed) unsaved = true;
+    return changed;
+}
+
+bool NoteIndex::update(const std::string& base) {
+    NoteEntry e;
+    e.base = base;
+    e.txtPath = findWithExt(dir, base, TEXT_EXTS);
+    e.wavPath = findWithExt(dir, base, AUDIO_EXTS);
+
+    // Packed folder: the text is in the store unless a plain file is still around
+    NoteStore::Record rec;
+    const bool inStore = store && store->find(base, rec);
+    if (store) {
+        const std::string ext = e.wavPath.empty() ? "" : fs::path(e.wavPath).extension().string();
+        if (rec.audioExt != ext && (inStore || !ext.empty())) store->setAudio(base, ext);
+    }
+    const bool packedText = e.txtPath.empty() && inStore && rec.hasText;
+    if (packedText) e.txtPath = dir + base + ".txt";
+
+    auto it = notes.find(base);
+    if (e.txtPath.empty() && e.wavPath.empty()) {
+        if (it == notes.end()) return false;
+        notes.erase(it);
+        unsaved = true;
+        return true;
+    }
+
+    std::error_code ec;
+    fs::file_time_type ftime;
+    if (packedText) {
+        ftime = fs::file_time_type(fs::file_time_type::duration(rec.mtime));
+        e.size = rec.size;
+    } else {
+        const std::string& stamp = e.txtPath.empty() ? e.wavPath : e.txtPath;
+        ftime = fs::last_write_time(stamp, ec);
+        e.size = e.txtPath.empty() ? 0 : (std::uint64_t) fs::file_size(e.txtPath, ec);
+    }
+    e.mtime = ec ? 0 : (std::int64_t) ftime.time_since_epoch().count();
+
+    if (it != notes.end() && it->second.mtime == e.mtime && it->second.size == e.size) {
+        const NoteEntry& old = it->second;
+        if (old.txtPath == e.txtPath && old.wavPath == e.wavPath) return false;
+        e.title = old.title;
+        e.created = old.created;
+    } else {
+        if (packedText) e.title = rec.title;
+        else if (!e.txtPath.empty()) e.title = readTitle(e.txtPath);
+        e.created = ec ? "" : formatCreated(ftime);
+    }
+
+    notes[base] = std::move(e);
+    unsaved = true;
+    return true;
+}
+
+bool NoteIndex::poll() {
+    if (dir.empty()) return false;
+
+    std::vector<std::string> names;
+    if (!watcher.poll(names)) {
+        // Lost track (overflow, folder replaced, no native watcher): stat everything again
+        watcher.start(dir);
+        return rescan();
+    }
+
+    bool changed = false;
+    std::unordered_set<std::string> bases;
+    for (const auto& name : names) {
+        fs::path p(name);
+        auto ext = p.extension().string();
+        if (isNoteFile(ext)) bases.insert(p.stem().string());
+    }
+    if (store) {
+        // saves into the store touch no note file
+        for (auto& base : store->takeChanged()) bases.insert(std::move(base));
+    }
+    for (const auto& base : bases) changed |= update(base);
+    return changed;
+}
+
+void NoteIndex::refresh(const std::string& base) {
+    if (!dir.empty()) update(base);
+}
+
+std::vector<NoteEntry> NoteIndex::entries() const {
+    std::vector<NoteEntry> out;
+    out.reserve(notes.size());
+    for (const auto& kv : notes) out.push_back(kv.second);
+    return out;
+}
+
+void NoteIndex::save() {
+    if (!unsaved || dir.empty() || store) return; // a packed folder is its own index
+
+    const std::string path = dir + INDEX_FILE;
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return;
+        out << INDEX_MAGIC << '\n';
+        for (const auto& kv : notes) {
+            const NoteEntry& e = kv.second;
+            out << e.base << '\t'
+                << (e.txtPath.empty() ? "" : fs::path(e.txtPath).filename().string()) << '\t'
+                << (e.wavPath.empty() ? "" : fs::path(e.wavPath).filename().string()) << '\t'
+                << e.mtime << '\t' << e.size << '\t' << e.created << '\t' << e.title << '\n';
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (!ec) unsaved = false;
+}
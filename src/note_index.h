@@ -0,0 +1,79 @@
+#ifndef NOTE_INDEX_H
+#define NOTE_INDEX_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class NoteStore;
+
+// What the notes list needs to know about a note without reading its body
+struct NoteEntry {
+    std::string base;        // e.g., "note_2025-11-09_18-12-30"
+    std::string txtPath;     // "" when there is only a .wav
+    std::string wavPath;     // recording (.wav/.flac/.ogg/.mp3); "" when there is only a .txt
+    std::string title;       // first line of the .txt
+    std::string created;     // HH:MM of the last write
+    std::int64_t mtime = 0;  // .txt (or .wav) last_write_time ticks
+    std::uint64_t size = 0;  // .txt size in bytes
+};
+
+// Reports which file names in a directory changed since the last call.
+// inotify on Linux, ReadDirectoryChangesW on Windows; elsewhere it only
+// notices that *something* changed (directory mtime).
+class DirWatcher {
+public:
+    DirWatcher();
+    ~DirWatcher();
+    DirWatcher(const DirWatcher&) = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    void start(const std::string& dir);
+    void stop();
+    // Appends changed file names; returns false if the watcher lost track
+    // (overflow, unsupported platform) and the caller should rescan
+    bool poll(std::vector<std::string>& names);
+
+    struct Impl;
+
+private:
+    std::unique_ptr<Impl> impl;
+};
+
+// Persistent index of a voice-notes folder (<dir>/.notes_index).
+// Opening stats the folder once and only re-reads the first line of notes
+// whose mtime/size differ from the cache; afterwards it follows the watcher.
+// A packed folder (NoteStore) is listed from its mapped index instead, with
+// no scan at all; plain files still being written there show until absorbed.
+class NoteIndex {
+public:
+    ~NoteIndex();
+
+    // dir must end with a slash; created if missing. packed converts the
+    // folder's .txt notes into a NoteStore, !packed exports a store back
+    void open(const std::string& dir, bool packed = false);
+    // Apply pending file-system changes; true when entries changed
+    bool poll();
+    // Re-stat one note now (e.g. a file we just wrote ourselves)
+    void refresh(const std::string& base);
+    // Newest first
+    std::vector<NoteEntry> entries() const;
+    // Write the cache if anything changed since the last save
+    void save();
+
+private:
+    bool rescan();
+    bool update(const std::string& base);
+    bool openPacked();
+
+    std::string dir;
+    std::shared_ptr<NoteStore> store;   // packed folder
+    std::map<std::string, NoteEntry, std::greater<std::string>> notes; // base -> entry, newest first
+    DirWatcher watcher;
+    bool unsaved = false;
+};
+
+#endif // NOTE_INDEX_H
@@ -0,0 +1,218 @@
+#include "note_refiner.h"
+#include "audio_stream.h"
+#include "note_store.h"
+#include "settings.h"
+#include "transcript.h"
+#include "transcription_engine.h"
+#include "transcription_ledger.h"
+#include "whisper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Idleness is not signalled, so a waiting job looks again this often
+const auto IDLE_POLL = std::chrono::seconds(5);
+
+// The pass shares the machine with the user; whisper's compute threads are
+// spawned from this thread and inherit its nice value on Linux
+void lowerThreadPriority() {
+#if defined(_WIN32)
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 10);
+#endif
+}
+
+} // namespace
+
+NoteRefiner& NoteRefiner::instance() {
+    static NoteRefiner refiner;
+    return refiner;
+}
+
+NoteRefiner::~NoteRefiner() {
+    shutdown();
+}
+
+void NoteRefiner::enqueue(const std::string& audioPath, const std::string& textPath, const std::string& draft,
+                          std::function<bool()> audioClosed) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (stopping) return;
+    jobs.push_back({audioPath, textPath, draft, std::move(audioClosed)});
+    if (!worker.joinable()) worker = std::thread([this]{ run(); });
+    cv.notify_all();
+}
+
+void NoteRefiner::setRecording(bool on) {
+    std::lock_guard<std::mutex> lock(mtx);
+    recording = on;
+    if (on) abort = true;
+    cv.notify_all();
+}
+
+void NoteRefiner::shutdown() {
+    {
+        // The recordings stay on disk; unrefined notes keep their draft
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+        abort = true;
+        jobs.clear();
+    }
+    cv.notify_all();
+    if (worker.joinable()) worker.join();
+}
+
+// mtx held
+bool NoteRefiner::idle() const {
+    return !recording && TranscriptionEngine::instance().pendingJobs() == 0 &&
+           !TranscriptionEngine::deferBackground(true);
+}
+
+void NoteRefiner::run() {
+    lowerThreadPriority();
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            for (;;) {
+                if (stopping) break;
+                if (jobs.empty()) {
+                    // nothing left: give the memory back until the next note
+                    unloadModel();
+                    cv.wait(lock, [this]{ return stopping || !jobs.empty(); });
+                    continue;
+                }
+                if (idle() && (!jobs.front().audioClosed || jobs.front().audioClosed())) break;
+                cv.wait_for(lock, IDLE_POLL);
+            }
+            if (stopping) break;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            abort = false;
+        }
+
+        const int rc = refine(job);
+        if (rc == 0) continue;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (abort.load() && !stopping) {
+            // a recording started: redo the note once it is idle again
+            jobs.push_front(std::move(job));
+        } else if (!stopping) {
+            std::cerr << "Refinement failed for " << job.textPath << "\n";
+        }
+    }
+    unloadModel();
+}
+
+bool NoteRefiner::loadModel() {
+    if (ctx && loadedPath == Settings::refine_model_path) return true;
+    unloadModel();
+    if (Settings::refine_model_path.empty()) return false;
+
+    ctx = whisper_init_from_file_with_params_no_state(Settings::refine_model_path.c_str(),
+                                                      TranscriptionEngine::contextParams());
+    state = ctx ? whisper_init_state(ctx) : nullptr;
+    if (!state) {
+        std::cerr << "Failed to load refinement model '" << Settings::refine_model_path << "'\n";
+        unloadModel();
+        return false;
+    }
+    loadedPath = Settings::refine_model_path;
+    return true;
+}
+
+void NoteRefiner::unloadModel() {
+    if (state) whisper_free_state(state);
+    if (ctx) whisper_free(ctx);
+    state = nullptr;
+    ctx = nullptr;
+    loadedPath.clear();
+}
+
+int NoteRefiner::refine(const Job& job) {
+    // Done by this model before: this note, or the same recording under
+    // another name, whose text is taken over without loading the model
+    TranscriptionLedger& ledger = TranscriptionLedger::instance();
+    const std::string key = TranscriptionLedger::modelKey(Settings::refine_model_path);
+    const std::string hash = ledger.audioHash(job.audioPath);
+    const std::string done = ledger.find(hash, key, job.textPath);
+    if (done == job.textPath) {
+        std::cout << "Already refined: " << job.textPath << "\n";
+        return 0;
+    }
+
+    std::string text;
+    TranscriptBuilder transcript;
+    if (done.empty()) {
+        // Only the low-confidence stretches of the draft are decoded again,
+        // unless they make up most of the note or the draft has no tokens
+        // to judge by (a note transcribed by a server)
+        TranscriptView draft;
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> runs;
+        bool selective = false;
+        if (draft.open(transcriptPath(job.textPath)) && draft.segmentCount() > 0) {
+            const TranscriptSegment* segs = draft.segments();
+            bool scored = true;
+            for (std::uint32_t i = 0; i < draft.segmentCount(); ++i) scored = scored && segs[i].tokenCount > 0;
+            if (scored) {
+                runs = draft.lowConfidenceRuns();
+                if (runs.empty()) {
+                    std::cout << "Confident draft, not refined: " << job.textPath << "\n";
+                    return 0;
+                }
+                std::uint64_t runMs = 0;
+                for (const auto& [first, end] : runs) runMs += segs[end - 1].t1Ms - segs[first].t0Ms;
+                selective = runMs * 2 <= segs[draft.segmentCount() - 1].t1Ms;
+            }
+        }
+
+        if (!loadModel()) return 1;
+
+        // the plan scales to the load and power source; the pass takes half of it
+        const TranscriptionEngine::ThreadPlan plan = TranscriptionEngine::threadPlan(TranscriptionEngine::Priority::Background);
+        const int threads = std::max(1, plan.threads / 2);
+        std::unique_ptr<EfficientThreads> efficient;
+        if (plan.efficient) efficient = std::make_unique<EfficientThreads>(state, threads);
+        const int rc = selective
+            ? refineAudioSegments(ctx, state, job.audioPath, draft, runs, threads, abort, text, transcript)
+            : refineAudioFile(ctx, state, job.audioPath, threads, abort, text, transcript);
+        efficient.reset();
+        if (rc != 0) return rc;
+    } else {
+        text = readNoteText(done);
+    }
+
+    // replace the draft only; an edited note is the user's
+    if (readNoteText(job.textPath) != job.draft) {
+        std::cout << "Note changed since its draft, not refined: " << job.textPath << "\n";
+        return 0;
+    }
+    if (done.empty()) {
+        if (!writeNoteText(job.textPath, text)) return 1;
+        transcript.save(transcriptPath(job.textPath));
+    } else if (!TranscriptionLedger::copyNote(done, job.textPath)) {
+        return 1;
+    }
+    ledger.record(hash, key, job.textPath);
+    std::cout << "Refined: " << job.textPath << "\n";
+
+    TranscriptionEvent ev;
+    ev.type = TranscriptionEvent::Type::Refined;
+    ev.textPath = job.textPath;
+    ev.text = text;
+    TranscriptionEngine::instance().postEvent(std::move(ev));
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef NOTE_REFINER_H
+#define NOTE_REFINER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct whisper_context;
+struct whisper_state;
+
+// Second transcription pass with a larger model (Settings::refine_model_path).
+//
+// The live pass gives a note its draft within seconds; the refiner later
+// re-transcribes the recording and replaces the .txt, as long as it still
+// holds that draft (an edited note is left alone). Only the runs of draft
+// segments whose confidence is low are decoded again, with beam search, when
+// they are less than half the note; a confident draft is kept as it is and a
+// mostly doubtful one is transcribed whole. It only runs while the app
+// is idle: no recording, no queued transcription and, unless the power
+// policy is "performance", mains power. It uses half the threads of a
+// background job at low priority, gives way to a new recording by aborting
+// (the note is redone later) and frees its model once the queue is empty.
+class NoteRefiner {
+public:
+    static NoteRefiner& instance();
+
+    // `draft` is what the live pass wrote to textPath; `audioClosed` tells
+    // when the recording is complete on disk
+    void enqueue(const std::string& audioPath, const std::string& textPath, const std::string& draft,
+                 std::function<bool()> audioClosed);
+    // A recording started or stopped
+    void setRecording(bool on);
+
+    void shutdown();
+
+private:
+    NoteRefiner() = default;
+    ~NoteRefiner();
+    NoteRefiner(const NoteRefiner&) = delete;
+    NoteRefiner& operator=(const NoteRefiner&) = delete;
+
+    struct Job {
+        std::string audioPath;
+        std::string textPath;
+        std::string draft;
+        std::function<bool()> audioClosed;
+    };
+
+    void run();
+    bool idle() const;
+    // 0 on success or when the note was left alone; non-zero otherwise
+    int refine(const Job& job);
+    bool loadModel();
+    void unloadModel();
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    std::thread worker;
+    bool stopping = false;
+    bool recording = false;
+    std::atomic<bool> abort{false};      // stops the running pass
+
+    // Worker thread only
+    std::string loadedPath;
+    whisper_context* ctx = nullptr;
+    whisper_state* state = nullptr;
+};
+
+#endif // NOTE_REFINER_H
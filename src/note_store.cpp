@@ -0,0 +1,536 @@
+#include "note_store.h"
+#include "mapped_file.h"
+#include "note_writer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <iterator>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char* INDEX_FILE = "notes.idx";
+const char INDEX_MAGIC[8] = {'N', 'O', 'T', 'E', 'I', 'D', 'X', '1'};
+const std::uint32_t LOG_MAGIC = 0x474f4c4e; // "NLOG"
+const std::size_t BASE_BYTES = 40;
+const std::size_t AUDIO_BYTES = 8;
+const std::size_t TITLE_BYTES = 56;
+const std::uint32_t GROW_RECORDS = 256;
+const std::uint32_t HAS_TEXT = 1;
+// old versions must also be worth a rewrite
+const std::uint64_t COMPACT_MIN_BYTES = 1 << 20;
+
+struct IndexHeader {
+    char magic[8];
+    std::uint32_t count;        // records in use
+    std::uint32_t capacity;     // records the file has room for
+    std::uint64_t generation;   // of the log the offsets point into
+    std::uint64_t logBytes;     // log bytes the records cover
+    std::uint64_t liveBytes;    // of those, the newest version of each note
+    char reserved[24];
+};
+static_assert(sizeof(IndexHeader) == 64, "index header layout");
+
+struct IndexRecord {
+    char base[BASE_BYTES];
+    char audio[AUDIO_BYTES];
+    std::uint64_t offset;       // of the log record
+    std::uint32_t length;       // text bytes
+    std::uint32_t flags;
+    std::int64_t mtime;
+    char title[TITLE_BYTES];
+};
+static_assert(sizeof(IndexRecord) == 128, "index record layout");
+
+struct LogHeader {
+    std::uint32_t magic;
+    std::uint32_t length;
+    std::int64_t mtime;
+    char base[BASE_BYTES];
+};
+static_assert(sizeof(LogHeader) == 56, "log record layout");
+
+std::size_t indexBytes(std::uint32_t capacity) {
+    return sizeof(IndexHeader) + (std::size_t) capacity * sizeof(IndexRecord);
+}
+
+void putString(char* dst, std::size_t n, const std::string& s) {
+    std::memset(dst, 0, n);
+    std::memcpy(dst, s.data(), std::min(s.size(), n - 1));
+}
+
+std::string getString(const char* src, std::size_t n) {
+    return std::string(src, std::find(src, src + n, '\0'));
+}
+
+// Same as the first line NoteIndex reads from a .txt, cut to fit a record
+// without splitting a UTF-8 sequence
+std::string titleOf(const std::string& text) {
+    std::string line = text.substr(0, text.find('\n'));
+    for (char& c : line) if (c == '\t' || c == '\r') c = ' ';
+    while (!line.empty() && line.back() == ' ') line.pop_back();
+    if (line.size() >= TITLE_BYTES) {
+        std::size_t cut = TITLE_BYTES - 1;
+        while (cut > 0 && ((unsigned char) line[cut] & 0xC0) == 0x80) --cut;
+        line.resize(cut);
+    }
+    return line;
+}
+
+std::int64_t nowTicks() {
+    return (std::int64_t) fs::file_time_type::clock::now().time_since_epoch().count();
+}
+
+std::string lowerExt(const fs::path& p) {
+    std::string ext = p.extension().string();
+    for (char& c : ext) c = (char) std::tolower((unsigned char) c);
+    return ext;
+}
+
+std::string slurpFile(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+std::mutex activeMtx;
+std::shared_ptr<NoteStore> activeStore;
+
+} // namespace
+
+// notes.idx, mapped read-write
+struct NoteStore::Mapping : MappedFile {
+    IndexHeader* header() { return reinterpret_cast<IndexHeader*>(data()); }
+    IndexRecord* records() { return reinterpret_cast<IndexRecord*>(data() + sizeof(IndexHeader)); }
+};
+
+// ---------- NoteStore ----------
+
+NoteStore::NoteStore() = default;
+NoteStore::~NoteStore() { close(); }
+
+bool NoteStore::exists(const std::string& dir) {
+    std::error_code ec;
+    return fs::is_regular_file(dir + INDEX_FILE, ec);
+}
+
+std::string NoteStore::logPath(std::uint64_t generation) const {
+    return dir + "notes." + std::to_string(generation) + ".log";
+}
+
+bool NoteStore::open(const std::string& d) {
+    close();
+    std::lock_guard<std::mutex> lock(mtx);
+    dir = d;
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    map = std::make_unique<Mapping>();
+    if (!map->open(dir + INDEX_FILE, true, indexBytes(GROW_RECORDS))) {
+        std::cerr << "Failed to map " << dir << INDEX_FILE << "\n";
+        map.reset();
+        return false;
+    }
+
+    IndexHeader* h = map->header();
+    const bool valid = std::memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && h->count <= h->capacity &&
+                       indexBytes(h->capacity) <= map->size();
+    if (!valid) {
+        // new or damaged index: start over from the newest complete log, if any
+        std::uint64_t newest = 0;
+        for (const auto& p : fs::directory_iterator(dir, ec)) {
+            const std::string name = p.path().filename().string();
+            if (name.rfind("notes.", 0) != 0 || p.path().extension() != ".log") continue;
+            newest = std::max<std::uint64_t>(newest, std::strtoull(name.c_str() + 6, nullptr, 10));
+        }
+        std::memset(map->data(), 0, map->size());
+        std::memcpy(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        h->capacity = (std::uint32_t) ((map->size() - sizeof(IndexHeader)) / sizeof(IndexRecord));
+        h->generation = newest > 0 ? newest : 1;
+    }
+
+    slots.clear();
+    IndexRecord* recs = map->records();
+    for (std::uint32_t i = 0; i < h->count; ++i) slots[getString(recs[i].base, BASE_BYTES)] = i;
+
+    // saves the index did not get to (a crash between the two writes) are replayed
+    const std::uint64_t actual = fs::exists(logPath(h->generation), ec) ? fs::file_size(logPath(h->generation), ec) : 0;
+    if (actual > h->logBytes) {
+        if (!rebuild(h->logBytes)) return false;
+        h = map->header();
+    } else if (actual < h->logBytes) {
+        std::cerr << "Note log shorter than its index, notes past it are lost\n";
+        recs = map->records();
+        for (std::uint32_t i = 0; i < h->count; ++i) {
+            if (recs[i].offset + sizeof(LogHeader) + recs[i].length > actual) recs[i].flags &= ~HAS_TEXT;
+        }
+        h->logBytes = actual;
+    }
+
+    logEnd = h->logBytes;
+    log.open(logPath(h->generation), std::ios::binary | std::ios::app);
+    if (!log) {
+        map.reset();
+        return false;
+    }
+    map->flush();
+    return true;
+}
+
+void NoteStore::close() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (map) map->flush();
+    map.reset();
+    if (log.is_open()) log.close();
+    slots.clear();
+    changed.clear();
+}
+
+// mtx held. Applies the log records from `fromOffset` on; a torn record at
+// the end is cut off so the next append starts on a record boundary
+bool NoteStore::rebuild(std::uint64_t fromOffset) {
+    const std::string path = logPath(map->header()->generation);
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    in.seekg((std::streamoff) fromOffset);
+
+    std::uint64_t pos = fromOffset;
+    std::string text;
+    for (;;) {
+        LogHeader hdr;
+        if (!in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)) || hdr.magic != LOG_MAGIC ||
+            std::find(hdr.base, hdr.base + BASE_BYTES, '\0') == hdr.base + BASE_BYTES) break;
+        text.resize(hdr.length);
+        if (!in.read(text.data(), (std::streamsize) hdr.length)) break;
+
+        const std::string base = getString(hdr.base, BASE_BYTES);
+        const std::uint32_t slot = slotFor(base);
+        if (slot == UINT32_MAX) return false;
+        IndexHeader* h = map->header();
+        IndexRecord& r = map->records()[slot];
+        if (r.flags & HAS_TEXT) h->liveBytes -= sizeof(LogHeader) + r.length;
+        r.offset = pos;
+        r.length = hdr.length;
+        r.mtime = hdr.mtime;
+        r.flags |= HAS_TEXT;
+        putString(r.title, TITLE_BYTES, titleOf(text));
+        h->liveBytes += sizeof(LogHeader) + hdr.length;
+        pos += sizeof(LogHeader) + hdr.length;
+    }
+    in.close();
+
+    std::error_code ec;
+    if (fs::file_size(path, ec) != pos) fs::resize_file(path, pos, ec);
+    map->header()->logBytes = pos;
+    return true;
+}
+
+// mtx held. Record of base, added if new; UINT32_MAX when the index cannot grow
+std::uint32_t NoteStore::slotFor(const std::string& base) {
+    auto it = slots.find(base);
+    if (it != slots.end()) return it->second;
+
+    IndexHeader* h = map->header();
+    if (h->count == h->capacity) {
+        const std::uint32_t capacity = h->capacity + GROW_RECORDS;
+        if (!map->resize(indexBytes(capacity))) return UINT32_MAX;
+        h = map->header();
+        std::memset(map->records() + h->capacity, 0, (std::size_t) GROW_RECORDS * sizeof(IndexRecord));
+        h->capacity = capacity;
+    }
+    const std::uint32_t slot = h->count++;
+    IndexRecord& r = map->records()[slot];
+    std::memset(&r, 0, sizeof(r));
+    putString(r.base, BASE_BYTES, base);
+    slots[base] = slot;
+    return slot;
+}
+
+// mtx held
+bool NoteStore::append(const std::string& base, const std::string& text, std::int64_t mtime) {
+    LogHeader hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = LOG_MAGIC;
+    hdr.length = (std::uint32_t) text.size();
+    hdr.mtime = mtime;
+    putString(hdr.base, BASE_BYTES, base);
+    log.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    log.write(text.data(), (std::streamsize) text.size());
+    log.flush();
+    if (!log) {
+        log.clear();
+        return false;
+    }
+
+    // the log record is complete; now point the index at it
+    const std::uint32_t slot = slotFor(base);
+    if (slot == UINT32_MAX) return false;
+    IndexHeader* h = map->header();
+    IndexRecord& r = map->records()[slot];
+    if (r.flags & HAS_TEXT) h->liveBytes -= sizeof(LogHeader) + r.length;
+    r.offset = logEnd;
+    r.length = hdr.length;
+    r.mtime = mtime;
+    r.flags |= HAS_TEXT;
+    putString(r.title, TITLE_BYTES, titleOf(text));
+    logEnd += sizeof(LogHeader) + text.size();
+    h->liveBytes += sizeof(LogHeader) + text.size();
+    h->logBytes = logEnd;
+    map->flush();
+    return true;
+}
+
+std::vector<NoteStore::Record> NoteStore::records() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<Record> out;
+    if (!map) return out;
+    const IndexHeader* h = map->header();
+    const IndexRecord* recs = map->records();
+    out.reserve(h->count);
+    for (std::uint32_t i = 0; i < h->count; ++i) {
+        const IndexRecord& r = recs[i];
+        Record rec;
+        rec.base = getString(r.base, BASE_BYTES);
+        rec.audioExt = getString(r.audio, AUDIO_BYTES);
+        rec.title = getString(r.title, TITLE_BYTES);
+        rec.mtime = r.mtime;
+        rec.size = r.length;
+        rec.hasText = (r.flags & HAS_TEXT) != 0;
+        out.push_back(std::move(rec));
+    }
+    return out;
+}
+
+bool NoteStore::find(const std::string& base, Record& out) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = slots.find(base);
+    if (!map || it == slots.end()) return false;
+    const IndexRecord& r = map->records()[it->second];
+    out.base = base;
+    out.audioExt = getString(r.audio, AUDIO_BYTES);
+    out.title = getString(r.title, TITLE_BYTES);
+    out.mtime = r.mtime;
+    out.size = r.length;
+    out.hasText = (r.flags & HAS_TEXT) != 0;
+    return true;
+}
+
+bool NoteStore::read(const std::string& base, std::string& text) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = slots.find(base);
+    if (!map || it == slots.end()) return false;
+    const IndexRecord& r = map->records()[it->second];
+    if (!(r.flags & HAS_TEXT)) return false;
+
+    std::ifstream in(logPath(map->header()->generation), std::ios::binary);
+    in.seekg((std::streamoff) (r.offset + sizeof(LogHeader)));
+    text.resize(r.length);
+    return (bool) in.read(text.data(), (std::streamsize) r.length);
+}
+
+bool NoteStore::write(const std::string& base, const std::string& text, std::int64_t mtime) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!map || base.empty() || base.size() >= BASE_BYTES || text.size() > UINT32_MAX) return false;
+    if (!append(base, text, mtime != 0 ? mtime : nowTicks())) return false;
+    changed.push_back(base);
+    return true;
+}
+
+void NoteStore::setAudio(const std::string& base, const std::string& ext) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!map || base.empty() || base.size() >= BASE_BYTES || ext.size() >= AUDIO_BYTES) return;
+    const std::uint32_t slot = slotFor(base);
+    if (slot != UINT32_MAX) putString(map->records()[slot].audio, AUDIO_BYTES, ext);
+}
+
+std::vector<std::string> NoteStore::takeChanged() {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<std::string> out;
+    out.swap(changed);
+    return out;
+}
+
+bool NoteStore::compact() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!map) return false;
+    IndexHeader* h = map->header();
+    const std::uint64_t dead = h->logBytes - h->liveBytes;
+    if (dead <= h->liveBytes || dead < COMPACT_MIN_BYTES) return false;
+
+    // the newest version of every note goes to the next generation's log
+    const std::uint64_t generation = h->generation + 1;
+    const std::string oldLog = logPath(h->generation);
+    const std::string newLog = logPath(generation);
+    std::vector<IndexRecord> moved(map->records(), map->records() + h->count);
+    std::uint64_t pos = 0;
+    {
+        std::ifstream in(oldLog, std::ios::binary);
+        std::ofstream out(newLog + ".tmp", std::ios::binary | std::ios::trunc);
+        std::vector<char> buf;
+        for (IndexRecord& r : moved) {
+            if (!(r.flags & HAS_TEXT)) continue;
+            buf.resize(sizeof(LogHeader) + r.length);
+            in.seekg((std::streamoff) r.offset);
+            in.read(buf.data(), (std::streamsize) buf.size());
+            out.write(buf.data(), (std::streamsize) buf.size());
+            r.offset = pos;
+            pos += buf.size();
+        }
+        out.flush();
+        if (!in || !out) {
+            std::error_code ec;
+            fs::remove(newLog + ".tmp", ec);
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(newLog + ".tmp", newLog, ec);
+    if (ec) return false;
+
+    // then an index pointing into it replaces the old one
+    const std::string indexPath = dir + INDEX_FILE;
+    {
+        IndexHeader nh = *h;
+        nh.capacity = h->count + GROW_RECORDS;
+        nh.generation = generation;
+        nh.logBytes = pos;
+        nh.liveBytes = pos;
+        std::ofstream out(indexPath + ".tmp", std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&nh), sizeof(nh));
+        out.write(reinterpret_cast<const char*>(moved.data()), (std::streamsize) (moved.size() * sizeof(IndexRecord)));
+        const std::vector<char> spare((std::size_t) GROW_RECORDS * sizeof(IndexRecord), 0);
+        out.write(spare.data(), (std::streamsize) spare.size());
+        out.flush();
+        if (!out) {
+            fs::remove(indexPath + ".tmp", ec);
+            return false;
+        }
+    }
+    // Windows cannot replace a mapped or open file
+    log.close();
+    map->close();
+    fs::rename(indexPath + ".tmp", indexPath, ec);
+    const bool swapped = !ec;
+    if (!map->open(indexPath, true)) {
+        map.reset();
+        return false;
+    }
+    if (swapped) fs::remove(oldLog, ec);
+    logEnd = map->header()->logBytes;
+    log.open(logPath(map->header()->generation), std::ios::binary | std::ios::app);
+    return swapped;
+}
+
+std::size_t NoteStore::importFiles() {
+    std::vector<fs::path> texts;
+    std::vector<fs::path> audio;
+    std::error_code ec;
+    for (const auto& p : fs::directory_iterator(dir, ec)) {
+        if (!p.is_regular_file(ec)) continue;
+        const std::string ext = lowerExt(p.path());
+        if (ext == ".txt") texts.push_back(p.path());
+        else if (ext == ".wav" || ext == ".flac" || ext == ".ogg" || ext == ".mp3") audio.push_back(p.path());
+    }
+
+    std::size_t imported = 0;
+    for (const fs::path& p : texts) {
+        // names too long for a record stay plain files
+        const auto ftime = fs::last_write_time(p, ec);
+        const std::int64_t mtime = ec ? 0 : (std::int64_t) ftime.time_since_epoch().count();
+        if (!write(p.stem().string(), slurpFile(p.string()), mtime)) continue;
+        fs::remove(p, ec);
+        ++imported;
+    }
+    for (const fs::path& p : audio) setAudio(p.stem().string(), p.extension().string());
+    takeChanged();
+    return imported;
+}
+
+bool NoteStore::exportFiles() {
+    bool ok = true;
+    std::error_code ec;
+    for (const Record& r : records()) {
+        if (!r.hasText) continue;
+        const std::string path = dir + r.base + ".txt";
+        if (fs::exists(path, ec)) continue;
+        std::string text;
+        if (!read(r.base, text) || !writeFileAtomic(path, text)) {
+            ok = false;
+            continue;
+        }
+        // keeps the time the list shows
+        fs::last_write_time(path, fs::file_time_type(fs::file_time_type::duration(r.mtime)), ec);
+    }
+    return ok;
+}
+
+void NoteStore::removeFiles() {
+    std::uint64_t generation = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (map) generation = map->header()->generation;
+    }
+    close();
+    std::error_code ec;
+    fs::remove(dir + INDEX_FILE, ec);
+    if (generation) {
+        fs::remove(logPath(generation), ec);
+        fs::remove(logPath(generation + 1), ec); // left by an interrupted compaction
+    }
+}
+
+std::shared_ptr<NoteStore> NoteStore::forPath(const std::string& txtPath, std::string& base) {
+    std::shared_ptr<NoteStore> store;
+    {
+        std::lock_guard<std::mutex> lock(activeMtx);
+        store = activeStore;
+    }
+    if (!store) return nullptr;
+    const std::string& d = store->dir;
+    if (txtPath.size() <= d.size() + 4 || txtPath.compare(0, d.size(), d) != 0 ||
+        txtPath.compare(txtPath.size() - 4, 4, ".txt") != 0) return nullptr;
+    base = txtPath.substr(d.size(), txtPath.size() - d.size() - 4);
+    if (base.find_first_of("/\\") != std::string::npos) return nullptr;
+    return store;
+}
+
+void NoteStore::activate(const std::shared_ptr<NoteStore>& store) {
+    std::lock_guard<std::mutex> lock(activeMtx);
+    activeStore = store;
+}
+
+// ---------- Note text by path ----------
+
+std::string readNoteText(const std::string& txtPath) {
+    std::string base;
+    std::error_code ec;
+    auto store = NoteStore::forPath(txtPath, base);
+    if (!store || fs::is_regular_file(txtPath, ec)) return slurpFile(txtPath);
+    std::string text;
+    store->read(base, text);
+    return text;
+}
+
+bool writeNoteText(const std::string& txtPath, const std::string& text) {
+    std::string base;
+    auto store = NoteStore::forPath(txtPath, base);
+    if (store && store->write(base, text)) {
+        // the packed copy is the newer one now
+        std::error_code ec;
+        fs::remove(txtPath, ec);
+        return true;
+    }
+    return writeFileAtomic(txtPath, text);
+}
+
+void absorbNoteFile(const std::string& txtPath) {
+    std::string base;
+    std::error_code ec;
+    auto store = NoteStore::forPath(txtPath, base);
+    if (!store || !fs::is_regular_file(txtPath, ec)) return;
+    if (store->write(base, slurpFile(txtPath))) fs::remove(txtPath, ec);
+}
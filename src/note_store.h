@@ -0,0 +1,99 @@
+#ifndef NOTE_STORE_H
+#define NOTE_STORE_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Packed note store (Settings::note_store == "packed"): the text of every
+// note lives in one append-only log (<dir>/notes.<generation>.log) and a
+// memory-mapped index of fixed-size records (<dir>/notes.idx) holds, per
+// note, where its newest text starts, its title, write time and audio file
+// extension. Opening the folder maps the index; nothing else is listed or
+// opened, whatever the number of notes. Recordings stay separate files.
+//
+// A save appends a log record (header + text) and then updates the index
+// record in place, so a crash loses at most that save; log records carry
+// their note name, so an index that is missing or behind the log is rebuilt
+// from it. compact() rewrites the log once most of it is old versions.
+//
+// Thread-safe: the UI, the autosave thread and transcription jobs share it.
+class NoteStore {
+public:
+    struct Record {
+        std::string base;
+        std::string audioExt;    // ".wav", ".flac", ".ogg", ".mp3" or "" without a recording
+        std::string title;       // first line, truncated
+        std::int64_t mtime = 0;  // file_time_type ticks of the last save
+        std::uint32_t size = 0;  // text bytes
+        bool hasText = false;
+    };
+
+    NoteStore();
+    ~NoteStore();
+    NoteStore(const NoteStore&) = delete;
+    NoteStore& operator=(const NoteStore&) = delete;
+
+    // True when dir (with trailing slash) holds a packed store
+    static bool exists(const std::string& dir);
+    // Maps the index, creating an empty store if there is none
+    bool open(const std::string& dir);
+    void close();
+
+    std::vector<Record> records() const;
+    bool find(const std::string& base, Record& out) const;
+    bool read(const std::string& base, std::string& text) const;
+    // mtime 0 = now
+    bool write(const std::string& base, const std::string& text, std::int64_t mtime = 0);
+    void setAudio(const std::string& base, const std::string& ext);
+    // Notes written since the last call
+    std::vector<std::string> takeChanged();
+
+    // Rewrite the log without the old versions when they outweigh the notes
+    bool compact();
+    // Move the plain .txt notes of the folder into the store (their files are
+    // removed) and record the recordings next to them; returns notes imported
+    std::size_t importFiles();
+    // Write every note as a plain .txt (existing files are kept)
+    bool exportFiles();
+    // Delete the store's files (after an export)
+    void removeFiles();
+
+    // The store of the folder a note path belongs to, if that folder is packed
+    static std::shared_ptr<NoteStore> forPath(const std::string& txtPath, std::string& base);
+    // Makes this store the one forPath() finds (nullptr: none)
+    static void activate(const std::shared_ptr<NoteStore>& store);
+
+    const std::string& folder() const { return dir; }
+
+private:
+    struct Mapping;
+    bool rebuild(std::uint64_t fromOffset);
+    bool append(const std::string& base, const std::string& text, std::int64_t mtime);
+    std::uint32_t slotFor(const std::string& base);
+    std::string logPath(std::uint64_t generation) const;
+
+    mutable std::mutex mtx;
+    std::string dir;
+    std::unique_ptr<Mapping> map;        // notes.idx
+    std::ofstream log;                   // appends to the current log
+    std::uint64_t logEnd = 0;
+    std::unordered_map<std::string, std::uint32_t> slots; // base -> index record
+    std::vector<std::string> changed;
+};
+
+// Note text by .txt path: the plain file when there is one, else the packed
+// store of its folder
+std::string readNoteText(const std::string& txtPath);
+// Into the packed store of the folder if it has one (a plain file of the
+// same note is removed), else the plain file (writeFileAtomic)
+bool writeNoteText(const std::string& txtPath, const std::string& text);
+// A plain .txt a transcription job streamed to goes into the packed store
+// once the job is done; no-op for unpacked folders
+void absorbNoteFile(const std::string& txtPath);
+
+#endif // NOTE_STORE_H
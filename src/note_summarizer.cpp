@@ -0,0 +1,358 @@
+#include "note_summarizer.h"
+#include "note_store.h"
+#include "settings.h"
+#include "transcription_engine.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char* const SUMMARIES_FILE = ".summaries";
+const char* const INSTRUCTION =
+    "You title and summarize voice notes. The user sends the transcript of one note. "
+    "Reply with a title of at most eight words on the first line, then a summary of one or two sentences. "
+    "Write nothing else.";
+
+const int CONTEXT_TOKENS = 4096;
+const int BATCH_TOKENS = 512;
+const int MAX_REPLY_TOKENS = 80;
+// the model is freed once no note was summarized for this long
+const auto UNLOAD_AFTER = std::chrono::minutes(2);
+
+std::string dirOf(const std::string& path) {
+    std::string dir = fs::path(path).parent_path().string();
+    if (!dir.empty()) dir.push_back('/');
+    return dir;
+}
+
+// Tabs and newlines would break the file's lines
+std::string oneLine(std::string s) {
+    std::replace_if(s.begin(), s.end(), [](char c){ return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+    return s;
+}
+
+std::string trim(const std::string& s, const char* chars = " \t\r\n") {
+    const std::size_t b = s.find_first_not_of(chars);
+    if (b == std::string::npos) return {};
+    return s.substr(b, s.find_last_not_of(chars) - b + 1);
+}
+
+// "Title: ..." / "**Summary:** ..." -> "..."
+std::string dropLabel(std::string s, const char* label) {
+    s = trim(s, " \t*#\"");
+    const std::size_t n = std::char_traits<char>::length(label);
+    if (s.size() >= n && std::equal(s.begin(), s.begin() + (std::ptrdiff_t) n, label,
+                                    [](char a, char b){ return std::tolower((unsigned char) a) == b; })) {
+        s = trim(s.substr(n), " \t*:\"");
+    }
+    return trim(s, " \t*#\"");
+}
+
+// The reply's first line is the title, the rest the summary
+void parseReply(const std::string& reply, std::string& title, std::string& summary) {
+    std::istringstream in(reply);
+    std::string line;
+    while (std::getline(in, line)) {
+        line = trim(line);
+        if (line.empty()) continue;
+        if (title.empty()) {
+            title = dropLabel(line, "title");
+        } else {
+            if (!summary.empty()) summary += ' ';
+            summary += line;
+        }
+    }
+    summary = dropLabel(summary, "summary");
+    if (title.size() > 80) title.resize(80);
+}
+
+// Whisper keeps its threads while it transcribes; the summary gets the rest
+int threadBudget(bool transcribing) {
+    const int threads = TranscriptionEngine::threadPlan(TranscriptionEngine::Priority::Background).threads;
+    if (transcribing || TranscriptionEngine::instance().pendingJobs() > 0) return std::max(1, threads / 4);
+    return std::max(1, threads);
+}
+
+} // namespace
+
+NoteSummarizer& NoteSummarizer::instance() {
+    static NoteSummarizer summarizer;
+    return summarizer;
+}
+
+NoteSummarizer::~NoteSummarizer() {
+    shutdown();
+}
+
+// mtx held
+NoteSummarizer::Session* NoteSummarizer::findLocked(const std::string& textPath) {
+    for (Session& s : sessions) {
+        if (s.textPath == textPath) return &s;
+    }
+    return nullptr;
+}
+
+void NoteSummarizer::observe(const TranscriptionEvent& ev) {
+    using Type = TranscriptionEvent::Type;
+    if (ev.textPath.empty()) return;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    if (stopping) return;
+    Session* s = findLocked(ev.textPath);
+    switch (ev.type) {
+        case Type::Started:
+        case Type::Refined:
+            if (Settings::summary_model_path.empty()) return;
+            if (!s) {
+                sessions.emplace_back();
+                s = &sessions.back();
+                s->id = nextId++;
+                s->textPath = ev.textPath;
+            }
+            // a job that starts over (preempted, re-transcribed) feeds everything again
+            s->pending.clear();
+            s->restart = true;
+            s->finished = ev.type == Type::Refined;
+            if (s->finished) s->pending.push_back(ev.text);
+            break;
+        case Type::Segment:
+            if (!s || s->finished) return;
+            s->pending.push_back(ev.text + "\n");
+            break;
+        case Type::Finished:
+            if (!s) return;
+            s->finished = true;
+            break;
+        case Type::Failed:
+            if (!s) return;
+            sessions.erase(std::find_if(sessions.begin(), sessions.end(),
+                                        [&](const Session& x){ return x.textPath == ev.textPath; }));
+            break;
+        default:
+            return;
+    }
+    if (!worker.joinable()) worker = std::thread([this]{ run(); });
+    cv.notify_all();
+}
+
+std::map<std::string, std::string> NoteSummarizer::titles(const std::string& dir) {
+    std::map<std::string, std::string> out;
+    std::ifstream in(dir + SUMMARIES_FILE);
+    std::string line;
+    while (std::getline(in, line)) {
+        const std::size_t a = line.find('\t');
+        if (a == std::string::npos) continue;
+        const std::size_t b = line.find('\t', a + 1);
+        const std::string title = line.substr(a + 1, b == std::string::npos ? std::string::npos : b - a - 1);
+        if (!title.empty()) out[line.substr(0, a)] = title;  // later lines win
+    }
+    return out;
+}
+
+void NoteSummarizer::shutdown() {
+    {
+        // unsummarized notes keep their first line as title
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+        sessions.clear();
+    }
+    cv.notify_all();
+    if (worker.joinable()) worker.join();
+}
+
+void NoteSummarizer::run() {
+    for (;;) {
+        std::uint64_t id = 0;
+        std::string textPath;
+        std::vector<std::string> text;
+        bool restart = false, finished = false;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            auto ready = [this]{
+                return stopping || (!sessions.empty() && (!sessions.front().pending.empty() ||
+                                                          sessions.front().finished || sessions.front().restart));
+            };
+            while (!ready()) {
+                if (!cv.wait_for(lock, UNLOAD_AFTER, ready) && sessions.empty()) unloadModel();
+            }
+            if (stopping) break;
+            Session& s = sessions.front();
+            id = s.id;
+            textPath = s.textPath;
+            text.swap(s.pending);
+            restart = s.restart;
+            finished = s.finished;
+            s.restart = false;
+        }
+
+        bool ok = loadModel();
+        if (ok && restart) clearNote();
+        for (const std::string& t : text) {
+            if (ok) ok = feed(t, false, threadBudget(!finished));
+        }
+
+        std::string title, summary;
+        if (ok && finished) {
+            // nothing was streamed (a copied transcript, a note from disk)
+            if (noteTokens == 0) ok = feed(readNoteText(textPath), false, threadBudget(false));
+            std::string reply;
+            if (ok && noteTokens > 0 && generate(reply, threadBudget(false))) parseReply(reply, title, summary);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            const bool current = !sessions.empty() && sessions.front().id == id && !sessions.front().restart;
+            if (!ok && !model) {
+                // no usable model: drop what is queued instead of retrying on every event
+                sessions.clear();
+            } else if (current && (finished || !ok)) {
+                // a note that failed is not retried
+                sessions.pop_front();
+            }
+        }
+        // the next note starts from the prefix
+        if (!ok) clearNote();
+
+        if (!title.empty()) {
+            const std::string base = fs::path(textPath).stem().string();
+            std::ofstream out(dirOf(textPath) + SUMMARIES_FILE, std::ios::app);
+            out << oneLine(base) << '\t' << oneLine(title) << '\t' << oneLine(summary) << '\n';
+
+            TranscriptionEvent ev;
+            ev.type = TranscriptionEvent::Type::Summarized;
+            ev.textPath = textPath;
+            ev.text = title;
+            TranscriptionEngine::instance().postEvent(std::move(ev));
+        }
+    }
+    unloadModel();
+}
+
+bool NoteSummarizer::loadModel() {
+    const std::string path = Settings::summary_model_path;
+    if (lctx && loadedPath == path) return true;
+    unloadModel();
+    if (path.empty()) return false;
+
+    llama_backend_init();
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;   // small model; the GPU, if any, belongs to whisper
+    model = llama_model_load_from_file(path.c_str(), mparams);
+    if (!model) {
+        std::cerr << "Failed to load summary model '" << path << "'\n";
+        return false;
+    }
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = CONTEXT_TOKENS;
+    cparams.n_batch = BATCH_TOKENS;
+    cparams.n_threads = cparams.n_threads_batch = threadBudget(false);
+    cparams.no_perf = true;
+    lctx = llama_init_from_model(model, cparams);
+    if (!lctx) {
+        std::cerr << "Failed to create a context for '" << path << "'\n";
+        unloadModel();
+        return false;
+    }
+    vocab = llama_model_get_vocab(model);
+    sampler = llama_sampler_init_greedy();
+
+    // The note goes where the template puts the user's message: everything
+    // before it is the cached prefix, everything after it the suffix
+    const std::string mark = "\x01";
+    const llama_chat_message chat[] = {{"system", INSTRUCTION}, {"user", mark.c_str()}};
+    std::string prompt;
+    if (const char* tmpl = llama_model_chat_template(model, nullptr)) {
+        std::vector<char> buf(4096);
+        int n = llama_chat_apply_template(tmpl, chat, 2, true, buf.data(), (int) buf.size());
+        if (n > (int) buf.size()) {
+            buf.resize((std::size_t) n);
+            n = llama_chat_apply_template(tmpl, chat, 2, true, buf.data(), (int) buf.size());
+        }
+        if (n > 0) prompt.assign(buf.data(), (std::size_t) n);
+    }
+    std::size_t at = prompt.find(mark);
+    if (at == std::string::npos) {
+        // no usable chat template: plain completion
+        prompt = std::string(INSTRUCTION) + "\n\nTranscript:\n" + mark + "\nReply:\n";
+        at = prompt.find(mark);
+    }
+    suffix = prompt.substr(at + mark.size());
+
+    loadedPath = path;
+    cached = noteTokens = 0;
+    const std::string prefix = prompt.substr(0, at);
+    std::vector<llama_token> tokens(prefix.size() + 8);
+    const int n = llama_tokenize(vocab, prefix.c_str(), (int) prefix.size(), tokens.data(), (int) tokens.size(), true, true);
+    if (n < 0 || (n > 0 && llama_decode(lctx, llama_batch_get_one(tokens.data(), n)) != 0)) {
+        std::cerr << "Failed to evaluate the summary prompt\n";
+        unloadModel();
+        return false;
+    }
+    prefixTokens = cached = n;
+    return true;
+}
+
+void NoteSummarizer::unloadModel() {
+    if (sampler) llama_sampler_free(sampler);
+    if (lctx) llama_free(lctx);
+    if (model) llama_model_free(model);
+    sampler = nullptr;
+    lctx = nullptr;
+    model = nullptr;
+    vocab = nullptr;
+    loadedPath.clear();
+    prefixTokens = cached = noteTokens = 0;
+}
+
+void NoteSummarizer::clearNote() {
+    if (!lctx) return;
+    llama_memory_seq_rm(llama_get_memory(lctx), 0, prefixTokens, -1);
+    cached = prefixTokens;
+    noteTokens = 0;
+}
+
+bool NoteSummarizer::feed(const std::string& text, bool special, int threads) {
+    if (!lctx || text.empty()) return lctx != nullptr;
+    std::vector<llama_token> tokens(text.size() + 8);
+    int n = llama_tokenize(vocab, text.c_str(), (int) text.size(), tokens.data(), (int) tokens.size(), false, special);
+    if (n < 0) return false;
+    if (!special) {
+        // the end of a long note is left out; the suffix and reply must still fit
+        const int room = CONTEXT_TOKENS - cached - MAX_REPLY_TOKENS - 64;
+        n = std::min(n, std::max(0, room));
+    }
+    llama_set_n_threads(lctx, threads, threads);
+    for (int i = 0; i < n; i += BATCH_TOKENS) {
+        const int count = std::min(BATCH_TOKENS, n - i);
+        if (llama_decode(lctx, llama_batch_get_one(tokens.data() + i, count)) != 0) return false;
+        cached += count;
+        if (!special) noteTokens += count;
+    }
+    return true;
+}
+
+bool NoteSummarizer::generate(std::string& out, int threads) {
+    if (!feed(suffix, true, threads)) return false;
+    llama_sampler_reset(sampler);
+    for (int i = 0; i < MAX_REPLY_TOKENS && cached < CONTEXT_TOKENS; ++i) {
+        llama_token tok = llama_sampler_sample(sampler, lctx, -1);
+        if (llama_vocab_is_eog(vocab, tok)) break;
+        char piece[256];
+        const int len = llama_token_to_piece(vocab, tok, piece, sizeof(piece), 0, false);
+        if (len > 0) out.append(piece, (std::size_t) len);
+        if (llama_decode(lctx, llama_batch_get_one(&tok, 1)) != 0) return false;
+        ++cached;
+    }
+    // the reply is not part of the next note's prompt
+    clearNote();
+    return true;
+}
@@ -0,0 +1,87 @@
+#ifndef NOTE_SUMMARIZER_H
+#define NOTE_SUMMARIZER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct TranscriptionEvent;
+struct llama_model;
+struct llama_context;
+struct llama_vocab;
+struct llama_sampler;
+
+// Titles and short summaries of transcribed notes from a small local LLM
+// (Settings::summary_model_path, a GGUF model for the llama library vendored
+// with whisper's talk-llama example).
+//
+// One llama context stays loaded: the instruction prefix is evaluated once and
+// kept in the KV cache across notes, and a note's segments are decoded into the
+// cache as whisper commits them. When the transcription finishes only the
+// closing part of the prompt and the ~30 output tokens are left to compute.
+// While whisper is working the summarizer keeps to a quarter of the thread
+// budget. Results go to <dir>/.summaries and out as Summarized events.
+class NoteSummarizer {
+public:
+    static NoteSummarizer& instance();
+
+    // Follows the transcription events: Started opens a note's session,
+    // Segment feeds it, Finished summarizes, Failed drops it and Refined
+    // summarizes the refined text. No-op without a summary model.
+    void observe(const TranscriptionEvent& ev);
+
+    // Note base -> title of the notes in dir (with trailing slash) summarized so far
+    static std::map<std::string, std::string> titles(const std::string& dir);
+
+    void shutdown();
+
+private:
+    NoteSummarizer() = default;
+    ~NoteSummarizer();
+    NoteSummarizer(const NoteSummarizer&) = delete;
+    NoteSummarizer& operator=(const NoteSummarizer&) = delete;
+
+    // One note; the front session is the one in the KV cache
+    struct Session {
+        std::uint64_t id = 0;
+        std::string textPath;
+        std::vector<std::string> pending;  // text not decoded yet
+        bool restart = true;               // drop what the cache holds of it
+        bool finished = false;             // all text is in, summarize
+    };
+
+    void run();
+    bool loadModel();
+    void unloadModel();
+    // Back to the bare instruction prefix
+    void clearNote();
+    // Decodes text after what the cache holds; false on a llama error
+    bool feed(const std::string& text, bool special, int threads);
+    bool generate(std::string& out, int threads);
+    Session* findLocked(const std::string& textPath);
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Session> sessions;
+    std::uint64_t nextId = 1;
+    std::thread worker;
+    bool stopping = false;
+
+    // Worker thread only
+    std::string loadedPath;
+    llama_model* model = nullptr;
+    llama_context* lctx = nullptr;
+    const llama_vocab* vocab = nullptr;
+    llama_sampler* sampler = nullptr;
+    std::string suffix;                    // closes the note and opens the reply
+    int prefixTokens = 0;                  // instruction tokens kept in the cache
+    int cached = 0;                        // tokens in the cache
+    int noteTokens = 0;                    // of those, the current note's
+};
+
+#endif // NOTE_SUMMARIZER_H
@@ -0,0 +1,73 @@
+#include "note_writer.h"
+#include "note_store.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+bool writeFileAtomic(const std::string& path, const std::string& data) {
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f) return false;
+        f.write(data.data(), (std::streamsize)data.size());
+        f.flush();
+        if (!f) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+NoteWriter::~NoteWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) worker.join();
+}
+
+void NoteWriter::save(const std::string& path, std::string text) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        queued[path] = std::move(text);
+        if (!worker.joinable()) worker = std::thread([this]{ run(); });
+    }
+    cv.notify_all();
+}
+
+bool NoteWriter::isPending(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return writing == path || queued.count(path) != 0;
+}
+
+void NoteWriter::flush() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{ return queued.empty() && writing.empty(); });
+}
+
+void NoteWriter::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    for (;;) {
+        cv.wait(lock, [this]{ return stopping || !queued.empty(); });
+        if (queued.empty()) break; // stopping, and everything is written
+
+        auto it = queued.begin();
+        const std::string path = it->first;
+        std::string text = std::move(it->second);
+        queued.erase(it);
+        writing = path;
+
+        lock.unlock();
+        if (!writeNoteText(path, text)) std::cerr << "Failed to save " << path << "\n";
+        lock.lock();
+
+        writing.clear();
+        cv.notify_all();
+    }
+}
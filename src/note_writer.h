@@ -0,0 +1,40 @@
+#ifndef NOTE_WRITER_H
+#define NOTE_WRITER_H
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Write data to <path>.tmp and rename it over path, so a crash mid-write
+// leaves either the old or the new file, never a truncated one
+bool writeFileAtomic(const std::string& path, const std::string& data);
+
+// Background I/O thread for note autosaves. Saves to the same path coalesce:
+// if a write is still queued, the newer text replaces it.
+class NoteWriter {
+public:
+    NoteWriter() = default;
+    ~NoteWriter();
+    NoteWriter(const NoteWriter&) = delete;
+    NoteWriter& operator=(const NoteWriter&) = delete;
+
+    void save(const std::string& path, std::string text);
+    // True while a write for path is queued or in progress
+    bool isPending(const std::string& path);
+    // Block until everything queued so far is on disk
+    void flush();
+
+private:
+    void run();
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::map<std::string, std::string> queued; // path -> newest text
+    std::string writing;                       // path being written ("" when idle)
+    bool stopping = false;
+    std::thread worker;
+};
+
+#endif // NOTE_WRITER_H
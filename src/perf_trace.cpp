@@ -0,0 +1,251 @@
+#include "perf_trace.h"
+#include "whisper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#if defined(_WIN32)
+  #define WIN32_LEAN_AND_MEAN
+  #include <windows.h>
+  #include <psapi.h>
+#elif defined(__APPLE__)
+  #include <mach/mach.h>
+#else
+  #include <unistd.h>
+#endif
+
+namespace {
+
+// About a minute of a busy session
+const std::size_t CAPACITY = 16384;
+
+int threadIndex() {
+    static std::atomic<int> next{1};
+    thread_local int id = next++;
+    return id;
+}
+
+PerfTrace::Stages stagesOf(whisper_state* state) {
+    PerfTrace::Stages s;
+    if (!state) return s;
+    const whisper_metrics m = whisper_get_metrics_from_state(state);
+    s.mel = m.t_mel_us;
+    s.encode = m.t_encode_us;
+    s.decode = m.t_decode_us;
+    s.batchd = m.t_batchd_us;
+    s.prompt = m.t_prompt_us;
+    s.sample = m.t_sample_us;
+    s.vad = m.t_vad_us;
+    return s;
+}
+
+void writeName(std::ofstream& out, const char* s) {
+    out << '"';
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') out << '\\';
+        if ((unsigned char) *s >= 0x20) out << *s;
+    }
+    out << '"';
+}
+
+} // namespace
+
+PerfTrace& PerfTrace::instance() {
+    static PerfTrace trace;
+    return trace;
+}
+
+std::int64_t PerfTrace::nowUs() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void PerfTrace::push(Event ev) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (ring.size() < CAPACITY) {
+        ring.push_back(ev);
+    } else {
+        ring[head] = ev;
+        head = (head + 1) % CAPACITY;
+    }
+}
+
+void PerfTrace::span(const char* cat, const char* name, std::int64_t startUs, std::int64_t endUs) {
+    Event ev;
+    ev.cat = cat;
+    ev.name = name;
+    ev.start = startUs;
+    ev.end = endUs;
+    ev.tid = threadIndex();
+    push(ev);
+}
+
+bool PerfTrace::dump(const std::string& path, double seconds) {
+    std::vector<Event> events;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        events.reserve(ring.size());
+        // oldest first
+        events.insert(events.end(), ring.begin() + (std::ptrdiff_t) head, ring.end());
+        events.insert(events.end(), ring.begin(), ring.begin() + (std::ptrdiff_t) head);
+    }
+    const std::int64_t from = nowUs() - (std::int64_t) (seconds * 1e6);
+
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) return false;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for (const Event& ev : events) {
+        if (ev.end < from) continue;
+        if (!first) out << ",\n";
+        first = false;
+        out << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << ev.tid << ",\"ts\":" << ev.start << ",\"dur\":" << (ev.end - ev.start)
+            << ",\"cat\":";
+        writeName(out, ev.cat);
+        out << ",\"name\":";
+        writeName(out, ev.name);
+        if (ev.hasStages) {
+            const Stages& s = ev.stages;
+            out << ",\"args\":{\"mel_us\":" << s.mel << ",\"encode_us\":" << s.encode << ",\"decode_us\":" << s.decode
+                << ",\"batchd_us\":" << s.batchd << ",\"prompt_us\":" << s.prompt << ",\"sample_us\":" << s.sample
+                << ",\"vad_us\":" << s.vad << "}";
+        }
+        out << "}";
+    }
+    out << "\n]}\n";
+    return (bool) out;
+}
+
+PerfTrace::WhisperCall::WhisperCall(whisper_state* state, const char* name)
+    : state(state), name(name), start(nowUs()), before(stagesOf(state)) {}
+
+PerfTrace::WhisperCall::~WhisperCall() {
+    const Stages after = stagesOf(state);
+    Event ev;
+    ev.cat = "whisper";
+    ev.name = name;
+    ev.start = start;
+    ev.end = nowUs();
+    ev.tid = threadIndex();
+    ev.hasStages = true;
+    ev.stages.mel = after.mel - before.mel;
+    ev.stages.encode = after.encode - before.encode;
+    ev.stages.decode = after.decode - before.decode;
+    ev.stages.batchd = after.batchd - before.batchd;
+    ev.stages.prompt = after.prompt - before.prompt;
+    ev.stages.sample = after.sample - before.sample;
+    ev.stages.vad = after.vad - before.vad;
+
+    PerfTrace& t = instance();
+    {
+        std::lock_guard<std::mutex> lock(t.mtx);
+        if (t.jobStart.load() != 0) {
+            Stages& s = t.jobStages;
+            s.mel += ev.stages.mel;
+            s.encode += ev.stages.encode;
+            s.decode += ev.stages.decode;
+            s.batchd += ev.stages.batchd;
+            s.prompt += ev.stages.prompt;
+            s.sample += ev.stages.sample;
+            s.vad += ev.stages.vad;
+        }
+    }
+    t.push(ev);
+}
+
+PerfTrace::Job::Job(double audioSeconds) {
+    PerfTrace& t = instance();
+    {
+        std::lock_guard<std::mutex> lock(t.mtx);
+        t.jobStages = Stages();
+    }
+    t.jobAudio = audioSeconds;
+    t.jobDone = 0.0;
+    t.jobStart = nowUs();
+}
+
+PerfTrace::Job::~Job() {
+    PerfTrace& t = instance();
+    const std::int64_t start = t.jobStart.exchange(0);
+    t.span("transcribe", "file", start, nowUs());
+}
+
+void PerfTrace::jobProgress(double fraction) {
+    jobDone = std::clamp(fraction, 0.0, 1.0);
+}
+
+double PerfTrace::realtimeFactor() const {
+    const std::int64_t start = jobStart.load();
+    if (start == 0) return 0.0;
+    const double wall = (nowUs() - start) / 1e6;
+    return wall > 0.0 ? jobAudio.load() * jobDone.load() / wall : 0.0;
+}
+
+PerfTrace::Stages PerfTrace::stages() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return jobStages;
+}
+
+void PerfTrace::beginPath(const char* input, std::int64_t ageUs) {
+    std::lock_guard<std::mutex> lock(mtx);
+    pathStart = pathPrev = nowUs() - std::max<std::int64_t>(0, ageUs);
+    pathText = std::string(input) + ":";
+}
+
+void PerfTrace::pathStep(const char* step) {
+    std::int64_t from, to;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (pathStart == 0) return;
+        from = pathPrev;
+        to = pathPrev = nowUs();
+        char ms[32];
+        std::snprintf(ms, sizeof(ms), " %.1f", (to - from) / 1000.0);
+        if (pathText.back() != ':') pathText += " >";
+        pathText += std::string(" ") + step + ms;
+    }
+    span("latency", step, from, to);
+}
+
+void PerfTrace::endPath(const char* step) {
+    pathStep(step);
+    std::string line;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (pathStart == 0) return;
+        char ms[32];
+        std::snprintf(ms, sizeof(ms), " = %.1f ms", (pathPrev - pathStart) / 1000.0);
+        lastPathText = pathText + ms;
+        pathStart = 0;
+        line = lastPathText;
+    }
+    std::cout << "Latency " << line << "\n";
+}
+
+std::string PerfTrace::lastPath() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return lastPathText;
+}
+
+std::uint64_t PerfTrace::residentBytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return pmc.WorkingSetSize;
+    return 0;
+#elif defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) == KERN_SUCCESS) {
+        return info.resident_size;
+    }
+    return 0;
+#else
+    std::ifstream statm("/proc/self/statm");
+    std::uint64_t pages = 0, resident = 0;
+    if (!(statm >> pages >> resident)) return 0;
+    return resident * (std::uint64_t) sysconf(_SC_PAGESIZE);
+#endif
+}
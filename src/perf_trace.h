@@ -0,0 +1,113 @@
+#ifndef PERF_TRACE_H
+#define PERF_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct whisper_state;
+
+// Field diagnostics: a ring of the last few thousand timed spans (UI
+// frames, transcription jobs, whisper calls with their stage times) that
+// can be written as a Chrome trace (chrome://tracing, ui.perfetto.dev), plus
+// the live numbers the performance overlay shows. Always recording;
+// a span costs a clock read and a short lock.
+class PerfTrace {
+public:
+    static PerfTrace& instance();
+    static std::int64_t nowUs();
+
+    // Time whisper spent per stage, in us
+    struct Stages {
+        std::int64_t mel = 0, encode = 0, decode = 0, batchd = 0, prompt = 0, sample = 0, vad = 0;
+    };
+
+    void span(const char* cat, const char* name, std::int64_t startUs, std::int64_t endUs);
+    // Spans of the last `seconds`; false when the file cannot be written
+    bool dump(const std::string& path, double seconds);
+
+    // Times the enclosing block
+    class Scope {
+    public:
+        Scope(const char* cat, const char* name) : cat(cat), name(name), start(nowUs()) {}
+        ~Scope() { instance().span(cat, name, start, nowUs()); }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        const char* cat;
+        const char* name;
+        std::int64_t start;
+    };
+
+    // Around one whisper_full call: a span carrying the stage times the
+    // state's counters moved by, which also add up into stages()
+    class WhisperCall {
+    public:
+        WhisperCall(whisper_state* state, const char* name);
+        ~WhisperCall();
+        WhisperCall(const WhisperCall&) = delete;
+        WhisperCall& operator=(const WhisperCall&) = delete;
+    private:
+        whisper_state* state;
+        const char* name;
+        std::int64_t start;
+        Stages before;
+    };
+
+    // The file transcription running now, for the realtime factor
+    class Job {
+    public:
+        explicit Job(double audioSeconds);
+        ~Job();
+        Job(const Job&) = delete;
+        Job& operator=(const Job&) = delete;
+    };
+    // Share of the running job's audio done (0..1)
+    void jobProgress(double fraction);
+    // Audio seconds per wall-clock second of the running job; 0 when none
+    double realtimeFactor() const;
+    // Stage times of the running (or last) file transcription
+    Stages stages() const;
+
+    // Resident memory of the process; 0 where unknown
+    static std::uint64_t residentBytes();
+
+    // Latency of one action through its stages, e.g. a hotkey press to the
+    // running capture: beginPath() where the input arrives (`ageUs` earlier
+    // when the OS stamped it), pathStep() at each stage, endPath() logs the
+    // whole path and keeps it for the overlay. Steps are trace spans too.
+    void beginPath(const char* input, std::int64_t ageUs = 0);
+    void pathStep(const char* step);
+    void endPath(const char* step);
+    // "hotkey: ui 0.4 > device 0.1 > capture 3.2 = 3.7 ms"; "" before the first
+    std::string lastPath() const;
+
+private:
+    PerfTrace() = default;
+
+    struct Event {
+        const char* cat = "";
+        const char* name = "";
+        std::int64_t start = 0, end = 0;
+        int tid = 0;
+        bool hasStages = false;
+        Stages stages;
+    };
+    void push(Event ev);
+
+    mutable std::mutex mtx;
+    std::vector<Event> ring;             // grows to CAPACITY, then wraps
+    std::size_t head = 0;                // next slot once full
+
+    std::int64_t pathStart = 0, pathPrev = 0;  // under mtx; 0 = no path open
+    std::string pathText, lastPathText;
+
+    std::atomic<std::int64_t> jobStart{0};
+    std::atomic<double> jobAudio{0.0};
+    std::atomic<double> jobDone{0.0};
+    Stages jobStages;                    // under mtx
+};
+
+#endif // PERF_TRACE_H
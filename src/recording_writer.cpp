@@ -0,0 +1,139 @@
+#include "recording_writer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace {
+
+// 16-bit PCM header; the sizes are patched as the data grows
+const std::size_t WAV_HEADER_BYTES = 44;
+// How often the WAV header catches up with the data
+const auto HEADER_PATCH_INTERVAL = std::chrono::seconds(1);
+
+void putLe(char* dst, std::uint32_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) dst[i] = (char) ((v >> (8 * i)) & 0xff);
+}
+
+bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+RecordingWriter::~RecordingWriter() {
+    finish();
+    if (worker.joinable()) worker.join();
+}
+
+bool RecordingWriter::start(const std::string& audioPath, unsigned sampleRate, unsigned channelCount,
+                            const std::vector<sf::SoundChannel>& channelMap) {
+    path = audioPath;
+    channels = channelCount ? channelCount : 1;
+    wav = endsWith(path, ".wav");
+    peaks.reset(sampleRate, channels);
+
+    if (wav) {
+        wavFile.open(path, std::ios::binary | std::ios::trunc);
+        if (!wavFile) {
+            discard = true;
+            return false;
+        }
+
+        char header[WAV_HEADER_BYTES] = {};
+        std::copy_n("RIFF", 4, header);
+        std::copy_n("WAVEfmt ", 8, header + 8);
+        putLe(header + 16, 16, 4);                          // fmt chunk size
+        putLe(header + 20, 1, 2);                           // PCM
+        putLe(header + 22, channels, 2);
+        putLe(header + 24, sampleRate, 4);
+        putLe(header + 28, sampleRate * channels * 2, 4);   // byte rate
+        putLe(header + 32, channels * 2, 2);                // block align
+        putLe(header + 34, 16, 2);                          // bits per sample
+        std::copy_n("data", 4, header + 36);
+        wavFile.write(header, sizeof(header));
+        patchWavHeader();
+    } else if (!encoded.openFromFile(path, sampleRate, channels, channelMap)) {
+        discard = true;
+        return false;
+    }
+
+    worker = std::thread([this]{ run(); });
+    return true;
+}
+
+void RecordingWriter::feed(const std::int16_t* samples, std::size_t count) {
+    if (discard.load()) return;
+    // Same policy as LiveTranscriber::feed: never drop audio, spin only while
+    // the writer is badly behind
+    std::size_t written = 0;
+    while (written < count) {
+        written += ring.push(samples + written, count - written);
+        if (written < count) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void RecordingWriter::finish() {
+    finishing = true;
+}
+
+// Writes what the ring holds; false when it was empty
+bool RecordingWriter::drainRing() {
+    // keep whole frames, the encoders write interleaved frames
+    std::size_t avail = ring.size();
+    avail -= avail % channels;
+    if (avail == 0) return false;
+
+    scratch.resize(avail);
+    const std::size_t n = ring.pop(scratch.data(), avail);
+    peaks.push(scratch.data(), n);
+    if (wav) {
+        // WAV is little-endian, like every platform the app ships on
+        wavFile.write(reinterpret_cast<const char*>(scratch.data()), (std::streamsize) (n * sizeof(std::int16_t)));
+        wavBytes += n * sizeof(std::int16_t);
+    } else {
+        encoded.write(scratch.data(), n);
+    }
+    return true;
+}
+
+void RecordingWriter::patchWavHeader() {
+    // RIFF sizes are 32-bit; past 4 GiB the header stays at the maximum
+    const std::uint32_t data = (std::uint32_t) std::min<std::uint64_t>(wavBytes, 0xffffffffu - WAV_HEADER_BYTES);
+    char size[4];
+    const std::streampos end = wavFile.tellp();
+    putLe(size, data + (std::uint32_t) (WAV_HEADER_BYTES - 8), 4);
+    wavFile.seekp(4);
+    wavFile.write(size, 4);
+    putLe(size, data, 4);
+    wavFile.seekp(40);
+    wavFile.write(size, 4);
+    wavFile.seekp(end);
+    wavFile.flush();
+}
+
+void RecordingWriter::run() {
+    auto lastPatch = std::chrono::steady_clock::now();
+    while (true) {
+        const bool last = finishing.load();
+        const bool wrote = drainRing();
+        if (wav && wrote && std::chrono::steady_clock::now() - lastPatch >= HEADER_PATCH_INTERVAL) {
+            patchWavHeader();
+            lastPatch = std::chrono::steady_clock::now();
+        }
+        // the capture thread is joined before finish(), so an empty ring is the end
+        if (last && ring.size() < channels) break;
+        if (!wrote) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    if (wav) {
+        patchWavHeader();
+        wavFile.close();
+    } else {
+        encoded.close();
+    }
+    std::cout << "Saved: " << path << "\n";
+    peaks.finish();
+    if (!peaks.save(peaksPath(path))) std::cerr << "Failed to save the waveform of " << path << "\n";
+    done = true;
+}
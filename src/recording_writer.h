@@ -0,0 +1,69 @@
+#ifndef RECORDING_WRITER_H
+#define RECORDING_WRITER_H
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <SFML/Audio/OutputSoundFile.hpp>
+#include <SFML/Audio/SoundChannel.hpp>
+
+#include "spsc_ring.h"
+#include "waveform.h"
+
+// Writes the capture to disk while recording instead of keeping the whole take
+// in memory until stop.
+//
+// The capture thread feeds raw 16-bit PCM into a lock-free ring; a writer
+// thread drains it into the file. WAV is written directly and its RIFF/data
+// sizes are patched every second, so after a crash the file still plays up to
+// the last patch; FLAC and Ogg go through the SFML encoders. Stopping only
+// signals the thread, which writes the tail and closes the file on its own,
+// then saves the waveform overview built along the way.
+class RecordingWriter {
+public:
+    RecordingWriter() = default;
+    ~RecordingWriter();
+    RecordingWriter(const RecordingWriter&) = delete;
+    RecordingWriter& operator=(const RecordingWriter&) = delete;
+
+    // Opens the file, its format picked from the extension; feed() may already
+    // have queued samples of this format. On failure the samples are dropped
+    bool start(const std::string& audioPath, unsigned sampleRate, unsigned channelCount,
+               const std::vector<sf::SoundChannel>& channelMap);
+    // Capture thread only
+    void feed(const std::int16_t* samples, std::size_t count);
+    // Capture stopped: write what is left and close the file
+    void finish();
+    // True once the file is closed (or never opened)
+    bool isDone() const { return done.load() || discard.load(); }
+    const std::string& audioPath() const { return path; }
+
+private:
+    void run();
+    bool drainRing();
+    void patchWavHeader();
+
+    std::string path;
+    unsigned channels = 1;
+
+    bool wav = false;
+    std::ofstream wavFile;               // WAV: header + raw little-endian PCM
+    std::uint64_t wavBytes = 0;          // PCM bytes after the header
+    sf::OutputSoundFile encoded;         // FLAC, Ogg
+
+    SpscRing<std::int16_t> ring{1 << 20}; // ~65 s at 16 kHz mono of headroom
+    std::thread worker;
+    std::atomic<bool> finishing{false};
+    std::atomic<bool> done{false};
+    std::atomic<bool> discard{false};    // the file failed to open, feed() drops the samples
+
+    std::vector<std::int16_t> scratch;   // drained samples
+    WaveformPyramid peaks;               // saved next to the file when it closes
+};
+
+#endif // RECORDING_WRITER_H
@@ -0,0 +1,182 @@
+#include "remote_whisper.h"
+#include "settings.h"
+#include "transcription_engine.h"
+
+#include "server/httplib.h"
+#include "json.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+
+using json = nlohmann::json;
+
+namespace {
+
+// a probe result is trusted for this long
+const auto PROBE_VALID = std::chrono::seconds(30);
+const auto PROBE_TIMEOUT = std::chrono::seconds(1);
+// a pass over a window should take a fraction of it; longer and local is better anyway
+const auto STREAM_TIMEOUT = std::chrono::seconds(10);
+// weight of the newest pass in the running realtime factors
+const double RTF_WEIGHT = 0.3;
+
+struct Stats {
+    std::mutex mtx;
+    double localRtf = -1.0;    // < 0: not measured yet
+    double remoteRtf = -1.0;
+    double roundTripSec = 0.0; // of the last probe
+    std::string probedServer;
+    bool reachable = false;
+    std::chrono::steady_clock::time_point probedAt;
+};
+
+Stats& stats() {
+    static Stats s;
+    return s;
+}
+
+void record(double& rtf, double audioSec, double wallSec) {
+    if (audioSec <= 0.0) return;
+    const double r = wallSec / audioSec;
+    rtf = rtf < 0.0 ? r : (1.0 - RTF_WEIGHT) * rtf + RTF_WEIGHT * r;
+}
+
+std::unique_ptr<httplib::Client> makeClient(std::chrono::seconds readTimeout) {
+    auto client = std::make_unique<httplib::Client>(Settings::remote_server);
+    if (!client->is_valid()) return nullptr;
+    client->set_connection_timeout(PROBE_TIMEOUT);
+    client->set_read_timeout(readTimeout);
+    client->set_write_timeout(readTimeout);
+    return client;
+}
+
+// GET /health, timed; the caller holds the stats lock
+void probeLocked(Stats& s) {
+    const auto t0 = std::chrono::steady_clock::now();
+    auto client = makeClient(PROBE_TIMEOUT);
+    auto res = client ? client->Get("/health") : httplib::Result();
+    const auto t1 = std::chrono::steady_clock::now();
+
+    s.probedServer = Settings::remote_server;
+    s.probedAt = t1;
+    s.reachable = res && res->status == 200;
+    s.roundTripSec = std::chrono::duration<double>(t1 - t0).count();
+    if (!s.reachable) std::cerr << "Transcription server " << Settings::remote_server << " not reachable\n";
+}
+
+} // namespace
+
+bool RemoteWhisper::preferRemote(double windowSec) {
+    if (Settings::remote_server.empty()) return false;
+
+    Stats& s = stats();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    if (s.probedServer != Settings::remote_server || std::chrono::steady_clock::now() - s.probedAt > PROBE_VALID) {
+        probeLocked(s);
+    }
+    if (!s.reachable) return false;
+
+    // a model the user wants run there, or nothing to run here yet
+    if (!Settings::remote_model.empty()) return true;
+    if (!TranscriptionEngine::instance().isReady()) return true;
+
+    // measure the local side first; an unmeasured server is assumed to answer in a round trip
+    if (s.localRtf < 0.0) return false;
+    const double remoteSec = s.remoteRtf < 0.0 ? s.roundTripSec : s.remoteRtf * windowSec;
+    return remoteSec < s.localRtf * windowSec;
+}
+
+void RemoteWhisper::recordLocal(double audioSec, double wallSec) {
+    Stats& s = stats();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    record(s.localRtf, audioSec, wallSec);
+}
+
+void RemoteWhisper::recordRemote(double audioSec, double wallSec) {
+    Stats& s = stats();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    record(s.remoteRtf, audioSec, wallSec);
+}
+
+void RemoteWhisper::markUnreachable() {
+    Stats& s = stats();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    s.reachable = false;
+    s.probedAt = std::chrono::steady_clock::now();
+}
+
+struct RemoteStream::Impl {
+    std::unique_ptr<httplib::Client> client;
+    std::string session;
+    std::vector<char> body;   // s16le of the chunk being posted
+};
+
+RemoteStream::RemoteStream() : impl(std::make_unique<Impl>()) {}
+
+// A session left open (the app quit mid-note) is closed by the server once idle
+RemoteStream::~RemoteStream() = default;
+
+bool RemoteStream::open(int stepMs, int lengthMs, int keepMs) {
+    impl->client = makeClient(STREAM_TIMEOUT);
+    if (!impl->client) return false;
+
+    httplib::MultipartFormDataItems items = {
+        {"step_ms", std::to_string(stepMs), "", ""},
+        {"length_ms", std::to_string(lengthMs), "", ""},
+        {"keep_ms", std::to_string(keepMs), "", ""},
+    };
+    if (!Settings::remote_model.empty()) items.push_back({"model", Settings::remote_model, "", ""});
+
+    auto res = impl->client->Post("/stream", items);
+    if (!res || res->status != 200) {
+        std::cerr << "Failed to open a transcription stream on " << Settings::remote_server
+                  << (res ? ": " + res->body : "") << "\n";
+        return false;
+    }
+    try {
+        impl->session = json::parse(res->body).at("session").get<std::string>();
+    } catch (const std::exception& e) {
+        std::cerr << "Unexpected reply from " << Settings::remote_server << ": " << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool RemoteStream::send(const float* samples, std::size_t n, bool end, Reply& reply) {
+    if (impl->session.empty()) return false;
+
+    // half the bytes of f32le, and what the capture had in the first place
+    impl->body.resize(n * sizeof(std::int16_t));
+    auto* pcm = reinterpret_cast<std::int16_t*>(impl->body.data());
+    for (std::size_t i = 0; i < n; ++i) {
+        pcm[i] = (std::int16_t) std::lround(std::clamp(samples[i], -1.0f, 1.0f) * 32767.0f);
+    }
+
+    const std::string path = std::string(end ? "/stream/end" : "/stream/audio") + "?session=" + impl->session;
+    auto res = impl->client->Post(path, impl->body.data(), impl->body.size(), "application/octet-stream");
+    if (end) impl->session.clear();
+    if (!res || res->status != 200) {
+        std::cerr << "Transcription stream on " << Settings::remote_server << " failed"
+                  << (res ? ": " + res->body : ": " + httplib::to_string(res.error())) << "\n";
+        return false;
+    }
+
+    try {
+        const json jres = json::parse(res->body);
+        for (const auto& seg : jres.at("segments")) {
+            reply.segments.push_back({seg.at("start").get<double>(), seg.at("end").get<double>(),
+                                      seg.at("text").get<std::string>()});
+        }
+        reply.windowStart = jres.at("window_start").get<double>();
+        reply.transcribed = jres.contains("partial");
+        if (reply.transcribed) reply.partial = jres.at("partial").get<std::string>();
+    } catch (const std::exception& e) {
+        std::cerr << "Unexpected reply from " << Settings::remote_server << ": " << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
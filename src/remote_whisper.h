@@ -0,0 +1,63 @@
+#ifndef REMOTE_WHISPER_H
+#define REMOTE_WHISPER_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Live transcription offloaded to a whisper-server on the LAN (its /stream
+// endpoint, whisper/examples/server) at Settings::remote_server.
+//
+// Both sides are timed as notes are taken: the realtime factor of a local
+// window pass, and of a server round trip (network plus the server's pass
+// over the same window). A live session goes to the server when it is
+// reachable and expected to answer sooner, when Settings::remote_model
+// names a model to run there, or when no local model is loaded. Anything
+// else, an unreachable server included, stays local.
+class RemoteWhisper {
+public:
+    // Where the next live session runs; windowSec is its typical window.
+    // Probes the server (cached for a while), so it may block for a second
+    static bool preferRemote(double windowSec);
+    // A pass over audioSec of audio took wallSec
+    static void recordLocal(double audioSec, double wallSec);
+    static void recordRemote(double audioSec, double wallSec);
+    // The server stopped answering: stay local until the next probe
+    static void markUnreachable();
+};
+
+// One /stream session: raw 16 kHz mono audio in, finalized segments and the
+// partial text of the server's current window out
+class RemoteStream {
+public:
+    struct Segment {
+        double start = 0.0;   // seconds of the posted audio
+        double end = 0.0;
+        std::string text;
+    };
+
+    struct Reply {
+        std::vector<Segment> segments;
+        std::string partial;
+        bool transcribed = false;   // the server ran a pass over its window
+        double windowStart = 0.0;   // seconds; the audio before it is finalized
+    };
+
+    RemoteStream();
+    ~RemoteStream();
+    RemoteStream(const RemoteStream&) = delete;
+    RemoteStream& operator=(const RemoteStream&) = delete;
+
+    // Opens a session with the window geometry of LiveTranscriber
+    bool open(int stepMs, int lengthMs, int keepMs);
+    // Posts n samples; `end` finalizes the window and closes the session.
+    // False if the server failed or cannot be reached
+    bool send(const float* samples, std::size_t n, bool end, Reply& reply);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif // REMOTE_WHISPER_H
@@ -0,0 +1,313 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+static const char SEARCH_MAGIC[5] = {'V', 'N', 'S', 'I', 1};
+
+// ---------- tokenizer ----------
+
+static bool isWordByte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80 || c == '\'';
+}
+
+static std::vector<std::string> tokenize(const std::string& text) {
+    std::vector<std::string> out;
+    std::string cur;
+    auto flush = [&]{
+        // apostrophes only glue words together ("don't"), never stand alone
+        while (!cur.empty() && cur.back() == '\'') cur.pop_back();
+        std::size_t lead = 0;
+        while (lead < cur.size() && cur[lead] == '\'') ++lead;
+        if (lead < cur.size()) out.push_back(cur.substr(lead));
+        cur.clear();
+    };
+    for (unsigned char c : text) {
+        if (isWordByte(c)) cur.push_back((c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : char(c));
+        else if (!cur.empty()) flush();
+    }
+    if (!cur.empty()) flush();
+    return out;
+}
+
+// ---------- varint file helpers ----------
+
+static void putVar(std::string& out, std::uint64_t v) {
+    while (v >= 0x80) { out.push_back(char((v & 0x7f) | 0x80)); v >>= 7; }
+    out.push_back(char(v));
+}
+
+static void putStr(std::string& out, const std::string& s) {
+    putVar(out, s.size());
+    out += s;
+}
+
+struct Reader {
+    const std::string& buf;
+    std::size_t pos = 0;
+    bool ok = true;
+
+    std::uint64_t var() {
+        std::uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos >= buf.size()) { ok = false; return 0; }
+            unsigned char c = (unsigned char) buf[pos++];
+            v |= std::uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+    std::string str() {
+        const std::uint64_t n = var();
+        if (!ok || n > buf.size() - pos) { ok = false; return {}; }
+        std::string s = buf.substr(pos, (std::size_t) n);
+        pos += (std::size_t) n;
+        return s;
+    }
+};
+
+// ---------- index maintenance ----------
+
+bool SearchIndex::isCurrent(const std::string& base, std::int64_t mtime) const {
+    auto it = ids.find(base);
+    return it != ids.end() && docs[it->second].mtime == mtime;
+}
+
+void SearchIndex::removeDoc(std::uint32_t id) {
+    Doc& d = docs[id];
+    for (const auto& term : d.terms) {
+        auto it = postings.find(term);
+        if (it == postings.end()) continue;
+        auto& list = it->second;
+        auto p = std::lower_bound(list.begin(), list.end(), id,
+                                  [](const Posting& a, std::uint32_t v){ return a.doc < v; });
+        if (p != list.end() && p->doc == id) list.erase(p);
+        if (list.empty()) postings.erase(it);
+    }
+    totalLength -= d.length;
+    ids.erase(d.base);
+    d = Doc{};
+    freeIds.push_back(id);
+    dirty = true;
+}
+
+void SearchIndex::remove(const std::string& base) {
+    auto it = ids.find(base);
+    if (it != ids.end()) removeDoc(it->second);
+}
+
+void SearchIndex::retain(const std::unordered_set<std::string>& keep) {
+    std::vector<std::uint32_t> drop;
+    for (const auto& kv : ids) {
+        if (!keep.count(kv.first)) drop.push_back(kv.second);
+    }
+    for (auto id : drop) removeDoc(id);
+}
+
+void SearchIndex::update(const std::string& base, std::int64_t mtime, const std::string& text) {
+    remove(base);
+
+    std::uint32_t id;
+    if (!freeIds.empty()) { id = freeIds.back(); freeIds.pop_back(); }
+    else { id = (std::uint32_t) docs.size(); docs.emplace_back(); }
+
+    Doc& d = docs[id];
+    d.base = base;
+    d.mtime = mtime;
+    d.live = true;
+
+    std::map<std::string, std::vector<std::uint32_t>> local;
+    const std::vector<std::string> tokens = tokenize(text);
+    for (std::uint32_t i = 0; i < tokens.size(); ++i) local[tokens[i]].push_back(i);
+    d.length = (std::uint32_t) tokens.size();
+    totalLength += d.length;
+
+    d.terms.reserve(local.size());
+    for (auto& kv : local) {
+        auto& list = postings[kv.first];
+        auto p = std::lower_bound(list.begin(), list.end(), id,
+                                  [](const Posting& a, std::uint32_t v){ return a.doc < v; });
+        list.insert(p, Posting{id, std::move(kv.second)});
+        d.terms.push_back(kv.first);
+    }
+
+    ids[base] = id;
+    dirty = true;
+}
+
+// ---------- query ----------
+
+std::vector<SearchHit> SearchIndex::search(const std::string& query, std::size_t limit) const {
+    std::vector<SearchHit> hits;
+    const std::vector<std::string> words = tokenize(query);
+    const std::size_t nDocs = ids.size();
+    if (words.empty() || nDocs == 0) return hits;
+
+    const bool prefixLast = !query.empty() && isWordByte((unsigned char) query.back());
+    const double avgLen = std::max(1.0, (double) totalLength / (double) nDocs);
+    const double k1 = 1.2, b = 0.75;
+
+    struct Match {
+        double score = 0.0;
+        std::size_t words = 0;
+        std::vector<const std::vector<std::uint32_t>*> positions; // best term per query word
+    };
+    std::unordered_map<std::uint32_t, Match> matches;
+
+    for (std::size_t w = 0; w < words.size(); ++w) {
+        const std::string& word = words[w];
+
+        // Terms this word can match: itself, or every completion of the last word
+        std::vector<std::pair<const std::vector<Posting>*, double>> lists; // postings, weight
+        auto it = postings.lower_bound(word);
+        if (prefixLast && w + 1 == words.size()) {
+            for (; it != postings.end() && it->first.compare(0, word.size(), word) == 0; ++it) {
+                lists.emplace_back(&it->second, it->first.size() == word.size() ? 1.0 : 0.8);
+            }
+        } else if (it != postings.end() && it->first == word) {
+            lists.emplace_back(&it->second, 1.0);
+        }
+        if (lists.empty()) return hits; // AND semantics: nothing can match
+
+        std::unordered_map<std::uint32_t, std::pair<double, const std::vector<std::uint32_t>*>> best;
+        for (const auto& [list, weight] : lists) {
+            const double df = (double) list->size();
+            const double idf = std::log(1.0 + (nDocs - df + 0.5) / (df + 0.5));
+            for (const Posting& p : *list) {
+                const double tf = (double) p.positions.size();
+                const double len = (double) docs[p.doc].length;
+                const double s = weight * idf * tf * (k1 + 1.0) / (tf + k1 * (1.0 - b + b * len / avgLen));
+                auto& slot = best[p.doc];
+                if (s > slot.first) slot = {s, &p.positions};
+            }
+        }
+
+        for (const auto& [doc, sp] : best) {
+            auto mit = (w == 0) ? matches.try_emplace(doc).first : matches.find(doc);
+            if (mit == matches.end() || mit->second.words != w) continue; // missed an earlier word
+            Match& m = mit->second;
+            m.score += sp.first;
+            m.positions.push_back(sp.second);
+            m.words++;
+        }
+    }
+
+    for (auto& [doc, m] : matches) {
+        if (m.words != words.size()) continue;
+
+        // Phrase boost: consecutive query words at consecutive positions
+        double boost = 1.0;
+        for (std::size_t w = 1; w < m.positions.size(); ++w) {
+            const auto& prev = *m.positions[w - 1];
+            const auto& cur = *m.positions[w];
+            for (std::uint32_t p : prev) {
+                if (std::binary_search(cur.begin(), cur.end(), p + 1)) { boost += 0.5; break; }
+            }
+        }
+        hits.push_back(SearchHit{docs[doc].base, (float) (m.score * boost)});
+    }
+
+    std::sort(hits.begin(), hits.end(), [](const SearchHit& a, const SearchHit& b){
+        if (a.score != b.score) return a.score > b.score;
+        return a.base > b.base; // newest first on ties
+    });
+    if (hits.size() > limit) hits.resize(limit);
+    return hits;
+}
+
+// ---------- persistence ----------
+
+bool SearchIndex::save(const std::string& path) {
+    std::string out(SEARCH_MAGIC, sizeof(SEARCH_MAGIC));
+    putVar(out, docs.size());
+    for (const Doc& d : docs) {
+        out.push_back(d.live ? 1 : 0);
+        if (!d.live) continue;
+        putStr(out, d.base);
+        putVar(out, (std::uint64_t) d.mtime);
+        putVar(out, d.length);
+    }
+    putVar(out, postings.size());
+    for (const auto& [term, list] : postings) {
+        putStr(out, term);
+        putVar(out, list.size());
+        std::uint32_t prevDoc = 0;
+        for (const Posting& p : list) {
+            putVar(out, p.doc - prevDoc);
+            prevDoc = p.doc;
+            putVar(out, p.positions.size());
+            std::uint32_t prevPos = 0;
+            for (std::uint32_t pos : p.positions) { putVar(out, pos - prevPos); prevPos = pos; }
+        }
+    }
+
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f) return false;
+        f.write(out.data(), (std::streamsize) out.size());
+        if (!f) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) return false;
+    dirty = false;
+    return true;
+}
+
+bool SearchIndex::load(const std::string& path) {
+    *this = SearchIndex{};
+
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+    const std::string buf((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (buf.size() < sizeof(SEARCH_MAGIC) || buf.compare(0, sizeof(SEARCH_MAGIC), SEARCH_MAGIC, sizeof(SEARCH_MAGIC)) != 0) {
+        return false;
+    }
+
+    Reader r{buf, sizeof(SEARCH_MAGIC)};
+    const std::uint64_t nDocs = r.var();
+    if (!r.ok || nDocs > buf.size()) return false;
+    docs.resize((std::size_t) nDocs);
+    for (std::uint32_t id = 0; id < nDocs && r.ok; ++id) {
+        if (r.pos >= buf.size()) { r.ok = false; break; }
+        Doc& d = docs[id];
+        d.live = buf[r.pos++] != 0;
+        if (!d.live) { freeIds.push_back(id); continue; }
+        d.base = r.str();
+        d.mtime = (std::int64_t) r.var();
+        d.length = (std::uint32_t) r.var();
+        totalLength += d.length;
+        ids[d.base] = id;
+    }
+
+    const std::uint64_t nTerms = r.var();
+    for (std::uint64_t t = 0; t < nTerms && r.ok; ++t) {
+        std::string term = r.str();
+        const std::uint64_t n = r.var();
+        if (!r.ok || n > nDocs) { r.ok = false; break; }
+        auto& list = postings[term];
+        list.resize((std::size_t) n);
+        std::uint32_t doc = 0;
+        for (auto& p : list) {
+            doc += (std::uint32_t) r.var();
+            p.doc = doc;
+            const std::uint64_t np = r.var();
+            if (!r.ok || doc >= docs.size() || !docs[doc].live || np > buf.size()) { r.ok = false; break; }
+            p.positions.resize((std::size_t) np);
+            std::uint32_t pos = 0;
+            for (auto& v : p.positions) { pos += (std::uint32_t) r.var(); v = pos; }
+            docs[doc].terms.push_back(term);
+        }
+    }
+
+    if (!r.ok) {
+        *this = SearchIndex{};
+        return false;
+    }
+    return true;
+}
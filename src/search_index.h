@@ -0,0 +1,60 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct SearchHit {
+    std::string base;   // note base name
+    float score = 0.f;
+};
+
+// In-process inverted index over note text with positional postings.
+// Terms are lowercased ASCII words (UTF-8 bytes count as word characters).
+// search() ANDs the query words, treats the last one as a prefix while the
+// user is still typing, ranks with BM25 and boosts exact phrase matches.
+class SearchIndex {
+public:
+    // Compact binary cache; a missing or foreign file just means an empty index
+    bool load(const std::string& path);
+    bool save(const std::string& path);
+
+    // True if base was indexed from a file with this mtime
+    bool isCurrent(const std::string& base, std::int64_t mtime) const;
+    void update(const std::string& base, std::int64_t mtime, const std::string& text);
+    void remove(const std::string& base);
+    // Drop every note not in keep
+    void retain(const std::unordered_set<std::string>& keep);
+
+    std::vector<SearchHit> search(const std::string& query, std::size_t limit = 50) const;
+
+    bool unsaved() const { return dirty; }
+
+private:
+    struct Posting {
+        std::uint32_t doc = 0;
+        std::vector<std::uint32_t> positions;
+    };
+    struct Doc {
+        std::string base;
+        std::int64_t mtime = 0;
+        std::uint32_t length = 0;          // tokens
+        std::vector<std::string> terms;    // distinct terms, for removal
+        bool live = false;
+    };
+
+    void removeDoc(std::uint32_t id);
+
+    std::vector<Doc> docs;                                     // indexed by doc id
+    std::vector<std::uint32_t> freeIds;
+    std::unordered_map<std::string, std::uint32_t> ids;        // base -> doc id
+    std::map<std::string, std::vector<Posting>> postings;      // term -> postings sorted by doc
+    std::uint64_t totalLength = 0;
+    bool dirty = false;
+};
+
+#endif // SEARCH_INDEX_H
@@ -1,5 +1,7 @@
 #include "settings.h"
 #include <string>
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <iostream>
@@ -9,6 +11,24 @@
 // Define static members
 std::string Settings::voice_notes_path;
 std::string Settings::audio_input_device;
+std::string Settings::audio_loopback_device;
+std::string Settings::audio_format;
+std::string Settings::whisper_model_path;
+std::string Settings::model_preference;
+bool Settings::quantize_models;
+std::string Settings::whisper_device;
+bool Settings::flash_attention;
+std::string Settings::vad_model_path;
+std::string Settings::refine_model_path;
+std::string Settings::summary_model_path;
+std::string Settings::note_store;
+int Settings::preroll_seconds;
+bool Settings::skip_silence_on_playback;
+int Settings::transcription_threads;
+int Settings::transcription_processors;
+std::string Settings::power_policy;
+std::string Settings::remote_server;
+std::string Settings::remote_model;
 bool Settings::always_on_top;
 bool Settings::hide_in_taskbar;
 std::string Settings::keybinding_start_stop_recording;
@@ -23,6 +43,24 @@ Settings::Settings() {
 void Settings::reset_settings() {
     voice_notes_path = "voice_notes/";
     audio_input_device = "default";
+    audio_loopback_device = "";
+    audio_format = "wav";
+    note_store = "files";
+    whisper_model_path = "whisper/models/ggml-base.en.bin";
+    model_preference = "balanced";
+    quantize_models = false;
+    whisper_device = "auto";
+    flash_attention = true;
+    vad_model_path = "whisper/models/ggml-silero-v5.1.2.bin";
+    refine_model_path = "";
+    summary_model_path = "";
+    preroll_seconds = 0;
+    skip_silence_on_playback = true;
+    transcription_threads = 0;
+    transcription_processors = 0;
+    power_policy = "balanced";
+    remote_server = "";
+    remote_model = "";
     always_on_top = true;
     hide_in_taskbar = false;
     keybinding_start_stop_recording = "Ctrl+R";
@@ -36,6 +74,7 @@ SettingsManager::SettingsManager(const std::string& path) : settingsPath(path) {
     if(!readSettings(settingsPath)){
         std::cerr << "Failed to read settings. Using default values." << std::endl;
     }
+    takeChanges();
 }
 
 Settings SettingsManager::getSettings() const {
@@ -70,7 +109,11 @@ bool SettingsManager::readSettings(std::string path){
     // File exists, parse the settings
     std::string line;
 
-    std::string requiredKeys[] = {"voice_notes_path", "audio_input_device", "always_on_top", "hide_in_taskbar",
+    std::string requiredKeys[] = {"voice_notes_path", "audio_input_device", "audio_loopback_device", "audio_format", "note_store", "whisper_model_path", "model_preference", "refine_model_path", "summary_model_path",
+                                  "quantize_models", "whisper_device",
+                                  "flash_attention", "vad_model_path", "preroll_seconds", "skip_silence_on_playback",
+                                  "transcription_threads",
+                                  "transcription_processors", "power_policy", "remote_server", "remote_model", "always_on_top", "hide_in_taskbar",
                                   "keybinding_start_stop_recording", "keybinding_open_notes_window"};
 
     // Read line by line
@@ -82,6 +125,42 @@ bool SettingsManager::readSettings(std::string path){
                     Settings::voice_notes_path = value;
                 } else if (key == "audio_input_device") {
                     Settings::audio_input_device = value;
+                } else if (key == "audio_loopback_device") {
+                    Settings::audio_loopback_device = value;
+                } else if (key == "audio_format") {
+                    Settings::audio_format = value;
+                } else if (key == "note_store") {
+                    Settings::note_store = value;
+                } else if (key == "whisper_model_path") {
+                    Settings::whisper_model_path = value;
+                } else if (key == "model_preference") {
+                    Settings::model_preference = value;
+                } else if (key == "refine_model_path") {
+                    Settings::refine_model_path = value;
+                } else if (key == "summary_model_path") {
+                    Settings::summary_model_path = value;
+                } else if (key == "quantize_models") {
+                    Settings::quantize_models = (value == "true");
+                } else if (key == "whisper_device") {
+                    Settings::whisper_device = value;
+                } else if (key == "flash_attention") {
+                    Settings::flash_attention = (value == "true");
+                } else if (key == "vad_model_path") {
+                    Settings::vad_model_path = value;
+                } else if (key == "preroll_seconds") {
+                    Settings::preroll_seconds = std::clamp(std::atoi(value.c_str()), 0, 30);
+                } else if (key == "skip_silence_on_playback") {
+                    Settings::skip_silence_on_playback = (value == "true");
+                } else if (key == "transcription_threads") {
+                    Settings::transcription_threads = std::max(0, std::atoi(value.c_str()));
+                } else if (key == "transcription_processors") {
+                    Settings::transcription_processors = std::max(0, std::atoi(value.c_str()));
+                } else if (key == "power_policy") {
+                    Settings::power_policy = value;
+                } else if (key == "remote_server") {
+                    Settings::remote_server = value;
+                } else if (key == "remote_model") {
+                    Settings::remote_model = value;
                 } else if (key == "always_on_top") {
                     Settings::always_on_top = (value == "true");
                 } else if (key == "hide_in_taskbar") {
@@ -98,6 +177,48 @@ bool SettingsManager::readSettings(std::string path){
     return true;
 }
 
+std::vector<std::pair<std::string, std::string>> SettingsManager::values() {
+    auto flag = [](bool b) { return std::string(b ? "true" : "false"); };
+    return {
+        {"voice_notes_path", Settings::voice_notes_path},
+        {"audio_input_device", Settings::audio_input_device},
+        {"audio_loopback_device", Settings::audio_loopback_device},
+        {"audio_format", Settings::audio_format},
+        {"note_store", Settings::note_store},
+        {"whisper_model_path", Settings::whisper_model_path},
+        {"model_preference", Settings::model_preference},
+        {"refine_model_path", Settings::refine_model_path},
+        {"summary_model_path", Settings::summary_model_path},
+        {"quantize_models", flag(Settings::quantize_models)},
+        {"whisper_device", Settings::whisper_device},
+        {"flash_attention", flag(Settings::flash_attention)},
+        {"vad_model_path", Settings::vad_model_path},
+        {"preroll_seconds", std::to_string(Settings::preroll_seconds)},
+        {"skip_silence_on_playback", flag(Settings::skip_silence_on_playback)},
+        {"transcription_threads", std::to_string(Settings::transcription_threads)},
+        {"transcription_processors", std::to_string(Settings::transcription_processors)},
+        {"power_policy", Settings::power_policy},
+        {"remote_server", Settings::remote_server},
+        {"remote_model", Settings::remote_model},
+        {"always_on_top", flag(Settings::always_on_top)},
+        {"hide_in_taskbar", flag(Settings::hide_in_taskbar)},
+        {"keybinding_start_stop_recording", Settings::keybinding_start_stop_recording},
+        {"keybinding_open_notes_window", Settings::keybinding_open_notes_window},
+    };
+}
+
+std::set<std::string> SettingsManager::takeChanges() {
+    std::set<std::string> changed;
+    for (auto& [key, value] : values()) {
+        auto it = applied.find(key);
+        if (it == applied.end() || it->second != value) {
+            changed.insert(key);
+            applied[key] = std::move(value);
+        }
+    }
+    return changed;
+}
+
 const std::string& SettingsManager::getSettingsPath() const {
     return settingsPath;
 }
@@ -109,11 +230,6 @@ bool SettingsManager::writeSettings(const Settings& s) {
         return false;
     }
     // Persist in the same key=value format that readSettings() parses
-    out << "voice_notes_path=" << Settings::voice_notes_path << "\n";
-    out << "audio_input_device=" << Settings::audio_input_device << "\n";
-    out << "always_on_top=" << (Settings::always_on_top ? "true" : "false") << "\n";
-    out << "hide_in_taskbar=" << (Settings::hide_in_taskbar ? "true" : "false") << "\n";
-    out << "keybinding_start_stop_recording=" << Settings::keybinding_start_stop_recording << "\n";
-    out << "keybinding_open_notes_window=" << Settings::keybinding_open_notes_window << "\n";
+    for (const auto& [key, value] : values()) out << key << "=" << value << "\n";
     return true;
 }
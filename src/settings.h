@@ -1,12 +1,34 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+#include <map>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 class Settings {
 public:
     static std::string voice_notes_path;
     static std::string audio_input_device;
+    static std::string audio_loopback_device; // system audio (loopback/monitor) captured as the other speakers; "" = off
+    static std::string audio_format;        // container for new recordings: wav, flac or ogg
+    static std::string note_store;          // "files" (one .txt per note) or "packed" (one log + mapped index)
+    static std::string whisper_model_path;
+    static std::string model_preference;    // speed (q5), balanced (q8_0) or accuracy (full weights)
+    static std::string refine_model_path;   // larger model that re-transcribes notes when idle; "" = off
+    static std::string summary_model_path;  // small GGUF LLM that titles and summarizes notes; "" = off
+    static bool quantize_models;            // create the preferred variant in the background if missing
+    static std::string whisper_device;      // "auto", "cpu" or a ggml device name (e.g. "Vulkan0")
+    static bool flash_attention;
+    static std::string vad_model_path;      // Silero VAD for dropping silences; "" = off
+    static int preroll_seconds;             // keep the microphone open and start notes with this much earlier audio; 0 = off
+    static bool skip_silence_on_playback;
+    static int transcription_threads;       // 0 = one per physical core
+    static int transcription_processors;    // parallel sections for long notes; 0 = auto
+    static std::string power_policy;        // performance, balanced (background work yields on battery) or saver
+    static std::string remote_server;       // whisper-server for live notes when it is faster (e.g. "http://10.0.0.5:8080"); "" = off
+    static std::string remote_model;        // a model of the server's --models to always run there; "" = pick the faster side
     static bool always_on_top;
     static bool hide_in_taskbar;
     static std::string keybinding_start_stop_recording;
@@ -23,12 +45,18 @@ public:
     bool applySettings();
     const std::string& getSettingsPath() const;
     bool writeSettings(const Settings& s);
+    // Keys (as in settings.txt) whose value changed since the last call, so
+    // callers re-apply only what is affected
+    std::set<std::string> takeChanges();
 
 private:
     std::string settingsPath;
     Settings settings;
+    std::map<std::string, std::string> applied;   // key -> value at the last takeChanges()
 
     bool readSettings(std::string path);
+    // Every setting as key=value text, in file order
+    static std::vector<std::pair<std::string, std::string>> values();
 };
 
 #endif // SETTINGS_H
\ No newline at end of file
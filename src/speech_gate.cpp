@@ -0,0 +1,114 @@
+#include "speech_gate.h"
+#include "whisper.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+// Only silences longer than this are cut; shorter pauses are part of speech
+static const int MIN_SILENCE_MS = 1000;
+static const int SPEECH_PAD_MS  = 200;
+// What is left of a dropped silence, so words on either side stay apart
+static const std::uint64_t GAP_SAMPLES = WHISPER_SAMPLE_RATE / 10;
+
+SpeechGate::~SpeechGate() {
+    if (vctx) whisper_vad_free(vctx);
+}
+
+bool SpeechGate::open(const std::string& modelPath, int threads) {
+    if (vctx) return true;
+    if (modelPath.empty() || !std::filesystem::exists(modelPath)) return false;
+
+    whisper_vad_context_params cparams = whisper_vad_default_context_params();
+    cparams.n_threads = std::max(1, threads);
+    vctx = whisper_vad_init_from_file_with_params(modelPath.c_str(), cparams);
+    if (!vctx) {
+        std::cerr << "Failed to load VAD model '" << modelPath << "'\n";
+        return false;
+    }
+    return true;
+}
+
+void SpeechGate::keep(const float* samples, std::uint64_t begin, std::uint64_t end, std::vector<float>& out) {
+    if (end <= begin) return;
+    const std::uint64_t at = inPos + begin;
+
+    if (spans.empty() || spans.back().end < at) {
+        if (!spans.empty()) {
+            const std::uint64_t gap = std::min(GAP_SAMPLES, at - spans.back().end);
+            out.insert(out.end(), (std::size_t) gap, 0.0f);
+        }
+        spans.push_back({at, at});
+    }
+    out.insert(out.end(), samples + begin, samples + end);
+    spans.back().end = inPos + end;
+}
+
+void SpeechGate::push(const float* samples, std::size_t n, std::vector<float>& out) {
+    if (n == 0) return;
+    if (!vctx) {
+        keep(samples, 0, n, out);
+        inPos += n;
+        return;
+    }
+
+    whisper_vad_params params = whisper_vad_default_params();
+    params.min_silence_duration_ms = MIN_SILENCE_MS;
+    params.speech_pad_ms = SPEECH_PAD_MS;
+
+    whisper_vad_segments* segs = whisper_vad_segments_from_samples(vctx, params, samples, (int) n);
+    if (!segs) {
+        // keep the audio rather than lose words
+        keep(samples, 0, n, out);
+    } else {
+        const int count = whisper_vad_segments_n_segments(segs);
+        for (int i = 0; i < count; ++i) {
+            // centiseconds
+            const std::uint64_t t0 = (std::uint64_t) std::max(0.0f, whisper_vad_segments_get_segment_t0(segs, i)) * WHISPER_SAMPLE_RATE / 100;
+            const std::uint64_t t1 = (std::uint64_t) std::max(0.0f, whisper_vad_segments_get_segment_t1(segs, i)) * WHISPER_SAMPLE_RATE / 100;
+            keep(samples, std::min<std::uint64_t>(t0, n), std::min<std::uint64_t>(t1, n), out);
+        }
+        whisper_vad_free_segments(segs);
+    }
+    inPos += n;
+}
+
+std::uint64_t SpeechGate::toOriginal(std::uint64_t kept) const {
+    std::uint64_t pos = 0; // output samples before spans[i]
+    for (std::size_t i = 0; i < spans.size(); ++i) {
+        if (i > 0) {
+            const std::uint64_t gap = std::min(GAP_SAMPLES, spans[i].begin - spans[i - 1].end);
+            if (kept < pos + gap) return spans[i - 1].end + (kept - pos);
+            pos += gap;
+        }
+        const std::uint64_t len = spans[i].end - spans[i].begin;
+        if (kept < pos + len) return spans[i].begin + (kept - pos);
+        pos += len;
+    }
+    return spans.empty() ? kept : spans.back().end + (kept - pos);
+}
+
+std::string speechMapPath(const std::string& notePath) {
+    return std::filesystem::path(notePath).replace_extension(".speech").string();
+}
+
+bool saveSpeechMap(const std::string& path, const std::vector<SpeechSpan>& spans) {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) return false;
+    for (const SpeechSpan& s : spans) {
+        out << s.begin * 1000 / WHISPER_SAMPLE_RATE << '\t' << s.end * 1000 / WHISPER_SAMPLE_RATE << '\n';
+    }
+    return (bool) out;
+}
+
+bool loadSpeechMap(const std::string& path, std::vector<SpeechSpan>& spans) {
+    spans.clear();
+    std::ifstream in(path);
+    if (!in) return false;
+    std::uint64_t t0 = 0, t1 = 0;
+    while (in >> t0 >> t1) {
+        if (t1 > t0) spans.push_back({t0 * WHISPER_SAMPLE_RATE / 1000, t1 * WHISPER_SAMPLE_RATE / 1000});
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef SPEECH_GATE_H
+#define SPEECH_GATE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct whisper_vad_context;
+
+// One stretch of speech, in 16 kHz samples of the original recording
+struct SpeechSpan {
+    std::uint64_t begin = 0;
+    std::uint64_t end = 0;
+};
+
+// Drops long silences from 16 kHz mono audio with whisper's Silero VAD so
+// the encoder only sees speech. Audio is pushed in contiguous blocks as it
+// arrives; the gate records where the kept stretches are in the original
+// timeline, which is stored as a speech map for playback.
+// Without a VAD model the gate is inactive and passes everything through.
+class SpeechGate {
+public:
+    SpeechGate() = default;
+    ~SpeechGate();
+    SpeechGate(const SpeechGate&) = delete;
+    SpeechGate& operator=(const SpeechGate&) = delete;
+
+    // False (and inactive) if the model cannot be loaded
+    bool open(const std::string& modelPath, int threads);
+    bool active() const { return vctx != nullptr; }
+
+    // Appends the speech in [samples, samples + n) to out
+    void push(const float* samples, std::size_t n, std::vector<float>& out);
+
+    // Original samples pushed so far
+    std::uint64_t consumed() const { return inPos; }
+    const std::vector<SpeechSpan>& speech() const { return spans; }
+    // Original sample that a sample of the output (speech and the short gaps
+    // left between it) was taken from
+    std::uint64_t toOriginal(std::uint64_t kept) const;
+
+private:
+    void keep(const float* samples, std::uint64_t begin, std::uint64_t end, std::vector<float>& out);
+
+    whisper_vad_context* vctx = nullptr;
+    std::vector<SpeechSpan> spans;   // merged, original timeline
+    std::uint64_t inPos = 0;
+};
+
+// <base>.speech next to the note: one "begin_ms<TAB>end_ms" line per span
+std::string speechMapPath(const std::string& notePath);
+bool saveSpeechMap(const std::string& path, const std::vector<SpeechSpan>& spans);
+bool loadSpeechMap(const std::string& path, std::vector<SpeechSpan>& spans);
+
+#endif // SPEECH_GATE_H
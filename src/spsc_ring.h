@@ -0,0 +1,62 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Lock-free single-producer / single-consumer ring buffer.
+// The capture thread pushes, one consumer thread pops; neither ever blocks.
+template <typename T>
+class SpscRing {
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity = 1 << 16) {
+        size_t cap = 1;
+        while (cap < capacity) cap <<= 1;
+        buf.resize(cap);
+        mask = cap - 1;
+    }
+
+    // Producer side; returns how many items were written (may be < n when full)
+    size_t push(const T* data, size_t n) {
+        const size_t w = writePos.load(std::memory_order_relaxed);
+        const size_t r = readPos.load(std::memory_order_acquire);
+        const size_t room = buf.size() - (w - r);
+        if (n > room) n = room;
+        for (size_t i = 0; i < n; ++i) buf[(w + i) & mask] = data[i];
+        writePos.store(w + n, std::memory_order_release);
+        return n;
+    }
+
+    // Consumer side; returns how many items were read
+    size_t pop(T* out, size_t n) {
+        const size_t r = readPos.load(std::memory_order_relaxed);
+        const size_t w = writePos.load(std::memory_order_acquire);
+        const size_t avail = w - r;
+        if (n > avail) n = avail;
+        for (size_t i = 0; i < n; ++i) out[i] = buf[(r + i) & mask];
+        readPos.store(r + n, std::memory_order_release);
+        return n;
+    }
+
+    size_t size() const {
+        return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return buf.size(); }
+
+    // Only safe while neither side is active
+    void reset() {
+        readPos.store(0);
+        writePos.store(0);
+    }
+
+private:
+    std::vector<T> buf;
+    size_t mask = 0;
+    std::atomic<size_t> readPos{0};
+    std::atomic<size_t> writePos{0};
+};
+
+#endif // SPSC_RING_H
@@ -0,0 +1,74 @@
+#include "text_layout.h"
+
+#include <algorithm>
+#include <cmath>
+
+TextLayout::TextLayout(const sf::Font& font_, unsigned characterSize, float lineSpacing, sf::Color color_)
+    : font(font_), charSize(characterSize), spacing(lineSpacing), color(color_) {
+    lines.resize(1);
+}
+
+void TextLayout::update(const std::string& newText) {
+    // First byte that differs from what is laid out
+    const std::size_t common = std::min(text.size(), newText.size());
+    const std::size_t diff = static_cast<std::size_t>(
+        std::mismatch(text.begin(), text.begin() + common, newText.begin()).first - text.begin());
+    if (diff == text.size() && diff == newText.size()) return;
+
+    // Lines starting at or before diff are intact up to the line holding diff
+    std::size_t keep = static_cast<std::size_t>(std::upper_bound(starts.begin(), starts.end(), diff) - starts.begin());
+    if (keep == 0) keep = 1;
+    starts.resize(keep);
+    lines.resize(keep - 1);
+
+    text = newText;
+    for (std::size_t p = text.find('\n', starts.back()); p != std::string::npos; p = text.find('\n', p + 1)) {
+        starts.push_back(p + 1);
+    }
+    lines.resize(starts.size());
+}
+
+float TextLayout::lineHeight() const {
+    return font.getLineSpacing(charSize) * spacing;
+}
+
+std::size_t TextLayout::lineLength(std::size_t i) const {
+    const std::size_t end = (i + 1 < starts.size()) ? starts[i + 1] - 1 : text.size();
+    return end - starts[i];
+}
+
+TextLayout::Line& TextLayout::line(std::size_t i) {
+    std::optional<Line>& l = lines[i];
+    if (!l) {
+        l.emplace();
+        l->width = appendText(l->quads, font, charSize, sf::String(text.substr(starts[i], lineLength(i))), color);
+    }
+    return *l;
+}
+
+unsigned TextLayout::draw(sf::RenderTarget& target, sf::Vector2f origin, float scroll, float viewHeight) {
+    const float lh = lineHeight();
+    if (lh <= 0.f) return 0;
+
+    const float top = scroll - origin.y;
+    const std::size_t first = static_cast<std::size_t>(std::max(0.f, std::floor(top / lh)));
+    const std::size_t last  = std::min(lineCount(), static_cast<std::size_t>(std::max(0.f, std::ceil((top + viewHeight) / lh))) + 1);
+
+    batch.clear();
+    for (std::size_t i = first; i < last; ++i) {
+        batch.append(line(i).quads, sf::Vector2f(origin.x, origin.y - scroll + static_cast<float>(i) * lh));
+    }
+    // after shaping: new glyphs may have grown the page
+    return batch.draw(target, &font.getTexture(charSize));
+}
+
+sf::Vector2f TextLayout::endPosition() {
+    const std::size_t last = lineCount() - 1;
+    return sf::Vector2f(line(last).width, static_cast<float>(last) * lineHeight());
+}
+
+std::size_t TextLayout::lineAt(float y) const {
+    const float lh = lineHeight();
+    if (lh <= 0.f || y <= 0.f) return 0;
+    return std::min(lineCount() - 1, static_cast<std::size_t>(y / lh));
+}
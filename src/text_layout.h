@@ -0,0 +1,56 @@
+#ifndef TEXT_LAYOUT_H
+#define TEXT_LAYOUT_H
+
+#include <SFML/Graphics.hpp>
+#include "ui_batch.h"
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Line-indexed layout of the editor text. Keeps a copy of what it last laid
+// out; update() finds the first changed byte and only re-indexes and
+// re-shapes the lines from there on, so typing at the end of a long
+// transcript touches one line. draw() shapes visible lines only, caches
+// their glyph quads, and draws all of them in one call.
+class TextLayout {
+public:
+    TextLayout(const sf::Font& font, unsigned characterSize, float lineSpacing, sf::Color color);
+
+    void update(const std::string& text);
+
+    float lineHeight() const;
+    std::size_t lineCount() const { return starts.size(); }
+    float height() const { return lineHeight() * static_cast<float>(lineCount()); }
+
+    // Draw the lines that intersect [scroll, scroll + viewHeight) with the
+    // first line's top-left at origin.y - scroll; returns the draw calls issued
+    unsigned draw(sf::RenderTarget& target, sf::Vector2f origin, float scroll, float viewHeight);
+
+    // Offset from origin of the position just past the last character
+    sf::Vector2f endPosition();
+
+    // Line at y (from the first line's top), clamped to the last line
+    std::size_t lineAt(float y) const;
+    std::string lineText(std::size_t i) const { return text.substr(starts[i], lineLength(i)); }
+
+private:
+    struct Line {
+        std::vector<sf::Vertex> quads;       // glyphs at the origin
+        float width = 0.f;
+    };
+    Line& line(std::size_t i);
+    std::size_t lineLength(std::size_t i) const;
+
+    const sf::Font& font;
+    unsigned charSize;
+    float spacing;
+    sf::Color color;
+
+    std::string text;                        // what the index describes
+    std::vector<std::size_t> starts{0};      // byte offset of each line
+    std::vector<std::optional<Line>> lines;  // shaped lines, built on demand
+    QuadBatch batch;                         // visible lines of the last draw()
+};
+
+#endif // TEXT_LAYOUT_H
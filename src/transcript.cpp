@@ -0,0 +1,196 @@
+#include "transcript.h"
+#include "note_writer.h"
+#include "whisper.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+static const char TRANSCRIPT_MAGIC[4] = {'N', 'T', 'R', 'S'};
+static const std::uint32_t TRANSCRIPT_VERSION = 1;
+
+static_assert(sizeof(TranscriptHeader) == 32, "transcript header layout");
+static_assert(sizeof(TranscriptSegment) == 32, "transcript segment layout");
+static_assert(sizeof(TranscriptToken) == 24, "transcript token layout");
+
+// ---------- TranscriptBuilder ----------
+
+std::uint32_t TranscriptBuilder::addText(std::string_view s) {
+    const std::uint32_t at = (std::uint32_t) pool.size();
+    pool.append(s);
+    return at;
+}
+
+std::uint32_t TranscriptBuilder::tokenText(std::string_view s) {
+    auto it = tokenTexts.find(std::string(s));
+    if (it != tokenTexts.end()) return it->second;
+    const std::uint32_t at = addText(s);
+    tokenTexts.emplace(std::string(s), at);
+    return at;
+}
+
+void TranscriptBuilder::addSegments(whisper_context* ctx, whisper_state* state, int count, const TimeMap& toMs) {
+    // everything in one call; the arrays live in the state
+    whisper_results res{};
+    count = std::min(count, whisper_full_get_results_from_state(ctx, state, &res));
+
+    const whisper_token eot = whisper_token_eot(ctx);
+    for (int i = 0; i < count; ++i) {
+        const whisper_result_segment& rs = res.segments[i];
+        const std::string_view sv(res.text + rs.text, (std::size_t) rs.text_len);
+
+        TranscriptSegment seg{};
+        seg.t0Ms = toMs(rs.t0);
+        seg.t1Ms = std::max(seg.t0Ms, toMs(rs.t1));
+        seg.text = addText(sv);
+        seg.textLength = (std::uint32_t) sv.size();
+        seg.firstToken = (std::uint32_t) tokens.size();
+        seg.noSpeechProb = rs.no_speech_prob;
+        if (rs.speaker_turn_next) seg.flags |= TranscriptSegment::SPEAKER_TURN_NEXT;
+        if (whisper_full_get_segment_confidence_from_state(ctx, state, i) < TranscriptSegment::LOW_CONFIDENCE_BELOW) {
+            seg.flags |= TranscriptSegment::LOW_CONFIDENCE;
+        }
+
+        for (int j = rs.i_token; j < rs.i_token + rs.n_tokens; ++j) {
+            const whisper_token_data& data = res.tokens[j];
+            if (data.id >= eot) continue; // special and timestamp tokens
+            const std::string_view pv(res.text + res.token_text[j]);
+
+            TranscriptToken tok{};
+            tok.id = data.id;
+            tok.p = data.p;
+            if (data.t0 >= 0 && data.t1 >= data.t0) {
+                tok.t0Ms = std::clamp(toMs(data.t0), seg.t0Ms, seg.t1Ms);
+                tok.t1Ms = std::clamp(toMs(data.t1), tok.t0Ms, seg.t1Ms);
+            } else {
+                tok.t0Ms = seg.t0Ms;
+                tok.t1Ms = seg.t1Ms;
+            }
+            tok.text = tokenText(pv);
+            tok.textLength = (std::uint32_t) pv.size();
+            tokens.push_back(tok);
+        }
+        seg.tokenCount = (std::uint32_t) tokens.size() - seg.firstToken;
+        segments.push_back(seg);
+    }
+}
+
+void TranscriptBuilder::addSegment(std::uint32_t t0Ms, std::uint32_t t1Ms, std::string_view text) {
+    TranscriptSegment seg{};
+    seg.t0Ms = t0Ms;
+    seg.t1Ms = std::max(t0Ms, t1Ms);
+    seg.text = addText(text);
+    seg.textLength = (std::uint32_t) text.size();
+    seg.firstToken = (std::uint32_t) tokens.size();
+    segments.push_back(seg);
+}
+
+void TranscriptBuilder::addSegment(const TranscriptView& view, std::uint32_t i) {
+    TranscriptSegment seg = view.segments()[i];
+    seg.text = addText(view.text(seg.text, seg.textLength));
+    const std::uint32_t first = (std::uint32_t) tokens.size();
+    for (std::uint32_t k = 0; k < seg.tokenCount && seg.firstToken + k < view.tokenCount(); ++k) {
+        TranscriptToken tok = view.tokens()[seg.firstToken + k];
+        tok.text = tokenText(view.text(tok.text, tok.textLength));
+        tokens.push_back(tok);
+    }
+    seg.firstToken = first;
+    seg.tokenCount = (std::uint32_t) tokens.size() - first;
+    segments.push_back(seg);
+}
+
+void TranscriptBuilder::append(const TranscriptBuilder& other) {
+    const std::string_view from = other.pool;
+    for (TranscriptSegment seg : other.segments) {
+        seg.text = addText(from.substr(seg.text, seg.textLength));
+        const std::uint32_t first = (std::uint32_t) tokens.size();
+        for (std::uint32_t k = 0; k < seg.tokenCount; ++k) {
+            TranscriptToken tok = other.tokens[seg.firstToken + k];
+            tok.text = tokenText(from.substr(tok.text, tok.textLength));
+            tokens.push_back(tok);
+        }
+        seg.firstToken = first;
+        segments.push_back(seg);
+    }
+}
+
+bool TranscriptBuilder::save(const std::string& path) const {
+    TranscriptHeader h{};
+    std::memcpy(h.magic, TRANSCRIPT_MAGIC, sizeof(h.magic));
+    h.version = TRANSCRIPT_VERSION;
+    h.segmentCount = (std::uint32_t) segments.size();
+    h.tokenCount = (std::uint32_t) tokens.size();
+    h.poolBytes = (std::uint32_t) pool.size();
+
+    std::string out;
+    out.reserve(sizeof(h) + segments.size() * sizeof(TranscriptSegment) + tokens.size() * sizeof(TranscriptToken) + pool.size());
+    out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.append(reinterpret_cast<const char*>(segments.data()), segments.size() * sizeof(TranscriptSegment));
+    out.append(reinterpret_cast<const char*>(tokens.data()), tokens.size() * sizeof(TranscriptToken));
+    out.append(pool);
+    return writeFileAtomic(path, out);
+}
+
+// ---------- TranscriptView ----------
+
+bool TranscriptView::open(const std::string& path) {
+    close();
+    if (!file.open(path, false)) return false;
+
+    const std::size_t size = file.size();
+    const char* base = file.data();
+    if (size < sizeof(TranscriptHeader)) {
+        close();
+        return false;
+    }
+    const auto* h = reinterpret_cast<const TranscriptHeader*>(base);
+    const std::uint64_t need = sizeof(TranscriptHeader) + (std::uint64_t) h->segmentCount * sizeof(TranscriptSegment) +
+                               (std::uint64_t) h->tokenCount * sizeof(TranscriptToken) + h->poolBytes;
+    if (std::memcmp(h->magic, TRANSCRIPT_MAGIC, sizeof(h->magic)) != 0 || h->version != TRANSCRIPT_VERSION || need > size) {
+        close();
+        return false;
+    }
+    header = h;
+    segs = reinterpret_cast<const TranscriptSegment*>(base + sizeof(TranscriptHeader));
+    toks = reinterpret_cast<const TranscriptToken*>(segs + h->segmentCount);
+    pool = reinterpret_cast<const char*>(toks + h->tokenCount);
+    return true;
+}
+
+void TranscriptView::close() {
+    file.close();
+    header = nullptr;
+    segs = nullptr;
+    toks = nullptr;
+    pool = nullptr;
+}
+
+std::string_view TranscriptView::text(std::uint32_t offset, std::uint32_t length) const {
+    if (!header || (std::uint64_t) offset + length > header->poolBytes) return {};
+    return std::string_view(pool + offset, length);
+}
+
+int TranscriptView::segmentAt(std::uint32_t ms) const {
+    const TranscriptSegment* end = segs + segmentCount();
+    const TranscriptSegment* it = std::upper_bound(segs, end, ms,
+        [](std::uint32_t t, const TranscriptSegment& s) { return t < s.t0Ms; });
+    return (int) (it - segs) - 1;
+}
+
+std::vector<std::pair<std::uint32_t, std::uint32_t>> TranscriptView::lowConfidenceRuns() const {
+    const std::uint32_t n = segmentCount();
+    auto low = [this](std::uint32_t i) { return (segs[i].flags & TranscriptSegment::LOW_CONFIDENCE) != 0; };
+    auto inRun = [&](std::uint32_t i) { return low(i) || (i > 0 && low(i - 1)) || (i + 1 < n && low(i + 1)); };
+
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> runs;
+    for (std::uint32_t i = 0; i < n; ++i) {
+        if (!inRun(i)) continue;
+        if (!runs.empty() && runs.back().second == i) runs.back().second = i + 1;
+        else runs.push_back({i, i + 1});
+    }
+    return runs;
+}
+
+std::string transcriptPath(const std::string& notePath) {
+    return std::filesystem::path(notePath).replace_extension(".transcript").string();
+}
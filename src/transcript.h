@@ -0,0 +1,115 @@
+#ifndef TRANSCRIPT_H
+#define TRANSCRIPT_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.h"
+
+struct whisper_context;
+struct whisper_state;
+class TranscriptView;
+
+// <base>.transcript next to the note: what whisper knew about the text
+// beyond the words themselves, written once when the note is transcribed so
+// seeking playback to a word, confidence shading or timed search hits never
+// run whisper again. Times are ms of the recording (silences included).
+//
+// Layout, native byte order, every table 4-byte aligned:
+//   TranscriptHeader
+//   TranscriptSegment[segmentCount]
+//   TranscriptToken[tokenCount]       text tokens only, segment by segment
+//   string pool (segment texts and each distinct token text once)
+// TranscriptView maps the file and uses the tables in place.
+
+struct TranscriptHeader {
+    char magic[4];                   // "NTRS"
+    std::uint32_t version;
+    std::uint32_t segmentCount;
+    std::uint32_t tokenCount;
+    std::uint32_t poolBytes;
+    std::uint32_t reserved[3];
+};
+
+struct TranscriptSegment {
+    std::uint32_t t0Ms, t1Ms;
+    std::uint32_t text, textLength;  // in the string pool
+    std::uint32_t firstToken, tokenCount;
+    float noSpeechProb;
+    std::uint32_t flags;             // SPEAKER_TURN_NEXT, LOW_CONFIDENCE
+    static constexpr std::uint32_t SPEAKER_TURN_NEXT = 1;
+    // whisper_full_get_segment_confidence() below LOW_CONFIDENCE_BELOW: worth decoding again
+    static constexpr std::uint32_t LOW_CONFIDENCE = 2;
+    static constexpr float LOW_CONFIDENCE_BELOW = 0.5f;
+};
+
+struct TranscriptToken {
+    std::int32_t id;                 // whisper_token
+    std::uint32_t t0Ms, t1Ms;        // the segment's times without token timestamps
+    float p;
+    std::uint32_t text, textLength;  // in the string pool
+};
+
+// Collects the segments of a transcription as they are committed
+class TranscriptBuilder {
+public:
+    // Maps a whisper time (10 ms units from the start of the decoded
+    // window) to ms of the recording
+    using TimeMap = std::function<std::uint32_t(std::int64_t)>;
+
+    // Segments [0, count) of the last whisper_full on state
+    void addSegments(whisper_context* ctx, whisper_state* state, int count, const TimeMap& toMs);
+    // A segment known only by its text (transcribed elsewhere), no tokens
+    void addSegment(std::uint32_t t0Ms, std::uint32_t t1Ms, std::string_view text);
+    // Segment i of a saved transcript, with its tokens
+    void addSegment(const TranscriptView& view, std::uint32_t i);
+    // Appends the transcript of a later stretch of the same recording
+    void append(const TranscriptBuilder& other);
+    bool empty() const { return segments.empty(); }
+    bool save(const std::string& path) const;
+
+private:
+    std::uint32_t addText(std::string_view s);
+    std::uint32_t tokenText(std::string_view s);
+
+    std::vector<TranscriptSegment> segments;
+    std::vector<TranscriptToken> tokens;
+    std::string pool;
+    std::unordered_map<std::string, std::uint32_t> tokenTexts; // deduplicates token texts in the pool
+};
+
+// A saved transcript, mapped read-only
+class TranscriptView {
+public:
+    bool open(const std::string& path);
+    void close();
+
+    std::uint32_t segmentCount() const { return header ? header->segmentCount : 0; }
+    const TranscriptSegment* segments() const { return segs; }
+    std::uint32_t tokenCount() const { return header ? header->tokenCount : 0; }
+    const TranscriptToken* tokens() const { return toks; }
+    // Pool text; empty if the range is out of bounds
+    std::string_view text(std::uint32_t offset, std::uint32_t length) const;
+    // Segment at ms (the last one starting at or before it), -1 before the first
+    int segmentAt(std::uint32_t ms) const;
+    // Runs [first, end) of segments to decode again: each LOW_CONFIDENCE
+    // segment with a neighbour on either side, so it is decoded with the
+    // words around it and the new text replaces whole segments
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> lowConfidenceRuns() const;
+
+private:
+    MappedFile file;
+    const TranscriptHeader* header = nullptr;
+    const TranscriptSegment* segs = nullptr;
+    const TranscriptToken* toks = nullptr;
+    const char* pool = nullptr;
+};
+
+std::string transcriptPath(const std::string& notePath);
+
+#endif // TRANSCRIPT_H
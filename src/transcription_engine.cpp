@@ -0,0 +1,623 @@
+#include "transcription_engine.h"
+#include "whisper.h"
+#include "settings.h"
+#include "ui_wake.h"
+#include "perf_trace.h"
+#include "note_summarizer.h"
+#include "model_catalog.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <vector>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+TranscriptionEngine& TranscriptionEngine::instance() {
+    static TranscriptionEngine engine;
+    return engine;
+}
+
+TranscriptionEngine::~TranscriptionEngine() {
+    shutdown();
+}
+
+// Everything that requires a reload when it changes
+static std::string configKey(const std::string& modelPath) {
+    return modelPath + "|" + Settings::whisper_device + "|" + (Settings::flash_attention ? "fa" : "") + "|" +
+           preferredQuant(Settings::model_preference);
+}
+
+bool TranscriptionEngine::keepLoadedLocked(const std::string& key) const {
+    if (!ctx) return false;
+    if (key == loadedKey) return true;
+    // a job still decodes with the old model; swap on a later load
+    return freeStates.size() != allStates.size();
+}
+
+void TranscriptionEngine::unloadLocked() {
+    for (auto* st : allStates) whisper_free_state(st);
+    allStates.clear();
+    freeStates.clear();
+    if (ctx) {
+        whisper_free(ctx);
+        ctx = nullptr;
+    }
+    loadedKey.clear();
+}
+
+void TranscriptionEngine::loadAsync(const std::string& modelPath) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (loading || keepLoadedLocked(configKey(modelPath))) return;
+    if (loader.joinable()) loader.join();
+
+    loading = true;
+    loader = std::thread([this, modelPath]() {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            loadLocked(lock, modelPath);
+        }
+        UiWake::instance().wake();   // the mic button stops showing the load
+    });
+}
+
+bool TranscriptionEngine::load(const std::string& modelPath) {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{ return !loading; });
+    if (keepLoadedLocked(configKey(modelPath))) return true;
+    loading = true;
+    return loadLocked(lock, modelPath);
+}
+
+// Expects `loading` to be set by the caller; the mutex is released while the
+// model is read so that isReady()/acquireState() never stall on disk I/O.
+bool TranscriptionEngine::loadLocked(std::unique_lock<std::mutex>& lock, const std::string& modelPath) {
+    // No state is leased (keepLoadedLocked), so the old model can go
+    unloadLocked();
+    const std::string key = configKey(modelPath);
+
+    const whisper_context_params cparams = contextParams();
+
+    lock.unlock();
+    whisper_context* loaded = whisper_init_from_file_with_params_no_state(modelPath.c_str(), cparams);
+    whisper_state* first = loaded ? whisper_init_state(loaded) : nullptr;
+    // Pay for kernel setup and page faults here rather than on the first note
+    if (first) whisper_warmup_with_state(loaded, first, threadCount());
+    lock.lock();
+
+    loading = false;
+    if (!loaded || !first) {
+        std::cerr << "Failed to load model '" << modelPath << "'\n";
+        if (loaded) whisper_free(loaded);
+        cv.notify_all();
+        return false;
+    }
+
+    ctx = loaded;
+    loadedKey = key;
+    allStates.push_back(first);
+    freeStates.push_back(first);
+    std::cout << "Whisper model loaded: " << modelPath << "\n";
+    cv.notify_all();
+    return true;
+}
+
+bool TranscriptionEngine::waitUntilReady() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{ return !loading; });
+    return ctx != nullptr;
+}
+
+bool TranscriptionEngine::isReady() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return ctx != nullptr;
+}
+
+bool TranscriptionEngine::isLoading() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return loading;
+}
+
+whisper_context* TranscriptionEngine::context() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return ctx;
+}
+
+whisper_state* TranscriptionEngine::acquireState() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{ return !loading; });
+    if (!ctx) return nullptr;
+
+    if (!freeStates.empty()) {
+        whisper_state* st = freeStates.back();
+        freeStates.pop_back();
+        return st;
+    }
+
+    whisper_state* st = whisper_init_state(ctx);
+    if (!st) {
+        std::cerr << "Failed to create whisper state\n";
+        return nullptr;
+    }
+    allStates.push_back(st);
+    return st;
+}
+
+void TranscriptionEngine::releaseState(whisper_state* state) {
+    if (!state) return;
+    std::lock_guard<std::mutex> lock(mtx);
+    freeStates.push_back(state);
+}
+
+// 0 when the platform does not tell us
+static unsigned physicalCores() {
+#if defined(_WIN32)
+    DWORD len = 0;
+    GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &len);
+    if (len == 0) return 0;
+    std::vector<char> buf(len);
+    auto* info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buf.data());
+    if (!GetLogicalProcessorInformationEx(RelationProcessorCore, info, &len)) return 0;
+    unsigned cores = 0;
+    for (DWORD off = 0; off < len; ) {
+        auto* rec = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buf.data() + off);
+        if (rec->Relationship == RelationProcessorCore) cores++;
+        off += rec->Size;
+    }
+    return cores;
+#elif defined(__linux__)
+    // Distinct (package, core) pairs over the online CPUs
+    std::set<std::pair<int, int>> cores;
+    for (unsigned cpu = 0; ; ++cpu) {
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        std::ifstream pkg(dir + "physical_package_id"), core(dir + "core_id");
+        int p = 0, c = 0;
+        if (!(pkg >> p) || !(core >> c)) break;
+        cores.insert({p, c});
+    }
+    return (unsigned) cores.size();
+#else
+    return 0;
+#endif
+}
+
+int TranscriptionEngine::threadCount() {
+    if (Settings::transcription_threads > 0) return Settings::transcription_threads;
+
+    static const int detected = []{
+        const unsigned logical = std::thread::hardware_concurrency();
+        unsigned n = physicalCores();
+        if (n == 0 || (logical && n > logical)) n = logical;
+        return n > 0 ? (int) n : 4;
+    }();
+    return detected;
+}
+
+// 0 when the platform does not tell us. Sampled over a short interval, at
+// the start of a background job, when the app itself is idle
+static double busyCores() {
+    const auto interval = std::chrono::milliseconds(200);
+#if defined(_WIN32)
+    auto sample = [](std::uint64_t& idle, std::uint64_t& total) {
+        FILETIME i, k, u;
+        if (!GetSystemTimes(&i, &k, &u)) return false;
+        auto ticks = [](const FILETIME& t) { return ((std::uint64_t) t.dwHighDateTime << 32) | t.dwLowDateTime; };
+        idle = ticks(i);
+        total = ticks(k) + ticks(u); // kernel time includes idle time
+        return true;
+    };
+#elif defined(__linux__)
+    auto sample = [](std::uint64_t& idle, std::uint64_t& total) {
+        std::ifstream stat("/proc/stat");
+        std::string cpu;
+        if (!(stat >> cpu) || cpu != "cpu") return false;
+        idle = total = 0;
+        std::uint64_t v = 0;
+        for (int field = 0; field < 8 && stat >> v; ++field) {
+            total += v;
+            if (field == 3 || field == 4) idle += v; // idle, iowait
+        }
+        return total > 0;
+    };
+#else
+    auto sample = [](std::uint64_t&, std::uint64_t&) { return false; };
+#endif
+    std::uint64_t idle0 = 0, total0 = 0, idle1 = 0, total1 = 0;
+    if (!sample(idle0, total0)) return 0.0;
+    std::this_thread::sleep_for(interval);
+    if (!sample(idle1, total1) || total1 <= total0) return 0.0;
+    const double busy = 1.0 - (double) (idle1 - idle0) / (double) (total1 - total0);
+    return std::max(0.0, busy) * std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool TranscriptionEngine::onMainsPower() {
+#if defined(_WIN32)
+    SYSTEM_POWER_STATUS status;
+    if (!GetSystemPowerStatus(&status)) return true;
+    return status.ACLineStatus != 0;
+#elif defined(__linux__)
+    // desktops have no "Mains" supply at all
+    bool sawMains = false;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/class/power_supply", ec)) {
+        std::ifstream typeFile(entry.path() / "type");
+        std::string type;
+        if (!(typeFile >> type) || type != "Mains") continue;
+        sawMains = true;
+        std::ifstream onlineFile(entry.path() / "online");
+        int online = 0;
+        if (onlineFile >> online && online) return true;
+    }
+    return !sawMains;
+#else
+    return true;
+#endif
+}
+
+bool TranscriptionEngine::deferBackground(bool optional) {
+    if (Settings::power_policy == "performance") return false;
+    if (!optional && Settings::power_policy != "saver") return false;
+    return !onMainsPower();
+}
+
+TranscriptionEngine::ThreadPlan TranscriptionEngine::threadPlan(Priority priority) {
+    ThreadPlan plan;
+    plan.threads = threadCount();
+    if (Settings::power_policy == "performance") return plan;
+
+    const bool battery = !onMainsPower();
+    if (priority == Priority::Interactive) {
+        // the user is waiting: full speed, except when saving battery is all that counts
+        if (battery && Settings::power_policy == "saver") plan.threads = std::max(1, plan.threads / 2);
+        return plan;
+    }
+
+    // leave the cores other programs use to them; busy logical CPUs are
+    // scaled to the physical cores threadCount() counts
+    const unsigned logical = std::max(1u, std::thread::hardware_concurrency());
+    const int busy = (int) (busyCores() * threadCount() / logical + 0.5);
+    plan.threads = std::max(1, plan.threads - busy);
+    if (battery) {
+        plan.threads = std::max(1, plan.threads / 2);
+        plan.efficient = true;
+    }
+    return plan;
+}
+
+TranscriptionEngine::Priority TranscriptionEngine::currentPriority() {
+    std::lock_guard<std::mutex> lock(jobMtx);
+    if (jobRunning && std::this_thread::get_id() == worker.get_id()) return runningPriority;
+    return Priority::Interactive;
+}
+
+void TranscriptionEngine::loadBackends() {
+    static std::once_flag once;
+    std::call_once(once, []{
+        // no-op in a static build: the backends are linked in
+        ggml_backend_load_all();
+        for (size_t i = 0; i < ggml_backend_reg_count(); ++i) {
+            ggml_backend_reg_t reg = ggml_backend_reg_get(i);
+            std::cout << "ggml backend: " << ggml_backend_reg_name(reg);
+            if (ggml_backend_reg_dev_count(reg) > 0) {
+                std::cout << " (" << ggml_backend_dev_description(ggml_backend_reg_dev_get(reg, 0)) << ")";
+            }
+            std::cout << "\n";
+        }
+    });
+}
+
+std::vector<std::string> TranscriptionEngine::gpuDevices() {
+    std::vector<std::string> out;
+    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        const enum ggml_backend_dev_type type = ggml_backend_dev_type(dev);
+        if (type == GGML_BACKEND_DEVICE_TYPE_GPU || type == GGML_BACKEND_DEVICE_TYPE_IGPU) {
+            out.push_back(ggml_backend_dev_name(dev));
+        }
+    }
+    return out;
+}
+
+whisper_context_params TranscriptionEngine::contextParams() {
+    whisper_context_params cparams = whisper_context_default_params();
+    cparams.flash_attn = Settings::flash_attention;
+    cparams.fuse_qkv = true;
+    // a full-precision file is quantized to the preferred type while it loads,
+    // so one f16 download serves every model_preference (quantized files load as they are)
+    const std::string quant = preferredQuant(Settings::model_preference);
+    if (quant == "q5_0") cparams.type_weights = GGML_TYPE_Q5_0;
+    else if (quant == "q8_0") cparams.type_weights = GGML_TYPE_Q8_0;
+    if (Settings::whisper_device == "cpu") {
+        cparams.use_gpu = false;
+    } else if (!Settings::whisper_device.empty() && Settings::whisper_device != "auto") {
+        const std::vector<std::string> gpus = gpuDevices();
+        auto it = std::find(gpus.begin(), gpus.end(), Settings::whisper_device);
+        if (it != gpus.end()) cparams.gpu_device = (int) (it - gpus.begin());
+        else std::cerr << "Unknown whisper device '" << Settings::whisper_device << "', using the default\n";
+    }
+    return cparams;
+}
+
+void TranscriptionEngine::enqueue(const std::string& textPath, std::function<int(const std::atomic<bool>&)> work,
+                                  Priority priority) {
+    std::lock_guard<std::mutex> lock(jobMtx);
+    if (stopping) return;
+    if (priority == Priority::Interactive) {
+        // after the other interactive jobs, before any background one
+        auto pos = std::find_if(jobs.begin(), jobs.end(),
+                                [](const Job& j){ return j.priority == Priority::Background; });
+        jobs.insert(pos, {textPath, std::move(work), priority});
+        preemptLocked();
+    } else {
+        jobs.push_back({textPath, std::move(work), priority});
+    }
+    if (!worker.joinable()) {
+        worker = std::thread([this]{ workerLoop(); });
+    }
+    jobCv.notify_one();
+}
+
+void TranscriptionEngine::cancel(const std::string& textPath) {
+    std::lock_guard<std::mutex> lock(jobMtx);
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&](const Job& j){ return j.textPath == textPath; }),
+               jobs.end());
+    if (jobRunning && runningPath == textPath) cancelRunning = true;
+}
+
+void TranscriptionEngine::holdBackground(bool on) {
+    std::lock_guard<std::mutex> lock(jobMtx);
+    backgroundHolds = std::max(0, backgroundHolds + (on ? 1 : -1));
+    if (on) preemptLocked();
+    jobCv.notify_one();
+}
+
+void TranscriptionEngine::preemptLocked() {
+    if (jobRunning && runningPriority == Priority::Background) {
+        preempted = true;
+        cancelRunning = true;
+    }
+}
+
+bool TranscriptionEngine::runnableLocked(bool deferred) const {
+    if (jobs.empty()) return false;
+    if (jobs.front().priority == Priority::Interactive) return true;
+    return backgroundHolds == 0 && !deferred;
+}
+
+size_t TranscriptionEngine::pendingJobs() {
+    std::lock_guard<std::mutex> lock(jobMtx);
+    return jobs.size() + (jobRunning ? 1 : 0);
+}
+
+void TranscriptionEngine::workerLoop() {
+    for (;;) {
+        Job job;
+        // the power source comes from sysfs, which is not read under jobMtx
+        bool deferred = deferBackground();
+        {
+            std::unique_lock<std::mutex> lock(jobMtx);
+            while (!stopping && !runnableLocked(deferred)) {
+                // the power source is not signalled: a deferred job looks again now and then
+                if (jobs.empty()) jobCv.wait(lock);
+                else jobCv.wait_for(lock, std::chrono::seconds(30));
+                lock.unlock();
+                deferred = deferBackground();
+                lock.lock();
+            }
+            if (stopping) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            jobRunning = true;
+            runningPath = job.textPath;
+            runningPriority = job.priority;
+            cancelRunning = false;
+            preempted = false;
+        }
+
+        TranscriptionEvent started;
+        started.type = TranscriptionEvent::Type::Started;
+        started.textPath = job.textPath;
+        postEvent(started);
+
+        int rc;
+        {
+            PerfTrace::Scope traced("engine", "job");
+            rc = job.work ? job.work(cancelRunning) : 0;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(jobMtx);
+            if (preempted && !stopping) {
+                // redone from the start, ahead of the other background jobs
+                auto pos = std::find_if(jobs.begin(), jobs.end(),
+                                        [](const Job& j){ return j.priority == Priority::Background; });
+                jobs.insert(pos, std::move(job));
+                jobRunning = false;
+                continue;
+            }
+        }
+
+        TranscriptionEvent done;
+        done.type = rc == 0 ? TranscriptionEvent::Type::Finished : TranscriptionEvent::Type::Failed;
+        done.textPath = job.textPath;
+        postEvent(done);
+
+        std::lock_guard<std::mutex> lock(jobMtx);
+        jobRunning = false;
+    }
+}
+
+void TranscriptionEngine::postEvent(TranscriptionEvent ev) {
+    // the summarizer reads along as segments are committed
+    NoteSummarizer::instance().observe(ev);
+    {
+        std::lock_guard<std::mutex> lock(eventMtx);
+        events.push_back(std::move(ev));
+    }
+    UiWake::instance().wake();
+}
+
+bool TranscriptionEngine::pollEvent(TranscriptionEvent& ev) {
+    std::lock_guard<std::mutex> lock(eventMtx);
+    if (events.empty()) return false;
+    ev = std::move(events.front());
+    events.pop_front();
+    return true;
+}
+
+void TranscriptionEngine::shutdown() {
+    {
+        // Stop the running job, drop the rest (their audio is already on disk)
+        std::lock_guard<std::mutex> lock(jobMtx);
+        stopping = true;
+        jobs.clear();
+        cancelRunning = true;
+    }
+    jobCv.notify_all();
+    if (worker.joinable()) worker.join();
+    if (loader.joinable()) loader.join();
+
+    std::lock_guard<std::mutex> lock(mtx);
+    unloadLocked();
+}
+
+// Efficiency cores by logical CPU index; empty on uniform CPUs
+static std::vector<int> efficiencyCores() {
+    std::vector<int> out;
+#if defined(_WIN32)
+    ULONG len = 0;
+    GetSystemCpuSetInformation(nullptr, 0, &len, GetCurrentProcess(), 0);
+    if (len == 0) return out;
+    std::vector<char> buf(len);
+    if (!GetSystemCpuSetInformation(reinterpret_cast<SYSTEM_CPU_SET_INFORMATION*>(buf.data()), len, &len,
+                                    GetCurrentProcess(), 0)) return out;
+    std::vector<std::pair<int, int>> cpus; // (logical index, efficiency class)
+    int lowest = 255, highest = 0;
+    for (ULONG off = 0; off < len; ) {
+        auto* info = reinterpret_cast<SYSTEM_CPU_SET_INFORMATION*>(buf.data() + off);
+        if (info->Type == CpuSetInformation && info->CpuSet.Group == 0) {
+            const int cls = info->CpuSet.EfficiencyClass;
+            cpus.push_back({info->CpuSet.LogicalProcessorIndex, cls});
+            lowest = std::min(lowest, cls);
+            highest = std::max(highest, cls);
+        }
+        off += info->Size;
+    }
+    if (lowest == highest) return out;
+    for (const auto& [cpu, cls] : cpus) {
+        if (cls == lowest) out.push_back(cpu);
+    }
+#elif defined(__linux__)
+    // Intel hybrid CPUs list their E-cores; elsewhere (ARM big.LITTLE) the
+    // smallest cpu_capacity marks them
+    std::ifstream atom("/sys/devices/cpu_atom/cpus");
+    std::string list;
+    if (atom >> list) {
+        std::size_t pos = 0;
+        while (pos < list.size()) {
+            std::size_t next = list.find(',', pos);
+            if (next == std::string::npos) next = list.size();
+            const std::string range = list.substr(pos, next - pos);
+            const std::size_t dash = range.find('-');
+            const int first = std::atoi(range.c_str());
+            const int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for (int c = first; c <= last; ++c) out.push_back(c);
+            pos = next + 1;
+        }
+        return out;
+    }
+    std::vector<std::pair<int, long>> cpus;
+    long lowest = 0, highest = 0;
+    for (int cpu = 0; ; ++cpu) {
+        std::ifstream cap("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpu_capacity");
+        long c = 0;
+        if (!(cap >> c)) break;
+        lowest = cpus.empty() ? c : std::min(lowest, c);
+        highest = std::max(highest, c);
+        cpus.push_back({cpu, c});
+    }
+    if (lowest == highest) return out;
+    for (const auto& [cpu, c] : cpus) {
+        if (c == lowest) out.push_back(cpu);
+    }
+#endif
+    return out;
+}
+
+// ggml pins and deprioritizes the thread that computes with a pool too
+struct EfficientThreads::SavedThread {
+#if defined(_WIN32)
+    int priority = THREAD_PRIORITY_NORMAL;
+    DWORD_PTR affinity = 0;
+#elif defined(__linux__)
+    int nice = 0;
+    int policy = SCHED_OTHER;            // GGML_SCHED_PRIO_LOW switches it to SCHED_BATCH
+    sched_param param{};
+    bool hasPolicy = false;
+    cpu_set_t affinity;
+    bool hasAffinity = false;
+#endif
+};
+
+EfficientThreads::EfficientThreads(whisper_state* state, int threads) : st(state), saved(std::make_unique<SavedThread>()) {
+    ggml_backend_reg_t reg = ggml_backend_reg_by_name("CPU");
+    auto* fnNew = reg ? (decltype(&ggml_threadpool_new)) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new") : nullptr;
+    if (!st || !fnNew) return;
+
+#if defined(_WIN32)
+    saved->priority = GetThreadPriority(GetCurrentThread());
+    DWORD_PTR process = 0, system = 0;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &process, &system)) saved->affinity = process;
+#elif defined(__linux__)
+    const id_t tid = (id_t) syscall(SYS_gettid);
+    errno = 0;
+    saved->nice = getpriority(PRIO_PROCESS, tid);
+    if (errno != 0) saved->nice = 0;
+    saved->hasPolicy = pthread_getschedparam(pthread_self(), &saved->policy, &saved->param) == 0;
+    saved->hasAffinity = sched_getaffinity(0, sizeof(saved->affinity), &saved->affinity) == 0;
+#endif
+
+    ggml_threadpool_params params = ggml_threadpool_params_default(threads);
+    params.prio = GGML_SCHED_PRIO_LOW;
+    params.poll = 0; // sleep between graphs instead of spinning on battery
+    for (int cpu : efficiencyCores()) {
+        if (cpu >= 0 && cpu < GGML_MAX_N_THREADS) params.cpumask[cpu] = true;
+    }
+    pool = fnNew(&params);
+    if (pool) whisper_state_set_threadpool(st, pool);
+}
+
+EfficientThreads::~EfficientThreads() {
+    if (!pool) return;
+    whisper_state_set_threadpool(st, nullptr);
+    ggml_backend_reg_t reg = ggml_backend_reg_by_name("CPU");
+    auto* fnFree = (decltype(&ggml_threadpool_free)) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+    if (fnFree) fnFree(pool);
+
+#if defined(_WIN32)
+    SetThreadPriority(GetCurrentThread(), saved->priority);
+    if (saved->affinity) SetThreadAffinityMask(GetCurrentThread(), saved->affinity);
+#elif defined(__linux__)
+    if (saved->hasPolicy) pthread_setschedparam(pthread_self(), saved->policy, &saved->param);
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), saved->nice);
+    if (saved->hasAffinity) sched_setaffinity(0, sizeof(saved->affinity), &saved->affinity);
+#endif
+}
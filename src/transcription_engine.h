@@ -0,0 +1,191 @@
+#ifndef TRANSCRIPTION_ENGINE_H
+#define TRANSCRIPTION_ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct whisper_context;
+struct whisper_state;
+struct whisper_context_params;
+struct ggml_threadpool;
+
+// Posted by transcription jobs, drained by the UI thread once per frame
+struct TranscriptionEvent {
+    enum class Type { Started, Progress, Segment, Partial, Finished, Failed, Refined, Summarized };
+    Type type = Type::Started;
+    std::string textPath;   // identifies the note the job belongs to
+    int progress = 0;       // percent, for Progress
+    std::string text;       // committed text for Segment, tentative text for Partial, the note for Refined,
+                            // the title for Summarized
+};
+
+// Process-wide owner of the whisper model.
+// The context is loaded once (at startup or lazily) and recordings borrow a
+// whisper_state from a small pool instead of reloading the model per note.
+// Backend device and flash attention come from Settings; when they or the
+// model path change, the next load() swaps the model once no job holds a state.
+class TranscriptionEngine {
+public:
+    static TranscriptionEngine& instance();
+
+    // Load the model on a background thread; returns immediately
+    void loadAsync(const std::string& modelPath);
+    // Load the model on the calling thread (no-op if already loaded as configured)
+    bool load(const std::string& modelPath);
+    // Block until a pending load finished; returns true if a model is ready
+    bool waitUntilReady();
+    bool isReady();
+    // A load is in progress (the UI shows it on the mic button)
+    bool isLoading();
+
+    whisper_context* context();
+
+    // Borrow a state from the pool (creates one if the pool is empty)
+    whisper_state* acquireState();
+    void releaseState(whisper_state* state);
+
+    // CPU threads a job may use: Settings::transcription_threads, or one per
+    // physical core (SMT siblings share the SIMD units whisper saturates)
+    static int threadCount();
+
+    // Registers ggml's backends when they are built as modules (GGML_BACKEND_DL):
+    // the best CPU variant this machine runs and any GPU backend found next
+    // to the executable. Call before anything else uses ggml; once is enough
+    static void loadBackends();
+    // GPU/iGPU backend devices, in the order whisper's gpu_device counts them
+    static std::vector<std::string> gpuDevices();
+    // Backend device and flash attention as configured in Settings
+    static whisper_context_params contextParams();
+
+    // Interactive jobs (a note the user is waiting for) run before queued
+    // background ones (imports) and preempt a running one; the preempted job
+    // is restarted once no interactive work is left
+    enum class Priority { Interactive, Background };
+
+    // Queue work for the background worker; jobs run one at a time in order
+    // of priority. `work` returns 0 on success, like sendAudioFileToWhisper(),
+    // and must return soon after `cancel` is set (it feeds abort_callback).
+    void enqueue(const std::string& textPath, std::function<int(const std::atomic<bool>& cancel)> work,
+                 Priority priority = Priority::Background);
+    // Drop the queued jobs of a note and stop its running one (note deleted)
+    void cancel(const std::string& textPath);
+    // While held (a recording is running), background jobs are preempted and
+    // do not start; calls nest
+    void holdBackground(bool on);
+    size_t pendingJobs();
+
+    // Settings::power_policy applied to a job: threads scaled to the power
+    // source and, for background work, to the cores other programs keep
+    // busy; `efficient` asks for the efficiency cores (EfficientThreads)
+    struct ThreadPlan {
+        int threads = 4;
+        bool efficient = false;
+    };
+    static ThreadPlan threadPlan(Priority priority);
+    // False only when the machine is known to run on battery
+    static bool onMainsPower();
+    // Background work waits for mains power; `optional` work (refinement)
+    // under every policy but "performance", imports only under "saver"
+    static bool deferBackground(bool optional = false);
+    // Priority of the job the calling thread runs; Interactive outside the worker
+    Priority currentPriority();
+
+    // Thread-safe; called from inside jobs (whisper callbacks)
+    void postEvent(TranscriptionEvent ev);
+    // Non-blocking; returns false when no event is waiting
+    bool pollEvent(TranscriptionEvent& ev);
+
+    void shutdown();
+
+private:
+    TranscriptionEngine() = default;
+    ~TranscriptionEngine();
+    TranscriptionEngine(const TranscriptionEngine&) = delete;
+    TranscriptionEngine& operator=(const TranscriptionEngine&) = delete;
+
+    bool loadLocked(std::unique_lock<std::mutex>& lock, const std::string& modelPath);
+    // True when ctx is what (modelPath, current settings) asks for, or is busy
+    bool keepLoadedLocked(const std::string& key) const;
+    void unloadLocked();
+    void workerLoop();
+
+    struct Job {
+        std::string textPath;
+        std::function<int(const std::atomic<bool>&)> work;
+        Priority priority = Priority::Background;
+    };
+
+    // `deferred`: deferBackground(), looked up without jobMtx held
+    bool runnableLocked(bool deferred) const;
+    // Stops the running job if it is background work; it goes back to the queue
+    void preemptLocked();
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread loader;
+    bool loading = false;
+
+    std::string loadedKey;   // model path + backend settings of ctx
+    whisper_context* ctx = nullptr;
+    std::vector<whisper_state*> freeStates;
+    std::vector<whisper_state*> allStates;
+
+    // Job queue (guarded by jobMtx, separate from the model lock)
+    std::mutex jobMtx;
+    std::condition_variable jobCv;
+    std::deque<Job> jobs;
+    std::thread worker;
+    bool jobRunning = false;
+    bool stopping = false;
+    std::string runningPath;              // of the running job
+    Priority runningPriority = Priority::Background;
+    std::atomic<bool> cancelRunning{false};
+    bool preempted = false;               // the running job was stopped to be redone
+    int backgroundHolds = 0;
+
+    std::mutex eventMtx;
+    std::deque<TranscriptionEvent> events;
+};
+
+// Runs a state's CPU work on `threads` workers pinned to the efficiency
+// cores (all cores on uniform CPUs) at low priority, for battery-friendly
+// background jobs. The calling thread computes too; its affinity and
+// priority are restored and the state gets its own pool back on destruction.
+class EfficientThreads {
+public:
+    EfficientThreads(whisper_state* state, int threads);
+    ~EfficientThreads();
+    EfficientThreads(const EfficientThreads&) = delete;
+    EfficientThreads& operator=(const EfficientThreads&) = delete;
+
+private:
+    whisper_state* st;
+    ggml_threadpool* pool = nullptr;
+    struct SavedThread;
+    std::unique_ptr<SavedThread> saved;
+};
+
+// RAII lease of a pooled whisper_state
+class StateLease {
+public:
+    explicit StateLease(TranscriptionEngine& e) : engine(e), st(e.acquireState()) {}
+    ~StateLease() { if (st) engine.releaseState(st); }
+    StateLease(const StateLease&) = delete;
+    StateLease& operator=(const StateLease&) = delete;
+
+    whisper_state* get() const { return st; }
+    explicit operator bool() const { return st != nullptr; }
+
+private:
+    TranscriptionEngine& engine;
+    whisper_state* st;
+};
+
+#endif // TRANSCRIPTION_ENGINE_H
@@ -0,0 +1,162 @@
+#include "transcription_ledger.h"
+#include "note_store.h"
+#include "settings.h"
+#include "speech_gate.h"
+#include "transcript.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char* const LEDGER_FILE = ".transcriptions";
+// Bumped when the decoding options change what a model writes
+const char* const PARAMS_VERSION = "1";
+
+std::string dirOf(const std::string& path) {
+    std::string dir = fs::path(path).parent_path().string();
+    if (!dir.empty()) dir.push_back('/');
+    return dir;
+}
+
+std::string baseOf(const std::string& path) {
+    return fs::path(path).stem().string();
+}
+
+std::uint64_t mix(std::uint64_t h, std::uint64_t v) {
+    h ^= v;
+    h *= 0x100000001b3ull;
+    return h ^ (h >> 29);
+}
+
+} // namespace
+
+TranscriptionLedger& TranscriptionLedger::instance() {
+    static TranscriptionLedger ledger;
+    return ledger;
+}
+
+TranscriptionLedger::Folder& TranscriptionLedger::folderLocked(const std::string& dir) {
+    auto it = folders.find(dir);
+    if (it != folders.end()) return it->second;
+
+    Folder& f = folders[dir];
+    std::ifstream in(dir + LEDGER_FILE);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::vector<std::string> cols;
+        std::stringstream ss(line);
+        for (std::string c; std::getline(ss, c, '\t'); ) cols.push_back(c);
+        if (cols.size() == 5 && cols[0] == "a") {
+            f.hashes[cols[1] + "\t" + cols[2] + "\t" + cols[3]] = cols[4];
+        } else if (cols.size() == 4 && cols[0] == "t") {
+            auto& bases = f.done[cols[1] + "\t" + cols[2]];
+            if (std::find(bases.begin(), bases.end(), cols[3]) == bases.end()) bases.push_back(cols[3]);
+        }
+    }
+    return f;
+}
+
+void TranscriptionLedger::appendLocked(const std::string& dir, const std::string& line) {
+    std::ofstream out(dir + LEDGER_FILE, std::ios::app);
+    out << line << "\n";
+}
+
+std::string TranscriptionLedger::audioHash(const std::string& audioPath) {
+    std::error_code ec;
+    const auto ftime = fs::last_write_time(audioPath, ec);
+    if (ec) return {};
+    const std::uint64_t size = fs::file_size(audioPath, ec);
+    if (ec) return {};
+    const std::string dir = dirOf(audioPath);
+    const std::string cacheKey = fs::path(audioPath).filename().string() + "\t" +
+                                 std::to_string((long long) ftime.time_since_epoch().count()) + "\t" +
+                                 std::to_string(size);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        Folder& f = folderLocked(dir);
+        auto it = f.hashes.find(cacheKey);
+        if (it != f.hashes.end()) return it->second;
+    }
+
+    sf::InputSoundFile file;
+    if (!file.openFromFile(audioPath)) return {};
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    h = mix(h, file.getSampleRate());
+    h = mix(h, file.getChannelCount());
+    std::vector<std::int16_t> buf(1 << 16);
+    for (std::uint64_t n; (n = file.read(buf.data(), buf.size())) > 0; ) {
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            std::uint64_t v = 0;
+            for (int k = 0; k < 4; ++k) v |= (std::uint64_t) (std::uint16_t) buf[i + k] << (16 * k);
+            h = mix(h, v);
+        }
+        for (; i < n; ++i) h = mix(h, (std::uint16_t) buf[i]);
+    }
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) h);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    Folder& f = folderLocked(dir);
+    f.hashes[cacheKey] = hex;
+    appendLocked(dir, "a\t" + cacheKey + "\t" + hex);
+    return hex;
+}
+
+std::string TranscriptionLedger::modelKey(const std::string& modelPath) {
+    std::string key = fs::path(modelPath).filename().string();
+    key += Settings::vad_model_path.empty() ? "|novad" : "|vad";
+    key += std::string("|p") + PARAMS_VERSION;
+    return key;
+}
+
+std::string TranscriptionLedger::find(const std::string& hash, const std::string& key, const std::string& textPath) {
+    if (hash.empty()) return {};
+    const std::string dir = dirOf(textPath);
+    std::vector<std::string> bases;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        Folder& f = folderLocked(dir);
+        auto it = f.done.find(hash + "\t" + key);
+        if (it == f.done.end()) return {};
+        bases = it->second;
+    }
+    // the note itself first; then any other copy of the recording
+    const std::string self = baseOf(textPath);
+    std::stable_partition(bases.begin(), bases.end(), [&](const std::string& b){ return b == self; });
+    for (const std::string& b : bases) {
+        const std::string path = dir + b + ".txt";
+        if (!readNoteText(path).empty()) return path;
+    }
+    return {};
+}
+
+void TranscriptionLedger::record(const std::string& hash, const std::string& key, const std::string& textPath) {
+    if (hash.empty()) return;
+    const std::string dir = dirOf(textPath);
+    const std::string base = baseOf(textPath);
+    std::lock_guard<std::mutex> lock(mtx);
+    auto& bases = folderLocked(dir).done[hash + "\t" + key];
+    if (std::find(bases.begin(), bases.end(), base) != bases.end()) return;
+    bases.push_back(base);
+    appendLocked(dir, "t\t" + hash + "\t" + key + "\t" + base);
+}
+
+bool TranscriptionLedger::copyNote(const std::string& fromText, const std::string& toText) {
+    if (fromText == toText) return true;
+    if (!writeNoteText(toText, readNoteText(fromText))) return false;
+    std::error_code ec;
+    for (auto sidecar : {transcriptPath, speechMapPath}) {
+        const std::string from = sidecar(fromText);
+        if (fs::exists(from, ec)) fs::copy_file(from, sidecar(toText), fs::copy_options::overwrite_existing, ec);
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef TRANSCRIPTION_LEDGER_H
+#define TRANSCRIPTION_LEDGER_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Which model produced the text of which note, keyed by a hash of the
+// recording's decoded audio, per notes folder (<dir>/.transcriptions).
+// Transcription jobs look here first: a recording imported again or synced
+// back under another name gets the existing text instead of another pass,
+// and a note is never refined twice by the same model.
+//
+// The file is append-only text; audio hashes are cached in it by file name,
+// write time and size, so a recording is decoded for hashing only once.
+// Thread-safe: transcription jobs and the refiner use it.
+class TranscriptionLedger {
+public:
+    static TranscriptionLedger& instance();
+
+    // Hash of the samples (and their rate / channel count), whatever the
+    // container; "" when the file cannot be decoded
+    std::string audioHash(const std::string& audioPath);
+    // The model file and the options that shape its text
+    static std::string modelKey(const std::string& modelPath);
+
+    // A note whose text was made from `hash` by `key` and still has text;
+    // `textPath` itself if it is one, "" if there is none
+    std::string find(const std::string& hash, const std::string& key, const std::string& textPath);
+    void record(const std::string& hash, const std::string& key, const std::string& textPath);
+
+    // Text and sidecars (transcript, speech map) of one note into another
+    static bool copyNote(const std::string& fromText, const std::string& toText);
+
+private:
+    TranscriptionLedger() = default;
+
+    struct Folder {
+        std::map<std::string, std::string> hashes;                      // "name\tmtime\tsize" -> hash
+        std::unordered_map<std::string, std::vector<std::string>> done; // "hash\tkey" -> note bases
+    };
+    Folder& folderLocked(const std::string& dir);
+    void appendLocked(const std::string& dir, const std::string& line);
+
+    std::mutex mtx;
+    std::map<std::string, Folder> folders;   // dir (with slash) -> what its file holds
+};
+
+#endif // TRANSCRIPTION_LEDGER_H
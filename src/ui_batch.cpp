@@ -0,0 +1,114 @@
+#include "ui_batch.h"
+
+#include <algorithm>
+#include <future>
+#include <iostream>
+
+namespace {
+
+// Transparent border around atlas icons so smoothing never samples a neighbour
+const unsigned ATLAS_PADDING = 2;
+
+void quad(sf::VertexArray& va, sf::Vector2f p1, sf::Vector2f p2, sf::Vector2f uv1, sf::Vector2f uv2, sf::Color color) {
+    va.append(sf::Vertex{p1, color, uv1});
+    va.append(sf::Vertex{{p2.x, p1.y}, color, {uv2.x, uv1.y}});
+    va.append(sf::Vertex{{p1.x, p2.y}, color, {uv1.x, uv2.y}});
+    va.append(sf::Vertex{{p1.x, p2.y}, color, {uv1.x, uv2.y}});
+    va.append(sf::Vertex{{p2.x, p1.y}, color, {uv2.x, uv1.y}});
+    va.append(sf::Vertex{p2, color, uv2});
+}
+
+} // namespace
+
+void QuadBatch::rect(const sf::FloatRect& r, sf::Color color) {
+    quad(vertices, r.position, r.position + r.size, {}, {}, color);
+}
+
+void QuadBatch::image(const sf::FloatRect& dst, const sf::IntRect& src, sf::Color color) {
+    quad(vertices, dst.position, dst.position + dst.size, sf::Vector2f(src.position), sf::Vector2f(src.position + src.size), color);
+}
+
+void QuadBatch::append(const std::vector<sf::Vertex>& quads, sf::Vector2f offset) {
+    for (sf::Vertex v : quads) {
+        v.position += offset;
+        vertices.append(v);
+    }
+}
+
+unsigned QuadBatch::draw(sf::RenderTarget& target, const sf::Texture* texture) const {
+    if (vertices.getVertexCount() == 0) return 0;
+    sf::RenderStates states;
+    states.texture = texture;
+    target.draw(vertices, states);
+    return 1;
+}
+
+float appendText(std::vector<sf::Vertex>& out, const sf::Font& font, unsigned characterSize,
+                 const sf::String& text, sf::Color color) {
+    // same geometry as sf::Text: glyph bounds around the baseline, padded by
+    // a pixel on each side
+    const float padding = 1.f;
+    const float baseline = static_cast<float>(characterSize);
+    float x = 0.f;
+    char32_t prev = 0;
+    for (const char32_t c : text) {
+        if (c == '\r' || c == '\n') continue;
+        x += font.getKerning(prev, c, characterSize);
+        prev = c;
+        if (c == '\t') {
+            x += 4.f * font.getGlyph(U' ', characterSize, false).advance;
+            continue;
+        }
+        const sf::Glyph& g = font.getGlyph(c, characterSize, false);
+        if (g.bounds.size.x > 0.f && g.bounds.size.y > 0.f) {
+            const sf::Vector2f p1(x + g.bounds.position.x - padding, baseline + g.bounds.position.y - padding);
+            const sf::Vector2f p2(x + g.bounds.position.x + g.bounds.size.x + padding,
+                                  baseline + g.bounds.position.y + g.bounds.size.y + padding);
+            const sf::Vector2f uv1 = sf::Vector2f(g.textureRect.position) - sf::Vector2f(padding, padding);
+            const sf::Vector2f uv2 = sf::Vector2f(g.textureRect.position + g.textureRect.size) + sf::Vector2f(padding, padding);
+            out.push_back(sf::Vertex{p1, color, uv1});
+            out.push_back(sf::Vertex{{p2.x, p1.y}, color, {uv2.x, uv1.y}});
+            out.push_back(sf::Vertex{{p1.x, p2.y}, color, {uv1.x, uv2.y}});
+            out.push_back(sf::Vertex{{p1.x, p2.y}, color, {uv1.x, uv2.y}});
+            out.push_back(sf::Vertex{{p2.x, p1.y}, color, {uv2.x, uv1.y}});
+            out.push_back(sf::Vertex{p2, color, uv2});
+        }
+        x += g.advance;
+    }
+    return x;
+}
+
+std::vector<sf::Image> IconAtlas::decode(const std::vector<std::string>& paths) {
+    std::vector<std::future<sf::Image>> pending;
+    for (const std::string& path : paths) {
+        pending.push_back(std::async(std::launch::async, [path]{
+            sf::Image img;
+            if (!img.loadFromFile(path)) std::cerr << "Missing " << path << "\n";
+            return img;
+        }));
+    }
+    std::vector<sf::Image> images;
+    for (auto& f : pending) images.push_back(f.get());
+    return images;
+}
+
+void IconAtlas::build(const std::vector<sf::Image>& images) {
+    sf::Vector2u size(ATLAS_PADDING, 1);
+    for (const sf::Image& img : images) {
+        size.x += img.getSize().x + ATLAS_PADDING;
+        size.y = std::max(size.y, img.getSize().y + 2 * ATLAS_PADDING);
+    }
+
+    sf::Image packed(size, sf::Color::Transparent);
+    rects.clear();
+    unsigned x = ATLAS_PADDING;
+    for (const sf::Image& img : images) {
+        const sf::Vector2u s = img.getSize();
+        if (s.x > 0 && s.y > 0) (void) packed.copy(img, {x, ATLAS_PADDING});
+        rects.push_back(sf::IntRect({static_cast<int>(x), static_cast<int>(ATLAS_PADDING)},
+                                    {static_cast<int>(s.x), static_cast<int>(s.y)}));
+        x += s.x + ATLAS_PADDING;
+    }
+    if (!atlas.loadFromImage(packed)) std::cerr << "Failed to create the icon atlas\n";
+    atlas.setSmooth(true);
+}
@@ -0,0 +1,51 @@
+#ifndef UI_BATCH_H
+#define UI_BATCH_H
+
+#include <SFML/Graphics.hpp>
+#include <string>
+#include <vector>
+
+// Draw-call batching for the hub window. Every sf::Shape, sf::Sprite and
+// sf::Text is a draw call of its own; the hub instead collects everything
+// that shares a texture (none, the icon atlas, one font page) into one
+// vertex array and draws that once.
+class QuadBatch {
+public:
+    void clear() { vertices.clear(); }
+    void rect(const sf::FloatRect& r, sf::Color color);
+    // A texture region (pixels) stretched over dst
+    void image(const sf::FloatRect& dst, const sf::IntRect& src, sf::Color color = sf::Color::White);
+    // Vertices built at the origin (e.g. by appendText), moved by offset
+    void append(const std::vector<sf::Vertex>& quads, sf::Vector2f offset);
+    // Returns the draw calls issued (0 when empty, else 1)
+    unsigned draw(sf::RenderTarget& target, const sf::Texture* texture = nullptr) const;
+
+private:
+    sf::VertexArray vertices{sf::PrimitiveType::Triangles};
+};
+
+// Glyph quads of `text` as sf::Text would lay them out on one line at the
+// origin (first baseline at characterSize), with texture coordinates into
+// font.getTexture(characterSize); returns the advance width. The result can
+// be cached: glyphs keep their place in the page when it grows.
+float appendText(std::vector<sf::Vertex>& out, const sf::Font& font, unsigned characterSize,
+                 const sf::String& text, sf::Color color);
+
+// Icons packed side by side into one texture
+class IconAtlas {
+public:
+    // Reads and decodes the files in parallel; safe off the UI thread.
+    // Missing files are reported and leave an empty slot
+    static std::vector<sf::Image> decode(const std::vector<std::string>& paths);
+    // Packs decoded icons into the texture (UI thread)
+    void build(const std::vector<sf::Image>& images);
+    const sf::Texture& texture() const { return atlas; }
+    // Region of the i-th icon, in load order
+    sf::IntRect rect(std::size_t i) const { return i < rects.size() ? rects[i] : sf::IntRect(); }
+
+private:
+    sf::Texture atlas;
+    std::vector<sf::IntRect> rects;
+};
+
+#endif // UI_BATCH_H
@@ -0,0 +1,79 @@
+#include "ui_wake.h"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+  #define WIN32_LEAN_AND_MEAN
+  #include <windows.h>
+#endif
+
+UiWake& UiWake::instance() {
+    static UiWake w;
+    return w;
+}
+
+UiWake::UiWake() {
+#if defined(_WIN32)
+    event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+#endif
+}
+
+UiWake::~UiWake() {
+#if defined(_WIN32)
+    if (event) CloseHandle(static_cast<HANDLE>(event));
+#endif
+}
+
+void UiWake::post(Message m) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        messages.push_back(m);
+    }
+    wake();
+}
+
+void UiWake::wake() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        woken = true;
+    }
+    cv.notify_one();
+#if defined(_WIN32)
+    if (event) SetEvent(static_cast<HANDLE>(event));
+#endif
+}
+
+std::optional<sf::Event> UiWake::wait(sf::WindowBase& win, std::chrono::milliseconds timeout) {
+    const auto until = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+        if (std::optional<sf::Event> ev = win.pollEvent()) return ev;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (woken) { woken = false; return std::nullopt; }
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= until) return std::nullopt;
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - now) + std::chrono::milliseconds(1);
+#if defined(_WIN32)
+        // Sleeps until input or any other message reaches this thread's
+        // queue (pollEvent() dispatches it) or a producer sets the event
+        HANDLE h = static_cast<HANDLE>(event);
+        MsgWaitForMultipleObjectsEx(h ? 1 : 0, h ? &h : nullptr, static_cast<DWORD>(left.count()),
+                                    QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+#else
+        // SFML has no blocking wait here either (waitEvent() polls every
+        // 10 ms); do the same, but on the condition variable so a post()
+        // ends the sleep at once
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait_for(lock, std::min(left, std::chrono::milliseconds(10)), [&]{ return woken; });
+#endif
+    }
+}
+
+bool UiWake::take(Message& m) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (messages.empty()) return false;
+    m = messages.front();
+    messages.pop_front();
+    return true;
+}
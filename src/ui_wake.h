@@ -0,0 +1,51 @@
+#ifndef UI_WAKE_H
+#define UI_WAKE_H
+
+#include <SFML/Window/Event.hpp>
+#include <SFML/Window/WindowBase.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Wakes the UI loop from other threads. Producers (global hotkeys,
+// transcription events, waveform loads) post() a message or just wake();
+// the loop sleeps in wait() until a window event arrives, something was
+// posted, or its deadline passes, so it can sleep until the next caret blink
+// without polling for background news.
+class UiWake {
+public:
+    enum class Message {
+        ToggleRecording,     // global record hotkey
+        ShowWindow,          // global "open notes" hotkey
+    };
+
+    static UiWake& instance();
+
+    // Thread-safe
+    void post(Message m);
+    // Something the loop polls itself (e.g. TranscriptionEngine events) changed
+    void wake();
+
+    // UI thread: the next window event, or nullopt once woken or at timeout
+    std::optional<sf::Event> wait(sf::WindowBase& win, std::chrono::milliseconds timeout);
+    // UI thread: next posted message; false when none is waiting
+    bool take(Message& m);
+
+private:
+    UiWake();
+    ~UiWake();
+    UiWake(const UiWake&) = delete;
+    UiWake& operator=(const UiWake&) = delete;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Message> messages;
+    bool woken = false;
+#if defined(_WIN32)
+    void* event = nullptr;   // auto-reset event the UI thread waits on with its message queue
+#endif
+};
+
+#endif // UI_WAKE_H
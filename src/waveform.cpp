@@ -0,0 +1,163 @@
+#include "waveform.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace {
+
+const char PEAKS_MAGIC[4] = {'N', 'P', 'K', 'S'};
+const std::uint32_t PEAKS_VERSION = 1;
+
+struct PeaksHeader {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t sampleRate;
+    std::uint32_t baseFrames;
+    std::uint64_t frames;
+    std::uint32_t levels;           // each: u64 pair count, then the pairs
+    std::uint32_t reserved;
+};
+static_assert(sizeof(PeaksHeader) == 32, "peaks header layout");
+
+// Decoding block for buildFromFile, in samples
+const std::size_t READ_BLOCK = 1 << 16;
+
+} // namespace
+
+void WaveformPyramid::reset(unsigned sampleRate, unsigned channelCount) {
+    rate = sampleRate;
+    channels = channelCount ? channelCount : 1;
+    frameCount = 0;
+    levels.assign(1, {});
+    partial = {};
+    partialFrames = 0;
+    partialChannel = 0;
+}
+
+void WaveformPyramid::push(const std::int16_t* samples, std::size_t count) {
+    if (levels.empty()) levels.resize(1);
+    for (std::size_t i = 0; i < count; ++i) {
+        const std::int16_t s = samples[i];
+        if (partialFrames == 0 && partialChannel == 0) partial = {s, s};
+        partial.min = std::min(partial.min, s);
+        partial.max = std::max(partial.max, s);
+        if (++partialChannel < channels) continue;
+        partialChannel = 0;
+        ++frameCount;
+        if (++partialFrames == BASE_FRAMES) {
+            levels[0].push_back(partial);
+            partialFrames = 0;
+        }
+    }
+}
+
+void WaveformPyramid::finish() {
+    if (levels.empty()) levels.resize(1);
+    if (partialFrames > 0) levels[0].push_back(partial);
+    partialFrames = 0;
+    partialChannel = 0;
+
+    levels.resize(1);
+    while (levels.back().size() > 1) {
+        const std::vector<Peak>& below = levels.back();
+        std::vector<Peak> level((below.size() + 1) / 2);
+        for (std::size_t i = 0; i < level.size(); ++i) {
+            const Peak& a = below[2 * i];
+            const Peak& b = 2 * i + 1 < below.size() ? below[2 * i + 1] : a;
+            level[i] = {std::min(a.min, b.min), std::max(a.max, b.max)};
+        }
+        levels.push_back(std::move(level));
+    }
+}
+
+bool WaveformPyramid::save(const std::string& path) const {
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        PeaksHeader h{};
+        std::memcpy(h.magic, PEAKS_MAGIC, sizeof(h.magic));
+        h.version = PEAKS_VERSION;
+        h.sampleRate = rate;
+        h.baseFrames = BASE_FRAMES;
+        h.frames = frameCount;
+        h.levels = (std::uint32_t) levels.size();
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        for (const auto& level : levels) {
+            const std::uint64_t n = level.size();
+            out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+            out.write(reinterpret_cast<const char*>(level.data()), (std::streamsize) (n * sizeof(Peak)));
+        }
+        if (!out) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+bool WaveformPyramid::load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    PeaksHeader h;
+    if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)) || std::memcmp(h.magic, PEAKS_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != PEAKS_VERSION || h.baseFrames != BASE_FRAMES || h.sampleRate == 0 || h.levels == 0 || h.levels > 64) {
+        return false;
+    }
+
+    std::vector<std::vector<Peak>> loaded(h.levels);
+    std::uint64_t expect = (h.frames + BASE_FRAMES - 1) / BASE_FRAMES;
+    for (auto& level : loaded) {
+        std::uint64_t n = 0;
+        if (!in.read(reinterpret_cast<char*>(&n), sizeof(n)) || n != expect) return false;
+        level.resize((std::size_t) n);
+        if (!in.read(reinterpret_cast<char*>(level.data()), (std::streamsize) (n * sizeof(Peak)))) return false;
+        expect = (n + 1) / 2;
+    }
+    rate = h.sampleRate;
+    frameCount = h.frames;
+    levels = std::move(loaded);
+    partialFrames = 0;
+    partialChannel = 0;
+    return true;
+}
+
+bool WaveformPyramid::buildFromFile(const std::string& audioPath) {
+    sf::InputSoundFile file;
+    if (!file.openFromFile(audioPath) || file.getChannelCount() == 0 || file.getSampleRate() == 0) return false;
+    reset(file.getSampleRate(), file.getChannelCount());
+
+    std::vector<std::int16_t> block(READ_BLOCK - READ_BLOCK % channels);
+    for (;;) {
+        const std::uint64_t got = file.read(block.data(), block.size());
+        if (got == 0) break;
+        push(block.data(), (std::size_t) got);
+    }
+    finish();
+    return true;
+}
+
+WaveformPyramid::Peak WaveformPyramid::range(std::uint64_t begin, std::uint64_t end) const {
+    if (empty() || end <= begin) return {};
+
+    // coarsest level whose pairs are no longer than the range
+    std::size_t level = 0;
+    while (level + 1 < levels.size() && ((std::uint64_t) BASE_FRAMES << (level + 1)) <= end - begin) ++level;
+    const std::uint64_t span = (std::uint64_t) BASE_FRAMES << level;
+    const std::vector<Peak>& pairs = levels[level];
+
+    const std::size_t first = (std::size_t) std::min<std::uint64_t>(begin / span, pairs.size() - 1);
+    const std::size_t last = (std::size_t) std::min<std::uint64_t>((end + span - 1) / span, pairs.size());
+    Peak out = pairs[first];
+    for (std::size_t i = first + 1; i < last; ++i) {
+        out.min = std::min(out.min, pairs[i].min);
+        out.max = std::max(out.max, pairs[i].max);
+    }
+    return out;
+}
+
+std::string peaksPath(const std::string& audioPath) {
+    return std::filesystem::path(audioPath).replace_extension(".peaks").string();
+}
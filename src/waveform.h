@@ -0,0 +1,57 @@
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Min/max overview of a recording for the waveform strip.
+//
+// Level 0 holds one min/max pair per BASE_FRAMES frames (the extremes over
+// all channels); every further level halves the one below. Any strip width
+// is then drawn from a handful of pairs per pixel whatever the length: an
+// hour at 44.1 kHz is ~620k pairs at level 0 but ~1.2k at level 9. Built
+// while recording (or once from the file for older notes) and cached next
+// to the recording as <base>.peaks.
+class WaveformPyramid {
+public:
+    static constexpr std::uint32_t BASE_FRAMES = 256;
+    struct Peak {
+        std::int16_t min = 0;
+        std::int16_t max = 0;
+    };
+
+    void reset(unsigned sampleRate, unsigned channelCount);
+    // Interleaved 16-bit frames, in order
+    void push(const std::int16_t* samples, std::size_t count);
+    // End of the recording: close the partial pair and build the upper levels
+    void finish();
+
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
+    // Decodes the whole recording once; false if it cannot be read
+    bool buildFromFile(const std::string& audioPath);
+
+    unsigned sampleRate() const { return rate; }
+    std::uint64_t frames() const { return frameCount; }
+    bool empty() const { return levels.empty() || levels[0].empty(); }
+
+    // Extremes over [begin, end) frames, from the coarsest level that still
+    // has a pair boundary inside the range; a few pairs are read at most
+    Peak range(std::uint64_t begin, std::uint64_t end) const;
+
+private:
+    unsigned rate = 0;
+    unsigned channels = 1;
+    std::uint64_t frameCount = 0;
+    std::vector<std::vector<Peak>> levels;
+    Peak partial;                        // level-0 pair being filled
+    std::uint32_t partialFrames = 0;
+    unsigned partialChannel = 0;         // channel of the next pushed sample
+};
+
+// <base>.peaks next to the recording
+std::string peaksPath(const std::string& audioPath);
+
+#endif // WAVEFORM_H
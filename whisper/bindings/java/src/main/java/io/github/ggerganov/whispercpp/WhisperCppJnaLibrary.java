@@ -107,6 +107,34 @@ public interface WhisperCppJnaLibrary extends Library {
      */
     void whisper_free_state(Pointer state);
 
+    /**
+     * Clear a state for the next job, keeping its buffers allocated.
+     *
+     * @param state Whisper state
+     */
+    void whisper_state_reset(Pointer state);
+
+    /**
+     * Save the resumable part of a state (seek position, results, prompt history) to a file.
+     *
+     * @param ctx        Whisper context
+     * @param state      Whisper state
+     * @param path       Output file
+     * @param include_kv Also store the cross-attention KV cache of the last encoded window
+     * @return true on success
+     */
+    boolean whisper_state_save_file(Pointer ctx, Pointer state, String path, boolean include_kv);
+
+    /**
+     * Restore a state saved with whisper_state_save_file(), to continue the job with WhisperFullParams.resume.
+     *
+     * @param ctx   Whisper context of the same model
+     * @param state Whisper state
+     * @param path  Input file
+     * @return true on success
+     */
+    boolean whisper_state_load_file(Pointer ctx, Pointer state, String path);
+
 
     /**
      * Convert RAW PCM audio to log mel spectrogram.
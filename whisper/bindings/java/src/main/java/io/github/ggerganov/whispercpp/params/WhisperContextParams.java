@@ -26,6 +26,9 @@ public class WhisperContextParams extends Structure {
     /** CUDA device to use (default = 0) */
     public int gpu_device;
 
+    /** Number of encoder, then decoder layers on the GPU (default = -1, all) */
+    public int n_gpu_layers;
+
     /** [EXPERIMENTAL] Enable token-level timestamps with DTW (default = false) */
     public CBool dtw_token_timestamps;
 
@@ -40,6 +43,69 @@ public class WhisperContextParams extends Structure {
     /** DTW memory size (internal use) */
     public NativeLong dtw_mem_size;
 
+    /** Map the model file instead of reading it */
+    public CBool use_mmap;
+
+    /** Skip the encoder when the same mel window is encoded again */
+    public CBool encoder_cache;
+
+    /** Storage type of the KV caches (ggml_type, default GGML_TYPE_F16) */
+    public int type_kv;
+
+    /** How long the CPU worker threads poll for work before they sleep (0 - 100, default 50) */
+    public int cpu_poll;
+
+    /** Keep CPU weights in the extra (repacked) buffer types of the CPU backend */
+    public CBool use_extra_bufts;
+
+    /** Place the CPU worker threads on the fastest cores first (hybrid CPUs, NUMA hosts) */
+    public CBool cpu_affinity;
+
+    /** CPU worker threads owned by the application (ggml_threadpool_t, default NULL) */
+    public Pointer threadpool;
+
+    /** Callback for the graph nodes being computed (ggml_backend_sched_eval_callback, default NULL) */
+    public Pointer cb_eval;
+
+    /** User data passed to cb_eval */
+    public Pointer cb_eval_user_data;
+
+    /** One set of compute buffers for all the graphs of a state (smaller footprint per state) */
+    public CBool share_compute_buffers;
+
+    /** Project the cross-attention K/V in the encoder graph (one graph less per encode) */
+    public CBool fuse_cross;
+
+    /** File caching the load-time calibration of weight layout and threads (default NULL - off) */
+    public String autotune_cache;
+
+    /** Comma-separated ggml RPC servers (host:port) to run the encoder on */
+    public String rpc_servers;
+
+    /** Back the CPU weights and compute buffers with huge pages */
+    public CBool use_hugepages;
+
+    /** Keep one copy of the CPU weights per NUMA node */
+    public CBool numa_replicate;
+
+    /** Number of GPUs holding a copy of the GPU weights (0 - all) */
+    public int n_gpu_devices;
+
+    /** Pack the Q, K and V weights of each self-attention layer into one matmul */
+    public CBool fuse_qkv;
+
+    /** Return from init once the encoder weights are loaded, the decoder keeps loading in the background */
+    public CBool progressive_load;
+
+    /** File keeping the compute buffer sizes of the graphs across processes (default NULL - off) */
+    public String sched_cache;
+
+    /** Type the full precision matmul weights are converted to while loading (ggml_type, default GGML_TYPE_COUNT - as stored) */
+    public int type_weights;
+
+    /** Comma-separated REGEX=TYPE overrides of type_weights (default NULL) */
+    public String tensor_types;
+
     /** Use GPU for inference */
     public void useGpu(boolean enable) {
         use_gpu = enable ? CBool.TRUE : CBool.FALSE;
@@ -55,6 +121,21 @@ public class WhisperContextParams extends Structure {
         dtw_token_timestamps = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** Map the model file instead of reading it */
+    public void useMmap(boolean enable) {
+        use_mmap = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
+    /** Convert the full precision matmul weights to this ggml_type while loading */
+    public void setTypeWeights(int type) {
+        type_weights = type;
+    }
+
+    /** Per-weight overrides of type_weights, e.g. "decoder.token_embedding.weight=q8_0" */
+    public void setTensorTypes(String overrides) {
+        tensor_types = overrides;
+    }
+
     /** Set DTW alignment heads preset */
     public void setDtwAheadsPreset(int preset) {
         dtw_aheads_preset = preset;
@@ -66,11 +147,33 @@ public class WhisperContextParams extends Structure {
             "use_gpu",
             "flash_attn",
             "gpu_device",
+            "n_gpu_layers",
             "dtw_token_timestamps",
             "dtw_aheads_preset",
             "dtw_n_top",
             "dtw_aheads",
-            "dtw_mem_size"
+            "dtw_mem_size",
+            "use_mmap",
+            "encoder_cache",
+            "type_kv",
+            "cpu_poll",
+            "use_extra_bufts",
+            "cpu_affinity",
+            "threadpool",
+            "cb_eval",
+            "cb_eval_user_data",
+            "share_compute_buffers",
+            "fuse_cross",
+            "autotune_cache",
+            "rpc_servers",
+            "use_hugepages",
+            "numa_replicate",
+            "n_gpu_devices",
+            "fuse_qkv",
+            "progressive_load",
+            "sched_cache",
+            "type_weights",
+            "tensor_types"
         );
     }
 
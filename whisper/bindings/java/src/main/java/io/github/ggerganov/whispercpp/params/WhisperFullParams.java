@@ -40,6 +40,20 @@ public class WhisperFullParams extends Structure {
     /** Audio duration to process in milliseconds. (default = 0) */
     public int duration_ms;
 
+    /** Chunked long-form mode: chunk length in milliseconds, 0 for sequential windows. (default = 0) */
+    public int chunk_ms;
+
+    /** Overlap on each side of a chunk in milliseconds, 0 for chunk_ms/6. (default = 0) */
+    public int chunk_stride_ms;
+
+    /** whisper_full_parallel(): overlap of neighbouring slices in milliseconds, merged where their tokens agree; 0 for hard cuts. (default = 4000) */
+    public int parallel_overlap_ms;
+
+    /** Overlap of the slices of whisper_full_parallel() in milliseconds */
+    public void setParallelOverlapMs(int ms) {
+        parallel_overlap_ms = ms;
+    }
+
     /** Translate flag. (default = false) */
     public CBool translate;
 
@@ -61,6 +75,9 @@ public class WhisperFullParams extends Structure {
         no_context = enable ? CBool.FALSE : CBool.TRUE;
     }
 
+    /** Continue from the seek position, results and prompt history of the state (whisper_state_load_file). (default = false) */
+    public CBool resume;
+
     /** Generate timestamps or not? */
     public CBool no_timestamps;
 
@@ -143,6 +160,12 @@ public class WhisperFullParams extends Structure {
     /** Overwrite the audio context size (0 = use default). */
     public int audio_ctx;
 
+    /** Shrink the audio context to the audio left in the window when audio_ctx is 0 (default = false) */
+    public CBool audio_ctx_auto;
+
+    /** Encode the next window on a second state while the current one decodes (default = false) */
+    public CBool encode_ahead;
+
     /** Enable tinydiarize (default = false) */
     public CBool tdrz_enable;
 
@@ -184,6 +207,15 @@ public class WhisperFullParams extends Structure {
         detect_language = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** Audio context of the language detection, 0 = the whole window. (default = 0) */
+    public int lid_audio_ctx;
+
+    /** With lid_audio_ctx, detect again on the whole window below this probability. (default = 0.8) */
+    public float lid_thold;
+
+    /** Keep the language of the state's last detection if its probability is >= lid_thold. (default = false) */
+    public CBool lid_cache;
+
     // Common decoding parameters.
 
     /** Flag to suppress blank tokens. */
@@ -224,6 +256,12 @@ public class WhisperFullParams extends Structure {
     /** No speech threshold. */
     public float no_speech_thold;
 
+    /** Skip the decoding of a window whose no speech probability after the prompt is above this, 0 = off. (default = 0) */
+    public float no_speech_skip_thold;
+
+    /** Fail a decoder once its last text tokens repeat one phrase of up to 32 tokens 3 times and at least this many tokens, then fall back, 0 = off. (default = 16) */
+    public int repeat_thold;
+
     /** Greedy decoding parameters. */
     public GreedyParams greedy;
 
@@ -265,6 +303,16 @@ public class WhisperFullParams extends Structure {
      */
     public Pointer new_segment_callback_user_data;
 
+    /**
+     * Callback for every token sampled while a window is decoded.
+     */
+    public Pointer new_token_callback;
+
+    /**
+     * User data for the new_token_callback.
+     */
+    public Pointer new_token_callback_user_data;
+
     /**
      * Callback on each progress update.
      * WhisperProgressCallback
@@ -287,6 +335,16 @@ public class WhisperFullParams extends Structure {
      */
     public Pointer encoder_begin_callback_user_data;
 
+    /**
+     * Callback before the encoder runs on each window.
+     */
+    public Pointer encoder_window_callback;
+
+    /**
+     * User data for the encoder_window_callback.
+     */
+    public Pointer encoder_window_callback_user_data;
+
     /** Callback used to abort GGML computation */
     public Pointer abort_callback;
 
@@ -331,25 +389,58 @@ public class WhisperFullParams extends Structure {
     public long i_start_rule;
     public float grammar_penalty;
 
+    /** Enable VAD. (default = false) */
+    public CBool vad;
+
+    /** Path to the VAD model. */
+    public String vad_model_path;
+
+    public WhisperVadParams vad_params;
+
+    /** [EXPERIMENTAL] Draft model (whisper context) for speculative greedy decoding, null to disable. (default = null) */
+    public Pointer draft_ctx;
+
+    /** Number of tokens the draft model proposes per decode. (default = 4) */
+    public int n_draft;
+
+    /** Decode greedily with a smaller model of the same vocabulary proposing nDraft tokens at a time */
+    public void setDraftContext(Pointer ctx, int nDraft) {
+        draft_ctx = ctx;
+        n_draft = nDraft;
+    }
+
+    /** Without draft_ctx: propose up to n_draft tokens that followed the last n_lookup tokens earlier in the prompt or segment, 0 to disable. (default = 0) */
+    public int n_lookup;
+
+    /** Speculative decoding by prompt lookup, no draft model needed */
+    public void setPromptLookup(int nLookup, int nDraft) {
+        n_lookup = nLookup;
+        n_draft = nDraft;
+    }
+
     @Override
     protected List<String> getFieldOrder() {
         return Arrays.asList("strategy", "n_threads", "n_max_text_ctx",
-                "offset_ms", "duration_ms", "translate", "no_context",
+                "offset_ms", "duration_ms", "chunk_ms", "chunk_stride_ms", "parallel_overlap_ms", "translate", "no_context", "resume",
                 "no_timestamps", "single_segment", "print_special",
                 "print_progress", "print_realtime", "print_timestamps",
                 "token_timestamps", "thold_pt", "thold_ptsum", "max_len",
                 "split_on_word", "max_tokens", "debug_mode", "audio_ctx",
-                "tdrz_enable", "suppress_regex", "initial_prompt", "carry_initial_prompt",
+                "audio_ctx_auto", "encode_ahead", "tdrz_enable", "suppress_regex", "initial_prompt", "carry_initial_prompt",
                 "prompt_tokens", "prompt_n_tokens", "language", "detect_language",
+                "lid_audio_ctx", "lid_thold", "lid_cache",
                 "suppress_blank", "suppress_nst", "temperature",
                 "max_initial_ts", "length_penalty", "temperature_inc",
-                "entropy_thold", "logprob_thold", "no_speech_thold", "greedy",
+                "entropy_thold", "logprob_thold", "no_speech_thold", "no_speech_skip_thold", "repeat_thold", "greedy",
                 "beam_search", "new_segment_callback", "new_segment_callback_user_data",
+                "new_token_callback", "new_token_callback_user_data",
                 "progress_callback", "progress_callback_user_data",
                 "encoder_begin_callback", "encoder_begin_callback_user_data",
+                "encoder_window_callback", "encoder_window_callback_user_data",
                 "abort_callback", "abort_callback_user_data",
                 "logits_filter_callback", "logits_filter_callback_user_data",
-                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty");
+                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty",
+                "vad", "vad_model_path", "vad_params", "draft_ctx", "n_draft", "n_lookup");
     }
 
     public static class ByValue extends WhisperFullParams implements Structure.ByValue {
@@ -272,6 +272,161 @@ VALUE ruby_whisper_model_type(VALUE self)
   return rb_str_new2(whisper_model_type_readable(rw->context));
 }
 
+/*
+ * Samples passed to full and full_parallel.
+ * Strings and MemoryViews are borrowed for the duration of the transcription,
+ * Arrays and Enumerables are copied into a buffer of floats.
+ */
+typedef struct {
+  VALUE samples;
+  VALUE n_samples_value; // Qnil when not given
+  float *data;
+  int n_samples;
+  bool copied;
+  rb_memory_view_t view;
+  bool view_p;
+  bool locked_p;
+} samples_buffer;
+
+typedef struct {
+  ruby_whisper *rw;
+  ruby_whisper_params *rwp;
+  VALUE *self;
+  samples_buffer *buf;
+  bool parallel;
+  int n_processors;
+  int result;
+} full_args;
+
+static int
+samples_length(VALUE n_samples_value, long available)
+{
+  if (NIL_P(n_samples_value)) {
+    if (available > INT_MAX) {
+      rb_raise(rb_eArgError, "samples are too long");
+    }
+    return (int)available;
+  }
+  const int n_samples = NUM2INT(n_samples_value);
+  if (available < n_samples) {
+    rb_raise(rb_eArgError, "samples length %ld is less than n_samples %d", available, n_samples);
+  }
+  return n_samples;
+}
+
+static void
+get_samples(samples_buffer *buf)
+{
+  VALUE samples = buf->samples;
+
+  if (RB_TYPE_P(samples, T_STRING)) {
+    // packed 32 bit floats in native byte order, e.g. Array#pack("e*") on little-endian machines
+    const long available = RSTRING_LEN(samples) / (long)sizeof(float);
+    buf->n_samples = samples_length(buf->n_samples_value, available);
+    if ((uintptr_t)RSTRING_PTR(samples) % sizeof(float) == 0) {
+      // keep the string from being modified or freed while it is transcribed
+      rb_str_locktmp(samples);
+      buf->locked_p = true;
+      buf->data = (float *)RSTRING_PTR(samples);
+      return;
+    }
+    // an unaligned substring, copy it
+    buf->data = (float *)ruby_xmalloc(buf->n_samples * sizeof(float));
+    buf->copied = true;
+    memcpy(buf->data, RSTRING_PTR(samples), buf->n_samples * sizeof(float));
+    return;
+  }
+
+  if (rb_memory_view_available_p(samples)) {
+    if (!rb_memory_view_get(samples, &buf->view, RUBY_MEMORY_VIEW_SIMPLE)) {
+      rb_raise(rb_eArgError, "unable to get a memory view");
+    }
+    buf->view_p = true;
+    buf->n_samples = samples_length(buf->n_samples_value, buf->view.byte_size / buf->view.item_size);
+    buf->data = (float *)buf->view.data;
+    return;
+  }
+
+  if (TYPE(samples) == T_ARRAY) {
+    buf->n_samples = samples_length(buf->n_samples_value, RARRAY_LEN(samples));
+    buf->data = (float *)ruby_xmalloc(buf->n_samples * sizeof(float));
+    buf->copied = true;
+    for (int i = 0; i < buf->n_samples; i++) {
+      buf->data[i] = RFLOAT_VALUE(rb_ary_entry(samples, i));
+    }
+    return;
+  }
+
+  if (!NIL_P(buf->n_samples_value)) {
+    // Should check when samples.respond_to?(:length)?
+    buf->n_samples = NUM2INT(buf->n_samples_value);
+  } else if (rb_respond_to(samples, id_length)) {
+    buf->n_samples = NUM2INT(rb_funcall(samples, id_length, 0));
+  } else {
+    rb_raise(rb_eArgError, "samples must respond to :length or be a MemoryView of an array of flaot when n_samples is not given");
+  }
+  buf->data = (float *)ruby_xmalloc(buf->n_samples * sizeof(float));
+  buf->copied = true;
+  // TODO: use rb_block_call
+  VALUE iter = rb_funcall(samples, id_to_enum, 1, rb_str_new2("each"));
+  for (int i = 0; i < buf->n_samples; i++) {
+    // TODO: check if iter is exhausted and raise ArgumentError appropriately
+    VALUE sample = rb_funcall(iter, id_next, 0);
+    buf->data[i] = RFLOAT_VALUE(sample);
+  }
+}
+
+static VALUE
+release_samples(VALUE arg)
+{
+  samples_buffer *buf = (samples_buffer *)arg;
+  if (buf->locked_p) {
+    rb_str_unlocktmp(buf->samples);
+  }
+  if (buf->view_p) {
+    rb_memory_view_release(&buf->view);
+  }
+  if (buf->copied) {
+    ruby_xfree(buf->data);
+  }
+  return Qnil;
+}
+
+static VALUE
+run_full(VALUE arg)
+{
+  full_args *args = (full_args *)arg;
+  get_samples(args->buf);
+  prepare_transcription(args->rwp, args->self);
+  if (args->parallel) {
+    args->result = whisper_full_parallel(args->rw->context, args->rwp->params, args->buf->data, args->buf->n_samples, args->n_processors);
+  } else {
+    args->result = whisper_full(args->rw->context, args->rwp->params, args->buf->data, args->buf->n_samples);
+  }
+  return Qnil;
+}
+
+static VALUE
+full_with_samples(VALUE self, VALUE params, VALUE samples, VALUE n_samples_value, bool parallel, int n_processors)
+{
+  ruby_whisper *rw;
+  ruby_whisper_params *rwp;
+  TypedData_Get_Struct(self, ruby_whisper, &ruby_whisper_type, rw);
+  TypedData_Get_Struct(params, ruby_whisper_params, &ruby_whisper_params_type, rwp);
+
+  samples_buffer buf = {0};
+  buf.samples = samples;
+  buf.n_samples_value = n_samples_value;
+  full_args args = { rw, rwp, &self, &buf, parallel, n_processors, 0 };
+  rb_ensure(run_full, (VALUE)&args, release_samples, (VALUE)&buf);
+
+  if (0 == args.result) {
+    return self;
+  } else {
+    rb_exc_raise(rb_funcall(eError, id_new, 1, INT2NUM(args.result)));
+  }
+}
+
 /*
  * Run the entire model: PCM -> log mel spectrogram -> encoder -> decoder -> text
  * Not thread safe for same context
@@ -282,6 +437,8 @@ VALUE ruby_whisper_model_type(VALUE self)
  *   full(params, samples) -> nil
  *
  * The second argument +samples+ must be an array of samples, respond to :length, or be a MemoryView of an array of float. It must be 32 bit float PCM audio data.
+ * It can also be a String of packed 32 bit floats in native byte order. Strings and MemoryViews are used in place, without a copy, and the String is locked while it is transcribed.
+ * Use Params#on_new_segment to receive the segments as they are decoded.
  */
 VALUE ruby_whisper_full(int argc, VALUE *argv, VALUE self)
 {
@@ -289,70 +446,7 @@ VALUE ruby_whisper_full(int argc, VALUE *argv, VALUE self)
     rb_raise(rb_eArgError, "wrong number of arguments (given %d, expected 2..3)", argc);
   }
 
-  ruby_whisper *rw;
-  ruby_whisper_params *rwp;
-  TypedData_Get_Struct(self, ruby_whisper, &ruby_whisper_type, rw);
-  VALUE params = argv[0];
-  TypedData_Get_Struct(params, ruby_whisper_params, &ruby_whisper_params_type, rwp);
-  VALUE samples = argv[1];
-  int n_samples;
-  rb_memory_view_t view;
-  const bool memory_view_available_p = rb_memory_view_available_p(samples);
-  if (argc == 3) {
-    n_samples = NUM2INT(argv[2]);
-    if (TYPE(samples) == T_ARRAY) {
-      if (RARRAY_LEN(samples) < n_samples) {
-        rb_raise(rb_eArgError, "samples length %ld is less than n_samples %d", RARRAY_LEN(samples), n_samples);
-      }
-    }
-    // Should check when samples.respond_to?(:length)?
-  } else {
-    if (TYPE(samples) == T_ARRAY) {
-      if (RARRAY_LEN(samples) > INT_MAX) {
-        rb_raise(rb_eArgError, "samples are too long");
-      }
-      n_samples = (int)RARRAY_LEN(samples);
-    } else if (memory_view_available_p) {
-      if (!rb_memory_view_get(samples, &view, RUBY_MEMORY_VIEW_SIMPLE)) {
-        view.obj = Qnil;
-        rb_raise(rb_eArgError, "unable to get a memory view");
-      }
-      ssize_t n_samples_size = view.byte_size / view.item_size;
-      if (n_samples_size > INT_MAX) {
-        rb_raise(rb_eArgError, "samples are too long");
-      }
-      n_samples = (int)n_samples_size;
-    } else if (rb_respond_to(samples, id_length)) {
-      n_samples = NUM2INT(rb_funcall(samples, id_length, 0));
-    } else {
-      rb_raise(rb_eArgError, "samples must respond to :length or be a MemoryView of an array of flaot when n_samples is not given");
-    }
-  }
-  float * c_samples = (float *)malloc(n_samples * sizeof(float));
-  if (memory_view_available_p)  {
-    c_samples = (float *)view.data;
-  } else {
-    if (TYPE(samples) == T_ARRAY) {
-      for (int i = 0; i < n_samples; i++) {
-        c_samples[i] = RFLOAT_VALUE(rb_ary_entry(samples, i));
-      }
-    } else {
-      // TODO: use rb_block_call
-      VALUE iter = rb_funcall(samples, id_to_enum, 1, rb_str_new2("each"));
-      for (int i = 0; i < n_samples; i++) {
-        // TODO: check if iter is exhausted and raise ArgumentError appropriately
-        VALUE sample = rb_funcall(iter, id_next, 0);
-        c_samples[i] = RFLOAT_VALUE(sample);
-      }
-    }
-  }
-  prepare_transcription(rwp, &self);
-  const int result = whisper_full(rw->context, rwp->params, c_samples, n_samples);
-  if (0 == result) {
-    return self;
-  } else {
-    rb_exc_raise(rb_funcall(eError, id_new, 1, result));
-  }
+  return full_with_samples(self, argv[0], argv[1], argc == 3 ? argv[2] : Qnil, false, 1);
 }
 
 /*
@@ -367,6 +461,8 @@ VALUE ruby_whisper_full(int argc, VALUE *argv, VALUE self)
  *   full_parallel(params, samples, n_samples) -> nil
  *   full_parallel(params, samples, n_samples, n_processors) -> nil
  *   full_parallel(params, samples, nil, n_processors) -> nil
+ *
+ * +samples+ are accepted in the same forms as in #full.
  */
 static VALUE
 ruby_whisper_full_parallel(int argc, VALUE *argv,VALUE self)
@@ -375,82 +471,9 @@ ruby_whisper_full_parallel(int argc, VALUE *argv,VALUE self)
     rb_raise(rb_eArgError, "wrong number of arguments (given %d, expected 2..3)", argc);
   }
 
-  ruby_whisper *rw;
-  ruby_whisper_params *rwp;
-  TypedData_Get_Struct(self, ruby_whisper, &ruby_whisper_type, rw);
-  VALUE params = argv[0];
-  TypedData_Get_Struct(params, ruby_whisper_params, &ruby_whisper_params_type, rwp);
-  VALUE samples = argv[1];
-  int n_samples;
-  int n_processors;
-  rb_memory_view_t view;
-  const bool memory_view_available_p = rb_memory_view_available_p(samples);
-  switch (argc) {
-  case 2:
-    n_processors = 1;
-    break;
-  case 3:
-    n_processors = 1;
-    break;
-  case 4:
-    n_processors = NUM2INT(argv[3]);
-    break;
-  }
-  if (argc >= 3 && !NIL_P(argv[2])) {
-    n_samples = NUM2INT(argv[2]);
-    if (TYPE(samples) == T_ARRAY) {
-      if (RARRAY_LEN(samples) < n_samples) {
-        rb_raise(rb_eArgError, "samples length %ld is less than n_samples %d", RARRAY_LEN(samples), n_samples);
-      }
-    }
-    // Should check when samples.respond_to?(:length)?
-  } else if (memory_view_available_p) {
-    if (!rb_memory_view_get(samples, &view, RUBY_MEMORY_VIEW_SIMPLE)) {
-      view.obj = Qnil;
-      rb_raise(rb_eArgError, "unable to get a memory view");
-    }
-    ssize_t n_samples_size = view.byte_size / view.item_size;
-    if (n_samples_size > INT_MAX) {
-      rb_raise(rb_eArgError, "samples are too long");
-    }
-    n_samples = (int)n_samples_size;
-  } else {
-    if (TYPE(samples) == T_ARRAY) {
-      if (RARRAY_LEN(samples) > INT_MAX) {
-        rb_raise(rb_eArgError, "samples are too long");
-      }
-      n_samples = (int)RARRAY_LEN(samples);
-    } else if (rb_respond_to(samples, id_length)) {
-      n_samples = NUM2INT(rb_funcall(samples, id_length, 0));
-    } else {
-      rb_raise(rb_eArgError, "samples must respond to :length or be a MemoryView of an array of flaot when n_samples is not given");
-    }
-  }
-  float * c_samples = (float *)malloc(n_samples * sizeof(float));
-  if (memory_view_available_p) {
-    c_samples = (float *)view.data;
-  } else {
-    if (TYPE(samples) == T_ARRAY) {
-      for (int i = 0; i < n_samples; i++) {
-        c_samples[i] = RFLOAT_VALUE(rb_ary_entry(samples, i));
-      }
-    } else {
-      // FIXME: use rb_block_call
-      VALUE iter = rb_funcall(samples, id_to_enum, 1, rb_str_new2("each"));
-      for (int i = 0; i < n_samples; i++) {
-        // TODO: check if iter is exhausted and raise ArgumentError
-        VALUE sample = rb_funcall(iter, id_next, 0);
-        c_samples[i] = RFLOAT_VALUE(sample);
-      }
-    }
-  }
-  prepare_transcription(rwp, &self);
-  const int result = whisper_full_parallel(rw->context, rwp->params, c_samples, n_samples, n_processors);
-  if (0 == result) {
-    return self;
-  } else {
-    rb_exc_raise(rb_funcall(eError, id_new, 1, result));
-  }
+  const int n_processors = argc == 4 ? NUM2INT(argv[3]) : 1;
+
+  return full_with_samples(self, argv[0], argv[1], argc >= 3 ? argv[2] : Qnil, true, n_processors);
 }
 
 /*
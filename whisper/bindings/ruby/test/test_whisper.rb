@@ -200,6 +200,19 @@ class TestWhisper < TestBase
       assert_match(/ask not what your country can do for you, ask what you can do for your country/, @whisper.each_segment.first.text)
     end
 
+    def test_full_with_packed_string
+      samples = @samples.pack("e*")
+      texts = []
+      @params.on_new_segment do |segment|
+        texts << segment.text
+      end
+      @whisper.full(@params, samples)
+
+      assert_equal 1, @whisper.full_n_segments
+      assert_match(/ask not what your country can do for you, ask what you can do for your country/, texts.join)
+      assert_false samples.frozen?
+    end
+
     def test_full_parallel
       nprocessors = 2
       @whisper.full_parallel(@params, @samples, @samples.length, nprocessors)
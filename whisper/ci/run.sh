@@ -262,6 +262,13 @@ function gg_run_bench {
         gg_check_last_command_status "$OUT/${ci}-mul_mat.exit" "ggml_mul_mat benchmark"
     fi
 
+    # the whisper kernels (matmuls, flash attention, conv) on the GPU
+    if [ ! -z ${GG_BUILD_VULKAN} ]; then
+        echo "Running ggml ops benchmark on Vulkan0"
+        (time ./build-ci-release/bin/whisper-bench -w 4 -dev Vulkan0 -ms tiny,base,small,large -wt f16,q5_0,q8_0 -oj $OUT/${ci}-ops-vulkan.json 2>&1) | tee -a $OUT/${ci}-ops-vulkan.log
+        gg_check_last_command_status "$OUT/${ci}-ops-vulkan.exit" "ggml ops benchmark (Vulkan)"
+    fi
+
     echo "Running benchmark for all models"
 
     # generate header for the benchmark table
@@ -348,6 +355,11 @@ function gg_sum_bench {
         fi
     fi
 
+    if [ -f "$OUT/${ci}-ops-vulkan.log" ]; then
+        gg_printf '#### ggml ops Benchmark (Vulkan)\n\n'
+        gg_printf '```\n%s\n```\n\n' "$(cat $OUT/${ci}-ops-vulkan.log)"
+    fi
+
     # show model benchmark results
     gg_printf '#### Model Benchmarks\n\n'
     if [ -f "$OUT/${ci}-models-table.log" ]; then
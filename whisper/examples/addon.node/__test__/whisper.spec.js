@@ -1,5 +1,5 @@
 const { join } = require('path');
-const { whisper } = require('../../../build/Release/addon.node');
+const { whisper, WhisperContext } = require('../../../build/Release/addon.node');
 const { promisify } = require('util');
 
 const whisperAsync = promisify(whisper);
@@ -129,5 +129,34 @@ describe('Whisper.cpp Node.js addon with VAD support', () => {
     expect(Array.isArray(result.transcription)).toBe(true);
     expect(result.transcription.length).toBeGreaterThan(0);
   }, 30000);
-});
 
+  test('Persistent context with concurrent transcriptions', async () => {
+    const ctx = new WhisperContext({
+      model: commonParams.model,
+      use_gpu: commonParams.use_gpu,
+      n_states: 2
+    });
+    const transcribe = promisify(ctx.transcribe.bind(ctx));
+
+    const params = {
+      language: 'en',
+      fname_inp: commonParams.fname_inp,
+      no_prints: true
+    };
+
+    const results = await Promise.all([transcribe(params), transcribe(params), transcribe(params)]);
+    ctx.free();
+
+    for (const result of results) {
+      const text = result.transcription.map(segment => segment[2]).join(' ');
+      expect(text.toLowerCase()).toContain('ask not');
+    }
+  }, 60000);
+
+  test('Persistent context rejects calls after free', () => {
+    const ctx = new WhisperContext({ model: commonParams.model, use_gpu: commonParams.use_gpu });
+    ctx.free();
+
+    expect(() => ctx.transcribe({ fname_inp: commonParams.fname_inp }, () => {})).toThrow();
+  });
+});
@@ -4,12 +4,16 @@
 
 #include "whisper.h"
 
+#include <algorithm>
 #include <string>
 #include <thread>
 #include <vector>
 #include <cmath>
 #include <cstdint>
 #include <cfloat>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 struct whisper_params {
     int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
@@ -51,8 +55,6 @@ struct whisper_params {
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
 
-    std::vector<float> pcmf32 = {}; // mono-channel F32 PCM
-
     // Voice Activity Detection (VAD) parameters
     bool        vad           = false;
     std::string vad_model     = "";
@@ -70,11 +72,11 @@ struct whisper_print_user_data {
     const std::vector<std::vector<float>> * pcmf32s;
 };
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * /*ctx*/, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -90,8 +92,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps && !params.no_prints) {
@@ -126,7 +128,7 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         // colorful print bug
         //
         if (!params.no_prints) {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
             printf("%s%s", speaker.c_str(), text);
         }
 
@@ -147,10 +149,51 @@ struct whisper_result {
     std::string language;
 };
 
+// the model of a WhisperContext, loaded once and shared by its transcribe() calls
+// each call runs on one of the states and waits for a free one if all are busy
+// the calls in flight hold a reference, so the model outlives WhisperContext.free()
+struct whisper_context_pool {
+    struct whisper_context * ctx = nullptr;
+
+    std::vector<struct whisper_state *> states;
+    std::vector<struct whisper_state *> states_free;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    ~whisper_context_pool() {
+        for (auto * state : states) {
+            whisper_free_state(state);
+        }
+        if (ctx) {
+            whisper_free(ctx);
+        }
+    }
+
+    struct whisper_state * acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return !states_free.empty(); });
+
+        struct whisper_state * state = states_free.back();
+        states_free.pop_back();
+
+        return state;
+    }
+
+    void release(struct whisper_state * state) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            states_free.push_back(state);
+        }
+        cv.notify_one();
+    }
+};
+
 class ProgressWorker : public Napi::AsyncWorker {
  public:
-    ProgressWorker(Napi::Function& callback, whisper_params params, Napi::Function progress_callback, Napi::Env env)
-        : Napi::AsyncWorker(callback), params(params), env(env) {
+    ProgressWorker(Napi::Function& callback, whisper_params params, Napi::Function progress_callback, Napi::Env env,
+                   std::shared_ptr<whisper_context_pool> pool = nullptr)
+        : Napi::AsyncWorker(callback), params(params), env(env), pool(std::move(pool)) {
         // Create thread-safe function
         if (!progress_callback.IsEmpty()) {
             tsfn = Napi::ThreadSafeFunction::New(
@@ -168,6 +211,29 @@ class ProgressWorker : public Napi::AsyncWorker {
             // Make sure to release the thread-safe function on destruction
             tsfn.Release();
         }
+        if (segment_tsfn) {
+            segment_tsfn.Release();
+        }
+    }
+
+    // segment_callback([t0, t1, text]) is called for each new segment while the audio is transcribed,
+    // the transcription of the result is then left empty
+    void SetSegmentCallback(Napi::Function segment_callback, Napi::Env env) {
+        segment_tsfn = Napi::ThreadSafeFunction::New(
+            env,
+            segment_callback,
+            "Segment Callback",
+            0,
+            1
+        );
+    }
+
+    // transcribe the samples of a Float32Array in place instead of params.fname_inp
+    // the reference keeps the array alive until the worker is done with it
+    void SetAudio(Napi::Float32Array pcmf32) {
+        pcmf32_ref  = Napi::Persistent(pcmf32);
+        pcmf32_data = pcmf32.Data();
+        pcmf32_size = pcmf32.ElementLength();
     }
 
     void Execute() override {
@@ -212,11 +278,42 @@ class ProgressWorker : public Napi::AsyncWorker {
         }
     }
 
+    void OnSegments(struct whisper_state * state, int n_new) {
+        if (!segment_tsfn) {
+            return;
+        }
+
+        const int n_segments = whisper_full_n_segments_from_state(state);
+        for (int i = n_segments - n_new; i < n_segments; ++i) {
+            std::string t0   = to_timestamp(whisper_full_get_segment_t0_from_state(state, i), params.comma_in_time);
+            std::string t1   = to_timestamp(whisper_full_get_segment_t1_from_state(state, i), params.comma_in_time);
+            std::string text = whisper_full_get_segment_text_from_state(state, i);
+
+            auto callback = [t0, t1, text](Napi::Env env, Napi::Function jsCallback) {
+                Napi::Array segment = Napi::Array::New(env, 3);
+                segment[(uint32_t) 0] = Napi::String::New(env, t0);
+                segment[(uint32_t) 1] = Napi::String::New(env, t1);
+                segment[(uint32_t) 2] = Napi::String::New(env, text);
+                jsCallback.Call({segment});
+            };
+
+            segment_tsfn.BlockingCall(callback);
+        }
+    }
+
  private:
     whisper_params params;
     whisper_result result;
     Napi::Env env;
     Napi::ThreadSafeFunction tsfn;
+    Napi::ThreadSafeFunction segment_tsfn;
+
+    // set for WhisperContext.transcribe(), the model is loaded per call otherwise
+    std::shared_ptr<whisper_context_pool> pool;
+
+    Napi::Reference<Napi::Float32Array> pcmf32_ref;
+    const float * pcmf32_data = nullptr;
+    size_t        pcmf32_size = 0;
 
     // Custom run function with progress callback support
     int run_with_progress(whisper_params &params, whisper_result & result) {
@@ -224,7 +321,7 @@ class ProgressWorker : public Napi::AsyncWorker {
             whisper_log_set(cb_log_disable, NULL);
         }
 
-        if (params.fname_inp.empty() && params.pcmf32.empty()) {
+        if (params.fname_inp.empty() && pcmf32_data == nullptr) {
             fprintf(stderr, "error: no input files or audio buffer specified\n");
             return 2;
         }
@@ -234,6 +331,16 @@ class ProgressWorker : public Napi::AsyncWorker {
             exit(0);
         }
 
+        if (pool) {
+            struct whisper_state * state = pool->acquire();
+
+            const int ret = run_files(pool->ctx, state, params, result);
+
+            pool->release(state);
+
+            return ret;
+        }
+
         // whisper init
         struct whisper_context_params cparams = whisper_context_default_params();
         cparams.use_gpu = params.use_gpu;
@@ -245,8 +352,18 @@ class ProgressWorker : public Napi::AsyncWorker {
             return 3;
         }
 
-        // If params.pcmf32 provides, set params.fname_inp as "buffer"
-        if (!params.pcmf32.empty()) {
+        const int ret = run_files(ctx, nullptr, params, result);
+
+        whisper_print_timings(ctx);
+        whisper_free(ctx);
+
+        return ret;
+    }
+
+    // state == nullptr: run in the default state of ctx, with params.n_processors
+    int run_files(struct whisper_context * ctx, struct whisper_state * state, whisper_params & params, whisper_result & result) {
+        // If an audio buffer is provided, set params.fname_inp as "buffer"
+        if (pcmf32_data != nullptr) {
             fprintf(stderr, "info: using audio buffer as input\n");
             params.fname_inp.clear();
             params.fname_inp.emplace_back("buffer");
@@ -259,16 +376,17 @@ class ProgressWorker : public Napi::AsyncWorker {
             std::vector<float> pcmf32; // mono-channel F32 PCM
             std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
 
-            // If params.pcmf32 is empty, read input audio file
-            if (params.pcmf32.empty()) {
+            // If no audio buffer is provided, read input audio file
+            if (pcmf32_data == nullptr) {
                 if (!::read_audio_data(fname_inp, pcmf32, pcmf32s, params.diarize)) {
                     fprintf(stderr, "error: failed to read audio file '%s'\n", fname_inp.c_str());
                     continue;
                 }
-            } else {
-                pcmf32 = params.pcmf32;
             }
 
+            const float * samples   = pcmf32_data ? pcmf32_data : pcmf32.data();
+            const int     n_samples = pcmf32_data ? (int) pcmf32_size : (int) pcmf32.size();
+
             // Print system info
             if (!params.no_prints) {
                 fprintf(stderr, "\n");
@@ -287,7 +405,7 @@ class ProgressWorker : public Napi::AsyncWorker {
                     }
                 }
                 fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, lang = %s, task = %s, timestamps = %d, audio_ctx = %d ...\n",
-                        __func__, fname_inp.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
+                        __func__, fname_inp.c_str(), n_samples, float(n_samples)/WHISPER_SAMPLE_RATE,
                         params.n_threads, params.n_processors,
                         params.language.c_str(),
                         params.translate ? "translate" : "transcribe",
@@ -329,11 +447,20 @@ class ProgressWorker : public Napi::AsyncWorker {
 
                 wparams.no_timestamps    = params.no_timestamps;
 
-                whisper_print_user_data user_data = { &params, &pcmf32s };
+                struct segment_user_data {
+                    whisper_print_user_data print;
+                    ProgressWorker        * worker;
+                };
+
+                segment_user_data user_data = { { &params, &pcmf32s }, this };
 
                 // This callback is called for each new segment
                 if (!wparams.print_realtime) {
-                    wparams.new_segment_callback           = whisper_print_segment_callback;
+                    wparams.new_segment_callback = [](struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+                        segment_user_data * data = static_cast<segment_user_data *>(user_data);
+                        whisper_print_segment_callback(ctx, state, n_new, &data->print);
+                        data->worker->OnSegments(state, n_new);
+                    };
                     wparams.new_segment_callback_user_data = &user_data;
                 }
 
@@ -355,7 +482,9 @@ class ProgressWorker : public Napi::AsyncWorker {
                 wparams.vad_params.speech_pad_ms           = params.vad_speech_pad_ms;
                 wparams.vad_params.samples_overlap         = params.vad_samples_overlap;
 
-                if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+                const int ret = state ? whisper_full_with_state(ctx, state, wparams, samples, n_samples)
+                                      : whisper_full_parallel(ctx, wparams, samples, n_samples, params.n_processors);
+                if (ret != 0) {
                     fprintf(stderr, "failed to process audio\n");
                     return 10;
                 }
@@ -363,39 +492,43 @@ class ProgressWorker : public Napi::AsyncWorker {
         }
 
         if (params.detect_language || params.language == "auto") {
-            result.language = whisper_lang_str(whisper_full_lang_id(ctx));
+            result.language = whisper_lang_str(state ? whisper_full_lang_id_from_state(state) : whisper_full_lang_id(ctx));
+        }
+        if (segment_tsfn) {
+            // the segments were passed to the segment callback already
+            return 0;
         }
-        const int n_segments = whisper_full_n_segments(ctx);
+
+        const int n_segments = state ? whisper_full_n_segments_from_state(state) : whisper_full_n_segments(ctx);
         result.segments.resize(n_segments);
 
         for (int i = 0; i < n_segments; ++i) {
-            const char * text = whisper_full_get_segment_text(ctx, i);
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const char * text = state ? whisper_full_get_segment_text_from_state(state, i) : whisper_full_get_segment_text(ctx, i);
+            const int64_t t0  = state ? whisper_full_get_segment_t0_from_state(state, i)   : whisper_full_get_segment_t0(ctx, i);
+            const int64_t t1  = state ? whisper_full_get_segment_t1_from_state(state, i)   : whisper_full_get_segment_t1(ctx, i);
 
             result.segments[i].emplace_back(to_timestamp(t0, params.comma_in_time));
             result.segments[i].emplace_back(to_timestamp(t1, params.comma_in_time));
             result.segments[i].emplace_back(text);
         }
 
-        whisper_print_timings(ctx);
-        whisper_free(ctx);
-
         return 0;
     }
 };
 
-Napi::Value whisper(const Napi::CallbackInfo& info) {
-  Napi::Env env = info.Env();
-  if (info.Length() <= 0 || !info[0].IsObject()) {
-    Napi::TypeError::New(env, "object expected").ThrowAsJavaScriptException();
+// the options of a transcription, shared by whisper() and WhisperContext.transcribe()
+static whisper_params whisper_params_from_object(const Napi::Object & whisper_params, Napi::Function & progress_callback, Napi::Function & segment_callback) {
+  struct whisper_params params;
+
+  std::string language = "en";
+  if (whisper_params.Has("language") && whisper_params.Get("language").IsString()) {
+    language = whisper_params.Get("language").As<Napi::String>();
   }
-  whisper_params params;
 
-  Napi::Object whisper_params = info[0].As<Napi::Object>();
-  std::string language = whisper_params.Get("language").As<Napi::String>();
-  std::string model = whisper_params.Get("model").As<Napi::String>();
-  std::string input = whisper_params.Get("fname_inp").As<Napi::String>();
+  std::string model = "";
+  if (whisper_params.Has("model") && whisper_params.Get("model").IsString()) {
+    model = whisper_params.Get("model").As<Napi::String>();
+  }
 
   bool use_gpu = true;
   if (whisper_params.Has("use_gpu") && whisper_params.Get("use_gpu").IsBoolean()) {
@@ -455,11 +588,14 @@ Napi::Value whisper(const Napi::CallbackInfo& info) {
     print_progress = whisper_params.Get("print_progress").As<Napi::Boolean>();
   }
   // Add support for progress_callback
-  Napi::Function progress_callback;
   if (whisper_params.Has("progress_callback") && whisper_params.Get("progress_callback").IsFunction()) {
     progress_callback = whisper_params.Get("progress_callback").As<Napi::Function>();
   }
 
+  if (whisper_params.Has("segment_callback") && whisper_params.Get("segment_callback").IsFunction()) {
+    segment_callback = whisper_params.Get("segment_callback").As<Napi::Function>();
+  }
+
   // Add support for VAD parameters
   bool vad = false;
   if (whisper_params.Has("vad") && whisper_params.Get("vad").IsBoolean()) {
@@ -501,26 +637,16 @@ Napi::Value whisper(const Napi::CallbackInfo& info) {
     vad_samples_overlap = whisper_params.Get("vad_samples_overlap").As<Napi::Number>();
   }
 
-  Napi::Value pcmf32Value = whisper_params.Get("pcmf32");
-  std::vector<float> pcmf32_vec;
-  if (pcmf32Value.IsTypedArray()) {
-    Napi::Float32Array pcmf32 = pcmf32Value.As<Napi::Float32Array>();
-    size_t length = pcmf32.ElementLength();
-    pcmf32_vec.reserve(length);
-    for (size_t i = 0; i < length; i++) {
-      pcmf32_vec.push_back(pcmf32[i]);
-    }
-  }
-
   params.language = language;
   params.model = model;
-  params.fname_inp.emplace_back(input);
+  if (whisper_params.Has("fname_inp") && whisper_params.Get("fname_inp").IsString()) {
+    params.fname_inp.emplace_back(whisper_params.Get("fname_inp").As<Napi::String>());
+  }
   params.use_gpu = use_gpu;
   params.flash_attn = flash_attn;
   params.no_prints = no_prints;
   params.no_timestamps = no_timestamps;
   params.audio_ctx = audio_ctx;
-  params.pcmf32 = pcmf32_vec;
   params.comma_in_time = comma_in_time;
   params.max_len = max_len;
   params.max_context = max_context;
@@ -538,19 +664,149 @@ Napi::Value whisper(const Napi::CallbackInfo& info) {
   params.vad_speech_pad_ms = vad_speech_pad_ms;
   params.vad_samples_overlap = vad_samples_overlap;
 
+  return params;
+}
+
+// pcmf32: a Float32Array of mono 16 kHz samples, transcribed without copying it
+static void set_audio_from_object(ProgressWorker * worker, const Napi::Object & whisper_params) {
+  if (whisper_params.Has("pcmf32") && whisper_params.Get("pcmf32").IsTypedArray()) {
+    Napi::TypedArray pcmf32 = whisper_params.Get("pcmf32").As<Napi::TypedArray>();
+    if (pcmf32.TypedArrayType() == napi_float32_array) {
+      worker->SetAudio(pcmf32.As<Napi::Float32Array>());
+    }
+  }
+}
+
+Napi::Value whisper(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (info.Length() <= 0 || !info[0].IsObject()) {
+    Napi::TypeError::New(env, "object expected").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  Napi::Function progress_callback;
+  Napi::Function segment_callback;
+  whisper_params params = whisper_params_from_object(info[0].As<Napi::Object>(), progress_callback, segment_callback);
+
   Napi::Function callback = info[1].As<Napi::Function>();
   // Create a new Worker class with progress callback support
   ProgressWorker* worker = new ProgressWorker(callback, params, progress_callback, env);
+  if (!segment_callback.IsEmpty()) {
+    worker->SetSegmentCallback(segment_callback, env);
+  }
+  set_audio_from_object(worker, info[0].As<Napi::Object>());
   worker->Queue();
   return env.Undefined();
 }
 
+// new WhisperContext({ model, use_gpu, flash_attn, n_states }) loads the model once,
+// transcribe(params, callback) then runs up to n_states calls at the same time on the libuv thread pool
+class WhisperContext : public Napi::ObjectWrap<WhisperContext> {
+ public:
+    static Napi::Function Init(Napi::Env env) {
+        return DefineClass(env, "WhisperContext", {
+            InstanceMethod("transcribe", &WhisperContext::Transcribe),
+            InstanceMethod("free",       &WhisperContext::Free),
+        });
+    }
+
+    WhisperContext(const Napi::CallbackInfo & info) : Napi::ObjectWrap<WhisperContext>(info) {
+        Napi::Env env = info.Env();
+        if (info.Length() <= 0 || !info[0].IsObject()) {
+            Napi::TypeError::New(env, "object expected").ThrowAsJavaScriptException();
+            return;
+        }
+
+        Napi::Object options = info[0].As<Napi::Object>();
+        if (!options.Has("model") || !options.Get("model").IsString()) {
+            Napi::TypeError::New(env, "model path expected").ThrowAsJavaScriptException();
+            return;
+        }
+
+        std::string model = options.Get("model").As<Napi::String>();
+
+        struct whisper_context_params cparams = whisper_context_default_params();
+        if (options.Has("use_gpu") && options.Get("use_gpu").IsBoolean()) {
+            cparams.use_gpu = options.Get("use_gpu").As<Napi::Boolean>();
+        }
+        if (options.Has("flash_attn") && options.Get("flash_attn").IsBoolean()) {
+            cparams.flash_attn = options.Get("flash_attn").As<Napi::Boolean>();
+        }
+
+        int32_t n_states = 1;
+        if (options.Has("n_states") && options.Get("n_states").IsNumber()) {
+            n_states = std::max(1, options.Get("n_states").As<Napi::Number>().Int32Value());
+        }
+
+        if (options.Has("no_prints") && options.Get("no_prints").IsBoolean() && options.Get("no_prints").As<Napi::Boolean>()) {
+            whisper_log_set(cb_log_disable, NULL);
+        }
+
+        auto new_pool = std::make_shared<whisper_context_pool>();
+
+        new_pool->ctx = whisper_init_from_file_with_params_no_state(model.c_str(), cparams);
+        if (new_pool->ctx == nullptr) {
+            Napi::Error::New(env, "failed to initialize whisper context").ThrowAsJavaScriptException();
+            return;
+        }
+
+        for (int32_t i = 0; i < n_states; ++i) {
+            struct whisper_state * state = whisper_init_state(new_pool->ctx);
+            if (state == nullptr) {
+                Napi::Error::New(env, "failed to initialize whisper state").ThrowAsJavaScriptException();
+                return;
+            }
+            new_pool->states.push_back(state);
+        }
+        new_pool->states_free = new_pool->states;
+
+        pool = std::move(new_pool);
+    }
+
+ private:
+    std::shared_ptr<whisper_context_pool> pool;
+
+    Napi::Value Transcribe(const Napi::CallbackInfo & info) {
+        Napi::Env env = info.Env();
+        if (info.Length() < 2 || !info[0].IsObject() || !info[1].IsFunction()) {
+            Napi::TypeError::New(env, "object and callback expected").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        if (!pool) {
+            Napi::Error::New(env, "whisper context is freed").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+
+        Napi::Function progress_callback;
+        Napi::Function segment_callback;
+        whisper_params params = whisper_params_from_object(info[0].As<Napi::Object>(), progress_callback, segment_callback);
+
+        Napi::Function callback = info[1].As<Napi::Function>();
+        ProgressWorker * worker = new ProgressWorker(callback, params, progress_callback, env, pool);
+        if (!segment_callback.IsEmpty()) {
+            worker->SetSegmentCallback(segment_callback, env);
+        }
+        set_audio_from_object(worker, info[0].As<Napi::Object>());
+        worker->Queue();
+        return env.Undefined();
+    }
+
+    // the model is freed once the calls in flight are done
+    Napi::Value Free(const Napi::CallbackInfo & info) {
+        pool.reset();
+        return info.Env().Undefined();
+    }
+};
 
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
   exports.Set(
       Napi::String::New(env, "whisper"),
       Napi::Function::New(env, whisper)
   );
+  exports.Set(
+      Napi::String::New(env, "WhisperContext"),
+      WhisperContext::Init(env)
+  );
   return exports;
 }
 
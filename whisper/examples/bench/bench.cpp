@@ -1,21 +1,214 @@
+#include "common-whisper.h"
 #include "whisper.h"
+#include "json.hpp"
 
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#include <algorithm>
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using json = nlohmann::ordered_json;
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - whisper_full, 4 - ggml ops, 5 - memory
 
     std::string model = "models/ggml-base.en.bin";
 
     bool use_gpu    = true;
     bool flash_attn = true;
+    bool repack     = true;
+
+    // whisper_full benchmark
+    std::vector<std::string> fname_inp  = {};
+    std::vector<std::string> fname_ref  = {};
+    std::vector<int32_t>     threads    = {};
+    std::vector<std::string> decoding   = { "greedy" };
+    std::vector<std::string> backends   = {};
+    std::string              language   = "en";
+    std::string              vad_model  = "";
+    std::string              fname_json = "";
+
+    // ggml ops benchmark
+    std::vector<std::string> sizes      = { "tiny", "base", "small", "medium", "large" };
+    std::vector<std::string> wtypes     = { "f16", "q5_0", "q8_0", "q4_0_r" };
+    std::string              fname_base = "";
+    std::string              device     = "";
+
+    // memory benchmark
+    int32_t                  n_states   = 4;
+
+    bool perf_counters = false;
 };
 
+static std::vector<std::string> split_list(const std::string & str) {
+    std::vector<std::string> res;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            res.push_back(item);
+        }
+    }
+    return res;
+}
+
+// hardware performance counters (-pc, Linux perf_event_open) of all the threads of the process
+// the counters follow the threads created after bench_counters_open(), which runs before any backend starts
+// its workers; the memory bandwidth is estimated from the LLC misses (64 bytes each), so it leaves out the
+// hardware prefetches and the writebacks
+enum bench_counter {
+    BENCH_COUNTER_TASK_CLOCK, // ns of CPU time
+    BENCH_COUNTER_CYCLES,
+    BENCH_COUNTER_INSTRUCTIONS,
+    BENCH_COUNTER_LLC_REFS,
+    BENCH_COUNTER_LLC_MISSES,
+    BENCH_COUNTER_COUNT,
+};
+
+static int g_counter_fd[BENCH_COUNTER_COUNT] = { -1, -1, -1, -1, -1 };
+
+struct bench_counts {
+    int64_t  t_us = 0;
+    uint64_t v[BENCH_COUNTER_COUNT] = {};
+};
+
+static bool bench_counters_enabled() {
+    for (int fd : g_counter_fd) {
+        if (fd >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the counters the kernel and the CPU have (e.g. none but the CPU time in most VMs)
+static void bench_counters_open() {
+#if defined(__linux__)
+    const struct { uint32_t type; uint64_t config; } events[BENCH_COUNTER_COUNT] = {
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK       },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES       },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS     },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES     },
+    };
+
+    for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size           = sizeof(attr);
+        attr.type           = events[i].type;
+        attr.config         = events[i].config;
+        attr.inherit        = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        g_counter_fd[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    if (g_counter_fd[BENCH_COUNTER_CYCLES] < 0) {
+        fprintf(stderr, "warning: no hardware performance counters (see /proc/sys/kernel/perf_event_paranoid)%s\n",
+                g_counter_fd[BENCH_COUNTER_TASK_CLOCK] >= 0 ? ", only the CPU time is reported" : "");
+    }
+#else
+    fprintf(stderr, "warning: performance counters are only supported on Linux\n");
+#endif
+}
+
+static bench_counts bench_counters_read() {
+    bench_counts res;
+    res.t_us = ggml_time_us();
+#if defined(__linux__)
+    for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+        if (g_counter_fd[i] < 0 || read(g_counter_fd[i], &res.v[i], sizeof(res.v[i])) != (ssize_t) sizeof(res.v[i])) {
+            res.v[i] = 0;
+        }
+    }
+#endif
+    return res;
+}
+
+// the counters from a to b per run, only the available ones
+static json bench_counters_json(const bench_counts & a, const bench_counts & b, int n_runs = 1) {
+    json res = json::object();
+
+    const double t_s = 1e-6*(b.t_us - a.t_us);
+    if (t_s <= 0.0) {
+        return res;
+    }
+
+    auto delta = [&](bench_counter c) { return double(b.v[c] - a.v[c]); };
+    auto has   = [&](bench_counter c) { return g_counter_fd[c] >= 0; };
+
+    if (has(BENCH_COUNTER_TASK_CLOCK)) {
+        res["cpu_ms"]   = 1e-6*delta(BENCH_COUNTER_TASK_CLOCK)/n_runs;
+        res["cpu_util"] = 1e-9*delta(BENCH_COUNTER_TASK_CLOCK)/t_s;
+    }
+    if (has(BENCH_COUNTER_CYCLES)) {
+        res["cycles"] = delta(BENCH_COUNTER_CYCLES)/n_runs;
+    }
+    if (has(BENCH_COUNTER_INSTRUCTIONS)) {
+        res["instructions"] = delta(BENCH_COUNTER_INSTRUCTIONS)/n_runs;
+        if (has(BENCH_COUNTER_CYCLES) && delta(BENCH_COUNTER_CYCLES) > 0) {
+            res["ipc"] = delta(BENCH_COUNTER_INSTRUCTIONS)/delta(BENCH_COUNTER_CYCLES);
+        }
+    }
+    if (has(BENCH_COUNTER_LLC_MISSES)) {
+        res["llc_misses"] = delta(BENCH_COUNTER_LLC_MISSES)/n_runs;
+        res["mem_gbps"]   = 64.0*delta(BENCH_COUNTER_LLC_MISSES)/t_s*1e-9;
+        if (has(BENCH_COUNTER_LLC_REFS) && delta(BENCH_COUNTER_LLC_REFS) > 0) {
+            res["llc_miss_rate"] = delta(BENCH_COUNTER_LLC_MISSES)/delta(BENCH_COUNTER_LLC_REFS);
+        }
+    }
+
+    return res;
+}
+
+// " | cpu 3.9x, ipc 1.20, llc miss 12.0%, ~5.3 GB/s" for the available counters
+static std::string bench_counters_str(const json & jc) {
+    std::string res;
+    char buf[64];
+
+    if (jc.contains("cpu_util")) {
+        snprintf(buf, sizeof(buf), ", cpu %.1fx", jc["cpu_util"].get<double>());
+        res += buf;
+    }
+    if (jc.contains("ipc")) {
+        snprintf(buf, sizeof(buf), ", ipc %.2f", jc["ipc"].get<double>());
+        res += buf;
+    }
+    if (jc.contains("llc_miss_rate")) {
+        snprintf(buf, sizeof(buf), ", llc miss %.1f%%", 100.0*jc["llc_miss_rate"].get<double>());
+        res += buf;
+    }
+    if (jc.contains("mem_gbps")) {
+        snprintf(buf, sizeof(buf), ", ~%.1f GB/s", jc["mem_gbps"].get<double>());
+        res += buf;
+    }
+
+    return res.empty() ? res : " |" + res.substr(1);
+}
+
 void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
 
 static bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
@@ -32,6 +225,26 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-ng"    || arg == "--no-gpu")        { params.use_gpu    = false; }
         else if (arg == "-fa"    || arg == "--flash-attn")    { params.flash_attn = true; }
         else if (arg == "-nfa"   || arg == "--no-flash-attn") { params.flash_attn = false; }
+        else if (arg == "-nr"    || arg == "--no-repack")     { params.repack     = false; }
+        else if (arg == "-pc"    || arg == "--perf-counters") { params.perf_counters = true; }
+        else if (arg == "-f"     || arg == "--file")          { params.fname_inp.emplace_back(argv[++i]); }
+        else if (arg == "-r"     || arg == "--ref")           { params.fname_ref.emplace_back(argv[++i]); }
+        else if (arg == "-ts"    || arg == "--threads-list")  {
+            params.threads.clear();
+            for (const auto & t : split_list(argv[++i])) {
+                params.threads.push_back(std::stoi(t));
+            }
+        }
+        else if (arg == "-ds"    || arg == "--decoding")      { params.decoding   = split_list(argv[++i]); }
+        else if (arg == "-bk"    || arg == "--backends")      { params.backends   = split_list(argv[++i]); }
+        else if (arg == "-l"     || arg == "--language")      { params.language   = argv[++i]; }
+        else if (arg == "-vm"    || arg == "--vad-model")     { params.vad_model  = argv[++i]; }
+        else if (arg == "-oj"    || arg == "--output-json")   { params.fname_json = argv[++i]; }
+        else if (arg == "-ms"    || arg == "--model-sizes")   { params.sizes      = split_list(argv[++i]); }
+        else if (arg == "-wt"    || arg == "--weight-types")  { params.wtypes     = split_list(argv[++i]); }
+        else if (arg == "-bl"    || arg == "--baseline")      { params.fname_base = argv[++i]; }
+        else if (arg == "-dev"   || arg == "--device")        { params.device     = argv[++i]; }
+        else if (arg == "-ns"    || arg == "--n-states")      { params.n_states   = std::stoi(argv[++i]); }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -54,9 +267,33 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "                             %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                             %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                             %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                             %-7s  3 - whisper_full on the -f files\n",           "");
+    fprintf(stderr, "                             %-7s  4 - ggml ops at whisper shapes\n",             "");
+    fprintf(stderr, "                             %-7s  5 - memory of the model and 1..N states\n",   "");
     fprintf(stderr, "  -ng,      --no-gpu        [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,      --flash-attn    [%-7s] enable flash attention\n",                      params.flash_attn ? "true" : "false");
     fprintf(stderr, "  -nfa,     --no-flash-attn [%-7s] disable flash attention\n",                     params.flash_attn ? "false" : "true");
+    fprintf(stderr, "  -nr,      --no-repack     [%-7s] disable weight repacking for the CPU backend\n",    params.repack ? "false" : "true");
+    fprintf(stderr, "  -pc,      --perf-counters [%-7s] report CPU time, cycles, instructions and LLC misses (Linux)\n", params.perf_counters ? "true" : "false");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "whisper_full (-w 3) options:\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME    [%-7s] audio file, can be repeated\n",                "");
+    fprintf(stderr, "  -r FNAME, --ref FNAME     [%-7s] reference transcript of the n-th -f file for WER\n", "");
+    fprintf(stderr, "  -ts LIST, --threads-list  [%-7s] thread counts to run, e.g. 1,2,4 (default -t)\n", "");
+    fprintf(stderr, "  -ds LIST, --decoding LIST [%-7s] decoding strategies: greedy,best_of,beam\n",   "greedy");
+    fprintf(stderr, "  -bk LIST, --backends LIST [%-7s] backends to run: gpu,cpu (default per -ng)\n", "");
+    fprintf(stderr, "  -l LANG,  --language LANG [%-7s] spoken language\n",                            params.language.c_str());
+    fprintf(stderr, "  -vm FNAME,--vad-model     [%-7s] VAD model, every run is repeated with VAD on\n", "");
+    fprintf(stderr, "  -oj FNAME,--output-json   [%-7s] write the results to a JSON file (default stdout)\n", "");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "ggml ops (-w 4) options, -ts and -oj apply too:\n");
+    fprintf(stderr, "  -ms LIST, --model-sizes   [%-7s] model sizes: tiny,base,small,medium,large\n",  "all");
+    fprintf(stderr, "  -wt LIST, --weight-types  [%-7s] matrix types: f32,f16,q4_0,q4_1,q5_0,q5_1,q8_0, _r - repacked\n", "f16,...");
+    fprintf(stderr, "  -bl FNAME,--baseline      [%-7s] compare with the -oj output of an earlier run\n", "");
+    fprintf(stderr, "  -dev NAME,--device NAME   [%-7s] ggml device to run the ops on, e.g. Vulkan0\n", "CPU");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "memory (-w 5) options, -f (the first file), -ds, -bk and -oj apply too:\n");
+    fprintf(stderr, "  -ns N,    --n-states N    [%-7d] measure 1..N states transcribing at the same time\n", params.n_states);
     fprintf(stderr, "\n");
 }
 
@@ -67,6 +304,7 @@ static int whisper_bench_full(const whisper_params & params) {
 
     cparams.use_gpu    = params.use_gpu;
     cparams.flash_attn = params.flash_attn;
+    cparams.use_extra_bufts = params.repack;
 
     {
         fprintf(stderr, "\n");
@@ -116,11 +354,21 @@ static int whisper_bench_full(const whisper_params & params) {
 
     whisper_reset_timings(ctx);
 
+    // the counters of each stage, with -pc
+    std::vector<std::pair<const char *, json>> counters;
+    bench_counts c0 = bench_counters_read();
+    auto counters_add = [&](const char * name, int n_runs) {
+        const bench_counts c1 = bench_counters_read();
+        counters.emplace_back(name, bench_counters_json(c0, c1, n_runs));
+        c0 = c1;
+    };
+
     // actual run
     if (int ret = whisper_encode(ctx, 0, params.n_threads) != 0) {
         fprintf(stderr, "error: failed to encode: %d\n", ret);
         return 4;
     }
+    counters_add("encode", 1);
 
     // text-generation
     for (int i = 0; i < 256; i++) {
@@ -129,6 +377,7 @@ static int whisper_bench_full(const whisper_params & params) {
             return 4;
         }
     }
+    counters_add("decode", 256);
 
     // batched decoding
     for (int i = 0; i < 64; i++) {
@@ -137,6 +386,7 @@ static int whisper_bench_full(const whisper_params & params) {
             return 4;
         }
     }
+    counters_add("batchd", 64);
 
     // prompt processing
     for (int i = 0; i < 16; i++) {
@@ -145,8 +395,20 @@ static int whisper_bench_full(const whisper_params & params) {
             return 4;
         }
     }
+    counters_add("prompt", 16);
 
     whisper_print_timings(ctx);
+
+    if (bench_counters_enabled()) {
+        fprintf(stderr, "\n");
+        for (const auto & c : counters) {
+            fprintf(stderr, "%s: %-6s per run:", __func__, c.first);
+            for (const auto & it : c.second.items()) {
+                fprintf(stderr, " %s = %.4g", it.key().c_str(), it.value().get<double>());
+            }
+            fprintf(stderr, "\n");
+        }
+    }
     whisper_free(ctx);
 
     fprintf(stderr, "\n");
@@ -164,6 +426,862 @@ static int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+// reference transcript of an audio file, empty if there is none:
+//  - the -r file: plain text, or an earnings21 .nlp file (one token per line, '|' separated fields)
+//  - LibriSpeech: the line of the audio's code in the chapter's <speaker>-<chapter>.trans.txt
+static std::string bench_read_ref(const std::string & fname_inp, const std::string & fname_ref) {
+    if (!fname_ref.empty()) {
+        std::ifstream fin(fname_ref);
+        if (!fin) {
+            fprintf(stderr, "error: failed to open reference '%s'\n", fname_ref.c_str());
+            return "";
+        }
+
+        std::string res;
+        std::string line;
+        const bool nlp = fname_ref.size() > 4 && fname_ref.compare(fname_ref.size() - 4, 4, ".nlp") == 0;
+        if (nlp) {
+            std::getline(fin, line); // header
+        }
+        while (std::getline(fin, line)) {
+            res += (nlp ? line.substr(0, line.find('|')) : line) + " ";
+        }
+        return res;
+    }
+
+    const size_t pos_dir = fname_inp.find_last_of("/\\");
+    const std::string dir  = pos_dir == std::string::npos ? "" : fname_inp.substr(0, pos_dir + 1);
+    const std::string base = pos_dir == std::string::npos ? fname_inp : fname_inp.substr(pos_dir + 1);
+    const std::string code = base.substr(0, base.find('.'));
+
+    const size_t pos_utt = code.find_last_of('-');
+    if (pos_utt == std::string::npos) {
+        return "";
+    }
+
+    std::ifstream fin(dir + code.substr(0, pos_utt) + ".trans.txt");
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.compare(0, code.size() + 1, code + " ") == 0) {
+            return line.substr(code.size() + 1);
+        }
+    }
+
+    return "";
+}
+
+// lower case words without punctuation. Numbers and spellings are not normalized, use the eval.py
+// scripts in tests/librispeech and tests/earnings21 for WER comparable with other implementations
+static std::vector<std::string> bench_words(const std::string & text) {
+    std::vector<std::string> res;
+    std::string word;
+    for (const char c : text) {
+        if (std::isalnum((unsigned char) c) || c == '\'' || (unsigned char) c >= 0x80) {
+            word += (char) std::tolower((unsigned char) c);
+        } else if (!word.empty()) {
+            res.push_back(word);
+            word.clear();
+        }
+    }
+    if (!word.empty()) {
+        res.push_back(word);
+    }
+    return res;
+}
+
+// word-level edit distance
+static int bench_word_errors(const std::vector<std::string> & ref, const std::vector<std::string> & hyp) {
+    std::vector<int> prev(hyp.size() + 1);
+    std::vector<int> cur (hyp.size() + 1);
+    for (size_t j = 0; j <= hyp.size(); ++j) {
+        prev[j] = j;
+    }
+    for (size_t i = 1; i <= ref.size(); ++i) {
+        cur[0] = i;
+        for (size_t j = 1; j <= hyp.size(); ++j) {
+            cur[j] = std::min({ prev[j] + 1, cur[j - 1] + 1, prev[j - 1] + (ref[i - 1] == hyp[j - 1] ? 0 : 1) });
+        }
+        std::swap(prev, cur);
+    }
+    return prev[hyp.size()];
+}
+
+struct bench_audio {
+    std::string        fname;
+    std::vector<float> pcmf32;
+    std::vector<std::string> ref;
+    bool               has_ref = false;
+};
+
+// runs whisper_full over every audio file for each backend x thread count x decoding strategy x VAD
+// combination and reports the realtime factor, tokens/s, per-stage times and WER as JSON
+static int whisper_bench_pipeline(const whisper_params & params) {
+    if (params.fname_inp.empty()) {
+        fprintf(stderr, "error: no audio files, use -f\n");
+        return 1;
+    }
+
+    std::vector<bench_audio> audio(params.fname_inp.size());
+    for (size_t i = 0; i < audio.size(); ++i) {
+        audio[i].fname = params.fname_inp[i];
+
+        std::vector<std::vector<float>> pcmf32s;
+        if (!read_audio_data(audio[i].fname, audio[i].pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read audio file '%s'\n", audio[i].fname.c_str());
+            return 2;
+        }
+
+        const std::string ref = bench_read_ref(audio[i].fname, i < params.fname_ref.size() ? params.fname_ref[i] : "");
+        audio[i].ref     = bench_words(ref);
+        audio[i].has_ref = !audio[i].ref.empty();
+    }
+
+    const std::vector<int32_t>     threads  = params.threads.empty()  ? std::vector<int32_t>{ params.n_threads } : params.threads;
+    const std::vector<std::string> backends = params.backends.empty() ? std::vector<std::string>{ params.use_gpu ? "gpu" : "cpu" } : params.backends;
+
+    std::vector<bool> vads = { false };
+    if (!params.vad_model.empty()) {
+        vads.push_back(true);
+    }
+
+    json jres = {
+        { "system_info", whisper_print_system_info() },
+        { "version",     whisper_version() },
+        { "model",       params.model },
+        { "runs",        json::array() },
+    };
+
+    for (const auto & backend : backends) {
+        if (backend != "gpu" && backend != "cpu") {
+            fprintf(stderr, "error: unknown backend '%s'\n", backend.c_str());
+            return 1;
+        }
+
+        struct whisper_context_params cparams = whisper_context_default_params();
+
+        cparams.use_gpu    = backend == "gpu";
+        cparams.flash_attn = params.flash_attn;
+        cparams.use_extra_bufts = params.repack;
+
+        struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+        if (ctx == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context\n");
+            return 2;
+        }
+
+        jres["model_type"] = whisper_model_type_readable(ctx);
+
+        const whisper_token token_eot = whisper_token_eot(ctx);
+
+        for (const int32_t n_threads : threads) {
+            for (const auto & decoding : params.decoding) {
+                for (const bool vad : vads) {
+                    whisper_full_params wparams = whisper_full_default_params(
+                            decoding == "beam" ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+                    if (decoding == "greedy") {
+                        wparams.greedy.best_of = 1;
+                    } else if (decoding == "best_of") {
+                        wparams.greedy.best_of = 5;
+                    } else if (decoding == "beam") {
+                        wparams.beam_search.beam_size = 5;
+                    } else {
+                        fprintf(stderr, "error: unknown decoding strategy '%s'\n", decoding.c_str());
+                        whisper_free(ctx);
+                        return 1;
+                    }
+
+                    wparams.n_threads        = n_threads;
+                    wparams.language         = params.language.c_str();
+                    wparams.print_progress   = false;
+                    wparams.print_realtime   = false;
+                    wparams.print_special    = false;
+                    wparams.print_timestamps = false;
+                    wparams.vad              = vad;
+                    wparams.vad_model_path   = vad ? params.vad_model.c_str() : nullptr;
+
+                    // heat: the first second of the first file
+                    whisper_full(ctx, wparams, audio[0].pcmf32.data(), std::min<int>(audio[0].pcmf32.size(), WHISPER_SAMPLE_RATE));
+
+                    json jfiles = json::array();
+
+                    double  audio_s  = 0.0;
+                    double  wall_s   = 0.0;
+                    int64_t n_tokens = 0;
+                    int64_t n_words  = 0;
+                    int64_t n_errors = 0;
+
+                    const whisper_metrics m0 = whisper_get_metrics(ctx);
+                    const bench_counts    c0 = bench_counters_read();
+
+                    for (const auto & a : audio) {
+                        const int64_t t_start_us = ggml_time_us();
+
+                        if (whisper_full(ctx, wparams, a.pcmf32.data(), a.pcmf32.size()) != 0) {
+                            fprintf(stderr, "error: failed to process '%s'\n", a.fname.c_str());
+                            whisper_free(ctx);
+                            return 4;
+                        }
+
+                        const double t_s = 1e-6*(ggml_time_us() - t_start_us);
+                        const double a_s = double(a.pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+                        std::string text;
+                        int n_tok = 0;
+                        for (int i = 0; i < whisper_full_n_segments(ctx); ++i) {
+                            text += whisper_full_get_segment_text(ctx, i);
+                            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+                                if (whisper_full_get_token_id(ctx, i, j) < token_eot) {
+                                    n_tok++;
+                                }
+                            }
+                        }
+
+                        json jfile = {
+                            { "file",     a.fname },
+                            { "audio_s",  a_s },
+                            { "wall_s",   t_s },
+                            { "rtf",      t_s/a_s },
+                            { "n_tokens", n_tok },
+                        };
+
+                        if (a.has_ref) {
+                            const int n_err = bench_word_errors(a.ref, bench_words(text));
+                            jfile["wer"] = double(n_err)/a.ref.size();
+                            n_words  += a.ref.size();
+                            n_errors += n_err;
+                        }
+
+                        jfiles.push_back(jfile);
+
+                        audio_s  += a_s;
+                        wall_s   += t_s;
+                        n_tokens += n_tok;
+                    }
+
+                    const whisper_metrics m1 = whisper_get_metrics(ctx);
+                    const bench_counts    c1 = bench_counters_read();
+
+                    json jrun = {
+                        { "backend",    backend },
+                        { "n_threads",  n_threads },
+                        { "decoding",   decoding },
+                        { "vad",        vad },
+                        { "audio_s",    audio_s },
+                        { "wall_s",     wall_s },
+                        { "rtf",        wall_s/audio_s },
+                        { "tokens_per_s", n_tokens/wall_s },
+                        { "n_tokens",   n_tokens },
+                        { "stages_ms", {
+                            { "mel",    1e-3*(m1.t_mel_us    - m0.t_mel_us) },
+                            { "vad",    1e-3*(m1.t_vad_us    - m0.t_vad_us) },
+                            { "encode", 1e-3*(m1.t_encode_us - m0.t_encode_us) },
+                            { "decode", 1e-3*(m1.t_decode_us - m0.t_decode_us) },
+                            { "batchd", 1e-3*(m1.t_batchd_us - m0.t_batchd_us) },
+                            { "prompt", 1e-3*(m1.t_prompt_us - m0.t_prompt_us) },
+                            { "sample", 1e-3*(m1.t_sample_us - m0.t_sample_us) },
+                        } },
+                        { "n_fallbacks", (m1.n_fail_p - m0.n_fail_p) + (m1.n_fail_h - m0.n_fail_h) },
+                    };
+
+                    if (n_words > 0) {
+                        jrun["wer"] = double(n_errors)/n_words;
+                    }
+
+                    const json jcounters = bench_counters_enabled() ? bench_counters_json(c0, c1) : json();
+                    if (!jcounters.is_null()) {
+                        jrun["counters"] = jcounters;
+                    }
+
+                    jrun["files"] = jfiles;
+
+                    fprintf(stderr, "%s: backend = %s, threads = %2d, decoding = %-7s, vad = %d: rtf = %.3f, tokens/s = %8.2f",
+                            __func__, backend.c_str(), n_threads, decoding.c_str(), vad, wall_s/audio_s, n_tokens/wall_s);
+                    if (n_words > 0) {
+                        fprintf(stderr, ", wer = %.4f", double(n_errors)/n_words);
+                    }
+                    if (!jcounters.is_null()) {
+                        fprintf(stderr, "%s", bench_counters_str(jcounters).c_str());
+                    }
+                    fprintf(stderr, "\n");
+
+                    jres["runs"].push_back(jrun);
+                }
+            }
+        }
+
+        whisper_free(ctx);
+    }
+
+    if (params.fname_json.empty()) {
+        printf("%s\n", jres.dump(2).c_str());
+    } else {
+        std::ofstream fout(params.fname_json);
+        if (!fout) {
+            fprintf(stderr, "error: failed to open '%s' for writing\n", params.fname_json.c_str());
+            return 5;
+        }
+        fout << jres.dump(2) << "\n";
+    }
+
+    return 0;
+}
+
+// ggml ops at the shapes of the whisper graphs, on the CPU backend or the device given with -dev
+
+struct bench_op {
+    std::string name;
+    std::string size;
+    std::string type;
+    double      flops; // 0 - memory bound, only GB/s is reported
+
+    // weights go to ctx_w, which is allocated in the buffer type of the weight type
+    std::function<ggml_tensor * (ggml_context * ctx_w, ggml_context * ctx)> build;
+};
+
+static void bench_op_fill(ggml_tensor * t, std::mt19937 & rng) {
+    const int64_t n = ggml_nelements(t);
+
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> f32(n);
+    for (auto & x : f32) {
+        x = dist(rng);
+    }
+
+    std::vector<uint8_t> data(ggml_nbytes(t));
+    switch (t->type) {
+        case GGML_TYPE_F32: memcpy(data.data(), f32.data(), data.size()); break;
+        case GGML_TYPE_F16: ggml_fp32_to_fp16_row(f32.data(), (ggml_fp16_t *) data.data(), n); break;
+        default:
+            ggml_quantize_chunk(t->type, f32.data(), data.data(), 0, ggml_nrows(t), t->ne[0], nullptr);
+            break;
+    }
+
+    ggml_backend_tensor_set(t, data.data(), 0, data.size());
+}
+
+// returns the time per run in microseconds, or 0 if the op is not supported with this buffer type
+// jcounters: the performance counters per run, with -pc
+static double bench_op_run(const bench_op & op, ggml_backend_t backend, ggml_backend_dev_t dev, ggml_backend_buffer_type_t buft_w, double & nbytes, json & jcounters) {
+    ggml_init_params iparams = {
+        /*.mem_size   =*/ 64*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx_w = ggml_init(iparams);
+    ggml_context * ctx   = ggml_init(iparams);
+
+    ggml_tensor * out = op.build(ctx_w, ctx);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    ggml_backend_buffer_t buf_w = ggml_get_first_tensor(ctx_w) ? ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, buft_w) : nullptr;
+    ggml_backend_buffer_t buf   = ggml_backend_alloc_ctx_tensors_from_buft(ctx, ggml_backend_dev_buffer_type(dev));
+
+    double t_us = 0.0;
+
+    bool supported = buf != nullptr;
+    for (int i = 0; supported && i < ggml_graph_n_nodes(gf); ++i) {
+        supported = ggml_backend_supports_op(backend, ggml_graph_node(gf, i));
+    }
+
+    if (supported) {
+        std::mt19937 rng(0);
+
+        nbytes = ggml_nbytes(out);
+        for (ggml_context * c : { ctx_w, ctx }) {
+            for (ggml_tensor * t = ggml_get_first_tensor(c); t != nullptr; t = ggml_get_next_tensor(c, t)) {
+                if (t->op == GGML_OP_NONE) {
+                    bench_op_fill(t, rng);
+                    nbytes += ggml_nbytes(t);
+                }
+            }
+        }
+
+        // heat
+        ggml_backend_graph_compute(backend, gf);
+
+        const bench_counts c0 = bench_counters_read();
+
+        int    n    = 0;
+        double tsum = 0.0;
+        while (n < 1000 && (tsum < 0.5 || n < 3)) {
+            const int64_t t0 = ggml_time_us();
+            ggml_backend_graph_compute(backend, gf);
+            tsum += 1e-6*(ggml_time_us() - t0);
+            n++;
+        }
+
+        t_us = 1e6*tsum/n;
+
+        if (bench_counters_enabled()) {
+            jcounters = bench_counters_json(c0, bench_counters_read(), n);
+        }
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_backend_buffer_free(buf_w);
+    ggml_free(ctx);
+    ggml_free(ctx_w);
+
+    return t_us;
+}
+
+static std::vector<bench_op> bench_ops_for_size(const std::string & size, int n_state, ggml_type wtype, const std::string & type) {
+    const int n_ctx   = 1500;  // encoder positions
+    const int n_kv    = 1536;  // padded for flash attention
+    const int n_mels  = 80;
+    const int n_ff    = 4*n_state;
+    const int n_head  = n_state/64;
+    const int n_vocab = 51865;
+
+    std::vector<bench_op> ops;
+
+    auto add_mul_mat = [&](const std::string & name, int k, int m, int n) {
+        ops.push_back({ name, size, type, 2.0*k*m*n, [=](ggml_context * ctx_w, ggml_context * ctx) {
+            ggml_tensor * w = ggml_new_tensor_2d(ctx_w, wtype,         k, m);
+            ggml_tensor * x = ggml_new_tensor_2d(ctx,   GGML_TYPE_F32, k, n);
+            ggml_set_name(w, name.c_str());
+            return ggml_mul_mat(ctx, w, x);
+        } });
+    };
+
+    add_mul_mat("enc_attn_proj", n_state, n_state, n_ctx);
+    add_mul_mat("enc_ff_up",     n_state, n_ff,    n_ctx);
+    add_mul_mat("enc_ff_down",   n_ff,    n_state, n_ctx);
+    for (int b : { 1, 2, 4, 8 }) {
+        add_mul_mat("dec_ff_up_b"  + std::to_string(b), n_state, n_ff,    b);
+        add_mul_mat("dec_logits_b" + std::to_string(b), n_state, n_vocab, b);
+    }
+
+    // the ops below do not use the weight type
+    if (wtype != GGML_TYPE_F16) {
+        return ops;
+    }
+
+    auto add_fattn = [&](const std::string & name, int n_q) {
+        ops.push_back({ name, size, "f16", 4.0*64*n_q*n_kv*n_head, [=](ggml_context *, ggml_context * ctx) {
+            ggml_tensor * q = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 64, n_q,  n_head);
+            ggml_tensor * k = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 64, n_kv, n_head);
+            ggml_tensor * v = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 64, n_kv, n_head);
+            return ggml_flash_attn_ext(ctx, q, k, v, nullptr, 0.125f, 0.0f, 0.0f);
+        } });
+    };
+
+    add_fattn("enc_flash_attn", n_ctx);
+    add_fattn("dec_cross_attn", 1);
+
+    // the attention products without flash attention, one slice per head
+    auto add_attn_mul_mat = [&](const std::string & name, int k, int m, int n) {
+        ops.push_back({ name, size, "f16", 2.0*k*m*n*n_head, [=](ggml_context *, ggml_context * ctx) {
+            ggml_tensor * a = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, k, m, n_head);
+            ggml_tensor * b = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, k, n, n_head);
+            return ggml_mul_mat(ctx, a, b);
+        } });
+    };
+
+    add_attn_mul_mat("enc_attn_kq",      64,    n_ctx, n_ctx);
+    add_attn_mul_mat("enc_attn_kqv",     n_ctx, 64,    n_ctx);
+    add_attn_mul_mat("dec_cross_kq_b4",  64,    n_ctx, 4);
+    add_attn_mul_mat("dec_cross_kqv_b4", n_ctx, 64,    4);
+
+    ops.push_back({ "conv1", size, "f16", 2.0*3*n_mels*n_state*2*n_ctx, [=](ggml_context *, ggml_context * ctx) {
+        ggml_tensor * w   = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 3, n_mels, n_state);
+        ggml_tensor * mel = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 2*n_ctx, n_mels);
+        return ggml_conv_1d_ph(ctx, w, mel, 1, 1);
+    } });
+    ops.push_back({ "conv2", size, "f16", 2.0*3*n_state*n_state*n_ctx, [=](ggml_context *, ggml_context * ctx) {
+        ggml_tensor * w = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 3, n_state, n_state);
+        ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 2*n_ctx, n_state);
+        return ggml_conv_1d_ph(ctx, w, x, 2, 1);
+    } });
+    // the same convolutions as a CONV_2D with a 1-high kernel, which whisper uses on Vulkan and for the large models
+    ops.push_back({ "conv1_direct", size, "f16", 2.0*3*n_mels*n_state*2*n_ctx, [=](ggml_context *, ggml_context * ctx) {
+        ggml_tensor * w   = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, 3, 1, n_mels, n_state);
+        ggml_tensor * mel = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 2*n_ctx, 1, n_mels, 1);
+        return ggml_conv_2d_direct(ctx, w, mel, 1, 1, 1, 0, 1, 1);
+    } });
+    ops.push_back({ "conv2_direct", size, "f16", 2.0*3*n_state*n_state*n_ctx, [=](ggml_context *, ggml_context * ctx) {
+        ggml_tensor * w = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, 3, 1, n_state, n_state);
+        ggml_tensor * x = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 2*n_ctx, 1, n_state, 1);
+        return ggml_conv_2d_direct(ctx, w, x, 2, 1, 1, 0, 1, 1);
+    } });
+    ops.push_back({ "norm", size, "f32", 0.0, [=](ggml_context *, ggml_context * ctx) {
+        return ggml_norm(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_state, n_ctx), 1e-5f);
+    } });
+    ops.push_back({ "gelu", size, "f32", 0.0, [=](ggml_context *, ggml_context * ctx) {
+        return ggml_gelu(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_ff, n_ctx));
+    } });
+
+    return ops;
+}
+
+static int whisper_bench_ops(const whisper_params & params) {
+    static const std::map<std::string, int> n_state_by_size = {
+        { "tiny", 384 }, { "base", 512 }, { "small", 768 }, { "medium", 1024 }, { "large", 1280 },
+    };
+    static const std::map<std::string, ggml_type> types = {
+        { "f32",  GGML_TYPE_F32  }, { "f16",  GGML_TYPE_F16  },
+        { "q4_0", GGML_TYPE_Q4_0 }, { "q4_1", GGML_TYPE_Q4_1 },
+        { "q5_0", GGML_TYPE_Q5_0 }, { "q5_1", GGML_TYPE_Q5_1 },
+        { "q8_0", GGML_TYPE_Q8_0 },
+    };
+
+    ggml_time_init();
+
+    ggml_backend_dev_t dev = params.device.empty() ? ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU) : ggml_backend_dev_by_name(params.device.c_str());
+    if (!dev) {
+        fprintf(stderr, "error: no %s device\n", params.device.empty() ? "CPU" : params.device.c_str());
+        return 2;
+    }
+
+    ggml_backend_t backend = ggml_backend_dev_init(dev, nullptr);
+
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(dev);
+
+    auto set_n_threads_fn   = (ggml_backend_set_n_threads_t)      ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+    auto get_extra_bufts_fn = (ggml_backend_dev_get_extra_bufts_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_dev_get_extra_bufts");
+
+    std::vector<ggml_backend_buffer_type_t> extra_bufts;
+    if (get_extra_bufts_fn) {
+        for (ggml_backend_buffer_type_t * b = get_extra_bufts_fn(dev); b && *b; ++b) {
+            extra_bufts.push_back(*b);
+        }
+    }
+
+    // results of an earlier run, by op/size/type/threads
+    std::map<std::string, double> baseline;
+    if (!params.fname_base.empty()) {
+        std::ifstream fin(params.fname_base);
+        if (!fin) {
+            fprintf(stderr, "error: failed to open baseline '%s'\n", params.fname_base.c_str());
+            ggml_backend_free(backend);
+            return 1;
+        }
+        const json jbase = json::parse(fin, nullptr, false);
+        if (jbase.is_discarded() || !jbase.contains("results")) {
+            fprintf(stderr, "error: failed to parse baseline '%s'\n", params.fname_base.c_str());
+            ggml_backend_free(backend);
+            return 1;
+        }
+        for (const auto & r : jbase["results"]) {
+            baseline[r["op"].get<std::string>() + "/" + r["size"].get<std::string>() + "/" +
+                     r["type"].get<std::string>() + "/" + std::to_string(r["n_threads"].get<int>())] = r["us"].get<double>();
+        }
+    }
+
+    const std::vector<int32_t> threads = params.threads.empty() ? std::vector<int32_t>{ params.n_threads } : params.threads;
+
+    // the matmul kernel selection of the CPU backend (see GGML_CPU_SGEMM in ggml-cpu.c)
+    const char * sgemm = getenv("GGML_CPU_SGEMM");
+
+    json jres = {
+        { "system_info", whisper_print_system_info() },
+        { "device",      ggml_backend_dev_name(dev) },
+        { "sgemm",       sgemm ? sgemm : "auto" },
+        { "results",     json::array() },
+    };
+
+    for (const auto & size : params.sizes) {
+        if (n_state_by_size.count(size) == 0) {
+            fprintf(stderr, "error: unknown model size '%s'\n", size.c_str());
+            ggml_backend_free(backend);
+            return 1;
+        }
+
+        for (const auto & type : params.wtypes) {
+            const bool repack = type.size() > 2 && type.compare(type.size() - 2, 2, "_r") == 0;
+            const auto it = types.find(repack ? type.substr(0, type.size() - 2) : type);
+            if (it == types.end()) {
+                fprintf(stderr, "error: unknown weight type '%s'\n", type.c_str());
+                ggml_backend_free(backend);
+                return 1;
+            }
+
+            // the ops without weights run once per size, with the f16 weights
+            std::vector<bench_op> ops = bench_ops_for_size(size, n_state_by_size.at(size), it->second, type);
+            if (repack || it->second != GGML_TYPE_F16) {
+                ops.erase(std::remove_if(ops.begin(), ops.end(), [&](const bench_op & op) { return op.type != type; }), ops.end());
+            }
+
+            for (const int32_t n_threads : threads) {
+                if (set_n_threads_fn) {
+                    set_n_threads_fn(backend, n_threads);
+                }
+
+                for (const auto & op : ops) {
+                    double nbytes = 0.0;
+                    double t_us   = 0.0;
+                    json   jcounters;
+                    if (repack) {
+                        for (auto * buft : extra_bufts) {
+                            if ((t_us = bench_op_run(op, backend, dev, buft, nbytes, jcounters)) > 0.0) {
+                                break;
+                            }
+                        }
+                    } else {
+                        t_us = bench_op_run(op, backend, dev, ggml_backend_dev_buffer_type(dev), nbytes, jcounters);
+                    }
+
+                    if (t_us <= 0.0) {
+                        fprintf(stderr, "%-16s %-6s %-7s t = %2d: not supported\n", op.name.c_str(), size.c_str(), op.type.c_str(), n_threads);
+                        continue;
+                    }
+
+                    json jr = {
+                        { "op",        op.name },
+                        { "size",      size },
+                        { "type",      op.type },
+                        { "n_threads", n_threads },
+                        { "us",        t_us },
+                        { "gflops",    op.flops*1e-3/t_us },
+                        { "gbps",      nbytes*1e-3/t_us },
+                    };
+
+                    fprintf(stderr, "%-16s %-6s %-7s t = %2d: %10.1f us %8.1f GFLOP/s %7.1f GB/s",
+                            op.name.c_str(), size.c_str(), op.type.c_str(), n_threads, t_us, op.flops*1e-3/t_us, nbytes*1e-3/t_us);
+
+                    const auto ib = baseline.find(op.name + "/" + size + "/" + op.type + "/" + std::to_string(n_threads));
+                    if (ib != baseline.end()) {
+                        jr["baseline_us"] = ib->second;
+                        jr["speedup"]     = ib->second/t_us;
+                        fprintf(stderr, "  x%.3f", ib->second/t_us);
+                    }
+                    if (!jcounters.is_null()) {
+                        jr["counters"] = jcounters;
+                        fprintf(stderr, "%s", bench_counters_str(jcounters).c_str());
+                    }
+                    fprintf(stderr, "\n");
+
+                    jres["results"].push_back(jr);
+                }
+            }
+        }
+    }
+
+    ggml_backend_free(backend);
+
+    if (params.fname_json.empty()) {
+        printf("%s\n", jres.dump(2).c_str());
+    } else {
+        std::ofstream fout(params.fname_json);
+        if (!fout) {
+            fprintf(stderr, "error: failed to open '%s' for writing\n", params.fname_json.c_str());
+            return 5;
+        }
+        fout << jres.dump(2) << "\n";
+    }
+
+    return 0;
+}
+
+// resident set size of the process and its peak so far, in bytes (0 where not available)
+static void bench_rss(size_t & rss, size_t & rss_peak) {
+    rss      = 0;
+    rss_peak = 0;
+#if defined(__linux__)
+    std::ifstream fin("/proc/self/status");
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            rss = 1024*std::stoull(line.substr(6));
+        } else if (line.compare(0, 6, "VmHWM:") == 0) {
+            rss_peak = 1024*std::stoull(line.substr(6));
+        }
+    }
+#endif
+}
+
+// bytes in use on each GPU device, as the device reports them
+static std::vector<size_t> bench_vram() {
+    std::vector<size_t> res;
+    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU) {
+            continue;
+        }
+        size_t free  = 0;
+        size_t total = 0;
+        ggml_backend_dev_memory(dev, &free, &total);
+        res.push_back(total - free);
+    }
+    return res;
+}
+
+static json bench_memory_usage(const whisper_memory_usage & u) {
+    return {
+        { "kv_self",        u.kv_self },
+        { "kv_cross",       u.kv_cross },
+        { "kv_pad",         u.kv_pad },
+        { "embd_io",        u.embd_io },
+        { "aheads_masks",   u.aheads_masks },
+        { "compute_conv",   u.compute_conv },
+        { "compute_encode", u.compute_encode },
+        { "compute_cross",  u.compute_cross },
+        { "compute_decode", u.compute_decode },
+        { "compute_batch",  u.compute_batch },
+        { "total",          u.state },
+        { "device",         u.state_device },
+    };
+}
+
+// for each backend x decoding strategy: the buffers of the model, then of 1..n_states states that
+// transcribe the first -f file (or 10 s of silence) at the same time, with the RSS and VRAM in use
+static int whisper_bench_memory(const whisper_params & params) {
+    std::vector<float> pcmf32(10*WHISPER_SAMPLE_RATE, 0.0f);
+    if (!params.fname_inp.empty()) {
+        std::vector<std::vector<float>> pcmf32s;
+        if (!read_audio_data(params.fname_inp[0], pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read audio file '%s'\n", params.fname_inp[0].c_str());
+            return 2;
+        }
+    }
+
+    const std::vector<std::string> backends = params.backends.empty() ? std::vector<std::string>{ params.use_gpu ? "gpu" : "cpu" } : params.backends;
+
+    json jres = {
+        { "system_info", whisper_print_system_info() },
+        { "version",     whisper_version() },
+        { "model",       params.model },
+        { "runs",        json::array() },
+    };
+
+    for (const auto & backend : backends) {
+        if (backend != "gpu" && backend != "cpu") {
+            fprintf(stderr, "error: unknown backend '%s'\n", backend.c_str());
+            return 1;
+        }
+
+        for (const auto & decoding : params.decoding) {
+            whisper_full_params wparams = whisper_full_default_params(
+                    decoding == "beam" ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+            if (decoding == "greedy") {
+                wparams.greedy.best_of = 1;
+            } else if (decoding == "best_of") {
+                wparams.greedy.best_of = 5;
+            } else if (decoding == "beam") {
+                wparams.beam_search.beam_size = 5;
+            } else {
+                fprintf(stderr, "error: unknown decoding strategy '%s'\n", decoding.c_str());
+                return 1;
+            }
+
+            wparams.n_threads        = params.n_threads;
+            wparams.language         = params.language.c_str();
+            wparams.print_progress   = false;
+            wparams.print_realtime   = false;
+            wparams.print_special    = false;
+            wparams.print_timestamps = false;
+
+            struct whisper_context_params cparams = whisper_context_default_params();
+
+            cparams.use_gpu    = backend == "gpu";
+            cparams.flash_attn = params.flash_attn;
+            cparams.use_extra_bufts = params.repack;
+
+            // a new context for each run, so that the states start from their initial buffers
+            const std::vector<size_t> vram0 = bench_vram();
+
+            struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+            if (ctx == nullptr) {
+                fprintf(stderr, "error: failed to initialize whisper context\n");
+                return 2;
+            }
+
+            const whisper_memory_usage model_usage = whisper_get_memory_usage(ctx, nullptr);
+
+            json jrun = {
+                { "backend",        backend },
+                { "decoding",       decoding },
+                { "model_type",     whisper_model_type_readable(ctx) },
+                { "weights",        model_usage.weights },
+                { "weights_device", model_usage.weights_device },
+                { "steps",          json::array() },
+            };
+
+            std::vector<whisper_state *> states;
+            for (int n = 1; n <= params.n_states; ++n) {
+                whisper_state * state = whisper_init_state(ctx);
+                if (state == nullptr) {
+                    fprintf(stderr, "error: failed to initialize state %d\n", n);
+                    break;
+                }
+                states.push_back(state);
+
+                // all states at once, as a server with n slots
+                std::vector<std::thread> workers;
+                std::vector<int> rets(states.size(), 0);
+                for (size_t i = 0; i < states.size(); ++i) {
+                    workers.emplace_back([&, i]() {
+                        rets[i] = whisper_full_with_state(ctx, states[i], wparams, pcmf32.data(), pcmf32.size());
+                    });
+                }
+                for (auto & w : workers) {
+                    w.join();
+                }
+                if (std::find_if(rets.begin(), rets.end(), [](int r) { return r != 0; }) != rets.end()) {
+                    fprintf(stderr, "error: failed to process audio with %d states\n", n);
+                    break;
+                }
+
+                const whisper_memory_usage usage = whisper_get_memory_usage(ctx, states.back());
+
+                size_t states_total = 0;
+                for (auto * st : states) {
+                    states_total += whisper_get_memory_usage(ctx, st).state;
+                }
+
+                size_t rss      = 0;
+                size_t rss_peak = 0;
+                bench_rss(rss, rss_peak);
+
+                json jvram = json::array();
+                const std::vector<size_t> vram = bench_vram();
+                for (size_t i = 0; i < vram.size() && i < vram0.size(); ++i) {
+                    jvram.push_back(vram[i] - std::min(vram[i], vram0[i]));
+                }
+
+                jrun["steps"].push_back({
+                    { "n_states",     n },
+                    { "state",        bench_memory_usage(usage) },
+                    { "states_total", states_total },
+                    { "rss",          rss },
+                    { "rss_peak",     rss_peak },
+                    { "vram",         jvram },
+                });
+
+                fprintf(stderr, "%s: backend = %s, decoding = %-7s, states = %2d: weights = %8.2f MB, state = %8.2f MB (kv self %.2f, compute %.2f), rss = %8.2f MB, peak = %8.2f MB\n",
+                        __func__, backend.c_str(), decoding.c_str(), n, model_usage.weights/1e6, usage.state/1e6, usage.kv_self/1e6,
+                        (usage.compute_conv + usage.compute_encode + usage.compute_cross + usage.compute_decode + usage.compute_batch)/1e6,
+                        rss/1e6, rss_peak/1e6);
+            }
+
+            for (auto * state : states) {
+                whisper_free_state(state);
+            }
+            whisper_free(ctx);
+
+            jres["runs"].push_back(jrun);
+        }
+    }
+
+    if (params.fname_json.empty()) {
+        printf("%s\n", jres.dump(2).c_str());
+    } else {
+        std::ofstream fout(params.fname_json);
+        if (!fout) {
+            fprintf(stderr, "error: failed to open '%s' for writing\n", params.fname_json.c_str());
+            return 5;
+        }
+        fout << jres.dump(2) << "\n";
+    }
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     ggml_backend_load_all();
 
@@ -173,12 +1291,20 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // before any backend or context starts its worker threads, so that the counters follow them
+    if (params.perf_counters) {
+        bench_counters_open();
+    }
+
     int ret = -1;
 
     switch (params.what) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_pipeline(params);            break;
+        case 4: ret = whisper_bench_ops(params);                 break;
+        case 5: ret = whisper_bench_memory(params);              break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
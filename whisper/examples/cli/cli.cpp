@@ -13,6 +13,9 @@
 #include <vector>
 #include <cstring>
 #include <cfloat>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 
 #if defined(_WIN32)
 #ifndef NOMINMAX
@@ -35,26 +38,36 @@ static void replace_all(std::string & s, const std::string & search, const std::
 struct whisper_params {
     int32_t n_threads     = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors  = 1;
+    int32_t n_jobs        = 1;
     int32_t offset_t_ms   = 0;
     int32_t offset_n      = 0;
     int32_t duration_ms   = 0;
+    int32_t chunk_ms      = 0;
+    int32_t chunk_stride_ms = 0;
+    int32_t parallel_overlap_ms = 4000;
+    int32_t stream_chunk_s = 0;
     int32_t progress_step = 5;
     int32_t max_context   = -1;
     int32_t max_len       = 0;
     int32_t best_of       = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).greedy.best_of;
     int32_t beam_size     = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH).beam_search.beam_size;
     int32_t audio_ctx     = 0;
+    int32_t lid_audio_ctx = 0;
 
     float word_thold      =  0.01f;
     float entropy_thold   =  2.40f;
     float logprob_thold   = -1.00f;
     float no_speech_thold =  0.6f;
+    float no_speech_skip  =  0.0f;
+    int32_t repeat_thold  = 16;
+    int32_t n_lookup      =  0;
     float grammar_penalty = 100.0f;
     float temperature     = 0.0f;
     float temperature_inc = 0.2f;
 
     bool debug_mode      = false;
     bool translate       = false;
+    bool dual_task       = false;
     bool detect_language = false;
     bool diarize         = false;
     bool tinydiarize     = false;
@@ -79,6 +92,12 @@ struct whisper_params {
     bool flash_attn      = true;
     bool suppress_nst    = false;
     bool carry_initial_prompt = false;
+    int32_t n_gpu_layers = -1;
+    bool use_hugepages   = false;
+    bool numa_replicate  = false;
+    bool fuse_qkv        = false;
+    bool progressive_load = false;
+    int32_t n_gpu_devices = 1;
 
     std::string language  = "en";
     std::string prompt;
@@ -95,6 +114,19 @@ struct whisper_params {
 
     std::string openvino_encode_device = "CPU";
 
+    std::string rpc_servers;
+
+    // LoRA adapters (--lora, --lora-scaled) and, once loaded, what every state applies
+    std::vector<std::pair<std::string, float>> lora;
+    std::vector<std::pair<whisper_adapter_lora *, float>> lora_adapters;
+
+    // calibration cache; the tuned thread count is used unless -t is given
+    std::string autotune;
+    std::string sched_cache;
+    std::string weight_type;
+    std::string tensor_types;
+    bool n_threads_set = false;
+
     std::string dtw = "";
 
     std::vector<std::string> fname_inp = {};
@@ -147,11 +179,16 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
             exit(0);
         }
         #define ARGV_NEXT (((i + 1) < argc) ? argv[++i] : requires_value_error(arg))
-        else if (arg == "-t"    || arg == "--threads")              { params.n_threads       = std::stoi(ARGV_NEXT); }
+        else if (arg == "-t"    || arg == "--threads")              { params.n_threads       = std::stoi(ARGV_NEXT); params.n_threads_set = true; }
         else if (arg == "-p"    || arg == "--processors")           { params.n_processors    = std::stoi(ARGV_NEXT); }
+        else if (arg == "-j"    || arg == "--jobs")                 { params.n_jobs          = std::stoi(ARGV_NEXT); }
         else if (arg == "-ot"   || arg == "--offset-t")             { params.offset_t_ms     = std::stoi(ARGV_NEXT); }
         else if (arg == "-on"   || arg == "--offset-n")             { params.offset_n        = std::stoi(ARGV_NEXT); }
         else if (arg == "-d"    || arg == "--duration")             { params.duration_ms     = std::stoi(ARGV_NEXT); }
+        else if (arg == "-cms"  || arg == "--chunk-ms")             { params.chunk_ms        = std::stoi(ARGV_NEXT); }
+        else if (arg == "-css"  || arg == "--chunk-stride-ms")      { params.chunk_stride_ms = std::stoi(ARGV_NEXT); }
+        else if (arg == "-po"   || arg == "--processor-overlap")    { params.parallel_overlap_ms = std::stoi(ARGV_NEXT); }
+        else if (arg == "-sc"   || arg == "--stream-chunk")         { params.stream_chunk_s  = std::stoi(ARGV_NEXT); }
         else if (arg == "-mc"   || arg == "--max-context")          { params.max_context     = std::stoi(ARGV_NEXT); }
         else if (arg == "-ml"   || arg == "--max-len")              { params.max_len         = std::stoi(ARGV_NEXT); }
         else if (arg == "-bo"   || arg == "--best-of")              { params.best_of         = std::stoi(ARGV_NEXT); }
@@ -161,10 +198,14 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-et"   || arg == "--entropy-thold")        { params.entropy_thold   = std::stof(ARGV_NEXT); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")        { params.logprob_thold   = std::stof(ARGV_NEXT); }
         else if (arg == "-nth"  || arg == "--no-speech-thold")      { params.no_speech_thold = std::stof(ARGV_NEXT); }
+        else if (arg == "-nss"  || arg == "--no-speech-skip")       { params.no_speech_skip  = std::stof(ARGV_NEXT); }
+        else if (arg == "-rt"   || arg == "--repeat-thold")         { params.repeat_thold    = std::stoi(ARGV_NEXT); }
+        else if (arg == "-pl"   || arg == "--prompt-lookup")        { params.n_lookup        = std::stoi(ARGV_NEXT); }
         else if (arg == "-tp"   || arg == "--temperature")          { params.temperature     = std::stof(ARGV_NEXT); }
         else if (arg == "-tpi"  || arg == "--temperature-inc")      { params.temperature_inc = std::stof(ARGV_NEXT); }
         else if (arg == "-debug"|| arg == "--debug-mode")           { params.debug_mode      = true; }
         else if (arg == "-tr"   || arg == "--translate")            { params.translate       = true; }
+        else if (arg == "-dt"   || arg == "--dual-task")            { params.dual_task       = true; }
         else if (arg == "-di"   || arg == "--diarize")              { params.diarize         = true; }
         else if (arg == "-tdrz" || arg == "--tinydiarize")          { params.tinydiarize     = true; }
         else if (arg == "-sow"  || arg == "--split-on-word")        { params.split_on_word   = true; }
@@ -187,14 +228,28 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-nt"   || arg == "--no-timestamps")        { params.no_timestamps   = true; }
         else if (arg == "-l"    || arg == "--language")             { params.language        = whisper_param_turn_lowercase(ARGV_NEXT); }
         else if (arg == "-dl"   || arg == "--detect-language")      { params.detect_language = true; }
+        else if (arg == "-lac"  || arg == "--lid-audio-ctx")        { params.lid_audio_ctx   = std::stoi(ARGV_NEXT); }
         else if (                  arg == "--prompt")               { params.prompt          = ARGV_NEXT; }
         else if (                  arg == "--carry-initial-prompt") { params.carry_initial_prompt = true; }
         else if (arg == "-m"    || arg == "--model")                { params.model           = ARGV_NEXT; }
+        else if (                  arg == "--lora")                 { params.lora.emplace_back(ARGV_NEXT, 1.0f); }
+        else if (                  arg == "--lora-scaled")          { const std::string f = ARGV_NEXT; params.lora.emplace_back(f, std::stof(ARGV_NEXT)); }
         else if (arg == "-f"    || arg == "--file")                 { params.fname_inp.emplace_back(ARGV_NEXT); }
         else if (arg == "-oved" || arg == "--ov-e-device")          { params.openvino_encode_device = ARGV_NEXT; }
         else if (arg == "-dtw"  || arg == "--dtw")                  { params.dtw             = ARGV_NEXT; }
         else if (arg == "-ls"   || arg == "--log-score")            { params.log_score       = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")               { params.use_gpu         = false; }
+        else if (arg == "-ngl"  || arg == "--n-gpu-layers")         { params.n_gpu_layers    = std::stoi(ARGV_NEXT); }
+        else if (arg == "-hp"   || arg == "--hugepages")            { params.use_hugepages   = true; }
+        else if (                  arg == "--numa-replicate")       { params.numa_replicate  = true; }
+        else if (                  arg == "--fuse-qkv")             { params.fuse_qkv        = true; }
+        else if (                  arg == "--progressive-load")     { params.progressive_load = true; }
+        else if (                  arg == "--gpu-devices")          { params.n_gpu_devices   = std::stoi(ARGV_NEXT); }
+        else if (                  arg == "--rpc")                  { params.rpc_servers     = ARGV_NEXT; }
+        else if (                  arg == "--autotune")             { params.autotune        = ARGV_NEXT; }
+        else if (                  arg == "--sched-cache")          { params.sched_cache     = ARGV_NEXT; }
+        else if (                  arg == "--weight-type")          { params.weight_type     = ARGV_NEXT; }
+        else if (                  arg == "--tensor-type")          { params.tensor_types    += (params.tensor_types.empty() ? "" : ",") + std::string(ARGV_NEXT); }
         else if (arg == "-fa"   || arg == "--flash-attn")           { params.flash_attn      = true; }
         else if (arg == "-nfa"  || arg == "--no-flash-attn")        { params.flash_attn      = false; }
         else if (arg == "-sns"  || arg == "--suppress-nst")         { params.suppress_nst    = true; }
@@ -230,9 +285,14 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -h,        --help                 [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,      --threads N            [%-7d] number of threads to use during computation\n",    params.n_threads);
     fprintf(stderr, "  -p N,      --processors N         [%-7d] number of processors to use during computation\n", params.n_processors);
+    fprintf(stderr, "  -j N,      --jobs N               [%-7d] number of input files transcribed at the same time\n", params.n_jobs);
     fprintf(stderr, "  -ot N,     --offset-t N           [%-7d] time offset in milliseconds\n",                    params.offset_t_ms);
     fprintf(stderr, "  -on N,     --offset-n N           [%-7d] segment index offset\n",                           params.offset_n);
     fprintf(stderr, "  -d  N,     --duration N           [%-7d] duration of audio to process in milliseconds\n",   params.duration_ms);
+    fprintf(stderr, "  -cms N,    --chunk-ms N           [%-7d] transcribe overlapping chunks of N ms (0 - sequential)\n", params.chunk_ms);
+    fprintf(stderr, "  -css N,    --chunk-stride-ms N    [%-7d] overlap on each side of a chunk (0 - chunk/6)\n",  params.chunk_stride_ms);
+    fprintf(stderr, "  -po N,     --processor-overlap N  [%-7d] overlap in ms of the processors' slices (0 - hard cuts)\n", params.parallel_overlap_ms);
+    fprintf(stderr, "  -sc N,     --stream-chunk N       [%-7d] decode and transcribe the input N sec at a time (0 - all at once)\n", params.stream_chunk_s);
     fprintf(stderr, "  -mc N,     --max-context N        [%-7d] maximum number of text context tokens to store\n", params.max_context);
     fprintf(stderr, "  -ml N,     --max-len N            [%-7d] maximum segment length in characters\n",           params.max_len);
     fprintf(stderr, "  -sow,      --split-on-word        [%-7s] split on word rather than on token\n",             params.split_on_word ? "true" : "false");
@@ -243,10 +303,14 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -et N,     --entropy-thold N      [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N      [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
     fprintf(stderr, "  -nth N,    --no-speech-thold N    [%-7.2f] no speech threshold\n",                          params.no_speech_thold);
+    fprintf(stderr, "  -nss N,    --no-speech-skip N     [%-7.2f] skip windows above this no speech probability (0 - off)\n", params.no_speech_skip);
+    fprintf(stderr, "  -rt N,     --repeat-thold N       [%-7d] fail a decoder on a phrase repeated 3 times over N tokens (0 - off)\n", params.repeat_thold);
+    fprintf(stderr, "  -pl N,     --prompt-lookup N      [%-7d] greedy: verify tokens that followed the last N tokens earlier in the context (0 - off)\n", params.n_lookup);
     fprintf(stderr, "  -tp,       --temperature N        [%-7.2f] The sampling temperature, between 0 and 1\n",    params.temperature);
     fprintf(stderr, "  -tpi,      --temperature-inc N    [%-7.2f] The increment of temperature, between 0 and 1\n",params.temperature_inc);
     fprintf(stderr, "  -debug,    --debug-mode           [%-7s] enable debug mode (eg. dump log_mel)\n",           params.debug_mode ? "true" : "false");
     fprintf(stderr, "  -tr,       --translate            [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
+    fprintf(stderr, "  -dt,       --dual-task            [%-7s] transcribe and translate with one encoder pass, translation to <output>.en.*\n", params.dual_task ? "true" : "false");
     fprintf(stderr, "  -di,       --diarize              [%-7s] stereo audio diarization\n",                       params.diarize ? "true" : "false");
     fprintf(stderr, "  -tdrz,     --tinydiarize          [%-7s] enable tinydiarize (requires a tdrz model)\n",     params.tinydiarize ? "true" : "false");
     fprintf(stderr, "  -nf,       --no-fallback          [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
@@ -268,14 +332,28 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -nt,       --no-timestamps        [%-7s] do not print timestamps\n",                        params.no_timestamps ? "true" : "false");
     fprintf(stderr, "  -l LANG,   --language LANG        [%-7s] spoken language ('auto' for auto-detect)\n",       params.language.c_str());
     fprintf(stderr, "  -dl,       --detect-language      [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
+    fprintf(stderr, "  -lac N,    --lid-audio-ctx N      [%-7d] audio context of the language detection (0 - all)\n", params.lid_audio_ctx);
     fprintf(stderr, "             --prompt PROMPT        [%-7s] initial prompt (max n_text_ctx/2 tokens)\n",       params.prompt.c_str());
     fprintf(stderr, "             --carry-initial-prompt [%-7s] always prepend initial prompt\n",                  params.carry_initial_prompt ? "true" : "false");
     fprintf(stderr, "  -m FNAME,  --model FNAME          [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "             --lora FNAME           [%-7s] apply a LoRA adapter (can be repeated)\n",          "");
+    fprintf(stderr, "             --lora-scaled FNAME S  [%-7s] apply a LoRA adapter with scale S (can be repeated)\n", "");
     fprintf(stderr, "  -f FNAME,  --file FNAME           [%-7s] input audio file path\n",                          "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME    [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "  -dtw MODEL --dtw MODEL            [%-7s] compute token-level timestamps\n",                 params.dtw.c_str());
     fprintf(stderr, "  -ls,       --log-score            [%-7s] log best decoder scores of tokens\n",              params.log_score?"true":"false");
     fprintf(stderr, "  -ng,       --no-gpu               [%-7s] disable GPU\n",                                    params.use_gpu ? "false" : "true");
+    fprintf(stderr, "  -ngl N,    --n-gpu-layers N       [%-7d] encoder, then decoder layers on the GPU (-1 - all)\n", params.n_gpu_layers);
+    fprintf(stderr, "  -hp,       --hugepages            [%-7s] back the CPU weights and compute buffers with huge pages\n", params.use_hugepages ? "true" : "false");
+    fprintf(stderr, "             --numa-replicate       [%-7s] one copy of the CPU weights per NUMA node\n", params.numa_replicate ? "true" : "false");
+    fprintf(stderr, "             --fuse-qkv             [%-7s] pack the self-attention Q, K and V weights into one matmul\n", params.fuse_qkv ? "true" : "false");
+    fprintf(stderr, "             --progressive-load     [%-7s] start encoding while the decoder weights are loading\n", params.progressive_load ? "true" : "false");
+    fprintf(stderr, "             --gpu-devices N        [%-7d] number of GPUs holding a copy of the weights (0 - all)\n", params.n_gpu_devices);
+    fprintf(stderr, "             --rpc SERVERS          [%-7s] comma-separated RPC servers (host:port) to run the encoder on\n", params.rpc_servers.c_str());
+    fprintf(stderr, "             --autotune FNAME       [%-7s] tune weight layout and threads for this host, cached in FNAME\n", params.autotune.c_str());
+    fprintf(stderr, "             --sched-cache FNAME    [%-7s] keep the measured compute buffer sizes in FNAME for faster start-up\n", params.sched_cache.c_str());
+    fprintf(stderr, "             --weight-type TYPE     [%-7s] convert the weights of an f16/f32 model to TYPE (q8_0, q5_0, ...) while loading\n", params.weight_type.c_str());
+    fprintf(stderr, "             --tensor-type R=TYPE   [%-7s] convert the weights whose name matches regex R to TYPE, can be repeated\n", params.tensor_types.c_str());
     fprintf(stderr, "  -fa,       --flash-attn           [%-7s] enable flash attention\n",                         params.flash_attn ? "true" : "false");
     fprintf(stderr, "  -nfa,      --no-flash-attn        [%-7s] disable flash attention\n",                        params.flash_attn ? "false" : "true");
     fprintf(stderr, "  -sns,      --suppress-nst         [%-7s] suppress non-speech tokens\n",                     params.suppress_nst ? "true" : "false");
@@ -298,11 +376,139 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "\n");
 }
 
+// Results of a chunked transcription (--stream-chunk): the segments of every chunk, with the
+// timestamps shifted to the position of the chunk in the input
+struct chunked_result {
+    struct token {
+        std::string        text;
+        whisper_token_data data;
+    };
+
+    struct segment {
+        std::string text;
+        int64_t     t0;
+        int64_t     t1;
+        bool        speaker_turn_next;
+
+        std::vector<token> tokens;
+    };
+
+    int lang_id = -1;
+
+    std::vector<segment> segments;
+
+    // the results of the last whisper_full*() run on the default state, of a chunk starting at t_offset (10 ms units)
+    void append(whisper_context * ctx, int64_t t_offset) {
+        whisper_results r;
+        whisper_full_get_results(ctx, &r);
+
+        if (lang_id < 0) {
+            lang_id = r.lang_id;
+        }
+        for (int i = 0; i < r.n_segments; ++i) {
+            const whisper_result_segment & rs = r.segments[i];
+
+            segment seg = { std::string(r.text + rs.text, rs.text_len), rs.t0 + t_offset, rs.t1 + t_offset, rs.speaker_turn_next, {} };
+            for (int j = rs.i_token; j < rs.i_token + rs.n_tokens; ++j) {
+                whisper_token_data data = r.tokens[j];
+                if (data.t0 >= 0) {
+                    data.t0 += t_offset;
+                    data.t1 += t_offset;
+                }
+                if (data.t_dtw >= 0) {
+                    data.t_dtw += t_offset;
+                }
+                seg.tokens.push_back({ r.text + r.token_text[j], data });
+            }
+            segments.push_back(std::move(seg));
+        }
+    }
+};
+
+// Results of the last whisper_full*() run, kept either in a state of the --jobs mode or in
+// the default state of the context (state == nullptr), or of all the chunks of a --stream-chunk
+// run (chunked != nullptr)
+struct whisper_result {
+    whisper_context * ctx;
+    whisper_state   * state;
+
+    const chunked_result * chunked = nullptr;
+
+    int n_segments() const {
+        if (chunked) {
+            return chunked->segments.size();
+        }
+        return state ? whisper_full_n_segments_from_state(state) : whisper_full_n_segments(ctx);
+    }
+    int lang_id() const {
+        if (chunked) {
+            return chunked->lang_id;
+        }
+        return state ? whisper_full_lang_id_from_state(state) : whisper_full_lang_id(ctx);
+    }
+    const char * segment_text(int i) const {
+        if (chunked) {
+            return chunked->segments[i].text.c_str();
+        }
+        return state ? whisper_full_get_segment_text_from_state(state, i) : whisper_full_get_segment_text(ctx, i);
+    }
+    int64_t segment_t0(int i) const {
+        if (chunked) {
+            return chunked->segments[i].t0;
+        }
+        return state ? whisper_full_get_segment_t0_from_state(state, i) : whisper_full_get_segment_t0(ctx, i);
+    }
+    int64_t segment_t1(int i) const {
+        if (chunked) {
+            return chunked->segments[i].t1;
+        }
+        return state ? whisper_full_get_segment_t1_from_state(state, i) : whisper_full_get_segment_t1(ctx, i);
+    }
+    bool segment_speaker_turn_next(int i) const {
+        if (chunked) {
+            return chunked->segments[i].speaker_turn_next;
+        }
+        return state ? whisper_full_get_segment_speaker_turn_next_from_state(state, i) : whisper_full_get_segment_speaker_turn_next(ctx, i);
+    }
+    int n_tokens(int i) const {
+        if (chunked) {
+            return chunked->segments[i].tokens.size();
+        }
+        return state ? whisper_full_n_tokens_from_state(state, i) : whisper_full_n_tokens(ctx, i);
+    }
+    whisper_token token_id(int i, int j) const {
+        if (chunked) {
+            return chunked->segments[i].tokens[j].data.id;
+        }
+        return state ? whisper_full_get_token_id_from_state(state, i, j) : whisper_full_get_token_id(ctx, i, j);
+    }
+    const char * token_text(int i, int j) const {
+        if (chunked) {
+            return chunked->segments[i].tokens[j].text.c_str();
+        }
+        return state ? whisper_full_get_token_text_from_state(ctx, state, i, j) : whisper_full_get_token_text(ctx, i, j);
+    }
+    float token_p(int i, int j) const {
+        if (chunked) {
+            return chunked->segments[i].tokens[j].data.p;
+        }
+        return state ? whisper_full_get_token_p_from_state(state, i, j) : whisper_full_get_token_p(ctx, i, j);
+    }
+    whisper_token_data token_data(int i, int j) const {
+        if (chunked) {
+            return chunked->segments[i].tokens[j].data;
+        }
+        return state ? whisper_full_get_token_data_from_state(state, i, j) : whisper_full_get_token_data(ctx, i, j);
+    }
+};
+
 struct whisper_print_user_data {
     const whisper_params * params;
 
     const std::vector<std::vector<float>> * pcmf32s;
     int progress_prev;
+
+    int64_t t_offset = 0; // of the chunk in the input (--stream-chunk), in 10 ms units
 };
 
 static std::string estimate_diarization_speaker(std::vector<std::vector<float>> pcmf32s, int64_t t0, int64_t t1, bool id_only = false) {
@@ -347,11 +553,14 @@ static void whisper_print_progress_callback(struct whisper_context * /*ctx*/, st
     }
 }
 
-static void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+static void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
+    const int64_t t_offset = ((whisper_print_user_data *) user_data)->t_offset;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const whisper_result res = { ctx, state };
+
+    const int n_segments = res.n_segments();
 
     std::string speaker = "";
 
@@ -361,18 +570,18 @@ static void whisper_print_segment_callback(struct whisper_context * ctx, struct
     // print the last n_new segments
     const int s0 = n_segments - n_new;
 
-    if (s0 == 0) {
+    if (s0 == 0 && t_offset == 0) {
         printf("\n");
     }
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = res.segment_t0(i);
+            t1 = res.segment_t1(i);
         }
 
         if (!params.no_timestamps) {
-            printf("[%s --> %s]  ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
+            printf("[%s --> %s]  ", to_timestamp(t0 + t_offset).c_str(), to_timestamp(t1 + t_offset).c_str());
         }
 
         if (params.diarize && pcmf32s.size() == 2) {
@@ -380,16 +589,16 @@ static void whisper_print_segment_callback(struct whisper_context * ctx, struct
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < res.n_tokens(i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
-                    if (id >= whisper_token_eot(ctx)) {
+                    const whisper_token id = res.token_id(i, j);
+                    if (id >= whisper_token_eot(res.ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = res.token_text(i, j);
+                const float  p    = res.token_p(i, j);
 
                 const int n_colors = (int) k_colors.size();
                 int raw_col = (int) (std::pow(p, 3)*float(n_colors));
@@ -400,16 +609,16 @@ static void whisper_print_segment_callback(struct whisper_context * ctx, struct
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else if (params.print_confidence) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < res.n_tokens(i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
-                    if (id >= whisper_token_eot(ctx)) {
+                    const whisper_token id = res.token_id(i, j);
+                    if (id >= whisper_token_eot(res.ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = res.token_text(i, j);
+                const float  p    = res.token_p(i, j);
 
                 int style_idx = 2;     // High confidence - dim
                 if (p < 0.33) {
@@ -420,13 +629,13 @@ static void whisper_print_segment_callback(struct whisper_context * ctx, struct
                 printf("%s%s%s%s", speaker.c_str(), k_styles[style_idx].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = res.segment_text(i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (res.segment_speaker_turn_next(i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -440,16 +649,16 @@ static void whisper_print_segment_callback(struct whisper_context * ctx, struct
     }
 }
 
-static void output_txt(struct whisper_context * ctx, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    const int n_segments = whisper_full_n_segments(ctx);
+static void output_txt(const whisper_result & res, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+    const int n_segments = res.n_segments();
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        const char * text = res.segment_text(i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = res.segment_t0(i);
+            const int64_t t1 = res.segment_t1(i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -457,14 +666,14 @@ static void output_txt(struct whisper_context * ctx, std::ofstream & fout, const
     }
 }
 
-static void output_vtt(struct whisper_context * ctx, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+static void output_vtt(const whisper_result & res, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     fout << "WEBVTT\n\n";
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = res.n_segments();
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = res.segment_text(i);
+        const int64_t t0 = res.segment_t0(i);
+        const int64_t t1 = res.segment_t1(i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
@@ -479,12 +688,12 @@ static void output_vtt(struct whisper_context * ctx, std::ofstream & fout, const
     }
 }
 
-static void output_srt(struct whisper_context * ctx, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    const int n_segments = whisper_full_n_segments(ctx);
+static void output_srt(const whisper_result & res, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+    const int n_segments = res.n_segments();
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = res.segment_text(i);
+        const int64_t t0 = res.segment_t0(i);
+        const int64_t t1 = res.segment_t1(i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
@@ -561,8 +770,8 @@ static char * escape_double_quotes_in_csv(const char * str) {
     return escaped;
 }
 
-static void output_csv(struct whisper_context * ctx, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    const int n_segments = whisper_full_n_segments(ctx);
+static void output_csv(const whisper_result & res, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+    const int n_segments = res.n_segments();
     fout << "start,end,";
     if (params.diarize && pcmf32s.size() == 2)
     {
@@ -571,9 +780,9 @@ static void output_csv(struct whisper_context * ctx, std::ofstream & fout, const
     fout << "text\n";
 
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = res.segment_text(i);
+        const int64_t t0 = res.segment_t0(i);
+        const int64_t t1 = res.segment_t1(i);
         char * text_escaped = escape_double_quotes_in_csv(text);
 
         //need to multiply times returned from whisper_full_get_segment_t{0,1}() by 10 to get milliseconds.
@@ -586,15 +795,15 @@ static void output_csv(struct whisper_context * ctx, std::ofstream & fout, const
     }
 }
 
-static void output_score(struct whisper_context * ctx, std::ofstream & fout, const whisper_params & /*params*/, std::vector<std::vector<float>> /*pcmf32s*/) {
-    const int n_segments = whisper_full_n_segments(ctx);
+static void output_score(const whisper_result & res, std::ofstream & fout, const whisper_params & /*params*/, std::vector<std::vector<float>> /*pcmf32s*/) {
+    const int n_segments = res.n_segments();
     // fprintf(stderr,"segments: %d\n",n_segments);
     for (int i = 0; i < n_segments; ++i) {
-        const int n_tokens = whisper_full_n_tokens(ctx, i);
+        const int n_tokens = res.n_tokens(i);
         // fprintf(stderr,"tokens: %d\n",n_tokens);
         for (int j = 0; j < n_tokens; j++) {
-            auto token = whisper_full_get_token_text(ctx, i, j);
-            auto probability = whisper_full_get_token_p(ctx, i, j);
+            auto token = res.token_text(i, j);
+            auto probability = res.token_p(i, j);
             fout << token << '\t' << probability << std::endl;
             // fprintf(stderr,"token: %s %f\n",token,probability);
 	    }
@@ -602,7 +811,7 @@ static void output_score(struct whisper_context * ctx, std::ofstream & fout, con
 }
 
 static void output_json(
-             struct whisper_context * ctx,
+               const whisper_result & res,
                       std::ofstream & fout,
                const whisper_params & params,
     std::vector<std::vector<float>>   pcmf32s) {
@@ -689,23 +898,23 @@ static void output_json(
     start_obj(nullptr);
         value_s("systeminfo", whisper_print_system_info(), false);
         start_obj("model");
-            value_s("type", whisper_model_type_readable(ctx), false);
-            value_b("multilingual", whisper_is_multilingual(ctx), false);
-            value_i("vocab", whisper_model_n_vocab(ctx), false);
+            value_s("type", whisper_model_type_readable(res.ctx), false);
+            value_b("multilingual", whisper_is_multilingual(res.ctx), false);
+            value_i("vocab", whisper_model_n_vocab(res.ctx), false);
             start_obj("audio");
-                value_i("ctx", whisper_model_n_audio_ctx(ctx), false);
-                value_i("state", whisper_model_n_audio_state(ctx), false);
-                value_i("head", whisper_model_n_audio_head(ctx), false);
-                value_i("layer", whisper_model_n_audio_layer(ctx), true);
+                value_i("ctx", whisper_model_n_audio_ctx(res.ctx), false);
+                value_i("state", whisper_model_n_audio_state(res.ctx), false);
+                value_i("head", whisper_model_n_audio_head(res.ctx), false);
+                value_i("layer", whisper_model_n_audio_layer(res.ctx), true);
             end_obj(false);
             start_obj("text");
-                value_i("ctx", whisper_model_n_text_ctx(ctx), false);
-                value_i("state", whisper_model_n_text_state(ctx), false);
-                value_i("head", whisper_model_n_text_head(ctx), false);
-                value_i("layer", whisper_model_n_text_layer(ctx), true);
+                value_i("ctx", whisper_model_n_text_ctx(res.ctx), false);
+                value_i("state", whisper_model_n_text_state(res.ctx), false);
+                value_i("head", whisper_model_n_text_head(res.ctx), false);
+                value_i("layer", whisper_model_n_text_layer(res.ctx), true);
             end_obj(false);
-            value_i("mels", whisper_model_n_mels(ctx), false);
-            value_i("ftype", whisper_model_ftype(ctx), true);
+            value_i("mels", whisper_model_n_mels(res.ctx), false);
+            value_i("ftype", whisper_model_ftype(res.ctx), true);
         end_obj(false);
         start_obj("params");
             value_s("model", params.model.c_str(), false);
@@ -713,16 +922,16 @@ static void output_json(
             value_b("translate", params.translate, true);
         end_obj(false);
         start_obj("result");
-            value_s("language", whisper_lang_str(whisper_full_lang_id(ctx)), true);
+            value_s("language", whisper_lang_str(res.lang_id()), true);
         end_obj(false);
         start_arr("transcription");
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = res.n_segments();
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
+                const char * text = res.segment_text(i);
 
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const int64_t t0 = res.segment_t0(i);
+                const int64_t t1 = res.segment_t1(i);
 
                 start_obj(nullptr);
                     times_o(t0, t1, false);
@@ -730,11 +939,11 @@ static void output_json(
 
                     if (full) {
                         start_arr("tokens");
-                        const int n = whisper_full_n_tokens(ctx, i);
+                        const int n = res.n_tokens(i);
                         for (int j = 0; j < n; ++j) {
-                            auto token = whisper_full_get_token_data(ctx, i, j);
+                            auto token = res.token_data(i, j);
                             start_obj(nullptr);
-                                value_s("text", whisper_token_to_str(ctx, token.id), false);
+                                value_s("text", whisper_token_to_str(res.ctx, token.id), false);
                                 if(token.t0 > -1 && token.t1 > -1) {
                                     // If we have per-token timestamps, write them out
                                     times_o(token.t0, token.t1, false);
@@ -752,7 +961,7 @@ static void output_json(
                     }
 
                     if (params.tinydiarize) {
-                        value_b("speaker_turn_next", whisper_full_get_segment_speaker_turn_next(ctx, i), true);
+                        value_b("speaker_turn_next", res.segment_speaker_turn_next(i), true);
                     }
                 end_obj(i == (n_segments - 1));
             }
@@ -764,7 +973,7 @@ static void output_json(
 // karaoke video generation
 // outputs a bash script that uses ffmpeg to generate a video with the subtitles
 // TODO: font parameter adjustments
-static bool output_wts(struct whisper_context * ctx, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s, const char * fname_inp, float t_sec, const char * fname_out) {
+static bool output_wts(const whisper_result & res, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s, const char * fname_inp, float t_sec, const char * fname_out) {
     static const char * font = params.font_path.c_str();
 
     std::ifstream fin(font);
@@ -778,15 +987,15 @@ static bool output_wts(struct whisper_context * ctx, std::ofstream & fout, const
 
     fout << "ffmpeg -i " << fname_inp << " -f lavfi -i color=size=1200x120:duration=" << t_sec << ":rate=25:color=black -vf \"";
 
-    for (int i = 0; i < whisper_full_n_segments(ctx); i++) {
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+    for (int i = 0; i < res.n_segments(); i++) {
+        const int64_t t0 = res.segment_t0(i);
+        const int64_t t1 = res.segment_t1(i);
 
-        const int n = whisper_full_n_tokens(ctx, i);
+        const int n = res.n_tokens(i);
 
         std::vector<whisper_token_data> tokens(n);
         for (int j = 0; j < n; ++j) {
-            tokens[j] = whisper_full_get_token_data(ctx, i, j);
+            tokens[j] = res.token_data(i, j);
         }
 
         if (i > 0) {
@@ -806,7 +1015,7 @@ static bool output_wts(struct whisper_context * ctx, std::ofstream & fout, const
         for (int j = 0; j < n; ++j) {
             const auto & token = tokens[j];
 
-            if (tokens[j].id >= whisper_token_eot(ctx)) {
+            if (tokens[j].id >= whisper_token_eot(res.ctx)) {
                 continue;
             }
 
@@ -828,11 +1037,11 @@ static bool output_wts(struct whisper_context * ctx, std::ofstream & fout, const
                 for (int k = 0; k < n; ++k) {
                     const auto & token2 = tokens[k];
 
-                    if (tokens[k].id >= whisper_token_eot(ctx)) {
+                    if (tokens[k].id >= whisper_token_eot(res.ctx)) {
                         continue;
                     }
 
-                    const std::string txt = whisper_token_to_str(ctx, token2.id);
+                    const std::string txt = whisper_token_to_str(res.ctx, token2.id);
 
                     txt_bg += txt;
 
@@ -885,13 +1094,13 @@ static bool output_wts(struct whisper_context * ctx, std::ofstream & fout, const
     return true;
 }
 
-static void output_lrc(struct whisper_context * ctx, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+static void output_lrc(const whisper_result & res, std::ofstream & fout, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     fout << "[by:whisper.cpp]\n";
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = res.n_segments();
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t = whisper_full_get_segment_t0(ctx, i);
+        const char * text = res.segment_text(i);
+        const int64_t t = res.segment_t0(i);
 
         int64_t msec = t * 10;
         int64_t min = msec / (1000 * 60);
@@ -906,8 +1115,8 @@ static void output_lrc(struct whisper_context * ctx, std::ofstream & fout, const
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = res.segment_t0(i);
+            const int64_t t1 = res.segment_t1(i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -916,6 +1125,518 @@ static void output_lrc(struct whisper_context * ctx, std::ofstream & fout, const
 }
 
 
+struct fout_factory {
+    std::string fname_out;
+    const size_t basename_length;
+    const bool is_stdout;
+    bool used_stdout;
+    decltype(whisper_print_segment_callback) * const print_segment_callback;
+    std::ofstream fout;
+
+    fout_factory (const std::string & fname_out_, const std::string & fname_inp, whisper_params & params) :
+            fname_out{!fname_out_.empty() ? fname_out_ : fname_inp},
+            basename_length{fname_out.size()},
+            is_stdout{fname_out == "-"},
+            used_stdout{},
+            print_segment_callback{is_stdout ? nullptr : whisper_print_segment_callback} {
+        if (!print_segment_callback) {
+            params.print_progress = false;
+        }
+    }
+
+    bool open(const char * ext, const char * function) {
+        if (is_stdout) {
+            if (used_stdout) {
+                fprintf(stderr, "warning: Not appending multiple file formats to stdout\n");
+                return false;
+            }
+
+            used_stdout = true;
+#ifdef _WIN32
+            fout = std::ofstream{"CON"};
+#else
+            fout = std::ofstream{"/dev/stdout"};
+#endif
+            // Not using fprintf stderr here because it might equal stdout
+            // Also assuming /dev is mounted
+            return true;
+        }
+
+        fname_out.resize(basename_length);
+        fname_out += ext;
+        fout = std::ofstream{fname_out};
+        if (!fout.is_open()) {
+            fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+            return false;
+        }
+        fprintf(stderr, "%s: saving output to '%s'\n", function, fname_out.c_str());
+        return true;
+    }
+};
+
+// prints what process_file() is about to transcribe, n_samples < 0 for a --stream-chunk input
+static void print_processing_info(const whisper_params & params, const std::string & fname_inp, int64_t n_samples) {
+    // print system information
+    fprintf(stderr, "\n");
+    fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+            params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
+
+    // print some info about the processing
+    char what[64];
+    if (n_samples >= 0) {
+        snprintf(what, sizeof(what), "%d samples, %.1f sec", int(n_samples), float(n_samples)/WHISPER_SAMPLE_RATE);
+    } else {
+        snprintf(what, sizeof(what), "in chunks of %d sec", params.stream_chunk_s);
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "process_file: processing '%s' (%s), %d threads, %d processors, %d beams + best of %d, lang = %s, task = %s, %stimestamps = %d ...\n",
+            fname_inp.c_str(), what,
+            params.n_threads, params.n_processors, params.beam_size, params.best_of,
+            params.language.c_str(),
+            params.dual_task ? "transcribe + translate" : params.translate ? "translate" : "transcribe",
+            params.tinydiarize ? "tdrz = 1, " : "",
+            params.no_timestamps ? 0 : 1);
+
+    if (params.print_colors) {
+        fprintf(stderr, "process_file: color scheme: red (low confidence), yellow (medium), green (high confidence)\n");
+    } else if (params.print_confidence) {
+        fprintf(stderr, "process_file: confidence: highlighted (low confidence), underlined (medium), dim (high confidence)\n");
+    }
+    fprintf(stderr, "\n");
+}
+
+// runs the inference on pcmf32, a whole input or a chunk of one starting at t_offset (10 ms units);
+// cont: a chunk after the first, which keeps the text context of the previous one
+// state_translate: --dual-task, the translation goes there
+static int transcribe(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+          const whisper_params & params,
+            const fout_factory & fout_factory,
+      const std::vector<float> & pcmf32,
+    const std::vector<std::vector<float>> & pcmf32s,
+                         int64_t t_offset,
+                            bool cont,
+             const std::string & fname_inp,
+                    const char * argv0,
+          struct whisper_state * state_translate = nullptr) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    const bool use_grammar = (!params.grammar_parsed.rules.empty() && !params.grammar_rule.empty());
+    wparams.strategy = (params.beam_size > 1 || use_grammar) ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.detect_language  = params.detect_language;
+    wparams.lid_audio_ctx    = params.lid_audio_ctx;
+    wparams.n_threads        = params.n_threads;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+    wparams.chunk_ms         = params.chunk_ms;
+    wparams.chunk_stride_ms  = params.chunk_stride_ms;
+    wparams.parallel_overlap_ms = params.parallel_overlap_ms;
+
+    wparams.token_timestamps = params.output_wts || params.output_jsn_full || params.max_len > 0;
+    wparams.thold_pt         = params.word_thold;
+    wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+    wparams.split_on_word    = params.split_on_word;
+    wparams.audio_ctx        = params.audio_ctx;
+
+    wparams.debug_mode       = params.debug_mode;
+
+    wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+    wparams.suppress_regex   = params.suppress_regex.empty() ? nullptr : params.suppress_regex.c_str();
+
+    wparams.initial_prompt       = params.prompt.c_str();
+    wparams.carry_initial_prompt = params.carry_initial_prompt;
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : params.temperature_inc;
+    wparams.temperature      = params.temperature;
+
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+    wparams.no_speech_thold  = params.no_speech_thold;
+    wparams.no_speech_skip_thold = params.no_speech_skip;
+    wparams.repeat_thold     = params.repeat_thold;
+    wparams.n_lookup         = params.n_lookup;
+
+    wparams.no_timestamps    = params.no_timestamps;
+
+    wparams.suppress_nst     = params.suppress_nst;
+
+    wparams.vad            = params.vad;
+    wparams.vad_model_path = params.vad_model.c_str();
+
+    wparams.vad_params.threshold               = params.vad_threshold;
+    wparams.vad_params.min_speech_duration_ms  = params.vad_min_speech_duration_ms;
+    wparams.vad_params.min_silence_duration_ms = params.vad_min_silence_duration_ms;
+    wparams.vad_params.max_speech_duration_s   = params.vad_max_speech_duration_s;
+    wparams.vad_params.speech_pad_ms           = params.vad_speech_pad_ms;
+    wparams.vad_params.samples_overlap         = params.vad_samples_overlap;
+
+    whisper_print_user_data user_data = { &params, &pcmf32s, 0, t_offset };
+
+    const auto & grammar_parsed = params.grammar_parsed;
+    auto grammar_rules = grammar_parsed.c_rules();
+
+    if (use_grammar) {
+        if (grammar_parsed.symbol_ids.find(params.grammar_rule) == grammar_parsed.symbol_ids.end()) {
+            fprintf(stderr, "%s: warning: grammar rule '%s' not found - skipping grammar sampling\n", __func__, params.grammar_rule.c_str());
+        } else {
+            wparams.grammar_rules = grammar_rules.data();
+            wparams.n_grammar_rules = grammar_rules.size();
+            wparams.i_start_rule = grammar_parsed.symbol_ids.at(params.grammar_rule);
+            wparams.grammar_penalty = params.grammar_penalty;
+        }
+    }
+
+    // a chunk after the first continues the text of the previous one, in its language
+    if (cont) {
+        wparams.no_context = false;
+        if (!params.carry_initial_prompt) {
+            wparams.initial_prompt = nullptr;
+        }
+    }
+
+    // this callback is called on each new segment, in --jobs mode the segments are printed at the end
+    if (!wparams.print_realtime && !state) {
+        wparams.new_segment_callback           = fout_factory.print_segment_callback;
+        wparams.new_segment_callback_user_data = &user_data;
+    }
+
+    if (wparams.print_progress) {
+        wparams.progress_callback           = whisper_print_progress_callback;
+        wparams.progress_callback_user_data = &user_data;
+    }
+
+    // examples for abort mechanism
+    // in examples below, we do not abort the processing, but we could if the flag is set to true
+
+    // the callback is called before every encoder run - if it returns false, the processing is aborted
+    {
+        static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
+
+        wparams.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
+            bool is_aborted = *(bool*)user_data;
+            return !is_aborted;
+        };
+        wparams.encoder_begin_callback_user_data = &is_aborted;
+    }
+
+    // the callback is called before every computation - if it returns true, the computation is aborted
+    {
+        static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
+
+        wparams.abort_callback = [](void * user_data) {
+            bool is_aborted = *(bool*)user_data;
+            return is_aborted;
+        };
+        wparams.abort_callback_user_data = &is_aborted;
+    }
+
+    const int ret = state_translate ? whisper_full_dual(ctx, state_translate, wparams, pcmf32.data(), pcmf32.size())
+                  : state           ? whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size())
+                                    : whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors);
+    if (ret != 0) {
+        fprintf(stderr, "%s: failed to process audio '%s'\n", argv0, fname_inp.c_str());
+        return 10;
+    }
+
+    return 0;
+}
+
+// writes the output files of res, an input of t_sec seconds
+static void write_outputs(
+    const whisper_result & res,
+  const whisper_params & params,
+          fout_factory & fout_factory,
+    const std::vector<std::vector<float>> & pcmf32s,
+     const std::string & fname_inp,
+                   float t_sec) {
+    // macros to stringify function name
+#define output_func(func, ext, param, ...) if (param && fout_factory.open(ext, #func)) {\
+func(res, fout_factory.fout, params, __VA_ARGS__); \
+}
+#define output_ext(ext, ...) output_func(output_##ext, "." #ext, params.output_##ext, __VA_ARGS__)
+
+    output_ext(txt, pcmf32s);
+    output_ext(vtt, pcmf32s);
+    output_ext(srt, pcmf32s);
+    output_ext(wts, pcmf32s, fname_inp.c_str(), t_sec, fout_factory.fname_out.c_str());
+    output_ext(csv, pcmf32s);
+    output_func(output_json, ".json", params.output_jsn, pcmf32s);
+    output_ext(lrc, pcmf32s);
+    output_func(output_score, ".score.txt", params.log_score, pcmf32s);
+
+#undef output_ext
+#undef output_func
+
+    if (fout_factory.is_stdout && !fout_factory.used_stdout) {
+        fprintf(stderr, "warning: '--output-file -' used without any other '--output-*'");
+    }
+}
+
+// transcribes the f-th input file and writes its outputs
+// state == nullptr: in the default state of ctx, with params.n_processors
+// otherwise: in the given state (--jobs), the segments are printed when the file is done
+// state_translate: --dual-task, the translation is printed after the transcription and written to <output>.en.*
+static int process_file(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                whisper_params & params,
+                             int f,
+      const std::vector<float> & pcmf32,
+    const std::vector<std::vector<float>> & pcmf32s,
+                    const char * argv0,
+          struct whisper_state * state_translate = nullptr) {
+    const auto & fname_inp = params.fname_inp[f];
+
+    struct fout_factory fout_factory{f < (int) params.fname_out.size() ? params.fname_out[f] : "", fname_inp, params};
+
+    // in --jobs mode, the progress across the files is printed instead
+    if (!params.no_prints && !state) {
+        print_processing_info(params, fname_inp, pcmf32.size());
+    }
+
+    if (const int ret = transcribe(ctx, state, params, fout_factory, pcmf32, pcmf32s, 0, false, fname_inp, argv0, state_translate)) {
+        return ret;
+    }
+
+    // output stuff
+    {
+        // the files of the --jobs mode finish in any order, print and write the outputs of one at a time
+        static std::mutex output_mutex;
+        std::lock_guard<std::mutex> lock(output_mutex);
+
+        const whisper_result res = { ctx, state };
+
+        if (state && fout_factory.print_segment_callback) {
+            whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
+            fout_factory.print_segment_callback(ctx, state, res.n_segments(), &user_data);
+        }
+
+        write_outputs(res, params, fout_factory, pcmf32s, fname_inp, float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE);
+    }
+
+    if (state_translate) {
+        const std::string fname_out = f < (int) params.fname_out.size() ? params.fname_out[f] : fname_inp;
+
+        struct fout_factory fout_translate{fname_out == "-" ? fname_out : fname_out + ".en", fname_inp, params};
+
+        const whisper_result res = { ctx, state_translate };
+
+        if (fout_translate.print_segment_callback) {
+            whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
+            fout_translate.print_segment_callback(ctx, state_translate, res.n_segments(), &user_data);
+        }
+
+        write_outputs(res, params, fout_translate, pcmf32s, fname_inp, float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE);
+    }
+    return 0;
+}
+
+// --stream-chunk: decodes and transcribes the f-th input params.stream_chunk_s seconds at a time, so that
+// only about two chunks of audio are in memory, the next one decoded while the current one is transcribed
+static int process_file_chunked(struct whisper_context * ctx, whisper_params & params, int f, const char * argv0) {
+    const auto & fname_inp = params.fname_inp[f];
+
+    audio_decoder decoder;
+    if (!decoder.open(fname_inp, false)) {
+        fprintf(stderr, "error: failed to read audio file '%s'\n", fname_inp.c_str());
+        return 0;
+    }
+
+    struct fout_factory fout_factory{f < (int) params.fname_out.size() ? params.fname_out[f] : "", fname_inp, params};
+
+    if (!params.no_prints) {
+        print_processing_info(params, fname_inp, -1);
+    }
+
+    audio_chunk_reader reader(decoder, (int64_t) params.stream_chunk_s*WHISPER_SAMPLE_RATE, false);
+
+    whisper_params params_chunk = params;
+    chunked_result chunked;
+
+    std::vector<float>              pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+
+    int64_t offset    = 0;
+    int64_t n_samples = 0;
+
+    for (int i = 0; reader.next(pcmf32, pcmf32s, offset); ++i) {
+        const int64_t t_offset = 100*offset/WHISPER_SAMPLE_RATE;
+
+        if (const int ret = transcribe(ctx, nullptr, params_chunk, fout_factory, pcmf32, pcmf32s, t_offset, i > 0, fname_inp, argv0)) {
+            return ret;
+        }
+
+        chunked.append(ctx, t_offset);
+
+        // the language detected in the first chunk is kept
+        if (i == 0 && params_chunk.language == "auto" && !params_chunk.detect_language && chunked.lang_id >= 0) {
+            params_chunk.language = whisper_lang_str(chunked.lang_id);
+        }
+
+        n_samples = offset + pcmf32.size();
+    }
+
+    if (reader.failed()) {
+        fprintf(stderr, "%s: failed to decode audio '%s' after %.1f sec\n", argv0, fname_inp.c_str(), float(n_samples)/WHISPER_SAMPLE_RATE);
+        return 10;
+    }
+
+    const whisper_result res = { ctx, nullptr, &chunked };
+
+    write_outputs(res, params, fout_factory, pcmf32s, fname_inp, float(n_samples + 1000)/WHISPER_SAMPLE_RATE);
+
+    return 0;
+}
+
+// --jobs: transcribes up to params.n_jobs files at the same time, each on its own whisper_state
+// of the shared context. A loader thread decodes the audio of the next files in the meantime.
+static int process_files_jobs(struct whisper_context * ctx, const whisper_params & params, const char * argv0) {
+    const int n_files = params.fname_inp.size();
+    const int n_jobs  = std::min<int>(params.n_jobs, n_files);
+
+    std::vector<whisper_state *> states;
+    for (int i = 0; i < n_jobs; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper state %d\n", i);
+            for (auto * s : states) {
+                whisper_free_state(s);
+            }
+            return 3;
+        }
+        states.push_back(state);
+
+        for (const auto & l : params.lora_adapters) {
+            whisper_set_adapter_lora_with_state(ctx, state, l.first, l.second);
+        }
+    }
+
+    struct job {
+        int  f  = 0;
+        bool ok = false;
+
+        std::vector<float>              pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+    };
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<job>         queue; // decoded files, at most n_jobs ahead of the workers
+    bool                    loaded = false;
+
+    int    n_done   = 0;
+    int    n_failed = 0;
+    double audio_s  = 0.0;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    std::thread loader([&]() {
+        for (int f = 0; f < n_files; ++f) {
+            job j;
+            j.f  = f;
+            j.ok = ::read_audio_data(params.fname_inp[f], j.pcmf32, j.pcmf32s, params.diarize);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return (int) queue.size() < n_jobs; });
+            queue.push_back(std::move(j));
+            cv.notify_all();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        loaded = true;
+        cv.notify_all();
+    });
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_jobs; ++i) {
+        workers.emplace_back([&, i]() {
+            whisper_params params_job = params;
+            params_job.print_progress = false;
+            params_job.n_processors   = 1;
+
+            while (true) {
+                job j;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&]() { return !queue.empty() || loaded; });
+                    if (queue.empty()) {
+                        break;
+                    }
+                    j = std::move(queue.front());
+                    queue.pop_front();
+                    cv.notify_all();
+                }
+
+                const std::string & fname_inp = params.fname_inp[j.f];
+
+                int ret = 0;
+                if (!j.ok) {
+                    fprintf(stderr, "error: failed to read audio file '%s'\n", fname_inp.c_str());
+                } else {
+                    ret = process_file(ctx, states[i], params_job, j.f, j.pcmf32, j.pcmf32s, argv0);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+
+                n_done++;
+                if (ret != 0) {
+                    n_failed++;
+                } else if (j.ok) {
+                    audio_s += double(j.pcmf32.size())/WHISPER_SAMPLE_RATE;
+                }
+
+                if (!params.no_prints) {
+                    const double t_s = 1e-6*(ggml_time_us() - t_start_us);
+                    const double eta = t_s/n_done*(n_files - n_done);
+
+                    fprintf(stderr, "process_files_jobs: [%d/%d] '%s' done | %.1f s of audio, %.1fx realtime | elapsed %s, ETA %s\n",
+                            n_done, n_files, fname_inp.c_str(), audio_s, audio_s/t_s,
+                            to_timestamp(int64_t(100*t_s)).c_str(), to_timestamp(int64_t(100*eta)).c_str());
+                }
+            }
+        });
+    }
+
+    for (auto & w : workers) {
+        w.join();
+    }
+    loader.join();
+
+    for (auto * s : states) {
+        whisper_free_state(s);
+    }
+
+    if (!params.no_prints) {
+        const double t_s = 1e-6*(ggml_time_us() - t_start_us);
+
+        fprintf(stderr, "\n%s: %d files, %.1f s of audio in %.1f s (%.1fx realtime) with %d jobs, %d failed\n",
+                __func__, n_files, audio_s, t_s, audio_s/t_s, n_jobs, n_failed);
+
+        const whisper_cpu_sched_stats cpu = whisper_cpu_sched_get_stats();
+        if (cpu.n_threads > 0 && cpu.t_wall_s > 0.0) {
+            fprintf(stderr, "%s: CPU scheduler: %d threads, %.0f%% busy, at most %d at once, %lld of %lld graphs with fewer threads\n",
+                    __func__, cpu.n_threads, 100.0*cpu.t_busy_s/(cpu.t_wall_s*cpu.n_threads), cpu.n_busy_max,
+                    (long long) cpu.n_graphs_clamped, (long long) cpu.n_graphs);
+        }
+    }
+
+    return n_failed > 0 ? 10 : 0;
+}
+
 static void cb_log_disable(enum ggml_log_level , const char * , void * ) { }
 
 int main(int argc, char ** argv) {
@@ -995,6 +1716,18 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    if (params.stream_chunk_s > 0 && (params.diarize || params.offset_t_ms > 0 || params.duration_ms > 0)) {
+        fprintf(stderr, "error: --stream-chunk cannot be used with --diarize, --offset-t or --duration\n");
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    if (params.dual_task && (params.stream_chunk_s > 0 || params.n_processors > 1 || params.n_jobs > 1 || params.vad)) {
+        fprintf(stderr, "error: --dual-task cannot be used with --stream-chunk, --processors, --jobs or --vad\n");
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
     if (params.no_prints) {
         whisper_log_set(cb_log_disable, NULL);
     }
@@ -1002,8 +1735,39 @@ int main(int argc, char ** argv) {
     // whisper init
     struct whisper_context_params cparams = whisper_context_default_params();
 
-    cparams.use_gpu    = params.use_gpu;
-    cparams.flash_attn = params.flash_attn;
+    cparams.use_gpu      = params.use_gpu;
+    cparams.flash_attn   = params.flash_attn;
+    cparams.n_gpu_layers = params.n_gpu_layers;
+    cparams.use_hugepages = params.use_hugepages;
+    cparams.numa_replicate = params.numa_replicate;
+    cparams.fuse_qkv       = params.fuse_qkv;
+    cparams.progressive_load = params.progressive_load;
+    cparams.n_gpu_devices  = params.n_gpu_devices;
+
+    if (!params.rpc_servers.empty()) {
+        cparams.rpc_servers = params.rpc_servers.c_str();
+    }
+
+    if (!params.sched_cache.empty()) {
+        cparams.sched_cache = params.sched_cache.c_str();
+    }
+    if (!params.autotune.empty()) {
+        cparams.autotune_cache = params.autotune.c_str();
+    }
+    if (!params.weight_type.empty()) {
+        for (int t = 0; t < GGML_TYPE_COUNT; ++t) {
+            if (params.weight_type == ggml_type_name((ggml_type) t)) {
+                cparams.type_weights = (ggml_type) t;
+            }
+        }
+        if (cparams.type_weights == GGML_TYPE_COUNT) {
+            fprintf(stderr, "error: unknown weight type '%s'\n", params.weight_type.c_str());
+            return 3;
+        }
+    }
+    if (!params.tensor_types.empty()) {
+        cparams.tensor_types = params.tensor_types.c_str();
+    }
 
     if (!params.dtw.empty()) {
         cparams.dtw_token_timestamps = true;
@@ -1035,9 +1799,27 @@ int main(int argc, char ** argv) {
         return 3;
     }
 
+    if (!params.autotune.empty() && !params.n_threads_set) {
+        params.n_threads = whisper_autotune_n_threads(ctx);
+    }
+
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+    for (const auto & l : params.lora) {
+        whisper_adapter_lora * adapter = whisper_adapter_lora_init(ctx, l.first.c_str());
+        if (adapter == nullptr) {
+            fprintf(stderr, "error: failed to load LoRA adapter '%s'\n", l.first.c_str());
+            for (const auto & a : params.lora_adapters) {
+                whisper_adapter_lora_free(a.first);
+            }
+            whisper_free(ctx);
+            return 3;
+        }
+        whisper_set_adapter_lora(ctx, adapter, l.second);
+        params.lora_adapters.emplace_back(adapter, l.second);
+    }
+
     if (!params.grammar.empty()) {
         auto & grammar = params.grammar_parsed;
         if (is_file_exist(params.grammar.c_str())) {
@@ -1061,245 +1843,67 @@ int main(int argc, char ** argv) {
         }
     }
 
-    for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
-        const auto & fname_inp = params.fname_inp[f];
-        struct fout_factory {
-            std::string fname_out;
-            const size_t basename_length;
-            const bool is_stdout;
-            bool used_stdout;
-            decltype(whisper_print_segment_callback) * const print_segment_callback;
-            std::ofstream fout;
-
-            fout_factory (const std::string & fname_out_, const std::string & fname_inp, whisper_params & params) :
-                    fname_out{!fname_out_.empty() ? fname_out_ : fname_inp},
-                    basename_length{fname_out.size()},
-                    is_stdout{fname_out == "-"},
-                    used_stdout{},
-                    print_segment_callback{is_stdout ? nullptr : whisper_print_segment_callback} {
-                if (!print_segment_callback) {
-                    params.print_progress = false;
-                }
-            }
-
-            bool open(const char * ext, const char * function) {
-                if (is_stdout) {
-                    if (used_stdout) {
-                        fprintf(stderr, "warning: Not appending multiple file formats to stdout\n");
-                        return false;
-                    }
-
-                    used_stdout = true;
-#ifdef _WIN32
-                    fout = std::ofstream{"CON"};
-#else
-                    fout = std::ofstream{"/dev/stdout"};
-#endif
-                    // Not using fprintf stderr here because it might equal stdout
-                    // Also assuming /dev is mounted
-                    return true;
-                }
-
-                fname_out.resize(basename_length);
-                fname_out += ext;
-                fout = std::ofstream{fname_out};
-                if (!fout.is_open()) {
-                    fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
-                    return false;
-                }
-                fprintf(stderr, "%s: saving output to '%s'\n", function, fname_out.c_str());
-                return true;
-            }
-        } fout_factory{f < (int) params.fname_out.size() ? params.fname_out[f] : "", fname_inp, params};
-
-        std::vector<float> pcmf32;               // mono-channel F32 PCM
-        std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
-
-        if (!::read_audio_data(fname_inp, pcmf32, pcmf32s, params.diarize)) {
-            fprintf(stderr, "error: failed to read audio file '%s'\n", fname_inp.c_str());
-            continue;
+    if (!whisper_is_multilingual(ctx)) {
+        if (params.language != "en" || params.translate || params.dual_task) {
+            params.language = "en";
+            params.translate = false;
+            params.dual_task = false;
+            fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
         }
+    }
+    if (params.detect_language) {
+        params.language = "auto";
+    }
 
-        if (!whisper_is_multilingual(ctx)) {
-            if (params.language != "en" || params.translate) {
-                params.language = "en";
-                params.translate = false;
-                fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
-            }
-        }
-        if (params.detect_language) {
-            params.language = "auto";
-        }
+    const bool use_jobs = params.n_jobs > 1 && params.fname_inp.size() > 1;
 
-        if (!params.no_prints) {
-            // print system information
-            fprintf(stderr, "\n");
-            fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
-                    params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
+    // --dual-task: the translation of every input goes to this state
+    whisper_state * state_translate = params.dual_task && !params.detect_language ? whisper_init_state(ctx) : nullptr;
+    if (params.dual_task && !params.detect_language && !state_translate) {
+        fprintf(stderr, "error: failed to initialize the translation state\n");
+        whisper_free(ctx);
+        return 3;
+    }
 
-            // print some info about the processing
-            fprintf(stderr, "\n");
-            fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, %d beams + best of %d, lang = %s, task = %s, %stimestamps = %d ...\n",
-                    __func__, fname_inp.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
-                    params.n_threads, params.n_processors, params.beam_size, params.best_of,
-                    params.language.c_str(),
-                    params.translate ? "translate" : "transcribe",
-                    params.tinydiarize ? "tdrz = 1, " : "",
-                    params.no_timestamps ? 0 : 1);
-
-            if (params.print_colors) {
-                fprintf(stderr, "%s: color scheme: red (low confidence), yellow (medium), green (high confidence)\n", __func__);
-            } else if (params.print_confidence) {
-                fprintf(stderr, "%s: confidence: highlighted (low confidence), underlined (medium), dim (high confidence)\n", __func__);
-            }
-            fprintf(stderr, "\n");
+    if (use_jobs) {
+        if (const int ret = process_files_jobs(ctx, params, argv[0])) {
+            whisper_free(ctx);
+            return ret;
         }
+    } else {
+        for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
+            const auto & fname_inp = params.fname_inp[f];
 
-        // run the inference
-        {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-
-            const bool use_grammar = (!params.grammar_parsed.rules.empty() && !params.grammar_rule.empty());
-            wparams.strategy = (params.beam_size > 1 || use_grammar) ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
-
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-
-            wparams.token_timestamps = params.output_wts || params.output_jsn_full || params.max_len > 0;
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
-            wparams.split_on_word    = params.split_on_word;
-            wparams.audio_ctx        = params.audio_ctx;
-
-            wparams.debug_mode       = params.debug_mode;
-
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
-
-            wparams.suppress_regex   = params.suppress_regex.empty() ? nullptr : params.suppress_regex.c_str();
-
-            wparams.initial_prompt       = params.prompt.c_str();
-            wparams.carry_initial_prompt = params.carry_initial_prompt;
-
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
-
-            wparams.temperature_inc  = params.no_fallback ? 0.0f : params.temperature_inc;
-            wparams.temperature      = params.temperature;
-
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
-            wparams.no_speech_thold  = params.no_speech_thold;
-
-            wparams.no_timestamps    = params.no_timestamps;
-
-            wparams.suppress_nst     = params.suppress_nst;
-
-            wparams.vad            = params.vad;
-            wparams.vad_model_path = params.vad_model.c_str();
-
-            wparams.vad_params.threshold               = params.vad_threshold;
-            wparams.vad_params.min_speech_duration_ms  = params.vad_min_speech_duration_ms;
-            wparams.vad_params.min_silence_duration_ms = params.vad_min_silence_duration_ms;
-            wparams.vad_params.max_speech_duration_s   = params.vad_max_speech_duration_s;
-            wparams.vad_params.speech_pad_ms           = params.vad_speech_pad_ms;
-            wparams.vad_params.samples_overlap         = params.vad_samples_overlap;
-
-            whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
-
-            const auto & grammar_parsed = params.grammar_parsed;
-            auto grammar_rules = grammar_parsed.c_rules();
-
-            if (use_grammar) {
-                if (grammar_parsed.symbol_ids.find(params.grammar_rule) == grammar_parsed.symbol_ids.end()) {
-                    fprintf(stderr, "%s: warning: grammar rule '%s' not found - skipping grammar sampling\n", __func__, params.grammar_rule.c_str());
-                } else {
-                    wparams.grammar_rules = grammar_rules.data();
-                    wparams.n_grammar_rules = grammar_rules.size();
-                    wparams.i_start_rule = grammar_parsed.symbol_ids.at(params.grammar_rule);
-                    wparams.grammar_penalty = params.grammar_penalty;
+            if (params.stream_chunk_s > 0) {
+                if (const int ret = process_file_chunked(ctx, params, f, argv[0])) {
+                    return ret;
                 }
+                continue;
             }
 
-            // this callback is called on each new segment
-            if (!wparams.print_realtime) {
-                wparams.new_segment_callback           = fout_factory.print_segment_callback;
-                wparams.new_segment_callback_user_data = &user_data;
-            }
-
-            if (wparams.print_progress) {
-                wparams.progress_callback           = whisper_print_progress_callback;
-                wparams.progress_callback_user_data = &user_data;
-            }
-
-            // examples for abort mechanism
-            // in examples below, we do not abort the processing, but we could if the flag is set to true
-
-            // the callback is called before every encoder run - if it returns false, the processing is aborted
-            {
-                static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
-
-                wparams.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
-                    bool is_aborted = *(bool*)user_data;
-                    return !is_aborted;
-                };
-                wparams.encoder_begin_callback_user_data = &is_aborted;
-            }
-
-            // the callback is called before every computation - if it returns true, the computation is aborted
-            {
-                static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
+            std::vector<float> pcmf32;               // mono-channel F32 PCM
+            std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
 
-                wparams.abort_callback = [](void * user_data) {
-                    bool is_aborted = *(bool*)user_data;
-                    return is_aborted;
-                };
-                wparams.abort_callback_user_data = &is_aborted;
-            }
-
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
-                fprintf(stderr, "%s: failed to process audio\n", argv[0]);
-                return 10;
+            if (!::read_audio_data(fname_inp, pcmf32, pcmf32s, params.diarize)) {
+                fprintf(stderr, "error: failed to read audio file '%s'\n", fname_inp.c_str());
+                continue;
             }
-        }
-
-        // output stuff
-        {
-            // macros to stringify function name
-#define output_func(func, ext, param, ...) if (param && fout_factory.open(ext, #func)) {\
-    func(ctx, fout_factory.fout, params, __VA_ARGS__); \
-}
-#define output_ext(ext, ...) output_func(output_##ext, "." #ext, params.output_##ext, __VA_ARGS__)
-
-            output_ext(txt, pcmf32s);
-            output_ext(vtt, pcmf32s);
-            output_ext(srt, pcmf32s);
-            output_ext(wts, pcmf32s, fname_inp.c_str(), float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE, fout_factory.fname_out.c_str());
-            output_ext(csv, pcmf32s);
-            output_func(output_json, ".json", params.output_jsn, pcmf32s);
-            output_ext(lrc, pcmf32s);
-            output_func(output_score, ".score.txt", params.log_score, pcmf32s);
 
-#undef output_ext
-#undef output_func
-
-            if (fout_factory.is_stdout && !fout_factory.used_stdout) {
-                fprintf(stderr, "warning: '--output-file -' used without any other '--output-*'");
+            if (const int ret = process_file(ctx, nullptr, params, f, pcmf32, pcmf32s, argv[0], state_translate)) {
+                return ret;
             }
         }
     }
 
-    if (!params.no_prints) {
+    if (!params.no_prints && !use_jobs) {
         whisper_print_timings(ctx);
     }
+    for (const auto & a : params.lora_adapters) {
+        whisper_adapter_lora_free(a.first);
+    }
+    if (state_translate) {
+        whisper_free_state(state_translate);
+    }
     whisper_free(ctx);
 
     return 0;
@@ -13,6 +13,7 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <fstream>
 #include <map>
@@ -35,6 +36,8 @@ struct whisper_params {
 
     float grammar_penalty = 100.0f;
 
+    float kws_margin = 5.0f;
+
     grammar_parser::parse_state grammar_parsed;
 
     bool translate     = false;
@@ -43,6 +46,7 @@ struct whisper_params {
     bool no_timestamps = true;
     bool use_gpu       = true;
     bool flash_attn    = true;
+    bool kws           = false;
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
@@ -84,6 +88,8 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-m"     || arg == "--model")         { params.model         = argv[++i]; }
         else if (arg == "-f"     || arg == "--file")          { params.fname_out     = argv[++i]; }
         else if (arg == "-cmd"   || arg == "--commands")      { params.commands      = argv[++i]; }
+        else if (arg == "-kws"   || arg == "--keyword-spotting") { params.kws        = true; }
+        else if (arg == "-kwm"   || arg == "--kws-margin")    { params.kws_margin    = std::stof(argv[++i]); }
         else if (arg == "-p"     || arg == "--prompt")        { params.prompt        = argv[++i]; }
         else if (arg == "-ctx"   || arg == "--context")       { params.context       = argv[++i]; }
         else if (                   arg == "--grammar")       { params.grammar       = argv[++i]; }
@@ -123,6 +129,8 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -m FNAME,   --model FNAME    [%-7s] model path\n",                                  params.model.c_str());
     fprintf(stderr, "  -f FNAME,   --file FNAME     [%-7s] text output file name\n",                       params.fname_out.c_str());
     fprintf(stderr, "  -cmd FNAME, --commands FNAME [%-7s] text file with allowed commands\n",             params.commands.c_str());
+    fprintf(stderr, "  -kws,       --keyword-spotting [%-5s] score the allowed commands in one batched decode\n", params.kws ? "true" : "false");
+    fprintf(stderr, "  -kwm N,     --kws-margin N   [%-7.1f] drop commands this far below the best (log prob)\n", params.kws_margin);
     fprintf(stderr, "  -p,         --prompt         [%-7s] the required activation prompt\n",              params.prompt.c_str());
     fprintf(stderr, "  -ctx,       --context        [%-7s] sample text to help the transcription\n",       params.context.c_str());
     fprintf(stderr, "  --grammar GRAMMAR            [%-7s] GBNF grammar to guide decoding\n",              params.grammar.c_str());
@@ -255,7 +263,7 @@ static std::vector<std::string> get_words(const std::string &txt) {
 // guide the transcription to match the most likely command from a provided list
 static int process_command_list(struct whisper_context * ctx, audio_async &audio, const whisper_params &params, std::ofstream &fout) {
     fprintf(stderr, "\n");
-    fprintf(stderr, "%s: guided mode\n", __func__);
+    fprintf(stderr, "%s: guided mode%s\n", __func__, params.kws ? " (keyword spotting)" : "");
 
     std::vector<std::string> allowed_commands = read_allowed_commands(params.commands);
 
@@ -337,6 +345,11 @@ static int process_command_list(struct whisper_context * ctx, audio_async &audio
     bool is_running  = true;
 
     std::vector<float> pcmf32_cur;
+
+    // end of speech detector over the last 2 s, fed with the audio captured since the previous poll
+    vad_energy vad(WHISPER_SAMPLE_RATE, 2000, 1000, params.vad_thold, params.freq_thold);
+    uint64_t   vad_pos = 0;
+    audio_view vad_view;
     std::vector<float> pcmf32_prompt;
 
     // main loop
@@ -347,13 +360,64 @@ static int process_command_list(struct whisper_context * ctx, audio_async &audio
         // delay
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-        audio.get(2000, pcmf32_cur);
+        audio.peek_new(vad_pos, vad_view);
+        vad.push(vad_view.data[0], vad_view.size[0]);
+        vad.push(vad_view.data[1], vad_view.size[1]);
 
-        if (::vad_simple(pcmf32_cur, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, params.print_energy)) {
+        if (vad.speech_ended(params.print_energy)) {
             fprintf(stdout, "%s: Speech detected! Processing ...\n", __func__);
 
+            audio.get(2000, pcmf32_cur);
+
             const auto t_start = std::chrono::high_resolution_clock::now();
 
+            if (params.kws) {
+                // encode once and score all the commands in one batched decode, with early exit
+                std::vector<const char *> phrases;
+                for (const auto & cmd : allowed_commands) {
+                    phrases.push_back(cmd.c_str());
+                }
+
+                std::vector<float> scores(phrases.size());
+
+                const int index = whisper_score_phrases(ctx, pcmf32_cur.data(), pcmf32_cur.size(), params.language.c_str(),
+                        phrases.data(), phrases.size(), params.audio_ctx, params.kws_margin, scores.data(), params.n_threads);
+                if (index < 0) {
+                    fprintf(stderr, "%s: ERROR: whisper_score_phrases() failed\n", __func__);
+                    break;
+                }
+
+                const auto t_end = std::chrono::high_resolution_clock::now();
+
+                // probability of each command among the allowed ones
+                double psum = 0.0;
+                for (const float score : scores) {
+                    psum += exp(score - scores[index]);
+                }
+
+                fprintf(stdout, "\n");
+                for (int i = 0; i < (int) allowed_commands.size(); ++i) {
+                    if (scores[i] == -INFINITY) {
+                        continue;
+                    }
+                    fprintf(stdout, "%s: %s%-*s%s = %f | log p = %8.3f\n", __func__, "\033[1m", max_len, allowed_commands[i].c_str(), "\033[0m",
+                            exp(scores[i] - scores[index])/psum, scores[i]);
+                }
+
+                fprintf(stdout, "\n");
+                fprintf(stdout, "%s: detected command: %s%s%s | p = %f | t = %d ms\n", __func__,
+                        "\033[1m", allowed_commands[index].c_str(), "\033[0m", 1.0/psum,
+                        (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count());
+                fprintf(stdout, "\n");
+                if (fout.is_open()) {
+                    fout << allowed_commands[index] << std::endl;
+                }
+
+                audio.clear();
+                vad.reset();
+                continue;
+            }
+
             whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
             wparams.print_progress   = false;
@@ -460,6 +524,7 @@ static int process_command_list(struct whisper_context * ctx, audio_async &audio
             }
 
             audio.clear();
+            vad.reset();
         }
     }
 
@@ -478,6 +543,11 @@ static int always_prompt_transcription(struct whisper_context * ctx, audio_async
 
     std::vector<float> pcmf32_cur;
 
+    // end of speech detector over the last 2 s, fed with the audio captured since the previous poll
+    vad_energy vad(WHISPER_SAMPLE_RATE, 2000, 1000, params.vad_thold, params.freq_thold);
+    uint64_t   vad_pos = 0;
+    audio_view vad_view;
+
     const std::string k_prompt = params.prompt;
 
     const int k_prompt_length = get_words(k_prompt).size();
@@ -502,9 +572,11 @@ static int always_prompt_transcription(struct whisper_context * ctx, audio_async
         }
 
         {
-            audio.get(2000, pcmf32_cur);
+            audio.peek_new(vad_pos, vad_view);
+            vad.push(vad_view.data[0], vad_view.size[0]);
+            vad.push(vad_view.data[1], vad_view.size[1]);
 
-            if (::vad_simple(pcmf32_cur, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, params.print_energy)) {
+            if (vad.speech_ended(params.print_energy)) {
                 fprintf(stdout, "%s: Speech detected! Processing ...\n", __func__);
 
                 int64_t t_ms = 0;
@@ -542,6 +614,7 @@ static int always_prompt_transcription(struct whisper_context * ctx, audio_async
                 fprintf(stdout, "\n");
 
                 audio.clear();
+                vad.reset();
             }
         }
     }
@@ -566,6 +639,11 @@ static int process_general_transcription(struct whisper_context * ctx, audio_asy
     int n_tokens  = 0;
 
     std::vector<float> pcmf32_cur;
+
+    // end of speech detector over the last 2 s, fed with the audio captured since the previous poll
+    vad_energy vad(WHISPER_SAMPLE_RATE, 2000, 1000, params.vad_thold, params.freq_thold);
+    uint64_t   vad_pos = 0;
+    audio_view vad_view;
     std::vector<float> pcmf32_prompt;
 
     std::string k_prompt = "Ok Whisper, start listening for commands.";
@@ -593,9 +671,11 @@ static int process_general_transcription(struct whisper_context * ctx, audio_asy
         }
 
         {
-            audio.get(2000, pcmf32_cur);
+            audio.peek_new(vad_pos, vad_view);
+            vad.push(vad_view.data[0], vad_view.size[0]);
+            vad.push(vad_view.data[1], vad_view.size[1]);
 
-            if (::vad_simple(pcmf32_cur, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, params.print_energy)) {
+            if (vad.speech_ended(params.print_energy)) {
                 fprintf(stdout, "%s: Speech detected! Processing ...\n", __func__);
 
                 int64_t t_ms = 0;
@@ -681,6 +761,7 @@ static int process_general_transcription(struct whisper_context * ctx, audio_asy
                 }
 
                 audio.clear();
+                vad.reset();
             }
         }
     }
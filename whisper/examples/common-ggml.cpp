@@ -1,7 +1,10 @@
 #include "common-ggml.h"
 
+#include <algorithm>
+#include <cctype>
 #include <regex>
 #include <map>
+#include <thread>
 
 static const std::map<std::string, enum ggml_ftype> GGML_FTYPE_MAP = {
     {"q4_0", GGML_FTYPE_MOSTLY_Q4_0},
@@ -14,6 +17,8 @@ static const std::map<std::string, enum ggml_ftype> GGML_FTYPE_MAP = {
     {"q4_k", GGML_FTYPE_MOSTLY_Q4_K},
     {"q5_k", GGML_FTYPE_MOSTLY_Q5_K},
     {"q6_k", GGML_FTYPE_MOSTLY_Q6_K},
+    {"iq4_nl", GGML_FTYPE_MOSTLY_IQ4_NL},
+    {"bf16", GGML_FTYPE_MOSTLY_BF16},
 };
 
 void ggml_print_ftypes(FILE * fp) {
@@ -24,7 +29,7 @@ void ggml_print_ftypes(FILE * fp) {
 
 enum ggml_ftype ggml_parse_ftype(const char * str) {
     enum ggml_ftype ftype;
-    if (str[0] == 'q') {
+    if (str[0] == 'q' || str[0] == 'i' || str[0] == 'b') {
         const auto it = GGML_FTYPE_MAP.find(str);
         if (it == GGML_FTYPE_MAP.end()) {
             fprintf(stderr, "%s: unknown ftype '%s'\n", __func__, str);
@@ -38,12 +43,105 @@ enum ggml_ftype ggml_parse_ftype(const char * str) {
     return ftype;
 }
 
+enum ggml_type ggml_parse_type(const char * str) {
+    for (int i = 0; i < GGML_TYPE_COUNT; ++i) {
+        const char * name = ggml_type_name((ggml_type) i);
+        if (!name) {
+            continue;
+        }
+        size_t j = 0;
+        while (name[j] && str[j] && tolower((unsigned char) name[j]) == tolower((unsigned char) str[j])) {
+            ++j;
+        }
+        if (name[j] == '\0' && str[j] == '\0') {
+            return (ggml_type) i;
+        }
+    }
+
+    return GGML_TYPE_COUNT;
+}
+
+static bool ggml_can_quantize_to(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_Q4_K:
+        case GGML_TYPE_Q5_K:
+        case GGML_TYPE_Q6_K:
+        case GGML_TYPE_IQ4_NL:
+        case GGML_TYPE_F16:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// quantizes nrows rows of src into dst, split in row ranges over n_threads threads
+static size_t ggml_quantize_rows(ggml_type type, const float * src, void * dst, int64_t nrows, int64_t n_per_row, const float * imatrix, int n_threads) {
+    n_threads = (int) std::max<int64_t>(1, std::min<int64_t>(n_threads, nrows));
+
+    const int64_t rows_per_thread = (nrows + n_threads - 1)/n_threads;
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        const int64_t row0 = i*rows_per_thread;
+        const int64_t n    = std::min(rows_per_thread, nrows - row0);
+        if (n <= 0) {
+            break;
+        }
+        workers.emplace_back([=]() {
+            ggml_quantize_chunk(type, src, dst, row0*n_per_row, n, n_per_row, imatrix);
+        });
+    }
+
+    ggml_quantize_chunk(type, src, dst, 0, std::min(rows_per_thread, nrows), n_per_row, imatrix);
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return nrows*ggml_row_size(type, n_per_row);
+}
+
+// sum_j w_j (x_j - q_j)^2 / sum_j w_j x_j^2 over all rows, with w the importance of the column (1 without imatrix)
+static double ggml_quantize_error(ggml_type type, const float * src, const void * q, int64_t nrows, int64_t n_per_row, const float * imatrix) {
+    const auto * traits = ggml_get_type_traits(type);
+    if (!traits->to_float) {
+        return 0.0;
+    }
+
+    const size_t row_size = ggml_row_size(type, n_per_row);
+
+    std::vector<float> row(n_per_row);
+
+    double err = 0.0;
+    double ref = 0.0;
+    for (int64_t r = 0; r < nrows; ++r) {
+        traits->to_float((const char *) q + r*row_size, row.data(), n_per_row);
+
+        const float * x = src + r*n_per_row;
+        for (int64_t j = 0; j < n_per_row; ++j) {
+            const double w = imatrix ? imatrix[j] : 1.0;
+            err += w*(x[j] - row[j])*(x[j] - row[j]);
+            ref += w*x[j]*x[j];
+        }
+    }
+
+    return ref > 0.0 ? err/ref : 0.0;
+}
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip) {
+        const std::vector<std::string> & to_skip,
+        const ggml_quantize_params & qparams) {
 
     ggml_type qtype = GGML_TYPE_F32;
 
@@ -58,6 +156,8 @@ bool ggml_common_quantize_0(
         case GGML_FTYPE_MOSTLY_Q4_K: qtype = GGML_TYPE_Q4_K; break;
         case GGML_FTYPE_MOSTLY_Q5_K: qtype = GGML_TYPE_Q5_K; break;
         case GGML_FTYPE_MOSTLY_Q6_K: qtype = GGML_TYPE_Q6_K; break;
+        case GGML_FTYPE_MOSTLY_IQ4_NL: qtype = GGML_TYPE_IQ4_NL; break;
+        case GGML_FTYPE_MOSTLY_BF16: qtype = GGML_TYPE_BF16; break;
         case GGML_FTYPE_UNKNOWN:
         case GGML_FTYPE_ALL_F32:
         case GGML_FTYPE_MOSTLY_F16:
@@ -68,10 +168,8 @@ bool ggml_common_quantize_0(
         case GGML_FTYPE_MOSTLY_IQ3_XXS:
         case GGML_FTYPE_MOSTLY_IQ3_S:
         case GGML_FTYPE_MOSTLY_IQ1_S:
-        case GGML_FTYPE_MOSTLY_IQ4_NL:
         case GGML_FTYPE_MOSTLY_IQ4_XS:
         case GGML_FTYPE_MOSTLY_IQ1_M:
-        case GGML_FTYPE_MOSTLY_BF16:
         case GGML_FTYPE_MOSTLY_MXFP4:
                 {
                     fprintf(stderr, "%s: invalid model type %d\n", __func__, ftype);
@@ -79,11 +177,19 @@ bool ggml_common_quantize_0(
                 }
     };
 
-    if (!ggml_is_quantized(qtype)) {
+    // BF16 is not quantized, but converted the same way
+    if (!ggml_is_quantized(qtype) && qtype != GGML_TYPE_BF16) {
         fprintf(stderr, "%s: invalid quantization type %d (%s)\n", __func__, qtype, ggml_type_name(qtype));
         return false;
     }
 
+    for (const auto & tt : qparams.tensor_types) {
+        if (!ggml_can_quantize_to(tt.second)) {
+            fprintf(stderr, "%s: unsupported type %s for tensors matching '%s'\n", __func__, ggml_type_name(tt.second), tt.first.c_str());
+            return false;
+        }
+    }
+
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
@@ -91,6 +197,7 @@ bool ggml_common_quantize_0(
 
     std::vector<uint8_t>     data_u8;
     std::vector<ggml_fp16_t> data_f16;
+    std::vector<ggml_bf16_t> data_bf16;
     std::vector<float>       data_f32;
 
     while (true) {
@@ -140,7 +247,7 @@ bool ggml_common_quantize_0(
         quantize &= (n_dims == 2);
 
         if (quantize) {
-            if (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16) {
+            if (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16 && ttype != GGML_TYPE_BF16) {
                 fprintf(stderr, "%s: unsupported ttype %d (%s) for integer quantization\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
                 return false;
             }
@@ -152,12 +259,17 @@ bool ggml_common_quantize_0(
                 for (int i = 0; i < nelements; ++i) {
                     data_f32[i] = ggml_fp16_to_fp32(data_f16[i]);
                 }
+            } else if (ttype == GGML_TYPE_BF16) {
+                data_bf16.resize(nelements);
+                finp.read(reinterpret_cast<char *>(data_bf16.data()), nelements * sizeof(ggml_bf16_t));
+                data_f32.resize(nelements);
+                for (int i = 0; i < nelements; ++i) {
+                    data_f32[i] = ggml_bf16_to_fp32(data_bf16[i]);
+                }
             } else {
                 data_f32.resize(nelements);
                 finp.read(reinterpret_cast<char *>(data_f32.data()), nelements * sizeof(float));
             }
-
-            ttype = qtype;
         } else {
             const int bpe = (ttype == 0) ? sizeof(float) : sizeof(uint16_t);
 
@@ -165,6 +277,55 @@ bool ggml_common_quantize_0(
             finp.read(reinterpret_cast<char *>(data_u8.data()), nelements * bpe);
         }
 
+        size_t cur_size    = 0;
+        bool   use_imatrix = false;
+
+        if (quantize) {
+            ggml_type type = qtype;
+            for (const auto & tt : qparams.tensor_types) {
+                if (std::regex_search(name, std::regex(tt.first))) {
+                    type = tt.second;
+                    break;
+                }
+            }
+
+            if (ne[0] % ggml_blck_size(type) != 0) {
+                printf("(%d columns, not a multiple of %d: f16) ", ne[0], (int) ggml_blck_size(type));
+                type = GGML_TYPE_F16;
+            }
+
+            const float * imatrix = nullptr;
+            {
+                const auto it = qparams.imatrix.find(name);
+                if (it != qparams.imatrix.end() && it->second.size() == (size_t) ne[0]) {
+                    imatrix = it->second.data();
+                    use_imatrix = true;
+                }
+            }
+
+            const int64_t nrows = nelements/ne[0];
+
+            work.resize(nelements); // for quantization
+
+            while (true) {
+                cur_size = ggml_quantize_rows(type, data_f32.data(), work.data(), nrows, ne[0], imatrix, qparams.n_threads);
+
+                if (qparams.max_error <= 0.0f || type == GGML_TYPE_F16 || type == GGML_TYPE_BF16) {
+                    break;
+                }
+
+                const double err = ggml_quantize_error(type, data_f32.data(), work.data(), nrows, ne[0], imatrix);
+                if (err <= qparams.max_error) {
+                    break;
+                }
+
+                printf("(%s err %.2e) ", ggml_type_name(type), err);
+                type = type == GGML_TYPE_Q8_0 || ne[0] % ggml_blck_size(GGML_TYPE_Q8_0) != 0 ? GGML_TYPE_F16 : GGML_TYPE_Q8_0;
+            }
+
+            ttype = type;
+        }
+
         fout.write(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
         fout.write(reinterpret_cast<char *>(&length), sizeof(length));
         fout.write(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
@@ -174,56 +335,11 @@ bool ggml_common_quantize_0(
         fout.write(&name[0], length);
 
         if (quantize) {
-            work.resize(nelements); // for quantization
-
-            size_t cur_size = 0;
-            switch ((ggml_type) ttype) {
-                case GGML_TYPE_Q4_0:
-                case GGML_TYPE_Q4_1:
-                case GGML_TYPE_Q5_0:
-                case GGML_TYPE_Q5_1:
-                case GGML_TYPE_Q8_0:
-                case GGML_TYPE_Q2_K:
-                case GGML_TYPE_Q3_K:
-                case GGML_TYPE_Q4_K:
-                case GGML_TYPE_Q5_K:
-                case GGML_TYPE_Q6_K:
-                    {
-                        cur_size = ggml_quantize_chunk((ggml_type) ttype, data_f32.data(), work.data(), 0, nelements/ne[0], ne[0], nullptr);
-                    } break;
-                case GGML_TYPE_F32:
-                case GGML_TYPE_F16:
-                case GGML_TYPE_I8:
-                case GGML_TYPE_I16:
-                case GGML_TYPE_I32:
-                case GGML_TYPE_I64:
-                case GGML_TYPE_F64:
-                case GGML_TYPE_Q8_1:
-                case GGML_TYPE_Q8_K:
-                case GGML_TYPE_IQ2_XXS:
-                case GGML_TYPE_IQ2_XS:
-                case GGML_TYPE_IQ2_S:
-                case GGML_TYPE_IQ3_XXS:
-                case GGML_TYPE_IQ3_S:
-                case GGML_TYPE_IQ1_S:
-                case GGML_TYPE_IQ4_NL:
-                case GGML_TYPE_IQ4_XS:
-                case GGML_TYPE_IQ1_M:
-                case GGML_TYPE_BF16:
-                case GGML_TYPE_TQ1_0:
-                case GGML_TYPE_TQ2_0:
-                case GGML_TYPE_MXFP4:
-                case GGML_TYPE_COUNT:
-                    {
-                        fprintf(stderr, "%s: unsupported quantization type %d (%s)\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
-                        return false;
-                    }
-            }
-
             fout.write(reinterpret_cast<char *>(work.data()), cur_size);
             total_size_new += cur_size;
 
-            printf("size = %8.2f MB -> %8.2f MB\n", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0);
+            printf("size = %8.2f MB -> %8.2f MB (%s)%s\n", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0,
+                    ggml_type_name((ggml_type) ttype), use_imatrix ? " imatrix" : "");
         } else {
             printf("size = %8.3f MB\n", data_u8.size()/1024.0/1024.0);
             fout.write(reinterpret_cast<char *>(data_u8.data()), data_u8.size());
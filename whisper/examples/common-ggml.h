@@ -3,16 +3,37 @@
 #include "ggml.h"
 
 #include <fstream>
+#include <map>
 #include <vector>
 #include <string>
+#include <utility>
 
 enum ggml_ftype ggml_parse_ftype(const char * str);
 
 void ggml_print_ftypes(FILE * fp = stderr);
 
+// parses a tensor type by name ("q4_k", "q8_0", "f16", ...), GGML_TYPE_COUNT if unknown
+enum ggml_type ggml_parse_type(const char * str);
+
+struct ggml_quantize_params {
+    int n_threads = 1;
+
+    // the first regex that matches the name of a tensor to quantize picks its type instead of ftype
+    std::vector<std::pair<std::string, ggml_type>> tensor_types;
+
+    // per tensor, the mean of the squared activations of each input column (an importance matrix);
+    // the k-quants and IQ4_NL use it to keep the columns that see large activations more precise
+    std::map<std::string, std::vector<float>> imatrix;
+
+    // while the relative (importance weighted) quantization error of a tensor exceeds this,
+    // it is upgraded to Q8_0 and then F16 (0 - off)
+    float max_error = 0.0f;
+};
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip);
+        const std::vector<std::string> & to_skip,
+        const ggml_quantize_params & qparams = {});
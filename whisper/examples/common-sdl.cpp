@@ -1,11 +1,14 @@
 #include "common-sdl.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 audio_async::audio_async(int len_ms) {
     m_len_ms = len_ms;
 
     m_running = false;
+    m_audio_total = 0;
 }
 
 audio_async::~audio_async() {
@@ -73,7 +76,8 @@ bool audio_async::init(int capture_id, int sample_rate) {
 
     m_sample_rate = capture_spec_obtained.freq;
 
-    m_audio.resize((m_sample_rate*m_len_ms)/1000);
+    m_audio_len = (m_sample_rate*m_len_ms)/1000;
+    m_audio.resize(2*m_audio_len);
 
     return true;
 }
@@ -125,12 +129,7 @@ bool audio_async::clear() {
         return false;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-
-        m_audio_pos = 0;
-        m_audio_len = 0;
-    }
+    m_audio_clear = m_audio_total.load(std::memory_order_acquire);
 
     return true;
 }
@@ -143,27 +142,85 @@ void audio_async::callback(uint8_t * stream, int len) {
 
     size_t n_samples = len / sizeof(float);
 
-    if (n_samples > m_audio.size()) {
-        n_samples = m_audio.size();
+    // keep the newest len_ms, the rest of the buffer is for the samples being read
+    if (n_samples > m_audio_len) {
+        n_samples = m_audio_len;
 
         stream += (len - (n_samples * sizeof(float)));
     }
 
-    //fprintf(stderr, "%s: %zu samples, pos %zu, len %zu\n", __func__, n_samples, m_audio_pos, m_audio_len);
+    //fprintf(stderr, "%s: %zu samples, total %llu\n", __func__, n_samples, (unsigned long long) m_audio_total);
 
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
+    const uint64_t total = m_audio_total.load(std::memory_order_relaxed);
+    const size_t   pos   = total % m_audio.size();
 
-        if (m_audio_pos + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - m_audio_pos;
+    if (pos + n_samples > m_audio.size()) {
+        const size_t n0 = m_audio.size() - pos;
 
-            memcpy(&m_audio[m_audio_pos], stream, n0 * sizeof(float));
-            memcpy(&m_audio[0], stream + n0 * sizeof(float), (n_samples - n0) * sizeof(float));
-        } else {
-            memcpy(&m_audio[m_audio_pos], stream, n_samples * sizeof(float));
-        }
-        m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-        m_audio_len = std::min(m_audio_len + n_samples, m_audio.size());
+        memcpy(&m_audio[pos], stream, n0 * sizeof(float));
+        memcpy(&m_audio[0], stream + n0 * sizeof(float), (n_samples - n0) * sizeof(float));
+    } else {
+        memcpy(&m_audio[pos], stream, n_samples * sizeof(float));
+    }
+
+    // publish the samples
+    m_audio_total.store(total + n_samples, std::memory_order_release);
+}
+
+void audio_async::view(uint64_t pos, uint64_t total, audio_view & view) const {
+    if (m_audio.empty()) {
+        view = audio_view();
+        return;
+    }
+
+    const size_t n_samples = total - pos;
+    const size_t s0        = pos % m_audio.size();
+    const size_t n0        = std::min(n_samples, m_audio.size() - s0);
+
+    view.pos     = pos;
+    view.data[0] = m_audio.data() + s0;
+    view.size[0] = n0;
+    view.data[1] = m_audio.data();
+    view.size[1] = n_samples - n0;
+}
+
+void audio_async::peek(int ms, audio_view & result) const {
+    if (ms <= 0) {
+        ms = m_len_ms;
+    }
+
+    const uint64_t total = m_audio_total.load(std::memory_order_acquire);
+
+    size_t n_samples = (m_sample_rate * ms) / 1000;
+    n_samples = std::min(n_samples, (size_t) std::min<uint64_t>(total - m_audio_clear, m_audio_len));
+
+    view(total - n_samples, total, result);
+}
+
+void audio_async::peek_new(uint64_t & pos, audio_view & result) const {
+    const uint64_t total = m_audio_total.load(std::memory_order_acquire);
+    const uint64_t first = total - std::min<uint64_t>(total - m_audio_clear, m_audio_len);
+
+    pos = std::min(std::max(pos, first), total);
+
+    view(pos, total, result);
+
+    pos = total;
+}
+
+bool audio_async::valid(const audio_view & view) const {
+    // the callback writes at most len_ms ahead of the published total
+    return view.pos + m_audio.size() >= m_audio_total.load(std::memory_order_acquire) + m_audio_len;
+}
+
+static void copy_view(const audio_view & view, std::vector<float> & result) {
+    result.resize(view.n_samples());
+
+    if (view.size[0] > 0) {
+        memcpy(result.data(), view.data[0], view.size[0] * sizeof(float));
+    }
+    if (view.size[1] > 0) {
+        memcpy(result.data() + view.size[0], view.data[1], view.size[1] * sizeof(float));
     }
 }
 
@@ -178,36 +235,32 @@ void audio_async::get(int ms, std::vector<float> & result) {
         return;
     }
 
-    result.clear();
-
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-
-        if (ms <= 0) {
-            ms = m_len_ms;
-        }
-
-        size_t n_samples = (m_sample_rate * ms) / 1000;
-        if (n_samples > m_audio_len) {
-            n_samples = m_audio_len;
-        }
+    audio_view v;
+    do {
+        peek(ms, v);
+        copy_view(v, result);
+    } while (!valid(v));
+}
 
-        result.resize(n_samples);
+void audio_async::get_new(uint64_t & pos, std::vector<float> & result) {
+    if (!m_dev_id_in) {
+        fprintf(stderr, "%s: no audio device to get audio from!\n", __func__);
+        return;
+    }
 
-        int s0 = m_audio_pos - n_samples;
-        if (s0 < 0) {
-            s0 += m_audio.size();
-        }
+    if (!m_running) {
+        fprintf(stderr, "%s: not running!\n", __func__);
+        return;
+    }
 
-        if (s0 + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - s0;
+    const uint64_t pos0 = pos;
 
-            memcpy(result.data(), &m_audio[s0], n0 * sizeof(float));
-            memcpy(&result[n0], &m_audio[0], (n_samples - n0) * sizeof(float));
-        } else {
-            memcpy(result.data(), &m_audio[s0], n_samples * sizeof(float));
-        }
-    }
+    audio_view v;
+    do {
+        pos = pos0;
+        peek_new(pos, v);
+        copy_view(v, result);
+    } while (!valid(v));
 }
 
 bool sdl_poll_events() {
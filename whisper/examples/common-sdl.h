@@ -6,12 +6,24 @@
 #include <atomic>
 #include <cstdint>
 #include <vector>
-#include <mutex>
 
 //
 // SDL Audio capture
 //
 
+// samples of the capture buffer, read in place
+// the samples are in two parts when they wrap around the end of the buffer
+struct audio_view {
+    const float * data[2] = { nullptr, nullptr };
+    size_t        size[2] = { 0, 0 };
+
+    uint64_t pos = 0; // stream position of data[0][0]
+
+    size_t n_samples() const { return size[0] + size[1]; }
+};
+
+// the SDL callback is the single producer and the thread that calls get(), get_new() and clear() is the single
+// consumer of a lock-free ring buffer, so the audio thread never waits for the consumer
 class audio_async {
 public:
     audio_async(int len_ms);
@@ -31,18 +43,34 @@ public:
     // get audio data from the circular buffer
     void get(int ms, std::vector<float> & audio);
 
+    // get the audio captured since the previous call, pos is the caller's read position (start with 0)
+    // audio that has already left the circular buffer is skipped
+    void get_new(uint64_t & pos, std::vector<float> & audio);
+
+    // same as get() and get_new() without copying
+    // a view stays valid until another len_ms of audio has been captured, see valid()
+    void peek(int ms, audio_view & view) const;
+    void peek_new(uint64_t & pos, audio_view & view) const;
+
+    // false if the capture has overwritten some of the samples of the view
+    bool valid(const audio_view & view) const;
+
 private:
+    void view(uint64_t pos, uint64_t total, audio_view & view) const;
+
     SDL_AudioDeviceID m_dev_id_in = 0;
 
     int m_len_ms = 0;
     int m_sample_rate = 0;
 
     std::atomic_bool m_running;
-    std::mutex       m_mutex;
 
+    // twice len_ms, the second half keeps the samples of a view intact while the callback writes new ones
     std::vector<float> m_audio;
-    size_t             m_audio_pos = 0;
-    size_t             m_audio_len = 0;
+    size_t             m_audio_len = 0; // samples in len_ms
+
+    std::atomic<uint64_t> m_audio_total; // samples captured since init, written by the callback only
+    uint64_t              m_audio_clear = 0; // m_audio_total at the last clear(), consumer only
 };
 
 // Return false if need to quit
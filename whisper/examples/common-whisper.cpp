@@ -31,6 +31,7 @@
 #include <io.h>
 #endif
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 
@@ -39,100 +40,342 @@
 extern bool ffmpeg_decode_audio(const std::string & ifname, std::vector<uint8_t> & wav_data);
 #endif
 
-bool read_audio_data(const std::string & fname, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
-    std::vector<uint8_t> audio_data; // used for pipe input from stdin or ffmpeg decoding output
+// stdin as a miniaudio data source. The decoder rewinds while it detects the format, so the
+// bytes read until then are kept; once it is initialized they are streamed
+struct audio_stdin_source {
+    std::vector<uint8_t> head;
+    size_t pos  = 0;    // read position in head
+    bool   keep = true; // until the decoder is initialized
+
+    size_t read(uint8_t * dst, size_t n) {
+        size_t n_read = 0;
+        if (pos < head.size()) {
+            n_read = std::min(n, head.size() - pos);
+            memcpy(dst, head.data() + pos, n_read);
+            pos += n_read;
+        }
+        if (n_read < n) {
+            const size_t n_new = fread(dst + n_read, 1, n - n_read, stdin);
+            if (keep) {
+                head.insert(head.end(), dst + n_read, dst + n_read + n_new);
+                pos += n_new;
+            }
+            n_read += n_new;
+        }
+        if (!keep && !head.empty() && pos == head.size()) {
+            head.clear();
+            head.shrink_to_fit();
+            pos = 0;
+        }
+        return n_read;
+    }
+};
 
-    ma_result result;
-    ma_decoder_config decoder_config;
+static ma_result audio_stdin_read(ma_decoder * decoder, void * buf, size_t n, size_t * n_read) {
+    auto * src = (audio_stdin_source *) decoder->pUserData;
+    *n_read = src->read((uint8_t *) buf, n);
+    return *n_read == 0 && n > 0 ? MA_AT_END : MA_SUCCESS;
+}
+
+// back within the kept bytes, or forward by reading
+static ma_result audio_stdin_seek(ma_decoder * decoder, ma_int64 offset, ma_seek_origin origin) {
+    auto * src = (audio_stdin_source *) decoder->pUserData;
+    if (origin == ma_seek_origin_start && src->keep) {
+        offset -= (ma_int64) src->pos;
+        origin  = ma_seek_origin_current;
+    }
+    if (origin != ma_seek_origin_current) {
+        return MA_BAD_SEEK;
+    }
+    if (offset < 0) {
+        if ((size_t) -offset > src->pos) {
+            return MA_BAD_SEEK;
+        }
+        src->pos -= (size_t) -offset;
+        return MA_SUCCESS;
+    }
+    uint8_t buf[4096];
+    while (offset > 0) {
+        const size_t n = src->read(buf, (size_t) std::min<ma_int64>(offset, sizeof(buf)));
+        if (n == 0) {
+            return MA_BAD_SEEK;
+        }
+        offset -= n;
+    }
+    return MA_SUCCESS;
+}
+
+struct audio_decoder_impl {
     ma_decoder decoder;
 
-    decoder_config = ma_decoder_config_init(ma_format_f32, stereo ? 2 : 1, WHISPER_SAMPLE_RATE);
+    bool stereo   = false;
+    bool is_stdin = false;
 
-    if (fname == "-") {
-		#ifdef _WIN32
-		_setmode(_fileno(stdin), _O_BINARY);
-		#endif
+    audio_stdin_source   src;
+    std::vector<uint8_t> data; // audio decoded from memory: the ffmpeg output or fname used as a buffer
+    std::vector<float>   buf;
+};
 
-		uint8_t buf[1024];
-		while (true)
-		{
-			const size_t n = fread(buf, 1, sizeof(buf), stdin);
-			if (n == 0) {
-				break;
-			}
-			audio_data.insert(audio_data.end(), buf, buf + n);
-		}
+audio_decoder::audio_decoder() = default;
 
-		if ((result = ma_decoder_init_memory(audio_data.data(), audio_data.size(), &decoder_config, &decoder)) != MA_SUCCESS) {
+audio_decoder::~audio_decoder() {
+    close();
+}
 
-			fprintf(stderr, "Error: failed to open audio data from stdin (%s)\n", ma_result_description(result));
+bool audio_decoder::open(const std::string & fname, bool stereo) {
+    close();
 
-			return false;
-		}
+    auto d = std::make_unique<audio_decoder_impl>();
+    d->stereo = stereo;
 
-		fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__, audio_data.size());
-    }
-    else if (((result = ma_decoder_init_file(fname.c_str(), &decoder_config, &decoder)) != MA_SUCCESS)) {
-#if defined(WHISPER_FFMPEG)
-		if (ffmpeg_decode_audio(fname, audio_data) != 0) {
-			fprintf(stderr, "error: failed to ffmpeg decode '%s'\n", fname.c_str());
+    ma_result result;
+    const ma_decoder_config decoder_config = ma_decoder_config_init(ma_format_f32, stereo ? 2 : 1, WHISPER_SAMPLE_RATE);
 
-			return false;
-		}
+    if (fname == "-") {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        d->is_stdin = true;
+        if ((result = ma_decoder_init(audio_stdin_read, audio_stdin_seek, &d->src, &decoder_config, &d->decoder)) != MA_SUCCESS) {
+            fprintf(stderr, "error: failed to read audio data from stdin (%s)\n", ma_result_description(result));
 
-		if ((result = ma_decoder_init_memory(audio_data.data(), audio_data.size(), &decoder_config, &decoder)) != MA_SUCCESS) {
-			fprintf(stderr, "error: failed to read audio data as wav (%s)\n", ma_result_description(result));
+            return false;
+        }
+        d->src.keep = false;
+    } else if ((result = ma_decoder_init_file(fname.c_str(), &decoder_config, &d->decoder)) != MA_SUCCESS) {
+#if defined(WHISPER_FFMPEG)
+        // the whole file is transcoded to a WAV in memory first
+        if (ffmpeg_decode_audio(fname, d->data) != 0) {
+            fprintf(stderr, "error: failed to ffmpeg decode '%s'\n", fname.c_str());
 
-			return false;
-		}
+            return false;
+        }
 #else
-		if ((result = ma_decoder_init_memory(fname.c_str(), fname.size(), &decoder_config, &decoder)) != MA_SUCCESS) {
-			fprintf(stderr, "error: failed to read audio data as wav (%s)\n", ma_result_description(result));
-
-			return false;
-		}
+        d->data.assign(fname.begin(), fname.end());
 #endif
+        if ((result = ma_decoder_init_memory(d->data.data(), d->data.size(), &decoder_config, &d->decoder)) != MA_SUCCESS) {
+            fprintf(stderr, "error: failed to read audio data (%s)\n", ma_result_description(result));
+
+            return false;
+        }
     }
 
-    ma_uint64 frame_count;
-    ma_uint64 frames_read;
+    impl = std::move(d);
+
+    return true;
+}
 
-    if ((result = ma_decoder_get_length_in_pcm_frames(&decoder, &frame_count)) != MA_SUCCESS) {
-		fprintf(stderr, "error: failed to retrieve the length of the audio data (%s)\n", ma_result_description(result));
+bool audio_decoder::open_memory(const void * data, size_t size, bool stereo) {
+    close();
 
-		return false;
+    auto d = std::make_unique<audio_decoder_impl>();
+    d->stereo = stereo;
+
+    ma_result result;
+    const ma_decoder_config decoder_config = ma_decoder_config_init(ma_format_f32, stereo ? 2 : 1, WHISPER_SAMPLE_RATE);
+
+    if ((result = ma_decoder_init_memory(data, size, &decoder_config, &d->decoder)) != MA_SUCCESS) {
+        fprintf(stderr, "error: failed to read audio data (%s)\n", ma_result_description(result));
+
+        return false;
     }
 
-    pcmf32.resize(stereo ? frame_count*2 : frame_count);
+    impl = std::move(d);
 
-    if ((result = ma_decoder_read_pcm_frames(&decoder, pcmf32.data(), frame_count, &frames_read)) != MA_SUCCESS) {
-		fprintf(stderr, "error: failed to read the frames of the audio data (%s)\n", ma_result_description(result));
+    return true;
+}
 
-		return false;
+void audio_decoder::close() {
+    if (impl) {
+        ma_decoder_uninit(&impl->decoder);
+        impl.reset();
     }
+}
+
+int64_t audio_decoder::read(int64_t n_samples, std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s) {
+    if (!impl) {
+        return -1;
+    }
+
+    const bool      stereo     = impl->stereo;
+    const ma_uint32 n_channels = stereo ? 2 : 1;
 
     if (stereo) {
-        std::vector<float> stereo_data = pcmf32;
-        pcmf32.resize(frame_count);
+        pcmf32s.resize(2);
+    }
+
+    auto & buf = impl->buf;
+    buf.resize(4096*n_channels);
+
+    int64_t n_read = 0;
+    while (n_read < n_samples) {
+        const ma_uint64 n = std::min<int64_t>(4096, n_samples - n_read);
+
+        ma_uint64 frames_read = 0;
+        const ma_result result = ma_decoder_read_pcm_frames(&impl->decoder, buf.data(), n, &frames_read);
+        if (result != MA_SUCCESS && result != MA_AT_END) {
+            fprintf(stderr, "error: failed to read the frames of the audio data (%s)\n", ma_result_description(result));
+
+            return -1;
+        }
 
-        for (uint64_t i = 0; i < frame_count; i++) {
-            pcmf32[i] = (stereo_data[2*i] + stereo_data[2*i + 1]);
+        if (stereo) {
+            for (ma_uint64 i = 0; i < frames_read; i++) {
+                pcmf32.push_back(buf[2*i] + buf[2*i + 1]);
+                pcmf32s[0].push_back(buf[2*i]);
+                pcmf32s[1].push_back(buf[2*i + 1]);
+            }
+        } else {
+            pcmf32.insert(pcmf32.end(), buf.begin(), buf.begin() + frames_read);
         }
 
+        n_read += frames_read;
+
+        if (result == MA_AT_END || frames_read == 0) {
+            break;
+        }
+    }
+
+    return n_read;
+}
+
+int64_t audio_decoder::length() const {
+    ma_uint64 frame_count = 0;
+    if (!impl || impl->is_stdin || ma_decoder_get_length_in_pcm_frames(&impl->decoder, &frame_count) != MA_SUCCESS) {
+        return 0;
+    }
+    return frame_count;
+}
+
+audio_chunk_reader::audio_chunk_reader(audio_decoder & decoder, int64_t n_chunk, bool stereo) :
+        decoder(decoder), n_chunk(std::max<int64_t>(n_chunk, 2*WHISPER_SAMPLE_RATE)), stereo(stereo) {
+    fetch();
+}
+
+audio_chunk_reader::~audio_chunk_reader() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void audio_chunk_reader::fetch() {
+    pending.clear();
+    for (auto & channel : pending_s) {
+        channel.clear();
+    }
+    worker = std::thread([this]() {
+        n_pending = decoder.read(n_chunk, pending, pending_s);
+    });
+}
+
+bool audio_chunk_reader::next(std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s, int64_t & offset) {
+    if (done) {
+        return false;
+    }
+
+    worker.join();
+    if (n_pending < 0) {
+        error = true;
+        done  = true;
+        return false;
+    }
+
+    const bool last = n_pending < n_chunk;
+
+    pcmf32 = std::move(carry);
+    pcmf32.insert(pcmf32.end(), pending.begin(), pending.end());
+    carry.clear();
+    if (stereo) {
         pcmf32s.resize(2);
-        pcmf32s[0].resize(frame_count);
-        pcmf32s[1].resize(frame_count);
-        for (uint64_t i = 0; i < frame_count; i++) {
-            pcmf32s[0][i] = stereo_data[2*i];
-            pcmf32s[1][i] = stereo_data[2*i + 1];
+        carry_s.resize(2);
+        for (int c = 0; c < 2; ++c) {
+            pcmf32s[c] = std::move(carry_s[c]);
+            pcmf32s[c].insert(pcmf32s[c].end(), pending_s[c].begin(), pending_s[c].end());
+            carry_s[c].clear();
+        }
+    }
+
+    if (last) {
+        done = true;
+    } else {
+        // the quietest 100 ms of the last second, in steps of 10 ms
+        const int64_t n     = pcmf32.size();
+        const int64_t n_win = WHISPER_SAMPLE_RATE/10;
+
+        int64_t cut  = n;
+        double  best = -1.0;
+        for (int64_t i = std::max<int64_t>(0, n - WHISPER_SAMPLE_RATE); i + n_win <= n; i += n_win/10) {
+            double energy = 0.0;
+            for (int64_t j = i; j < i + n_win; ++j) {
+                energy += pcmf32[j]*pcmf32[j];
+            }
+            if (best < 0.0 || energy < best) {
+                best = energy;
+                cut  = i + n_win/2;
+            }
+        }
+
+        carry.assign(pcmf32.begin() + cut, pcmf32.end());
+        pcmf32.resize(cut);
+        if (stereo) {
+            for (int c = 0; c < 2; ++c) {
+                carry_s[c].assign(pcmf32s[c].begin() + cut, pcmf32s[c].end());
+                pcmf32s[c].resize(cut);
+            }
         }
+
+        fetch();
     }
 
-    ma_decoder_uninit(&decoder);
+    offset       = offset_next;
+    offset_next += pcmf32.size();
+
+    return !pcmf32.empty();
+}
+
+// decodes the rest of the audio of decoder
+static bool read_audio_all(audio_decoder & decoder, std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s, bool stereo) {
+    const int64_t n = decoder.length();
+
+    pcmf32.clear();
+    pcmf32.reserve(n);
+    if (stereo) {
+        pcmf32s.assign(2, std::vector<float>());
+        pcmf32s[0].reserve(n);
+        pcmf32s[1].reserve(n);
+    }
+
+    while (true) {
+        const int64_t n_read = decoder.read(1 << 16, pcmf32, pcmf32s);
+        if (n_read < 0) {
+            return false;
+        }
+        if (n_read == 0) {
+            break;
+        }
+    }
 
     return true;
 }
 
+bool read_audio_data_from_memory(const void * data, size_t size, std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s, bool stereo) {
+    audio_decoder decoder;
+    if (!decoder.open_memory(data, size, stereo)) {
+        return false;
+    }
+
+    return read_audio_all(decoder, pcmf32, pcmf32s, stereo);
+}
+
+bool read_audio_data(const std::string & fname, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
+    audio_decoder decoder;
+    if (!decoder.open(fname, stereo)) {
+        return false;
+    }
+
+    return read_audio_all(decoder, pcmf32, pcmf32s, stereo);
+}
+
 //  500 -> 00:05.000
 // 6000 -> 01:00.000
 std::string to_timestamp(int64_t t, bool comma) {
@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <memory>
+#include <thread>
 
 // Read WAV audio file and store the PCM data into pcmf32
 // fname can be a buffer of WAV data instead of a filename
@@ -14,6 +16,76 @@ bool read_audio_data(
         std::vector<std::vector<float>> & pcmf32s,
         bool stereo);
 
+// Same as read_audio_data() for a buffer of encoded audio (WAV, MP3, FLAC or Ogg Vorbis),
+// decoded and resampled to 16 kHz float without touching the file system
+bool read_audio_data_from_memory(
+        const void * data,
+        size_t size,
+        std::vector<float> & pcmf32,
+        std::vector<std::vector<float>> & pcmf32s,
+        bool stereo);
+
+// Pull-based decoder of an audio file, stdin ("-") or a buffer of encoded audio, producing
+// 16 kHz float PCM a piece at a time so that long inputs need not be held in memory.
+// stdin is streamed too: only the bytes read while the format is detected are kept.
+struct audio_decoder_impl;
+
+class audio_decoder {
+public:
+    audio_decoder();
+    ~audio_decoder();
+
+    // fname as in read_audio_data()
+    bool open(const std::string & fname, bool stereo);
+    // data must stay valid until close()
+    bool open_memory(const void * data, size_t size, bool stereo);
+    void close();
+
+    // decodes up to n_samples more samples and appends them to pcmf32 (and the 2 channels to
+    // pcmf32s if stereo), returns the number of samples, 0 at the end of the audio, -1 on error
+    int64_t read(int64_t n_samples, std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s);
+
+    // total samples if the container tells, 0 otherwise (and always for stdin)
+    int64_t length() const;
+
+private:
+    std::unique_ptr<audio_decoder_impl> impl;
+};
+
+// The audio of a decoder in chunks of about n_chunk samples for chunked transcription.
+// The next chunk is decoded in a background thread while the caller transcribes the
+// current one, and each chunk ends at the quietest 100 ms of its last second, so a
+// word is rarely cut in two; the rest of that second starts the next chunk.
+class audio_chunk_reader {
+public:
+    audio_chunk_reader(audio_decoder & decoder, int64_t n_chunk, bool stereo);
+    ~audio_chunk_reader();
+
+    // the next chunk and the sample of the audio it starts at; false at the end or on error
+    bool next(std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s, int64_t & offset);
+
+    bool failed() const { return error; }
+
+private:
+    void fetch();
+
+    audio_decoder & decoder;
+    const int64_t   n_chunk;
+    const bool      stereo;
+
+    std::thread worker; // decodes into pending
+    int64_t     n_pending = 0;
+
+    std::vector<float>              pending;
+    std::vector<std::vector<float>> pending_s;
+    std::vector<float>              carry; // the tail of the previous chunk after its cut
+    std::vector<std::vector<float>> carry_s;
+
+    int64_t offset_next = 0;
+    bool    done  = false;
+    bool    error = false;
+};
+
 // convert timestamp to string, 6000 -> 01:00.000
 std::string to_timestamp(int64_t t, bool comma = false);
 
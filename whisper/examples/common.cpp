@@ -645,6 +645,162 @@ bool vad_simple(std::vector<float> & pcmf32, int sample_rate, int last_ms, float
     return true;
 }
 
+vad_energy::vad_energy(int sample_rate, int window_ms, int last_ms, float vad_thold, float freq_thold, float vad_thold_on, float zcr_thold)
+    : vad_thold(vad_thold), vad_thold_on(vad_thold_on > 0.0f ? vad_thold_on : vad_thold), zcr_thold(zcr_thold) {
+    n_block  = std::max(1, sample_rate/100);
+    n_window = std::max(2, window_ms/10);
+    n_last   = std::max(1, std::min(n_window - 1, last_ms/10));
+
+    alpha = 0.0f;
+    if (freq_thold > 0.0f) {
+        const float rc = 1.0f / (2.0f * M_PI * freq_thold);
+        const float dt = 1.0f / sample_rate;
+        alpha = dt / (rc + dt);
+    }
+
+    reset();
+}
+
+void vad_energy::reset() {
+    blocks.assign(n_window, block());
+    head    = 0;
+    n_total = 0;
+    x_prev  = 0.0f;
+    y_prev  = 0.0f;
+    armed   = true;
+}
+
+void vad_energy::push(const float * samples, size_t n_samples) {
+    if (n_samples == 0) {
+        return;
+    }
+
+    const float * x = samples;
+
+    if (alpha > 0.0f) {
+        // the filter is a recurrence, it runs sample by sample with the state of the previous call
+        filtered.resize(n_samples);
+
+        // same start as high_pass_filter(): the first sample passes unchanged
+        size_t i0 = 0;
+        if (n_total == 0) {
+            x_prev = y_prev = filtered[0] = samples[0];
+            i0 = 1;
+        }
+
+        float xp = x_prev;
+        float y  = y_prev;
+
+        for (size_t i = i0; i < n_samples; i++) {
+            y = alpha * (y + samples[i] - xp);
+            xp = samples[i];
+            filtered[i] = y;
+        }
+
+        x_prev = xp;
+        y_prev = y;
+
+        x = filtered.data();
+    }
+
+    // the last (filtered) sample of the previous call, for the zero crossing at the boundary
+    float x_last = n_total == 0 ? x[0] : out_prev;
+
+    size_t i = 0;
+    while (i < n_samples) {
+        block & b = blocks[head];
+
+        const size_t n = std::min(n_samples - i, (size_t) (n_block - b.n));
+
+        // branch-free so that the compiler can vectorize them
+        float   energy = 0.0f;
+        int32_t n_zc   = (x_last >= 0.0f) != (x[i] >= 0.0f);
+        for (size_t j = 0; j < n; j++) {
+            energy += fabsf(x[i + j]);
+        }
+        for (size_t j = 1; j < n; j++) {
+            n_zc += (x[i + j - 1] >= 0.0f) != (x[i + j] >= 0.0f);
+        }
+
+        b.energy += energy;
+        b.n_zc   += n_zc;
+        b.n      += n;
+
+        x_last = x[i + n - 1];
+        i += n;
+
+        if (b.n == n_block) {
+            head = (head + 1) % n_window;
+            blocks[head] = block();
+        }
+    }
+
+    out_prev = x_last;
+    n_total += n_samples;
+}
+
+// the sums over the last n_blocks blocks, the current partial block included
+void vad_energy::sum_blocks(int n_blocks, float & energy, int32_t & n_zc, int32_t & n) const {
+    energy = 0.0f;
+    n_zc   = 0;
+    n      = 0;
+
+    for (int k = 0; k < n_blocks; k++) {
+        const block & b = blocks[(head - k + n_window) % n_window];
+
+        energy += b.energy;
+        n_zc   += b.n_zc;
+        n      += b.n;
+    }
+}
+
+float vad_energy::energy_all() const {
+    float energy; int32_t n_zc, n;
+    sum_blocks(n_window, energy, n_zc, n);
+    return n > 0 ? energy/n : 0.0f;
+}
+
+float vad_energy::energy_last() const {
+    float energy; int32_t n_zc, n;
+    sum_blocks(n_last + 1, energy, n_zc, n);
+    return n > 0 ? energy/n : 0.0f;
+}
+
+float vad_energy::zcr_last() const {
+    float energy; int32_t n_zc, n;
+    sum_blocks(n_last + 1, energy, n_zc, n);
+    return n > 0 ? float(n_zc)/n : 0.0f;
+}
+
+bool vad_energy::speech_ended(bool verbose) {
+    // not enough samples - assume no speech
+    if (n_total <= (int64_t) n_last*n_block) {
+        return false;
+    }
+
+    const float e_all  = energy_all();
+    const float e_last = energy_last();
+    const float zcr    = zcr_last();
+
+    if (verbose) {
+        fprintf(stderr, "%s: energy_all: %f, energy_last: %f, zcr_last: %f, vad_thold: %f\n", __func__, e_all, e_last, zcr, vad_thold);
+    }
+
+    if (e_last > vad_thold_on*e_all) {
+        armed = true;
+    }
+
+    const bool quiet = e_last <= vad_thold*e_all && (zcr_thold <= 0.0f || zcr < zcr_thold);
+
+    if (!armed || !quiet) {
+        return false;
+    }
+
+    armed = false;
+
+    return true;
+}
+
 float similarity(const std::string & s0, const std::string & s1) {
     const size_t len0 = s0.size() + 1;
     const size_t len1 = s1.size() + 1;
@@ -248,6 +248,71 @@ bool vad_simple(
         float freq_thold,
         bool  verbose);
 
+// Incremental version of vad_simple(): detects the end of speech in a stream of audio
+// The high-pass filter state and the energy and zero crossings of 10 ms blocks of the last window_ms are kept
+// across calls, so push() only processes the samples captured since the previous call and nothing is rescanned
+//
+//   window_ms    - the audio the average energy is taken over (the whole buffer in vad_simple)
+//   last_ms      - the trailing part that must be quiet
+//   vad_thold    - end of speech: energy of last_ms <= vad_thold * energy of window_ms
+//   freq_thold   - high-pass cutoff in Hz, 0 - no filter
+//   vad_thold_on - hysteresis: after a detection, the ratio has to rise above it before the next one (0 - vad_thold)
+//   zcr_thold    - the last part is quiet only with fewer zero crossings per sample, so that unvoiced sounds
+//                  are not taken for silence (0 - ignore the zero crossings)
+class vad_energy {
+public:
+    vad_energy(
+            int   sample_rate,
+            int   window_ms,
+            int   last_ms,
+            float vad_thold,
+            float freq_thold,
+            float vad_thold_on = 0.0f,
+            float zcr_thold    = 0.0f);
+
+    // filter and accumulate new samples, the input is not modified
+    void push(const float * samples, size_t n_samples);
+    void push(const std::vector<float> & samples) { push(samples.data(), samples.size()); }
+
+    // true when the end of speech is detected, same condition as vad_simple() over the last window_ms
+    bool speech_ended(bool verbose = false);
+
+    // forget all audio, e.g. after audio_async::clear()
+    void reset();
+
+    float energy_all()  const;
+    float energy_last() const;
+    float zcr_last()    const;
+
+private:
+    struct block {
+        float   energy = 0.0f; // sum of |x|
+        int32_t n_zc   = 0;    // zero crossings
+        int32_t n      = 0;    // samples
+    };
+
+    void sum_blocks(int n_blocks, float & energy, int32_t & n_zc, int32_t & n) const;
+
+    int   n_block;      // samples per block
+    int   n_window;     // blocks in window_ms
+    int   n_last;       // blocks in last_ms
+    float alpha;        // high-pass filter coefficient, 0 - no filter
+    float vad_thold;
+    float vad_thold_on;
+    float zcr_thold;
+
+    std::vector<block> blocks; // ring buffer of the last n_window blocks, the current one is partial
+    int     head     = 0;      // current block
+    int64_t n_total  = 0;      // samples pushed since reset()
+
+    float x_prev   = 0.0f; // high-pass filter state
+    float y_prev   = 0.0f;
+    float out_prev = 0.0f; // last filtered sample, for the zero crossings
+    bool  armed    = true;
+
+    std::vector<float> filtered;
+};
+
 // compute similarity between two strings using Levenshtein distance
 float similarity(const std::string & s0, const std::string & s1);
 
@@ -1,9 +1,14 @@
 #include "ggml.h"
 #include "ggml-backend.h"
+#include "ggml-cpp.h"
+#include "gguf.h"
 
+#include "whisper.h"
 #include "common.h"
 #include "common-ggml.h"
+#include "common-whisper.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
@@ -11,6 +16,7 @@
 #include <fstream>
 #include <map>
 #include <string>
+#include <thread>
 #include <vector>
 #include <regex>
 
@@ -36,8 +42,450 @@ struct whisper_filters {
     std::vector<float> data;
 };
 
+struct quantize_params {
+    int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+
+    float max_error = 0.0f;
+
+    std::vector<std::pair<std::string, ggml_type>> tensor_types;
+
+    std::vector<std::string> fname_calib;
+
+    std::string fname_imatrix;
+    std::string fname_imatrix_out;
+
+    std::string fname_inp;
+    std::string fname_out;
+    std::string type;
+};
+
+static void quantize_print_usage(int /*argc*/, char ** argv, const quantize_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options] model-f32.bin model-quant.bin type\n", argv[0]);
+    fprintf(stderr, "       %s [options] model.bin model-quant.gguf [type]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "an output name ending in .gguf writes a GGUF model; without a type the input is only converted\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,        --help              [default] show this help message and exit\n");
+    fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to quantize with\n",          params.n_threads);
+    fprintf(stderr, "  -tt R=T,   --tensor-type R=T   [%-7s] tensors whose name matches regex R get type T, e.g.\n", "");
+    fprintf(stderr, "                                           'decoder\\..*=q8_0' (repeatable, first match wins)\n");
+    fprintf(stderr, "  -c FNAME,  --calibrate FNAME   [%-7s] run the input model on this audio and collect an importance\n", "");
+    fprintf(stderr, "                                           matrix from the activations (repeatable)\n");
+    fprintf(stderr, "  -im FNAME, --imatrix FNAME     [%-7s] load an importance matrix saved with --imatrix-out\n", "");
+    fprintf(stderr, "  -imo FNAME,--imatrix-out FNAME [%-7s] save the importance matrix collected by --calibrate\n", "");
+    fprintf(stderr, "  -me E,     --max-error E       [%-7.0e] keep tensors whose relative quantization error exceeds E\n", params.max_error);
+    fprintf(stderr, "                                           in Q8_0 or F16 (0 - off)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "types:\n");
+    ggml_print_ftypes(stderr);
+    fprintf(stderr, "\n");
+}
+
+static bool quantize_is_gguf(const std::string & fname) {
+    return fname.size() >= 5 && fname.compare(fname.size() - 5, 5, ".gguf") == 0;
+}
+
+static bool quantize_params_parse(int argc, char ** argv, quantize_params & params) {
+    std::vector<std::string> positional;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            return false;
+        }
+
+        if (arg[0] != '-' || arg.size() == 1) {
+            positional.push_back(arg);
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for argument: %s\n", arg.c_str());
+            return false;
+        }
+
+        if      (arg == "-t"   || arg == "--threads")     { params.n_threads = std::stoi(argv[++i]); }
+        else if (arg == "-me"  || arg == "--max-error")   { params.max_error = std::stof(argv[++i]); }
+        else if (arg == "-c"   || arg == "--calibrate")   { params.fname_calib.emplace_back(argv[++i]); }
+        else if (arg == "-im"  || arg == "--imatrix")     { params.fname_imatrix     = argv[++i]; }
+        else if (arg == "-imo" || arg == "--imatrix-out") { params.fname_imatrix_out = argv[++i]; }
+        else if (arg == "-tt"  || arg == "--tensor-type") {
+            const std::string value = argv[++i];
+            const size_t pos = value.rfind('=');
+            const ggml_type type = pos == std::string::npos ? GGML_TYPE_COUNT : ggml_parse_type(value.substr(pos + 1).c_str());
+            if (type == GGML_TYPE_COUNT) {
+                fprintf(stderr, "error: invalid tensor type override '%s', expected REGEX=TYPE\n", value.c_str());
+                return false;
+            }
+            params.tensor_types.emplace_back(value.substr(0, pos), type);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    // without a type, a GGUF output keeps the types of the input
+    if (positional.size() != 3 && !(positional.size() == 2 && quantize_is_gguf(positional[1]))) {
+        return false;
+    }
+
+    params.fname_inp = positional[0];
+    params.fname_out = positional[1];
+    params.type      = positional.size() == 3 ? positional[2] : "";
+
+    return true;
+}
+
+// importance matrix: per weight, the sum of the squared input activations of each column and the number of rows seen
+struct imatrix_entry {
+    std::vector<float> sum;
+    int64_t n_rows = 0;
+};
+
+using imatrix_map = std::map<std::string, imatrix_entry>;
+
+// picks the activations of the matrix multiplications with model weights out of the computed graphs
+static bool imatrix_collect(struct ggml_tensor * t, bool ask, void * user_data) {
+    const ggml_tensor * w = t->src[0];
+    const ggml_tensor * x = t->src[1];
+
+    const bool wanted = t->op == GGML_OP_MUL_MAT && w && x && ggml_n_dims(w) == 2 &&
+        (strncmp(w->name, "encoder.", 8) == 0 || strncmp(w->name, "decoder.", 8) == 0) &&
+        x->type == GGML_TYPE_F32 && ggml_is_contiguous(x) && x->ne[0] == w->ne[0];
+
+    if (ask) {
+        return wanted;
+    }
+
+    if (!wanted) {
+        return true;
+    }
+
+    auto & imatrix = *(imatrix_map *) user_data;
+    auto & entry = imatrix[w->name];
+
+    std::vector<float> data(ggml_nelements(x));
+    ggml_backend_tensor_get(x, data.data(), 0, ggml_nbytes(x));
+
+    const int64_t n_cols = x->ne[0];
+    const int64_t n_rows = ggml_nrows(x);
+
+    entry.sum.resize(n_cols, 0.0f);
+    for (int64_t r = 0; r < n_rows; ++r) {
+        const float * row = data.data() + r*n_cols;
+        for (int64_t j = 0; j < n_cols; ++j) {
+            entry.sum[j] += row[j]*row[j];
+        }
+    }
+    entry.n_rows += n_rows;
+
+    return true;
+}
+
+static bool imatrix_calibrate(const quantize_params & params, imatrix_map & imatrix) {
+    whisper_context_params cparams = whisper_context_default_params();
+    cparams.cb_eval           = imatrix_collect;
+    cparams.cb_eval_user_data = &imatrix;
+
+    whisper_context * ctx = whisper_init_from_file_with_params(params.fname_inp.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, params.fname_inp.c_str());
+        return false;
+    }
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.n_threads      = params.n_threads;
+    wparams.print_progress = false;
+    wparams.language       = "auto";
+
+    bool ok = true;
+
+    for (const auto & fname : params.fname_calib) {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+
+        if (!read_audio_data(fname, pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "%s: failed to read audio '%s'\n", __func__, fname.c_str());
+            ok = false;
+            break;
+        }
+
+        printf("%s: calibrating on '%s' (%.1f s)\n", __func__, fname.c_str(), pcmf32.size()/float(WHISPER_SAMPLE_RATE));
+
+        if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            fprintf(stderr, "%s: failed to process '%s'\n", __func__, fname.c_str());
+            ok = false;
+            break;
+        }
+    }
+
+    whisper_free(ctx);
+
+    printf("%s: collected activations for %zu tensors\n", __func__, imatrix.size());
+
+    return ok;
+}
+
+// file layout: n_entries, then per entry: name length, name, n_rows, n_cols, n_cols x float (sum of squares)
+static bool imatrix_save(const std::string & fname, const imatrix_map & imatrix) {
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const int32_t n_entries = imatrix.size();
+    fout.write((const char *) &n_entries, sizeof(n_entries));
+
+    for (const auto & kv : imatrix) {
+        const int32_t len    = kv.first.size();
+        const int32_t n_cols = kv.second.sum.size();
+        fout.write((const char *) &len, sizeof(len));
+        fout.write(kv.first.data(), len);
+        fout.write((const char *) &kv.second.n_rows, sizeof(kv.second.n_rows));
+        fout.write((const char *) &n_cols, sizeof(n_cols));
+        fout.write((const char *) kv.second.sum.data(), n_cols*sizeof(float));
+    }
+
+    return (bool) fout;
+}
+
+static bool imatrix_load(const std::string & fname, imatrix_map & imatrix) {
+    std::ifstream finp(fname, std::ios::binary);
+    if (!finp) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname.c_str());
+        return false;
+    }
+
+    int32_t n_entries = 0;
+    finp.read((char *) &n_entries, sizeof(n_entries));
+
+    for (int32_t i = 0; i < n_entries && finp; ++i) {
+        int32_t len    = 0;
+        int32_t n_cols = 0;
+
+        finp.read((char *) &len, sizeof(len));
+        if (len <= 0 || len > 256) {
+            break;
+        }
+        std::string name(len, 0);
+        finp.read(&name[0], len);
+
+        auto & entry = imatrix[name];
+        int64_t n_rows = 0;
+        finp.read((char *) &n_rows, sizeof(n_rows));
+        finp.read((char *) &n_cols, sizeof(n_cols));
+        if (n_cols <= 0) {
+            break;
+        }
+
+        // entries of several files add up
+        std::vector<float> sum(n_cols);
+        finp.read((char *) sum.data(), n_cols*sizeof(float));
+        entry.sum.resize(n_cols, 0.0f);
+        for (int32_t j = 0; j < n_cols && (size_t) n_cols == entry.sum.size(); ++j) {
+            entry.sum[j] += sum[j];
+        }
+        entry.n_rows += n_rows;
+    }
+
+    if (!finp) {
+        fprintf(stderr, "%s: invalid importance matrix '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    printf("%s: loaded activations for %zu tensors from '%s'\n", __func__, imatrix.size(), fname.c_str());
+
+    return true;
+}
+
+// convert a model in the legacy ggml format to GGUF, with the tensor data aligned for memory mapping
+static bool whisper_model_to_gguf(const std::string & fname_inp, const std::string & fname_out) {
+    printf("%s: converting '%s' to GGUF\n", __func__, fname_inp.c_str());
+
+    auto finp = std::ifstream(fname_inp, std::ios::binary);
+    if (!finp) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    uint32_t magic = 0;
+    finp.read((char *) &magic, sizeof(magic));
+    if (magic != GGML_FILE_MAGIC) {
+        fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    gguf_context_ptr gguf(gguf_init_empty());
+    gguf_context * g = gguf.get();
+
+    gguf_set_val_str(g, "general.architecture", "whisper");
+
+    // hparams
+    {
+        whisper_hparams hparams;
+
+        finp.read((char *) &hparams.n_vocab,       sizeof(hparams.n_vocab));
+        finp.read((char *) &hparams.n_audio_ctx,   sizeof(hparams.n_audio_ctx));
+        finp.read((char *) &hparams.n_audio_state, sizeof(hparams.n_audio_state));
+        finp.read((char *) &hparams.n_audio_head,  sizeof(hparams.n_audio_head));
+        finp.read((char *) &hparams.n_audio_layer, sizeof(hparams.n_audio_layer));
+        finp.read((char *) &hparams.n_text_ctx,    sizeof(hparams.n_text_ctx));
+        finp.read((char *) &hparams.n_text_state,  sizeof(hparams.n_text_state));
+        finp.read((char *) &hparams.n_text_head,   sizeof(hparams.n_text_head));
+        finp.read((char *) &hparams.n_text_layer,  sizeof(hparams.n_text_layer));
+        finp.read((char *) &hparams.n_mels,        sizeof(hparams.n_mels));
+        finp.read((char *) &hparams.ftype,         sizeof(hparams.ftype));
+
+        gguf_set_val_u32(g, "general.file_type",                  hparams.ftype % GGML_QNT_VERSION_FACTOR);
+        gguf_set_val_u32(g, "general.quantization_version",       hparams.ftype / GGML_QNT_VERSION_FACTOR);
+        gguf_set_val_u32(g, "whisper.vocab_size",                 hparams.n_vocab);
+        gguf_set_val_u32(g, "whisper.audio.context_length",       hparams.n_audio_ctx);
+        gguf_set_val_u32(g, "whisper.audio.embedding_length",     hparams.n_audio_state);
+        gguf_set_val_u32(g, "whisper.audio.attention.head_count", hparams.n_audio_head);
+        gguf_set_val_u32(g, "whisper.audio.block_count",          hparams.n_audio_layer);
+        gguf_set_val_u32(g, "whisper.text.context_length",        hparams.n_text_ctx);
+        gguf_set_val_u32(g, "whisper.text.embedding_length",      hparams.n_text_state);
+        gguf_set_val_u32(g, "whisper.text.attention.head_count",  hparams.n_text_head);
+        gguf_set_val_u32(g, "whisper.text.block_count",           hparams.n_text_layer);
+        gguf_set_val_u32(g, "whisper.audio.mel_count",            hparams.n_mels);
+    }
+
+    // mel filters
+    {
+        whisper_filters filters;
+
+        finp.read((char *) &filters.n_mel, sizeof(filters.n_mel));
+        finp.read((char *) &filters.n_fft, sizeof(filters.n_fft));
+
+        filters.data.resize(filters.n_mel * filters.n_fft);
+        finp.read((char *) filters.data.data(), filters.data.size() * sizeof(float));
+
+        gguf_set_val_u32 (g, "whisper.audio.mel_filters.n_fft", filters.n_fft);
+        gguf_set_arr_data(g, "whisper.audio.mel_filters", GGUF_TYPE_FLOAT32, filters.data.data(), filters.data.size());
+    }
+
+    // vocab
+    {
+        int32_t n_vocab = 0;
+        finp.read((char *) &n_vocab, sizeof(n_vocab));
+
+        std::vector<std::string> words(n_vocab);
+        for (auto & word : words) {
+            uint32_t len = 0;
+            finp.read((char *) &len, sizeof(len));
+            word.resize(len);
+            finp.read(&word[0], len);
+        }
+
+        std::vector<const char *> ptrs;
+        for (const auto & word : words) {
+            ptrs.push_back(word.c_str());
+        }
+
+        gguf_set_arr_str(g, "tokenizer.ggml.tokens", ptrs.data(), ptrs.size());
+    }
+
+    if (!finp) {
+        fprintf(stderr, "%s: failed to read the header of '%s'\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    // tensor records: the metadata goes in the GGUF header, the data is copied afterwards
+    struct record {
+        std::string name;
+        ggml_type   type;
+        int64_t     ne[4];
+        int32_t     n_dims;
+        size_t      offs; // of the data in the input
+    };
+
+    std::vector<record> records;
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        finp.read((char *) &n_dims, sizeof(n_dims));
+        finp.read((char *) &length, sizeof(length));
+        finp.read((char *) &ttype,  sizeof(ttype));
+
+        if (finp.eof()) {
+            break;
+        }
+
+        record r = { "", (ggml_type) ttype, { 1, 1, 1, 1 }, n_dims, 0 };
+        for (int i = 0; i < n_dims; ++i) {
+            int32_t ne = 1;
+            finp.read((char *) &ne, sizeof(ne));
+            r.ne[i] = ne;
+        }
+
+        r.name.resize(length);
+        finp.read(&r.name[0], length);
+        r.offs = finp.tellg();
+
+        if (!finp || n_dims < 1 || n_dims > 4 || ttype < 0 || ttype >= GGML_TYPE_COUNT) {
+            fprintf(stderr, "%s: invalid tensor record in '%s'\n", __func__, fname_inp.c_str());
+            return false;
+        }
+
+        finp.seekg(ggml_row_size(r.type, r.ne[0])*r.ne[1]*r.ne[2]*r.ne[3], std::ios::cur);
+        records.push_back(std::move(r));
+    }
+
+    ggml_init_params params = { records.size()*ggml_tensor_overhead(), nullptr, true };
+    ggml_context_ptr ctx(ggml_init(params));
+
+    for (const auto & r : records) {
+        ggml_tensor * t = ggml_new_tensor(ctx.get(), r.type, r.n_dims, r.ne);
+        ggml_set_name(t, r.name.c_str());
+        gguf_add_tensor(g, t);
+    }
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    {
+        std::vector<uint8_t> meta(gguf_get_meta_size(g));
+        gguf_get_meta_data(g, meta.data());
+        fout.write((const char *) meta.data(), meta.size());
+    }
+
+    finp.clear();
+
+    std::vector<char> data;
+    for (const auto & r : records) {
+        const size_t nbytes = ggml_row_size(r.type, r.ne[0])*r.ne[1]*r.ne[2]*r.ne[3];
+
+        data.resize(nbytes);
+        finp.seekg(r.offs);
+        finp.read(data.data(), nbytes);
+
+        // gguf_add_tensor() placed every tensor at an offset aligned to the alignment of the file
+        data.resize(GGML_PAD(nbytes, gguf_get_alignment(g)), 0);
+        fout.write(data.data(), data.size());
+    }
+
+    if (!finp || !fout) {
+        fprintf(stderr, "%s: failed to copy the tensor data to '%s'\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    printf("%s: wrote %zu tensors to '%s'\n", __func__, records.size(), fname_out.c_str());
+
+    return true;
+}
+
 // quantize a model
-static bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype) {
+static bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype, const ggml_quantize_params & qparams) {
     gpt_vocab vocab;
 
     printf("%s: loading model from '%s'\n", __func__, fname_inp.c_str());
@@ -165,7 +613,7 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
         "decoder.positional_embedding",
     };
 
-    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
+    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip, qparams)) {
         fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
         return false;
     }
@@ -179,37 +627,94 @@ static bool whisper_model_quantize(const std::string & fname_inp, const std::str
 int main(int argc, char ** argv) {
     ggml_backend_load_all();
 
-    if (argc != 4) {
-        fprintf(stderr, "usage: %s model-f32.bin model-quant.bin type\n", argv[0]);
-        ggml_print_ftypes(stderr);
+    quantize_params params;
+
+    if (!quantize_params_parse(argc, argv, params)) {
+        quantize_print_usage(argc, argv, params);
         return 1;
     }
 
     // needed to initialize f16 tables
     {
-        struct ggml_init_params params = { 0, NULL, false };
-        struct ggml_context * ctx = ggml_init(params);
+        struct ggml_init_params iparams = { 0, NULL, false };
+        struct ggml_context * ctx = ggml_init(iparams);
         ggml_free(ctx);
     }
 
-    const std::string fname_inp = argv[1];
-    const std::string fname_out = argv[2];
+    const std::string & fname_inp = params.fname_inp;
+    const std::string & fname_out = params.fname_out;
+
+    const bool to_gguf = quantize_is_gguf(fname_out);
+
+    // convert only
+    if (params.type.empty()) {
+        return whisper_model_to_gguf(fname_inp, fname_out) ? 0 : 1;
+    }
 
-    const ggml_ftype ftype = ggml_parse_ftype(argv[3]);
+    const ggml_ftype ftype = ggml_parse_ftype(params.type.c_str());
 
     const int64_t t_main_start_us = ggml_time_us();
 
+    int64_t t_calib_us    = 0;
     int64_t t_quantize_us = 0;
 
+    ggml_quantize_params qparams;
+    qparams.n_threads    = std::max(1, params.n_threads);
+    qparams.tensor_types = params.tensor_types;
+    qparams.max_error    = params.max_error;
+
+    // importance matrix
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        imatrix_map imatrix;
+
+        if (!params.fname_imatrix.empty() && !imatrix_load(params.fname_imatrix, imatrix)) {
+            return 1;
+        }
+
+        if (!params.fname_calib.empty() && !imatrix_calibrate(params, imatrix)) {
+            return 1;
+        }
+
+        if (!params.fname_imatrix_out.empty() && !imatrix_save(params.fname_imatrix_out, imatrix)) {
+            return 1;
+        }
+
+        for (const auto & kv : imatrix) {
+            if (kv.second.n_rows == 0) {
+                continue;
+            }
+            auto & mean = qparams.imatrix[kv.first];
+            mean.resize(kv.second.sum.size());
+            for (size_t j = 0; j < mean.size(); ++j) {
+                mean[j] = kv.second.sum[j]/kv.second.n_rows;
+            }
+        }
+
+        t_calib_us = ggml_time_us() - t_start_us;
+    }
+
     // load the model
     {
         const int64_t t_start_us = ggml_time_us();
 
-        if (!whisper_model_quantize(fname_inp, fname_out, ggml_ftype(ftype))) {
+        // a GGUF output is quantized in the legacy format first, then converted
+        const std::string fname_quant = to_gguf ? fname_out + ".tmp" : fname_out;
+
+        if (!whisper_model_quantize(fname_inp, fname_quant, ggml_ftype(ftype), qparams)) {
             fprintf(stderr, "%s: failed to quantize model from '%s'\n", __func__, fname_inp.c_str());
             return 1;
         }
 
+        if (to_gguf) {
+            const bool ok = whisper_model_to_gguf(fname_quant, fname_out);
+            std::remove(fname_quant.c_str());
+            if (!ok) {
+                return 1;
+            }
+        }
+
         t_quantize_us = ggml_time_us() - t_start_us;
     }
 
@@ -218,6 +723,9 @@ int main(int argc, char ** argv) {
         const int64_t t_main_end_us = ggml_time_us();
 
         printf("\n");
+        if (!qparams.imatrix.empty()) {
+            printf("%s:  imatrix time = %8.2f ms\n", __func__, t_calib_us/1000.0f);
+        }
         printf("%s: quantize time = %8.2f ms\n", __func__, t_quantize_us/1000.0f);
         printf("%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
     }
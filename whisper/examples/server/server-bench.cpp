@@ -0,0 +1,478 @@
+// Load generator for whisper-server
+//
+// Replays audio files against a running server, closed-loop (N clients sending back-to-back) or
+// open-loop (Poisson arrivals at a fixed rate), and reports latency percentiles and throughput.
+// With --server, it starts the server itself for each --parallel / --batch-size combination.
+
+#include "common-whisper.h"
+#include "whisper.h"
+
+#include "httplib.h"
+#include "json.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using json = nlohmann::ordered_json;
+
+struct bench_params {
+    std::string host = "127.0.0.1";
+    int32_t     port = 8080;
+    std::string path = "/inference";
+
+    std::vector<std::string> fname_inp;
+    std::vector<std::pair<std::string, std::string>> fields;
+
+    int32_t n_requests = 32;
+
+    std::vector<int32_t> concurrency = { 1 }; // closed-loop clients
+    std::vector<float>   rates;               // open-loop requests per second, replaces concurrency
+
+    std::string          server_cmd;          // started for every combination below
+    std::vector<int32_t> parallel;
+    std::vector<int32_t> batch_size;
+    int32_t              server_timeout = 120; // seconds to wait for the server to load
+
+    std::string fname_json;
+};
+
+static std::vector<std::string> split_list(const std::string & str) {
+    std::vector<std::string> res;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            res.push_back(item);
+        }
+    }
+    return res;
+}
+
+static void bench_print_usage(int /*argc*/, char ** argv, const bench_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,         --help              [default] show this help message and exit\n");
+    fprintf(stderr, "  --host HOST,                    [%-7s] server host\n",                              params.host.c_str());
+    fprintf(stderr, "  --port PORT,                    [%-7d] server port\n",                              params.port);
+    fprintf(stderr, "  --path PATH,                    [%-7s] inference path\n",                           params.path.c_str());
+    fprintf(stderr, "  -f FNAME,   --file FNAME        [%-7s] audio file or directory of files, can be repeated\n", "");
+    fprintf(stderr, "  -F K=V,     --field K=V         [%-7s] form field sent with every request, can be repeated\n", "");
+    fprintf(stderr, "  -n N,       --requests N        [%-7d] requests per run\n",                         params.n_requests);
+    fprintf(stderr, "  -c LIST,    --concurrency LIST  [%-7s] closed loop: clients sending back-to-back, e.g. 1,2,4\n", "1");
+    fprintf(stderr, "  -r LIST,    --rate LIST         [%-7s] open loop: Poisson arrivals per second, e.g. 0.5,1,2\n", "");
+    fprintf(stderr, "  --server CMD,                   [%-7s] start the server with CMD (plus --port, --parallel, --batch-size), output discarded\n", "");
+    fprintf(stderr, "  --parallel LIST,                [%-7s] --server: --parallel values to run\n",       "");
+    fprintf(stderr, "  --batch-size LIST,              [%-7s] --server: --batch-size values to run\n",     "");
+    fprintf(stderr, "  --server-timeout N,             [%-7d] --server: seconds to wait for the server to start\n", params.server_timeout);
+    fprintf(stderr, "  -oj FNAME,  --output-json FNAME [%-7s] write the results to a JSON file (default stdout)\n", "");
+    fprintf(stderr, "\n");
+}
+
+static bool bench_params_parse(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            bench_print_usage(argc, argv, params);
+            exit(0);
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for argument: %s\n", arg.c_str());
+            return false;
+        }
+
+        if      (arg == "--host")                            { params.host           = argv[++i]; }
+        else if (arg == "--port")                            { params.port           = std::stoi(argv[++i]); }
+        else if (arg == "--path")                            { params.path           = argv[++i]; }
+        else if (arg == "-f"  || arg == "--file")            { params.fname_inp.emplace_back(argv[++i]); }
+        else if (arg == "-F"  || arg == "--field")           {
+            const std::string kv = argv[++i];
+            const size_t pos = kv.find('=');
+            if (pos == std::string::npos) {
+                fprintf(stderr, "error: expected KEY=VALUE: %s\n", kv.c_str());
+                return false;
+            }
+            params.fields.emplace_back(kv.substr(0, pos), kv.substr(pos + 1));
+        }
+        else if (arg == "-n"  || arg == "--requests")        { params.n_requests     = std::stoi(argv[++i]); }
+        else if (arg == "-c"  || arg == "--concurrency")     {
+            params.concurrency.clear();
+            for (const auto & v : split_list(argv[++i])) {
+                params.concurrency.push_back(std::stoi(v));
+            }
+        }
+        else if (arg == "-r"  || arg == "--rate")            {
+            params.rates.clear();
+            for (const auto & v : split_list(argv[++i])) {
+                params.rates.push_back(std::stof(v));
+            }
+        }
+        else if (arg == "--server")                          { params.server_cmd     = argv[++i]; }
+        else if (arg == "--parallel")                        {
+            params.parallel.clear();
+            for (const auto & v : split_list(argv[++i])) {
+                params.parallel.push_back(std::stoi(v));
+            }
+        }
+        else if (arg == "--batch-size")                      {
+            params.batch_size.clear();
+            for (const auto & v : split_list(argv[++i])) {
+                params.batch_size.push_back(std::stoi(v));
+            }
+        }
+        else if (arg == "--server-timeout")                  { params.server_timeout = std::stoi(argv[++i]); }
+        else if (arg == "-oj" || arg == "--output-json")     { params.fname_json     = argv[++i]; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_print_usage(argc, argv, params);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct bench_file {
+    std::string name;
+    std::string data;
+    double      audio_s = 0.0;
+};
+
+static bool bench_load_files(const std::vector<std::string> & fnames, std::vector<bench_file> & files) {
+    std::vector<std::string> paths;
+    for (const auto & fname : fnames) {
+        if (std::filesystem::is_directory(fname)) {
+            std::vector<std::string> dir;
+            for (const auto & entry : std::filesystem::directory_iterator(fname)) {
+                if (entry.is_regular_file()) {
+                    dir.push_back(entry.path().string());
+                }
+            }
+            std::sort(dir.begin(), dir.end());
+            paths.insert(paths.end(), dir.begin(), dir.end());
+        } else {
+            paths.push_back(fname);
+        }
+    }
+
+    for (const auto & path : paths) {
+        std::ifstream fin(path, std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "error: failed to open '%s'\n", path.c_str());
+            return false;
+        }
+
+        bench_file file;
+        file.name = path;
+        file.data.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+        if (!read_audio_data_from_memory(file.data.data(), file.data.size(), pcmf32, pcmf32s, false)) {
+            // the server may still convert it with --convert, the audio duration is unknown
+            fprintf(stderr, "warning: failed to decode '%s', audio duration not counted\n", path.c_str());
+        }
+        file.audio_s = double(pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+        files.push_back(std::move(file));
+    }
+
+    return !files.empty();
+}
+
+struct bench_result {
+    double latency_s = 0.0; // from the scheduled send time to the end of the response
+    double audio_s   = 0.0;
+    int    status    = 0;   // HTTP status, 0 if the connection failed
+};
+
+static bench_result bench_request(const bench_params & params, const bench_file & file) {
+    httplib::Client cli(params.host, params.port);
+    cli.set_read_timeout(3600);
+    cli.set_write_timeout(3600);
+
+    httplib::MultipartFormDataItems items = {
+        { "file", file.data, file.name, "application/octet-stream" },
+    };
+    for (const auto & kv : params.fields) {
+        items.push_back({ kv.first, kv.second, "", "" });
+    }
+
+    bench_result res;
+    res.audio_s = file.audio_s;
+
+    auto r = cli.Post(params.path, items);
+    if (r) {
+        res.status = r->status;
+    }
+
+    return res;
+}
+
+// closed loop: n_clients send the next request as soon as their previous one returns
+// open loop: requests are sent at exponentially distributed intervals, whatever the server does
+static std::vector<bench_result> bench_run(const bench_params & params, const std::vector<bench_file> & files, int n_clients, float rate, double & wall_s) {
+    using clock = std::chrono::steady_clock;
+
+    std::vector<bench_result> results(params.n_requests);
+
+    const auto t_start = clock::now();
+
+    auto run_one = [&](int i, clock::time_point t_sched) {
+        results[i] = bench_request(params, files[i % files.size()]);
+        results[i].latency_s = std::chrono::duration<double>(clock::now() - t_sched).count();
+    };
+
+    std::vector<std::thread> workers;
+
+    if (rate > 0.0f) {
+        std::mt19937 rng(42);
+        std::exponential_distribution<double> dist(rate);
+
+        auto t_next = t_start;
+        for (int i = 0; i < params.n_requests; ++i) {
+            std::this_thread::sleep_until(t_next);
+            workers.emplace_back(run_one, i, t_next);
+            t_next += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(dist(rng)));
+        }
+    } else {
+        std::atomic<int> next(0);
+        for (int c = 0; c < n_clients; ++c) {
+            workers.emplace_back([&]() {
+                int i;
+                while ((i = next++) < params.n_requests) {
+                    run_one(i, clock::now());
+                }
+            });
+        }
+    }
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    wall_s = std::chrono::duration<double>(clock::now() - t_start).count();
+
+    return results;
+}
+
+static json bench_summary(const std::vector<bench_result> & results, double wall_s) {
+    std::vector<double> latencies;
+    std::map<std::string, int> status;
+
+    double audio_s = 0.0;
+    for (const auto & r : results) {
+        status[std::to_string(r.status)]++;
+        if (r.status == 200) {
+            latencies.push_back(r.latency_s);
+            audio_s += r.audio_s;
+        }
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    // nearest-rank percentile
+    auto pct = [&](double p) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        const size_t k = std::max<size_t>(1, (size_t) std::ceil(p/100.0*latencies.size()));
+        return latencies[std::min(k, latencies.size()) - 1];
+    };
+
+    double sum = 0.0;
+    for (const double l : latencies) {
+        sum += l;
+    }
+
+    return json{
+        { "n_ok",           (int) latencies.size() },
+        { "status",         status },
+        { "wall_s",         wall_s },
+        { "throughput_rps", latencies.size()/wall_s },
+        { "audio_s_per_s",  audio_s/wall_s },
+        { "latency_s", {
+            { "mean", latencies.empty() ? 0.0 : sum/latencies.size() },
+            { "p50",  pct(50) },
+            { "p90",  pct(90) },
+            { "p99",  pct(99) },
+            { "max",  latencies.empty() ? 0.0 : latencies.back() },
+        } },
+    };
+}
+
+#if !defined(_WIN32)
+static pid_t bench_server_start(const std::string & cmd) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+        // keep the results readable, the server logs every request
+        const int fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execl("/bin/sh", "sh", "-c", ("exec " + cmd).c_str(), (char *) nullptr);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void bench_server_stop(pid_t pid) {
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+static bool bench_server_wait(const bench_params & params, pid_t pid) {
+    httplib::Client cli(params.host, params.port);
+    for (int i = 0; i < params.server_timeout*10; ++i) {
+        if (waitpid(pid, nullptr, WNOHANG) == pid) {
+            return false;
+        }
+        auto r = cli.Get("/health");
+        if (r && r->status == 200) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return false;
+}
+#endif
+
+int main(int argc, char ** argv) {
+    bench_params params;
+
+    if (!bench_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    std::vector<bench_file> files;
+    if (!bench_load_files(params.fname_inp, files)) {
+        fprintf(stderr, "error: no audio files, use -f\n");
+        return 1;
+    }
+
+    if (params.server_cmd.empty() && (!params.parallel.empty() || !params.batch_size.empty())) {
+        fprintf(stderr, "error: --parallel and --batch-size need --server\n");
+        return 1;
+    }
+
+#if defined(_WIN32)
+    if (!params.server_cmd.empty()) {
+        fprintf(stderr, "error: --server is not supported on Windows\n");
+        return 1;
+    }
+#endif
+
+    // 0 - the server's own setting
+    const std::vector<int32_t> parallel   = params.parallel.empty()   ? std::vector<int32_t>{ 0 } : params.parallel;
+    const std::vector<int32_t> batch_size = params.batch_size.empty() ? std::vector<int32_t>{ 0 } : params.batch_size;
+
+    json jres = json::array();
+
+    for (const int32_t n_parallel : parallel) {
+        for (const int32_t n_batch : batch_size) {
+#if !defined(_WIN32)
+            pid_t pid = -1;
+            if (!params.server_cmd.empty()) {
+                std::string cmd = params.server_cmd + " --port " + std::to_string(params.port);
+                if (n_parallel > 0) {
+                    cmd += " --parallel " + std::to_string(n_parallel);
+                }
+                if (n_batch > 0) {
+                    cmd += " --batch-size " + std::to_string(n_batch);
+                }
+
+                fprintf(stderr, "%s: starting '%s'\n", __func__, cmd.c_str());
+                pid = bench_server_start(cmd);
+                if (pid < 0 || !bench_server_wait(params, pid)) {
+                    fprintf(stderr, "error: the server did not start\n");
+                    bench_server_stop(pid);
+                    return 2;
+                }
+            }
+#endif
+
+            // open-loop runs replace the closed-loop ones
+            std::vector<std::pair<int, float>> loads;
+            if (params.rates.empty()) {
+                for (const int32_t c : params.concurrency) {
+                    loads.emplace_back(c, 0.0f);
+                }
+            } else {
+                for (const float r : params.rates) {
+                    loads.emplace_back(0, r);
+                }
+            }
+
+            for (const auto & load : loads) {
+                double wall_s = 0.0;
+                const auto results = bench_run(params, files, load.first, load.second, wall_s);
+
+                json jrun = {
+                    { "mode", load.second > 0.0f ? "open" : "closed" },
+                };
+                if (load.second > 0.0f) {
+                    jrun["rate"] = load.second;
+                } else {
+                    jrun["concurrency"] = load.first;
+                }
+                if (n_parallel > 0) {
+                    jrun["parallel"] = n_parallel;
+                }
+                if (n_batch > 0) {
+                    jrun["batch_size"] = n_batch;
+                }
+                jrun.update(bench_summary(results, wall_s));
+
+                const auto & lat = jrun["latency_s"];
+                fprintf(stderr, "%s: %s = %-5g, parallel = %d, batch = %d: ok = %3d/%3d, %6.2f req/s, %7.2f audio s/s, latency p50 = %7.3f s, p90 = %7.3f s, p99 = %7.3f s\n",
+                        __func__, load.second > 0.0f ? "rate" : "clients", load.second > 0.0f ? load.second : (float) load.first,
+                        n_parallel, n_batch, jrun["n_ok"].get<int>(), params.n_requests,
+                        jrun["throughput_rps"].get<double>(), jrun["audio_s_per_s"].get<double>(),
+                        lat["p50"].get<double>(), lat["p90"].get<double>(), lat["p99"].get<double>());
+
+                jres.push_back(jrun);
+            }
+
+#if !defined(_WIN32)
+            bench_server_stop(pid);
+#endif
+        }
+    }
+
+    if (params.fname_json.empty()) {
+        printf("%s\n", jres.dump(2).c_str());
+    } else {
+        std::ofstream fout(params.fname_json);
+        if (!fout) {
+            fprintf(stderr, "error: failed to open '%s' for writing\n", params.fname_json.c_str());
+            return 3;
+        }
+        fout << jres.dump(2) << "\n";
+    }
+
+    return 0;
+}
@@ -9,6 +9,7 @@
 #include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -17,8 +18,17 @@
 #include <memory>
 #include <csignal>
 #include <atomic>
+#include <algorithm>
 #include <functional>
 #include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
 #if defined (_WIN32)
 #include <windows.h>
 #endif
@@ -66,6 +76,41 @@ struct server_params
     int32_t write_timeout = 600;
 
     bool ffmpeg_converter = false;
+
+    // requests transcribed at the same time, one whisper_state each; more wait in a queue of max_queue
+    int32_t n_parallel    = 1;
+    int32_t max_queue     = 64;
+    int32_t max_wait_ms   = 0; // > 0: refuse requests expected to wait longer for a slot (503 with Retry-After)
+    int32_t timeout_ms    = 0; // > 0: default deadline of a request from its arrival, -F timeout_ms overrides
+    int32_t mem_budget_mb = 0; // > 0: fewer states if n_parallel of them do not fit
+
+    // > 1: run requests concurrently and batch their first encoder window
+    int32_t batch_size    = 1;
+    int32_t batch_wait_ms = 10;
+
+    // /stream sessions: transcribe every step_ms of new audio, finalize windows of length_ms
+    int32_t stream_step_ms   = 1000;
+    int32_t stream_length_ms = 10000;
+    int32_t stream_keep_ms   = 200;
+    int32_t stream_idle_s    = 60;
+
+    // NAME=PATH,... models picked with the "model" field, loaded on first use
+    std::string models           = "";
+    int32_t     models_budget_mb = 0; // > 0: unload unused models to stay below
+
+    // languages detected for the "user" field of the requests, remembered once confident
+    int32_t lid_users = 1024;
+
+    // > 0: keep the results of earlier requests, to answer the same audio and parameters again
+    int32_t cache_mb = 0;
+
+    // /v1/jobs: runner threads (0 - one per state), jobs waiting for them, seconds a finished job is kept
+    int32_t job_runners = 0;
+    int32_t max_jobs    = 64;
+    int32_t job_ttl_s   = 600;
+
+    // /v1/jobs: > 0: keep the upload encoded and decode and transcribe it N seconds at a time
+    int32_t job_chunk_s = 0;
 };
 
 struct whisper_params {
@@ -80,6 +125,7 @@ struct whisper_params {
     int32_t best_of       = 2;
     int32_t beam_size     = -1;
     int32_t audio_ctx     = 0;
+    int32_t lid_audio_ctx = 0;
 
     float word_thold      =  0.01f;
     float entropy_thold   =  2.40f;
@@ -87,6 +133,8 @@ struct whisper_params {
     float temperature     =  0.00f;
     float temperature_inc =  0.20f;
     float no_speech_thold = 0.6f;
+    float no_speech_skip  = 0.0f;
+    float lid_thold       = 0.8f;
 
     bool debug_mode      = false;
     bool translate       = false;
@@ -104,12 +152,19 @@ struct whisper_params {
     bool flash_attn      = true;
     bool suppress_nst    = false;
     bool no_context      = true;
+    int32_t n_gpu_layers = -1;
+    bool use_hugepages   = false;
+    bool numa_replicate  = false;
+    int32_t n_gpu_devices = 1;
     bool no_language_probabilities = false;
+    bool timings         = false; // add the time of each request stage to json responses
 
     std::string language        = "en";
     std::string prompt          = "";
+    std::string user            = ""; // request field, the key of the remembered languages
     std::string font_path       = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model           = "models/ggml-base.en.bin";
+    std::string kv_type         = "f16";
 
     std::string response_format     = json_format;
 
@@ -163,6 +218,8 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -nt,       --no-timestamps     [%-7s] do not print timestamps\n",                        params.no_timestamps ? "true" : "false");
     fprintf(stderr, "  -l LANG,   --language LANG     [%-7s] spoken language ('auto' for auto-detect)\n",       params.language.c_str());
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
+    fprintf(stderr, "  -lac N,    --lid-audio-ctx N   [%-7d] audio context of the language detection (0 - all)\n", params.lid_audio_ctx);
+    fprintf(stderr, "  -lt N,     --lid-thold N       [%-7.2f] language probability to trust the short detection / a user's language\n", params.lid_thold);
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
@@ -173,12 +230,37 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  --public PATH,                 [%-7s] Path to the public folder\n", sparams.public_path.c_str());
     fprintf(stderr, "  --request-path PATH,           [%-7s] Request path for all requests\n", sparams.request_path.c_str());
     fprintf(stderr, "  --inference-path PATH,         [%-7s] Inference path for all requests\n", sparams.inference_path.c_str());
-    fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server\n", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  --convert,                     [%-7s] Convert formats other than WAV, MP3, FLAC and Ogg Vorbis with ffmpeg\n", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  --parallel N,                  [%-7d] Number of requests transcribed at the same time\n", sparams.n_parallel);
+    fprintf(stderr, "  --max-queue N,                 [%-7d] Number of requests waiting for a free slot, more are refused (503)\n", sparams.max_queue);
+    fprintf(stderr, "  --max-wait-ms N,               [%-7d] Refuse requests expected to wait longer for a slot (503, 0 - no limit)\n", sparams.max_wait_ms);
+    fprintf(stderr, "  --timeout-ms N,                [%-7d] Deadline of a request, aborted when it passes (504, 0 - none)\n", sparams.timeout_ms);
+    fprintf(stderr, "  --mem-budget MB,               [%-7d] Memory for the parallel slots, caps --parallel (0 - no limit)\n", sparams.mem_budget_mb);
+    fprintf(stderr, "  --batch-size N,                [%-7d] Number of concurrent requests whose encoder runs are batched\n", sparams.batch_size);
+    fprintf(stderr, "  --batch-wait-ms N,             [%-7d] Time to wait for a batch to fill up\n", sparams.batch_wait_ms);
+    fprintf(stderr, "  --stream-step N,               [%-7d] /stream: milliseconds of new audio between transcriptions\n", sparams.stream_step_ms);
+    fprintf(stderr, "  --stream-length N,             [%-7d] /stream: milliseconds of audio in a window before it is finalized\n", sparams.stream_length_ms);
+    fprintf(stderr, "  --stream-keep N,               [%-7d] /stream: milliseconds of audio kept from the previous window\n", sparams.stream_keep_ms);
+    fprintf(stderr, "  --stream-idle N,               [%-7d] /stream: seconds before an idle session is closed\n", sparams.stream_idle_s);
+    fprintf(stderr, "  --models LIST,                 [%-7s] NAME=PATH,... models that requests pick with -F model=NAME\n", sparams.models.c_str());
+    fprintf(stderr, "  --models-budget MB,            [%-7d] Memory for the --models, unused ones are unloaded (0 - no limit)\n", sparams.models_budget_mb);
+    fprintf(stderr, "  --lid-users N,                 [%-7d] Languages remembered for the 'user' field of the requests (0 - none)\n", sparams.lid_users);
+    fprintf(stderr, "  --cache MB,                    [%-7d] Memory for the results of earlier requests, reused for the same audio (0 - off)\n", sparams.cache_mb);
+    fprintf(stderr, "  --job-runners N,               [%-7d] /v1/jobs: jobs transcribed at the same time (0 - one per slot)\n", sparams.job_runners);
+    fprintf(stderr, "  --max-jobs N,                  [%-7d] /v1/jobs: jobs waiting for a runner, more are refused (503)\n", sparams.max_jobs);
+    fprintf(stderr, "  --job-ttl N,                   [%-7d] /v1/jobs: seconds the result of a finished job is kept\n", sparams.job_ttl_s);
+    fprintf(stderr, "  --job-chunk N,                 [%-7d] /v1/jobs: decode and transcribe the audio N sec at a time (0 - all at once)\n", sparams.job_chunk_s);
     fprintf(stderr, "  -sns,      --suppress-nst      [%-7s] suppress non-speech tokens\n", params.suppress_nst ? "true" : "false");
     fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech threshold\n",   params.no_speech_thold);
+    fprintf(stderr, "  -nss N,    --no-speech-skip N  [%-7.2f] skip windows above this no speech probability (0 - off)\n", params.no_speech_skip);
     fprintf(stderr, "  -ng,       --no-gpu            [%-7s] do not use gpu\n", params.use_gpu ? "false" : "true");
+    fprintf(stderr, "  -ngl N,    --n-gpu-layers N    [%-7d] encoder, then decoder layers on the gpu (-1 - all)\n", params.n_gpu_layers);
+    fprintf(stderr, "  -hp,       --hugepages         [%-7s] back the cpu weights and compute buffers with huge pages\n", params.use_hugepages ? "true" : "false");
+    fprintf(stderr, "             --numa-replicate    [%-7s] one copy of the cpu weights per numa node\n", params.numa_replicate ? "true" : "false");
+    fprintf(stderr, "             --gpu-devices N     [%-7d] number of gpus holding a copy of the weights (0 - all)\n", params.n_gpu_devices);
     fprintf(stderr, "  -fa,       --flash-attn        [%-7s] enable flash attention\n", params.flash_attn ? "true" : "false");
     fprintf(stderr, "  -nfa,      --no-flash-attn     [%-7s] disable flash attention\n", params.flash_attn ? "false" : "true");
+    fprintf(stderr, "  -kvt TYPE, --kv-type TYPE      [%-7s] KV cache type (f16, bf16, q8_0, q4_0 - quantized needs flash attention)\n", params.kv_type.c_str());
     fprintf(stderr, "  -nlp,      --no-language-probabilities [%-7s] exclude language probabilities from verbose_json output\n", params.no_language_probabilities ? "true" : "false");
     // Voice Activity Detection (VAD) parameters
     fprintf(stderr, "\nVoice Activity Detection (VAD) options:\n");
@@ -230,15 +312,23 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (arg == "-nt"   || arg == "--no-timestamps")   { params.no_timestamps   = true; }
         else if (arg == "-l"    || arg == "--language")        { params.language        = argv[++i]; }
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
+        else if (arg == "-lac"  || arg == "--lid-audio-ctx")   { params.lid_audio_ctx   = std::stoi(argv[++i]); }
+        else if (arg == "-lt"   || arg == "--lid-thold")       { params.lid_thold       = std::stof(argv[++i]); }
         else if (                  arg == "--prompt")          { params.prompt          = argv[++i]; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = argv[++i]; }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
         else if (arg == "-dtw"  || arg == "--dtw")             { params.dtw             = argv[++i]; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
+        else if (arg == "-ngl"  || arg == "--n-gpu-layers")    { params.n_gpu_layers    = std::stoi(argv[++i]); }
+        else if (arg == "-hp"   || arg == "--hugepages")       { params.use_hugepages   = true; }
+        else if (                  arg == "--numa-replicate")  { params.numa_replicate  = true; }
+        else if (                  arg == "--gpu-devices")     { params.n_gpu_devices   = std::stoi(argv[++i]); }
         else if (arg == "-fa"   || arg == "--flash-attn")      { params.flash_attn      = true; }
         else if (arg == "-nfa"  || arg == "--no-flash-attn")   { params.flash_attn      = false; }
+        else if (arg == "-kvt"  || arg == "--kv-type")         { params.kv_type         = argv[++i]; }
         else if (arg == "-sns"  || arg == "--suppress-nst")    { params.suppress_nst    = true; }
         else if (arg == "-nth"  || arg == "--no-speech-thold") { params.no_speech_thold = std::stof(argv[++i]); }
+        else if (arg == "-nss"  || arg == "--no-speech-skip")  { params.no_speech_skip  = std::stof(argv[++i]); }
         else if (arg == "-nlp"  || arg == "--no-language-probabilities") { params.no_language_probabilities = true; }
 
         // server params
@@ -248,6 +338,25 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (                  arg == "--request-path")    { sparams.request_path = argv[++i]; }
         else if (                  arg == "--inference-path")  { sparams.inference_path = argv[++i]; }
         else if (                  arg == "--convert")         { sparams.ffmpeg_converter     = true; }
+        else if (                  arg == "--parallel")        { sparams.n_parallel    = std::stoi(argv[++i]); }
+        else if (                  arg == "--max-queue")       { sparams.max_queue     = std::stoi(argv[++i]); }
+        else if (                  arg == "--max-wait-ms")     { sparams.max_wait_ms   = std::stoi(argv[++i]); }
+        else if (                  arg == "--timeout-ms")      { sparams.timeout_ms    = std::stoi(argv[++i]); }
+        else if (                  arg == "--mem-budget")      { sparams.mem_budget_mb = std::stoi(argv[++i]); }
+        else if (                  arg == "--batch-size")      { sparams.batch_size    = std::stoi(argv[++i]); }
+        else if (                  arg == "--batch-wait-ms")   { sparams.batch_wait_ms = std::stoi(argv[++i]); }
+        else if (                  arg == "--stream-step")     { sparams.stream_step_ms   = std::stoi(argv[++i]); }
+        else if (                  arg == "--stream-length")   { sparams.stream_length_ms = std::stoi(argv[++i]); }
+        else if (                  arg == "--stream-keep")     { sparams.stream_keep_ms   = std::stoi(argv[++i]); }
+        else if (                  arg == "--stream-idle")     { sparams.stream_idle_s    = std::stoi(argv[++i]); }
+        else if (                  arg == "--models")          { sparams.models           = argv[++i]; }
+        else if (                  arg == "--models-budget")   { sparams.models_budget_mb = std::stoi(argv[++i]); }
+        else if (                  arg == "--lid-users")       { sparams.lid_users        = std::stoi(argv[++i]); }
+        else if (                  arg == "--cache")           { sparams.cache_mb      = std::stoi(argv[++i]); }
+        else if (                  arg == "--job-runners")     { sparams.job_runners   = std::stoi(argv[++i]); }
+        else if (                  arg == "--max-jobs")        { sparams.max_jobs      = std::stoi(argv[++i]); }
+        else if (                  arg == "--job-ttl")         { sparams.job_ttl_s     = std::stoi(argv[++i]); }
+        else if (                  arg == "--job-chunk")       { sparams.job_chunk_s   = std::stoi(argv[++i]); }
 
         // Voice Activity Detection (VAD)
         else if (                  arg == "--vad")                         { params.vad                         = true; }
@@ -292,7 +401,7 @@ std::string generate_temp_filename(const std::string &prefix, const std::string
     auto now = std::chrono::system_clock::now();
     auto now_time_t = std::chrono::system_clock::to_time_t(now);
 
-    static std::mt19937 rng{std::random_device{}()};
+    static thread_local std::mt19937 rng{std::random_device{}()};
     std::uniform_int_distribution<long long> dist(0, 1e9);
 
     std::stringstream ss;
@@ -365,168 +474,1040 @@ std::string estimate_diarization_speaker(std::vector<std::vector<float>> pcmf32s
     return speaker;
 }
 
-void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, int progress, void * user_data) {
-    int progress_step = ((whisper_print_user_data *) user_data)->params->progress_step;
-    int * progress_prev  = &(((whisper_print_user_data *) user_data)->progress_prev);
-    if (progress >= *progress_prev + progress_step) {
-        *progress_prev += progress_step;
-        fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress);
+// The segments and tokens of a finished request, enough to render any response format
+struct cached_result {
+    struct token {
+        std::string        text;
+        whisper_token_data data;
+    };
+
+    struct segment {
+        std::string text;
+        int64_t     t0;
+        int64_t     t1;
+        float       no_speech_prob;
+
+        std::vector<token> tokens;
+    };
+
+    int   lang_id   = -1;
+    float lang_prob = 0.0f;
+
+    // of the language detection of verbose_json responses, empty if no response needed them
+    int                lang_probs_id = -1;
+    std::vector<float> lang_probs;
+
+    std::vector<segment> segments;
+
+    // the results of a chunk of the audio starting at t_offset (10 ms units), see --job-chunk
+    void append(cached_result && chunk, int64_t t_offset) {
+        if (lang_id < 0) {
+            lang_id   = chunk.lang_id;
+            lang_prob = chunk.lang_prob;
+        }
+        for (auto & seg : chunk.segments) {
+            seg.t0 += t_offset;
+            seg.t1 += t_offset;
+            for (auto & tok : seg.tokens) {
+                if (tok.data.t0 >= 0) {
+                    tok.data.t0 += t_offset;
+                    tok.data.t1 += t_offset;
+                }
+                if (tok.data.t_dtw >= 0) {
+                    tok.data.t_dtw += t_offset;
+                }
+            }
+            segments.push_back(std::move(seg));
+        }
     }
-}
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
-    const auto & params  = *((whisper_print_user_data *) user_data)->params;
-    const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
+    size_t size() const {
+        size_t n = sizeof(*this) + lang_probs.size()*sizeof(float);
+        for (const auto & seg : segments) {
+            n += sizeof(seg) + seg.text.size();
+            for (const auto & tok : seg.tokens) {
+                n += sizeof(tok) + tok.text.size();
+            }
+        }
+        return n;
+    }
+};
 
-    const int n_segments = whisper_full_n_segments(ctx);
+// Results of the last whisper_full*() run, kept either in a pooled state or in
+// the default state of the context (state == nullptr), or of an earlier request
+// found in the result cache (cached != nullptr)
+struct whisper_result {
+    whisper_context * ctx;
+    whisper_state   * state;
 
-    std::string speaker = "";
+    const cached_result * cached = nullptr;
 
-    int64_t t0 = 0;
-    int64_t t1 = 0;
+    int n_segments() const {
+        if (cached) {
+            return cached->segments.size();
+        }
+        return state ? whisper_full_n_segments_from_state(state) : whisper_full_n_segments(ctx);
+    }
+    int lang_id() const {
+        if (cached) {
+            return cached->lang_id;
+        }
+        return state ? whisper_full_lang_id_from_state(state) : whisper_full_lang_id(ctx);
+    }
+    float lang_prob() const {
+        if (cached) {
+            return cached->lang_prob;
+        }
+        return state ? whisper_full_lang_prob_from_state(state) : whisper_full_lang_prob(ctx);
+    }
+    const char * segment_text(int i) const {
+        if (cached) {
+            return cached->segments[i].text.c_str();
+        }
+        return state ? whisper_full_get_segment_text_from_state(state, i) : whisper_full_get_segment_text(ctx, i);
+    }
+    int64_t segment_t0(int i) const {
+        if (cached) {
+            return cached->segments[i].t0;
+        }
+        return state ? whisper_full_get_segment_t0_from_state(state, i) : whisper_full_get_segment_t0(ctx, i);
+    }
+    int64_t segment_t1(int i) const {
+        if (cached) {
+            return cached->segments[i].t1;
+        }
+        return state ? whisper_full_get_segment_t1_from_state(state, i) : whisper_full_get_segment_t1(ctx, i);
+    }
+    float segment_no_speech_prob(int i) const {
+        if (cached) {
+            return cached->segments[i].no_speech_prob;
+        }
+        return state ? whisper_full_get_segment_no_speech_prob_from_state(state, i) : whisper_full_get_segment_no_speech_prob(ctx, i);
+    }
+    int n_tokens(int i) const {
+        if (cached) {
+            return cached->segments[i].tokens.size();
+        }
+        return state ? whisper_full_n_tokens_from_state(state, i) : whisper_full_n_tokens(ctx, i);
+    }
+    const char * token_text(int i, int j) const {
+        if (cached) {
+            return cached->segments[i].tokens[j].text.c_str();
+        }
+        return state ? whisper_full_get_token_text_from_state(ctx, state, i, j) : whisper_full_get_token_text(ctx, i, j);
+    }
+    whisper_token_data token_data(int i, int j) const {
+        if (cached) {
+            return cached->segments[i].tokens[j].data;
+        }
+        return state ? whisper_full_get_token_data_from_state(state, i, j) : whisper_full_get_token_data(ctx, i, j);
+    }
+    int lang_auto_detect(int n_threads, float * lang_probs) const {
+        if (cached) {
+            std::copy(cached->lang_probs.begin(), cached->lang_probs.end(), lang_probs);
+            return cached->lang_probs_id;
+        }
+        return state ? whisper_lang_auto_detect_with_state(ctx, state, 0, n_threads, lang_probs) : whisper_lang_auto_detect(ctx, 0, n_threads, lang_probs);
+    }
 
-    // print the last n_new segments
-    const int s0 = n_segments - n_new;
+    std::shared_ptr<cached_result> snapshot() const {
+        auto result = std::make_shared<cached_result>();
+        result->lang_id   = lang_id();
+        result->lang_prob = lang_prob();
+        for (int i = 0; i < n_segments(); ++i) {
+            cached_result::segment seg = { segment_text(i), segment_t0(i), segment_t1(i), segment_no_speech_prob(i), {} };
+            for (int j = 0; j < n_tokens(i); ++j) {
+                seg.tokens.push_back({ token_text(i, j), token_data(i, j) });
+            }
+            result->segments.push_back(std::move(seg));
+        }
+        return result;
+    }
+};
 
-    if (s0 == 0) {
-        printf("\n");
+// Results of earlier requests by a hash of their audio and the request fields
+// that change the transcription, so that retries and duplicate uploads, in any
+// response format, are answered without transcribing them again. The least
+// recently used results are dropped to stay below max_bytes.
+struct result_cache {
+    using entry_ptr = std::shared_ptr<const cached_result>;
+
+    size_t max_bytes = 0; // 0 - off
+
+    std::mutex mutex;
+    std::list<std::pair<std::string, entry_ptr>> lru; // most recent first
+    std::map<std::string, decltype(lru)::iterator> index;
+    size_t  n_bytes  = 0;
+    int64_t n_hits   = 0;
+    int64_t n_misses = 0;
+
+    static size_t entry_size(const std::string & key, const entry_ptr & entry) {
+        return key.size() + entry->size();
     }
 
-    for (int i = s0; i < n_segments; i++) {
-        if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+    // 64-bit hash of the samples
+    static uint64_t hash(const std::vector<float> & pcmf32) {
+        uint64_t h = 0xcbf29ce484222325ull ^ pcmf32.size();
+        for (float x : pcmf32) {
+            uint32_t bits;
+            memcpy(&bits, &x, sizeof(bits));
+            h = (h ^ bits)*0x100000001b3ull;
+            h ^= h >> 29;
         }
+        return h;
+    }
 
-        if (!params.no_timestamps) {
-            printf("[%s --> %s]  ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
+    // with_lang_probs: only results that kept the language probabilities
+    entry_ptr find(const std::string & key, bool with_lang_probs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = index.find(key);
+        if (it == index.end() || (with_lang_probs && it->second->second->lang_probs.empty())) {
+            n_misses++;
+            return nullptr;
         }
+        n_hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
 
-        if (params.diarize && pcmf32s.size() == 2) {
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+    void insert(const std::string & key, entry_ptr entry) {
+        const size_t size = entry_size(key, entry);
+        if (size > max_bytes) {
+            return;
         }
 
-        if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
-                if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
-                    if (id >= whisper_token_eot(ctx)) {
-                        continue;
-                    }
-                }
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = index.find(key);
+        if (it != index.end()) {
+            n_bytes -= entry_size(key, it->second->second);
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        while (!lru.empty() && n_bytes + size > max_bytes) {
+            n_bytes -= entry_size(lru.back().first, lru.back().second);
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        lru.emplace_front(key, std::move(entry));
+        index[key] = lru.begin();
+        n_bytes += size;
+    }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        lru.clear();
+        index.clear();
+        n_bytes = 0;
+    }
 
-                const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
+    void render(std::stringstream & ss) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ss << "# HELP whisper_cache_requests_total Lookups of the result cache by result.\n";
+        ss << "# TYPE whisper_cache_requests_total counter\n";
+        ss << "whisper_cache_requests_total{result=\"hit\"} "  << n_hits   << "\n";
+        ss << "whisper_cache_requests_total{result=\"miss\"} " << n_misses << "\n";
+        ss << "# HELP whisper_cache_bytes Memory used by the result cache.\n";
+        ss << "# TYPE whisper_cache_bytes gauge\n";
+        ss << "whisper_cache_bytes " << n_bytes << "\n";
+        ss << "# HELP whisper_cache_entries Results in the result cache.\n";
+        ss << "# TYPE whisper_cache_entries gauge\n";
+        ss << "whisper_cache_entries " << lru.size() << "\n";
+    }
+};
 
-                printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
+// One whisper_state per concurrent request. Requests that find no free state
+// wait in a bounded queue and are served by priority, then in arrival order.
+// A request is refused up front when the wait expected from the average time a
+// request holds a state and the requests ahead of it exceeds max_wait_ms or its
+// deadline, and leaves the queue when its deadline passes or its client is gone.
+struct state_pool {
+    struct waiter {
+        int      priority;
+        uint64_t seq;
+
+        whisper_state * state = nullptr;
+    };
+
+    enum wait_result {
+        WAIT_OK,
+        WAIT_FULL,    // max_waiting requests queued
+        WAIT_SHED,    // expected to wait too long
+        WAIT_EXPIRED, // deadline passed while waiting
+        WAIT_CLOSED,  // client disconnected while waiting
+    };
+
+    struct wait_status {
+        wait_result result = WAIT_OK;
+        double expected_ms = 0.0; // expected wait for a state
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<whisper_state *> states;
+    std::vector<whisper_state *> free_states;
+    std::vector<waiter *> waiting;
+
+    int      max_waiting = 0;
+    int      max_wait_ms = 0; // 0 - no limit
+    uint64_t n_arrived   = 0;
+    double   service_ms  = 0.0; // moving average of the time a request holds a state
+
+    // up to n states, as many as fit in mem_budget bytes (0 - no limit), at least one
+    bool init(whisper_context * ctx, int n, size_t mem_budget) {
+        size_t size = 0;
+        for (int i = 0; i < n; ++i) {
+            if (i > 0 && mem_budget > 0 && size/i*(i + 1) > mem_budget) {
+                fprintf(stderr, "%s: %d of %d states fit in the memory budget\n", __func__, i, n);
+                break;
             }
-        } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr) {
+                return false;
+            }
+            size += whisper_state_memory_size(state);
 
-            printf("%s%s", speaker.c_str(), text);
+            std::lock_guard<std::mutex> lock(mutex);
+            states.push_back(state);
+            free_states.push_back(state);
         }
+        fprintf(stderr, "%s: %zu states, %.1f MB\n", __func__, states.size(), size/1e6);
+        return true;
+    }
 
-        if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
-                printf("%s", params.tdrz_speaker_turn.c_str());
-            }
+    // all states must have been released
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto * state : states) {
+            whisper_free_state(state);
         }
+        states.clear();
+        free_states.clear();
+    }
 
-        // with timestamps or speakers: each segment on new line
-        if (!params.no_timestamps || params.diarize) {
-            printf("\n");
+    // nullptr, with the reason in status, if the request is refused or gives up waiting
+    // t_deadline_us: ggml_time_us() after which the request is of no use (0 - none)
+    // closed:        polled while waiting, true when the client is gone
+    // bounded:       false for the job runners, which are never refused (the job queue bounds them)
+    whisper_state * acquire(int priority, int64_t t_deadline_us, const std::function<bool()> & closed, wait_status & status, bool bounded = true) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (waiting.empty() && !free_states.empty()) {
+            whisper_state * state = free_states.back();
+            free_states.pop_back();
+            return state;
         }
-        fflush(stdout);
+
+        // the requests served before this one, each holding a state for service_ms
+        int n_ahead = 0;
+        for (const auto * w : waiting) {
+            n_ahead += w->priority >= priority;
+        }
+        status.expected_ms = service_ms*(n_ahead + 1)/std::max<size_t>(1, states.size());
+
+        if (bounded && (int) waiting.size() >= max_waiting) {
+            status.result = WAIT_FULL;
+            return nullptr;
+        }
+
+        if ((bounded && max_wait_ms > 0 && status.expected_ms > max_wait_ms) ||
+            (t_deadline_us > 0 && ggml_time_us() + 1e3*status.expected_ms > t_deadline_us)) {
+            status.result = WAIT_SHED;
+            return nullptr;
+        }
+
+        waiter w = { priority, n_arrived++ };
+        waiting.push_back(&w);
+
+        while (w.state == nullptr) {
+            const int64_t t_now_us = ggml_time_us();
+            if (t_deadline_us > 0 && t_now_us >= t_deadline_us) {
+                status.result = WAIT_EXPIRED;
+            } else if (closed && closed()) {
+                status.result = WAIT_CLOSED;
+            } else {
+                // wake up now and then to check the client
+                int64_t wait_us = 100000;
+                if (t_deadline_us > 0) {
+                    wait_us = std::min(wait_us, t_deadline_us - t_now_us);
+                }
+                cv.wait_for(lock, std::chrono::microseconds(wait_us));
+                continue;
+            }
+            waiting.erase(std::find(waiting.begin(), waiting.end(), &w));
+            return nullptr;
+        }
+
+        return w.state;
     }
-}
 
-std::string output_str(struct whisper_context * ctx, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::stringstream result;
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        std::string speaker = "";
+    // nullptr unless a state is free now and no request is waiting for one
+    whisper_state * try_acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
 
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+        if (!waiting.empty() || free_states.empty()) {
+            return nullptr;
         }
 
-        result << speaker << text << "\n";
+        whisper_state * state = free_states.back();
+        free_states.pop_back();
+        return state;
     }
-    return result.str();
-}
 
-bool parse_str_to_bool(const std::string & s) {
-    if (s == "true" || s == "1" || s == "yes" || s == "y") {
-        return true;
+    void stats(int & n_states, int & n_waiting, int & n_busy) {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_states  = states.size();
+        n_waiting = waiting.size();
+        n_busy    = states.size() - free_states.size();
     }
-    return false;
-}
 
-void get_req_parameters(const Request & req, whisper_params & params)
-{
-    if (req.has_file("offset_t"))
-    {
-        params.offset_t_ms = std::stoi(req.get_file_value("offset_t").content);
+    // hands the state to the first waiting request, if any
+    // the results and prompt history of the last request are cleared, the buffers stay allocated
+    // held_ms: time the request held the state, for the expected waits (0 - not a request)
+    void release(whisper_state * state, double held_ms = 0.0) {
+        whisper_state_reset(state);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (held_ms > 0.0) {
+                service_ms = service_ms > 0.0 ? 0.9*service_ms + 0.1*held_ms : held_ms;
+            }
+
+            if (waiting.empty()) {
+                free_states.push_back(state);
+                return;
+            }
+
+            auto it = std::min_element(waiting.begin(), waiting.end(), [](const waiter * a, const waiter * b) {
+                return a->priority != b->priority ? a->priority > b->priority : a->seq < b->seq;
+            });
+            (*it)->state = state;
+            waiting.erase(it);
+        }
+        cv.notify_all();
     }
-    if (req.has_file("offset_n"))
-    {
-        params.offset_n = std::stoi(req.get_file_value("offset_n").content);
+};
+
+// Time spent in each stage of a request. mel, encode and decode come from the
+// metrics of the whisper state that ran it; decode includes token sampling.
+struct request_timings {
+    double wait_ms   = 0.0; // for a state or the model lock
+    double audio_ms  = 0.0; // decoding the uploaded file
+    double mel_ms    = 0.0;
+    double encode_ms = 0.0;
+    double decode_ms = 0.0;
+    double total_ms  = 0.0;
+
+    int64_t n_tokens = 0; // in the result, special tokens included
+
+    void add_state_delta(const whisper_metrics & m0, const whisper_metrics & m1) {
+        mel_ms    += 1e-3*(m1.t_mel_us    - m0.t_mel_us);
+        encode_ms += 1e-3*(m1.t_encode_us - m0.t_encode_us);
+        decode_ms += 1e-3*((m1.t_decode_us + m1.t_batchd_us + m1.t_prompt_us + m1.t_sample_us) -
+                           (m0.t_decode_us + m0.t_batchd_us + m0.t_prompt_us + m0.t_sample_us));
     }
-    if (req.has_file("duration"))
-    {
-        params.duration_ms = std::stoi(req.get_file_value("duration").content);
+
+    json to_json() const {
+        return json{
+            {"wait_ms",   wait_ms},
+            {"audio_ms",  audio_ms},
+            {"mel_ms",    mel_ms},
+            {"encode_ms", encode_ms},
+            {"decode_ms", decode_ms},
+            {"total_ms",  total_ms},
+        };
     }
-    if (req.has_file("max_context"))
-    {
-        params.max_context = std::stoi(req.get_file_value("max_context").content);
+};
+
+// Request counts and latency histograms of the request stages, exported at
+// /metrics in the Prometheus text format
+struct server_metrics {
+    // seconds: the default buckets of the Prometheus clients, extended to a minute
+    static constexpr double buckets[] = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0 };
+    static constexpr int    n_buckets = sizeof(buckets)/sizeof(buckets[0]);
+
+    struct histogram {
+        int64_t count = 0;
+        double  sum   = 0.0;
+        int64_t counts[n_buckets] = {}; // not cumulative
+
+        void observe(double s) {
+            count++;
+            sum += s;
+            for (int i = 0; i < n_buckets; ++i) {
+                if (s <= buckets[i]) {
+                    counts[i]++;
+                    break;
+                }
+            }
+        }
+    };
+
+    std::mutex mutex;
+
+    std::map<std::string, int64_t> requests; // by outcome
+    double  audio_s  = 0.0;
+    int64_t n_tokens = 0;
+
+    histogram wait, audio, mel, encode, decode, total;
+
+    void count(const std::string & outcome) {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests[outcome]++;
     }
-    if (req.has_file("max_len"))
-    {
-        params.max_len = std::stoi(req.get_file_value("max_len").content);
+
+    void observe(const request_timings & t, double duration_s) {
+        std::lock_guard<std::mutex> lock(mutex);
+        audio_s  += duration_s;
+        n_tokens += t.n_tokens;
+        wait  .observe(1e-3*t.wait_ms);
+        audio .observe(1e-3*t.audio_ms);
+        mel   .observe(1e-3*t.mel_ms);
+        encode.observe(1e-3*t.encode_ms);
+        decode.observe(1e-3*t.decode_ms);
+        total .observe(1e-3*t.total_ms);
     }
-    if (req.has_file("best_of"))
-    {
-        params.best_of = std::stoi(req.get_file_value("best_of").content);
+
+    // counters and histograms; the gauges are added by the caller
+    void render(std::stringstream & ss) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        ss << "# HELP whisper_requests_total Transcription requests by outcome.\n";
+        ss << "# TYPE whisper_requests_total counter\n";
+        for (const auto & it : requests) {
+            ss << "whisper_requests_total{outcome=\"" << it.first << "\"} " << it.second << "\n";
+        }
+
+        ss << "# HELP whisper_audio_seconds_total Seconds of audio transcribed.\n";
+        ss << "# TYPE whisper_audio_seconds_total counter\n";
+        ss << "whisper_audio_seconds_total " << audio_s << "\n";
+
+        ss << "# HELP whisper_tokens_total Tokens in the transcriptions.\n";
+        ss << "# TYPE whisper_tokens_total counter\n";
+        ss << "whisper_tokens_total " << n_tokens << "\n";
+
+        ss << "# HELP whisper_request_stage_seconds Time per request in each stage.\n";
+        ss << "# TYPE whisper_request_stage_seconds histogram\n";
+
+        const std::pair<const char *, const histogram *> stages[] = {
+            { "wait", &wait }, { "audio", &audio }, { "mel", &mel }, { "encode", &encode }, { "decode", &decode }, { "total", &total },
+        };
+        for (const auto & stage : stages) {
+            const histogram & h = *stage.second;
+
+            int64_t n = 0;
+            for (int i = 0; i < n_buckets; ++i) {
+                n += h.counts[i];
+                ss << "whisper_request_stage_seconds_bucket{stage=\"" << stage.first << "\",le=\"" << buckets[i] << "\"} " << n << "\n";
+            }
+            ss << "whisper_request_stage_seconds_bucket{stage=\"" << stage.first << "\",le=\"+Inf\"} " << h.count << "\n";
+            ss << "whisper_request_stage_seconds_sum{stage=\""    << stage.first << "\"} " << h.sum   << "\n";
+            ss << "whisper_request_stage_seconds_count{stage=\""  << stage.first << "\"} " << h.count << "\n";
+        }
     }
-    if (req.has_file("beam_size"))
-    {
-        params.beam_size = std::stoi(req.get_file_value("beam_size").content);
+};
+
+struct state_lease {
+    state_pool & pool;
+    state_pool::wait_status status;
+    whisper_state * state;
+    int64_t t_acquired_us;
+
+    state_lease(state_pool & pool, int priority, int64_t t_deadline_us, const std::function<bool()> & closed, bool bounded = true)
+        : pool(pool), state(pool.acquire(priority, t_deadline_us, closed, status, bounded)), t_acquired_us(ggml_time_us()) {}
+    ~state_lease() {
+        if (state) {
+            pool.release(state, 1e-3*(ggml_time_us() - t_acquired_us));
+        }
     }
-    if (req.has_file("audio_ctx"))
-    {
-        params.audio_ctx = std::stof(req.get_file_value("audio_ctx").content);
+
+    state_lease(const state_lease &) = delete;
+    state_lease & operator=(const state_lease &) = delete;
+};
+
+// Models served by name besides the one given with -m (or /load). A model is
+// loaded on first use with a pool of n_states states; when loading it would
+// exceed mem_budget, models without requests are unloaded, least recently used
+// first. With mmap loading the weights stay in the page cache when unloaded.
+struct model_registry {
+    struct model {
+        std::string       path;
+        whisper_context * ctx = nullptr;
+        state_pool        pool;
+        size_t            size    = 0;     // file size + states, once loaded
+        int               n_refs  = 0;
+        uint64_t          t_used  = 0;
+        bool              loading = false;
+    };
+
+    whisper_context_params cparams;
+
+    int    n_states    = 1;
+    int    max_waiting = 64;
+    int    max_wait_ms = 0;
+    size_t mem_budget  = 0; // 0 - no limit
+
+    std::map<std::string, std::unique_ptr<model>> models;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    uint64_t                n_used = 0;
+
+    ~model_registry() {
+        for (auto & it : models) {
+            unload(*it.second);
+        }
     }
-    if (req.has_file("word_thold"))
-    {
-        params.word_thold = std::stof(req.get_file_value("word_thold").content);
+
+    void add(const std::string & name, const std::string & path) {
+        auto m = std::make_unique<model>();
+        m->path = path;
+        m->pool.max_waiting = max_waiting;
+        m->pool.max_wait_ms = max_wait_ms;
+        models[name] = std::move(m);
     }
-    if (req.has_file("entropy_thold"))
-    {
-        params.entropy_thold = std::stof(req.get_file_value("entropy_thold").content);
+
+    // nullptr if the model is unknown or fails to load
+    model * acquire(const std::string & name) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto it = models.find(name);
+        if (it == models.end()) {
+            return nullptr;
+        }
+        model & m = *it->second;
+
+        cv.wait(lock, [&] { return !m.loading; });
+
+        m.n_refs++;
+        m.t_used = ++n_used;
+        if (m.ctx) {
+            return &m;
+        }
+
+        evict(file_size(m.path));
+
+        m.loading = true;
+        lock.unlock();
+
+        fprintf(stderr, "%s: loading model '%s' from '%s'\n", __func__, name.c_str(), m.path.c_str());
+
+        // with the default state for VAD and --processors
+        whisper_context * ctx = whisper_init_from_file_with_params(m.path.c_str(), cparams);
+        if (ctx && !m.pool.init(ctx, n_states, 0)) {
+            m.pool.clear();
+            whisper_free(ctx);
+            ctx = nullptr;
+        }
+
+        lock.lock();
+        m.loading = false;
+        cv.notify_all();
+
+        if (ctx == nullptr) {
+            fprintf(stderr, "%s: failed to load model '%s'\n", __func__, name.c_str());
+            m.n_refs--;
+            return nullptr;
+        }
+
+        m.ctx  = ctx;
+        m.size = file_size(m.path);
+        for (auto * state : m.pool.states) {
+            m.size += whisper_state_memory_size(state);
+        }
+        if (!m.pool.states.empty()) {
+            // the default state is as large
+            m.size += whisper_state_memory_size(m.pool.states[0]);
+        }
+
+        return &m;
     }
-    if (req.has_file("logprob_thold"))
-    {
-        params.logprob_thold = std::stof(req.get_file_value("logprob_thold").content);
+
+    void release(model * m) {
+        std::lock_guard<std::mutex> lock(mutex);
+        m->n_refs--;
     }
-    if (req.has_file("debug_mode"))
-    {
-        params.debug_mode = parse_str_to_bool(req.get_file_value("debug_mode").content);
+
+    // name, states, waiting requests and busy states of each loaded model
+    std::vector<std::tuple<std::string, int, int, int>> stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::tuple<std::string, int, int, int>> result;
+        for (auto & it : models) {
+            if (it.second->ctx) {
+                int n_states  = 0;
+                int n_waiting = 0;
+                int n_busy    = 0;
+                it.second->pool.stats(n_states, n_waiting, n_busy);
+                result.emplace_back(it.first, n_states, n_waiting, n_busy);
+            }
+        }
+        return result;
     }
-    if (req.has_file("translate"))
-    {
-        params.translate = parse_str_to_bool(req.get_file_value("translate").content);
+
+    json list() {
+        std::lock_guard<std::mutex> lock(mutex);
+        json jres = json::array();
+        for (auto & it : models) {
+            jres.push_back(json{
+                {"name",   it.first},
+                {"loaded", it.second->ctx != nullptr},
+                {"in_use", it.second->n_refs},
+            });
+        }
+        return jres;
     }
-    if (req.has_file("diarize"))
-    {
-        params.diarize = parse_str_to_bool(req.get_file_value("diarize").content);
+
+private:
+    static size_t file_size(const std::string & path) {
+        std::ifstream f(path, std::ios::binary | std::ios::ate);
+        return f ? (size_t) f.tellg() : 0;
     }
-    if (req.has_file("tinydiarize"))
+
+    static void unload(model & m) {
+        if (m.ctx) {
+            m.pool.clear();
+            whisper_free(m.ctx);
+            m.ctx  = nullptr;
+            m.size = 0;
+        }
+    }
+
+    // makes room for a model of size bytes, called with the mutex held
+    void evict(size_t size) {
+        if (mem_budget == 0) {
+            return;
+        }
+
+        size_t total = size;
+        for (auto & it : models) {
+            total += it.second->size;
+        }
+
+        while (total > mem_budget) {
+            auto lru = models.end();
+            for (auto it = models.begin(); it != models.end(); ++it) {
+                const model & m = *it->second;
+                if (m.ctx && m.n_refs == 0 && (lru == models.end() || m.t_used < lru->second->t_used)) {
+                    lru = it;
+                }
+            }
+            if (lru == models.end()) {
+                fprintf(stderr, "%s: all loaded models are in use, exceeding the memory budget\n", __func__);
+                break;
+            }
+            fprintf(stderr, "%s: unloading model '%s'\n", __func__, lru->first.c_str());
+            total -= lru->second->size;
+            unload(*lru->second);
+        }
+    }
+};
+
+struct model_lease {
+    model_registry        & registry;
+    model_registry::model * model;
+
+    model_lease(model_registry & registry, const std::string & name) : registry(registry), model(registry.acquire(name)) {}
+    ~model_lease() {
+        if (model) {
+            registry.release(model);
+        }
+    }
+
+    model_lease(const model_lease &) = delete;
+    model_lease & operator=(const model_lease &) = delete;
+};
+
+// Gathers the encoder windows of concurrent requests and evaluates them with
+// whisper_encode_batch(). Requests submit each window from the encoder window
+// callback of whisper_full_with_state(), which then finds it in the encoder cache
+// of their state. A batch closes when it is full, when every running request is
+// in it, or when its oldest window has waited wait_ms.
+struct encode_batcher {
+    struct job {
+        whisper_state * state;
+        int offset;
+        int audio_ctx;
+        std::chrono::steady_clock::time_point t_submit;
+
+        bool done   = false;
+        int  result = 0;
+    };
+
+    whisper_context * ctx = nullptr;
+
+    int n_batch   = 1;
+    int wait_ms   = 0;
+    int n_threads = 1;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<job *> queue;
+    int  n_active = 0; // requests between begin() and end()
+    bool running = false;
+    std::thread worker;
+
+    void start(whisper_context * ctx_, int n_batch_, int wait_ms_, int n_threads_) {
+        ctx       = ctx_;
+        n_batch   = n_batch_;
+        wait_ms   = wait_ms_;
+        n_threads = n_threads_;
+        running   = true;
+        worker    = std::thread([this] { loop(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // only while no job is pending
+    void set_context(whisper_context * ctx_) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ctx = ctx_;
+    }
+
+    void begin() {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_active++;
+    }
+
+    void end() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            n_active--;
+        }
+        cv.notify_all();
+    }
+
+    // encoder_window_callback, user_data is the batcher
+    static void encode_window(whisper_context * /*ctx*/, whisper_state * state, int offset, int audio_ctx, void * user_data) {
+        ((encode_batcher *) user_data)->encode(state, offset, audio_ctx);
+    }
+
+    // blocks until the batch holding this window has been evaluated
+    int encode(whisper_state * state, int offset, int audio_ctx) {
+        job j = { state, offset, audio_ctx, std::chrono::steady_clock::now() };
+
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.push_back(&j);
+        cv.notify_all();
+        cv.wait(lock, [&] { return j.done; });
+
+        return j.result;
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&] { return !running || !queue.empty(); });
+            if (!running && queue.empty()) {
+                break;
+            }
+
+            const auto deadline = queue.front()->t_submit + std::chrono::milliseconds(wait_ms);
+            cv.wait_until(lock, deadline, [&] { return !running || (int) queue.size() >= std::max(1, std::min(n_batch, n_active)); });
+
+            // windows of one graph must share the audio context
+            const int audio_ctx = queue.front()->audio_ctx;
+
+            std::vector<job *> batch;
+            for (auto it = queue.begin(); it != queue.end() && (int) batch.size() < n_batch; ) {
+                if ((*it)->audio_ctx == audio_ctx) {
+                    batch.push_back(*it);
+                    it = queue.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            std::vector<whisper_state *> states;
+            std::vector<int> offsets;
+            for (auto * j : batch) {
+                states.push_back(j->state);
+                offsets.push_back(j->offset);
+            }
+
+            lock.unlock();
+            const int result = whisper_encode_batch(ctx, states.data(), offsets.data(), (int) batch.size(), audio_ctx, n_threads);
+            lock.lock();
+
+            for (auto * j : batch) {
+                j->done   = true;
+                j->result = result;
+            }
+            cv.notify_all();
+        }
+    }
+};
+
+void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, int progress, void * user_data) {
+    int progress_step = ((whisper_print_user_data *) user_data)->params->progress_step;
+    int * progress_prev  = &(((whisper_print_user_data *) user_data)->progress_prev);
+    if (progress >= *progress_prev + progress_step) {
+        *progress_prev += progress_step;
+        fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress);
+    }
+}
+
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    const auto & params  = *((whisper_print_user_data *) user_data)->params;
+    const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    std::string speaker = "";
+
+    int64_t t0 = 0;
+    int64_t t1 = 0;
+
+    // print the last n_new segments
+    const int s0 = n_segments - n_new;
+
+    if (s0 == 0) {
+        printf("\n");
+    }
+
+    for (int i = s0; i < n_segments; i++) {
+        if (!params.no_timestamps || params.diarize) {
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
+        }
+
+        if (!params.no_timestamps) {
+            printf("[%s --> %s]  ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
+        }
+
+        if (params.diarize && pcmf32s.size() == 2) {
+            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+        }
+
+        if (params.print_colors) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
+                if (params.print_special == false) {
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
+                    if (id >= whisper_token_eot(ctx)) {
+                        continue;
+                    }
+                }
+
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state(state, i, j);
+
+                const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
+
+                printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
+            }
+        } else {
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
+
+            printf("%s%s", speaker.c_str(), text);
+        }
+
+        if (params.tinydiarize) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
+                printf("%s", params.tdrz_speaker_turn.c_str());
+            }
+        }
+
+        // with timestamps or speakers: each segment on new line
+        if (!params.no_timestamps || params.diarize) {
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+}
+
+std::string output_str(const whisper_result & wres, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+    std::stringstream result;
+    const int n_segments = wres.n_segments();
+    for (int i = 0; i < n_segments; ++i) {
+        const char * text = wres.segment_text(i);
+        std::string speaker = "";
+
+        if (params.diarize && pcmf32s.size() == 2)
+        {
+            const int64_t t0 = wres.segment_t0(i);
+            const int64_t t1 = wres.segment_t1(i);
+            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+        }
+
+        result << speaker << text << "\n";
+    }
+    return result.str();
+}
+
+bool parse_str_to_bool(const std::string & s) {
+    if (s == "true" || s == "1" || s == "yes" || s == "y") {
+        return true;
+    }
+    return false;
+}
+
+void get_req_parameters(const Request & req, whisper_params & params)
+{
+    if (req.has_file("offset_t"))
+    {
+        params.offset_t_ms = std::stoi(req.get_file_value("offset_t").content);
+    }
+    if (req.has_file("offset_n"))
+    {
+        params.offset_n = std::stoi(req.get_file_value("offset_n").content);
+    }
+    if (req.has_file("duration"))
+    {
+        params.duration_ms = std::stoi(req.get_file_value("duration").content);
+    }
+    if (req.has_file("max_context"))
+    {
+        params.max_context = std::stoi(req.get_file_value("max_context").content);
+    }
+    if (req.has_file("max_len"))
+    {
+        params.max_len = std::stoi(req.get_file_value("max_len").content);
+    }
+    if (req.has_file("best_of"))
+    {
+        params.best_of = std::stoi(req.get_file_value("best_of").content);
+    }
+    if (req.has_file("beam_size"))
+    {
+        params.beam_size = std::stoi(req.get_file_value("beam_size").content);
+    }
+    if (req.has_file("audio_ctx"))
+    {
+        params.audio_ctx = std::stof(req.get_file_value("audio_ctx").content);
+    }
+    if (req.has_file("word_thold"))
+    {
+        params.word_thold = std::stof(req.get_file_value("word_thold").content);
+    }
+    if (req.has_file("entropy_thold"))
+    {
+        params.entropy_thold = std::stof(req.get_file_value("entropy_thold").content);
+    }
+    if (req.has_file("logprob_thold"))
+    {
+        params.logprob_thold = std::stof(req.get_file_value("logprob_thold").content);
+    }
+    if (req.has_file("debug_mode"))
+    {
+        params.debug_mode = parse_str_to_bool(req.get_file_value("debug_mode").content);
+    }
+    if (req.has_file("translate"))
+    {
+        params.translate = parse_str_to_bool(req.get_file_value("translate").content);
+    }
+    if (req.has_file("diarize"))
+    {
+        params.diarize = parse_str_to_bool(req.get_file_value("diarize").content);
+    }
+    if (req.has_file("tinydiarize"))
     {
         params.tinydiarize = parse_str_to_bool(req.get_file_value("tinydiarize").content);
     }
@@ -546,6 +1527,10 @@ void get_req_parameters(const Request & req, whisper_params & params)
     {
         params.detect_language = parse_str_to_bool(req.get_file_value("detect_language").content);
     }
+    if (req.has_file("user"))
+    {
+        params.user = req.get_file_value("user").content;
+    }
     if (req.has_file("prompt"))
     {
         params.prompt = req.get_file_value("prompt").content;
@@ -602,6 +1587,693 @@ void get_req_parameters(const Request & req, whisper_params & params)
     {
         params.no_language_probabilities = parse_str_to_bool(req.get_file_value("no_language_probabilities").content);
     }
+    if (req.has_file("timings"))
+    {
+        params.timings = parse_str_to_bool(req.get_file_value("timings").content);
+    }
+}
+
+// key of the result cache: the audio and everything that changes the segments and tokens,
+// but not how they are rendered (response_format, offset_n, diarize, timings)
+std::string result_cache_key(const whisper_params & params, const std::string & model, const std::vector<float> & pcmf32)
+{
+    std::stringstream ss;
+    ss << std::hex << result_cache::hash(pcmf32) << std::dec << ' ' << pcmf32.size() << ' ' << model << '\n'
+       << params.language << ' ' << params.translate << ' ' << params.detect_language << ' '
+       << params.offset_t_ms << ' ' << params.duration_ms << ' ' << params.max_context << ' '
+       << params.max_len << ' ' << params.split_on_word << ' ' << params.word_thold << ' '
+       << params.best_of << ' ' << params.beam_size << ' ' << params.audio_ctx << ' ' << params.n_processors << ' '
+       << params.entropy_thold << ' ' << params.logprob_thold << ' ' << params.temperature << ' ' << params.temperature_inc << ' '
+       << params.no_timestamps << ' ' << params.tinydiarize << ' ' << params.suppress_nst << ' '
+       << (params.response_format == vjson_format) << ' ' // token timestamps
+       << params.vad << ' ' << params.vad_threshold << ' ' << params.vad_min_speech_duration_ms << ' '
+       << params.vad_min_silence_duration_ms << ' ' << params.vad_max_speech_duration_s << ' '
+       << params.vad_speech_pad_ms << ' ' << params.vad_samples_overlap << '\n'
+       << params.prompt;
+    return ss.str();
+}
+
+// A transcription submitted to /v1/jobs. The upload returns an id right away and
+// the job waits in the job queue, by priority, for one of the job runners, which
+// leases a state of the pool like a request does. The segments are kept as they
+// are decoded, for the clients that poll the job or follow its events; the job
+// and its response stay ttl_s seconds after it ends. Deleting it aborts the
+// transcription through the abort callback.
+struct transcription_job {
+    enum job_status {
+        JOB_QUEUED,
+        JOB_RUNNING,
+        JOB_DONE,
+        JOB_FAILED,
+        JOB_CANCELLED,
+    };
+
+    std::string id;
+    std::string filename;
+    int         priority = 0;
+    uint64_t    seq      = 0;
+
+    std::unique_ptr<model_lease> model; // of --models, if picked
+
+    whisper_params params;
+
+    std::vector<float>              pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+
+    std::string audio;        // the encoded upload instead of pcmf32 with --job-chunk
+    int64_t     t_offset = 0; // of the chunk being transcribed, in 10 ms units
+
+    std::atomic<bool> cancelled { false };
+
+    std::mutex              mutex;
+    std::condition_variable cv; // a new segment or the end of the job
+
+    job_status  status   = JOB_QUEUED;
+    json        segments = json::array();
+    std::string content;      // the response /inference would have given, once done
+    std::string content_type;
+    std::string error;
+
+    std::chrono::steady_clock::time_point t_end;
+
+    bool finished() const {
+        return status >= JOB_DONE;
+    }
+
+    static const char * status_str(job_status status) {
+        switch (status) {
+            case JOB_QUEUED:    return "queued";
+            case JOB_RUNNING:   return "running";
+            case JOB_DONE:      return "done";
+            case JOB_FAILED:    return "failed";
+            case JOB_CANCELLED: return "cancelled";
+        }
+        return "unknown";
+    }
+
+    // the segments from after on, and the response once done; the caller holds mutex
+    json to_json(size_t after) const {
+        json jres = json{
+            {"id",         id},
+            {"status",     status_str(status)},
+            {"n_segments", segments.size()},
+            {"segments",   json::array()},
+        };
+        for (size_t i = after; i < segments.size(); ++i) {
+            jres["segments"].push_back(segments[i]);
+        }
+        if (status == JOB_DONE) {
+            if (content_type == "application/json") {
+                jres["result"] = json::parse(content);
+            } else {
+                jres["result"] = content;
+            }
+        }
+        if (!error.empty()) {
+            jres["error"] = error;
+        }
+        return jres;
+    }
+
+    void finish(job_status s, const std::string & err = "") {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            status = s;
+            error  = err;
+            t_end  = std::chrono::steady_clock::now();
+        }
+        cv.notify_all();
+    }
+};
+
+// The jobs by id, until ttl_s after their end, and the queue of those not started.
+// Each runner thread takes the queued job of highest priority, the oldest first.
+struct job_queue {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::map<std::string, std::shared_ptr<transcription_job>> jobs;
+    std::vector<std::shared_ptr<transcription_job>>           queued;
+
+    std::vector<std::thread> runners;
+
+    bool         stopping   = false;
+    int          ttl_s      = 600;
+    int          max_queued = 64;
+    uint64_t     n_arrived  = 0;
+    std::mt19937 rng { std::random_device{}() };
+
+    // the id of the job, empty if the queue is full
+    std::string submit(const std::shared_ptr<transcription_job> & job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if ((int) queued.size() >= max_queued) {
+                return "";
+            }
+            do {
+                char buf[17];
+                snprintf(buf, sizeof(buf), "%08x%08x", (unsigned) rng(), (unsigned) rng());
+                job->id = buf;
+            } while (jobs.count(job->id));
+            job->seq = n_arrived++;
+
+            jobs[job->id] = job;
+            queued.push_back(job);
+        }
+        cv.notify_one();
+        return job->id;
+    }
+
+    std::shared_ptr<transcription_job> find(const std::string & id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        expire();
+        auto it = jobs.find(id);
+        return it == jobs.end() ? nullptr : it->second;
+    }
+
+    // a queued job is dropped, a running one aborts at its next abort callback
+    std::shared_ptr<transcription_job> cancel(const std::string & id) {
+        std::shared_ptr<transcription_job> job;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = jobs.find(id);
+            if (it == jobs.end()) {
+                return nullptr;
+            }
+            job = it->second;
+            job->cancelled = true;
+
+            auto qt = std::find(queued.begin(), queued.end(), job);
+            if (qt == queued.end()) {
+                return job;
+            }
+            queued.erase(qt);
+        }
+        job->finish(transcription_job::JOB_CANCELLED);
+        return job;
+    }
+
+    // blocks until a job is queued, nullptr once stopping
+    std::shared_ptr<transcription_job> next() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return stopping || !queued.empty(); });
+        if (stopping) {
+            return nullptr;
+        }
+        auto it = std::min_element(queued.begin(), queued.end(), [](const std::shared_ptr<transcription_job> & a, const std::shared_ptr<transcription_job> & b) {
+            return a->priority != b->priority ? a->priority > b->priority : a->seq < b->seq;
+        });
+        auto job = *it;
+        queued.erase(it);
+
+        std::lock_guard<std::mutex> jlock(job->mutex);
+        job->status = transcription_job::JOB_RUNNING;
+        return job;
+    }
+
+    void start(int n, const std::function<void(transcription_job &)> & run) {
+        for (int i = 0; i < n; ++i) {
+            runners.emplace_back([this, run]() {
+                while (auto job = next()) {
+                    run(*job);
+                    job->pcmf32.clear();
+                    job->pcmf32.shrink_to_fit();
+                    job->pcmf32s.clear();
+                    job->audio.clear();
+                    job->audio.shrink_to_fit();
+                    job->model.reset();
+                }
+            });
+        }
+    }
+
+    // running jobs are aborted, the queued ones dropped
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (auto & it : jobs) {
+                it.second->cancelled = true;
+            }
+            queued.clear();
+        }
+        cv.notify_all();
+        for (auto & t : runners) {
+            t.join();
+        }
+        runners.clear();
+        jobs.clear();
+    }
+
+    // drops the jobs that ended more than ttl_s ago, the caller holds mutex
+    void expire() {
+        const auto t_now = std::chrono::steady_clock::now();
+        for (auto it = jobs.begin(); it != jobs.end(); ) {
+            std::unique_lock<std::mutex> jlock(it->second->mutex, std::try_to_lock);
+            if (jlock.owns_lock() && it->second->finished() && t_now - it->second->t_end > std::chrono::seconds(ttl_s)) {
+                jlock.unlock();
+                it = jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void stats(int & n_queued, int & n_running, int & n_kept) {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_queued  = queued.size();
+        n_running = 0;
+        n_kept    = jobs.size();
+        for (auto & it : jobs) {
+            std::lock_guard<std::mutex> jlock(it.second->mutex);
+            n_running += it.second->status == transcription_job::JOB_RUNNING;
+        }
+    }
+};
+
+// appends the new segments of a job, for its pollers and event streams
+void job_segment_callback(struct whisper_context * /*ctx*/, struct whisper_state * state, int n_new, void * user_data) {
+    auto & job = *(transcription_job *) user_data;
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        for (int i = std::max(0, n_segments - n_new); i < n_segments; ++i) {
+            json segment = json{
+                {"id",   job.segments.size()},
+                {"text", whisper_full_get_segment_text_from_state(state, i)},
+            };
+            if (!job.params.no_timestamps) {
+                segment["start"] = (whisper_full_get_segment_t0_from_state(state, i) + job.t_offset)*0.01;
+                segment["end"]   = (whisper_full_get_segment_t1_from_state(state, i) + job.t_offset)*0.01;
+            }
+            job.segments.push_back(segment);
+        }
+    }
+    job.cv.notify_all();
+}
+
+// A live transcription: the client posts raw PCM as it is captured and each post
+// returns what the new audio produced. As in examples/stream, the window is
+// transcribed every step_ms of new audio and finalized once it reaches length_ms
+// or its speech ends; the last keep_ms of it start the next window and its text
+// becomes the prompt. The session holds a pooled state for its whole lifetime.
+struct stream_session {
+    std::unique_ptr<model_lease> model; // of --models, if picked
+
+    whisper_context * ctx;
+    state_pool      & pool;
+    whisper_state   * state;
+
+    whisper_params params;
+
+    int step_ms;
+    int length_ms;
+    int keep_ms;
+
+    std::mutex mutex;
+
+    std::vector<float>         pcmf32;       // current window
+    int64_t                    n_past = 0;   // samples before the window
+    int                        n_new  = 0;   // samples since the last transcription
+    int                        n_kept = 0;   // samples of the previous window at its start
+    std::vector<whisper_token> prompt_tokens;
+
+    std::chrono::steady_clock::time_point t_last = std::chrono::steady_clock::now();
+
+    stream_session(whisper_context * ctx, state_pool & pool, whisper_state * state) : ctx(ctx), pool(pool), state(state) {}
+    ~stream_session() {
+        pool.release(state);
+    }
+
+    stream_session(const stream_session &) = delete;
+    stream_session & operator=(const stream_session &) = delete;
+};
+
+// raw mono 16 kHz PCM, s16le or f32le
+bool stream_read_pcm(const std::string & body, const std::string & format, std::vector<float> & pcmf32) {
+    if (format == "f32le") {
+        const size_t n = body.size()/sizeof(float);
+        const size_t n0 = pcmf32.size();
+        pcmf32.resize(n0 + n);
+        memcpy(pcmf32.data() + n0, body.data(), n*sizeof(float));
+        return true;
+    }
+    if (format == "s16le") {
+        const size_t n = body.size()/sizeof(int16_t);
+        const int16_t * data = (const int16_t *) body.data();
+        pcmf32.reserve(pcmf32.size() + n);
+        for (size_t i = 0; i < n; ++i) {
+            pcmf32.push_back(float(data[i])/32768.0f);
+        }
+        return true;
+    }
+    return false;
+}
+
+// transcribes the window once step_ms of new audio arrived (or at the end of the
+// stream) and adds the finalized segments and the partial text to jres
+bool stream_step(stream_session & s, bool flush, json & jres) {
+    whisper_context * ctx = s.ctx;
+
+    const whisper_params & params = s.params;
+
+    const int n_samples_step = (int64_t) s.step_ms  *WHISPER_SAMPLE_RATE/1000;
+    const int n_samples_len  = (int64_t) s.length_ms*WHISPER_SAMPLE_RATE/1000;
+    const int n_samples_keep = (int64_t) s.keep_ms  *WHISPER_SAMPLE_RATE/1000;
+
+    if ((int) s.pcmf32.size() <= s.n_kept || (!flush && s.n_new < n_samples_step)) {
+        return true;
+    }
+    s.n_new = 0;
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+    wparams.audio_ctx        = params.audio_ctx;
+    wparams.lid_audio_ctx    = params.lid_audio_ctx;
+    wparams.lid_thold        = params.lid_thold;
+    wparams.lid_cache        = true; // the session keeps its state, the language is detected once
+    wparams.single_segment   = true;
+    wparams.no_timestamps    = true;
+    wparams.no_context       = true;
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.temperature      = params.temperature;
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : params.temperature_inc;
+    wparams.no_speech_thold  = params.no_speech_thold;
+    wparams.no_speech_skip_thold = params.no_speech_skip;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+    wparams.suppress_nst     = params.suppress_nst;
+
+    if (s.prompt_tokens.empty()) {
+        wparams.initial_prompt = params.prompt.c_str();
+    } else {
+        wparams.prompt_tokens   = s.prompt_tokens.data();
+        wparams.prompt_n_tokens = s.prompt_tokens.size();
+    }
+
+    if (whisper_full_with_state(ctx, s.state, wparams, s.pcmf32.data(), s.pcmf32.size()) != 0) {
+        return false;
+    }
+
+    const whisper_result wres = { ctx, s.state };
+
+    std::string text;
+    for (int i = 0; i < wres.n_segments(); ++i) {
+        text += wres.segment_text(i);
+    }
+
+    bool done = flush || (int) s.pcmf32.size() >= n_samples_len;
+    if (!done && s.pcmf32.size() > 2*WHISPER_SAMPLE_RATE) {
+        // vad_simple filters its input in place
+        std::vector<float> pcm = s.pcmf32;
+        done = ::vad_simple(pcm, WHISPER_SAMPLE_RATE, 1000, 0.6f, 100.0f, false);
+    }
+
+    if (!done) {
+        jres["partial"] = text;
+        return true;
+    }
+
+    if (!text.empty()) {
+        jres["segments"].push_back(json{
+            {"start", float(s.n_past)/WHISPER_SAMPLE_RATE},
+            {"end",   float(s.n_past + s.pcmf32.size())/WHISPER_SAMPLE_RATE},
+            {"text",  text},
+        });
+    }
+    jres["partial"] = "";
+
+    s.prompt_tokens.clear();
+    for (int i = 0; i < wres.n_segments(); ++i) {
+        for (int j = 0; j < wres.n_tokens(i); ++j) {
+            const whisper_token id = wres.token_data(i, j).id;
+            if (id < whisper_token_eot(ctx)) {
+                s.prompt_tokens.push_back(id);
+            }
+        }
+    }
+
+    const int n_keep = flush ? 0 : std::min((int) s.pcmf32.size(), n_samples_keep);
+    s.n_past += s.pcmf32.size() - n_keep;
+    s.pcmf32.erase(s.pcmf32.begin(), s.pcmf32.end() - n_keep);
+    s.n_kept = n_keep;
+
+    return true;
+}
+
+// the whisper_full() parameters of a transcription request; the strings point into params
+whisper_full_params make_full_params(const whisper_params & params) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.detect_language  = params.detect_language;
+    wparams.lid_audio_ctx    = params.lid_audio_ctx;
+    wparams.lid_thold        = params.lid_thold;
+    wparams.n_threads        = params.n_threads;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+
+    wparams.thold_pt         = params.word_thold;
+    wparams.max_len          = params.max_len == 0 ? 60 : params.max_len;
+    wparams.split_on_word    = params.split_on_word;
+    wparams.audio_ctx        = params.audio_ctx;
+
+    wparams.debug_mode       = params.debug_mode;
+
+    wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+    wparams.initial_prompt   = params.prompt.c_str();
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.temperature      = params.temperature;
+    wparams.no_speech_thold = params.no_speech_thold;
+    wparams.no_speech_skip_thold = params.no_speech_skip;
+    wparams.temperature_inc  = params.temperature_inc;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+
+    wparams.no_timestamps    = params.no_timestamps;
+    wparams.token_timestamps = !params.no_timestamps && params.response_format == vjson_format;
+    wparams.no_context       = params.no_context;
+
+    wparams.suppress_nst     = params.suppress_nst;
+
+    wparams.vad              = params.vad;
+    wparams.vad_model_path   = params.vad_model.c_str();
+
+    wparams.vad_params.threshold               = params.vad_threshold;
+    wparams.vad_params.min_speech_duration_ms  = params.vad_min_speech_duration_ms;
+    wparams.vad_params.min_silence_duration_ms = params.vad_min_silence_duration_ms;
+    wparams.vad_params.max_speech_duration_s   = params.vad_max_speech_duration_s;
+    wparams.vad_params.speech_pad_ms           = params.vad_speech_pad_ms;
+    wparams.vad_params.samples_overlap         = params.vad_samples_overlap;
+
+    return wparams;
+}
+
+// WAV, MP3, FLAC and Ogg Vorbis are decoded in memory, ffmpeg (--convert) is only needed for other formats
+bool read_upload_audio(const std::string & content, bool diarize, bool ffmpeg_converter,
+        std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s, std::string & error_resp) {
+    if (::read_audio_data_from_memory(content.data(), content.size(), pcmf32, pcmf32s, diarize)) {
+        return true;
+    }
+
+    if (!ffmpeg_converter) {
+        fprintf(stderr, "error: failed to read audio data\n");
+        error_resp = "{\"error\":\"failed to read audio data\"}";
+        return false;
+    }
+
+    // convert to wav through a temporary file
+    const std::string temp_filename = generate_temp_filename("whisper-server", ".wav");
+    std::ofstream temp_file{temp_filename, std::ios::binary};
+    temp_file << content;
+    temp_file.close();
+
+    error_resp = "{\"error\":\"Failed to execute ffmpeg command.\"}";
+    if (!convert_to_wav(temp_filename, error_resp)) {
+        return false;
+    }
+
+    // read audio content into pcmf32
+    const bool ok = ::read_audio_data(temp_filename, pcmf32, pcmf32s, diarize);
+    if (!ok) {
+        fprintf(stderr, "error: failed to read WAV file '%s'\n", temp_filename.c_str());
+        error_resp = "{\"error\":\"failed to read WAV file\"}";
+    }
+    // remove temp file
+    std::remove(temp_filename.c_str());
+
+    return ok;
+}
+
+// the response to a transcription in params.response_format; fresh, if set, keeps the language
+// probabilities of verbose_json for the result cache
+void render_result(const whisper_result & wres, const whisper_params & params, const std::vector<std::vector<float>> & pcmf32s,
+        float duration_s, const request_timings & timings, cached_result * fresh, std::string & content, std::string & content_type) {
+    if (params.response_format == text_format)
+    {
+        content = output_str(wres, params, pcmf32s);
+        content_type = "text/html; charset=utf-8";
+    }
+    else if (params.response_format == srt_format)
+    {
+        std::stringstream ss;
+        const int n_segments = wres.n_segments();
+        for (int i = 0; i < n_segments; ++i) {
+            const char * text = wres.segment_text(i);
+            const int64_t t0 = wres.segment_t0(i);
+            const int64_t t1 = wres.segment_t1(i);
+            std::string speaker = "";
+
+            if (params.diarize && pcmf32s.size() == 2)
+            {
+                speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+            }
+
+            ss << i + 1 + params.offset_n << "\n";
+            ss << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
+            ss << speaker << text << "\n\n";
+        }
+        content = ss.str();
+        content_type = "application/x-subrip";
+    } else if (params.response_format == vtt_format) {
+        std::stringstream ss;
+
+        ss << "WEBVTT\n\n";
+
+        const int n_segments = wres.n_segments();
+        for (int i = 0; i < n_segments; ++i) {
+            const char * text = wres.segment_text(i);
+            const int64_t t0 = wres.segment_t0(i);
+            const int64_t t1 = wres.segment_t1(i);
+            std::string speaker = "";
+
+            if (params.diarize && pcmf32s.size() == 2)
+            {
+                speaker = estimate_diarization_speaker(pcmf32s, t0, t1, true);
+                speaker.insert(0, "<v Speaker");
+                speaker.append(">");
+            }
+
+            ss << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
+            ss << speaker << text << "\n\n";
+        }
+        content = ss.str();
+        content_type = "text/vtt";
+    } else if (params.response_format == vjson_format) {
+        /* try to match openai/whisper's Python format */
+        std::string results = output_str(wres, params, pcmf32s); 
+        json jres = json{
+            {"task", params.translate ? "translate" : "transcribe"},
+            {"language", whisper_lang_str_full(wres.lang_id())},
+            {"duration", duration_s},
+            {"text", results},
+            {"segments", json::array()}
+        };
+        // Only compute language probabilities if requested (expensive operation)
+        if (!params.no_language_probabilities) {
+            std::vector<float> lang_probs(whisper_lang_max_id() + 1, 0.0f);
+            const auto detected_lang_id = wres.lang_auto_detect(params.n_threads, lang_probs.data());
+            if (fresh) {
+                fresh->lang_probs_id = detected_lang_id;
+                fresh->lang_probs    = lang_probs;
+            }
+            jres["detected_language"] = whisper_lang_str_full(detected_lang_id);
+            jres["detected_language_probability"] = lang_probs[detected_lang_id];
+            jres["language_probabilities"] = json::object();
+            // Add all language probabilities
+            for (int i = 0; i <= whisper_lang_max_id(); ++i) {
+                if (lang_probs[i] > 0.001f) { // Only include non-negligible probabilities
+                    jres["language_probabilities"][whisper_lang_str(i)] = lang_probs[i];
+                }
+            }
+        }
+        const int n_segments = wres.n_segments();
+        for (int i = 0; i < n_segments; ++i)
+        {
+            json segment = json{
+                {"id", i},
+                {"text", wres.segment_text(i)},
+            };
+
+            if (!params.no_timestamps) {
+                segment["start"] = wres.segment_t0(i) * 0.01;
+                segment["end"] = wres.segment_t1(i) * 0.01;
+            }
+
+            float total_logprob = 0;
+            const int n_tokens = wres.n_tokens(i);
+            for (int j = 0; j < n_tokens; ++j) {
+                whisper_token_data token = wres.token_data(i, j);
+                if (token.id >= whisper_token_eot(wres.ctx)) {
+                    continue;
+                }
+
+                segment["tokens"].push_back(token.id);
+                json word = json{{"word", wres.token_text(i, j)}};
+                if (!params.no_timestamps) {
+                    word["start"] = token.t0 * 0.01;
+                    word["end"] = token.t1 * 0.01;
+                    word["t_dtw"] = token.t_dtw;
+                }
+                word["probability"] = token.p;
+                total_logprob += token.plog;
+                segment["words"].push_back(word);
+            }
+
+            segment["temperature"] = params.temperature;
+            segment["avg_logprob"] = total_logprob / n_tokens;
+
+            // TODO compression_ratio and no_speech_prob are not implemented yet
+            // segment["compression_ratio"] = 0;
+            segment["no_speech_prob"] = wres.segment_no_speech_prob(i);
+
+            jres["segments"].push_back(segment);
+        }
+        if (params.timings) {
+            jres["timings"] = timings.to_json();
+        }
+        content = jres.dump(-1, ' ', false, json::error_handler_t::replace);
+        content_type = "application/json";
+    }
+    // TODO add more output formats
+    else
+    {
+        std::string results = output_str(wres, params, pcmf32s);
+        json jres = json{
+            {"text", results}
+        };
+        if (params.timings) {
+            jres["timings"] = timings.to_json();
+        }
+        content = jres.dump(-1, ' ', false, json::error_handler_t::replace);
+        content_type = "application/json";
+    }
 }
 
 }  // namespace
@@ -612,7 +2284,8 @@ int main(int argc, char ** argv) {
     whisper_params params;
     server_params sparams;
 
-    std::mutex whisper_mutex;
+    // shared by batched requests, exclusive for everything else and for /load
+    std::shared_mutex whisper_mutex;
 
     if (whisper_params_parse(argc, argv, params, sparams) == false) {
         whisper_print_usage(argc, argv, params, sparams);
@@ -634,11 +2307,32 @@ int main(int argc, char ** argv) {
     if (sparams.ffmpeg_converter) {
         check_ffmpeg_availibility();
     }
+
+    const bool batching = sparams.batch_size > 1;
     // whisper init
     struct whisper_context_params cparams = whisper_context_default_params();
 
-    cparams.use_gpu    = params.use_gpu;
-    cparams.flash_attn = params.flash_attn;
+    cparams.use_gpu      = params.use_gpu;
+    cparams.flash_attn   = params.flash_attn;
+    cparams.n_gpu_layers = params.n_gpu_layers;
+    cparams.use_hugepages = params.use_hugepages;
+    cparams.numa_replicate = params.numa_replicate;
+    cparams.n_gpu_devices  = params.n_gpu_devices;
+
+    cparams.type_kv = GGML_TYPE_COUNT;
+    for (int t = 0; t < GGML_TYPE_COUNT; ++t) {
+        if (params.kv_type == ggml_type_name((ggml_type) t)) {
+            cparams.type_kv = (ggml_type) t;
+        }
+    }
+    if (cparams.type_kv == GGML_TYPE_COUNT) {
+        fprintf(stderr, "error: unknown KV cache type '%s'\n", params.kv_type.c_str());
+        whisper_print_usage(argc, argv, params, sparams);
+        exit(1);
+    }
+
+    // lets whisper_full_with_state() pick up the batched encoder output
+    cparams.encoder_cache = batching;
 
     if (!params.dtw.empty()) {
         cparams.dtw_token_timestamps = true;
@@ -692,13 +2386,79 @@ int main(int argc, char ** argv) {
 
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
 
-    if (ctx == nullptr) {
-        fprintf(stderr, "error: failed to initialize whisper context\n");
-        return 3;
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 3;
+    }
+
+    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
+    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+
+    state_pool     pool;
+    encode_batcher batcher;
+
+    const int    n_states   = std::max(1, std::max(sparams.n_parallel, sparams.batch_size));
+    const size_t mem_budget = (size_t) std::max(0, sparams.mem_budget_mb)*1024*1024;
+
+    pool.max_waiting = std::max(0, sparams.max_queue);
+    pool.max_wait_ms = std::max(0, sparams.max_wait_ms);
+    if (!pool.init(ctx, n_states, mem_budget)) {
+        fprintf(stderr, "error: failed to initialize %d whisper states\n", n_states);
+        return 3;
+    }
+
+    model_registry registry;
+
+    registry.cparams     = cparams;
+    registry.n_states    = n_states;
+    registry.max_waiting = pool.max_waiting;
+    registry.max_wait_ms = pool.max_wait_ms;
+    registry.mem_budget  = (size_t) std::max(0, sparams.models_budget_mb)*1024*1024;
+    {
+        std::stringstream ss(sparams.models);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            const size_t pos = item.find('=');
+            if (pos == std::string::npos || pos == 0) {
+                fprintf(stderr, "error: invalid --models entry '%s', expected NAME=PATH\n", item.c_str());
+                return 1;
+            }
+            const std::string path = item.substr(pos + 1);
+            if (!is_file_exist(path.c_str())) {
+                fprintf(stderr, "error: model '%s' not found\n", path.c_str());
+                return 1;
+            }
+            registry.add(item.substr(0, pos), path);
+        }
+    }
+
+    server_metrics metrics;
+
+    result_cache cache;
+    cache.max_bytes = (size_t) std::max(0, sparams.cache_mb)*1024*1024;
+
+    // /stream sessions by id, each holds a state of the pool
+    std::map<std::string, std::shared_ptr<stream_session>> sessions;
+    std::mutex   sessions_mutex;
+    std::mt19937 sessions_rng{std::random_device{}()};
+
+    // /v1/jobs, started once the handlers are set up
+    job_queue jobs;
+    jobs.ttl_s      = std::max(0, sparams.job_ttl_s);
+    jobs.max_queued = std::max(0, sparams.max_jobs);
+
+    // language id and probability by "user" field, so that the requests of a user
+    // skip the detection once it was confident
+    std::map<std::string, std::pair<int, float>> lid_users;
+    std::mutex lid_users_mutex;
+
+    if (batching) {
+        batcher.start(ctx, sparams.batch_size, sparams.batch_wait_ms, params.n_threads);
     }
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    // so that the first request is not slower than the rest
+    whisper_warmup(ctx, params.n_threads);
+
     state.store(SERVER_STATE_READY);
 
 
@@ -745,6 +2505,18 @@ int main(int argc, char ** argv) {
     -F response_format="json"
         </pre>
 
+        <h2>/v1/jobs</h2>
+        <pre>
+    curl 127.0.0.1:)" + std::to_string(sparams.port) + R"(/v1/jobs \
+    -H "Content-Type: multipart/form-data" \
+    -F file="@&lt;file-path&gt;" \
+    -F response_format="json"
+
+    curl 127.0.0.1:)" + std::to_string(sparams.port) + R"(/v1/jobs/&lt;id&gt;
+    curl -N 127.0.0.1:)" + std::to_string(sparams.port) + R"(/v1/jobs/&lt;id&gt;/events
+    curl -X DELETE 127.0.0.1:)" + std::to_string(sparams.port) + R"(/v1/jobs/&lt;id&gt;
+        </pre>
+
         <h2>/load</h2>
         <pre>
     curl 127.0.0.1:)" + std::to_string(sparams.port) + R"(/load \
@@ -790,8 +2562,21 @@ int main(int argc, char ** argv) {
     });
 
     svr->Post(sparams.request_path + sparams.inference_path, [&](const Request &req, Response &res){
-        // acquire whisper model mutex lock
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        // per-request copy, requests may run concurrently
+        whisper_params params = default_params;
+
+        const int64_t t_start_us = ggml_time_us();
+
+        request_timings timings;
+
+        // counted when the handler returns
+        struct request_outcome {
+            server_metrics & metrics;
+            std::string      name = "error";
+            ~request_outcome() {
+                metrics.count(name);
+            }
+        } outcome { metrics };
 
         // first check user requested fields of the request
         if (!req.has_file("file"))
@@ -813,43 +2598,111 @@ int main(int argc, char ** argv) {
         std::vector<float> pcmf32;               // mono-channel F32 PCM
         std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
 
-        if (sparams.ffmpeg_converter) {
-            // if file is not wav, convert to wav
-            // write to temporary file
-            const std::string temp_filename = generate_temp_filename("whisper-server", ".wav");
-            std::ofstream temp_file{temp_filename, std::ios::binary};
-            temp_file << audio_file.content;
-            temp_file.close();
-
-            std::string error_resp = "{\"error\":\"Failed to execute ffmpeg command.\"}";
-            const bool is_converted = convert_to_wav(temp_filename, error_resp);
-            if (!is_converted) {
-                res.set_content(error_resp, "application/json");
+        const int64_t t_audio_us = ggml_time_us();
+
+        std::string error_resp;
+        if (!read_upload_audio(audio_file.content, params.diarize, sparams.ffmpeg_converter, pcmf32, pcmf32s, error_resp)) {
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        timings.audio_ms = 1e-3*(ggml_time_us() - t_audio_us);
+
+        printf("Successfully loaded %s\n", filename.c_str());
+
+        // a model of --models, loaded on first use, or the default one
+        std::unique_ptr<model_lease> mlease;
+        if (req.has_file("model") && !registry.models.empty()) {
+            mlease = std::make_unique<model_lease>(registry, req.get_file_value("model").content);
+            if (!mlease->model) {
+                res.status = 400;
+                res.set_content("{\"error\":\"unknown model or failed to load it\"}", "application/json");
                 return;
             }
+        }
 
-            // read audio content into pcmf32
-            if (!::read_audio_data(temp_filename, pcmf32, pcmf32s, params.diarize))
-            {
-                fprintf(stderr, "error: failed to read WAV file '%s'\n", temp_filename.c_str());
-                const std::string error_resp = "{\"error\":\"failed to read WAV file\"}";
-                res.set_content(error_resp, "application/json");
-                std::remove(temp_filename.c_str());
-                return;
+        // VAD and whisper_full_parallel() run on the default state of the context, one request at a time
+        const bool pooled  = !params.vad && params.n_processors <= 1;
+        const bool batched = batching && pooled && !mlease;
+
+        whisper_context * model_ctx  = mlease ? mlease->model->ctx  : ctx;
+        state_pool      & model_pool = mlease ? mlease->model->pool : pool;
+
+        // the result of an earlier request with the same audio and fields
+        // verbose_json also needs the language probabilities of the detection
+        std::string cache_key;
+        result_cache::entry_ptr cached;
+        std::shared_ptr<cached_result> fresh;
+        if (cache.max_bytes > 0) {
+            cache_key = result_cache_key(params, mlease ? req.get_file_value("model").content : "", pcmf32);
+            cached = cache.find(cache_key, params.response_format == vjson_format && !params.no_language_probabilities);
+            if (cached) {
+                printf("Found %s in the result cache\n", filename.c_str());
             }
-            // remove temp file
-            std::remove(temp_filename.c_str());
+        }
+
+        // higher first, then in arrival order
+        const int priority = req.has_file("priority") ? std::stoi(req.get_file_value("priority").content) : 0;
+
+        // counted from the arrival of the request
+        const int timeout_ms = req.has_file("timeout_ms") ? std::stoi(req.get_file_value("timeout_ms").content) : sparams.timeout_ms;
+        const int64_t t_deadline_us = timeout_ms > 0 ? t_start_us + 1000ll*timeout_ms : 0;
+
+        const auto expired = [&]() {
+            return t_deadline_us > 0 && ggml_time_us() >= t_deadline_us;
+        };
+        const auto deadline_exceeded = [&]() {
+            fprintf(stderr, "error: request deadline of %d ms exceeded\n", timeout_ms);
+            outcome.name = "expired";
+            res.status = 504;
+            res.set_content("{\"error\":\"request deadline exceeded\"}", "application/json");
+        };
+
+        const int64_t t_wait_us = ggml_time_us();
+
+        // acquire whisper model mutex lock
+        std::shared_lock<std::shared_mutex> shared_lock(whisper_mutex, std::defer_lock);
+        std::unique_lock<std::shared_mutex> lock(whisper_mutex, std::defer_lock);
+        if (pooled || cached) {
+            shared_lock.lock();
         } else {
-            if (!::read_audio_data(audio_file.content, pcmf32, pcmf32s, params.diarize))
-            {
-                fprintf(stderr, "error: failed to read audio data\n");
-                const std::string error_resp = "{\"error\":\"failed to read audio data\"}";
-                res.set_content(error_resp, "application/json");
+            lock.lock();
+        }
+
+        std::unique_ptr<state_lease> lease;
+        if (pooled && !cached) {
+            lease = std::make_unique<state_lease>(model_pool, priority, t_deadline_us, [&]() { return req.is_connection_closed(); });
+            if (!lease->state) {
+                switch (lease->status.result) {
+                    case state_pool::WAIT_EXPIRED:
+                        deadline_exceeded();
+                        return;
+                    case state_pool::WAIT_CLOSED:
+                        fprintf(stderr, "client disconnected while waiting for a slot\n");
+                        outcome.name = "closed";
+                        res.status = 499;
+                        res.set_content("{\"error\":\"client disconnected\"}", "application/json");
+                        return;
+                    default:
+                        break;
+                }
+                fprintf(stderr, "error: %s, expected wait %.0f ms\n",
+                        lease->status.result == state_pool::WAIT_FULL ? "too many requests in the queue" : "expected wait too long",
+                        lease->status.expected_ms);
+                outcome.name = lease->status.result == state_pool::WAIT_FULL ? "busy" : "shed";
+                res.status = 503;
+                res.set_header("Retry-After", std::to_string(std::max(1, (int) std::ceil(1e-3*lease->status.expected_ms))));
+                res.set_content("{\"error\":\"server busy, try again later\"}", "application/json");
                 return;
             }
         }
+        if (expired()) {
+            deadline_exceeded();
+            return;
+        }
+        const whisper_result wres = { model_ctx, lease ? lease->state : nullptr, cached.get() };
 
-        printf("Successfully loaded %s\n", filename.c_str());
+        timings.wait_ms = 1e-3*(ggml_time_us() - t_wait_us);
 
         // print system information
         {
@@ -858,10 +2711,21 @@ int main(int argc, char ** argv) {
                     params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
         }
 
+        // a user whose language was detected confidently before skips the detection
+        const bool lid_user = sparams.lid_users > 0 && !params.user.empty() && params.language == "auto" && !params.detect_language;
+        if (lid_user) {
+            std::lock_guard<std::mutex> lock(lid_users_mutex);
+
+            const auto it = lid_users.find(params.user);
+            if (it != lid_users.end() && it->second.second >= params.lid_thold) {
+                params.language = whisper_lang_str(it->second.first);
+            }
+        }
+
         // print some info about the processing
         {
             fprintf(stderr, "\n");
-            if (!whisper_is_multilingual(ctx)) {
+            if (!whisper_is_multilingual(model_ctx)) {
                 if (params.language != "en" || params.translate) {
                     params.language = "en";
                     params.translate = false;
@@ -883,59 +2747,9 @@ int main(int argc, char ** argv) {
         }
 
         // run the inference
-        {
+        if (!cached) {
             printf("Running whisper.cpp inference on %s\n", filename.c_str());
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-
-            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
-
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.max_len == 0 ? 60 : params.max_len;
-            wparams.split_on_word    = params.split_on_word;
-            wparams.audio_ctx        = params.audio_ctx;
-
-            wparams.debug_mode       = params.debug_mode;
-
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
-
-            wparams.initial_prompt   = params.prompt.c_str();
-
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
-
-            wparams.temperature      = params.temperature;
-            wparams.no_speech_thold = params.no_speech_thold;
-            wparams.temperature_inc  = params.temperature_inc;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
-
-            wparams.no_timestamps    = params.no_timestamps;
-            wparams.token_timestamps = !params.no_timestamps && params.response_format == vjson_format;
-            wparams.no_context       = params.no_context;
-
-            wparams.suppress_nst     = params.suppress_nst;
-
-            wparams.vad              = params.vad;
-            wparams.vad_model_path   = params.vad_model.c_str();
-
-            wparams.vad_params.threshold               = params.vad_threshold;
-            wparams.vad_params.min_speech_duration_ms  = params.vad_min_speech_duration_ms;
-            wparams.vad_params.min_silence_duration_ms = params.vad_min_silence_duration_ms;
-            wparams.vad_params.max_speech_duration_s   = params.vad_max_speech_duration_s;
-            wparams.vad_params.speech_pad_ms           = params.vad_speech_pad_ms;
-            wparams.vad_params.samples_overlap         = params.vad_samples_overlap;
+            whisper_full_params wparams = make_full_params(params);
 
             whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
 
@@ -950,165 +2764,590 @@ int main(int argc, char ** argv) {
                 wparams.progress_callback_user_data = &user_data;
             }
 
-            // tell whisper to abort if the HTTP connection closed
+            // tell whisper to abort if the HTTP connection closed or the deadline passed
+            struct abort_data {
+                const httplib::Request * req;
+                int64_t t_deadline_us;
+            } abort_data = { &req, t_deadline_us };
+
             wparams.abort_callback = [](void *user_data) {
-                // user_data is a pointer to our Request
-                auto req_ptr = static_cast<const httplib::Request*>(user_data);
-                return req_ptr->is_connection_closed();
+                const auto * data = static_cast<const struct abort_data *>(user_data);
+                return data->req->is_connection_closed() || (data->t_deadline_us > 0 && ggml_time_us() >= data->t_deadline_us);
             };
-            wparams.abort_callback_user_data = (void*)&req;
+            wparams.abort_callback_user_data = &abort_data;
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            const whisper_metrics m0 = wres.state ? whisper_get_metrics_from_state(wres.state) : whisper_get_metrics(model_ctx);
+
+            int ret = 0;
+            if (pooled) {
+                // encode the windows together with other requests
+                if (batched) {
+                    wparams.encoder_window_callback           = encode_batcher::encode_window;
+                    wparams.encoder_window_callback_user_data = &batcher;
+                    batcher.begin();
+                }
+                ret = whisper_full_with_state(model_ctx, wres.state, wparams, pcmf32.data(), pcmf32.size());
+                if (batched) {
+                    batcher.end();
+                }
+            } else {
+                ret = whisper_full_parallel(model_ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors);
+            }
+            if (ret != 0) {
                 // handle failure or early abort
                 if (req.is_connection_closed()) {
                     // log client disconnect
                     fprintf(stderr, "client disconnected, aborted processing\n");
+                    outcome.name = "closed";
                     res.status = 499; // Client Closed Request (nginx convention)
                     res.set_content("{\"error\":\"client disconnected\"}", "application/json");
                     return;
                 }
+                if (expired()) {
+                    deadline_exceeded();
+                    return;
+                }
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 res.status = 500; // Internal Server Error
                 const std::string error_resp = "{\"error\":\"failed to process audio\"}";
                 res.set_content(error_resp, "application/json");
                 return;
             }
+
+            const whisper_metrics m1 = wres.state ? whisper_get_metrics_from_state(wres.state) : whisper_get_metrics(model_ctx);
+            timings.add_state_delta(m0, m1);
+
+            if (lid_user && params.language == "auto") {
+                std::lock_guard<std::mutex> lock(lid_users_mutex);
+
+                if (lid_users.size() >= (size_t) sparams.lid_users && lid_users.find(params.user) == lid_users.end()) {
+                    lid_users.clear();
+                }
+                lid_users[params.user] = { wres.lang_id(), wres.lang_prob() };
+            }
+
+            for (int i = 0; i < wres.n_segments(); ++i) {
+                timings.n_tokens += wres.n_tokens(i);
+            }
+
+            if (cache.max_bytes > 0) {
+                fresh = wres.snapshot();
+            }
         }
 
+        timings.total_ms = 1e-3*(ggml_time_us() - t_start_us);
+
+        metrics.observe(timings, float(pcmf32.size())/WHISPER_SAMPLE_RATE);
+        outcome.name = "ok";
+
         // return results to user
-        if (params.response_format == text_format)
-        {
-            std::string results = output_str(ctx, params, pcmf32s);
-            res.set_content(results.c_str(), "text/html; charset=utf-8");
-        }
-        else if (params.response_format == srt_format)
-        {
-            std::stringstream ss;
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-                std::string speaker = "";
-
-                if (params.diarize && pcmf32s.size() == 2)
-                {
-                    speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
-                }
+        std::string content;
+        std::string content_type;
+        render_result(wres, params, pcmf32s, float(pcmf32.size())/WHISPER_SAMPLE_RATE, timings, fresh.get(), content, content_type);
+        res.set_content(content, content_type);
 
-                ss << i + 1 + params.offset_n << "\n";
-                ss << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
-                ss << speaker << text << "\n\n";
+        if (fresh) {
+            cache.insert(cache_key, fresh);
+        }
+    });
+    // sessions of clients that stopped posting audio give their state back
+    auto close_idle_sessions = [&]() {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        const auto t_now = std::chrono::steady_clock::now();
+        for (auto it = sessions.begin(); it != sessions.end(); ) {
+            std::unique_lock<std::mutex> slock(it->second->mutex, std::try_to_lock);
+            if (slock.owns_lock() && t_now - it->second->t_last > std::chrono::seconds(sparams.stream_idle_s)) {
+                fprintf(stderr, "closing idle stream session %s\n", it->first.c_str());
+                slock.unlock();
+                it = sessions.erase(it);
+            } else {
+                ++it;
             }
-            res.set_content(ss.str(), "application/x-subrip");
-        } else if (params.response_format == vtt_format) {
-            std::stringstream ss;
-
-            ss << "WEBVTT\n\n";
-
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-                std::string speaker = "";
-
-                if (params.diarize && pcmf32s.size() == 2)
-                {
-                    speaker = estimate_diarization_speaker(pcmf32s, t0, t1, true);
-                    speaker.insert(0, "<v Speaker");
-                    speaker.append(">");
-                }
+        }
+    };
+
+    auto find_session = [&](const Request & req) -> std::shared_ptr<stream_session> {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        auto it = sessions.find(req.get_param_value("session"));
+        return it == sessions.end() ? nullptr : it->second;
+    };
 
-                ss << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
-                ss << speaker << text << "\n\n";
+    // opens a session: the audio is then posted to /stream/audio, the last of it to /stream/end
+    svr->Post(sparams.request_path + "/stream", [&](const Request &req, Response &res){
+        std::shared_lock<std::shared_mutex> lock(whisper_mutex);
+
+        close_idle_sessions();
+
+        std::unique_ptr<model_lease> mlease;
+        if (req.has_file("model") && !registry.models.empty()) {
+            mlease = std::make_unique<model_lease>(registry, req.get_file_value("model").content);
+            if (!mlease->model) {
+                res.status = 400;
+                res.set_content("{\"error\":\"unknown model or failed to load it\"}", "application/json");
+                return;
             }
-            res.set_content(ss.str(), "text/vtt");
-        } else if (params.response_format == vjson_format) {
-            /* try to match openai/whisper's Python format */
-            std::string results = output_str(ctx, params, pcmf32s); 
-            json jres = json{
-                {"task", params.translate ? "translate" : "transcribe"},
-                {"language", whisper_lang_str_full(whisper_full_lang_id(ctx))},
-                {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
-                {"text", results},
-                {"segments", json::array()}
-            };
-            // Only compute language probabilities if requested (expensive operation)
-            if (!params.no_language_probabilities) {
-                std::vector<float> lang_probs(whisper_lang_max_id() + 1, 0.0f);
-                const auto detected_lang_id = whisper_lang_auto_detect(ctx, 0, params.n_threads, lang_probs.data());
-                jres["detected_language"] = whisper_lang_str_full(detected_lang_id);
-                jres["detected_language_probability"] = lang_probs[detected_lang_id];
-                jres["language_probabilities"] = json::object();
-                // Add all language probabilities
-                for (int i = 0; i <= whisper_lang_max_id(); ++i) {
-                    if (lang_probs[i] > 0.001f) { // Only include non-negligible probabilities
-                        jres["language_probabilities"][whisper_lang_str(i)] = lang_probs[i];
-                    }
+        }
+
+        whisper_context * model_ctx  = mlease ? mlease->model->ctx  : ctx;
+        state_pool      & model_pool = mlease ? mlease->model->pool : pool;
+
+        // a live stream cannot wait in the queue for a state
+        whisper_state * wstate = model_pool.try_acquire();
+        if (wstate == nullptr) {
+            fprintf(stderr, "error: no free state for a stream session\n");
+            res.status = 503;
+            res.set_content("{\"error\":\"server busy, try again later\"}", "application/json");
+            return;
+        }
+
+        auto session = std::make_shared<stream_session>(model_ctx, model_pool, wstate);
+        session->model = std::move(mlease);
+
+        session->params = default_params;
+        get_req_parameters(req, session->params);
+
+        session->step_ms   = req.has_file("step_ms")   ? std::stoi(req.get_file_value("step_ms").content)   : sparams.stream_step_ms;
+        session->length_ms = req.has_file("length_ms") ? std::stoi(req.get_file_value("length_ms").content) : sparams.stream_length_ms;
+        session->keep_ms   = req.has_file("keep_ms")   ? std::stoi(req.get_file_value("keep_ms").content)   : sparams.stream_keep_ms;
+
+        session->length_ms = std::max(session->length_ms, session->step_ms);
+        session->keep_ms   = std::min(session->keep_ms,   session->step_ms);
+
+        std::string id;
+        {
+            std::lock_guard<std::mutex> slock(sessions_mutex);
+            do {
+                char buf[17];
+                snprintf(buf, sizeof(buf), "%08x%08x", (unsigned) sessions_rng(), (unsigned) sessions_rng());
+                id = buf;
+            } while (sessions.count(id));
+            sessions[id] = session;
+        }
+
+        fprintf(stderr, "opened stream session %s\n", id.c_str());
+
+        const json jres = json{
+            {"session",   id},
+            {"step_ms",   session->step_ms},
+            {"length_ms", session->length_ms},
+        };
+        res.set_content(jres.dump(), "application/json");
+    });
+
+    // body: raw mono 16 kHz PCM, s16le or with format=f32le
+    auto stream_audio = [&](const Request &req, Response &res, bool end) {
+        std::shared_lock<std::shared_mutex> lock(whisper_mutex);
+
+        auto session = find_session(req);
+        if (!session) {
+            res.status = 404;
+            res.set_content("{\"error\":\"unknown stream session\"}", "application/json");
+            return;
+        }
+
+        std::lock_guard<std::mutex> slock(session->mutex);
+        session->t_last = std::chrono::steady_clock::now();
+
+        const std::string format = req.has_param("format") ? req.get_param_value("format") : "s16le";
+
+        const size_t n0 = session->pcmf32.size();
+        if (!stream_read_pcm(req.body, format, session->pcmf32)) {
+            res.status = 400;
+            res.set_content("{\"error\":\"unsupported format, use s16le or f32le\"}", "application/json");
+            return;
+        }
+        session->n_new += session->pcmf32.size() - n0;
+
+        json jres = json{
+            {"segments", json::array()},
+        };
+        if (!stream_step(*session, end, jres)) {
+            fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+            res.status = 500;
+            res.set_content("{\"error\":\"failed to process audio\"}", "application/json");
+            return;
+        }
+        // where the next window starts, for clients that keep the audio not finalized yet
+        jres["window_start"] = double(session->n_past)/WHISPER_SAMPLE_RATE;
+        res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
+
+        if (end) {
+            std::lock_guard<std::mutex> sessions_lock(sessions_mutex);
+            sessions.erase(req.get_param_value("session"));
+            fprintf(stderr, "closed stream session %s\n", req.get_param_value("session").c_str());
+        }
+    };
+
+    svr->Post(sparams.request_path + "/stream/audio", [&](const Request &req, Response &res){
+        stream_audio(req, res, false);
+    });
+
+    svr->Post(sparams.request_path + "/stream/end", [&](const Request &req, Response &res){
+        stream_audio(req, res, true);
+    });
+
+    // runs a job on a state of the pool, as the inference handler runs a request
+    // (without the result cache and the languages of the users)
+    auto run_job = [&](transcription_job & job) {
+        whisper_params & params = job.params;
+
+        const int64_t t_start_us = ggml_time_us();
+
+        request_timings timings;
+
+        const bool pooled  = !params.vad && params.n_processors <= 1;
+        const bool batched = batching && pooled && !job.model;
+
+        std::shared_lock<std::shared_mutex> shared_lock(whisper_mutex, std::defer_lock);
+        std::unique_lock<std::shared_mutex> lock(whisper_mutex, std::defer_lock);
+        if (pooled) {
+            shared_lock.lock();
+        } else {
+            lock.lock();
+        }
+
+        // after the lock, /load may have replaced the default model
+        whisper_context * model_ctx  = job.model ? job.model->model->ctx  : ctx;
+        state_pool      & model_pool = job.model ? job.model->model->pool : pool;
+
+        std::unique_ptr<state_lease> lease;
+        if (pooled) {
+            lease = std::make_unique<state_lease>(model_pool, job.priority, 0, [&]() { return job.cancelled.load(); }, false);
+        }
+        if (job.cancelled || (pooled && !lease->state)) {
+            job.finish(transcription_job::JOB_CANCELLED);
+            metrics.count("cancelled");
+            return;
+        }
+        const whisper_result wres = { model_ctx, lease ? lease->state : nullptr, nullptr };
+
+        timings.wait_ms = 1e-3*(ggml_time_us() - t_start_us);
+
+        if (!whisper_is_multilingual(model_ctx)) {
+            params.language  = "en";
+            params.translate = false;
+        }
+        if (params.detect_language) {
+            params.language = "auto";
+        }
+
+        printf("Running job %s on %s\n", job.id.c_str(), job.filename.c_str());
+
+        whisper_full_params wparams = make_full_params(params);
+
+        wparams.print_progress = false;
+
+        wparams.new_segment_callback           = job_segment_callback;
+        wparams.new_segment_callback_user_data = &job;
+
+        wparams.abort_callback = [](void * user_data) {
+            return ((const transcription_job *) user_data)->cancelled.load();
+        };
+        wparams.abort_callback_user_data = &job;
+
+        const whisper_metrics m0 = wres.state ? whisper_get_metrics_from_state(wres.state) : whisper_get_metrics(model_ctx);
+
+        auto run = [&](const std::vector<float> & pcm) {
+            int ret = 0;
+            if (pooled) {
+                if (batched) {
+                    wparams.encoder_window_callback           = encode_batcher::encode_window;
+                    wparams.encoder_window_callback_user_data = &batcher;
+                    batcher.begin();
                 }
+                ret = whisper_full_with_state(model_ctx, wres.state, wparams, pcm.data(), pcm.size());
+                if (batched) {
+                    batcher.end();
+                }
+            } else {
+                ret = whisper_full_parallel(model_ctx, wparams, pcm.data(), pcm.size(), params.n_processors);
             }
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i)
-            {
-                json segment = json{
-                    {"id", i},
-                    {"text", whisper_full_get_segment_text(ctx, i)},
-                };
+            return ret;
+        };
 
-                if (!params.no_timestamps) {
-                    segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-                    segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
+        int   ret        = 0;
+        float duration_s = float(job.pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+        // --job-chunk: the chunks are decoded one ahead of the transcription and their results collected here
+        cached_result chunked;
+
+        if (job.audio.empty()) {
+            ret = run(job.pcmf32);
+        } else {
+            audio_decoder decoder;
+            decoder.open_memory(job.audio.data(), job.audio.size(), false);
+
+            audio_chunk_reader reader(decoder, (int64_t) sparams.job_chunk_s*WHISPER_SAMPLE_RATE, false);
+
+            std::vector<float>              pcm;
+            std::vector<std::vector<float>> pcms;
+
+            int64_t offset    = 0;
+            int64_t n_samples = 0;
+
+            for (int i = 0; ret == 0 && reader.next(pcm, pcms, offset); ++i) {
+                job.t_offset = 100*offset/WHISPER_SAMPLE_RATE;
+
+                ret = run(pcm);
+                if (ret != 0) {
+                    break;
                 }
 
-                float total_logprob = 0;
-                const int n_tokens = whisper_full_n_tokens(ctx, i);
-                for (int j = 0; j < n_tokens; ++j) {
-                    whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
-                    if (token.id >= whisper_token_eot(ctx)) {
-                        continue;
-                    }
+                chunked.append(std::move(*wres.snapshot()), job.t_offset);
+                n_samples = offset + pcm.size();
 
-                    segment["tokens"].push_back(token.id);
-                    json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
-                    if (!params.no_timestamps) {
-                        word["start"] = token.t0 * 0.01;
-                        word["end"] = token.t1 * 0.01;
-                        word["t_dtw"] = token.t_dtw;
-                    }
-                    word["probability"] = token.p;
-                    total_logprob += token.plog;
-                    segment["words"].push_back(word);
+                if (i == 0 && params.response_format == vjson_format && !params.no_language_probabilities) {
+                    chunked.lang_probs.assign(whisper_lang_max_id() + 1, 0.0f);
+                    chunked.lang_probs_id = wres.lang_auto_detect(params.n_threads, chunked.lang_probs.data());
                 }
 
-                segment["temperature"] = params.temperature;
-                segment["avg_logprob"] = total_logprob / n_tokens;
+                // the next chunks continue the text of this one, in the language detected in the first
+                wparams.no_context     = false;
+                wparams.initial_prompt = nullptr;
+                if (i == 0 && params.language == "auto" && !params.detect_language && chunked.lang_id >= 0) {
+                    wparams.language = whisper_lang_str(chunked.lang_id);
+                }
+            }
+            if (ret == 0 && reader.failed()) {
+                ret = -1;
+            }
+
+            duration_s = float(n_samples)/WHISPER_SAMPLE_RATE;
+        }
+        if (ret != 0) {
+            if (job.cancelled) {
+                fprintf(stderr, "job %s cancelled\n", job.id.c_str());
+                job.finish(transcription_job::JOB_CANCELLED);
+                metrics.count("cancelled");
+            } else {
+                fprintf(stderr, "job %s: failed to process audio\n", job.id.c_str());
+                job.finish(transcription_job::JOB_FAILED, "failed to process audio");
+                metrics.count("error");
+            }
+            return;
+        }
+
+        const whisper_metrics m1 = wres.state ? whisper_get_metrics_from_state(wres.state) : whisper_get_metrics(model_ctx);
+        timings.add_state_delta(m0, m1);
+
+        const whisper_result result = { model_ctx, wres.state, job.audio.empty() ? nullptr : &chunked };
+
+        for (int i = 0; i < result.n_segments(); ++i) {
+            timings.n_tokens += result.n_tokens(i);
+        }
+
+        timings.total_ms = 1e-3*(ggml_time_us() - t_start_us);
+
+        std::string content;
+        std::string content_type;
+        render_result(result, params, job.pcmf32s, duration_s, timings, nullptr, content, content_type);
+        {
+            std::lock_guard<std::mutex> jlock(job.mutex);
+            job.content      = std::move(content);
+            job.content_type = std::move(content_type);
+        }
+        job.finish(transcription_job::JOB_DONE);
+
+        metrics.observe(timings, duration_s);
+        metrics.count("ok");
+
+        printf("Finished job %s\n", job.id.c_str());
+    };
+
+    // takes the same fields as the inference endpoint, returns the id of the job (202)
+    svr->Post(sparams.request_path + "/v1/jobs", [&](const Request &req, Response &res){
+        if (!req.has_file("file")) {
+            res.status = 400;
+            res.set_content("{\"error\":\"no 'file' field in the request\"}", "application/json");
+            return;
+        }
+        const auto audio_file = req.get_file_value("file");
+
+        auto job = std::make_shared<transcription_job>();
+        job->filename = audio_file.filename;
+        job->params   = default_params;
+        get_req_parameters(req, job->params);
+
+        // higher first, then in arrival order
+        job->priority = req.has_file("priority") ? std::stoi(req.get_file_value("priority").content) : 0;
+
+        // with --job-chunk, the formats decoded in memory are kept encoded until the job runs; diarization
+        // and the formats converted by ffmpeg need all of the samples
+        bool chunked = false;
+        if (sparams.job_chunk_s > 0 && !job->params.diarize) {
+            audio_decoder decoder;
+            chunked = decoder.open_memory(audio_file.content.data(), audio_file.content.size(), false);
+        }
+
+        std::string error_resp;
+        if (chunked) {
+            job->audio = audio_file.content;
+        } else if (!read_upload_audio(audio_file.content, job->params.diarize, sparams.ffmpeg_converter, job->pcmf32, job->pcmf32s, error_resp)) {
+            res.status = 400;
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        if (req.has_file("model") && !registry.models.empty()) {
+            job->model = std::make_unique<model_lease>(registry, req.get_file_value("model").content);
+            if (!job->model->model) {
+                res.status = 400;
+                res.set_content("{\"error\":\"unknown model or failed to load it\"}", "application/json");
+                return;
+            }
+        }
+
+        const std::string id = jobs.submit(job);
+        if (id.empty()) {
+            fprintf(stderr, "error: too many jobs in the queue\n");
+            metrics.count("busy");
+            res.status = 503;
+            res.set_content("{\"error\":\"server busy, try again later\"}", "application/json");
+            return;
+        }
+
+        printf("Queued job %s for %s\n", id.c_str(), job->filename.c_str());
+
+        res.status = 202;
+        res.set_content(json{{"id", id}, {"status", "queued"}}.dump(), "application/json");
+    });
+
+    auto find_job = [&](const Request & req, Response & res) -> std::shared_ptr<transcription_job> {
+        auto job = jobs.find(req.matches[1]);
+        if (!job) {
+            res.status = 404;
+            res.set_content("{\"error\":\"unknown job\"}", "application/json");
+        }
+        return job;
+    };
+
+    // ?after=N: only the segments from N on
+    svr->Get(sparams.request_path + R"(/v1/jobs/([0-9a-f]+))", [&](const Request &req, Response &res){
+        auto job = find_job(req, res);
+        if (!job) {
+            return;
+        }
+        const size_t after = req.has_param("after") ? std::stoul(req.get_param_value("after")) : 0;
+
+        std::lock_guard<std::mutex> lock(job->mutex);
+        res.set_content(job->to_json(after).dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
+    });
+
+    // server-sent events: "segment" for each segment as it is decoded, then "end" with the job
+    svr->Get(sparams.request_path + R"(/v1/jobs/([0-9a-f]+)/events)", [&](const Request &req, Response &res){
+        auto job = find_job(req, res);
+        if (!job) {
+            return;
+        }
+        auto n_sent = std::make_shared<size_t>(req.has_param("after") ? std::stoul(req.get_param_value("after")) : 0);
+
+        res.set_header("Cache-Control", "no-cache");
+        res.set_chunked_content_provider("text/event-stream", [job, n_sent](size_t, DataSink & sink) {
+            std::unique_lock<std::mutex> lock(job->mutex);
+
+            // wake up now and then to check the client
+            job->cv.wait_for(lock, std::chrono::seconds(1), [&]() { return job->segments.size() > *n_sent || job->finished(); });
 
-                // TODO compression_ratio and no_speech_prob are not implemented yet
-                // segment["compression_ratio"] = 0;
-                segment["no_speech_prob"] = whisper_full_get_segment_no_speech_prob(ctx, i);
+            std::string events;
+            for (; *n_sent < job->segments.size(); ++*n_sent) {
+                events += "event: segment\ndata: " + job->segments[*n_sent].dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+            }
+            const bool end = job->finished();
+            if (end) {
+                json jend = job->to_json(job->segments.size());
+                jend.erase("segments");
+                events += "event: end\ndata: " + jend.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+            }
+            lock.unlock();
 
-                jres["segments"].push_back(segment);
+            if (!sink.is_writable() || (!events.empty() && !sink.write(events.data(), events.size()))) {
+                return false;
             }
-            res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
-                            "application/json");
+            if (end) {
+                sink.done();
+            }
+            return true;
+        });
+    });
+
+    svr->Delete(sparams.request_path + R"(/v1/jobs/([0-9a-f]+))", [&](const Request &req, Response &res){
+        auto job = jobs.cancel(req.matches[1]);
+        if (!job) {
+            res.status = 404;
+            res.set_content("{\"error\":\"unknown job\"}", "application/json");
+            return;
         }
-        // TODO add more output formats
-        else
+        fprintf(stderr, "cancelling job %s\n", job->id.c_str());
+
+        std::lock_guard<std::mutex> lock(job->mutex);
+        res.set_content(json{{"id", job->id}, {"status", transcription_job::status_str(job->status)}}.dump(), "application/json");
+    });
+
+    jobs.start(sparams.job_runners > 0 ? sparams.job_runners : n_states, run_job);
+
+    svr->Get(sparams.request_path + "/metrics", [&](const Request &, Response &res){
+        std::stringstream ss;
+
+        metrics.render(ss);
+        cache.render(ss);
+
+        // the -m model, then the loaded models of --models
+        std::vector<std::tuple<std::string, int, int, int>> pools;
         {
-            std::string results = output_str(ctx, params, pcmf32s);
-            json jres = json{
-                {"text", results}
-            };
-            res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
-                            "application/json");
+            int n_states  = 0;
+            int n_waiting = 0;
+            int n_busy    = 0;
+            pool.stats(n_states, n_waiting, n_busy);
+            pools.emplace_back("default", n_states, n_waiting, n_busy);
+        }
+        for (const auto & it : registry.stats()) {
+            pools.push_back(it);
+        }
+
+        ss << "# HELP whisper_states States of each model.\n";
+        ss << "# TYPE whisper_states gauge\n";
+        for (const auto & it : pools) {
+            ss << "whisper_states{model=\"" << std::get<0>(it) << "\"} " << std::get<1>(it) << "\n";
+        }
+        ss << "# HELP whisper_queue_depth Requests waiting for a state.\n";
+        ss << "# TYPE whisper_queue_depth gauge\n";
+        for (const auto & it : pools) {
+            ss << "whisper_queue_depth{model=\"" << std::get<0>(it) << "\"} " << std::get<2>(it) << "\n";
+        }
+        ss << "# HELP whisper_states_active States running a request or a stream session.\n";
+        ss << "# TYPE whisper_states_active gauge\n";
+        for (const auto & it : pools) {
+            ss << "whisper_states_active{model=\"" << std::get<0>(it) << "\"} " << std::get<3>(it) << "\n";
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            ss << "# HELP whisper_stream_sessions Open /stream sessions.\n";
+            ss << "# TYPE whisper_stream_sessions gauge\n";
+            ss << "whisper_stream_sessions " << sessions.size() << "\n";
+        }
+
+        {
+            int n_queued  = 0;
+            int n_running = 0;
+            int n_kept    = 0;
+            jobs.stats(n_queued, n_running, n_kept);
+            ss << "# HELP whisper_jobs Jobs of /v1/jobs, by status.\n";
+            ss << "# TYPE whisper_jobs gauge\n";
+            ss << "whisper_jobs{status=\"queued\"} "  << n_queued  << "\n";
+            ss << "whisper_jobs{status=\"running\"} " << n_running << "\n";
+            ss << "whisper_jobs{status=\"ended\"} "   << n_kept - n_queued - n_running << "\n";
         }
 
-        // reset params to their defaults
-        params = default_params;
+        res.set_content(ss.str(), "text/plain; version=0.0.4");
+    });
+
+    svr->Get(sparams.request_path + "/models", [&](const Request &, Response &res){
+        res.set_content(json{{"models", registry.list()}}.dump(), "application/json");
     });
+
     svr->Post(sparams.request_path + "/load", [&](const Request &req, Response &res){
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        std::unique_lock<std::shared_mutex> lock(whisper_mutex);
         state.store(SERVER_STATE_LOADING_MODEL);
         if (!req.has_file("model"))
         {
@@ -1126,7 +3365,13 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        // clean up
+        // clean up, the stream sessions end with the model
+        {
+            std::lock_guard<std::mutex> slock(sessions_mutex);
+            sessions.clear();
+        }
+        pool.clear();
+        cache.clear();
         whisper_free(ctx);
 
         // whisper init
@@ -1138,6 +3383,14 @@ int main(int argc, char ** argv) {
             exit(1);
         }
 
+        if (!pool.init(ctx, n_states, mem_budget)) {
+            fprintf(stderr, "error: failed to initialize %d whisper states, must exit\n", n_states);
+            exit(1);
+        }
+        if (batching) {
+            batcher.set_context(ctx);
+        }
+
         // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
         whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
@@ -1174,6 +3427,10 @@ int main(int argc, char ** argv) {
     });
 
     svr->set_error_handler([](const Request &req, Response &res) {
+        if (!res.body.empty()) {
+            // the handler described the error
+            return;
+        }
         if (res.status == 400) {
             res.set_content("Invalid request", "text/plain");
         } else if (res.status != 500) {
@@ -1222,6 +3479,10 @@ int main(int argc, char ** argv) {
 
     // clean up function, to be called before exit
     auto clean_up = [&]() {
+        jobs.stop();
+        batcher.stop();
+        sessions.clear();
+        pool.clear();
         whisper_print_timings(ctx);
         whisper_free(ctx);
     };
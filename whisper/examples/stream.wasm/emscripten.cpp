@@ -24,7 +24,23 @@ std::string g_status        = "";
 std::string g_status_forced = "";
 std::string g_transcribed   = "";
 
-std::vector<float> g_pcmf32;
+// the last 30 s of microphone audio, written by the AudioWorklet of the page straight into the WASM memory
+// (a SharedArrayBuffer with pthreads). Every sample is stored twice, at i and i + kRingSize, so that any window
+// of up to kRingSize samples ending at the write position is contiguous and whisper_full() reads it in place
+constexpr uint32_t kRingSize = 30*WHISPER_SAMPLE_RATE;
+
+std::vector<float> g_ring(2*kRingSize);
+
+// number of samples written so far (Atomics.store() on the JS side)
+std::atomic<uint32_t> g_ring_n(0);
+
+static void stream_ring_write(const float * data, uint32_t n) {
+    uint32_t w = g_ring_n.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < n; ++i, ++w) {
+        g_ring[w % kRingSize] = g_ring[w % kRingSize + kRingSize] = data[i];
+    }
+    g_ring_n.store(w, std::memory_order_release);
+}
 
 void stream_set_status(const std::string & status) {
     std::lock_guard<std::mutex> lock(g_mutex);
@@ -57,38 +73,37 @@ void stream_main(size_t index, const std::string & lang) {
 
     printf("stream: using %d threads\n", wparams.n_threads);
 
-    std::vector<float> pcmf32;
-
     // whisper context
     auto & ctx = g_contexts[index];
 
     // 5 seconds interval
-    const int64_t window_samples = 5*WHISPER_SAMPLE_RATE;
+    const uint32_t window_samples = 5*WHISPER_SAMPLE_RATE;
+
+    uint32_t n_read = g_ring_n.load(std::memory_order_acquire);
 
     while (g_running) {
         stream_set_status("waiting for audio ...");
 
-        {
-            std::unique_lock<std::mutex> lock(g_mutex);
+        const uint32_t n_written = g_ring_n.load(std::memory_order_acquire);
 
-            if (g_pcmf32.size() < 1024) {
-                lock.unlock();
+        if (n_written - n_read < 1024) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
 
-                continue;
-            }
+        // the last window of the new audio, in place in the ring
+        const uint32_t n_window = std::min(n_written - n_read, window_samples);
+        const float *  pcmf32   = g_ring.data() + (n_written - n_window) % kRingSize;
 
-            pcmf32 = std::vector<float>(g_pcmf32.end() - std::min((int64_t) g_pcmf32.size(), window_samples), g_pcmf32.end());
-            g_pcmf32.clear();
-        }
+        n_read = n_written;
 
         {
             const auto t_start = std::chrono::high_resolution_clock::now();
 
             stream_set_status("running whisper ...");
 
-            int ret = whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size());
+            int ret = whisper_full(ctx, wparams, pcmf32, n_window);
             if (ret != 0) {
                 printf("whisper_full() failed: %d\n", ret);
                 break;
@@ -169,22 +184,27 @@ EMSCRIPTEN_BINDINGS(stream) {
             return -2;
         }
 
+        // appends to the ring; pages with an AudioWorklet write there directly (see get_ring)
         {
-            std::lock_guard<std::mutex> lock(g_mutex);
-            const int n = audio["length"].as<int>();
-
-            emscripten::val heap = emscripten::val::module_property("HEAPU8");
-            emscripten::val memory = heap["buffer"];
-
-            g_pcmf32.resize(n);
+            const std::vector<float> pcmf32 = emscripten::convertJSArrayToNumberVector<float>(audio);
 
-            emscripten::val memoryView = audio["constructor"].new_(memory, reinterpret_cast<uintptr_t>(g_pcmf32.data()), n);
-            memoryView.call<void>("set", audio);
+            stream_ring_write(pcmf32.data(), pcmf32.size());
         }
 
         return 0;
     }));
 
+    // where the AudioWorklet writes: the byte offsets of the ring and of its sample counter in the WASM memory
+    emscripten::function("get_ring", emscripten::optional_override([]() {
+        emscripten::val ring = emscripten::val::object();
+
+        ring.set("data",    reinterpret_cast<uintptr_t>(g_ring.data()));
+        ring.set("size",    kRingSize);
+        ring.set("counter", reinterpret_cast<uintptr_t>(&g_ring_n));
+
+        return ring;
+    }));
+
     emscripten::function("get_transcribed", emscripten::optional_override([]() {
         std::string transcribed;
 
@@ -6,14 +6,25 @@
 #include "common.h"
 #include "common-whisper.h"
 #include "whisper.h"
+#include "json.hpp"
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <cstdio>
 #include <fstream>
+#include <set>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+using json = nlohmann::ordered_json;
+
 // command-line parameters
 struct whisper_params {
     int32_t n_threads  = std::min(4, (int32_t) std::thread::hardware_concurrency());
@@ -37,10 +48,17 @@ struct whisper_params {
     bool save_audio    = false; // save audio to wav file
     bool use_gpu       = true;
     bool flash_attn    = true;
+    bool agreement     = false; // commit the words two consecutive steps agree on
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
     std::string fname_out;
+
+    // replay an audio file instead of capturing, and measure the latency
+    std::string fname_replay;
+    std::string fname_align;
+    std::string fname_report;
+    float       replay_speed = 1.0f; // 0 - as fast as possible
 };
 
 void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
@@ -75,6 +93,11 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-ng"   || arg == "--no-gpu")        { params.use_gpu       = false; }
         else if (arg == "-fa"   || arg == "--flash-attn")    { params.flash_attn    = true; }
         else if (arg == "-nfa"  || arg == "--no-flash-attn") { params.flash_attn    = false; }
+        else if (arg == "-la"   || arg == "--local-agreement") { params.agreement   = true; }
+        else if (                  arg == "--replay")        { params.fname_replay  = argv[++i]; }
+        else if (                  arg == "--replay-speed")  { params.replay_speed  = std::stof(argv[++i]); }
+        else if (                  arg == "--alignment")     { params.fname_align   = argv[++i]; }
+        else if (arg == "-oj"   || arg == "--output-json")   { params.fname_report  = argv[++i]; }
 
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
@@ -114,9 +137,252 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -ng,      --no-gpu        [%-7s] disable GPU inference\n",                          params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,      --flash-attn    [%-7s] enable flash attention during inference\n",        params.flash_attn ? "true" : "false");
     fprintf(stderr, "  -nfa,     --no-flash-attn [%-7s] disable flash attention during inference\n",       params.flash_attn ? "false" : "true");
+    fprintf(stderr, "  -la,      --local-agreement [%-5s] commit words once two steps agree, decode only the rest\n", params.agreement ? "true" : "false");
+    fprintf(stderr, "            --replay FNAME  [%-7s] replay an audio file instead of capturing\n",       params.fname_replay.c_str());
+    fprintf(stderr, "            --replay-speed N [%-5.2f] replay speed (1 - real time, 0 - as fast as possible)\n", params.replay_speed);
+    fprintf(stderr, "            --alignment F   [%-7s] reference word alignment of the replayed file\n", params.fname_align.c_str());
+    fprintf(stderr, "  -oj FNAME,--output-json   [%-7s] write the replay latency report to a JSON file\n",  params.fname_report.c_str());
     fprintf(stderr, "\n");
 }
 
+// latency of a replayed stream
+//
+// Times are in seconds of audio since the start of the stream. A step starts when its audio is
+// available and the previous step has finished, so the results do not depend on --replay-speed
+// as long as the replay is not slowed down by other processes.
+struct stream_report {
+    struct word {
+        double      t0;
+        double      t1;
+        std::string text;
+        double      t_emit = -1.0; // first step whose result contains the word
+    };
+
+    struct step {
+        double      t_audio;    // end of the audio of the step
+        double      t_emit;     // when the result is available
+        double      compute_ms;
+        double      mel_ms;
+        double      encode_ms;
+        double      decode_ms;
+        std::string text;
+    };
+
+    std::vector<word> words;
+    std::vector<step> steps;
+
+    double t_free = 0.0;
+
+    static std::vector<std::string> normalize(const std::string & text) {
+        std::vector<std::string> res;
+        std::string cur;
+        for (const char c : text + " ") {
+            if (std::isalnum((unsigned char) c) || c == '\'' || (unsigned char) c >= 0x80) {
+                cur += (char) std::tolower((unsigned char) c);
+            } else if (!cur.empty()) {
+                res.push_back(cur);
+                cur.clear();
+            }
+        }
+        return res;
+    }
+
+    // one word per line: "start end word", in seconds
+    bool load_alignment(const std::string & fname) {
+        std::ifstream fin(fname);
+        if (!fin) {
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+
+            std::istringstream ss(line);
+            word w;
+            if (ss >> w.t0 >> w.t1 >> w.text) {
+                const auto norm = normalize(w.text);
+                if (!norm.empty()) {
+                    w.text = norm[0];
+                    words.push_back(w);
+                }
+            }
+        }
+
+        return true;
+    }
+
+    void add_step(double t_audio, double compute_s, const whisper_metrics & m0, const whisper_metrics & m1, const std::string & text) {
+        step s;
+        s.t_audio    = t_audio;
+        s.t_emit     = std::max(t_audio, t_free) + compute_s;
+        s.compute_ms = 1e3*compute_s;
+        s.mel_ms     = 1e-3*(m1.t_mel_us    - m0.t_mel_us);
+        s.encode_ms  = 1e-3*(m1.t_encode_us - m0.t_encode_us);
+        s.decode_ms  = 1e-3*((m1.t_decode_us + m1.t_batchd_us + m1.t_prompt_us + m1.t_sample_us) -
+                             (m0.t_decode_us + m0.t_batchd_us + m0.t_prompt_us + m0.t_sample_us));
+        s.text       = text;
+
+        t_free = s.t_emit;
+
+        const auto hyp = normalize(text);
+        const std::set<std::string> hyp_set(hyp.begin(), hyp.end());
+        for (auto & w : words) {
+            if (w.t_emit < 0.0 && w.t1 <= t_audio && hyp_set.count(w.text)) {
+                w.t_emit = s.t_emit;
+            }
+        }
+
+        steps.push_back(std::move(s));
+    }
+
+    static json stats(std::vector<double> v) {
+        if (v.empty()) {
+            return json::object();
+        }
+        std::sort(v.begin(), v.end());
+        double sum = 0.0;
+        for (const double x : v) {
+            sum += x;
+        }
+        auto pct = [&](double p) { return v[std::min(v.size() - 1, (size_t) (p*v.size()))]; };
+        return json{ { "mean", sum/v.size() }, { "p50", pct(0.5) }, { "p90", pct(0.9) }, { "max", v.back() } };
+    }
+
+    json to_json(double audio_s, double wall_s, double cpu_s) const {
+        std::vector<double> compute_ms;
+        double compute_s = 0.0;
+        for (const auto & s : steps) {
+            compute_ms.push_back(s.compute_ms);
+            compute_s += 1e-3*s.compute_ms;
+        }
+
+        std::vector<double> latency;
+        for (const auto & w : words) {
+            if (w.t_emit >= 0.0) {
+                latency.push_back(w.t_emit - w.t1);
+            }
+        }
+
+        json jsteps = json::array();
+        for (const auto & s : steps) {
+            jsteps.push_back({
+                { "t_audio",    s.t_audio },
+                { "t_emit",     s.t_emit },
+                { "compute_ms", s.compute_ms },
+                { "mel_ms",     s.mel_ms },
+                { "encode_ms",  s.encode_ms },
+                { "decode_ms",  s.decode_ms },
+                { "text",       s.text },
+            });
+        }
+
+        json res = {
+            { "audio_s",    audio_s },
+            { "n_steps",    (int) steps.size() },
+            { "rtf",        compute_s/audio_s },
+            { "cpu_s",      cpu_s },
+            { "cpu_cores",  wall_s > 0.0 ? cpu_s/wall_s : 0.0 },
+            { "compute_ms", stats(compute_ms) },
+        };
+        if (!words.empty()) {
+            res["n_words"]         = (int) words.size();
+            res["n_words_emitted"] = (int) latency.size();
+            res["word_latency_s"]  = stats(latency);
+        }
+        res["steps"] = jsteps;
+
+        return res;
+    }
+};
+
+// LocalAgreement streaming (-la): the window starts where the committed text ends. Each step
+// transcribes the window with token timestamps; the words on which it agrees with the uncommitted
+// words of the previous step, from the first one on, are committed, printed once and their audio is
+// dropped from the window. The committed tokens are the prompt of the next steps, and only the
+// uncommitted tail is decoded again, so the cost of a step does not grow with the stream.
+struct stream_agreement {
+    struct word {
+        std::string text;
+        int64_t     t0; // ms since the start of the stream
+        int64_t     t1;
+
+        std::vector<whisper_token> tokens;
+    };
+
+    int64_t t_window = 0; // ms of the stream before the window
+
+    std::vector<word>          tail;   // uncommitted words of the last step
+    std::vector<whisper_token> prompt; // committed tokens, the last ones used as prompt
+
+    // the words of the last whisper_full() over the window
+    std::vector<word> hypothesis(struct whisper_context * ctx) const {
+        std::vector<word> res;
+
+        const whisper_token token_eot = whisper_token_eot(ctx);
+        for (int i = 0; i < whisper_full_n_segments(ctx); ++i) {
+            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+                const whisper_token_data data = whisper_full_get_token_data(ctx, i, j);
+                if (data.id >= token_eot) {
+                    continue;
+                }
+                const std::string text = whisper_full_get_token_text(ctx, i, j);
+                if (res.empty() || (!text.empty() && text[0] == ' ')) {
+                    res.push_back({ "", t_window + 10*data.t0, 0, {} });
+                }
+                res.back().text += text;
+                res.back().t1 = t_window + 10*data.t1;
+                res.back().tokens.push_back(data.id);
+            }
+        }
+
+        return res;
+    }
+
+    static bool same(const word & a, const word & b) {
+        return stream_report::normalize(a.text) == stream_report::normalize(b.text);
+    }
+
+    // commits the words of hyp that the previous step agrees on, all of them with flush
+    // force: the window is full, commit all but the last word
+    std::vector<word> commit(std::vector<word> hyp, bool force, bool flush) {
+        size_t n = 0;
+        while (n < hyp.size() && n < tail.size() && same(hyp[n], tail[n])) {
+            n++;
+        }
+        if (flush) {
+            n = hyp.size();
+        } else if (force && n == 0 && hyp.size() > 1) {
+            n = hyp.size() - 1;
+        }
+
+        std::vector<word> res(hyp.begin(), hyp.begin() + n);
+        tail.assign(hyp.begin() + n, hyp.end());
+
+        for (const auto & w : res) {
+            prompt.insert(prompt.end(), w.tokens.begin(), w.tokens.end());
+        }
+        if (prompt.size() > 224) {
+            prompt.erase(prompt.begin(), prompt.end() - 224);
+        }
+
+        return res;
+    }
+};
+
+// user + system CPU time of the process, in seconds
+static double stream_cpu_time() {
+#if !defined(_WIN32)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6*(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    }
+#endif
+    return 0.0;
+}
+
 int main(int argc, char ** argv) {
     ggml_backend_load_all();
 
@@ -136,21 +402,51 @@ int main(int argc, char ** argv) {
 
     const bool use_vad = n_samples_step <= 0; // sliding window mode uses VAD
 
+    if (params.agreement && use_vad) {
+        fprintf(stderr, "%s: --local-agreement needs --step > 0\n", __func__);
+        return 1;
+    }
+
     const int n_new_line = !use_vad ? std::max(1, params.length_ms / params.step_ms - 1) : 1; // number of steps to print new line
 
-    params.no_timestamps  = !use_vad;
+    params.no_timestamps  = !use_vad && !params.agreement;
     params.no_context    |= use_vad;
     params.max_tokens     = 0;
 
+    const bool replay = !params.fname_replay.empty();
+
     // init audio
 
+    std::vector<float> pcmf32_replay;
+    size_t replay_pos = 0;
+
+    stream_report report;
+
     audio_async audio(params.length_ms);
-    if (!audio.init(params.capture_id, WHISPER_SAMPLE_RATE)) {
-        fprintf(stderr, "%s: audio.init() failed!\n", __func__);
-        return 1;
-    }
+    if (replay) {
+        if (use_vad) {
+            fprintf(stderr, "%s: --replay needs --step > 0\n", __func__);
+            return 1;
+        }
 
-    audio.resume();
+        std::vector<std::vector<float>> pcmf32s;
+        if (!read_audio_data(params.fname_replay, pcmf32_replay, pcmf32s, false)) {
+            fprintf(stderr, "%s: failed to read audio file '%s'\n", __func__, params.fname_replay.c_str());
+            return 1;
+        }
+
+        if (!params.fname_align.empty() && !report.load_alignment(params.fname_align)) {
+            fprintf(stderr, "%s: failed to read alignment '%s'\n", __func__, params.fname_align.c_str());
+            return 1;
+        }
+    } else {
+        if (!audio.init(params.capture_id, WHISPER_SAMPLE_RATE)) {
+            fprintf(stderr, "%s: audio.init() failed!\n", __func__);
+            return 1;
+        }
+
+        audio.resume();
+    }
 
     // whisper init
     if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1){
@@ -176,6 +472,9 @@ int main(int argc, char ** argv) {
 
     std::vector<whisper_token> prompt_tokens;
 
+    stream_agreement agreement;
+    std::string      committed_line; // committed text of the current output line
+
     // print some info about the processing
     {
         fprintf(stderr, "\n");
@@ -236,13 +535,20 @@ int main(int argc, char ** argv) {
     auto t_last  = std::chrono::high_resolution_clock::now();
     const auto t_start = t_last;
 
+    const double cpu_start = stream_cpu_time();
+
+    // VAD mode: end of speech detector over the last 2 s, fed incrementally
+    vad_energy vad(WHISPER_SAMPLE_RATE, 2000, 1000, params.vad_thold, params.freq_thold);
+    uint64_t   vad_pos = 0;
+    audio_view vad_view;
+
     // main audio loop
     while (is_running) {
         if (params.save_audio) {
             wavWriter.write(pcmf32_new.data(), pcmf32_new.size());
         }
         // handle Ctrl + C
-        is_running = sdl_poll_events();
+        is_running = replay || sdl_poll_events();
 
         if (!is_running) {
             break;
@@ -250,8 +556,25 @@ int main(int argc, char ** argv) {
 
         // process new audio
 
+        int64_t t_compute_us = 0;
+
+        if (replay) {
+            if (replay_pos >= pcmf32_replay.size()) {
+                break;
+            }
+
+            const size_t n = std::min(pcmf32_replay.size() - replay_pos, (size_t) n_samples_step);
+            pcmf32_new.assign(pcmf32_replay.begin() + replay_pos, pcmf32_replay.begin() + replay_pos + n);
+            replay_pos += n;
+
+            // the audio of the step is complete
+            if (params.replay_speed > 0.0f) {
+                std::this_thread::sleep_until(t_start + std::chrono::microseconds((int64_t) (1e6*replay_pos/WHISPER_SAMPLE_RATE/params.replay_speed)));
+            }
+        }
+
         if (!use_vad) {
-            while (true) {
+            while (!replay) {
                 // handle Ctrl + C
                 is_running = sdl_poll_events();
                 if (!is_running) {
@@ -276,7 +599,9 @@ int main(int argc, char ** argv) {
             const int n_samples_new = pcmf32_new.size();
 
             // take up to params.length_ms audio from previous iteration
-            const int n_samples_take = std::min((int) pcmf32_old.size(), std::max(0, n_samples_keep + n_samples_len - n_samples_new));
+            // with -la, all of the audio after the committed text
+            const int n_samples_take = params.agreement ? (int) pcmf32_old.size() :
+                std::min((int) pcmf32_old.size(), std::max(0, n_samples_keep + n_samples_len - n_samples_new));
 
             //printf("processing: take = %d, new = %d, old = %d\n", n_samples_take, n_samples_new, (int) pcmf32_old.size());
 
@@ -289,26 +614,32 @@ int main(int argc, char ** argv) {
             memcpy(pcmf32.data() + n_samples_take, pcmf32_new.data(), n_samples_new*sizeof(float));
 
             pcmf32_old = pcmf32;
-        } else {
-            const auto t_now  = std::chrono::high_resolution_clock::now();
-            const auto t_diff = std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_last).count();
 
-            if (t_diff < 2000) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            t_compute_us = ggml_time_us();
 
-                continue;
+            // pcmf32 is always the tail of the stream, so only the new audio needs a spectrogram
+            if (whisper_mel_stream_append(ctx, pcmf32_new.data(), n_samples_new, params.n_threads) != 0) {
+                fprintf(stderr, "%s: failed to compute the spectrogram\n", argv[0]);
+                return 6;
             }
+        } else {
+            // only the audio captured since the last poll goes through the detector
+            audio.peek_new(vad_pos, vad_view);
+            vad.push(vad_view.data[0], vad_view.size[0]);
+            vad.push(vad_view.data[1], vad_view.size[1]);
 
-            audio.get(2000, pcmf32_new);
+            const auto t_now  = std::chrono::high_resolution_clock::now();
+            const auto t_diff = std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_last).count();
 
-            if (::vad_simple(pcmf32_new, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, false)) {
-                audio.get(params.length_ms, pcmf32);
-            } else {
+            if (t_diff < 2000 || !vad.speech_ended()) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
                 continue;
             }
 
+            audio.get(params.length_ms, pcmf32);
+            vad.reset();
+
             t_last = t_now;
         }
 
@@ -321,7 +652,8 @@ int main(int argc, char ** argv) {
             wparams.print_realtime   = false;
             wparams.print_timestamps = !params.no_timestamps;
             wparams.translate        = params.translate;
-            wparams.single_segment   = !use_vad;
+            wparams.single_segment   = !use_vad && !params.agreement;
+            wparams.token_timestamps = params.agreement;
             wparams.max_tokens       = params.max_tokens;
             wparams.language         = params.language.c_str();
             wparams.n_threads        = params.n_threads;
@@ -338,11 +670,88 @@ int main(int argc, char ** argv) {
             wparams.prompt_tokens    = params.no_context ? nullptr : prompt_tokens.data();
             wparams.prompt_n_tokens  = params.no_context ? 0       : prompt_tokens.size();
 
-            if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            if (params.agreement) {
+                wparams.print_timestamps = false;
+                wparams.no_context       = true;
+                wparams.prompt_tokens    = agreement.prompt.data();
+                wparams.prompt_n_tokens  = agreement.prompt.size();
+            }
+
+            const whisper_metrics m0 = whisper_get_metrics(ctx);
+
+            int ret;
+            if (!use_vad) {
+                ret = whisper_mel_stream_window(ctx, pcmf32.size());
+                if (ret == 0) {
+                    ret = whisper_full(ctx, wparams, nullptr, 0);
+                }
+            } else {
+                ret = whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size());
+            }
+            if (ret != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 return 6;
             }
 
+            if (params.agreement) {
+                const bool flush = replay && replay_pos >= pcmf32_replay.size();
+                const bool force = (int) pcmf32.size() + n_samples_step > std::min(n_samples_len, n_samples_30s);
+
+                const auto words = agreement.commit(agreement.hypothesis(ctx), force, flush);
+
+                std::string text;
+                for (const auto & w : words) {
+                    text += w.text;
+                }
+
+                if (replay) {
+                    report.add_step(double(replay_pos)/WHISPER_SAMPLE_RATE, 1e-6*(ggml_time_us() - t_compute_us),
+                                    m0, whisper_get_metrics(ctx), text);
+                }
+
+                // drop the committed audio from the window, or all but the last step of a full window without words
+                size_t n_drop = 0;
+                if (!words.empty()) {
+                    const int64_t t_end = std::max(agreement.t_window, words.back().t1);
+                    n_drop = std::min(pcmf32_old.size(), (size_t) ((t_end - agreement.t_window)*WHISPER_SAMPLE_RATE/1000));
+                } else if (force) {
+                    n_drop = pcmf32_old.size() - std::min(pcmf32_old.size(), (size_t) n_samples_step);
+                    agreement.tail.clear();
+                }
+                pcmf32_old.erase(pcmf32_old.begin(), pcmf32_old.begin() + n_drop);
+                agreement.t_window += (int64_t) n_drop*1000/WHISPER_SAMPLE_RATE;
+
+                // the committed text stays, the uncommitted tail is redrawn each step
+                std::string tail;
+                for (const auto & w : agreement.tail) {
+                    tail += w.text;
+                }
+                committed_line += text;
+
+                printf("\33[2K\r%s\033[90m%s\033[0m", committed_line.c_str(), tail.c_str());
+                if (committed_line.size() > 80 || flush) {
+                    printf("\n");
+                    committed_line.clear();
+                }
+                fflush(stdout);
+
+                if (params.fname_out.length() > 0) {
+                    fout << text << std::flush;
+                }
+
+                ++n_iter;
+                continue;
+            }
+
+            if (replay) {
+                std::string text;
+                for (int i = 0; i < whisper_full_n_segments(ctx); ++i) {
+                    text += whisper_full_get_segment_text(ctx, i);
+                }
+                report.add_step(double(replay_pos)/WHISPER_SAMPLE_RATE, 1e-6*(ggml_time_us() - t_compute_us),
+                                m0, whisper_get_metrics(ctx), text);
+            }
+
             // print result;
             {
                 if (!use_vad) {
@@ -428,7 +837,31 @@ int main(int argc, char ** argv) {
         }
     }
 
-    audio.pause();
+    if (replay) {
+        const double wall_s = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t_start).count();
+        const json jreport  = report.to_json(double(pcmf32_replay.size())/WHISPER_SAMPLE_RATE, wall_s, stream_cpu_time() - cpu_start);
+
+        fprintf(stderr, "\n\n%s: replay: %d steps, compute p50 = %.1f ms, max = %.1f ms, rtf = %.3f, cpu cores = %.2f\n", __func__,
+                jreport["n_steps"].get<int>(),
+                jreport["compute_ms"].value("p50", 0.0), jreport["compute_ms"].value("max", 0.0),
+                jreport["rtf"].get<double>(), jreport["cpu_cores"].get<double>());
+        if (jreport.contains("word_latency_s")) {
+            fprintf(stderr, "%s: replay: %d / %d words emitted, latency after the end of the word p50 = %.2f s, p90 = %.2f s\n", __func__,
+                    jreport["n_words_emitted"].get<int>(), jreport["n_words"].get<int>(),
+                    jreport["word_latency_s"].value("p50", 0.0), jreport["word_latency_s"].value("p90", 0.0));
+        }
+
+        if (!params.fname_report.empty()) {
+            std::ofstream fout_report(params.fname_report);
+            if (!fout_report) {
+                fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, params.fname_report.c_str());
+            } else {
+                fout_report << jreport.dump(2) << "\n";
+            }
+        }
+    } else {
+        audio.pause();
+    }
 
     whisper_print_timings(ctx);
     whisper_free(ctx);
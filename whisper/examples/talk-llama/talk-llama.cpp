@@ -6,11 +6,15 @@
 #include "common-whisper.h"
 #include "whisper.h"
 #include "llama.h"
+#include "gguf.h"
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
 #include <fstream>
-#include <regex>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <string>
@@ -60,7 +64,10 @@ struct whisper_params {
     int32_t max_tokens = 32;
     int32_t audio_ctx  = 0;
     int32_t n_gpu_layers = 999;
+    int32_t gpu_device = 0;
+    int32_t vram_mb = 0;
     int32_t seed = 0;
+    int32_t partial_ms = 1000;
     int32_t top_k = 5;
     int32_t min_keep = 1;
     float top_p = 0.80f;
@@ -77,6 +84,8 @@ struct whisper_params {
     bool verbose_prompt = false;
     bool use_gpu        = true;
     bool flash_attn     = true;
+    bool pipeline       = false;
+    bool shared_threads = true;
 
     std::string person      = "Georgi";
     std::string bot_name    = "LLaMA";
@@ -108,6 +117,9 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-mt"  || arg == "--max-tokens")     { params.max_tokens     = std::stoi(argv[++i]); }
         else if (arg == "-ac"  || arg == "--audio-ctx")      { params.audio_ctx      = std::stoi(argv[++i]); }
         else if (arg == "-ngl" || arg == "--n-gpu-layers")   { params.n_gpu_layers   = std::stoi(argv[++i]); }
+        else if (arg == "-dev" || arg == "--device")         { params.gpu_device     = std::stoi(argv[++i]); }
+        else if (arg == "-vram"|| arg == "--vram-budget")    { params.vram_mb        = std::stoi(argv[++i]); }
+        else if (arg == "-nst" || arg == "--no-shared-threads") { params.shared_threads = false; }
         else if (arg == "--seed")                            { params.seed           = std::stoi(argv[++i]); }
         else if (arg == "--top-k")                           { params.top_k          = std::stoi(argv[++i]); }
         else if (arg == "--min-keep")                        { params.min_keep       = std::stoul(argv[++i]);}
@@ -123,6 +135,8 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-ng"  || arg == "--no-gpu")         { params.use_gpu        = false; }
         else if (arg == "-fa"  || arg == "--flash-attn")     { params.flash_attn     = true; }
         else if (arg == "-nfa" || arg == "--no-flash-attn")  { params.flash_attn     = false; }
+        else if (arg == "-pl"  || arg == "--pipeline")       { params.pipeline       = true; }
+        else if (arg == "-pms" || arg == "--partial-ms")     { params.partial_ms     = std::stoi(argv[++i]); }
         else if (arg == "-p"   || arg == "--person")         { params.person         = argv[++i]; }
         else if (arg == "-bn"   || arg == "--bot-name")      { params.bot_name       = argv[++i]; }
         else if (arg == "--session")                         { params.path_session   = argv[++i]; }
@@ -163,6 +177,9 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -mt N,    --max-tokens N   [%-7d] maximum number of tokens per audio chunk\n",    params.max_tokens);
     fprintf(stderr, "  -ac N,    --audio-ctx N    [%-7d] audio context size (0 - all)\n",                params.audio_ctx);
     fprintf(stderr, "  -ngl N,   --n-gpu-layers N [%-7d] number of layers to store in VRAM\n",           params.n_gpu_layers);
+    fprintf(stderr, "  -dev N,   --device N       [%-7d] GPU device used by both whisper and LLaMA\n",   params.gpu_device);
+    fprintf(stderr, "  -vram N,  --vram-budget N  [%-7d] MiB of VRAM for both models, fewer LLaMA layers are offloaded to fit (0 - -ngl)\n", params.vram_mb);
+    fprintf(stderr, "  -nst,     --no-shared-threads [%-7s] separate CPU threads for whisper and LLaMA\n", params.shared_threads ? "false" : "true");
     fprintf(stderr, "  --seed N                   [%-7d] seed sampling\n",                               params.seed);
     fprintf(stderr, "  --top-k N                  [%-7d] top-k sampling (0 = disabled)\n",               params.top_k);
     fprintf(stderr, "  --min-keep N               [%-7d] minimum number of tokens to keep\n",            params.min_keep);
@@ -178,6 +195,8 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -ng,      --no-gpu         [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,      --flash-attn     [%-7s] enable flash attention\n",                      params.flash_attn ? "true" : "false");
     fprintf(stderr, "  -nfa,     --no-flash-attn  [%-7s] disable flash attention\n",                     params.flash_attn ? "false" : "true");
+    fprintf(stderr, "  -pl,      --pipeline       [%-7s] prefill LLaMA while listening, speak the reply while generating\n", params.pipeline ? "true" : "false");
+    fprintf(stderr, "  -pms N,   --partial-ms N   [%-7d] pipeline: milliseconds between partial transcriptions\n", params.partial_ms);
     fprintf(stderr, "  -p NAME,  --person NAME    [%-7s] person name (for prompt selection)\n",          params.person.c_str());
     fprintf(stderr, "  -bn NAME, --bot-name NAME  [%-7s] bot name (to display)\n",                       params.bot_name.c_str());
     fprintf(stderr, "  -w TEXT,  --wake-command T [%-7s] wake-up command to listen for\n",               params.wake_cmd.c_str());
@@ -272,6 +291,225 @@ static std::vector<std::string> get_words(const std::string &txt) {
     return words;
 }
 
+typedef ggml_threadpool_t (*ggml_threadpool_new_t)(struct ggml_threadpool_params * params);
+typedef void (*ggml_threadpool_free_t)(ggml_threadpool_t threadpool);
+
+// CPU worker threads for both whisper and LLaMA, from the CPU backend (looked up at run time, as it may be a loadable module)
+// the two never compute at the same time here, and two teams of workers would spin against each other for the same cores
+static ggml_threadpool_t shared_threadpool_new(int n_threads, ggml_threadpool_free_t & fn_free) {
+    ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+    if (!reg) {
+        return nullptr;
+    }
+
+    auto * fn_new = (ggml_threadpool_new_t)  ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+    fn_free       = (ggml_threadpool_free_t) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+    if (!fn_new || !fn_free) {
+        return nullptr;
+    }
+
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+
+    return fn_new(&tpp);
+}
+
+// the GPU device with the given index, counted the same way as whisper_context_params.gpu_device
+static ggml_backend_dev_t gpu_device_get(int index) {
+    int cnt = 0;
+    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        const auto type = ggml_backend_dev_type(dev);
+        if (type == GGML_BACKEND_DEVICE_TYPE_GPU || type == GGML_BACKEND_DEVICE_TYPE_IGPU) {
+            if (cnt++ == index) {
+                return dev;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+// the number of repeating layers of a LLaMA model whose weights and f16 KV cache fit in budget bytes
+// the compute buffers are not known before the context is created, 10% of the budget (at least 256 MiB) is kept for them
+static int llama_layers_fit(const std::string & fname, int n_ctx, size_t budget) {
+    struct gguf_init_params gparams = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+
+    struct gguf_context * gctx = gguf_init_from_file(fname.c_str(), gparams);
+    if (!gctx) {
+        return -1;
+    }
+
+    const auto get_u32 = [&](const std::string & key, uint32_t def) {
+        const int64_t id = gguf_find_key(gctx, key.c_str());
+        return id >= 0 && gguf_get_kv_type(gctx, id) == GGUF_TYPE_UINT32 ? gguf_get_val_u32(gctx, id) : def;
+    };
+
+    const int64_t id_arch = gguf_find_key(gctx, "general.architecture");
+    const std::string arch = id_arch >= 0 ? gguf_get_val_str(gctx, id_arch) : "llama";
+
+    const uint32_t n_layer   = get_u32(arch + ".block_count", 0);
+    const uint32_t n_embd    = get_u32(arch + ".embedding_length", 0);
+    const uint32_t n_head    = get_u32(arch + ".attention.head_count", 1);
+    const uint32_t n_head_kv = get_u32(arch + ".attention.head_count_kv", n_head);
+
+    std::vector<size_t> layer_size(n_layer, 0);
+    for (int64_t i = 0; i < gguf_get_n_tensors(gctx); ++i) {
+        int il = -1;
+        if (sscanf(gguf_get_tensor_name(gctx, i), "blk.%d.", &il) == 1 && il >= 0 && il < (int) n_layer) {
+            layer_size[il] += gguf_get_tensor_size(gctx, i);
+        }
+    }
+
+    gguf_free(gctx);
+
+    const size_t kv_size = (size_t) n_ctx*2*(n_embd/std::max(1u, n_head))*n_head_kv*sizeof(ggml_fp16_t);
+    const size_t reserve = std::max<size_t>(256ull*1024*1024, budget/10);
+
+    // llama offloads the last layers first
+    size_t used = reserve;
+    int n_fit = 0;
+    for (int il = (int) n_layer - 1; il >= 0; --il) {
+        if (used + layer_size[il] + kv_size > budget) {
+            break;
+        }
+        used += layer_size[il] + kv_size;
+        n_fit++;
+    }
+
+    return n_fit;
+}
+
+// splits the wake-up command off a transcript and removes annotations and unsupported characters from the rest
+static std::string text_from_heard(const std::string & all_heard, int wake_cmd_length, std::string & wake_cmd_heard) {
+    const auto words = get_words(all_heard);
+
+    std::string text_heard;
+
+    wake_cmd_heard.clear();
+
+    for (int i = 0; i < (int) words.size(); ++i) {
+        if (i < wake_cmd_length) {
+            wake_cmd_heard += words[i] + " ";
+        } else {
+            text_heard += words[i] + " ";
+        }
+    }
+
+    // remove text between brackets using regex
+    {
+        std::regex re("\\[.*?\\]");
+        text_heard = std::regex_replace(text_heard, re, "");
+    }
+
+    // remove text between brackets using regex
+    {
+        std::regex re("\\(.*?\\)");
+        text_heard = std::regex_replace(text_heard, re, "");
+    }
+
+    // remove all characters, except for letters, numbers, punctuation and ':', '\'', '-', ' '
+    text_heard = std::regex_replace(text_heard, std::regex("[^a-zA-Z0-9åäöÅÄÖ\\.,\\?!\\s\\:\\'\\-]"), "");
+
+    // take first line
+    text_heard = text_heard.substr(0, text_heard.find_first_of('\n'));
+
+    // remove leading and trailing whitespace
+    text_heard = std::regex_replace(text_heard, std::regex("^\\s+"), "");
+    text_heard = std::regex_replace(text_heard, std::regex("\\s+$"), "");
+
+    return text_heard;
+}
+
+static size_t common_prefix(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+
+    return n;
+}
+
+// length of the finished sentences at the start of text, 0 if none
+// a sentence is finished by a new line or by '.', '?' or '!' followed by a space, so that "3.5" is not split
+static size_t sentences_end(const std::string & text) {
+    for (size_t i = text.size(); i-- > 0; ) {
+        if (text[i] == '\n') {
+            return i + 1;
+        }
+        if ((text[i] == '.' || text[i] == '?' || text[i] == '!') && i + 1 < text.size() && isspace((unsigned char) text[i + 1])) {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+// speaks the sentences of a reply in order on its own thread, while the rest of the reply is generated
+struct tts_queue {
+    std::string command;
+    std::string path;
+    int         voice_id = 0;
+
+    std::thread             worker;
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<std::string> texts;
+
+    bool busy = false;
+    bool stop = false;
+
+    void start() {
+        worker = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cv.wait(lock, [this]() { return stop || !texts.empty(); });
+                if (texts.empty()) {
+                    break;
+                }
+
+                const std::string text = std::move(texts.front());
+                texts.pop_front();
+                busy = true;
+
+                lock.unlock();
+                speak_with_file(command, text, path, voice_id);
+                lock.lock();
+
+                busy = false;
+                cv.notify_all();
+            }
+        });
+    }
+
+    void push(const std::string & text) {
+        if (text.find_first_not_of(" \t\n") == std::string::npos) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        texts.push_back(text);
+        cv.notify_all();
+    }
+
+    // until everything pushed has been spoken
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return texts.empty() && !busy; });
+    }
+
+    ~tts_queue() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+                cv.notify_all();
+            }
+            worker.join();
+        }
+    }
+};
+
 const std::string k_prompt_whisper = R"(A conversation with a person called {1}.)";
 
 const std::string k_prompt_llama = R"(Text transcript of a never ending dialog, where {0} interacts with an AI assistant named {1}.
@@ -307,12 +545,36 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    // tune this to your liking
+    const int n_ctx_llama = 2048;
+
+    ggml_threadpool_t      threadpool      = nullptr;
+    ggml_threadpool_free_t threadpool_free = nullptr;
+
+    if (params.shared_threads) {
+        threadpool = shared_threadpool_new(params.n_threads, threadpool_free);
+        if (!threadpool) {
+            fprintf(stderr, "%s: WARNING: failed to create a shared threadpool\n", __func__);
+        }
+    }
+
+    // both models on the same GPU
+    ggml_backend_dev_t dev_gpu = params.use_gpu ? gpu_device_get(params.gpu_device) : nullptr;
+
+    size_t vram_free = 0;
+    size_t vram_total = 0;
+    if (dev_gpu) {
+        ggml_backend_dev_memory(dev_gpu, &vram_free, &vram_total);
+    }
+
     // whisper init
 
     struct whisper_context_params cparams = whisper_context_default_params();
 
     cparams.use_gpu    = params.use_gpu;
     cparams.flash_attn = params.flash_attn;
+    cparams.gpu_device = params.gpu_device;
+    cparams.threadpool = threadpool;
 
     struct whisper_context * ctx_wsp = whisper_init_from_file_with_params(params.model_wsp.c_str(), cparams);
     if (!ctx_wsp) {
@@ -320,6 +582,22 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // what whisper took is taken off the budget, and LLaMA gets as many layers as fit in the rest
+    if (dev_gpu && params.vram_mb > 0) {
+        size_t vram_free_wsp = 0;
+        ggml_backend_dev_memory(dev_gpu, &vram_free_wsp, &vram_total);
+
+        const size_t used_wsp = vram_free > vram_free_wsp ? vram_free - vram_free_wsp : 0;
+        const size_t budget   = std::min(vram_free_wsp, (size_t) params.vram_mb*1024*1024 - std::min(used_wsp, (size_t) params.vram_mb*1024*1024));
+
+        const int n_fit = llama_layers_fit(params.model_llama, n_ctx_llama, budget);
+        if (n_fit >= 0) {
+            fprintf(stderr, "%s: whisper uses %zu MiB of VRAM, %d LLaMA layers fit in the remaining %zu MiB\n",
+                    __func__, used_wsp/1024/1024, n_fit, budget/1024/1024);
+            params.n_gpu_layers = std::min(params.n_gpu_layers, n_fit);
+        }
+    }
+
     // llama init
 
     llama_backend_init();
@@ -331,6 +609,11 @@ int main(int argc, char ** argv) {
         lmparams.n_gpu_layers = params.n_gpu_layers;
     }
 
+    ggml_backend_dev_t llama_devices[] = { dev_gpu, nullptr };
+    if (dev_gpu) {
+        lmparams.devices = llama_devices;
+    }
+
     struct llama_model * model_llama = llama_model_load_from_file(params.model_llama.c_str(), lmparams);
     if (!model_llama) {
         fprintf(stderr, "No llama.cpp model specified. Please provide using -ml <modelfile>\n");
@@ -341,14 +624,17 @@ int main(int argc, char ** argv) {
 
     llama_context_params lcparams = llama_context_default_params();
 
-    // tune these to your liking
-    lcparams.n_ctx     = 2048;
+    lcparams.n_ctx     = n_ctx_llama;
     lcparams.n_threads = params.n_threads;
 
     lcparams.flash_attn_type = params.flash_attn ? LLAMA_FLASH_ATTN_TYPE_AUTO : LLAMA_FLASH_ATTN_TYPE_DISABLED;
 
     struct llama_context * ctx_llama = llama_init_from_model(model_llama, lcparams);
 
+    if (threadpool) {
+        llama_attach_threadpool(ctx_llama, threadpool, threadpool);
+    }
+
     // print some info about the processing
     {
         fprintf(stderr, "\n");
@@ -390,6 +676,11 @@ int main(int argc, char ** argv) {
     std::vector<float> pcmf32_cur;
     std::vector<float> pcmf32_prompt;
 
+    // end of speech detector over the last 2 s, fed with the audio captured since the previous poll
+    vad_energy vad(WHISPER_SAMPLE_RATE, 2000, 1250, params.vad_thold, params.freq_thold);
+    uint64_t   vad_pos = 0;
+    audio_view vad_view;
+
     const std::string prompt_whisper = ::replace(k_prompt_whisper, "{1}", params.bot_name);
 
     // construct the initial prompt for LLaMA inference
@@ -564,6 +855,28 @@ int main(int argc, char ** argv) {
         params.person + chat_symb,
     };
 
+    // pipeline: tokens of the turn being spoken that are already in the KV cache at n_past, and the last partial transcript
+    std::vector<llama_token> prefilled;
+    std::vector<llama_token> partial_tokens;
+
+    auto t_partial = std::chrono::steady_clock::now();
+
+    const auto drop_prefill = [&]() {
+        if (!prefilled.empty()) {
+            llama_memory_seq_rm(llama_get_memory(ctx_llama), 0, n_past, -1);
+        }
+        prefilled.clear();
+        partial_tokens.clear();
+    };
+
+    tts_queue tts;
+    if (params.pipeline) {
+        tts.command  = params.speak;
+        tts.path     = params.speak_file;
+        tts.voice_id = voice_id;
+        tts.start();
+    }
+
     // main loop
     while (is_running) {
         // handle Ctrl + C
@@ -579,9 +892,11 @@ int main(int argc, char ** argv) {
         int64_t t_ms = 0;
 
         {
-            audio.get(2000, pcmf32_cur);
+            audio.peek_new(vad_pos, vad_view);
+            vad.push(vad_view.data[0], vad_view.size[0]);
+            vad.push(vad_view.data[1], vad_view.size[1]);
 
-            if (::vad_simple(pcmf32_cur, WHISPER_SAMPLE_RATE, 1250, params.vad_thold, params.freq_thold, params.print_energy) || force_speak) {
+            if (vad.speech_ended(params.print_energy) || force_speak) {
                 //fprintf(stdout, "%s: Speech detected! Processing ...\n", __func__);
 
                 audio.get(params.voice_ms, pcmf32_cur);
@@ -592,61 +907,37 @@ int main(int argc, char ** argv) {
                     all_heard = ::trim(::transcribe(ctx_wsp, params, pcmf32_cur, prompt_whisper, prob0, t_ms));
                 }
 
-                const auto words = get_words(all_heard);
-
                 std::string wake_cmd_heard;
-                std::string text_heard;
-
-                for (int i = 0; i < (int) words.size(); ++i) {
-                    if (i < wake_cmd_length) {
-                        wake_cmd_heard += words[i] + " ";
-                    } else {
-                        text_heard += words[i] + " ";
-                    }
-                }
+                std::string text_heard = text_from_heard(all_heard, wake_cmd_length, wake_cmd_heard);
 
                 // check if audio starts with the wake-up command if enabled
                 if (use_wake_cmd) {
                     const float sim = similarity(wake_cmd_heard, wake_cmd);
 
                     if ((sim < 0.7f) || (text_heard.empty())) {
+                        drop_prefill();
                         audio.clear();
+                        vad.reset();
                         continue;
                     }
                 }
 
                 // optionally give audio feedback that the current text is being processed
                 if (!params.heard_ok.empty()) {
-                    speak_with_file(params.speak, params.heard_ok, params.speak_file, voice_id);
-                }
-
-                // remove text between brackets using regex
-                {
-                    std::regex re("\\[.*?\\]");
-                    text_heard = std::regex_replace(text_heard, re, "");
-                }
-
-                // remove text between brackets using regex
-                {
-                    std::regex re("\\(.*?\\)");
-                    text_heard = std::regex_replace(text_heard, re, "");
+                    if (params.pipeline) {
+                        tts.push(params.heard_ok);
+                    } else {
+                        speak_with_file(params.speak, params.heard_ok, params.speak_file, voice_id);
+                    }
                 }
 
-                // remove all characters, except for letters, numbers, punctuation and ':', '\'', '-', ' '
-                text_heard = std::regex_replace(text_heard, std::regex("[^a-zA-Z0-9åäöÅÄÖ\\.,\\?!\\s\\:\\'\\-]"), "");
-
-                // take first line
-                text_heard = text_heard.substr(0, text_heard.find_first_of('\n'));
-
-                // remove leading and trailing whitespace
-                text_heard = std::regex_replace(text_heard, std::regex("^\\s+"), "");
-                text_heard = std::regex_replace(text_heard, std::regex("\\s+$"), "");
-
                 const std::vector<llama_token> tokens = llama_tokenize(ctx_llama, text_heard.c_str(), false);
 
                 if (text_heard.empty() || tokens.empty() || force_speak) {
                     //fprintf(stdout, "%s: Heard nothing, skipping ...\n", __func__);
+                    drop_prefill();
                     audio.clear();
+                    vad.reset();
 
                     continue;
                 }
@@ -665,6 +956,25 @@ int main(int argc, char ** argv) {
                     session_tokens.insert(session_tokens.end(), tokens.begin(), tokens.end());
                 }
 
+                // the tokens prefilled from partial transcripts that the final one agrees with are already in the KV cache
+                if (!prefilled.empty()) {
+                    const size_t n_reuse = std::min(common_prefix(prefilled, embd), embd.size() - 1);
+
+                    llama_memory_seq_rm(llama_get_memory(ctx_llama), 0, n_past + n_reuse, -1);
+
+                    embd_inp.insert(embd_inp.end(), embd.begin(), embd.begin() + n_reuse);
+                    if (!path_session.empty()) {
+                        session_tokens.insert(session_tokens.end(), embd.begin(), embd.begin() + n_reuse);
+                        n_session_consumed = session_tokens.size();
+                    }
+                    n_past += n_reuse;
+
+                    embd.erase(embd.begin(), embd.begin() + n_reuse);
+
+                    prefilled.clear();
+                    partial_tokens.clear();
+                }
+
                 // text inference
                 bool done = false;
                 std::string text_to_speak;
@@ -758,6 +1068,15 @@ int main(int argc, char ** argv) {
 
                             text_to_speak += llama_token_to_piece(ctx_llama, id);
 
+                            // hand each finished sentence to TTS, the antiprompt is never in one
+                            if (params.pipeline) {
+                                const size_t n = sentences_end(text_to_speak);
+                                if (n > 0) {
+                                    tts.push(text_to_speak.substr(0, n));
+                                    text_to_speak.erase(0, n);
+                                }
+                            }
+
                             printf("%s", llama_token_to_piece(ctx_llama, id).c_str());
                             fflush(stdout);
                         }
@@ -788,9 +1107,74 @@ int main(int argc, char ** argv) {
                     }
                 }
 
-                speak_with_file(params.speak, text_to_speak, params.speak_file, voice_id);
+                if (params.pipeline) {
+                    tts.push(text_to_speak);
+                    tts.wait();
+                } else {
+                    speak_with_file(params.speak, text_to_speak, params.speak_file, voice_id);
+                }
 
                 audio.clear();
+                vad.reset();
+                t_partial = std::chrono::steady_clock::now();
+            } else if (params.pipeline && n_session_consumed >= (int) session_tokens.size()) {
+                // while the person is speaking, transcribe what was said so far and prefill the part
+                // that two partial transcripts agree on, so that only the rest is decoded once they stop
+                const auto t_now = std::chrono::steady_clock::now();
+
+                if (t_now - t_partial < std::chrono::milliseconds(params.partial_ms) ||
+                    vad.energy_last() <= params.vad_thold*vad.energy_all()) {
+                    continue;
+                }
+
+                t_partial = t_now;
+
+                audio.get(params.voice_ms, pcmf32_cur);
+                if ((int) pcmf32_cur.size() < WHISPER_SAMPLE_RATE) {
+                    continue;
+                }
+
+                std::string wake_cmd_heard;
+                const std::string text_heard = text_from_heard(::transcribe(ctx_wsp, params, pcmf32_cur, prompt_whisper, prob0, t_ms), wake_cmd_length, wake_cmd_heard);
+
+                if (text_heard.empty() || (use_wake_cmd && similarity(wake_cmd_heard, wake_cmd) < 0.7f)) {
+                    continue;
+                }
+
+                const auto tokens = ::llama_tokenize(ctx_llama, " " + text_heard, false);
+
+                // the last token may still change with more audio
+                const size_t n_stable = std::min(common_prefix(tokens, partial_tokens), tokens.size() - 1);
+                partial_tokens = tokens;
+
+                if (n_past + (int) n_stable + n_prev >= n_ctx) {
+                    continue;
+                }
+
+                const size_t n_keep_prefill = common_prefix(prefilled, tokens);
+                if (n_keep_prefill < prefilled.size()) {
+                    llama_memory_seq_rm(llama_get_memory(ctx_llama), 0, n_past + n_keep_prefill, -1);
+                    prefilled.resize(n_keep_prefill);
+                }
+
+                if (n_stable > prefilled.size()) {
+                    batch.n_tokens = n_stable - prefilled.size();
+
+                    for (int i = 0; i < batch.n_tokens; i++) {
+                        batch.token[i]     = tokens[prefilled.size() + i];
+                        batch.pos[i]       = n_past + prefilled.size() + i;
+                        batch.n_seq_id[i]  = 1;
+                        batch.seq_id[i][0] = 0;
+                        batch.logits[i]    = false;
+                    }
+
+                    if (llama_decode(ctx_llama, batch)) {
+                        fprintf(stderr, "%s : failed to decode\n", __func__);
+                        return 1;
+                    }
+
+                    prefilled.assign(tokens.begin(), tokens.begin() + n_stable);
+                }
             }
         }
     }
@@ -806,6 +1190,11 @@ int main(int argc, char ** argv) {
     llama_sampler_free(smpl);
     llama_batch_free(batch);
     llama_free(ctx_llama);
+    llama_model_free(model_llama);
+
+    if (threadpool) {
+        threadpool_free(threadpool);
+    }
 
     llama_backend_free();
 
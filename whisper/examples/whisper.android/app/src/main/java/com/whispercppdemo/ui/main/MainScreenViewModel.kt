@@ -21,6 +21,8 @@ import kotlinx.coroutines.launch
 import kotlinx.coroutines.runBlocking
 import kotlinx.coroutines.withContext
 import java.io.File
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 
 private const val LOG_TAG = "MainScreenViewModel"
 
@@ -142,8 +144,12 @@ class MainScreenViewModel(private val application: Application) : ViewModel() {
             val data = readAudioSamples(file)
             printMessage("${data.size / (16000 / 1000)} ms\n")
             printMessage("Transcribing data...\n")
+            val buffer = ByteBuffer.allocateDirect(4 * data.size).order(ByteOrder.nativeOrder()).asFloatBuffer()
+            buffer.put(data).flip()
             val start = System.currentTimeMillis()
-            val text = whisperContext?.transcribeData(data)
+            val text = whisperContext?.transcribeBuffer(buffer) { _, _, _, segment ->
+                viewModelScope.launch(Dispatchers.Main) { printMessage("$segment\n") }
+            }
             val elapsed = System.currentTimeMillis() - start
             printMessage("Done ($elapsed ms): \n$text\n")
         } catch (e: Exception) {
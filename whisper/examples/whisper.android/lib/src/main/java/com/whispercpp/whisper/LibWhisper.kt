@@ -6,11 +6,19 @@ import android.util.Log
 import kotlinx.coroutines.*
 import java.io.File
 import java.io.InputStream
+import java.nio.FloatBuffer
 import java.util.concurrent.Executors
 
 private const val LOG_TAG = "LibWhisper"
 
+fun interface WhisperSegmentCallback {
+    // t0 and t1 in units of 10 ms; called on the transcription thread while decoding
+    fun onNewSegment(index: Int, t0: Long, t1: Long, text: String)
+}
+
 class WhisperContext private constructor(private var ptr: Long) {
+    // Kept across transcribeBuffer() calls, so the compute buffers and KV caches are only allocated once.
+    private var statePtr: Long = 0
     // Meet Whisper C++ constraint: Don't access from more than one thread at a time.
     private val scope: CoroutineScope = CoroutineScope(
         Executors.newSingleThreadExecutor().asCoroutineDispatcher()
@@ -35,6 +43,41 @@ class WhisperContext private constructor(private var ptr: Long) {
         }
     }
 
+    // data must be a direct buffer (e.g. ByteBuffer.allocateDirect(4 * n).order(ByteOrder.nativeOrder()).asFloatBuffer()),
+    // the samples from its position to its limit are used in place, without a copy.
+    suspend fun transcribeBuffer(
+        data: FloatBuffer,
+        printTimestamp: Boolean = true,
+        onSegment: WhisperSegmentCallback? = null
+    ): String = withContext(scope.coroutineContext) {
+        require(ptr != 0L)
+        require(data.isDirect) { "The audio buffer must be a direct buffer" }
+        if (statePtr == 0L) {
+            statePtr = WhisperLib.initState(ptr)
+            if (statePtr == 0L) {
+                throw java.lang.RuntimeException("Couldn't create a whisper state")
+            }
+        }
+        val numThreads = WhisperCpuConfig.preferredThreadCount
+        Log.d(LOG_TAG, "Selecting $numThreads threads")
+        val audio = data.slice()
+        if (WhisperLib.fullTranscribeWithState(ptr, statePtr, numThreads, audio, audio.remaining(), onSegment) != 0) {
+            throw java.lang.RuntimeException("Failed to transcribe the audio")
+        }
+        val textCount = WhisperLib.getTextSegmentCountFromState(statePtr)
+        return@withContext buildString {
+            for (i in 0 until textCount) {
+                if (printTimestamp) {
+                    val textTimestamp = "[${toTimestamp(WhisperLib.getTextSegmentT0FromState(statePtr, i))} --> ${toTimestamp(WhisperLib.getTextSegmentT1FromState(statePtr, i))}]"
+                    val textSegment = WhisperLib.getTextSegmentFromState(statePtr, i)
+                    append("$textTimestamp: $textSegment\n")
+                } else {
+                    append(WhisperLib.getTextSegmentFromState(statePtr, i))
+                }
+            }
+        }
+    }
+
     suspend fun benchMemory(nthreads: Int): String = withContext(scope.coroutineContext) {
         return@withContext WhisperLib.benchMemcpy(nthreads)
     }
@@ -44,6 +87,10 @@ class WhisperContext private constructor(private var ptr: Long) {
     }
 
     suspend fun release() = withContext(scope.coroutineContext) {
+        if (statePtr != 0L) {
+            WhisperLib.freeState(statePtr)
+            statePtr = 0
+        }
         if (ptr != 0L) {
             WhisperLib.freeContext(ptr)
             ptr = 0
@@ -57,8 +104,10 @@ class WhisperContext private constructor(private var ptr: Long) {
     }
 
     companion object {
-        fun createContextFromFile(filePath: String): WhisperContext {
-            val ptr = WhisperLib.initContext(filePath)
+        // cpuAffinity places the worker threads on the big cores first
+        // useGpu runs the model on the GPU when the library is built with OpenCL (-PGGML_OPENCL=ON)
+        fun createContextFromFile(filePath: String, cpuAffinity: Boolean = true, useGpu: Boolean = true): WhisperContext {
+            val ptr = WhisperLib.initContext(filePath, cpuAffinity, useGpu)
             if (ptr == 0L) {
                 throw java.lang.RuntimeException("Couldn't create context with path $filePath")
             }
@@ -74,8 +123,8 @@ class WhisperContext private constructor(private var ptr: Long) {
             return WhisperContext(ptr)
         }
 
-        fun createContextFromAsset(assetManager: AssetManager, assetPath: String): WhisperContext {
-            val ptr = WhisperLib.initContextFromAsset(assetManager, assetPath)
+        fun createContextFromAsset(assetManager: AssetManager, assetPath: String, cpuAffinity: Boolean = true, useGpu: Boolean = true): WhisperContext {
+            val ptr = WhisperLib.initContextFromAsset(assetManager, assetPath, cpuAffinity, useGpu)
 
             if (ptr == 0L) {
                 throw java.lang.RuntimeException("Couldn't create context from asset $assetPath")
@@ -131,10 +180,17 @@ private class WhisperLib {
 
         // JNI methods
         external fun initContextFromInputStream(inputStream: InputStream): Long
-        external fun initContextFromAsset(assetManager: AssetManager, assetPath: String): Long
-        external fun initContext(modelPath: String): Long
+        external fun initContextFromAsset(assetManager: AssetManager, assetPath: String, cpuAffinity: Boolean, useGpu: Boolean): Long
+        external fun initContext(modelPath: String, cpuAffinity: Boolean, useGpu: Boolean): Long
         external fun freeContext(contextPtr: Long)
+        external fun initState(contextPtr: Long): Long
+        external fun freeState(statePtr: Long)
         external fun fullTranscribe(contextPtr: Long, numThreads: Int, audioData: FloatArray)
+        external fun fullTranscribeWithState(contextPtr: Long, statePtr: Long, numThreads: Int, audioData: FloatBuffer, numSamples: Int, callback: WhisperSegmentCallback?): Int
+        external fun getTextSegmentCountFromState(statePtr: Long): Int
+        external fun getTextSegmentFromState(statePtr: Long, index: Int): String
+        external fun getTextSegmentT0FromState(statePtr: Long, index: Int): Long
+        external fun getTextSegmentT1FromState(statePtr: Long, index: Int): Long
         external fun getTextSegmentCount(contextPtr: Long): Int
         external fun getTextSegment(contextPtr: Long, index: Int): String
         external fun getTextSegmentT0(contextPtr: Long, index: Int): Long
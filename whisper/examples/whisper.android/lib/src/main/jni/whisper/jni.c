@@ -110,7 +110,9 @@ static void asset_close(void *ctx) {
 static struct whisper_context *whisper_init_from_asset(
         JNIEnv *env,
         jobject assetManager,
-        const char *asset_path
+        const char *asset_path,
+        bool cpu_affinity,
+        bool use_gpu
 ) {
     LOGI("Loading model from asset '%s'\n", asset_path);
     AAssetManager *asset_manager = AAssetManager_fromJava(env, assetManager);
@@ -127,27 +129,37 @@ static struct whisper_context *whisper_init_from_asset(
             .close = &asset_close
     };
 
-    return whisper_init_with_params(&loader, whisper_context_default_params());
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.cpu_affinity = cpu_affinity;
+    cparams.use_gpu = use_gpu;
+
+    return whisper_init_with_params(&loader, cparams);
 }
 
 JNIEXPORT jlong JNICALL
 Java_com_whispercpp_whisper_WhisperLib_00024Companion_initContextFromAsset(
-        JNIEnv *env, jobject thiz, jobject assetManager, jstring asset_path_str) {
+        JNIEnv *env, jobject thiz, jobject assetManager, jstring asset_path_str, jboolean cpu_affinity, jboolean use_gpu) {
     UNUSED(thiz);
     struct whisper_context *context = NULL;
     const char *asset_path_chars = (*env)->GetStringUTFChars(env, asset_path_str, NULL);
-    context = whisper_init_from_asset(env, assetManager, asset_path_chars);
+    context = whisper_init_from_asset(env, assetManager, asset_path_chars, cpu_affinity, use_gpu);
     (*env)->ReleaseStringUTFChars(env, asset_path_str, asset_path_chars);
     return (jlong) context;
 }
 
 JNIEXPORT jlong JNICALL
 Java_com_whispercpp_whisper_WhisperLib_00024Companion_initContext(
-        JNIEnv *env, jobject thiz, jstring model_path_str) {
+        JNIEnv *env, jobject thiz, jstring model_path_str, jboolean cpu_affinity, jboolean use_gpu) {
     UNUSED(thiz);
     struct whisper_context *context = NULL;
     const char *model_path_chars = (*env)->GetStringUTFChars(env, model_path_str, NULL);
-    context = whisper_init_from_file_with_params(model_path_chars, whisper_context_default_params());
+    // with cpu_affinity the worker threads go to the big cores first, so n_threads <= number of big cores
+    // keeps the whole pool off the LITTLE cores
+    // with use_gpu the model runs on the GPU of a build with -PGGML_OPENCL=ON (Adreno), see README.md
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.cpu_affinity = cpu_affinity;
+    cparams.use_gpu = use_gpu;
+    context = whisper_init_from_file_with_params(model_path_chars, cparams);
     (*env)->ReleaseStringUTFChars(env, model_path_str, model_path_chars);
     return (jlong) context;
 }
@@ -193,6 +205,148 @@ Java_com_whispercpp_whisper_WhisperLib_00024Companion_fullTranscribe(
     (*env)->ReleaseFloatArrayElements(env, audio_data, audio_data_arr, JNI_ABORT);
 }
 
+JNIEXPORT jlong JNICALL
+Java_com_whispercpp_whisper_WhisperLib_00024Companion_initState(
+        JNIEnv *env, jobject thiz, jlong context_ptr) {
+    UNUSED(env);
+    UNUSED(thiz);
+    struct whisper_context *context = (struct whisper_context *) context_ptr;
+    return (jlong) whisper_init_state(context);
+}
+
+JNIEXPORT void JNICALL
+Java_com_whispercpp_whisper_WhisperLib_00024Companion_freeState(
+        JNIEnv *env, jobject thiz, jlong state_ptr) {
+    UNUSED(env);
+    UNUSED(thiz);
+    struct whisper_state *state = (struct whisper_state *) state_ptr;
+    whisper_free_state(state);
+}
+
+struct segment_callback_context {
+    JNIEnv * env;
+    jobject callback;
+    jmethodID mid_on_new_segment;
+};
+
+// called on the thread that runs whisper_full_with_state(), i.e. the one that entered the JNI call,
+// so the JNIEnv of that call is valid here
+static void segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    UNUSED(ctx);
+    struct segment_callback_context *cb = (struct segment_callback_context *) user_data;
+    JNIEnv *env = cb->env;
+    if ((*env)->ExceptionCheck(env)) {
+        return;
+    }
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    for (int i = max(0, n_segments - n_new); i < n_segments; ++i) {
+        jstring text = (*env)->NewStringUTF(env, whisper_full_get_segment_text_from_state(state, i));
+        (*env)->CallVoidMethod(env, cb->callback, cb->mid_on_new_segment,
+                               (jint) i,
+                               (jlong) whisper_full_get_segment_t0_from_state(state, i),
+                               (jlong) whisper_full_get_segment_t1_from_state(state, i),
+                               text);
+        (*env)->DeleteLocalRef(env, text);
+        if ((*env)->ExceptionCheck(env)) {
+            // leave the exception pending, it is thrown once the JNI call returns
+            return;
+        }
+    }
+}
+
+// transcribes a direct FloatBuffer in place (no copy of the audio) with a state that is kept across calls
+// new segments are passed to callback.onNewSegment(index, t0, t1, text) as soon as they are decoded
+JNIEXPORT jint JNICALL
+Java_com_whispercpp_whisper_WhisperLib_00024Companion_fullTranscribeWithState(
+        JNIEnv *env, jobject thiz, jlong context_ptr, jlong state_ptr, jint num_threads,
+        jobject audio_buffer, jint num_samples, jobject callback) {
+    UNUSED(thiz);
+    struct whisper_context *context = (struct whisper_context *) context_ptr;
+    struct whisper_state *state = (struct whisper_state *) state_ptr;
+
+    const float *audio_data = (const float *) (*env)->GetDirectBufferAddress(env, audio_buffer);
+    const jlong capacity = (*env)->GetDirectBufferCapacity(env, audio_buffer);
+    if (audio_data == NULL || capacity < 0) {
+        LOGW("Audio buffer is not a direct buffer");
+        return -1;
+    }
+    if (num_samples < 0 || num_samples > capacity) {
+        LOGW("Invalid number of samples: %d (capacity %lld)", num_samples, (long long) capacity);
+        return -1;
+    }
+
+    struct whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    params.print_realtime = false;
+    params.print_progress = false;
+    params.print_timestamps = false;
+    params.print_special = false;
+    params.translate = false;
+    params.language = "en";
+    params.n_threads = num_threads;
+    params.offset_ms = 0;
+    params.no_context = true;
+    params.single_segment = false;
+
+    struct segment_callback_context cb_ctx = {};
+    if (callback != NULL) {
+        jclass cls = (*env)->GetObjectClass(env, callback);
+        cb_ctx.env = env;
+        cb_ctx.callback = callback;
+        cb_ctx.mid_on_new_segment = (*env)->GetMethodID(env, cls, "onNewSegment", "(IJJLjava/lang/String;)V");
+        (*env)->DeleteLocalRef(env, cls);
+        if (cb_ctx.mid_on_new_segment == NULL) {
+            return -1;
+        }
+
+        params.new_segment_callback = segment_callback;
+        params.new_segment_callback_user_data = &cb_ctx;
+    }
+
+    const int ret = whisper_full_with_state(context, state, params, audio_data, num_samples);
+    if (ret != 0) {
+        LOGI("Failed to run the model");
+    }
+    return ret;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_whispercpp_whisper_WhisperLib_00024Companion_getTextSegmentCountFromState(
+        JNIEnv *env, jobject thiz, jlong state_ptr) {
+    UNUSED(env);
+    UNUSED(thiz);
+    struct whisper_state *state = (struct whisper_state *) state_ptr;
+    return whisper_full_n_segments_from_state(state);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_whispercpp_whisper_WhisperLib_00024Companion_getTextSegmentFromState(
+        JNIEnv *env, jobject thiz, jlong state_ptr, jint index) {
+    UNUSED(thiz);
+    struct whisper_state *state = (struct whisper_state *) state_ptr;
+    const char *text = whisper_full_get_segment_text_from_state(state, index);
+    jstring string = (*env)->NewStringUTF(env, text);
+    return string;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_whispercpp_whisper_WhisperLib_00024Companion_getTextSegmentT0FromState(
+        JNIEnv *env, jobject thiz, jlong state_ptr, jint index) {
+    UNUSED(env);
+    UNUSED(thiz);
+    struct whisper_state *state = (struct whisper_state *) state_ptr;
+    return whisper_full_get_segment_t0_from_state(state, index);
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_whispercpp_whisper_WhisperLib_00024Companion_getTextSegmentT1FromState(
+        JNIEnv *env, jobject thiz, jlong state_ptr, jint index) {
+    UNUSED(env);
+    UNUSED(thiz);
+    struct whisper_state *state = (struct whisper_state *) state_ptr;
+    return whisper_full_get_segment_t1_from_state(state, index);
+}
+
 JNIEXPORT jint JNICALL
 Java_com_whispercpp_whisper_WhisperLib_00024Companion_getTextSegmentCount(
         JNIEnv *env, jobject thiz, jlong context_ptr) {
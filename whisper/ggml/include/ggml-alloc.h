@@ -60,6 +60,12 @@ GGML_API bool ggml_gallocr_reserve_n(
     const int * node_buffer_ids,
     const int * leaf_buffer_ids);
 
+// allocate the buffers with at least sizes[i] bytes for buffer i, without a measure graph
+// e.g. with the sizes of ggml_gallocr_get_buffer_size after an earlier reserve of the same graphs
+// buffers that are already large enough are kept; a size above the max size of the buffer type is skipped
+// returns false if the buffer allocation failed
+GGML_API bool ggml_gallocr_reserve_sizes(ggml_gallocr_t galloc, const size_t * sizes);
+
 // automatic reallocation if the topology changes when using a single buffer
 // returns false if using multiple buffers and a re-allocation is needed (call ggml_gallocr_reserve_n first to set the node buffers)
 GGML_API bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph * graph);
@@ -308,6 +308,8 @@ extern "C" {
 
     // Initialize backend buffers from a measure graph
     GGML_API bool                 ggml_backend_sched_reserve(ggml_backend_sched_t sched, struct ggml_cgraph * measure_graph); // returns success
+    // allocate the compute buffers with at least sizes[i] bytes for the i-th backend, without a measure graph (see ggml_gallocr_reserve_sizes)
+    GGML_API bool                 ggml_backend_sched_reserve_sizes(ggml_backend_sched_t sched, const size_t * sizes); // returns success
 
     GGML_API int                  ggml_backend_sched_get_n_backends(ggml_backend_sched_t sched);
     GGML_API ggml_backend_t       ggml_backend_sched_get_backend(ggml_backend_sched_t sched, int i);
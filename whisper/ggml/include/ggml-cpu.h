@@ -131,6 +131,31 @@ extern "C" {
     GGML_BACKEND_API void ggml_backend_cpu_set_threadpool    (ggml_backend_t backend_cpu, ggml_threadpool_t threadpool);
     GGML_BACKEND_API void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // host memory backed by huge pages (explicit MAP_HUGETLB pages when reserved, else transparent huge pages on Linux;
+    // large pages on Windows); falls back to regular pages, so it can always be used in place of the CPU buffer type
+    GGML_BACKEND_API ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(void);
+
+    // Called by each worker thread after it computed its share of a graph node, with ggml_time_us() timestamps.
+    // Process-wide; only change it while no graph is being computed.
+    typedef void (*ggml_cpu_trace_callback)(const struct ggml_tensor * node, int ith, int64_t t_start_us, int64_t t_end_us, void * user_data);
+
+    GGML_BACKEND_API void ggml_cpu_set_trace_callback(ggml_cpu_trace_callback callback, void * user_data);
+
+    // How the worker threads waited at the barriers between graph nodes; process-wide totals over the multi-threaded
+    // graphs computed so far. The barrier spins for an adaptive budget, then yields, then sleeps (GGML_CPU_BARRIER=spin
+    // in the environment: spin only). Independent nodes are computed without a barrier between them
+    // (GGML_CPU_NO_BARRIER_ELISION in the environment: a barrier after every node).
+    struct ggml_cpu_barrier_stats {
+        int64_t n_graphs;
+        int64_t n_barriers;
+        int64_t n_waits;    // threads that waited at a barrier (the last one to arrive does not)
+        int64_t n_yield;    // waits that outlasted the spin budget and yielded the CPU
+        int64_t n_sleep;    // waits that went on to sleep until woken
+        int32_t spin;       // spin budget after the last graph, in cpu-relax rounds
+    };
+
+    GGML_BACKEND_API void ggml_cpu_get_barrier_stats(struct ggml_cpu_barrier_stats * stats);
+
     GGML_BACKEND_API ggml_backend_reg_t ggml_backend_cpu_reg(void);
 
     GGML_BACKEND_API void ggml_cpu_fp32_to_fp32(const float *,       float *, int64_t);
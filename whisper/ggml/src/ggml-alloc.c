@@ -934,6 +934,49 @@ bool ggml_gallocr_reserve(ggml_gallocr_t galloc, struct ggml_cgraph *graph) {
     return ggml_gallocr_reserve_n(galloc, graph, NULL, NULL);
 }
 
+bool ggml_gallocr_reserve_sizes(ggml_gallocr_t galloc, const size_t * sizes) {
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        // if the buffer type is used multiple times, we reuse the same buffer
+        bool reused = false;
+        for (int j = 0; j < i; j++) {
+            if (galloc->buf_tallocs[j] == galloc->buf_tallocs[i]) {
+                galloc->buffers[i] = galloc->buffers[j];
+                reused = true;
+                break;
+            }
+        }
+        if (reused) {
+            continue;
+        }
+
+        if (galloc->buffers[i] != NULL && ggml_vbuffer_size(galloc->buffers[i]) >= sizes[i]) {
+            continue;
+        }
+
+        // larger buffers are split into chunks when a graph is planned
+        if (sizes[i] > ggml_backend_buft_get_max_size(galloc->bufts[i])) {
+            continue;
+        }
+
+        struct vbuffer * buf = (struct vbuffer *)calloc(1, sizeof(struct vbuffer));
+        if (buf == NULL) {
+            return false;
+        }
+        buf->chunks[0] = ggml_backend_buft_alloc_buffer(galloc->bufts[i], sizes[i]);
+        if (buf->chunks[0] == NULL) {
+            GGML_LOG_ERROR("%s: failed to allocate %s buffer of size %zu\n", __func__, ggml_backend_buft_name(galloc->bufts[i]), sizes[i]);
+            free(buf);
+            return false;
+        }
+        ggml_backend_buffer_set_usage(buf->chunks[0], GGML_BACKEND_BUFFER_USAGE_COMPUTE);
+
+        ggml_vbuffer_free(galloc->buffers[i]);
+        galloc->buffers[i] = buf;
+    }
+
+    return true;
+}
+
 static void ggml_gallocr_init_tensor(ggml_gallocr_t galloc, struct ggml_tensor * tensor, struct tensor_alloc * tensor_alloc) {
     int buffer_id = tensor_alloc->buffer_id;
     assert(tensor->data || tensor->view_src || ggml_backend_buft_get_alloc_size(galloc->bufts[buffer_id], tensor) <= tensor_alloc->size_max);
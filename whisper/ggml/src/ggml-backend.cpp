@@ -1713,6 +1713,14 @@ bool ggml_backend_sched_reserve(ggml_backend_sched_t sched, struct ggml_cgraph *
     return true;
 }
 
+bool ggml_backend_sched_reserve_sizes(ggml_backend_sched_t sched, const size_t * sizes) {
+    GGML_ASSERT(sched);
+
+    ggml_backend_sched_synchronize(sched);
+
+    return ggml_gallocr_reserve_sizes(sched->galloc, sizes);
+}
+
 bool ggml_backend_sched_alloc_graph(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
     GGML_ASSERT(sched);
     GGML_ASSERT((int)sched->hash_set.size >= graph->n_nodes + graph->n_leafs);
@@ -474,6 +474,104 @@ void ggml_gemv_iq4_nl_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const
     ggml_gemv_iq4_nl_4x4_q8_0_generic(n, s, bs, vx, vy, nr, nc);
 }
 
+void ggml_gemv_q8_0_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+    const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q8_0x4 * b_ptr = (const block_q8_0x4 *) vx + (x * nb);
+
+        float32x4_t acc = vdupq_n_f32(0);
+        for (int l = 0; l < nb; l++) {
+            const int8x16_t a0 = vld1q_s8(a_ptr[l].qs);
+            const int8x16_t a1 = vld1q_s8(a_ptr[l].qs + qk/2);
+
+            int32x4_t ret = vdupq_n_s32(0);
+
+            ret = vdotq_laneq_s32(ret, vld1q_s8(b_ptr[l].qs +   0), a0, 0);
+            ret = vdotq_laneq_s32(ret, vld1q_s8(b_ptr[l].qs +  16), a0, 1);
+            ret = vdotq_laneq_s32(ret, vld1q_s8(b_ptr[l].qs +  32), a0, 2);
+            ret = vdotq_laneq_s32(ret, vld1q_s8(b_ptr[l].qs +  48), a0, 3);
+            ret = vdotq_laneq_s32(ret, vld1q_s8(b_ptr[l].qs +  64), a1, 0);
+            ret = vdotq_laneq_s32(ret, vld1q_s8(b_ptr[l].qs +  80), a1, 1);
+            ret = vdotq_laneq_s32(ret, vld1q_s8(b_ptr[l].qs +  96), a1, 2);
+            ret = vdotq_laneq_s32(ret, vld1q_s8(b_ptr[l].qs + 112), a1, 3);
+
+            const float32x4_t b_d = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+            acc = vmlaq_f32(acc, vmulq_n_f32(b_d, GGML_CPU_FP16_TO_FP32(a_ptr[l].d)), vcvtq_f32_s32(ret));
+        }
+        vst1q_f32(s + x * ncols_interleaved, acc);
+    }
+    return;
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+    ggml_gemv_q8_0_4x4_q8_0_generic(n, s, bs, vx, vy, nr, nc);
+}
+
+void ggml_gemv_q8_0_4x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+    const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q8_0x4 * b_ptr = (const block_q8_0x4 *) vx + (x * nb);
+
+        float32x4_t acc = vdupq_n_f32(0);
+        for (int l = 0; l < nb; l++) {
+            // each lane pair accumulates the two 4-byte halves of one column
+            int32x4_t ret_01 = vdupq_n_s32(0);
+            int32x4_t ret_23 = vdupq_n_s32(0);
+
+            for (int k = 0; k < qk / blocklen; k++) {
+                const int8x8_t  a_k = vld1_s8(a_ptr[l].qs + k * blocklen);
+                const int8x16_t a   = vcombine_s8(a_k, a_k);
+
+                ret_01 = vdotq_s32(ret_01, vld1q_s8(b_ptr[l].qs + k * ncols_interleaved * blocklen +  0), a);
+                ret_23 = vdotq_s32(ret_23, vld1q_s8(b_ptr[l].qs + k * ncols_interleaved * blocklen + 16), a);
+            }
+
+            const float32x4_t b_d = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+            acc = vmlaq_f32(acc, vmulq_n_f32(b_d, GGML_CPU_FP16_TO_FP32(a_ptr[l].d)), vcvtq_f32_s32(vpaddq_s32(ret_01, ret_23)));
+        }
+        vst1q_f32(s + x * ncols_interleaved, acc);
+    }
+    return;
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+    ggml_gemv_q8_0_4x8_q8_0_generic(n, s, bs, vx, vy, nr, nc);
+}
+
 void ggml_gemm_q4_0_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -1889,3 +1987,149 @@ void ggml_gemm_iq4_nl_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const
 #endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
     ggml_gemm_iq4_nl_4x4_q8_0_generic(n, s, bs, vx, vy, nr, nc);
 }
+
+void ggml_gemm_q8_0_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x4 * b_ptr = (const block_q8_0x4 *) vx + (x * nb);
+
+            float32x4_t sumf[4];
+            for (int m = 0; m < 4; m++) {
+                sumf[m] = vdupq_n_f32(0);
+            }
+
+            for (int l = 0; l < nb; l++) {
+                float32x4_t a_d = vcvt_f32_f16(vld1_f16((const float16_t *)a_ptr[l].d));
+                float32x4_t b_d = vcvt_f32_f16(vld1_f16((const float16_t *)b_ptr[l].d));
+
+                int32x4_t sumi_0 = vdupq_n_s32(0);
+                int32x4_t sumi_1 = vdupq_n_s32(0);
+                int32x4_t sumi_2 = vdupq_n_s32(0);
+                int32x4_t sumi_3 = vdupq_n_s32(0);
+
+                for (int k = 0; k < qk / blocklen; k++) {
+                    const int8x16_t a = vld1q_s8(a_ptr[l].qs + 16 * k);
+                    const int8x16_t b = vld1q_s8(b_ptr[l].qs + 16 * k);
+
+                    sumi_0 = vdotq_laneq_s32(sumi_0, b, a, 0);
+                    sumi_1 = vdotq_laneq_s32(sumi_1, b, a, 1);
+                    sumi_2 = vdotq_laneq_s32(sumi_2, b, a, 2);
+                    sumi_3 = vdotq_laneq_s32(sumi_3, b, a, 3);
+                }
+
+                sumf[0] = vmlaq_f32(sumf[0], vmulq_laneq_f32(b_d, a_d, 0), vcvtq_f32_s32(sumi_0));
+                sumf[1] = vmlaq_f32(sumf[1], vmulq_laneq_f32(b_d, a_d, 1), vcvtq_f32_s32(sumi_1));
+                sumf[2] = vmlaq_f32(sumf[2], vmulq_laneq_f32(b_d, a_d, 2), vcvtq_f32_s32(sumi_2));
+                sumf[3] = vmlaq_f32(sumf[3], vmulq_laneq_f32(b_d, a_d, 3), vcvtq_f32_s32(sumi_3));
+            }
+
+            for (int m = 0; m < 4; m++) {
+                vst1q_f32(s + (y * 4 + m) * bs + x * 4, sumf[m]);
+            }
+        }
+    }
+    return;
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+    ggml_gemm_q8_0_4x4_q8_0_generic(n, s, bs, vx, vy, nr, nc);
+}
+
+void ggml_gemm_q8_0_4x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_MATMUL_INT8)
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x4 * b_ptr = (const block_q8_0x4 *) vx + (x * nb);
+
+            float32x4_t sumf[4];
+            for (int m = 0; m < 4; m++) {
+                sumf[m] = vdupq_n_f32(0);
+            }
+
+            for (int l = 0; l < nb; l++) {
+                float32x4_t a_d = vcvt_f32_f16(vld1_f16((const float16_t *)a_ptr[l].d));
+                float32x4_t b_d = vcvt_f32_f16(vld1_f16((const float16_t *)b_ptr[l].d));
+
+                // 2x2 tiles: rows {0,1} or {2,3} times columns {0,1} or {2,3}
+                int32x4_t sumi_r01_c01 = vdupq_n_s32(0);
+                int32x4_t sumi_r01_c23 = vdupq_n_s32(0);
+                int32x4_t sumi_r23_c01 = vdupq_n_s32(0);
+                int32x4_t sumi_r23_c23 = vdupq_n_s32(0);
+
+                for (int k = 0; k < qk / blocklen; k++) {
+                    const int8x16_t a_01 = vld1q_s8(a_ptr[l].qs + 32 * k +  0);
+                    const int8x16_t a_23 = vld1q_s8(a_ptr[l].qs + 32 * k + 16);
+                    const int8x16_t b_01 = vld1q_s8(b_ptr[l].qs + 32 * k +  0);
+                    const int8x16_t b_23 = vld1q_s8(b_ptr[l].qs + 32 * k + 16);
+
+                    sumi_r01_c01 = vmmlaq_s32(sumi_r01_c01, a_01, b_01);
+                    sumi_r01_c23 = vmmlaq_s32(sumi_r01_c23, a_01, b_23);
+                    sumi_r23_c01 = vmmlaq_s32(sumi_r23_c01, a_23, b_01);
+                    sumi_r23_c23 = vmmlaq_s32(sumi_r23_c23, a_23, b_23);
+                }
+
+                // each tile holds [r0c0 r0c1 r1c0 r1c1]: gather the rows
+                const int64x2_t r01_c01 = vreinterpretq_s64_s32(sumi_r01_c01);
+                const int64x2_t r01_c23 = vreinterpretq_s64_s32(sumi_r01_c23);
+                const int64x2_t r23_c01 = vreinterpretq_s64_s32(sumi_r23_c01);
+                const int64x2_t r23_c23 = vreinterpretq_s64_s32(sumi_r23_c23);
+
+                const int32x4_t sumi_0 = vreinterpretq_s32_s64(vzip1q_s64(r01_c01, r01_c23));
+                const int32x4_t sumi_1 = vreinterpretq_s32_s64(vzip2q_s64(r01_c01, r01_c23));
+                const int32x4_t sumi_2 = vreinterpretq_s32_s64(vzip1q_s64(r23_c01, r23_c23));
+                const int32x4_t sumi_3 = vreinterpretq_s32_s64(vzip2q_s64(r23_c01, r23_c23));
+
+                sumf[0] = vmlaq_f32(sumf[0], vmulq_laneq_f32(b_d, a_d, 0), vcvtq_f32_s32(sumi_0));
+                sumf[1] = vmlaq_f32(sumf[1], vmulq_laneq_f32(b_d, a_d, 1), vcvtq_f32_s32(sumi_1));
+                sumf[2] = vmlaq_f32(sumf[2], vmulq_laneq_f32(b_d, a_d, 2), vcvtq_f32_s32(sumi_2));
+                sumf[3] = vmlaq_f32(sumf[3], vmulq_laneq_f32(b_d, a_d, 3), vcvtq_f32_s32(sumi_3));
+            }
+
+            for (int m = 0; m < 4; m++) {
+                vst1q_f32(s + (y * 4 + m) * bs + x * 4, sumf[m]);
+            }
+        }
+    }
+    return;
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_MATMUL_INT8)
+    ggml_gemm_q8_0_4x8_q8_0_generic(n, s, bs, vx, vy, nr, nc);
+}
@@ -1625,6 +1625,56 @@ void ggml_gemv_iq4_nl_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const
     ggml_gemv_iq4_nl_8x8_q8_0_generic(n, s, bs, vx, vy, nr, nc);
 }
 
+void ggml_gemv_q8_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(bs);
+    UNUSED(nr);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    // hadd of the column pairs of cols 0-3 and cols 4-7 yields [c0 c1 c4 c5 | c2 c3 c6 c7]
+    const __m256i col_order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+
+    const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+
+        __m256 acc = _mm256_setzero_ps();
+        for (int l = 0; l < nb; l++) {
+            __m256i sumi_0123 = _mm256_setzero_si256();
+            __m256i sumi_4567 = _mm256_setzero_si256();
+            for (int k = 0; k < qk / blocklen; k++) {
+                const __m256i b_0123 = _mm256_loadu_si256((const __m256i *) (b_ptr[l].qs + k * ncols_interleaved * blocklen));
+                const __m256i b_4567 = _mm256_loadu_si256((const __m256i *) (b_ptr[l].qs + k * ncols_interleaved * blocklen + 32));
+
+                int64_t a_k;
+                memcpy(&a_k, a_ptr[l].qs + k * blocklen, sizeof(a_k));
+                const __m256i a = _mm256_set1_epi64x(a_k);
+
+                sumi_0123 = mul_sum_i8_pairs_acc_int32x8(sumi_0123, b_0123, a);
+                sumi_4567 = mul_sum_i8_pairs_acc_int32x8(sumi_4567, b_4567, a);
+            }
+            const __m256i sumi = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(sumi_0123, sumi_4567), col_order);
+            const __m256 d = _mm256_mul_ps(GGML_F32Cx8_LOAD(b_ptr[l].d), _mm256_set1_ps(GGML_CPU_FP16_TO_FP32(a_ptr[l].d)));
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sumi), d, acc);
+        }
+        _mm256_storeu_ps(s + x * ncols_interleaved, acc);
+    }
+    return;
+#endif
+
+    ggml_gemv_q8_0_8x8_q8_0_generic(n, s, bs, vx, vy, nr, nc);
+}
+
 void ggml_gemv_q2_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK_K;
     const int nb = n / qk;
@@ -3423,6 +3473,80 @@ void ggml_gemm_iq4_nl_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const
     ggml_gemm_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
 
+void ggml_gemm_q8_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    // hadd of the column pairs of cols 0-3 and cols 4-7 yields [c0 c1 c4 c5 | c2 c3 c6 c7]
+    const __m256i col_order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+
+            __m256 acc_rows[4];
+            for (int m = 0; m < 4; m++) {
+                acc_rows[m] = _mm256_setzero_ps();
+            }
+
+            for (int l = 0; l < nb; l++) {
+                __m256i sumi_0123[4];
+                __m256i sumi_4567[4];
+                for (int m = 0; m < 4; m++) {
+                    sumi_0123[m] = _mm256_setzero_si256();
+                    sumi_4567[m] = _mm256_setzero_si256();
+                }
+
+                for (int k = 0; k < qk / blocklen; k++) {
+                    const __m256i b_0123 = _mm256_loadu_si256((const __m256i *) (b_ptr[l].qs + k * ncols_interleaved * blocklen));
+                    const __m256i b_4567 = _mm256_loadu_si256((const __m256i *) (b_ptr[l].qs + k * ncols_interleaved * blocklen + 32));
+
+                    // the weights are reused for the 4 rows: take their absolute values once
+                    // and move their signs onto the activations
+                    const __m256i ab_0123 = _mm256_sign_epi8(b_0123, b_0123);
+                    const __m256i ab_4567 = _mm256_sign_epi8(b_4567, b_4567);
+
+                    for (int m = 0; m < 4; m++) {
+                        int64_t a_k;
+                        memcpy(&a_k, a_ptr[l].qs + k * 4 * blocklen + m * blocklen, sizeof(a_k));
+                        const __m256i a = _mm256_set1_epi64x(a_k);
+
+                        sumi_0123[m] = mul_sum_us8_pairs_acc_int32x8(sumi_0123[m], ab_0123, _mm256_sign_epi8(a, b_0123));
+                        sumi_4567[m] = mul_sum_us8_pairs_acc_int32x8(sumi_4567[m], ab_4567, _mm256_sign_epi8(a, b_4567));
+                    }
+                }
+
+                const __m256 col_d = GGML_F32Cx8_LOAD(b_ptr[l].d);
+                for (int m = 0; m < 4; m++) {
+                    const __m256i sumi = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(sumi_0123[m], sumi_4567[m]), col_order);
+                    const __m256 d = _mm256_mul_ps(col_d, _mm256_set1_ps(GGML_CPU_FP16_TO_FP32(a_ptr[l].d[m])));
+                    acc_rows[m] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sumi), d, acc_rows[m]);
+                }
+            }
+
+            for (int m = 0; m < 4; m++) {
+                _mm256_storeu_ps(s + (y * 4 + m) * bs + x * ncols_interleaved, acc_rows[m]);
+            }
+        }
+    }
+    return;
+#endif
+
+    ggml_gemm_q8_0_8x8_q8_0_generic(n, s, bs, vx, vy, nr, nc);
+}
+
 void ggml_gemm_q2_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK_K;
     const int nb = n / qk;
@@ -38,6 +38,11 @@
 #include <syscall.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #ifdef GGML_USE_OPENMP
 #include <omp.h>
 #endif
@@ -452,8 +457,16 @@ struct ggml_threadpool {
     atomic_int n_graph;       // incremented when there is work to be done (i.e each graph)
     atomic_int GGML_CACHE_ALIGN n_barrier;
     atomic_int GGML_CACHE_ALIGN n_barrier_passed;
+    atomic_int GGML_CACHE_ALIGN n_barrier_sleeping; // threads asleep in ggml_barrier
+    atomic_int barrier_spin;                        // spin budget of ggml_barrier, in cpu-relax rounds
+    int        barrier_spin_max;
+    atomic_int n_barrier_yield;                     // barrier waits that outlasted the spin budget
+    atomic_int n_barrier_sleep;                     // ... and then slept until woken
     atomic_int GGML_CACHE_ALIGN current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
 
+    bool * sync_after;        // the threads wait for each other after these nodes, see ggml_graph_plan_barriers()
+    int    n_sync_after;
+
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
     atomic_bool pause;        // Used for pausing the threadpool or individual threads
@@ -494,6 +507,26 @@ static inline void ggml_thread_cpu_relax(void) {
 static inline void ggml_thread_cpu_relax(void) {;}
 #endif
 
+// Sleeping in ggml_barrier: a futex on Linux, WaitOnAddress on Windows 8+;
+// elsewhere a long wait keeps yielding
+#if defined(__linux__)
+#define GGML_BARRIER_SLEEP
+static inline void ggml_barrier_sleep(atomic_int * addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+static inline void ggml_barrier_wake(atomic_int * addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#elif defined(_WIN32) && _WIN32_WINNT >= 0x0602
+#define GGML_BARRIER_SLEEP
+static inline void ggml_barrier_sleep(atomic_int * addr, int val) {
+    WaitOnAddress((volatile VOID *) addr, &val, sizeof(val), INFINITE);
+}
+static inline void ggml_barrier_wake(atomic_int * addr) {
+    WakeByAddressAll((PVOID) addr);
+}
+#endif
+
 //
 // NUMA support
 //
@@ -529,6 +562,97 @@ struct ggml_state {
 
 static struct ggml_state g_state = {0};
 
+// per-node tracing, off unless ggml_cpu_set_trace_callback() was called
+static ggml_cpu_trace_callback g_trace_callback      = NULL;
+static void *                  g_trace_callback_data = NULL;
+
+void ggml_cpu_set_trace_callback(ggml_cpu_trace_callback callback, void * user_data) {
+    g_trace_callback      = callback;
+    g_trace_callback_data = user_data;
+}
+
+// Adaptive barrier (GGML_CPU_BARRIER=spin in the environment: spin only, or
+// the OpenMP barrier). A waiter spins for the threadpool's spin budget, then
+// yields the CPU for a few rounds, then sleeps until the last thread wakes
+// it. A wait that ends while yielding was a bit longer than the budget, so
+// the budget doubles; one that has to sleep was far longer, so it halves.
+// Short barriers keep the spin-only latency, long ones stop burning cores.
+// With more threads than CPUs to run them on, the thread being waited for
+// is likely descheduled and spinning only delays it: waiters yield at once.
+#define GGML_BARRIER_SPIN_MIN     64
+#define GGML_BARRIER_YIELD_ROUNDS 32
+
+static bool ggml_cpu_barrier_adaptive = true;
+static int  ggml_cpu_barrier_n_cpus   = 0; // CPUs the process may run on, 0 = unknown
+
+static int ggml_cpu_count_available(void) {
+#if defined(__gnu_linux__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return CPU_COUNT(&set);
+    }
+#endif
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+#else
+    return (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+// ggml_barrier counts over all graphs, see ggml_cpu_get_barrier_stats()
+static struct ggml_cpu_barrier_stats g_barrier_stats = {0};
+
+void ggml_cpu_get_barrier_stats(struct ggml_cpu_barrier_stats * stats) {
+    ggml_critical_section_start();
+    *stats = g_barrier_stats;
+    ggml_critical_section_end();
+}
+
+static void ggml_barrier_wait(struct ggml_threadpool * tp, int n_threads, int n_passed) {
+    const int spin = atomic_load_explicit(&tp->barrier_spin, memory_order_relaxed);
+    const bool oversubscribed = ggml_cpu_barrier_n_cpus > 0 && n_threads > ggml_cpu_barrier_n_cpus;
+
+    for (int i = 0; i < (oversubscribed ? 0 : spin); i++) {
+        if (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) != n_passed) {
+            return;
+        }
+        ggml_thread_cpu_relax();
+    }
+
+    atomic_fetch_add_explicit(&tp->n_barrier_yield, 1, memory_order_relaxed);
+
+    for (int i = 0; i < GGML_BARRIER_YIELD_ROUNDS; i++) {
+        if (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) != n_passed) {
+            if (!oversubscribed && spin < tp->barrier_spin_max) {
+                atomic_store_explicit(&tp->barrier_spin, MIN(2*spin, tp->barrier_spin_max), memory_order_relaxed);
+            }
+            return;
+        }
+        sched_yield();
+    }
+
+    if (spin > GGML_BARRIER_SPIN_MIN) {
+        atomic_store_explicit(&tp->barrier_spin, MAX(spin/2, GGML_BARRIER_SPIN_MIN), memory_order_relaxed);
+    }
+
+#ifdef GGML_BARRIER_SLEEP
+    atomic_fetch_add_explicit(&tp->n_barrier_sleep, 1, memory_order_relaxed);
+
+    // pairs with the check of n_barrier_sleeping after the release in ggml_barrier
+    atomic_fetch_add_explicit(&tp->n_barrier_sleeping, 1, memory_order_seq_cst);
+    while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_seq_cst) == n_passed) {
+        ggml_barrier_sleep(&tp->n_barrier_passed, n_passed);
+    }
+    atomic_fetch_add_explicit(&tp->n_barrier_sleeping, -1, memory_order_relaxed);
+#else
+    while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) == n_passed) {
+        sched_yield();
+    }
+#endif
+}
+
 void ggml_barrier(struct ggml_threadpool * tp) {
     int n_threads = atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed);
     if (n_threads == 1) {
@@ -536,8 +660,12 @@ void ggml_barrier(struct ggml_threadpool * tp) {
     }
 
 #ifdef GGML_USE_OPENMP
-    #pragma omp barrier
-#else
+    if (!ggml_cpu_barrier_adaptive) {
+        #pragma omp barrier
+        return;
+    }
+#endif
+
     int n_passed = atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed);
 
     // enter barrier (full seq-cst fence)
@@ -549,12 +677,22 @@ void ggml_barrier(struct ggml_threadpool * tp) {
 
         // exit barrier (fill seq-cst fence)
         atomic_fetch_add_explicit(&tp->n_barrier_passed, 1, memory_order_seq_cst);
+
+#ifdef GGML_BARRIER_SLEEP
+        if (atomic_load_explicit(&tp->n_barrier_sleeping, memory_order_seq_cst) > 0) {
+            ggml_barrier_wake(&tp->n_barrier_passed);
+        }
+#endif
         return;
     }
 
     // wait for other threads
-    while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) == n_passed) {
-        ggml_thread_cpu_relax();
+    if (ggml_cpu_barrier_adaptive) {
+        ggml_barrier_wait(tp, n_threads, n_passed);
+    } else {
+        while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) == n_passed) {
+            ggml_thread_cpu_relax();
+        }
     }
 
     // exit barrier (full seq-cst fence)
@@ -564,7 +702,6 @@ void ggml_barrier(struct ggml_threadpool * tp) {
     #else
     atomic_thread_fence(memory_order_seq_cst);
     #endif
-#endif
 }
 
 void ggml_threadpool_chunk_set(struct ggml_threadpool * tp, int value) {
@@ -1207,6 +1344,33 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     }
 }
 
+#if GGML_USE_LLAMAFILE
+// llamafile sgemm (tinyBLAS)
+//
+// GGML_CPU_SGEMM=0 in the environment never uses it, GGML_CPU_SGEMM=1 tries it for every matmul it supports
+// by default it is used for the F32, F16 and BF16 weights, except for batched products (e.g. one per attention head)
+// with too little work per slice: tinyBLAS synchronizes the threads twice per slice, which for the small per-head
+// products of a short decoder batch costs more than the faster kernel saves
+static int ggml_cpu_sgemm_mode = -1;
+
+static bool ggml_compute_forward_mul_mat_use_sgemm(const struct ggml_tensor * src0, const struct ggml_tensor * src1, int nth) {
+    if (ggml_cpu_sgemm_mode >= 0) {
+        return ggml_cpu_sgemm_mode > 0;
+    }
+
+    if (src0->type != GGML_TYPE_F32 && src0->type != GGML_TYPE_F16 && src0->type != GGML_TYPE_BF16) {
+        return false;
+    }
+
+    if (src1->ne[2]*src1->ne[3] == 1) {
+        return true;
+    }
+
+    // about 256k multiply-adds per thread and slice
+    return src0->ne[1]*src1->ne[1]*src0->ne[0] >= ((int64_t) nth << 18);
+}
+#endif
+
 void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -1247,9 +1411,11 @@ void ggml_compute_forward_mul_mat(
     const int64_t r2 = ne12 / ne02;
     const int64_t r3 = ne13 / ne03;
 
+    const bool use_sgemm = ggml_compute_forward_mul_mat_use_sgemm(src0, src1, nth);
+
     const bool src1_cont = ggml_is_contiguous(src1);
 
-    if (src1_cont) {
+    if (use_sgemm && src1_cont) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
                 if (!llamafile_sgemm(params,
@@ -1314,7 +1480,7 @@ UseGgmlGemm1:;
     ggml_barrier(params->threadpool);
 
 #if GGML_USE_LLAMAFILE
-    if (src1->type != vec_dot_type) {
+    if (use_sgemm && src1->type != vec_dot_type) {
         const void* wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
@@ -2630,6 +2796,7 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
 
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
     ggml_aligned_free(threadpool->workers, workers_size);
+    free(threadpool->sync_after);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
 }
 
@@ -2714,6 +2881,9 @@ struct ggml_cplan ggml_graph_plan(
                             (node->src[0]->type == GGML_TYPE_F32 && node->src[1] && node->src[1]->type == GGML_TYPE_I32) ||
                             (node->src[0]->type == GGML_TYPE_I32 && node->src[1] && node->src[1]->type == GGML_TYPE_F32)) {
                             cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                        } else if (node->type == GGML_TYPE_F16 && node->src[0]->type == GGML_TYPE_F32) {
+                            // F32 row per thread for the fused chains that end in this cast (ggml_cpu_forward_fused)
+                            cur = sizeof(float) * (node->ne[0] + CACHE_LINE_SIZE_F32) * n_tasks;
                         }
                     } break;
                 case GGML_OP_ADD:
@@ -2822,7 +2992,11 @@ struct ggml_cplan ggml_graph_plan(
                         const int64_t ne10 = node->src[1]->ne[0]; // DK
                         const int64_t ne20 = node->src[2]->ne[0]; // DV
 
-                        cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+                        if (GGML_FA_USE_TILED(node->src[0], node->src[1], node->src[2])) {
+                            cur = sizeof(float)*(GGML_FA_TILE_WSIZE(ne10, ne20) + CACHE_LINE_SIZE_F32)*n_tasks; // Q/K/V/S/O tiles (per thread)
+                        } else {
+                            cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+                        }
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -2869,6 +3043,301 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+//
+// fusion of short node sequences
+//
+// chains such as norm -> mul -> add (layer norm with weight and bias) and add -> gelu (bias + activation after a
+// matmul) are computed in a single pass over the rows, which saves a memory pass and a barrier per fused node
+// either chain may end in a cast to F16: the rows are then stored in half precision directly, so an F16 matmul
+// can use them without converting its input (the F32 intermediate never reaches memory)
+// every sequence has a fallback: when the pattern or the layouts do not match, the nodes run one by one
+// set GGML_CPU_NO_FUSION in the environment to disable it
+//
+
+static bool ggml_cpu_fusion = true;
+
+// F32 operand with rows that can be broadcast over the rows of node
+static bool ggml_cpu_fuse_row_operand(const struct ggml_tensor * t, const struct ggml_tensor * node) {
+    return t->type == GGML_TYPE_F32 && t->nb[0] == sizeof(float) && t->ne[0] == node->ne[0] && ggml_can_repeat(t, node);
+}
+
+// src of a binary node other than prev
+static const struct ggml_tensor * ggml_cpu_fuse_other_src(const struct ggml_tensor * node, const struct ggml_tensor * prev) {
+    const struct ggml_tensor * other = node->src[0] == prev ? node->src[1] : node->src[0];
+    return other == prev ? NULL : other;
+}
+
+// the fused kernels read a row of the input and then write the same row of the output,
+// so the two may share their data but must not partially overlap
+static bool ggml_cpu_fuse_no_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+    return a0 == b0 || a0 + ggml_nbytes(a) <= b0 || b0 + ggml_nbytes(b) <= a0;
+}
+
+// node_n is a contiguous F32 -> F16 cast of prev, with room in wdata for an F32 row per thread
+static bool ggml_cpu_fuse_f16_cast(const struct ggml_compute_params * params, const struct ggml_cgraph * cgraph, int node_n,
+        const struct ggml_tensor * prev) {
+    if (node_n >= cgraph->n_nodes) {
+        return false;
+    }
+    const struct ggml_tensor * cpy = cgraph->nodes[node_n];
+    return cpy->op == GGML_OP_CPY && cpy->src[0] == prev && cpy->type == GGML_TYPE_F16 &&
+        ggml_are_same_shape(cpy, prev) && ggml_is_contiguous(cpy) && !ggml_is_empty(cpy) &&
+        params->wsize >= sizeof(float)*(cpy->ne[0] + CACHE_LINE_SIZE_F32)*params->nth;
+}
+
+// the number of nodes of the sequence starting at node_n that are computed fused, 0 if the node is computed on its own
+// the decision depends only on the graph and on the number of threads, so all threads take the same one
+static int ggml_cpu_fused_len(const struct ggml_compute_params * params, const struct ggml_cgraph * cgraph, int node_n) {
+    const struct ggml_tensor * node = cgraph->nodes[node_n];
+
+    if (node->op == GGML_OP_NORM) {
+        static const enum ggml_op ops[] = { GGML_OP_NORM, GGML_OP_MUL, GGML_OP_ADD };
+
+        if (!ggml_can_fuse(cgraph, node_n, ops, 3)) {
+            return 0;
+        }
+
+        const struct ggml_tensor * mul = cgraph->nodes[node_n + 1];
+        const struct ggml_tensor * add = cgraph->nodes[node_n + 2];
+
+        const struct ggml_tensor * x = node->src[0];
+        const struct ggml_tensor * w = ggml_cpu_fuse_other_src(mul, node);
+        const struct ggml_tensor * b = ggml_cpu_fuse_other_src(add, mul);
+
+        if (!w || !b || ggml_is_empty(add) ||
+            x->type   != GGML_TYPE_F32 || x->nb[0]   != sizeof(float) ||
+            add->type != GGML_TYPE_F32 || add->nb[0] != sizeof(float) ||
+            !ggml_cpu_fuse_row_operand(w, add) || !ggml_cpu_fuse_row_operand(b, add)) {
+            return 0;
+        }
+
+        static const enum ggml_op ops_cast[] = { GGML_OP_NORM, GGML_OP_MUL, GGML_OP_ADD, GGML_OP_CPY };
+
+        if (ggml_cpu_fuse_f16_cast(params, cgraph, node_n + 3, add) && ggml_can_fuse(cgraph, node_n, ops_cast, 4) &&
+            ggml_cpu_fuse_no_overlap(x, cgraph->nodes[node_n + 3])) {
+            return 4;
+        }
+
+        return ggml_cpu_fuse_no_overlap(x, add) ? 3 : 0;
+    }
+
+    if (node->op == GGML_OP_ADD) {
+        static const enum ggml_op ops[] = { GGML_OP_ADD, GGML_OP_UNARY };
+
+        if (!ggml_can_fuse(cgraph, node_n, ops, 2)) {
+            return 0;
+        }
+
+        const struct ggml_tensor * gelu = cgraph->nodes[node_n + 1];
+
+        const struct ggml_tensor * x = node->src[0];
+        const struct ggml_tensor * b = node->src[1];
+
+        if (ggml_get_unary_op(gelu) != GGML_UNARY_OP_GELU || ggml_is_empty(gelu) ||
+            !ggml_are_same_shape(x, node) ||
+            x->type    != GGML_TYPE_F32 || !ggml_is_contiguous_1(x) ||
+            gelu->type != GGML_TYPE_F32 || !ggml_is_contiguous_1(gelu) ||
+            !ggml_cpu_fuse_row_operand(b, gelu)) {
+            return 0;
+        }
+
+        static const enum ggml_op ops_cast[] = { GGML_OP_ADD, GGML_OP_UNARY, GGML_OP_CPY };
+
+        if (ggml_cpu_fuse_f16_cast(params, cgraph, node_n + 2, gelu) && ggml_can_fuse(cgraph, node_n, ops_cast, 3) &&
+            ggml_cpu_fuse_no_overlap(x, cgraph->nodes[node_n + 2])) {
+            return 3;
+        }
+
+        return ggml_cpu_fuse_no_overlap(x, gelu) ? 2 : 0;
+    }
+
+    return 0;
+}
+
+// computes the sequence of nodes starting at node_n if it can be fused
+// returns the number of nodes computed, 0 if the node has to be computed on its own
+static int ggml_cpu_forward_fused(struct ggml_compute_params * params, const struct ggml_cgraph * cgraph, int node_n) {
+    const int n_fused = ggml_cpu_fused_len(params, cgraph, node_n);
+    if (n_fused == 0) {
+        return 0;
+    }
+
+    struct ggml_tensor * node = cgraph->nodes[node_n];
+    struct ggml_tensor * last = cgraph->nodes[node_n + n_fused - 1];
+
+    if (node->op == GGML_OP_NORM) {
+        const struct ggml_tensor * mul = cgraph->nodes[node_n + 1];
+        const struct ggml_tensor * add = cgraph->nodes[node_n + 2];
+
+        ggml_compute_forward_norm_mul_add(params, node, ggml_cpu_fuse_other_src(mul, node), ggml_cpu_fuse_other_src(add, mul), last);
+    } else {
+        ggml_compute_forward_add_gelu(params, node->src[0], node->src[1], last);
+    }
+
+    return n_fused;
+}
+
+//
+// barriers between graph nodes
+//
+// a node normally starts once every thread is done with the previous one; independent nodes (the K and V stores
+// into the KV cache, the projections of different branches, the views that only describe memory) need no barrier
+// between them: a thread done with its share of one starts on the next, so the idle threads of a small node take
+// the work of the following one and a barrier is saved
+// a node joins the nodes since the last barrier when its memory does not overlap theirs (other than reads of the
+// same data) and when at most one of them uses the state shared by all threads (the work buffer, the chunk
+// counter and the barriers inside an op); the others only split their rows by ith/nth
+// set GGML_CPU_NO_BARRIER_ELISION in the environment to have a barrier after every node
+//
+
+static bool ggml_cpu_barrier_elision = true;
+
+// nodes between two barriers at most
+#define GGML_CPU_SYNC_GROUP_MAX 16
+
+// node that splits its rows by ith/nth without any state shared by the threads
+static bool ggml_cpu_node_is_local(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+            // the quantized variants dequantize in the work buffer
+            return !ggml_is_quantized(node->src[0]->type) && !ggml_is_quantized(node->type);
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            return !ggml_is_quantized(node->type);
+        case GGML_OP_SCALE:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_SET_ROWS:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_UNARY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+struct ggml_cpu_mem_range {
+    const char * begin;
+    const char * end;
+};
+
+static struct ggml_cpu_mem_range ggml_cpu_node_range(const struct ggml_tensor * t) {
+    const char * data = (const char *) t->data;
+    struct ggml_cpu_mem_range r = { data, data + ggml_nbytes(t) };
+    return r;
+}
+
+static bool ggml_cpu_ranges_overlap(const struct ggml_cpu_mem_range * a, int n_a, const struct ggml_cpu_mem_range * b, int n_b) {
+    for (int i = 0; i < n_a; i++) {
+        for (int j = 0; j < n_b; j++) {
+            if (a[i].begin < b[j].end && b[j].begin < a[i].end) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// decides after which nodes of cgraph the threads wait for each other (tp->sync_after)
+// runs before the threads start, with the number of threads that compute the graph
+static void ggml_graph_plan_barriers(struct ggml_threadpool * tp, const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan,
+        int n_threads) {
+    const int n_nodes = cgraph->n_nodes;
+
+    if (tp->n_sync_after < n_nodes) {
+        free(tp->sync_after);
+        tp->sync_after   = malloc(n_nodes*sizeof(bool));
+        tp->n_sync_after = n_nodes;
+    }
+
+    if (!ggml_cpu_barrier_elision || n_threads == 1) {
+        for (int i = 0; i < n_nodes; i++) {
+            tp->sync_after[i] = true;
+        }
+        return;
+    }
+
+    const struct ggml_compute_params params = {
+        /*.ith       =*/ 0,
+        /*.nth       =*/ n_threads,
+        /*.wsize     =*/ cplan->work_size,
+        /*.wdata     =*/ cplan->work_data,
+        /*.threadpool=*/ tp,
+    };
+
+    // the memory read and written by the nodes since the last barrier
+    struct ggml_cpu_mem_range reads [GGML_CPU_SYNC_GROUP_MAX*4*GGML_MAX_SRC];
+    struct ggml_cpu_mem_range writes[GGML_CPU_SYNC_GROUP_MAX*4];
+    int  n_reads  = 0;
+    int  n_writes = 0;
+    int  n_group  = 0;
+    bool shared   = false;
+
+    int prev = -1; // last node of the previous step
+
+    for (int node_n = 0; node_n < n_nodes; ) {
+        const int n_fused = ggml_cpu_fusion ? ggml_cpu_fused_len(&params, cgraph, node_n) : 0;
+        const int n_step  = n_fused > 0 ? n_fused : 1;
+
+        tp->sync_after[node_n + n_step - 1] = false;
+
+        const struct ggml_tensor * node = cgraph->nodes[node_n];
+
+        // views and reshapes only describe memory, the nodes that use them see the ranges of their data
+        if (n_step == 1 && ggml_op_is_empty(node->op)) {
+            node_n += n_step;
+            continue;
+        }
+
+        struct ggml_cpu_mem_range step_reads [4*GGML_MAX_SRC];
+        struct ggml_cpu_mem_range step_writes[4];
+        int n_step_reads = 0;
+
+        for (int i = 0; i < n_step; i++) {
+            const struct ggml_tensor * t = cgraph->nodes[node_n + i];
+            for (int j = 0; j < GGML_MAX_SRC; j++) {
+                if (t->src[j] && t->src[j]->data) {
+                    step_reads[n_step_reads++] = ggml_cpu_node_range(t->src[j]);
+                }
+            }
+            step_writes[i] = ggml_cpu_node_range(t);
+        }
+
+        const bool step_shared = n_fused > 0 || !ggml_cpu_node_is_local(node);
+
+        const bool join = n_group > 0 && n_group < GGML_CPU_SYNC_GROUP_MAX && !(shared && step_shared) &&
+            !ggml_cpu_ranges_overlap(step_writes, n_step, writes, n_writes) &&
+            !ggml_cpu_ranges_overlap(step_writes, n_step, reads,  n_reads) &&
+            !ggml_cpu_ranges_overlap(step_reads,  n_step_reads, writes, n_writes);
+
+        if (!join) {
+            if (prev >= 0) {
+                tp->sync_after[prev] = true;
+            }
+            n_reads  = 0;
+            n_writes = 0;
+            n_group  = 0;
+            shared   = false;
+        }
+
+        memcpy(reads  + n_reads,  step_reads,  n_step_reads*sizeof(step_reads[0]));
+        memcpy(writes + n_writes, step_writes, n_step*sizeof(step_writes[0]));
+        n_reads  += n_step_reads;
+        n_writes += n_step;
+        n_group  += 1;
+        shared    = shared || step_shared;
+
+        prev    = node_n + n_step - 1;
+        node_n += n_step;
+    }
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2886,18 +3355,37 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
+    const ggml_cpu_trace_callback trace_callback      = g_trace_callback;
+    void * const                  trace_callback_data = g_trace_callback_data;
+
     for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        const int64_t t_start_us = trace_callback ? ggml_time_us() : 0;
+
+        const int n_fused = ggml_cpu_fusion ? ggml_cpu_forward_fused(&params, cgraph, node_n) : 0;
+        if (n_fused > 0) {
+            // the fused sequence is reported as its last node, which holds the result
+            node_n += n_fused - 1;
+            node    = cgraph->nodes[node_n];
+        } else {
+            ggml_compute_forward(&params, node);
+        }
 
-        if (state->ith == 0 && cplan->abort_callback &&
+        if (trace_callback) {
+            trace_callback(node, state->ith, t_start_us, ggml_time_us(), trace_callback_data);
+        }
+
+        // the threads only agree on where to stop at a barrier
+        const bool sync = node_n + 1 == cgraph->n_nodes || tp->sync_after[node_n];
+
+        if (sync && state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
             atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
             tp->ec    = GGML_STATUS_ABORTED;
         }
 
-        if (node_n + 1 < cgraph->n_nodes) {
+        if (sync && node_n + 1 < cgraph->n_nodes) {
             ggml_barrier(state->threadpool);
         }
     }
@@ -3067,7 +3555,14 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_graph          = 0;
         threadpool->n_barrier        = 0;
         threadpool->n_barrier_passed = 0;
+        threadpool->n_barrier_sleeping = 0;
+        threadpool->barrier_spin_max = MAX(GGML_BARRIER_SPIN_MIN, 1024 * (int) tpp->poll);
+        threadpool->barrier_spin     = threadpool->barrier_spin_max / 4;
+        threadpool->n_barrier_yield  = 0;
+        threadpool->n_barrier_sleep  = 0;
         threadpool->current_chunk    = 0;
+        threadpool->sync_after       = NULL;
+        threadpool->n_sync_after     = 0;
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = -1;
@@ -3160,6 +3655,10 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    const int n_passed0 = atomic_load_explicit(&threadpool->n_barrier_passed, memory_order_relaxed);
+    const int n_yield0  = atomic_load_explicit(&threadpool->n_barrier_yield,  memory_order_relaxed);
+    const int n_sleep0  = atomic_load_explicit(&threadpool->n_barrier_sleep,  memory_order_relaxed);
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -3169,6 +3668,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
                 // update the number of threads from the actual number of threads that we got from OpenMP
                 n_threads = omp_get_num_threads();
                 atomic_store_explicit(&threadpool->n_threads_cur, n_threads, memory_order_relaxed);
+
+                ggml_graph_plan_barriers(threadpool, cgraph, cplan, n_threads);
             }
 
             // Apply thread CPU mask and priority
@@ -3182,6 +3683,7 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         }
     } else {
         atomic_store_explicit(&threadpool->n_threads_cur, 1, memory_order_relaxed);
+        ggml_graph_plan_barriers(threadpool, cgraph, cplan, 1);
         ggml_graph_compute_thread(&threadpool->workers[0]);
     }
 #else
@@ -3190,6 +3692,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         n_threads = threadpool->n_threads_max;
     }
 
+    ggml_graph_plan_barriers(threadpool, cgraph, cplan, n_threads);
+
     // Kick all threads to start the new graph
     ggml_graph_compute_kickoff(threadpool, n_threads);
 
@@ -3200,6 +3704,21 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
+    const int n_threads_used = atomic_load_explicit(&threadpool->n_threads_cur, memory_order_relaxed);
+    if (n_threads_used > 1) {
+        // unsigned: the counters wrap around in long-lived threadpools
+        const unsigned n_barriers = (unsigned) atomic_load_explicit(&threadpool->n_barrier_passed, memory_order_relaxed) - (unsigned) n_passed0;
+
+        ggml_critical_section_start();
+        g_barrier_stats.n_graphs   += 1;
+        g_barrier_stats.n_barriers += n_barriers;
+        g_barrier_stats.n_waits    += (int64_t) n_barriers * (n_threads_used - 1);
+        g_barrier_stats.n_yield    += (unsigned) atomic_load_explicit(&threadpool->n_barrier_yield, memory_order_relaxed) - (unsigned) n_yield0;
+        g_barrier_stats.n_sleep    += (unsigned) atomic_load_explicit(&threadpool->n_barrier_sleep, memory_order_relaxed) - (unsigned) n_sleep0;
+        g_barrier_stats.spin        = atomic_load_explicit(&threadpool->barrier_spin, memory_order_relaxed);
+        ggml_critical_section_end();
+    }
+
     enum ggml_status ret = threadpool->ec;
 
     if (disposable_threadpool) {
@@ -3545,6 +4064,24 @@ void ggml_cpu_init(void) {
     static bool is_first_call = true;
 
     if (is_first_call) {
+        ggml_cpu_fusion = getenv("GGML_CPU_NO_FUSION") == NULL;
+        ggml_cpu_barrier_elision = getenv("GGML_CPU_NO_BARRIER_ELISION") == NULL;
+        {
+            const char * barrier = getenv("GGML_CPU_BARRIER");
+            ggml_cpu_barrier_adaptive = barrier == NULL || strcmp(barrier, "spin") != 0;
+            ggml_cpu_barrier_n_cpus   = ggml_cpu_count_available();
+        }
+#ifdef GGML_VEC_GELU_SIMD
+        ggml_cpu_gelu_table = getenv("GGML_CPU_GELU_TABLE") != NULL;
+#endif
+
+#if GGML_USE_LLAMAFILE
+        {
+            const char * sgemm = getenv("GGML_CPU_SGEMM");
+            ggml_cpu_sgemm_mode = sgemm ? atoi(sgemm) != 0 : -1;
+        }
+#endif
+
         // initialize GELU, Quick GELU, SILU and EXP F32 tables
         {
             const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
@@ -5,6 +5,7 @@
 #include "traits.h"
 #include "ggml-impl.h"
 #include "amx/amx.h"
+#include "numa.h"
 
 #include <cctype>
 #include <string>
@@ -67,6 +68,9 @@ std::vector<ggml_backend_buffer_type_t> & ggml_backend_cpu_get_extra_buffer_type
         }
 #endif
 
+        // opt-in, see ggml_backend_cpu_device_get_extra_buffers_type()
+        bufts.push_back(ggml_backend_cpu_numa_buffer_type());
+
         return bufts;
     }();
 
@@ -75,7 +79,13 @@ std::vector<ggml_backend_buffer_type_t> & ggml_backend_cpu_get_extra_buffer_type
 
 static ggml_backend_buffer_type_t * ggml_backend_cpu_device_get_extra_buffers_type(ggml_backend_dev_t device) {
     static std::vector<ggml_backend_buffer_type_t> extra_bufts = [] {
-        std::vector<ggml_backend_buffer_type_t> bufts = ggml_backend_cpu_get_extra_buffer_types();
+        std::vector<ggml_backend_buffer_type_t> bufts;
+        for (auto * buft : ggml_backend_cpu_get_extra_buffer_types()) {
+            // the NUMA replicas multiply the memory of the weights, so they are not offered by default
+            if (buft != ggml_backend_cpu_numa_buffer_type()) {
+                bufts.push_back(buft);
+            }
+        }
         bufts.push_back(nullptr);
         return bufts;
     }();
@@ -630,6 +640,12 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
         ggml_backend_dev_get_extra_bufts_t fct = ggml_backend_cpu_device_get_extra_buffers_type;
         return (void *)fct;
     }
+    if (strcmp(name, "ggml_backend_cpu_numa_buffer_type") == 0) {
+        return (void *)ggml_backend_cpu_numa_buffer_type;
+    }
+    if (strcmp(name, "ggml_backend_cpu_hugepage_buffer_type") == 0) {
+        return (void *)ggml_backend_cpu_hugepage_buffer_type;
+    }
     if (strcmp(name, "ggml_backend_get_features") == 0) {
         return (void *)ggml_backend_cpu_get_features;
     }
@@ -642,6 +658,12 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_is_numa") == 0) {
         return (void *)ggml_is_numa;
     }
+    if (strcmp(name, "ggml_cpu_set_trace_callback") == 0) {
+        return (void *)ggml_cpu_set_trace_callback;
+    }
+    if (strcmp(name, "ggml_cpu_get_barrier_stats") == 0) {
+        return (void *)ggml_cpu_get_barrier_stats;
+    }
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
@@ -0,0 +1,146 @@
+#include "ggml-backend.h"
+#include "ggml-backend-impl.h"
+#include "ggml-cpu.h"
+#include "ggml-impl.h"
+
+// buffer type HUGEPAGE
+//
+// host memory backed by huge pages, so that streaming the weights through the matrix multiplications does not
+// miss the TLB every 4 KiB; the buffers are used like the ones of the CPU buffer type
+//
+// Linux:   explicit huge pages (MAP_HUGETLB) from the pool in /proc/sys/vm/nr_hugepages when it has enough free
+//          pages, otherwise a 2 MiB aligned mapping marked with madvise(MADV_HUGEPAGE) for transparent huge pages
+// Windows: large pages (MEM_LARGE_PAGES) when the process holds SeLockMemoryPrivilege, otherwise regular pages
+// other:   regular pages
+
+#if defined(_WIN32)
+#    define WIN32_LEAN_AND_MEAN
+#    ifndef NOMINMAX
+#        define NOMINMAX
+#    endif
+#    include <windows.h>
+#else
+#    include <sys/mman.h>
+#    include <unistd.h>
+#endif
+
+#include <cstdint>
+
+#define GGML_HUGEPAGE_SIZE ((size_t) 2*1024*1024)
+
+static size_t ggml_backend_cpu_hugepage_size(void) {
+#if defined(_WIN32)
+    static const size_t size = [] {
+        const size_t large = GetLargePageMinimum();
+        return large > 0 ? large : (size_t) GGML_HUGEPAGE_SIZE;
+    }();
+    return size;
+#else
+    return GGML_HUGEPAGE_SIZE;
+#endif
+}
+
+// the length of the mapping behind a buffer of the given size
+static size_t ggml_backend_cpu_hugepage_mapped_size(size_t size) {
+    const size_t page = ggml_backend_cpu_hugepage_size();
+    return ((size > 0 ? size : 1) + page - 1) / page * page;
+}
+
+static void * ggml_backend_cpu_hugepage_alloc(size_t mapped) {
+#if defined(_WIN32)
+    void * ptr = VirtualAlloc(NULL, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (ptr == NULL) {
+        GGML_LOG_DEBUG("%s: large pages not available (error %lu), using regular pages\n", __func__, GetLastError());
+        ptr = VirtualAlloc(NULL, mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+    return ptr;
+#else
+#if defined(MAP_HUGETLB)
+    void * ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        return ptr;
+    }
+#endif
+
+    // over-allocate by one huge page and trim, so that the mapping starts on a huge page boundary
+    const size_t page = ggml_backend_cpu_hugepage_size();
+    uint8_t * raw = (uint8_t *) mmap(NULL, mapped + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == (uint8_t *) MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8_t * base = (uint8_t *) (((uintptr_t) raw + page - 1) & ~((uintptr_t) page - 1));
+    if (base > raw) {
+        munmap(raw, base - raw);
+    }
+    if (raw + page > base) {
+        munmap(base + mapped, (raw + page) - base);
+    }
+
+#if defined(MADV_HUGEPAGE)
+    if (madvise(base, mapped, MADV_HUGEPAGE) != 0) {
+        GGML_LOG_DEBUG("%s: transparent huge pages not available, using regular pages\n", __func__);
+    }
+#endif
+
+    return base;
+#endif
+}
+
+static const char * ggml_backend_cpu_hugepage_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_HUGEPAGE";
+
+    GGML_UNUSED(buft);
+}
+
+static void ggml_backend_cpu_hugepage_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+#if defined(_WIN32)
+    VirtualFree(buffer->context, 0, MEM_RELEASE);
+#else
+    munmap(buffer->context, ggml_backend_cpu_hugepage_mapped_size(buffer->size));
+#endif
+}
+
+static ggml_backend_buffer_t ggml_backend_cpu_hugepage_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft,
+                                                                                size_t                     size) {
+    void * ptr = ggml_backend_cpu_hugepage_alloc(ggml_backend_cpu_hugepage_mapped_size(size));
+    if (ptr == NULL) {
+        GGML_LOG_ERROR("failed to allocate HUGEPAGE buffer of size %zu\n", size);
+        return NULL;
+    }
+
+    ggml_backend_buffer_t buffer = ggml_backend_cpu_buffer_from_ptr(ptr, size);
+    buffer->buft                 = buft;
+    buffer->iface.free_buffer    = ggml_backend_cpu_hugepage_buffer_free_buffer;
+
+    return buffer;
+}
+
+static size_t ggml_backend_cpu_hugepage_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return TENSOR_ALIGNMENT;
+
+    GGML_UNUSED(buft);
+}
+
+static bool ggml_backend_cpu_hugepage_buffer_type_is_host(ggml_backend_buffer_type_t buft) {
+    return true;
+
+    GGML_UNUSED(buft);
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_hugepage = {
+        /* .iface    = */ {
+                           /* .get_name         = */ ggml_backend_cpu_hugepage_buffer_type_get_name,
+                           /* .alloc_buffer     = */ ggml_backend_cpu_hugepage_buffer_type_alloc_buffer,
+                           /* .get_alignment    = */ ggml_backend_cpu_hugepage_buffer_type_get_alignment,
+                           /* .get_max_size     = */ nullptr,  // defaults to SIZE_MAX
+                           /* .get_alloc_size   = */ nullptr,  // defaults to ggml_nbytes
+                           /* .is_host          = */ ggml_backend_cpu_hugepage_buffer_type_is_host,
+                           },
+        /* .device   = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+        /* .context  = */ nullptr,
+    };
+
+    return &ggml_backend_cpu_buffer_type_hugepage;
+}
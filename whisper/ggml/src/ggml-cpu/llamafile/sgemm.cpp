@@ -77,6 +77,11 @@ inline float unhalf(ggml_fp16_t d) {
     return GGML_CPU_FP16_TO_FP32(d);
 }
 
+// scalar element of a float matrix, for the tail of k that does not fill a vector
+inline float unpack(float x) { return x; }
+inline float unpack(ggml_fp16_t x) { return unhalf(x); }
+inline float unpack(ggml_bf16_t x) { return GGML_BF16_TO_FP32(x); }
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // VECTORIZED ARITHMETIC OPERATIONS
 
@@ -340,7 +345,8 @@ class tinyBLAS {
     }
 
     bool matmul(int64_t m, int64_t n) {
-        if (k % KN != 0)
+        // the last k % KN columns are summed in scalar (e.g. the 1500 positions of the whisper encoder)
+        if (k < KN)
             return false;
         // compute RM for only need tile with size RM&RM-1
 #if VECTOR_REGISTERS == 32
@@ -396,7 +402,8 @@ class tinyBLAS {
     template <int RM, int RN>
     inline void gemm_bloc(int64_t ii, int64_t jj) {
         D Cv[RN][RM] = {};
-        for (int64_t l = 0; l < k; l += KN) {
+        const int64_t kv = k - k % KN;
+        for (int64_t l = 0; l < kv; l += KN) {
             // help compiler for op order.
             if constexpr (RM <= RN) {
                 V Av[RM];
@@ -423,8 +430,13 @@ class tinyBLAS {
             }
         }
         for (int64_t j = 0; j < RN; ++j)
-            for (int64_t i = 0; i < RM; ++i)
-                C[ldc * (jj + j) + (ii + i)] = hsum(Cv[j][i]);
+            for (int64_t i = 0; i < RM; ++i) {
+                float sum = hsum(Cv[j][i]);
+                for (int64_t l = kv; l < k; ++l) {
+                    sum += unpack(A[lda * (ii + i) + l]) * unpack(B[ldb * (jj + j) + l]);
+                }
+                C[ldc * (jj + j) + (ii + i)] = sum;
+            }
     }
 
     template <int RM, int RN, int BM>
@@ -0,0 +1,316 @@
+#include "ops.h"
+
+#include "ggml-backend.h"
+#include "ggml-backend-impl.h"
+#include "ggml-cpu.h"
+#include "ggml-impl.h"
+#include "traits.h"
+
+#include "numa.h"
+
+// buffer type NUMA
+//
+// read-only weights replicated in the memory of every NUMA node: the buffer keeps one copy per node, each bound to
+// its node, and MUL_MAT / GET_ROWS threads read the copy of the node they run on; with the threads of a pool placed
+// one node at a time, decoding then streams the weights from local memory on every socket instead of across the
+// interconnect for all but one of them
+//
+// the tensors point into the copy of the first node; the buffer is not host memory, so tensors are written with
+// ggml_backend_tensor_set(), which updates all copies
+// on hosts with a single node (and outside Linux) there is one copy and the buffer behaves like a CPU buffer
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#    include <sched.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+#    ifndef MPOL_BIND
+#        define MPOL_BIND 2
+#    endif
+#endif
+
+#define GGML_NUMA_REPLICAS_MAX 8
+
+namespace {
+
+// node of each CPU, from /sys/devices/system/node/node*/cpulist
+struct numa_topology {
+    int n_nodes = 1;
+    std::vector<int> node_of_cpu;
+
+    numa_topology() {
+#if defined(__linux__)
+        for (int n = 0; n < GGML_NUMA_REPLICAS_MAX; ++n) {
+            const std::string path = "/sys/devices/system/node/node" + std::to_string(n) + "/cpulist";
+            FILE * f = fopen(path.c_str(), "r");
+            if (!f) {
+                break;
+            }
+            char buf[4096] = { 0 };
+            const size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+            fclose(f);
+            buf[len] = '\0';
+
+            // "0-3,8-11"
+            for (char * p = buf; *p && *p != '\n';) {
+                char * end = nullptr;
+                const long first = strtol(p, &end, 10);
+                if (end == p) {
+                    break;
+                }
+                long last = first;
+                p = end;
+                if (*p == '-') {
+                    last = strtol(p + 1, &end, 10);
+                    p = end;
+                }
+                for (long c = first; c <= last && c < 4096; ++c) {
+                    if ((long) node_of_cpu.size() <= c) {
+                        node_of_cpu.resize(c + 1, 0);
+                    }
+                    node_of_cpu[c] = n;
+                }
+                if (*p == ',') {
+                    ++p;
+                }
+            }
+            n_nodes = n + 1;
+        }
+#endif
+    }
+
+    // node of the CPU the calling thread runs on
+    int current_node() const {
+#if defined(__linux__)
+        if (n_nodes > 1) {
+            const int cpu = sched_getcpu();
+            if (cpu >= 0 && cpu < (int) node_of_cpu.size()) {
+                return node_of_cpu[cpu];
+            }
+        }
+#endif
+        return 0;
+    }
+};
+
+const numa_topology & ggml_numa_topology() {
+    static const numa_topology topo;
+    return topo;
+}
+
+struct numa_buffer_context {
+    size_t                 size = 0;
+    std::vector<uint8_t *> replicas;  // one per node, replicas[0] backs the tensor data pointers
+};
+
+uint8_t * numa_alloc_on_node(size_t size, int node, int n_nodes) {
+#if defined(__linux__)
+    void * ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+    if (n_nodes > 1) {
+        // bind before the first touch, so that the pages are faulted in on the node
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_mbind, ptr, size, MPOL_BIND, &mask, sizeof(mask)*8, 0) != 0) {
+            GGML_LOG_WARN("%s: failed to bind %zu bytes to NUMA node %d\n", __func__, size, node);
+        }
+    }
+    return (uint8_t *) ptr;
+#else
+    GGML_UNUSED(node);
+    GGML_UNUSED(n_nodes);
+    return (uint8_t *) ggml_aligned_malloc(size);
+#endif
+}
+
+void numa_free(uint8_t * ptr, size_t size) {
+#if defined(__linux__)
+    munmap(ptr, size);
+#else
+    ggml_aligned_free(ptr, size);
+#endif
+}
+
+}  // namespace
+
+static void ggml_backend_cpu_numa_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    auto * ctx = (numa_buffer_context *) buffer->context;
+    for (uint8_t * replica : ctx->replicas) {
+        numa_free(replica, ctx->size);
+    }
+    delete ctx;
+}
+
+static void * ggml_backend_cpu_numa_buffer_get_base(ggml_backend_buffer_t buffer) {
+    auto * ctx = (numa_buffer_context *) buffer->context;
+    return ctx->replicas[0];
+}
+
+static void ggml_backend_cpu_numa_buffer_memset_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, uint8_t value, size_t offset, size_t size) {
+    auto * ctx = (numa_buffer_context *) buffer->context;
+    const size_t offs = (uint8_t *) tensor->data - ctx->replicas[0] + offset;
+    for (uint8_t * replica : ctx->replicas) {
+        memset(replica + offs, value, size);
+    }
+}
+
+static void ggml_backend_cpu_numa_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    auto * ctx = (numa_buffer_context *) buffer->context;
+    const size_t offs = (uint8_t *) tensor->data - ctx->replicas[0] + offset;
+    for (uint8_t * replica : ctx->replicas) {
+        memcpy(replica + offs, data, size);
+    }
+}
+
+static void ggml_backend_cpu_numa_buffer_get_tensor(ggml_backend_buffer_t buffer, const struct ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    memcpy(data, (const uint8_t *) tensor->data + offset, size);
+
+    GGML_UNUSED(buffer);
+}
+
+static void ggml_backend_cpu_numa_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    auto * ctx = (numa_buffer_context *) buffer->context;
+    for (uint8_t * replica : ctx->replicas) {
+        memset(replica, value, ctx->size);
+    }
+}
+
+static const struct ggml_backend_buffer_i ggml_backend_cpu_numa_buffer_i = {
+    /* .free_buffer     = */ ggml_backend_cpu_numa_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_numa_buffer_get_base,
+    /* .init_tensor     = */ nullptr, // no initialization required
+    /* .memset_tensor   = */ ggml_backend_cpu_numa_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_numa_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_cpu_numa_buffer_get_tensor,
+    /* .cpy_tensor      = */ nullptr,
+    /* .clear           = */ ggml_backend_cpu_numa_buffer_clear,
+    /* .reset           = */ nullptr,
+};
+
+static const char * ggml_backend_cpu_numa_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_NUMA";
+
+    GGML_UNUSED(buft);
+}
+
+static ggml_backend_buffer_t ggml_backend_cpu_numa_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    const auto & topo = ggml_numa_topology();
+
+    auto * ctx = new numa_buffer_context;
+    ctx->size = size > 0 ? size : 1;
+
+    for (int node = 0; node < topo.n_nodes; ++node) {
+        uint8_t * replica = numa_alloc_on_node(ctx->size, node, topo.n_nodes);
+        if (replica == nullptr) {
+            GGML_LOG_ERROR("%s: failed to allocate NUMA buffer of size %zu on node %d\n", __func__, size, node);
+            for (uint8_t * r : ctx->replicas) {
+                numa_free(r, ctx->size);
+            }
+            delete ctx;
+            return nullptr;
+        }
+        ctx->replicas.push_back(replica);
+    }
+
+    return ggml_backend_buffer_init(buft, ggml_backend_cpu_numa_buffer_i, ctx, size);
+}
+
+static size_t ggml_backend_cpu_numa_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return TENSOR_ALIGNMENT;
+
+    GGML_UNUSED(buft);
+}
+
+namespace ggml::cpu::numa {
+class tensor_traits : public ggml::cpu::tensor_traits {
+    bool work_size(int /* n_threads */, const struct ggml_tensor * /* op */, size_t & /* size */) override {
+        // same as the op on a CPU buffer
+        return false;
+    }
+
+    bool compute_forward(struct ggml_compute_params * params, struct ggml_tensor * op) override {
+        const auto * ctx  = (const numa_buffer_context *) op->src[0]->buffer->context;
+        const int    node = ggml_numa_topology().current_node();
+
+        // the op as seen by this thread: src0 points into the replica of its node
+        ggml_tensor src0 = *op->src[0];
+        ggml_tensor dst  = *op;
+        if (node > 0 && node < (int) ctx->replicas.size()) {
+            src0.data = ctx->replicas[node] + ((uint8_t *) op->src[0]->data - ctx->replicas[0]);
+        }
+        dst.src[0] = &src0;
+
+        switch (op->op) {
+            case GGML_OP_MUL_MAT:
+                ggml_compute_forward_mul_mat(params, &dst);
+                return true;
+            case GGML_OP_GET_ROWS:
+                ggml_compute_forward_get_rows(params, &dst);
+                return true;
+            default:
+                return false;
+        }
+    }
+};
+
+static tensor_traits traits;
+
+class extra_buffer_type : ggml::cpu::extra_buffer_type {
+    bool supports_op(ggml_backend_dev_t, const struct ggml_tensor * op) override {
+        if (op->src[0]->buffer == nullptr || op->src[0]->buffer->buft != ggml_backend_cpu_numa_buffer_type()) {
+            return false;
+        }
+        // only the weights are replicated
+        for (int i = 1; i < GGML_MAX_SRC; ++i) {
+            if (op->src[i] && op->src[i]->buffer && op->src[i]->buffer->buft == ggml_backend_cpu_numa_buffer_type()) {
+                return false;
+            }
+        }
+        if (op->src[1]->buffer && !ggml_backend_buft_is_host(op->src[1]->buffer->buft)) {
+            return false;
+        }
+        switch (op->op) {
+            case GGML_OP_MUL_MAT:
+                return op->src[1]->type == GGML_TYPE_F32 || op->src[1]->type == ggml_get_type_traits_cpu(op->src[0]->type)->vec_dot_type;
+            case GGML_OP_GET_ROWS:
+                return op->src[1]->type == GGML_TYPE_I32;
+            default:
+                return false;
+        }
+    }
+
+    ggml::cpu::tensor_traits * get_tensor_traits(const struct ggml_tensor * op) override {
+        if (op->op == GGML_OP_MUL_MAT || op->op == GGML_OP_GET_ROWS) {
+            if (op->src[0]->buffer && op->src[0]->buffer->buft == ggml_backend_cpu_numa_buffer_type()) {
+                return &traits;
+            }
+        }
+        return nullptr;
+    }
+};
+}  // namespace ggml::cpu::numa
+
+ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_numa = {
+        /* .iface    = */ {
+                           /* .get_name         = */ ggml_backend_cpu_numa_buffer_type_get_name,
+                           /* .alloc_buffer     = */ ggml_backend_cpu_numa_buffer_type_alloc_buffer,
+                           /* .get_alignment    = */ ggml_backend_cpu_numa_buffer_type_get_alignment,
+                           /* .get_max_size     = */ nullptr,  // defaults to SIZE_MAX
+                           /* .get_alloc_size   = */ nullptr,  // defaults to ggml_nbytes
+                           /* .is_host          = */ nullptr,
+                           },
+        /* .device  = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+        /* .context = */ new ggml::cpu::numa::extra_buffer_type(),
+    };
+
+    return &ggml_backend_cpu_buffer_type_numa;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "ggml-backend.h"
+#include "ggml.h"
+
+// GGML CPU internal header
+
+// weights replicated per NUMA node; not listed by ggml_backend_dev_get_extra_bufts(), applications opt in
+// through the "ggml_backend_cpu_numa_buffer_type" proc address of the CPU backend
+ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(void);
@@ -3512,6 +3512,129 @@ void ggml_compute_forward_norm(
     }
 }
 
+// ggml_compute_forward_norm_mul_add
+
+// norm(x)*w + b in one pass over the rows, w and b are broadcast over the rows of dst
+// dst may share its data with x, every row is read before it is written
+// an F16 dst (the chain ends in a cast) is computed in an F32 row of wdata per thread and stored converted
+void ggml_compute_forward_norm_mul_add(
+        const ggml_compute_params * params,
+        const ggml_tensor * norm,
+        const ggml_tensor * w,
+        const ggml_tensor * b,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = norm->src[0];
+
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
+    GGML_ASSERT(src0->type == GGML_TYPE_F32 && src0->nb[0] == sizeof(float));
+    GGML_ASSERT(w->type    == GGML_TYPE_F32 && w->nb[0]    == sizeof(float) && w->ne[0] == dst->ne[0]);
+    GGML_ASSERT(b->type    == GGML_TYPE_F32 && b->nb[0]    == sizeof(float) && b->ne[0] == dst->ne[0]);
+    GGML_ASSERT((dst->type == GGML_TYPE_F32 || dst->type == GGML_TYPE_F16) && dst->nb[0] == ggml_type_size(dst->type));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const bool f16 = dst->type == GGML_TYPE_F16;
+
+    float * row = nullptr;
+    if (f16) {
+        GGML_ASSERT(params->wsize >= sizeof(float)*(ne00 + CACHE_LINE_SIZE_F32)*nth);
+        row = (float *) params->wdata + (ne00 + CACHE_LINE_SIZE_F32)*ith;
+    }
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+                float sum = 0.0;
+                ggml_vec_sum_f32(ne00, &sum, x);
+                const float mean = sum/ne00;
+
+                float * y = f16 ? row : (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                const float variance = ggml_vec_cvar_f32(ne00, y, x, mean);
+                const float scale    = 1.0f/sqrtf(variance + eps);
+
+                const float * pw = (const float *) ((const char *) w->data + (i01%w->ne[1])*w->nb[1] + (i02%w->ne[2])*w->nb[2] + (i03%w->ne[3])*w->nb[3]);
+                const float * pb = (const float *) ((const char *) b->data + (i01%b->ne[1])*b->nb[1] + (i02%b->ne[2])*b->nb[2] + (i03%b->ne[3])*b->nb[3]);
+
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    y[i00] = (y[i00]*scale)*pw[i00] + pb[i00];
+                }
+
+                if (f16) {
+                    ggml_cpu_fp32_to_fp16(y, (ggml_fp16_t *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3), ne00);
+                }
+            }
+        }
+    }
+}
+
+// ggml_compute_forward_add_gelu
+
+// gelu(x + b) in one pass, b is broadcast over the rows of dst
+// an F16 dst goes through an F32 row of wdata per thread, as in ggml_compute_forward_norm_mul_add
+void ggml_compute_forward_add_gelu(
+        const ggml_compute_params * params,
+        const ggml_tensor * x,
+        const ggml_tensor * b,
+        ggml_tensor * dst) {
+
+    GGML_ASSERT(ggml_are_same_shape(x, dst));
+
+    GGML_ASSERT(x->type   == GGML_TYPE_F32 && ggml_is_contiguous_1(x));
+    GGML_ASSERT(b->type   == GGML_TYPE_F32 && b->nb[0] == sizeof(float) && b->ne[0] == dst->ne[0]);
+    GGML_ASSERT((dst->type == GGML_TYPE_F32 || dst->type == GGML_TYPE_F16) && ggml_is_contiguous_1(dst));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = dst->ne[0];
+    const int nr = ggml_nrows(dst);
+
+    const bool f16 = dst->type == GGML_TYPE_F16;
+
+    float * row = nullptr;
+    if (f16) {
+        GGML_ASSERT(params->wsize >= sizeof(float)*(nc + CACHE_LINE_SIZE_F32)*nth);
+        row = (float *) params->wdata + (nc + CACHE_LINE_SIZE_F32)*ith;
+    }
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int64_t i3 = ir/(dst->ne[2]*dst->ne[1]);
+        const int64_t i2 = (ir - i3*dst->ne[2]*dst->ne[1])/dst->ne[1];
+        const int64_t i1 = (ir - i3*dst->ne[2]*dst->ne[1] - i2*dst->ne[1]);
+
+        char        * pd =                   (char       *) dst->data + i1*dst->nb[1] + i2*dst->nb[2] + i3*dst->nb[3];
+        const float * px = (const float *) ((const char *) x->data   + i1*x->nb[1]   + i2*x->nb[2]   + i3*x->nb[3]);
+        const float * pb = (const float *) ((const char *) b->data   + (i1%b->ne[1])*b->nb[1] + (i2%b->ne[2])*b->nb[2] + (i3%b->ne[3])*b->nb[3]);
+
+        if (f16) {
+            ggml_vec_add_gelu_f32(nc, row, px, pb);
+            ggml_cpu_fp32_to_fp16(row, (ggml_fp16_t *) pd, nc);
+        } else {
+            ggml_vec_add_gelu_f32(nc, (float *) pd, px, pb);
+        }
+    }
+}
+
 // ggml_compute_forward_group_rms_norm
 
 static void ggml_compute_forward_rms_norm_f32(
@@ -7967,12 +8090,12 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     // total rows in q
     const int nr = neq1*neq2*neq3;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    // the rows are split in a few chunks per thread that the threads take from a shared counter,
+    // so a preempted or slower thread does not hold back the others at the next barrier
+    const int nchunk = MIN(nr, 4*nth);
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // rows per chunk
+    const int dr = (nr + nchunk - 1)/nchunk;
 
     float scale         = 1.0f;
     float max_bias      = 0.0f;
@@ -8000,150 +8123,406 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
     GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    if (ith == 0) {
+        // every thread starts at chunk ith, so the first unclaimed chunk is nth
+        ggml_threadpool_chunk_set(params->threadpool, nth);
+    }
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+    ggml_barrier(params->threadpool);
 
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
+    for (int ichunk = ith; ichunk < nchunk; ichunk = ggml_threadpool_chunk_add(params->threadpool, 1)) {
+        // row range of this chunk
+        const int ir0 = dr*ichunk;
+        const int ir1 = MIN(ir0 + dr, nr);
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
+        // loop over n_batch and n_head
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // q indices
+            const int iq3 = ir/(neq2*neq1);
+            const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+            const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-        if (v->type == GGML_TYPE_F16) {
-            memset(VKQ16, 0, DV*sizeof(ggml_fp16_t));
-        } else {
-            memset(VKQ32, 0, DV*sizeof(float));
-        }
+            const uint32_t h = iq2; // head index
+            const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
 
-        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) : NULL;
+            float S = 0.0f;      // sum
+            float M = -INFINITY; // maximum KQ value
 
-        // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+            float       * VKQ32 = (float       *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
+            float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
+            ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
+            ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
 
-        // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+            if (v->type == GGML_TYPE_F16) {
+                memset(VKQ16, 0, DV*sizeof(ggml_fp16_t));
+            } else {
+                memset(VKQ32, 0, DV*sizeof(float));
+            }
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, DK);
+            const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) : NULL;
 
-        // online softmax / attention
-        // loop over n_kv and n_head_kv
-        // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_CPU_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
-            }
+            // k indices
+            const int ik3 = iq3 / rk3;
+            const int ik2 = iq2 / rk2;
+
+            // v indices
+            const int iv3 = iq3 / rv3;
+            const int iv2 = iq2 / rv2;
 
-            float s; // KQ value
+            const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+            q_to_vec_dot(pq, Q_q, DK);
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
+            // online softmax / attention
+            // loop over n_kv and n_head_kv
+            // ref: https://arxiv.org/pdf/2112.05682.pdf
+            for (int64_t ic = 0; ic < nek1; ++ic) {
+                const float mv = mp ? slope*GGML_CPU_FP16_TO_FP32(mp[ic]) : 0.0f;
+                if (mv == -INFINITY) {
+                    continue;
+                }
 
-            s = s*scale; // scale KQ value
+                float s; // KQ value
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
-            }
+                const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
+                kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
 
-            s += mv; // apply mask
+                s = s*scale; // scale KQ value
 
-            const float Mold = M;
+                if (logit_softcap != 0.0f) {
+                    s = logit_softcap*tanhf(s);
+                }
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+                s += mv; // apply mask
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                const float Mold = M;
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
+                float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+
+                const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(DV, VKQ16, ms);
+                if (v->type == GGML_TYPE_F16) {
+                    if (s > M) {
+                        // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                        M = s;
+                        ms = expf(Mold - M);
+
+                        // V = V*expf(Mold - M)
+                        ggml_vec_scale_f16(DV, VKQ16, ms);
+                    } else {
+                        // no new maximum, ms == 1.0f, vs != 1.0f
+                        vs = expf(s - M);
+                    }
+
+                    // V += v*expf(s - M)
+                    ggml_vec_mad_f16(DV, VKQ16, (const ggml_fp16_t *) v_data, vs);
                 } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                    if (s > M) {
+                        // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                        M = s;
+                        ms = expf(Mold - M);
+
+                        // V = V*expf(Mold - M)
+                        ggml_vec_scale_f32(DV, VKQ32, ms);
+                    } else {
+                        // no new maximum, ms == 1.0f, vs != 1.0f
+                        vs = expf(s - M);
+                    }
+
+                    // V += v*expf(s - M)
+                    if (v_to_float) {
+                        v_to_float(v_data, V32, DV);
+                        ggml_vec_mad_f32(DV, VKQ32, V32, vs);
+                    } else {
+                        // V is F32
+                        ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
+                    }
                 }
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(DV, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                S = S*ms + vs; // scale and increment sum with partial sum
+            }
 
-                    // V = V*expf(Mold - M)
+            if (v->type == GGML_TYPE_F16) {
+                for (int64_t d = 0; d < DV; ++d) {
+                    VKQ32[d] = GGML_CPU_FP16_TO_FP32(VKQ16[d]);
+                }
+            }
+
+            // sinks
+            if (sinks) {
+                const float s = ((float *)((char *) sinks->data))[h];
+
+                float ms = 1.0f;
+                float vs = 1.0f;
+
+                if (s > M) {
+                    ms = expf(M - s);
                     ggml_vec_scale_f32(DV, VKQ32, ms);
                 } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
                     vs = expf(s - M);
                 }
 
-                // V += v*expf(s - M)
-                if (v_to_float) {
-                    v_to_float(v_data, V32, DV);
-                    ggml_vec_mad_f32(DV, VKQ32, V32, vs);
-                } else {
-                    // V is F32
-                    ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
-                }
+                S = S*ms + vs;
             }
 
-            S = S*ms + vs; // scale and increment sum with partial sum
+            // V /= S
+            const float S_inv = S == 0.0f ? 0.0f : 1.0f/S;
+            ggml_vec_scale_f32(DV, VKQ32, S_inv);
+
+            // dst indices
+            const int i1 = iq1;
+            const int i2 = iq2;
+            const int i3 = iq3;
+
+            // original
+            //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
         }
+    }
+}
 
-        if (v->type == GGML_TYPE_F16) {
-            for (int64_t d = 0; d < DV; ++d) {
-                VKQ32[d] = GGML_CPU_FP16_TO_FP32(VKQ16[d]);
-            }
+// tiled variant for F16 K/V with many queries (e.g. encoder self-attention)
+// a tile of Q rows is processed against tiles of K/V rows that are converted to F32 once per tile,
+// so the KQ matrix never exists as a whole and the K/V conversion is shared by all rows of the Q tile
+static void ggml_compute_forward_flash_attn_ext_f16_tiled(
+        const ggml_compute_params * params,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * q     = dst->src[0];
+    const ggml_tensor * k     = dst->src[1];
+    const ggml_tensor * v     = dst->src[2];
+    const ggml_tensor * mask  = dst->src[3];
+    const ggml_tensor * sinks = dst->src[4];
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+
+    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne2 == N);
+
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->type == GGML_TYPE_F16);
+    GGML_ASSERT(v->type == GGML_TYPE_F16);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(neq0 == DK);
+    GGML_ASSERT(nev0 == DV);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    // broadcast factors
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    float scale         = 1.0f;
+    float max_bias      = 0.0f;
+    float logit_softcap = 0.0f;
+
+    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias,      (float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+
+    if (logit_softcap != 0) {
+        scale /= logit_softcap;
+    }
+
+    const uint32_t n_head      = neq2;
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+
+    const int64_t TQ = GGML_FA_TILE_Q;
+    const int64_t TK = GGML_FA_TILE_KV;
+
+    float * Q32  = (float *) params->wdata + ith*(GGML_FA_TILE_WSIZE(DK, DV) + CACHE_LINE_SIZE_F32); // [TQ][DK] scaled Q rows
+    float * KT32 = Q32  + TQ*DK; // [DK][TK] transposed K tile
+    float * V32  = KT32 + DK*TK; // [TK][DV] V tile
+    float * S32  = V32  + TK*DV; // [TQ][TK] KQ values of the tile
+    float * O32  = S32  + TQ*TK; // [TQ][DV] VKQ accumulators
+    float * M    = O32  + TQ*DV; // [TQ] maximum KQ value
+    float * L    = M    + TQ;    // [TQ] sum
+
+    // work units are (q tile, head, batch), consecutive units share the same K/V rows
+    // the threads take the units from a shared counter, so a preempted or slower thread does not hold back the others
+    const int64_t n_tq    = (N + TQ - 1)/TQ;
+    const int64_t n_units = n_tq*neq2*neq3;
+
+    if (ith == 0) {
+        // every thread starts at unit ith, so the first unclaimed unit is nth
+        ggml_threadpool_chunk_set(params->threadpool, nth);
+    }
+
+    ggml_barrier(params->threadpool);
+
+    for (int64_t iu = ith; iu < n_units; iu = ggml_threadpool_chunk_add(params->threadpool, 1)) {
+        const int64_t iq3 = iu/(n_tq*neq2);
+        const int64_t iq2 = (iu - iq3*n_tq*neq2)/n_tq;
+        const int64_t iq0 = (iu - iq3*n_tq*neq2 - iq2*n_tq)*TQ;
+
+        const int64_t nq = MIN(TQ, N - iq0);
+
+        const uint32_t h = iq2; // head index
+        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+        // k indices
+        const int64_t ik3 = iq3 / rk3;
+        const int64_t ik2 = iq2 / rk2;
+
+        // v indices
+        const int64_t iv3 = iq3 / rv3;
+        const int64_t iv2 = iq2 / rv2;
+
+        const ggml_fp16_t * mp[GGML_FA_TILE_Q];
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            const int64_t iq1 = iq0 + iq;
+
+            const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+            memcpy(Q32 + iq*DK, pq, DK*sizeof(float));
+            ggml_vec_scale_f32(DK, Q32 + iq*DK, scale);
+
+            mp[iq] = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) : NULL;
+
+            M[iq] = -INFINITY;
+            L[iq] = 0.0f;
         }
 
-        // sinks
-        if (sinks) {
-            const float s = ((float *)((char *) sinks->data))[h];
+        memset(O32, 0, nq*DV*sizeof(float));
 
-            float ms = 1.0f;
-            float vs = 1.0f;
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += TK) {
+            const int64_t nk = MIN(TK, nek1 - ic0);
 
-            if (s > M) {
-                ms = expf(M - s);
-                ggml_vec_scale_f32(DV, VKQ32, ms);
-            } else {
-                vs = expf(s - M);
+            // skip tiles that are fully masked for every row
+            if (mask) {
+                bool masked = true;
+                for (int64_t iq = 0; iq < nq && masked; ++iq) {
+                    for (int64_t ic = 0; ic < nk; ++ic) {
+                        if (GGML_CPU_FP16_TO_FP32(mp[iq][ic0 + ic]) != -INFINITY) {
+                            masked = false;
+                            break;
+                        }
+                    }
+                }
+                if (masked) {
+                    continue;
+                }
             }
 
-            S = S*ms + vs;
+            for (int64_t ic = 0; ic < nk; ++ic) {
+                const ggml_fp16_t * pk = (const ggml_fp16_t *) ((const char *) k->data + ((ic0 + ic)*nbk1 + ik2*nbk2 + ik3*nbk3));
+                for (int64_t d = 0; d < DK; ++d) {
+                    KT32[d*TK + ic] = GGML_CPU_FP16_TO_FP32(pk[d]);
+                }
+
+                const ggml_fp16_t * pv = (const ggml_fp16_t *) ((const char *) v->data + ((ic0 + ic)*nbv1 + iv2*nbv2 + iv3*nbv3));
+                ggml_cpu_fp16_to_fp32(pv, V32 + ic*DV, DV);
+            }
+
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                float * s = S32 + iq*TK;
+
+                // KQ values of the row
+                memset(s, 0, nk*sizeof(float));
+                for (int64_t d = 0; d < DK; ++d) {
+                    ggml_vec_mad_f32(nk, s, KT32 + d*TK, Q32[iq*DK + d]);
+                }
+
+                float smax = -INFINITY;
+                for (int64_t ic = 0; ic < nk; ++ic) {
+                    if (logit_softcap != 0.0f) {
+                        s[ic] = logit_softcap*tanhf(s[ic]);
+                    }
+                    if (mp[iq]) {
+                        s[ic] += slope*GGML_CPU_FP16_TO_FP32(mp[iq][ic0 + ic]);
+                    }
+                    smax = MAX(smax, s[ic]);
+                }
+
+                if (smax == -INFINITY) {
+                    continue;
+                }
+
+                // online softmax: rescale the accumulators if the maximum grew
+                // ref: https://arxiv.org/pdf/2112.05682.pdf
+                if (smax > M[iq]) {
+                    const float ms = expf(M[iq] - smax);
+                    ggml_vec_scale_f32(DV, O32 + iq*DV, ms);
+                    L[iq] *= ms;
+                    M[iq]  = smax;
+                }
+
+                L[iq] += ggml_vec_soft_max_f32(nk, s, s, M[iq]);
+
+                // V += v*expf(s - M)
+                for (int64_t ic = 0; ic < nk; ++ic) {
+                    if (s[ic] != 0.0f) {
+                        ggml_vec_mad_f32(DV, O32 + iq*DV, V32 + ic*DV, s[ic]);
+                    }
+                }
+            }
         }
 
-        // V /= S
-        const float S_inv = S == 0.0f ? 0.0f : 1.0f/S;
-        ggml_vec_scale_f32(DV, VKQ32, S_inv);
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            float * o = O32 + iq*DV;
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
+            float S = L[iq];
 
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+            // sinks
+            if (sinks) {
+                const float s = ((float *)((char *) sinks->data))[h];
+
+                float ms = 1.0f;
+                float vs = 1.0f;
+
+                if (s > M[iq]) {
+                    ms = expf(M[iq] - s);
+                    ggml_vec_scale_f32(DV, o, ms);
+                } else {
+                    vs = expf(s - M[iq]);
+                }
 
-        // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+                S = S*ms + vs;
+            }
+
+            // V /= S
+            const float S_inv = S == 0.0f ? 0.0f : 1.0f/S;
+            ggml_vec_scale_f32(DV, o, S_inv);
+
+            // dst indices
+            const int64_t i1 = iq0 + iq;
+            const int64_t i2 = iq2;
+            const int64_t i3 = iq3;
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, o, nb1);
+        }
     }
 }
 
@@ -8155,7 +8534,11 @@ void ggml_compute_forward_flash_attn_ext(
         case GGML_PREC_F32:
             {
                 // uses F32 accumulators
-                ggml_compute_forward_flash_attn_ext_f16(params, dst);
+                if (GGML_FA_USE_TILED(dst->src[0], dst->src[1], dst->src[2])) {
+                    ggml_compute_forward_flash_attn_ext_f16_tiled(params, dst);
+                } else {
+                    ggml_compute_forward_flash_attn_ext_f16(params, dst);
+                }
             } break;
         default:
             {
@@ -23,6 +23,19 @@ static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 // Work buffer size for im2col operations in CONV2D
 #define GGML_IM2COL_WORK_SIZE (16 * 1024 * 1024)
 
+// Tile sizes of the tiled F16 flash attention kernel
+#define GGML_FA_TILE_Q  32
+#define GGML_FA_TILE_KV 64
+
+// Per-thread work buffer of the tiled flash attention kernel, in floats:
+// Q, S, O and M/L rows for a Q tile plus the F32 copies of a K and a V tile
+#define GGML_FA_TILE_WSIZE(DK, DV) \
+    (GGML_FA_TILE_Q*((DK) + GGML_FA_TILE_KV + (DV) + 2) + GGML_FA_TILE_KV*((DK) + (DV)))
+
+// The tiled kernel pays off once there are enough queries to share the K/V conversion
+#define GGML_FA_USE_TILED(q, k, v) \
+    ((k)->type == GGML_TYPE_F16 && (v)->type == GGML_TYPE_F16 && (q)->type == GGML_TYPE_F32 && (q)->ne[1] >= GGML_FA_TILE_Q)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -110,6 +123,10 @@ void ggml_compute_forward_cross_entropy_loss_back(const struct ggml_compute_para
 void ggml_compute_forward_opt_step_adamw(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_mul_mat(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_opt_step_sgd(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+
+// fused node sequences, see ggml_cpu_forward_fused() in ggml-cpu.c
+void ggml_compute_forward_norm_mul_add(const struct ggml_compute_params * params, const struct ggml_tensor * norm, const struct ggml_tensor * w, const struct ggml_tensor * b, struct ggml_tensor * dst);
+void ggml_compute_forward_add_gelu(const struct ggml_compute_params * params, const struct ggml_tensor * x, const struct ggml_tensor * b, struct ggml_tensor * dst);
 #ifdef __cplusplus
 }
 #endif
@@ -8,6 +8,10 @@ ggml_fp16_t ggml_table_gelu_f16[1 << 16];
 // precomputed quick gelu table for f16 (128 KB)
 ggml_fp16_t ggml_table_gelu_quick_f16[1 << 16];
 
+#ifdef GGML_VEC_GELU_SIMD
+bool ggml_cpu_gelu_table = false;
+#endif
+
 void ggml_vec_dot_f32(int n, float * GGML_RESTRICT s, size_t bs, const float * GGML_RESTRICT x, size_t bx, const float * GGML_RESTRICT y, size_t by, int nrc) {
    assert(nrc == 1);
    GGML_UNUSED(nrc);
@@ -195,6 +199,19 @@ void ggml_vec_dot_bf16(int n, float * GGML_RESTRICT s, size_t bs, ggml_bf16_t *
     sumf += (ggml_float)_mm_cvtss_f32(g);
 
 #undef LOAD
+#elif defined(__ARM_NEON) && defined(__ARM_FEATURE_BF16_VECTOR_ARITHMETIC)
+    // BFDOT: each lane accumulates the products of two adjacent pairs
+    float32x4_t c1 = vdupq_n_f32(0.0f);
+    float32x4_t c2 = vdupq_n_f32(0.0f);
+    float32x4_t c3 = vdupq_n_f32(0.0f);
+    float32x4_t c4 = vdupq_n_f32(0.0f);
+    for (; i + 32 <= n; i += 32) {
+        c1 = vbfdotq_f32(c1, vld1q_bf16((const bfloat16_t *)(x + i)),      vld1q_bf16((const bfloat16_t *)(y + i)));
+        c2 = vbfdotq_f32(c2, vld1q_bf16((const bfloat16_t *)(x + i + 8)),  vld1q_bf16((const bfloat16_t *)(y + i + 8)));
+        c3 = vbfdotq_f32(c3, vld1q_bf16((const bfloat16_t *)(x + i + 16)), vld1q_bf16((const bfloat16_t *)(y + i + 16)));
+        c4 = vbfdotq_f32(c4, vld1q_bf16((const bfloat16_t *)(x + i + 24)), vld1q_bf16((const bfloat16_t *)(y + i + 24)));
+    }
+    sumf += (ggml_float)vaddvq_f32(vaddq_f32(vaddq_f32(c1, c2), vaddq_f32(c3, c4)));
 #endif
 
     for (; i < n; ++i) {
@@ -366,6 +383,87 @@ void ggml_vec_silu_f32(const int n, float * y, const float * x) {
     }
 }
 
+void ggml_vec_gelu_simd_f32(const int n, float * y, const float * x) {
+    int i = 0;
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+    for (; i + 15 < n; i += 16) {
+        _mm512_storeu_ps(y + i, ggml_v_gelu(_mm512_loadu_ps(x + i)));
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(y + i, ggml_v_gelu(_mm256_loadu_ps(x + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 3 < n; i += 4) {
+        _mm_storeu_ps(y + i, ggml_v_gelu(_mm_loadu_ps(x + i)));
+    }
+#elif defined(__ARM_FEATURE_SVE) && defined(__aarch64__)
+    const int vlen = svcntw();
+    for (; i < n; i += vlen) {
+        const svbool_t pg = svwhilelt_b32_s32(i, n);
+        svst1_f32(pg, y + i, ggml_v_gelu(pg, svld1_f32(pg, x + i)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 3 < n; i += 4) {
+        vst1q_f32(y + i, ggml_v_gelu(vld1q_f32(x + i)));
+    }
+#elif defined(__riscv_v_intrinsic)
+    for (int vl; i < n; i += vl) {
+        vl = __riscv_vsetvl_e32m2(n - i);
+        __riscv_vse32_v_f32m2(&y[i], ggml_v_gelu_m2(__riscv_vle32_v_f32m2(&x[i], vl), vl), vl);
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = ggml_gelu_f32(x[i]);
+    }
+}
+
+void ggml_vec_add_gelu_f32(const int n, float * y, const float * x, const float * b) {
+#ifdef GGML_VEC_GELU_SIMD
+    if (ggml_cpu_gelu_table) {
+        ggml_vec_add_f32(n, y, x, b);
+        ggml_vec_gelu_f32(n, y, y);
+        return;
+    }
+    int i = 0;
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+    for (; i + 15 < n; i += 16) {
+        _mm512_storeu_ps(y + i, ggml_v_gelu(_mm512_add_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(b + i))));
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(y + i, ggml_v_gelu(_mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(b + i))));
+    }
+#elif defined(__SSE2__)
+    for (; i + 3 < n; i += 4) {
+        _mm_storeu_ps(y + i, ggml_v_gelu(_mm_add_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(b + i))));
+    }
+#elif defined(__ARM_FEATURE_SVE) && defined(__aarch64__)
+    const int vlen = svcntw();
+    for (; i < n; i += vlen) {
+        const svbool_t pg = svwhilelt_b32_s32(i, n);
+        svst1_f32(pg, y + i, ggml_v_gelu(pg, svadd_f32_x(pg, svld1_f32(pg, x + i), svld1_f32(pg, b + i))));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 3 < n; i += 4) {
+        vst1q_f32(y + i, ggml_v_gelu(vaddq_f32(vld1q_f32(x + i), vld1q_f32(b + i))));
+    }
+#elif defined(__riscv_v_intrinsic)
+    for (int vl; i < n; i += vl) {
+        vl = __riscv_vsetvl_e32m2(n - i);
+        vfloat32m2_t vx = __riscv_vfadd_vv_f32m2(__riscv_vle32_v_f32m2(&x[i], vl), __riscv_vle32_v_f32m2(&b[i], vl), vl);
+        __riscv_vse32_v_f32m2(&y[i], ggml_v_gelu_m2(vx, vl), vl);
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = ggml_gelu_f32(x[i] + b[i]);
+    }
+#else
+    ggml_vec_add_f32(n, y, x, b);
+    ggml_vec_gelu_f32(n, y, y);
+#endif
+}
+
 void ggml_vec_swiglu_f32(const int n, float * y, const float * x, const float * g) {
     int i = 0;
 #if defined(__AVX512F__) && defined(__AVX512DQ__)
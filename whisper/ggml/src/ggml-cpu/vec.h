@@ -17,6 +17,14 @@ typedef double ggml_float;
 #define GGML_GELU_FP16
 #define GGML_GELU_QUICK_FP16
 
+// vector GELU kernels (ggml_v_gelu) exist for this target; the fp16 table
+// stays as the fallback
+#if (defined(__ARM_FEATURE_SVE) && defined(__aarch64__)) || (defined(__ARM_NEON) && defined(__aarch64__)) || \
+    (defined(__AVX512F__) && defined(__AVX512DQ__)) || (defined(__AVX2__) && defined(__FMA__)) || \
+    defined(__SSE2__) || defined(__riscv_v_intrinsic)
+#define GGML_VEC_GELU_SIMD
+#endif
+
 #define GGML_SOFT_MAX_UNROLL 4
 #define GGML_VEC_DOT_UNROLL  2
 #define GGML_VEC_MAD_UNROLL  32
@@ -35,6 +43,12 @@ extern ggml_fp16_t ggml_table_gelu_f16[1 << 16];
 // precomputed quick gelu table for f16 (128 KB)
 extern ggml_fp16_t ggml_table_gelu_quick_f16[1 << 16];
 
+#ifdef GGML_VEC_GELU_SIMD
+// GELU goes through the fp16 table instead of the vector kernels
+// (GGML_CPU_GELU_TABLE set in the environment, read by ggml_cpu_init)
+extern bool ggml_cpu_gelu_table;
+#endif
+
 //
 // fundamental operations
 //
@@ -44,6 +58,9 @@ void ggml_vec_dot_bf16(int n, float * GGML_RESTRICT s, size_t bs, ggml_bf16_t *
 void ggml_vec_dot_f16(int n, float * GGML_RESTRICT s, size_t bs, ggml_fp16_t * GGML_RESTRICT x, size_t bx, ggml_fp16_t * GGML_RESTRICT y, size_t by, int nrc);
 
 void ggml_vec_silu_f32(const int n, float * y, const float * x);
+void ggml_vec_gelu_simd_f32(const int n, float * y, const float * x);
+// y = gelu(x + b)
+void ggml_vec_add_gelu_f32(const int n, float * y, const float * x, const float * b);
 ggml_float ggml_vec_cvar_f32(const int n, float * y, const float * x, const float mean); //it will also center y ( y = y - mean )
 ggml_float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max);
 ggml_float ggml_vec_log_soft_max_f32(const int n, float * y, const float * x, float max);
@@ -870,11 +887,27 @@ static const float GELU_QUICK_COEF = -1.702f;
 static const float SQRT_2_OVER_PI  = 0.79788456080286535587989211986876f;
 static const float SQRT_2_INV      = 0.70710678118654752440084436210484f;
 
+// 0.5*(1+tanh(u)) = 1/(1+exp(-2u)): the exponent of the vector GELU is x*(COEF_1 + COEF_2*x^2)
+static const float GELU_EXP_COEF_1 = -2.0f*0.79788456080286535587989211986876f;
+static const float GELU_EXP_COEF_2 = -2.0f*0.79788456080286535587989211986876f*0.044715f;
+
 inline static float ggml_gelu_f32(float x) {
     return 0.5f*x*(1.0f + tanhf(SQRT_2_OVER_PI*x*(1.0f + GELU_COEF_A*x*x)));
 }
 
 inline static void ggml_vec_gelu_f16(const int n, ggml_fp16_t * y, const ggml_fp16_t * x) {
+#ifdef GGML_VEC_GELU_SIMD
+    if (!ggml_cpu_gelu_table) {
+        float tmp[256];
+        for (int i = 0; i < n; i += 256) {
+            const int m = n - i < 256 ? n - i : 256;
+            ggml_cpu_fp16_to_fp32(x + i, tmp, m);
+            ggml_vec_gelu_simd_f32(m, tmp, tmp);
+            ggml_cpu_fp32_to_fp16(tmp, y + i, m);
+        }
+        return;
+    }
+#endif
     const uint16_t * i16 = (const uint16_t *) x;
     for (int i = 0; i < n; ++i) {
         y[i] = ggml_table_gelu_f16[i16[i]];
@@ -891,6 +924,12 @@ inline static void ggml_vec_gelu_erf_f16(const int n, ggml_fp16_t * y, const ggm
 
 #ifdef GGML_GELU_FP16
 inline static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
+#ifdef GGML_VEC_GELU_SIMD
+    if (!ggml_cpu_gelu_table) {
+        ggml_vec_gelu_simd_f32(n, y, x);
+        return;
+    }
+#endif
     uint16_t t;
     for (int i = 0; i < n; ++i) {
         if (x[i] <= -10.0f) {
@@ -1036,6 +1075,16 @@ inline static svfloat32_t ggml_v_silu(svbool_t pg, svfloat32_t x) {
     return svdiv_f32_x(pg, x, one_plus_exp_neg_x);
 }
 
+// computes gelu x/(1+exp(-2*sqrt(2/pi)*(x+0.044715*x^3))) in single precision vector
+inline static svfloat32_t ggml_v_gelu(svbool_t pg, svfloat32_t x) {
+    const svfloat32_t one = svdup_n_f32_x(pg, 1.0f);
+    const svfloat32_t c1 = svdup_n_f32_x(pg, GELU_EXP_COEF_1);
+    const svfloat32_t c2 = svdup_n_f32_x(pg, GELU_EXP_COEF_2);
+    const svfloat32_t x2 = svmul_f32_x(pg, x, x);
+    const svfloat32_t z = svmul_f32_x(pg, x, svmad_f32_x(pg, x2, c2, c1));
+    return svdiv_f32_x(pg, x, svadd_f32_x(pg, one, ggml_v_expf(pg, z)));
+}
+
 #elif defined(__ARM_NEON) && defined(__aarch64__)
 
 // adapted from arm limited optimized routine
@@ -1075,6 +1124,16 @@ inline static float32x4_t ggml_v_silu(float32x4_t x) {
     return vdivq_f32(x, one_plus_exp_neg_x);
 }
 
+// computes gelu x/(1+exp(-2*sqrt(2/pi)*(x+0.044715*x^3))) in single precision vector
+inline static float32x4_t ggml_v_gelu(float32x4_t x) {
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t c1 = vdupq_n_f32(GELU_EXP_COEF_1);
+    const float32x4_t c2 = vdupq_n_f32(GELU_EXP_COEF_2);
+    const float32x4_t x2 = vmulq_f32(x, x);
+    const float32x4_t z = vmulq_f32(x, vfmaq_f32(c1, x2, c2));
+    return vdivq_f32(x, vaddq_f32(one, ggml_v_expf(z)));
+}
+
 #elif defined(__AVX512F__) && defined(__AVX512DQ__)
 
 // adapted from arm limited optimized routine
@@ -1118,6 +1177,16 @@ inline static __m512 ggml_v_silu(__m512 x) {
     return _mm512_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes gelu x/(1+exp(-2*sqrt(2/pi)*(x+0.044715*x^3))) in single precision vector
+inline static __m512 ggml_v_gelu(__m512 x) {
+    const __m512 one = _mm512_set1_ps(1);
+    const __m512 c1 = _mm512_set1_ps(GELU_EXP_COEF_1);
+    const __m512 c2 = _mm512_set1_ps(GELU_EXP_COEF_2);
+    const __m512 x2 = _mm512_mul_ps(x, x);
+    const __m512 z = _mm512_mul_ps(x, _mm512_fmadd_ps(x2, c2, c1));
+    return _mm512_div_ps(x, _mm512_add_ps(one, ggml_v_expf(z)));
+}
+
 #elif defined(__AVX2__) && defined(__FMA__)
 
 // adapted from arm limited optimized routine
@@ -1173,6 +1242,16 @@ inline static __m256 ggml_v_silu(__m256 x) {
     return _mm256_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes gelu x/(1+exp(-2*sqrt(2/pi)*(x+0.044715*x^3))) in single precision vector
+inline static __m256 ggml_v_gelu(__m256 x) {
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 c1 = _mm256_set1_ps(GELU_EXP_COEF_1);
+    const __m256 c2 = _mm256_set1_ps(GELU_EXP_COEF_2);
+    const __m256 x2 = _mm256_mul_ps(x, x);
+    const __m256 z = _mm256_mul_ps(x, _mm256_fmadd_ps(x2, c2, c1));
+    return _mm256_div_ps(x, _mm256_add_ps(one, ggml_v_expf(z)));
+}
+
 #elif defined(__SSE2__) // __AVX2__ / __ARM_NEON
 
 #if defined(__FMA__)
@@ -1227,6 +1306,16 @@ inline static __m128 ggml_v_silu(__m128 x) {
     return _mm_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes gelu x/(1+exp(-2*sqrt(2/pi)*(x+0.044715*x^3))) in single precision vector
+inline static __m128 ggml_v_gelu(__m128 x) {
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 c1 = _mm_set1_ps(GELU_EXP_COEF_1);
+    const __m128 c2 = _mm_set1_ps(GELU_EXP_COEF_2);
+    const __m128 x2 = _mm_mul_ps(x, x);
+    const __m128 z = _mm_mul_ps(x, MADD128(x2, c2, c1));
+    return _mm_div_ps(x, _mm_add_ps(one, ggml_v_expf(z)));
+}
+
 #elif defined(__riscv_v_intrinsic)
 
 // adapted from arm limited optimized routine
@@ -1279,6 +1368,15 @@ inline static vfloat32m2_t ggml_v_silu_m2(vfloat32m2_t x, int vl) {
     return __riscv_vfdiv_vv_f32m2(x, one_plus_exp_neg_x, vl);
 }
 
+// computes gelu x/(1+exp(-2*sqrt(2/pi)*(x+0.044715*x^3))) in single precision vector
+inline static vfloat32m2_t ggml_v_gelu_m2(vfloat32m2_t x, int vl) {
+    const vfloat32m2_t x2 = __riscv_vfmul_vv_f32m2(x, x, vl);
+    const vfloat32m2_t p = __riscv_vfmacc_vf_f32m2(__riscv_vfmv_v_f_f32m2(GELU_EXP_COEF_1, vl), GELU_EXP_COEF_2, x2, vl);
+    const vfloat32m2_t z = __riscv_vfmul_vv_f32m2(x, p, vl);
+    const vfloat32m2_t one_plus_exp_z = __riscv_vfadd_vf_f32m2(ggml_v_expf_m2(z, vl), 1.0f, vl);
+    return __riscv_vfdiv_vv_f32m2(x, one_plus_exp_z, vl);
+}
+
 #endif // __ARM_NEON / __AVX2__ / __SSE2__ / __riscv_v_intrinsic
 
 inline static void ggml_vec_silu_f16(const int n, ggml_fp16_t * y, const ggml_fp16_t * x) {
@@ -79,6 +79,7 @@ extern "C" {
 
     struct whisper_context;
     struct whisper_state;
+    struct whisper_adapter_lora;
     struct whisper_full_params;
 
     typedef int32_t whisper_pos;
@@ -115,9 +116,15 @@ extern "C" {
 
     struct whisper_context_params {
         bool  use_gpu;
-        bool  flash_attn;
+        bool  flash_attn;  // turned off (with a warning) when the GPU has no flash attention kernel, e.g. SYCL
         int   gpu_device;  // CUDA device
 
+        // number of layers whose weights go to the GPU, counting the encoder layers first and then the decoder
+        // layers (default: -1 - all); the other layers run from host memory, e.g. large models on GPUs with
+        // little VRAM. The conv stem follows the first encoder layer, the token embedding and the final norms
+        // follow the last layer of their stack
+        int   n_gpu_layers;
+
         // [EXPERIMENTAL] Token-level timestamps with DTW
         bool dtw_token_timestamps;
         enum whisper_alignment_heads_preset dtw_aheads_preset;
@@ -125,7 +132,115 @@ extern "C" {
         int dtw_n_top;
         struct whisper_aheads dtw_aheads;
 
-        size_t dtw_mem_size; // TODO: remove
+        size_t dtw_mem_size; // unused - TODO: remove
+
+        // map the model file instead of reading it (whisper_init_from_file_*);
+        // CPU weights are then used in place and share the page cache
+        bool use_mmap;
+
+        // skip the encoder when a state is asked to encode the same mel window it encoded last
+        // (e.g. a note transcribed again with different decoding parameters)
+        bool encoder_cache;
+
+        // storage type of the self- and cross-attention KV caches (default: GGML_TYPE_F16)
+        // GGML_TYPE_BF16 uses the native BF16 dot products of AVX512-BF16 / ARMv8.6 CPUs, e.g. with a BF16 model
+        // GGML_TYPE_Q8_0 and GGML_TYPE_Q4_0 trade some accuracy for a much smaller state and require flash_attn
+        enum ggml_type type_kv;
+
+        // how long the CPU worker threads of a state poll for the next graph before they sleep
+        // (0 - 100, default 50); 0 saves CPU time between graphs, higher values cut the wake-up latency
+        int cpu_poll;
+
+        // keep CPU weights in the extra buffer types of the CPU backend (default: true)
+        // e.g. Q4_0, Q4_K and IQ4_NL matmul weights are repacked into interleaved layouts on AVX2/NEON hosts
+        bool use_extra_bufts;
+
+        // place the CPU worker threads from the host topology (default: true): on hybrid CPUs the fast cores
+        // are used first, then one NUMA node at a time; no effect on hosts with uniform cores (Linux only)
+        // note: the thread that calls into whisper computes with the pool and gets the same affinity
+        bool cpu_affinity;
+
+        // CPU worker threads owned by the application (ggml_threadpool_new(), default: NULL - each state makes its own)
+        // lets whisper share one pool with another ggml user, e.g. llama_attach_threadpool(), instead of both keeping
+        // a team of threads that spin against each other; cpu_poll and cpu_affinity then come from the pool's params
+        // the pool must outlive the states, and graphs of different users must not run on it at the same time
+        ggml_threadpool_t threadpool;
+
+        // called by the schedulers of every state for the nodes of the graphs being computed (default: NULL)
+        // see ggml_backend_sched_eval_callback; used e.g. by the quantize tool to collect activation statistics
+        ggml_backend_sched_eval_callback cb_eval;
+        void * cb_eval_user_data;
+
+        // one set of compute buffers for the conv, encoder, cross and decoder graphs of a state (default: false)
+        // the buffers are as large as the largest graph instead of the sum of all of them; the decoder graph
+        // is then planned again after every encode
+        bool share_compute_buffers;
+
+        // project the cross-attention K/V at the end of the encoder graph, straight into the KV cache (default: false)
+        // saves one graph launch and the compute buffer of the cross graph per encode; no effect with Core ML / OpenVINO
+        bool fuse_cross;
+
+        // path of a file caching the result of a short calibration at load time (default: NULL - no calibration)
+        // on the first load for a CPU and model shape, MLP matmuls of the encoder and decoder are timed with
+        // plain and repacked weights (use_extra_bufts) and with several thread counts; the best layout is then
+        // used for the weights, and whisper_full() uses the best thread count when its n_threads is <= 0
+        const char * autotune_cache;
+
+        // comma-separated ggml RPC servers ("host:port,host:port", see ggml rpc-server) to run the encoder on (default: NULL)
+        // the first server that answers gets the encoder weights and the cross-attention K/V projections; per audio
+        // window the mel goes out and the cross-attention KV comes back, decoding and sampling stay on this host
+        // requires ggml built with GGML_RPC
+        const char * rpc_servers;
+
+        // back the CPU weights and the CPU compute buffers with huge pages (default: false)
+        // cuts the TLB misses of streaming the weights for every decoded token; explicit huge pages are used when
+        // reserved (/proc/sys/vm/nr_hugepages), else transparent huge pages; the weights are then copied out of
+        // the memory-mapped model file instead of being used in place (use_mmap)
+        bool use_hugepages;
+
+        // keep one copy of the CPU matmul weights in the memory of every NUMA node (default: false)
+        // the threads of a state read the copy of the node they run on, so on multi-socket hosts decoding is not
+        // limited by the interconnect; with cpu_affinity the threads fill one node before the next. Costs one
+        // copy of the weights per node; takes precedence over the repacked layouts of use_extra_bufts (Linux only)
+        bool numa_replicate;
+
+        // number of GPUs, from gpu_device on, that hold a copy of the GPU weights (default: 1, 0 - all GPUs)
+        // every new state (whisper_init_state(), the processors of whisper_full_parallel(), server workers) goes to
+        // the GPU with the fewest states; the model file is read once and each extra GPU costs one copy of the
+        // weights; whisper_encode_batch() and whisper_decode_batch() split their states per GPU
+        int n_gpu_devices;
+
+        // pack the Q, K and V weights of every self-attention layer into one tensor at load time (default: false)
+        // the encoder and decoder graphs then read the normalized input once, with one matmul instead of three;
+        // layers whose weights live in the CPU extra buffer types (use_extra_bufts) or have mixed types are left
+        // as they are. Packed CPU weights are copied out of the memory-mapped model file (use_mmap)
+        bool fuse_qkv;
+
+        // return from whisper_init_* once the conv and encoder weights are loaded (default: false)
+        // the decoder weights, token embedding and cross-attention projections keep loading in the background;
+        // the first window is encoded meanwhile and the cross-attention and decoder graphs wait for them.
+        // Applies to the weights that are copied out of the memory-mapped model file (use_mmap): GPU weights,
+        // repacked or packed CPU weights; the CPU weights used in place are paged in on first use anyway
+        bool progressive_load;
+
+        // path of a file keeping the compute buffer sizes of the conv, encoder, cross and decoder graphs (default: NULL)
+        // whisper_init_state() measures them by planning worst-case graphs; the sizes are kept in the context for the
+        // next states of the same backends anyway, and with this file also for the next process with the same model
+        // shape and parameters. Stale sizes are harmless: the buffers grow when a graph does not fit
+        const char * sched_cache;
+
+        // type the F32/F16/BF16 matmul weights and the token embedding are converted to while loading (default:
+        // GGML_TYPE_COUNT - as stored in the file), e.g. GGML_TYPE_Q8_0 or GGML_TYPE_Q5_0, so that one full precision
+        // file serves every device class. The rows of each weight are converted on several threads as it is read.
+        // Weights that are quantized in the file, and those whose rows do not split into blocks of the type, keep
+        // their type. Converted weights are not used in place from the
+        // memory-mapped model file (use_mmap) and are not loaded in the background (progressive_load)
+        enum ggml_type type_weights;
+
+        // comma-separated REGEX=TYPE overrides of type_weights for the weights whose name matches REGEX, as the
+        // --tensor-type option of the quantize tool, e.g. "decoder.token_embedding.weight=q8_0" (default: NULL)
+        // the first match wins; TYPE is a ggml type name (f16, q8_0, q5_0, q4_k, ...)
+        const char * tensor_types;
     };
 
     typedef struct whisper_token_data {
@@ -240,6 +355,35 @@ extern "C" {
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // Bytes held by the state on its backends: the KV caches and the compute buffers of its graphs.
+    // Helps to size a pool of states for concurrent requests against a memory budget.
+    WHISPER_API size_t whisper_state_memory_size(struct whisper_state * state);
+
+    // Bytes of each buffer of a context and one of its states (nullptr - the default state, if any).
+    // A compute buffer shared by several graphs (share_compute_buffers) is counted with the conv graph.
+    // The KV self-attention cache grows with the decoders of the last whisper_full() (best_of, beam_size).
+    struct whisper_memory_usage {
+        size_t weights;        // the model, on all devices
+        size_t weights_device; // of which not in host memory
+
+        size_t kv_self;
+        size_t kv_cross;
+        size_t kv_pad;
+        size_t embd_io;
+        size_t aheads_masks;
+
+        size_t compute_conv;
+        size_t compute_encode;
+        size_t compute_cross;
+        size_t compute_decode;
+        size_t compute_batch;  // batched encoder and decoder graphs
+
+        size_t state;          // all of the state, as whisper_state_memory_size() and the alignment heads masks
+        size_t state_device;   // of which not in host memory
+    };
+
+    WHISPER_API struct whisper_memory_usage whisper_get_memory_usage(struct whisper_context * ctx, struct whisper_state * state);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -264,6 +408,90 @@ extern "C" {
                     const char * device,
                     const char * cache_dir);
 
+    // LoRA adapters: low-rank deltas of the encoder and decoder weights, applied on the fly to the matmuls of a
+    // state's graphs. The base weights stay shared, so every state of a context can run its own domain adapter
+    // and switching one (e.g. per request) costs nothing but rebuilding the graphs.
+    // The adapter is a GGUF file (general.type = "adapter", general.architecture = "whisper", adapter.type = "lora",
+    // optional adapter.lora.alpha) with the tensors <weight name>.lora_a and .lora_b; see
+    // models/convert-lora-to-gguf.py. Free the adapters after the states that use them and before the context.
+    // Returns NULL on failure
+    WHISPER_API struct whisper_adapter_lora * whisper_adapter_lora_init(struct whisper_context * ctx, const char * path_lora);
+
+    WHISPER_API void whisper_adapter_lora_free(struct whisper_adapter_lora * adapter);
+
+    // Applies the adapter to the state with the given scale, or updates its scale; adapters stack
+    // Returns 0 on success
+    WHISPER_API int whisper_set_adapter_lora_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+   struct whisper_adapter_lora * adapter,
+                         float   scale);
+
+    WHISPER_API int whisper_set_adapter_lora(
+        struct whisper_context * ctx,
+   struct whisper_adapter_lora * adapter,
+                         float   scale);
+
+    // Returns -1 if the adapter was not applied to the state
+    WHISPER_API int whisper_rm_adapter_lora_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+   struct whisper_adapter_lora * adapter);
+
+    WHISPER_API int whisper_rm_adapter_lora(
+        struct whisper_context * ctx,
+   struct whisper_adapter_lora * adapter);
+
+    WHISPER_API void whisper_clear_adapter_lora_with_state(struct whisper_context * ctx, struct whisper_state * state);
+    WHISPER_API void whisper_clear_adapter_lora           (struct whisper_context * ctx);
+
+    // Clears a state for the next job: results, prompt history, VAD mapping, KV cells, timings and metrics
+    // The KV caches, compute buffers, scheduler plans and decoder work buffers are kept, so a warm state
+    // can be reused (e.g. from a pool) without allocating again
+    WHISPER_API void whisper_state_reset(struct whisper_state * state);
+
+    // Runs the CPU graphs of a state on the given worker threads from now on (ggml_threadpool_new(), e.g. pinned to
+    // the efficiency cores at a low priority); NULL goes back to a pool of the state's own. The state lets go of its
+    // current pool first, so an application pool can be freed once another one (or NULL) is set. Helper states
+    // (draft model, encode ahead) keep their own pools
+    WHISPER_API void whisper_state_set_threadpool(struct whisper_state * state, ggml_threadpool_t threadpool);
+
+    // The CPU graphs of all the states computing at the same time (whisper_full_parallel(), --jobs, server workers)
+    // share a process-wide budget of n_threads threads (default: the hardware threads, 0: no limit) instead of each
+    // one running with its own n_threads; encoder graphs get a larger share than decoder graphs, and the worker
+    // pools of concurrent states are placed on disjoint cores while there are enough of them. States sharing an
+    // application pool (whisper_context_params.threadpool) run their graphs on it one at a time
+    WHISPER_API void whisper_cpu_sched_set_threads(int n_threads);
+
+    struct whisper_cpu_sched_stats {
+        int     n_threads;        // budget, 0: no limit
+        int     n_busy;           // threads computing graphs now
+        int     n_busy_max;       // most threads computing graphs at the same time
+        int     n_states;         // states that computed a graph within the last second
+        int64_t n_graphs;         // graphs computed
+        int64_t n_graphs_clamped; // graphs that got fewer threads than asked for
+        double  t_busy_s;         // thread-seconds spent computing graphs
+        double  t_wall_s;         // seconds since the first graph
+    };
+
+    // Utilization of the CPU scheduler: t_busy_s / (t_wall_s * n_threads) is the share of the budget in use
+    WHISPER_API struct whisper_cpu_sched_stats whisper_cpu_sched_get_stats(void);
+
+    // Snapshot of the resumable part of a state: the seek position, the results, the prompt history, the detected
+    // language and the VAD mapping. With include_kv, the cross-attention KV cache of the last encoded window is
+    // stored too, so that a job stopped in the middle of a window (abort_callback) does not encode it again
+    // (requires whisper_context_params.encoder_cache)
+    // Restore it in a state of the same model, then call whisper_full_with_state() with the same audio and
+    // whisper_full_params.resume = true to continue the job
+    // whisper_state_get_data() returns the number of bytes written (whisper_state_get_size()), 0 on error
+    // whisper_state_set_data() returns the number of bytes read, 0 on error
+    WHISPER_API size_t whisper_state_get_size(struct whisper_context * ctx, struct whisper_state * state, bool include_kv);
+    WHISPER_API size_t whisper_state_get_data(struct whisper_context * ctx, struct whisper_state * state, uint8_t * dst, size_t size, bool include_kv);
+    WHISPER_API size_t whisper_state_set_data(struct whisper_context * ctx, struct whisper_state * state, const uint8_t * src, size_t size);
+
+    WHISPER_API bool whisper_state_save_file(struct whisper_context * ctx, struct whisper_state * state, const char * path, bool include_kv);
+    WHISPER_API bool whisper_state_load_file(struct whisper_context * ctx, struct whisper_state * state, const char * path);
+
     // Frees all allocated memory
     WHISPER_API void whisper_free      (struct whisper_context * ctx);
     WHISPER_API void whisper_free_state(struct whisper_state * state);
@@ -303,6 +531,38 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    // Streaming log mel spectrogram.
+    // whisper_mel_stream_append() adds PCM to the state's running spectrogram and only computes the frames
+    // that the new audio completes. whisper_mel_stream_window() then loads the last n_samples of the stream
+    // into the state's spectrogram, normalized over that window like whisper_pcm_to_mel() would, so that
+    // whisper_full() can be called with n_samples = 0. The stream keeps the last 30 s of frames.
+    // The stream starts with zero padding instead of the reflection used by whisper_pcm_to_mel().
+    // Returns 0 on success
+    WHISPER_API void whisper_mel_stream_reset(struct whisper_context * ctx);
+    WHISPER_API void whisper_mel_stream_reset_with_state(struct whisper_state * state);
+
+    WHISPER_API int whisper_mel_stream_append(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
+    WHISPER_API int whisper_mel_stream_append_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
+    WHISPER_API int whisper_mel_stream_window(
+            struct whisper_context * ctx,
+                               int   n_samples);
+
+    WHISPER_API int whisper_mel_stream_window_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   n_samples);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the default state in the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -318,6 +578,20 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // Run the encoder for n_states states of the same context in one batched graph.
+    // states[i] is encoded from its own spectrogram at mel offset offsets[i], all with the same audio_ctx (0 = default).
+    // The result is the same as calling whisper_encode_with_state() for each state; with encoder_cache set in the
+    // context params, a following whisper_full_with_state() over the same window skips its first encoder pass.
+    // The states must not be in use by other threads during the call.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_context * ctx,
+            struct whisper_state ** states,
+                       const int  * offsets,
+                               int   n_states,
+                               int   audio_ctx,
+                               int   n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -339,6 +613,68 @@ extern "C" {
                                int   n_past,
                                int   n_threads);
 
+    // Run the decoder for n_states states of the same context in one graph.
+    // State i appends n_tokens[i] tokens from tokens[i] after n_past[i] tokens of its own history, exactly as
+    // whisper_decode_with_state() would, and gets the logits of its last token. The set of states may change
+    // from one call to the next, so independent streams can join and leave a shared decoding loop at every step.
+    // Each state must have been encoded first. The states must not be in use by other threads during the call.
+    // Returns 0 on success
+    WHISPER_API int whisper_decode_batch(
+            struct whisper_context * ctx,
+            struct whisper_state ** states,
+       const whisper_token * const * tokens,
+                         const int * n_tokens,
+                         const int * n_past,
+                               int   n_states,
+                               int   n_threads);
+
+    // Keyword spotting: score how well each of the phrases matches the audio (a short command, at most 30 s).
+    // The audio is encoded once, then the phrases are decoded together after a shared prompt, one sequence
+    // per phrase, one batch per token. A phrase is dropped once its log probability trails the best phrase
+    // by more than margin; decoding stops as soon as only one phrase is left.
+    // scores[i] is the log probability of phrase i followed by the end of the text, -INFINITY if it was dropped.
+    // The score of the phrase left last may only cover its first tokens.
+    // audio_ctx: encoder context size, 0 - fit to the length of the audio
+    // Returns the index of the best phrase, or a negative number on failure
+    WHISPER_API int whisper_score_phrases(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples,
+                        const char * language,
+                       const char ** phrases,
+                               int   n_phrases,
+                               int   audio_ctx,
+                             float   margin,
+                             float * scores,
+                               int   n_threads);
+
+    WHISPER_API int whisper_score_phrases_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                        const char * language,
+                       const char ** phrases,
+                               int   n_phrases,
+                               int   audio_ctx,
+                             float   margin,
+                             float * scores,
+                               int   n_threads);
+
+    // Run the encoder and the decoder once on silence, so that the first real request does not pay for
+    // backend kernel compilation, first-touch page faults on memory-mapped weights and buffer setup.
+    // The encoder and decoder results of the state are discarded and its timings are reset.
+    // Call it from a background thread right after whisper_init_state() - it takes about one encoder pass.
+    // Returns 0 on success
+    WHISPER_API int whisper_warmup(
+            struct whisper_context * ctx,
+                               int   n_threads);
+
+    WHISPER_API int whisper_warmup_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   n_threads);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -395,6 +731,9 @@ extern "C" {
     WHISPER_API int whisper_n_audio_ctx     (struct whisper_context * ctx);
     WHISPER_API int whisper_is_multilingual (struct whisper_context * ctx);
 
+    // thread count picked with whisper_context_params.autotune_cache, else min(4, hardware threads)
+    WHISPER_API int whisper_autotune_n_threads(struct whisper_context * ctx);
+
     WHISPER_API int whisper_model_n_vocab      (struct whisper_context * ctx);
     WHISPER_API int whisper_model_n_audio_ctx  (struct whisper_context * ctx);
     WHISPER_API int whisper_model_n_audio_state(struct whisper_context * ctx);
@@ -446,6 +785,57 @@ extern "C" {
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
+    // Counters and latency histograms of a state, for exporting to a metrics system.
+    // Bucket i of a histogram counts samples in [2^i, 2^(i+1)) us; bucket 0 also
+    // takes anything shorter and the last bucket anything longer.
+    #define WHISPER_METRICS_N_BUCKETS 24
+
+    struct whisper_histogram {
+        int64_t count;
+        int64_t sum_us;
+        int64_t max_us;
+        int64_t buckets[WHISPER_METRICS_N_BUCKETS];
+    };
+
+    struct whisper_metrics {
+        int64_t t_mel_us;
+        int64_t t_sample_us;
+        int64_t t_encode_us;
+        int64_t t_decode_us;
+        int64_t t_batchd_us;
+        int64_t t_prompt_us;
+        int64_t t_vad_us;
+
+        int32_t n_sample;        // tokens sampled
+        int32_t n_encode;        // encoder calls
+        int32_t n_decode;        // decoder calls with one token
+        int32_t n_batchd;        // tokens decoded in small batches
+        int32_t n_prompt;        // prompt tokens
+        int32_t n_fail_p;        // logprob threshold fallbacks
+        int32_t n_fail_h;        // entropy threshold fallbacks
+
+        int32_t n_splits_encode; // backend splits of the last encoder graph
+        int32_t n_splits_decode; // backend splits of the last decoder graph
+
+        struct whisper_histogram encode; // per encoder call (conv + encoder + cross)
+        struct whisper_histogram decode; // per decoder call
+        struct whisper_histogram token;  // per decoded token (call time / tokens in the call)
+        struct whisper_histogram alloc;  // per compute graph allocation
+    };
+
+    WHISPER_API struct whisper_metrics whisper_get_metrics_from_state(struct whisper_state * state);
+    WHISPER_API struct whisper_metrics whisper_get_metrics          (struct whisper_context * ctx);
+
+    WHISPER_API void whisper_reset_metrics_from_state(struct whisper_state * state);
+
+    // Chrome trace JSON (chrome://tracing, ui.perfetto.dev) with spans for the whisper stages
+    // (mel, conv, encoder, cross, decode, sample, vad) and for every graph node each CPU worker
+    // thread computes. Process-wide; while stopped a span costs one relaxed atomic load.
+    // Stop only when no whisper call is running. Returns false if tracing was not started or the
+    // file could not be written.
+    WHISPER_API void whisper_trace_start(void);
+    WHISPER_API bool whisper_trace_stop(const char * path_json);
+
     // Print system information
     WHISPER_API const char * whisper_print_system_info(void);
 
@@ -462,6 +852,15 @@ extern "C" {
     // Use the whisper_full_...() functions to obtain the text segments
     typedef void (*whisper_new_segment_callback)(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data);
 
+    // Tentative token callback
+    // Called after every decoding step with the token just sampled by the best decoder of the window, before the
+    // segment is finalized. i_token is its index in the window: 0 starts a new window, or the same window again
+    // after a temperature fallback, so the tokens received since the last i_token == 0 are to be discarded.
+    // stable is true when all the decoders agree on the tokens of the window up to this one (always with one decoder)
+    // token->t0 and token->t1 are the times of the last timestamp token before and at this token (in 10 ms units),
+    // or the start of the window if there is none
+    typedef void (*whisper_new_token_callback)(struct whisper_context * ctx, struct whisper_state * state, const whisper_token_data * token, int i_token, bool stable, void * user_data);
+
     // Progress callback
     typedef void (*whisper_progress_callback)(struct whisper_context * ctx, struct whisper_state * state, int progress, void * user_data);
 
@@ -470,6 +869,12 @@ extern "C" {
     // If it returns false, the computation is aborted
     typedef bool (*whisper_encoder_begin_callback)(struct whisper_context * ctx, struct whisper_state * state, void * user_data);
 
+    // Encoder window callback
+    // If not NULL, called before the encoder runs on the window at mel offset `offset` with audio context `audio_ctx`
+    // With encoder_cache set in the context params, encoding that window here (e.g. with whisper_encode_batch()
+    // together with other states) lets whisper_full_with_state() skip its own encoder pass
+    typedef void (*whisper_encoder_window_callback)(struct whisper_context * ctx, struct whisper_state * state, int offset, int audio_ctx, void * user_data);
+
     // Logits filter callback
     // Can be used to modify the logits before sampling
     // If not NULL, called after applying temperature to logits
@@ -487,13 +892,26 @@ extern "C" {
     struct whisper_full_params {
         enum whisper_sampling_strategy strategy;
 
-        int n_threads;
+        int n_threads;          // <= 0: whisper_autotune_n_threads()
         int n_max_text_ctx;     // max tokens to use from past text as prompt for the decoder
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
 
+        // chunked long-form mode of whisper_full() / whisper_full_parallel() (default: 0 - sequential 30 s windows)
+        // the audio is cut into chunks of chunk_ms that overlap by 2*chunk_stride_ms (0: chunk_ms/6), the chunks are
+        // transcribed independently (on n_processors states) and a segment is kept from the chunk whose part without
+        // the strides contains its midpoint; meant for distilled models with a shallow decoder
+        int chunk_ms;
+        int chunk_stride_ms;
+
+        // whisper_full_parallel() without chunk_ms or VAD (default: 4000, 0 - hard cuts at even splits)
+        // each cut between the n_processors slices goes to the quietest 100 ms within parallel_overlap_ms of the even
+        // split, the slices reach parallel_overlap_ms past it and are joined where their tokens agree
+        int parallel_overlap_ms;
+
         bool translate;
         bool no_context;        // do not use past transcription (if any) as initial prompt for the decoder
+        bool resume;            // continue from the seek position, results and prompt history of the state (whisper_state_set_data())
         bool no_timestamps;     // do not generate timestamps
         bool single_segment;    // force single segment output (useful for streaming)
         bool print_special;     // print special tokens (e.g. <SOT>, <EOT>, <BEG>, etc.)
@@ -513,6 +931,8 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_auto;    // when audio_ctx is 0, shrink it to the audio left in the window (in 256-frame buckets)
+        bool encode_ahead;      // encode the next window on a second state while the current one decodes (pays off when the encoder runs on a GPU)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -533,6 +953,11 @@ extern "C" {
         const char * language;
         bool detect_language;
 
+        // [EXPERIMENTAL] fast language identification
+        int   lid_audio_ctx; // audio context of the detection (e.g. 256 = the first ~5 s), 0 = the whole window
+        float lid_thold;     // with lid_audio_ctx, detect again on the whole window below this probability
+        bool  lid_cache;     // keep the language of the state's last detection if its probability is >= lid_thold
+
         // common decoding parameters:
         bool suppress_blank; // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L89
         bool suppress_nst;   // non-speech tokens, ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
@@ -547,6 +972,9 @@ extern "C" {
         float entropy_thold;    // similar to OpenAI's "compression_ratio_threshold"
         float logprob_thold;
         float no_speech_thold;
+        float no_speech_skip_thold; // skip the decoding of a window whose no_speech_prob after the prompt is above this (0.0f = off)
+        int   repeat_thold;         // fail a decoder as soon as its last text tokens repeat one phrase of up to 32 tokens 3 times
+                                    // and at least this many tokens, then fall back to the next temperature (0 = off)
 
         struct {
             int best_of;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L264
@@ -555,13 +983,17 @@ extern "C" {
         struct {
             int beam_size;  // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L265
 
-            float patience; // TODO: not implemented, ref: https://arxiv.org/pdf/2204.05424.pdf
+            float patience; // stop once round(beam_size*patience) beams have finished (<= 0: wait for all), ref: https://arxiv.org/pdf/2204.05424.pdf
         } beam_search;
 
         // called for every newly generated text segment
         whisper_new_segment_callback new_segment_callback;
         void * new_segment_callback_user_data;
 
+        // called for every token sampled while a window is decoded
+        whisper_new_token_callback new_token_callback;
+        void * new_token_callback_user_data;
+
         // called on each progress update
         whisper_progress_callback progress_callback;
         void * progress_callback_user_data;
@@ -570,6 +1002,10 @@ extern "C" {
         whisper_encoder_begin_callback encoder_begin_callback;
         void * encoder_begin_callback_user_data;
 
+        // called before the encoder runs on each window
+        whisper_encoder_window_callback encoder_window_callback;
+        void * encoder_window_callback_user_data;
+
         // called each time before ggml computation starts
         ggml_abort_callback abort_callback;
         void * abort_callback_user_data;
@@ -588,6 +1024,15 @@ extern "C" {
         const char * vad_model_path;              // Path to VAD model
 
         whisper_vad_params vad_params;
+
+        // [EXPERIMENTAL] speculative decoding for greedy sampling at temperature 0
+        // a smaller model with the same vocabulary proposes n_draft tokens, the main model verifies them in one decode
+        struct whisper_context * draft_ctx; // nullptr = disabled; not thread safe for the same draft context
+        int                      n_draft;
+
+        // without draft_ctx: propose up to n_draft tokens that followed the last n_lookup tokens earlier in the
+        // prompt or the current segment (prompt lookup), no second model needed; 0 = disabled
+        int                      n_lookup;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()
@@ -616,8 +1061,10 @@ extern "C" {
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // The chunks overlap and are merged by token alignment (params.parallel_overlap_ms), are cut at silences (VAD)
+    // or overlap by strides (params.chunk_ms); with parallel_overlap_ms = 0 they are cut at arbitrary samples and
+    // the accuracy can be worse at the beginning and end of each chunk.
+    // The worker states stay on the context for the next call and are freed by whisper_free().
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -625,6 +1072,30 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    // Transcribe the audio and translate it to English with one encoder pass per window
+    // The transcription goes to the default state (to state with whisper_full_dual_with_state()), the translation
+    // to state_translate, a state of the same context; read them with the whisper_full_get_*_from_state() functions.
+    // Both tasks see the same windows: state_translate takes the cross-attention KV cache of each window from the
+    // transcribing state and decodes on a thread of its own at the same time (params.n_threads each). A window then
+    // advances by the shorter of the two results; the segments of the other task past that point are decoded again
+    // with the next window. params.translate is ignored, VAD is not applied (as in whisper_full_with_state()) and the
+    // callbacks of params are called for the transcription only
+    // Returns 0 on success, else the error of the task that failed
+    WHISPER_API int whisper_full_dual(
+                struct whisper_context * ctx,
+                  struct whisper_state * state_translate,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples);
+
+    WHISPER_API int whisper_full_dual_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+                  struct whisper_state * state_translate,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
@@ -636,6 +1107,10 @@ extern "C" {
     // Language id associated with the provided state
     WHISPER_API int whisper_full_lang_id_from_state(struct whisper_state * state);
 
+    // Probability of the language detected by whisper_full() with language = "auto", 0.0f if it was given
+    WHISPER_API float whisper_full_lang_prob           (struct whisper_context * ctx);
+    WHISPER_API float whisper_full_lang_prob_from_state(struct whisper_state * state);
+
     // Get the start and end time of the specified segment
     WHISPER_API int64_t whisper_full_get_segment_t0           (struct whisper_context * ctx, int i_segment);
     WHISPER_API int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment);
@@ -671,6 +1146,39 @@ extern "C" {
     WHISPER_API float whisper_full_get_token_p           (struct whisper_context * ctx, int i_segment, int i_token);
     WHISPER_API float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token);
 
+    // A segment of whisper_results
+    typedef struct whisper_result_segment {
+        int64_t t0;
+        int64_t t1;
+        int32_t text;              // offset of the NUL-terminated text in whisper_results.text
+        int32_t text_len;
+        int32_t i_token;           // first token in whisper_results.tokens
+        int32_t n_tokens;
+        float   no_speech_prob;
+        bool    speaker_turn_next;
+    } whisper_result_segment;
+
+    // All the results of the last whisper_full*() call, flattened
+    typedef struct whisper_results {
+        int32_t n_segments;
+        int32_t n_tokens;
+        int32_t n_text;                            // bytes in text
+
+        const whisper_result_segment * segments;
+        const whisper_token_data     * tokens;     // of every segment, in order
+        const int32_t                * token_text; // per token: offset of its NUL-terminated text in text
+        const char                   * text;       // segment texts, then each distinct token text once
+
+        int32_t lang_id;
+        float   lang_prob;
+    } whisper_results;
+
+    // Get every segment, token and text in one call, instead of a call per segment and per token (costly across
+    // the FFI of the bindings). The arrays are built in the state and stay valid until its next
+    // whisper_full_get_results*() call or whisper_free_state(). Returns the number of segments
+    WHISPER_API int whisper_full_get_results           (struct whisper_context * ctx, struct whisper_results * results);
+    WHISPER_API int whisper_full_get_results_from_state(struct whisper_context * ctx, struct whisper_state * state, struct whisper_results * results);
+
     //
     // Voice Activity Detection (VAD)
     //
@@ -698,6 +1206,32 @@ extern "C" {
     WHISPER_API int     whisper_vad_n_probs(struct whisper_vad_context * vctx);
     WHISPER_API float * whisper_vad_probs  (struct whisper_vad_context * vctx);
 
+    // Streaming VAD
+    // Push audio as it arrives. Samples are buffered until a full window is
+    // available and the LSTM state carries over between calls, so each call
+    // only costs the new audio. Returns the number of windows completed by
+    // this call (their probabilities are whisper_vad_probs()), or -1 on error.
+    // Speech start/end events found by the call are available through
+    // whisper_vad_n_events(); params.threshold and params.min_silence_duration_ms
+    // control them. whisper_vad_detect_speech() resets the stream.
+    enum whisper_vad_event_type {
+        WHISPER_VAD_EVENT_SPEECH_START = 0,
+        WHISPER_VAD_EVENT_SPEECH_END   = 1,
+    };
+
+    WHISPER_API void whisper_vad_reset(struct whisper_vad_context * vctx);
+
+    WHISPER_API int whisper_vad_feed(
+            struct whisper_vad_context * vctx,
+            struct whisper_vad_params    params,
+                           const float * samples,
+                                   int   n_samples);
+
+    WHISPER_API int                         whisper_vad_n_events        (struct whisper_vad_context * vctx);
+    WHISPER_API enum whisper_vad_event_type whisper_vad_get_event_type  (struct whisper_vad_context * vctx, int i_event);
+    // Position of the event in samples since the last reset
+    WHISPER_API int64_t                     whisper_vad_get_event_sample(struct whisper_vad_context * vctx, int i_event);
+
     struct whisper_vad_segments;
 
     WHISPER_API struct whisper_vad_segments * whisper_vad_segments_from_probs(
@@ -734,6 +1268,19 @@ extern "C" {
     // Get the no_speech probability for the specified segment
     WHISPER_API float whisper_full_get_segment_no_speech_prob           (struct whisper_context * ctx, int i_segment);
     WHISPER_API float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state * state, int i_segment);
+
+    // Get the number of temperature fallbacks it took to decode the window of the specified segment, one per
+    // fallback: due to the entropy threshold or a repetition loop (h), due to the logprob threshold otherwise (p)
+    WHISPER_API int whisper_full_get_segment_n_fail_p           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_get_segment_n_fail_p_from_state(struct whisper_state * state, int i_segment);
+    WHISPER_API int whisper_full_get_segment_n_fail_h           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_get_segment_n_fail_h_from_state(struct whisper_state * state, int i_segment);
+
+    // Get how sure the decoder was of the specified segment, in [0, 1]: the geometric mean of the probabilities of
+    // its text tokens, times 1 - no_speech_prob, halved for every temperature fallback its window took.
+    // Segments below ~0.5 are the ones worth decoding again, e.g. with a larger model or beam search
+    WHISPER_API float whisper_full_get_segment_confidence           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API float whisper_full_get_segment_confidence_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment);
 #ifdef __cplusplus
 }
 #endif
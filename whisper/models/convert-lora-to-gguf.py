@@ -0,0 +1,96 @@
+# Convert a PEFT LoRA adapter of a Hugging Face Whisper model to a GGUF adapter for whisper.cpp
+#
+# Usage:
+#
+#   pip install gguf safetensors torch
+#
+#   python3 ./whisper.cpp/models/convert-lora-to-gguf.py ./my-lora/ ./ggml-my-lora.gguf
+#
+# ./my-lora/ holds adapter_config.json and adapter_model.safetensors (or adapter_model.bin), as saved by
+# peft for WhisperForConditionalGeneration. The adapter is applied with whisper-cli --lora or
+# whisper_adapter_lora_init() on a context of the base model it was trained on.
+#
+
+import sys
+import json
+import torch
+import numpy as np
+from pathlib import Path
+
+import gguf
+
+conv_map = {
+        'self_attn.k_proj'              : 'attn.key',
+        'self_attn.q_proj'              : 'attn.query',
+        'self_attn.v_proj'              : 'attn.value',
+        'self_attn.out_proj'            : 'attn.out',
+        'encoder_attn.q_proj'           : 'cross_attn.query',
+        'encoder_attn.v_proj'           : 'cross_attn.value',
+        'encoder_attn.out_proj'         : 'cross_attn.out',
+        'fc1'                           : 'mlp.0',
+        'fc2'                           : 'mlp.2',
+        }
+
+# base_model.model.model.encoder.layers.3.self_attn.q_proj.lora_A.weight -> (encoder.blocks.3.attn.query.weight, a)
+def map_name(src):
+    nn = src.split(".")
+    i = nn.index("layers") - 1 # encoder or decoder
+
+    system, layer, module, ab = nn[i], nn[i + 2], ".".join(nn[i + 3:-2]), nn[-2]
+    if ab not in ("lora_A", "lora_B"):
+        raise ValueError(f"unexpected tensor {src}")
+
+    if module == "encoder_attn.k_proj":
+        mapped = "cross_attn.key"
+    elif module in conv_map:
+        mapped = conv_map[module]
+    else:
+        raise ValueError(f"cannot adapt {module} ({src})")
+
+    return f"{system}.blocks.{layer}.{mapped}.weight", "a" if ab == "lora_A" else "b"
+
+if len(sys.argv) < 3:
+    print("Usage: convert-lora-to-gguf.py dir_adapter file_out [f32|f16]\n")
+    sys.exit(1)
+
+dir_adapter = Path(sys.argv[1])
+fname_out   = Path(sys.argv[2])
+use_f16     = len(sys.argv) < 4 or sys.argv[3] != "f32"
+
+with open(dir_adapter / "adapter_config.json", "r", encoding="utf8") as f:
+    config = json.load(f)
+
+if config.get("peft_type", "LORA") != "LORA":
+    raise ValueError(f"not a LoRA adapter: {config.get('peft_type')}")
+if config.get("rank_pattern") or config.get("alpha_pattern"):
+    print("warning: rank_pattern/alpha_pattern are not supported, every weight is scaled by lora_alpha/r")
+
+if (dir_adapter / "adapter_model.safetensors").exists():
+    from safetensors.torch import load_file
+    list_vars = load_file(dir_adapter / "adapter_model.safetensors")
+else:
+    list_vars = torch.load(dir_adapter / "adapter_model.bin", map_location="cpu")
+
+writer = gguf.GGUFWriter(fname_out, "whisper")
+writer.add_string("general.type", "adapter")
+writer.add_string("adapter.type", "lora")
+writer.add_float32("adapter.lora.alpha", float(config["lora_alpha"]))
+
+for src in sorted(list_vars.keys()):
+    name, ab = map_name(src)
+
+    # lora_A is [rank, n_in] and lora_B [n_out, rank]: in ggml order A = [n_in, rank], B = [rank, n_out]
+    data = list_vars[src].float().numpy()
+    data = data.astype(np.float16 if use_f16 else np.float32)
+
+    print(src, ' -> ', name + ".lora_" + ab, data.shape)
+
+    writer.add_tensor(name + ".lora_" + ab, data)
+
+writer.write_header_to_file()
+writer.write_kv_data_to_file()
+writer.write_tensors_to_file()
+writer.close()
+
+print("Done. Output file: ", fname_out)
+print("")
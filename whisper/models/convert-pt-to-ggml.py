@@ -191,7 +191,7 @@ def bytes_to_unicode():
 
 
 if len(sys.argv) < 4:
-    print("Usage: convert-pt-to-ggml.py model.pt path-to-whisper-repo dir-output [use-f32]\n")
+    print("Usage: convert-pt-to-ggml.py model.pt path-to-whisper-repo dir-output [use-f32 | bf16]\n")
     sys.exit(1)
 
 fname_inp   = Path(sys.argv[1])
@@ -258,10 +258,16 @@ elif tokenizer_type == "hf_transformers":
 fname_out = dir_out / "ggml-model.bin"
 
 # use 16-bit or 32-bit floats
-use_f16 = True
+# with "bf16", the matrices are stored in bfloat16 (the conv kernels stay in float16)
+use_f16  = True
+use_bf16 = False
 if len(sys.argv) > 4:
-    use_f16 = False
-    fname_out = dir_out / "ggml-model-f32.bin"
+    if sys.argv[4] == "bf16":
+        use_bf16 = True
+        fname_out = dir_out / "ggml-model-bf16.bin"
+    else:
+        use_f16 = False
+        fname_out = dir_out / "ggml-model-f32.bin"
 
 fout = fname_out.open("wb")
 
@@ -276,7 +282,7 @@ fout.write(struct.pack("i", hparams["n_text_state"]))
 fout.write(struct.pack("i", hparams["n_text_head"]))
 fout.write(struct.pack("i", hparams["n_text_layer"]))
 fout.write(struct.pack("i", hparams["n_mels"]))
-fout.write(struct.pack("i", use_f16))
+fout.write(struct.pack("i", 24 if use_bf16 else use_f16)) # GGML_FTYPE_MOSTLY_BF16 = 24
 
 # write mel filters
 fout.write(struct.pack("i", filters.shape[0]))
@@ -316,6 +322,10 @@ for name in list_vars.keys():
             print("  Converting to float32")
             data = data.astype(np.float32)
             ftype = 0
+        elif use_bf16 and n_dims == 2:
+            print("  Converting to bfloat16")
+            data = list_vars[name].squeeze().to(torch.bfloat16).view(torch.int16).numpy()
+            ftype = 30 # GGML_TYPE_BF16
     else:
         data = data.astype(np.float32)
         ftype = 0
@@ -1,4 +1,5 @@
 import argparse
+import copy
 import torch
 import torch.nn.functional as F
 import coremltools as ct
@@ -245,10 +246,18 @@ class WhisperANE(Whisper):
         self.decoder.apply(install_hooks)
         return cache, hooks
 
-def convert_encoder(hparams, model, quantize=False):
+def encoder_for_audio_ctx(encoder, n_ctx):
+    # the same weights with the positional embedding cut to n_ctx, for 2*n_ctx mel frames
+    encoder = copy.deepcopy(encoder)
+    encoder.positional_embedding = encoder.positional_embedding[:n_ctx].clone()
+    return encoder
+
+def convert_encoder(hparams, model, quantize=False, n_ctx=None):
     model.eval()
 
-    input_shape = (1, hparams.n_mels, 3000)
+    n_ctx = n_ctx or hparams.n_audio_ctx
+
+    input_shape = (1, hparams.n_mels, 2*n_ctx)
     input_data = torch.randn(input_shape)
     traced_model = torch.jit.trace(model, input_data)
 
@@ -297,6 +306,7 @@ if __name__ == "__main__":
     parser.add_argument("--encoder-only", type=bool, help="only convert encoder", default=False)
     parser.add_argument("--quantize",     type=bool, help="quantize weights to F16", default=False)
     parser.add_argument("--optimize-ane", type=bool, help="optimize for ANE execution (currently broken)", default=False)
+    parser.add_argument("--audio-ctx",    type=str,  help="also convert encoders for these audio contexts, for short audio (e.g. 256,512,768)", default="")
     args = parser.parse_args()
 
     if args.model not in ["tiny", "tiny.en", "base", "base.en", "small", "small.en", "small.en-tdrz", "medium", "medium.en", "large-v1", "large-v2", "large-v3", "large-v3-turbo"]:
@@ -316,6 +326,14 @@ if __name__ == "__main__":
         encoder = whisper.encoder
         decoder = whisper.decoder
 
+    # Encoders for shorter audio contexts, picked by whisper.cpp when the audio fits
+    for n_ctx in [int(n) for n in args.audio_ctx.split(",") if n]:
+        if n_ctx <= 0 or n_ctx >= hparams.n_audio_ctx or n_ctx % 256 != 0:
+            raise ValueError(f"Invalid audio context {n_ctx}: must be a multiple of 256 below {hparams.n_audio_ctx}")
+
+        encoder_ctx = convert_encoder(hparams, encoder_for_audio_ctx(encoder, n_ctx), quantize=args.quantize, n_ctx=n_ctx)
+        encoder_ctx.save(f"models/coreml-encoder-{args.model}-{n_ctx}.mlpackage")
+
     # Convert encoder
     encoder = convert_encoder(hparams, encoder, quantize=args.quantize)
     encoder.save(f"models/coreml-encoder-{args.model}.mlpackage")
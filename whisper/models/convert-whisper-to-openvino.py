@@ -1,4 +1,5 @@
 import argparse
+import copy
 import torch
 from whisper import load_model
 import os
@@ -7,10 +8,19 @@ from openvino.frontend import FrontEndManager
 from openvino.runtime import serialize
 import shutil
 
-def convert_encoder(hparams, encoder, mname):
+def convert_encoder(hparams, encoder, mname, n_ctx=None):
     encoder.eval()
 
-    mel = torch.zeros((1, hparams.n_mels, 3000))
+    suffix = ""
+    if n_ctx:
+        # the same weights with the positional embedding cut to n_ctx, for 2*n_ctx mel frames
+        encoder = copy.deepcopy(encoder)
+        encoder.positional_embedding = encoder.positional_embedding[:n_ctx].clone()
+        suffix = f"-{n_ctx}"
+    else:
+        n_ctx = hparams.n_audio_ctx
+
+    mel = torch.zeros((1, hparams.n_mels, 2*n_ctx))
 
     onnx_folder = os.path.join(os.path.dirname(__file__), "onnx_encoder")
 
@@ -36,7 +46,7 @@ def convert_encoder(hparams, encoder, mname):
     ov_model = onnx_fe.convert(onnx_model)
 
     # Serialize the OpenVINO model to XML and BIN files
-    serialize(ov_model, xml_path=os.path.join(os.path.dirname(__file__), "ggml-" + mname + "-encoder-openvino.xml"))
+    serialize(ov_model, xml_path=os.path.join(os.path.dirname(__file__), "ggml-" + mname + "-encoder-openvino" + suffix + ".xml"))
 
     # Cleanup
     if os.path.isdir(onnx_folder):
@@ -46,6 +56,7 @@ def convert_encoder(hparams, encoder, mname):
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("--model", type=str, help="model to convert (e.g. tiny, tiny.en, base, base.en, small, small.en, medium, medium.en, large-v1, large-v2, large-v3, large-v3-turbo)", required=True)
+    parser.add_argument("--audio-ctx", type=str, help="also convert encoders for these audio contexts, for short audio (e.g. 256,512,768)", default="")
     args = parser.parse_args()
 
     if args.model not in ["tiny", "tiny.en", "base", "base.en", "small", "small.en", "medium", "medium.en", "large-v1", "large-v2", "large-v3", "large-v3-turbo"]:
@@ -58,3 +69,10 @@ if __name__ == "__main__":
 
     # Convert encoder to onnx
     convert_encoder(hparams, encoder, args.model)
+
+    # Encoders for shorter audio contexts, picked by whisper.cpp when the audio fits
+    for n_ctx in [int(n) for n in args.audio_ctx.split(",") if n]:
+        if n_ctx <= 0 or n_ctx >= hparams.n_audio_ctx or n_ctx % 256 != 0:
+            raise ValueError(f"Invalid audio context {n_ctx}: must be a multiple of 256 below {hparams.n_audio_ctx}")
+
+        convert_encoder(hparams, encoder, args.model, n_ctx)
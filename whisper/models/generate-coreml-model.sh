@@ -2,10 +2,13 @@
 
 set -e
 
-# Usage: ./generate-coreml-model.sh <model-name>
+# Usage: ./generate-coreml-model.sh <model-name> [audio-ctx,...]
+#
+# The optional list of audio contexts (multiples of 256 below the model's, e.g. 256,512,768) adds encoders
+# compiled for short audio, which whisper.cpp picks when the audio fits: ggml-<model-name>-encoder-<n>.mlmodelc
 if [ $# -eq 0 ]; then
   echo "No model name supplied"
-  echo "Usage for Whisper models: ./generate-coreml-model.sh <model-name>"
+  echo "Usage for Whisper models: ./generate-coreml-model.sh <model-name> [audio-ctx,...]"
   echo "Usage for HuggingFace models: ./generate-coreml-model.sh -h5 <model-name> <model-path>"
   exit 1
 elif [ "$1" = "-h5" ] && [ $# != 3 ]; then
@@ -15,6 +18,7 @@ elif [ "$1" = "-h5" ] && [ $# != 3 ]; then
 fi
 
 mname="$1"
+actx="$2"
 
 wd=$(dirname "$0")
 cd "$wd/../" || exit
@@ -22,16 +26,24 @@ cd "$wd/../" || exit
 if [ "$mname" = "-h5" ]; then
   mname="$2"
   mpath="$3"
+  actx=""
   echo "$mpath"
   python3 models/convert-h5-to-coreml.py --model-name "$mname" --model-path "$mpath" --encoder-only True
 else
-  python3 models/convert-whisper-to-coreml.py --model "$mname" --encoder-only True --optimize-ane True
+  python3 models/convert-whisper-to-coreml.py --model "$mname" --encoder-only True --optimize-ane True --audio-ctx "$actx"
+  actx=$(echo "$actx" | tr ',' ' ')
 fi
 
 xcrun coremlc compile models/coreml-encoder-"${mname}".mlpackage models/
 rm -rf models/ggml-"${mname}"-encoder.mlmodelc
 mv -v models/coreml-encoder-"${mname}".mlmodelc models/ggml-"${mname}"-encoder.mlmodelc
 
+for n in $actx; do
+  xcrun coremlc compile models/coreml-encoder-"${mname}"-"${n}".mlpackage models/
+  rm -rf models/ggml-"${mname}"-encoder-"${n}".mlmodelc
+  mv -v models/coreml-encoder-"${mname}"-"${n}".mlmodelc models/ggml-"${mname}"-encoder-"${n}".mlmodelc
+done
+
 # TODO: decoder (sometime in the future maybe)
 #xcrun coremlc compile models/whisper-decoder-${mname}.mlpackage models/
 #rm -rf models/ggml-${mname}-decoder.mlmodelc
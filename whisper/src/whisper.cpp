@@ -5,6 +5,8 @@
 #include "ggml-cpp.h"
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "gguf.h"
 
 #ifdef WHISPER_USE_COREML
 #include "coreml/whisper-encoder.h"
@@ -16,6 +18,7 @@
 
 #include <atomic>
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cfloat>
 #define _USE_MATH_DEFINES
@@ -24,20 +27,51 @@
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <condition_variable>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <random>
 #include <regex>
 #include <set>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 #ifdef _MSC_VER
 #include <codecvt>
 #endif
 
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#define WHISPER_MMAP_SUPPORTED
+#elif defined(__has_include)
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define WHISPER_MMAP_SUPPORTED
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
 #if defined(WHISPER_BIG_ENDIAN)
 template<typename T>
 static T byteswap(T value) {
@@ -161,37 +195,628 @@ static std::string format(const char * fmt, ...) {
     return std::string(buf.data(), size);
 }
 
+//
+// tracing
+//
+
+struct whisper_trace_event {
+    const char * cat;                // "whisper" or "ggml"
+    const char * op;                 // ggml op of a node span
+    char         name[GGML_MAX_NAME];
+    int64_t      t_start_us;
+    int64_t      t_end_us;
+};
+
+// events of one thread; the lock is only ever contended by whisper_trace_stop()
+struct whisper_trace_buffer {
+    int tid = 0;
+    std::mutex mutex;
+    std::vector<whisper_trace_event> events;
+};
+
+static struct {
+    std::atomic<bool> enabled{false};
+    int64_t t_start_us = 0;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<whisper_trace_buffer>> buffers;
+} g_trace;
+
+static whisper_trace_buffer & whisper_trace_thread_buffer() {
+    thread_local whisper_trace_buffer * buf = nullptr;
+    if (!buf) {
+        std::lock_guard<std::mutex> lock(g_trace.mutex);
+        g_trace.buffers.emplace_back(new whisper_trace_buffer);
+        buf = g_trace.buffers.back().get();
+        buf->tid = (int) g_trace.buffers.size();
+    }
+    return *buf;
+}
+
+static void whisper_trace_record(const char * cat, const char * op, const char * name, int64_t t_start_us, int64_t t_end_us) {
+    whisper_trace_event ev;
+    ev.cat        = cat;
+    ev.op         = op;
+    ev.t_start_us = t_start_us;
+    ev.t_end_us   = t_end_us;
+    snprintf(ev.name, sizeof(ev.name), "%s", name);
+
+    auto & buf = whisper_trace_thread_buffer();
+    std::lock_guard<std::mutex> lock(buf.mutex);
+    buf.events.push_back(ev);
+}
+
+// span for a stage that was timed anyway
+static void whisper_trace_add(const char * name, int64_t t_start_us) {
+    if (g_trace.enabled.load(std::memory_order_relaxed)) {
+        whisper_trace_record("whisper", nullptr, name, t_start_us, ggml_time_us());
+    }
+}
+
+struct whisper_trace_scope {
+    const char * name;
+    int64_t t_start_us;
+
+    explicit whisper_trace_scope(const char * name) : name(name), t_start_us(0) {
+        if (g_trace.enabled.load(std::memory_order_relaxed)) {
+            t_start_us = ggml_time_us();
+        } else {
+            this->name = nullptr;
+        }
+    }
+
+    ~whisper_trace_scope() {
+        if (name) {
+            whisper_trace_record("whisper", nullptr, name, t_start_us, ggml_time_us());
+        }
+    }
+};
+
+static void whisper_trace_ggml_node(const struct ggml_tensor * node, int /*ith*/, int64_t t_start_us, int64_t t_end_us, void * /*user_data*/) {
+    whisper_trace_record("ggml", ggml_op_desc(node), node->name, t_start_us, t_end_us);
+}
+
+static void whisper_trace_set_cpu_callback(ggml_cpu_trace_callback callback) {
+    ggml_backend_reg_t reg = ggml_backend_reg_by_name("CPU");
+    if (!reg) {
+        return;
+    }
+    auto * fn = (decltype(ggml_cpu_set_trace_callback) *) ggml_backend_reg_get_proc_address(reg, "ggml_cpu_set_trace_callback");
+    if (fn) {
+        fn(callback, nullptr);
+    }
+}
+
+// false without a CPU backend that reports them
+static bool whisper_cpu_barrier_stats(ggml_cpu_barrier_stats & stats) {
+    ggml_backend_reg_t reg = ggml_backend_reg_by_name("CPU");
+    if (!reg) {
+        return false;
+    }
+    auto * fn = (decltype(ggml_cpu_get_barrier_stats) *) ggml_backend_reg_get_proc_address(reg, "ggml_cpu_get_barrier_stats");
+    if (!fn) {
+        return false;
+    }
+    fn(&stats);
+    return true;
+}
+
+void whisper_trace_start(void) {
+    if (g_trace.enabled.load()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_trace.mutex);
+        for (auto & buf : g_trace.buffers) {
+            std::lock_guard<std::mutex> lock_buf(buf->mutex);
+            buf->events.clear();
+        }
+        g_trace.t_start_us = ggml_time_us();
+    }
+    whisper_trace_set_cpu_callback(whisper_trace_ggml_node);
+    g_trace.enabled.store(true);
+}
+
+static void whisper_trace_write_str(std::ofstream & fout, const char * str) {
+    fout << '"';
+    for (const char * c = str; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fout << '\\' << *c;
+        } else if ((unsigned char) *c >= 0x20) {
+            fout << *c;
+        }
+    }
+    fout << '"';
+}
+
+bool whisper_trace_stop(const char * path_json) {
+    if (!g_trace.enabled.exchange(false)) {
+        return false;
+    }
+    whisper_trace_set_cpu_callback(nullptr);
+
+    std::ofstream fout(path_json);
+    if (!fout) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s' for writing\n", __func__, path_json);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(g_trace.mutex);
+
+    fout << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for (auto & buf : g_trace.buffers) {
+        std::lock_guard<std::mutex> lock_buf(buf->mutex);
+        if (buf->events.empty()) {
+            continue;
+        }
+        fout << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buf->tid
+             << ",\"args\":{\"name\":\"thread " << buf->tid << "\"}}";
+        first = false;
+        for (const auto & ev : buf->events) {
+            fout << ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":" << buf->tid << ",\"cat\":\"" << ev.cat << "\",\"name\":";
+            whisper_trace_write_str(fout, ev.op ? ev.op : ev.name);
+            fout << ",\"ts\":" << ev.t_start_us - g_trace.t_start_us << ",\"dur\":" << ev.t_end_us - ev.t_start_us;
+            if (ev.op) {
+                fout << ",\"args\":{\"tensor\":";
+                whisper_trace_write_str(fout, ev.name);
+                fout << "}";
+            }
+            fout << "}";
+        }
+        buf->events.clear();
+    }
+    fout << "\n]}\n";
+
+    return fout.good();
+}
+
 //
 // ggml helpers
 //
 
-static bool ggml_graph_compute_helper(
-          struct ggml_cgraph * graph,
-                         int   n_threads,
-         ggml_abort_callback   abort_callback,
-                        void * abort_callback_data) {
-    ggml_backend_ptr backend { ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr) };
+typedef ggml_threadpool_t (*ggml_threadpool_new_t)(struct ggml_threadpool_params * params);
+typedef void (*ggml_threadpool_free_t)(ggml_threadpool_t threadpool);
+typedef void (*ggml_backend_cpu_set_threadpool_t)(ggml_backend_t backend_cpu, ggml_threadpool_t threadpool);
+
+// CPU worker threads kept alive across graphs, instead of threads started and joined for every graph
+// between graphs the workers poll for new work for a while (poll: 0 - 100, see ggml_threadpool_params)
+// and then sleep
+struct whisper_threadpool {
+    ggml_threadpool_t tp = nullptr;
+
+    int      n_threads = 0;
+    uint32_t poll      = 50;
+    bool     affinity  = true; // place the workers from the host topology, see whisper_cpu_affinity()
+    bool     external  = false; // tp belongs to the application (whisper_context_params.threadpool)
+
+    std::vector<int> cpus; // the CPUs the workers are placed on, see whisper_cpu_sched_place()
+
+    ggml_threadpool_free_t fn_free = nullptr;
+};
+
+static void whisper_cpu_sched_hold(const std::vector<int> & cpus, int delta);
+
+static void whisper_threadpool_free(whisper_threadpool & threadpool) {
+    if (threadpool.external) {
+        threadpool.tp = nullptr;
+        return;
+    }
+
+    if (threadpool.tp) {
+        threadpool.fn_free(threadpool.tp);
+        threadpool.tp = nullptr;
+    }
+
+    whisper_cpu_sched_hold(threadpool.cpus, -1);
+    threadpool.cpus.clear();
+}
+
+#if defined(__linux__)
+// parse a sysfs cpu list such as "0-3,8,10-11"
+static std::vector<int> whisper_parse_cpu_list(const std::string & path) {
+    std::vector<int> res;
+
+    std::ifstream fin(path);
+    std::string list;
+    if (!std::getline(fin, list)) {
+        return res;
+    }
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+
+        const std::string item = list.substr(pos, end - pos);
+        const size_t dash = item.find('-');
+
+        try {
+            const int a = std::stoi(item.substr(0, dash));
+            const int b = dash == std::string::npos ? a : std::stoi(item.substr(dash + 1));
+            for (int i = a; i <= b; ++i) {
+                res.push_back(i);
+            }
+        } catch (...) {
+            return {};
+        }
+
+        pos = end + 1;
+    }
+
+    return res;
+}
+
+static long whisper_read_sysfs_long(const std::string & path, long def) {
+    std::ifstream fin(path);
+    long val = def;
+    if (!(fin >> val)) {
+        return def;
+    }
+    return val;
+}
+#endif
+
+// CPUs of the process in the order the worker threads should take them, empty when all of them are alike:
+// the fastest core class first (P-cores of hybrid Intel, big cores of ARM big.LITTLE), then one NUMA node
+// before the next, then one hardware thread per physical core before the SMT siblings
+// the threads of a pool float within their first n_threads CPUs; when the pool has to spill onto the slower
+// cores, the chunked work distribution of the matrix multiplications lets the faster threads take more chunks
+static const std::vector<int> & whisper_cpu_affinity() {
+    static const std::vector<int> order = [] {
+        std::vector<int> res;
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+            return res;
+        }
+
+        struct cpu_info {
+            int  id;
+            long perf;  // core class, higher is faster
+            int  node;
+            int  smt;   // index among the hardware threads of the core
+        };
+
+        const std::string base = "/sys/devices/system/cpu/";
+
+        // hybrid Intel CPUs list their P-cores as a separate PMU
+        std::vector<int> p_cores = whisper_parse_cpu_list("/sys/devices/cpu_core/cpus");
+
+        std::vector<int> node_of(GGML_MAX_N_THREADS, 0);
+        for (int n = 0; n < 64; ++n) {
+            for (int c : whisper_parse_cpu_list("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist")) {
+                if (c >= 0 && c < GGML_MAX_N_THREADS) {
+                    node_of[c] = n;
+                }
+            }
+        }
+
+        std::vector<cpu_info> cpus;
+        long perf_max = 0;
+
+        for (int c = 0; c < GGML_MAX_N_THREADS && c < CPU_SETSIZE; ++c) {
+            if (!CPU_ISSET(c, &set)) {
+                continue;
+            }
+
+            const std::string dir = base + "cpu" + std::to_string(c) + "/";
+
+            cpu_info info = { c, 0, node_of[c], 0 };
+
+            if (!p_cores.empty()) {
+                info.perf = std::find(p_cores.begin(), p_cores.end(), c) != p_cores.end() ? 1 : 0;
+            } else {
+                info.perf = whisper_read_sysfs_long(dir + "cpu_capacity", 0);
+                if (info.perf == 0) {
+                    info.perf = whisper_read_sysfs_long(dir + "cpufreq/cpuinfo_max_freq", 0);
+                }
+            }
+            perf_max = std::max(perf_max, info.perf);
 
-    auto * reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend.get()));
+            const std::vector<int> siblings = whisper_parse_cpu_list(dir + "topology/thread_siblings_list");
+            info.smt = (int) (std::find(siblings.begin(), siblings.end(), c) - siblings.begin());
+            if (info.smt == (int) siblings.size()) {
+                info.smt = 0;
+            }
+
+            cpus.push_back(info);
+        }
+
+        // cores within ~10% of each other (e.g. turbo bins of the same core type) are one class
+        if (p_cores.empty() && perf_max > 0) {
+            for (auto & info : cpus) {
+                info.perf = (info.perf*10 + perf_max/2)/perf_max;
+            }
+        }
+
+        bool uniform = true;
+        for (const auto & info : cpus) {
+            uniform = uniform && info.perf == cpus[0].perf && info.node == cpus[0].node;
+        }
+        if (cpus.size() < 2 || uniform) {
+            return res;
+        }
+
+        std::stable_sort(cpus.begin(), cpus.end(), [](const cpu_info & a, const cpu_info & b) {
+            if (a.perf != b.perf) return a.perf > b.perf;
+            if (a.node != b.node) return a.node < b.node;
+            return a.smt < b.smt;
+        });
+
+        for (const auto & info : cpus) {
+            res.push_back(info.id);
+        }
+#endif
+        return res;
+    }();
+
+    return order;
+}
+
+// process-wide CPU scheduler: the graphs of all the states computing at the same time share a budget of threads
+// (default: the hardware threads) instead of each one running a team of n_threads threads of its own
+// a graph gets a share of the budget by the weight of its work among the states that computed within the last
+// second; the encoder scales with the threads much better than the decoding of a few tokens, so it weighs more
+// decoder graphs are short and also stay within the threads left free by the graphs running at the moment,
+// encoder graphs take their share right away and the decoders make room from their next token on
+// the worker pools are placed on the least used CPUs of whisper_cpu_affinity(), so that the pools of concurrent
+// states get disjoint cores as long as there are enough of them
+enum whisper_cpu_work {
+    WHISPER_CPU_WORK_ENCODE,
+    WHISPER_CPU_WORK_DECODE,
+};
+
+struct whisper_cpu_sched {
+    std::mutex mutex;
+
+    int n_threads = (int) std::thread::hardware_concurrency(); // 0: no limit
+
+    struct user {
+        int64_t t_last_us = 0;
+        int     weight    = 0;
+        int     n_active  = 0;
+    };
+
+    std::map<const void *, user> users; // by the pool of the state
+
+    std::vector<int> cpu_pools; // number of pools on each CPU of whisper_cpu_affinity()
+
+    // application pools shared by several states run one graph at a time
+    std::map<ggml_threadpool_t, std::unique_ptr<std::mutex>> external;
+
+    // utilization, see whisper_cpu_sched_get_stats()
+    int     n_busy           = 0;
+    int     n_busy_max       = 0;
+    int64_t n_graphs         = 0;
+    int64_t n_graphs_clamped = 0;
+    int64_t t_first_us       = 0;
+    double  t_busy_us        = 0.0; // thread-microseconds
+};
+
+static whisper_cpu_sched & whisper_cpu_sched_instance() {
+    static whisper_cpu_sched sched;
+    return sched;
+}
+
+static void whisper_cpu_sched_hold(const std::vector<int> & cpus, int delta) {
+    if (cpus.empty()) {
+        return;
+    }
+
+    auto & sched = whisper_cpu_sched_instance();
+    std::lock_guard<std::mutex> lock(sched.mutex);
+
+    const auto & order = whisper_cpu_affinity();
+    sched.cpu_pools.resize(order.size(), 0);
+
+    for (int c : cpus) {
+        const auto it = std::find(order.begin(), order.end(), c);
+        if (it != order.end()) {
+            sched.cpu_pools[it - order.begin()] += delta;
+        }
+    }
+}
+
+// the CPUs for a new pool of n_threads workers: the ones with the fewest pools, the faster ones first
+static std::vector<int> whisper_cpu_sched_place(int n_threads) {
+    const auto & order = whisper_cpu_affinity();
+
+    std::vector<int> res;
+    if (order.empty()) {
+        return res;
+    }
+
+    {
+        auto & sched = whisper_cpu_sched_instance();
+        std::lock_guard<std::mutex> lock(sched.mutex);
+
+        sched.cpu_pools.resize(order.size(), 0);
+
+        std::vector<int> idx(order.size());
+        for (size_t i = 0; i < idx.size(); ++i) {
+            idx[i] = (int) i;
+        }
+        std::stable_sort(idx.begin(), idx.end(), [&](int a, int b) {
+            return sched.cpu_pools[a] < sched.cpu_pools[b];
+        });
+
+        for (int i = 0; i < n_threads && i < (int) idx.size(); ++i) {
+            res.push_back(order[idx[i]]);
+        }
+    }
+
+    whisper_cpu_sched_hold(res, 1);
+
+    return res;
+}
+
+// the threads of one graph, from the budget of the scheduler, for as long as the lease lives
+struct whisper_cpu_lease {
+    const void * key;
+
+    int     n_threads  = 0;
+    int64_t t_start_us = 0;
+
+    std::unique_lock<std::mutex> pool_lock;
+
+    whisper_cpu_lease(const whisper_threadpool & threadpool, whisper_cpu_work work, int n_threads_req) : key(&threadpool) {
+        auto & sched = whisper_cpu_sched_instance();
+
+        if (threadpool.external && threadpool.tp) {
+            std::mutex * m = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(sched.mutex);
+                auto & ptr = sched.external[threadpool.tp];
+                if (!ptr) {
+                    ptr.reset(new std::mutex());
+                }
+                m = ptr.get();
+            }
+            pool_lock = std::unique_lock<std::mutex>(*m);
+        }
 
-    auto * set_abort_callback_fn = (ggml_backend_set_abort_callback_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_abort_callback");
-    if (set_abort_callback_fn) {
-        set_abort_callback_fn(backend.get(), abort_callback, abort_callback_data);
+        std::lock_guard<std::mutex> lock(sched.mutex);
+
+        t_start_us = ggml_time_us();
+        if (sched.t_first_us == 0) {
+            sched.t_first_us = t_start_us;
+        }
+
+        for (auto it = sched.users.begin(); it != sched.users.end(); ) {
+            if (it->second.n_active == 0 && it->second.t_last_us < t_start_us - 1000000) {
+                it = sched.users.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        auto & u = sched.users[key];
+        u.t_last_us = t_start_us;
+        u.weight    = work == WHISPER_CPU_WORK_ENCODE ? 3 : 1;
+        u.n_active++;
+
+        n_threads = std::max(1, n_threads_req);
+
+        if (sched.n_threads > 0) {
+            int weight_sum = 0;
+            for (const auto & it : sched.users) {
+                weight_sum += it.second.weight;
+            }
+
+            int n_share = std::max(1, (sched.n_threads*u.weight + weight_sum/2)/weight_sum);
+            if (work == WHISPER_CPU_WORK_DECODE) {
+                n_share = std::min(n_share, std::max(1, sched.n_threads - sched.n_busy));
+            }
+
+            if (n_share < n_threads) {
+                n_threads = n_share;
+                sched.n_graphs_clamped++;
+            }
+        }
+
+        sched.n_busy    += n_threads;
+        sched.n_busy_max = std::max(sched.n_busy_max, sched.n_busy);
+        sched.n_graphs++;
+    }
+
+    ~whisper_cpu_lease() {
+        auto & sched = whisper_cpu_sched_instance();
+        std::lock_guard<std::mutex> lock(sched.mutex);
+
+        const int64_t t_end_us = ggml_time_us();
+
+        sched.n_busy    -= n_threads;
+        sched.t_busy_us += double(n_threads)*(t_end_us - t_start_us);
+
+        auto it = sched.users.find(key);
+        if (it != sched.users.end()) {
+            it->second.n_active--;
+            it->second.t_last_us = t_end_us;
+        }
+    }
+};
+
+// point the CPU backend at the pool, (re)creating it when more threads are asked for than it has
+static void whisper_threadpool_attach(whisper_threadpool & threadpool, ggml_backend_t backend, ggml_backend_reg_t reg, int n_threads) {
+    auto * fn_set = (ggml_backend_cpu_set_threadpool_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_set_threadpool");
+    if (!fn_set) {
+        return;
+    }
+
+    // an external pool is never replaced, ggml caps n_threads at its size
+    if (!threadpool.external && (!threadpool.tp || threadpool.n_threads < n_threads)) {
+        auto * fn_new  = (ggml_threadpool_new_t)  ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+        auto * fn_free = (ggml_threadpool_free_t) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+        if (!fn_new || !fn_free) {
+            return;
+        }
+
+        struct ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+        params.poll = threadpool.poll;
+
+        // a pool that grows may move to other CPUs, its current ones count as free
+        std::vector<int> cpus;
+        if (threadpool.affinity) {
+            whisper_cpu_sched_hold(threadpool.cpus, -1);
+            cpus = whisper_cpu_sched_place(n_threads);
+            for (int c : cpus) {
+                params.cpumask[c] = true;
+            }
+        }
+
+        ggml_threadpool_t tp = fn_new(&params);
+        if (!tp) {
+            whisper_cpu_sched_hold(cpus, -1);
+            whisper_cpu_sched_hold(threadpool.cpus, 1);
+            return;
+        }
+
+        // the backend pauses the old pool before it lets go of it
+        fn_set(backend, tp);
+        threadpool.cpus.clear();
+        whisper_threadpool_free(threadpool);
+
+        threadpool.tp        = tp;
+        threadpool.n_threads = n_threads;
+        threadpool.cpus      = std::move(cpus);
+        threadpool.fn_free   = fn_free;
     }
 
+    fn_set(backend, threadpool.tp);
+}
+
+static bool ggml_graph_compute_helper(
+              ggml_backend_t   backend,
+          whisper_threadpool & threadpool,
+          struct ggml_cgraph * graph,
+                         int   n_threads) {
+    auto * reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend));
+
     auto ggml_backend_set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
     if (ggml_backend_set_n_threads_fn) {
-        ggml_backend_set_n_threads_fn(backend.get(), n_threads);
+        ggml_backend_set_n_threads_fn(backend, n_threads);
     }
 
-    return ggml_backend_graph_compute(backend.get(), graph) == GGML_STATUS_SUCCESS;
+    whisper_threadpool_attach(threadpool, backend, reg, n_threads);
+
+    return ggml_backend_graph_compute(backend, graph) == GGML_STATUS_SUCCESS;
 }
 
+// work: what the graph computes, for its share of the threads of the CPU scheduler
+// the pool keeps the n_threads workers asked for, the graph runs on as many of them as the scheduler leases
 static bool ggml_graph_compute_helper(
       ggml_backend_sched_t   sched,
         struct ggml_cgraph * graph,
                        int   n_threads,
+        whisper_threadpool & threadpool,
+          whisper_cpu_work   work,
                       bool   sched_reset = true) {
+    whisper_cpu_lease lease(threadpool, work, n_threads);
+
     for (int i = 0; i < ggml_backend_sched_get_n_backends(sched); ++i) {
         ggml_backend_t backend = ggml_backend_sched_get_backend(sched, i);
         ggml_backend_dev_t dev = ggml_backend_get_device(backend);
@@ -199,7 +824,11 @@ static bool ggml_graph_compute_helper(
 
         auto * fn_set_n_threads = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
         if (fn_set_n_threads) {
-            fn_set_n_threads(backend, n_threads);
+            fn_set_n_threads(backend, lease.n_threads);
+        }
+
+        if (reg) {
+            whisper_threadpool_attach(threadpool, backend, reg, n_threads);
         }
     }
 
@@ -212,52 +841,6 @@ static bool ggml_graph_compute_helper(
     return t;
 }
 
-// TODO: move these functions to ggml-base with support for ggml-backend?
-
-static ggml_tensor * whisper_set_f32(struct ggml_tensor * t, float v) {
-    GGML_ASSERT(t->type == GGML_TYPE_F32);
-    GGML_ASSERT(ggml_is_contiguous(t));
-    size_t nels = ggml_nelements(t);
-    for (size_t i = 0; i < nels; ++i) {
-        ((float *) t->data)[i] = v;
-    }
-    return t;
-}
-
-static ggml_tensor * whisper_set_i32(struct ggml_tensor * t, int32_t v) {
-    GGML_ASSERT(t->type == GGML_TYPE_I32);
-    GGML_ASSERT(ggml_is_contiguous(t));
-    size_t nels = ggml_nelements(t);
-    for (size_t i = 0; i < nels; ++i) {
-        ((int32_t *) t->data)[i] = v;
-    }
-    return t;
-}
-
-static float whisper_get_f32_nd(const struct ggml_tensor * t, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-    GGML_ASSERT(t->type == GGML_TYPE_F32);
-    void * data = (char *) t->data + i0*t->nb[0] + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3];
-    return *(float *) data;
-}
-
-static void whisper_set_f32_nd(struct ggml_tensor * t, int64_t i0, int64_t i1, int64_t i2, int64_t i3, float v) {
-    GGML_ASSERT(t->type == GGML_TYPE_F32);
-    void * data = (char *) t->data + i0*t->nb[0] + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3];
-    *(float *) data = v;
-}
-
-static int32_t whisper_get_i32_nd(const struct ggml_tensor * t, int64_t i0, int64_t i1, int64_t i2, int64_t i3) {
-    GGML_ASSERT(t->type == GGML_TYPE_I32);
-    void * data = (char *) t->data + i0*t->nb[0] + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3];
-    return *(int32_t *) data;
-}
-
-static void whisper_set_i32_nd(struct ggml_tensor * t, int64_t i0, int64_t i1, int64_t i2, int64_t i3, int32_t v) {
-    GGML_ASSERT(t->type == GGML_TYPE_I32);
-    void * data = (char *) t->data + i0*t->nb[0] + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3];
-    *(int32_t *) data = v;
-}
-
 // available whisper models
 enum e_model {
     MODEL_UNKNOWN,
@@ -419,11 +1002,42 @@ struct whisper_mel {
     std::vector<float> data;
 };
 
-struct whisper_filters {
+// Un-normalized log10 mel frames of an audio stream, see whisper_mel_stream_append().
+// Stream frame f is centered on stream sample f*WHISPER_HOP_LENGTH.
+struct whisper_mel_stream {
+    int64_t n_samples = 0;        // samples appended since the last reset
+
+    std::vector<float> pcm;       // audio still needed by frames that are not final
+    int64_t pcm_offset = 0;       // stream position of pcm[0]
+
+    std::vector<float> frames;    // frames[(f - frame_offset)*n_mel + j]
+    std::vector<float> frame_max; // largest value of each stored frame
+    int64_t frame_offset = 0;     // stream index of the first stored frame
+    int64_t n_final = 0;          // frames computed so far
+
+    whisper_mel_stream() {
+        reset();
+    }
+
+    void reset() {
+        n_samples    = 0;
+        pcm.assign(WHISPER_N_FFT/2, 0.0f); // zero padding before the first sample
+        pcm_offset   = -(WHISPER_N_FFT/2);
+        frames.clear();
+        frame_max.clear();
+        frame_offset = 0;
+        n_final      = 0;
+    }
+};
+
+struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // [begin, end) of the non-zero weights of each mel band, 2*n_mel values
+    std::vector<int32_t> bands;
 };
 
 struct whisper_vocab {
@@ -432,8 +1046,69 @@ struct whisper_vocab {
 
     int n_vocab = 51864;
 
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
+    enum token_flag : uint8_t {
+        TOKEN_SPECIAL    = 1 << 0, // id >= token_eot
+        TOKEN_TIMESTAMP  = 1 << 1, // id >= token_beg
+        TOKEN_SPACE      = 1 << 2, // text starts with ' '
+        TOKEN_NON_SPEECH = 1 << 3, // suppressed by suppress_nst
+    };
+
+    // token texts by id, in one buffer: text i is text_pool[text_offsets[i], text_offsets[i + 1] - 1),
+    // NUL-terminated so that token_str() can be handed out as a C string
+    std::vector<uint32_t> text_offsets = { 0 };
+    std::string           text_pool;
+    std::vector<uint8_t>  token_flags;
+
+    // ids ordered by text, one per distinct text (the last id added wins, as with a map insert)
+    std::vector<id> sorted_ids;
+
+    id token_space = -1; // " ", for suppress_blank
+
+    int n_tokens() const {
+        return (int) text_offsets.size() - 1;
+    }
+
+    const char * token_str(id i) const {
+        return text_pool.data() + text_offsets[i];
+    }
+
+    size_t token_len(id i) const {
+        return text_offsets[i + 1] - text_offsets[i] - 1;
+    }
+
+    std::string token_text(id i) const {
+        return std::string(token_str(i), token_len(i));
+    }
+
+    bool has_flag(id i, token_flag flag) const {
+        return (token_flags[i] & flag) != 0;
+    }
+
+    void add_token(const std::string & text) {
+        text_pool.append(text);
+        text_pool.push_back('\0');
+        text_offsets.push_back((uint32_t) text_pool.size());
+    }
+
+    // -1 when no token has this text
+    id find(const std::string & text) const {
+        const auto it = std::lower_bound(sorted_ids.begin(), sorted_ids.end(), text, [&](id a, const std::string & b) {
+            return compare(a, b.data(), b.size()) < 0;
+        });
+        if (it == sorted_ids.end() || compare(*it, text.data(), text.size()) != 0) {
+            return -1;
+        }
+        return *it;
+    }
+
+    int compare(id a, const char * b, size_t n_b) const {
+        const size_t n_a = token_len(a);
+        const int    res = memcmp(token_str(a), b, std::min(n_a, n_b));
+        if (res != 0) {
+            return res;
+        }
+        return n_a < n_b ? -1 : (n_a > n_b ? 1 : 0);
+    }
 
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
     id token_eot        = 50256;
@@ -455,6 +1130,22 @@ struct whisper_vocab {
     int num_languages() const {
         return n_vocab - 51765 - (is_multilingual() ? 1 : 0);
     }
+
+    // byte trie over sorted_ids, for the longest token match in tokenize()
+    // node 0 is the root, the children of a node are trie_edges[first, first + n_edges), sorted by byte
+    struct trie_node {
+        id       token   = -1;
+        uint32_t first   = 0;
+        uint32_t n_edges = 0;
+    };
+
+    struct trie_edge {
+        uint8_t  byte;
+        uint32_t node;
+    };
+
+    std::vector<trie_node> trie_nodes;
+    std::vector<trie_edge> trie_edges;
 };
 
 struct whisper_segment {
@@ -467,6 +1158,10 @@ struct whisper_segment {
     std::vector<whisper_token_data> tokens;
 
     bool speaker_turn_next;
+
+    // temperature fallbacks of the window this segment was decoded in
+    int32_t n_fail_p = 0; // logprob threshold failures
+    int32_t n_fail_h = 0; // entropy threshold failures
 };
 
 struct whisper_batch {
@@ -522,6 +1217,15 @@ static void whisper_batch_prep_legacy(whisper_batch & batch, const whisper_token
     batch.logits[n_tokens - 1] = 1;
 }
 
+// number of tokens of the batch whose logits are requested
+static int whisper_batch_n_outputs(const whisper_batch & batch) {
+    int n_outputs = 0;
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        n_outputs += batch.logits[i] != 0;
+    }
+    return n_outputs;
+}
+
 // replace std::pair by using customized pair struct (reason: std::pair is very slow)
 template<typename A, typename B>
 struct whisper_pair {
@@ -539,6 +1243,8 @@ struct whisper_sched {
     ggml_backend_sched_t sched = nullptr;
 
     std::vector<uint8_t> meta;
+
+    size_t peak = 0; // bytes of the compute buffers used by the graph measured in whisper_sched_graph_init()
 };
 
 static size_t whisper_sched_size(struct whisper_sched & allocr) {
@@ -550,25 +1256,184 @@ static size_t whisper_sched_size(struct whisper_sched & allocr) {
     return size;
 }
 
+// memory plan of an allocated graph: returns the bytes of the compute buffers that the graph uses
+// with WHISPER_DEBUG, also logs its largest intermediate tensors with their lifetime (the nodes that produce and last read them)
+static size_t whisper_graph_plan_report(const char * name, struct ggml_cgraph * gf) {
+    const int n_nodes = ggml_graph_n_nodes(gf);
+
+    // the compute buffers are the ones that hold the nodes of the graph
+    std::map<ggml_backend_buffer_t, size_t> used;
+
+    for (int i = 0; i < n_nodes; ++i) {
+        const ggml_tensor * node = ggml_graph_node(gf, i);
+        if (node->view_src || !node->buffer || !node->data) {
+            continue;
+        }
+
+        const size_t end = (const char *) node->data + ggml_nbytes(node) - (const char *) ggml_backend_buffer_get_base(node->buffer);
+        used[node->buffer] = std::max(used[node->buffer], end);
+    }
+
+    size_t total = 0;
+    for (const auto & it : used) {
+        total += it.second;
+    }
+
+#if defined(WHISPER_DEBUG)
+    std::map<const ggml_tensor *, int> last_use;
+    for (int i = 0; i < n_nodes; ++i) {
+        const ggml_tensor * node = ggml_graph_node(gf, i);
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            const ggml_tensor * src = node->src[j];
+            if (src) {
+                last_use[src->view_src ? src->view_src : src] = i;
+            }
+        }
+    }
+
+    struct tensor_life {
+        size_t size;
+        int    first;
+        int    last;
+        const char * name;
+    };
+    std::vector<tensor_life> lives;
+
+    for (int i = 0; i < n_nodes; ++i) {
+        const ggml_tensor * node = ggml_graph_node(gf, i);
+        if (node->view_src || !node->buffer || !node->data) {
+            continue;
+        }
+
+        const auto it = last_use.find(node);
+        lives.push_back({ ggml_nbytes(node), i, it == last_use.end() ? n_nodes - 1 : it->second, node->name });
+    }
+
+    std::sort(lives.begin(), lives.end(), [](const tensor_life & a, const tensor_life & b) { return a.size > b.size; });
+
+    WHISPER_LOG_DEBUG("%s: %-6s graph: %d nodes, compute buffers used = %7.2f MB\n", __func__, name, n_nodes, total/1e6);
+    for (size_t i = 0; i < std::min<size_t>(lives.size(), 5); ++i) {
+        WHISPER_LOG_DEBUG("%s: %-6s   %-24s %7.2f MB, nodes %5d - %5d\n", __func__, name,
+                lives[i].name, lives[i].size/1e6, lives[i].first, lives[i].last);
+    }
+#else
+    GGML_UNUSED(name);
+#endif
+
+    return total;
+}
+
+// the huge page buffer type of the CPU backend (nullptr when the backend does not provide one)
+static ggml_backend_buffer_type_t whisper_cpu_hugepage_buft() {
+    static ggml_backend_buffer_type_t buft = [] {
+        ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+        auto * fn = reg ? (decltype(ggml_backend_cpu_hugepage_buffer_type) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_hugepage_buffer_type") : nullptr;
+        return fn ? fn() : nullptr;
+    }();
+    return buft;
+}
+
+// the buffer type of the CPU backend that replicates the weights per NUMA node (nullptr if not provided)
+static ggml_backend_buffer_type_t whisper_cpu_numa_buft() {
+    static ggml_backend_buffer_type_t buft = [] {
+        ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+        auto * fn = reg ? (ggml_backend_buffer_type_t (*)(void)) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_numa_buffer_type") : nullptr;
+        return fn ? fn() : nullptr;
+    }();
+    return buft;
+}
+
+// the buffer type of the plain CPU weights and of the CPU compute buffers
+static ggml_backend_buffer_type_t whisper_cpu_buft(const whisper_context_params & params) {
+    if (params.use_hugepages && whisper_cpu_hugepage_buft()) {
+        return whisper_cpu_hugepage_buft();
+    }
+    return ggml_backend_cpu_buffer_type();
+}
+
 // measure the memory usage of a graph and prepare the allocr's internal data buffer
-static bool whisper_sched_graph_init(struct whisper_sched & allocr, std::vector<ggml_backend_t> backends, std::function<struct ggml_cgraph *()> && get_graph) {
+// with shared set, the graph is planned in the compute buffers of that scheduler, which grow to the largest graph
+// the graph inputs are placed in the compute buffer of the CPU backend; with a GPU, that buffer is pinned host
+// memory, so the scheduler uploads the inputs with asynchronous copies instead of staging them first
+// otherwise the CPU compute buffers are of buft_cpu (nullptr - the default of the CPU backend)
+static std::vector<ggml_backend_buffer_type_t> whisper_sched_bufts(const std::vector<ggml_backend_t> & backends, ggml_backend_buffer_type_t buft_cpu) {
+    ggml_backend_buffer_type_t buft_host = nullptr;
+    for (ggml_backend_t backend : backends) {
+        ggml_backend_dev_t dev = ggml_backend_get_device(backend);
+        if (dev && (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU || ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_IGPU)) {
+            buft_host = ggml_backend_dev_host_buffer_type(dev);
+            if (buft_host) {
+                break;
+            }
+        }
+    }
+
+    std::vector<ggml_backend_buffer_type_t> bufts;
+    for (ggml_backend_t backend : backends) {
+        if (ggml_backend_is_cpu(backend) && (buft_host || buft_cpu)) {
+            bufts.push_back(buft_host ? buft_host : buft_cpu);
+        } else {
+            bufts.push_back(ggml_backend_get_default_buffer_type(backend));
+        }
+    }
+
+    return bufts;
+}
+
+static ggml_backend_sched_t whisper_sched_new(std::vector<ggml_backend_t> & backends, ggml_backend_buffer_type_t buft_cpu, int n_nodes) {
+    auto bufts = whisper_sched_bufts(backends, buft_cpu);
+
+    return ggml_backend_sched_new(backends.data(), bufts.data(), backends.size(), n_nodes, false, true);
+}
+
+// with sizes set, the graph is not measured: non-empty sizes (peak, then the buffer size per backend of an earlier
+// measurement of the same graph) are reserved as they are, empty sizes are filled from the measurement
+static bool whisper_sched_graph_init(
+        struct whisper_sched & allocr,
+                  const char * name,
+        std::vector<ggml_backend_t> backends,
+        ggml_backend_buffer_type_t buft_cpu,
+        std::function<struct ggml_cgraph *()> && get_graph,
+        ggml_backend_sched_t shared = nullptr,
+        std::vector<size_t> * sizes = nullptr) {
     auto & sched = allocr.sched;
     auto & meta  = allocr.meta;
 
-    sched = ggml_backend_sched_new(backends.data(), nullptr, backends.size(), WHISPER_MAX_NODES, false, true);
+    sched = shared ? shared : whisper_sched_new(backends, buft_cpu, WHISPER_MAX_NODES);
 
     meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
 
+    const int n_backends = ggml_backend_sched_get_n_backends(sched);
+
+    if (sizes && (int) sizes->size() == n_backends + 1) {
+        if (!ggml_backend_sched_reserve_sizes(sched, sizes->data() + 1)) {
+            WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+            return false;
+        }
+        allocr.peak = (*sizes)[0];
+        return true;
+    }
+
     // since there are dependencies between the different graphs,
     // we need to allocate them instead of only reserving to get the correct compute buffer size
-    if (!ggml_backend_sched_alloc_graph(sched, get_graph())) {
+    ggml_cgraph * gf = get_graph();
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
         // failed to allocate the compute buffer
         WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
         return false;
     }
 
+    allocr.peak = whisper_graph_plan_report(name, gf);
+
     ggml_backend_sched_reset(sched);
 
+    if (sizes) {
+        sizes->assign(1, allocr.peak);
+        for (int i = 0; i < n_backends; ++i) {
+            sizes->push_back(ggml_backend_sched_get_buffer_size(sched, ggml_backend_sched_get_backend(sched, i)));
+        }
+    }
+
     return true;
 }
 
@@ -623,6 +1488,9 @@ struct whisper_layer_encoder {
     struct ggml_tensor * attn_v_w;
     struct ggml_tensor * attn_v_b;
 
+    // attn_q_w, attn_k_w and attn_v_w are views of its rows (fuse_qkv), else nullptr
+    struct ggml_tensor * attn_qkv_w = nullptr;
+
     // encoder.blocks.*.mlp_ln
     struct ggml_tensor * mlp_ln_w;
     struct ggml_tensor * mlp_ln_b;
@@ -657,6 +1525,9 @@ struct whisper_layer_decoder {
     struct ggml_tensor * attn_v_w;
     struct ggml_tensor * attn_v_b;
 
+    // attn_q_w, attn_k_w and attn_v_w are views of its rows (fuse_qkv), else nullptr
+    struct ggml_tensor * attn_qkv_w = nullptr;
+
     // decoder.blocks.*.cross_attn_ln
     struct ggml_tensor * cross_attn_ln_0_w;
     struct ggml_tensor * cross_attn_ln_0_b;
@@ -689,16 +1560,33 @@ struct whisper_layer_decoder {
     struct ggml_tensor * mlp_1_b;
 };
 
+// cells are shared between sequences: beams that branch from a common prefix reference the same cells
+// and only the tokens decoded after the branch point get new ones
+// the sequences a cell belongs to are kept as a bit mask - seq ids are decoder indices, < WHISPER_MAX_DECODERS
 struct whisper_kv_cell {
     whisper_pos pos = -1;
 
-    std::set<whisper_seq_id> seq_id;
+    uint32_t seq_mask = 0;
 
     bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_mask & (1u << id);
+    }
+
+    void add_seq_id(const whisper_seq_id & id) {
+        seq_mask |= 1u << id;
+    }
+
+    void rm_seq_id(const whisper_seq_id & id) {
+        seq_mask &= ~(1u << id);
+    }
+
+    bool is_empty() const {
+        return seq_mask == 0;
     }
 };
 
+static_assert(WHISPER_MAX_DECODERS <= 32, "whisper_kv_cell::seq_mask has one bit per decoder");
+
 struct whisper_kv_cache {
     uint32_t head = 0;
     uint32_t size = 0;
@@ -708,6 +1596,20 @@ struct whisper_kv_cache {
 
     std::vector<whisper_kv_cell> cells;
 
+    // cells changed since the KQ mask was last set (whisper_kq_mask_set): [dirty_begin, dirty_end)
+    uint32_t dirty_begin = 0;
+    uint32_t dirty_end   = 0;
+
+    void mark_dirty(uint32_t i0, uint32_t i1) {
+        if (dirty_begin == dirty_end) {
+            dirty_begin = i0;
+            dirty_end   = i1;
+        } else {
+            dirty_begin = std::min(dirty_begin, i0);
+            dirty_end   = std::max(dirty_end,   i1);
+        }
+    }
+
     struct ggml_tensor * k;
     struct ggml_tensor * v;
 
@@ -716,6 +1618,131 @@ struct whisper_kv_cache {
     std::vector<uint8_t> ctx_buf;
 };
 
+// the KQ mask of the decoder graphs, kept by a state across decodes (whisper_kq_mask_set)
+// one row of flags over all the cells per batch token: a row is only computed again when its token moved to
+// another sequence or position, else just for the cells changed since and the cells that entered the window
+struct whisper_kq_mask {
+    int n_cells = 0;
+
+    std::vector<uint8_t>        hidden; // [rows][n_cells]
+    std::vector<int32_t>        width;  // cells [0, width) of the row are up to date, but for the dirty ones
+    std::vector<whisper_pos>    pos;
+    std::vector<whisper_seq_id> seq;
+
+    // the tensor data of the last call, F16 with flash attention; the padding rows are only written on a new shape
+    std::vector<uint8_t> data;
+    int64_t shape[3] = { 0, 0, 0 };
+    ggml_type type = GGML_TYPE_COUNT;
+};
+
+// read-only mapping of a model file
+struct whisper_mmap {
+    uint8_t * addr = nullptr; // mapped read-only
+    size_t size = 0;
+
+#if defined(_WIN32)
+    HANDLE file    = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    whisper_mmap() = default;
+    whisper_mmap(const whisper_mmap &) = delete;
+    whisper_mmap & operator=(const whisper_mmap &) = delete;
+
+    ~whisper_mmap() {
+#if defined(_WIN32)
+        if (addr)                         UnmapViewOfFile(addr);
+        if (mapping)                      CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#elif defined(WHISPER_MMAP_SUPPORTED)
+        if (addr) munmap(addr, size);
+#endif
+    }
+
+    // nullptr if the file cannot be mapped; the caller falls back to reading it
+    static std::unique_ptr<whisper_mmap> open(const char * path) {
+#if defined(_WIN32)
+        auto map = std::unique_ptr<whisper_mmap>(new whisper_mmap());
+        const int n = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+        std::wstring wpath(n > 0 ? n : 0, L'\0');
+        if (n <= 0 || !MultiByteToWideChar(CP_UTF8, 0, path, -1, &wpath[0], n)) {
+            return nullptr;
+        }
+        map->file = CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (map->file == INVALID_HANDLE_VALUE) {
+            return nullptr;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(map->file, &size) || size.QuadPart == 0) {
+            return nullptr;
+        }
+        map->mapping = CreateFileMappingW(map->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!map->mapping) {
+            return nullptr;
+        }
+        map->addr = (uint8_t *) MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!map->addr) {
+            return nullptr;
+        }
+        map->size = (size_t) size.QuadPart;
+        return map;
+#elif defined(WHISPER_MMAP_SUPPORTED)
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        void * addr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+#ifdef MADV_WILLNEED
+        // the whole file is read during load; start reading ahead now
+        madvise(addr, (size_t) st.st_size, MADV_WILLNEED);
+#endif
+        auto map = std::unique_ptr<whisper_mmap>(new whisper_mmap());
+        map->addr = (uint8_t *) addr;
+        map->size = (size_t) st.st_size;
+        return map;
+#else
+        GGML_UNUSED(path);
+        return nullptr;
+#endif
+    }
+};
+
+// whisper_model_loader over a whisper_mmap; whisper_model_load() recognizes it
+// by its read function and binds CPU weights to the mapping instead of copying
+struct whisper_mmap_reader {
+    const whisper_mmap * map = nullptr;
+    size_t pos = 0;
+    bool   eof = false;   // set by a read past the end, like std::ifstream
+
+    static size_t read(void * ctx, void * output, size_t read_size) {
+        auto * r = (whisper_mmap_reader *) ctx;
+        const size_t n = std::min(read_size, r->map->size - r->pos);
+        memcpy(output, r->map->addr + r->pos, n);
+        r->pos += n;
+        if (n < read_size) {
+            r->eof = true;
+        }
+        return n;
+    }
+
+    static bool is_eof(void * ctx) {
+        return ((whisper_mmap_reader *) ctx)->eof;
+    }
+
+    static void close(void * ctx) {
+        GGML_UNUSED(ctx);
+    }
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -756,19 +1783,39 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     std::vector<ggml_backend_buffer_t> buffers;
 
+    // backs the weights bound in place when the model was loaded with use_mmap
+    std::unique_ptr<whisper_mmap> mapping;
+
+    // the decoder weights still being copied out of the mapping (progressive_load)
+    std::shared_future<void> pending;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
 };
 
+// one of the GPUs of whisper_context_params.n_gpu_devices
+struct whisper_model_device {
+    int gpu_device = 0; // index among the GPUs, as whisper_context_params.gpu_device
+
+    ggml_backend_dev_t dev = nullptr;
+
+    // the weights with the GPU ones copied to this device; null on the device of whisper_context.model
+    std::unique_ptr<whisper_model> model;
+
+    std::atomic<int> n_states { 0 };
+};
+
 struct whisper_partial_utf8 {
     uint32_t value;    // bit value so far (unshifted)
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
 };
 
 struct whisper_grammar {
-    /*const*/ std::vector<std::vector<whisper_grammar_element>> rules;
-    std::vector<std::vector<const whisper_grammar_element *>>   stacks;
+    // shared by the copies made for beam candidates and the draft decoder, so the stacks of every
+    // copy point into the same elements
+    std::shared_ptr<const std::vector<std::vector<whisper_grammar_element>>> rules;
+    std::vector<std::vector<const whisper_grammar_element *>>                stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     whisper_partial_utf8 partial_utf8;
@@ -780,9 +1827,38 @@ struct whisper_grammar_candidate {
     whisper_partial_utf8   partial_utf8;
 };
 
+// parse stacks and pending UTF-8 bytes; the tokens a grammar rejects depend on nothing else
+using whisper_grammar_key = std::tuple<std::vector<std::vector<const whisper_grammar_element *>>, uint32_t, int>;
+
+// tokens rejected by the grammar of the current whisper_full call, one bit per token and parse state
+// the parse states of a command grammar repeat across steps, decoders and segments, so most steps
+// only look up a mask instead of matching the whole vocab against every stack
+struct whisper_grammar_cache {
+    std::mutex mutex; // the decoders are sampled in parallel
+
+    std::shared_ptr<const std::vector<std::vector<whisper_grammar_element>>> rules; // the keys point into these
+
+    // vocab decoded as UTF-8 with no pending bytes, each token terminated by 0
+    std::vector<uint32_t>             code_points;
+    std::vector<size_t>               code_offset;
+    std::vector<whisper_partial_utf8> code_partial;
+
+    std::map<whisper_grammar_key, std::shared_ptr<const std::vector<uint64_t>>> rejects;
+};
+
+// longest phrase, in text tokens, that the repetition tracker of a sequence looks for
+#define WHISPER_REPEAT_MAX_PERIOD 32
+
 struct whisper_sequence {
     std::vector<whisper_token_data> tokens;
 
+    uint64_t hash = 0; // rolling hash of the token ids while decoding, see whisper_sequence_push()
+
+    // repetition tracker over the text tokens (no timestamps, they keep rising in a loop), see whisper_sequence_push()
+    // repeat_run[p - 1]: how many text tokens in a row equal the text token p before them
+    std::vector<whisper_token> text;
+    std::array<int, WHISPER_REPEAT_MAX_PERIOD> repeat_run = {};
+
     // the accumulated transcription in the current iteration (used to truncate the tokens array)
     int result_len;
 
@@ -793,6 +1869,44 @@ struct whisper_sequence {
     double score;            // likelihood rank score
 };
 
+// FNV-1a step over a token id: a sequence's hash follows its tokens in O(1) per token, so telling two beams
+// apart does not depend on their length
+static uint64_t whisper_sequence_hash_next(uint64_t hash, whisper_token id) {
+    return (hash ^ (uint64_t) (uint32_t) id)*0x100000001b3ULL;
+}
+
+// token_eot: the text tokens are the ones below it
+static void whisper_sequence_push(whisper_sequence & seq, const whisper_token_data & token, whisper_token token_eot) {
+    seq.tokens.push_back(token);
+    seq.hash = whisper_sequence_hash_next(seq.hash, token.id);
+
+    if (token.id < token_eot) {
+        const int n = (int) seq.text.size();
+        for (int p = 1; p <= WHISPER_REPEAT_MAX_PERIOD; ++p) {
+            seq.repeat_run[p - 1] = p <= n && seq.text[n - p] == token.id ? seq.repeat_run[p - 1] + 1 : 0;
+        }
+        seq.text.push_back(token.id);
+    }
+}
+
+static void whisper_sequence_clear(whisper_sequence & seq) {
+    seq.tokens.clear();
+    seq.hash = 0;
+    seq.text.clear();
+    seq.repeat_run.fill(0);
+}
+
+// the period of the phrase the sequence is looping on, 0 if none: a phrase of p text tokens repeated 3 times in a
+// row, spanning at least n_min tokens - O(WHISPER_REPEAT_MAX_PERIOD) per token thanks to the runs of the tracker
+static int whisper_sequence_repeat_period(const whisper_sequence & seq, int n_min) {
+    for (int p = 1; p <= WHISPER_REPEAT_MAX_PERIOD; ++p) {
+        if (seq.repeat_run[p - 1] >= std::max(2*p, n_min - p)) {
+            return p;
+        }
+    }
+    return 0;
+}
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // the currently generated sequence of tokens
@@ -813,12 +1927,105 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
-    // work container used to avoid memory allocations
+    // work containers used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
+    std::vector<double> cdf;              // sampling at t > 0.0
+    std::vector<whisper_token_data> topk; // beam search candidates
 
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 };
 
+// persistent helper threads for the per-token work of the decoders
+// run(n, fn) calls fn on the calling thread and on n - 1 helpers, then waits for all of them
+struct whisper_worker_pool {
+    std::vector<std::thread> threads;
+
+    std::mutex              mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+
+    void (*job)(void *) = nullptr;
+    void * job_data     = nullptr;
+
+    uint64_t generation = 0;
+    int      n_active   = 0; // helpers taking part in the current job
+    int      n_pending  = 0; // helpers still running it
+    bool     stop       = false;
+
+    whisper_worker_pool() = default;
+    whisper_worker_pool(const whisper_worker_pool &) = delete;
+    whisper_worker_pool & operator=(const whisper_worker_pool &) = delete;
+
+    ~whisper_worker_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    template <typename F>
+    void run(int n, F & fn) {
+        if (n <= 1) {
+            fn();
+            return;
+        }
+
+        while ((int) threads.size() < n - 1) {
+            const int id = threads.size();
+            threads.emplace_back([this, id] { loop(id); });
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job       = [](void * data) { (*(F *) data)(); };
+            job_data  = &fn;
+            n_active  = n - 1;
+            n_pending = n - 1;
+            generation++;
+        }
+        cv_work.notify_all();
+
+        fn();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_pending == 0; });
+    }
+
+    void loop(int id) {
+        uint64_t seen = 0;
+        while (true) {
+            void (*cur)(void *);
+            void * data;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_work.wait(lock, [&] { return stop || generation != seen; });
+                if (stop) {
+                    return;
+                }
+                seen = generation;
+                if (id >= n_active) {
+                    continue;
+                }
+                cur  = job;
+                data = job_data;
+            }
+
+            cur(data);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--n_pending == 0) {
+                    cv_done.notify_one();
+                }
+            }
+        }
+    }
+};
+
 // [EXPERIMENTAL] Token-level timestamps with DTW
 struct whisper_aheads_masks {
     std::vector<struct ggml_tensor *> m;    // One mask per text layer.
@@ -831,6 +2038,48 @@ struct vad_time_mapping {
     int64_t original_time;   // Corresponding time in original audio
 };
 
+// low-rank delta of one weight: w*x + scale*B*(A*x), A = [n_in, rank], B = [rank, n_out]
+struct whisper_adapter_lora_weight {
+    struct ggml_tensor * a = nullptr;
+    struct ggml_tensor * b = nullptr;
+
+    // alpha/rank scaling of the adapter, times the scale it was set with
+    float get_scale(float alpha, float adapter_scale) const {
+        const float rank = (float) a->ne[1];
+        return alpha ? adapter_scale * alpha / rank : adapter_scale;
+    }
+};
+
+// a LoRA adapter of the model of a context (whisper_adapter_lora_init()); it only holds the deltas, the base
+// weights stay shared by every state of the context whatever adapters they use
+struct whisper_adapter_lora {
+    const whisper_context * ctx = nullptr;
+
+    float alpha = 0.0f;
+
+    // by name of the base weight
+    std::map<std::string, whisper_adapter_lora_weight> ab_map;
+
+    std::vector<ggml_context *> ctxs;
+    std::vector<ggml_backend_buffer_t> bufs;
+
+    ~whisper_adapter_lora() {
+        for (auto * buf : bufs) {
+            ggml_backend_buffer_free(buf);
+        }
+        for (auto * c : ctxs) {
+            ggml_free(c);
+        }
+    }
+
+    const whisper_adapter_lora_weight * get_weight(const ggml_tensor * w) const {
+        const auto it = ab_map.find(w->name);
+        return it != ab_map.end() ? &it->second : nullptr;
+    }
+};
+
+struct whisper_dual_link;
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -847,6 +2096,15 @@ struct whisper_state {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    // see whisper_get_metrics_from_state()
+    whisper_histogram h_encode = {};
+    whisper_histogram h_decode = {};
+    whisper_histogram h_token  = {};
+    whisper_histogram h_alloc  = {};
+
+    int32_t n_splits_encode = 0;
+    int32_t n_splits_decode = 0;
+
     // number of decoders for which we have constructed the KV cache
     int32_t kv_self_n_dec = 0;
 
@@ -857,22 +2115,58 @@ struct whisper_state {
     // shared between all decoders
     whisper_kv_cache kv_cross;
 
+    // hash of the encoder input that kv_cross was computed from (encoder_cache)
+    uint64_t enc_key   = 0;
+    bool     enc_valid = false;
+
+    // the mel window that whisper_encode_batch() just encoded into kv_cross, taken by the next encode of this state
+    // without copying and hashing the window again (offset -1: none; cleared when the mel changes)
+    int enc_batch_offset  = -1;
+    int enc_batch_n_ctx   = 0;
+    int enc_batch_mel_end = INT_MAX;
+
+    // adapters applied to the matmuls of this state's graphs, with their scale (whisper_set_adapter_lora())
+    std::vector<std::pair<whisper_adapter_lora *, float>> loras;
+
     // padded buffer for flash-attention
     whisper_kv_cache kv_pad;
 
+    // with share_compute_buffers, the results of the conv (k) and encoder (v) graphs are kept here,
+    // because the next graph is computed in the same compute buffers
+    whisper_kv_cache embd_io;
+
     whisper_mel mel;
+    whisper_mel_stream mel_stream;
 
     whisper_batch batch;
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS];
 
     std::vector<ggml_backend_t> backends;
+    ggml_backend_t              backend_encoder = nullptr; // remote backend of the encoder, null when it runs here
+
+    whisper_model_device * device = nullptr; // the GPU of the state when the context has several
+    whisper_threadpool          threadpool; // shared by the CPU graphs of all the schedulers below
 
     // - stores meta info about the intermediate tensors into the `meta` buffers
     whisper_sched sched_conv;
     whisper_sched sched_encode;
     whisper_sched sched_cross;
     whisper_sched sched_decode;
+    whisper_sched sched_batch; // whisper_encode_batch(), created on first use
+    whisper_sched sched_decode_batch; // whisper_decode_batch(), created on first use
+
+    // the graph of the last whisper_decode_internal() call, still allocated in sched_decode
+    // it is computed again with new inputs while the batch and the KV window keep their sizes
+    struct {
+        ggml_cgraph * gf = nullptr;
+
+        int  n_tokens    = 0;
+        int  n_outputs   = 0;
+        int  n_kv        = 0;
+        int  n_audio_ctx = 0;
+        bool aheads      = false;
+    } graph_decode;
 
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
@@ -880,36 +2174,53 @@ struct whisper_state {
 
     // helpers for GPU offloading
     std::vector<float> inp_mel;
-    std::vector<float> inp_mask;
+
+    whisper_kq_mask kq_mask;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
     std::vector<whisper_segment> result_all;
 
+    // result_all flattened by whisper_full_get_results_from_state()
+    std::vector<whisper_result_segment> results_segments;
+    std::vector<whisper_token_data>     results_tokens;
+    std::vector<int32_t>                results_token_text;
+    std::string                         results_text;
+
+    // mel frame the last whisper_full_with_state() call got to, a resumed job continues from it
+    int32_t seek = 0;
+
     // prompt history split into static prefix (prompt_past0) and dynamic rolling context (prompt_past1)
     std::vector<whisper_token>   prompt_past0; // static carried initial prompt (if enabled)
     std::vector<whisper_token>   prompt_past1; // dynamic context from decoded output
 
-    int lang_id = 0; // english by default
+    int   lang_id   = 0;    // english by default
+    float lang_prob = 0.0f; // of lang_id, when whisper_full() detected it
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
 
 #ifdef WHISPER_USE_COREML
     whisper_coreml_context * ctx_coreml = nullptr;
+    std::vector<whisper_coreml_context *> ctx_coreml_short; // by n_ctx_external
 #endif
 
 #ifdef WHISPER_USE_OPENVINO
     whisper_openvino_context * ctx_openvino = nullptr;
+    std::vector<whisper_openvino_context *> ctx_openvino_short; // by n_ctx_external
 #endif
 
+    // audio contexts of the external encoder variants compiled for short audio (ascending, below n_audio_ctx),
+    // found next to the full-context encoder as <name>-<n_ctx>.<ext>
+    std::vector<int> n_ctx_external;
+
     // [EXPERIMENTAL] token-level timestamps data
     int64_t t_beg  = 0;
     int64_t t_last = 0;
 
     whisper_token tid_last;
 
-    std::vector<float> energy; // PCM signal energy
+    std::vector<float> energy; // PCM signal energy, one value per 2 ms (get_signal_energy())
     float no_speech_prob = 0.0f;
 
     // [EXPERIMENTAL] Token-level timestamps with DTW
@@ -917,9 +2228,23 @@ struct whisper_state {
     ggml_tensor * aheads_cross_QKs = nullptr;
     std::vector<float> aheads_cross_QKs_data;
 
+    // host buffers reused by every DTW call, see whisper_exp_compute_token_level_timestamps_dtw()
+    struct {
+        std::vector<float>   w;      // [n_heads][n_tokens][n_audio_tokens]
+        std::vector<float>   row;    // one median-filtered row
+        std::vector<float>   filter; // median filter window
+        std::vector<float>   x;      // [n_audio_tokens][n_text] negative mean over heads
+        std::vector<float>   cost;   // two cost columns
+        std::vector<int8_t>  trace;  // [n_audio_tokens + 1][n_text + 1]
+        std::vector<int32_t> path;   // (text index, audio index) pairs, end to start
+    } dtw;
+
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 
+    // the encoder sees silence past this mel frame (VAD window packing)
+    int32_t mel_end = INT_MAX;
+
     whisper_vad_context * vad_context = nullptr;
 
     struct vad_segment_info {
@@ -932,12 +2257,44 @@ struct whisper_state {
     bool has_vad_segments = false;
 
     std::vector<vad_time_mapping> vad_mapping_table;
+
+    // runs the sampling of multiple decoders in parallel
+    whisper_worker_pool decoder_workers;
+
+    // prompt whose self-attention KV cells (seq 0) are valid for the current encoder output, with the
+    // logits of its last token, so that a temperature fallback on the same window does not decode it again
+    std::vector<whisper_token> kv_prompt;
+    std::vector<float>         kv_prompt_logits;
+    float                      kv_prompt_no_speech_prob = 0.0f;
+
+    // tokens suppressed by whisper_full_params.suppress_regex and suppress_nst, 0.0f or -INFINITY per token
+    // rebuilt only when those parameters change; empty when nothing is suppressed
+    std::vector<float> suppress_mask;
+    std::string        suppress_mask_regex;
+    bool               suppress_mask_nst = false;
+
+    whisper_grammar_cache grammar_cache;
+
+    // [EXPERIMENTAL] speculative decoding
+    whisper_state * draft_state = nullptr; // state of whisper_full_params.draft_ctx
+    whisper_context * draft_ctx = nullptr; // the context draft_state belongs to
+    std::vector<whisper_token> draft_past; // tokens in the KV cache of draft_state
+    std::vector<whisper_token> draft_tokens; // proposed tokens under verification
+
+    // [EXPERIMENTAL] encode ahead
+    whisper_state * ahead_state = nullptr; // encodes the next window while this state decodes
+
+    // whisper_full_dual(): the transcribing (role 0) and translating (role 1) states of one call
+    whisper_dual_link * dual = nullptr;
+    int dual_role = 0;
 };
 
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
+    ggml_cpu_barrier_stats barrier_stats0 = {}; // at t_start_us
+
     ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
     ggml_type itype = ggml_type::GGML_TYPE_F16; // intermediate type (FP32 or FP16)
 
@@ -948,7 +2305,22 @@ struct whisper_context {
 
     whisper_state * state = nullptr;
 
+    ggml_backend_dev_t dev_encoder = nullptr; // remote device of the encoder, see whisper_context_params.rpc_servers
+
+    // the GPUs of whisper_context_params.n_gpu_devices, empty with a single one
+    std::vector<std::unique_ptr<whisper_model_device>> devices;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
+
+    int n_threads_tuned = 0; // see whisper_context_params.autotune_cache
+
+    // compute buffer sizes of the conv, encode, cross and decode graphs measured by whisper_init_state(), by
+    // whisper_sched_key(); the next states reserve them instead of planning the graphs again
+    std::mutex sched_sizes_mutex;
+    std::map<std::string, std::vector<std::vector<size_t>>> sched_sizes;
+    std::string sched_cache; // copy of whisper_context_params.sched_cache
+
+    std::vector<whisper_state *> parallel_states; // workers of whisper_full_parallel(), kept for the next call
 };
 
 struct whisper_global {
@@ -988,6 +2360,7 @@ static bool whisper_kv_cache_init(
 
     cache.cells.clear();
     cache.cells.resize(n_ctx);
+    cache.mark_dirty(0, n_ctx);
 
     struct ggml_context * ctx = ggml_init(params);
 
@@ -1056,11 +2429,13 @@ static bool whisper_kv_cache_find_slot(
         }
     }
 
+    cache.mark_dirty(cache.head, cache.head + n_tokens);
+
     for (uint32_t i = 0; i < n_tokens; i++) {
         cache.cells[cache.head + i].pos = batch.pos[i];
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            cache.cells[cache.head + i].add_seq_id(batch.seq_id[i][j]);
         }
     }
 
@@ -1070,7 +2445,7 @@ static bool whisper_kv_cache_find_slot(
 // find how many cells are currently in use
 static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
     for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
+        if (cache.cells[i].pos >= 0 && !cache.cells[i].is_empty()) {
             return i + 1;
         }
     }
@@ -1081,9 +2456,10 @@ static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache)
 static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        cache.cells[i].seq_mask = 0;
     }
     cache.head = 0;
+    cache.mark_dirty(0, cache.size);
 
     ggml_backend_buffer_clear(cache.buffer, 0);
 }
@@ -1101,13 +2477,14 @@ static void whisper_kv_cache_seq_rm(
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
+                cache.cells[i].seq_mask = 0;
             } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                cache.cells[i].rm_seq_id(seq_id);
             } else {
                 continue;
             }
-            if (cache.cells[i].seq_id.empty()) {
+            cache.mark_dirty(i, i + 1);
+            if (cache.cells[i].is_empty()) {
                 cache.cells[i].pos = -1;
                 if (new_head == cache.size) new_head = i;
             }
@@ -1118,22 +2495,142 @@ static void whisper_kv_cache_seq_rm(
     if (new_head != cache.size) cache.head = new_head;
 }
 
-static void whisper_kv_cache_seq_cp(
+// share the cells of sequence seq_id_src with sequences [0, n_seq) in one pass
+// nothing is copied: the decoders branch from the same prompt cells and only their new tokens take new cells
+static void whisper_kv_cache_seq_fork(
         struct whisper_kv_cache & cache,
                  whisper_seq_id   seq_id_src,
-                 whisper_seq_id   seq_id_dst,
-                    whisper_pos   p0,
-                    whisper_pos   p1) {
-    if (p0 < 0) p0 = 0;
-    if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
+                            int   n_seq) {
+    const uint32_t mask = n_seq < 32 ? (1u << n_seq) - 1 : ~0u;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].has_seq_id(seq_id_src)) {
+            cache.cells[i].seq_mask |= mask;
+        }
+    }
 
     cache.head = 0;
+    cache.mark_dirty(0, cache.size);
+}
+
+// reassign all sequences at once: sequence j takes the cells of sequence src[j], for j in [0, n_seq)
+// this is the beam search reorder - it replaces a copy to a temporary sequence and back for each beam
+static void whisper_kv_cache_seq_reorder(
+        struct whisper_kv_cache & cache,
+           const whisper_seq_id * src,
+                            int   n_seq) {
+    const uint32_t keep = n_seq < 32 ? ~((1u << n_seq) - 1) : 0u;
 
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+        auto & cell = cache.cells[i];
+        if (cell.pos < 0) {
+            continue;
+        }
+
+        uint32_t mask = cell.seq_mask & keep;
+        for (int j = 0; j < n_seq; ++j) {
+            mask |= ((cell.seq_mask >> src[j]) & 1u) << j;
+        }
+
+        cell.seq_mask = mask;
+        if (mask == 0) {
+            cell.pos = -1;
+        }
+    }
+
+    cache.head = 0;
+    cache.mark_dirty(0, cache.size);
+}
+
+template <typename T>
+static void whisper_kq_mask_pack(const whisper_kq_mask & m, T * dst, int n_kv, int n_tokens, int n_rows, bool pad_rows, T visible, T masked) {
+    for (int j = 0; j < n_tokens; ++j) {
+        const uint8_t * row = m.hidden.data() + (size_t) j*m.n_cells;
+        for (int i = 0; i < n_kv; ++i) {
+            dst[j*n_kv + i] = row[i] ? masked : visible;
+        }
+    }
+
+    if (pad_rows) {
+        std::fill(dst + (size_t) n_tokens*n_kv, dst + (size_t) n_rows*n_kv, masked);
+    }
+}
+
+// fills the KQ mask input of a decoder graph: row j hides the cells that are not in the sequence of token j
+// of the batch or come after it, the padding rows (GGML_KQ_MASK_PAD) hide everything
+static void whisper_kq_mask_set(whisper_state & wstate, const whisper_batch & batch, struct ggml_tensor * KQ_mask) {
+    auto & m       = wstate.kq_mask;
+    auto & kv_self = wstate.kv_self;
+
+    const int n_cells  = kv_self.size;
+    const int n_kv     = kv_self.n;
+    const int n_tokens = batch.n_tokens;
+    const int n_rows   = KQ_mask->ne[1];
+
+    if (m.n_cells != n_cells) {
+        m = whisper_kq_mask();
+        m.n_cells = n_cells;
+    }
+
+    if ((int) m.width.size() < n_tokens) {
+        m.hidden.resize((size_t) n_tokens*n_cells);
+        m.width.resize(n_tokens, 0);
+        m.pos.resize(n_tokens, -1);
+        m.seq.resize(n_tokens, -1);
+    }
+
+    const int d0 = std::min<int>(kv_self.dirty_begin, n_kv);
+    const int d1 = std::min<int>(kv_self.dirty_end,   n_kv);
+
+    for (int j = 0; j < (int) m.width.size(); ++j) {
+        if (j >= n_tokens) {
+            // not in this batch: the changes to the cells are not tracked for it any more
+            m.width[j] = 0;
+            continue;
+        }
+
+        const whisper_pos    pos    = batch.pos[j];
+        const whisper_seq_id seq_id = batch.seq_id[j][0];
+
+        uint8_t * row = m.hidden.data() + (size_t) j*n_cells;
+
+        auto update = [&](int i0, int i1) {
+            for (int i = i0; i < i1; ++i) {
+                row[i] = !kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos;
+            }
+        };
+
+        if (pos != m.pos[j] || seq_id != m.seq[j]) {
+            update(0, n_kv);
+        } else {
+            const int w = std::min(m.width[j], n_kv);
+            update(std::min(d0, w), std::min(d1, w));
+            update(w, n_kv);
         }
+
+        m.width[j] = n_kv;
+        m.pos[j]   = pos;
+        m.seq[j]   = seq_id;
+    }
+
+    kv_self.dirty_begin = kv_self.dirty_end = 0;
+
+    const bool new_shape = m.type != KQ_mask->type || m.shape[0] != n_kv || m.shape[1] != n_rows || m.shape[2] != n_tokens;
+
+    m.data.resize(ggml_nbytes(KQ_mask));
+    m.type     = KQ_mask->type;
+    m.shape[0] = n_kv;
+    m.shape[1] = n_rows;
+    m.shape[2] = n_tokens;
+
+    if (KQ_mask->type == GGML_TYPE_F16) {
+        whisper_kq_mask_pack<ggml_fp16_t>(m, (ggml_fp16_t *) m.data.data(), n_kv, n_tokens, n_rows, new_shape,
+                ggml_fp32_to_fp16(0.0f), ggml_fp32_to_fp16(-INFINITY));
+    } else {
+        whisper_kq_mask_pack<float>(m, (float *) m.data.data(), n_kv, n_tokens, n_rows, new_shape, 0.0f, -INFINITY);
     }
+
+    ggml_backend_tensor_set(KQ_mask, m.data.data(), 0, ggml_nbytes(KQ_mask));
 }
 
 static uint32_t whisper_kv_cache_get_padding(const struct whisper_context & wctx) {
@@ -1287,6 +2784,52 @@ static size_t aheads_masks_nbytes(struct whisper_aheads_masks & aheads_masks) {
     return size;
 }
 
+// the GPU with the given index among the GPU devices, as whisper_context_params.gpu_device
+static ggml_backend_dev_t whisper_gpu_dev_get(int index) {
+    int cnt = 0;
+    for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU || ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_IGPU) {
+            if (cnt++ == index) {
+                return dev;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// whether dev runs the flash attention of whisper (head size 64): the encoder self-attention with F16 K/V,
+// and the decoder attention with a K/V cache of type_kv and the KQ mask
+// backends without it (e.g. SYCL) would split every attention of the graphs off to the CPU
+static bool whisper_gpu_dev_supports_fattn(ggml_backend_dev_t dev, ggml_type type_kv) {
+    ggml_init_params iparams = {
+        /*.mem_size   =*/ 16*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx = ggml_init(iparams);
+
+    const int n_head = 8;
+
+    ggml_tensor * q_enc = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 64, 1500, n_head);
+    ggml_tensor * k_enc = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 64, 1536, n_head);
+    ggml_tensor * v_enc = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 64, 1536, n_head);
+
+    ggml_tensor * q_dec = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 64, 4, n_head);
+    ggml_tensor * k_dec = ggml_new_tensor_3d(ctx, type_kv, 64, 256, n_head);
+    ggml_tensor * v_dec = ggml_new_tensor_3d(ctx, type_kv, 64, 256, n_head);
+    ggml_tensor * mask  = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 256, GGML_PAD(4, GGML_KQ_MASK_PAD), 1);
+
+    const bool res =
+        ggml_backend_dev_supports_op(dev, ggml_flash_attn_ext(ctx, q_enc, k_enc, v_enc, nullptr, 0.125f, 0.0f, 0.0f)) &&
+        ggml_backend_dev_supports_op(dev, ggml_flash_attn_ext(ctx, q_dec, k_dec, v_dec, mask,    1.0f,   0.0f, 0.0f));
+
+    ggml_free(ctx);
+
+    return res;
+}
+
 static ggml_backend_t whisper_backend_init_gpu(const whisper_context_params & params) {
     ggml_log_set(g_state.log_callback, g_state.log_callback_user_data);
 
@@ -1358,10 +2901,64 @@ static std::vector<ggml_backend_t> whisper_backend_init(const whisper_context_pa
     return result;
 }
 
+typedef ggml_backend_reg_t (*whisper_rpc_add_server_t)(const char * endpoint);
+
+// the first device of the first server in params.rpc_servers that answers
+static ggml_backend_dev_t whisper_rpc_device_init(const whisper_context_params & params) {
+    ggml_backend_reg_t reg = ggml_backend_reg_by_name("RPC");
+    if (!reg) {
+        WHISPER_LOG_ERROR("%s: RPC servers given, but ggml was built without GGML_RPC\n", __func__);
+        return nullptr;
+    }
+
+    auto add_server = (whisper_rpc_add_server_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_rpc_add_server");
+    if (!add_server) {
+        WHISPER_LOG_ERROR("%s: the RPC backend does not export ggml_backend_rpc_add_server\n", __func__);
+        return nullptr;
+    }
+
+    const std::string servers = params.rpc_servers;
+
+    size_t pos = 0;
+    while (pos <= servers.size()) {
+        size_t end = servers.find(',', pos);
+        if (end == std::string::npos) {
+            end = servers.size();
+        }
+        const std::string endpoint = servers.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (endpoint.empty()) {
+            continue;
+        }
+
+        ggml_backend_reg_t server = add_server(endpoint.c_str());
+        if (!server || ggml_backend_reg_dev_count(server) == 0) {
+            WHISPER_LOG_WARN("%s: RPC server %s is not reachable\n", __func__, endpoint.c_str());
+            continue;
+        }
+
+        ggml_backend_dev_t dev = ggml_backend_reg_dev_get(server, 0);
+
+        size_t free  = 0;
+        size_t total = 0;
+        ggml_backend_dev_memory(dev, &free, &total);
+
+        WHISPER_LOG_INFO("%s: running the encoder on %s (%s, %zu of %zu MiB free)\n", __func__,
+                ggml_backend_dev_name(dev), endpoint.c_str(), free/1024/1024, total/1024/1024);
+
+        return dev;
+    }
+
+    WHISPER_LOG_ERROR("%s: none of the RPC servers '%s' is reachable\n", __func__, params.rpc_servers);
+
+    return nullptr;
+}
+
 using buft_list_t = std::vector<std::pair<ggml_backend_dev_t, ggml_backend_buffer_type_t>>;
 
 static buft_list_t make_buft_list(whisper_context_params & params) {
-    // Prio order: GPU -> CPU Extra -> CPU
+    // Prio order: GPU -> CPU NUMA -> CPU Extra -> CPU
     buft_list_t buft_list;
 
     // GPU
@@ -1384,12 +2981,18 @@ static buft_list_t make_buft_list(whisper_context_params & params) {
         }
     }
 
-    // CPU Extra
     auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+
+    // CPU NUMA replicas
+    if (params.numa_replicate && whisper_cpu_numa_buft()) {
+        buft_list.emplace_back(cpu_dev, whisper_cpu_numa_buft());
+    }
+
+    // CPU Extra
     auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
     auto get_extra_bufts_fn = (ggml_backend_dev_get_extra_bufts_t)
         ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_dev_get_extra_bufts");
-    if (get_extra_bufts_fn) {
+    if (params.use_extra_bufts && get_extra_bufts_fn) {
         ggml_backend_buffer_type_t * extra_bufts = get_extra_bufts_fn(cpu_dev);
         while (extra_bufts && *extra_bufts) {
             buft_list.emplace_back(cpu_dev, *extra_bufts);
@@ -1398,7 +3001,7 @@ static buft_list_t make_buft_list(whisper_context_params & params) {
     }
 
     // CPU
-    buft_list.emplace_back(cpu_dev, ggml_backend_cpu_buffer_type());
+    buft_list.emplace_back(cpu_dev, whisper_cpu_buft(params));
 
     return buft_list;
 }
@@ -1406,10 +3009,14 @@ static buft_list_t make_buft_list(whisper_context_params & params) {
 static bool weight_buft_supported(const whisper_hparams & hparams, ggml_tensor * w, ggml_op op, ggml_backend_buffer_type_t buft, ggml_backend_dev_t dev) {
     bool op_supported = true;
 
-    if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU ||
-        ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_IGPU ||
-        (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU && buft == ggml_backend_cpu_buffer_type())) {
-        // GPU and default CPU backend support all operators
+    const bool is_gpu = ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU ||
+                        ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_IGPU;
+
+    // the GPU backends have the matmuls and row gets of only some weight types (e.g. OpenCL: F16, Q4_0, Q8_0), a weight
+    // of another type is kept in host memory - on the GPU, the CPU would copy it back for every graph
+    if ((is_gpu && op != GGML_OP_MUL_MAT && op != GGML_OP_GET_ROWS) ||
+        (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU && (buft == ggml_backend_cpu_buffer_type() || buft == whisper_cpu_hugepage_buft()))) {
+        // default CPU backend supports all operators
         op_supported = true;
     } else {
         switch (op) {
@@ -1471,6296 +3078,12795 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
     return nullptr;
 }
 
-// load the model from a ggml file
-//
-// file format:
-//
-//   - hparams
-//   - pre-computed mel filters
-//   - vocab
-//   - weights
-//
-// see the convert-pt-to-ggml.py script for details
-//
-static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
-    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+// time of one MLP matmul of the encoder (n_enc frames) and of the decoder (one token) with the weights in buft
+static bool whisper_autotune_time(const whisper_hparams & hparams, ggml_type wtype, ggml_backend_buffer_type_t buft,
+        ggml_backend_t backend, whisper_threadpool & threadpool, int n_threads, int n_enc, double & t_enc, double & t_dec) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 8*ggml_tensor_overhead() + 2*ggml_graph_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
 
-    const int64_t t_start_us = ggml_time_us();
+    ggml_context_ptr ctx_w { ggml_init(params) };
+    ggml_context_ptr ctx_x { ggml_init(params) };
 
-    wctx.t_start_us = t_start_us;
+    ggml_tensor * w_enc = ggml_new_tensor_2d(ctx_w.get(), wtype, hparams.n_audio_state, 4*hparams.n_audio_state);
+    ggml_tensor * w_dec = ggml_new_tensor_2d(ctx_w.get(), wtype, hparams.n_text_state,  4*hparams.n_text_state);
 
-    auto & model = wctx.model;
-    auto & vocab = wctx.vocab;
+    ggml_tensor * x_enc = ggml_new_tensor_2d(ctx_x.get(), GGML_TYPE_F32, hparams.n_audio_state, n_enc);
+    ggml_tensor * x_dec = ggml_new_tensor_2d(ctx_x.get(), GGML_TYPE_F32, hparams.n_text_state,  1);
 
-    // verify magic
-    {
-        uint32_t magic;
-        read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
-            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
-            return false;
-        }
+    ggml_backend_buffer_ptr buf_w { ggml_backend_alloc_ctx_tensors_from_buft(ctx_w.get(), buft) };
+    ggml_backend_buffer_ptr buf_x { ggml_backend_alloc_ctx_tensors_from_buft(ctx_x.get(), ggml_backend_cpu_buffer_type()) };
+    if (!buf_w || !buf_x) {
+        return false;
     }
 
-    //load hparams
-    {
-        auto & hparams = model.hparams;
+    // the kernels do not depend on the values; zero weights are valid in every type
+    for (ggml_tensor * w : { w_enc, w_dec }) {
+        std::vector<uint8_t> zero(ggml_nbytes(w), 0);
+        ggml_backend_tensor_set(w, zero.data(), 0, zero.size());
+    }
+    for (ggml_tensor * x : { x_enc, x_dec }) {
+        std::vector<float> data(ggml_nelements(x), 0.01f);
+        ggml_backend_tensor_set(x, data.data(), 0, ggml_nbytes(x));
+    }
 
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.ftype);
+    ggml_cgraph * gf_enc = ggml_new_graph(ctx_x.get());
+    ggml_cgraph * gf_dec = ggml_new_graph(ctx_x.get());
 
-        assert(hparams.n_text_state == hparams.n_audio_state);
+    ggml_build_forward_expand(gf_enc, ggml_mul_mat(ctx_x.get(), w_enc, x_enc));
+    ggml_build_forward_expand(gf_dec, ggml_mul_mat(ctx_x.get(), w_dec, x_dec));
 
-        std::string mver = "";
+    // the results are not allocated yet
+    ggml_gallocr_ptr galloc { ggml_gallocr_new(ggml_backend_cpu_buffer_type()) };
 
-        if (hparams.n_audio_layer == 4) {
-            model.type = e_model::MODEL_TINY;
+    auto run = [&](ggml_cgraph * gf, int n_rep) -> double {
+        if (!ggml_gallocr_alloc_graph(galloc.get(), gf) || !ggml_graph_compute_helper(backend, threadpool, gf, n_threads)) {
+            return -1.0;
         }
 
-        if (hparams.n_audio_layer == 6) {
-            model.type = e_model::MODEL_BASE;
+        double best = DBL_MAX;
+        for (int i = 0; i < n_rep; ++i) {
+            const int64_t t0 = ggml_time_us();
+            ggml_graph_compute_helper(backend, threadpool, gf, n_threads);
+            best = std::min(best, (ggml_time_us() - t0)*1e-6);
         }
 
-        if (hparams.n_audio_layer == 12) {
-            model.type = e_model::MODEL_SMALL;
-        }
+        return best;
+    };
 
-        if (hparams.n_audio_layer == 24) {
-            model.type = e_model::MODEL_MEDIUM;
-        }
+    t_enc = run(gf_enc, 3);
+    t_dec = run(gf_dec, 16);
 
-        if (hparams.n_audio_layer == 32) {
-            model.type = e_model::MODEL_LARGE;
+    return t_enc >= 0.0 && t_dec >= 0.0;
+}
 
-            if (hparams.n_vocab == 51866) {
-                mver = " v3";
-            }
-        }
+// pick the CPU buffer type of the weights (plain or repacked) and the thread count for this host;
+// the result is cached in params.autotune_cache per CPU and model shape
+static void whisper_autotune(whisper_context & wctx, const whisper_hparams & hparams) {
+    const std::string path = wctx.params.autotune_cache;
 
-        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
+    ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
 
-        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
+    const std::string key = format("%s\t%d-%d-%d-%d-%s",
+            ggml_backend_dev_description(cpu_dev), hparams.n_audio_state, hparams.n_audio_layer,
+            hparams.n_text_state, hparams.n_text_layer, ggml_type_name(wctx.wtype));
 
-        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
-        // in order to save memory and also to speed up the computation
-        wctx.wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
-        if (wctx.wtype == GGML_TYPE_COUNT) {
-            WHISPER_LOG_ERROR("%s: invalid model (bad ftype value %d)\n", __func__, model.hparams.ftype);
-            return false;
+    // the cache has one line per key: <cpu> \t <model> \t <use_extra_bufts> \t <n_threads>
+    std::vector<std::string> lines;
+    {
+        std::ifstream fin(path);
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (line.compare(0, key.size() + 1, key + "\t") == 0) {
+                int extra = 0;
+                int n_threads = 0;
+                if (sscanf(line.c_str() + key.size() + 1, "%d\t%d", &extra, &n_threads) == 2 && n_threads > 0) {
+                    wctx.params.use_extra_bufts = wctx.params.use_extra_bufts && extra;
+                    wctx.n_threads_tuned = n_threads;
+                    WHISPER_LOG_INFO("%s: cached: extra buffer types = %d, n_threads = %d\n", __func__, extra, n_threads);
+                    return;
+                }
+                continue;
+            }
+            if (!line.empty()) {
+                lines.push_back(line);
+            }
         }
-
-        WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
-        WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
-        WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
-        WHISPER_LOG_INFO("%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
-        WHISPER_LOG_INFO("%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
-        WHISPER_LOG_INFO("%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
-        WHISPER_LOG_INFO("%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
-        WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
-        WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
-        WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
-        WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
-        WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
-        WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
     }
 
-    // load mel filters
+    // the candidates: the buffer type make_buft_list() picks first for the weights, and the plain CPU one
+    std::vector<ggml_backend_buffer_type_t> bufts;
     {
-        auto & filters = wctx.model.filters;
+        ggml_init_params params = {
+            /*.mem_size   =*/ ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context_ptr ctx { ggml_init(params) };
+        ggml_tensor * w = ggml_new_tensor_2d(ctx.get(), wctx.wtype, hparams.n_audio_state, 4*hparams.n_audio_state);
+
+        for (const auto & p : make_buft_list(wctx.params)) {
+            if (p.first == cpu_dev && weight_buft_supported(hparams, w, GGML_OP_MUL_MAT, p.second, p.first)) {
+                bufts.push_back(p.second);
+                break;
+            }
+        }
+        if (bufts.empty() || bufts[0] != whisper_cpu_buft(wctx.params)) {
+            bufts.push_back(whisper_cpu_buft(wctx.params));
+        }
+    }
 
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
+    const int n_hw = std::max(1, (int) std::thread::hardware_concurrency());
 
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
+    std::vector<int> threads;
+    for (int n = 1; n < n_hw; n *= 2) {
+        threads.push_back(n);
     }
+    threads.push_back(n_hw);
 
-    // load vocab
-    {
-        int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
+    ggml_backend_ptr   backend { ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr) };
+    whisper_threadpool threadpool;
 
-        //if (n_vocab != model.hparams.n_vocab) {
-        //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
-        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
-        //    return false;
-        //}
+    const int n_enc = std::min(256, hparams.n_audio_ctx);
 
-        std::string word;
-        std::vector<char> tmp;
+    // cost of a 30 s window: the encoder over n_audio_ctx frames and about 100 decoded tokens
+    const double w_enc = double(hparams.n_audio_ctx)/n_enc;
+    const double w_dec = 100.0;
 
-        tmp.reserve(128);
+    double best      = DBL_MAX;
+    int    best_buft = 0;
+    int    best_nt   = std::min(4, n_hw);
 
-        for (int i = 0; i < n_vocab; i++) {
-            uint32_t len;
-            read_safe(loader, len);
+    const int64_t t_start_us = ggml_time_us();
 
-            if (len > 0) {
-                tmp.resize(len);
-                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
-            } else {
-                // seems like we have an empty-string token in multi-language models (i = 50256)
-                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
+    for (int ib = 0; ib < (int) bufts.size(); ++ib) {
+        for (int nt : threads) {
+            double t_enc = 0.0;
+            double t_dec = 0.0;
+            if (!whisper_autotune_time(hparams, wctx.wtype, bufts[ib], backend.get(), threadpool, nt, n_enc, t_enc, t_dec)) {
+                continue;
             }
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            const double t = w_enc*t_enc + w_dec*t_dec;
 
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+            WHISPER_LOG_DEBUG("%s: %-12s n_threads = %3d: enc %8.3f ms, dec %8.3f ms\n", __func__,
+                    ggml_backend_buft_name(bufts[ib]), nt, 1e3*t_enc, 1e3*t_dec);
+
+            if (t < best) {
+                best      = t;
+                best_buft = ib;
+                best_nt   = nt;
+            }
         }
+    }
 
-        vocab.n_vocab = model.hparams.n_vocab;
-        if (vocab.is_multilingual()) {
-            vocab.token_eot++;
-            vocab.token_sot++;
+    const bool extra = bufts[best_buft] != whisper_cpu_buft(wctx.params);
 
-            // account for variable number of language tokens
-            const int dt = vocab.num_languages() - 98;
+    wctx.params.use_extra_bufts = extra;
+    wctx.n_threads_tuned = best_nt;
 
-            vocab.token_translate  += dt;
-            vocab.token_transcribe += dt;
-            vocab.token_solm       += dt;
-            vocab.token_prev       += dt;
-            vocab.token_nosp       += dt;
-            vocab.token_not        += dt;
-            vocab.token_beg        += dt;
-        }
+    WHISPER_LOG_INFO("%s: extra buffer types = %d, n_threads = %d (%.0f ms)\n", __func__,
+            extra, best_nt, (ggml_time_us() - t_start_us)/1e3);
 
-        if (n_vocab < model.hparams.n_vocab) {
-            WHISPER_LOG_INFO("%s: adding %d extra tokens\n", __func__, model.hparams.n_vocab - n_vocab);
-            for (int i = n_vocab; i < model.hparams.n_vocab; i++) {
-                if (i > vocab.token_beg) {
-                    word = "[_TT_" + std::to_string(i - vocab.token_beg) + "]";
-                } else if (i == vocab.token_eot) {
-                    word = "[_EOT_]";
-                } else if (i == vocab.token_sot) {
-                    word = "[_SOT_]";
-                } else if (i == vocab.token_translate) {
-                    word = "[_TRANSLATE_]";
-                } else if (i == vocab.token_transcribe) {
-                    word = "[_TRANSCRIBE_]";
-                } else if (i == vocab.token_solm) {
-                    word = "[_SOLM_]";
-                } else if (i == vocab.token_prev) {
-                    word = "[_PREV_]";
-                } else if (i == vocab.token_nosp) {
-                    word = "[_NOSP_]";
-                } else if (i == vocab.token_not) {
-                    word = "[_NOT_]";
-                } else if (i == vocab.token_beg) {
-                    word = "[_BEG_]";
-                } else if (i > vocab.token_sot && i <= vocab.token_sot + vocab.num_languages()) {
-                    word = "[_LANG_" + std::string(whisper_lang_str(i - vocab.token_sot - 1)) + "]";
-                } else {
-                    word = "[_extra_token_" + std::to_string(i) + "]";
-                }
-                vocab.token_to_id[word] = i;
-                vocab.id_to_token[i] = word;
-            }
-        }
+    lines.push_back(format("%s\t%d\t%d", key.c_str(), extra ? 1 : 0, best_nt));
 
-        WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
+    std::ofstream fout(path);
+    for (const auto & line : lines) {
+        fout << line << "\n";
     }
+    if (!fout) {
+        WHISPER_LOG_WARN("%s: failed to write the autotune cache '%s'\n", __func__, path.c_str());
+    }
+}
 
-    const ggml_type wtype = wctx.wtype;
-    const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
-
-    const auto & hparams = model.hparams;
-
-    const int n_audio_layer = hparams.n_audio_layer;
-    const int n_text_layer  = hparams.n_text_layer;
-
-    const size_t n_tensors = 10 /* input */ + 15 + 15*n_audio_layer + 24*n_text_layer;
-
-    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
-    auto get_ctx = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
-        auto it = ctx_map.find(buft);
-        if (it == ctx_map.end()) {
-            ggml_init_params params = {
-                /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
-                /*.mem_buffer =*/ nullptr,
-                /*.no_alloc   =*/ true,
-            };
-
-            ggml_context * ctx = ggml_init(params);
-            if (!ctx) {
-                throw std::runtime_error("failed to create ggml context");
-            }
-
-            ctx_map[buft] = ctx;
-            model.ctxs.emplace_back(ctx);
-
-            return ctx;
+// load the model from a ggml file
+//
+// file format:
+//
+//   - hparams
+//   - pre-computed mel filters
+//   - vocab
+//   - weights
+//
+// see the convert-pt-to-ggml.py script for details
+//
+// Calls fn(name, type, ne, data, nbytes) for the tensor records that follow the reader position,
+// without moving the reader. Stops at the end of the mapping or at the first malformed record.
+template <typename F>
+static void whisper_mmap_for_each_tensor(const whisper_mmap_reader & reader, F && fn) {
+    const whisper_mmap & map = *reader.map;
+
+    size_t pos = reader.pos;
+    auto get = [&](int32_t & v) {
+        if (map.size - pos < sizeof(v)) {
+            return false;
         }
-
-        return it->second;
+        memcpy(&v, map.addr + pos, sizeof(v));
+        pos += sizeof(v);
+        return true;
     };
 
-    // Create a list of available bufts, in priority order
-    buft_list_t buft_list = make_buft_list(wctx.params);
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+        if (!get(n_dims) || !get(length) || !get(ttype)) {
+            break;
+        }
+        if (n_dims < 1 || n_dims > 4 || length < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT) {
+            break;
+        }
 
-    auto create_tensor = [&](asr_tensor type, asr_system system, ggml_tensor * meta, int layer = 0) -> ggml_tensor * {
-        ggml_op op = ASR_TENSOR_INFO.at(type);
-        ggml_backend_buffer_type_t buft = select_weight_buft(hparams, meta, op, buft_list);
-        if (!buft) {
-            throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", ASR_TENSOR_NAMES.at(system).at(type)));
+        int64_t ne[4] = { 1, 1, 1, 1 };
+        bool ok = true;
+        for (int i = 0; i < n_dims && ok; ++i) {
+            int32_t v;
+            ok = get(v) && v >= 0;
+            ne[i] = v;
+        }
+        if (!ok || map.size - pos < (size_t) length) {
+            break;
         }
 
-        ggml_context * ctx = get_ctx(buft);
-        ggml_tensor * tensor = ggml_dup_tensor(ctx, meta);
+        const std::string name((const char *) map.addr + pos, length);
+        pos += length;
 
-        model.tensors[format(ASR_TENSOR_NAMES.at(system).at(type), layer)] = tensor;
+        const size_t nbytes = ggml_row_size(ggml_type(ttype), ne[0])*ne[1]*ne[2]*ne[3];
+        if (map.size - pos < nbytes) {
+            break;
+        }
 
-        return tensor;
-    };
+        fn(name, ggml_type(ttype), ne, map.addr + pos, nbytes);
 
+        pos += nbytes;
+    }
+}
 
-    // prepare tensors for the weights
-    {
-        ggml_init_params params = {
-            /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
-            /*.mem_buffer =*/ nullptr,
-            /*.no_alloc   =*/ true,
-        };
+// GGUF models keep the hparams, mel filters and vocab as metadata (keys below, written by the quantize tool)
+// and align the tensor data, so the weights can always be used in place from a mapping
+static const char * WHISPER_GGUF_ARCH = "whisper";
 
-        ggml_context * ctx = ggml_init(params);
+// Calls fn(name, type, ne, data, nbytes) for the tensors of a GGUF file whose data starts at base
+// (base may be null to only list them). Tensors past size are skipped.
+template <typename F>
+static void whisper_gguf_for_each_tensor(const gguf_context * gguf, const ggml_context * meta, uint8_t * base, size_t size, F && fn) {
+    const size_t data_offset = gguf_get_data_offset(gguf);
 
-        const auto & hparams = model.hparams;
+    for (int64_t i = 0; i < gguf_get_n_tensors(gguf); ++i) {
+        const char * name = gguf_get_tensor_name(gguf, i);
+        const ggml_tensor * t = ggml_get_tensor(const_cast<ggml_context *>(meta), name);
 
-        const int n_vocab = hparams.n_vocab;
+        const size_t offs   = data_offset + gguf_get_tensor_offset(gguf, i);
+        const size_t nbytes = gguf_get_tensor_size(gguf, i);
+        if (t == nullptr || (base && (offs > size || size - offs < nbytes))) {
+            continue;
+        }
 
-        const int n_audio_ctx   = hparams.n_audio_ctx;
-        const int n_audio_state = hparams.n_audio_state;
-        const int n_audio_layer = hparams.n_audio_layer;
+        fn(std::string(name), t->type, t->ne, base ? base + offs : nullptr, nbytes);
+    }
+}
 
-        const int n_text_ctx   = hparams.n_text_ctx;
-        const int n_text_state = hparams.n_text_state;
-        const int n_text_layer = hparams.n_text_layer;
+static bool whisper_gguf_get_i32(const gguf_context * gguf, const char * key, int32_t & dst) {
+    const int64_t id = gguf_find_key(gguf, key);
+    if (id < 0) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found in model file\n", __func__, key);
+        return false;
+    }
 
-        const int n_mels = hparams.n_mels;
+    switch (gguf_get_kv_type(gguf, id)) {
+        case GGUF_TYPE_UINT8:  dst = gguf_get_val_u8 (gguf, id); break;
+        case GGUF_TYPE_INT8:   dst = gguf_get_val_i8 (gguf, id); break;
+        case GGUF_TYPE_UINT16: dst = gguf_get_val_u16(gguf, id); break;
+        case GGUF_TYPE_INT16:  dst = gguf_get_val_i16(gguf, id); break;
+        case GGUF_TYPE_UINT32: dst = gguf_get_val_u32(gguf, id); break;
+        case GGUF_TYPE_INT32:  dst = gguf_get_val_i32(gguf, id); break;
+        default:
+            WHISPER_LOG_ERROR("%s: key '%s' has type %s, expected an integer\n", __func__, key, gguf_type_name(gguf_get_kv_type(gguf, id)));
+            return false;
+    }
 
-        model.layers_encoder.resize(n_audio_layer);
-        model.layers_decoder.resize(n_text_layer);
+    return true;
+}
 
-        // encoder
-        model.e_pe = create_tensor(ASR_TENSOR_ENC_POS_EMBD, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_audio_state, n_audio_ctx));
+// Points the CPU weights in cpu_ctx at their bytes in the mapping. The legacy ggml format
+// does not pad tensor data, so tensors that are not naturally aligned in the
+// file are left to the regular (copying) path.
+static ggml_backend_buffer_t whisper_mmap_bind_tensors(const whisper_mmap_reader & reader, const gguf_context * gguf, const ggml_context * gguf_meta,
+        ggml_context * cpu_ctx, whisper_model & model) {
+#if defined(WHISPER_BIG_ENDIAN)
+    // the weights need byte swapping
+    GGML_UNUSED(reader);
+    GGML_UNUSED(gguf);
+    GGML_UNUSED(gguf_meta);
+    GGML_UNUSED(cpu_ctx);
+    GGML_UNUSED(model);
+    return nullptr;
+#else
+    const whisper_mmap & map = *reader.map;
 
-        model.e_conv_1_w = create_tensor(ASR_TENSOR_CONV1_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_3d(ctx, vtype, 3, n_mels, n_audio_state));
-        model.e_conv_1_b = create_tensor(ASR_TENSOR_CONV1_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state));
+    std::set<const ggml_tensor *> on_cpu;
+    for (ggml_tensor * t = ggml_get_first_tensor(cpu_ctx); t != nullptr; t = ggml_get_next_tensor(cpu_ctx, t)) {
+        on_cpu.insert(t);
+    }
 
-        model.e_conv_2_w = create_tensor(ASR_TENSOR_CONV2_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_3d(ctx, vtype, 3, n_audio_state, n_audio_state));
-        model.e_conv_2_b = create_tensor(ASR_TENSOR_CONV2_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state));
+    ggml_backend_buffer_t buf = ggml_backend_cpu_buffer_from_ptr(map.addr, map.size);
+    if (!buf) {
+        return nullptr;
+    }
 
-        model.e_ln_w = create_tensor(ASR_TENSOR_LN_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state));
-        model.e_ln_b = create_tensor(ASR_TENSOR_LN_POST_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state));
+    int    n_bound    = 0;
+    size_t size_bound = 0;
 
-        for (int i = 0; i < n_audio_layer; ++i) {
-            auto & layer = model.layers_encoder[i];
+    auto bind = [&](const std::string & name, ggml_type ttype, const int64_t * /*ne*/, uint8_t * data, size_t nbytes) {
+        const auto it = model.tensors.find(name);
+        if (it == model.tensors.end()) {
+            return;
+        }
 
-            layer.mlp_ln_w = create_tensor(ASR_TENSOR_MLP_LN_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
-            layer.mlp_ln_b = create_tensor(ASR_TENSOR_MLP_LN_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state), i);
+        ggml_tensor * tensor = it->second;
 
-            layer.mlp_0_w = create_tensor(ASR_TENSOR_MLP_0_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, n_audio_state, 4*n_audio_state), i);
-            layer.mlp_0_b = create_tensor(ASR_TENSOR_MLP_0_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_audio_state), i);
+        // f32 is read as float, f16 and the quant blocks start with a 16-bit scale
+        const size_t align = ggml_type_size(tensor->type) >= 4 && !ggml_is_quantized(tensor->type) ? 4 : 2;
 
-            layer.mlp_1_w = create_tensor(ASR_TENSOR_MLP_2_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, 4*n_audio_state, n_audio_state), i);
-            layer.mlp_1_b = create_tensor(ASR_TENSOR_MLP_2_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state), i);
+        if (on_cpu.count(tensor) && tensor->view_src == nullptr && tensor->type == ttype && ggml_nbytes(tensor) == nbytes &&
+            (uintptr_t) data % align == 0 && ggml_backend_tensor_alloc(buf, tensor, data) == GGML_STATUS_SUCCESS) {
+            n_bound++;
+            size_bound += nbytes;
+        }
+    };
 
-            layer.attn_ln_0_w = create_tensor(ASR_TENSOR_ATTN_LN_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
-            layer.attn_ln_0_b = create_tensor(ASR_TENSOR_ATTN_LN_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
+    if (gguf) {
+        whisper_gguf_for_each_tensor(gguf, gguf_meta, map.addr, map.size, bind);
+    } else {
+        whisper_mmap_for_each_tensor(reader, bind);
+    }
 
-            layer.attn_q_w = create_tensor(ASR_TENSOR_ATTN_QUERY_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, n_audio_state, n_audio_state), i);
-            layer.attn_q_b = create_tensor(ASR_TENSOR_ATTN_QUERY_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
+    if (n_bound == 0) {
+        ggml_backend_buffer_free(buf);
+        return nullptr;
+    }
 
-            layer.attn_k_w = create_tensor(ASR_TENSOR_ATTN_KEY_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, n_audio_state, n_audio_state), i);
+    WHISPER_LOG_INFO("%s: %d tensors (%.2f MB) used in place from the mapped file\n", __func__, n_bound, size_bound/1e6);
 
-            layer.attn_v_w = create_tensor(ASR_TENSOR_ATTN_VALUE_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, n_audio_state, n_audio_state), i);
-            layer.attn_v_b = create_tensor(ASR_TENSOR_ATTN_VALUE_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
+    return buf;
+#endif
+}
 
-            layer.attn_ln_1_w = create_tensor(ASR_TENSOR_ATTN_OUT_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, n_audio_state, n_audio_state), i);
-            layer.attn_ln_1_b = create_tensor(ASR_TENSOR_ATTN_OUT_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
-        }
+// the types type_weights and tensor_types convert weights to: no importance matrix needed
+static bool whisper_weight_type_supported(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F16:
+        case GGML_TYPE_BF16:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q6_K:
+        case GGML_TYPE_Q5_K:
+        case GGML_TYPE_Q4_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_IQ4_NL:
+            return true;
+        default:
+            return false;
+    }
+}
 
-        // decoder
-        model.d_pe = create_tensor(ASR_TENSOR_DEC_POS_EMBD, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_text_state, n_text_ctx));
+// parses tensor_types ("REGEX=TYPE,REGEX=TYPE"); false on an invalid regex or an unknown or unsupported type
+static bool whisper_parse_tensor_types(const char * spec, std::vector<std::pair<std::regex, ggml_type>> & out) {
+    std::stringstream ss(spec ? spec : "");
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) {
+            continue;
+        }
 
-        model.d_te = create_tensor(ASR_TENSOR_DEC_TOKEN_EMBD_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_vocab));
+        const size_t pos = item.rfind('=');
+        const std::string name = pos == std::string::npos ? "" : item.substr(pos + 1);
 
-        model.d_ln_w = create_tensor(ASR_TENSOR_LN_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state));
-        model.d_ln_b = create_tensor(ASR_TENSOR_LN_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state));
+        ggml_type type = GGML_TYPE_COUNT;
+        for (int t = 0; t < GGML_TYPE_COUNT; ++t) {
+            if (name == ggml_type_name((ggml_type) t)) {
+                type = (ggml_type) t;
+                break;
+            }
+        }
+        if (type == GGML_TYPE_COUNT || !whisper_weight_type_supported(type)) {
+            WHISPER_LOG_ERROR("%s: invalid tensor type override '%s', expected REGEX=TYPE\n", __func__, item.c_str());
+            return false;
+        }
 
-        for (int i = 0; i < n_text_layer; ++i) {
-            auto & layer = model.layers_decoder[i];
+        try {
+            out.emplace_back(std::regex(item.substr(0, pos)), type);
+        } catch (const std::regex_error & e) {
+            WHISPER_LOG_ERROR("%s: invalid regex in tensor type override '%s': %s\n", __func__, item.c_str(), e.what());
+            return false;
+        }
+    }
+    return true;
+}
 
-            layer.mlp_ln_w = create_tensor(ASR_TENSOR_MLP_LN_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
-            layer.mlp_ln_b = create_tensor(ASR_TENSOR_MLP_LN_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+// writes the F32/F16/BF16 data of a weight at src to tensor, converted to its type (type_weights); the rows are
+// spread over threads and go straight into host memory, else through a staging copy
+static void whisper_convert_weight(ggml_tensor * tensor, ggml_type src_type, const uint8_t * src) {
+    const int64_t n_per_row = tensor->ne[0];
+    const int64_t n_rows    = ggml_nrows(tensor);
+    const size_t  src_row   = ggml_row_size(src_type, n_per_row);
+    const size_t  dst_row   = ggml_row_size(tensor->type, n_per_row);
+
+    const bool host = ggml_backend_buffer_is_host(tensor->buffer);
+
+    std::vector<uint8_t> staging(host ? 0 : ggml_nbytes(tensor));
+    uint8_t * dst = host ? (uint8_t *) tensor->data : staging.data();
+
+    ggml_quantize_init(tensor->type);
+
+    const int64_t n_chunk   = std::max<int64_t>(1, 65536/n_per_row); // rows per task
+    const int     n_threads = (int) std::max<int64_t>(1, std::min<int64_t>({ 8, (int64_t) std::thread::hardware_concurrency(), (n_rows + n_chunk - 1)/n_chunk }));
+
+    std::atomic<int64_t> next(0);
+    auto convert = [&]() {
+        std::vector<float> f32(n_chunk*n_per_row);
+        for (int64_t r0 = next.fetch_add(n_chunk); r0 < n_rows; r0 = next.fetch_add(n_chunk)) {
+            const int64_t n = std::min(n_chunk, n_rows - r0);
+            const uint8_t * s = src + r0*src_row;
+            switch (src_type) {
+                case GGML_TYPE_F16:  ggml_fp16_to_fp32_row((const ggml_fp16_t *) s, f32.data(), n*n_per_row); break;
+                case GGML_TYPE_BF16: ggml_bf16_to_fp32_row((const ggml_bf16_t *) s, f32.data(), n*n_per_row); break;
+                default:             memcpy(f32.data(), s, n*src_row); break;
+            }
+            ggml_quantize_chunk(tensor->type, f32.data(), dst + r0*dst_row, 0, n, n_per_row, nullptr);
+        }
+    };
 
-            layer.mlp_0_w = create_tensor(ASR_TENSOR_MLP_0_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, 4*n_text_state), i);
-            layer.mlp_0_b = create_tensor(ASR_TENSOR_MLP_0_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_text_state), i);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(convert);
+    }
+    convert();
+    for (auto & w : workers) {
+        w.join();
+    }
 
-            layer.mlp_1_w = create_tensor(ASR_TENSOR_MLP_2_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, 4*n_text_state, n_text_state), i);
-            layer.mlp_1_b = create_tensor(ASR_TENSOR_MLP_2_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+    if (!host) {
+        ggml_backend_tensor_set(tensor, staging.data(), 0, staging.size());
+    }
+}
 
-            layer.attn_ln_0_w = create_tensor(ASR_TENSOR_ATTN_LN_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
-            layer.attn_ln_0_b = create_tensor(ASR_TENSOR_ATTN_LN_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+// a weight that is copied out of the mapped model file
+struct whisper_load_job {
+    ggml_tensor   * tensor;
+    const uint8_t * src;
+};
 
-            layer.attn_q_w = create_tensor(ASR_TENSOR_ATTN_QUERY_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
-            layer.attn_q_b = create_tensor(ASR_TENSOR_ATTN_QUERY_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+// uploads the weights of one device in chunks through pinned staging buffers: the copy of a chunk out of the
+// mapping (i.e. the disk read) overlaps with the asynchronous transfer of the previous chunks
+static void whisper_load_device(ggml_backend_dev_t dev, const std::vector<whisper_load_job> & jobs) {
+    const size_t n_staging  = 4;
+    const size_t chunk_size = 16u*1024*1024;
 
-            layer.attn_k_w = create_tensor(ASR_TENSOR_ATTN_KEY_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
+    ggml_backend_dev_props props;
+    ggml_backend_dev_get_props(dev, &props);
 
-            layer.attn_v_w = create_tensor(ASR_TENSOR_ATTN_VALUE_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
-            layer.attn_v_b = create_tensor(ASR_TENSOR_ATTN_VALUE_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+    ggml_backend_buffer_type_t host_buft = props.caps.async && props.caps.events ? ggml_backend_dev_host_buffer_type(dev) : nullptr;
+    ggml_backend_t backend = host_buft ? ggml_backend_dev_init(dev, nullptr) : nullptr;
 
-            layer.attn_ln_1_w = create_tensor(ASR_TENSOR_ATTN_OUT_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
-            layer.attn_ln_1_b = create_tensor(ASR_TENSOR_ATTN_OUT_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+    std::vector<ggml_backend_buffer_t> staging;
+    std::vector<ggml_backend_event_t>  events;
 
-            layer.cross_attn_ln_0_w = create_tensor(ASR_TENSOR_ATTN_LN_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
-            layer.cross_attn_ln_0_b = create_tensor(ASR_TENSOR_ATTN_LN_BIAS, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+    for (size_t i = 0; backend && i < n_staging; ++i) {
+        ggml_backend_buffer_t buf = ggml_backend_buft_alloc_buffer(host_buft, chunk_size);
+        ggml_backend_event_t  ev  = ggml_backend_event_new(dev);
+        if (!buf || !ev) {
+            if (buf) {
+                ggml_backend_buffer_free(buf);
+            }
+            if (ev) {
+                ggml_backend_event_free(ev);
+            }
+            break;
+        }
+        ggml_backend_event_record(ev, backend);
+        staging.push_back(buf);
+        events.push_back(ev);
+    }
 
-            layer.cross_attn_q_w = create_tensor(ASR_TENSOR_ATTN_QUERY_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
-            layer.cross_attn_q_b = create_tensor(ASR_TENSOR_ATTN_QUERY_BIAS, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+    if (staging.empty()) {
+        // synchronous uploads straight from the mapping
+        for (const auto & job : jobs) {
+            ggml_backend_tensor_set(job.tensor, job.src, 0, ggml_nbytes(job.tensor));
+        }
+    } else {
+        size_t idx = 0;
+        for (const auto & job : jobs) {
+            const size_t nbytes = ggml_nbytes(job.tensor);
+            for (size_t offs = 0; offs < nbytes; offs += chunk_size) {
+                const size_t n = std::min(chunk_size, nbytes - offs);
 
-            layer.cross_attn_k_w = create_tensor(ASR_TENSOR_ATTN_KEY_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
+                ggml_backend_event_synchronize(events[idx]);
 
-            layer.cross_attn_v_w = create_tensor(ASR_TENSOR_ATTN_VALUE_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
-            layer.cross_attn_v_b = create_tensor(ASR_TENSOR_ATTN_VALUE_BIAS, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+                void * dst = ggml_backend_buffer_get_base(staging[idx]);
+                memcpy(dst, job.src + offs, n);
+                ggml_backend_tensor_set_async(backend, job.tensor, dst, offs, n);
+                ggml_backend_event_record(events[idx], backend);
 
-            layer.cross_attn_ln_1_w = create_tensor(ASR_TENSOR_ATTN_OUT_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
-            layer.cross_attn_ln_1_b = create_tensor(ASR_TENSOR_ATTN_OUT_BIAS, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+                idx = (idx + 1) % staging.size();
+            }
         }
+        ggml_backend_synchronize(backend);
+    }
 
-        ggml_free(ctx);
+    for (auto * ev : events) {
+        ggml_backend_event_free(ev);
+    }
+    for (auto * buf : staging) {
+        ggml_backend_buffer_free(buf);
+    }
+    if (backend) {
+        ggml_backend_free(backend);
     }
+}
 
-    // allocate tensors in the backend buffers
-    for (auto & p : ctx_map) {
-        ggml_backend_buffer_type_t buft = p.first;
-        ggml_context * ctx = p.second;
-        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
-        if (buf) {
-            model.buffers.emplace_back(buf);
+// copies the weights that are not used in place out of the mapping: host buffers are filled by several threads
+// (parallel page faults keep a fast disk busy), each device is fed by a thread of its own
+static void whisper_load_from_mapping(const std::vector<whisper_load_job> & jobs) {
+    std::vector<whisper_load_job> host;
+    std::map<ggml_backend_dev_t, std::vector<whisper_load_job>> devices;
 
-            size_t size_main = ggml_backend_buffer_get_size(buf);
-            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), size_main / 1e6);
+    for (const auto & job : jobs) {
+        if (ggml_backend_buffer_is_host(job.tensor->buffer)) {
+            host.push_back(job);
+        } else {
+            devices[ggml_backend_buft_get_device(ggml_backend_buffer_get_type(job.tensor->buffer))].push_back(job);
         }
     }
 
-    // load weights
-    {
-        size_t total_size = 0;
+    std::vector<std::thread> workers;
+    for (const auto & dev : devices) {
+        workers.emplace_back(whisper_load_device, dev.first, std::cref(dev.second));
+    }
 
-        model.n_loaded = 0;
+    const int n_threads = std::max(1, std::min(8, (int) std::thread::hardware_concurrency()) - (int) devices.size());
 
-        std::vector<char> read_buf;
+    std::atomic<size_t> next(0);
+    auto copy_host = [&]() {
+        for (size_t i = next++; i < host.size(); i = next++) {
+            ggml_tensor * tensor = host[i].tensor;
+            memcpy(tensor->data, host[i].src, ggml_nbytes(tensor));
+            BYTESWAP_TENSOR(tensor);
+        }
+    };
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+    for (int i = 1; i < n_threads && (size_t) i < host.size(); ++i) {
+        workers.emplace_back(copy_host);
+    }
+    copy_host();
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+    for (auto & w : workers) {
+        w.join();
+    }
+}
 
-            if (loader->eof(loader->context)) {
-                break;
-            }
+// blocks until the weights that progressive_load copies in the background are in
+// the conv and encoder graphs do not need them, the cross and decoder graphs do
+static void whisper_model_wait(const whisper_model & model) {
+    if (model.pending.valid()) {
+        std::shared_future<void> pending = model.pending;
+        pending.wait();
+    }
+}
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
+// ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+// sorted_ids and token_flags, once all the token texts are in
+static void whisper_vocab_init_index(whisper_vocab & vocab) {
+    const int n = vocab.n_tokens();
+
+    std::vector<whisper_vocab::id> ids(n);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::stable_sort(ids.begin(), ids.end(), [&](whisper_vocab::id a, whisper_vocab::id b) {
+        return vocab.compare(a, vocab.token_str(b), vocab.token_len(b)) < 0;
+    });
+
+    vocab.sorted_ids.clear();
+    vocab.sorted_ids.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        if (i + 1 < n && vocab.compare(ids[i], vocab.token_str(ids[i + 1]), vocab.token_len(ids[i + 1])) == 0) {
+            continue; // a later id has the same text
+        }
+        vocab.sorted_ids.push_back(ids[i]);
+    }
+
+    vocab.token_space = vocab.find(" ");
+
+    vocab.token_flags.assign(n, 0);
+    for (int i = 0; i < n; ++i) {
+        uint8_t flags = 0;
+        if (i >= vocab.token_eot) flags |= whisper_vocab::TOKEN_SPECIAL;
+        if (i >= vocab.token_beg) flags |= whisper_vocab::TOKEN_TIMESTAMP;
+        if (vocab.token_str(i)[0] == ' ') flags |= whisper_vocab::TOKEN_SPACE;
+        vocab.token_flags[i] = flags;
+    }
+
+    for (const std::string & token : non_speech_tokens) {
+        for (const std::string & text : { token, " " + token }) {
+            const whisper_vocab::id i = vocab.find(text);
+            if (i >= 0) {
+                vocab.token_flags[i] |= whisper_vocab::TOKEN_NON_SPEECH;
             }
+        }
+    }
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+    // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+    for (const char * text : { " -", " '" }) {
+        const whisper_vocab::id i = vocab.find(text);
+        if (i >= 0) {
+            vocab.token_flags[i] |= whisper_vocab::TOKEN_NON_SPEECH;
+        }
+    }
+}
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
+static void whisper_vocab_init_trie(whisper_vocab & vocab) {
+    // sorted_ids is ordered by text, so the children of every node are created in increasing byte order
+    // and a new byte only has to be compared with the last child
+    std::vector<whisper_vocab::id> token(1, -1);
+    std::vector<std::vector<whisper_vocab::trie_edge>> children(1);
+
+    for (const whisper_vocab::id id : vocab.sorted_ids) {
+        const char * text = vocab.token_str(id);
+        const size_t len  = vocab.token_len(id);
+
+        uint32_t node = 0;
+        for (size_t k = 0; k < len; ++k) {
+            const uint8_t byte = text[k];
+            auto & edges = children[node];
+            if (edges.empty() || edges.back().byte != byte) {
+                edges.push_back({ byte, (uint32_t) token.size() });
+                token.push_back(-1);
+                children.emplace_back();
             }
+            node = children[node].back().node;
+        }
+        token[node] = id;
+    }
 
-            auto tensor = model.tensors[name.data()];
+    vocab.trie_nodes.resize(token.size());
+    vocab.trie_edges.clear();
+    vocab.trie_edges.reserve(token.size() - 1);
 
-            if (ggml_nelements(tensor) != nelements) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+    for (size_t i = 0; i < token.size(); ++i) {
+        vocab.trie_nodes[i].token   = token[i];
+        vocab.trie_nodes[i].first   = vocab.trie_edges.size();
+        vocab.trie_nodes[i].n_edges = children[i].size();
+        vocab.trie_edges.insert(vocab.trie_edges.end(), children[i].begin(), children[i].end());
+    }
+}
+
+static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
+    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    wctx.t_start_us = t_start_us;
+    whisper_cpu_barrier_stats(wctx.barrier_stats0);
+
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
+
+    // GGUF metadata, the loader still reads the tensor data
+    gguf_context_ptr gguf;
+    ggml_context_ptr gguf_meta;
+
+    // verify magic
+    {
+        uint32_t magic;
+        read_safe(loader, magic);
+
+        if (memcmp(&magic, GGUF_MAGIC, sizeof(magic)) == 0) {
+            if (wctx.path_model.empty()) {
+                WHISPER_LOG_ERROR("%s: GGUF models can only be loaded from a file\n", __func__);
                 return false;
             }
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+            ggml_context * meta = nullptr;
+            gguf.reset(gguf_init_from_file(wctx.path_model.c_str(), { /*.no_alloc =*/ true, /*.ctx =*/ &meta }));
+            gguf_meta.reset(meta);
+            if (!gguf) {
+                WHISPER_LOG_ERROR("%s: failed to read the GGUF metadata of '%s'\n", __func__, wctx.path_model.c_str());
                 return false;
             }
 
-            const size_t bpe = ggml_type_size(ggml_type(ttype));
-
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+            const int64_t id_arch = gguf_find_key(gguf.get(), "general.architecture");
+            if (id_arch < 0 || gguf_get_kv_type(gguf.get(), id_arch) != GGUF_TYPE_STRING ||
+                strcmp(gguf_get_val_str(gguf.get(), id_arch), WHISPER_GGUF_ARCH) != 0) {
+                WHISPER_LOG_ERROR("%s: '%s' is not a whisper GGUF model\n", __func__, wctx.path_model.c_str());
                 return false;
             }
+        } else if (magic != GGML_FILE_MAGIC) {
+            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
+            return false;
+        }
+    }
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+    //load hparams
+    {
+        auto & hparams = model.hparams;
 
-                loader->read(loader->context, read_buf.data(), read_buf.size());
+        if (gguf) {
+            const gguf_context * g = gguf.get();
 
-                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+            int32_t qntvr = 0;
+            if (gguf_find_key(g, "general.quantization_version") >= 0 && !whisper_gguf_get_i32(g, "general.quantization_version", qntvr)) {
+                return false;
             }
 
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
-        }
+            if (!whisper_gguf_get_i32(g, "whisper.vocab_size",                       hparams.n_vocab)       ||
+                !whisper_gguf_get_i32(g, "whisper.audio.context_length",             hparams.n_audio_ctx)   ||
+                !whisper_gguf_get_i32(g, "whisper.audio.embedding_length",           hparams.n_audio_state) ||
+                !whisper_gguf_get_i32(g, "whisper.audio.attention.head_count",       hparams.n_audio_head)  ||
+                !whisper_gguf_get_i32(g, "whisper.audio.block_count",                hparams.n_audio_layer) ||
+                !whisper_gguf_get_i32(g, "whisper.text.context_length",              hparams.n_text_ctx)    ||
+                !whisper_gguf_get_i32(g, "whisper.text.embedding_length",            hparams.n_text_state)  ||
+                !whisper_gguf_get_i32(g, "whisper.text.attention.head_count",        hparams.n_text_head)   ||
+                !whisper_gguf_get_i32(g, "whisper.text.block_count",                 hparams.n_text_layer)  ||
+                !whisper_gguf_get_i32(g, "whisper.audio.mel_count",                  hparams.n_mels)        ||
+                !whisper_gguf_get_i32(g, "general.file_type",                        hparams.ftype)) {
+                return false;
+            }
 
-        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
+            hparams.ftype += qntvr*GGML_QNT_VERSION_FACTOR;
+        } else {
+            read_safe(loader, hparams.n_vocab);
+            read_safe(loader, hparams.n_audio_ctx);
+            read_safe(loader, hparams.n_audio_state);
+            read_safe(loader, hparams.n_audio_head);
+            read_safe(loader, hparams.n_audio_layer);
+            read_safe(loader, hparams.n_text_ctx);
+            read_safe(loader, hparams.n_text_state);
+            read_safe(loader, hparams.n_text_head);
+            read_safe(loader, hparams.n_text_layer);
+            read_safe(loader, hparams.n_mels);
+            read_safe(loader, hparams.ftype);
+        }
 
-        if (model.n_loaded == 0) {
-            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
-        } else if (model.n_loaded != (int) model.tensors.size()) {
-            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
+        // the decoder can be much shallower than the encoder (distilled models), but the cross-attention
+        // projections need both sides to have the same width
+        if (hparams.n_audio_layer <= 0 || hparams.n_text_layer <= 0 || hparams.n_audio_head <= 0 || hparams.n_text_head <= 0 ||
+            hparams.n_audio_state % hparams.n_audio_head != 0 || hparams.n_text_state % hparams.n_text_head != 0) {
+            WHISPER_LOG_ERROR("%s: invalid model (bad layer or head counts)\n", __func__);
+            return false;
+        }
+        if (hparams.n_text_state != hparams.n_audio_state) {
+            WHISPER_LOG_ERROR("%s: invalid model (n_text_state %d != n_audio_state %d)\n", __func__, hparams.n_text_state, hparams.n_audio_state);
             return false;
         }
-    }
 
-    for (auto & buf : model.buffers) {
-        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
-    }
+        std::string mver = "";
 
-    wctx.t_load_us = ggml_time_us() - t_start_us;
+        if (hparams.n_audio_layer == 4) {
+            model.type = e_model::MODEL_TINY;
+        }
 
-    return true;
-}
+        if (hparams.n_audio_layer == 6) {
+            model.type = e_model::MODEL_BASE;
+        }
 
-static bool whisper_encode_external(const whisper_state & wstate) {
-    GGML_UNUSED(wstate);
+        if (hparams.n_audio_layer == 12) {
+            model.type = e_model::MODEL_SMALL;
+        }
 
-#ifndef WHISPER_USE_COREML
-    const bool use_coreml = false;
-#else
-    const bool use_coreml = wstate.ctx_coreml != nullptr;
-#endif
+        if (hparams.n_audio_layer == 24) {
+            model.type = e_model::MODEL_MEDIUM;
+        }
 
-#ifndef WHISPER_USE_OPENVINO
-    const bool use_openvino = false;
-#else
-    const bool use_openvino = wstate.ctx_openvino != nullptr;
-#endif
+        if (hparams.n_audio_layer == 32) {
+            model.type = e_model::MODEL_LARGE;
 
-    return use_coreml || use_openvino;
-}
+            if (hparams.n_vocab == 51866) {
+                mver = " v3";
+            }
+        }
 
-static struct ggml_cgraph * whisper_build_graph_conv(
-        whisper_context & wctx,
-          whisper_state & wstate) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state; GGML_UNUSED(n_state);
+        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
 
-    const int n_mels = hparams.n_mels;
+        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
+        // in order to save memory and also to speed up the computation
+        wctx.wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
+        if (wctx.wtype == GGML_TYPE_COUNT) {
+            WHISPER_LOG_ERROR("%s: invalid model (bad ftype value %d)\n", __func__, model.hparams.ftype);
+            return false;
+        }
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_conv.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_conv.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+        WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
+        WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
+        WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
+        WHISPER_LOG_INFO("%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
+        WHISPER_LOG_INFO("%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
+        WHISPER_LOG_INFO("%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
+        WHISPER_LOG_INFO("%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
+        WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
+        WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
+        WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
+        WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
+        WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
+        WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
+        if (hparams.n_text_layer < hparams.n_audio_layer) {
+            WHISPER_LOG_INFO("%s: shallow decoder (%d of %d layers) - long audio is best transcribed with chunk_ms\n", __func__,
+                    hparams.n_text_layer, hparams.n_audio_layer);
+        }
+    }
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    // load mel filters
+    {
+        auto & filters = wctx.model.filters;
 
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
+        if (gguf) {
+            const gguf_context * g = gguf.get();
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    ggml_set_name(mel, "mel");
-    ggml_set_input(mel);
+            const int64_t id = gguf_find_key(g, "whisper.audio.mel_filters");
+            if (!whisper_gguf_get_i32(g, "whisper.audio.mel_filters.n_fft", filters.n_fft) || filters.n_fft <= 0) {
+                return false;
+            }
+            if (id < 0 || gguf_get_kv_type(g, id) != GGUF_TYPE_ARRAY || gguf_get_arr_type(g, id) != GGUF_TYPE_FLOAT32 ||
+                gguf_get_arr_n(g, id) % filters.n_fft != 0) {
+                WHISPER_LOG_ERROR("%s: invalid or missing mel filters in model file\n", __func__);
+                return false;
+            }
 
-    struct ggml_tensor * cur = nullptr;
+            filters.n_mel = gguf_get_arr_n(g, id) / filters.n_fft;
+            filters.data.resize(gguf_get_arr_n(g, id));
+            memcpy(filters.data.data(), gguf_get_arr_data(g, id), filters.data.size() * sizeof(float));
+        } else {
+            read_safe(loader, filters.n_mel);
+            read_safe(loader, filters.n_fft);
 
-    if (!whisper_encode_external(wstate)) {
-        // convolution + gelu
-        {
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_1_b);
+            filters.data.resize(filters.n_mel * filters.n_fft);
+            loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
+            BYTESWAP_FILTERS(filters);
+        }
 
-            cur = ggml_gelu(ctx0, cur);
+        // each triangular filter covers a few bins, the mel stage only visits those
+        filters.bands.resize(2 * filters.n_mel);
+        for (int j = 0; j < filters.n_mel; j++) {
+            const float * w = filters.data.data() + (size_t) j * filters.n_fft;
+            int begin = 0;
+            int end   = filters.n_fft;
+            while (begin < end && w[begin] == 0.0f) {
+                begin++;
+            }
+            while (end > begin && w[end - 1] == 0.0f) {
+                end--;
+            }
+            filters.bands[2*j + 0] = begin;
+            filters.bands[2*j + 1] = end;
+        }
+    }
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+    // load vocab
+    {
+        const int64_t id_tokens = gguf ? gguf_find_key(gguf.get(), "tokenizer.ggml.tokens") : -1;
 
-            cur = ggml_gelu(ctx0, cur);
+        int32_t n_vocab = 0;
+        if (gguf) {
+            if (id_tokens < 0 || gguf_get_kv_type(gguf.get(), id_tokens) != GGUF_TYPE_ARRAY || gguf_get_arr_type(gguf.get(), id_tokens) != GGUF_TYPE_STRING) {
+                WHISPER_LOG_ERROR("%s: invalid or missing vocab in model file\n", __func__);
+                return false;
+            }
+            n_vocab = gguf_get_arr_n(gguf.get(), id_tokens);
+        } else {
+            read_safe(loader, n_vocab);
         }
 
-        ggml_set_name(cur, "embd_conv");
-        wstate.embd_conv = cur;
-    } else {
-        ggml_build_forward_expand(gf, mel);
+        //if (n_vocab != model.hparams.n_vocab) {
+        //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
+        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
+        //    return false;
+        //}
 
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
-        ggml_set_input(cur); // the external encoder will write into this tensor
+        std::string word;
+        std::vector<char> tmp;
 
-        ggml_set_name(cur, "embd_enc");
-        wstate.embd_enc = cur;
-    }
+        tmp.reserve(128);
 
-    ggml_set_output(cur);
+        for (int i = 0; i < n_vocab; i++) {
+            if (gguf) {
+                // note: gguf_get_arr_str() ends a token at its first NUL byte, i.e. the "\0" byte token reads as ""
+                word = gguf_get_arr_str(gguf.get(), id_tokens, i);
 
-    ggml_build_forward_expand(gf, cur);
+                vocab.add_token(word);
+                continue;
+            }
 
-    ggml_free(ctx0);
+            uint32_t len;
+            read_safe(loader, len);
 
-    return gf;
-}
+            if (len > 0) {
+                tmp.resize(len);
+                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                word.assign(&tmp[0], tmp.size());
+            } else {
+                // seems like we have an empty-string token in multi-language models (i = 50256)
+                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
+                word = "";
+            }
 
-static struct ggml_cgraph * whisper_build_graph_encoder(
-        whisper_context & wctx,
-          whisper_state & wstate) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+            vocab.add_token(word);
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
-
-    const int n_state_head = n_state/n_head;
-
-    auto & kv_pad = wstate.kv_pad;
-
-    WHISPER_ASSERT(!!kv_pad.buffer);
+            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+        }
 
-    const int n_ctx_pad = GGML_PAD(n_ctx, 256);
+        vocab.n_vocab = model.hparams.n_vocab;
+        if (vocab.is_multilingual()) {
+            vocab.token_eot++;
+            vocab.token_sot++;
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+            // account for variable number of language tokens
+            const int dt = vocab.num_languages() - 98;
 
-    struct ggml_context * ctx0 = ggml_init(params);
+            vocab.token_translate  += dt;
+            vocab.token_transcribe += dt;
+            vocab.token_solm       += dt;
+            vocab.token_prev       += dt;
+            vocab.token_nosp       += dt;
+            vocab.token_not        += dt;
+            vocab.token_beg        += dt;
+        }
 
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+        if (n_vocab < model.hparams.n_vocab) {
+            WHISPER_LOG_INFO("%s: adding %d extra tokens\n", __func__, model.hparams.n_vocab - n_vocab);
+            for (int i = n_vocab; i < model.hparams.n_vocab; i++) {
+                if (i > vocab.token_beg) {
+                    word = "[_TT_" + std::to_string(i - vocab.token_beg) + "]";
+                } else if (i == vocab.token_eot) {
+                    word = "[_EOT_]";
+                } else if (i == vocab.token_sot) {
+                    word = "[_SOT_]";
+                } else if (i == vocab.token_translate) {
+                    word = "[_TRANSLATE_]";
+                } else if (i == vocab.token_transcribe) {
+                    word = "[_TRANSCRIBE_]";
+                } else if (i == vocab.token_solm) {
+                    word = "[_SOLM_]";
+                } else if (i == vocab.token_prev) {
+                    word = "[_PREV_]";
+                } else if (i == vocab.token_nosp) {
+                    word = "[_NOSP_]";
+                } else if (i == vocab.token_not) {
+                    word = "[_NOT_]";
+                } else if (i == vocab.token_beg) {
+                    word = "[_BEG_]";
+                } else if (i > vocab.token_sot && i <= vocab.token_sot + vocab.num_languages()) {
+                    word = "[_LANG_" + std::string(whisper_lang_str(i - vocab.token_sot - 1)) + "]";
+                } else {
+                    word = "[_extra_token_" + std::to_string(i) + "]";
+                }
+                vocab.add_token(word);
+            }
+        }
 
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
+        WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
 
-    const float KQscale = 1.0f/sqrtf(float(n_state_head));
+        whisper_vocab_init_index(vocab);
+        whisper_vocab_init_trie(vocab);
+    }
 
-    // ===================================================================
-    // NOTE: experimenting with partial evaluation of the encoder (ignore)
-    //static int iter = -1;
-    //const int n_iter = 1500/n_ctx;
+    const ggml_type wtype = wctx.wtype;
+    const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
 
-    //iter = (iter + 1) % n_iter;
+    const auto & hparams = model.hparams;
 
-    //if (iter == 0) {
-    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-    //}
+    const int n_audio_layer = hparams.n_audio_layer;
+    const int n_text_layer  = hparams.n_text_layer;
 
-    static int iter = 0;
+    const size_t n_tensors = 10 /* input */ + 15 + 15*n_audio_layer + 24*n_text_layer + n_audio_layer + n_text_layer /* packed QKV */;
 
-    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    auto get_ctx = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            ggml_init_params params = {
+                /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
+                /*.mem_buffer =*/ nullptr,
+                /*.no_alloc   =*/ true,
+            };
 
-    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+            ggml_context * ctx = ggml_init(params);
+            if (!ctx) {
+                throw std::runtime_error("failed to create ggml context");
+            }
 
-    // ===================================================================
+            ctx_map[buft] = ctx;
+            model.ctxs.emplace_back(ctx);
 
-    // original:
-    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+            return ctx;
+        }
 
-    struct ggml_tensor * inpL = cur;
+        return it->second;
+    };
 
-    for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_encoder[il];
+    if (wctx.params.autotune_cache && wctx.params.autotune_cache[0] != '\0') {
+        whisper_autotune(wctx, hparams);
+    }
 
-        // norm
-        {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
+    // Create a list of available bufts, in priority order
+    buft_list_t buft_list = make_buft_list(wctx.params);
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
+    // the same list without the GPU, for the layers past n_gpu_layers
+    buft_list_t buft_list_host;
+    for (const auto & p : buft_list) {
+        const auto type = ggml_backend_dev_type(p.first);
+        if (type != GGML_BACKEND_DEVICE_TYPE_GPU && type != GGML_BACKEND_DEVICE_TYPE_IGPU) {
+            buft_list_host.push_back(p);
         }
+    }
 
-        // self-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.attn_q_w,
-                    cur);
+    const int n_layer_total = hparams.n_audio_layer + hparams.n_text_layer;
+    const int n_gpu_layers  = wctx.params.n_gpu_layers < 0 ? n_layer_total : std::min(wctx.params.n_gpu_layers, n_layer_total);
+
+    if (n_gpu_layers < n_layer_total && buft_list_host.size() < buft_list.size()) {
+        WHISPER_LOG_INFO("%s: offloading %d of %d layers to the GPU\n", __func__, n_gpu_layers, n_layer_total);
+    }
+
+    // position of a tensor in the offload order: the encoder layers, then the decoder layers
+    auto offload_index = [&](asr_tensor type, asr_system system, int layer) -> int {
+        if (system == ASR_SYSTEM_ENCODER) {
+            switch (type) {
+                case ASR_TENSOR_ENC_POS_EMBD:
+                case ASR_TENSOR_CONV1_WEIGHT:
+                case ASR_TENSOR_CONV1_BIAS:
+                case ASR_TENSOR_CONV2_WEIGHT:
+                case ASR_TENSOR_CONV2_BIAS:
+                    return 0;
+                case ASR_TENSOR_LN_WEIGHT:
+                case ASR_TENSOR_LN_POST_BIAS:
+                    return hparams.n_audio_layer - 1;
+                default:
+                    return layer;
+            }
+        }
 
-            Qcur = ggml_add(ctx0, Qcur, layer.attn_q_b);
+        switch (type) {
+            case ASR_TENSOR_DEC_POS_EMBD:
+            case ASR_TENSOR_DEC_TOKEN_EMBD_WEIGHT:
+            case ASR_TENSOR_LN_WEIGHT:
+            case ASR_TENSOR_LN_BIAS:
+                return system == ASR_SYSTEM_DECODER ? n_layer_total - 1 : hparams.n_audio_layer + layer;
+            default:
+                return hparams.n_audio_layer + layer;
+        }
+    };
 
-            //Qcur = ggml_scale(ctx0, Qcur, pow(float(n_state_head), -0.25));
+    // with RPC servers, the encoder and the cross-attention K/V projections (the cross graph) live on the remote device
+    ggml_backend_buffer_type_t buft_encoder = wctx.dev_encoder ? ggml_backend_dev_buffer_type(wctx.dev_encoder) : nullptr;
 
-            // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
-                    layer.attn_k_w,
-                    cur);
+    // with a mapped file, CPU weights can use the mapped pages directly;
+    // ggml_backend_alloc_ctx_tensors_from_buft() skips tensors bound here
+    whisper_mmap_reader * mapped = loader->read == whisper_mmap_reader::read ? (whisper_mmap_reader *) loader->context : nullptr;
 
-            //Kcur = ggml_scale(ctx0, Kcur, pow(float(n_state_head), -0.25));
+    // mixed precision files (quantize --tensor-type) keep some matrices in another type than the one of the
+    // header; the types are known ahead of the data with GGUF or when the file is mapped
+    std::map<std::string, ggml_type> file_types;
+    {
+        auto add_type = [&](const std::string & name, ggml_type ttype, const int64_t *, uint8_t *, size_t) {
+            file_types[name] = ttype;
+        };
 
-            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                    layer.attn_v_w,
-                    cur);
+        if (gguf) {
+            whisper_gguf_for_each_tensor(gguf.get(), gguf_meta.get(), nullptr, 0, add_type);
+        } else if (mapped) {
+            whisper_mmap_for_each_tensor(*mapped, add_type);
+        }
+    }
 
-            Vcur = ggml_add(ctx0, Vcur, layer.attn_v_b);
+    // weights converted while loading (type_weights, tensor_types) and their type in the file
+    std::vector<std::pair<std::regex, ggml_type>> tensor_types;
+    if (!whisper_parse_tensor_types(wctx.params.tensor_types, tensor_types)) {
+        return false;
+    }
+    std::map<std::string, ggml_type> quant_src;
 
-            // ------
+    // the buffer type of a weight; meta takes the type of the weight in the file
+    auto select_buft = [&](asr_tensor type, asr_system system, ggml_tensor * meta, int layer) -> ggml_backend_buffer_type_t {
+        ggml_op op = ASR_TENSOR_INFO.at(type);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_ctx),
-                        0, 2, 1, 3);
+        const std::string name = format(ASR_TENSOR_NAMES.at(system).at(type), layer);
 
-            if (wctx.params.flash_attn) {
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, ggml_view_1d(ctx0, kv_pad.k, n_ctx*n_state, 0)));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, ggml_view_1d(ctx0, kv_pad.v, n_ctx*n_state, 0)));
+        const auto it_type = file_types.find(name);
+        if (it_type != file_types.end() && it_type->second != meta->type && meta->type == wctx.wtype &&
+            meta->ne[0] % ggml_blck_size(it_type->second) == 0) {
+            meta->type  = it_type->second;
+            meta->nb[0] = ggml_type_size(meta->type);
+            meta->nb[1] = ggml_row_size(meta->type, meta->ne[0]);
+            for (int i = 2; i < GGML_MAX_DIMS; ++i) {
+                meta->nb[i] = meta->nb[i - 1]*meta->ne[i - 1];
+            }
+        }
 
-                struct ggml_tensor * K =
-                    ggml_view_3d(ctx0, kv_pad.k,
-                            n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.k)*n_state,
-                            ggml_element_size(kv_pad.k)*n_state_head,
-                            0);
+        // the matrices of the matmuls and the token embeddings of an unquantized file can be quantized here
+        if ((op == GGML_OP_MUL_MAT || type == ASR_TENSOR_DEC_TOKEN_EMBD_WEIGHT) &&
+            (meta->type == GGML_TYPE_F32 || meta->type == GGML_TYPE_F16 || meta->type == GGML_TYPE_BF16)) {
+            ggml_type target = wctx.params.type_weights;
+            for (const auto & tt : tensor_types) {
+                if (std::regex_search(name, tt.first)) {
+                    target = tt.second;
+                    break;
+                }
+            }
 
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_pad.v,
-                            n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.v)*n_state,
-                            ggml_element_size(kv_pad.v)*n_state_head,
-                            0);
+            if (target != GGML_TYPE_COUNT && target != meta->type && meta->ne[0] % ggml_blck_size(target) == 0) {
+                quant_src[name] = meta->type;
 
-                cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
+                meta->type  = target;
+                meta->nb[0] = ggml_type_size(meta->type);
+                meta->nb[1] = ggml_row_size(meta->type, meta->ne[0]);
+                for (int i = 2; i < GGML_MAX_DIMS; ++i) {
+                    meta->nb[i] = meta->nb[i - 1]*meta->ne[i - 1];
+                }
+            }
+        }
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx);
-            } else {
-                struct ggml_tensor * K =
-                    ggml_permute(ctx0,
-                            ggml_cast(ctx0,
-                                ggml_reshape_3d(ctx0, Kcur, n_state_head, n_head, n_ctx),
-                                wctx.itype),
-                            0, 2, 1, 3);
+        const bool is_encoder = system == ASR_SYSTEM_ENCODER || (system == ASR_SYSTEM_CROSS &&
+                (type == ASR_TENSOR_ATTN_KEY_WEIGHT || type == ASR_TENSOR_ATTN_VALUE_WEIGHT || type == ASR_TENSOR_ATTN_VALUE_BIAS));
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+        const bool on_gpu = offload_index(type, system, layer) < n_gpu_layers;
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+        ggml_backend_buffer_type_t buft = buft_encoder && is_encoder ? buft_encoder : select_weight_buft(hparams, meta, op, on_gpu ? buft_list : buft_list_host);
+        if (!buft) {
+            throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", ASR_TENSOR_NAMES.at(system).at(type)));
+        }
 
-                struct ggml_tensor * V =
-                    ggml_cast(ctx0,
-                            ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
-                                    Vcur,
-                                    n_state_head, n_head, n_ctx),
-                                1, 2, 0, 3),
-                            wctx.itype);
+        return buft;
+    };
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+    auto create_tensor = [&](asr_tensor type, asr_system system, ggml_tensor * meta, int layer = 0) -> ggml_tensor * {
+        const std::string name = format(ASR_TENSOR_NAMES.at(system).at(type), layer);
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+        ggml_context * ctx = get_ctx(select_buft(type, system, meta, layer));
+        ggml_tensor * tensor = ggml_dup_tensor(ctx, meta);
+        ggml_set_name(tensor, name.c_str());
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx);
-            }
-        }
+        model.tensors[name] = tensor;
 
-        // projection
-        {
-            cur = ggml_mul_mat(ctx0,
-                    layer.attn_ln_1_w,
-                    cur);
+        return tensor;
+    };
 
-            cur = ggml_add(ctx0, cur, layer.attn_ln_1_b);
+    // with fuse_qkv, the Q, K and V weights of a self-attention layer are the rows of one [n_state, 3*n_state]
+    // tensor: they load as views of it and the graphs issue one matmul (whisper_build_qkv); returns the packed
+    // tensor, or nullptr when the three are created apart (different types in the file, or a buffer type that
+    // repacks its tensors and so cannot hold views, e.g. the CPU extra buffer types)
+    auto create_qkv = [&](ggml_context * ctx_meta, asr_system system, int64_t n_state, int layer,
+            ggml_tensor *& q, ggml_tensor *& k, ggml_tensor *& v) -> ggml_tensor * {
+        const asr_tensor types[3] = { ASR_TENSOR_ATTN_QUERY_WEIGHT, ASR_TENSOR_ATTN_KEY_WEIGHT, ASR_TENSOR_ATTN_VALUE_WEIGHT };
+
+        ggml_tensor * metas[3];
+        ggml_backend_buffer_type_t bufts[3];
+        for (int i = 0; i < 3; ++i) {
+            metas[i] = ggml_new_tensor_2d(ctx_meta, wtype, n_state, n_state);
+            bufts[i] = select_buft(types[i], system, metas[i], layer);
         }
 
-        // add the input
-        cur = ggml_add(ctx0, cur, inpL);
+        ggml_backend_dev_t dev = ggml_backend_buft_get_device(bufts[0]);
+        const bool plain = !dev || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU || bufts[0] == whisper_cpu_buft(wctx.params);
 
-        struct ggml_tensor * inpFF = cur;
+        const bool fuse = wctx.params.fuse_qkv && plain &&
+            metas[1]->type == metas[0]->type && metas[2]->type == metas[0]->type &&
+            bufts[1] == bufts[0] && bufts[2] == bufts[0];
 
-        // feed-forward network
-        {
-            // norm
-            {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+        ggml_tensor ** out[3] = { &q, &k, &v };
 
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0, cur, layer.mlp_ln_w),
-                        layer.mlp_ln_b);
+        if (!fuse) {
+            for (int i = 0; i < 3; ++i) {
+                *out[i] = create_tensor(types[i], system, metas[i], layer);
             }
+            return nullptr;
+        }
 
-            // fully connected
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_0_w,
-                    cur);
-
-            cur = ggml_add(ctx0, cur, layer.mlp_0_b);
+        ggml_context * ctx = get_ctx(bufts[0]);
 
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+        std::string name = format(ASR_TENSOR_NAMES.at(system).at(ASR_TENSOR_ATTN_QUERY_WEIGHT), layer);
+        name.replace(name.find("query"), 5, "qkv");
 
-            // projection
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_1_w,
-                    cur);
+        ggml_tensor * qkv = ggml_new_tensor_2d(ctx, metas[0]->type, n_state, 3*n_state);
+        ggml_set_name(qkv, name.c_str());
 
-            cur = ggml_add(ctx0, cur, layer.mlp_1_b);
+        for (int i = 0; i < 3; ++i) {
+            ggml_tensor * view = ggml_view_2d(ctx, qkv, n_state, n_state, qkv->nb[1], i*n_state*qkv->nb[1]);
+            const std::string view_name = format(ASR_TENSOR_NAMES.at(system).at(types[i]), layer);
+            ggml_set_name(view, view_name.c_str());
+            model.tensors[view_name] = view;
+            *out[i] = view;
         }
 
-        inpL = ggml_add(ctx0, cur, inpFF);
-    }
+        return qkv;
+    };
 
-    cur = inpL;
 
-    // norm
+    // prepare tensors for the weights
     {
-        cur = ggml_norm(ctx0, cur, hparams.eps);
-
-        // cur = ln_f_g*cur + ln_f_b
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0, cur, model.e_ln_w),
-                model.e_ln_b);
-    }
+        ggml_init_params params = {
+            /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
 
-    ggml_build_forward_expand(gf, cur);
+        ggml_context * ctx = ggml_init(params);
 
-    wstate.embd_enc = cur;
+        const auto & hparams = model.hparams;
 
-    //ggml_graph_print(gf);
+        const int n_vocab = hparams.n_vocab;
 
-    ////////////////////////////////////////////////////////////////////////////
+        const int n_audio_ctx   = hparams.n_audio_ctx;
+        const int n_audio_state = hparams.n_audio_state;
+        const int n_audio_layer = hparams.n_audio_layer;
 
-    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-    //        ggml_used_mem(ctx0)/1e6,
-    //        wstate.get_buf_max_mem(0)/1e6,
-    //        wstate.get_buf_max_mem(1)/1e6,
-    //        wstate.get_buf_max_mem(2)/1e6,
-    //        wstate.get_buf_max_mem(3)/1e6);
-
-    ggml_free(ctx0);
-
-    return gf;
-}
-
-// pre-compute cross-attention memory
-static struct ggml_cgraph * whisper_build_graph_cross(
-        whisper_context & wctx,
-          whisper_state & wstate) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
-
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-
-    const int n_state_head = n_state/n_head;
-
-    const int n_ctx_pad = GGML_PAD(n_ctx, 256);
-
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_cross.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_cross.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+        const int n_text_ctx   = hparams.n_text_ctx;
+        const int n_text_state = hparams.n_text_state;
+        const int n_text_layer = hparams.n_text_layer;
 
-    struct ggml_context * ctx0 = ggml_init(params);
+        const int n_mels = hparams.n_mels;
 
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
+        model.layers_encoder.resize(n_audio_layer);
+        model.layers_decoder.resize(n_text_layer);
 
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+        // encoder
+        model.e_pe = create_tensor(ASR_TENSOR_ENC_POS_EMBD, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_audio_state, n_audio_ctx));
 
-    const float  Kscale = pow(float(n_state_head), -0.25);
+        model.e_conv_1_w = create_tensor(ASR_TENSOR_CONV1_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_3d(ctx, vtype, 3, n_mels, n_audio_state));
+        model.e_conv_1_b = create_tensor(ASR_TENSOR_CONV1_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state));
 
-    for (int il = 0; il < model.hparams.n_text_layer; ++il) {
-        auto & layer = model.layers_decoder[il];
+        model.e_conv_2_w = create_tensor(ASR_TENSOR_CONV2_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_3d(ctx, vtype, 3, n_audio_state, n_audio_state));
+        model.e_conv_2_b = create_tensor(ASR_TENSOR_CONV2_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state));
 
-        struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
-                layer.cross_attn_k_w,
-                cur);
+        model.e_ln_w = create_tensor(ASR_TENSOR_LN_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state));
+        model.e_ln_b = create_tensor(ASR_TENSOR_LN_POST_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state));
 
-        Kcross = ggml_scale(ctx0, Kcross, Kscale);
+        for (int i = 0; i < n_audio_layer; ++i) {
+            auto & layer = model.layers_encoder[i];
 
-        struct ggml_tensor * Vcross = ggml_mul_mat(ctx0,
-                layer.cross_attn_v_w,
-                cur);
+            layer.mlp_ln_w = create_tensor(ASR_TENSOR_MLP_LN_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
+            layer.mlp_ln_b = create_tensor(ASR_TENSOR_MLP_LN_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state), i);
 
-        Vcross = ggml_add(ctx0,
-                    Vcross,
-                    layer.cross_attn_v_b);
+            layer.mlp_0_w = create_tensor(ASR_TENSOR_MLP_0_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, n_audio_state, 4*n_audio_state), i);
+            layer.mlp_0_b = create_tensor(ASR_TENSOR_MLP_0_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_audio_state), i);
 
-        struct ggml_tensor * k;
-        struct ggml_tensor * v;
+            layer.mlp_1_w = create_tensor(ASR_TENSOR_MLP_2_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, 4*n_audio_state, n_audio_state), i);
+            layer.mlp_1_b = create_tensor(ASR_TENSOR_MLP_2_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state), i);
 
-        if (wctx.params.flash_attn) {
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
+            layer.attn_ln_0_w = create_tensor(ASR_TENSOR_ATTN_LN_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
+            layer.attn_ln_0_b = create_tensor(ASR_TENSOR_ATTN_LN_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
 
-            v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
-        } else {
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+            layer.attn_qkv_w = create_qkv(ctx, ASR_SYSTEM_ENCODER, n_audio_state, i, layer.attn_q_w, layer.attn_k_w, layer.attn_v_w);
 
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+            layer.attn_q_b = create_tensor(ASR_TENSOR_ATTN_QUERY_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
+            layer.attn_v_b = create_tensor(ASR_TENSOR_ATTN_VALUE_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
 
-            v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
+            layer.attn_ln_1_w = create_tensor(ASR_TENSOR_ATTN_OUT_WEIGHT, ASR_SYSTEM_ENCODER, ggml_new_tensor_2d(ctx, wtype, n_audio_state, n_audio_state), i);
+            layer.attn_ln_1_b = create_tensor(ASR_TENSOR_ATTN_OUT_BIAS, ASR_SYSTEM_ENCODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state), i);
         }
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
-    }
+        // decoder
+        model.d_pe = create_tensor(ASR_TENSOR_DEC_POS_EMBD, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_text_state, n_text_ctx));
 
-    //ggml_graph_print(gf);
+        model.d_te = create_tensor(ASR_TENSOR_DEC_TOKEN_EMBD_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_vocab));
 
-    ggml_free(ctx0);
+        model.d_ln_w = create_tensor(ASR_TENSOR_LN_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state));
+        model.d_ln_b = create_tensor(ASR_TENSOR_LN_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state));
 
-    return gf;
-}
+        for (int i = 0; i < n_text_layer; ++i) {
+            auto & layer = model.layers_decoder[i];
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads,
-    ggml_abort_callback   abort_callback,
-                   void * abort_callback_data) {
-    const int64_t t_start_us = ggml_time_us();
+            layer.mlp_ln_w = create_tensor(ASR_TENSOR_MLP_LN_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+            layer.mlp_ln_b = create_tensor(ASR_TENSOR_MLP_LN_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
 
-    // conv
-    {
-        auto & sched = wstate.sched_conv.sched;
+            layer.mlp_0_w = create_tensor(ASR_TENSOR_MLP_0_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, 4*n_text_state), i);
+            layer.mlp_0_b = create_tensor(ASR_TENSOR_MLP_0_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_text_state), i);
 
-        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
+            layer.mlp_1_w = create_tensor(ASR_TENSOR_MLP_2_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, 4*n_text_state, n_text_state), i);
+            layer.mlp_1_b = create_tensor(ASR_TENSOR_MLP_2_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+            layer.attn_ln_0_w = create_tensor(ASR_TENSOR_ATTN_LN_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+            layer.attn_ln_0_b = create_tensor(ASR_TENSOR_ATTN_LN_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
 
-        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+            layer.attn_qkv_w = create_qkv(ctx, ASR_SYSTEM_DECODER, n_text_state, i, layer.attn_q_w, layer.attn_k_w, layer.attn_v_w);
 
-        // set the input
-        {
-            const auto & mel_inp = wstate.mel;
-            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+            layer.attn_q_b = create_tensor(ASR_TENSOR_ATTN_QUERY_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+            layer.attn_v_b = create_tensor(ASR_TENSOR_ATTN_VALUE_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
 
-            assert(mel->type == GGML_TYPE_F32);
-            assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
+            layer.attn_ln_1_w = create_tensor(ASR_TENSOR_ATTN_OUT_WEIGHT, ASR_SYSTEM_DECODER, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
+            layer.attn_ln_1_b = create_tensor(ASR_TENSOR_ATTN_OUT_BIAS, ASR_SYSTEM_DECODER, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
 
-            wstate.inp_mel.resize(ggml_nelements(mel));
+            layer.cross_attn_ln_0_w = create_tensor(ASR_TENSOR_ATTN_LN_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
+            layer.cross_attn_ln_0_b = create_tensor(ASR_TENSOR_ATTN_LN_BIAS, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
 
-            float * dst = wstate.inp_mel.data();
-            memset(dst, 0, ggml_nbytes(mel));
+            layer.cross_attn_q_w = create_tensor(ASR_TENSOR_ATTN_QUERY_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
+            layer.cross_attn_q_b = create_tensor(ASR_TENSOR_ATTN_QUERY_BIAS, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
 
-            const int i0 = std::min(mel_offset,           mel_inp.n_len);
-            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+            layer.cross_attn_k_w = create_tensor(ASR_TENSOR_ATTN_KEY_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
 
-            for (int j = 0; j < mel_inp.n_mel; ++j) {
-                for (int i = i0; i < i1; ++i) {
-                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-                }
-            }
+            layer.cross_attn_v_w = create_tensor(ASR_TENSOR_ATTN_VALUE_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
+            layer.cross_attn_v_b = create_tensor(ASR_TENSOR_ATTN_VALUE_BIAS, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
 
-            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+            layer.cross_attn_ln_1_w = create_tensor(ASR_TENSOR_ATTN_OUT_WEIGHT, ASR_SYSTEM_CROSS, ggml_new_tensor_2d(ctx, wtype, n_text_state, n_text_state), i);
+            layer.cross_attn_ln_1_b = create_tensor(ASR_TENSOR_ATTN_OUT_BIAS, ASR_SYSTEM_CROSS, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state), i);
         }
 
-        if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-                return false;
+        if (wctx.params.fuse_qkv) {
+            int n_fused = 0;
+            for (const auto & layer : model.layers_encoder) {
+                n_fused += layer.attn_qkv_w != nullptr;
             }
-        } else {
-            ggml_backend_sched_reset(sched);
-
-#if defined(WHISPER_USE_COREML)
-            whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) wstate.embd_enc->data);
-#elif defined(WHISPER_USE_OPENVINO)
-            whisper_openvino_encode(wstate.ctx_openvino, mel, wstate.embd_enc);
-#endif
+            for (const auto & layer : model.layers_decoder) {
+                n_fused += layer.attn_qkv_w != nullptr;
+            }
+            WHISPER_LOG_INFO("%s: packed QKV weights in %d of %d layers\n", __func__, n_fused, n_audio_layer + n_text_layer);
         }
-    }
-
-    // encoder
-    if (!whisper_encode_external(wstate)) {
-        auto & sched = wstate.sched_encode.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
+        ggml_free(ctx);
+    }
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
+    ggml_backend_buffer_t buf_mapped = nullptr;
+    if (mapped) {
+        const auto it = ctx_map.find(ggml_backend_cpu_buffer_type());
+        if (it != ctx_map.end()) {
+            buf_mapped = whisper_mmap_bind_tensors(*mapped, gguf.get(), gguf_meta.get(), it->second, model);
         }
-
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
+        if (buf_mapped) {
+            model.buffers.emplace_back(buf_mapped);
         }
     }
 
-    // cross
-    {
-        auto & sched = wstate.sched_cross.sched;
-
-        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
-
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+    // allocate tensors in the backend buffers
+    for (auto & p : ctx_map) {
+        ggml_backend_buffer_type_t buft = p.first;
+        ggml_context * ctx = p.second;
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        if (buf) {
+            model.buffers.emplace_back(buf);
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
+            size_t size_main = ggml_backend_buffer_get_size(buf);
+            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), size_main / 1e6);
         }
     }
 
-    wstate.t_encode_us += ggml_time_us() - t_start_us;
-    wstate.n_encode++;
+    // load weights
+    {
+        size_t total_size = 0;
 
-    return !(abort_callback && abort_callback(abort_callback_data));
-}
+        model.n_loaded = 0;
 
-static struct ggml_cgraph * whisper_build_graph_decoder(
-         whisper_context & wctx,
-         whisper_state   & wstate,
-     const whisper_batch & batch,
-                    bool   save_alignment_heads_QKs,
-                    bool   worst_case) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+        std::vector<char> read_buf;
 
-    auto & kv_self = wstate.kv_self;
+        // with a mapped file, the weights that are not used in place are copied once all offsets are known
+        std::vector<whisper_load_job> jobs;
 
-    WHISPER_ASSERT(!!kv_self.buffer);
+        size_t n_converted = 0;
+        int64_t t_convert_us = 0;
 
-    const int n_ctx   = kv_self.size;
-    const int n_state = hparams.n_text_state;
-    const int n_head  = hparams.n_text_head;
-    const int n_layer = hparams.n_text_layer;
+        // reads the data of a tensor, the loader is at its first byte
+        auto load_data = [&](ggml_tensor * tensor) {
+            const auto it_src = quant_src.find(ggml_get_name(tensor));
+            if (it_src != quant_src.end()) {
+                const size_t nbytes = ggml_row_size(it_src->second, tensor->ne[0])*ggml_nrows(tensor);
 
-    const int n_state_head = n_state/n_head;
+                const uint8_t * src;
+                if (mapped && mapped->map->size - mapped->pos >= nbytes) {
+                    src = mapped->map->addr + mapped->pos;
+                    mapped->pos += nbytes;
+                } else {
+                    read_buf.resize(nbytes);
+                    loader->read(loader->context, read_buf.data(), nbytes);
+                    src = (const uint8_t *) read_buf.data();
+                }
 
-    const int n_tokens    = batch.n_tokens;
-    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+                const int64_t t_start_us = ggml_time_us();
+                whisper_convert_weight(tensor, it_src->second, src);
+                t_convert_us += ggml_time_us() - t_start_us;
 
-    const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
+                n_converted++;
+                total_size += ggml_nbytes(tensor);
+                model.n_loaded++;
+                return;
+            }
 
-    const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
-    const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
+            if (buf_mapped && tensor->buffer == buf_mapped) {
+                // already points at its bytes in the mapping
+                mapped->pos += ggml_nbytes(tensor);
+            } else if (mapped && mapped->map->size - mapped->pos >= ggml_nbytes(tensor)) {
+                jobs.push_back({ tensor, mapped->map->addr + mapped->pos });
+                mapped->pos += ggml_nbytes(tensor);
+            } else if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                // for the CPU and Metal backend, we can read directly into the tensor
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+            } else {
+                // read into a temporary buffer first, then copy to device memory
+                read_buf.resize(ggml_nbytes(tensor));
 
-    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
+                loader->read(loader->context, read_buf.data(), read_buf.size());
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_decode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+            }
 
-    struct ggml_context * ctx0 = ggml_init(params);
+            total_size += ggml_nbytes(tensor);
+            model.n_loaded++;
+        };
 
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+        while (!gguf) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(embd, "embd");
-    ggml_set_input(embd);
+            read_safe(loader, n_dims);
+            read_safe(loader, length);
+            read_safe(loader, ttype);
 
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(position, "position");
-    ggml_set_input(position);
+            if (loader->eof(loader->context)) {
+                break;
+            }
 
-    const float KQscale = pow(float(n_state_head), -0.25);
+            int32_t nelements = 1;
+            int32_t ne[4] = { 1, 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                read_safe(loader, ne[i]);
+                nelements *= ne[i];
+            }
 
-    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD), 1);
-    ggml_set_name(KQ_mask, "KQ_mask");
-    ggml_set_input(KQ_mask);
+            std::string name;
+            std::vector<char> tmp(length); // create a buffer
+            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+            name.assign(&tmp[0], tmp.size());
 
-    struct ggml_tensor * KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
+            if (model.tensors.find(name) == model.tensors.end()) {
+                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                return false;
+            }
 
-    // token encoding + position encoding
-    struct ggml_tensor * cur =
-        ggml_add(ctx0,
-                ggml_get_rows(ctx0, model.d_te, embd),
-                ggml_get_rows(ctx0, model.d_pe, position));
+            auto tensor = model.tensors[name.data()];
 
-    struct ggml_tensor * inpL = cur;
+            if (ggml_nelements(tensor) != nelements) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                return false;
+            }
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
-    struct ggml_tensor * aheads_cross_QKs = nullptr;
+            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                return false;
+            }
 
-    for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_decoder[il];
+            const auto it_src = quant_src.find(name);
+            const ggml_type src_type = it_src != quant_src.end() ? it_src->second : tensor->type;
 
-        // norm
-        {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
+            if (ttype != src_type) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has type %s in model file, expected %s%s\n", __func__, name.data(),
+                        ggml_type_name(ggml_type(ttype)), ggml_type_name(src_type),
+                        mapped ? "" : " (mixed precision ggml models need use_mmap)");
+                return false;
+            }
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
-        }
+            const size_t bpe = ggml_type_size(ggml_type(ttype));
 
-        // self-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.attn_q_w,
-                    cur);
+            const size_t nbytes = ggml_row_size(src_type, tensor->ne[0])*ggml_nrows(tensor);
 
-            Qcur = ggml_add(ctx0,
-                        Qcur,
-                        layer.attn_q_b);
+            if ((nelements*bpe)/ggml_blck_size(src_type) != nbytes) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                        __func__, name.data(), nbytes, nelements*bpe);
+                return false;
+            }
 
-            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+            load_data(tensor);
+        }
 
-            // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
-                    layer.attn_k_w,
-                    cur);
+        // the GGUF tensor data follows the metadata, in the order of the offsets and with padding between tensors
+        if (gguf) {
+            const gguf_context * g = gguf.get();
 
-            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+            std::vector<int64_t> order(gguf_get_n_tensors(g));
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](int64_t a, int64_t b) {
+                return gguf_get_tensor_offset(g, a) < gguf_get_tensor_offset(g, b);
+            });
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+            size_t pos = sizeof(uint32_t); // the loader has only read the magic
 
-                Vcur = ggml_add(ctx0,
-                            Vcur,
-                            layer.attn_v_b);
+            for (const int64_t i : order) {
+                const char * name = gguf_get_tensor_name(g, i);
+                const size_t offs = gguf_get_data_offset(g) + gguf_get_tensor_offset(g, i);
 
-                struct ggml_tensor * k;
-                struct ggml_tensor * v;
+                const auto it = model.tensors.find(name);
+                if (it == model.tensors.end()) {
+                    WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name);
+                    return false;
+                }
 
-                if (wctx.params.flash_attn) {
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                ggml_tensor * tensor = it->second;
+                const ggml_tensor * meta = ggml_get_tensor(gguf_meta.get(), name);
 
-                    v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
-                } else {
-                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+                if (!ggml_are_same_shape(tensor, meta)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                            __func__, name, (int) meta->ne[0], (int) meta->ne[1], (int) meta->ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                    return false;
+                }
 
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                const auto it_src = quant_src.find(name);
+                const ggml_type src_type = it_src != quant_src.end() ? it_src->second : tensor->type;
+                const size_t nbytes = ggml_row_size(src_type, tensor->ne[0])*ggml_nrows(tensor);
 
-                    v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                            (   n_ctx)*ggml_element_size(kv_self.v),
-                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+                if (meta->type != src_type) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has type %s in model file, expected %s\n", __func__, name,
+                            ggml_type_name(meta->type), ggml_type_name(src_type));
+                    return false;
                 }
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
-            }
+                // skip the padding
+                if (mapped) {
+                    if (offs > mapped->map->size || mapped->map->size - offs < nbytes) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' is out of bounds in model file\n", __func__, name);
+                        return false;
+                    }
+                    mapped->pos = offs;
+                } else {
+                    while (pos < offs) {
+                        read_buf.resize(std::min<size_t>(offs - pos, 4096));
+                        loader->read(loader->context, read_buf.data(), read_buf.size());
+                        pos += read_buf.size();
+                    }
+                }
+                if (pos > offs || loader->eof(loader->context)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has invalid data offset in model file\n", __func__, name);
+                    return false;
+                }
 
-            // ------
+                load_data(tensor);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+                pos = offs + nbytes;
+            }
+        }
 
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+        if (n_converted > 0) {
+            WHISPER_LOG_INFO("%s: %zu tensors converted while loading in %.2f ms\n", __func__, n_converted, t_convert_us/1000.0);
+        }
 
-            if (wctx.params.flash_attn) {
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                            n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+        // with progressive_load, the decoder weights are copied while the first window is encoded
+        std::vector<whisper_load_job> jobs_decoder;
+        if (wctx.params.progressive_load) {
+            const auto it = std::stable_partition(jobs.begin(), jobs.end(), [](const whisper_load_job & job) {
+                return strncmp(ggml_get_name(job.tensor), "encoder.", 8) == 0;
+            });
+            jobs_decoder.assign(it, jobs.end());
+            jobs.erase(it, jobs.end());
+        }
 
-                cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
+        if (!jobs.empty()) {
+            const int64_t t_copy_us = ggml_time_us();
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
-            } else {
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            whisper_load_from_mapping(jobs);
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, 1.0f, 0.0f);
+            WHISPER_LOG_INFO("%s: %zu tensors copied from the mapped file in %.2f ms\n", __func__, jobs.size(), (ggml_time_us() - t_copy_us)/1000.0);
+        }
 
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                            n_kv, n_state_head, n_head,
-                            n_ctx*ggml_element_size(kv_self.v),
-                            n_ctx*ggml_element_size(kv_self.v)*n_state_head,
-                            n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+        if (!jobs_decoder.empty()) {
+            WHISPER_LOG_INFO("%s: copying %zu decoder tensors in the background\n", __func__, jobs_decoder.size());
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+            model.pending = std::async(std::launch::async, [](std::vector<whisper_load_job> jobs) {
+                const int64_t t_copy_us = ggml_time_us();
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                whisper_load_from_mapping(jobs);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
-            }
+                WHISPER_LOG_INFO("%s: %zu decoder tensors copied from the mapped file in %.2f ms\n", "whisper_model_load", jobs.size(), (ggml_time_us() - t_copy_us)/1000.0);
+            }, std::move(jobs_decoder)).share();
         }
 
-        // projection
-        {
-            cur = ggml_mul_mat(ctx0,
-                    layer.attn_ln_1_w,
-                    cur);
+        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.attn_ln_1_b);
+        if (model.n_loaded == 0) {
+            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
+        } else if (model.n_loaded != (int) model.tensors.size()) {
+            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
+            return false;
         }
+    }
 
-        // add the input
-        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
+    for (auto & buf : model.buffers) {
+        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    }
 
-        // norm
-        {
-            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
+    wctx.t_load_us = ggml_time_us() - t_start_us;
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.cross_attn_ln_0_w),
-                    layer.cross_attn_ln_0_b);
-        }
+    return true;
+}
 
-        // cross-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.cross_attn_q_w,
-                    cur);
+static bool whisper_encode_external(const whisper_state & wstate) {
+    GGML_UNUSED(wstate);
 
-            Qcur = ggml_add(ctx0,
-                        Qcur,
-                        layer.cross_attn_q_b);
+#ifndef WHISPER_USE_COREML
+    const bool use_coreml = false;
+#else
+    const bool use_coreml = wstate.ctx_coreml != nullptr;
+#endif
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+#ifndef WHISPER_USE_OPENVINO
+    const bool use_openvino = false;
+#else
+    const bool use_openvino = wstate.ctx_openvino != nullptr;
+#endif
 
-            if (wctx.params.flash_attn) {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+    return use_coreml || use_openvino;
+}
 
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+// the audio context the external encoder runs for the requested one (0 = full): the smallest compiled variant
+// that holds it, else the full context - the input shape of a compiled encoder is fixed
+static int whisper_external_audio_ctx(const whisper_state & wstate, int n_ctx) {
+    if (n_ctx <= 0) {
+        return 0;
+    }
+    for (int n : wstate.n_ctx_external) {
+        if (n >= n_ctx) {
+            return n;
+        }
+    }
+    return 0;
+}
 
-                cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
+// the weights the graphs of a state use: the copy on the GPU of the state when the context has several
+static const whisper_model & whisper_state_model(const whisper_context & wctx, const whisper_state & wstate) {
+    return wstate.device && wstate.device->model ? *wstate.device->model : wctx.model;
+}
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
-            } else {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+// the cross-attention K/V are projected at the end of the encoder graph instead of in a graph of their own
+static bool whisper_fuse_cross(const whisper_context & wctx, const whisper_state & wstate) {
+    return wctx.params.fuse_cross && !whisper_encode_external(wstate);
+}
 
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_audio_ctx, n_state_head, n_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+static void whisper_build_cross_kv(
+        struct ggml_context * ctx0,
+        struct ggml_cgraph  * gf,
+        whisper_context & wctx,
+          whisper_state & wstate,
+        struct ggml_tensor * cur);
 
-                // ------
+// ggml_conv_1d_ph for b->ne[2] > 1: the im2col matmul yields [OL, N, OC], so
+// swap the last two dims back to the [OL, OC, N] layout the caller expects
+static struct ggml_tensor * whisper_conv_1d_ph_batch(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+                        int   s) {
+    struct ggml_tensor * im2col = ggml_im2col(ctx, a, b, s, 0, a->ne[0]/2, 0, 1, 0, false, GGML_TYPE_F16);
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+    struct ggml_tensor * cur =
+        ggml_mul_mat(ctx,
+                ggml_reshape_2d(ctx, im2col, im2col->ne[0], im2col->ne[2]*im2col->ne[1]),
+                ggml_reshape_2d(ctx, a, a->ne[0]*a->ne[1], a->ne[2]));
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+    cur = ggml_reshape_3d(ctx, cur, im2col->ne[1], im2col->ne[2], a->ne[2]);
 
-                // [EXPERIMENTAL] Token-level timestamps with DTW
-                if (wctx.params.dtw_token_timestamps) {
-                    if (wstate.aheads_masks.m[il] != nullptr) {
-                        struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
-                        if (aheads_cross_QKs == NULL) {
-                            aheads_cross_QKs = aheads_KQs;
-                        } else {
-                            aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
-                        }
-                    }
-                }
+    return ggml_cont(ctx, ggml_permute(ctx, cur, 0, 2, 1, 3));
+}
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
+// the CPU backend tiles a CONV_2D through a 16 MB work buffer; a smaller im2col
+// matrix costs less memory than growing that buffer for it
+#define WHISPER_CONV_DIRECT_MIN_BYTES (8*1024*1024)
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+// the Vulkan CONV_2D is an implicit GEMM (on the tensor cores with coopmat2), as fast as the
+// im2col matmul without the write and read of the im2col matrix, so it is used at every size
+static bool whisper_backend_conv_direct(ggml_backend_t backend) {
+    ggml_backend_dev_t dev = ggml_backend_get_device(backend);
+    return dev && strcmp(ggml_backend_reg_name(ggml_backend_dev_backend_reg(dev)), "Vulkan") == 0;
+}
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
-            }
+// conv1d with half padding: b [L, IC, N] -> [OL, OC, N]
+// for the large models (or on Vulkan) this is a CONV_2D with a 1-high kernel where the backend has
+// it, which convolves without materializing the im2col matrix; otherwise im2col + mul_mat
+static struct ggml_tensor * whisper_conv_1d_ph(
+        struct ggml_context * ctx,
+             ggml_backend_t   backend,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+                        int   s) {
+    const int64_t n_im2col = a->ne[0]*a->ne[1]*(b->ne[0]/s)*b->ne[2];
+
+    if (whisper_backend_conv_direct(backend) || n_im2col*(int64_t) sizeof(ggml_fp16_t) >= WHISPER_CONV_DIRECT_MIN_BYTES) {
+        struct ggml_tensor * cur = ggml_conv_2d_direct(ctx,
+                ggml_reshape_4d(ctx, a, a->ne[0], 1, a->ne[1], a->ne[2]),
+                ggml_reshape_4d(ctx, b, b->ne[0], 1, b->ne[1], b->ne[2]),
+                s, 1, a->ne[0]/2, 0, 1, 1);
+
+        if (ggml_backend_supports_op(backend, cur)) {
+            return ggml_reshape_3d(ctx, cur, cur->ne[0], cur->ne[2], cur->ne[3]);
         }
+    }
 
-        // projection
-        {
-            cur = ggml_mul_mat(ctx0,
-                    layer.cross_attn_ln_1_w,
-                    cur);
+    return b->ne[2] == 1 ? ggml_conv_1d_ph(ctx, a, b, s, 1) : whisper_conv_1d_ph_batch(ctx, a, b, s);
+}
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.cross_attn_ln_1_b);
-        }
+// the CPU flash attention kernel is tiled for F16 K/V, so the encoder self-attention on the CPU uses it even
+// when flash attention is disabled - this avoids the [n_ctx, n_ctx, n_head] KQ matrix of the mul_mat path
+// the decoder is not affected, its KV cache layout depends on params.flash_attn
+static bool whisper_encoder_use_fused_attn(const whisper_context & wctx, ggml_backend_t backend) {
+    return wctx.itype == GGML_TYPE_F16 && ggml_backend_is_cpu(backend);
+}
 
-        // add the input
-        cur = ggml_add(ctx0, cur, inpCA);
+// the backend that runs the conv and encoder graphs
+static ggml_backend_t whisper_encoder_backend(const whisper_state & wstate) {
+    return wstate.backend_encoder ? wstate.backend_encoder : wstate.backends[0];
+}
 
-        struct ggml_tensor * inpFF = cur;
+// on the CPU, the encoder activations that only feed F16 matmuls (the layer norm outputs and the GELU output) are
+// stored as F16: the backend fuses the cast into the norm and bias + GELU kernels, and the matmul takes the F16
+// rows as they are instead of converting its F32 input first. The residual stream, attention and all accumulation
+// stay F32. Quantized weights quantize their input anyway, so it stays F32 for them.
+static bool whisper_encoder_use_f16_act(const whisper_context & wctx, ggml_backend_t backend) {
+    return wctx.itype == GGML_TYPE_F16 && ggml_backend_is_cpu(backend);
+}
 
-        // feed-forward network
-        {
-            // norm
-            {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+static struct ggml_tensor * whisper_f16_act(struct ggml_context * ctx0, struct ggml_tensor * cur, bool f16) {
+    return f16 ? ggml_cast(ctx0, cur, GGML_TYPE_F16) : cur;
+}
 
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            cur,
-                            layer.mlp_ln_w),
-                        layer.mlp_ln_b);
-            }
+static bool whisper_qkv_f16(const whisper_layer_encoder & layer) {
+    return layer.attn_q_w->type == GGML_TYPE_F16 && layer.attn_k_w->type == GGML_TYPE_F16 && layer.attn_v_w->type == GGML_TYPE_F16;
+}
 
-            // fully connected
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_0_w,
-                    cur);
+static bool whisper_cross_f16(const whisper_model & model) {
+    for (const auto & layer : model.layers_decoder) {
+        if (layer.cross_attn_k_w->type != GGML_TYPE_F16 || layer.cross_attn_v_w->type != GGML_TYPE_F16) {
+            return false;
+        }
+    }
+    return true;
+}
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.mlp_0_b);
+static struct ggml_cgraph * whisper_build_graph_conv(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = whisper_state_model(wctx, wstate);
+    const auto & hparams = model.hparams;
 
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
 
-            // projection
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_1_w,
-                    cur);
+    const int n_mels = hparams.n_mels;
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.mlp_1_b);
-        }
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_conv.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_conv.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-        inpL = ggml_add(ctx0, cur, inpFF);
-    }
+    struct ggml_context * ctx0 = ggml_init(params);
 
-    cur = inpL;
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    // norm
-    {
-        cur = ggml_norm(ctx0, cur, hparams.eps);
+    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
 
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0,
-                    cur,
-                    model.d_ln_w),
-                model.d_ln_b);
-    }
+    struct ggml_tensor * cur = nullptr;
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    if (!whisper_encode_external(wstate)) {
+        // convolution + gelu
+        {
+            cur = whisper_conv_1d_ph(ctx0, whisper_encoder_backend(wstate), model.e_conv_1_w, mel, 1);
+            cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+            cur = ggml_gelu(ctx0, cur);
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
-    if (wctx.params.dtw_token_timestamps && aheads_cross_QKs != nullptr) {
-        aheads_cross_QKs = ggml_transpose(ctx0, aheads_cross_QKs);
-        aheads_cross_QKs = ggml_cont(ctx0, aheads_cross_QKs);
-        if (save_alignment_heads_QKs) {
-            ggml_build_forward_expand(gf, aheads_cross_QKs);
-            wstate.aheads_cross_QKs = aheads_cross_QKs;
+            cur = whisper_conv_1d_ph(ctx0, whisper_encoder_backend(wstate), model.e_conv_2_w, cur, 2);
+            cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+
+            cur = ggml_gelu(ctx0, cur);
+        }
+
+        if (wstate.embd_io.buffer) {
+            cur = ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, wstate.embd_io.k, n_ctx, n_state, n_ctx*sizeof(float), 0));
+        }
+
+        ggml_set_name(cur, "embd_conv");
+        wstate.embd_conv = cur;
+    } else {
+        ggml_build_forward_expand(gf, mel);
+
+        if (wstate.embd_io.buffer) {
+            cur = ggml_view_2d(ctx0, wstate.embd_io.v, n_state, n_ctx, n_state*sizeof(float), 0);
+        } else {
+            cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+            ggml_set_input(cur); // the external encoder will write into this tensor
         }
+
+        ggml_set_name(cur, "embd_enc");
+        wstate.embd_enc = cur;
     }
 
-    ggml_build_forward_expand(gf, logits);
+    ggml_set_output(cur);
+
+    ggml_build_forward_expand(gf, cur);
 
     ggml_free(ctx0);
 
     return gf;
 }
 
-// evaluate the decoder
-//
-// given text prompt + audio features -> computes the logits for the next token
-//
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
-//
-static bool whisper_decode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-    const whisper_batch & batch,
-              const int   n_threads,
-                   bool   save_alignment_heads_QKs,
-    ggml_abort_callback   abort_callback,
-                   void * abort_callback_data) {
-    const int64_t t_start_us = ggml_time_us();
+// res (= w*cur) plus the low-rank delta of every adapter of the state that has w
+static struct ggml_tensor * whisper_lora_add(
+        struct ggml_context * ctx0,
+      const whisper_state & wstate,
+         struct ggml_tensor * w,
+         struct ggml_tensor * cur,
+         struct ggml_tensor * res) {
+    for (const auto & lora : wstate.loras) {
+        const whisper_adapter_lora_weight * lw = lora.first->get_weight(w);
+        if (lw == nullptr) {
+            continue;
+        }
 
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+        // the F16 encoder activations only suit F16 weights
+        struct ggml_tensor * x = cur->type == GGML_TYPE_F32 || cur->type == lw->a->type ? cur : ggml_cast(ctx0, cur, GGML_TYPE_F32);
 
-    const int n_vocab  = hparams.n_vocab;
-    const int n_tokens = batch.n_tokens;
+        struct ggml_tensor * ab_cur = ggml_mul_mat(ctx0, lw->b, ggml_mul_mat(ctx0, lw->a, x));
 
-    auto & logits_out = wstate.logits;
+        res = ggml_add(ctx0, res, ggml_scale(ctx0, ab_cur, lw->get_scale(lora.first->alpha, lora.second)));
+    }
 
-    struct ggml_tensor * logits;
+    return res;
+}
 
-    // find KV slot for the batch
-    {
-        auto & kv_self = wstate.kv_self;
+// w*cur with the adapters of the state
+static struct ggml_tensor * whisper_mm(
+        struct ggml_context * ctx0,
+      const whisper_state & wstate,
+         struct ggml_tensor * w,
+         struct ggml_tensor * cur) {
+    return whisper_lora_add(ctx0, wstate, w, cur, ggml_mul_mat(ctx0, w, cur));
+}
 
-        if (!whisper_kv_cache_find_slot(kv_self, batch)) {
-            return false;
-        }
+// the self-attention projections of cur: one matmul over the packed weights when the layer has them (fuse_qkv),
+// else one per projection; Q and V come with their bias, K has none
+template <typename T>
+static void whisper_build_qkv(
+        struct ggml_context * ctx0,
+      const whisper_state & wstate,
+                    const T & layer,
+         struct ggml_tensor * cur,
+         struct ggml_tensor *& Qcur,
+         struct ggml_tensor *& Kcur,
+         struct ggml_tensor *& Vcur) {
+    if (!layer.attn_qkv_w) {
+        Qcur = ggml_add(ctx0, whisper_mm(ctx0, wstate, layer.attn_q_w, cur), layer.attn_q_b);
+        Kcur = whisper_mm(ctx0, wstate, layer.attn_k_w, cur);
+        Vcur = ggml_add(ctx0, whisper_mm(ctx0, wstate, layer.attn_v_w, cur), layer.attn_v_b);
+        return;
+    }
 
-        const uint32_t pad = whisper_kv_cache_get_padding(wctx);
-        kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
+    struct ggml_tensor * qkv = whisper_mm(ctx0, wstate, layer.attn_qkv_w, cur);
 
-        //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
-        //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
-    }
+    const int64_t n_state = layer.attn_q_w->ne[1];
 
-    // decoder
-    {
-        auto & sched = wstate.sched_decode.sched;
+    auto rows = [&](int i) {
+        return ggml_view_2d(ctx0, qkv, n_state, qkv->ne[1], qkv->nb[1], i*n_state*ggml_element_size(qkv));
+    };
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+    // the adds write contiguous Q and V; K is copied out, the graphs reshape and scale it
+    // (the adapters have the deltas of the unpacked weights, whose views carry their names)
+    Qcur = ggml_add(ctx0, whisper_lora_add(ctx0, wstate, layer.attn_q_w, cur, rows(0)), layer.attn_q_b);
+    Kcur = whisper_lora_add(ctx0, wstate, layer.attn_k_w, cur, rows(1));
+    Kcur = Kcur->op == GGML_OP_VIEW ? ggml_cont(ctx0, Kcur) : Kcur;
+    Vcur = ggml_add(ctx0, whisper_lora_add(ctx0, wstate, layer.attn_v_w, cur, rows(2)), layer.attn_v_b);
+}
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+static struct ggml_cgraph * whisper_build_graph_encoder(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = whisper_state_model(wctx, wstate);
+    const auto & hparams = model.hparams;
 
-        // set the inputs
-        {
-            struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
-            ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
-        }
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
 
-        {
-            struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
-            for (int i = 0; i < n_tokens; ++i) {
-                const int32_t val = batch.pos[i];
-                ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
-            }
-        }
+    const int n_state_head = n_state/n_head;
 
-        {
-            struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask");
+    auto & kv_pad = wstate.kv_pad;
 
-            auto & kv_self = wstate.kv_self;
+    WHISPER_ASSERT(!!kv_pad.buffer);
 
-            const int32_t n_kv = kv_self.n;
+    const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
-            wstate.inp_mask.resize(ggml_nelements(KQ_mask));
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-            float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
+    struct ggml_context * ctx0 = ggml_init(params);
 
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
-                    }
-                }
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
 
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
-                }
-            }
+    const float KQscale = 1.0f/sqrtf(float(n_state_head));
 
-            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
-        }
+    // ===================================================================
+    // NOTE: experimenting with partial evaluation of the encoder (ignore)
+    //static int iter = -1;
+    //const int n_iter = 1500/n_ctx;
 
-        logits = ggml_graph_node(gf, -1);
+    //iter = (iter + 1) % n_iter;
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
-        }
-    }
+    //if (iter == 0) {
+    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
+    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
+    //}
 
-    logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
-        }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
-    }
+    static int iter = 0;
 
-    if (batch.n_tokens > 1) {
-        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        ggml_used_mem(ctx0)/1e6,
-        //        wstate.get_buf_max_mem(0)/1e6,
-        //        wstate.get_buf_max_mem(1)/1e6,
-        //        wstate.get_buf_max_mem(2)/1e6,
-        //        wstate.get_buf_max_mem(3)/1e6);
-    }
+    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
 
-    if (batch.n_tokens == 1) {
-        wstate.t_decode_us += ggml_time_us() - t_start_us;
-        wstate.n_decode++;
-    } else if (batch.n_tokens < 16) {
-        wstate.t_batchd_us += ggml_time_us() - t_start_us;
-        wstate.n_batchd += n_tokens;
-    } else {
-        wstate.t_prompt_us += ggml_time_us() - t_start_us;
-        wstate.n_prompt += n_tokens;
-    }
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
 
-    return !(abort_callback && abort_callback(abort_callback_data));
-}
+    // ===================================================================
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
-    msec = msec - min * (1000 * 60);
-    int64_t sec = msec / 1000;
-    msec = msec - sec * 1000;
+    // original:
+    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+    struct ggml_tensor * inpL = cur;
 
-    return std::string(buf);
-}
+    const bool f16_act = whisper_encoder_use_f16_act(wctx, whisper_encoder_backend(wstate));
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
-namespace {
-struct whisper_global_cache {
-    // In FFT, we frequently use sine and cosine operations with the same values.
-    // We can use precalculated values to speed up the process.
-    float sin_vals[SIN_COS_N_COUNT];
-    float cos_vals[SIN_COS_N_COUNT];
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_encoder[il];
 
-    // Hann window (Use cosf to eliminate difference)
-    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
-    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
-    float hann_window[WHISPER_N_FFT];
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
 
-    whisper_global_cache() {
-        fill_sin_cos_table();
-        fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
-    }
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
 
-    void fill_sin_cos_table() {
-        for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-            double theta = (2 * M_PI * i) / SIN_COS_N_COUNT;
-            sin_vals[i] = sinf(theta);
-            cos_vals[i] = cosf(theta);
+            cur = whisper_f16_act(ctx0, cur, f16_act && whisper_qkv_f16(layer));
         }
-    }
 
-    void fill_hann_window(int length, bool periodic, float * output) {
-        int offset = -1;
-        if (periodic) {
-            offset = 0;
-        }
-        for (int i = 0; i < length; i++) {
-            output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
-        }
-    }
-} global_cache;
-}
+        // self-attention
+        {
+            struct ggml_tensor * Qcur;
+            struct ggml_tensor * Kcur;
+            struct ggml_tensor * Vcur;
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const float* in, int N, float* out) {
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+            // note: no bias for Key
+            whisper_build_qkv(ctx0, wstate, layer, cur, Qcur, Kcur, Vcur);
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+            // ------
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*global_cache.cos_vals[idx]; // cos(t)
-            im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
-        }
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_ctx),
+                        0, 2, 1, 3);
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
-    }
-}
+            if (wctx.params.flash_attn) {
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, ggml_view_1d(ctx0, kv_pad.k, n_ctx*n_state, 0)));
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, ggml_view_1d(ctx0, kv_pad.v, n_ctx*n_state, 0)));
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(float* in, int N, float* out) {
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
-    }
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_pad.k,
+                            n_state_head, n_ctx_pad, n_head,
+                            ggml_row_size(kv_pad.k->type, n_state),
+                            ggml_row_size(kv_pad.k->type, n_state_head),
+                            0);
 
-    const int half_N = N / 2;
-    if (N - half_N*2 == 1) {
-        dft(in, N, out);
-        return;
-    }
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_pad.v,
+                            n_state_head, n_ctx_pad, n_head,
+                            ggml_row_size(kv_pad.v->type, n_state),
+                            ggml_row_size(kv_pad.v->type, n_state_head),
+                            0);
 
-    float* even = in + N;
-    for (int i = 0; i < half_N; ++i) {
-        even[i]= in[2*i];
-    }
-    float* even_fft = out + 2 * N;
-    fft(even, half_N, even_fft);
+                cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
 
-    float* odd = even;
-    for (int i = 0; i < half_N; ++i) {
-        odd[i] = in[2*i + 1];
-    }
-    float* odd_fft = even_fft + N;
-    fft(odd, half_N, odd_fft);
+                cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx);
+            } else if (whisper_encoder_use_fused_attn(wctx, whisper_encoder_backend(wstate))) {
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_reshape_3d(ctx0, Kcur, n_state_head, n_head, n_ctx),
+                                wctx.itype),
+                            0, 2, 1, 3);
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < half_N; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = global_cache.cos_vals[idx]; // cos(t)
-        float im = -global_cache.sin_vals[idx]; // sin(t)
+                struct ggml_tensor * V =
+                    ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_reshape_3d(ctx0, Vcur, n_state_head, n_head, n_ctx),
+                                wctx.itype),
+                            0, 2, 1, 3);
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+                cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+                cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx);
+            } else {
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_reshape_3d(ctx0, Kcur, n_state_head, n_head, n_ctx),
+                                wctx.itype),
+                            0, 2, 1, 3);
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
-    }
-}
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
 
-    int n_fft = filters.n_fft;
-    int i = ith;
+                struct ggml_tensor * V =
+                    ggml_cast(ctx0,
+                            ggml_permute(ctx0,
+                                ggml_reshape_3d(ctx0,
+                                    Vcur,
+                                    n_state_head, n_head, n_ctx),
+                                1, 2, 0, 3),
+                            wctx.itype);
 
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    assert(n_fft == 1 + (frame_size / 2));
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-        // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
+                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx);
+            }
         }
 
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
+        // projection
+        {
+            cur = whisper_mm(ctx0, wstate,
+                    layer.attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0, cur, layer.attn_ln_1_b);
         }
 
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
+        // add the input
+        cur = ggml_add(ctx0, cur, inpL);
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+        struct ggml_tensor * inpFF = cur;
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0, cur, layer.mlp_ln_w),
+                        layer.mlp_ln_b);
+
+                cur = whisper_f16_act(ctx0, cur, f16_act && layer.mlp_0_w->type == GGML_TYPE_F16);
             }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
-        }
-    }
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
-        }
-    }
-}
+            // fully connected
+            cur = whisper_mm(ctx0, wstate,
+                    layer.mlp_0_w,
+                    cur);
 
-// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
-static bool log_mel_spectrogram(
-              whisper_state & wstate,
-              const float * samples,
-              const int   n_samples,
-              const int   /*sample_rate*/,
-              const int   frame_size,
-              const int   frame_step,
-              const int   n_mel,
-              const int   n_threads,
-              const whisper_filters & filters,
-              const bool   debug,
-              whisper_mel & mel) {
-    const int64_t t_start_us = ggml_time_us();
+            cur = ggml_add(ctx0, cur, layer.mlp_0_b);
 
-    // Hann window
-    WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
-    const float * hann = global_cache.hann_window;
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
 
-    // Calculate the length of padding
-    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
-    int64_t stage_2_pad = frame_size / 2;
+            cur = whisper_f16_act(ctx0, cur, f16_act && layer.mlp_1_w->type == GGML_TYPE_F16);
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
-    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+            // projection
+            cur = whisper_mm(ctx0, wstate,
+                    layer.mlp_1_w,
+                    cur);
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+            cur = ggml_add(ctx0, cur, layer.mlp_1_b);
+        }
 
-    // reflective pad 200 samples at the beginning of audio
-    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
 
-    mel.n_mel     = n_mel;
-    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
-    // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
-    // Calculate semi-padded sample length to ensure compatibility
-    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
-    mel.data.resize(mel.n_mel * mel.n_len);
+    cur = inpL;
 
+    // norm
     {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
-
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        cur = ggml_norm(ctx0, cur, hparams.eps);
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
+        // cur = ln_f_g*cur + ln_f_b
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0, cur, model.e_ln_w),
+                model.e_ln_b);
     }
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+    if (whisper_fuse_cross(wctx, wstate)) {
+        // the encoder output is only needed for the projections, so it never leaves the compute buffer
+        whisper_build_cross_kv(ctx0, gf, wctx, wstate, whisper_f16_act(ctx0, cur, f16_act && whisper_cross_f16(model)));
+    } else {
+        if (wstate.embd_io.buffer) {
+            cur = ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, wstate.embd_io.v, n_state, n_ctx, n_state*sizeof(float), 0));
         }
+
+        ggml_build_forward_expand(gf, cur);
     }
 
-    mmax -= 8.0;
+    wstate.embd_enc = cur;
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+    //ggml_graph_print(gf);
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+    ////////////////////////////////////////////////////////////////////////////
 
-    wstate.t_mel_us += ggml_time_us() - t_start_us;
+    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
+    //        ggml_used_mem(ctx0)/1e6,
+    //        wstate.get_buf_max_mem(0)/1e6,
+    //        wstate.get_buf_max_mem(1)/1e6,
+    //        wstate.get_buf_max_mem(2)/1e6,
+    //        wstate.get_buf_max_mem(3)/1e6);
 
-    // Dump log_mel_spectrogram
-    if (debug) {
-        std::ofstream outFile("log_mel_spectrogram.json");
-        outFile << "[";
-        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
-            outFile << mel.data[i] << ", ";
-        }
-        outFile << mel.data[mel.data.size() - 1] << "]";
-        outFile.close();
-    }
+    ggml_free(ctx0);
 
-    return true;
+    return gf;
 }
 
-// split text into tokens
-//
-// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
-//
-// Regex (Python):
-// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
-//
-// Regex (C++):
-// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
-//
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// project the encoder output to the cross-attention K/V of every decoder layer and copy them into kv_cross
+static void whisper_build_cross_kv(
+        struct ggml_context * ctx0,
+        struct ggml_cgraph  * gf,
+        whisper_context & wctx,
+          whisper_state & wstate,
+        struct ggml_tensor * cur) {
+    const auto & model   = whisper_state_model(wctx, wstate);
+    const auto & hparams = model.hparams;
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
 
-        std::regex re(pat);
-        std::smatch m;
+    const int n_state_head = n_state/n_head;
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
-        }
-    }
+    const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
-    // find the longest tokens that form the words:
-    std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
+    const float  Kscale = pow(float(n_state_head), -0.25);
 
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
-                    break;
-                }
-                --j;
-            }
-            if (!found) {
-                WHISPER_LOG_ERROR("unknown token\n");
-                ++i;
-            }
-        }
-    }
+    for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+        auto & layer = model.layers_decoder[il];
 
-    return tokens;
-}
+        struct ggml_tensor * Kcross = whisper_mm(ctx0, wstate,
+                layer.cross_attn_k_w,
+                cur);
 
-//
-// interface implementation
-//
+        Kcross = ggml_scale(ctx0, Kcross, Kscale);
 
-#ifdef WHISPER_USE_COREML
-// replace .bin with -encoder.mlmodelc
-static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
-    }
+        struct ggml_tensor * Vcross = whisper_mm(ctx0, wstate,
+                layer.cross_attn_v_w,
+                cur);
 
-    // match "-qx_x"
-    pos = path_bin.rfind('-');
-    if (pos != std::string::npos) {
-        auto sub = path_bin.substr(pos);
-        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
-            path_bin = path_bin.substr(0, pos);
+        Vcross = ggml_add(ctx0,
+                    Vcross,
+                    layer.cross_attn_v_b);
+
+        // with a remote encoder, convert to the cache type over there so the KV comes back in its final size
+        if (wstate.backend_encoder) {
+            Kcross = ggml_cast(ctx0, Kcross, wstate.kv_cross.k->type);
+            Vcross = ggml_cast(ctx0, Vcross, wstate.kv_cross.v->type);
+        }
+
+        struct ggml_tensor * k;
+        struct ggml_tensor * v;
+
+        if (wctx.params.flash_attn) {
+            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx_pad));
+
+            v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
+                    ggml_row_size(wstate.kv_cross.v->type, n_state)*(il*n_ctx_pad));
+        } else {
+            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+
+            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx));
+
+            v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
+                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
+                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
         }
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
     }
+}
 
-    path_bin += "-encoder.mlmodelc";
+// pre-compute cross-attention memory
+static struct ggml_cgraph * whisper_build_graph_cross(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_cross.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_cross.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-    return path_bin;
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+
+    whisper_build_cross_kv(ctx0, gf, wctx, wstate, cur);
+
+    //ggml_graph_print(gf);
+
+    ggml_free(ctx0);
+
+    return gf;
 }
-#endif
 
-#ifdef WHISPER_USE_OPENVINO
-// replace .bin with-encoder-openvino.xml
-static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
+// 64-bit hash of the encoder input; 8 bytes at a time (mix from splitmix64)
+static uint64_t whisper_hash_input(const float * data, size_t n, uint64_t seed) {
+    uint64_t h = seed ^ (n * 0x9e3779b97f4a7c15ull);
+
+    const uint8_t * p = (const uint8_t *) data;
+    const size_t nb = n*sizeof(float);
+
+    size_t i = 0;
+    for (; i + 8 <= nb; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        h = (h ^ v) * 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 31;
+    }
+    for (; i < nb; ++i) {
+        h = (h ^ p[i]) * 0x94d049bb133111ebull;
     }
 
-    path_bin += "-encoder-openvino.xml";
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
 
-    return path_bin;
+    return h;
 }
 
-static std::string whisper_openvino_get_path_cache(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
+// copy 2*n_ctx mel frames starting at mel_offset into dst ([n_mel][2*n_ctx]),
+// zero past the end of the spectrogram
+static void whisper_histogram_add(whisper_histogram & h, int64_t t_us, int64_t n = 1) {
+    int i = 0;
+    for (int64_t v = t_us; v > 1 && i < WHISPER_METRICS_N_BUCKETS - 1; v >>= 1) {
+        ++i;
     }
 
-    path_bin += "-encoder-openvino-cache";
+    h.count      += n;
+    h.sum_us     += t_us*n;
+    h.max_us      = std::max(h.max_us, t_us);
+    h.buckets[i] += n;
+}
 
-    return path_bin;
+static void whisper_histogram_merge(whisper_histogram & dst, const whisper_histogram & src) {
+    dst.count  += src.count;
+    dst.sum_us += src.sum_us;
+    dst.max_us  = std::max(dst.max_us, src.max_us);
+    for (int i = 0; i < WHISPER_METRICS_N_BUCKETS; ++i) {
+        dst.buckets[i] += src.buckets[i];
+    }
 }
-#endif
 
-struct whisper_state * whisper_init_state(whisper_context * ctx) {
-    whisper_state * state = new whisper_state;
+// ggml_backend_sched_alloc_graph() with the time spent recorded in the state metrics
+static bool whisper_sched_alloc(whisper_state & wstate, ggml_backend_sched_t sched, ggml_cgraph * gf) {
+    const int64_t t_start_us = ggml_time_us();
 
-    state->backends = whisper_backend_init(ctx->params);
-    if (state->backends.empty()) {
-        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
-        whisper_free_state(state);
-        return nullptr;
-    }
+    const bool ok = ggml_backend_sched_alloc_graph(sched, gf);
 
-    // at this point, we don't know yet how many decoders will be used
-    // later during decoding, if more decoders are used, we will recreate the KV cache respectively
-    state->kv_self_n_dec = 1;
-    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
-                ctx->model.hparams.n_text_state,
-                ctx->model.hparams.n_text_layer,
-                GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
-        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
-        whisper_free_state(state);
-        return nullptr;
-    }
+    whisper_histogram_add(wstate.h_alloc, ggml_time_us() - t_start_us);
 
-    {
-        const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
-        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
+    return ok;
+}
+
+// frames from mel_end on read as the trailing padding of the spectrogram (silence)
+static void whisper_mel_window(const whisper_mel & mel, int mel_offset, int mel_end, int n_ctx, float * dst) {
+    memset(dst, 0, sizeof(float)*mel.n_mel*2*n_ctx);
+
+    const int i0 = std::min(mel_offset,           mel.n_len);
+    const int i1 = std::min(mel_offset + 2*n_ctx, mel.n_len);
+    const int ie = std::max(i0, std::min(i1, mel_end));
+
+    for (int j = 0; j < mel.n_mel; ++j) {
+        for (int i = i0; i < ie; ++i) {
+            dst[j*2*n_ctx + (i - i0)] = mel.data[j*mel.n_len + i];
+        }
+        for (int i = ie; i < i1; ++i) {
+            dst[j*2*n_ctx + (i - i0)] = mel.data[j*mel.n_len + mel.n_len - 1];
+        }
     }
+}
 
-    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->itype,
-                ctx->model.hparams.n_text_state,
-                ctx->model.hparams.n_text_layer,
-                GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
-        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for cross-attention cache\n", __func__);
-        whisper_free_state(state);
-        return nullptr;
+// evaluate the encoder with the given state
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    const int64_t t_start_us = ggml_time_us();
+
+    if (whisper_encode_external(wstate)) {
+        // the decoder reads the context back from the state, so it follows the variant that runs
+        wstate.exp_n_audio_ctx = whisper_external_audio_ctx(wstate, wstate.exp_n_audio_ctx);
     }
 
+    // the window was encoded in a batch with the windows of other states right before (encoder_window_callback)
     {
-        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
-        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
+        const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+        const bool batched = wstate.enc_batch_offset == mel_offset && wstate.enc_batch_n_ctx == n_ctx &&
+                             wstate.enc_batch_mel_end == wstate.mel_end;
+        wstate.enc_batch_offset = -1;
+        if (batched && wstate.enc_valid) {
+            WHISPER_LOG_DEBUG("%s: taking the batched encoder output for offset %d\n", __func__, mel_offset);
+            return !(abort_callback && abort_callback(abort_callback_data));
+        }
     }
 
-    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype,
-                ctx->model.hparams.n_audio_state,
-                1,
-                GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
-        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
-        whisper_free_state(state);
-        return nullptr;
+    // the decoder graph that is kept allocated lives in the same compute buffers
+    if (wstate.sched_decode.sched == wstate.sched_conv.sched && wstate.graph_decode.gf) {
+        ggml_backend_sched_reset(wstate.sched_decode.sched);
+        wstate.graph_decode.gf = nullptr;
     }
 
+    // conv
     {
-        const size_t memory_size = ggml_nbytes(state->kv_pad.k) + ggml_nbytes(state->kv_pad.v);
-        WHISPER_LOG_INFO("%s: kv pad  size  = %7.2f MB\n", __func__, memory_size / 1e6);
-    }
+        auto & sched = wstate.sched_conv.sched;
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
-    if (ctx->params.dtw_token_timestamps) {
-        if (!aheads_masks_init(ctx->params, ctx->model.hparams, state->aheads_masks, state->backends[0])) {
-            WHISPER_LOG_ERROR("%s: aheads_masks_init() failed for alignment heads masks\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
-        }
-        const size_t memory_size = aheads_masks_nbytes(state->aheads_masks);
-        WHISPER_LOG_INFO("%s: alignment heads masks size = %ld B\n", __func__, memory_size);
-    }
+        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
 
-#ifdef WHISPER_USE_COREML
-    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+        if (!whisper_sched_alloc(wstate, sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
 
-    WHISPER_LOG_INFO("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
-    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
 
-    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
-    if (!state->ctx_coreml) {
-        WHISPER_LOG_ERROR("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
-#ifndef WHISPER_COREML_ALLOW_FALLBACK
-        whisper_free_state(state);
-        return nullptr;
-#endif
-    } else {
-        WHISPER_LOG_INFO("%s: Core ML model loaded\n", __func__);
-    }
-#endif
+        // set the input
+        {
+            const auto & mel_inp = wstate.mel;
+            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+            assert(mel->type == GGML_TYPE_F32);
+            assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
 
-    state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
+            wstate.inp_mel.resize(ggml_nelements(mel));
 
-    // TAGS: WHISPER_DECODER_INIT
-    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+            float * dst = wstate.inp_mel.data();
+            whisper_mel_window(mel_inp, mel_offset, wstate.mel_end, n_ctx, dst);
+
+            if (wctx.params.encoder_cache) {
+                // kv_cross only depends on the mel window and the audio context
+                const uint64_t key = whisper_hash_input(dst, wstate.inp_mel.size(), (uint64_t) n_ctx);
+                if (wstate.enc_valid && wstate.enc_key == key) {
+                    ggml_backend_sched_reset(sched);
+                    WHISPER_LOG_DEBUG("%s: reusing the encoder output for offset %d\n", __func__, mel_offset);
+                    return !(abort_callback && abort_callback(abort_callback_data));
+                }
+                wstate.enc_key = key;
+            }
+            // kv_cross is about to be overwritten
+            wstate.enc_valid = false;
 
-    state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
-    state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
-    state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
-    state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
+            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+        }
 
-    state->decoders[0].rng = std::mt19937(0);
+        if (!whisper_encode_external(wstate)) {
+            whisper_trace_scope trace("conv");
+            if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool, WHISPER_CPU_WORK_ENCODE)) {
+                return false;
+            }
+        } else {
+            ggml_backend_sched_reset(sched);
 
-    // conv allocator
-    {
-        bool ok = whisper_sched_graph_init(state->sched_conv, state->backends,
-                [&]() {
-                    return whisper_build_graph_conv(*ctx, *state);
-                });
+            // the variant compiled for this context, if it is not the full one
+            const auto it = std::find(wstate.n_ctx_external.begin(), wstate.n_ctx_external.end(), wstate.exp_n_audio_ctx);
+            const int  iv = it != wstate.n_ctx_external.end() ? int(it - wstate.n_ctx_external.begin()) : -1;
+            GGML_UNUSED(iv);
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init conv allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
+#if defined(WHISPER_USE_COREML)
+            whisper_coreml_encode(iv >= 0 ? wstate.ctx_coreml_short[iv] : wstate.ctx_coreml,
+                    mel->ne[0], mel->ne[1], (float *) mel->data, (float *) wstate.embd_enc->data);
+#elif defined(WHISPER_USE_OPENVINO)
+            whisper_openvino_encode(iv >= 0 ? wstate.ctx_openvino_short[iv] : wstate.ctx_openvino, mel, wstate.embd_enc);
+#endif
         }
-
-        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_sched_size(state->sched_conv) / 1e6);
     }
 
-    // encoder allocator
-    if (!whisper_encode_external(*state)) {
-        bool ok = whisper_sched_graph_init(state->sched_encode, state->backends,
-                [&]() {
-                    return whisper_build_graph_encoder(*ctx, *state);
-                });
+    // encoder
+    if (!whisper_encode_external(wstate)) {
+        auto & sched = wstate.sched_encode.sched;
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init encoder allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
+        // the fused cross-attention projections are decoder weights
+        if (whisper_fuse_cross(wctx, wstate)) {
+            whisper_model_wait(wctx.model);
         }
 
-        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_encode) / 1e6);
-    }
-
-    // cross allocator
-    {
-        bool ok = whisper_sched_graph_init(state->sched_cross, state->backends,
-                [&]() {
-                    return whisper_build_graph_cross(*ctx, *state);
-                });
+        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init cross allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
+        if (!whisper_sched_alloc(wstate, sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
         }
 
-        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_sched_size(state->sched_cross) / 1e6);
+        wstate.n_splits_encode = ggml_backend_sched_get_n_splits(sched);
+
+        whisper_trace_scope trace("encoder");
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool, WHISPER_CPU_WORK_ENCODE)) {
+            return false;
+        }
     }
 
-    // decoder allocator
-    {
-        bool ok = whisper_sched_graph_init(state->sched_decode, state->backends,
-                [&]() {
-                    const auto & hparams = ctx->model.hparams;
+    // cross
+    if (!whisper_fuse_cross(wctx, wstate)) {
+        auto & sched = wstate.sched_cross.sched;
 
-                    // TODO: make sure this is the worst-case scenario
-                    const int n_tokens = hparams.n_text_ctx;
-                    const int n_past   = 0;
+        whisper_model_wait(wctx.model);
 
-                    whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
+        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
 
-                    return whisper_build_graph_decoder(*ctx, *state, state->batch, ctx->params.dtw_token_timestamps, true);
-                });
+        if (!whisper_sched_alloc(wstate, sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init decoder allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
+        whisper_trace_scope trace("cross");
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool, WHISPER_CPU_WORK_ENCODE)) {
+            return false;
         }
-
-        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_decode) / 1e6);
     }
 
-    return state;
+    wstate.t_encode_us += ggml_time_us() - t_start_us;
+    wstate.n_encode++;
+    whisper_histogram_add(wstate.h_encode, ggml_time_us() - t_start_us);
+
+    wstate.enc_valid = wctx.params.encoder_cache;
+
+    return !(abort_callback && abort_callback(abort_callback_data));
 }
 
-int whisper_ctx_init_openvino_encoder_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                    const char * model_path,
-                    const char * device,
-                    const char * cache_dir) {
-#ifndef WHISPER_USE_OPENVINO
-    (void)(ctx);
-    (void)(state);
-    (void)(model_path);
-    (void)(device);
-    (void)(cache_dir);
+// conv + encoder + cross for n_states windows in one graph; the windows are
+// stacked along the frame dimension, so every matmul sees n_states*n_ctx
+// columns and only the self-attention is done per window
+static struct ggml_cgraph * whisper_build_graph_encoder_batch(
+        whisper_context & wctx,
+          whisper_sched & wsched,
+          whisper_state ** states,
+                    int   n_states,
+                    int   n_ctx) {
+    const auto & model   = whisper_state_model(wctx, *states[0]);
+    const auto & hparams = model.hparams;
 
-    return 1;
-#else
-    if (!model_path && ctx->path_model.empty()) {
-        WHISPER_LOG_ERROR("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
-        return 1;
-    }
+    // the batched states use the same adapters (whisper_states_split())
+    const whisper_state & wstate = *states[0];
 
-    std::string path_encoder;
-    if (!model_path) {
-        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
-        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
-    } else {
-        path_encoder = model_path;
-    }
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+    const int n_mels  = hparams.n_mels;
 
-    std::string path_cache;
-    if (!cache_dir) {
-        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
-        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
-    } else {
-        path_cache = cache_dir;
-    }
+    const int n_state_head = n_state/n_head;
+    const int n_ctx_pad    = GGML_PAD(n_ctx, 256);
+    const int n_tokens     = n_ctx*n_states;
 
-    WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
-    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wsched.meta.size(),
+        /*.mem_buffer =*/ wsched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-    state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
-    if (!state->ctx_openvino) {
-        WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
-        return 1;
-    } else {
-        WHISPER_LOG_INFO("%s: OpenVINO model loaded\n", __func__);
-    }
+    struct ggml_context * ctx0 = ggml_init(params);
 
-    return 0;
-#endif
-}
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
-int whisper_ctx_init_openvino_encoder(
-        struct whisper_context * ctx,
-                    const char * model_path,
-                    const char * device,
-                    const char * cache_dir) {
-    return whisper_ctx_init_openvino_encoder_with_state(ctx, ctx->state, model_path, device, cache_dir);
-}
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_states);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
 
-struct whisper_context_params whisper_context_default_params() {
-    struct whisper_context_params result = {
-        /*.use_gpu              =*/ true,
-        /*.flash_attn           =*/ true,
-        /*.gpu_device           =*/ 0,
+    struct ggml_tensor * cur;
 
-        /*.dtw_token_timestamps =*/ false,
-        /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
-        /*.dtw_n_top            =*/ -1,
-        /*.dtw_aheads           =*/ {
-            /*.n_heads          =*/ 0,
-            /*.heads            =*/ NULL,
-        },
-        /*.dtw_mem_size         =*/ 1024*1024*128,
-    };
-    return result;
-}
+    // convolution + gelu, batched over ne[2]
+    {
+        cur = whisper_conv_1d_ph(ctx0, whisper_encoder_backend(*states[0]), model.e_conv_1_w, mel, 1);
+        cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
-struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
-    WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
-#ifdef _MSC_VER
-    // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
-    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
-    std::wstring path_model_wide = converter.from_bytes(path_model);
-    auto fin = std::ifstream(path_model_wide, std::ios::binary);
-#else
-    auto fin = std::ifstream(path_model, std::ios::binary);
-#endif
-    if (!fin) {
-        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
-        return nullptr;
+        cur = ggml_gelu(ctx0, cur);
+
+        cur = whisper_conv_1d_ph(ctx0, whisper_encoder_backend(*states[0]), model.e_conv_2_w, cur, 2);
+        cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+
+        cur = ggml_gelu(ctx0, cur);
     }
 
-    whisper_model_loader loader = {};
+    // [n_ctx, n_state, n_states] -> [n_state, n_ctx, n_states] + positional embedding
+    {
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, model.e_pe->nb[1], 0);
 
-    loader.context = &fin;
+        cur = ggml_add(ctx0, ggml_cont(ctx0, ggml_permute(ctx0, cur, 1, 0, 2, 3)), e_pe);
+        cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
+    }
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->read((char *)output, read_size);
-        return read_size;
-    };
+    const float KQscale = 1.0f/sqrtf(float(n_state_head));
 
-    loader.eof = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        return fin->eof();
-    };
+    struct ggml_tensor * inpL = cur;
 
-    loader.close = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->close();
-    };
+    const bool f16_act = whisper_encoder_use_f16_act(wctx, whisper_encoder_backend(*states[0]));
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_encoder[il];
 
-    auto ctx = whisper_init_with_params_no_state(&loader, params);
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
 
-    if (ctx) {
-        ctx->path_model = path_model;
-    }
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
 
-    return ctx;
-}
+            cur = whisper_f16_act(ctx0, cur, f16_act && whisper_qkv_f16(layer));
+        }
 
-struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    struct buf_context {
-        uint8_t* buffer;
-        size_t size;
-        size_t current_offset;
-    };
+        // self-attention within each window
+        {
+            struct ggml_tensor * Qcur;
+            struct ggml_tensor * Kcur;
+            struct ggml_tensor * Vcur;
 
-    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+            whisper_build_qkv(ctx0, wstate, layer, cur, Qcur, Kcur, Vcur);
 
-    WHISPER_LOG_INFO("%s: loading model from buffer\n", __func__);
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_reshape_4d(ctx0, Qcur, n_state_head, n_head, n_ctx, n_states),
+                        0, 2, 1, 3);
 
-    whisper_model_loader loader = {};
+            if (wctx.params.flash_attn || whisper_encoder_use_fused_attn(wctx, whisper_encoder_backend(*states[0]))) {
+                struct ggml_tensor * Kw = ggml_reshape_4d(ctx0, Kcur, n_state_head, n_head, n_ctx, n_states);
+                struct ggml_tensor * Vw = ggml_reshape_4d(ctx0, Vcur, n_state_head, n_head, n_ctx, n_states);
 
-    loader.context = &ctx;
+                if (wctx.params.flash_attn) {
+                    // the single-window graph attends to the zero rows of kv_pad up to n_ctx_pad, so must the batch
+                    Kw = ggml_pad(ctx0, Kw, 0, 0, n_ctx_pad - n_ctx, 0);
+                    Vw = ggml_pad(ctx0, Vw, 0, 0, n_ctx_pad - n_ctx, 0);
+                }
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+                struct ggml_tensor * K = ggml_permute(ctx0, ggml_cast(ctx0, Kw, wctx.itype), 0, 2, 1, 3);
+                struct ggml_tensor * V = ggml_permute(ctx0, ggml_cast(ctx0, Vw, wctx.itype), 0, 2, 1, 3);
 
-        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+                cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
 
-        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
-        buf->current_offset += size_to_copy;
+                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
+            } else {
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_reshape_4d(ctx0, Kcur, n_state_head, n_head, n_ctx, n_states),
+                                wctx.itype),
+                            0, 2, 1, 3);
 
-        return size_to_copy;
-    };
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-    loader.eof = [](void * ctx) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
 
-        return buf->current_offset >= buf->size;
-    };
+                struct ggml_tensor * V =
+                    ggml_cast(ctx0,
+                            ggml_permute(ctx0,
+                                ggml_reshape_4d(ctx0, Vcur, n_state_head, n_head, n_ctx, n_states),
+                                1, 2, 0, 3),
+                            wctx.itype);
 
-    loader.close = [](void * /*ctx*/) { };
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-    return whisper_init_with_params_no_state(&loader, params);
-}
+                cur = ggml_cont_2d(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3), n_state, n_tokens);
+            }
+        }
 
-struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    ggml_time_init();
+        // projection
+        cur = ggml_add(ctx0, whisper_mm(ctx0, wstate, layer.attn_ln_1_w, cur), layer.attn_ln_1_b);
 
-    if (params.flash_attn && params.dtw_token_timestamps) {
-        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
-        params.dtw_token_timestamps = false;
-    }
+        // add the input
+        cur = ggml_add(ctx0, cur, inpL);
 
-    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
-    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
-    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
-    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
-    WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
-    WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
+        struct ggml_tensor * inpFF = cur;
 
-    whisper_context * ctx = new whisper_context;
-    ctx->params = params;
+        // feed-forward network
+        {
+            cur = ggml_norm(ctx0, inpFF, hparams.eps);
 
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
-    }
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, layer.mlp_ln_w),
+                    layer.mlp_ln_b);
 
-    loader->close(loader->context);
+            cur = whisper_f16_act(ctx0, cur, f16_act && layer.mlp_0_w->type == GGML_TYPE_F16);
 
-    return ctx;
-}
+            cur = ggml_add(ctx0, whisper_mm(ctx0, wstate, layer.mlp_0_w, cur), layer.mlp_0_b);
 
-struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
-    if (!ctx) {
-        return nullptr;
-    }
+            cur = ggml_gelu(ctx0, cur);
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
-    }
+            cur = whisper_f16_act(ctx0, cur, f16_act && layer.mlp_1_w->type == GGML_TYPE_F16);
 
-    return ctx;
-}
+            cur = ggml_add(ctx0, whisper_mm(ctx0, wstate, layer.mlp_1_w, cur), layer.mlp_1_b);
+        }
 
-struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
-    if (!ctx) {
-        return nullptr;
+        inpL = ggml_add(ctx0, cur, inpFF);
     }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
-    }
+    // norm
+    {
+        cur = ggml_norm(ctx0, inpL, hparams.eps);
 
-    return ctx;
-}
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0, cur, model.e_ln_w),
+                model.e_ln_b);
 
-struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
-    if (!ctx) {
-        return nullptr;
+        cur = whisper_f16_act(ctx0, cur, f16_act && whisper_cross_f16(model));
     }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
-    }
+    // cross-attention memory, scattered into the kv_cross of each state
+    const float Kscale = pow(float(n_state_head), -0.25);
 
-    return ctx;
-}
+    for (int il = 0; il < hparams.n_text_layer; ++il) {
+        auto & layer = model.layers_decoder[il];
 
-struct whisper_context * whisper_init_from_file(const char * path_model) {
-    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
-}
+        struct ggml_tensor * Kcross = ggml_scale(ctx0, whisper_mm(ctx0, wstate, layer.cross_attn_k_w, cur), Kscale);
+        struct ggml_tensor * Vcross = ggml_add(ctx0, whisper_mm(ctx0, wstate, layer.cross_attn_v_w, cur), layer.cross_attn_v_b);
 
-struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
-    return whisper_init_from_buffer_with_params(buffer, buffer_size, whisper_context_default_params());
-}
+        for (int b = 0; b < n_states; ++b) {
+            const whisper_kv_cache & kv_cross = states[b]->kv_cross;
 
-struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
-    return whisper_init_with_params(loader, whisper_context_default_params());
-}
+            struct ggml_tensor * Kb = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], b*n_ctx*Kcross->nb[1]);
+            struct ggml_tensor * Vb = ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], b*n_ctx*Vcross->nb[1]);
 
-struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
-    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
-}
+            struct ggml_tensor * k;
+            struct ggml_tensor * v;
 
-struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
-    return whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, whisper_context_default_params());
-}
+            if (wctx.params.flash_attn) {
+                k = ggml_view_2d(ctx0, kv_cross.k, n_state, n_ctx, ggml_row_size(kv_cross.k->type, n_state),
+                        ggml_row_size(kv_cross.k->type, n_state)*(il*n_ctx_pad));
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
-    return whisper_init_with_params_no_state(loader, whisper_context_default_params());
-}
+                v = ggml_view_2d(ctx0, kv_cross.v, n_state, n_ctx, ggml_row_size(kv_cross.v->type, n_state),
+                        ggml_row_size(kv_cross.v->type, n_state)*(il*n_ctx_pad));
+            } else {
+                Vb = ggml_transpose(ctx0, Vb);
 
-void whisper_free_state(struct whisper_state * state) {
-    if (state) {
-        whisper_kv_cache_free(state->kv_self);
-        whisper_kv_cache_free(state->kv_cross);
-        whisper_kv_cache_free(state->kv_pad);
+                k = ggml_view_2d(ctx0, kv_cross.k, n_state, n_ctx, ggml_row_size(kv_cross.k->type, n_state),
+                        ggml_row_size(kv_cross.k->type, n_state)*(il*n_ctx));
 
-#ifdef WHISPER_USE_COREML
-        if (state->ctx_coreml != nullptr) {
-            whisper_coreml_free(state->ctx_coreml);
-            state->ctx_coreml = nullptr;
-        }
-#endif
+                v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross.v),
+                        (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
+            }
 
-#ifdef WHISPER_USE_OPENVINO
-        if (state->ctx_openvino != nullptr) {
-            whisper_openvino_free(state->ctx_openvino);
-            state->ctx_openvino = nullptr;
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kb, k));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vb, v));
         }
-#endif
+    }
 
-        whisper_batch_free(state->batch);
+    ggml_free(ctx0);
 
-        ggml_backend_sched_free(state->sched_conv.sched);
-        ggml_backend_sched_free(state->sched_encode.sched);
-        ggml_backend_sched_free(state->sched_cross.sched);
-        ggml_backend_sched_free(state->sched_decode.sched);
+    return gf;
+}
 
-        for (auto & backend : state->backends) {
-            ggml_backend_free(backend);
-        }
+static struct ggml_cgraph * whisper_build_graph_decoder(
+         whisper_context & wctx,
+         whisper_state   & wstate,
+     const whisper_batch & batch,
+                    bool   save_alignment_heads_QKs,
+                    bool   worst_case) {
+    const auto & model   = whisper_state_model(wctx, wstate);
+    const auto & hparams = model.hparams;
 
-        // [EXPERIMENTAL] Token-level timestamps with DTW
-        aheads_masks_free(state->aheads_masks);
+    auto & kv_self = wstate.kv_self;
 
-        if (state->vad_context != nullptr) {
-            whisper_vad_free(state->vad_context);
-            state->vad_context = nullptr;
-        }
+    WHISPER_ASSERT(!!kv_self.buffer);
 
-        delete state;
-    }
-}
+    const int n_ctx   = kv_self.size;
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
 
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        for (ggml_context * context : ctx->model.ctxs) {
-            ggml_free(context);
-        }
+    const int n_outputs = worst_case ? batch.n_tokens : whisper_batch_n_outputs(batch);
 
-        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
-            ggml_backend_buffer_free(buf);
-        }
+    const int n_state_head = n_state/n_head;
 
-        whisper_free_state(ctx->state);
+    const int n_tokens    = batch.n_tokens;
+    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-        delete ctx;
-    }
-}
+    const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
 
-void whisper_free_context_params(struct whisper_context_params * params) {
-    if (params) {
-        delete params;
-    }
-}
+    const int32_t n_kv = worst_case ? n_ctx : kv_self.n;
 
-void whisper_free_params(struct whisper_full_params * params) {
-    if (params) {
-        delete params;
-    }
-}
+    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
-        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
-    }
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_decode.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_decode.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-    return 0;
-}
+    struct ggml_context * ctx0 = ggml_init(params);
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
-}
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
-int whisper_set_mel_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                   const float * data,
-                           int   n_len,
-                           int   n_mel) {
-    if (n_mel != ctx->model.filters.n_mel) {
-        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
-        return -1;
-    }
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(embd, "embd");
+    ggml_set_input(embd);
 
-    state->mel.n_len     = n_len;
-    state->mel.n_len_org = n_len;
-    state->mel.n_mel     = n_mel;
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(position, "position");
+    ggml_set_input(position);
 
-    state->mel.data.resize(n_len*n_mel);
-    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+    const float KQscale = pow(float(n_state_head), -0.25);
 
-    return 0;
-}
+    // F16 as flash attention takes it, else F32 for the soft max
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, wctx.params.flash_attn ? GGML_TYPE_F16 : GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD), 1);
+    ggml_set_name(KQ_mask, "KQ_mask");
+    ggml_set_input(KQ_mask);
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
-}
+    // KV cells of the batch, so that the graph does not depend on where they are
+    // the transposed V cache (no flash attention) is written one element per row
+    struct ggml_tensor * kv_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I64, n_tokens);
+    ggml_set_name(kv_idxs, "kv_idxs");
+    ggml_set_input(kv_idxs);
 
-int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return -1;
+    struct ggml_tensor * kv_idxs_v = kv_idxs;
+    if (!wctx.params.flash_attn) {
+        kv_idxs_v = ggml_new_tensor_1d(ctx0, GGML_TYPE_I64, n_tokens*n_state);
+        ggml_set_name(kv_idxs_v, "kv_idxs_v");
+        ggml_set_input(kv_idxs_v);
     }
 
-    return 0;
-}
-
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return -1;
-    }
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
 
-    return 0;
-}
+    struct ggml_tensor * inpL = cur;
 
-int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    struct ggml_tensor * aheads_cross_QKs = nullptr;
 
-    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
 
-    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return 1;
-    }
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
 
-    return 0;
-}
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    if (ctx->state == nullptr) {
-        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
-        return -1;
-    }
+        // self-attention
+        {
+            struct ggml_tensor * Qcur;
+            struct ggml_tensor * Kcur;
+            struct ggml_tensor * Vcur;
 
-    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
-}
+            // note: no bias for Key
+            whisper_build_qkv(ctx0, wstate, layer, cur, Qcur, Kcur, Vcur);
 
-int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
-    const auto res = tokenize(ctx->vocab, text);
+            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+            Kcur = ggml_scale(ctx0, Kcur, KQscale);
 
-    if (n_max_tokens < (int) res.size()) {
-        WHISPER_LOG_ERROR("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
-        return -(int) res.size();
-    }
+            // store key and value to memory
+            {
+                struct ggml_tensor * k = ggml_view_2d(ctx0, kv_self.k, n_state, n_ctx,
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
-    for (int i = 0; i < (int) res.size(); i++) {
-        tokens[i] = res[i];
-    }
+                struct ggml_tensor * v;
 
-    return res.size();
-}
+                if (wctx.params.flash_attn) {
+                    v = ggml_view_2d(ctx0, kv_self.v, n_state, n_ctx,
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
+                } else {
+                    Vcur = ggml_reshape_2d(ctx0, Vcur, 1, n_state*n_tokens);
 
-int whisper_token_count(struct whisper_context * ctx, const char * text) {
-    return -whisper_tokenize(ctx, text, NULL, 0);
-}
+                    v = ggml_view_2d(ctx0, kv_self.v, 1, n_ctx*n_state,
+                            ggml_element_size(kv_self.v),
+                            ggml_element_size(kv_self.v)*n_ctx*n_state*il);
+                }
 
-int whisper_lang_max_id(void) {
-    auto max_id = 0;
-    for (const auto & kv : g_lang) {
-        max_id = std::max(max_id, kv.second.first);
-    }
+                ggml_build_forward_expand(gf, ggml_set_rows(ctx0, k, Kcur, kv_idxs));
+                ggml_build_forward_expand(gf, ggml_set_rows(ctx0, v, Vcur, kv_idxs_v));
+            }
 
-    return max_id;
-}
+            // ------
 
-int whisper_lang_id(const char * lang) {
-    if (!g_lang.count(lang)) {
-        for (const auto & kv : g_lang) {
-            if (kv.second.second == lang) {
-                return kv.second.first;
-            }
-        }
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
+                        0, 2, 1, 3);
 
-        WHISPER_LOG_ERROR("%s: unknown language '%s'\n", __func__, lang);
-        return -1;
-    }
-    return g_lang.at(lang).first;
-}
+            struct ggml_tensor * K =
+                ggml_view_3d(ctx0, kv_self.k,
+                        n_state_head, n_kv, n_head,
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state_head),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
-const char * whisper_lang_str(int id) {
-    for (const auto & kv : g_lang) {
-        if (kv.second.first == id) {
-            return kv.first.c_str();
+            if (wctx.params.flash_attn) {
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_state_head, n_kv, n_head,
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state_head),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
+
+                cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask, 1.0f, 0.0f, 0.0f);
+
+                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
+            } else {
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, 1.0f, 0.0f);
+
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_state_head, n_head,
+                            n_ctx*ggml_element_size(kv_self.v),
+                            n_ctx*ggml_element_size(kv_self.v)*n_state_head,
+                            n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
+            }
         }
-    }
 
-    WHISPER_LOG_ERROR("%s: unknown language id %d\n", __func__, id);
-    return nullptr;
-}
+        // projection
+        {
+            cur = whisper_mm(ctx0, wstate,
+                    layer.attn_ln_1_w,
+                    cur);
 
-const char * whisper_lang_str_full(int id) {
-   for (const auto & kv : g_lang) {
-        if (kv.second.first == id) {
-            return kv.second.second.c_str();
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.attn_ln_1_b);
         }
-    }
 
-    WHISPER_LOG_ERROR("%s: unknown language id %d\n", __func__, id);
-    return nullptr;
-}
+        // add the input
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
-int whisper_lang_auto_detect_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    const int seek = offset_ms/10;
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
 
-    if (seek < 0) {
-        WHISPER_LOG_ERROR("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
-        return -1;
-    }
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.cross_attn_ln_0_w),
+                    layer.cross_attn_ln_0_b);
+        }
 
-    if (seek >= state->mel.n_len_org) {
-        WHISPER_LOG_ERROR("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
-        return -2;
-    }
+        // cross-attention
+        {
+            struct ggml_tensor * Qcur = whisper_mm(ctx0, wstate,
+                    layer.cross_attn_q_w,
+                    cur);
 
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
-        WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
-        return -6;
-    }
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.cross_attn_q_b);
 
-    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
+                        0, 2, 1, 3);
 
-    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
-        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-        return -7;
-    }
+            if (wctx.params.flash_attn) {
+                struct ggml_tensor * Kcross =
+                    ggml_view_3d(ctx0, wstate.kv_cross.k,
+                            n_state_head, n_audio_ctx_pad, n_head,
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
 
-    auto & logits_id = state->decoders[0].logits_id;
-    logits_id.clear();
+                struct ggml_tensor * Vcross =
+                    ggml_view_3d(ctx0, wstate.kv_cross.v,
+                            n_state_head, n_audio_ctx_pad, n_head,
+                            ggml_row_size(wstate.kv_cross.v->type, n_state),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
 
-    for (const auto & kv : g_lang) {
-        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
-        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
-    }
+                cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
 
-    // sort descending
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
+            } else {
+                struct ggml_tensor * Kcross =
+                    ggml_view_3d(ctx0, wstate.kv_cross.k,
+                            n_state_head, n_audio_ctx, n_head,
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx*il);
 
-    // softmax
-    {
-        const auto max = logits_id[0].first;
+                struct ggml_tensor * Vcross =
+                    ggml_view_3d(ctx0, wstate.kv_cross.v,
+                            n_audio_ctx, n_state_head, n_head,
+                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
+                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state_head,
+                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
 
-        double sum = 0.0f;
-        for (auto & kv : logits_id) {
-            kv.first = exp(kv.first - max);
-            sum += kv.first;
-        }
+                // ------
 
-        for (auto & kv : logits_id) {
-            kv.first /= sum;
-        }
-    }
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
 
-    {
-        for (const auto & prob : logits_id) {
-            if (lang_probs) {
-                lang_probs[prob.second] = prob.first;
-            }
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
 
-            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+                // [EXPERIMENTAL] Token-level timestamps with DTW
+                if (wctx.params.dtw_token_timestamps) {
+                    if (wstate.aheads_masks.m[il] != nullptr) {
+                        struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
+                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                        aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
+                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                        aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
+                        if (aheads_cross_QKs == NULL) {
+                            aheads_cross_QKs = aheads_KQs;
+                        } else {
+                            aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
+                        }
+                    }
+                }
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
+            }
         }
-    }
 
-    return logits_id[0].second;
-}
+        // projection
+        {
+            cur = whisper_mm(ctx0, wstate,
+                    layer.cross_attn_ln_1_w,
+                    cur);
 
-int whisper_lang_auto_detect(
-        struct whisper_context * ctx,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
-}
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.cross_attn_ln_1_b);
+        }
 
-int whisper_model_n_vocab(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_vocab;
-}
+        // add the input
+        cur = ggml_add(ctx0, cur, inpCA);
 
-int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+        struct ggml_tensor * inpFF = cur;
 
-int whisper_model_n_audio_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_state;
-}
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF, hparams.eps);
 
-int whisper_model_n_audio_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_head;
-}
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            cur,
+                            layer.mlp_ln_w),
+                        layer.mlp_ln_b);
+            }
 
-int whisper_model_n_audio_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_layer;
-}
+            // fully connected
+            cur = whisper_mm(ctx0, wstate,
+                    layer.mlp_0_w,
+                    cur);
 
-int whisper_model_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_0_b);
 
-int whisper_model_n_text_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_state;
-}
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
 
-int whisper_model_n_text_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_head;
-}
+            // projection
+            cur = whisper_mm(ctx0, wstate,
+                    layer.mlp_1_w,
+                    cur);
 
-int whisper_model_n_text_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_layer;
-}
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_1_b);
+        }
 
-int whisper_model_n_mels(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_mels;
-}
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
 
-int whisper_model_ftype(struct whisper_context * ctx) {
-    return ctx->model.hparams.ftype;
-}
+    cur = inpL;
 
-int whisper_model_type(struct whisper_context * ctx) {
-    return ctx->model.type;
-}
+    // the final norm and the vocabulary projection only for the tokens whose logits are requested
+    // (e.g. the last one of a prompt)
+    if (n_outputs > 0 && n_outputs < n_tokens) {
+        struct ggml_tensor * out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs);
+        ggml_set_name(out_ids, "out_ids");
+        ggml_set_input(out_ids);
 
-const char *whisper_model_type_readable(struct whisper_context * ctx) {
-    switch (ctx->model.type) {
-    case e_model::MODEL_TINY:
-        return "tiny";
-    case e_model::MODEL_BASE:
-        return "base";
-    case e_model::MODEL_SMALL:
-        return "small";
-    case e_model::MODEL_MEDIUM:
-        return "medium";
-    case e_model::MODEL_LARGE:
-        return "large";
-    default:
-        return "unknown";
+        cur = ggml_get_rows(ctx0, cur, out_ids);
     }
-}
-
-int whisper_n_len_from_state(struct whisper_state * state) {
-    return state->mel.n_len_org;
-}
-
-int whisper_n_len(struct whisper_context * ctx) {
-    return ctx->state->mel.n_len_org;
-}
-
-int whisper_n_vocab(struct whisper_context * ctx) {
-    return ctx->vocab.n_vocab;
-}
 
-int whisper_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+    // norm
+    {
+        cur = ggml_norm(ctx0, cur, hparams.eps);
 
-int whisper_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0,
+                    cur,
+                    model.d_ln_w),
+                model.d_ln_b);
+    }
 
-int whisper_is_multilingual(struct whisper_context * ctx) {
-    return ctx->vocab.is_multilingual() ? 1 : 0;
-}
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
-float * whisper_get_logits(struct whisper_context * ctx) {
-    return ctx->state->logits.data();
-}
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    if (wctx.params.dtw_token_timestamps && aheads_cross_QKs != nullptr) {
+        aheads_cross_QKs = ggml_transpose(ctx0, aheads_cross_QKs);
+        aheads_cross_QKs = ggml_cont(ctx0, aheads_cross_QKs);
+        if (save_alignment_heads_QKs) {
+            ggml_build_forward_expand(gf, aheads_cross_QKs);
+            wstate.aheads_cross_QKs = aheads_cross_QKs;
+        }
+    }
 
-float * whisper_get_logits_from_state(struct whisper_state * state) {
-    return state->logits.data();
-}
+    ggml_build_forward_expand(gf, logits);
 
-const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
-    return ctx->vocab.id_to_token.at(token).c_str();
-}
+    ggml_free(ctx0);
 
-whisper_token whisper_token_eot(struct whisper_context * ctx) {
-    return ctx->vocab.token_eot;
+    return gf;
 }
 
-whisper_token whisper_token_sot(struct whisper_context * ctx) {
-    return ctx->vocab.token_sot;
-}
+// evaluate the decoder
+//
+// given text prompt + audio features -> computes the logits for the next token
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+    const whisper_batch & batch,
+              const int   n_threads,
+                   bool   save_alignment_heads_QKs,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    const int64_t t_start_us = ggml_time_us();
 
-whisper_token whisper_token_solm(struct whisper_context * ctx) {
-    return ctx->vocab.token_solm;
-}
+    whisper_model_wait(wctx.model);
 
-whisper_token whisper_token_prev(struct whisper_context * ctx) {
-    return ctx->vocab.token_prev;
-}
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-whisper_token whisper_token_nosp(struct whisper_context * ctx) {
-    return ctx->vocab.token_nosp;
-}
+    const int n_vocab  = hparams.n_vocab;
+    const int n_tokens = batch.n_tokens;
 
-whisper_token whisper_token_not(struct whisper_context * ctx) {
-    return ctx->vocab.token_not;
-}
+    auto & logits_out = wstate.logits;
 
-whisper_token whisper_token_beg(struct whisper_context * ctx) {
-    return ctx->vocab.token_beg;
-}
+    struct ggml_tensor * logits;
 
-whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
-    return whisper_token_sot(ctx) + 1 + lang_id;
-}
+    // find KV slot for the batch
+    {
+        auto & kv_self = wstate.kv_self;
 
-whisper_token whisper_token_translate(struct whisper_context * ctx) {
-    return ctx->vocab.token_translate;
-}
+        if (!whisper_kv_cache_find_slot(kv_self, batch)) {
+            return false;
+        }
 
-whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
-    return ctx->vocab.token_transcribe;
-}
+        // the window grows in steps of at least 32 cells, so that consecutive steps can reuse the graph
+        const uint32_t pad = std::max(32u, whisper_kv_cache_get_padding(wctx));
+        kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
 
-struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
-    if (ctx->state == nullptr) {
-        return nullptr;
+        //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
+        //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
     }
-    whisper_timings * timings = new whisper_timings;
-    timings->sample_ms = 1e-3f * ctx->state->t_sample_us / std::max(1, ctx->state->n_sample);
-    timings->encode_ms = 1e-3f * ctx->state->t_encode_us / std::max(1, ctx->state->n_encode);
-    timings->decode_ms = 1e-3f * ctx->state->t_decode_us / std::max(1, ctx->state->n_decode);
-    timings->batchd_ms = 1e-3f * ctx->state->t_batchd_us / std::max(1, ctx->state->n_batchd);
-    timings->prompt_ms = 1e-3f * ctx->state->t_prompt_us / std::max(1, ctx->state->n_prompt);
-    return timings;
-}
 
-void whisper_print_timings(struct whisper_context * ctx) {
-    const int64_t t_end_us = ggml_time_us();
+    // decoder
+    {
+        auto & sched = wstate.sched_decode.sched;
+        auto & graph = wstate.graph_decode;
 
-    WHISPER_LOG_INFO("\n");
-    WHISPER_LOG_INFO("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
-    if (ctx->state != nullptr) {
+        const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-        const int32_t n_sample = std::max(1, ctx->state->n_sample);
-        const int32_t n_encode = std::max(1, ctx->state->n_encode);
-        const int32_t n_decode = std::max(1, ctx->state->n_decode);
-        const int32_t n_batchd = std::max(1, ctx->state->n_batchd);
-        const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
+        ggml_cgraph * gf = graph.gf;
 
-        WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
-        WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
-        WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
-        WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
-        WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
-        WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
-        WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
-    }
-    WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
-}
+        const int n_outputs = whisper_batch_n_outputs(batch);
 
-void whisper_reset_timings(struct whisper_context * ctx) {
-    ctx->t_start_us = ggml_time_us();
-    if (ctx->state != nullptr) {
-        ctx->state->t_mel_us = 0;
-        ctx->state->t_sample_us = 0;
-        ctx->state->t_encode_us = 0;
-        ctx->state->t_decode_us = 0;
-        ctx->state->t_batchd_us = 0;
-        ctx->state->t_prompt_us = 0;
-        ctx->state->n_sample = 0;
-        ctx->state->n_encode = 0;
-        ctx->state->n_decode = 0;
-        ctx->state->n_batchd = 0;
-        ctx->state->n_prompt = 0;
-    }
-}
+        if (!gf || graph.n_tokens != n_tokens || graph.n_outputs != n_outputs || graph.n_kv != (int) wstate.kv_self.n ||
+                graph.n_audio_ctx != n_audio_ctx || graph.aheads != save_alignment_heads_QKs) {
+            ggml_backend_sched_reset(sched);
+            graph.gf = nullptr;
 
-static int whisper_has_coreml(void) {
-#ifdef WHISPER_USE_COREML
-    return 1;
-#else
-    return 0;
-#endif
-}
+            gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
 
-static int whisper_has_openvino(void) {
-#ifdef WHISPER_USE_OPENVINO
-    return 1;
-#else
-    return 0;
-#endif
-}
+            if (!whisper_sched_alloc(wstate, sched, gf)) {
+                // should never happen as we pre-allocate the memory
+                return false;
+            }
 
-const char * whisper_print_system_info(void) {
-    static std::string s;
+            wstate.n_splits_decode = ggml_backend_sched_get_n_splits(sched);
 
-    s  = "";
-    s += "WHISPER : ";
-    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
-    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+            graph.gf          = gf;
+            graph.n_tokens    = n_tokens;
+            graph.n_outputs   = n_outputs;
+            graph.n_kv        = wstate.kv_self.n;
+            graph.n_audio_ctx = n_audio_ctx;
+            graph.aheads      = save_alignment_heads_QKs;
+        }
 
-    for (size_t i = 0; i < ggml_backend_reg_count(); i++) {
-        auto * reg = ggml_backend_reg_get(i);
-        auto * get_features_fn = (ggml_backend_get_features_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features");
-        if (get_features_fn) {
-            ggml_backend_feature * features = get_features_fn(reg);
-            s += ggml_backend_reg_name(reg);
-            s += " : ";
-            for (; features->name; features++) {
-                s += features->name;
-                s += " = ";
-                s += features->value;
-                s += " | ";
+        // set the inputs
+        {
+            struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
+            ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
+        }
+
+        if (struct ggml_tensor * out_ids = ggml_graph_get_tensor(gf, "out_ids")) {
+            std::vector<int32_t> ids;
+            ids.reserve(n_outputs);
+            for (int i = 0; i < n_tokens; ++i) {
+                if (batch.logits[i] != 0) {
+                    ids.push_back(i);
+                }
             }
+            ggml_backend_tensor_set(out_ids, ids.data(), 0, ggml_nbytes(out_ids));
         }
-    }
-    return s.c_str();
-}
 
-//////////////////////////////////
-// Voice Activity Detection (VAD)
-//////////////////////////////////
+        {
+            struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
+            ggml_backend_tensor_set(position, batch.pos, 0, n_tokens*ggml_element_size(position));
+        }
 
-struct whisper_vad_hparams {
-    int32_t   n_encoder_layers;
-    int32_t * encoder_in_channels;
-    int32_t * encoder_out_channels;
-    int32_t * kernel_sizes;
-    int32_t   lstm_input_size;
-    int32_t   lstm_hidden_size;
-    int32_t   final_conv_in;
-    int32_t   final_conv_out;
-};
+        {
+            const auto & kv_self = wstate.kv_self;
 
-struct whisper_vad_model {
-    std::string type;
-    std::string version;
-    whisper_vad_hparams hparams;
+            struct ggml_tensor * kv_idxs = ggml_graph_get_tensor(gf, "kv_idxs");
 
-    struct ggml_tensor * stft_forward_basis; // [256, 1, 258]
+            std::vector<int64_t> idxs(n_tokens);
+            for (int i = 0; i < n_tokens; ++i) {
+                idxs[i] = kv_self.head + i;
+            }
+            ggml_backend_tensor_set(kv_idxs, idxs.data(), 0, ggml_nbytes(kv_idxs));
 
-    // Encoder tensors - 4 convolutional layers
-    struct ggml_tensor * encoder_0_weight;  // [3, 129, 128]
-    struct ggml_tensor * encoder_0_bias;    // [128]
+            if (struct ggml_tensor * kv_idxs_v = ggml_graph_get_tensor(gf, "kv_idxs_v")) {
+                // element (s, i) of the batch goes to row s of the transposed cache
+                const int n_state = hparams.n_text_state;
 
-    // Second encoder layer
-    struct ggml_tensor * encoder_1_weight;  // [3, 128, 64]
-    struct ggml_tensor * encoder_1_bias;    // [64]
+                idxs.resize(n_tokens*n_state);
+                for (int i = 0; i < n_tokens; ++i) {
+                    for (int s = 0; s < n_state; ++s) {
+                        idxs[i*n_state + s] = (int64_t) s*kv_self.size + kv_self.head + i;
+                    }
+                }
+                ggml_backend_tensor_set(kv_idxs_v, idxs.data(), 0, ggml_nbytes(kv_idxs_v));
+            }
+        }
 
-    // Third encoder layer
-    struct ggml_tensor * encoder_2_weight;  // [3, 64, 64]
-    struct ggml_tensor * encoder_2_bias;    // [64]
+        whisper_kq_mask_set(wstate, batch, ggml_graph_get_tensor(gf, "KQ_mask"));
 
-    // Fourth encoder layer
-    struct ggml_tensor * encoder_3_weight;  // [3, 64, 128]
-    struct ggml_tensor * encoder_3_bias;    // [128]
+        logits = ggml_graph_node(gf, -1);
 
-    // LSTM decoder tensors
-    struct ggml_tensor * lstm_ih_weight;    // [128, 512] input-to-hidden
-    struct ggml_tensor * lstm_ih_bias;      // [512]
-    struct ggml_tensor * lstm_hh_weight;    // [128, 512] hidden-to-hidden
-    struct ggml_tensor * lstm_hh_bias;      // [512]
-
-    // Final conv layer
-    struct ggml_tensor * final_conv_weight; // [128]
-    struct ggml_tensor * final_conv_bias;   // [1]
-
-    // ggml contexts
-    std::vector<ggml_context *> ctxs;
+        whisper_trace_scope trace("decode");
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool, WHISPER_CPU_WORK_DECODE, false)) {
+            graph.gf = nullptr;
+            return false;
+        }
+    }
 
-    // buffer for the model tensors
-    std::vector<ggml_backend_buffer_t> buffers;
+    logits_out.resize(n_tokens*n_vocab);
+    {
+        // one read per run of requested rows, queued on the backend that computed them and waited for once
+        // the graph computes the requested rows only (row j of the logits is the j-th requested token),
+        // unless all or none of them are requested
+        ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(wstate.sched_decode.sched, logits);
 
-    // tensors
-    int n_loaded;
-    std::map<std::string, struct ggml_tensor *> tensors;
-};
+        const bool all_rows = logits->ne[1] == n_tokens;
 
-struct whisper_vad_segment {
-    int64_t start;
-    int64_t end;
-};
+        for (int i = 0, j = 0; i < n_tokens; ) {
+            if (batch.logits[i] == 0) {
+                ++i;
+                continue;
+            }
 
-struct whisper_vad_segments {
-    std::vector<whisper_vad_segment> data;
-};
+            int n = 1;
+            while (i + n < n_tokens && batch.logits[i + n] != 0) {
+                ++n;
+            }
 
-struct whisper_vad_context {
-    int64_t t_vad_us = 0;
+            const int row = all_rows ? i : j;
 
-    int     n_window;
-    int     n_context;
-    int     n_threads;
+            ggml_backend_tensor_get_async(backend_res, logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*row), sizeof(float)*n_vocab*n);
 
-    std::vector<ggml_backend_t> backends;
-    ggml_backend_buffer_t       buffer = nullptr;
-    whisper_context_params      params;
-    std::vector<uint8_t>        ctx_buf;
-    whisper_sched               sched;
+            i += n;
+            j += n;
+        }
 
-    whisper_vad_model    model;
-    std::string          path_model;
-    struct ggml_tensor * h_state;
-    struct ggml_tensor * c_state;
-    std::vector<float>   probs;
-};
+        ggml_backend_synchronize(backend_res);
+    }
 
-struct whisper_vad_context_params whisper_vad_default_context_params(void) {
-    whisper_vad_context_params result = {
-        /*.n_thread                = */ 4,
-        /*.use_gpu                 = */ false,
-        /*.gpu_device              = */ 0,
-    };
-    return result;
-}
+    if (batch.n_tokens > 1) {
+        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
+        //        ggml_used_mem(ctx0)/1e6,
+        //        wstate.get_buf_max_mem(0)/1e6,
+        //        wstate.get_buf_max_mem(1)/1e6,
+        //        wstate.get_buf_max_mem(2)/1e6,
+        //        wstate.get_buf_max_mem(3)/1e6);
+    }
 
-struct whisper_vad_params whisper_vad_default_params(void) {
-    whisper_vad_params result = {
-        /* threshold               = */ 0.5f,
-        /* min_speech_duration_ms  = */ 250,
-        /* min_silence_duration_ms = */ 100,
-        /* max_speech_duration_s   = */ FLT_MAX,
-        /* speech_pad_ms           = */ 30,
-        /* samples_overlap         = */ 0.1,
-    };
-    return result;
-}
+    {
+        const int64_t t_us = ggml_time_us() - t_start_us;
+        whisper_histogram_add(wstate.h_decode, t_us);
+        whisper_histogram_add(wstate.h_token,  t_us/n_tokens, n_tokens);
+    }
 
-// Time conversion utility functions for whisper VAD
-static int cs_to_samples(int64_t cs) {
-    return (int)((cs / 100.0) * WHISPER_SAMPLE_RATE + 0.5);
-}
+    if (batch.n_tokens == 1) {
+        wstate.t_decode_us += ggml_time_us() - t_start_us;
+        wstate.n_decode++;
+    } else if (batch.n_tokens < 16) {
+        wstate.t_batchd_us += ggml_time_us() - t_start_us;
+        wstate.n_batchd += n_tokens;
+    } else {
+        wstate.t_prompt_us += ggml_time_us() - t_start_us;
+        wstate.n_prompt += n_tokens;
+    }
 
-static int64_t samples_to_cs(int samples) {
-    return (int64_t)((samples / (double)WHISPER_SAMPLE_RATE) * 100.0 + 0.5);
+    return !(abort_callback && abort_callback(abort_callback_data));
 }
 
-static bool weight_buft_supported(const whisper_vad_hparams & hparams, ggml_tensor * w, ggml_op op, ggml_backend_buffer_type_t buft, ggml_backend_dev_t dev) {
-    bool op_supported = true;
-
-    if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU ||
-        ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_IGPU ||
-        (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU && buft == ggml_backend_cpu_buffer_type())) {
-        // GPU and default CPU backend support all operators
-        op_supported = true;
-    } else {
-        switch (op) {
-            // The current extra_buffer_type implementations only support GGML_OP_MUL_MAT
-            case GGML_OP_MUL_MAT: {
-                ggml_init_params params = {
-                    /*.mem_size   =*/ 2 * ggml_tensor_overhead(),
-                    /*.mem_buffer =*/ nullptr,
-                    /*.no_alloc   =*/ true,
-                };
+// decoder graph for whisper_decode_batch()
+//
+// the tokens of all states are concatenated, so the projections, the MLP and
+// the logits run as one matmul each; self- and cross-attention run per state
+// against its own kv_self and kv_cross. only the last token of every state
+// gets logits
+static struct ggml_cgraph * whisper_build_graph_decoder_batch(
+         whisper_context & wctx,
+           whisper_sched & wsched,
+           whisper_state ** states,
+               const int * n_tokens,
+                     int   n_states,
+                     int   n_nodes) {
+    const auto & model   = whisper_state_model(wctx, *states[0]);
+    const auto & hparams = model.hparams;
 
-                ggml_context_ptr ctx_ptr { ggml_init(params) };
-                if (!ctx_ptr) {
-                    throw std::runtime_error("failed to create ggml context");
-                }
-                ggml_context * ctx = ctx_ptr.get();
+    // the batched states use the same adapters (whisper_states_split())
+    const whisper_state & wstate = *states[0];
 
-                ggml_tensor * op_tensor = nullptr;
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
 
-                int64_t n_ctx = hparams.lstm_hidden_size;
-                ggml_tensor * b = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, w->ne[0], n_ctx, w->ne[2], w->ne[3]);
-                op_tensor = ggml_mul_mat(ctx, w, b);
+    const int n_state_head = n_state/n_head;
 
-                // create a temporary dummy buffer for the weight so that supports_op can check the buffer type
-                GGML_ASSERT(w->buffer == nullptr);
-                w->buffer = ggml_backend_buft_alloc_buffer(buft, 0);
-                op_supported = ggml_backend_dev_supports_op(dev, op_tensor);
-                ggml_backend_buffer_free(w->buffer);
-                w->buffer = nullptr;
-                break;
-            }
-            default: {
-                op_supported = false;
-                break;
-            }
-        };
+    std::vector<int> offs(n_states + 1, 0);
+    for (int b = 0; b < n_states; ++b) {
+        offs[b + 1] = offs[b] + n_tokens[b];
     }
-    return op_supported;
-}
+    const int n_tokens_all = offs[n_states];
 
-static ggml_backend_buffer_type_t select_weight_buft(const whisper_vad_hparams & hparams, ggml_tensor * w, ggml_op op, buft_list_t buft_list) {
-    GGML_ASSERT(!buft_list.empty());
-    for (const auto & p : buft_list) {
-        ggml_backend_dev_t dev = p.first;
-        ggml_backend_buffer_type_t buft = p.second;
-        if (weight_buft_supported(hparams, w, op, buft, dev)) {
-            return buft;
-        }
-    }
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wsched.meta.size(),
+        /*.mem_buffer =*/ wsched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-    return nullptr;
-}
+    struct ggml_context * ctx0 = ggml_init(params);
 
-static ggml_tensor * whisper_vad_build_stft_layer(ggml_context * ctx0,
-        const whisper_vad_model & model, ggml_tensor * cur) {
-    // Apply reflective padding to the input tensor
-    ggml_tensor * padded = ggml_pad_reflect_1d(ctx0, cur, 64, 64);
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, n_nodes, false);
 
-    struct ggml_tensor * stft = ggml_conv_1d(ctx0, model.stft_forward_basis, padded, model.hparams.lstm_input_size, 0, 1);
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens_all);
+    ggml_set_name(embd, "embd");
+    ggml_set_input(embd);
 
-    // Calculate cutoff for real/imaginary parts
-    int cutoff = model.stft_forward_basis->ne[2] / 2;
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens_all);
+    ggml_set_name(position, "position");
+    ggml_set_input(position);
 
-    // Extract real part (first half of the STFT output).
-    struct ggml_tensor * real_part = ggml_view_2d(ctx0, stft, 4, cutoff, stft->nb[1], 0);
-    // Extract imaginary part (second half of the STFT output).
-    struct ggml_tensor * img_part = ggml_view_2d(ctx0, stft, 4, cutoff, stft->nb[1], cutoff * stft->nb[1]);
+    struct ggml_tensor * out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_states);
+    ggml_set_name(out_ids, "out_ids");
+    ggml_set_input(out_ids);
 
-    // Calculate magnitude: sqrt(real^2 + imag^2)
-    struct ggml_tensor * real_squared = ggml_mul(ctx0, real_part, real_part);
-    struct ggml_tensor * img_squared  = ggml_mul(ctx0, img_part, img_part);
-    struct ggml_tensor * sum_squares  = ggml_add(ctx0, real_squared, img_squared);
-    struct ggml_tensor * magnitude    = ggml_sqrt(ctx0, sum_squares);
-    return magnitude;
-}
+    const float KQscale = pow(float(n_state_head), -0.25);
 
-static ggml_tensor * whisper_vad_build_encoder_layer(ggml_context * ctx0,
-        const whisper_vad_model & model, ggml_tensor * cur) {
-    // First Conv1D: expands to 128 channels.
-    cur = ggml_conv_1d(ctx0, model.encoder_0_weight, cur, 1, 1, 1);
-    cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_0_bias, 1, 128, 1));
-    cur = ggml_relu(ctx0, cur);
+    std::vector<struct ggml_tensor *> KQ_mask(n_states);
+    for (int b = 0; b < n_states; ++b) {
+        KQ_mask[b] = ggml_new_tensor_3d(ctx0, wctx.params.flash_attn ? GGML_TYPE_F16 : GGML_TYPE_F32, states[b]->kv_self.n, GGML_PAD(n_tokens[b], GGML_KQ_MASK_PAD), 1);
+        ggml_format_name(KQ_mask[b], "KQ_mask_%d", b);
+        ggml_set_input(KQ_mask[b]);
+    }
 
-    // Second Conv1D: reduces to 64 channels.
-    cur = ggml_conv_1d(ctx0, model.encoder_1_weight, cur, 2, 1, 1);
-    cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_1_bias, 1, 64, 1));
-    cur = ggml_relu(ctx0, cur);
+    // rows [offs[b], offs[b + 1]) of a [n_state, n_tokens_all] tensor
+    auto rows = [&](struct ggml_tensor * t, int b) {
+        return ggml_view_2d(ctx0, t, n_state, n_tokens[b], t->nb[1], offs[b]*t->nb[1]);
+    };
 
-    // Third Conv1D: maintains 64 channels
-    cur = ggml_conv_1d(ctx0, model.encoder_2_weight, cur, 2, 1, 1);
-    cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_2_bias, 1, 64, 1));
-    cur = ggml_relu(ctx0, cur);
+    auto heads = [&](struct ggml_tensor * t, int b) {
+        return ggml_permute(ctx0,
+                ggml_view_3d(ctx0, t, n_state_head, n_head, n_tokens[b], t->nb[0]*n_state_head, t->nb[1], offs[b]*t->nb[1]),
+                0, 2, 1, 3);
+    };
 
-    // Fourth Conv1D: expands to 128 channels
-    cur = ggml_conv_1d(ctx0, model.encoder_3_weight, cur, 1, 1, 1);
-    cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_3_bias, 1, 128, 1));
-    cur = ggml_relu(ctx0, cur);
+    auto concat = [&](struct ggml_tensor * a, struct ggml_tensor * cur) {
+        return a ? ggml_concat(ctx0, a, cur, 1) : cur;
+    };
 
-    return cur;
-}
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
 
-static ggml_tensor * whisper_vad_build_lstm_layer(ggml_context * ctx0,
-        const whisper_vad_context & vctx, ggml_tensor * cur, ggml_cgraph * gf) {
-    const whisper_vad_model & model = vctx.model;
-    const int hdim = model.hparams.lstm_hidden_size;
+    struct ggml_tensor * inpL = cur;
 
-    struct ggml_tensor * x_t = ggml_transpose(ctx0, cur);
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
 
-    // Create operations using the input-to-hidden weights.
-    struct ggml_tensor * inp_gate = ggml_mul_mat(ctx0, model.lstm_ih_weight, x_t);
-    inp_gate = ggml_add(ctx0, inp_gate, model.lstm_ih_bias);
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
 
-    // Create operations using the hidden-to-hidden weights.
-    struct ggml_tensor * hid_gate = ggml_mul_mat(ctx0, model.lstm_hh_weight, vctx.h_state);
-    hid_gate = ggml_add(ctx0, hid_gate, model.lstm_hh_bias);
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
 
-    // Create add operation to get preactivations for all gates.
-    struct ggml_tensor * out_gate = ggml_add(ctx0, inp_gate, hid_gate);
+        // self-attention
+        {
+            struct ggml_tensor * Qcur;
+            struct ggml_tensor * Kcur;
+            struct ggml_tensor * Vcur;
 
-    const size_t hdim_size = ggml_row_size(out_gate->type, hdim);
+            whisper_build_qkv(ctx0, wstate, layer, cur, Qcur, Kcur, Vcur);
 
-    // Create sigmoid for input gate (using the first 128 bytes from the preactivations).
-    struct ggml_tensor * i_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 0 * hdim_size));
+            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+            Kcur = ggml_scale(ctx0, Kcur, KQscale);
 
-    // Create sigmoid for the forget gate (using the second 128 bytes from the preactivations).
-    struct ggml_tensor * f_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 1 * hdim_size));
+            struct ggml_tensor * out = nullptr;
 
-    // Create sigmoid for the cell gate (using the third 128 bytes from the preactivations).
-    struct ggml_tensor * g_t = ggml_tanh(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 2 * hdim_size));
+            for (int b = 0; b < n_states; ++b) {
+                auto & kv_self = states[b]->kv_self;
 
-    // Create sigmoid for the output gate (using the fourth 128 bytes from the preactivations).
-    struct ggml_tensor * o_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 3 * hdim_size));
+                const int n_ctx   = kv_self.size;
+                const int n_kv    = kv_self.n;
+                const int kv_head = kv_self.head;
 
-    // Update cell state
-    struct ggml_tensor * c_out = ggml_add(ctx0,
-        ggml_mul(ctx0, f_t, vctx.c_state),
-        ggml_mul(ctx0, i_t, g_t));
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, c_out, vctx.c_state));
+                // store key and value to memory
+                {
+                    struct ggml_tensor * k;
+                    struct ggml_tensor * v;
+                    struct ggml_tensor * Vb = rows(Vcur, b);
 
-    // Update hidden state
-    struct ggml_tensor * out = ggml_mul(ctx0, o_t, ggml_tanh(ctx0, c_out));
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, out,   vctx.h_state));
+                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens[b]*n_state,
+                            ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
 
-    return out;
-}
+                    if (wctx.params.flash_attn) {
+                        v = ggml_view_1d(ctx0, kv_self.v, n_tokens[b]*n_state,
+                                ggml_row_size(kv_self.v->type, n_state)*(il*n_ctx + kv_head));
+                    } else {
+                        Vb = ggml_transpose(ctx0, Vb);
 
-static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx) {
-    const auto & model = vctx.model;
+                        v = ggml_view_2d(ctx0, kv_self.v, n_tokens[b], n_state,
+                                (   n_ctx)*ggml_element_size(kv_self.v),
+                                (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+                    }
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ vctx.sched.meta.size(),
-        /*.mem_buffer =*/ vctx.sched.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, rows(Kcur, b), k));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vb, v));
+                }
 
-    struct ggml_context * ctx0 = ggml_init(params);
+                struct ggml_tensor * Q = heads(Qcur, b);
 
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_state_head, n_kv, n_head,
+                            ggml_row_size(kv_self.k->type, n_state),
+                            ggml_row_size(kv_self.k->type, n_state_head),
+                            ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
-    struct ggml_tensor * frame = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, vctx.n_window, 1);
-    ggml_set_name(frame, "frame");
-    ggml_set_input(frame);
+                struct ggml_tensor * KQV;
 
-    struct ggml_tensor * cur = nullptr;
-    {
-        cur = whisper_vad_build_stft_layer(ctx0, model, frame);
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_state_head, n_kv, n_head,
+                                ggml_row_size(kv_self.v->type, n_state),
+                                ggml_row_size(kv_self.v->type, n_state_head),
+                                ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
+
+                    KQV = ggml_reshape_2d(ctx0, ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask[b], 1.0f, 0.0f, 0.0f), n_state, n_tokens[b]);
+                } else {
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, ggml_mul_mat(ctx0, K, Q), KQ_mask[b], 1.0f, 0.0f);
 
-        cur = whisper_vad_build_encoder_layer(ctx0, model, cur);
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_kv, n_state_head, n_head,
+                                n_ctx*ggml_element_size(kv_self.v),
+                                n_ctx*ggml_element_size(kv_self.v)*n_state_head,
+                                n_ctx*ggml_element_size(kv_self.v)*n_state*il);
 
-        // Extract the first element of the first dimension
-        // (equivalent to pytorch's [:, :, 0])
-        cur = ggml_view_2d(ctx0, cur, 1, 128, cur->nb[1], 0);
-
-        cur = whisper_vad_build_lstm_layer(ctx0, vctx, cur, gf);
-        cur = ggml_relu(ctx0, cur);
-        cur = ggml_conv_1d(ctx0, model.final_conv_weight, cur, 1, 0, 1);
-        cur = ggml_add(ctx0, cur, model.final_conv_bias);
-        cur = ggml_sigmoid(ctx0, cur);
-        ggml_set_name(cur, "prob");
-        ggml_set_output(cur);
-    }
+                    KQV = ggml_cont_2d(ctx0, ggml_permute(ctx0, ggml_mul_mat(ctx0, V, KQ_soft_max), 0, 2, 1, 3), n_state, n_tokens[b]);
+                }
 
-    ggml_build_forward_expand(gf, cur);
+                out = concat(out, KQV);
+            }
 
-    ggml_free(ctx0);
+            cur = out;
+        }
 
-    return gf;
-}
+        // projection
+        {
+            cur = whisper_mm(ctx0, wstate, layer.attn_ln_1_w, cur);
+            cur = ggml_add(ctx0, cur, layer.attn_ln_1_b);
+        }
 
-static bool whisper_vad_init_context(whisper_vad_context * vctx) {
+        // add the input
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
-    auto whisper_context_params = whisper_context_default_params();
-    // TODO: GPU VAD is forced disabled until the performance is improved
-    //whisper_context_params.use_gpu    = vctx->params.use_gpu;
-    whisper_context_params.use_gpu    = false;
-    whisper_context_params.gpu_device = vctx->params.gpu_device;
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
 
-    vctx->backends = whisper_backend_init(whisper_context_params);
-    if (vctx->backends.empty()) {
-        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
-        return false;
-    }
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, layer.cross_attn_ln_0_w),
+                    layer.cross_attn_ln_0_b);
+        }
 
-    const int32_t lstm_hidden_size = vctx->model.hparams.lstm_hidden_size;
+        // cross-attention
+        {
+            struct ggml_tensor * Qcur = ggml_add(ctx0, whisper_mm(ctx0, wstate, layer.cross_attn_q_w, cur), layer.cross_attn_q_b);
 
-    vctx->ctx_buf.resize(2u*ggml_tensor_overhead());
+            struct ggml_tensor * out = nullptr;
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ vctx->ctx_buf.size(),
-        /*.mem_buffer =*/ vctx->ctx_buf.data(),
-        /*.no_alloc   =*/ true,
-    };
+            for (int b = 0; b < n_states; ++b) {
+                const auto & kv_cross = states[b]->kv_cross;
 
-    ggml_context * ctx = ggml_init(params);
-    if (!ctx) {
-        WHISPER_LOG_ERROR("%s: failed to init LSTM state ggml context\n", __func__);
-        return false;
-    }
+                const int n_audio_ctx     = states[b]->exp_n_audio_ctx > 0 ? states[b]->exp_n_audio_ctx : hparams.n_audio_ctx;
+                const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
 
-    // LSTM Hidden state
-    vctx->h_state = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, lstm_hidden_size);
-    ggml_set_name(vctx->h_state, "h_state");
+                struct ggml_tensor * Q = heads(Qcur, b);
 
-    // LSTM Cell state
-    vctx->c_state = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, lstm_hidden_size);
-    ggml_set_name(vctx->c_state, "c_state");
+                struct ggml_tensor * KQV;
 
-    vctx->buffer = ggml_backend_alloc_ctx_tensors(ctx, vctx->backends[0]);
-    ggml_free(ctx);
-    if (!vctx->buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the VAD state\n", __func__);
-        return false;
-    }
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, kv_cross.k,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_row_size(kv_cross.k->type, n_state),
+                                ggml_row_size(kv_cross.k->type, n_state_head),
+                                ggml_row_size(kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, kv_cross.v,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_row_size(kv_cross.v->type, n_state),
+                                ggml_row_size(kv_cross.v->type, n_state_head),
+                                ggml_row_size(kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
+
+                    KQV = ggml_reshape_2d(ctx0, ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f), n_state, n_tokens[b]);
+                } else {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, kv_cross.k,
+                                n_state_head, n_audio_ctx, n_head,
+                                ggml_row_size(kv_cross.k->type, n_state),
+                                ggml_row_size(kv_cross.k->type, n_state_head),
+                                ggml_row_size(kv_cross.k->type, n_state)*n_audio_ctx*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, kv_cross.v,
+                                n_audio_ctx, n_state_head, n_head,
+                                n_audio_ctx*ggml_element_size(kv_cross.v),
+                                n_audio_ctx*ggml_element_size(kv_cross.v)*n_state_head,
+                                n_audio_ctx*ggml_element_size(kv_cross.v)*n_state*il);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, ggml_mul_mat(ctx0, Kcross, Q), nullptr, KQscale, 0.0f);
+
+                    KQV = ggml_cont_2d(ctx0, ggml_permute(ctx0, ggml_mul_mat(ctx0, Vcross, KQ_soft_max), 0, 2, 1, 3), n_state, n_tokens[b]);
+                }
 
-    {
-        bool ok = whisper_sched_graph_init(vctx->sched, vctx->backends,
-                [&]() {
-                    return whisper_vad_build_graph(*vctx);
-                });
+                out = concat(out, KQV);
+            }
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init VAD allocator\n", __func__);
-            return false;
+            cur = out;
         }
 
-        WHISPER_LOG_INFO("%s: compute buffer (VAD)   = %7.2f MB\n", __func__, whisper_sched_size(vctx->sched) / 1e6);
-    }
+        // projection
+        {
+            cur = whisper_mm(ctx0, wstate, layer.cross_attn_ln_1_w, cur);
+            cur = ggml_add(ctx0, cur, layer.cross_attn_ln_1_b);
+        }
 
-    return true;
-}
+        // add the input
+        cur = ggml_add(ctx0, cur, inpCA);
 
-struct whisper_vad_context * whisper_vad_init_from_file_with_params(
-        const char * path_model,
-        struct whisper_vad_context_params params) {
-    WHISPER_LOG_INFO("%s: loading VAD model from '%s'\n", __func__, path_model);
-#ifdef _MSC_VER
-    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
-    std::wstring path_model_wide = converter.from_bytes(path_model);
-    auto fin = std::ifstream(path_model_wide, std::ios::binary);
-#else
-    auto fin = std::ifstream(path_model, std::ios::binary);
-#endif
-    if (!fin) {
-        WHISPER_LOG_ERROR("%s: failed to open VAD model '%s'\n", __func__, path_model);
-        return nullptr;
-    }
+        struct ggml_tensor * inpFF = cur;
 
-    whisper_model_loader loader = {};
-    loader.context = &fin;
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF, hparams.eps);
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->read((char *)output, read_size);
-        return read_size;
-    };
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0, cur, layer.mlp_ln_w),
+                        layer.mlp_ln_b);
+            }
 
-    loader.eof = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        return fin->eof();
-    };
+            // fully connected
+            cur = whisper_mm(ctx0, wstate, layer.mlp_0_w, cur);
+            cur = ggml_add(ctx0, cur, layer.mlp_0_b);
 
-    loader.close = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->close();
-    };
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
 
-    auto ctx = whisper_vad_init_with_params(&loader, params);
-    if (!ctx) {
-        whisper_vad_free(ctx);
-        return nullptr;
+            // projection
+            cur = whisper_mm(ctx0, wstate, layer.mlp_1_w, cur);
+            cur = ggml_add(ctx0, cur, layer.mlp_1_b);
+        }
+
+        inpL = ggml_add(ctx0, cur, inpFF);
     }
-    ctx->path_model = path_model;
-    return ctx;
-}
 
-struct whisper_vad_context * whisper_vad_init_with_params(
-            struct whisper_model_loader * loader,
-            struct whisper_vad_context_params params) {
-    // Read the VAD model
+    // the last token of every state
+    cur = ggml_get_rows(ctx0, inpL, out_ids);
+
+    // norm
     {
-        uint32_t magic;
-        read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
-            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
-            return nullptr;
-        }
+        cur = ggml_norm(ctx0, cur, hparams.eps);
+
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0, cur, model.d_ln_w),
+                model.d_ln_b);
     }
 
-    whisper_vad_context * vctx = new whisper_vad_context;
-    vctx->n_threads = params.n_threads;
-    vctx->params.use_gpu = params.use_gpu;
-    vctx->params.gpu_device = params.gpu_device;
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
-    auto & model = vctx->model;
-    auto & hparams = model.hparams;
+    ggml_build_forward_expand(gf, logits);
 
-    // load model context params.
-    {
-        int32_t str_len;
-        read_safe(loader, str_len);
-        std::vector<char> buffer(str_len + 1, 0);
-        loader->read(loader->context, buffer.data(), str_len);
-        std::string model_type(buffer.data(), str_len);
-        model.type = model_type;
-        WHISPER_LOG_INFO("%s: model type: %s\n", __func__, model.type.c_str());
+    ggml_free(ctx0);
 
-        int32_t major, minor, patch;
-        read_safe(loader, major);
-        read_safe(loader, minor);
-        read_safe(loader, patch);
-        std::string version_str = std::to_string(major) + "." +
-                                  std::to_string(minor) + "." +
-                                  std::to_string(patch);
-        model.version = version_str;
-        WHISPER_LOG_INFO("%s: model version: %s\n", __func__, model.version.c_str());
+    return gf;
+}
 
-        read_safe(loader, vctx->n_window);
-        read_safe(loader, vctx->n_context);
-    }
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
 
-    // load model hyper params (hparams).
-    {
-        read_safe(loader, hparams.n_encoder_layers);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
 
-        hparams.encoder_in_channels = new int32_t[hparams.n_encoder_layers];
-        hparams.encoder_out_channels = new int32_t[hparams.n_encoder_layers];
-        hparams.kernel_sizes = new int32_t[hparams.n_encoder_layers];
+    return std::string(buf);
+}
 
-        for (int32_t i = 0; i < hparams.n_encoder_layers; i++) {
-            read_safe(loader, hparams.encoder_in_channels[i]);
-            read_safe(loader, hparams.encoder_out_channels[i]);
-            read_safe(loader, hparams.kernel_sizes[i]);
-        }
+namespace {
+// Real-input FFT of a fixed even length n. The n real samples are treated as
+// n/2 complex values (even + i*odd), transformed with an iterative mixed-radix
+// Stockham FFT (radix 4, 2, 3, 5 and a generic odd radix), then split into the
+// n/2 + 1 bins of the real spectrum. All twiddles are precomputed; the inner
+// butterfly loop runs over contiguous sub-transforms so it vectorizes.
+struct whisper_fft_plan {
+    struct stage {
+        int    radix;
+        size_t twiddles; // offset of the (len/radix) x (radix - 1) twiddles
+        size_t roots;    // offset of the radix roots of unity (generic radix only)
+    };
 
-        read_safe(loader, hparams.lstm_input_size);
-        read_safe(loader, hparams.lstm_hidden_size);
-        read_safe(loader, hparams.final_conv_in);
-        read_safe(loader, hparams.final_conv_out);
+    int n = 0; // real length
+    int m = 0; // complex length, n/2
 
-        WHISPER_LOG_INFO("%s: n_encoder_layers = %d\n", __func__, hparams.n_encoder_layers);
-        for (int32_t i = 0; i < hparams.n_encoder_layers; i++) {
-            WHISPER_LOG_INFO("%s: encoder_in_channels[%d] = %d\n", __func__, i, hparams.encoder_in_channels[i]);
-        }
-        for (int32_t i = 0; i < hparams.n_encoder_layers; i++) {
-            WHISPER_LOG_INFO("%s: encoder_out_channels[%d] = %d\n", __func__, i, hparams.encoder_out_channels[i]);
-        }
-        WHISPER_LOG_INFO("%s: lstm_input_size = %d\n", __func__, hparams.lstm_input_size);
-        WHISPER_LOG_INFO("%s: lstm_hidden_size = %d\n", __func__, hparams.lstm_hidden_size);
-        WHISPER_LOG_INFO("%s: final_conv_in = %d\n", __func__, hparams.final_conv_in);
-        WHISPER_LOG_INFO("%s: final_conv_out = %d\n", __func__, hparams.final_conv_out);
-    }
+    std::vector<stage> stages;
+    std::vector<float> table; // interleaved (re, im)
+    std::vector<float> post;  // W_n^k for k in [0, m], interleaved
 
-    // 1 STFT tensor, 4*2 encoder tensors, 4 LSTM tensors, 2 final output tensors
-    const size_t n_tensors = hparams.n_encoder_layers * 2 + 4 + 2 + 1;
+    void init(int n_real) {
+        WHISPER_ASSERT(n_real >= 2 && n_real % 2 == 0);
 
-    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
-    auto get_ctx = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
-        auto it = ctx_map.find(buft);
-        if (it == ctx_map.end()) {
-            ggml_init_params params = {
-                /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
-                /*.mem_buffer =*/ nullptr,
-                /*.no_alloc   =*/ true,
-            };
+        n = n_real;
+        m = n_real / 2;
 
-            ggml_context * ctx = ggml_init(params);
-            if (!ctx) {
-                throw std::runtime_error("failed to create ggml context");
+        stages.clear();
+        table.clear();
+        post.clear();
+
+        auto push_root = [this](double theta) {
+            table.push_back((float) cos(theta));
+            table.push_back((float) -sin(theta));
+        };
+
+        int len = m;
+        while (len > 1) {
+            int r = 0;
+            for (int f : { 4, 2, 3, 5 }) {
+                if (len % f == 0) {
+                    r = f;
+                    break;
+                }
+            }
+            if (r == 0) {
+                // smallest remaining factor
+                for (r = 7; len % r != 0; r += 2) {}
             }
 
-            ctx_map[buft] = ctx;
-            model.ctxs.emplace_back(ctx);
+            stage st = { r, table.size(), 0 };
+            const int mm = len / r;
+            for (int p = 0; p < mm; ++p) {
+                for (int u = 1; u < r; ++u) {
+                    push_root(2.0 * M_PI * p * u / len);
+                }
+            }
+            if (r > 5) {
+                st.roots = table.size();
+                for (int u = 0; u < r; ++u) {
+                    push_root(2.0 * M_PI * u / r);
+                }
+            }
+            stages.push_back(st);
+            len = mm;
+        }
 
-            return ctx;
+        for (int k = 0; k <= m; ++k) {
+            const double theta = 2.0 * M_PI * k / n;
+            post.push_back((float) cos(theta));
+            post.push_back((float) -sin(theta));
         }
+    }
 
-        return it->second;
-    };
+    // scratch floats needed by rfft()
+    size_t work_size() const {
+        return 4 * (size_t) m;
+    }
 
-    whisper_context_params wparams = whisper_context_default_params();
-    wparams.use_gpu = params.use_gpu;
-    wparams.gpu_device = params.gpu_device;
-    buft_list_t buft_list = make_buft_list(wparams);
+    // in: n real samples; out: m + 1 complex bins, interleaved
+    void rfft(const float * in, float * out, float * work) const {
+        float * x = work;
+        float * y = work + 2 * m;
 
-    auto create_tensor = [&](vad_tensor type, ggml_tensor * meta) -> ggml_tensor * {
-        ggml_op op = VAD_TENSOR_OPS.at(type);
-        ggml_backend_buffer_type_t buft = select_weight_buft(hparams, meta, op, buft_list);
-        if (!buft) {
-            throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", VAD_TENSOR_NAMES.at(type)));
+        std::copy(in, in + n, x);
+
+        int len = m;
+        int s   = 1; // number of interleaved sub-transforms
+        for (const stage & st : stages) {
+            butterflies(st, len, s, x, y);
+            std::swap(x, y);
+            len /= st.radix;
+            s   *= st.radix;
         }
-        ggml_context * ctx = get_ctx(buft);
-        ggml_tensor * tensor = ggml_dup_tensor(ctx, meta);
-        model.tensors[VAD_TENSOR_NAMES.at(type)] = tensor;
 
-        return tensor;
-    };
+        // split the transform of (even + i*odd) into the real spectrum
+        for (int k = 0; k <= m; ++k) {
+            const float zr =  x[2*(k % m) + 0];
+            const float zi =  x[2*(k % m) + 1];
+            const float cr =  x[2*((m - k) % m) + 0];
+            const float ci = -x[2*((m - k) % m) + 1];
 
-    // create tensors
-    {
-        ggml_init_params params = {
-            /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
-            /*.mem_buffer =*/ nullptr,
-            /*.no_alloc   =*/ true,
-        };
+            const float er = 0.5f * (zr + cr);
+            const float ei = 0.5f * (zi + ci);
+            const float or_ = 0.5f * (zi - ci);
+            const float oi  = -0.5f * (zr - cr);
 
-        ggml_context * ctx = ggml_init(params);
-        const auto & hparams = model.hparams;
+            const float wr = post[2*k + 0];
+            const float wi = post[2*k + 1];
 
-        // SFTF precomputed basis matrix
-        model.stft_forward_basis = create_tensor(VAD_TENSOR_STFT_BASIS,
-            ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 256, 1, 258));
+            out[2*k + 0] = er + wr*or_ - wi*oi;
+            out[2*k + 1] = ei + wr*oi  + wi*or_;
+        }
+    }
 
-        model.encoder_0_weight = create_tensor(VAD_TENSOR_ENC_0_WEIGHT,
-            ggml_new_tensor_3d(
-                ctx,
-                GGML_TYPE_F16,
-                hparams.kernel_sizes[0],
+private:
+    // one Stockham pass: for every p, combine x[q + s*(p + t*mm)], t < radix,
+    // into y[q + s*(radix*p + u)] scaled by W_len^(p*u)
+    void butterflies(const stage & st, int len, int s, const float * x, float * y) const {
+        const int r  = st.radix;
+        const int mm = len / r;
+
+        for (int p = 0; p < mm; ++p) {
+            const float * w = table.data() + st.twiddles + 2 * (size_t) p * (r - 1);
+
+            const float * a = x + 2 * (size_t) s * p;
+            float       * b = y + 2 * (size_t) s * r * p;
+            const size_t da = 2 * (size_t) s * mm; // between inputs t and t + 1
+            const size_t db = 2 * (size_t) s;      // between outputs u and u + 1
+
+            switch (r) {
+                case 2:
+                    for (int q = 0; q < s; ++q) {
+                        const float * a0 = a + 2*q;
+                        const float * a1 = a0 + da;
+                        float * b0 = b + 2*q;
+                        float * b1 = b0 + db;
+
+                        const float dr = a0[0] - a1[0];
+                        const float di = a0[1] - a1[1];
+                        b0[0] = a0[0] + a1[0];
+                        b0[1] = a0[1] + a1[1];
+                        b1[0] = dr*w[0] - di*w[1];
+                        b1[1] = dr*w[1] + di*w[0];
+                    }
+                    break;
+                case 3:
+                    for (int q = 0; q < s; ++q) {
+                        const float * a0 = a + 2*q;
+                        const float * a1 = a0 + da;
+                        const float * a2 = a1 + da;
+                        float * b0 = b + 2*q;
+                        float * b1 = b0 + db;
+                        float * b2 = b1 + db;
+
+                        const float c = -0.5f;
+                        const float sn = 0.86602540378443865f;
+
+                        const float t1r = a1[0] + a2[0], t1i = a1[1] + a2[1];
+                        const float t2r = a1[0] - a2[0], t2i = a1[1] - a2[1];
+                        const float m1r = a0[0] + c*t1r, m1i = a0[1] + c*t1i;
+                        const float m2r = sn*t2i,        m2i = -sn*t2r;
+
+                        b0[0] = a0[0] + t1r;
+                        b0[1] = a0[1] + t1i;
+                        cmul(m1r + m2r, m1i + m2i, w + 0, b1);
+                        cmul(m1r - m2r, m1i - m2i, w + 2, b2);
+                    }
+                    break;
+                case 4:
+                    for (int q = 0; q < s; ++q) {
+                        const float * a0 = a + 2*q;
+                        const float * a1 = a0 + da;
+                        const float * a2 = a1 + da;
+                        const float * a3 = a2 + da;
+                        float * b0 = b + 2*q;
+                        float * b1 = b0 + db;
+                        float * b2 = b1 + db;
+                        float * b3 = b2 + db;
+
+                        const float t0r = a0[0] + a2[0], t0i = a0[1] + a2[1];
+                        const float t1r = a0[0] - a2[0], t1i = a0[1] - a2[1];
+                        const float t2r = a1[0] + a3[0], t2i = a1[1] + a3[1];
+                        // (a1 - a3) * -i
+                        const float t3r = a1[1] - a3[1], t3i = a3[0] - a1[0];
+
+                        b0[0] = t0r + t2r;
+                        b0[1] = t0i + t2i;
+                        cmul(t1r + t3r, t1i + t3i, w + 0, b1);
+                        cmul(t0r - t2r, t0i - t2i, w + 2, b2);
+                        cmul(t1r - t3r, t1i - t3i, w + 4, b3);
+                    }
+                    break;
+                case 5:
+                    for (int q = 0; q < s; ++q) {
+                        const float * a0 = a + 2*q;
+                        const float * a1 = a0 + da;
+                        const float * a2 = a1 + da;
+                        const float * a3 = a2 + da;
+                        const float * a4 = a3 + da;
+                        float * b0 = b + 2*q;
+                        float * b1 = b0 + db;
+                        float * b2 = b1 + db;
+                        float * b3 = b2 + db;
+                        float * b4 = b3 + db;
+
+                        const float c1 =  0.30901699437494742f; // cos(2pi/5)
+                        const float c2 = -0.80901699437494742f; // cos(4pi/5)
+                        const float s1 =  0.95105651629515357f; // sin(2pi/5)
+                        const float s2 =  0.58778525229247313f; // sin(4pi/5)
+
+                        const float t1r = a1[0] + a4[0], t1i = a1[1] + a4[1];
+                        const float t2r = a2[0] + a3[0], t2i = a2[1] + a3[1];
+                        const float t3r = a1[0] - a4[0], t3i = a1[1] - a4[1];
+                        const float t4r = a2[0] - a3[0], t4i = a2[1] - a3[1];
+
+                        const float m1r = a0[0] + c1*t1r + c2*t2r, m1i = a0[1] + c1*t1i + c2*t2i;
+                        const float m2r = a0[0] + c2*t1r + c1*t2r, m2i = a0[1] + c2*t1i + c1*t2i;
+                        // -i * (s1*t3 + s2*t4) and -i * (s2*t3 - s1*t4)
+                        const float n1r = s1*t3i + s2*t4i, n1i = -(s1*t3r + s2*t4r);
+                        const float n2r = s2*t3i - s1*t4i, n2i = -(s2*t3r - s1*t4r);
+
+                        b0[0] = a0[0] + t1r + t2r;
+                        b0[1] = a0[1] + t1i + t2i;
+                        cmul(m1r + n1r, m1i + n1i, w + 0, b1);
+                        cmul(m2r + n2r, m2i + n2i, w + 2, b2);
+                        cmul(m2r - n2r, m2i - n2i, w + 4, b3);
+                        cmul(m1r - n1r, m1i - n1i, w + 6, b4);
+                    }
+                    break;
+                default:
+                    {
+                        const float * root = table.data() + st.roots;
+                        for (int q = 0; q < s; ++q) {
+                            for (int u = 0; u < r; ++u) {
+                                float sr = 0.0f;
+                                float si = 0.0f;
+                                for (int t = 0; t < r; ++t) {
+                                    const float * at = a + 2*q + t*da;
+                                    const float * rt = root + 2*((t*u) % r);
+                                    sr += at[0]*rt[0] - at[1]*rt[1];
+                                    si += at[0]*rt[1] + at[1]*rt[0];
+                                }
+                                float * bu = b + 2*q + u*db;
+                                if (u == 0) {
+                                    bu[0] = sr;
+                                    bu[1] = si;
+                                } else {
+                                    cmul(sr, si, w + 2*(u - 1), bu);
+                                }
+                            }
+                        }
+                    }
+                    break;
+            }
+        }
+    }
+
+    static void cmul(float re, float im, const float * w, float * out) {
+        out[0] = re*w[0] - im*w[1];
+        out[1] = re*w[1] + im*w[0];
+    }
+};
+
+struct whisper_global_cache {
+    // Hann window (Use cosf to eliminate difference)
+    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
+    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
+    float hann_window[WHISPER_N_FFT];
+
+    // FFT of one WHISPER_N_FFT frame
+    whisper_fft_plan fft_plan;
+
+    whisper_global_cache() {
+        fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
+        fft_plan.init(WHISPER_N_FFT);
+    }
+
+    void fill_hann_window(int length, bool periodic, float * output) {
+        int offset = -1;
+        if (periodic) {
+            offset = 0;
+        }
+        for (int i = 0; i < length; i++) {
+            output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
+        }
+    }
+} global_cache;
+}
+
+// log10 for normal positive floats, written without calls or branches so the
+// per-band loop vectorizes: x = 2^e * m with m in [sqrt(1/2), sqrt(2)),
+// ln(m) = 2*atanh((m - 1)/(m + 1)); abs. error ~1e-6
+static inline float whisper_log10f(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    int e = (int) ((bits >> 23) & 0xff) - 127;
+    const uint32_t mbits = (bits & 0x007fffff) | 0x3f800000;
+    float m;
+    memcpy(&m, &mbits, sizeof(m));
+
+    const bool hi = m > 1.41421356f;
+    m = hi ? 0.5f*m : m;
+    e = hi ? e + 1 : e;
+
+    const float f  = (m - 1.0f)/(m + 1.0f);
+    const float f2 = f*f;
+    const float ln_m = 2.0f*f*(1.0f + f2*(1.0f/3.0f + f2*(1.0f/5.0f + f2*(1.0f/7.0f + f2*(1.0f/9.0f)))));
+
+    return (ln_m + (float) e*0.693147181f)*0.434294482f;
+}
+
+// frames per mel batch; the filterbank is applied to all of them at once
+#define WHISPER_MEL_BATCH 8
+
+static void log_mel_spectrogram_worker_thread(std::atomic<int> & next, const float * hann, const float * samples,
+                                              int n_samples, int frame_size, int frame_step,
+                                              const whisper_filters & filters, whisper_mel & mel) {
+    const whisper_fft_plan & plan = global_cache.fft_plan;
+    const int B = WHISPER_MEL_BATCH;
+
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(2 * (frame_size / 2 + 1));
+    std::vector<float> fft_work(plan.work_size());
+
+    const int n_fft = filters.n_fft;
+
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    assert(n_fft == 1 + (frame_size / 2));
+
+    // power spectra of the batch, bin-major: power[k*B + b]
+    std::vector<float> power(n_fft * B);
+    float acc[WHISPER_MEL_BATCH];
+
+    // frames past this one only see the zero padding
+    const int n_nonzero = std::min(n_samples / frame_step + 1, mel.n_len);
+    const float log_zero = log10f(1e-10f);
+
+    // threads take the next batch of consecutive frames from a shared counter, so a preempted or slower
+    // thread does not hold back the others with a fixed share of the frames
+    for (int i0 = next.fetch_add(B, std::memory_order_relaxed); i0 < mel.n_len; i0 = next.fetch_add(B, std::memory_order_relaxed)) {
+        const int nb = std::max(0, std::min(B, n_nonzero - i0));
+
+        for (int b = 0; b < nb; b++) {
+            const int offset = (i0 + b) * frame_step;
+
+            // apply Hann window (~10% faster)
+            for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
+                fft_in[j] = hann[j] * samples[offset + j];
+            }
+
+            // fill the rest with zeros
+            if (n_samples - offset < frame_size) {
+                std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
+            }
+
+            // FFT
+            plan.rfft(fft_in.data(), fft_out.data(), fft_work.data());
+
+            // Calculate modulus^2 of complex numbers
+            // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+            for (int k = 0; k < n_fft; k++) {
+                power[k*B + b] = (fft_out[2 * k + 0] * fft_out[2 * k + 0] + fft_out[2 * k + 1] * fft_out[2 * k + 1]);
+            }
+        }
+        for (int b = nb; b < B; b++) {
+            for (int k = 0; k < n_fft; k++) {
+                power[k*B + b] = 0.0f;
+            }
+        }
+
+        const int n_out = std::min(B, mel.n_len - i0);
+
+        // mel spectrogram: banded filterbank times the batch
+        for (int j = 0; j < mel.n_mel; j++) {
+            float * out = mel.data.data() + (size_t) j * mel.n_len + i0;
+
+            if (nb == 0) {
+                for (int b = 0; b < n_out; b++) {
+                    out[b] = log_zero;
+                }
+                continue;
+            }
+
+            const float * w = filters.data.data() + (size_t) j * n_fft;
+            for (int b = 0; b < B; b++) {
+                acc[b] = 0.0f;
+            }
+            for (int k = filters.bands[2*j + 0]; k < filters.bands[2*j + 1]; k++) {
+                const float wk = w[k];
+                const float * pk = power.data() + k*B;
+                for (int b = 0; b < B; b++) {
+                    acc[b] += wk * pk[b];
+                }
+            }
+            for (int b = 0; b < B; b++) {
+                acc[b] = whisper_log10f(std::max(acc[b], 1e-10f));
+            }
+            for (int b = 0; b < n_out; b++) {
+                out[b] = acc[b];
+            }
+        }
+    }
+}
+
+// Computes mel.n_len frames from samples[i*frame_step ...]; samples past
+// n_samples are zero
+static void log_mel_frames(const float * samples, int n_samples, int n_threads,
+                           const whisper_filters & filters, whisper_mel & mel) {
+    const float * hann = global_cache.hann_window;
+
+    std::atomic<int> next(0);
+
+    std::vector<std::thread> workers(n_threads - 1);
+    for (int iw = 0; iw < n_threads - 1; ++iw) {
+        workers[iw] = std::thread(
+                log_mel_spectrogram_worker_thread, std::ref(next), hann, samples,
+                n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH,
+                std::cref(filters), std::ref(mel));
+    }
+
+    // main thread
+    log_mel_spectrogram_worker_thread(next, hann, samples, n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH, filters, mel);
+
+    for (int iw = 0; iw < n_threads - 1; ++iw) {
+        workers[iw].join();
+    }
+}
+
+// clamp to 8 below the largest value and scale, as openai/whisper does
+static void log_mel_normalize(whisper_mel & mel, float mmax) {
+    mmax -= 8.0f;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        mel.data[i] = ((mel.data[i] < mmax ? mmax : mel.data[i]) + 4.0f)*0.25f;
+    }
+}
+
+// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
+static bool log_mel_spectrogram(
+              whisper_state & wstate,
+              const float * samples,
+              const int   n_samples,
+              const int   /*sample_rate*/,
+              const int   frame_size,
+              const int   frame_step,
+              const int   n_mel,
+              const int   n_threads,
+              const whisper_filters & filters,
+              const bool   debug,
+              whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // Hann window and FFT plan are built for these
+    WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
+    WHISPER_ASSERT(frame_step == WHISPER_HOP_LENGTH && "Unsupported frame_step");
+
+    // Calculate the length of padding
+    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    int64_t stage_2_pad = frame_size / 2;
+
+    // Initialize a vector and copy data from C array to it.
+    std::vector<float> samples_padded;
+    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+
+    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+
+    // reflective pad 200 samples at the beginning of audio
+    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+
+    mel.n_mel     = n_mel;
+    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
+    // Calculate number of frames + remove the last frame
+    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    // Calculate semi-padded sample length to ensure compatibility
+    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+    log_mel_frames(samples_padded.data(), n_samples + stage_2_pad, n_threads, filters, mel);
+
+    // clamping and normalization
+    float mmax = -1e20f;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        mmax = mel.data[i] > mmax ? mel.data[i] : mmax;
+    }
+
+    log_mel_normalize(mel, mmax);
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+    whisper_trace_add("mel", t_start_us);
+
+    // Dump log_mel_spectrogram
+    if (debug) {
+        std::ofstream outFile("log_mel_spectrogram.json");
+        outFile << "[";
+        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
+            outFile << mel.data[i] << ", ";
+        }
+        outFile << mel.data[mel.data.size() - 1] << "]";
+        outFile.close();
+    }
+
+    return true;
+}
+
+// split text into tokens
+//
+// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
+//
+// Regex (Python):
+// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
+//
+// Regex (C++):
+// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+//
+
+// length of the longest non-empty token that str[0, n) starts with, 0 if there is none
+static int whisper_vocab_longest_token(const whisper_vocab & vocab, const char * str, int n, whisper_vocab::id & id) {
+    int len = 0;
+
+    uint32_t node = 0;
+    for (int i = 0; i < n; ++i) {
+        const auto & cur   = vocab.trie_nodes[node];
+        const auto   begin = vocab.trie_edges.begin() + cur.first;
+        const auto   end   = begin + cur.n_edges;
+        const uint8_t byte = str[i];
+
+        const auto it = std::lower_bound(begin, end, byte, [](const whisper_vocab::trie_edge & e, uint8_t b) { return e.byte < b; });
+        if (it == end || it->byte != byte) {
+            break;
+        }
+
+        node = it->node;
+        if (vocab.trie_nodes[node].token >= 0) {
+            id  = vocab.trie_nodes[node].token;
+            len = i + 1;
+        }
+    }
+
+    return len;
+}
+
+// character classes of the GPT-2 pre-tokenizer, ASCII only (as std::regex in the "C" locale)
+static bool whisper_is_alpha(uint8_t c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static bool whisper_is_digit(uint8_t c) { return c >= '0' && c <= '9'; }
+static bool whisper_is_space(uint8_t c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static bool whisper_is_other(uint8_t c) { return !whisper_is_alpha(c) && !whisper_is_digit(c) && !whisper_is_space(c); }
+
+// length of the word at the start of str[0, n), n > 0
+// same split as the regex 's|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+
+static int whisper_pretokenize(const char * str, int n) {
+    if (str[0] == '\'') {
+        for (const char * c : { "s", "t", "re", "ve", "m", "ll", "d" }) {
+            const int len = strlen(c);
+            if (len < n && strncmp(str + 1, c, len) == 0) {
+                return len + 1;
+            }
+        }
+    }
+
+    for (const auto is_class : { whisper_is_alpha, whisper_is_digit, whisper_is_other }) {
+        int i = (str[0] == ' ' && n > 1 && is_class(str[1])) ? 1 : 0;
+        if (!is_class(str[i])) {
+            continue;
+        }
+        while (i < n && is_class(str[i])) {
+            ++i;
+        }
+        return i;
+    }
+
+    // whitespace: leave the last one for the next word, unless the run ends the text or is a single character
+    int i = 0;
+    while (i < n && whisper_is_space(str[i])) {
+        ++i;
+    }
+
+    return (i < n && i > 1) ? i - 1 : i;
+}
+
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<whisper_vocab::id> tokens;
+
+    const char * str = text.data();
+    const int    n   = text.size();
+
+    // split the text into words and find the longest tokens that form each word
+    for (int w = 0; w < n; ) {
+        const int n_word = whisper_pretokenize(str + w, n - w);
+
+        for (int i = w; i < w + n_word; ) {
+            whisper_vocab::id id = -1;
+            const int len = whisper_vocab_longest_token(vocab, str + i, w + n_word - i, id);
+            if (len > 0) {
+                tokens.push_back(id);
+                i += len;
+            } else {
+                WHISPER_LOG_ERROR("unknown token\n");
+                ++i;
+            }
+        }
+
+        w += n_word;
+    }
+
+    return tokens;
+}
+
+//
+// interface implementation
+//
+
+#ifdef WHISPER_USE_COREML
+// replace .bin with -encoder.mlmodelc
+static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    // match "-qx_x"
+    pos = path_bin.rfind('-');
+    if (pos != std::string::npos) {
+        auto sub = path_bin.substr(pos);
+        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
+            path_bin = path_bin.substr(0, pos);
+        }
+    }
+
+    path_bin += "-encoder.mlmodelc";
+
+    return path_bin;
+}
+#endif
+
+#if defined(WHISPER_USE_COREML) || defined(WHISPER_USE_OPENVINO)
+// path of the external encoder variant for n_ctx: -<n_ctx> before the extension
+static std::string whisper_external_path_ctx(const std::string & path, int n_ctx) {
+    const auto pos = path.rfind('.');
+    return path.substr(0, pos) + "-" + std::to_string(n_ctx) + (pos != std::string::npos ? path.substr(pos) : "");
+}
+#endif
+
+#ifdef WHISPER_USE_OPENVINO
+// replace .bin with-encoder-openvino.xml
+static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    path_bin += "-encoder-openvino.xml";
+
+    return path_bin;
+}
+
+static std::string whisper_openvino_get_path_cache(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    path_bin += "-encoder-openvino-cache";
+
+    return path_bin;
+}
+#endif
+
+// identifies the graphs measured by whisper_init_state(): the model shape, the parameters the graphs depend on
+// and the backends of the state with the buffer types of their compute buffers
+static std::string whisper_sched_key(const whisper_context & ctx, const whisper_state & state) {
+    const auto & hparams = ctx.model.hparams;
+    const auto & params  = ctx.params;
+
+    std::string key = format("%d-%d-%d-%d-%d-%d-%d-%d-%d-%d-%s-%s-%s|fa=%d kv=%s dtw=%d.%d share=%d fuse=%d qkv=%d ngl=%d extra=%d ext=%d",
+            hparams.n_vocab, hparams.n_mels, hparams.n_audio_ctx, hparams.n_audio_state, hparams.n_audio_head, hparams.n_audio_layer,
+            hparams.n_text_ctx, hparams.n_text_state, hparams.n_text_head, hparams.n_text_layer, ggml_type_name(ctx.wtype),
+            ggml_type_name(params.type_weights), params.tensor_types ? params.tensor_types : "",
+            params.flash_attn, ggml_type_name(params.type_kv), params.dtw_token_timestamps, (int) params.dtw_aheads_preset,
+            params.share_compute_buffers, params.fuse_cross, params.fuse_qkv, params.n_gpu_layers, params.use_extra_bufts,
+            whisper_encode_external(state));
+
+    const auto bufts = whisper_sched_bufts(state.backends, whisper_cpu_buft(params));
+    for (size_t i = 0; i < state.backends.size(); ++i) {
+        key += format("|%s:%s", ggml_backend_name(state.backends[i]), ggml_backend_buft_name(bufts[i]));
+    }
+
+    return key;
+}
+
+// the sizes of an earlier state with the same key, from the context or the file of params.sched_cache
+// the file has one line per key: <key> \t <sizes of conv> \t <encode> \t <cross> \t <decode>, comma-separated
+static bool whisper_sched_sizes_get(whisper_context & ctx, const std::string & key, std::vector<std::vector<size_t>> & sizes) {
+    std::lock_guard<std::mutex> lock(ctx.sched_sizes_mutex);
+
+    auto it = ctx.sched_sizes.find(key);
+    if (it != ctx.sched_sizes.end()) {
+        sizes = it->second;
+        return true;
+    }
+
+    if (ctx.sched_cache.empty()) {
+        return false;
+    }
+
+    std::ifstream fin(ctx.sched_cache);
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.compare(0, key.size() + 1, key + "\t") != 0) {
+            continue;
+        }
+
+        std::vector<std::vector<size_t>> res;
+        std::istringstream fields(line.substr(key.size() + 1));
+        std::string field;
+        while (std::getline(fields, field, '\t')) {
+            res.emplace_back();
+            std::istringstream values(field);
+            std::string value;
+            while (std::getline(values, value, ',')) {
+                res.back().push_back(std::strtoull(value.c_str(), nullptr, 10));
+            }
+        }
+        // a skipped phase has no sizes
+        res.resize(4);
+
+        WHISPER_LOG_INFO("%s: compute buffer sizes from '%s'\n", __func__, ctx.sched_cache.c_str());
+
+        ctx.sched_sizes[key] = res;
+        sizes = std::move(res);
+        return true;
+    }
+
+    return false;
+}
+
+static void whisper_sched_sizes_put(whisper_context & ctx, const std::string & key, const std::vector<std::vector<size_t>> & sizes) {
+    std::lock_guard<std::mutex> lock(ctx.sched_sizes_mutex);
+
+    ctx.sched_sizes[key] = sizes;
+
+    if (ctx.sched_cache.empty()) {
+        return;
+    }
+
+    std::vector<std::string> lines;
+    {
+        std::ifstream fin(ctx.sched_cache);
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (!line.empty() && line.compare(0, key.size() + 1, key + "\t") != 0) {
+                lines.push_back(line);
+            }
+        }
+    }
+
+    std::string line = key;
+    for (const auto & phase : sizes) {
+        line += "\t";
+        for (size_t i = 0; i < phase.size(); ++i) {
+            line += (i > 0 ? "," : "") + std::to_string(phase[i]);
+        }
+    }
+    lines.push_back(line);
+
+    std::ofstream fout(ctx.sched_cache);
+    for (const auto & l : lines) {
+        fout << l << "\n";
+    }
+    if (!fout) {
+        WHISPER_LOG_WARN("%s: failed to write the compute buffer cache '%s'\n", __func__, ctx.sched_cache.c_str());
+    }
+}
+
+struct whisper_state * whisper_init_state(whisper_context * ctx) {
+    whisper_state * state = new whisper_state;
+
+    // with several GPUs, the state goes to the one with the fewest states
+    whisper_context_params params = ctx->params;
+    for (auto & device : ctx->devices) {
+        if (!state->device || device->n_states < state->device->n_states) {
+            state->device = device.get();
+        }
+    }
+    if (state->device) {
+        state->device->n_states++;
+        params.gpu_device = state->device->gpu_device;
+        WHISPER_LOG_INFO("%s: state on %s (%d states)\n", __func__, ggml_backend_dev_name(state->device->dev), state->device->n_states.load());
+    }
+
+    state->backends = whisper_backend_init(params);
+    if (state->backends.empty()) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    if (ctx->dev_encoder) {
+        state->backend_encoder = ggml_backend_dev_init(ctx->dev_encoder, nullptr);
+        if (!state->backend_encoder) {
+            WHISPER_LOG_ERROR("%s: failed to initialize %s backend\n", __func__, ggml_backend_dev_name(ctx->dev_encoder));
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        // the scheduler expects the CPU backend last
+        state->backends.insert(state->backends.end() - 1, state->backend_encoder);
+    }
+
+    state->threadpool.poll     = std::min(100, std::max(0, ctx->params.cpu_poll));
+    state->threadpool.affinity = ctx->params.cpu_affinity;
+
+    if (ctx->params.threadpool) {
+        state->threadpool.tp       = ctx->params.threadpool;
+        state->threadpool.external = true;
+    }
+
+    // at this point, we don't know yet how many decoders will be used
+    // later during decoding, if more decoders are used, we will recreate the KV cache respectively
+    state->kv_self_n_dec = 1;
+    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->params.type_kv,
+                ctx->model.hparams.n_text_state,
+                ctx->model.hparams.n_text_layer,
+                GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
+        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
+        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
+    }
+
+    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->params.type_kv,
+                ctx->model.hparams.n_text_state,
+                ctx->model.hparams.n_text_layer,
+                GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
+        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for cross-attention cache\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
+        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
+    }
+
+    if (!whisper_kv_cache_init(state->kv_pad, whisper_encoder_backend(*state), ctx->itype,
+                ctx->model.hparams.n_audio_state,
+                1,
+                GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
+        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_pad.k) + ggml_nbytes(state->kv_pad.v);
+        WHISPER_LOG_INFO("%s: kv pad  size  = %7.2f MB\n", __func__, memory_size / 1e6);
+    }
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    if (ctx->params.dtw_token_timestamps) {
+        if (!aheads_masks_init(ctx->params, ctx->model.hparams, state->aheads_masks, state->backends[0])) {
+            WHISPER_LOG_ERROR("%s: aheads_masks_init() failed for alignment heads masks\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+        const size_t memory_size = aheads_masks_nbytes(state->aheads_masks);
+        WHISPER_LOG_INFO("%s: alignment heads masks size = %ld B\n", __func__, memory_size);
+    }
+
+#ifdef WHISPER_USE_COREML
+    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+
+    WHISPER_LOG_INFO("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
+    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+
+    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
+    if (!state->ctx_coreml) {
+        WHISPER_LOG_ERROR("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
+#ifndef WHISPER_COREML_ALLOW_FALLBACK
+        whisper_free_state(state);
+        return nullptr;
+#endif
+    } else {
+        WHISPER_LOG_INFO("%s: Core ML model loaded\n", __func__);
+
+        // variants for short audio, in the steps of whisper_audio_ctx_bucket()
+        for (int n_ctx = 256; n_ctx < ctx->model.hparams.n_audio_ctx; n_ctx += 256) {
+            const auto path_short = whisper_external_path_ctx(path_coreml, n_ctx);
+            if (!std::ifstream(path_short + "/coremldata.bin")) {
+                continue;
+            }
+            whisper_coreml_context * ctx_short = whisper_coreml_init(path_short.c_str());
+            if (!ctx_short) {
+                WHISPER_LOG_WARN("%s: failed to load Core ML model from '%s'\n", __func__, path_short.c_str());
+                continue;
+            }
+            state->ctx_coreml_short.push_back(ctx_short);
+            state->n_ctx_external.push_back(n_ctx);
+            WHISPER_LOG_INFO("%s: Core ML model for audio_ctx = %d loaded\n", __func__, n_ctx);
+        }
+    }
+#endif
+
+    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+
+    state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
+
+    // TAGS: WHISPER_DECODER_INIT
+    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+
+    state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
+    state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
+    state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
+    state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
+
+    state->decoders[0].rng = std::mt19937(0);
+
+    // the phases of a state never run at the same time, so they can share their compute buffers
+    // the conv and encoder results then go to a small buffer of their own
+    ggml_backend_sched_t sched_shared = nullptr;
+
+    // the compute buffer sizes of conv, encode, cross and decode are measured by the first state of a kind only
+    const std::string sched_key = whisper_sched_key(*ctx, *state);
+
+    std::vector<std::vector<size_t>> sched_sizes(4);
+    const bool sched_sizes_cached = whisper_sched_sizes_get(*ctx, sched_key, sched_sizes);
+
+    if (ctx->params.share_compute_buffers) {
+        if (!whisper_kv_cache_init(state->embd_io, whisper_encoder_backend(*state), GGML_TYPE_F32,
+                    ctx->model.hparams.n_audio_state,
+                    1,
+                    ctx->model.hparams.n_audio_ctx)) {
+            WHISPER_LOG_ERROR("%s: failed to allocate the encoder results buffer\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+    }
+
+    // conv allocator
+    {
+        bool ok = whisper_sched_graph_init(state->sched_conv, "conv", state->backends, whisper_cpu_buft(ctx->params),
+                [&]() {
+                    return whisper_build_graph_conv(*ctx, *state);
+                }, nullptr, &sched_sizes[0]);
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init conv allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_sched_size(state->sched_conv) / 1e6);
+
+        if (ctx->params.share_compute_buffers) {
+            sched_shared = state->sched_conv.sched;
+        }
+    }
+
+    // encoder allocator
+    if (!whisper_encode_external(*state)) {
+        bool ok = whisper_sched_graph_init(state->sched_encode, "encode", state->backends, whisper_cpu_buft(ctx->params),
+                [&]() {
+                    return whisper_build_graph_encoder(*ctx, *state);
+                }, sched_shared, &sched_sizes[1]);
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init encoder allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_encode) / 1e6);
+    }
+
+    // cross allocator
+    if (!whisper_fuse_cross(*ctx, *state)) {
+        bool ok = whisper_sched_graph_init(state->sched_cross, "cross", state->backends, whisper_cpu_buft(ctx->params),
+                [&]() {
+                    return whisper_build_graph_cross(*ctx, *state);
+                }, sched_shared, &sched_sizes[2]);
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init cross allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_sched_size(state->sched_cross) / 1e6);
+    }
+
+    // decoder allocator
+    {
+        bool ok = whisper_sched_graph_init(state->sched_decode, "decode", state->backends, whisper_cpu_buft(ctx->params),
+                [&]() {
+                    const auto & hparams = ctx->model.hparams;
+
+                    // TODO: make sure this is the worst-case scenario
+                    const int n_tokens = hparams.n_text_ctx;
+                    const int n_past   = 0;
+
+                    whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
+
+                    return whisper_build_graph_decoder(*ctx, *state, state->batch, ctx->params.dtw_token_timestamps, true);
+                }, sched_shared, &sched_sizes[3]);
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init decoder allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_decode) / 1e6);
+    }
+
+    if (!sched_sizes_cached) {
+        whisper_sched_sizes_put(*ctx, sched_key, sched_sizes);
+    }
+
+    if (ctx->params.cb_eval) {
+        for (auto * allocr : { &state->sched_conv, &state->sched_encode, &state->sched_cross, &state->sched_decode }) {
+            if (allocr->sched) {
+                ggml_backend_sched_set_eval_callback(allocr->sched, ctx->params.cb_eval, ctx->params.cb_eval_user_data);
+            }
+        }
+    }
+
+    if (sched_shared) {
+        WHISPER_LOG_INFO("%s: compute buffers shared by all graphs = %7.2f MB (peaks: conv %.2f, encode %.2f, cross %.2f, decode %.2f MB)\n", __func__,
+                whisper_sched_size(state->sched_conv) / 1e6,
+                state->sched_conv.peak / 1e6, state->sched_encode.peak / 1e6, state->sched_cross.peak / 1e6, state->sched_decode.peak / 1e6);
+    }
+
+    return state;
+}
+
+size_t whisper_state_memory_size(struct whisper_state * state) {
+    size_t size = 0;
+
+    for (const auto * cache : { &state->kv_self, &state->kv_cross, &state->kv_pad, &state->embd_io }) {
+        if (cache->buffer) {
+            size += ggml_backend_buffer_get_size(cache->buffer);
+        }
+    }
+
+    // with share_compute_buffers, several graphs use the scheduler of the conv graph
+    std::vector<ggml_backend_sched_t> seen;
+    for (auto * allocr : { &state->sched_conv, &state->sched_encode, &state->sched_cross, &state->sched_decode, &state->sched_batch, &state->sched_decode_batch }) {
+        if (!allocr->sched || std::find(seen.begin(), seen.end(), allocr->sched) != seen.end()) {
+            continue;
+        }
+        seen.push_back(allocr->sched);
+        size += whisper_sched_size(*allocr);
+    }
+
+    return size;
+}
+
+struct whisper_memory_usage whisper_get_memory_usage(struct whisper_context * ctx, struct whisper_state * state) {
+    whisper_memory_usage usage = {};
+
+    std::vector<ggml_backend_buffer_t> weights = ctx->model.buffers;
+    for (const auto & device : ctx->devices) {
+        if (device->model) {
+            weights.insert(weights.end(), device->model->buffers.begin(), device->model->buffers.end());
+        }
+    }
+    for (ggml_backend_buffer_t buf : weights) {
+        usage.weights += ggml_backend_buffer_get_size(buf);
+        if (!ggml_backend_buffer_is_host(buf)) {
+            usage.weights_device += ggml_backend_buffer_get_size(buf);
+        }
+    }
+
+    if (state == nullptr) {
+        state = ctx->state;
+    }
+    if (state == nullptr) {
+        return usage;
+    }
+
+    const auto buffer_size = [&](ggml_backend_buffer_t buf) -> size_t {
+        if (!buf) {
+            return 0;
+        }
+        const size_t size = ggml_backend_buffer_get_size(buf);
+        usage.state += size;
+        if (!ggml_backend_buffer_is_host(buf)) {
+            usage.state_device += size;
+        }
+        return size;
+    };
+
+    usage.kv_self      = buffer_size(state->kv_self.buffer);
+    usage.kv_cross     = buffer_size(state->kv_cross.buffer);
+    usage.kv_pad       = buffer_size(state->kv_pad.buffer);
+    usage.embd_io      = buffer_size(state->embd_io.buffer);
+    usage.aheads_masks = buffer_size(state->aheads_masks.buffer);
+
+    // as whisper_state_memory_size(), a scheduler shared by several graphs is counted once
+    std::vector<ggml_backend_sched_t> seen;
+    const auto sched_size = [&](whisper_sched & allocr) -> size_t {
+        if (!allocr.sched || std::find(seen.begin(), seen.end(), allocr.sched) != seen.end()) {
+            return 0;
+        }
+        seen.push_back(allocr.sched);
+
+        size_t size = allocr.meta.size();
+        for (int i = 0; i < ggml_backend_sched_get_n_backends(allocr.sched); ++i) {
+            ggml_backend_t backend = ggml_backend_sched_get_backend(allocr.sched, i);
+            const size_t size_backend = ggml_backend_sched_get_buffer_size(allocr.sched, backend);
+            if (ggml_backend_dev_type(ggml_backend_get_device(backend)) != GGML_BACKEND_DEVICE_TYPE_CPU) {
+                usage.state_device += size_backend;
+            }
+            size += size_backend;
+        }
+        usage.state += size;
+        return size;
+    };
+
+    usage.compute_conv   = sched_size(state->sched_conv);
+    usage.compute_encode = sched_size(state->sched_encode);
+    usage.compute_cross  = sched_size(state->sched_cross);
+    usage.compute_decode = sched_size(state->sched_decode);
+    usage.compute_batch  = sched_size(state->sched_batch) + sched_size(state->sched_decode_batch);
+
+    return usage;
+}
+
+int whisper_ctx_init_openvino_encoder_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+#ifndef WHISPER_USE_OPENVINO
+    (void)(ctx);
+    (void)(state);
+    (void)(model_path);
+    (void)(device);
+    (void)(cache_dir);
+
+    return 1;
+#else
+    if (!model_path && ctx->path_model.empty()) {
+        WHISPER_LOG_ERROR("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
+        return 1;
+    }
+
+    std::string path_encoder;
+    if (!model_path) {
+        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
+        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
+    } else {
+        path_encoder = model_path;
+    }
+
+    std::string path_cache;
+    if (!cache_dir) {
+        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
+        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
+    } else {
+        path_cache = cache_dir;
+    }
+
+    WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
+    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+
+    state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
+    if (!state->ctx_openvino) {
+        WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
+        return 1;
+    } else {
+        WHISPER_LOG_INFO("%s: OpenVINO model loaded\n", __func__);
+    }
+
+    for (auto * ctx_short : state->ctx_openvino_short) {
+        whisper_openvino_free(ctx_short);
+    }
+    state->ctx_openvino_short.clear();
+    state->n_ctx_external.clear();
+
+    // variants for short audio, in the steps of whisper_audio_ctx_bucket()
+    for (int n_ctx = 256; n_ctx < ctx->model.hparams.n_audio_ctx; n_ctx += 256) {
+        const auto path_short = whisper_external_path_ctx(path_encoder, n_ctx);
+        if (!std::ifstream(path_short)) {
+            continue;
+        }
+        whisper_openvino_context * ctx_short = whisper_openvino_init(path_short.c_str(), device, path_cache.c_str());
+        if (!ctx_short) {
+            WHISPER_LOG_WARN("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_short.c_str());
+            continue;
+        }
+        state->ctx_openvino_short.push_back(ctx_short);
+        state->n_ctx_external.push_back(n_ctx);
+        WHISPER_LOG_INFO("%s: OpenVINO model for audio_ctx = %d loaded\n", __func__, n_ctx);
+    }
+
+    return 0;
+#endif
+}
+
+int whisper_ctx_init_openvino_encoder(
+        struct whisper_context * ctx,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+    return whisper_ctx_init_openvino_encoder_with_state(ctx, ctx->state, model_path, device, cache_dir);
+}
+
+// LoRA adapters: a GGUF file with general.type = "adapter", general.architecture = "whisper", adapter.type = "lora",
+// an optional adapter.lora.alpha and, for each adapted weight, the tensors <weight name>.lora_a and .lora_b
+static bool whisper_adapter_lora_load(const whisper_context & ctx, const char * path_lora, whisper_adapter_lora & adapter) {
+    ggml_context * meta_init = nullptr;
+    gguf_context_ptr gguf { gguf_init_from_file(path_lora, { /*.no_alloc =*/ true, /*.ctx =*/ &meta_init }) };
+    ggml_context_ptr meta { meta_init };
+    if (!gguf) {
+        WHISPER_LOG_ERROR("%s: failed to read the GGUF metadata of '%s'\n", __func__, path_lora);
+        return false;
+    }
+
+    auto get_str = [&](const char * key) -> std::string {
+        const int64_t id = gguf_find_key(gguf.get(), key);
+        return id >= 0 && gguf_get_kv_type(gguf.get(), id) == GGUF_TYPE_STRING ? gguf_get_val_str(gguf.get(), id) : "";
+    };
+
+    if (get_str("general.type") != "adapter" || get_str("adapter.type") != "lora") {
+        WHISPER_LOG_ERROR("%s: '%s' is not a LoRA adapter\n", __func__, path_lora);
+        return false;
+    }
+    if (get_str("general.architecture") != WHISPER_GGUF_ARCH) {
+        WHISPER_LOG_ERROR("%s: '%s' is not an adapter of a whisper model\n", __func__, path_lora);
+        return false;
+    }
+
+    {
+        const int64_t id = gguf_find_key(gguf.get(), "adapter.lora.alpha");
+        adapter.alpha = id >= 0 && gguf_get_kv_type(gguf.get(), id) == GGUF_TYPE_FLOAT32 ? gguf_get_val_f32(gguf.get(), id) : 0.0f;
+    }
+
+    // bundle lora_a and lora_b into pairs
+    std::map<std::string, whisper_adapter_lora_weight> ab_map;
+    for (ggml_tensor * cur = ggml_get_first_tensor(meta.get()); cur; cur = ggml_get_next_tensor(meta.get(), cur)) {
+        const std::string name = cur->name;
+        const size_t n = name.size();
+        if (n > 7 && name.compare(n - 7, 7, ".lora_a") == 0) {
+            ab_map[name.substr(0, n - 7)].a = cur;
+        } else if (n > 7 && name.compare(n - 7, 7, ".lora_b") == 0) {
+            ab_map[name.substr(0, n - 7)].b = cur;
+        } else {
+            WHISPER_LOG_ERROR("%s: unexpected tensor '%s' in '%s'\n", __func__, name.c_str(), path_lora);
+            return false;
+        }
+    }
+
+    // the deltas go next to their weights; repacking CPU buffer types cannot hold them and use the plain one
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it != ctx_map.end()) {
+            return it->second;
+        }
+        ggml_init_params params = {
+            /*.mem_size   =*/ 2*ab_map.size()*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context * c = ggml_init(params);
+        adapter.ctxs.push_back(c);
+        return ctx_map[buft] = c;
+    };
+
+    for (const auto & it : ab_map) {
+        const std::string & name = it.first;
+        const whisper_adapter_lora_weight & w = it.second;
+
+        if (!w.a || !w.b) {
+            WHISPER_LOG_ERROR("%s: the LoRA pair of '%s' is missing one tensor\n", __func__, name.c_str());
+            return false;
+        }
+
+        const auto pos = ctx.model.tensors.find(name);
+        if (pos == ctx.model.tensors.end()) {
+            WHISPER_LOG_ERROR("%s: '%s' is not a tensor of the model (adapter of another model?)\n", __func__, name.c_str());
+            return false;
+        }
+        const ggml_tensor * t = pos->second;
+
+        if (t->ne[0] != w.a->ne[0] || t->ne[1] != w.b->ne[1] || w.a->ne[1] != w.b->ne[0]) {
+            WHISPER_LOG_ERROR("%s: the LoRA pair of '%s' has the wrong shape (adapter of another model?)\n", __func__, name.c_str());
+            return false;
+        }
+
+        ggml_backend_buffer_type_t buft = ggml_backend_buffer_get_type(t->buffer);
+        ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft);
+        if (!dev || ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU) {
+            buft = whisper_cpu_buft(ctx.params);
+        }
+
+        ggml_context * c = ctx_for_buft(buft);
+
+        whisper_adapter_lora_weight dw;
+        dw.a = ggml_dup_tensor(c, w.a);
+        dw.b = ggml_dup_tensor(c, w.b);
+        ggml_set_name(dw.a, w.a->name);
+        ggml_set_name(dw.b, w.b->name);
+        adapter.ab_map[name] = dw;
+    }
+
+    for (const auto & it : ctx_map) {
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first);
+        if (!buf) {
+            WHISPER_LOG_ERROR("%s: failed to allocate the %s buffer of the adapter\n", __func__, ggml_backend_buft_name(it.first));
+            return false;
+        }
+        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        adapter.bufs.push_back(buf);
+        WHISPER_LOG_INFO("%s: %10s LoRA buffer size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1e6);
+    }
+
+    std::ifstream fin(path_lora, std::ios::binary);
+    std::vector<uint8_t> read_buf;
+    auto set_tensor = [&](const ggml_tensor * orig, ggml_tensor * dst) {
+        const int64_t id = gguf_find_tensor(gguf.get(), orig->name);
+        const size_t offs = gguf_get_data_offset(gguf.get()) + gguf_get_tensor_offset(gguf.get(), id);
+        read_buf.resize(ggml_nbytes(orig));
+        fin.seekg(offs);
+        fin.read((char *) read_buf.data(), read_buf.size());
+        if (!fin) {
+            return false;
+        }
+        ggml_backend_tensor_set(dst, read_buf.data(), 0, read_buf.size());
+        return true;
+    };
+    for (auto & it : adapter.ab_map) {
+        const auto & orig = ab_map[it.first];
+        if (!set_tensor(orig.a, it.second.a) || !set_tensor(orig.b, it.second.b)) {
+            WHISPER_LOG_ERROR("%s: failed to read the tensors of '%s'\n", __func__, path_lora);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct whisper_adapter_lora * whisper_adapter_lora_init(struct whisper_context * ctx, const char * path_lora) {
+    const int64_t t_start_us = ggml_time_us();
+
+    WHISPER_LOG_INFO("%s: loading LoRA adapter from '%s'\n", __func__, path_lora);
+
+    auto * adapter = new whisper_adapter_lora;
+    adapter->ctx = ctx;
+
+    if (!whisper_adapter_lora_load(*ctx, path_lora, *adapter)) {
+        delete adapter;
+        return nullptr;
+    }
+
+    WHISPER_LOG_INFO("%s: %zu weights adapted, alpha = %.1f, loaded in %.2f ms\n", __func__,
+            adapter->ab_map.size(), adapter->alpha, (ggml_time_us() - t_start_us)/1000.0);
+
+    return adapter;
+}
+
+void whisper_adapter_lora_free(struct whisper_adapter_lora * adapter) {
+    delete adapter;
+}
+
+// new adapters make the kept decoder graph and the cached encoder output stale
+static void whisper_state_set_loras(whisper_state & state, const std::vector<std::pair<whisper_adapter_lora *, float>> & loras) {
+    if (state.loras == loras) {
+        return;
+    }
+
+    state.loras = loras;
+
+    if (state.graph_decode.gf) {
+        ggml_backend_sched_reset(state.sched_decode.sched);
+        state.graph_decode.gf = nullptr;
+    }
+    state.enc_valid = false;
+}
+
+int whisper_set_adapter_lora_with_state(struct whisper_context * ctx, struct whisper_state * state, struct whisper_adapter_lora * adapter, float scale) {
+    if (adapter == nullptr || adapter->ctx != ctx) {
+        WHISPER_LOG_ERROR("%s: the adapter was not loaded for this context\n", __func__);
+        return -1;
+    }
+
+    auto loras = state->loras;
+
+    auto it = std::find_if(loras.begin(), loras.end(), [&](const std::pair<whisper_adapter_lora *, float> & l) { return l.first == adapter; });
+    if (it != loras.end()) {
+        it->second = scale;
+    } else {
+        loras.emplace_back(adapter, scale);
+    }
+
+    whisper_state_set_loras(*state, loras);
+
+    return 0;
+}
+
+int whisper_set_adapter_lora(struct whisper_context * ctx, struct whisper_adapter_lora * adapter, float scale) {
+    return whisper_set_adapter_lora_with_state(ctx, ctx->state, adapter, scale);
+}
+
+int whisper_rm_adapter_lora_with_state(struct whisper_context * ctx, struct whisper_state * state, struct whisper_adapter_lora * adapter) {
+    GGML_UNUSED(ctx);
+
+    auto loras = state->loras;
+
+    auto it = std::find_if(loras.begin(), loras.end(), [&](const std::pair<whisper_adapter_lora *, float> & l) { return l.first == adapter; });
+    if (it == loras.end()) {
+        return -1;
+    }
+    loras.erase(it);
+
+    whisper_state_set_loras(*state, loras);
+
+    return 0;
+}
+
+int whisper_rm_adapter_lora(struct whisper_context * ctx, struct whisper_adapter_lora * adapter) {
+    return whisper_rm_adapter_lora_with_state(ctx, ctx->state, adapter);
+}
+
+void whisper_clear_adapter_lora_with_state(struct whisper_context * ctx, struct whisper_state * state) {
+    GGML_UNUSED(ctx);
+
+    whisper_state_set_loras(*state, {});
+}
+
+void whisper_clear_adapter_lora(struct whisper_context * ctx) {
+    whisper_clear_adapter_lora_with_state(ctx, ctx->state);
+}
+
+struct whisper_context_params whisper_context_default_params() {
+    struct whisper_context_params result = {
+        /*.use_gpu              =*/ true,
+        /*.flash_attn           =*/ true,
+        /*.gpu_device           =*/ 0,
+        /*.n_gpu_layers         =*/ -1,
+
+        /*.dtw_token_timestamps =*/ false,
+        /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
+        /*.dtw_n_top            =*/ -1,
+        /*.dtw_aheads           =*/ {
+            /*.n_heads          =*/ 0,
+            /*.heads            =*/ NULL,
+        },
+        /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.use_mmap             =*/ true,
+        /*.encoder_cache        =*/ false,
+        /*.type_kv              =*/ GGML_TYPE_F16,
+        /*.cpu_poll             =*/ 50,
+        /*.use_extra_bufts      =*/ true,
+        /*.cpu_affinity         =*/ true,
+        /*.threadpool           =*/ nullptr,
+        /*.cb_eval              =*/ nullptr,
+        /*.cb_eval_user_data    =*/ nullptr,
+        /*.share_compute_buffers=*/ false,
+        /*.fuse_cross           =*/ false,
+        /*.autotune_cache       =*/ nullptr,
+        /*.rpc_servers          =*/ nullptr,
+        /*.use_hugepages        =*/ false,
+        /*.numa_replicate       =*/ false,
+        /*.n_gpu_devices        =*/ 1,
+        /*.fuse_qkv             =*/ false,
+        /*.progressive_load     =*/ false,
+        /*.sched_cache          =*/ nullptr,
+        /*.type_weights         =*/ GGML_TYPE_COUNT,
+        /*.tensor_types         =*/ nullptr,
+    };
+    return result;
+}
+
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, const char * path_model);
+
+struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
+    WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+
+    if (params.use_mmap) {
+        std::unique_ptr<whisper_mmap> map = whisper_mmap::open(path_model);
+        if (map) {
+            whisper_mmap_reader reader;
+            reader.map = map.get();
+
+            whisper_model_loader loader = {};
+            loader.context = &reader;
+            loader.read    = whisper_mmap_reader::read;
+            loader.eof     = whisper_mmap_reader::is_eof;
+            loader.close   = whisper_mmap_reader::close;
+
+            auto ctx = whisper_init_with_params_no_state_impl(&loader, params, path_model);
+            if (ctx) {
+                ctx->model.mapping = std::move(map);
+            }
+            return ctx;
+        }
+        WHISPER_LOG_WARN("%s: failed to map '%s', reading it instead\n", __func__, path_model);
+    }
+#ifdef _MSC_VER
+    // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+    std::wstring path_model_wide = converter.from_bytes(path_model);
+    auto fin = std::ifstream(path_model_wide, std::ios::binary);
+#else
+    auto fin = std::ifstream(path_model, std::ios::binary);
+#endif
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = &fin;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->read((char *)output, read_size);
+        return read_size;
+    };
+
+    loader.eof = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        return fin->eof();
+    };
+
+    loader.close = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->close();
+    };
+
+    return whisper_init_with_params_no_state_impl(&loader, params, path_model);
+}
+
+struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    struct buf_context {
+        uint8_t* buffer;
+        size_t size;
+        size_t current_offset;
+    };
+
+    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+
+    WHISPER_LOG_INFO("%s: loading model from buffer\n", __func__);
+
+    whisper_model_loader loader = {};
+
+    loader.context = &ctx;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+
+        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
+        buf->current_offset += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        return buf->current_offset >= buf->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_with_params_no_state(&loader, params);
+}
+
+// path_model: the file behind the loader, if any (GGUF metadata is read from it)
+// copies the weights on the GPU of params.gpu_device to the next GPUs, up to params.n_gpu_devices in total;
+// the weights in host memory are shared by all of them
+static void whisper_model_replicate(whisper_context & wctx) {
+    const auto & params = wctx.params;
+
+    if (!params.use_gpu || params.n_gpu_devices == 1) {
+        return;
+    }
+
+    ggml_backend_dev_t dev_main = whisper_gpu_dev_get(params.gpu_device);
+    if (!dev_main) {
+        return;
+    }
+
+    const whisper_model & src = wctx.model;
+
+    whisper_model_wait(src);
+
+    std::vector<ggml_tensor *> weights;
+    for (const auto & it : src.tensors) {
+        if (it.second->buffer && ggml_backend_buft_get_device(ggml_backend_buffer_get_type(it.second->buffer)) == dev_main) {
+            weights.push_back(it.second);
+        }
+    }
+
+    if (weights.empty()) {
+        WHISPER_LOG_WARN("%s: no weights on %s, using a single GPU\n", __func__, ggml_backend_dev_name(dev_main));
+        return;
+    }
+
+    const int n_devices = params.n_gpu_devices > 0 ? params.n_gpu_devices : INT_MAX;
+
+    wctx.devices.emplace_back(new whisper_model_device);
+    wctx.devices.back()->gpu_device = params.gpu_device;
+    wctx.devices.back()->dev        = dev_main;
+
+    for (int i = params.gpu_device + 1; (int) wctx.devices.size() < n_devices; ++i) {
+        ggml_backend_dev_t dev = whisper_gpu_dev_get(i);
+        if (!dev) {
+            break;
+        }
+
+        ggml_init_params iparams = {
+            /*.mem_size   =*/ weights.size()*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+
+        ggml_context * ctx = ggml_init(iparams);
+
+        std::map<const ggml_tensor *, ggml_tensor *> copies;
+        for (ggml_tensor * w : weights) {
+            ggml_tensor * copy = ggml_dup_tensor(ctx, w);
+            ggml_set_name(copy, w->name);
+            copies[w] = copy;
+        }
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, ggml_backend_dev_buffer_type(dev));
+        if (!buf) {
+            WHISPER_LOG_WARN("%s: failed to allocate the weights on %s\n", __func__, ggml_backend_dev_name(dev));
+            ggml_free(ctx);
+            break;
+        }
+        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+
+        for (const auto & it : copies) {
+            ggml_backend_tensor_copy(const_cast<ggml_tensor *>(it.first), it.second);
+        }
+
+        auto get = [&](ggml_tensor * t) {
+            const auto it = copies.find(t);
+            return it == copies.end() ? t : it->second;
+        };
+
+        std::unique_ptr<whisper_model> model(new whisper_model);
+
+        model->type    = src.type;
+        model->hparams = src.hparams;
+        model->filters = src.filters;
+
+        model->e_pe       = get(src.e_pe);
+        model->e_conv_1_w = get(src.e_conv_1_w);
+        model->e_conv_1_b = get(src.e_conv_1_b);
+        model->e_conv_2_w = get(src.e_conv_2_w);
+        model->e_conv_2_b = get(src.e_conv_2_b);
+        model->e_ln_w     = get(src.e_ln_w);
+        model->e_ln_b     = get(src.e_ln_b);
+        model->d_pe       = get(src.d_pe);
+        model->d_te       = get(src.d_te);
+        model->d_ln_w     = get(src.d_ln_w);
+        model->d_ln_b     = get(src.d_ln_b);
+
+        for (const auto & l : src.layers_encoder) {
+            whisper_layer_encoder layer;
+
+            layer.attn_ln_0_w = get(l.attn_ln_0_w);
+            layer.attn_ln_0_b = get(l.attn_ln_0_b);
+            layer.attn_ln_1_w = get(l.attn_ln_1_w);
+            layer.attn_ln_1_b = get(l.attn_ln_1_b);
+            layer.attn_q_w    = get(l.attn_q_w);
+            layer.attn_q_b    = get(l.attn_q_b);
+            layer.attn_k_w    = get(l.attn_k_w);
+            layer.attn_v_w    = get(l.attn_v_w);
+            layer.attn_v_b    = get(l.attn_v_b);
+            layer.mlp_ln_w    = get(l.mlp_ln_w);
+            layer.mlp_ln_b    = get(l.mlp_ln_b);
+            layer.mlp_0_w     = get(l.mlp_0_w);
+            layer.mlp_0_b     = get(l.mlp_0_b);
+            layer.mlp_1_w     = get(l.mlp_1_w);
+            layer.mlp_1_b     = get(l.mlp_1_b);
+
+            model->layers_encoder.push_back(layer);
+        }
+
+        for (const auto & l : src.layers_decoder) {
+            whisper_layer_decoder layer;
+
+            layer.attn_ln_0_w       = get(l.attn_ln_0_w);
+            layer.attn_ln_0_b       = get(l.attn_ln_0_b);
+            layer.attn_ln_1_w       = get(l.attn_ln_1_w);
+            layer.attn_ln_1_b       = get(l.attn_ln_1_b);
+            layer.attn_q_w          = get(l.attn_q_w);
+            layer.attn_q_b          = get(l.attn_q_b);
+            layer.attn_k_w          = get(l.attn_k_w);
+            layer.attn_v_w          = get(l.attn_v_w);
+            layer.attn_v_b          = get(l.attn_v_b);
+            layer.cross_attn_ln_0_w = get(l.cross_attn_ln_0_w);
+            layer.cross_attn_ln_0_b = get(l.cross_attn_ln_0_b);
+            layer.cross_attn_ln_1_w = get(l.cross_attn_ln_1_w);
+            layer.cross_attn_ln_1_b = get(l.cross_attn_ln_1_b);
+            layer.cross_attn_q_w    = get(l.cross_attn_q_w);
+            layer.cross_attn_q_b    = get(l.cross_attn_q_b);
+            layer.cross_attn_k_w    = get(l.cross_attn_k_w);
+            layer.cross_attn_v_w    = get(l.cross_attn_v_w);
+            layer.cross_attn_v_b    = get(l.cross_attn_v_b);
+            layer.mlp_ln_w          = get(l.mlp_ln_w);
+            layer.mlp_ln_b          = get(l.mlp_ln_b);
+            layer.mlp_0_w           = get(l.mlp_0_w);
+            layer.mlp_0_b           = get(l.mlp_0_b);
+            layer.mlp_1_w           = get(l.mlp_1_w);
+            layer.mlp_1_b           = get(l.mlp_1_b);
+
+            model->layers_decoder.push_back(layer);
+        }
+
+        for (const auto & it : src.tensors) {
+            model->tensors[it.first] = get(it.second);
+        }
+        model->n_loaded = src.n_loaded;
+
+        model->ctxs.push_back(ctx);
+        model->buffers.push_back(buf);
+
+        WHISPER_LOG_INFO("%s: %s: %zu weights, %8.2f MB\n", __func__, ggml_backend_dev_name(dev), weights.size(), ggml_backend_buffer_get_size(buf)/1e6);
+
+        wctx.devices.emplace_back(new whisper_model_device);
+        wctx.devices.back()->gpu_device = i;
+        wctx.devices.back()->dev        = dev;
+        wctx.devices.back()->model      = std::move(model);
+    }
+
+    if (wctx.devices.size() < 2) {
+        WHISPER_LOG_WARN("%s: no other GPU for the weights, using a single GPU\n", __func__);
+        wctx.devices.clear();
+    }
+}
+
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, const char * path_model) {
+    ggml_time_init();
+
+    // flash attention is on by default; on a GPU without it the attention would run on the CPU instead
+    if (params.flash_attn && params.use_gpu) {
+        if (ggml_backend_dev_t dev = whisper_gpu_dev_get(params.gpu_device)) {
+            if (params.type_kv != GGML_TYPE_F16 && !whisper_gpu_dev_supports_fattn(dev, params.type_kv) && whisper_gpu_dev_supports_fattn(dev, GGML_TYPE_F16)) {
+                WHISPER_LOG_WARN("%s: %s has no flash attention with a %s KV cache - using f16\n", __func__, ggml_backend_dev_name(dev), ggml_type_name(params.type_kv));
+                params.type_kv = GGML_TYPE_F16;
+            }
+            if (!whisper_gpu_dev_supports_fattn(dev, params.type_kv)) {
+                WHISPER_LOG_WARN("%s: %s has no flash attention - disabling flash_attn\n", __func__, ggml_backend_dev_name(dev));
+                params.flash_attn = false;
+            }
+        }
+    }
+
+    if (params.flash_attn && params.dtw_token_timestamps) {
+        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
+        params.dtw_token_timestamps = false;
+    }
+
+    if (params.type_kv != GGML_TYPE_F16 && params.type_kv != GGML_TYPE_F32 && params.type_kv != GGML_TYPE_BF16) {
+        if (params.type_kv != GGML_TYPE_Q8_0 && params.type_kv != GGML_TYPE_Q4_0) {
+            WHISPER_LOG_WARN("%s: unsupported KV cache type %s - using f16\n", __func__, ggml_type_name(params.type_kv));
+            params.type_kv = GGML_TYPE_F16;
+        } else if (!params.flash_attn) {
+            WHISPER_LOG_WARN("%s: a %s KV cache requires flash_attn - using f16\n", __func__, ggml_type_name(params.type_kv));
+            params.type_kv = GGML_TYPE_F16;
+        }
+    }
+
+    if (params.type_weights != GGML_TYPE_COUNT && !whisper_weight_type_supported(params.type_weights)) {
+        WHISPER_LOG_WARN("%s: weights cannot be converted to %s while loading - keeping the types of the file\n", __func__, ggml_type_name(params.type_weights));
+        params.type_weights = GGML_TYPE_COUNT;
+    }
+
+    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
+    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
+    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
+    if (params.n_gpu_devices != 1) {
+        WHISPER_LOG_INFO("%s: gpu devs   = %d\n", __func__, params.n_gpu_devices);
+    }
+    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: kv type    = %s\n", __func__, ggml_type_name(params.type_kv));
+    if (params.type_weights != GGML_TYPE_COUNT) {
+        WHISPER_LOG_INFO("%s: wtype load = %s\n", __func__, ggml_type_name(params.type_weights));
+    }
+    if (params.threadpool) {
+        WHISPER_LOG_INFO("%s: threadpool = external\n", __func__);
+    }
+    WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
+    WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
+
+    whisper_context * ctx = new whisper_context;
+    ctx->params = params;
+
+    if (path_model) {
+        ctx->path_model = path_model;
+    }
+
+    if (params.sched_cache) {
+        ctx->sched_cache = params.sched_cache;
+    }
+
+    if (params.rpc_servers && params.rpc_servers[0] != '\0') {
+        ctx->dev_encoder = whisper_rpc_device_init(params);
+        if (!ctx->dev_encoder) {
+            loader->close(loader->context);
+            delete ctx;
+            return nullptr;
+        }
+    }
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    whisper_model_replicate(*ctx);
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr);
+}
+
+struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+    return whisper_init_from_buffer_with_params(buffer, buffer_size, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+    return whisper_init_with_params(loader, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
+    return whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    return whisper_init_with_params_no_state(loader, whisper_context_default_params());
+}
+
+void whisper_state_reset(struct whisper_state * state) {
+    if (!state) {
+        return;
+    }
+
+    // the KV cells are invalidated, their buffers are kept
+    // kv_cross stays valid for its input hash (encoder_cache)
+    whisper_kv_cache_clear(state->kv_self);
+
+    state->kv_prompt.clear();
+    state->kv_prompt_logits.clear();
+    state->kv_prompt_no_speech_prob = 0.0f;
+
+    state->mel_stream.reset();
+    state->mel_end = INT_MAX;
+
+    for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+        whisper_sequence_clear(state->decoders[j].sequence);
+        // the sampling at t > 0.0 must start from the same seeds as a new state
+        state->decoders[j].rng = std::mt19937(j);
+    }
+
+    state->result_all.clear();
+    state->seek = 0;
+    state->prompt_past0.clear();
+    state->prompt_past1.clear();
+    state->lang_id   = 0;
+    state->lang_prob = 0.0f;
+
+    state->t_beg    = 0;
+    state->t_last   = 0;
+    state->tid_last = 0;
+    state->energy.clear();
+    state->no_speech_prob = 0.0f;
+
+    state->vad_segments.clear();
+    state->vad_mapping_table.clear();
+    state->has_vad_segments = false;
+
+    state->draft_past.clear();
+    state->draft_tokens.clear();
+    whisper_state_reset(state->draft_state);
+    whisper_state_reset(state->ahead_state);
+
+    whisper_reset_metrics_from_state(state);
+}
+
+void whisper_state_set_threadpool(struct whisper_state * state, ggml_threadpool_t threadpool) {
+    if (!state || (threadpool && state->threadpool.tp == threadpool)) {
+        return;
+    }
+
+    // point the CPU backends away from the current pool (they pause it) before it is freed or handed back
+    for (ggml_backend_t backend : state->backends) {
+        auto * reg    = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend));
+        auto * fn_set = (ggml_backend_cpu_set_threadpool_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_set_threadpool");
+        if (fn_set) {
+            fn_set(backend, threadpool);
+        }
+    }
+
+    whisper_threadpool_free(state->threadpool);
+
+    state->threadpool.tp        = threadpool;
+    state->threadpool.n_threads = 0;
+    state->threadpool.external  = threadpool != nullptr;
+}
+
+void whisper_cpu_sched_set_threads(int n_threads) {
+    auto & sched = whisper_cpu_sched_instance();
+    std::lock_guard<std::mutex> lock(sched.mutex);
+
+    sched.n_threads = std::max(0, n_threads);
+}
+
+struct whisper_cpu_sched_stats whisper_cpu_sched_get_stats(void) {
+    auto & sched = whisper_cpu_sched_instance();
+    std::lock_guard<std::mutex> lock(sched.mutex);
+
+    const int64_t t_now_us = ggml_time_us();
+
+    struct whisper_cpu_sched_stats stats = {};
+
+    stats.n_threads        = sched.n_threads;
+    stats.n_busy           = sched.n_busy;
+    stats.n_busy_max       = sched.n_busy_max;
+    stats.n_graphs         = sched.n_graphs;
+    stats.n_graphs_clamped = sched.n_graphs_clamped;
+    stats.t_busy_s         = 1e-6*sched.t_busy_us;
+    stats.t_wall_s         = sched.t_first_us > 0 ? 1e-6*(t_now_us - sched.t_first_us) : 0.0;
+
+    for (const auto & it : sched.users) {
+        if (it.second.n_active > 0 || it.second.t_last_us >= t_now_us - 1000000) {
+            stats.n_states++;
+        }
+    }
+
+    return stats;
+}
+
+// snapshot of the resumable part of a state, see whisper_state_get_data()
+// the layout is native-endian and only meant to be read back by the same build on the same kind of host
+
+static const uint32_t WHISPER_STATE_MAGIC   = 0x77737374; // "wsst"
+static const uint32_t WHISPER_STATE_VERSION = 1;
+
+// with dst == nullptr, only counts the bytes
+struct whisper_state_writer {
+    uint8_t * dst  = nullptr;
+    size_t    size = 0;
+    size_t    n    = 0;
+
+    void write_raw(const void * src, size_t nbytes) {
+        if (dst && n + nbytes <= size) {
+            memcpy(dst + n, src, nbytes);
+        }
+        n += nbytes;
+    }
+
+    template <typename T>
+    void write(const T & v) {
+        write_raw(&v, sizeof(v));
+    }
+
+    template <typename T>
+    void write_vec(const std::vector<T> & v) {
+        write((uint32_t) v.size());
+        write_raw(v.data(), v.size()*sizeof(T));
+    }
+
+    void write_str(const std::string & s) {
+        write((uint32_t) s.size());
+        write_raw(s.data(), s.size());
+    }
+
+    void write_tensor(const ggml_tensor * t) {
+        const uint64_t nbytes = ggml_nbytes(t);
+        write(nbytes);
+        if (dst && n + nbytes <= size) {
+            ggml_backend_tensor_get(t, dst + n, 0, nbytes);
+        }
+        n += nbytes;
+    }
+};
+
+struct whisper_state_reader {
+    const uint8_t * src  = nullptr;
+    size_t          size = 0;
+    size_t          n    = 0;
+
+    bool read_raw(void * dst, size_t nbytes) {
+        if (nbytes > size - n) {
+            return false;
+        }
+        memcpy(dst, src + n, nbytes);
+        n += nbytes;
+        return true;
+    }
+
+    template <typename T>
+    bool read(T & v) {
+        return read_raw(&v, sizeof(v));
+    }
+
+    template <typename T>
+    bool read_vec(std::vector<T> & v) {
+        uint32_t k = 0;
+        if (!read(k) || (size_t) k*sizeof(T) > size - n) {
+            return false;
+        }
+        v.resize(k);
+        return read_raw(v.data(), k*sizeof(T));
+    }
+
+    bool read_str(std::string & s) {
+        uint32_t k = 0;
+        if (!read(k) || k > size - n) {
+            return false;
+        }
+        s.assign((const char *) src + n, k);
+        n += k;
+        return true;
+    }
+
+    bool read_tensor(ggml_tensor * t) {
+        uint64_t nbytes = 0;
+        if (!read(nbytes) || nbytes != ggml_nbytes(t) || nbytes > size - n) {
+            return false;
+        }
+        ggml_backend_tensor_set(t, src + n, 0, nbytes);
+        n += nbytes;
+        return true;
+    }
+};
+
+static void whisper_state_write(const whisper_context & ctx, const whisper_state & state, whisper_state_writer & w, bool include_kv) {
+    const auto & hparams = ctx.model.hparams;
+
+    w.write(WHISPER_STATE_MAGIC);
+    w.write(WHISPER_STATE_VERSION);
+
+    // the model the snapshot belongs to
+    w.write((int32_t) hparams.n_vocab);
+    w.write((int32_t) hparams.n_audio_ctx);
+    w.write((int32_t) hparams.n_audio_state);
+    w.write((int32_t) hparams.n_text_layer);
+
+    w.write(state.seek);
+    w.write((int32_t) state.lang_id);
+    w.write(state.t_beg);
+    w.write(state.t_last);
+    w.write(state.tid_last);
+
+    w.write_vec(state.prompt_past0);
+    w.write_vec(state.prompt_past1);
+
+    // a resumed job samples the fallback windows with the same random numbers
+    for (const auto & decoder : state.decoders) {
+        std::ostringstream rng;
+        rng << decoder.rng;
+        w.write_str(rng.str());
+    }
+
+    w.write((uint32_t) state.result_all.size());
+    for (const auto & segment : state.result_all) {
+        w.write(segment.t0);
+        w.write(segment.t1);
+        w.write_str(segment.text);
+        w.write(segment.no_speech_prob);
+        w.write_vec(segment.tokens);
+        w.write((uint8_t) segment.speaker_turn_next);
+        w.write(segment.n_fail_p);
+        w.write(segment.n_fail_h);
+    }
+
+    w.write((uint8_t) state.has_vad_segments);
+    w.write_vec(state.vad_segments);
+    w.write_vec(state.vad_mapping_table);
+
+    // the encoder output of the window the job stopped in, valid for enc_key
+    const bool has_kv = include_kv && state.enc_valid;
+
+    w.write((uint8_t) has_kv);
+    if (has_kv) {
+        w.write(state.enc_key);
+        w.write_tensor(state.kv_cross.k);
+        w.write_tensor(state.kv_cross.v);
+    }
+}
+
+static bool whisper_state_read(const whisper_context & ctx, whisper_state & state, whisper_state_reader & r) {
+    const auto & hparams = ctx.model.hparams;
+
+    uint32_t magic   = 0;
+    uint32_t version = 0;
+    if (!r.read(magic) || magic != WHISPER_STATE_MAGIC) {
+        WHISPER_LOG_ERROR("%s: not a whisper state snapshot\n", __func__);
+        return false;
+    }
+    if (!r.read(version) || version != WHISPER_STATE_VERSION) {
+        WHISPER_LOG_ERROR("%s: unsupported snapshot version %u (expected %u)\n", __func__, version, WHISPER_STATE_VERSION);
+        return false;
+    }
+
+    int32_t n_vocab       = 0;
+    int32_t n_audio_ctx   = 0;
+    int32_t n_audio_state = 0;
+    int32_t n_text_layer  = 0;
+    if (!r.read(n_vocab) || !r.read(n_audio_ctx) || !r.read(n_audio_state) || !r.read(n_text_layer)) {
+        return false;
+    }
+    if (n_vocab != hparams.n_vocab || n_audio_ctx != hparams.n_audio_ctx ||
+        n_audio_state != hparams.n_audio_state || n_text_layer != hparams.n_text_layer) {
+        WHISPER_LOG_ERROR("%s: the snapshot was taken with a different model\n", __func__);
+        return false;
+    }
+
+    // read everything but the KV before touching the state
+    int32_t       seek     = 0;
+    int32_t       lang_id  = 0;
+    int64_t       t_beg    = 0;
+    int64_t       t_last   = 0;
+    whisper_token tid_last = 0;
+
+    std::vector<whisper_token> prompt_past0;
+    std::vector<whisper_token> prompt_past1;
+
+    if (!r.read(seek) || !r.read(lang_id) || !r.read(t_beg) || !r.read(t_last) || !r.read(tid_last) ||
+        !r.read_vec(prompt_past0) || !r.read_vec(prompt_past1)) {
+        return false;
+    }
+
+    std::string rng[WHISPER_MAX_DECODERS];
+    for (auto & s : rng) {
+        if (!r.read_str(s)) {
+            return false;
+        }
+    }
+
+    uint32_t n_segments = 0;
+    if (!r.read(n_segments)) {
+        return false;
+    }
+
+    std::vector<whisper_segment> result_all;
+    for (uint32_t i = 0; i < n_segments; ++i) {
+        whisper_segment segment = {};
+
+        uint8_t speaker_turn_next = 0;
+        if (!r.read(segment.t0) || !r.read(segment.t1) || !r.read_str(segment.text) || !r.read(segment.no_speech_prob) ||
+            !r.read_vec(segment.tokens) || !r.read(speaker_turn_next) || !r.read(segment.n_fail_p) || !r.read(segment.n_fail_h)) {
+            return false;
+        }
+        segment.speaker_turn_next = speaker_turn_next != 0;
+
+        result_all.push_back(std::move(segment));
+    }
+
+    uint8_t has_vad_segments = 0;
+
+    std::vector<whisper_state::vad_segment_info> vad_segments;
+    std::vector<vad_time_mapping>                vad_mapping_table;
+
+    if (!r.read(has_vad_segments) || !r.read_vec(vad_segments) || !r.read_vec(vad_mapping_table)) {
+        return false;
+    }
+
+    uint8_t has_kv = 0;
+    if (!r.read(has_kv)) {
+        return false;
+    }
+
+    // the ids index the vocabulary and the language table later on, a corrupt snapshot must not get that far
+    {
+        const auto valid_token = [&](whisper_token id) { return id >= 0 && id < hparams.n_vocab; };
+
+        bool valid = seek >= 0 && lang_id >= 0 && lang_id <= whisper_lang_max_id() && valid_token(tid_last);
+        for (const auto id : prompt_past0) {
+            valid = valid && valid_token(id);
+        }
+        for (const auto id : prompt_past1) {
+            valid = valid && valid_token(id);
+        }
+        for (const auto & segment : result_all) {
+            for (const auto & token : segment.tokens) {
+                valid = valid && valid_token(token.id) && valid_token(token.tid);
+            }
+        }
+
+        if (!valid) {
+            WHISPER_LOG_ERROR("%s: the snapshot holds an out-of-range language or token id\n", __func__);
+            return false;
+        }
+    }
+
+    whisper_state_reset(&state);
+
+    if (has_kv) {
+        uint64_t enc_key = 0;
+        if (!r.read(enc_key) || !r.read_tensor(state.kv_cross.k) || !r.read_tensor(state.kv_cross.v)) {
+            WHISPER_LOG_ERROR("%s: the cross-attention KV of the snapshot does not fit this state\n", __func__);
+            state.enc_valid = false;
+            return false;
+        }
+        state.enc_key   = enc_key;
+        state.enc_valid = ctx.params.encoder_cache;
+    }
+
+    state.seek     = seek;
+    state.lang_id  = lang_id;
+    state.t_beg    = t_beg;
+    state.t_last   = t_last;
+    state.tid_last = tid_last;
+
+    state.prompt_past0 = std::move(prompt_past0);
+    state.prompt_past1 = std::move(prompt_past1);
+    state.result_all   = std::move(result_all);
+
+    for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+        std::istringstream(rng[j]) >> state.decoders[j].rng;
+    }
+
+    state.has_vad_segments  = has_vad_segments != 0;
+    state.vad_segments      = std::move(vad_segments);
+    state.vad_mapping_table = std::move(vad_mapping_table);
+
+    return true;
+}
+
+size_t whisper_state_get_size(struct whisper_context * ctx, struct whisper_state * state, bool include_kv) {
+    whisper_state_writer w;
+    whisper_state_write(*ctx, *state, w, include_kv);
+
+    return w.n;
+}
+
+size_t whisper_state_get_data(struct whisper_context * ctx, struct whisper_state * state, uint8_t * dst, size_t size, bool include_kv) {
+    whisper_state_writer w;
+    w.dst  = dst;
+    w.size = size;
+    whisper_state_write(*ctx, *state, w, include_kv);
+
+    if (w.n > size) {
+        WHISPER_LOG_ERROR("%s: the buffer is too small (%zu bytes, %zu needed)\n", __func__, size, w.n);
+        return 0;
+    }
+
+    return w.n;
+}
+
+size_t whisper_state_set_data(struct whisper_context * ctx, struct whisper_state * state, const uint8_t * src, size_t size) {
+    whisper_state_reader r;
+    r.src  = src;
+    r.size = size;
+
+    if (!whisper_state_read(*ctx, *state, r)) {
+        WHISPER_LOG_ERROR("%s: failed to restore the state\n", __func__);
+        return 0;
+    }
+
+    return r.n;
+}
+
+bool whisper_state_save_file(struct whisper_context * ctx, struct whisper_state * state, const char * path, bool include_kv) {
+    std::vector<uint8_t> data(whisper_state_get_size(ctx, state, include_kv));
+    if (whisper_state_get_data(ctx, state, data.data(), data.size(), include_kv) == 0) {
+        return false;
+    }
+
+    std::ofstream fout(path, std::ios::binary);
+    if (!fout) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path);
+        return false;
+    }
+
+    fout.write((const char *) data.data(), data.size());
+
+    return (bool) fout;
+}
+
+bool whisper_state_load_file(struct whisper_context * ctx, struct whisper_state * state, const char * path) {
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path);
+        return false;
+    }
+
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    if (data.empty()) {
+        WHISPER_LOG_ERROR("%s: failed to read '%s'\n", __func__, path);
+        return false;
+    }
+
+    const size_t n_read = whisper_state_set_data(ctx, state, data.data(), data.size());
+
+    return n_read != 0 && n_read == data.size();
+}
+
+void whisper_free_state(struct whisper_state * state) {
+    if (state) {
+        if (state->device) {
+            state->device->n_states--;
+        }
+
+        whisper_kv_cache_free(state->kv_self);
+        whisper_kv_cache_free(state->kv_cross);
+        whisper_kv_cache_free(state->kv_pad);
+        whisper_kv_cache_free(state->embd_io);
+
+#ifdef WHISPER_USE_COREML
+        if (state->ctx_coreml != nullptr) {
+            whisper_coreml_free(state->ctx_coreml);
+            state->ctx_coreml = nullptr;
+        }
+        for (auto * ctx_short : state->ctx_coreml_short) {
+            whisper_coreml_free(ctx_short);
+        }
+        state->ctx_coreml_short.clear();
+#endif
+
+#ifdef WHISPER_USE_OPENVINO
+        if (state->ctx_openvino != nullptr) {
+            whisper_openvino_free(state->ctx_openvino);
+            state->ctx_openvino = nullptr;
+        }
+        for (auto * ctx_short : state->ctx_openvino_short) {
+            whisper_openvino_free(ctx_short);
+        }
+        state->ctx_openvino_short.clear();
+#endif
+
+        whisper_batch_free(state->batch);
+
+        // with share_compute_buffers, the schedulers of the other graphs are the one of the conv graph
+        for (auto * sched : { state->sched_encode.sched, state->sched_cross.sched, state->sched_decode.sched }) {
+            if (sched != state->sched_conv.sched) {
+                ggml_backend_sched_free(sched);
+            }
+        }
+        ggml_backend_sched_free(state->sched_conv.sched);
+        if (state->sched_batch.sched) {
+            ggml_backend_sched_free(state->sched_batch.sched);
+        }
+        if (state->sched_decode_batch.sched) {
+            ggml_backend_sched_free(state->sched_decode_batch.sched);
+        }
+
+        for (auto & backend : state->backends) {
+            ggml_backend_free(backend);
+        }
+
+        whisper_threadpool_free(state->threadpool);
+
+        // [EXPERIMENTAL] Token-level timestamps with DTW
+        aheads_masks_free(state->aheads_masks);
+
+        if (state->vad_context != nullptr) {
+            whisper_vad_free(state->vad_context);
+            state->vad_context = nullptr;
+        }
+
+        whisper_free_state(state->draft_state);
+        whisper_free_state(state->ahead_state);
+
+        delete state;
+    }
+}
+
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        whisper_model_wait(ctx->model);
+
+        for (ggml_context * context : ctx->model.ctxs) {
+            ggml_free(context);
+        }
+
+        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
+            ggml_backend_buffer_free(buf);
+        }
+
+        whisper_free_state(ctx->state);
+        for (whisper_state * state : ctx->parallel_states) {
+            whisper_free_state(state);
+        }
+
+        for (auto & device : ctx->devices) {
+            if (device->model) {
+                for (ggml_context * context : device->model->ctxs) {
+                    ggml_free(context);
+                }
+                for (ggml_backend_buffer_t buf : device->model->buffers) {
+                    ggml_backend_buffer_free(buf);
+                }
+            }
+        }
+
+        delete ctx;
+    }
+}
+
+void whisper_free_context_params(struct whisper_context_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+void whisper_free_params(struct whisper_full_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    state->enc_batch_offset = -1;
+
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_set_mel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * data,
+                           int   n_len,
+                           int   n_mel) {
+    if (n_mel != ctx->model.filters.n_mel) {
+        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
+        return -1;
+    }
+
+    state->enc_batch_offset = -1;
+
+    state->mel.n_len     = n_len;
+    state->mel.n_len_org = n_len;
+    state->mel.n_mel     = n_mel;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+// frames kept after trimming the stream history (30 s)
+#define WHISPER_MEL_STREAM_HISTORY (WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE/WHISPER_HOP_LENGTH)
+
+void whisper_mel_stream_reset_with_state(struct whisper_state * state) {
+    state->mel_stream.reset();
+}
+
+void whisper_mel_stream_reset(struct whisper_context * ctx) {
+    whisper_mel_stream_reset_with_state(ctx->state);
+}
+
+int whisper_mel_stream_append_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_threads) {
+    if (n_samples < 0 || (n_samples > 0 && samples == nullptr)) {
+        WHISPER_LOG_ERROR("%s: invalid samples\n", __func__);
+        return -1;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const whisper_filters & filters = ctx->model.filters;
+    whisper_mel_stream & ms = state->mel_stream;
+
+    const int n_mel = filters.n_mel;
+    const int hop   = WHISPER_HOP_LENGTH;
+    const int half  = WHISPER_N_FFT/2;
+
+    ms.pcm.insert(ms.pcm.end(), samples, samples + n_samples);
+    ms.n_samples += n_samples;
+
+    // frame f is final once its window [f*hop - half, f*hop + half) has arrived
+    const int64_t n_final = ms.n_samples >= half ? (ms.n_samples - half)/hop + 1 : 0;
+
+    if (n_final > ms.n_final) {
+        whisper_mel mel;
+        mel.n_mel     = n_mel;
+        mel.n_len     = (int) (n_final - ms.n_final);
+        mel.n_len_org = mel.n_len;
+        mel.data.resize((size_t) n_mel*mel.n_len);
+
+        // pcm starts at the window of the first new frame
+        log_mel_frames(ms.pcm.data(), (int) ms.pcm.size(), n_threads, filters, mel);
+
+        for (int i = 0; i < mel.n_len; i++) {
+            float fmax = -1e20f;
+            for (int j = 0; j < n_mel; j++) {
+                const float v = mel.data[(size_t) j*mel.n_len + i];
+                ms.frames.push_back(v);
+                fmax = v > fmax ? v : fmax;
+            }
+            ms.frame_max.push_back(fmax);
+        }
+        ms.n_final = n_final;
+
+        // drop the audio that no future frame overlaps
+        const int64_t keep_from = ms.n_final*hop - half;
+        ms.pcm.erase(ms.pcm.begin(), ms.pcm.begin() + (keep_from - ms.pcm_offset));
+        ms.pcm_offset = keep_from;
+
+        // trim the history in bulk so appends stay amortized O(new frames)
+        const int64_t n_stored = ms.n_final - ms.frame_offset;
+        if (n_stored > 2*WHISPER_MEL_STREAM_HISTORY) {
+            const int64_t n_drop = n_stored - WHISPER_MEL_STREAM_HISTORY;
+            ms.frames.erase(ms.frames.begin(), ms.frames.begin() + n_drop*n_mel);
+            ms.frame_max.erase(ms.frame_max.begin(), ms.frame_max.begin() + n_drop);
+            ms.frame_offset += n_drop;
+        }
+    }
+
+    state->t_mel_us += ggml_time_us() - t_start_us;
+    whisper_trace_add("mel", t_start_us);
+
+    return 0;
+}
+
+int whisper_mel_stream_append(
+        struct whisper_context * ctx,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_threads) {
+    return whisper_mel_stream_append_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_mel_stream_window_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   n_samples) {
+    if (n_samples < 0) {
+        WHISPER_LOG_ERROR("%s: invalid window length %d\n", __func__, n_samples);
+        return -1;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    state->enc_batch_offset = -1;
+
+    const whisper_filters & filters = ctx->model.filters;
+    const whisper_mel_stream & ms = state->mel_stream;
+    whisper_mel & mel = state->mel;
+
+    const int n_mel = filters.n_mel;
+    const int hop   = WHISPER_HOP_LENGTH;
+    const int half  = WHISPER_N_FFT/2;
+
+    // start on a frame boundary, within the stored history
+    const int64_t start = ms.n_samples - std::min<int64_t>(n_samples, ms.n_samples);
+    // (the first frame that is not final yet is always included)
+    const int64_t f0    = std::min(std::max(start/hop, ms.frame_offset), ms.n_final);
+    const int64_t n_win = ms.n_samples - f0*hop;
+
+    // same frame counts as whisper_pcm_to_mel() on n_win samples (30 s of zero padding)
+    mel.n_mel     = n_mel;
+    mel.n_len     = (int) ((n_win + WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE)/hop);
+    mel.n_len_org = (int) (1 + (n_win + half - WHISPER_N_FFT)/hop);
+
+    const float log_zero = log10f(1e-10f);
+    mel.data.assign((size_t) n_mel*mel.n_len, log_zero);
+
+    float mmax = log_zero; // the padding frames are always part of the window
+
+    // final frames
+    const int n_stored = (int) std::min<int64_t>(ms.n_final - f0, mel.n_len);
+    for (int i = 0; i < n_stored; i++) {
+        const int64_t f = f0 + i - ms.frame_offset;
+        const float * src = ms.frames.data() + f*n_mel;
+        for (int j = 0; j < n_mel; j++) {
+            mel.data[(size_t) j*mel.n_len + i] = src[j];
+        }
+        mmax = ms.frame_max[f] > mmax ? ms.frame_max[f] : mmax;
+    }
+
+    // frames that reach past the end of the audio see zeros there
+    const int n_tail = std::min<int>(mel.n_len - n_stored, (int) ms.pcm.size()/hop + 1);
+    if (n_tail > 0) {
+        whisper_mel tail;
+        tail.n_mel     = n_mel;
+        tail.n_len     = n_tail;
+        tail.n_len_org = n_tail;
+        tail.data.resize((size_t) n_mel*n_tail);
+
+        log_mel_frames(ms.pcm.data(), (int) ms.pcm.size(), 1, filters, tail);
+
+        for (int j = 0; j < n_mel; j++) {
+            for (int i = 0; i < n_tail; i++) {
+                const float v = tail.data[(size_t) j*n_tail + i];
+                mel.data[(size_t) j*mel.n_len + n_stored + i] = v;
+                mmax = v > mmax ? v : mmax;
+            }
+        }
+    }
+
+    log_mel_normalize(mel, mmax);
+
+    state->t_mel_us += ggml_time_us() - t_start_us;
+    whisper_trace_add("mel", t_start_us);
+
+    return 0;
+}
+
+int whisper_mel_stream_window(
+        struct whisper_context * ctx,
+                           int   n_samples) {
+    return whisper_mel_stream_window_with_state(ctx, ctx->state, n_samples);
+}
+
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+// states share one batched graph when they are on the same GPU and apply the same adapters
+static bool whisper_states_match(const whisper_state & a, const whisper_state & b) {
+    return a.device == b.device && a.loras == b.loras;
+}
+
+// whether the states of a batch need more than one graph
+static bool whisper_states_split(whisper_state * const * states, int n_states) {
+    for (int b = 1; b < n_states; ++b) {
+        if (!whisper_states_match(*states[b], *states[0])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// calls fn(states, indices, n) with each group of matching states in turn
+static int whisper_states_per_group(whisper_state ** states, int n_states, const std::function<int(whisper_state **, const int *, int)> & fn) {
+    std::vector<bool> done(n_states, false);
+    for (int b = 0; b < n_states; ++b) {
+        if (done[b]) {
+            continue;
+        }
+        std::vector<whisper_state *> group;
+        std::vector<int> idx;
+        for (int c = b; c < n_states; ++c) {
+            if (!done[c] && whisper_states_match(*states[c], *states[b])) {
+                group.push_back(states[c]);
+                idx.push_back(c);
+                done[c] = true;
+            }
+        }
+        const int ret = fn(group.data(), idx.data(), (int) group.size());
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int whisper_encode_batch(
+        struct whisper_context * ctx,
+        struct whisper_state ** states,
+                   const int  * offsets,
+                           int   n_states,
+                           int   audio_ctx,
+                           int   n_threads) {
+    if (n_states <= 0 || states == nullptr || offsets == nullptr) {
+        WHISPER_LOG_ERROR("%s: no states to encode\n", __func__);
+        return -1;
+    }
+    // the batched graph projects the cross-attention K/V too
+    whisper_model_wait(ctx->model);
+
+    if (audio_ctx < 0 || audio_ctx > ctx->model.hparams.n_audio_ctx) {
+        WHISPER_LOG_ERROR("%s: invalid audio_ctx %d\n", __func__, audio_ctx);
+        return -1;
+    }
+
+    // states on different GPUs or with different adapters are batched per group
+    if (whisper_states_split(states, n_states)) {
+        return whisper_states_per_group(states, n_states, [&](whisper_state ** st, const int * idx, int n) {
+            std::vector<int> offs(n);
+            for (int b = 0; b < n; ++b) {
+                offs[b] = offsets[idx[b]];
+            }
+            return whisper_encode_batch(ctx, st, offs.data(), n, audio_ctx, n_threads);
+        });
+    }
+
+    for (int b = 0; b < n_states; ++b) {
+        states[b]->exp_n_audio_ctx = audio_ctx;
+    }
+
+    // nothing to batch, or the encoder does not run in ggml
+    if (n_states == 1 || whisper_encode_external(*states[0])) {
+        for (int b = 0; b < n_states; ++b) {
+            if (!whisper_encode_internal(*ctx, *states[b], offsets[b], n_threads, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const int n_ctx  = audio_ctx > 0 ? audio_ctx : ctx->model.hparams.n_audio_ctx;
+    const int n_mels = ctx->model.hparams.n_mels;
+
+    // the first state hosts the scheduler; its buffers grow to the largest batch seen
+    whisper_state & host = *states[0];
+    whisper_sched & wsched = host.sched_batch;
+
+    if (!wsched.sched) {
+        wsched.meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead_custom(WHISPER_MAX_NODES, false));
+        wsched.sched = whisper_sched_new(host.backends, whisper_cpu_buft(ctx->params), WHISPER_MAX_NODES);
+        ggml_backend_sched_set_eval_callback(wsched.sched, ctx->params.cb_eval, ctx->params.cb_eval_user_data);
+    }
+
+    ggml_cgraph * gf = whisper_build_graph_encoder_batch(*ctx, wsched, states, n_states, n_ctx);
+
+    if (!ggml_backend_sched_alloc_graph(wsched.sched, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return -1;
+    }
+
+    {
+        const size_t n_window = (size_t) n_mels*2*n_ctx;
+
+        std::vector<float> inp(n_window*n_states);
+        for (int b = 0; b < n_states; ++b) {
+            whisper_state & st = *states[b];
+            float * dst = inp.data() + n_window*b;
+
+            assert(st.mel.n_mel == n_mels);
+            whisper_mel_window(st.mel, offsets[b], st.mel_end, n_ctx, dst);
+
+            // a later whisper_full() over the same window can skip the encoder
+            st.enc_key   = whisper_hash_input(dst, n_window, (uint64_t) n_ctx);
+            st.enc_valid = false;
+        }
+
+        ggml_backend_tensor_set(ggml_graph_get_tensor(gf, "mel"), inp.data(), 0, inp.size()*sizeof(float));
+    }
+
+    if (!ggml_graph_compute_helper(wsched.sched, gf, n_threads, host.threadpool, WHISPER_CPU_WORK_ENCODE)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    const int64_t t_us = ggml_time_us() - t_start_us;
+    for (int b = 0; b < n_states; ++b) {
+        states[b]->t_encode_us += t_us/n_states;
+        states[b]->n_encode++;
+        whisper_histogram_add(states[b]->h_encode, t_us/n_states);
+        states[b]->enc_valid = ctx->params.encoder_cache;
+
+        states[b]->enc_batch_offset  = offsets[b];
+        states[b]->enc_batch_n_ctx   = n_ctx;
+        states[b]->enc_batch_mel_end = states[b]->mel_end;
+    }
+
+    return 0;
+}
+
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
+
+    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+
+    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_decode_batch(
+        struct whisper_context * ctx,
+        struct whisper_state ** states,
+   const whisper_token * const * tokens,
+                     const int * n_tokens,
+                     const int * n_past,
+                           int   n_states,
+                           int   n_threads) {
+    if (n_states <= 0 || states == nullptr || tokens == nullptr || n_tokens == nullptr || n_past == nullptr) {
+        WHISPER_LOG_ERROR("%s: no states to decode\n", __func__);
+        return -1;
+    }
+
+    whisper_model_wait(ctx->model);
+
+    if (n_states == 1) {
+        return whisper_decode_with_state(ctx, states[0], tokens[0], n_tokens[0], n_past[0], n_threads);
+    }
+
+    // states on different GPUs or with different adapters are batched per group
+    if (whisper_states_split(states, n_states)) {
+        return whisper_states_per_group(states, n_states, [&](whisper_state ** st, const int * idx, int n) {
+            std::vector<const whisper_token *> tok(n);
+            std::vector<int> n_tok(n);
+            std::vector<int> past(n);
+            for (int b = 0; b < n; ++b) {
+                tok[b]   = tokens[idx[b]];
+                n_tok[b] = n_tokens[idx[b]];
+                past[b]  = n_past[idx[b]];
+            }
+            return whisper_decode_batch(ctx, st, tok.data(), n_tok.data(), past.data(), n, n_threads);
+        });
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const int n_vocab = ctx->model.hparams.n_vocab;
+
+    int n_tokens_all = 0;
+
+    // find a KV slot in every state
+    for (int b = 0; b < n_states; ++b) {
+        whisper_state & st = *states[b];
+
+        if (n_tokens[b] <= 0 || n_tokens[b] > (int) st.kv_self.size) {
+            WHISPER_LOG_ERROR("%s: invalid n_tokens = %d for state %d\n", __func__, n_tokens[b], b);
+            return -1;
+        }
+
+        whisper_batch_prep_legacy(st.batch, tokens[b], n_tokens[b], n_past[b], 0);
+
+        auto & kv_self = st.kv_self;
+
+        whisper_kv_cache_seq_rm(kv_self, 0, n_past[b], -1);
+
+        if (!whisper_kv_cache_find_slot(kv_self, st.batch)) {
+            WHISPER_LOG_ERROR("%s: failed to find a KV slot for state %d\n", __func__, b);
+            return -1;
+        }
+
+        const uint32_t pad = whisper_kv_cache_get_padding(*ctx);
+        kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
+
+        n_tokens_all += n_tokens[b];
+    }
+
+    // the first state hosts the scheduler; its buffers grow to the largest batch seen
+    whisper_state & host = *states[0];
+    whisper_sched & wsched = host.sched_decode_batch;
+
+    // about 40 nodes per state and layer on top of the shared part
+    const int n_nodes = WHISPER_MAX_NODES + 64*n_states*ctx->model.hparams.n_text_layer;
+
+    if (!wsched.sched || wsched.meta.size() < ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false)) {
+        if (wsched.sched) {
+            ggml_backend_sched_free(wsched.sched);
+        }
+        wsched.meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
+        wsched.sched = whisper_sched_new(host.backends, whisper_cpu_buft(ctx->params), n_nodes);
+        ggml_backend_sched_set_eval_callback(wsched.sched, ctx->params.cb_eval, ctx->params.cb_eval_user_data);
+    }
+
+    ggml_cgraph * gf = whisper_build_graph_decoder_batch(*ctx, wsched, states, n_tokens, n_states, n_nodes);
+
+    if (!ggml_backend_sched_alloc_graph(wsched.sched, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return -1;
+    }
+
+    // set the inputs
+    {
+        std::vector<int32_t> embd;
+        std::vector<int32_t> position;
+        std::vector<int32_t> out_ids;
+
+        embd.reserve(n_tokens_all);
+        position.reserve(n_tokens_all);
+
+        for (int b = 0; b < n_states; ++b) {
+            const whisper_batch & batch = states[b]->batch;
+            for (int i = 0; i < batch.n_tokens; ++i) {
+                embd.push_back(batch.token[i]);
+                position.push_back(batch.pos[i]);
+            }
+            out_ids.push_back((int32_t) embd.size() - 1);
+        }
+
+        ggml_backend_tensor_set(ggml_graph_get_tensor(gf, "embd"),     embd.data(),     0, embd.size()*sizeof(int32_t));
+        ggml_backend_tensor_set(ggml_graph_get_tensor(gf, "position"), position.data(), 0, position.size()*sizeof(int32_t));
+        ggml_backend_tensor_set(ggml_graph_get_tensor(gf, "out_ids"),  out_ids.data(),  0, out_ids.size()*sizeof(int32_t));
+    }
+
+    for (int b = 0; b < n_states; ++b) {
+        char name[32];
+        snprintf(name, sizeof(name), "KQ_mask_%d", b);
+        whisper_kq_mask_set(*states[b], states[b]->batch, ggml_graph_get_tensor(gf, name));
+    }
+
+    struct ggml_tensor * logits = ggml_graph_node(gf, -1);
+
+    if (!ggml_graph_compute_helper(wsched.sched, gf, n_threads, host.threadpool, WHISPER_CPU_WORK_DECODE, false)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    // same layout as whisper_decode_with_state(): the last token's row
+    {
+        ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(wsched.sched, logits);
+
+        for (int b = 0; b < n_states; ++b) {
+            whisper_state & st = *states[b];
+
+            st.logits.resize((size_t) n_tokens[b]*n_vocab);
+            ggml_backend_tensor_get_async(backend_res, logits, st.logits.data() + (size_t) (n_tokens[b] - 1)*n_vocab, sizeof(float)*n_vocab*b, sizeof(float)*n_vocab);
+        }
+
+        ggml_backend_synchronize(backend_res);
+        ggml_backend_sched_reset(wsched.sched);
+    }
+
+    const int64_t t_us = ggml_time_us() - t_start_us;
+    for (int b = 0; b < n_states; ++b) {
+        whisper_state & st = *states[b];
+
+        if (n_tokens[b] == 1) {
+            st.t_decode_us += t_us/n_states;
+            st.n_decode++;
+        } else {
+            st.t_prompt_us += t_us/n_states;
+            st.n_prompt += n_tokens[b];
+        }
+    }
+
+    return 0;
+}
+
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+        return -1;
+    }
+
+    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+}
+
+int whisper_warmup_with_state(struct whisper_context * ctx, struct whisper_state * state, int n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // touch every page of a memory-mapped model once
+    if (ctx->model.mapping) {
+        const auto & map = *ctx->model.mapping;
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < map.size; i += 4096) {
+            sum += ((volatile const uint8_t *) map.addr)[i];
+        }
+        GGML_UNUSED(sum);
+    }
+
+    const int n_ctx = whisper_n_audio_ctx(ctx);
+
+    // one full window of silence, in place of whatever mel the state holds
+    whisper_mel mel;
+    mel.n_mel     = ctx->model.hparams.n_mels;
+    mel.n_len     = 2*n_ctx;
+    mel.n_len_org = 2*n_ctx;
+    mel.data.assign((size_t) mel.n_mel*mel.n_len, 0.0f);
+
+    std::swap(state->mel, mel);
+
+    const int exp_n_audio_ctx = state->exp_n_audio_ctx;
+    state->exp_n_audio_ctx = 0;
+
+    bool ok = whisper_encode_internal(*ctx, *state, 0, n_threads, nullptr, nullptr);
+
+    std::swap(state->mel, mel);
+    state->exp_n_audio_ctx = exp_n_audio_ctx;
+    state->enc_valid = false;
+
+    // a prompt-sized batch and a single-token step, the two decoder graphs every window uses
+    if (ok) {
+        const whisper_token prompt[3] = { whisper_token_sot(ctx), whisper_token_transcribe(ctx), whisper_token_beg(ctx) };
+
+        ok = whisper_decode_with_state(ctx, state, prompt, 3, 0, n_threads) == 0 &&
+             whisper_decode_with_state(ctx, state, prompt + 2, 1, 3, n_threads) == 0;
+    }
+
+    whisper_kv_cache_clear(state->kv_self);
+    state->kv_prompt.clear();
+
+    whisper_reset_metrics_from_state(state);
+
+    if (!ok) {
+        WHISPER_LOG_ERROR("%s: failed to warm up\n", __func__);
+        return -1;
+    }
+
+    WHISPER_LOG_INFO("%s: warm-up took %.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0f);
+
+    return 0;
+}
+
+int whisper_warmup(struct whisper_context * ctx, int n_threads) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+        return -1;
+    }
+
+    return whisper_warmup_with_state(ctx, ctx->state, n_threads);
+}
+
+// Encoder context for the last n_frames mel frames of the audio: the
+// encoder halves the frame rate, a little trailing context is kept and the
+// result is rounded up to a multiple of 256 so only a few graph shapes occur.
+// 0 (the full context) once the audio fills the window.
+static int whisper_audio_ctx_bucket(int n_audio_ctx, int n_frames) {
+    const int n_need = (n_frames + 1)/2 + 64;
+    const int n_ctx  = GGML_PAD(n_need, 256);
+
+    return n_ctx < n_audio_ctx ? n_ctx : 0;
+}
+
+// log probability of token in a row of logits
+static float whisper_token_logprob(const float * logits, int n_vocab, whisper_token token) {
+    float logit_max = -INFINITY;
+    for (int i = 0; i < n_vocab; ++i) {
+        logit_max = logits[i] > logit_max ? logits[i] : logit_max;
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum += expf(logits[i] - logit_max);
+    }
+
+    return logits[token] - logit_max - logf(sum);
+}
+
+int whisper_score_phrases_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * samples,
+                           int   n_samples,
+                    const char * language,
+                   const char ** phrases,
+                           int   n_phrases,
+                           int   audio_ctx,
+                         float   margin,
+                         float * scores,
+                           int   n_threads) {
+    if (n_phrases <= 0 || phrases == nullptr || scores == nullptr) {
+        WHISPER_LOG_ERROR("%s: no phrases to score\n", __func__);
+        return -1;
+    }
+
+    const auto & hparams = ctx->model.hparams;
+
+    const int n_vocab = hparams.n_vocab;
+
+    // the phrases as they are transcribed: after a space and followed by the end of the text,
+    // so that a phrase that is only the beginning of what was said scores low
+    std::vector<std::vector<whisper_token>> tokens(n_phrases);
+    for (int i = 0; i < n_phrases; ++i) {
+        tokens[i] = tokenize(ctx->vocab, std::string(" ") + phrases[i]);
+        if (tokens[i].empty() || (int) tokens[i].size() >= hparams.n_text_ctx/2) {
+            WHISPER_LOG_ERROR("%s: invalid phrase '%s'\n", __func__, phrases[i]);
+            return -1;
+        }
+        tokens[i].push_back(whisper_token_eot(ctx));
+    }
+
+    std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+    if (whisper_is_multilingual(ctx)) {
+        const int lang_id = whisper_lang_id(language ? language : "en");
+        if (lang_id < 0) {
+            WHISPER_LOG_ERROR("%s: unknown language '%s'\n", __func__, language);
+            return -1;
+        }
+        prompt.push_back(whisper_token_lang(ctx, lang_id));
+        prompt.push_back(whisper_token_transcribe(ctx));
+    }
+    prompt.push_back(whisper_token_not(ctx));
+
+    const int n_prompt = prompt.size();
+
+    // encode once
+    if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, n_threads) != 0) {
+        WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+        return -2;
+    }
+
+    {
+        const int exp_n_audio_ctx = state->exp_n_audio_ctx;
+
+        // a short command does not need the encoder to run over 30 s of padding
+        state->exp_n_audio_ctx = audio_ctx > 0 ? std::min(audio_ctx, hparams.n_audio_ctx) : whisper_audio_ctx_bucket(hparams.n_audio_ctx, state->mel.n_len_org);
+        state->mel_end         = INT_MAX;
+
+        const bool ok = whisper_encode_internal(*ctx, *state, 0, n_threads, nullptr, nullptr);
+
+        state->exp_n_audio_ctx = exp_n_audio_ctx;
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+            return -3;
+        }
+    }
+
+    auto & kv    = state->kv_self;
+    auto & batch = state->batch;
+
+    whisper_kv_cache_clear(kv);
+    state->kv_prompt.clear();
+
+    // the prompt is decoded once, its logits give the first token of every phrase
+    whisper_batch_prep_legacy(batch, prompt.data(), n_prompt, 0, 0);
+    if (!whisper_decode_internal(*ctx, *state, batch, n_threads, false, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to decode the prompt\n", __func__);
+        return -4;
+    }
+
+    // sum[i] - log probability of the tokens of phrase i scored so far, it only decreases with more tokens
+    std::vector<float> sum(n_phrases);
+    std::vector<char>  dropped(n_phrases, 0);
+    {
+        const float * logits = state->logits.data() + (size_t) (n_prompt - 1)*n_vocab;
+        for (int i = 0; i < n_phrases; ++i) {
+            sum[i] = whisper_token_logprob(logits, n_vocab, tokens[i][0]);
+        }
+    }
+
+    // drop the phrases that trail the best one by more than margin
+    // returns the number of phrases left in [0, i1)
+    auto drop = [&](int i1) {
+        float best = -INFINITY;
+        for (int i = 0; i < i1; ++i) {
+            if (!dropped[i]) {
+                best = std::max(best, sum[i]);
+            }
+        }
+
+        int n_left = 0;
+        for (int i = 0; i < i1; ++i) {
+            if (!dropped[i] && sum[i] < best - margin) {
+                dropped[i] = 1;
+            }
+            n_left += !dropped[i];
+        }
+
+        return n_left;
+    };
+
+    // the phrases are decoded in groups, one sequence per phrase, all after the shared prompt cells
+    // every step is one batch with the next token of each phrase of the group that is still left
+    const int n_seq_max = 32;
+
+    for (int g0 = 0; g0 < n_phrases; ) {
+        int g1      = g0;
+        int n_cells = n_prompt;
+        while (g1 < n_phrases && g1 - g0 < n_seq_max && n_cells + (int) tokens[g1].size() - 1 <= (int) kv.size) {
+            n_cells += tokens[g1].size() - 1;
+            g1++;
+        }
+
+        if (g0 > 0) {
+            whisper_kv_cache_seq_rm(kv, -1, n_prompt, -1);
+        }
+        whisper_kv_cache_seq_fork(kv, 0, g1 - g0);
+
+        const bool last = g1 == n_phrases;
+
+        std::vector<int> active;
+        for (int i = g0; i < g1; ++i) {
+            if (tokens[i].size() > 1) {
+                active.push_back(i);
+            }
+        }
+
+        for (int t = 1; ; ++t) {
+            // early exit: a single phrase left, the others trail it by more than margin
+            const int n_left = drop(g1);
+            if (last && n_left <= 1) {
+                break;
+            }
+
+            active.erase(std::remove_if(active.begin(), active.end(), [&](int i) { return dropped[i]; }), active.end());
+            if (active.empty()) {
+                break;
+            }
+
+            batch.n_tokens = active.size();
+            for (int j = 0; j < (int) active.size(); ++j) {
+                batch.token   [j]    = tokens[active[j]][t - 1];
+                batch.pos     [j]    = n_prompt + t - 1;
+                batch.n_seq_id[j]    = 1;
+                batch.seq_id  [j][0] = active[j] - g0;
+                batch.logits  [j]    = 1;
+            }
+
+            if (!whisper_decode_internal(*ctx, *state, batch, n_threads, false, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                whisper_kv_cache_clear(kv);
+                return -5;
+            }
+
+            for (int j = 0; j < (int) active.size(); ++j) {
+                const int i = active[j];
+                sum[i] += whisper_token_logprob(state->logits.data() + (size_t) j*n_vocab, n_vocab, tokens[i][t]);
+            }
+
+            active.erase(std::remove_if(active.begin(), active.end(), [&](int i) { return t + 1 == (int) tokens[i].size(); }), active.end());
+        }
+
+        g0 = g1;
+    }
+
+    // the KV cache no longer holds a transcription prompt
+    whisper_kv_cache_clear(kv);
+
+    int best = -1;
+    for (int i = 0; i < n_phrases; ++i) {
+        scores[i] = dropped[i] ? -INFINITY : sum[i];
+        if (best < 0 || scores[i] > scores[best]) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+int whisper_score_phrases(
+        struct whisper_context * ctx,
+                   const float * samples,
+                           int   n_samples,
+                    const char * language,
+                   const char ** phrases,
+                           int   n_phrases,
+                           int   audio_ctx,
+                         float   margin,
+                         float * scores,
+                           int   n_threads) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+        return -1;
+    }
+
+    return whisper_score_phrases_with_state(ctx, ctx->state, samples, n_samples, language, phrases, n_phrases, audio_ctx, margin, scores, n_threads);
+}
+
+int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
+    const auto res = tokenize(ctx->vocab, text);
+
+    if (n_max_tokens < (int) res.size()) {
+        WHISPER_LOG_ERROR("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
+        return -(int) res.size();
+    }
+
+    for (int i = 0; i < (int) res.size(); i++) {
+        tokens[i] = res[i];
+    }
+
+    return res.size();
+}
+
+int whisper_token_count(struct whisper_context * ctx, const char * text) {
+    return -whisper_tokenize(ctx, text, NULL, 0);
+}
+
+int whisper_lang_max_id(void) {
+    auto max_id = 0;
+    for (const auto & kv : g_lang) {
+        max_id = std::max(max_id, kv.second.first);
+    }
+
+    return max_id;
+}
+
+int whisper_lang_id(const char * lang) {
+    if (!g_lang.count(lang)) {
+        for (const auto & kv : g_lang) {
+            if (kv.second.second == lang) {
+                return kv.second.first;
+            }
+        }
+
+        WHISPER_LOG_ERROR("%s: unknown language '%s'\n", __func__, lang);
+        return -1;
+    }
+    return g_lang.at(lang).first;
+}
+
+const char * whisper_lang_str(int id) {
+    for (const auto & kv : g_lang) {
+        if (kv.second.first == id) {
+            return kv.first.c_str();
+        }
+    }
+
+    WHISPER_LOG_ERROR("%s: unknown language id %d\n", __func__, id);
+    return nullptr;
+}
+
+const char * whisper_lang_str_full(int id) {
+   for (const auto & kv : g_lang) {
+        if (kv.second.first == id) {
+            return kv.second.second.c_str();
+        }
+    }
+
+    WHISPER_LOG_ERROR("%s: unknown language id %d\n", __func__, id);
+    return nullptr;
+}
+
+// audio_ctx: the encoder context of the detection, 0 = the whole window
+static int whisper_lang_auto_detect_impl(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   audio_ctx,
+                           int   n_threads,
+                         float * lang_probs) {
+    const int seek = offset_ms/10;
+
+    if (seek < 0) {
+        WHISPER_LOG_ERROR("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
+        return -1;
+    }
+
+    if (seek >= state->mel.n_len_org) {
+        WHISPER_LOG_ERROR("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
+        return -2;
+    }
+
+    // run the encoder on the whole audio of the window, whatever the last whisper_full() window was
+    {
+        const int exp_n_audio_ctx = state->exp_n_audio_ctx;
+        const int mel_end         = state->mel_end;
+
+        state->exp_n_audio_ctx = std::min(audio_ctx, ctx->model.hparams.n_audio_ctx);
+        state->mel_end         = INT_MAX;
+
+        const int ret = whisper_encode_with_state(ctx, state, seek, n_threads);
+
+        state->exp_n_audio_ctx = exp_n_audio_ctx;
+        state->mel_end         = mel_end;
+
+        if (ret != 0) {
+            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+            return -6;
+        }
+    }
+
+    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+
+    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
+        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+        return -7;
+    }
+
+    auto & logits_id = state->decoders[0].logits_id;
+    logits_id.clear();
+
+    for (const auto & kv : g_lang) {
+        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
+        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
+    }
+
+    // sort descending
+    {
+        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
+        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
+            return a.first > b.first;
+        });
+    }
+
+    // softmax
+    {
+        const auto max = logits_id[0].first;
+
+        double sum = 0.0f;
+        for (auto & kv : logits_id) {
+            kv.first = exp(kv.first - max);
+            sum += kv.first;
+        }
+
+        for (auto & kv : logits_id) {
+            kv.first /= sum;
+        }
+    }
+
+    {
+        for (const auto & prob : logits_id) {
+            if (lang_probs) {
+                lang_probs[prob.second] = prob.first;
+            }
+
+            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+        }
+    }
+
+    return logits_id[0].second;
+}
+
+int whisper_lang_auto_detect_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    return whisper_lang_auto_detect_impl(ctx, state, offset_ms, state->exp_n_audio_ctx, n_threads, lang_probs);
+}
+
+int whisper_lang_auto_detect(
+        struct whisper_context * ctx,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
+}
+
+int whisper_model_n_vocab(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_vocab;
+}
+
+int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_model_n_audio_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_state;
+}
+
+int whisper_model_n_audio_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_head;
+}
+
+int whisper_model_n_audio_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_layer;
+}
+
+int whisper_model_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_model_n_text_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_state;
+}
+
+int whisper_model_n_text_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_head;
+}
+
+int whisper_model_n_text_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_layer;
+}
+
+int whisper_model_n_mels(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_mels;
+}
+
+int whisper_model_ftype(struct whisper_context * ctx) {
+    return ctx->model.hparams.ftype;
+}
+
+int whisper_model_type(struct whisper_context * ctx) {
+    return ctx->model.type;
+}
+
+const char *whisper_model_type_readable(struct whisper_context * ctx) {
+    switch (ctx->model.type) {
+    case e_model::MODEL_TINY:
+        return "tiny";
+    case e_model::MODEL_BASE:
+        return "base";
+    case e_model::MODEL_SMALL:
+        return "small";
+    case e_model::MODEL_MEDIUM:
+        return "medium";
+    case e_model::MODEL_LARGE:
+        return "large";
+    default:
+        return "unknown";
+    }
+}
+
+int whisper_n_len_from_state(struct whisper_state * state) {
+    return state->mel.n_len_org;
+}
+
+int whisper_n_len(struct whisper_context * ctx) {
+    return ctx->state->mel.n_len_org;
+}
+
+int whisper_n_vocab(struct whisper_context * ctx) {
+    return ctx->vocab.n_vocab;
+}
+
+int whisper_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_is_multilingual(struct whisper_context * ctx) {
+    return ctx->vocab.is_multilingual() ? 1 : 0;
+}
+
+int whisper_autotune_n_threads(struct whisper_context * ctx) {
+    if (ctx->n_threads_tuned > 0) {
+        return ctx->n_threads_tuned;
+    }
+    return std::min(4, std::max(1, (int) std::thread::hardware_concurrency()));
+}
+
+float * whisper_get_logits(struct whisper_context * ctx) {
+    return ctx->state->logits.data();
+}
+
+float * whisper_get_logits_from_state(struct whisper_state * state) {
+    return state->logits.data();
+}
+
+const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
+    if (token < 0 || token >= ctx->vocab.n_tokens()) {
+        throw std::out_of_range("whisper_token_to_str: invalid token");
+    }
+    return ctx->vocab.token_str(token);
+}
+
+whisper_token whisper_token_eot(struct whisper_context * ctx) {
+    return ctx->vocab.token_eot;
+}
+
+whisper_token whisper_token_sot(struct whisper_context * ctx) {
+    return ctx->vocab.token_sot;
+}
+
+whisper_token whisper_token_solm(struct whisper_context * ctx) {
+    return ctx->vocab.token_solm;
+}
+
+whisper_token whisper_token_prev(struct whisper_context * ctx) {
+    return ctx->vocab.token_prev;
+}
+
+whisper_token whisper_token_nosp(struct whisper_context * ctx) {
+    return ctx->vocab.token_nosp;
+}
+
+whisper_token whisper_token_not(struct whisper_context * ctx) {
+    return ctx->vocab.token_not;
+}
+
+whisper_token whisper_token_beg(struct whisper_context * ctx) {
+    return ctx->vocab.token_beg;
+}
+
+whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
+    return whisper_token_sot(ctx) + 1 + lang_id;
+}
+
+whisper_token whisper_token_translate(struct whisper_context * ctx) {
+    return ctx->vocab.token_translate;
+}
+
+whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
+    return ctx->vocab.token_transcribe;
+}
+
+struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        return nullptr;
+    }
+    whisper_timings * timings = new whisper_timings;
+    timings->sample_ms = 1e-3f * ctx->state->t_sample_us / std::max(1, ctx->state->n_sample);
+    timings->encode_ms = 1e-3f * ctx->state->t_encode_us / std::max(1, ctx->state->n_encode);
+    timings->decode_ms = 1e-3f * ctx->state->t_decode_us / std::max(1, ctx->state->n_decode);
+    timings->batchd_ms = 1e-3f * ctx->state->t_batchd_us / std::max(1, ctx->state->n_batchd);
+    timings->prompt_ms = 1e-3f * ctx->state->t_prompt_us / std::max(1, ctx->state->n_prompt);
+    return timings;
+}
+
+void whisper_print_timings(struct whisper_context * ctx) {
+    const int64_t t_end_us = ggml_time_us();
+
+    WHISPER_LOG_INFO("\n");
+    WHISPER_LOG_INFO("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
+    if (ctx->state != nullptr) {
+
+        const int32_t n_sample = std::max(1, ctx->state->n_sample);
+        const int32_t n_encode = std::max(1, ctx->state->n_encode);
+        const int32_t n_decode = std::max(1, ctx->state->n_decode);
+        const int32_t n_batchd = std::max(1, ctx->state->n_batchd);
+        const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
+
+        WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
+        WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
+        WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
+        WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
+        WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
+        WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
+        WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+    }
+    ggml_cpu_barrier_stats bs;
+    if (whisper_cpu_barrier_stats(bs) && bs.n_waits > ctx->barrier_stats0.n_waits) {
+        // process-wide: includes other contexts computing at the same time
+        const ggml_cpu_barrier_stats & b0 = ctx->barrier_stats0;
+        const double n_waits = (double) (bs.n_waits - b0.n_waits);
+        WHISPER_LOG_INFO("%s: barrier waits = %8lld / %5lld graphs (%5.1f%% yielded, %5.1f%% slept, spin %d)\n", __func__,
+                (long long) (bs.n_waits - b0.n_waits), (long long) (bs.n_graphs - b0.n_graphs),
+                100.0*(bs.n_yield - b0.n_yield)/n_waits, 100.0*(bs.n_sleep - b0.n_sleep)/n_waits, bs.spin);
+    }
+    WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
+}
+
+void whisper_reset_timings(struct whisper_context * ctx) {
+    ctx->t_start_us = ggml_time_us();
+    whisper_cpu_barrier_stats(ctx->barrier_stats0);
+    if (ctx->state != nullptr) {
+        whisper_reset_metrics_from_state(ctx->state);
+    }
+}
+
+static int whisper_has_coreml(void) {
+#ifdef WHISPER_USE_COREML
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int whisper_has_openvino(void) {
+#ifdef WHISPER_USE_OPENVINO
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+const char * whisper_print_system_info(void) {
+    static std::string s;
+
+    s  = "";
+    s += "WHISPER : ";
+    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
+    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+
+    for (size_t i = 0; i < ggml_backend_reg_count(); i++) {
+        auto * reg = ggml_backend_reg_get(i);
+        auto * get_features_fn = (ggml_backend_get_features_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features");
+        if (get_features_fn) {
+            ggml_backend_feature * features = get_features_fn(reg);
+            s += ggml_backend_reg_name(reg);
+            s += " : ";
+            for (; features->name; features++) {
+                s += features->name;
+                s += " = ";
+                s += features->value;
+                s += " | ";
+            }
+        }
+    }
+    return s.c_str();
+}
+
+//////////////////////////////////
+// Voice Activity Detection (VAD)
+//////////////////////////////////
+
+// number of VAD windows the feature graph processes per launch
+#define WHISPER_VAD_N_BATCH 256
+
+struct whisper_vad_hparams {
+    int32_t   n_encoder_layers;
+    int32_t * encoder_in_channels;
+    int32_t * encoder_out_channels;
+    int32_t * kernel_sizes;
+    int32_t   lstm_input_size;
+    int32_t   lstm_hidden_size;
+    int32_t   final_conv_in;
+    int32_t   final_conv_out;
+};
+
+struct whisper_vad_model {
+    std::string type;
+    std::string version;
+    whisper_vad_hparams hparams;
+
+    struct ggml_tensor * stft_forward_basis; // [256, 1, 258]
+
+    // Encoder tensors - 4 convolutional layers
+    struct ggml_tensor * encoder_0_weight;  // [3, 129, 128]
+    struct ggml_tensor * encoder_0_bias;    // [128]
+
+    // Second encoder layer
+    struct ggml_tensor * encoder_1_weight;  // [3, 128, 64]
+    struct ggml_tensor * encoder_1_bias;    // [64]
+
+    // Third encoder layer
+    struct ggml_tensor * encoder_2_weight;  // [3, 64, 64]
+    struct ggml_tensor * encoder_2_bias;    // [64]
+
+    // Fourth encoder layer
+    struct ggml_tensor * encoder_3_weight;  // [3, 64, 128]
+    struct ggml_tensor * encoder_3_bias;    // [128]
+
+    // LSTM decoder tensors
+    struct ggml_tensor * lstm_ih_weight;    // [128, 512] input-to-hidden
+    struct ggml_tensor * lstm_ih_bias;      // [512]
+    struct ggml_tensor * lstm_hh_weight;    // [128, 512] hidden-to-hidden
+    struct ggml_tensor * lstm_hh_bias;      // [512]
+
+    // Final conv layer
+    struct ggml_tensor * final_conv_weight; // [128]
+    struct ggml_tensor * final_conv_bias;   // [1]
+
+    // ggml contexts
+    std::vector<ggml_context *> ctxs;
+
+    // buffer for the model tensors
+    std::vector<ggml_backend_buffer_t> buffers;
+
+    // tensors
+    int n_loaded;
+    std::map<std::string, struct ggml_tensor *> tensors;
+};
+
+struct whisper_vad_segment {
+    int64_t start;
+    int64_t end;
+};
+
+struct whisper_vad_segments {
+    std::vector<whisper_vad_segment> data;
+};
+
+struct whisper_vad_event {
+    whisper_vad_event_type type;
+    int64_t                sample;
+};
+
+struct whisper_vad_context {
+    int64_t t_vad_us = 0;
+
+    int     n_window;
+    int     n_context;
+    int     n_threads;
+
+    std::vector<ggml_backend_t> backends;
+    whisper_threadpool          threadpool;
+    whisper_context_params      params;
+    whisper_sched               sched;
+
+    whisper_vad_model    model;
+    std::string          path_model;
+    std::vector<float>   probs;
+
+    // host copies of the recurrent part of the model; the LSTM is stepped on
+    // the CPU because each chunk depends on the previous chunk's state
+    std::vector<float>   lstm_hh_weight_t; // [4*hidden, hidden] transposed, one row per h element
+    std::vector<float>   lstm_hh_bias;
+    std::vector<float>   final_conv_weight;
+    float                final_conv_bias = 0.0f;
+
+    std::vector<float>   h_state;
+    std::vector<float>   c_state;
+
+    // STFT front end run on the host with the FFT, see whisper_vad_init_stft();
+    // stft_window is empty when the basis is not a windowed DFT, in which case
+    // the graph convolves the frames with it instead
+    std::vector<float>   stft_window;
+    whisper_fft_plan     stft_plan;
+    int                  stft_pad   = 64;
+    int                  stft_hop   = 0;
+    int                  stft_n_out = 0; // frames per window
+
+    // streaming state, see whisper_vad_feed()
+    std::vector<float>             stream_pending;       // samples of the incomplete window
+    int64_t                        stream_n_samples = 0; // samples consumed by complete windows
+    bool                           stream_speech    = false;
+    int64_t                        stream_silence   = -1; // start of the current silence inside speech
+    std::vector<whisper_vad_event> events;
+};
+
+struct whisper_vad_context_params whisper_vad_default_context_params(void) {
+    whisper_vad_context_params result = {
+        /*.n_thread                = */ 4,
+        /*.use_gpu                 = */ false,
+        /*.gpu_device              = */ 0,
+    };
+    return result;
+}
+
+struct whisper_vad_params whisper_vad_default_params(void) {
+    whisper_vad_params result = {
+        /* threshold               = */ 0.5f,
+        /* min_speech_duration_ms  = */ 250,
+        /* min_silence_duration_ms = */ 100,
+        /* max_speech_duration_s   = */ FLT_MAX,
+        /* speech_pad_ms           = */ 30,
+        /* samples_overlap         = */ 0.1,
+    };
+    return result;
+}
+
+// Time conversion utility functions for whisper VAD
+static int cs_to_samples(int64_t cs) {
+    return (int)((cs / 100.0) * WHISPER_SAMPLE_RATE + 0.5);
+}
+
+static int64_t samples_to_cs(int samples) {
+    return (int64_t)((samples / (double)WHISPER_SAMPLE_RATE) * 100.0 + 0.5);
+}
+
+static bool weight_buft_supported(const whisper_vad_hparams & hparams, ggml_tensor * w, ggml_op op, ggml_backend_buffer_type_t buft, ggml_backend_dev_t dev) {
+    bool op_supported = true;
+
+    if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU ||
+        ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_IGPU ||
+        (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU && buft == ggml_backend_cpu_buffer_type())) {
+        // GPU and default CPU backend support all operators
+        op_supported = true;
+    } else {
+        switch (op) {
+            // The current extra_buffer_type implementations only support GGML_OP_MUL_MAT
+            case GGML_OP_MUL_MAT: {
+                ggml_init_params params = {
+                    /*.mem_size   =*/ 2 * ggml_tensor_overhead(),
+                    /*.mem_buffer =*/ nullptr,
+                    /*.no_alloc   =*/ true,
+                };
+
+                ggml_context_ptr ctx_ptr { ggml_init(params) };
+                if (!ctx_ptr) {
+                    throw std::runtime_error("failed to create ggml context");
+                }
+                ggml_context * ctx = ctx_ptr.get();
+
+                ggml_tensor * op_tensor = nullptr;
+
+                int64_t n_ctx = hparams.lstm_hidden_size;
+                ggml_tensor * b = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, w->ne[0], n_ctx, w->ne[2], w->ne[3]);
+                op_tensor = ggml_mul_mat(ctx, w, b);
+
+                // create a temporary dummy buffer for the weight so that supports_op can check the buffer type
+                GGML_ASSERT(w->buffer == nullptr);
+                w->buffer = ggml_backend_buft_alloc_buffer(buft, 0);
+                op_supported = ggml_backend_dev_supports_op(dev, op_tensor);
+                ggml_backend_buffer_free(w->buffer);
+                w->buffer = nullptr;
+                break;
+            }
+            default: {
+                op_supported = false;
+                break;
+            }
+        };
+    }
+    return op_supported;
+}
+
+static ggml_backend_buffer_type_t select_weight_buft(const whisper_vad_hparams & hparams, ggml_tensor * w, ggml_op op, buft_list_t buft_list) {
+    GGML_ASSERT(!buft_list.empty());
+    for (const auto & p : buft_list) {
+        ggml_backend_dev_t dev = p.first;
+        ggml_backend_buffer_type_t buft = p.second;
+        if (weight_buft_supported(hparams, w, op, buft, dev)) {
+            return buft;
+        }
+    }
+
+    return nullptr;
+}
+
+// ggml_conv_1d() for a batch of n signals: the product it reshapes to
+// [OL, OC, N] is laid out as [OL, N, OC] in memory once N > 1, so return
+// it permuted instead. im2col only needs contiguous rows, so the next
+// layer can read the view directly.
+static ggml_tensor * whisper_vad_conv_1d(ggml_context * ctx0,
+        ggml_tensor * a, ggml_tensor * b, int s0, int p0, int d0) {
+    struct ggml_tensor * im2col = ggml_im2col(ctx0, a, b, s0, 0, p0, 0, d0, 0, false, GGML_TYPE_F16); // [N, OL, IC * K]
+
+    struct ggml_tensor * result =
+        ggml_mul_mat(ctx0,
+                ggml_reshape_2d(ctx0, im2col, im2col->ne[0], im2col->ne[2] * im2col->ne[1]),
+                ggml_reshape_2d(ctx0, a, a->ne[0] * a->ne[1], a->ne[2]));
+
+    result = ggml_reshape_3d(ctx0, result, im2col->ne[1], im2col->ne[2], a->ne[2]); // [OC, N, OL]
+
+    return ggml_permute(ctx0, result, 0, 2, 1, 3); // [N, OC, OL]
+}
+
+static ggml_tensor * whisper_vad_build_stft_layer(ggml_context * ctx0,
+        const whisper_vad_model & model, ggml_tensor * cur) {
+    // Apply reflective padding to the input tensor
+    ggml_tensor * padded = ggml_pad_reflect_1d(ctx0, cur, 64, 64);
+
+    struct ggml_tensor * stft = whisper_vad_conv_1d(ctx0, model.stft_forward_basis, padded, model.hparams.lstm_input_size, 0, 1);
+
+    // Calculate cutoff for real/imaginary parts
+    int cutoff = model.stft_forward_basis->ne[2] / 2;
+
+    // Extract real part (first half of the STFT output).
+    struct ggml_tensor * real_part = ggml_view_3d(ctx0, stft, stft->ne[0], cutoff, stft->ne[2], stft->nb[1], stft->nb[2], 0);
+    // Extract imaginary part (second half of the STFT output).
+    struct ggml_tensor * img_part = ggml_view_3d(ctx0, stft, stft->ne[0], cutoff, stft->ne[2], stft->nb[1], stft->nb[2], cutoff * stft->nb[1]);
+
+    // Calculate magnitude: sqrt(real^2 + imag^2)
+    struct ggml_tensor * real_squared = ggml_mul(ctx0, real_part, real_part);
+    struct ggml_tensor * img_squared  = ggml_mul(ctx0, img_part, img_part);
+    struct ggml_tensor * sum_squares  = ggml_add(ctx0, real_squared, img_squared);
+    struct ggml_tensor * magnitude    = ggml_sqrt(ctx0, sum_squares);
+    return magnitude;
+}
+
+static ggml_tensor * whisper_vad_build_encoder_layer(ggml_context * ctx0,
+        const whisper_vad_model & model, ggml_tensor * cur) {
+    // First Conv1D: expands to 128 channels.
+    cur = whisper_vad_conv_1d(ctx0, model.encoder_0_weight, cur, 1, 1, 1);
+    cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_0_bias, 1, 128, 1));
+    cur = ggml_relu(ctx0, cur);
+
+    // Second Conv1D: reduces to 64 channels.
+    cur = whisper_vad_conv_1d(ctx0, model.encoder_1_weight, cur, 2, 1, 1);
+    cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_1_bias, 1, 64, 1));
+    cur = ggml_relu(ctx0, cur);
+
+    // Third Conv1D: maintains 64 channels
+    cur = whisper_vad_conv_1d(ctx0, model.encoder_2_weight, cur, 2, 1, 1);
+    cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_2_bias, 1, 64, 1));
+    cur = ggml_relu(ctx0, cur);
+
+    // Fourth Conv1D: expands to 128 channels
+    cur = whisper_vad_conv_1d(ctx0, model.encoder_3_weight, cur, 1, 1, 1);
+    cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_3_bias, 1, 128, 1));
+    cur = ggml_relu(ctx0, cur);
+
+    return cur;
+}
+
+// Input-to-hidden gate preactivations for n_chunks windows at once. Only the
+// hidden-to-hidden part of the LSTM is sequential, see whisper_vad_lstm_step()
+static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx, int n_chunks) {
+    const auto & model = vctx.model;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ vctx.sched.meta.size(),
+        /*.mem_buffer =*/ vctx.sched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * cur = nullptr;
+    {
+        if (!vctx.stft_window.empty()) {
+            // magnitudes computed by whisper_vad_stft()
+            cur = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, vctx.stft_n_out, vctx.stft_plan.m + 1, n_chunks);
+            ggml_set_name(cur, "stft");
+            ggml_set_input(cur);
+        } else {
+            struct ggml_tensor * frames = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, vctx.n_window, 1, n_chunks);
+            ggml_set_name(frames, "frames");
+            ggml_set_input(frames);
+
+            cur = whisper_vad_build_stft_layer(ctx0, model, frames);
+        }
+
+        cur = whisper_vad_build_encoder_layer(ctx0, model, cur);
+
+        // Extract the first element of the first dimension of every chunk
+        // (equivalent to pytorch's [:, :, 0])
+        cur = ggml_view_3d(ctx0, cur, 1, cur->ne[1], n_chunks, cur->nb[1], cur->nb[2], 0);
+        cur = ggml_reshape_2d(ctx0, ggml_cont(ctx0, cur), cur->ne[1], n_chunks);
+
+        cur = ggml_mul_mat(ctx0, model.lstm_ih_weight, cur);
+        cur = ggml_add(ctx0, cur, model.lstm_ih_bias);
+        ggml_set_name(cur, "gates");
+        ggml_set_output(cur);
+    }
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static float whisper_vad_sigmoid(float x) {
+    return 1.0f / (1.0f + expf(-x));
+}
+
+// One LSTM step plus the final 1x1 conv for a chunk whose input gates were
+// computed by the graph; updates h_state/c_state and returns the probability
+static float whisper_vad_lstm_step(whisper_vad_context & vctx, const float * gates_ih, std::vector<float> & gates) {
+    const int hdim = vctx.model.hparams.lstm_hidden_size;
+
+    std::copy(vctx.lstm_hh_bias.begin(), vctx.lstm_hh_bias.end(), gates.begin());
+    for (int j = 0; j < hdim; ++j) {
+        const float h = vctx.h_state[j];
+        const float * w = vctx.lstm_hh_weight_t.data() + (size_t) j*4*hdim;
+        for (int k = 0; k < 4*hdim; ++k) {
+            gates[k] += w[k]*h;
+        }
+    }
+
+    float sum = vctx.final_conv_bias;
+    for (int j = 0; j < hdim; ++j) {
+        const float i_t = whisper_vad_sigmoid(gates_ih[0*hdim + j] + gates[0*hdim + j]);
+        const float f_t = whisper_vad_sigmoid(gates_ih[1*hdim + j] + gates[1*hdim + j]);
+        const float g_t = tanhf             (gates_ih[2*hdim + j] + gates[2*hdim + j]);
+        const float o_t = whisper_vad_sigmoid(gates_ih[3*hdim + j] + gates[3*hdim + j]);
+
+        vctx.c_state[j] = f_t*vctx.c_state[j] + i_t*g_t;
+        vctx.h_state[j] = o_t*tanhf(vctx.c_state[j]);
+
+        // the F16 conv weight used to round its input to half precision
+        const float x = ggml_fp16_to_fp32(ggml_fp32_to_fp16(std::max(0.0f, vctx.h_state[j])));
+        sum += x*vctx.final_conv_weight[j];
+    }
+
+    return whisper_vad_sigmoid(sum);
+}
+
+// The STFT basis of the model is a windowed DFT: row k < n/2 + 1 holds
+// w[i]*cos(2*pi*k*i/n) and row n/2 + 1 + k holds -w[i]*sin(2*pi*k*i/n). If it
+// matches, keep the window and take the magnitudes with an FFT on the host
+// instead of a [n, n + 2] convolution per frame in the graph
+static void whisper_vad_init_stft(whisper_vad_context * vctx) {
+    const auto & model = vctx->model;
+    const ggml_tensor * basis = model.stft_forward_basis;
+
+    const int n      = basis->ne[0];
+    const int n_bins = n/2 + 1;
+
+    if (basis->ne[1] != 1 || basis->ne[2] != 2*n_bins || n % 2 != 0) {
+        return;
+    }
+
+    std::vector<float> w((size_t) n*2*n_bins);
+    if (basis->type == GGML_TYPE_F16) {
+        std::vector<ggml_fp16_t> tmp(w.size());
+        ggml_backend_tensor_get(basis, tmp.data(), 0, ggml_nbytes(basis));
+        ggml_fp16_to_fp32_row(tmp.data(), w.data(), w.size());
+    } else if (basis->type == GGML_TYPE_F32) {
+        ggml_backend_tensor_get(basis, w.data(), 0, ggml_nbytes(basis));
+    } else {
+        return;
+    }
+
+    // row 0 is the window itself
+    std::vector<float> window(w.begin(), w.begin() + n);
+
+    float w_max = 0.0f;
+    for (float v : window) {
+        w_max = std::max(w_max, fabsf(v));
+    }
+    if (w_max == 0.0f) {
+        return; // e.g. an empty test model
+    }
+
+    // the basis is stored in half precision
+    const float tol = 2e-3f*w_max;
+
+    for (int k = 0; k < n_bins; ++k) {
+        const float * re = w.data() + (size_t) k*n;
+        const float * im = w.data() + (size_t) (n_bins + k)*n;
+        for (int i = 0; i < n; ++i) {
+            const double theta = 2.0*M_PI*(((int64_t) k*i) % n)/n;
+            if (fabsf(re[i] - window[i]*(float) cos(theta)) > tol ||
+                fabsf(im[i] + window[i]*(float) sin(theta)) > tol) {
+                WHISPER_LOG_WARN("%s: STFT basis is not a windowed DFT, using the convolution\n", __func__);
+                return;
+            }
+        }
+    }
+
+    vctx->stft_plan.init(n);
+    vctx->stft_hop    = model.hparams.lstm_input_size;
+    vctx->stft_n_out  = (vctx->n_window + 2*vctx->stft_pad - n)/vctx->stft_hop + 1;
+    vctx->stft_window = std::move(window);
+}
+
+// STFT magnitudes of n_chunks windows of n_window samples, laid out like the
+// output of whisper_vad_build_stft_layer(): [n_out, n_bins, n_chunks]
+static void whisper_vad_stft(const whisper_vad_context & vctx, const float * samples, int n_chunks, float * out) {
+    const whisper_fft_plan & plan = vctx.stft_plan;
+
+    const int n      = plan.n;
+    const int n_bins = plan.m + 1;
+    const int n_out  = vctx.stft_n_out;
+    const int pad    = vctx.stft_pad;
+    const int len    = vctx.n_window;
+
+    std::vector<float> padded(len + 2*pad);
+    std::vector<float> fft_in(n);
+    std::vector<float> fft_out(2*n_bins);
+    std::vector<float> fft_work(plan.work_size());
+
+    for (int c = 0; c < n_chunks; ++c) {
+        const float * x = samples + (size_t) c*len;
+
+        // reflect padding, same as ggml_pad_reflect_1d()
+        std::copy(x, x + len, padded.begin() + pad);
+        for (int i = 1; i <= pad; ++i) {
+            padded[pad - i]           = x[i];
+            padded[pad + len - 1 + i] = x[len - 1 - i];
+        }
+
+        float * dst = out + (size_t) c*n_bins*n_out;
+        for (int f = 0; f < n_out; ++f) {
+            const float * frame = padded.data() + (size_t) f*vctx.stft_hop;
+            for (int i = 0; i < n; ++i) {
+                fft_in[i] = frame[i]*vctx.stft_window[i];
+            }
+
+            plan.rfft(fft_in.data(), fft_out.data(), fft_work.data());
+
+            for (int k = 0; k < n_bins; ++k) {
+                const float re = fft_out[2*k + 0];
+                const float im = fft_out[2*k + 1];
+                dst[(size_t) k*n_out + f] = sqrtf(re*re + im*im);
+            }
+        }
+    }
+}
+
+static bool whisper_vad_init_context(whisper_vad_context * vctx) {
+
+    auto whisper_context_params = whisper_context_default_params();
+    // TODO: GPU VAD is forced disabled until the performance is improved
+    //whisper_context_params.use_gpu    = vctx->params.use_gpu;
+    whisper_context_params.use_gpu    = false;
+    whisper_context_params.gpu_device = vctx->params.gpu_device;
+
+    vctx->backends = whisper_backend_init(whisper_context_params);
+    if (vctx->backends.empty()) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        return false;
+    }
+
+    {
+        const auto & model = vctx->model;
+        const int hdim = model.hparams.lstm_hidden_size;
+
+        std::vector<float> hh((size_t) 4*hdim*hdim);
+        ggml_backend_tensor_get(model.lstm_hh_weight, hh.data(), 0, hh.size()*sizeof(float));
+
+        vctx->lstm_hh_weight_t.resize(hh.size());
+        for (int k = 0; k < 4*hdim; ++k) {
+            for (int j = 0; j < hdim; ++j) {
+                vctx->lstm_hh_weight_t[(size_t) j*4*hdim + k] = hh[(size_t) k*hdim + j];
+            }
+        }
+
+        vctx->lstm_hh_bias.resize(4*hdim);
+        ggml_backend_tensor_get(model.lstm_hh_bias, vctx->lstm_hh_bias.data(), 0, vctx->lstm_hh_bias.size()*sizeof(float));
+
+        std::vector<ggml_fp16_t> w(hdim);
+        ggml_backend_tensor_get(model.final_conv_weight, w.data(), 0, w.size()*sizeof(ggml_fp16_t));
+        vctx->final_conv_weight.resize(hdim);
+        ggml_fp16_to_fp32_row(w.data(), vctx->final_conv_weight.data(), hdim);
+
+        ggml_backend_tensor_get(model.final_conv_bias, &vctx->final_conv_bias, 0, sizeof(float));
+
+        vctx->h_state.assign(hdim, 0.0f);
+        vctx->c_state.assign(hdim, 0.0f);
+    }
+
+    whisper_vad_init_stft(vctx);
+
+    {
+        bool ok = whisper_sched_graph_init(vctx->sched, "vad", vctx->backends, nullptr,
+                [&]() {
+                    return whisper_vad_build_graph(*vctx, WHISPER_VAD_N_BATCH);
+                });
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init VAD allocator\n", __func__);
+            return false;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (VAD)   = %7.2f MB\n", __func__, whisper_sched_size(vctx->sched) / 1e6);
+    }
+
+    return true;
+}
+
+struct whisper_vad_context * whisper_vad_init_from_file_with_params(
+        const char * path_model,
+        struct whisper_vad_context_params params) {
+    WHISPER_LOG_INFO("%s: loading VAD model from '%s'\n", __func__, path_model);
+#ifdef _MSC_VER
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+    std::wstring path_model_wide = converter.from_bytes(path_model);
+    auto fin = std::ifstream(path_model_wide, std::ios::binary);
+#else
+    auto fin = std::ifstream(path_model, std::ios::binary);
+#endif
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to open VAD model '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+    loader.context = &fin;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->read((char *)output, read_size);
+        return read_size;
+    };
+
+    loader.eof = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        return fin->eof();
+    };
+
+    loader.close = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->close();
+    };
+
+    auto ctx = whisper_vad_init_with_params(&loader, params);
+    if (!ctx) {
+        whisper_vad_free(ctx);
+        return nullptr;
+    }
+    ctx->path_model = path_model;
+    return ctx;
+}
+
+struct whisper_vad_context * whisper_vad_init_with_params(
+            struct whisper_model_loader * loader,
+            struct whisper_vad_context_params params) {
+    // Read the VAD model
+    {
+        uint32_t magic;
+        read_safe(loader, magic);
+        if (magic != GGML_FILE_MAGIC) {
+            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
+            return nullptr;
+        }
+    }
+
+    whisper_vad_context * vctx = new whisper_vad_context;
+    vctx->n_threads = params.n_threads;
+    vctx->params.use_gpu = params.use_gpu;
+    vctx->params.gpu_device = params.gpu_device;
+
+    auto & model = vctx->model;
+    auto & hparams = model.hparams;
+
+    // load model context params.
+    {
+        int32_t str_len;
+        read_safe(loader, str_len);
+        std::vector<char> buffer(str_len + 1, 0);
+        loader->read(loader->context, buffer.data(), str_len);
+        std::string model_type(buffer.data(), str_len);
+        model.type = model_type;
+        WHISPER_LOG_INFO("%s: model type: %s\n", __func__, model.type.c_str());
+
+        int32_t major, minor, patch;
+        read_safe(loader, major);
+        read_safe(loader, minor);
+        read_safe(loader, patch);
+        std::string version_str = std::to_string(major) + "." +
+                                  std::to_string(minor) + "." +
+                                  std::to_string(patch);
+        model.version = version_str;
+        WHISPER_LOG_INFO("%s: model version: %s\n", __func__, model.version.c_str());
+
+        read_safe(loader, vctx->n_window);
+        read_safe(loader, vctx->n_context);
+    }
+
+    // load model hyper params (hparams).
+    {
+        read_safe(loader, hparams.n_encoder_layers);
+
+        hparams.encoder_in_channels = new int32_t[hparams.n_encoder_layers];
+        hparams.encoder_out_channels = new int32_t[hparams.n_encoder_layers];
+        hparams.kernel_sizes = new int32_t[hparams.n_encoder_layers];
+
+        for (int32_t i = 0; i < hparams.n_encoder_layers; i++) {
+            read_safe(loader, hparams.encoder_in_channels[i]);
+            read_safe(loader, hparams.encoder_out_channels[i]);
+            read_safe(loader, hparams.kernel_sizes[i]);
+        }
+
+        read_safe(loader, hparams.lstm_input_size);
+        read_safe(loader, hparams.lstm_hidden_size);
+        read_safe(loader, hparams.final_conv_in);
+        read_safe(loader, hparams.final_conv_out);
+
+        WHISPER_LOG_INFO("%s: n_encoder_layers = %d\n", __func__, hparams.n_encoder_layers);
+        for (int32_t i = 0; i < hparams.n_encoder_layers; i++) {
+            WHISPER_LOG_INFO("%s: encoder_in_channels[%d] = %d\n", __func__, i, hparams.encoder_in_channels[i]);
+        }
+        for (int32_t i = 0; i < hparams.n_encoder_layers; i++) {
+            WHISPER_LOG_INFO("%s: encoder_out_channels[%d] = %d\n", __func__, i, hparams.encoder_out_channels[i]);
+        }
+        WHISPER_LOG_INFO("%s: lstm_input_size = %d\n", __func__, hparams.lstm_input_size);
+        WHISPER_LOG_INFO("%s: lstm_hidden_size = %d\n", __func__, hparams.lstm_hidden_size);
+        WHISPER_LOG_INFO("%s: final_conv_in = %d\n", __func__, hparams.final_conv_in);
+        WHISPER_LOG_INFO("%s: final_conv_out = %d\n", __func__, hparams.final_conv_out);
+    }
+
+    // 1 STFT tensor, 4*2 encoder tensors, 4 LSTM tensors, 2 final output tensors
+    const size_t n_tensors = hparams.n_encoder_layers * 2 + 4 + 2 + 1;
+
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    auto get_ctx = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            ggml_init_params params = {
+                /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
+                /*.mem_buffer =*/ nullptr,
+                /*.no_alloc   =*/ true,
+            };
+
+            ggml_context * ctx = ggml_init(params);
+            if (!ctx) {
+                throw std::runtime_error("failed to create ggml context");
+            }
+
+            ctx_map[buft] = ctx;
+            model.ctxs.emplace_back(ctx);
+
+            return ctx;
+        }
+
+        return it->second;
+    };
+
+    whisper_context_params wparams = whisper_context_default_params();
+    wparams.use_gpu = params.use_gpu;
+    wparams.gpu_device = params.gpu_device;
+    buft_list_t buft_list = make_buft_list(wparams);
+
+    auto create_tensor = [&](vad_tensor type, ggml_tensor * meta) -> ggml_tensor * {
+        ggml_op op = VAD_TENSOR_OPS.at(type);
+        ggml_backend_buffer_type_t buft = select_weight_buft(hparams, meta, op, buft_list);
+        if (!buft) {
+            throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", VAD_TENSOR_NAMES.at(type)));
+        }
+        ggml_context * ctx = get_ctx(buft);
+        ggml_tensor * tensor = ggml_dup_tensor(ctx, meta);
+        model.tensors[VAD_TENSOR_NAMES.at(type)] = tensor;
+
+        return tensor;
+    };
+
+    // create tensors
+    {
+        ggml_init_params params = {
+            /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+
+        ggml_context * ctx = ggml_init(params);
+        const auto & hparams = model.hparams;
+
+        // SFTF precomputed basis matrix
+        model.stft_forward_basis = create_tensor(VAD_TENSOR_STFT_BASIS,
+            ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 256, 1, 258));
+
+        model.encoder_0_weight = create_tensor(VAD_TENSOR_ENC_0_WEIGHT,
+            ggml_new_tensor_3d(
+                ctx,
+                GGML_TYPE_F16,
+                hparams.kernel_sizes[0],
                 hparams.encoder_in_channels[0],
                 hparams.encoder_out_channels[0]
         ));
         model.encoder_0_bias = create_tensor(VAD_TENSOR_ENC_0_BIAS,
             ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hparams.encoder_out_channels[0]));
 
-        model.encoder_1_weight = create_tensor(VAD_TENSOR_ENC_1_WEIGHT,
-            ggml_new_tensor_3d(
-                ctx,
-                GGML_TYPE_F16,
-                hparams.kernel_sizes[1],
-                hparams.encoder_in_channels[1],
-                hparams.encoder_out_channels[1]
-        ));
-        model.encoder_1_bias = create_tensor(VAD_TENSOR_ENC_1_BIAS,
-            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hparams.encoder_out_channels[1]));
+        model.encoder_1_weight = create_tensor(VAD_TENSOR_ENC_1_WEIGHT,
+            ggml_new_tensor_3d(
+                ctx,
+                GGML_TYPE_F16,
+                hparams.kernel_sizes[1],
+                hparams.encoder_in_channels[1],
+                hparams.encoder_out_channels[1]
+        ));
+        model.encoder_1_bias = create_tensor(VAD_TENSOR_ENC_1_BIAS,
+            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hparams.encoder_out_channels[1]));
+
+        model.encoder_2_weight = create_tensor(VAD_TENSOR_ENC_2_WEIGHT,
+            ggml_new_tensor_3d(
+                ctx,
+                GGML_TYPE_F16,
+                hparams.kernel_sizes[2],
+                hparams.encoder_in_channels[2],
+                hparams.encoder_out_channels[2]
+        ));
+        model.encoder_2_bias = create_tensor(VAD_TENSOR_ENC_2_BIAS,
+            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hparams.encoder_out_channels[2]));
+
+        model.encoder_3_weight = create_tensor(VAD_TENSOR_ENC_3_WEIGHT,
+            ggml_new_tensor_3d(
+                ctx,
+                GGML_TYPE_F16,
+                hparams.kernel_sizes[3],
+                hparams.encoder_in_channels[3],
+                hparams.encoder_out_channels[3]
+        ));
+        model.encoder_3_bias = create_tensor(VAD_TENSOR_ENC_3_BIAS,
+                ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hparams.encoder_out_channels[3]));
+
+        // Hidden State dimension (input gate, forget gate, cell gate, output gate)
+        const int hstate_dim = hparams.lstm_hidden_size * 4;
+
+        // LSTM weights - input to hidden
+        model.lstm_ih_weight = create_tensor(
+            VAD_TENSOR_LSTM_WEIGHT_IH,
+            ggml_new_tensor_2d(ctx, GGML_TYPE_F32, hparams.lstm_hidden_size, hstate_dim)
+        );
+        model.lstm_ih_bias = create_tensor(
+            VAD_TENSOR_LSTM_BIAS_IH,
+            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hstate_dim)
+        );
+
+        // LSTM weights - hidden to hidden
+        model.lstm_hh_weight = create_tensor(
+            VAD_TENSOR_LSTM_WEIGHT_HH,
+            ggml_new_tensor_2d(ctx, GGML_TYPE_F32, hparams.lstm_hidden_size, hstate_dim)
+        );
+        model.lstm_hh_bias = create_tensor(
+            VAD_TENSOR_LSTM_BIAS_HH,
+            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hstate_dim)
+        );
+
+        // Final conv layer weight
+        model.final_conv_weight = create_tensor(
+            VAD_TENSOR_FINAL_CONV_WEIGHT,
+            ggml_new_tensor_2d(ctx, GGML_TYPE_F16, hparams.final_conv_in, 1)
+        );
+        model.final_conv_bias = create_tensor(
+            VAD_TENSOR_FINAL_CONV_BIAS,
+            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1)
+        );
+
+        ggml_free(ctx);
+    }
+
+    // allocate tensors in the backend buffers
+    for (auto & p : ctx_map) {
+        ggml_backend_buffer_type_t buft = p.first;
+        ggml_context * ctx = p.second;
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        if (buf) {
+            model.buffers.emplace_back(buf);
+
+            size_t size_main = ggml_backend_buffer_get_size(buf);
+            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), size_main / 1e6);
+        }
+    }
+
+    // load weights
+    {
+        size_t total_size = 0;
+        model.n_loaded = 0;
+        std::vector<char> read_buf;
+
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
+
+            read_safe(loader, n_dims);
+            read_safe(loader, length);
+            read_safe(loader, ttype);
+
+            if (loader->eof(loader->context)) {
+                break;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[4] = { 1, 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                read_safe(loader, ne[i]);
+                nelements *= ne[i];
+            }
+
+            std::string name;
+            std::vector<char> tmp(length);
+            loader->read(loader->context, &tmp[0], tmp.size());
+            name.assign(&tmp[0], tmp.size());
+
+            if (model.tensors.find(name) == model.tensors.end()) {
+                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                return nullptr;
+            }
+
+            auto tensor = model.tensors[name.data()];
+
+            if (ggml_nelements(tensor) != nelements) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                return nullptr;
+            }
+
+            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                return nullptr;
+            }
+
+            const size_t bpe = ggml_type_size(ggml_type(ttype));
+
+            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                return nullptr;
+            }
+
+            if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                // for the CPU and Metal backend, we can read directly into the tensor
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+            } else {
+                // read into a temporary buffer first, then copy to device memory
+                read_buf.resize(ggml_nbytes(tensor));
+
+                loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+            }
+
+            total_size += ggml_nbytes(tensor);
+            model.n_loaded++;
+        }
+
+        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
+
+        if (model.n_loaded == 0) {
+            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
+        } else if (model.n_loaded != (int) model.tensors.size()) {
+            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
+            return nullptr;
+        }
+
+    }
+
+    if (!whisper_vad_init_context(vctx)) {
+        whisper_vad_free(vctx);
+        return nullptr;
+    }
+
+    return vctx;
+}
+
+// Run n_chunks consecutive windows through the model starting from the
+// current LSTM state. The last window is zero-padded if n_samples is short.
+static bool whisper_vad_compute(
+        struct whisper_vad_context * vctx,
+        const float * samples,
+        int n_samples,
+        int n_chunks,
+        float * probs) {
+    if (n_chunks == 0) {
+        return true;
+    }
+
+    auto & sched = vctx->sched.sched;
+
+    // the feature extractor has no state, so it runs over a batch of chunks
+    // per graph launch and only the LSTM steps through them one by one
+    const int n_batch = std::min(n_chunks, WHISPER_VAD_N_BATCH);
+    const int n_gates = 4*vctx->model.hparams.lstm_hidden_size;
+
+    ggml_cgraph * gf = whisper_vad_build_graph(*vctx, n_batch);
+
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return false;
+    }
+
+    const bool use_fft = !vctx->stft_window.empty();
+
+    struct ggml_tensor * input   = ggml_graph_get_tensor(gf, use_fft ? "stft" : "frames");
+    struct ggml_tensor * t_gates = ggml_graph_get_tensor(gf, "gates");
+
+    std::vector<float> window((size_t) n_batch*vctx->n_window);
+    std::vector<float> stft(use_fft ? ggml_nelements(input) : 0);
+    std::vector<float> gates_ih((size_t) n_batch*n_gates);
+    std::vector<float> gates(n_gates);
+
+    // we are going to reuse the graph for every batch of chunks
+    const int64_t t_start_vad_us = ggml_time_us();
+
+    bool ok = true;
+
+    for (int i0 = 0; i0 < n_chunks; i0 += n_batch) {
+        const int n_cur = std::min(n_batch, n_chunks - i0);
+
+        // the last chunk of the input and the unused tail of the batch are zero-padded
+        const int idx_start = i0 * vctx->n_window;
+        const int idx_end   = std::min(idx_start + n_cur * vctx->n_window, n_samples);
+
+        std::copy(samples + idx_start, samples + idx_end, window.begin());
+        std::fill(window.begin() + (idx_end - idx_start), window.end(), 0.0f);
+
+        if (use_fft) {
+            whisper_vad_stft(*vctx, window.data(), n_cur, stft.data());
+            ggml_backend_tensor_set(input, stft.data(), 0, ggml_nbytes(input));
+        } else {
+            ggml_backend_tensor_set(input, window.data(), 0, ggml_nbytes(input));
+        }
+
+        // do not reset the scheduler - we will reuse the graph in the next batch
+        if (!ggml_graph_compute_helper(sched, gf, vctx->n_threads, vctx->threadpool, WHISPER_CPU_WORK_DECODE, false)) {
+            WHISPER_LOG_ERROR("%s: failed to compute VAD graph\n", __func__);
+            ok = false;
+            break;
+        }
+
+        ggml_backend_tensor_get(t_gates, gates_ih.data(), 0, (size_t) n_cur*n_gates*sizeof(float));
+
+        for (int i = 0; i < n_cur; ++i) {
+            probs[i0 + i] = whisper_vad_lstm_step(*vctx, gates_ih.data() + (size_t) i*n_gates, gates);
+        }
+    }
+
+    vctx->t_vad_us += ggml_time_us() - t_start_vad_us;
+    whisper_trace_add("vad", t_start_vad_us);
+
+    ggml_backend_sched_reset(sched);
+
+    return ok;
+}
+
+bool whisper_vad_detect_speech(
+        struct whisper_vad_context * vctx,
+        const float * samples,
+        int n_samples) {
+    int n_chunks = n_samples / vctx->n_window;
+    if (n_samples % vctx->n_window != 0) {
+        n_chunks += 1;  // Add one more chunk for remaining samples.
+    }
+
+    WHISPER_LOG_INFO("%s: detecting speech in %d samples\n", __func__, n_samples);
+    WHISPER_LOG_INFO("%s: n_chunks: %d\n", __func__, n_chunks);
+
+    // Reset LSTM hidden/cell states
+    whisper_vad_reset(vctx);
+
+    vctx->probs.resize(n_chunks);
+    WHISPER_LOG_INFO("%s: props size: %u\n", __func__, n_chunks);
+
+    if (!whisper_vad_compute(vctx, samples, n_samples, n_chunks, vctx->probs.data())) {
+        return false;
+    }
+
+    WHISPER_LOG_INFO("%s: vad time = %.2f ms processing %d samples\n", __func__, 1e-3f * vctx->t_vad_us, n_samples);
+
+    return true;
+}
+
+void whisper_vad_reset(struct whisper_vad_context * vctx) {
+    std::fill(vctx->h_state.begin(), vctx->h_state.end(), 0.0f);
+    std::fill(vctx->c_state.begin(), vctx->c_state.end(), 0.0f);
+
+    vctx->stream_pending.clear();
+    vctx->stream_n_samples = 0;
+    vctx->stream_speech    = false;
+    vctx->stream_silence   = -1;
+    vctx->events.clear();
+}
+
+int whisper_vad_feed(
+        struct whisper_vad_context * vctx,
+        struct whisper_vad_params    params,
+        const float * samples,
+        int n_samples) {
+    vctx->events.clear();
+
+    if (n_samples < 0 || (n_samples > 0 && samples == nullptr)) {
+        WHISPER_LOG_ERROR("%s: invalid number of samples %d\n", __func__, n_samples);
+        return -1;
+    }
+
+    const int n_window = vctx->n_window;
+
+    // complete the pending window first so the rest can be read in place
+    std::vector<float> & pending = vctx->stream_pending;
+    const int n_fill = std::min(n_samples, (int) (n_window - pending.size()));
+    pending.insert(pending.end(), samples, samples + n_fill);
+    samples   += n_fill;
+    n_samples -= n_fill;
+
+    const int n_head   = (int) pending.size() == n_window ? 1 : 0;
+    const int n_chunks = n_head + n_samples / n_window;
+
+    vctx->probs.resize(n_chunks);
+    if (n_chunks == 0) {
+        return 0;
+    }
+
+    if (n_head && !whisper_vad_compute(vctx, pending.data(), n_window, 1, vctx->probs.data())) {
+        return -1;
+    }
+    if (!whisper_vad_compute(vctx, samples, n_samples, n_chunks - n_head, vctx->probs.data() + n_head)) {
+        return -1;
+    }
+
+    pending.assign(samples + (n_chunks - n_head)*n_window, samples + n_samples);
+
+    // same hysteresis as whisper_vad_segments_from_probs(): speech starts above
+    // the threshold and ends after min_silence_duration_ms below threshold - 0.15
+    const float   neg_threshold       = std::max(0.01f, params.threshold - 0.15f);
+    const int64_t min_silence_samples = (int64_t) WHISPER_SAMPLE_RATE * params.min_silence_duration_ms / 1000;
+
+    for (int i = 0; i < n_chunks; ++i) {
+        const float   p      = vctx->probs[i];
+        const int64_t sample = vctx->stream_n_samples + (int64_t) i*n_window;
+
+        if (p >= params.threshold) {
+            vctx->stream_silence = -1;
+            if (!vctx->stream_speech) {
+                vctx->stream_speech = true;
+                vctx->events.push_back({ WHISPER_VAD_EVENT_SPEECH_START, sample });
+            }
+        } else if (vctx->stream_speech && p < neg_threshold) {
+            if (vctx->stream_silence < 0) {
+                vctx->stream_silence = sample;
+            }
+            if (sample + n_window - vctx->stream_silence >= min_silence_samples) {
+                vctx->stream_speech = false;
+                vctx->events.push_back({ WHISPER_VAD_EVENT_SPEECH_END, vctx->stream_silence });
+                vctx->stream_silence = -1;
+            }
+        }
+    }
+
+    vctx->stream_n_samples += (int64_t) n_chunks*n_window;
+
+    return n_chunks;
+}
+
+int whisper_vad_n_events(struct whisper_vad_context * vctx) {
+    return vctx->events.size();
+}
+
+enum whisper_vad_event_type whisper_vad_get_event_type(struct whisper_vad_context * vctx, int i_event) {
+    return vctx->events[i_event].type;
+}
+
+int64_t whisper_vad_get_event_sample(struct whisper_vad_context * vctx, int i_event) {
+    return vctx->events[i_event].sample;
+}
+
+int whisper_vad_segments_n_segments(struct whisper_vad_segments * segments) {
+    return segments->data.size();
+}
+
+float whisper_vad_segments_get_segment_t0(struct whisper_vad_segments * segments, int i_segment) {
+    return segments->data[i_segment].start;
+}
+
+float whisper_vad_segments_get_segment_t1(struct whisper_vad_segments * segments, int i_segment) {
+    return segments->data[i_segment].end;
+}
+
+int whisper_vad_n_probs(struct whisper_vad_context * vctx) {
+    return vctx->probs.size();
+}
+
+float * whisper_vad_probs(struct whisper_vad_context * vctx) {
+    return vctx->probs.data();
+}
+
+struct whisper_vad_segments * whisper_vad_segments_from_probs(
+        struct whisper_vad_context *  vctx,
+                whisper_vad_params    params) {
+    WHISPER_LOG_INFO("%s: detecting speech timestamps using %d probabilities\n", __func__, whisper_vad_n_probs(vctx));
+
+    int     n_probs                 = whisper_vad_n_probs(vctx);
+    float * probs                   = whisper_vad_probs(vctx);
+    float   threshold               = params.threshold;
+    int     min_speech_duration_ms  = params.min_speech_duration_ms;
+    int     min_silence_duration_ms = params.min_silence_duration_ms;
+    float   max_speech_duration_s   = params.max_speech_duration_s;
+    int     speech_pad_ms           = params.speech_pad_ms;
+    int     n_window                = vctx->n_window;
+    int     sample_rate             = WHISPER_SAMPLE_RATE;
+    int     min_silence_samples     = sample_rate * min_silence_duration_ms / 1000;
+    int     audio_length_samples    = n_probs * n_window;
+
+    // Min number of samples to be considered valid speech.
+    int     min_speech_samples      = sample_rate * min_speech_duration_ms / 1000;
+    int     speech_pad_samples      = sample_rate * speech_pad_ms / 1000;
+
+    // Max number of samples that a speech segment can contain before it is
+    // split into multiple segments.
+    int max_speech_samples;
+    if (max_speech_duration_s > 100000.0f) {
+        max_speech_samples = INT_MAX / 2;
+    } else {
+        int64_t temp = (int64_t)sample_rate * (int64_t)(max_speech_duration_s) - n_window - 2 * speech_pad_samples;
+        max_speech_samples = (temp > INT_MAX) ? INT_MAX / 2 : (int)temp;
+        if (max_speech_samples < 0) {
+            max_speech_samples = INT_MAX / 2;
+        }
+    }
+    // Detect silence period that exceeds this value, then that location (sample)
+    // is marked as a potential place where the segment could be split if
+    // max_speech_samples is reached. The value 98 was taken from the original
+    // silaro-vad python implementation:
+    //https://github.com/snakers4/silero-vad/blob/0dd45f0bcd7271463c234f3bae5ad25181f9df8b/src/silero_vad/utils_vad.py#L291
+    int min_silence_samples_at_max_speech = sample_rate * 98 / 1000;
+
+    // Calculate lower threshold for detecting end of speech segments.
+    float neg_threshold = threshold - 0.15f;
+    if (neg_threshold < 0.01f) {
+        neg_threshold = 0.01f;
+    }
+
+    struct speech_segment_t {
+        int start;
+        int end;
+    };
+
+    std::vector<speech_segment_t> speeches;
+    speeches.reserve(256);
+
+    bool is_speech_segment = false;
+    int  temp_end          = 0;
+    int  prev_end          = 0;
+    int  next_start        = 0;
+    int  curr_speech_start = 0;
+    bool has_curr_speech   = false;
+
+    for (int i = 0; i < n_probs; i++) {
+        float curr_prob   = probs[i];
+        int   curr_sample = n_window * i;
+
+        // Reset temp_end when we get back to speech
+        if ((curr_prob >= threshold) && temp_end) {
+            temp_end = 0;
+            if (next_start < prev_end) {
+                next_start = curr_sample;
+            }
+        }
+
+        // Start a new speech segment when probability exceeds threshold and not already in speech
+        if ((curr_prob >= threshold) && !is_speech_segment) {
+            is_speech_segment = true;
+            curr_speech_start = curr_sample;
+            has_curr_speech = true;
+            continue;
+        }
+
+        // Handle maximum speech duration
+        if (is_speech_segment && (curr_sample - curr_speech_start) > max_speech_samples) {
+            if (prev_end) {
+                speeches.push_back({ curr_speech_start, prev_end });
+                has_curr_speech = true;
+
+                if (next_start < prev_end) {  // Previously reached silence and is still not speech
+                    is_speech_segment = false;
+                    has_curr_speech = false;
+                } else {
+                    curr_speech_start = next_start;
+                }
+                prev_end = next_start = temp_end = 0;
+            } else {
+                speeches.push_back({ curr_speech_start, curr_sample });
+
+                prev_end = next_start = temp_end = 0;
+                is_speech_segment = false;
+                has_curr_speech = false;
+                continue;
+            }
+        }
+
+        // Handle silence after speech
+        if ((curr_prob < neg_threshold) && is_speech_segment) {
+            if (!temp_end) {
+                temp_end = curr_sample;
+            }
+
+            // Track potential segment ends for max_speech handling
+            if ((curr_sample - temp_end) > min_silence_samples_at_max_speech) {
+                prev_end = temp_end;
+            }
+
+            // Check if silence is long enough to end the segment
+            if ((curr_sample - temp_end) < min_silence_samples) {
+                continue;
+            } else {
+                // End the segment if it's long enough
+                if ((temp_end - curr_speech_start) > min_speech_samples) {
+                    speeches.push_back({ curr_speech_start, temp_end });
+                }
+
+                prev_end = next_start = temp_end = 0;
+                is_speech_segment = false;
+                has_curr_speech = false;
+                continue;
+            }
+        }
+    }
+
+    // Handle the case if we're still in a speech segment at the end
+    if (has_curr_speech && (audio_length_samples - curr_speech_start) > min_speech_samples) {
+        speeches.push_back({ curr_speech_start, audio_length_samples });
+    }
+
+    // Merge adjacent segments with small gaps in between (post-processing)
+    if (speeches.size() > 1) {
+        int merged_count = 0;
+        for (int i = 0; i < (int) speeches.size() - 1; i++) {
+            // Define maximum gap allowed for merging (e.g., 200ms converted to samples)
+            int max_merge_gap_samples = sample_rate * 200 / 1000;
+
+            // If the gap between this segment and the next is small enough
+            if (speeches[i+1].start - speeches[i].end < max_merge_gap_samples) {
+                // Merge by extending current segment to the end of next segment
+                speeches[i].end = speeches[i+1].end;
+                speeches.erase(speeches.begin() + i + 1);
+
+                i--;
+                merged_count++;
+            }
+        }
+        WHISPER_LOG_INFO("%s: Merged %d adjacent segments, now have %d segments\n",
+                         __func__, merged_count, (int) speeches.size());
+    }
+
+    // Double-check for minimum speech duration
+    for (int i = 0; i < (int) speeches.size(); i++) {
+        if (speeches[i].end - speeches[i].start < min_speech_samples) {
+            WHISPER_LOG_INFO("%s: Removing segment %d (too short: %d samples)\n",
+                            __func__, i, speeches[i].end - speeches[i].start);
+
+            speeches.erase(speeches.begin() + i);
+            i--;
+        }
+    }
+
+    WHISPER_LOG_INFO("%s: Final speech segments after filtering: %d\n", __func__, (int) speeches.size());
+
+    // Allocate final segments
+    std::vector<whisper_vad_segment> segments;
+    if (speeches.size() > 0) {
+        try {
+            segments.resize(speeches.size());
+        } catch (const std::bad_alloc &) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for final segments\n", __func__);
+            return nullptr;
+        }
+    }
+
+    // Apply padding to segments and copy to final segments
+    for (int i = 0; i < (int) speeches.size(); i++) {
+        // Apply padding to the start of the first segment
+        if (i == 0) {
+            speeches[i].start =
+                (speeches[i].start > speech_pad_samples) ?
+                (speeches[i].start - speech_pad_samples) : 0;
+        }
+
+        // Handle spacing between segments
+        if (i < (int) speeches.size() - 1) {
+            int silence_duration = speeches[i+1].start - speeches[i].end;
+
+            if (silence_duration < 2 * speech_pad_samples) {
+                // If segments are close, split the difference
+                speeches[i].end += silence_duration / 2;
+                speeches[i+1].start =
+                    (speeches[i+1].start > silence_duration / 2) ?
+                    (speeches[i+1].start - silence_duration / 2) : 0;
+            } else {
+                // Otherwise, apply full padding to both
+                speeches[i].end =
+                    (speeches[i].end + speech_pad_samples < audio_length_samples) ?
+                    (speeches[i].end + speech_pad_samples) : audio_length_samples;
+                speeches[i+1].start =
+                    (speeches[i+1].start > speech_pad_samples) ?
+                    (speeches[i+1].start - speech_pad_samples) : 0;
+            }
+        } else {
+            // Apply padding to the end of the last segment
+            speeches[i].end =
+                (speeches[i].end + speech_pad_samples < audio_length_samples) ?
+                (speeches[i].end + speech_pad_samples) : audio_length_samples;
+        }
+
+        // Convert from samples to centiseconds
+        segments[i].start = samples_to_cs(speeches[i].start);
+        segments[i].end   = samples_to_cs(speeches[i].end);
+
+        WHISPER_LOG_INFO("%s: VAD segment %d: start = %.2f, end = %.2f (duration: %.2f)\n",
+                        __func__, i, segments[i].start/100.0, segments[i].end/100.0, (segments[i].end - segments[i].start)/100.0);
+    }
+
+    whisper_vad_segments * vad_segments = new whisper_vad_segments;
+    if (vad_segments == NULL) {
+        WHISPER_LOG_ERROR("%s: failed to allocate memory for whisper_vad_segments\n", __func__);
+        return nullptr;
+    }
+
+    vad_segments->data = std::move(segments);
+
+    return vad_segments;
+}
+
+struct whisper_vad_segments * whisper_vad_segments_from_samples(
+        whisper_vad_context * vctx,
+        whisper_vad_params params,
+        const float * samples,
+        int n_samples) {
+    WHISPER_LOG_INFO("%s: detecting speech timestamps in %d samples\n", __func__, n_samples);
+    if (!whisper_vad_detect_speech(vctx, samples, n_samples)) {
+        WHISPER_LOG_ERROR("%s: failed to detect speech\n", __func__);
+        return nullptr;
+    }
+    return whisper_vad_segments_from_probs(vctx, params);
+}
+
+void whisper_vad_free(whisper_vad_context * ctx) {
+    if (ctx) {
+        for (ggml_context * context : ctx->model.ctxs) {
+            ggml_free(context);
+        }
+
+        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
+            ggml_backend_buffer_free(buf);
+        }
+
+        ggml_backend_sched_free(ctx->sched.sched);
+
+        for (auto & backend : ctx->backends) {
+            ggml_backend_free(backend);
+        }
+
+        whisper_threadpool_free(ctx->threadpool);
+
+        delete[] ctx->model.hparams.encoder_in_channels;
+        delete[] ctx->model.hparams.encoder_out_channels;
+        delete[] ctx->model.hparams.kernel_sizes;
+
+        delete ctx;
+    }
+}
+
+void whisper_vad_free_segments(whisper_vad_segments * segments) {
+    if (segments) {
+        delete segments;
+    }
+}
+
+struct whisper_metrics whisper_get_metrics_from_state(struct whisper_state * state) {
+    whisper_metrics m = {};
+
+    m.t_mel_us    = state->t_mel_us;
+    m.t_sample_us = state->t_sample_us;
+    m.t_encode_us = state->t_encode_us;
+    m.t_decode_us = state->t_decode_us;
+    m.t_batchd_us = state->t_batchd_us;
+    m.t_prompt_us = state->t_prompt_us;
+    m.t_vad_us    = state->vad_context ? state->vad_context->t_vad_us : 0;
+
+    m.n_sample = state->n_sample;
+    m.n_encode = state->n_encode;
+    m.n_decode = state->n_decode;
+    m.n_batchd = state->n_batchd;
+    m.n_prompt = state->n_prompt;
+    m.n_fail_p = state->n_fail_p;
+    m.n_fail_h = state->n_fail_h;
+
+    m.n_splits_encode = state->n_splits_encode;
+    m.n_splits_decode = state->n_splits_decode;
+
+    m.encode = state->h_encode;
+    m.decode = state->h_decode;
+    m.token  = state->h_token;
+    m.alloc  = state->h_alloc;
+
+    return m;
+}
+
+struct whisper_metrics whisper_get_metrics(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        return whisper_metrics {};
+    }
+    return whisper_get_metrics_from_state(ctx->state);
+}
+
+void whisper_reset_metrics_from_state(struct whisper_state * state) {
+    state->t_mel_us = 0;
+    state->t_sample_us = 0;
+    state->t_encode_us = 0;
+    state->t_decode_us = 0;
+    state->t_batchd_us = 0;
+    state->t_prompt_us = 0;
+    state->n_sample = 0;
+    state->n_encode = 0;
+    state->n_decode = 0;
+    state->n_batchd = 0;
+    state->n_prompt = 0;
+    state->n_fail_p = 0;
+    state->n_fail_h = 0;
+
+    state->h_encode = {};
+    state->h_decode = {};
+    state->h_token  = {};
+    state->h_alloc  = {};
+
+    if (state->vad_context) {
+        state->vad_context->t_vad_us = 0;
+    }
+}
+
+//////////////////////////////////
+// Grammar - ported from llama.cpp
+//////////////////////////////////
+
+// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
+// pointer. If an invalid sequence is encountered, returns `whisper_partial_utf8.n_remain == -1`.
+static std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
+        const char         * src,
+        whisper_partial_utf8   partial_start) {
+    static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    const char          * pos      = src;
+    std::vector<uint32_t> code_points;
+    uint32_t              value    = partial_start.value;
+    int                   n_remain = partial_start.n_remain;
+
+    // continue previous decode, if applicable
+    while (*pos != 0 && n_remain > 0) {
+        uint8_t next_byte = static_cast<uint8_t>(*pos);
+        if ((next_byte >> 6) != 2) {
+            // invalid sequence, abort
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, -1 });
+        }
+        value = (value << 6) + (next_byte & 0x3F);
+        ++pos;
+        --n_remain;
+    }
+
+    if (partial_start.n_remain > 0 && n_remain == 0) {
+        code_points.push_back(value);
+    }
+
+    // decode any subsequent utf-8 sequences, which may end in an incomplete one
+    while (*pos != 0) {
+        uint8_t  first_byte = static_cast<uint8_t>(*pos);
+        uint8_t  highbits   = first_byte >> 4;
+                 n_remain   = lookup[highbits] - 1;
+
+        if (n_remain < 0) {
+            // invalid sequence, abort
+            code_points.clear();
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, n_remain });
+        }
+
+        uint8_t  mask       = (1 << (7 - n_remain)) - 1;
+                 value      = first_byte & mask;
+        ++pos;
+        while (*pos != 0 && n_remain > 0) {
+            value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
+            ++pos;
+            --n_remain;
+        }
+        if (n_remain == 0) {
+            code_points.push_back(value);
+        }
+    }
+    code_points.push_back(0);
+
+    return std::make_pair(std::move(code_points), whisper_partial_utf8{ value, n_remain });
+}
+
+// returns true iff pos points to the end of one of the definitions of a rule
+static bool whisper_grammar_is_end_of_sequence(const whisper_grammar_element * pos) {
+    switch (pos->type) {
+        case WHISPER_GRETYPE_END: return true;  // NOLINT
+        case WHISPER_GRETYPE_ALT: return true;  // NOLINT
+        default:                return false;
+    }
+}
+
+// returns true iff chr satisfies the char range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static std::pair<bool, const whisper_grammar_element *> whisper_grammar_match_char(
+        const whisper_grammar_element * pos,
+        const uint32_t                chr) {
+
+    bool found            = false;
+    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+
+    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT); // NOLINT
+
+    do {
+        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            found = found || (pos->value <= chr && chr <= pos[1].value);
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            found = found || pos->value == chr;
+            pos += 1;
+        }
+    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+
+    return std::make_pair(found == is_positive_char, pos);
+}
+
+// returns true iff some continuation of the given partial UTF-8 sequence could satisfy the char
+// range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static bool whisper_grammar_match_partial_char(
+        const whisper_grammar_element * pos,
+        const whisper_partial_utf8      partial_utf8) {
+
+    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT);
+
+    uint32_t partial_value = partial_utf8.value;
+    int      n_remain      = partial_utf8.n_remain;
+
+    // invalid sequence or 7-bit char split across 2 bytes (overlong)
+    if (n_remain < 0 || (n_remain == 1 && partial_value < 2)) {
+        return false;
+    }
+
+    // range of possible code points this partial UTF-8 sequence could complete to
+    uint32_t low  = partial_value << (n_remain * 6);
+    uint32_t high = low | ((1 << (n_remain * 6)) - 1);
+
+    if (low == 0) {
+        if (n_remain == 2) {
+            low = 1 << 11;
+        } else if (n_remain == 3) {
+            low = 1 << 16;
+        }
+    }
+
+    do {
+        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            if (pos->value <= high && low <= pos[1].value) {
+                return is_positive_char;
+            }
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            if (low <= pos->value && pos->value <= high) {
+                return is_positive_char;
+            }
+            pos += 1;
+        }
+    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+
+    return !is_positive_char;
+}
+
+
+// transforms a grammar pushdown stack into N possible stacks, all ending
+// at a character range (terminal element)
+static void whisper_grammar_advance_stack(
+        const std::vector<std::vector<whisper_grammar_element>>   & rules,
+        const std::vector<const whisper_grammar_element *>        & stack,
+        std::vector<std::vector<const whisper_grammar_element *>> & new_stacks) {
+
+    if (stack.empty()) {
+        new_stacks.emplace_back();
+        return;
+    }
+
+    const whisper_grammar_element * pos = stack.back();
+
+    switch (pos->type) {
+        case WHISPER_GRETYPE_RULE_REF: {
+            const size_t                  rule_id = static_cast<size_t>(pos->value);
+            const whisper_grammar_element * subpos  = rules[rule_id].data();
+            do {
+                // init new stack without the top (pos)
+                std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
+                if (!whisper_grammar_is_end_of_sequence(pos + 1)) {
+                    // if this rule ref is followed by another element, add that to stack
+                    new_stack.push_back(pos + 1);
+                }
+                if (!whisper_grammar_is_end_of_sequence(subpos)) {
+                    // if alternate is nonempty, add to stack
+                    new_stack.push_back(subpos);
+                }
+                whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+                while (!whisper_grammar_is_end_of_sequence(subpos)) {
+                    // scan to end of alternate def
+                    subpos++;
+                }
+                if (subpos->type == WHISPER_GRETYPE_ALT) {
+                    // there's another alternate def of this rule to process
+                    subpos++;
+                } else {
+                    break;
+                }
+            } while (true);
+            break;
+        }
+        case WHISPER_GRETYPE_CHAR:
+        case WHISPER_GRETYPE_CHAR_NOT:
+            new_stacks.push_back(stack);
+            break;
+        default:
+            // end of alternate (WHISPER_GRETYPE_END, WHISPER_GRETYPE_ALT) or middle of char range
+            // (WHISPER_GRETYPE_CHAR_ALT, WHISPER_GRETYPE_CHAR_RNG_UPPER); stack should never be left on
+            // those
+            WHISPER_ASSERT(false);
+    }
+}
+
+// takes a set of possible pushdown stacks on a grammar, which are required to
+// be positioned at a character range (see `whisper_grammar_advance_stack`), and
+// produces the N possible stacks if the given char is accepted at those
+// positions
+static std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const uint32_t                                                  chr) {
+
+    std::vector<std::vector<const whisper_grammar_element *>> new_stacks;
+
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            continue;
+        }
+
+        auto match = whisper_grammar_match_char(stack.back(), chr);
+        if (match.first) {
+            const whisper_grammar_element * pos = match.second;
+
+            // update top of stack to next element, if any
+            std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
+            if (!whisper_grammar_is_end_of_sequence(pos)) {
+                new_stack.push_back(pos);
+            }
+            whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+        }
+    }
+
+    return new_stacks;
+}
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates);
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates_for_stack(
+        const std::vector<std::vector<whisper_grammar_element>> & rules,
+        const std::vector<const whisper_grammar_element *>      & stack,
+        const std::vector<whisper_grammar_candidate>            & candidates) {
+
+    std::vector<whisper_grammar_candidate> rejects;
+
+    if (stack.empty()) {
+        for (auto tok : candidates) {
+            if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
+                rejects.push_back(tok);
+            }
+        }
+        return rejects;
+    }
+
+    const whisper_grammar_element * stack_pos = stack.back();
+
+    std::vector<whisper_grammar_candidate> next_candidates;
+    for (auto tok : candidates) {
+        if (*tok.code_points == 0) {
+            // reached end of full codepoints in token, reject iff it ended in a partial sequence
+            // that cannot satisfy this position in grammar
+            if (tok.partial_utf8.n_remain != 0 && !whisper_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
+                rejects.push_back(tok);
+            }
+        } else if (whisper_grammar_match_char(stack_pos, *tok.code_points).first) {
+            next_candidates.push_back({ tok.id, tok.code_points + 1, tok.partial_utf8 });
+        } else {
+            rejects.push_back(tok);
+        }
+    }
+
+    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
+
+    // update top of stack to next element, if any
+    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
+        stack_after.push_back(stack_pos_after);
+    }
+    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
+    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
+
+    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
+    for (auto tok : next_rejects) {
+        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
+    }
+
+    return rejects;
+}
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates) {
+    if (candidates.empty() || stacks.empty()) {
+        return std::vector<whisper_grammar_candidate>();
+    }
+
+    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+
+    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
+        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+    }
+    return rejects;
+}
+
+static struct whisper_grammar whisper_grammar_init(
+            const whisper_grammar_element ** rules,
+                                 size_t      n_rules,
+                                 size_t      i_start_rule) {
+    const whisper_grammar_element * pos;
+
+    // copy rule definitions into vectors
+    std::vector<std::vector<whisper_grammar_element>> vec_rules(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
+            vec_rules[i].push_back(*pos);
+        }
+        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
+    }
+
+    // loop over alternates of start rule to build initial stacks
+    std::vector<std::vector<const whisper_grammar_element *>> stacks;
+    pos = vec_rules[i_start_rule].data();
+    do {
+        std::vector<const whisper_grammar_element *> stack;
+        if (!whisper_grammar_is_end_of_sequence(pos)) {
+            // if alternate is nonempty, add to stack
+            stack.push_back(pos);
+        }
+        whisper_grammar_advance_stack(vec_rules, stack, stacks);
+        while (!whisper_grammar_is_end_of_sequence(pos)) {
+            // scan to end of alternate def
+            pos++;
+        }
+        if (pos->type == WHISPER_GRETYPE_ALT) {
+            // there's another alternate def of this rule to process
+            pos++;
+        } else {
+            break;
+        }
+    } while (true);
+
+    return { std::make_shared<const std::vector<std::vector<whisper_grammar_element>>>(std::move(vec_rules)), std::move(stacks), {} };
+}
+
+static void whisper_suppress_invalid_grammar(
+             whisper_context  & ctx,
+               whisper_state  & state,
+    const whisper_full_params & params,
+           std::vector<float> & logits,
+    const     whisper_grammar & grammar) {
+
+    if (!grammar.rules || grammar.stacks.empty()) {
+        return;
+    }
+
+    const whisper_token eot = whisper_token_eot(&ctx);
+
+    auto & cache = state.grammar_cache;
+
+    // without pending bytes every token decodes the same way, whatever was accepted before
+    const bool pending = grammar.partial_utf8.n_remain > 0;
+
+    whisper_grammar_key key(grammar.stacks, pending ? grammar.partial_utf8.value : 0, pending ? grammar.partial_utf8.n_remain : 0);
+
+    std::shared_ptr<const std::vector<uint64_t>> mask;
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        if (cache.rules != grammar.rules) {
+            cache.rules = grammar.rules;
+            cache.rejects.clear();
+        }
+
+        if (cache.code_offset.empty()) {
+            cache.code_offset.resize(eot);
+            cache.code_partial.resize(eot);
+            for (whisper_token id = 0; id < eot; ++id) {
+                const auto decoded = decode_utf8(ctx.vocab.token_str(id), { 0, 0 });
+                cache.code_offset[id]  = cache.code_points.size();
+                cache.code_partial[id] = decoded.second;
+                cache.code_points.insert(cache.code_points.end(), decoded.first.begin(), decoded.first.end());
+            }
+        }
+
+        const auto it = cache.rejects.find(key);
+        if (it != cache.rejects.end()) {
+            mask = it->second;
+        }
+    }
+
+    if (!mask) {
+        std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
+        std::vector<whisper_grammar_candidate>                              candidates_grammar;
+
+        if (pending) {
+            candidates_decoded.reserve(eot);
+        }
+
+        for (whisper_token id = 0; id < eot; ++id) {
+            if (ctx.vocab.token_len(id) == 0) {
+                continue;
+            }
+            if (pending) {
+                candidates_decoded.push_back(decode_utf8(ctx.vocab.token_str(id), grammar.partial_utf8));
+                candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+            } else {
+                candidates_grammar.push_back({ id, cache.code_points.data() + cache.code_offset[id], cache.code_partial[id] });
+            }
+        }
+
+        const auto rejects = whisper_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar);
+
+        auto bits = std::make_shared<std::vector<uint64_t>>((eot + 63)/64, 0);
+        for (const auto & reject : rejects) {
+            (*bits)[reject.id/64] |= uint64_t(1) << (reject.id%64);
+        }
+        mask = bits;
+
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        // recursive grammars can reach any number of parse states
+        if (cache.rejects.size() >= 1024) {
+            cache.rejects.clear();
+        }
+        cache.rejects.emplace(std::move(key), mask);
+    }
+
+    for (whisper_token id = 0; id < eot; ++id) {
+        if (((*mask)[id/64] >> (id%64)) & 1) {
+            logits[id] -= params.grammar_penalty;
+        }
+    }
+}
+
+static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
+    if (!grammar.rules || grammar.stacks.empty()) {
+        return;
+    }
+
+    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.token_str(token));
+
+    const char * text = ctx.vocab.token_str(token);
+
+    if (strncmp(text, "[_", 2) == 0) {
+        // fprintf(stderr, " (skipped)\n");
+        return;
+    }
+    // fprintf(stderr, "\n");
+
+    // Note terminating 0 in decoded string
+    const auto   decoded     = decode_utf8(text, grammar.partial_utf8);
+    const auto & code_points = decoded.first;
+    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
+        grammar.stacks = whisper_grammar_accept(*grammar.rules, grammar.stacks, *it);
+    }
+    grammar.partial_utf8 = decoded.second;
+}
+
+//////////////
+// END grammar
+//////////////
+
+////////////////////////////////////////////////////////////////////////////
+
+struct whisper_context_params * whisper_context_default_params_by_ref(void) {
+    struct whisper_context_params params = whisper_context_default_params();
+
+    struct whisper_context_params* result = new whisper_context_params();
+    *result = params;
+    return result;
+}
+
+struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params params = whisper_full_default_params(strategy);
+
+    struct whisper_full_params* result = new whisper_full_params();
+    *result = params;
+    return result;
+}
+
+struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params result = {
+        /*.strategy          =*/ strategy,
+
+        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.n_max_text_ctx    =*/ 16384,
+        /*.offset_ms         =*/ 0,
+        /*.duration_ms       =*/ 0,
+
+        /*.chunk_ms          =*/ 0,
+        /*.chunk_stride_ms   =*/ 0,
+        /*.parallel_overlap_ms =*/ 4000,
+
+        /*.translate         =*/ false,
+        /*.no_context        =*/ true,
+        /*.resume            =*/ false,
+        /*.no_timestamps     =*/ false,
+        /*.single_segment    =*/ false,
+        /*.print_special     =*/ false,
+        /*.print_progress    =*/ true,
+        /*.print_realtime    =*/ false,
+        /*.print_timestamps  =*/ true,
+
+        /*.token_timestamps  =*/ false,
+        /*.thold_pt          =*/ 0.01f,
+        /*.thold_ptsum       =*/ 0.01f,
+        /*.max_len           =*/ 0,
+        /*.split_on_word     =*/ false,
+        /*.max_tokens        =*/ 0,
+
+        /*.debug_mode        =*/ false,
+        /*.audio_ctx         =*/ 0,
+        /*.audio_ctx_auto    =*/ false,
+        /*.encode_ahead      =*/ false,
+
+        /*.tdrz_enable       =*/ false,
+
+        /* suppress_regex    =*/ nullptr,
+
+        /*.initial_prompt       =*/ nullptr,
+        /*.carry_initial_prompt =*/ false,
+        /*.prompt_tokens        =*/ nullptr,
+        /*.prompt_n_tokens      =*/ 0,
+
+        /*.language          =*/ "en",
+        /*.detect_language   =*/ false,
+
+        /*.lid_audio_ctx     =*/ 0,
+        /*.lid_thold         =*/ 0.8f,
+        /*.lid_cache         =*/ false,
+
+        /*.suppress_blank    =*/ true,
+        /*.suppress_nst      =*/ false,
+
+        /*.temperature       =*/  0.0f,
+        /*.max_initial_ts    =*/  1.0f,
+        /*.length_penalty    =*/ -1.0f,
+
+        /*.temperature_inc   =*/  0.2f,
+        /*.entropy_thold     =*/  2.4f,
+        /*.logprob_thold     =*/ -1.0f,
+        /*.no_speech_thold   =*/  0.6f,
+        /*.no_speech_skip_thold =*/ 0.0f,
+        /*.repeat_thold      =*/ 16,
+
+        /*.greedy            =*/ {
+            /*.best_of   =*/ -1,
+        },
+
+        /*.beam_search      =*/ {
+            /*.beam_size =*/ -1,
+
+            /*.patience  =*/ -1.0f,
+        },
+
+        /*.new_segment_callback           =*/ nullptr,
+        /*.new_segment_callback_user_data =*/ nullptr,
+
+        /*.new_token_callback           =*/ nullptr,
+        /*.new_token_callback_user_data =*/ nullptr,
+
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
+
+        /*.encoder_begin_callback           =*/ nullptr,
+        /*.encoder_begin_callback_user_data =*/ nullptr,
+
+        /*.encoder_window_callback           =*/ nullptr,
+        /*.encoder_window_callback_user_data =*/ nullptr,
+
+        /*.abort_callback                   =*/ nullptr,
+        /*.abort_callback_user_data         =*/ nullptr,
+
+        /*.logits_filter_callback           =*/ nullptr,
+        /*.logits_filter_callback_user_data =*/ nullptr,
+
+        /*.grammar_rules   =*/ nullptr,
+        /*.n_grammar_rules =*/ 0,
+        /*.i_start_rule    =*/ 0,
+        /*.grammar_penalty =*/ 100.0f,
+
+        /*.vad                         =*/ false,
+        /*.vad_model_path              =*/ nullptr,
+
+        /* vad_params =*/ whisper_vad_default_params(),
+
+        /*.draft_ctx =*/ nullptr,
+        /*.n_draft   =*/ 4,
+        /*.n_lookup  =*/ 0,
+    };
+
+    switch (strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                result.greedy = {
+                    /*.best_of   =*/ 5,
+                };
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                result.beam_search = {
+                    /*.beam_size =*/ 5,
+
+                    /*.patience  =*/ -1.0f,
+                };
+            } break;
+    }
+
+    return result;
+}
+
+// forward declarations
+static void whisper_exp_compute_token_level_timestamps(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                           int   i_segment,
+                         float   thold_pt,
+                         float   thold_ptsum,
+                   const float * samples,
+                           int   n_samples);
+
+static inline bool should_split_on_word(bool starts_with_space, bool split_on_word) {
+    if (!split_on_word) return true;
+
+    return starts_with_space;
+}
+
+static void whisper_exp_compute_token_level_timestamps_dtw(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+        struct whisper_full_params   params,
+                               int   i_segment,
+                            size_t   n_segments,
+                               int   seek,
+                               int   n_frames,
+                               int   medfilt_width,
+                               int   n_threads);
+
+// wrap the last segment to max_len characters
+// returns the number of new segments
+static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
+    auto segment = state.result_all.back();
+
+    int res = 1;
+    int acc = 0;
+
+    std::string text;
+
+    for (int i = 0; i < (int) segment.tokens.size(); i++) {
+        const auto & token = segment.tokens[i];
+        if (token.id >= whisper_token_eot(&ctx)) {
+            continue;
+        }
+
+        const auto txt = ctx.vocab.token_str(token.id);
+        const int cur = ctx.vocab.token_len(token.id);
+
+        if (acc + cur > max_len && i > 0 && should_split_on_word(ctx.vocab.has_flag(token.id, whisper_vocab::TOKEN_SPACE), split_on_word)) {
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
+            state.result_all.back().speaker_turn_next = false;
+
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
+
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+            state.result_all.back().n_fail_p          = segment.n_fail_p;
+            state.result_all.back().n_fail_h          = segment.n_fail_h;
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    state.result_all.back().text = std::move(text);
+
+    return res;
+}
+
+// log_softmax of the first n_logits logits into logprobs, with the matching probabilities in probs
+// the loops are branch-free so that the compiler can vectorize them: -INFINITY logits come out as
+// exp() == 0 and logprob == -INFINITY without special casing
+static void whisper_compute_logprobs(
+                const std::vector<float> & logits,
+                              const int    n_logits,
+                      std::vector<float> & logprobs,
+                      std::vector<float> & probs) {
+    const float * x  = logits.data();
+          float * lp = logprobs.data();
+          float * p  = probs.data();
+
+    float logit_max = -INFINITY;
+    for (int i = 0; i < n_logits; ++i) {
+        logit_max = x[i] > logit_max ? x[i] : logit_max;
+    }
+
+    if (logit_max == -INFINITY) {
+        std::fill(lp, lp + n_logits, -INFINITY);
+        std::fill(p,  p  + n_logits, 0.0f);
+        return;
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < n_logits; ++i) {
+        p[i] = expf(x[i] - logit_max);
+        sum += p[i];
+    }
+
+    const float logsumexp = logf(sum) + logit_max;
+    const float scale     = 1.0f/sum;
+
+    for (int i = 0; i < n_logits; ++i) {
+        lp[i] = x[i] - logsumexp;
+        p[i] *= scale;
+    }
+}
+
+// (re)build state.suppress_mask for the suppress_regex and suppress_nst parameters
+static void whisper_suppress_mask_prepare(
+        const whisper_context     & ctx,
+              whisper_state       & state,
+        const whisper_full_params & params) {
+    const std::string regex = params.suppress_regex ? params.suppress_regex : "";
+
+    if (regex == state.suppress_mask_regex && params.suppress_nst == state.suppress_mask_nst) {
+        return;
+    }
+
+    const auto & vocab = ctx.vocab;
+
+    state.suppress_mask_regex = regex;
+    state.suppress_mask_nst   = params.suppress_nst;
+    state.suppress_mask.clear();
+
+    if (regex.empty() && !params.suppress_nst) {
+        return;
+    }
+
+    state.suppress_mask.assign(vocab.n_vocab, 0.0f);
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (!regex.empty()) {
+        std::regex re(regex);
+        for (const whisper_vocab::id id : vocab.sorted_ids) {
+            const char * text = vocab.token_str(id);
+            if (std::regex_match(text, text + vocab.token_len(id), re)) {
+                state.suppress_mask[id] = -INFINITY;
+            }
+        }
+    }
+
+    // suppress non-speech tokens (flagged at load, see whisper_vocab_init_index)
+    if (params.suppress_nst) {
+        for (int i = 0; i < vocab.n_tokens(); ++i) {
+            if (vocab.has_flag(i, whisper_vocab::TOKEN_NON_SPEECH)) {
+                state.suppress_mask[i] = -INFINITY;
+            }
+        }
+    }
+}
+
+// process the logits for the selected decoder
+// - applies logit filters
+// - computes logprobs and probs
+static void whisper_process_logits(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+              struct whisper_decoder & decoder,
+    const struct whisper_full_params   params,
+                               float   temperature) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
+
+    const bool is_initial = tokens_cur.size() == 0;
+    const int  n_logits   = vocab.n_tokens();
+
+    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+
+    // extract the logits for the last token
+    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
+    auto & probs    = decoder.probs;
+    auto & logits   = decoder.logits;
+    auto & logprobs = decoder.logprobs;
+    {
+        logits.resize(n_logits);
+        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
+
+        if (temperature > 0.0f) {
+            for (int i = 0; i < n_logits; i++) {
+                logits[i] /= temperature;
+            }
+        }
+
+        // will be populated a bit later
+        probs.resize(n_logits);
+        logprobs.resize(n_logits);
+    }
+
+    // apply logit filters here
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    {
+        // suppress blank
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
+        if (params.suppress_blank) {
+            if (is_initial) {
+                logits[vocab.token_eot] = -INFINITY;
+                if (vocab.token_space >= 0) {
+                    logits[vocab.token_space] = -INFINITY;
+                }
+            }
+        }
+
+        // suppress <|notimestamps|> token
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+        logits[vocab.token_not] = -INFINITY;
+        if (params.no_timestamps) {
+            std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
+        }
+
+        // suppress sot and nosp tokens
+        logits[vocab.token_sot]  = -INFINITY;
+        logits[vocab.token_nosp] = -INFINITY;
+
+        // [TDRZ] when tinydiarize is disabled, suppress solm token
+        if (params.tdrz_enable == false) {
+            logits[vocab.token_solm] = -INFINITY;
+        }
+
+        // suppress task tokens
+        logits[vocab.token_translate]  = -INFINITY;
+        logits[vocab.token_transcribe] = -INFINITY;
+        logits[vocab.token_prev]       = -INFINITY;
+
+        // suppress lang tokens
+        for (size_t i = 0; i < g_lang.size(); ++i) {
+            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
+        }
+
+        // suppress prev token
+        logits[vocab.token_prev] = -INFINITY;
+
+        if (params.logits_filter_callback) {
+            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
+        }
+
+        // suppress the tokens matching suppress_regex and the non-speech tokens
+        if (!state.suppress_mask.empty()) {
+            const float * mask = state.suppress_mask.data();
+            float * x = logits.data();
+            for (int i = 0; i < n_logits; ++i) {
+                x[i] += mask[i];
+            }
+        }
+
+        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
+        {
+            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
+            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+
+            //WHISPER_LOG_INFO("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+
+            if (last_was_timestamp) {
+                if (penultimate_was_timestamp) {
+                    std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
+                } else {
+                    std::fill(logits.begin(), logits.begin() + vocab.token_eot, -INFINITY);
+                }
+            }
+        }
+
+        // the initial timestamp cannot be larger than max_initial_ts
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
+        if (is_initial && params.max_initial_ts > 0.0f) {
+            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
+            const int   tid0      = std::round(params.max_initial_ts/precision);
+
+            if (vocab.token_beg + tid0 + 1 < n_logits) {
+                std::fill(logits.begin() + vocab.token_beg + tid0 + 1, logits.end(), -INFINITY);
+            }
+        }
+
+        // condition timestamp tokens to be increasing
+        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
+        if (decoder.has_ts) {
+            const int tid0 = decoder.seek_delta/2;
+
+            std::fill(logits.begin() + vocab.token_beg, logits.begin() + std::min(vocab.token_beg + tid0, n_logits), -INFINITY);
+        }
+
+        // populate the logprobs and probs arrays (softmax)
+        whisper_compute_logprobs(logits, n_logits, logprobs, probs);
+
+        // if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        {
+            // logsumexp over timestamps, from the already normalized probs
+            float timestamp_logprob = -INFINITY;
+            {
+                float sum_ts = 0.0f;
+                for (int i = vocab.token_beg; i < n_logits; ++i) {
+                    sum_ts += probs[i];
+                }
+                if (sum_ts > 0.0f) {
+                    timestamp_logprob = logf(sum_ts);
+                }
+            }
+
+            float max_text_token_logprob = -INFINITY;
+            for (int i = 0; i < vocab.token_beg; ++i) {
+                max_text_token_logprob = logprobs[i] > max_text_token_logprob ? logprobs[i] : max_text_token_logprob;
+            }
+
+            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
-        model.encoder_2_weight = create_tensor(VAD_TENSOR_ENC_2_WEIGHT,
-            ggml_new_tensor_3d(
-                ctx,
-                GGML_TYPE_F16,
-                hparams.kernel_sizes[2],
-                hparams.encoder_in_channels[2],
-                hparams.encoder_out_channels[2]
-        ));
-        model.encoder_2_bias = create_tensor(VAD_TENSOR_ENC_2_BIAS,
-            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hparams.encoder_out_channels[2]));
+            if (timestamp_logprob > max_text_token_logprob) {
+                std::fill(logits.begin(),   logits.begin()   + vocab.token_beg, -INFINITY);
+                std::fill(logprobs.begin(), logprobs.begin() + vocab.token_beg, -INFINITY);
+                std::fill(probs.begin(),    probs.begin()    + vocab.token_beg, 0.0f);
+            } else {
+                if (params.n_grammar_rules > 0) {
+                    whisper_suppress_invalid_grammar(ctx, state, params, logits, decoder.grammar);
 
-        model.encoder_3_weight = create_tensor(VAD_TENSOR_ENC_3_WEIGHT,
-            ggml_new_tensor_3d(
-                ctx,
-                GGML_TYPE_F16,
-                hparams.kernel_sizes[3],
-                hparams.encoder_in_channels[3],
-                hparams.encoder_out_channels[3]
-        ));
-        model.encoder_3_bias = create_tensor(VAD_TENSOR_ENC_3_BIAS,
-                ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hparams.encoder_out_channels[3]));
+                    whisper_compute_logprobs(logits, n_logits, logprobs, probs);
+                }
+            }
+        }
+    }
 
-        // Hidden State dimension (input gate, forget gate, cell gate, output gate)
-        const int hstate_dim = hparams.lstm_hidden_size * 4;
 
-        // LSTM weights - input to hidden
-        model.lstm_ih_weight = create_tensor(
-            VAD_TENSOR_LSTM_WEIGHT_IH,
-            ggml_new_tensor_2d(ctx, GGML_TYPE_F32, hparams.lstm_hidden_size, hstate_dim)
-        );
-        model.lstm_ih_bias = create_tensor(
-            VAD_TENSOR_LSTM_BIAS_IH,
-            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hstate_dim)
-        );
+#if 0
+    // print first 100 logits - token string : logit
+    //for (int i = 0; i < 10; i++) {
+    //    const auto token   = vocab.id_to_token.at(i);
+    //    const auto prob    = probs[i];
+    //    const auto logit   = logits[i];
+    //    const auto logprob = logprobs[i];
+    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
+    //}
 
-        // LSTM weights - hidden to hidden
-        model.lstm_hh_weight = create_tensor(
-            VAD_TENSOR_LSTM_WEIGHT_HH,
-            ggml_new_tensor_2d(ctx, GGML_TYPE_F32, hparams.lstm_hidden_size, hstate_dim)
-        );
-        model.lstm_hh_bias = create_tensor(
-            VAD_TENSOR_LSTM_BIAS_HH,
-            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, hstate_dim)
-        );
+    // print sorted
+    {
+        std::vector<std::pair<float, int>> pairs;
 
-        // Final conv layer weight
-        model.final_conv_weight = create_tensor(
-            VAD_TENSOR_FINAL_CONV_WEIGHT,
-            ggml_new_tensor_2d(ctx, GGML_TYPE_F16, hparams.final_conv_in, 1)
-        );
-        model.final_conv_bias = create_tensor(
-            VAD_TENSOR_FINAL_CONV_BIAS,
-            ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1)
-        );
+        for (int i = 0; i < n_logits; ++i) {
+            pairs.push_back(std::make_pair(probs[i], i));
+        }
 
-        ggml_free(ctx);
+        std::sort(pairs.begin(), pairs.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
+            return a.first > b.first;
+        });
+
+        for (int i = 0; i < 10; i++) {
+            const auto token   = vocab.token_text(pairs[i].second);
+            const auto prob    = pairs[i].first;
+            const auto logit   = logits[pairs[i].second];
+            const auto logprob = logprobs[pairs[i].second];
+            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
+        }
+
+        printf("----------------\n");
     }
 
-    // allocate tensors in the backend buffers
-    for (auto & p : ctx_map) {
-        ggml_backend_buffer_type_t buft = p.first;
-        ggml_context * ctx = p.second;
-        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
-        if (buf) {
-            model.buffers.emplace_back(buf);
+    // "And", "and", " And", " and"
+    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
+    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
+    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
+    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
+    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
 
-            size_t size_main = ggml_backend_buffer_get_size(buf);
-            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), size_main / 1e6);
-        }
+    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
+    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
+    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
+    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
+    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+
+    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
+    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
+    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
+    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
+    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
+#endif
+}
+
+// draw an index with probability proportional to probs[i]
+// same algorithm and draws as libstdc++'s std::discrete_distribution, but reuses cdf
+static int whisper_sample_discrete(const std::vector<float> & probs, std::vector<double> & cdf, std::mt19937 & rng) {
+    const size_t n = probs.size();
+    if (n < 2) {
+        return 0;
     }
 
-    // load weights
-    {
-        size_t total_size = 0;
-        model.n_loaded = 0;
-        std::vector<char> read_buf;
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += probs[i];
+    }
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+    cdf.resize(n);
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+    double acc = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        acc += probs[i]/sum;
+        cdf[i] = acc;
+    }
+    cdf[n - 1] = 1.0;
 
-            if (loader->eof(loader->context)) {
-                break;
-            }
+    const double p = std::generate_canonical<double, std::numeric_limits<double>::digits>(rng);
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
-            }
+    return std::lower_bound(cdf.begin(), cdf.end() - 1, p) - cdf.begin();
+}
 
-            std::string name;
-            std::vector<char> tmp(length);
-            loader->read(loader->context, &tmp[0], tmp.size());
-            name.assign(&tmp[0], tmp.size());
+static whisper_token_data whisper_sample_token(
+            whisper_context & ctx,
+            whisper_decoder & decoder,
+                       bool   best) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, -1, 0.0f,
+    };
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return nullptr;
-            }
+    const auto & vocab = ctx.vocab;
 
-            auto tensor = model.tensors[name.data()];
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
 
-            if (ggml_nelements(tensor) != nelements) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
-                return nullptr;
+    const int n_logits = vocab.n_vocab;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
             }
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
-                return nullptr;
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                result.tid = i;
             }
+        }
 
-            const size_t bpe = ggml_type_size(ggml_type(ttype));
+        result.pt    = max_ts/(sum_ts + 1e-10);
+        result.ptsum = sum_ts;
+    }
 
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return nullptr;
+    if (best) {
+        for (int i = 0; i < n_logits; ++i) {
+            if (result.p < probs[i]) {
+                result.id   = i;
+                result.p    = probs[i];
+                result.plog = logprobs[i];
             }
+        }
+    } else {
+        result.id   = whisper_sample_discrete(probs, decoder.cdf, decoder.rng);
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
+    }
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+    if (result.id >= vocab.token_beg) {
+        result.tid = result.id;
+        result.pt  = result.p;
+    }
 
-                loader->read(loader->context, read_buf.data(), read_buf.size());
+    return result;
+}
 
-                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+// fills decoder.topk
+static void whisper_sample_token_topk(
+            whisper_context & ctx,
+            whisper_decoder & decoder,
+                        int   k) {
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    // the k candidates are drawn from probs, so no ordering of the vocabulary is needed here
+    auto & result = decoder.topk;
+    result.clear();
+
+    whisper_token tid = vocab.token_beg;
+
+    float pt    = 0.0;
+    float ptsum = 0.0;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                tid = i;
             }
-
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
         }
 
-        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
+        pt    = max_ts/(sum_ts + 1e-10);
+        ptsum = sum_ts;
+    }
 
-        if (model.n_loaded == 0) {
-            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
-        } else if (model.n_loaded != (int) model.tensors.size()) {
-            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
-            return nullptr;
-        }
+    for (int i = 0; i < k; ++i) {
+        const auto id = whisper_sample_discrete(probs, decoder.cdf, decoder.rng);
+        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
-    }
+        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
 
-    if (!whisper_vad_init_context(vctx)) {
-        whisper_vad_free(vctx);
-        return nullptr;
+        if (result[i].id >= vocab.token_beg) {
+            result[i].tid = result[i].id;
+            result[i].pt  = result[i].p;
+        }
     }
 
-    return vctx;
 }
 
-bool whisper_vad_detect_speech(
-        struct whisper_vad_context * vctx,
-        const float * samples,
-        int n_samples) {
-    int n_chunks = n_samples / vctx->n_window;
-    if (n_samples % vctx->n_window != 0) {
-        n_chunks += 1;  // Add one more chunk for remaining samples.
+static double whisper_length_penalty(const struct whisper_full_params & params, int result_len) {
+    if (params.length_penalty > 0.0f) {
+        return pow((5.0 + result_len)/6.0, params.length_penalty);
     }
 
-    WHISPER_LOG_INFO("%s: detecting speech in %d samples\n", __func__, n_samples);
-    WHISPER_LOG_INFO("%s: n_chunks: %d\n", __func__, n_chunks);
-
-    // Reset LSTM hidden/cell states
-    ggml_backend_buffer_clear(vctx->buffer, 0);
+    return result_len;
+}
 
-    vctx->probs.resize(n_chunks);
-    WHISPER_LOG_INFO("%s: props size: %u\n", __func__, n_chunks);
+// entropy of the last 32 tokens before n_end - low values mean the decoder is repeating itself
+static double whisper_sequence_entropy(const whisper_sequence & sequence, int n_end) {
+    const int n = 32;
 
-    std::vector<float> window(vctx->n_window, 0.0f);
+    int cnt = 0;
+    double entropy = 0.0f;
 
-    auto & sched = vctx->sched.sched;
+    std::map<whisper_token, int> token_counts;
+    for (int i = std::max(0, n_end - n); i < n_end; ++i) {
+        token_counts[sequence.tokens[i].id]++;
+        cnt++;
+    }
 
-    ggml_cgraph * gf = whisper_vad_build_graph(*vctx);
+    for (const auto & kv : token_counts) {
+        const auto p = kv.second/(double)cnt;
+        entropy -= p*log(p);
 
-    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
-        return false;
+        //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
     }
 
-    struct ggml_tensor * frame = ggml_graph_get_tensor(gf, "frame");
-    struct ggml_tensor * prob  = ggml_graph_get_tensor(gf, "prob");
+    return entropy;
+}
 
-    // we are going to reuse the graph multiple times for each chunk
-    const int64_t t_start_vad_us = ggml_time_us();
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static void whisper_sequence_score(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence) {
+    if (sequence.result_len == 0) {
+        return;
+    }
 
-    for (int i = 0; i < n_chunks; i++) {
-        const int idx_start = i * vctx->n_window;
-        const int idx_end = std::min(idx_start + vctx->n_window, n_samples);
+    double result = 0.0f;
 
-        const int chunk_len = idx_end - idx_start;
+    for (int i = 0; i < sequence.result_len; ++i) {
+        result += sequence.tokens[i].plog;
+    }
 
-        if (chunk_len < vctx->n_window) {
-            WHISPER_LOG_INFO("%s: chunk_len: %d < n_window: %d\n", __func__, chunk_len, vctx->n_window);
-            std::vector<float> partial_chunk(vctx->n_window, 0.0f);
-            std::copy(samples + idx_start, samples + idx_end, partial_chunk.begin());
+    sequence.sum_logprobs = result;
+    sequence.avg_logprobs = result/sequence.result_len;
 
-            // Copy the zero-padded chunk to the window.
-            const int samples_to_copy_max = vctx->n_window;
-            const int samples_to_copy_cur = std::min(samples_to_copy_max, (int)partial_chunk.size());
-            std::copy(partial_chunk.begin(), partial_chunk.begin() + samples_to_copy_cur, window.begin());
-            if (samples_to_copy_cur < samples_to_copy_max) {
-                std::fill(window.begin() + samples_to_copy_cur, window.end(), 0.0f);
-            }
-        } else {
-            // Copy current frame samples to the window.
-            const int samples_to_copy = std::min(idx_end - idx_start, vctx->n_window);
-            std::copy(samples + idx_start, samples + idx_start + samples_to_copy, window.begin());
-        }
+    sequence.score = result/whisper_length_penalty(params, sequence.result_len);
 
-        // Set the frame tensor data with the samples.
-        ggml_backend_tensor_set(frame, window.data(), 0, ggml_nelements(frame) * sizeof(float));
+    sequence.entropy = whisper_sequence_entropy(sequence, sequence.result_len);
+}
 
-        // do not reset the scheduler - we will reuse the graph in the next chunk
-        if (!ggml_graph_compute_helper(sched, gf, vctx->n_threads, false)) {
-            WHISPER_LOG_ERROR("%s: failed to compute VAD graph\n", __func__);
-            break;
-        }
+static bool whisper_vad(
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples,
+            std::vector<float> & filtered_samples) {
+    WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
+    int filtered_n_samples = 0;
 
-        // Get the probability for this chunk.
-        ggml_backend_tensor_get(prob, &vctx->probs[i], 0, sizeof(float));
+    // Clear any existing mapping table
+    state->vad_mapping_table.clear();
+    state->has_vad_segments = false;
 
-        //WHISPER_LOG_DEBUG("chunk %d: p = %7.3f\n", i, probs[i]);
+    if (state->vad_context == nullptr) {
+        struct whisper_vad_context_params vad_ctx_params = whisper_vad_default_context_params();
+        struct whisper_vad_context * vctx = whisper_vad_init_from_file_with_params(params.vad_model_path, vad_ctx_params);
+        if (vctx == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize VAD context\n", __func__);
+            return false;
+        }
+        state->vad_context = vctx;
     }
+    auto vctx = state->vad_context;
 
-    vctx->t_vad_us += ggml_time_us() - t_start_vad_us;
-    WHISPER_LOG_INFO("%s: vad time = %.2f ms processing %d samples\n", __func__, 1e-3f * vctx->t_vad_us, n_samples);
+    const whisper_vad_params & vad_params = params.vad_params;
 
-    ggml_backend_sched_reset(sched);
+    whisper_vad_segments * vad_segments = whisper_vad_segments_from_samples(vctx, vad_params, samples, n_samples);
 
-    return true;
-}
+    if (!vad_segments) {
+        return false;
+    }
 
-int whisper_vad_segments_n_segments(struct whisper_vad_segments * segments) {
-    return segments->data.size();
-}
+    if (vad_segments->data.size() > 0) {
+        state->has_vad_segments = true;
+        state->vad_segments.clear();
+        state->vad_segments.reserve(vad_segments->data.size());
 
-float whisper_vad_segments_get_segment_t0(struct whisper_vad_segments * segments, int i_segment) {
-    return segments->data[i_segment].start;
-}
+        // Initialize the time mapping table
+        state->vad_mapping_table.clear();
+        state->vad_mapping_table.reserve(vad_segments->data.size() * 4);
 
-float whisper_vad_segments_get_segment_t1(struct whisper_vad_segments * segments, int i_segment) {
-    return segments->data[i_segment].end;
-}
+        WHISPER_LOG_INFO("%s: detected %d speech segments\n", __func__, (int)vad_segments->data.size());
+        float overlap_seconds = vad_params.samples_overlap;
+        int overlap_samples = overlap_seconds * WHISPER_SAMPLE_RATE;
 
-int whisper_vad_n_probs(struct whisper_vad_context * vctx) {
-    return vctx->probs.size();
-}
+        for (int i = 0; i < (int)vad_segments->data.size(); i++) {
+            int segment_start_samples = cs_to_samples(vad_segments->data[i].start);
+            int segment_end_samples   = cs_to_samples(vad_segments->data[i].end);
 
-float * whisper_vad_probs(struct whisper_vad_context * vctx) {
-    return vctx->probs.data();
-}
+            if (i < (int)vad_segments->data.size() - 1) {
+                segment_end_samples += overlap_samples;
+            }
+            segment_end_samples = std::min(segment_end_samples, n_samples - 1);
+            filtered_n_samples  += (segment_end_samples - segment_start_samples);
 
-struct whisper_vad_segments * whisper_vad_segments_from_probs(
-        struct whisper_vad_context *  vctx,
-                whisper_vad_params    params) {
-    WHISPER_LOG_INFO("%s: detecting speech timestamps using %d probabilities\n", __func__, whisper_vad_n_probs(vctx));
+            WHISPER_LOG_INFO("%s: Including segment %d: %.2f - %.2f (duration: %.2f)\n",
+                __func__, i, vad_segments->data[i].start/100.0,
+                (vad_segments->data[i].end/100.0 + (i < (int)vad_segments->data.size() - 1 ? overlap_seconds : 0)),
+                (vad_segments->data[i].end - vad_segments->data[i].start)/100.0 +
+                (i < (int)vad_segments->data.size() - 1 ? overlap_seconds : 0));
+        }
 
-    int     n_probs                 = whisper_vad_n_probs(vctx);
-    float * probs                   = whisper_vad_probs(vctx);
-    float   threshold               = params.threshold;
-    int     min_speech_duration_ms  = params.min_speech_duration_ms;
-    int     min_silence_duration_ms = params.min_silence_duration_ms;
-    float   max_speech_duration_s   = params.max_speech_duration_s;
-    int     speech_pad_ms           = params.speech_pad_ms;
-    int     n_window                = vctx->n_window;
-    int     sample_rate             = WHISPER_SAMPLE_RATE;
-    int     min_silence_samples     = sample_rate * min_silence_duration_ms / 1000;
-    int     audio_length_samples    = n_probs * n_window;
+        int silence_samples = 0.1 * WHISPER_SAMPLE_RATE;
+        int total_silence_samples = (vad_segments->data.size() > 1) ? (vad_segments->data.size() - 1) * silence_samples : 0;
+        int total_samples_needed = filtered_n_samples + total_silence_samples;
 
-    // Min number of samples to be considered valid speech.
-    int     min_speech_samples      = sample_rate * min_speech_duration_ms / 1000;
-    int     speech_pad_samples      = sample_rate * speech_pad_ms / 1000;
+        WHISPER_LOG_INFO("%s: total duration of speech segments: %.2f seconds\n",
+                        __func__, (float)filtered_n_samples / WHISPER_SAMPLE_RATE);
 
-    // Max number of samples that a speech segment can contain before it is
-    // split into multiple segments.
-    int max_speech_samples;
-    if (max_speech_duration_s > 100000.0f) {
-        max_speech_samples = INT_MAX / 2;
-    } else {
-        int64_t temp = (int64_t)sample_rate * (int64_t)(max_speech_duration_s) - n_window - 2 * speech_pad_samples;
-        max_speech_samples = (temp > INT_MAX) ? INT_MAX / 2 : (int)temp;
-        if (max_speech_samples < 0) {
-            max_speech_samples = INT_MAX / 2;
+        try {
+            filtered_samples.resize(total_samples_needed);
+        } catch (const std::bad_alloc & /* e */) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for filtered samples\n", __func__);
+            whisper_vad_free_segments(vad_segments);
+            return false;
         }
-    }
-    // Detect silence period that exceeds this value, then that location (sample)
-    // is marked as a potential place where the segment could be split if
-    // max_speech_samples is reached. The value 98 was taken from the original
-    // silaro-vad python implementation:
-    //https://github.com/snakers4/silero-vad/blob/0dd45f0bcd7271463c234f3bae5ad25181f9df8b/src/silero_vad/utils_vad.py#L291
-    int min_silence_samples_at_max_speech = sample_rate * 98 / 1000;
 
-    // Calculate lower threshold for detecting end of speech segments.
-    float neg_threshold = threshold - 0.15f;
-    if (neg_threshold < 0.01f) {
-        neg_threshold = 0.01f;
-    }
+        int offset = 0;
+        for (int i = 0; i < (int)vad_segments->data.size(); i++) {
+            int segment_start_samples = cs_to_samples(vad_segments->data[i].start);
+            int segment_end_samples   = cs_to_samples(vad_segments->data[i].end);
 
-    struct speech_segment_t {
-        int start;
-        int end;
-    };
+            if (i < (int)vad_segments->data.size() - 1) {
+                segment_end_samples += overlap_samples;
+            }
 
-    std::vector<speech_segment_t> speeches;
-    speeches.reserve(256);
+            segment_start_samples = std::min(segment_start_samples, n_samples - 1);
+            segment_end_samples = std::min(segment_end_samples, n_samples);
+            int segment_length = segment_end_samples - segment_start_samples;
+            if (segment_length > 0) {
+                whisper_state::vad_segment_info segment;
 
-    bool is_speech_segment = false;
-    int  temp_end          = 0;
-    int  prev_end          = 0;
-    int  next_start        = 0;
-    int  curr_speech_start = 0;
-    bool has_curr_speech   = false;
+                segment.orig_start = vad_segments->data[i].start;
+                segment.orig_end   = vad_segments->data[i].end;
 
-    for (int i = 0; i < n_probs; i++) {
-        float curr_prob   = probs[i];
-        int   curr_sample = n_window * i;
+                segment.vad_start = samples_to_cs(offset);
+                segment.vad_end   = samples_to_cs(offset + segment_length);
 
-        // Reset temp_end when we get back to speech
-        if ((curr_prob >= threshold) && temp_end) {
-            temp_end = 0;
-            if (next_start < prev_end) {
-                next_start = curr_sample;
-            }
-        }
+                // Add segment boundaries to mapping table
+                vad_time_mapping start_mapping = {segment.vad_start, segment.orig_start};
+                vad_time_mapping end_mapping = {segment.vad_end, segment.orig_end};
 
-        // Start a new speech segment when probability exceeds threshold and not already in speech
-        if ((curr_prob >= threshold) && !is_speech_segment) {
-            is_speech_segment = true;
-            curr_speech_start = curr_sample;
-            has_curr_speech = true;
-            continue;
-        }
+                state->vad_mapping_table.push_back(start_mapping);
+                state->vad_mapping_table.push_back(end_mapping);
 
-        // Handle maximum speech duration
-        if (is_speech_segment && (curr_sample - curr_speech_start) > max_speech_samples) {
-            if (prev_end) {
-                speeches.push_back({ curr_speech_start, prev_end });
-                has_curr_speech = true;
+                // Add intermediate points for longer segments to improve interpolation accuracy
+                const int64_t min_segment_length = 100; // 1 second
+                const int64_t point_interval = 20;     // Add a point every 200ms
 
-                if (next_start < prev_end) {  // Previously reached silence and is still not speech
-                    is_speech_segment = false;
-                    has_curr_speech = false;
-                } else {
-                    curr_speech_start = next_start;
-                }
-                prev_end = next_start = temp_end = 0;
-            } else {
-                speeches.push_back({ curr_speech_start, curr_sample });
+                if (segment.vad_end - segment.vad_start > min_segment_length) {
+                    int64_t segment_duration = segment.vad_end - segment.vad_start;
+                    int num_points = (int)(segment_duration / point_interval) - 1;
 
-                prev_end = next_start = temp_end = 0;
-                is_speech_segment = false;
-                has_curr_speech = false;
-                continue;
-            }
-        }
+                    for (int j = 1; j <= num_points; j++) {
+                        int64_t vad_time = segment.vad_start + j * point_interval;
 
-        // Handle silence after speech
-        if ((curr_prob < neg_threshold) && is_speech_segment) {
-            if (!temp_end) {
-                temp_end = curr_sample;
-            }
+                        if (vad_time >= segment.vad_end) continue;
 
-            // Track potential segment ends for max_speech handling
-            if ((curr_sample - temp_end) > min_silence_samples_at_max_speech) {
-                prev_end = temp_end;
-            }
+                        int64_t vad_elapsed = vad_time - segment.vad_start;
+                        int64_t vad_total = segment.vad_end - segment.vad_start;
+                        int64_t orig_total = segment.orig_end - segment.orig_start;
+                        int64_t orig_time = segment.orig_start + (vad_elapsed * orig_total) / vad_total;
 
-            // Check if silence is long enough to end the segment
-            if ((curr_sample - temp_end) < min_silence_samples) {
-                continue;
-            } else {
-                // End the segment if it's long enough
-                if ((temp_end - curr_speech_start) > min_speech_samples) {
-                    speeches.push_back({ curr_speech_start, temp_end });
+                        vad_time_mapping intermediate_mapping = {vad_time, orig_time};
+                        state->vad_mapping_table.push_back(intermediate_mapping);
+                    }
                 }
 
-                prev_end = next_start = temp_end = 0;
-                is_speech_segment = false;
-                has_curr_speech = false;
-                continue;
-            }
-        }
-    }
+                WHISPER_LOG_INFO("%s: vad_segment_info: orig_start: %.2f, orig_end: %.2f, vad_start: %.2f, vad_end: %.2f\n",
+                    __func__, segment.orig_start/100.0, segment.orig_end/100.0, segment.vad_start/100.0, segment.vad_end/100.0);
+                state->vad_segments.push_back(segment);
 
-    // Handle the case if we're still in a speech segment at the end
-    if (has_curr_speech && (audio_length_samples - curr_speech_start) > min_speech_samples) {
-        speeches.push_back({ curr_speech_start, audio_length_samples });
-    }
+                // Copy this speech segment
+                memcpy(filtered_samples.data() + offset, samples + segment_start_samples, segment_length * sizeof(float));
+                offset += segment_length;
 
-    // Merge adjacent segments with small gaps in between (post-processing)
-    if (speeches.size() > 1) {
-        int merged_count = 0;
-        for (int i = 0; i < (int) speeches.size() - 1; i++) {
-            // Define maximum gap allowed for merging (e.g., 200ms converted to samples)
-            int max_merge_gap_samples = sample_rate * 200 / 1000;
+                // Add silence after this segment (except after the last segment)
+                if (i < (int)vad_segments->data.size() - 1) {
+                    // Calculate the start and end time of the silence gap in processed audio
+                    int64_t silence_start_vad = samples_to_cs(offset);
+                    int64_t silence_end_vad = samples_to_cs(offset + silence_samples);
+                    // Calculate the corresponding original times
+                    int64_t orig_silence_start = segment.orig_end;
+                    int64_t orig_silence_end = vad_segments->data[i+1].start;
 
-            // If the gap between this segment and the next is small enough
-            if (speeches[i+1].start - speeches[i].end < max_merge_gap_samples) {
-                // Merge by extending current segment to the end of next segment
-                speeches[i].end = speeches[i+1].end;
-                speeches.erase(speeches.begin() + i + 1);
+                    // Add mapping points for silence boundaries
+                    state->vad_mapping_table.push_back({silence_start_vad, orig_silence_start});
+                    state->vad_mapping_table.push_back({silence_end_vad, orig_silence_end});
 
-                i--;
-                merged_count++;
+                    // Fill with zeros (silence)
+                    memset(filtered_samples.data() + offset, 0, silence_samples * sizeof(float));
+                    offset += silence_samples;
+                }
             }
         }
-        WHISPER_LOG_INFO("%s: Merged %d adjacent segments, now have %d segments\n",
-                         __func__, merged_count, (int) speeches.size());
-    }
 
-    // Double-check for minimum speech duration
-    for (int i = 0; i < (int) speeches.size(); i++) {
-        if (speeches[i].end - speeches[i].start < min_speech_samples) {
-            WHISPER_LOG_INFO("%s: Removing segment %d (too short: %d samples)\n",
-                            __func__, i, speeches[i].end - speeches[i].start);
+        // Sort the mapping table by processed time
+        std::sort(state->vad_mapping_table.begin(), state->vad_mapping_table.end(),
+            [](const vad_time_mapping& a, const vad_time_mapping& b) {
+                return a.processed_time < b.processed_time;
+        });
 
-            speeches.erase(speeches.begin() + i);
-            i--;
+        // Remove any duplicate processed times to ensure monotonicity which is
+        // needed for binary search and interpolation later.
+        if (!state->vad_mapping_table.empty()) {
+            auto last = std::unique(state->vad_mapping_table.begin(), state->vad_mapping_table.end(),
+                [](const vad_time_mapping& a, const vad_time_mapping& b) {
+                    return a.processed_time == b.processed_time;
+                });
+            state->vad_mapping_table.erase(last, state->vad_mapping_table.end());
         }
-    }
 
-    WHISPER_LOG_INFO("%s: Final speech segments after filtering: %d\n", __func__, (int) speeches.size());
+        WHISPER_LOG_INFO("%s: Created time mapping table with %d points\n", __func__, (int)state->vad_mapping_table.size());
 
-    // Allocate final segments
-    std::vector<whisper_vad_segment> segments;
-    if (speeches.size() > 0) {
-        try {
-            segments.resize(speeches.size());
-        } catch (const std::bad_alloc &) {
-            WHISPER_LOG_ERROR("%s: failed to allocate memory for final segments\n", __func__);
-            return nullptr;
-        }
+        filtered_n_samples = offset;
+        WHISPER_LOG_INFO("%s: Reduced audio from %d to %d samples (%.1f%% reduction)\n",
+                        __func__, n_samples, filtered_n_samples, 100.0f * (1.0f - (float)filtered_n_samples / n_samples));
     }
 
-    // Apply padding to segments and copy to final segments
-    for (int i = 0; i < (int) speeches.size(); i++) {
-        // Apply padding to the start of the first segment
-        if (i == 0) {
-            speeches[i].start =
-                (speeches[i].start > speech_pad_samples) ?
-                (speeches[i].start - speech_pad_samples) : 0;
-        }
+    whisper_vad_free_segments(vad_segments);
+    return true;
+}
 
-        // Handle spacing between segments
-        if (i < (int) speeches.size() - 1) {
-            int silence_duration = speeches[i+1].start - speeches[i].end;
+// [EXPERIMENTAL] encode ahead: take over the cross KV cache that ahead_state computed for the window at seek
+static void whisper_encode_ahead_take(whisper_state & state, const whisper_state & ahead) {
+    ggml_backend_tensor_copy(ahead.kv_cross.k, state.kv_cross.k);
+    ggml_backend_tensor_copy(ahead.kv_cross.v, state.kv_cross.v);
 
-            if (silence_duration < 2 * speech_pad_samples) {
-                // If segments are close, split the difference
-                speeches[i].end += silence_duration / 2;
-                speeches[i+1].start =
-                    (speeches[i+1].start > silence_duration / 2) ?
-                    (speeches[i+1].start - silence_duration / 2) : 0;
-            } else {
-                // Otherwise, apply full padding to both
-                speeches[i].end =
-                    (speeches[i].end + speech_pad_samples < audio_length_samples) ?
-                    (speeches[i].end + speech_pad_samples) : audio_length_samples;
-                speeches[i+1].start =
-                    (speeches[i+1].start > speech_pad_samples) ?
-                    (speeches[i+1].start - speech_pad_samples) : 0;
-            }
-        } else {
-            // Apply padding to the end of the last segment
-            speeches[i].end =
-                (speeches[i].end + speech_pad_samples < audio_length_samples) ?
-                (speeches[i].end + speech_pad_samples) : audio_length_samples;
-        }
+    state.enc_key   = ahead.enc_key;
+    state.enc_valid = ahead.enc_valid;
+}
 
-        // Convert from samples to centiseconds
-        segments[i].start = samples_to_cs(speeches[i].start);
-        segments[i].end   = samples_to_cs(speeches[i].end);
+// whisper_full_dual() runs whisper_full_with_state() for both tasks, each on its own thread: role 0 encodes every
+// window, role 1 copies its cross-attention KV cache; at the end of each window they wait for each other and both
+// advance by the shorter seek_delta. A task that leaves its loop (end, error, abort) sets done and the other goes
+// on alone
+struct whisper_dual_link {
+    std::mutex              mutex;
+    std::condition_variable cv;
 
-        WHISPER_LOG_INFO("%s: VAD segment %d: start = %.2f, end = %.2f (duration: %.2f)\n",
-                        __func__, i, segments[i].start/100.0, segments[i].end/100.0, (segments[i].end - segments[i].start)/100.0);
-    }
+    whisper_state * states[2] = {};
 
-    whisper_vad_segments * vad_segments = new whisper_vad_segments;
-    if (vad_segments == NULL) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for whisper_vad_segments\n", __func__);
-        return nullptr;
-    }
+    bool done[2] = {};
 
-    vad_segments->data = std::move(segments);
+    int  n_encoded = 0;  // windows encoded by role 0
+    int  n_taken   = 0;  // windows taken by role 1
+    int  seek_enc  = -1; // the last window encoded by role 0
+    bool ok_enc    = false;
 
-    return vad_segments;
-}
+    int n_agreed  = 0;     // windows both tasks are done with
+    bool proposed = false; // one task waits for the other at the end of the current window
+    int delta     = 0;     // its seek_delta
+    int agreed    = 0;     // seek_delta of the last window both are done with
+};
 
-struct whisper_vad_segments * whisper_vad_segments_from_samples(
-        whisper_vad_context * vctx,
-        whisper_vad_params params,
-        const float * samples,
-        int n_samples) {
-    WHISPER_LOG_INFO("%s: detecting speech timestamps in %d samples\n", __func__, n_samples);
-    if (!whisper_vad_detect_speech(vctx, samples, n_samples)) {
-        WHISPER_LOG_ERROR("%s: failed to detect speech\n", __func__);
-        return nullptr;
+static void whisper_dual_encoded(whisper_state & state, int seek, bool ok) {
+    auto & link = *state.dual;
+    {
+        std::lock_guard<std::mutex> lock(link.mutex);
+        link.seek_enc = seek;
+        link.ok_enc   = ok;
+        link.n_encoded++;
     }
-    return whisper_vad_segments_from_probs(vctx, params);
+    link.cv.notify_all();
 }
 
-void whisper_vad_free(whisper_vad_context * ctx) {
-    if (ctx) {
-        if (ctx->buffer) {
-            ggml_backend_buffer_free(ctx->buffer);
-        }
-        for (ggml_context * context : ctx->model.ctxs) {
-            ggml_free(context);
-        }
+// role 1: take the cross-attention KV cache of the window at seek from role 0
+// false if role 0 is gone or encoded something else - the window is then encoded here
+static bool whisper_dual_take(whisper_state & state, int seek) {
+    auto & link = *state.dual;
 
-        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
-            ggml_backend_buffer_free(buf);
-        }
+    std::unique_lock<std::mutex> lock(link.mutex);
+    link.cv.wait(lock, [&]() { return link.n_encoded > link.n_taken || link.done[0]; });
 
-        ggml_backend_sched_free(ctx->sched.sched);
+    if (link.n_encoded <= link.n_taken) {
+        return false;
+    }
+    link.n_taken = link.n_encoded;
 
-        for (auto & backend : ctx->backends) {
-            ggml_backend_free(backend);
-        }
+    const whisper_state & src = *link.states[0];
+    if (!link.ok_enc || link.seek_enc != seek) {
+        return false;
+    }
 
-        delete[] ctx->model.hparams.encoder_in_channels;
-        delete[] ctx->model.hparams.encoder_out_channels;
-        delete[] ctx->model.hparams.kernel_sizes;
+    // role 0 does not encode the next window before this one is done
+    whisper_encode_ahead_take(state, src);
+    state.exp_n_audio_ctx = src.exp_n_audio_ctx;
 
-        delete ctx;
-    }
+    return true;
 }
 
-void whisper_vad_free_segments(whisper_vad_segments * segments) {
-    if (segments) {
-        delete segments;
-    }
-}
+// both tasks advance by the shorter seek_delta of the window
+static int whisper_dual_agree(whisper_state & state, int seek_delta) {
+    auto & link = *state.dual;
 
-//////////////////////////////////
-// Grammar - ported from llama.cpp
-//////////////////////////////////
+    const int other = 1 - state.dual_role;
 
-// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
-// pointer. If an invalid sequence is encountered, returns `whisper_partial_utf8.n_remain == -1`.
-static std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
-        const char         * src,
-        whisper_partial_utf8   partial_start) {
-    static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src;
-    std::vector<uint32_t> code_points;
-    uint32_t              value    = partial_start.value;
-    int                   n_remain = partial_start.n_remain;
+    std::unique_lock<std::mutex> lock(link.mutex);
+    if (link.done[other]) {
+        return seek_delta;
+    }
 
-    // continue previous decode, if applicable
-    while (*pos != 0 && n_remain > 0) {
-        uint8_t next_byte = static_cast<uint8_t>(*pos);
-        if ((next_byte >> 6) != 2) {
-            // invalid sequence, abort
-            code_points.push_back(0);
-            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, -1 });
-        }
-        value = (value << 6) + (next_byte & 0x3F);
-        ++pos;
-        --n_remain;
+    if (link.proposed) {
+        const int agreed = std::min(link.delta, seek_delta);
+
+        link.proposed = false;
+        link.agreed   = agreed;
+        link.n_agreed++;
+        lock.unlock();
+        link.cv.notify_all();
+        return agreed;
     }
 
-    if (partial_start.n_remain > 0 && n_remain == 0) {
-        code_points.push_back(value);
+    link.proposed = true;
+    link.delta    = seek_delta;
+
+    const int n_agreed = link.n_agreed;
+    link.cv.wait(lock, [&]() { return link.n_agreed > n_agreed || link.done[other]; });
+
+    if (link.n_agreed == n_agreed) {
+        link.proposed = false;
+        return seek_delta;
     }
 
-    // decode any subsequent utf-8 sequences, which may end in an incomplete one
-    while (*pos != 0) {
-        uint8_t  first_byte = static_cast<uint8_t>(*pos);
-        uint8_t  highbits   = first_byte >> 4;
-                 n_remain   = lookup[highbits] - 1;
+    return link.agreed;
+}
 
-        if (n_remain < 0) {
-            // invalid sequence, abort
-            code_points.clear();
-            code_points.push_back(0);
-            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, n_remain });
-        }
+// number of leading tokens that make up the segments closed by seek_delta, see whisper_dual_agree()
+static int whisper_dual_cut(whisper_context & ctx, const std::vector<whisper_token_data> & tokens, int seek_delta) {
+    const whisper_token token_beg = whisper_token_beg(&ctx);
 
-        uint8_t  mask       = (1 << (7 - n_remain)) - 1;
-                 value      = first_byte & mask;
-        ++pos;
-        while (*pos != 0 && n_remain > 0) {
-            value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
-            ++pos;
-            --n_remain;
-        }
-        if (n_remain == 0) {
-            code_points.push_back(value);
+    int n_keep = 0;
+    for (int i = 1; i < (int) tokens.size(); ++i) {
+        if (tokens[i].id > token_beg && tokens[i - 1].id <= token_beg) {
+            if (2*(tokens[i].id - token_beg) > seek_delta) {
+                break;
+            }
+            n_keep = i + 1;
         }
     }
-    code_points.push_back(0);
 
-    return std::make_pair(std::move(code_points), whisper_partial_utf8{ value, n_remain });
+    return n_keep;
 }
 
-// returns true iff pos points to the end of one of the definitions of a rule
-static bool whisper_grammar_is_end_of_sequence(const whisper_grammar_element * pos) {
-    switch (pos->type) {
-        case WHISPER_GRETYPE_END: return true;  // NOLINT
-        case WHISPER_GRETYPE_ALT: return true;  // NOLINT
-        default:                return false;
-    }
+// the encoder time spent on ahead_state is reported by the state it worked for
+static void whisper_encode_ahead_merge_timings(whisper_state & state, whisper_state & ahead) {
+    state.t_encode_us += ahead.t_encode_us;
+    state.n_encode    += ahead.n_encode;
+    whisper_histogram_merge(state.h_encode, ahead.h_encode);
+    whisper_histogram_merge(state.h_alloc,  ahead.h_alloc);
+
+    ahead.t_encode_us = 0;
+    ahead.n_encode    = 0;
+    ahead.h_encode    = {};
+    ahead.h_alloc     = {};
 }
 
-// returns true iff chr satisfies the char range at pos (regular or inverse range)
-// asserts that pos is pointing to a char range element
-static std::pair<bool, const whisper_grammar_element *> whisper_grammar_match_char(
-        const whisper_grammar_element * pos,
-        const uint32_t                chr) {
+// With VAD the audio is a packed sequence of speech segments. End the window
+// starting at seek after the last segment that fits in it instead of cutting
+// the next utterance at the 30 s edge; the rest starts the next window.
+// Windows are only shortened while they keep at least 10 s of audio.
+static int whisper_vad_window_end(const whisper_state & state, int seek, int seek_end) {
+    if (!state.has_vad_segments) {
+        return seek_end;
+    }
 
-    bool found            = false;
-    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+    const int64_t t_window = seek + 100*WHISPER_CHUNK_SIZE;
+    if (t_window >= seek_end) {
+        return seek_end;
+    }
 
-    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT); // NOLINT
+    const auto & segments = state.vad_segments;
 
-    do {
-        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
-            // inclusive range, e.g. [a-z]
-            found = found || (pos->value <= chr && chr <= pos[1].value);
-            pos += 2;
-        } else {
-            // exact char match, e.g. [a] or "a"
-            found = found || pos->value == chr;
-            pos += 1;
-        }
-    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+    // first segment that does not end inside the window
+    auto it = std::upper_bound(segments.begin(), segments.end(), t_window,
+            [](int64_t t, const whisper_state::vad_segment_info & seg) { return t < seg.vad_end; });
 
-    return std::make_pair(found == is_positive_char, pos);
+    if (it == segments.begin() || it == segments.end() || it->vad_start >= t_window) {
+        return seek_end; // nothing would be cut
+    }
+
+    const int64_t t_end = (it - 1)->vad_end;
+    if (t_end < seek + 1000) {
+        return seek_end;
+    }
+
+    // keep the silence gap that follows the segment
+    return (int) std::min<int64_t>(seek_end, std::min<int64_t>(t_end + 10, it->vad_start));
 }
 
-// returns true iff some continuation of the given partial UTF-8 sequence could satisfy the char
-// range at pos (regular or inverse range)
-// asserts that pos is pointing to a char range element
-static bool whisper_grammar_match_partial_char(
-        const whisper_grammar_element * pos,
-        const whisper_partial_utf8      partial_utf8) {
+// [EXPERIMENTAL] speculative decoding
+//
+// let the draft model continue prompt + decoder.sequence greedily for up to n_draft tokens.
+// the draft KV cache keeps what it has already seen, so usually only the last accepted
+// tokens are evaluated before proposing. returns false on error
+static bool whisper_draft_propose(
+          whisper_state & state,
+  const whisper_decoder & decoder,
+const std::vector<whisper_token> & prompt,
+    whisper_full_params   params,
+                    int   n_draft) {
+    whisper_context & dctx   = *state.draft_ctx;
+    whisper_state   & dstate = *state.draft_state;
 
-    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
-    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT);
+    auto & past   = state.draft_past;
+    auto & tokens = state.draft_tokens;
 
-    uint32_t partial_value = partial_utf8.value;
-    int      n_remain      = partial_utf8.n_remain;
+    tokens.clear();
 
-    // invalid sequence or 7-bit char split across 2 bytes (overlong)
-    if (n_remain < 0 || (n_remain == 1 && partial_value < 2)) {
-        return false;
+    if (n_draft <= 0) {
+        return true;
     }
 
-    // range of possible code points this partial UTF-8 sequence could complete to
-    uint32_t low  = partial_value << (n_remain * 6);
-    uint32_t high = low | ((1 << (n_remain * 6)) - 1);
+    std::vector<whisper_token> cur(prompt);
+    for (const auto & token : decoder.sequence.tokens) {
+        cur.push_back(token.id);
+    }
 
-    if (low == 0) {
-        if (n_remain == 2) {
-            low = 1 << 11;
-        } else if (n_remain == 3) {
-            low = 1 << 16;
-        }
+    // at least one token has to be evaluated to get logits
+    int n_keep = 0;
+    while (n_keep < (int) past.size() && n_keep < (int) cur.size() - 1 && past[n_keep] == cur[n_keep]) {
+        n_keep++;
     }
 
-    do {
-        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
-            // inclusive range, e.g. [a-z]
-            if (pos->value <= high && low <= pos[1].value) {
-                return is_positive_char;
-            }
-            pos += 2;
-        } else {
-            // exact char match, e.g. [a] or "a"
-            if (low <= pos->value && pos->value <= high) {
-                return is_positive_char;
-            }
-            pos += 1;
-        }
-    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_keep, -1);
+    past.resize(n_keep);
 
-    return !is_positive_char;
-}
+    whisper_batch_prep_legacy(dstate.batch, cur.data() + n_keep, cur.size() - n_keep, n_keep, 0);
+    if (!whisper_decode_internal(dctx, dstate, dstate.batch, params.n_threads, false, nullptr, nullptr)) {
+        return false;
+    }
+    past.insert(past.end(), cur.begin() + n_keep, cur.end());
 
+    // the draft follows the same logit rules as the main decoder, without user filters
+    params.logits_filter_callback = nullptr;
 
-// transforms a grammar pushdown stack into N possible stacks, all ending
-// at a character range (terminal element)
-static void whisper_grammar_advance_stack(
-        const std::vector<std::vector<whisper_grammar_element>>   & rules,
-        const std::vector<const whisper_grammar_element *>        & stack,
-        std::vector<std::vector<const whisper_grammar_element *>> & new_stacks) {
+    auto & draft = dstate.decoders[0];
 
-    if (stack.empty()) {
-        new_stacks.emplace_back();
-        return;
-    }
+    draft.sequence   = decoder.sequence;
+    draft.grammar    = decoder.grammar;
+    draft.seek_delta = decoder.seek_delta;
+    draft.has_ts     = decoder.has_ts;
+    draft.i_batch    = dstate.batch.n_tokens - 1;
 
-    const whisper_grammar_element * pos = stack.back();
+    for (int k = 0; k < n_draft; ++k) {
+        whisper_process_logits(dctx, dstate, draft, params, 0.0f);
 
-    switch (pos->type) {
-        case WHISPER_GRETYPE_RULE_REF: {
-            const size_t                  rule_id = static_cast<size_t>(pos->value);
-            const whisper_grammar_element * subpos  = rules[rule_id].data();
-            do {
-                // init new stack without the top (pos)
-                std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
-                if (!whisper_grammar_is_end_of_sequence(pos + 1)) {
-                    // if this rule ref is followed by another element, add that to stack
-                    new_stack.push_back(pos + 1);
-                }
-                if (!whisper_grammar_is_end_of_sequence(subpos)) {
-                    // if alternate is nonempty, add to stack
-                    new_stack.push_back(subpos);
-                }
-                whisper_grammar_advance_stack(rules, new_stack, new_stacks);
-                while (!whisper_grammar_is_end_of_sequence(subpos)) {
-                    // scan to end of alternate def
-                    subpos++;
-                }
-                if (subpos->type == WHISPER_GRETYPE_ALT) {
-                    // there's another alternate def of this rule to process
-                    subpos++;
-                } else {
-                    break;
-                }
-            } while (true);
+        const whisper_token_data token = whisper_sample_token(dctx, draft, true);
+        tokens.push_back(token.id);
+
+        if (token.id == whisper_token_eot(&dctx) || k + 1 == n_draft) {
             break;
         }
-        case WHISPER_GRETYPE_CHAR:
-        case WHISPER_GRETYPE_CHAR_NOT:
-            new_stacks.push_back(stack);
-            break;
-        default:
-            // end of alternate (WHISPER_GRETYPE_END, WHISPER_GRETYPE_ALT) or middle of char range
-            // (WHISPER_GRETYPE_CHAR_ALT, WHISPER_GRETYPE_CHAR_RNG_UPPER); stack should never be left on
-            // those
-            WHISPER_ASSERT(false);
-    }
-}
-
-// takes a set of possible pushdown stacks on a grammar, which are required to
-// be positioned at a character range (see `whisper_grammar_advance_stack`), and
-// produces the N possible stacks if the given char is accepted at those
-// positions
-static std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const uint32_t                                                  chr) {
-
-    std::vector<std::vector<const whisper_grammar_element *>> new_stacks;
 
-    for (const auto & stack : stacks) {
-        if (stack.empty()) {
-            continue;
+        whisper_sequence_push(draft.sequence, token, whisper_token_eot(&dctx));
+        if (token.id > whisper_token_beg(&dctx)) {
+            draft.seek_delta = 2*(token.id - whisper_token_beg(&dctx));
+            draft.has_ts     = true;
         }
+        whisper_grammar_accept_token(dctx, draft.grammar, token.id);
 
-        auto match = whisper_grammar_match_char(stack.back(), chr);
-        if (match.first) {
-            const whisper_grammar_element * pos = match.second;
-
-            // update top of stack to next element, if any
-            std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
-            if (!whisper_grammar_is_end_of_sequence(pos)) {
-                new_stack.push_back(pos);
-            }
-            whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+        whisper_batch_prep_legacy(dstate.batch, &token.id, 1, past.size(), 0);
+        if (!whisper_decode_internal(dctx, dstate, dstate.batch, params.n_threads, false, nullptr, nullptr)) {
+            return false;
         }
+        past.push_back(token.id);
+
+        draft.i_batch = 0;
     }
 
-    return new_stacks;
+    return true;
 }
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const std::vector<whisper_grammar_candidate>                    & candidates);
+// [EXPERIMENTAL] prompt lookup
+//
+// find the latest earlier occurrence of the last n_lookup tokens of prompt + decoder.sequence and propose
+// the text tokens that followed it. shorter n-grams, down to 2 tokens, are tried if there is no match
+static void whisper_lookup_propose(
+          whisper_state & state,
+  const whisper_decoder & decoder,
+const std::vector<whisper_token> & prompt,
+                    int   n_lookup,
+                    int   n_draft,
+          whisper_token   token_eot) {
+    auto & tokens = state.draft_tokens;
+
+    tokens.clear();
+
+    if (n_draft <= 0) {
+        return;
+    }
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates_for_stack(
-        const std::vector<std::vector<whisper_grammar_element>> & rules,
-        const std::vector<const whisper_grammar_element *>      & stack,
-        const std::vector<whisper_grammar_candidate>            & candidates) {
+    std::vector<whisper_token> cur(prompt);
+    for (const auto & token : decoder.sequence.tokens) {
+        cur.push_back(token.id);
+    }
 
-    std::vector<whisper_grammar_candidate> rejects;
+    const int n_cur = cur.size();
 
-    if (stack.empty()) {
-        for (auto tok : candidates) {
-            if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
-                rejects.push_back(tok);
+    for (int n = std::min(n_lookup, n_cur - 1); n >= std::min(n_lookup, 2); --n) {
+        const whisper_token * tail = cur.data() + n_cur - n;
+
+        for (int i = n_cur - n - 1; i >= 0; --i) {
+            if (!std::equal(tail, tail + n, cur.data() + i)) {
+                continue;
             }
-        }
-        return rejects;
-    }
 
-    const whisper_grammar_element * stack_pos = stack.back();
+            // timestamps and special tokens of the earlier context do not carry over
+            for (int k = i + n; k < n_cur && (int) tokens.size() < n_draft && cur[k] < token_eot; ++k) {
+                tokens.push_back(cur[k]);
+            }
 
-    std::vector<whisper_grammar_candidate> next_candidates;
-    for (auto tok : candidates) {
-        if (*tok.code_points == 0) {
-            // reached end of full codepoints in token, reject iff it ended in a partial sequence
-            // that cannot satisfy this position in grammar
-            if (tok.partial_utf8.n_remain != 0 && !whisper_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
-                rejects.push_back(tok);
+            if (!tokens.empty()) {
+                return;
             }
-        } else if (whisper_grammar_match_char(stack_pos, *tok.code_points).first) {
-            next_candidates.push_back({ tok.id, tok.code_points + 1, tok.partial_utf8 });
-        } else {
-            rejects.push_back(tok);
         }
     }
+}
 
-    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
-
-    // update top of stack to next element, if any
-    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
-    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
-        stack_after.push_back(stack_pos_after);
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    if (params.n_threads <= 0) {
+        params.n_threads = whisper_autotune_n_threads(ctx);
     }
-    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
-    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
 
-    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
-    for (auto tok : next_rejects) {
-        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
+    // clear old results, unless continuing a job from a snapshot (whisper_state_set_data())
+    auto & result_all = state->result_all;
+
+    if (!params.resume) {
+        result_all.clear();
     }
 
-    return rejects;
-}
+    if (n_samples > 0) {
+        // compute log mel spectrogram
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+    }
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const std::vector<whisper_grammar_candidate>                    & candidates) {
-    if (candidates.empty() || stacks.empty()) {
-        return std::vector<whisper_grammar_candidate>();
+    // auto-detect language if not specified
+    // a resumed job keeps the language it detected in its first window
+    if (params.resume && !params.detect_language && (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0)) {
+        params.language = whisper_lang_str(state->lang_id);
     }
+    const bool lang_auto = params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0;
+    if (lang_auto && params.lid_cache && !params.detect_language && state->lang_prob > 0.0f && state->lang_prob >= params.lid_thold) {
+        // the state detected the language of this stream confidently before
+        params.language = whisper_lang_str(state->lang_id);
 
-    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+        WHISPER_LOG_DEBUG("%s: cached language: %s (p = %f)\n", __func__, params.language, state->lang_prob);
+    } else if (lang_auto || params.detect_language) {
+        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
-        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
-    }
-    return rejects;
-}
+        int lang_id = -1;
 
-static struct whisper_grammar whisper_grammar_init(
-            const whisper_grammar_element ** rules,
-                                 size_t      n_rules,
-                                 size_t      i_start_rule) {
-    const whisper_grammar_element * pos;
+        // a few seconds of audio are usually enough, the whole window is encoded only when they are not
+        if (params.lid_audio_ctx > 0 && params.lid_audio_ctx < whisper_n_audio_ctx(ctx)) {
+            lang_id = whisper_lang_auto_detect_impl(ctx, state, 0, params.lid_audio_ctx, params.n_threads, probs.data());
+            if (lang_id >= 0 && probs[lang_id] < params.lid_thold) {
+                WHISPER_LOG_DEBUG("%s: %s (p = %f) is below the threshold with audio_ctx = %d, detecting on the whole window\n",
+                        __func__, whisper_lang_str(lang_id), probs[lang_id], params.lid_audio_ctx);
+                lang_id = -1;
+            }
+        }
+        if (lang_id < 0) {
+            lang_id = whisper_lang_auto_detect_impl(ctx, state, 0, params.audio_ctx, params.n_threads, probs.data());
+        }
+        if (lang_id < 0) {
+            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        state->lang_id   = lang_id;
+        state->lang_prob = probs[lang_id];
+        params.language = whisper_lang_str(lang_id);
 
-    // copy rule definitions into vectors
-    std::vector<std::vector<whisper_grammar_element>> vec_rules(n_rules);
-    for (size_t i = 0; i < n_rules; i++) {
-        for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
-            vec_rules[i].push_back(*pos);
+        WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[lang_id]);
+        if (params.detect_language) {
+            return 0;
         }
-        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
+    } else if (!params.resume) {
+        state->lang_prob = 0.0f;
     }
 
-    // loop over alternates of start rule to build initial stacks
-    std::vector<std::vector<const whisper_grammar_element *>> stacks;
-    pos = rules[i_start_rule];
-    do {
-        std::vector<const whisper_grammar_element *> stack;
-        if (!whisper_grammar_is_end_of_sequence(pos)) {
-            // if alternate is nonempty, add to stack
-            stack.push_back(pos);
+    if (params.token_timestamps) {
+        if (!params.resume) {
+            state->t_beg    = 0;
+            state->t_last   = 0;
+            state->tid_last = 0;
         }
-        whisper_grammar_advance_stack(vec_rules, stack, stacks);
-        while (!whisper_grammar_is_end_of_sequence(pos)) {
-            // scan to end of alternate def
-            pos++;
+        if (n_samples > 0) {
+            // computed with the first segment, see whisper_exp_compute_token_level_timestamps()
+            state->energy.clear();
         }
-        if (pos->type == WHISPER_GRETYPE_ALT) {
-            // there's another alternate def of this rule to process
-            pos++;
+    }
+
+    whisper_suppress_mask_prepare(*ctx, *state, params);
+
+    // parsed once per call: the grammar caches in the states are keyed by these rules
+    whisper_grammar grammar;
+    if (params.grammar_rules != nullptr) {
+        grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
+    }
+
+    // the self-attention cache depends on the encoder output, which is about to change
+    state->kv_prompt.clear();
+
+    // [EXPERIMENTAL] speculative decoding: the draft model needs the same vocabulary and its own spectrogram
+    bool use_draft = params.draft_ctx != nullptr && params.n_draft > 0 && params.strategy == WHISPER_SAMPLING_GREEDY;
+    if (use_draft && params.draft_ctx->vocab.n_vocab != ctx->vocab.n_vocab) {
+        WHISPER_LOG_WARN("%s: draft model vocabulary differs (%d vs %d tokens) - speculative decoding disabled\n",
+                __func__, params.draft_ctx->vocab.n_vocab, ctx->vocab.n_vocab);
+        use_draft = false;
+    }
+    if (use_draft && state->draft_ctx != params.draft_ctx) {
+        whisper_free_state(state->draft_state);
+
+        state->draft_state = whisper_init_state(params.draft_ctx);
+        state->draft_ctx   = state->draft_state ? params.draft_ctx : nullptr;
+
+        use_draft = state->draft_state != nullptr;
+    }
+    if (use_draft) {
+        if (n_samples > 0) {
+            use_draft = whisper_pcm_to_mel_with_state(params.draft_ctx, state->draft_state, samples, n_samples, params.n_threads) == 0;
+        } else if (state->mel.n_mel == params.draft_ctx->model.hparams.n_mels) {
+            state->draft_state->mel = state->mel;
         } else {
-            break;
+            WHISPER_LOG_WARN("%s: no audio for the draft model - speculative decoding disabled\n", __func__);
+            use_draft = false;
         }
-    } while (true);
-
-    return { std::move(vec_rules), std::move(stacks), {} };
-}
+    }
 
-static void whisper_suppress_invalid_grammar(
-             whisper_context  & ctx,
-    const whisper_full_params & params,
-           std::vector<float> & logits,
-    const     whisper_grammar & grammar) {
+    // [EXPERIMENTAL] prompt lookup: the same verification, with drafts taken from the text context
+    const bool use_lookup = !use_draft && params.draft_ctx == nullptr && params.n_lookup > 0 && params.n_draft > 0 &&
+        params.strategy == WHISPER_SAMPLING_GREEDY;
 
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
-        return;
+    // [EXPERIMENTAL] encode ahead: a second state of the same model encodes the window that starts where the
+    // current one ends, while the current one decodes; it is used if the decoder seeks exactly there
+    bool use_ahead = params.encode_ahead;
+    if (use_ahead && state->ahead_state == nullptr) {
+        state->ahead_state = whisper_init_state(ctx);
+        use_ahead = state->ahead_state != nullptr;
+    }
+    if (use_ahead) {
+        state->ahead_state->mel = state->mel;
+        whisper_state_set_loras(*state->ahead_state, state->loras);
     }
 
-    //bool allow_eot = false;
-    //for (const auto & stack : grammar.stacks) {
-    //    if (stack.empty()) {
-    //        allow_eot = true;
-    //        break;
-    //    }
-    //}
+    const int seek_start = params.offset_ms/10;
+    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
 
-    const whisper_token eot = whisper_token_eot(&ctx);
+    // if length of spectrogram is less than 100ms (10 frames), then return
+    // basically don't process anything that is less than 100ms
+    // ref: https://github.com/ggml-org/whisper.cpp/issues/2065
+    const int delta_min = 10;
 
-    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
-    std::vector<whisper_grammar_candidate>                              candidates_grammar;
+    if (seek_end < seek_start + delta_min) {
+        WHISPER_LOG_WARN("%s: input is too short - %d ms < 100 ms. consider padding the input audio with silence\n", __func__, (seek_end - seek_start)*10);
+        return 0;
+    }
 
-    for (whisper_token id = 0; id < eot; ++id) {
-        const std::string & text = ctx.vocab.id_to_token[id];
-        if (!text.empty()) {
-            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
-            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+    // a set of temperatures to use
+    // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
+    std::vector<float> temperatures;
+    if (params.temperature_inc > 0.0f) {
+        for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
+            temperatures.push_back(t);
         }
+    } else {
+        temperatures.push_back(params.temperature);
     }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    // initialize the decoders
+    int n_decoders = 1;
 
-    for (const auto & reject : rejects) {
-        logits[reject.id] -= params.grammar_penalty;
-    }
+    switch (params.strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                n_decoders = params.greedy.best_of;
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
+            } break;
+    };
 
-    // when the grammar allows a continuation, we penalize the end-of-text token
-    //if (!allow_eot) {
-    //    logits[eot] -= params.grammar_penalty;
-    //}
-    //fprintf(stderr, "Allowed: (%zu tokens)\n", size - rejects.size());
-}
+    n_decoders = std::max(1, n_decoders);
 
-static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
-        return;
+    if (n_decoders > WHISPER_MAX_DECODERS) {
+        WHISPER_LOG_ERROR("%s: too many decoders requested (%d), max = %d\n", __func__, n_decoders, WHISPER_MAX_DECODERS);
+        return -4;
     }
 
-    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.id_to_token[token].c_str());
+    // TAGS: WHISPER_DECODER_INIT
+    for (int j = 1; j < n_decoders; j++) {
+        auto & decoder = state->decoders[j];
+
+        decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
 
-    const std::string & text = ctx.vocab.id_to_token[token];
+        decoder.probs.resize   (ctx->vocab.n_vocab);
+        decoder.logits.resize  (ctx->vocab.n_vocab);
+        decoder.logprobs.resize(ctx->vocab.n_vocab);
+        decoder.logits_id.reserve(ctx->model.hparams.n_vocab);
 
-    if (text.rfind("[_", 0) == 0) {
-        // fprintf(stderr, " (skipped)\n");
-        return;
+        if (!params.resume) {
+            decoder.rng = std::mt19937(j);
+        }
     }
-    // fprintf(stderr, "\n");
 
-    // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
-    const auto & code_points = decoded.first;
-    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
+    // the accumulated text context split into static (prompt_past0) and dynamic (prompt_past1)
+    auto & prompt_past0 = state->prompt_past0;
+    auto & prompt_past1 = state->prompt_past1;
+    if (params.no_context && !params.resume) {
+        prompt_past0.clear();
+        prompt_past1.clear();
     }
-    grammar.partial_utf8 = decoded.second;
-}
 
-//////////////
-// END grammar
-//////////////
+    // calculate the maximum context budget for prompt history
+    const int max_prompt_ctx = std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2);
 
-////////////////////////////////////////////////////////////////////////////
+    // prepare prompt
+    {
+        std::vector<whisper_token> prompt_tokens;
 
-struct whisper_context_params * whisper_context_default_params_by_ref(void) {
-    struct whisper_context_params params = whisper_context_default_params();
+        // tokenize the initial prompt
+        if (!params.prompt_tokens && params.initial_prompt) {
+            prompt_tokens.resize(1024);
+            int n_needed = whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size());
+            if (n_needed < 0) {
+                prompt_tokens.resize(-n_needed);
+                n_needed = whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size());
+            }
+            prompt_tokens.resize(n_needed);
+            params.prompt_tokens   = prompt_tokens.data();
+            params.prompt_n_tokens = prompt_tokens.size();
+        }
+        // a resumed job has the initial prompt in its prompt history already
+        if (params.prompt_tokens && params.prompt_n_tokens > 0 && !params.resume) {
+            if (params.carry_initial_prompt) {
+                if (prompt_past0.empty()) {
+                    const int max_tokens = std::max(1, max_prompt_ctx - 1);
 
-    struct whisper_context_params* result = new whisper_context_params();
-    *result = params;
-    return result;
-}
+                    if (params.prompt_n_tokens > max_tokens) {
+                        WHISPER_LOG_WARN("%s: initial prompt is too long (%d tokens), will use only the last %d tokens\n",
+                                        __func__, params.prompt_n_tokens, max_tokens);
+                    }
 
-struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params params = whisper_full_default_params(strategy);
+                    const int n_tokens = std::min(params.prompt_n_tokens, max_tokens);
+                    prompt_past0.assign(params.prompt_tokens + (params.prompt_n_tokens - n_tokens), params.prompt_tokens + params.prompt_n_tokens);
+                }
+            } else {
+                for (int i = 0; i < params.prompt_n_tokens; ++i) {
+                    prompt_past1.push_back(params.prompt_tokens[i]);
+                }
+                std::rotate(prompt_past1.begin(), prompt_past1.end() - params.prompt_n_tokens, prompt_past1.end());
+            }
+        }
+    }
 
-    struct whisper_full_params* result = new whisper_full_params();
-    *result = params;
-    return result;
-}
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
 
-struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params result = {
-        /*.strategy          =*/ strategy,
+    // these tokens determine the task that will be performed
+    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
-        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
-        /*.n_max_text_ctx    =*/ 16384,
-        /*.offset_ms         =*/ 0,
-        /*.duration_ms       =*/ 0,
+    if (whisper_is_multilingual(ctx)) {
+        const int lang_id = whisper_lang_id(params.language);
+        state->lang_id = lang_id;
+        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
+        if (params.translate) {
+            prompt_init.push_back(whisper_token_translate(ctx));
+        } else {
+            prompt_init.push_back(whisper_token_transcribe(ctx));
+        }
+    }
 
-        /*.translate         =*/ false,
-        /*.no_context        =*/ true,
-        /*.no_timestamps     =*/ false,
-        /*.single_segment    =*/ false,
-        /*.print_special     =*/ false,
-        /*.print_progress    =*/ true,
-        /*.print_realtime    =*/ false,
-        /*.print_timestamps  =*/ true,
+    // first release distilled models require the "no_timestamps" token
+    {
+        const bool is_distil = ctx->model.hparams.n_text_layer == 2 && ctx->model.hparams.n_vocab != 51866;
+        if (is_distil && !params.no_timestamps) {
+            WHISPER_LOG_WARN("%s: using first release distilled models - forcing no_timestamps\n", __func__);
+            params.no_timestamps = true;
+        }
+    }
 
-        /*.token_timestamps  =*/ false,
-        /*.thold_pt          =*/ 0.01f,
-        /*.thold_ptsum       =*/ 0.01f,
-        /*.max_len           =*/ 0,
-        /*.split_on_word     =*/ false,
-        /*.max_tokens        =*/ 0,
+    if (params.no_timestamps) {
+        prompt_init.push_back(whisper_token_not(ctx));
+    }
 
-        /*.debug_mode        =*/ false,
-        /*.audio_ctx         =*/ 0,
+    int seek = params.resume ? std::max(seek_start, state->seek) : seek_start;
 
-        /*.tdrz_enable       =*/ false,
+    state->seek = seek;
 
-        /* suppress_regex    =*/ nullptr,
+    std::vector<whisper_token> prompt;
+    prompt.reserve(whisper_n_text_ctx(ctx));
 
-        /*.initial_prompt       =*/ nullptr,
-        /*.carry_initial_prompt =*/ false,
-        /*.prompt_tokens        =*/ nullptr,
-        /*.prompt_n_tokens      =*/ 0,
+    // a beam search candidate: the sequence of decoder_idx extended by token. it holds no tokens of its own, the
+    // decoders it wins extend their parent's sequence, in place when a beam continues itself
+    struct beam_candidate {
+        int decoder_idx;
 
-        /*.language          =*/ "en",
-        /*.detect_language   =*/ false,
+        whisper_token_data token;
 
-        /*.suppress_blank    =*/ true,
-        /*.suppress_nst      =*/ false,
+        double   sum_logprobs_all; // of the extended sequence
+        uint64_t hash;             // of the extended sequence, tells duplicate beams apart in O(1)
+    };
 
-        /*.temperature       =*/  0.0f,
-        /*.max_initial_ts    =*/  1.0f,
-        /*.length_penalty    =*/ -1.0f,
+    // what a decoder that another decoder continues from had before the step reassigned it
+    struct beam_source {
+        whisper_sequence sequence;
+        whisper_grammar  grammar;
 
-        /*.temperature_inc   =*/  0.2f,
-        /*.entropy_thold     =*/  2.4f,
-        /*.logprob_thold     =*/ -1.0f,
-        /*.no_speech_thold   =*/  0.6f,
+        int  seek_delta;
+        bool has_ts;
+    };
 
-        /*.greedy            =*/ {
-            /*.best_of   =*/ -1,
-        },
+    // arenas reused across steps and windows: candidates are overwritten in place, sources keep their buffers
+    std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
+    std::vector<int> n_bc_per_dec(n_decoders, 0);
+    std::vector<const beam_candidate *> beam_candidates;
+    std::vector<beam_source> beam_sources(n_decoders);
 
-        /*.beam_search      =*/ {
-            /*.beam_size =*/ -1,
+    struct encode_ahead_job {
+        std::thread thread;
 
-            /*.patience  =*/ -1.0f,
-        },
+        int  seek    = -1; // window being encoded, -1 = none
+        int  n_ctx   = 0;
+        int  mel_end = INT_MAX;
+        bool ok      = false;
 
-        /*.new_segment_callback           =*/ nullptr,
-        /*.new_segment_callback_user_data =*/ nullptr,
+        void wait() {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+
+        ~encode_ahead_job() {
+            wait();
+        }
+    } ahead;
+
+    // main loop
+    while (true) {
+        if (params.progress_callback) {
+            const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+
+            params.progress_callback(
+                ctx, state, progress_cur, params.progress_callback_user_data);
+        }
 
-        /*.progress_callback           =*/ nullptr,
-        /*.progress_callback_user_data =*/ nullptr,
+        // if only 100ms left, then stop
+        if (seek + delta_min >= seek_end) {
+            break;
+        }
 
-        /*.encoder_begin_callback           =*/ nullptr,
-        /*.encoder_begin_callback_user_data =*/ nullptr,
+        if (params.encoder_begin_callback) {
+            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
+                WHISPER_LOG_ERROR("%s: encoder_begin_callback returned false - aborting\n", __func__);
+                break;
+            }
+        }
 
-        /*.abort_callback                   =*/ nullptr,
-        /*.abort_callback_user_data         =*/ nullptr,
+        const int seek_window = whisper_vad_window_end(*state, seek, seek_end);
 
-        /*.logits_filter_callback           =*/ nullptr,
-        /*.logits_filter_callback_user_data =*/ nullptr,
+        if (params.audio_ctx == 0 && params.audio_ctx_auto) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_bucket(ctx->model.hparams.n_audio_ctx, seek_window - seek);
+        }
 
-        /*.grammar_rules   =*/ nullptr,
-        /*.n_grammar_rules =*/ 0,
-        /*.i_start_rule    =*/ 0,
-        /*.grammar_penalty =*/ 100.0f,
+        // encode audio features starting at offset seek
+        state->mel_end = seek_window < seek_end ? seek_window : INT_MAX;
+
+        bool encoded = false;
+        if (ahead.seek >= 0) {
+            ahead.wait();
+            if (ahead.ok && ahead.seek == seek && ahead.n_ctx == state->exp_n_audio_ctx && ahead.mel_end == state->mel_end) {
+                whisper_encode_ahead_take(*state, *state->ahead_state);
+                encoded = true;
+            } else {
+                WHISPER_LOG_DEBUG("%s: encoded ahead at %d but seeking to %d - encoding again\n", __func__, ahead.seek, seek);
+            }
+            whisper_encode_ahead_merge_timings(*state, *state->ahead_state);
+            ahead.seek = -1;
+        }
+        if (!encoded && state->dual && state->dual_role == 1) {
+            encoded = whisper_dual_take(*state, seek);
+        }
+        if (!encoded) {
+            if (params.encoder_window_callback) {
+                params.encoder_window_callback(ctx, state, seek, state->exp_n_audio_ctx, params.encoder_window_callback_user_data);
+            }
+            encoded = whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data);
+        }
+        state->mel_end = INT_MAX;
 
-        /*.vad                         =*/ false,
-        /*.vad_model_path              =*/ nullptr,
+        if (state->dual && state->dual_role == 0) {
+            whisper_dual_encoded(*state, seek, encoded);
+        }
 
-        /* vad_params =*/ whisper_vad_default_params(),
-    };
+        if (!encoded) {
+            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+            return -6;
+        }
 
-    switch (strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                result.greedy = {
-                    /*.best_of   =*/ 5,
-                };
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                result.beam_search = {
-                    /*.beam_size =*/ 5,
+        // most windows are followed by the one starting where they end
+        const int seek_next = std::min(seek + 100*WHISPER_CHUNK_SIZE, seek_window);
+        if (use_ahead && seek_next + delta_min < seek_end) {
+            auto & astate = *state->ahead_state;
 
-                    /*.patience  =*/ -1.0f,
-                };
-            } break;
-    }
+            const int window_next = whisper_vad_window_end(*state, seek_next, seek_end);
 
-    return result;
-}
+            astate.exp_n_audio_ctx = params.audio_ctx;
+            if (params.audio_ctx == 0 && params.audio_ctx_auto) {
+                astate.exp_n_audio_ctx = whisper_audio_ctx_bucket(ctx->model.hparams.n_audio_ctx, window_next - seek_next);
+            }
+            astate.mel_end = window_next < seek_end ? window_next : INT_MAX;
+
+            ahead.seek    = seek_next;
+            ahead.n_ctx   = astate.exp_n_audio_ctx;
+            ahead.mel_end = astate.mel_end;
+            ahead.ok      = false;
+            ahead.thread  = std::thread([&ahead, &astate, ctx, &params, seek_next]() {
+                ahead.ok = whisper_encode_internal(*ctx, astate, seek_next, params.n_threads, params.abort_callback, params.abort_callback_user_data);
+            });
+        }
 
-// forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
-static void whisper_exp_compute_token_level_timestamps(
-        struct whisper_context & ctx,
-          struct whisper_state & state,
-                           int   i_segment,
-                         float   thold_pt,
-                         float   thold_ptsum);
+        state->kv_prompt.clear();
 
-static inline bool should_split_on_word(const char * txt, bool split_on_word) {
-    if (!split_on_word) return true;
+        // the draft model encodes the same window lazily, once a greedy pass needs it
+        bool draft_encoded = false;
 
-    return txt[0] == ' ';
-}
+        // if there is a very short audio segment left to process, we remove any past prompt since it tends
+        // to confuse the decoder and often make it repeat or hallucinate stuff
+        if (seek > seek_start && seek + 500 >= seek_end) {
+            prompt_past0.clear();
+            prompt_past1.clear();
+        }
 
-static void whisper_exp_compute_token_level_timestamps_dtw(
-            struct whisper_context * ctx,
-              struct whisper_state * state,
-        struct whisper_full_params   params,
-                               int   i_segment,
-                            size_t   n_segments,
-                               int   seek,
-                               int   n_frames,
-                               int   medfilt_width,
-                               int   n_threads);
+        int best_decoder_id = 0;
 
-// wrap the last segment to max_len characters
-// returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
-    auto segment = state.result_all.back();
+        // fallbacks needed for this window, reported with its segments
+        int n_fail_p = 0;
+        int n_fail_h = 0;
 
-    int res = 1;
-    int acc = 0;
+        // the prompt decode found no speech in the window, nothing is sampled
+        bool no_speech_skip = false;
 
-    std::string text;
+        for (int it = 0; it < (int) temperatures.size(); ++it) {
+            const float t_cur = temperatures[it];
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
-        if (token.id >= whisper_token_eot(&ctx)) {
-            continue;
-        }
+            // a decoder failed the entropy threshold or repeated itself at this temperature
+            bool failed_h = false;
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
+            int n_decoders_cur = 1;
 
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
+            switch (params.strategy) {
+                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                    {
+                        if (t_cur > 0.0f) {
+                            n_decoders_cur = params.greedy.best_of;
+                        }
+                    } break;
+                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                    {
+                        if (t_cur > 0.0f) {
+                            n_decoders_cur = params.greedy.best_of;
+                        } else {
+                            n_decoders_cur = params.beam_search.beam_size;
+                        }
+                    } break;
+            };
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+            n_decoders_cur = std::max(1, n_decoders_cur);
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+            WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+            // speculative decoding only applies to a single deterministic decoder
+            const bool speculate = (use_draft || use_lookup) && n_decoders_cur == 1 && t_cur < 1e-6f;
 
-            acc = 0;
-            text = "";
+            if (speculate && use_draft && !draft_encoded) {
+                auto & dstate = *state->draft_state;
 
-            segment = state.result_all.back();
-            i = -1;
+                dstate.exp_n_audio_ctx = state->exp_n_audio_ctx;
+                if (!whisper_encode_internal(*params.draft_ctx, dstate, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                    WHISPER_LOG_ERROR("%s: failed to encode with the draft model\n", __func__);
+                    return -6;
+                }
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
-        }
-    }
+                // the cross attention changed, nothing in the draft KV cache is valid
+                whisper_kv_cache_clear(dstate.kv_self);
+                state->draft_past.clear();
 
-    state.result_all.back().text = std::move(text);
+                draft_encoded = true;
+            }
 
-    return res;
-}
+            // drafts verified by the last decode, and how many of them were accepted
+            state->draft_tokens.clear();
+            int n_accepted = 0;
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+            // TAGS: WHISPER_DECODER_INIT
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
 
-static void whisper_compute_logprobs(
-                const std::vector<float> & logits,
-                              const int    n_logits,
-                      std::vector<float> & logprobs) {
-    const float logit_max = *std::max_element(logits.begin(), logits.end());
-    float logsumexp = 0.0f;
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logsumexp += expf(logits[i] - logit_max);
-        }
-    }
-    logsumexp = logf(logsumexp) + logit_max;
+                whisper_sequence_clear(decoder.sequence);
+                decoder.sequence.result_len       = 0;
+                decoder.sequence.sum_logprobs_all = 0.0;
+                decoder.sequence.sum_logprobs     = -INFINITY;
+                decoder.sequence.avg_logprobs     = -INFINITY;
+                decoder.sequence.entropy          = 0.0;
+                decoder.sequence.score            = -INFINITY;
 
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logprobs[i] = logits[i] - logsumexp;
-        } else {
-            logprobs[i] = -INFINITY;
-        }
-    }
-}
+                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
 
-static void whisper_compute_probs(
-    const std::vector<float> & logits,
-                  const int    n_logits,
-    const std::vector<float> & logprobs,
-          std::vector<float> & probs)     {
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] == -INFINITY) {
-            probs[i] = 0.0f;
-        } else {
-            probs[i] = expf(logprobs[i]);
-        }
-    }
-}
+                decoder.failed    = false;
+                decoder.completed = false;
+                decoder.has_ts    = false;
 
-// process the logits for the selected decoder
-// - applies logit filters
-// - computes logprobs and probs
-// TODO: optimize
-static void whisper_process_logits(
-              struct whisper_context & ctx,
-               struct whisper_state  & state,
-              struct whisper_decoder & decoder,
-    const struct whisper_full_params   params,
-                               float   temperature) {
-    const auto & vocab      = ctx.vocab;
-    const auto & tokens_cur = decoder.sequence.tokens;
+                decoder.grammar = grammar;
+            }
 
-    const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+            // init prompt and kv cache for the current iteration
+            {
+                prompt.clear();
 
-    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+                if (params.n_max_text_ctx > 0 && t_cur < WHISPER_HISTORY_CONDITIONING_TEMP_CUTOFF) {
+                    const bool can_take0 = params.carry_initial_prompt && !prompt_past0.empty();
+                    const bool can_take1 = !prompt_past1.empty();
 
-    // extract the logits for the last token
-    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
-    auto & probs    = decoder.probs;
-    auto & logits   = decoder.logits;
-    auto & logprobs = decoder.logprobs;
-    {
-        logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
+                    if (max_prompt_ctx > 0 && (can_take0 || can_take1)) {
+                        // Always start with previous token marker to connect continuity
+                        prompt.push_back(whisper_token_prev(ctx));
 
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
+                        // Take static tokens (initial prompt) first
+                        int n_take0 = 0;
+                        if (can_take0) {
+                            n_take0 = prompt_past0.size();
+                            prompt.insert(prompt.end(), prompt_past0.end() - n_take0, prompt_past0.end());
+                        }
 
-        // will be populated a bit later
-        probs.resize(n_logits);
-        logprobs.resize(n_logits);
-    }
+                        // Fill remaining budget with dynamic tokens (rolling context)
+                        const int n_take1 = std::min<int>(max_prompt_ctx - n_take0 - 1, prompt_past1.size());
+                        prompt.insert(prompt.end(), prompt_past1.end() - n_take1, prompt_past1.end());
+                    }
+                }
 
-    // apply logit filters here
-    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
-    {
-        // suppress blank
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
-        if (params.suppress_blank) {
-            if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
-            }
-        }
+                // init new transcription with sot, language (opt) and task tokens
+                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+                // print the prompt
+                WHISPER_LOG_DEBUG("\n\n");
+                for (int i = 0; i < (int) prompt.size(); i++) {
+                    WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.token_str(prompt[i]));
+                }
+                WHISPER_LOG_DEBUG("\n\n");
 
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY;
+                // recreate the KV cache if the number of decoders has changed
+                if (state->kv_self_n_dec < n_decoders_cur) {
+                    WHISPER_LOG_DEBUG("%s: recreating KV cache: n_decoders_cur = %d\n", __func__, n_decoders_cur);
 
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
-        }
+                    whisper_kv_cache_free(state->kv_self);
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
+                    // overallocate to workaround KV cache fragmentation issues
+                    const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
 
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
-        }
+                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->params.type_kv,
+                                ctx->model.hparams.n_text_state,
+                                ctx->model.hparams.n_text_layer,
+                                GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
+                        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
+                        whisper_free_state(state);
+                        return -7;
+                    }
 
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
+                    state->kv_self_n_dec = n_decoders_cur;
+                    state->kv_prompt.clear();
+                    state->graph_decode.gf = nullptr;
+                }
 
-        if (params.logits_filter_callback) {
-            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
-        }
+                // keep the KV cells of the common prefix with the prompt decoded last time for this window
+                // the last prompt token is decoded again unless its logits are cached
+                const auto & kv_prompt = state->kv_prompt;
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
+                int n_past = 0;
+                while (n_past < (int) std::min(kv_prompt.size(), prompt.size()) && kv_prompt[n_past] == prompt[n_past]) {
+                    n_past++;
+                }
+                if (n_past == (int) prompt.size() && kv_prompt.size() != prompt.size()) {
+                    n_past--;
                 }
-            }
-        }
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
+                if (n_past == 0) {
+                    whisper_kv_cache_clear(state->kv_self);
+                } else {
+                    whisper_kv_cache_seq_rm(state->kv_self, -1, n_past, -1);
+                    for (int j = 1; j < state->kv_self_n_dec; ++j) {
+                        whisper_kv_cache_seq_rm(state->kv_self, j, -1, -1);
                     }
                 }
-            }
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
-        }
+                const int n_vocab  = ctx->vocab.n_vocab;
+                const int n_decode = prompt.size() - n_past;
 
-        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
-        {
-            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
-            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+                if (n_decode > 0) {
+                    whisper_batch_prep_legacy(state->batch, prompt.data() + n_past, n_decode, n_past, 0);
 
-            //WHISPER_LOG_INFO("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -8;
+                    }
 
-            if (last_was_timestamp) {
-                if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
+                    // Calculate no_speech probability after first decode.
+                    // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
+                    {
+                        const int n_logits = ctx->vocab.n_tokens();
+                        std::vector<float> logprobs(n_logits);
+                        std::vector<float> probs(n_logits);
+
+                        whisper_compute_logprobs(state->logits, n_logits, logprobs, probs);
+                        state->no_speech_prob = probs[whisper_token_nosp(ctx)];
                     }
+
+                    state->kv_prompt = prompt;
+                    state->kv_prompt_logits.assign(state->logits.begin() + (n_decode - 1)*n_vocab, state->logits.begin() + n_decode*n_vocab);
+                    state->kv_prompt_no_speech_prob = state->no_speech_prob;
                 } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    state->logits.resize(n_vocab);
+                    memcpy(state->logits.data(), state->kv_prompt_logits.data(), n_vocab*sizeof(float));
+                    state->no_speech_prob = state->kv_prompt_no_speech_prob;
                 }
-            }
-        }
 
-        // the initial timestamp cannot be larger than max_initial_ts
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-        if (is_initial && params.max_initial_ts > 0.0f) {
-            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
-            const int   tid0      = std::round(params.max_initial_ts/precision);
+                if (params.no_speech_skip_thold > 0.0f && state->no_speech_prob > params.no_speech_skip_thold) {
+                    WHISPER_LOG_DEBUG("%s: no_speech_prob %8.5f > %8.5f - skipping the window at %d\n",
+                            __func__, state->no_speech_prob, params.no_speech_skip_thold, seek);
+                    no_speech_skip = true;
+                    break;
+                }
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+                {
+                    const int64_t t_start_sample_us = ggml_time_us();
 
-        // condition timestamp tokens to be increasing
-        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
-        if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+                    state->decoders[0].i_batch = std::max(0, n_decode - 1);
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+                    whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
-        // populate the logprobs array (log_softmax)
-        whisper_compute_logprobs(logits, n_logits, logprobs);
+                    // the prompt is decoded once; the other decoders start from its KV cells and logits
+                    if (n_decoders_cur > 1) {
+                        whisper_kv_cache_seq_fork(state->kv_self, 0, n_decoders_cur);
+                    }
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
+                    for (int j = 1; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                        memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
                     }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    whisper_trace_add("sample", t_start_sample_us);
                 }
             }
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
-
-            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
+                const int64_t t_start_sample_us = ggml_time_us();
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
+                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+                    std::fill(n_bc_per_dec.begin(), n_bc_per_dec.end(), 0);
                 }
-            } else {
-                if (params.n_grammar_rules > 0) {
-                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
+                // sampling
+                {
+                    std::atomic<int> j_cur(0);
 
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
+                    auto process = [&]() {
+                        while (true) {
+                            const int j = j_cur.fetch_add(1);
 
-    // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
+                            if (j >= n_decoders_cur) {
+                                break;
+                            }
 
-#if 0
-    // print first 100 logits - token string : logit
-    //for (int i = 0; i < 10; i++) {
-    //    const auto token   = vocab.id_to_token.at(i);
-    //    const auto prob    = probs[i];
-    //    const auto logit   = logits[i];
-    //    const auto logprob = logprobs[i];
-    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
-    //}
+                            auto & decoder = state->decoders[j];
 
-    // print sorted
-    {
-        std::vector<std::pair<float, int>> pairs;
+                            if (decoder.completed || decoder.failed) {
+                                continue;
+                            }
 
-        for (int i = 0; i < n_logits; ++i) {
-            pairs.push_back(std::make_pair(probs[i], i));
-        }
+                            switch (params.strategy) {
+                                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                                    {
+                                        if (t_cur < 1e-6f) {
+                                            whisper_sequence_push(decoder.sequence, whisper_sample_token(*ctx, decoder, true), whisper_token_eot(ctx));
+                                        } else {
+                                            whisper_sequence_push(decoder.sequence, whisper_sample_token(*ctx, decoder, false), whisper_token_eot(ctx));
+                                        }
 
-        std::sort(pairs.begin(), pairs.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
-            return a.first > b.first;
-        });
+                                        decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
+                                    } break;
+                                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                                    {
+                                        whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
 
-        for (int i = 0; i < 10; i++) {
-            const auto token   = vocab.id_to_token.at(pairs[i].second);
-            const auto prob    = pairs[i].first;
-            const auto logit   = logits[pairs[i].second];
-            const auto logprob = logprobs[pairs[i].second];
-            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
-        }
+                                        auto & bc = bc_per_dec[j];
 
-        printf("----------------\n");
-    }
+                                        for (const auto & token : decoder.topk) {
+                                            if ((int) bc.size() <= n_bc_per_dec[j]) {
+                                                bc.emplace_back();
+                                            }
 
-    // "And", "and", " And", " and"
-    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+                                            auto & cur = bc[n_bc_per_dec[j]++];
 
-    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+                                            cur.decoder_idx      = j;
+                                            cur.token            = token;
+                                            cur.sum_logprobs_all = decoder.sequence.sum_logprobs_all + token.plog;
+                                            cur.hash             = whisper_sequence_hash_next(decoder.sequence.hash, token.id);
+                                        }
+                                    } break;
+                            };
+                        }
+                    };
 
-    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
-#endif
-}
+                    state->decoder_workers.run(std::min(params.n_threads, n_decoders_cur), process);
+                }
 
-static bool whisper_sequence_tokens_equal(const whisper_sequence & a, const whisper_sequence & b) {
-    if (a.tokens.size() != b.tokens.size()) {
-        return false;
-    }
-    // sequences are more likely to diverge at the end
-    for (int i = a.tokens.size() - 1; i >= 0; i--) {
-        if (a.tokens[i].id != b.tokens[i].id) {
-            return false;
-        }
-    }
-    return true;
-}
+                beam_candidates.clear();
+                for (int j = 0; j < n_decoders; ++j) {
+                    for (int k = 0; k < n_bc_per_dec[j]; ++k) {
+                        beam_candidates.push_back(&bc_per_dec[j][k]);
+                    }
 
-static whisper_token_data whisper_sample_token(
-            whisper_context & ctx,
-      const whisper_decoder & decoder,
-                       bool   best) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, -1, 0.0f,
-    };
+                    if (n_bc_per_dec[j] > 0) {
+                        state->n_sample += 1;
+                    }
+                }
 
-    const auto & vocab = ctx.vocab;
+                // for beam-search, choose the top candidates and update the KV caches
+                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+                    std::sort(
+                            beam_candidates.begin(),
+                            beam_candidates.end(),
+                            [](const beam_candidate * a, const beam_candidate * b) {
+                        if (a->sum_logprobs_all != b->sum_logprobs_all) {
+                            return a->sum_logprobs_all > b->sum_logprobs_all;
+                        }
+                        return a->decoder_idx < b->decoder_idx;
+                    });
 
-    const auto & probs    = decoder.probs;
-    const auto & logprobs = decoder.logprobs;
+                    uint32_t cur_c = 0;
 
-    const int n_logits = vocab.n_vocab;
+                    // the sequence each decoder continues from
+                    whisper_seq_id kv_src[WHISPER_MAX_DECODERS];
+                    const beam_candidate * selected[WHISPER_MAX_DECODERS] = {};
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        kv_src[j] = j;
+                    }
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
-            }
-        }
+                        if (cur_c >= beam_candidates.size()) {
+                            cur_c = 0;
+                        }
 
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
-    }
+                        const auto & cur = *beam_candidates[cur_c++];
 
-    if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
-        }
-    } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
+                        // all the candidates are one token longer than the beams; equal hashes are almost always equal
+                        // tokens, but the hash can collide, so only a full comparison drops a beam
+                        const auto same_tokens = [&](const beam_candidate & a, const beam_candidate & b) {
+                            if (a.hash != b.hash || a.token.id != b.token.id) {
+                                return false;
+                            }
 
-        result.id   = dist(decoder.rng);
-        result.p    = probs[result.id];
-        result.plog = logprobs[result.id];
-    }
+                            const auto & ta = state->decoders[a.decoder_idx].sequence.tokens;
+                            const auto & tb = state->decoders[b.decoder_idx].sequence.tokens;
 
-    if (result.id >= vocab.token_beg) {
-        result.tid = result.id;
-        result.pt  = result.p;
-    }
+                            if (ta.size() != tb.size()) {
+                                return false;
+                            }
 
-    return result;
-}
+                            for (size_t k = 0; k < ta.size(); ++k) {
+                                if (ta[k].id != tb[k].id) {
+                                    return false;
+                                }
+                            }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
-            whisper_context & ctx,
-            whisper_decoder & decoder,
-                        int   k) {
-    const auto & vocab = ctx.vocab;
+                            return true;
+                        };
 
-    const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
+                        while (beam_candidates.size() > cur_c && same_tokens(*beam_candidates[cur_c], cur) && i > 0) {
+                            ++cur_c;
+                        }
 
-    const int n_logits = vocab.n_vocab;
+                        selected[j] = &cur;
+                        kv_src[j]   = cur.decoder_idx;
+                    }
 
-    auto & logits_id = decoder.logits_id;
+                    // set aside the decoders others continue from before any of them is overwritten
+                    bool is_source[WHISPER_MAX_DECODERS] = {};
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (selected[j] && selected[j]->decoder_idx != j) {
+                            is_source[selected[j]->decoder_idx] = true;
+                        }
+                    }
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (is_source[j]) {
+                            const auto & decoder = state->decoders[j];
 
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
+                            beam_sources[j].sequence   = decoder.sequence;
+                            beam_sources[j].grammar    = decoder.grammar;
+                            beam_sources[j].seek_delta = decoder.seek_delta;
+                            beam_sources[j].has_ts     = decoder.has_ts;
+                        }
+                    }
 
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (!selected[j]) {
+                            continue;
+                        }
 
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
+                        auto & decoder = state->decoders[j];
 
-    whisper_token tid = vocab.token_beg;
+                        const auto & cur = *selected[j];
 
-    float pt    = 0.0;
-    float ptsum = 0.0;
+                        if (cur.decoder_idx != j) {
+                            const auto & src = beam_sources[cur.decoder_idx];
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+                            decoder.sequence   = src.sequence;
+                            decoder.grammar    = src.grammar;
+                            decoder.seek_delta = src.seek_delta;
+                            decoder.has_ts     = src.has_ts;
+                        }
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+                        whisper_sequence_push(decoder.sequence, cur.token, whisper_token_eot(ctx));
+                        decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
-        }
+                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                                __func__, j, cur.decoder_idx, ctx->vocab.token_str(decoder.sequence.tokens.back().id), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                    }
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
-    }
+                    whisper_kv_cache_seq_reorder(state->kv_self, kv_src, n_decoders_cur);
+                }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+                // update the decoder state
+                // - check if the sequence is completed
+                // - check if the sequence is failed
+                // - update sliding window based on timestamp tokens
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
 
-    for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
-        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
+                    if (decoder.completed || decoder.failed) {
+                        continue;
+                    }
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
+                    auto & has_ts     = decoder.has_ts;
+                    auto & failed     = decoder.failed;
+                    auto & completed  = decoder.completed;
+                    auto & seek_delta = decoder.seek_delta;
+                    auto & result_len = decoder.sequence.result_len;
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
-        }
-    }
+                    {
+                        const auto & token = decoder.sequence.tokens.back();
 
-    return result;
-}
+                        // timestamp token - update sliding window
+                        if (token.id > whisper_token_beg(ctx)) {
+                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
-static void whisper_sequence_score(
-        const struct whisper_full_params & params,
-                        whisper_sequence & sequence) {
-    if (sequence.result_len == 0) {
-        return;
-    }
+                            // do not allow to go back in time
+                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
+                                WHISPER_LOG_DEBUG("%s: decoder %d: failed due to seek_delta (%d > %d)\n", __func__, j, seek_delta, seek_delta_new);
+                                failed = true; // TODO: maybe this is not a failure ?
+                                continue;
+                            }
 
-    double result = 0.0f;
+                            seek_delta = seek_delta_new;
+                            result_len = i + 1;
+                            has_ts = true;
+                        }
 
-    for (int i = 0; i < sequence.result_len; ++i) {
-        result += sequence.tokens[i].plog;
-    }
+                        whisper_grammar_accept_token(*ctx, decoder.grammar, token.id);
 
-    sequence.sum_logprobs = result;
-    sequence.avg_logprobs = result/sequence.result_len;
+#ifdef WHISPER_DEBUG
+                        {
+                            const auto tt = token.pt > 0.10 ? ctx->vocab.token_text(token.tid) : "[?]";
+                            WHISPER_LOG_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
+                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.token_str(token.id));
+                        }
+#endif
 
-    double penalty = sequence.result_len;
+                        // end of segment
+                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
+                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
+                           (has_ts && seek + seek_delta + delta_min >= seek_end)       // end of audio reached (100ms)
+                           ) {
+                            if (result_len == 0 && !params.no_timestamps) {
+                                if (seek + seek_delta + delta_min >= seek_end) {
+                                    result_len = i + 1;
+                                } else {
+                                    WHISPER_LOG_DEBUG("%s: decoder %d failed (result_len = 0)\n", __func__, j);
+                                    failed = true;
+                                    continue;
+                                }
+                            }
 
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
-    }
+                            if (params.single_segment || params.no_timestamps) {
+                                result_len = i + 1;
+                                seek_delta = 100*WHISPER_CHUNK_SIZE;
+                            }
 
-    sequence.score = result/penalty;
+                            WHISPER_LOG_DEBUG("%s: decoder %d completed\n", __func__, j);
+                            completed = true;
+                            continue;
+                        }
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+                        // TESTS: if no tensors are loaded, it means we are running tests
+                        if (ctx->model.n_loaded == 0) {
+                            seek_delta = 100*WHISPER_CHUNK_SIZE;
+                            completed = true;
+                            continue;
+                        }
+                    }
 
-        int cnt = 0;
-        double entropy = 0.0f;
+                    // a decoder whose last 32 tokens already fail the entropy threshold is stuck in a repetition loop
+                    // stop it now instead of at n_max, so that the fallback to the next temperature starts early
+                    // (at the last temperature there is no fallback and the result is kept as is)
+                    if (it != (int) temperatures.size() - 1 && i >= 32 &&
+                        whisper_sequence_entropy(decoder.sequence, decoder.sequence.tokens.size()) < params.entropy_thold) {
+                        WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition (entropy < %8.5f)\n", __func__, j, params.entropy_thold);
+                        failed = true;
+                        state->n_fail_h++;
+                        failed_h = true;
+                        continue;
+                    }
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
-        }
+                    // the same for a loop on a longer phrase, which keeps the entropy of the last 32 tokens up
+                    if (it != (int) temperatures.size() - 1 && params.repeat_thold > 0) {
+                        if (const int period = whisper_sequence_repeat_period(decoder.sequence, params.repeat_thold)) {
+                            WHISPER_LOG_DEBUG("%s: decoder %d: failed due to a repeated phrase of %d tokens\n", __func__, j, period);
+                            failed = true;
+                            state->n_fail_h++;
+                            failed_h = true;
+                            continue;
+                        }
+                    }
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+                    // sometimes, the decoding can get stuck in a repetition loop
+                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
+                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
+                        WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition loop\n", __func__, j);
+                        failed = true;
+                        continue;
+                    }
+                }
 
-            //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
-        }
+                // [beam search] stop the live beams once the outcome is decided:
+                // - patience: enough beams have finished, ref: https://arxiv.org/pdf/2204.05424.pdf
+                // - no live beam can beat the best finished one anymore: the sum of logprobs only decreases
+                //   and the length penalty is at most the one of the longest possible result
+                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH && n_decoders_cur > 1) {
+                    int    n_finished    = 0;
+                    double best_finished = -INFINITY;
 
-        sequence.entropy = entropy;
-    }
-}
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
 
-static bool whisper_vad(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples,
-            std::vector<float> & filtered_samples) {
-    WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
-    int filtered_n_samples = 0;
+                        if (!decoder.completed || decoder.failed) {
+                            continue;
+                        }
 
-    // Clear any existing mapping table
-    state->vad_mapping_table.clear();
-    state->has_vad_segments = false;
+                        // same ranking and entropy check as when selecting the best decoder below
+                        whisper_sequence_score(params, decoder.sequence);
+                        if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+                            continue;
+                        }
 
-    if (state->vad_context == nullptr) {
-        struct whisper_vad_context_params vad_ctx_params = whisper_vad_default_context_params();
-        struct whisper_vad_context * vctx = whisper_vad_init_from_file_with_params(params.vad_model_path, vad_ctx_params);
-        if (vctx == nullptr) {
-            WHISPER_LOG_ERROR("%s: failed to initialize VAD context\n", __func__);
-            return false;
-        }
-        state->vad_context = vctx;
-    }
-    auto vctx = state->vad_context;
+                        n_finished++;
+                        best_finished = std::max(best_finished, decoder.sequence.score);
+                    }
 
-    const whisper_vad_params & vad_params = params.vad_params;
+                    const int n_patience = params.beam_search.patience > 0.0f
+                        ? std::max(1, std::min(n_decoders_cur, (int) std::round(n_decoders_cur*params.beam_search.patience)))
+                        : n_decoders_cur;
 
-    whisper_vad_segments * vad_segments = whisper_vad_segments_from_samples(vctx, vad_params, samples, n_samples);
+                    const int len_max = params.max_tokens > 0 ? std::min(n_max, params.max_tokens + 1) : n_max;
 
-    if (!vad_segments) {
-        return false;
-    }
+                    for (int j = 0; n_finished > 0 && j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
 
-    if (vad_segments->data.size() > 0) {
-        state->has_vad_segments = true;
-        ctx->state->vad_segments.clear();
-        ctx->state->vad_segments.reserve(vad_segments->data.size());
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
 
-        // Initialize the time mapping table
-        state->vad_mapping_table.clear();
-        state->vad_mapping_table.reserve(vad_segments->data.size() * 4);
+                        double sum_logprobs = 0.0;
+                        for (int k = 0; k < decoder.sequence.result_len; ++k) {
+                            sum_logprobs += decoder.sequence.tokens[k].plog;
+                        }
 
-        WHISPER_LOG_INFO("%s: detected %d speech segments\n", __func__, (int)vad_segments->data.size());
-        float overlap_seconds = vad_params.samples_overlap;
-        int overlap_samples = overlap_seconds * WHISPER_SAMPLE_RATE;
+                        if (n_finished >= n_patience || sum_logprobs/whisper_length_penalty(params, len_max) < best_finished) {
+                            WHISPER_LOG_DEBUG("%s: decoder %d: pruned (finished = %d, bound = %8.5f, best = %8.5f)\n",
+                                    __func__, j, n_finished, sum_logprobs/whisper_length_penalty(params, len_max), best_finished);
+                            decoder.failed = true;
+                        }
+                    }
+                }
 
-        for (int i = 0; i < (int)vad_segments->data.size(); i++) {
-            int segment_start_samples = cs_to_samples(vad_segments->data[i].start);
-            int segment_end_samples   = cs_to_samples(vad_segments->data[i].end);
+                // report the token just sampled by the best decoder so far
+                if (params.new_token_callback) {
+                    int j_best = -1;
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        const auto & decoder = state->decoders[j];
 
-            if (i < (int)vad_segments->data.size() - 1) {
-                segment_end_samples += overlap_samples;
-            }
-            segment_end_samples = std::min(segment_end_samples, n_samples - 1);
-            filtered_n_samples  += (segment_end_samples - segment_start_samples);
+                        if (decoder.failed || (int) decoder.sequence.tokens.size() != i + 1) {
+                            continue;
+                        }
+                        if (j_best < 0 || decoder.sequence.sum_logprobs_all > state->decoders[j_best].sequence.sum_logprobs_all) {
+                            j_best = j;
+                        }
+                    }
 
-            WHISPER_LOG_INFO("%s: Including segment %d: %.2f - %.2f (duration: %.2f)\n",
-                __func__, i, vad_segments->data[i].start/100.0,
-                (vad_segments->data[i].end/100.0 + (i < (int)vad_segments->data.size() - 1 ? overlap_seconds : 0)),
-                (vad_segments->data[i].end - vad_segments->data[i].start)/100.0 +
-                (i < (int)vad_segments->data.size() - 1 ? overlap_seconds : 0));
-        }
+                    if (j_best >= 0) {
+                        const auto & tokens = state->decoders[j_best].sequence.tokens;
 
-        int silence_samples = 0.1 * WHISPER_SAMPLE_RATE;
-        int total_silence_samples = (vad_segments->data.size() > 1) ? (vad_segments->data.size() - 1) * silence_samples : 0;
-        int total_samples_needed = filtered_n_samples + total_silence_samples;
+                        bool stable = true;
+                        for (int j = 0; j < n_decoders_cur && stable; ++j) {
+                            const auto & decoder = state->decoders[j];
 
-        WHISPER_LOG_INFO("%s: total duration of speech segments: %.2f seconds\n",
-                        __func__, (float)filtered_n_samples / WHISPER_SAMPLE_RATE);
+                            if (j == j_best || decoder.failed) {
+                                continue;
+                            }
+                            if ((int) decoder.sequence.tokens.size() <= i) {
+                                stable = false;
+                                break;
+                            }
+                            for (int k = 0; k <= i; ++k) {
+                                if (decoder.sequence.tokens[k].id != tokens[k].id) {
+                                    stable = false;
+                                    break;
+                                }
+                            }
+                        }
 
-        try {
-            filtered_samples.resize(total_samples_needed);
-        } catch (const std::bad_alloc & /* e */) {
-            WHISPER_LOG_ERROR("%s: failed to allocate memory for filtered samples\n", __func__);
-            whisper_vad_free_segments(vad_segments);
-            return false;
-        }
+                        whisper_token_data token = tokens[i];
+
+                        token.t0 = seek;
+                        for (int k = i - 1; k >= 0; --k) {
+                            if (tokens[k].id > whisper_token_beg(ctx)) {
+                                token.t0 = seek + 2*(tokens[k].id - whisper_token_beg(ctx));
+                                break;
+                            }
+                        }
+                        token.t1 = token.id > whisper_token_beg(ctx) ? seek + 2*(token.id - whisper_token_beg(ctx)) : token.t0;
 
-        int offset = 0;
-        for (int i = 0; i < (int)vad_segments->data.size(); i++) {
-            int segment_start_samples = cs_to_samples(vad_segments->data[i].start);
-            int segment_end_samples   = cs_to_samples(vad_segments->data[i].end);
+                        params.new_token_callback(ctx, state, &token, i, stable, params.new_token_callback_user_data);
+                    }
+                }
 
-            if (i < (int)vad_segments->data.size() - 1) {
-                segment_end_samples += overlap_samples;
-            }
+                // check if all decoders have finished (i.e. completed or failed)
+                {
+                    bool completed_all = true;
 
-            segment_start_samples = std::min(segment_start_samples, n_samples - 1);
-            segment_end_samples = std::min(segment_end_samples, n_samples);
-            int segment_length = segment_end_samples - segment_start_samples;
-            if (segment_length > 0) {
-                whisper_state::vad_segment_info segment;
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
 
-                segment.orig_start = vad_segments->data[i].start;
-                segment.orig_end   = vad_segments->data[i].end;
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
 
-                segment.vad_start = samples_to_cs(offset);
-                segment.vad_end   = samples_to_cs(offset + segment_length);
+                        completed_all = false;
+                    }
 
-                // Add segment boundaries to mapping table
-                vad_time_mapping start_mapping = {segment.vad_start, segment.orig_start};
-                vad_time_mapping end_mapping = {segment.vad_end, segment.orig_end};
+                    if (completed_all) {
+                        break;
+                    }
+                }
 
-                state->vad_mapping_table.push_back(start_mapping);
-                state->vad_mapping_table.push_back(end_mapping);
+                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                whisper_trace_add("sample", t_start_sample_us);
 
-                // Add intermediate points for longer segments to improve interpolation accuracy
-                const int64_t min_segment_length = 100; // 1 second
-                const int64_t point_interval = 20;     // Add a point every 200ms
+                // obtain logits for the next token
+                if (speculate && n_accepted < (int) state->draft_tokens.size() &&
+                    state->decoders[0].sequence.tokens.back().id == state->draft_tokens[n_accepted]) {
+                    // the sampled token matches the draft - its logits came with the last decode
+                    state->decoders[0].i_batch = ++n_accepted;
+                } else if (speculate) {
+                    auto & batch   = state->batch;
+                    auto & decoder = state->decoders[0];
 
-                if (segment.vad_end - segment.vad_start > min_segment_length) {
-                    int64_t segment_duration = segment.vad_end - segment.vad_start;
-                    int num_points = (int)(segment_duration / point_interval) - 1;
+                    const int n_past = prompt.size() + i;
 
-                    for (int j = 1; j <= num_points; j++) {
-                        int64_t vad_time = segment.vad_start + j * point_interval;
+                    // drop the rejected drafts
+                    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
 
-                        if (vad_time >= segment.vad_end) continue;
+                    // stay within the positional embedding
+                    const int n_draft = std::min(params.n_draft, whisper_n_text_ctx(ctx) - n_past - 1);
 
-                        int64_t vad_elapsed = vad_time - segment.vad_start;
-                        int64_t vad_total = segment.vad_end - segment.vad_start;
-                        int64_t orig_total = segment.orig_end - segment.orig_start;
-                        int64_t orig_time = segment.orig_start + (vad_elapsed * orig_total) / vad_total;
+                    if (use_lookup) {
+                        whisper_lookup_propose(*state, decoder, prompt, params.n_lookup, n_draft, whisper_token_eot(ctx));
+                    } else if (!whisper_draft_propose(*state, decoder, prompt, params, n_draft)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode with the draft model\n", __func__);
+                        return -9;
+                    }
 
-                        vad_time_mapping intermediate_mapping = {vad_time, orig_time};
-                        state->vad_mapping_table.push_back(intermediate_mapping);
+                    // verify the sampled token and all drafts in one pass
+                    batch.n_tokens = 0;
+                    for (int k = -1; k < (int) state->draft_tokens.size(); ++k) {
+                        batch.token   [batch.n_tokens]    = k < 0 ? decoder.sequence.tokens.back().id : state->draft_tokens[k];
+                        batch.pos     [batch.n_tokens]    = n_past + k + 1;
+                        batch.n_seq_id[batch.n_tokens]    = 1;
+                        batch.seq_id  [batch.n_tokens][0] = 0;
+                        batch.logits  [batch.n_tokens]    = 1;
+                        batch.n_tokens++;
                     }
-                }
 
-                WHISPER_LOG_INFO("%s: vad_segment_info: orig_start: %.2f, orig_end: %.2f, vad_start: %.2f, vad_end: %.2f\n",
-                    __func__, segment.orig_start/100.0, segment.orig_end/100.0, segment.vad_start/100.0, segment.vad_end/100.0);
-                ctx->state->vad_segments.push_back(segment);
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -9;
+                    }
 
-                // Copy this speech segment
-                memcpy(filtered_samples.data() + offset, samples + segment_start_samples, segment_length * sizeof(float));
-                offset += segment_length;
+                    decoder.i_batch = 0;
+                    n_accepted = 0;
+                }
 
-                // Add silence after this segment (except after the last segment)
-                if (i < (int)vad_segments->data.size() - 1) {
-                    // Calculate the start and end time of the silence gap in processed audio
-                    int64_t silence_start_vad = samples_to_cs(offset);
-                    int64_t silence_end_vad = samples_to_cs(offset + silence_samples);
-                    // Calculate the corresponding original times
-                    int64_t orig_silence_start = segment.orig_end;
-                    int64_t orig_silence_end = vad_segments->data[i+1].start;
+                if (speculate) {
+                    const int64_t t_start_sample_us = ggml_time_us();
 
-                    // Add mapping points for silence boundaries
-                    state->vad_mapping_table.push_back({silence_start_vad, orig_silence_start});
-                    state->vad_mapping_table.push_back({silence_end_vad, orig_silence_end});
+                    whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
-                    // Fill with zeros (silence)
-                    memset(filtered_samples.data() + offset, 0, silence_samples * sizeof(float));
-                    offset += silence_samples;
-                }
-            }
-        }
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    whisper_trace_add("sample", t_start_sample_us);
+                } else {
+                    auto & batch = state->batch;
 
-        // Sort the mapping table by processed time
-        std::sort(state->vad_mapping_table.begin(), state->vad_mapping_table.end(),
-            [](const vad_time_mapping& a, const vad_time_mapping& b) {
-                return a.processed_time < b.processed_time;
-        });
+                    batch.n_tokens = 0;
 
-        // Remove any duplicate processed times to ensure monotonicity which is
-        // needed for binary search and interpolation later.
-        if (!state->vad_mapping_table.empty()) {
-            auto last = std::unique(state->vad_mapping_table.begin(), state->vad_mapping_table.end(),
-                [](const vad_time_mapping& a, const vad_time_mapping& b) {
-                    return a.processed_time == b.processed_time;
-                });
-            state->vad_mapping_table.erase(last, state->vad_mapping_table.end());
-        }
+                    const int n_past = prompt.size() + i;
 
-        WHISPER_LOG_INFO("%s: Created time mapping table with %d points\n", __func__, (int)state->vad_mapping_table.size());
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
 
-        filtered_n_samples = offset;
-        WHISPER_LOG_INFO("%s: Reduced audio from %d to %d samples (%.1f%% reduction)\n",
-                        __func__, n_samples, filtered_n_samples, 100.0f * (1.0f - (float)filtered_n_samples / n_samples));
-    }
+                        if (decoder.failed || decoder.completed) {
+                            continue;
+                        }
 
-    whisper_vad_free_segments(vad_segments);
-    return true;
-}
+                        //WHISPER_LOG_DEBUG("%s: decoder %d: token %d, seek_delta %d\n", __func__, j, decoder.sequence.tokens.back().id, decoder.seek_delta);
 
-int whisper_full_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    // clear old results
-    auto & result_all = state->result_all;
+                        decoder.i_batch = batch.n_tokens;
 
-    result_all.clear();
+                        batch.token   [batch.n_tokens]    = decoder.sequence.tokens.back().id;
+                        batch.pos     [batch.n_tokens]    = n_past;
+                        batch.n_seq_id[batch.n_tokens]    = 1;
+                        batch.seq_id  [batch.n_tokens][0] = j;
+                        batch.logits  [batch.n_tokens]    = 1;
+                        batch.n_tokens++;
+                    }
 
-    if (n_samples > 0) {
-        // compute log mel spectrogram
-        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
-            return -2;
-        }
-    }
+                    assert(batch.n_tokens > 0);
 
-    // auto-detect language if not specified
-    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
-        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -9;
+                    }
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
-        if (lang_id < 0) {
-            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
-            return -3;
-        }
-        state->lang_id = lang_id;
-        params.language = whisper_lang_str(lang_id);
+                    const int64_t t_start_sample_us = ggml_time_us();
 
-        WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
-        if (params.detect_language) {
-            return 0;
-        }
-    }
+                    {
+                        std::atomic<int> j_cur(0);
 
-    if (params.token_timestamps) {
-        state->t_beg    = 0;
-        state->t_last   = 0;
-        state->tid_last = 0;
-        if (n_samples > 0) {
-            state->energy = get_signal_energy(samples, n_samples, 32);
-        }
-    }
+                        auto process = [&]() {
+                            while (true) {
+                                const int j = j_cur.fetch_add(1);
 
-    const int seek_start = params.offset_ms/10;
-    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+                                if (j >= n_decoders_cur) {
+                                    break;
+                                }
 
-    // if length of spectrogram is less than 100ms (10 frames), then return
-    // basically don't process anything that is less than 100ms
-    // ref: https://github.com/ggml-org/whisper.cpp/issues/2065
-    const int delta_min = 10;
+                                auto & decoder = state->decoders[j];
 
-    if (seek_end < seek_start + delta_min) {
-        WHISPER_LOG_WARN("%s: input is too short - %d ms < 100 ms. consider padding the input audio with silence\n", __func__, (seek_end - seek_start)*10);
-        return 0;
-    }
+                                if (decoder.failed || decoder.completed) {
+                                    continue;
+                                }
 
-    // a set of temperatures to use
-    // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
-    std::vector<float> temperatures;
-    if (params.temperature_inc > 0.0f) {
-        for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
-            temperatures.push_back(t);
-        }
-    } else {
-        temperatures.push_back(params.temperature);
-    }
+                                whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+                            }
+                        };
 
-    // initialize the decoders
-    int n_decoders = 1;
+                        state->decoder_workers.run(std::min(params.n_threads, n_decoders_cur), process);
+                    }
 
-    switch (params.strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                n_decoders = params.greedy.best_of;
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    whisper_trace_add("sample", t_start_sample_us);
+                }
+            }
+
+            // rank the resulting sequences and select the best one
             {
-                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
-            } break;
-    };
+                double best_score = -INFINITY;
 
-    n_decoders = std::max(1, n_decoders);
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
 
-    if (n_decoders > WHISPER_MAX_DECODERS) {
-        WHISPER_LOG_ERROR("%s: too many decoders requested (%d), max = %d\n", __func__, n_decoders, WHISPER_MAX_DECODERS);
-        return -4;
-    }
+                    if (decoder.failed) {
+                        continue;
+                    }
 
-    // TAGS: WHISPER_DECODER_INIT
-    for (int j = 1; j < n_decoders; j++) {
-        auto & decoder = state->decoders[j];
+                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
+                    whisper_sequence_score(params, decoder.sequence);
+
+                    WHISPER_LOG_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
+                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+
+                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+                        WHISPER_LOG_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
+                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+
+                        decoder.failed = true;
+                        state->n_fail_h++;
+                        failed_h = true;
+
+                        continue;
+                    }
+
+                    if (best_score < decoder.sequence.score) {
+                        best_score = decoder.sequence.score;
+                        best_decoder_id = j;
+                    }
+                }
 
-        decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+                WHISPER_LOG_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
+            }
 
-        decoder.probs.resize   (ctx->vocab.n_vocab);
-        decoder.logits.resize  (ctx->vocab.n_vocab);
-        decoder.logprobs.resize(ctx->vocab.n_vocab);
-        decoder.logits_id.reserve(ctx->model.hparams.n_vocab);
+            bool success = true;
 
-        decoder.rng = std::mt19937(j);
-    }
+            // was the decoding successful for the current temperature?
+            // do fallback only if:
+            // - we are not at the last temperature
+            if (it != (int) temperatures.size() - 1) {
+                const auto & decoder = state->decoders[best_decoder_id];
 
-    // the accumulated text context split into static (prompt_past0) and dynamic (prompt_past1)
-    auto & prompt_past0 = state->prompt_past0;
-    auto & prompt_past1 = state->prompt_past1;
-    if (params.no_context) {
-        prompt_past0.clear();
-        prompt_past1.clear();
-    }
+                if (decoder.failed ||
+                    (decoder.sequence.avg_logprobs < params.logprob_thold && state->no_speech_prob < params.no_speech_thold)) {
+                    WHISPER_LOG_DEBUG("%s: failed due to avg_logprobs %8.5f < %8.5f and no_speech_prob %8.5f < %8.5f\n", __func__, decoder.sequence.avg_logprobs, params.logprob_thold, state->no_speech_prob, params.no_speech_thold);
+                    success = false;
+                    state->n_fail_p++;
 
-    // calculate the maximum context budget for prompt history
-    const int max_prompt_ctx = std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2);
+                    // one fallback per temperature, put down to the entropy threshold when it failed the best decoder
+                    if (decoder.failed && failed_h) {
+                        n_fail_h++;
+                    } else {
+                        n_fail_p++;
+                    }
+                }
+            }
 
-    // prepare prompt
-    {
-        std::vector<whisper_token> prompt_tokens;
+            if (success) {
+                //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
+                //    WHISPER_LOG_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
+                //}
 
-        // tokenize the initial prompt
-        if (!params.prompt_tokens && params.initial_prompt) {
-            prompt_tokens.resize(1024);
-            int n_needed = whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size());
-            if (n_needed < 0) {
-                prompt_tokens.resize(-n_needed);
-                n_needed = whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size());
+                break;
             }
-            prompt_tokens.resize(n_needed);
-            params.prompt_tokens   = prompt_tokens.data();
-            params.prompt_n_tokens = prompt_tokens.size();
-        }
-        if (params.prompt_tokens && params.prompt_n_tokens > 0) {
-            if (params.carry_initial_prompt) {
-                if (prompt_past0.empty()) {
-                    const int max_tokens = std::max(1, max_prompt_ctx - 1);
 
-                    if (params.prompt_n_tokens > max_tokens) {
-                        WHISPER_LOG_WARN("%s: initial prompt is too long (%d tokens), will use only the last %d tokens\n",
-                                        __func__, params.prompt_n_tokens, max_tokens);
-                    }
+            WHISPER_LOG_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
+        }
 
-                    const int n_tokens = std::min(params.prompt_n_tokens, max_tokens);
-                    prompt_past0.assign(params.prompt_tokens + (params.prompt_n_tokens - n_tokens), params.prompt_tokens + params.prompt_n_tokens);
-                }
-            } else {
-                for (int i = 0; i < params.prompt_n_tokens; ++i) {
-                    prompt_past1.push_back(params.prompt_tokens[i]);
-                }
-                std::rotate(prompt_past1.begin(), prompt_past1.end() - params.prompt_n_tokens, prompt_past1.end());
+        if (no_speech_skip) {
+            // no segment, and the prompt history of the next window stays as it was
+            int seek_delta = std::min(seek_window - seek, WHISPER_CHUNK_SIZE*100);
+            if (state->dual) {
+                seek_delta = whisper_dual_agree(*state, seek_delta);
             }
-        }
-    }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
+            seek += seek_delta;
 
-    // these tokens determine the task that will be performed
-    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
+            state->seek = seek;
 
-    if (whisper_is_multilingual(ctx)) {
-        const int lang_id = whisper_lang_id(params.language);
-        state->lang_id = lang_id;
-        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
-        if (params.translate) {
-            prompt_init.push_back(whisper_token_translate(ctx));
-        } else {
-            prompt_init.push_back(whisper_token_transcribe(ctx));
+            continue;
         }
-    }
 
-    // first release distilled models require the "no_timestamps" token
-    {
-        const bool is_distil = ctx->model.hparams.n_text_layer == 2 && ctx->model.hparams.n_vocab != 51866;
-        if (is_distil && !params.no_timestamps) {
-            WHISPER_LOG_WARN("%s: using first release distilled models - forcing no_timestamps\n", __func__);
-            params.no_timestamps = true;
-        }
-    }
+        // output results through a user-provided callback
+        {
+            auto & best_decoder = state->decoders[best_decoder_id];
 
-    if (params.no_timestamps) {
-        prompt_init.push_back(whisper_token_not(ctx));
-    }
+            // never skip audio the encoder did not see
+            auto seek_delta = std::min(best_decoder.seek_delta, seek_window - seek);
+            auto result_len = best_decoder.sequence.result_len;
 
-    int seek = seek_start;
+            // ref: https://github.com/ggml-org/whisper.cpp/pull/2629
+            const bool single_timestamp_ending = best_decoder.sequence.tokens.size() > 1 &&
+                best_decoder.sequence.tokens[best_decoder.sequence.tokens.size() - 2].id < whisper_token_beg(ctx) &&
+                best_decoder.sequence.tokens[best_decoder.sequence.tokens.size() - 1].id > whisper_token_beg(ctx);
+
+            // whisper_full_dual(): with a shorter seek_delta of the other task, the segments past it are decoded
+            // again with the next window
+            int seek_delta_dual = -1;
+            if (state->dual) {
+                const int seek_delta_own = single_timestamp_ending ? std::min(seek_window - seek, WHISPER_CHUNK_SIZE * 100) : seek_delta;
+
+                const int seek_delta_agreed = whisper_dual_agree(*state, seek_delta_own);
+                if (seek_delta_agreed < seek_delta_own) {
+                    result_len = whisper_dual_cut(*ctx, best_decoder.sequence.tokens, seek_delta_agreed);
+                    best_decoder.sequence.tokens.resize(result_len);
+
+                    seek_delta      = seek_delta_agreed;
+                    seek_delta_dual = seek_delta_agreed;
+                }
+            }
 
-    std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
+            const auto & tokens_cur = best_decoder.sequence.tokens;
 
-    struct beam_candidate {
-        int decoder_idx;
-        int seek_delta;
+            // [EXPERIMENTAL] Token-level timestamps with DTW
+            const auto n_segments_before = state->result_all.size();
 
-        bool has_ts;
+            const bool is_no_speech = (state->no_speech_prob > params.no_speech_thold &&
+                best_decoder.sequence.avg_logprobs < params.logprob_thold);
 
-        whisper_sequence sequence;
-        whisper_grammar grammar;
-    };
+            //WHISPER_LOG_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
 
-    std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
-    std::vector<beam_candidate> beam_candidates;
+            // update prompt_past1
+            prompt_past1.clear();
+            if (!params.carry_initial_prompt && !prompt.empty() && prompt.front() == whisper_token_prev(ctx)) {
+                prompt_past1.insert(prompt_past1.end(), prompt.begin() + 1, prompt.end() - prompt_init.size());
+            }
 
-    // main loop
-    while (true) {
-        if (params.progress_callback) {
-            const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+            // Add newly decoded tokens to the rolling context
+            if (!is_no_speech) {
+                for (int i = 0; i < result_len; ++i) {
+                    prompt_past1.push_back(tokens_cur[i].id);
+                }
+            }
 
-            params.progress_callback(
-                ctx, state, progress_cur, params.progress_callback_user_data);
-        }
+            if (!tokens_cur.empty() && ctx->model.n_loaded > 0 && !is_no_speech) {
+                int  i0 = 0;
+                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
 
-        // if only 100ms left, then stop
-        if (seek + delta_min >= seek_end) {
-            break;
-        }
+                std::string text;
+                bool speaker_turn_next = false;
 
-        if (params.encoder_begin_callback) {
-            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
-                WHISPER_LOG_ERROR("%s: encoder_begin_callback returned false - aborting\n", __func__);
-                break;
-            }
-        }
+                for (int i = 0; i < (int) tokens_cur.size(); i++) {
+                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
+                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
+                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
-            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
-            return -6;
-        }
+                    if (params.print_special || !ctx->vocab.has_flag(tokens_cur[i].id, whisper_vocab::TOKEN_SPECIAL)) {
+                        text += ctx->vocab.token_str(tokens_cur[i].id);
+                    }
 
-        // if there is a very short audio segment left to process, we remove any past prompt since it tends
-        // to confuse the decoder and often make it repeat or hallucinate stuff
-        if (seek > seek_start && seek + 500 >= seek_end) {
-            prompt_past0.clear();
-            prompt_past1.clear();
-        }
+                    // [TDRZ] record if speaker turn was predicted after current segment
+                    if (params.tdrz_enable && tokens_cur[i].id == whisper_token_solm(ctx)) {
+                        speaker_turn_next = true;
+                    }
 
-        int best_decoder_id = 0;
+                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
+                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
 
-        for (int it = 0; it < (int) temperatures.size(); ++it) {
-            const float t_cur = temperatures[it];
+                        if (!text.empty()) {
+                            const auto tt0 = t0;
+                            const auto tt1 = t1;
 
-            int n_decoders_cur = 1;
+                            if (params.print_realtime) {
+                                if (params.print_timestamps) {
+                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                                } else {
+                                    printf("%s", text.c_str());
+                                    fflush(stdout);
+                                }
+                            }
 
-            switch (params.strategy) {
-                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
+                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+
+                            result_all.push_back({ tt0, tt1, text, state->no_speech_prob, {}, speaker_turn_next, n_fail_p, n_fail_h });
+                            for (int j = i0; j <= i; j++) {
+                                result_all.back().tokens.push_back(tokens_cur[j]);
+                            }
+
+                            int n_new = 1;
+
+                            if (params.token_timestamps) {
+                                whisper_exp_compute_token_level_timestamps(
+                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum, samples, n_samples);
+
+                                if (params.max_len > 0) {
+                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                                }
+                            }
+                            if (params.new_segment_callback && !ctx->params.dtw_token_timestamps) {
+                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                            }
                         }
-                    } break;
-                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        } else {
-                            n_decoders_cur = params.beam_search.beam_size;
+                        text = "";
+                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
+                            i++;
                         }
-                    } break;
-            };
+                        i--;
+                        t0 = t1;
+                        i0 = i + 1;
+                        speaker_turn_next = false;
+                    }
+                }
 
-            n_decoders_cur = std::max(1, n_decoders_cur);
+                if (!text.empty()) {
+                    const auto t1 = seek + seek_delta;
 
-            WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
+                    const auto tt0 = t0;
+                    const auto tt1 = t1;
 
-            // TAGS: WHISPER_DECODER_INIT
-            for (int j = 0; j < n_decoders_cur; ++j) {
-                auto & decoder = state->decoders[j];
+                    if (params.print_realtime) {
+                        if (params.print_timestamps) {
+                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                        } else {
+                            printf("%s", text.c_str());
+                            fflush(stdout);
+                        }
+                    }
 
-                decoder.sequence.tokens.clear();
-                decoder.sequence.result_len       = 0;
-                decoder.sequence.sum_logprobs_all = 0.0;
-                decoder.sequence.sum_logprobs     = -INFINITY;
-                decoder.sequence.avg_logprobs     = -INFINITY;
-                decoder.sequence.entropy          = 0.0;
-                decoder.sequence.score            = -INFINITY;
+                    result_all.push_back({ tt0, tt1, text, state->no_speech_prob, {}, speaker_turn_next, n_fail_p, n_fail_h });
+                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
+                        result_all.back().tokens.push_back(tokens_cur[j]);
+                    }
 
-                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+                    int n_new = 1;
 
-                decoder.failed    = false;
-                decoder.completed = false;
-                decoder.has_ts    = false;
+                    if (params.token_timestamps) {
+                        whisper_exp_compute_token_level_timestamps(
+                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum, samples, n_samples);
 
-                if (params.grammar_rules != nullptr) {
-                    decoder.grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
-                } else {
-                    decoder.grammar = {};
+                        if (params.max_len > 0) {
+                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                        }
+                    }
+                    if (params.new_segment_callback && !ctx->params.dtw_token_timestamps) {
+                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                    }
                 }
             }
 
-            // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
+            // FIXME: will timestamp offsets be correct?
+            // [EXPERIMENTAL] Token-level timestamps with DTW
             {
-                prompt.clear();
-
-                if (params.n_max_text_ctx > 0 && t_cur < WHISPER_HISTORY_CONDITIONING_TEMP_CUTOFF) {
-                    const bool can_take0 = params.carry_initial_prompt && !prompt_past0.empty();
-                    const bool can_take1 = !prompt_past1.empty();
-
-                    if (max_prompt_ctx > 0 && (can_take0 || can_take1)) {
-                        // Always start with previous token marker to connect continuity
-                        prompt.push_back(whisper_token_prev(ctx));
-
-                        // Take static tokens (initial prompt) first
-                        int n_take0 = 0;
-                        if (can_take0) {
-                            n_take0 = prompt_past0.size();
-                            prompt.insert(prompt.end(), prompt_past0.end() - n_take0, prompt_past0.end());
+                const int n_segments = state->result_all.size() - n_segments_before;
+                if (ctx->params.dtw_token_timestamps && n_segments) {
+                    const int n_frames = std::min(std::min(WHISPER_CHUNK_SIZE * 100, seek_delta), seek_end - seek);
+                    whisper_exp_compute_token_level_timestamps_dtw(
+                            ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
+                    if (params.new_segment_callback) {
+                        for (int seg = (int) result_all.size() - n_segments; seg < n_segments; seg++) {
+                            params.new_segment_callback(ctx, state, seg, params.new_segment_callback_user_data);
                         }
-
-                        // Fill remaining budget with dynamic tokens (rolling context)
-                        const int n_take1 = std::min<int>(max_prompt_ctx - n_take0 - 1, prompt_past1.size());
-                        prompt.insert(prompt.end(), prompt_past1.end() - n_take1, prompt_past1.end());
                     }
                 }
+            }
 
-                // init new transcription with sot, language (opt) and task tokens
-                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
-
-                // print the prompt
-                WHISPER_LOG_DEBUG("\n\n");
-                for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
-                }
-                WHISPER_LOG_DEBUG("\n\n");
+            if (seek_delta_dual >= 0) {
+                seek_delta = seek_delta_dual;
+            } else if (single_timestamp_ending) {
+                WHISPER_LOG_DEBUG("single timestamp ending - skip entire chunk\n");
+                seek_delta = std::min(seek_window - seek, WHISPER_CHUNK_SIZE * 100);
+            }
 
-                // recreate the KV cache if the number of decoders has changed
-                if (state->kv_self_n_dec < n_decoders_cur) {
-                    WHISPER_LOG_DEBUG("%s: recreating KV cache: n_decoders_cur = %d\n", __func__, n_decoders_cur);
+            // update audio window
+            seek += seek_delta;
 
-                    whisper_kv_cache_free(state->kv_self);
+            state->seek = seek;
 
-                    // overallocate to workaround KV cache fragmentation issues
-                    const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
+            WHISPER_LOG_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+        }
+    }
 
-                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
-                                ctx->model.hparams.n_text_state,
-                                ctx->model.hparams.n_text_layer,
-                                GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
-                        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
-                        whisper_free_state(state);
-                        return -7;
-                    }
+    if (ahead.seek >= 0) {
+        ahead.wait();
+        whisper_encode_ahead_merge_timings(*state, *state->ahead_state);
+    }
 
-                    state->kv_self_n_dec = n_decoders_cur;
-                }
+    return 0;
+}
 
-                whisper_kv_cache_clear(state->kv_self);
+// up to n worker states for whisper_full_parallel() next to the default one. they stay on the context, so only
+// the first call (or one with more processors) pays for their buffers; their metrics restart on every call
+static std::vector<whisper_state *> whisper_parallel_states(struct whisper_context * ctx, int n) {
+    while ((int) ctx->parallel_states.size() < n) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            break;
+        }
+        ctx->parallel_states.push_back(state);
+    }
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+    std::vector<whisper_state *> states(ctx->parallel_states.begin(),
+            ctx->parallel_states.begin() + std::max(0, std::min(n, (int) ctx->parallel_states.size())));
+    for (auto * state : states) {
+        whisper_reset_metrics_from_state(state);
+    }
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -8;
-                }
+    return states;
+}
 
-                // Calculate no_speech probability after first decode.
-                // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
-                {
-                    const int n_logits = ctx->vocab.id_to_token.size();
-                    std::vector<float> logprobs(n_logits);
-                    std::vector<float> probs(n_logits);
+// chunked long-form transcription (params.chunk_ms): fixed chunks overlapping by two strides are transcribed
+// independently on a pool of states, then merged by timestamp into the default state
+static int whisper_full_chunked(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    if (params.n_threads <= 0) {
+        params.n_threads = whisper_autotune_n_threads(ctx);
+    }
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
-                    state->no_speech_prob = probs[whisper_token_nosp(ctx)];
-                }
+    const int n_chunk  = std::min(WHISPER_SAMPLE_RATE*params.chunk_ms/1000, WHISPER_SAMPLE_RATE*WHISPER_CHUNK_SIZE);
+    const int n_stride = params.chunk_stride_ms > 0 ? WHISPER_SAMPLE_RATE*params.chunk_stride_ms/1000 : n_chunk/6;
+    const int n_step   = n_chunk - 2*n_stride;
 
-                {
-                    const int64_t t_start_sample_us = ggml_time_us();
+    if (n_step <= 0) {
+        WHISPER_LOG_ERROR("%s: chunk_stride_ms (%d) must be less than half of chunk_ms (%d)\n", __func__, params.chunk_stride_ms, params.chunk_ms);
+        return -1;
+    }
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
+    const int i_beg = std::min(n_samples, WHISPER_SAMPLE_RATE*params.offset_ms/1000);
+    const int i_end = params.duration_ms > 0 ? std::min(n_samples, i_beg + WHISPER_SAMPLE_RATE*params.duration_ms/1000) : n_samples;
 
-                    whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
+    struct job {
+        int     i0  = 0;
+        int     n   = 0;
+        int64_t lo  = 0; // the segments whose midpoint is in [lo, hi) are kept (cs)
+        int64_t hi  = 0;
+        int     ret = 0;
+        std::vector<whisper_segment> result;
+    };
 
-                    for (int j = 1; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+    std::vector<job> jobs;
+    for (int i0 = i_beg; i0 < i_end; i0 += n_step) {
+        job cur;
+        cur.i0 = i0;
+        cur.n  = std::min(n_chunk, i_end - i0);
+        cur.lo = jobs.empty()        ? INT64_MIN : (int64_t) 100*(i0 + n_stride)/WHISPER_SAMPLE_RATE;
+        cur.hi = i0 + cur.n >= i_end ? INT64_MAX : (int64_t) 100*(i0 + n_chunk - n_stride)/WHISPER_SAMPLE_RATE;
+        jobs.push_back(std::move(cur));
 
-                        whisper_kv_cache_seq_cp(state->kv_self, 0, j, -1, -1);
+        if (i0 + n_chunk >= i_end) {
+            break;
+        }
+    }
 
-                        memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
-                    }
+    auto & result_all = ctx->state->result_all;
+    result_all.clear();
 
-                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                }
-            }
+    if (jobs.empty()) {
+        return 0;
+    }
 
-            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
-                const int64_t t_start_sample_us = ggml_time_us();
+    // one language for all the chunks, from the start of the audio
+    const bool lang_auto = params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0;
+    if (lang_auto && !params.detect_language) {
+        if (whisper_pcm_to_mel_with_state(ctx, ctx->state, samples + jobs[0].i0, jobs[0].n, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+        const int lang_id = whisper_lang_auto_detect_impl(ctx, ctx->state, 0, params.lid_audio_ctx, params.n_threads, nullptr);
+        if (lang_id < 0) {
+            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        params.language = whisper_lang_str(lang_id);
+    }
 
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    for (auto & bc : bc_per_dec) {
-                        bc.clear();
-                    }
-                }
+    const int n_states = std::max(1, std::min(n_processors, (int) jobs.size()));
 
-                // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
-                {
-                    std::atomic<int> j_cur(0);
+    WHISPER_LOG_INFO("%s: transcribing %d chunks of %.1f s (stride %.1f s) on %d states\n", __func__,
+            (int) jobs.size(), float(n_chunk)/WHISPER_SAMPLE_RATE, float(n_stride)/WHISPER_SAMPLE_RATE, n_states);
 
-                    auto process = [&]() {
-                        while (true) {
-                            const int j = j_cur.fetch_add(1);
+    auto params_cur = params;
 
-                            if (j >= n_decoders_cur) {
-                                break;
-                            }
+    params_cur.offset_ms      = 0;
+    params_cur.duration_ms    = 0;
+    params_cur.chunk_ms       = 0;
+    params_cur.resume         = false;
+    params_cur.print_progress = false;
+    params_cur.print_realtime = false;
 
-                            auto & decoder = state->decoders[j];
+    params_cur.new_segment_callback = nullptr;
+    params_cur.new_segment_callback_user_data = nullptr;
 
-                            if (decoder.completed || decoder.failed) {
-                                continue;
-                            }
+    params_cur.progress_callback = nullptr;
+    params_cur.progress_callback_user_data = nullptr;
 
-                            switch (params.strategy) {
-                                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                                    {
-                                        if (t_cur < 1e-6f) {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
-                                        } else {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
-                                        }
+    std::atomic<int> next_job(0);
+    std::atomic<int> n_done(0);
 
-                                        decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
-                                    } break;
-                                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                                    {
-                                        const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
+    auto worker = [&](whisper_state * state, bool report) {
+        for (int j = next_job++; j < (int) jobs.size(); j = next_job++) {
+            jobs[j].ret    = whisper_full_with_state(ctx, state, params_cur, samples + jobs[j].i0, jobs[j].n);
+            jobs[j].result = std::move(state->result_all);
 
-                                        for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
-                                        }
-                                    } break;
-                            };
-                        }
-                    };
+            const int progress = (100*++n_done)/(int) jobs.size();
+            if (report && params.progress_callback) {
+                params.progress_callback(ctx, ctx->state, progress, params.progress_callback_user_data);
+            }
+        }
+    };
 
-                    const int n_threads = std::min(params.n_threads, n_decoders_cur);
+    // the calling thread works on the default state, which also receives the merged result.
+    // its VAD segments describe the whole filtered audio, not the chunks
+    const bool has_vad_segments = ctx->state->has_vad_segments;
+    ctx->state->has_vad_segments = false;
 
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
+    const std::vector<whisper_state *> states = whisper_parallel_states(ctx, n_states - 1);
+    std::vector<std::thread>           workers;
+    for (auto * state : states) {
+        workers.emplace_back(worker, state, false);
+    }
 
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
+    worker(ctx->state, true);
 
-                        process();
+    for (auto & w : workers) {
+        w.join();
+    }
 
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
-                }
+    ctx->state->has_vad_segments = has_vad_segments;
 
-                beam_candidates.clear();
-                for (const auto & bc : bc_per_dec) {
-                    beam_candidates.insert(beam_candidates.end(), bc.begin(), bc.end());
+    int ret = 0;
 
-                    if (!bc.empty()) {
-                        state->n_sample += 1;
-                    }
-                }
+    for (auto & job : jobs) {
+        if (job.ret != 0 && ret == 0) {
+            ret = job.ret;
+        }
 
-                // for beam-search, choose the top candidates and update the KV caches
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
-                            beam_candidates.begin(),
-                            beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
-                        }
-                        return a.decoder_idx < b.decoder_idx;
-                    });
+        const int64_t t_offset = (int64_t) 100*job.i0/WHISPER_SAMPLE_RATE;
 
-                    uint32_t cur_c = 0;
+        for (auto & result : job.result) {
+            result.t0 += t_offset;
+            result.t1 += t_offset;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+            // the other chunk that overlaps here transcribes this part with more context
+            const int64_t t_mid = (result.t0 + result.t1)/2;
+            if (t_mid < job.lo || t_mid >= job.hi) {
+                continue;
+            }
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+            // make sure that segments are not overlapping
+            if (!result_all.empty()) {
+                result.t0 = std::max(result.t0, result_all.back().t1);
+            }
 
-                        if (cur_c >= beam_candidates.size()) {
-                            cur_c = 0;
-                        }
+            result_all.push_back(std::move(result));
 
-                        auto & cur = beam_candidates[cur_c++];
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            }
+        }
+    }
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
-                            ++cur_c;
-                        }
+    for (auto * state : states) {
+        ctx->state->t_mel_us    += state->t_mel_us;
+        ctx->state->t_sample_us += state->t_sample_us;
+        ctx->state->t_encode_us += state->t_encode_us;
+        ctx->state->t_decode_us += state->t_decode_us;
+        ctx->state->t_batchd_us += state->t_batchd_us;
+        ctx->state->t_prompt_us += state->t_prompt_us;
 
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
+        ctx->state->n_sample += state->n_sample;
+        ctx->state->n_encode += state->n_encode;
+        ctx->state->n_decode += state->n_decode;
+        ctx->state->n_batchd += state->n_batchd;
+        ctx->state->n_prompt += state->n_prompt;
 
-                        whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
+        whisper_histogram_merge(ctx->state->h_encode, state->h_encode);
+        whisper_histogram_merge(ctx->state->h_decode, state->h_decode);
+        whisper_histogram_merge(ctx->state->h_token,  state->h_token);
+        whisper_histogram_merge(ctx->state->h_alloc,  state->h_alloc);
+    }
 
-                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
-                    }
+    ctx->state->t_mel_us    /= n_states;
+    ctx->state->t_sample_us /= n_states;
+    ctx->state->t_encode_us /= n_states;
+    ctx->state->t_decode_us /= n_states;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+    return ret;
+}
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+int whisper_full(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
 
-                        whisper_kv_cache_seq_rm(state->kv_self, j,                           -1, -1);
-                        whisper_kv_cache_seq_cp(state->kv_self, WHISPER_MAX_DECODERS + j, j, -1, -1);
-                        whisper_kv_cache_seq_rm(state->kv_self, WHISPER_MAX_DECODERS + j,    -1, -1);
-                    }
-                }
+    std::vector<float> vad_samples;
+    if (params.vad) {
+        WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
+        if (!whisper_vad(ctx->state, params, samples, n_samples, vad_samples)) {
+            WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
+            return -1;
+        }
+        if (vad_samples.empty()) {
+            ctx->state->result_all.clear();
+            return 0;
+        }
+        samples = vad_samples.data();
+        n_samples = vad_samples.size();
+    }
+    if (params.chunk_ms > 0) {
+        return whisper_full_chunked(ctx, params, samples, n_samples, 1);
+    }
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
 
-                // update the decoder state
-                // - check if the sequence is completed
-                // - check if the sequence is failed
-                // - update sliding window based on timestamp tokens
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+int whisper_full_dual_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+          struct whisper_state * state_translate,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    if (state_translate == nullptr || state_translate == state) {
+        WHISPER_LOG_ERROR("%s: the translation needs a state of its own\n", __func__);
+        return -1;
+    }
+    if (!whisper_is_multilingual(ctx)) {
+        WHISPER_LOG_ERROR("%s: the model is English-only and cannot translate\n", __func__);
+        return -1;
+    }
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+    if (params.n_threads <= 0) {
+        params.n_threads = whisper_autotune_n_threads(ctx);
+    }
 
-                    auto & has_ts     = decoder.has_ts;
-                    auto & failed     = decoder.failed;
-                    auto & completed  = decoder.completed;
-                    auto & seek_delta = decoder.seek_delta;
-                    auto & result_len = decoder.sequence.result_len;
+    if (params.detect_language) {
+        return whisper_full_with_state(ctx, state, params, samples, n_samples);
+    }
 
-                    {
-                        const auto & token = decoder.sequence.tokens.back();
+    // one language for both tasks
+    const bool lang_auto = params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0;
+    if (lang_auto) {
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+        const int lang_id = whisper_lang_auto_detect_impl(ctx, state, 0, params.lid_audio_ctx, params.n_threads, nullptr);
+        if (lang_id < 0) {
+            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        params.language = whisper_lang_str(lang_id);
 
-                        // timestamp token - update sliding window
-                        if (token.id > whisper_token_beg(ctx)) {
-                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+        WHISPER_LOG_INFO("%s: auto-detected language: %s\n", __func__, params.language);
+    }
 
-                            // do not allow to go back in time
-                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
-                                WHISPER_LOG_DEBUG("%s: decoder %d: failed due to seek_delta (%d > %d)\n", __func__, j, seek_delta, seek_delta_new);
-                                failed = true; // TODO: maybe this is not a failure ?
-                                continue;
-                            }
+    whisper_dual_link link;
+    link.states[0] = state;
+    link.states[1] = state_translate;
 
-                            seek_delta = seek_delta_new;
-                            result_len = i + 1;
-                            has_ts = true;
-                        }
+    params.translate = false;
 
-                        whisper_grammar_accept_token(*ctx, decoder.grammar, token.id);
+    auto params_translate = params;
 
-#ifdef WHISPER_DEBUG
-                        {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
-                            WHISPER_LOG_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
-                        }
-#endif
+    params_translate.translate      = true;
+    params_translate.encode_ahead   = false;
+    params_translate.print_progress = false;
+    params_translate.print_realtime = false;
 
-                        // end of segment
-                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
-                           (has_ts && seek + seek_delta + delta_min >= seek_end)       // end of audio reached (100ms)
-                           ) {
-                            if (result_len == 0 && !params.no_timestamps) {
-                                if (seek + seek_delta + delta_min >= seek_end) {
-                                    result_len = i + 1;
-                                } else {
-                                    WHISPER_LOG_DEBUG("%s: decoder %d failed (result_len = 0)\n", __func__, j);
-                                    failed = true;
-                                    continue;
-                                }
-                            }
+    params_translate.new_segment_callback = nullptr;
+    params_translate.new_segment_callback_user_data = nullptr;
 
-                            if (params.single_segment || params.no_timestamps) {
-                                result_len = i + 1;
-                                seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            }
+    params_translate.progress_callback = nullptr;
+    params_translate.progress_callback_user_data = nullptr;
 
-                            WHISPER_LOG_DEBUG("%s: decoder %d completed\n", __func__, j);
-                            completed = true;
-                            continue;
-                        }
+    params_translate.encoder_window_callback = nullptr;
+    params_translate.encoder_window_callback_user_data = nullptr;
 
-                        // TESTS: if no tensors are loaded, it means we are running tests
-                        if (ctx->model.n_loaded == 0) {
-                            seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            completed = true;
-                            continue;
-                        }
-                    }
+    // the translation stops with the transcription
+    params_translate.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
+        auto & link = *(whisper_dual_link *) user_data;
+        std::lock_guard<std::mutex> lock(link.mutex);
+        return !link.done[0];
+    };
+    params_translate.encoder_begin_callback_user_data = &link;
 
-                    // sometimes, the decoding can get stuck in a repetition loop
-                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
-                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
-                        WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition loop\n", __func__, j);
-                        failed = true;
-                        continue;
-                    }
-                }
+    auto run = [&](int role, const whisper_full_params & params_cur) {
+        link.states[role]->dual      = &link;
+        link.states[role]->dual_role = role;
 
-                // check if all decoders have finished (i.e. completed or failed)
-                {
-                    bool completed_all = true;
+        const int ret = whisper_full_with_state(ctx, link.states[role], params_cur, samples, n_samples);
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+        link.states[role]->dual = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(link.mutex);
+            link.done[role] = true;
+        }
+        link.cv.notify_all();
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+        return ret;
+    };
 
-                        completed_all = false;
-                    }
+    int ret_translate = 0;
+    std::thread worker([&]() {
+        ret_translate = run(1, params_translate);
+    });
 
-                    if (completed_all) {
-                        break;
-                    }
-                }
+    const int ret = run(0, params);
 
-                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+    worker.join();
 
-                // obtain logits for the next token
-                {
-                    auto & batch = state->batch;
+    return ret != 0 ? ret : ret_translate;
+}
 
-                    batch.n_tokens = 0;
+int whisper_full_dual(
+        struct whisper_context * ctx,
+          struct whisper_state * state_translate,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_dual_with_state(ctx, ctx->state, state_translate, params, samples, n_samples);
+}
 
-                    const int n_past = prompt.size() + i;
+// whisper_full_parallel() after VAD: the speech segments are already cut at
+// silences, so consecutive segments are packed into jobs of up to one 30 s
+// window and the jobs are spread over a pool of states. Nothing is split
+// mid-speech, unlike the equal chunks used without VAD.
+static int whisper_full_parallel_vad(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    const auto & segments = ctx->state->vad_segments;
+
+    struct job {
+        int     i0       = 0;
+        int     n        = 0;
+        int64_t t_offset = 0; // cs in the filtered audio
+        int     ret = 0;
+        std::vector<whisper_segment> result;
+    };
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+    std::vector<job> jobs;
+    {
+        const int64_t t_skip   = params.offset_ms/10;
+        const int64_t t_window = 100*WHISPER_CHUNK_SIZE;
+
+        for (size_t i = 0; i < segments.size(); ) {
+            const int64_t t0 = segments[i].vad_start;
+            int64_t       t1 = segments[i].vad_end;
+            for (++i; i < segments.size() && segments[i].vad_end - t0 <= t_window; ++i) {
+                t1 = segments[i].vad_end;
+            }
+            if (t1 <= t_skip) {
+                continue;
+            }
 
-                        if (decoder.failed || decoder.completed) {
-                            continue;
-                        }
+            const int i0 = std::min(cs_to_samples(t0), n_samples);
+            const int i1 = std::min(cs_to_samples(t1), n_samples);
+            if (i1 > i0) {
+                job cur;
+                cur.i0       = i0;
+                cur.n        = i1 - i0;
+                cur.t_offset = t0;
+                jobs.push_back(std::move(cur));
+            }
+        }
+    }
 
-                        //WHISPER_LOG_DEBUG("%s: decoder %d: token %d, seek_delta %d\n", __func__, j, decoder.sequence.tokens.back().id, decoder.seek_delta);
+    const int n_states = std::max(1, std::min(n_processors, (int) jobs.size()));
 
-                        decoder.i_batch = batch.n_tokens;
+    WHISPER_LOG_INFO("%s: transcribing %d speech segments as %d jobs on %d states\n",
+            __func__, (int) segments.size(), (int) jobs.size(), n_states);
 
-                        batch.token   [batch.n_tokens]    = decoder.sequence.tokens.back().id;
-                        batch.pos     [batch.n_tokens]    = n_past;
-                        batch.n_seq_id[batch.n_tokens]    = 1;
-                        batch.seq_id  [batch.n_tokens][0] = j;
-                        batch.logits  [batch.n_tokens]    = 1;
-                        batch.n_tokens++;
-                    }
+    auto params_cur = params;
 
-                    assert(batch.n_tokens > 0);
+    params_cur.offset_ms      = 0;
+    params_cur.duration_ms    = 0;
+    params_cur.print_progress = false;
+    params_cur.print_realtime = false;
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                        return -9;
-                    }
+    params_cur.new_segment_callback = nullptr;
+    params_cur.new_segment_callback_user_data = nullptr;
 
-                    const int64_t t_start_sample_us = ggml_time_us();
+    params_cur.progress_callback = nullptr;
+    params_cur.progress_callback_user_data = nullptr;
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
-                    {
-                        std::atomic<int> j_cur(0);
+    std::atomic<int> next_job(0);
 
-                        auto process = [&]() {
-                            while (true) {
-                                const int j = j_cur.fetch_add(1);
+    auto worker = [&](whisper_state * state) {
+        for (int j = next_job++; j < (int) jobs.size(); j = next_job++) {
+            jobs[j].ret    = whisper_full_with_state(ctx, state, params_cur, samples + jobs[j].i0, jobs[j].n);
+            jobs[j].result = std::move(state->result_all);
+        }
+    };
 
-                                if (j >= n_decoders_cur) {
-                                    break;
-                                }
+    // the calling thread works on the default state, which also receives the merged result.
+    // its VAD segments describe the whole filtered audio, not the jobs
+    const bool has_vad_segments = ctx->state->has_vad_segments;
+    ctx->state->has_vad_segments = false;
 
-                                auto & decoder = state->decoders[j];
+    const std::vector<whisper_state *> states = whisper_parallel_states(ctx, n_states - 1);
+    std::vector<std::thread>           workers;
+    for (auto * state : states) {
+        workers.emplace_back(worker, state);
+    }
 
-                                if (decoder.failed || decoder.completed) {
-                                    continue;
-                                }
+    worker(ctx->state);
 
-                                whisper_process_logits(*ctx, *state, decoder, params, t_cur);
-                            }
-                        };
+    for (auto & w : workers) {
+        w.join();
+    }
 
-                        const int n_threads = std::min(params.n_threads, n_decoders_cur);
+    ctx->state->has_vad_segments = has_vad_segments;
 
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
+    int ret = 0;
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
+    auto & result_all = ctx->state->result_all;
+    result_all.clear();
 
-                            process();
+    for (auto & job : jobs) {
+        if (job.ret != 0 && ret == 0) {
+            ret = job.ret;
+        }
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
-                        }
-                    }
+        for (auto & result : job.result) {
+            result.t0 += job.t_offset;
+            result.t1 += job.t_offset;
 
-                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                }
+            // make sure that segments are not overlapping
+            if (!result_all.empty()) {
+                result.t0 = std::max(result.t0, result_all.back().t1);
             }
 
-            // rank the resulting sequences and select the best one
-            {
-                double best_score = -INFINITY;
+            result_all.push_back(std::move(result));
 
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            }
+        }
+    }
 
-                    if (decoder.failed) {
-                        continue;
-                    }
+    for (auto * state : states) {
+        ctx->state->t_mel_us    += state->t_mel_us;
+        ctx->state->t_sample_us += state->t_sample_us;
+        ctx->state->t_encode_us += state->t_encode_us;
+        ctx->state->t_decode_us += state->t_decode_us;
+        ctx->state->t_batchd_us += state->t_batchd_us;
+        ctx->state->t_prompt_us += state->t_prompt_us;
 
-                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
-                    whisper_sequence_score(params, decoder.sequence);
+        ctx->state->n_sample += state->n_sample;
+        ctx->state->n_encode += state->n_encode;
+        ctx->state->n_decode += state->n_decode;
+        ctx->state->n_batchd += state->n_batchd;
+        ctx->state->n_prompt += state->n_prompt;
 
-                    WHISPER_LOG_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
-                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+        // latency distributions are combined, not averaged
+        whisper_histogram_merge(ctx->state->h_encode, state->h_encode);
+        whisper_histogram_merge(ctx->state->h_decode, state->h_decode);
+        whisper_histogram_merge(ctx->state->h_token,  state->h_token);
+        whisper_histogram_merge(ctx->state->h_alloc,  state->h_alloc);
+    }
 
-                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
-                        WHISPER_LOG_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
-                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+    // average the timings
+    ctx->state->t_mel_us    /= n_states;
+    ctx->state->t_sample_us /= n_states;
+    ctx->state->t_encode_us /= n_states;
+    ctx->state->t_decode_us /= n_states;
 
-                        decoder.failed = true;
-                        state->n_fail_h++;
+    return ret;
+}
 
-                        continue;
-                    }
+// centre of the quietest 100 ms of [i0, i1), where a cut splits the fewest words
+static int whisper_quietest_sample(const float * samples, int i0, int i1) {
+    const int n_win = WHISPER_SAMPLE_RATE/10;
+    if (i1 - i0 <= n_win) {
+        return (i0 + i1)/2;
+    }
 
-                    if (best_score < decoder.sequence.score) {
-                        best_score = decoder.sequence.score;
-                        best_decoder_id = j;
-                    }
-                }
+    double energy = 0.0;
+    for (int i = i0; i < i0 + n_win; ++i) {
+        energy += samples[i]*samples[i];
+    }
 
-                WHISPER_LOG_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
-            }
+    double best   = energy;
+    int    best_i = i0;
+    for (int i = i0 + n_win; i < i1; ++i) {
+        energy += samples[i]*samples[i] - samples[i - n_win]*samples[i - n_win];
+        if (energy < best) {
+            best   = energy;
+            best_i = i - n_win + 1;
+        }
+    }
 
-            bool success = true;
+    return best_i + n_win/2;
+}
 
-            // was the decoding successful for the current temperature?
-            // do fallback only if:
-            // - we are not at the last temperature
-            if (it != (int) temperatures.size() - 1) {
-                const auto & decoder = state->decoders[best_decoder_id];
+// text of a segment from its tokens, as whisper_full_with_state() builds it
+static std::string whisper_segment_text(const whisper_context & ctx, const whisper_full_params & params, const whisper_segment & seg) {
+    std::string text;
+    for (const auto & token : seg.tokens) {
+        if (params.print_special || !ctx.vocab.has_flag(token.id, whisper_vocab::TOKEN_SPECIAL)) {
+            text += ctx.vocab.token_str(token.id);
+        }
+    }
+    return text;
+}
 
-                if (decoder.failed ||
-                    (decoder.sequence.avg_logprobs < params.logprob_thold && state->no_speech_prob < params.no_speech_thold)) {
-                    WHISPER_LOG_DEBUG("%s: failed due to avg_logprobs %8.5f < %8.5f and no_speech_prob %8.5f < %8.5f\n", __func__, decoder.sequence.avg_logprobs, params.logprob_thold, state->no_speech_prob, params.no_speech_thold);
-                    success = false;
-                    state->n_fail_p++;
+// appends the segments of the next slice `next` (absolute times) to `merged`, which ends with the previous
+// slice. both transcribed [t_beg, t_end) around the cut t_cut: the longest run of text tokens they share there
+// is where they agree, so the previous slice is kept up to its end and the next one after it. without a shared
+// run (or a single token) the slices are split at the cut by segment midpoint
+static void whisper_merge_slice(
+        const whisper_context & ctx,
+        const whisper_full_params & params,
+        std::vector<whisper_segment> & merged,
+        std::vector<whisper_segment> & next,
+        int64_t t_beg,
+        int64_t t_cut,
+        int64_t t_end) {
+    struct token_ref {
+        int seg;
+        int tok;
+        whisper_token id;
+    };
+
+    auto text_tokens = [&](const std::vector<whisper_segment> & segs, int s0, int s1) {
+        std::vector<token_ref> refs;
+        for (int s = s0; s < s1; ++s) {
+            for (int t = 0; t < (int) segs[s].tokens.size(); ++t) {
+                const whisper_token id = segs[s].tokens[t].id;
+                if (!ctx.vocab.has_flag(id, whisper_vocab::TOKEN_SPECIAL)) {
+                    refs.push_back({ s, t, id });
                 }
             }
+        }
+        return refs;
+    };
 
-            if (success) {
-                //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
-                //    WHISPER_LOG_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
-                //}
+    // the segments of each side that reach into the overlap: a suffix of merged, a prefix of next
+    int a0 = (int) merged.size();
+    while (a0 > 0 && merged[a0 - 1].t1 > t_beg) {
+        --a0;
+    }
+    int b1 = 0;
+    while (b1 < (int) next.size() && next[b1].t0 < t_end) {
+        ++b1;
+    }
 
-                break;
-            }
+    const std::vector<token_ref> a = text_tokens(merged, a0, (int) merged.size());
+    const std::vector<token_ref> b = text_tokens(next, 0, b1);
 
-            WHISPER_LOG_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
+    // longest common run (ties: the one ending nearest the cut)
+    int best_len = 0;
+    int best_a   = 0;
+    int best_b   = 0;
+    {
+        std::vector<int> prev(b.size() + 1, 0);
+        std::vector<int> cur (b.size() + 1, 0);
+        for (int i = 1; i <= (int) a.size(); ++i) {
+            for (int j = 1; j <= (int) b.size(); ++j) {
+                cur[j] = a[i - 1].id == b[j - 1].id ? prev[j - 1] + 1 : 0;
+                if (cur[j] == 0 || cur[j] < best_len) {
+                    continue;
+                }
+                const auto & seg = merged[a[i - 1].seg];
+                const auto & seg_best = merged[a[std::max(0, best_a - 1)].seg];
+                if (cur[j] > best_len || std::llabs((seg.t0 + seg.t1)/2 - t_cut) < std::llabs((seg_best.t0 + seg_best.t1)/2 - t_cut)) {
+                    best_len = cur[j];
+                    best_a   = i;
+                    best_b   = j;
+                }
+            }
+            std::swap(prev, cur);
         }
+    }
 
-        // output results through a user-provided callback
-        {
-            const auto & best_decoder = state->decoders[best_decoder_id];
-
-            auto seek_delta = best_decoder.seek_delta;
-            const auto result_len = best_decoder.sequence.result_len;
+    WHISPER_LOG_DEBUG("%s: cut at %s, %d tokens shared of %d and %d\n", __func__,
+            to_timestamp(t_cut).c_str(), best_len, (int) a.size(), (int) b.size());
 
-            const auto & tokens_cur = best_decoder.sequence.tokens;
+    size_t b_first = 0; // segments of next to append
+    if (best_len >= 2) {
+        // the previous slice up to the end of the run
+        const token_ref & a_last = a[best_a - 1];
+        merged.resize(a_last.seg + 1);
+        {
+            auto & seg = merged.back();
+            seg.tokens.resize(a_last.tok + 1);
+            seg.text = whisper_segment_text(ctx, params, seg);
+            if (seg.tokens.back().t1 >= 0) {
+                seg.t1 = std::max(seg.t0, seg.tokens.back().t1);
+            }
+        }
 
-            // [EXPERIMENTAL] Token-level timestamps with DTW
-            const auto n_segments_before = state->result_all.size();
+        // the next slice from the token after it
+        if (best_b < (int) b.size()) {
+            const token_ref & b_next = b[best_b];
+            b_first = b_next.seg;
+            auto & seg = next[b_next.seg];
+            seg.tokens.erase(seg.tokens.begin(), seg.tokens.begin() + b_next.tok);
+            seg.text = whisper_segment_text(ctx, params, seg);
+            if (seg.tokens.front().t0 >= 0) {
+                seg.t0 = std::min(seg.t1, seg.tokens.front().t0);
+            }
+        } else {
+            b_first = b.empty() ? 0 : b.back().seg + 1;
+        }
+    } else {
+        while (!merged.empty() && (merged.back().t0 + merged.back().t1)/2 >= t_cut) {
+            merged.pop_back();
+        }
+        while (b_first < next.size() && (next[b_first].t0 + next[b_first].t1)/2 < t_cut) {
+            ++b_first;
+        }
+    }
 
-            const bool is_no_speech = (state->no_speech_prob > params.no_speech_thold &&
-                best_decoder.sequence.avg_logprobs < params.logprob_thold);
+    for (size_t i = b_first; i < next.size(); ++i) {
+        auto & seg = next[i];
+        if (seg.text.empty()) {
+            continue;
+        }
 
-            //WHISPER_LOG_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
+        // make sure that segments are not overlapping
+        if (!merged.empty()) {
+            seg.t0 = std::max(seg.t0, merged.back().t1);
+            seg.t1 = std::max(seg.t1, seg.t0);
+        }
+        merged.push_back(std::move(seg));
+    }
+}
 
-            // update prompt_past1
-            prompt_past1.clear();
-            if (!params.carry_initial_prompt && !prompt.empty() && prompt.front() == whisper_token_prev(ctx)) {
-                prompt_past1.insert(prompt_past1.end(), prompt.begin() + 1, prompt.end() - prompt_init.size());
-            }
+// whisper_full_parallel() without VAD or chunk_ms: the audio is split into n_processors slices, each cut moved to
+// the quietest 100 ms within parallel_overlap_ms of where an even split puts it, and every slice reaches
+// parallel_overlap_ms past its cuts. the slices are transcribed on a pool of states and stitched where the
+// neighbours' tokens agree (whisper_merge_slice), so no word is lost or repeated at a cut
+static int whisper_full_parallel_overlap(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    const int i_beg = std::min(n_samples, WHISPER_SAMPLE_RATE*params.offset_ms/1000);
+    const int i_end = params.duration_ms > 0 ? std::min(n_samples, i_beg + WHISPER_SAMPLE_RATE*params.duration_ms/1000) : n_samples;
 
-            // Add newly decoded tokens to the rolling context
-            if (!is_no_speech) {
-                for (int i = 0; i < result_len; ++i) {
-                    prompt_past1.push_back(tokens_cur[i].id);
-                }
-            }
+    const int n_overlap = WHISPER_SAMPLE_RATE*params.parallel_overlap_ms/1000;
 
-            if (!tokens_cur.empty() && ctx->model.n_loaded > 0 && !is_no_speech) {
-                int  i0 = 0;
-                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
+    // a slice is at least twice as long as its overlaps
+    const int n_slices = std::max(1, std::min(n_processors, (i_end - i_beg)/std::max(1, 4*n_overlap)));
+    if (n_slices == 1) {
+        return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+    }
 
-                std::string text;
-                bool speaker_turn_next = false;
+    std::vector<int> cuts = { i_beg };
+    for (int k = 1; k < n_slices; ++k) {
+        const int c = i_beg + (int) ((int64_t) k*(i_end - i_beg)/n_slices);
+        cuts.push_back(whisper_quietest_sample(samples, c - n_overlap, c + n_overlap));
+    }
+    cuts.push_back(i_end);
 
-                for (int i = 0; i < (int) tokens_cur.size(); i++) {
-                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+    struct job {
+        int i0  = 0;
+        int n   = 0;
+        int ret = 0;
+        std::vector<whisper_segment> result;
+    };
 
-                    if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
-                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
-                    }
+    std::vector<job> jobs(n_slices);
+    for (int k = 0; k < n_slices; ++k) {
+        jobs[k].i0 = k == 0            ? i_beg : cuts[k] - n_overlap;
+        jobs[k].n  = (k == n_slices - 1 ? i_end : cuts[k + 1] + n_overlap) - jobs[k].i0;
+    }
 
-                    // [TDRZ] record if speaker turn was predicted after current segment
-                    if (params.tdrz_enable && tokens_cur[i].id == whisper_token_solm(ctx)) {
-                        speaker_turn_next = true;
-                    }
+    // one language for all the slices, from the start of the audio
+    const bool lang_auto = params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0;
+    if (lang_auto && !params.detect_language) {
+        if (whisper_pcm_to_mel_with_state(ctx, ctx->state, samples + jobs[0].i0, jobs[0].n, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+        const int lang_id = whisper_lang_auto_detect_impl(ctx, ctx->state, 0, params.lid_audio_ctx, params.n_threads, nullptr);
+        if (lang_id < 0) {
+            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        params.language = whisper_lang_str(lang_id);
+    }
 
-                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
-                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
+    const std::vector<whisper_state *> states = whisper_parallel_states(ctx, n_slices - 1);
+    const int n_states = (int) states.size() + 1;
 
-                        if (!text.empty()) {
-                            const auto tt0 = t0;
-                            const auto tt1 = t1;
+    WHISPER_LOG_INFO("%s: transcribing %d slices overlapping by %.1f s on %d states\n", __func__,
+            n_slices, float(n_overlap)/WHISPER_SAMPLE_RATE, n_states);
 
-                            if (params.print_realtime) {
-                                if (params.print_timestamps) {
-                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                                } else {
-                                    printf("%s", text.c_str());
-                                    fflush(stdout);
-                                }
-                            }
+    auto params_cur = params;
 
-                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+    params_cur.offset_ms      = 0;
+    params_cur.duration_ms    = 0;
+    params_cur.print_progress = false;
+    params_cur.print_realtime = false;
 
-                            result_all.push_back({ tt0, tt1, text, state->no_speech_prob, {}, speaker_turn_next });
-                            for (int j = i0; j <= i; j++) {
-                                result_all.back().tokens.push_back(tokens_cur[j]);
-                            }
+    params_cur.new_segment_callback = nullptr;
+    params_cur.new_segment_callback_user_data = nullptr;
 
-                            int n_new = 1;
+    params_cur.progress_callback = nullptr;
+    params_cur.progress_callback_user_data = nullptr;
 
-                            if (params.token_timestamps) {
-                                whisper_exp_compute_token_level_timestamps(
-                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+    std::atomic<int> next_job(0);
+    std::atomic<int> n_done(0);
 
-                                if (params.max_len > 0) {
-                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                                }
-                            }
-                            if (params.new_segment_callback && !ctx->params.dtw_token_timestamps) {
-                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                            }
-                        }
-                        text = "";
-                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
-                            i++;
-                        }
-                        i--;
-                        t0 = t1;
-                        i0 = i + 1;
-                        speaker_turn_next = false;
-                    }
-                }
+    auto worker = [&](whisper_state * state, bool report) {
+        for (int j = next_job++; j < (int) jobs.size(); j = next_job++) {
+            jobs[j].ret    = whisper_full_with_state(ctx, state, params_cur, samples + jobs[j].i0, jobs[j].n);
+            jobs[j].result = std::move(state->result_all);
 
-                if (!text.empty()) {
-                    const auto t1 = seek + seek_delta;
+            const int progress = (100*++n_done)/(int) jobs.size();
+            if (report && params.progress_callback) {
+                params.progress_callback(ctx, ctx->state, progress, params.progress_callback_user_data);
+            }
+        }
+    };
 
-                    const auto tt0 = t0;
-                    const auto tt1 = t1;
+    std::vector<std::thread> workers;
+    for (auto * state : states) {
+        workers.emplace_back(worker, state, false);
+    }
 
-                    if (params.print_realtime) {
-                        if (params.print_timestamps) {
-                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                        } else {
-                            printf("%s", text.c_str());
-                            fflush(stdout);
-                        }
-                    }
+    worker(ctx->state, true);
 
-                    result_all.push_back({ tt0, tt1, text, state->no_speech_prob, {}, speaker_turn_next });
-                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
-                        result_all.back().tokens.push_back(tokens_cur[j]);
-                    }
+    for (auto & w : workers) {
+        w.join();
+    }
 
-                    int n_new = 1;
+    int ret = 0;
 
-                    if (params.token_timestamps) {
-                        whisper_exp_compute_token_level_timestamps(
-                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+    std::vector<whisper_segment> merged;
+    for (int k = 0; k < n_slices; ++k) {
+        auto & job = jobs[k];
+        if (job.ret != 0 && ret == 0) {
+            ret = job.ret;
+        }
 
-                        if (params.max_len > 0) {
-                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                        }
-                    }
-                    if (params.new_segment_callback && !ctx->params.dtw_token_timestamps) {
-                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                    }
+        // to the time of the whole audio, tokens included
+        const int64_t t_offset = (int64_t) 100*job.i0/WHISPER_SAMPLE_RATE;
+        for (auto & seg : job.result) {
+            seg.t0 += t_offset;
+            seg.t1 += t_offset;
+            for (auto & token : seg.tokens) {
+                if (token.t0 >= 0) {
+                    token.t0 += t_offset;
+                    token.t1 += t_offset;
                 }
-            }
-
-            // FIXME: will timestamp offsets be correct?
-            // [EXPERIMENTAL] Token-level timestamps with DTW
-            {
-                const int n_segments = state->result_all.size() - n_segments_before;
-                if (ctx->params.dtw_token_timestamps && n_segments) {
-                    const int n_frames = std::min(std::min(WHISPER_CHUNK_SIZE * 100, seek_delta), seek_end - seek);
-                    whisper_exp_compute_token_level_timestamps_dtw(
-                            ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
-                    if (params.new_segment_callback) {
-                        for (int seg = (int) result_all.size() - n_segments; seg < n_segments; seg++) {
-                            params.new_segment_callback(ctx, state, seg, params.new_segment_callback_user_data);
-                        }
-                    }
+                if (token.t_dtw >= 0) {
+                    token.t_dtw += t_offset;
                 }
             }
+        }
 
-            // ref: https://github.com/ggml-org/whisper.cpp/pull/2629
-            const bool single_timestamp_ending = tokens_cur.size() > 1 &&
-                tokens_cur[tokens_cur.size() - 2].id < whisper_token_beg(ctx) &&
-                tokens_cur[tokens_cur.size() - 1].id > whisper_token_beg(ctx);
-            if (single_timestamp_ending) {
-                WHISPER_LOG_DEBUG("single timestamp ending - skip entire chunk\n");
-                seek_delta = std::min(seek_end - seek, WHISPER_CHUNK_SIZE * 100);
-            }
+        if (k == 0) {
+            merged = std::move(job.result);
+            continue;
+        }
 
-            // update audio window
-            seek += seek_delta;
+        whisper_merge_slice(*ctx, params, merged, job.result,
+                (int64_t) 100*job.i0/WHISPER_SAMPLE_RATE,
+                (int64_t) 100*cuts[k]/WHISPER_SAMPLE_RATE,
+                (int64_t) 100*(cuts[k] + n_overlap)/WHISPER_SAMPLE_RATE);
+    }
 
-            WHISPER_LOG_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+    auto & result_all = ctx->state->result_all;
+    result_all.clear();
+
+    for (auto & seg : merged) {
+        result_all.push_back(std::move(seg));
+
+        if (params.new_segment_callback) {
+            params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
         }
     }
 
-    return 0;
-}
+    for (auto * state : states) {
+        ctx->state->t_mel_us    += state->t_mel_us;
+        ctx->state->t_sample_us += state->t_sample_us;
+        ctx->state->t_encode_us += state->t_encode_us;
+        ctx->state->t_decode_us += state->t_decode_us;
+        ctx->state->t_batchd_us += state->t_batchd_us;
+        ctx->state->t_prompt_us += state->t_prompt_us;
 
-int whisper_full(
-        struct whisper_context * ctx,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
+        ctx->state->n_sample += state->n_sample;
+        ctx->state->n_encode += state->n_encode;
+        ctx->state->n_decode += state->n_decode;
+        ctx->state->n_batchd += state->n_batchd;
+        ctx->state->n_prompt += state->n_prompt;
 
-    std::vector<float> vad_samples;
-    if (params.vad) {
-        WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
-        if (!whisper_vad(ctx, ctx->state, params, samples, n_samples, vad_samples)) {
-            WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
-            return -1;
-        }
-        if (vad_samples.empty()) {
-            ctx->state->result_all.clear();
-            return 0;
-        }
-        samples = vad_samples.data();
-        n_samples = vad_samples.size();
+        // latency distributions are combined, not averaged
+        whisper_histogram_merge(ctx->state->h_encode, state->h_encode);
+        whisper_histogram_merge(ctx->state->h_decode, state->h_decode);
+        whisper_histogram_merge(ctx->state->h_token,  state->h_token);
+        whisper_histogram_merge(ctx->state->h_alloc,  state->h_alloc);
     }
-    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+
+    // average the timings
+    ctx->state->t_mel_us    /= n_states;
+    ctx->state->t_sample_us /= n_states;
+    ctx->state->t_encode_us /= n_states;
+    ctx->state->t_decode_us /= n_states;
+
+    for (int k = 1; k < n_slices; ++k) {
+        WHISPER_LOG_INFO("%s: cut %d at %s\n", __func__, k, to_timestamp((int64_t) 100*cuts[k]/WHISPER_SAMPLE_RATE).c_str());
+    }
+
+    return ret;
 }
 
 int whisper_full_parallel(
@@ -7777,20 +15883,30 @@ int whisper_full_parallel(
     std::vector<float> vad_samples;
     if (params.vad) {
         WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
-        if (!whisper_vad(ctx, ctx->state, params, samples, n_samples, vad_samples)) {
+        if (!whisper_vad(ctx->state, params, samples, n_samples, vad_samples)) {
             WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
             return -1;
         }
         if (vad_samples.empty()) {
             return 0;
         }
+        if (!ctx->state->vad_segments.empty() && params.chunk_ms <= 0) {
+            return whisper_full_parallel_vad(ctx, params, vad_samples.data(), vad_samples.size(), n_processors);
+        }
         samples = vad_samples.data();
         n_samples = vad_samples.size();
     }
+    if (params.chunk_ms > 0) {
+        return whisper_full_chunked(ctx, params, samples, n_samples, n_processors);
+    }
+    if (params.parallel_overlap_ms > 0) {
+        return whisper_full_parallel_overlap(ctx, params, samples, n_samples, n_processors);
+    }
     int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+    // separate states for each thread
+    const std::vector<whisper_state *> states = whisper_parallel_states(ctx, n_processors - 1);
+    n_processors = (int) states.size() + 1;
 
     const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
     const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
@@ -7800,9 +15916,6 @@ int whisper_full_parallel(
 
     std::vector<std::thread> workers(n_processors - 1);
     for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
-
         const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
         const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
 
@@ -7873,7 +15986,11 @@ int whisper_full_parallel(
         ctx->state->n_batchd += states[i]->n_batchd;
         ctx->state->n_prompt += states[i]->n_prompt;
 
-        whisper_free_state(states[i]);
+        // latency distributions are combined, not averaged
+        whisper_histogram_merge(ctx->state->h_encode, states[i]->h_encode);
+        whisper_histogram_merge(ctx->state->h_decode, states[i]->h_decode);
+        whisper_histogram_merge(ctx->state->h_token,  states[i]->h_token);
+        whisper_histogram_merge(ctx->state->h_alloc,  states[i]->h_alloc);
     }
 
     // average the timings
@@ -7909,6 +16026,14 @@ int whisper_full_lang_id(struct whisper_context * ctx) {
     return ctx->state->lang_id;
 }
 
+float whisper_full_lang_prob_from_state(struct whisper_state * state) {
+    return state->lang_prob;
+}
+
+float whisper_full_lang_prob(struct whisper_context * ctx) {
+    return ctx->state->lang_prob;
+}
+
 static int64_t map_processed_to_original_time(int64_t processed_time, const std::vector<vad_time_mapping> & mapping_table) {
     if (mapping_table.empty()) {
         return processed_time;
@@ -8023,11 +16148,11 @@ int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
 }
 
 const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.token_str(state->result_all[i_segment].tokens[i_token].id);
 }
 
 const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.token_str(ctx->state->result_all[i_segment].tokens[i_token].id);
 }
 
 whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
@@ -8054,6 +16179,64 @@ float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int
     return ctx->state->result_all[i_segment].tokens[i_token].p;
 }
 
+int whisper_full_get_results_from_state(struct whisper_context * ctx, struct whisper_state * state, struct whisper_results * results) {
+    auto & segments   = state->results_segments;
+    auto & tokens     = state->results_tokens;
+    auto & token_text = state->results_token_text;
+    auto & text       = state->results_text;
+
+    segments.clear();
+    tokens.clear();
+    token_text.clear();
+    text.clear();
+
+    for (const auto & seg : state->result_all) {
+        whisper_result_segment res = {};
+        res.t0                = seg.t0;
+        res.t1                = seg.t1;
+        res.text              = (int32_t) text.size();
+        res.text_len          = (int32_t) seg.text.size();
+        res.i_token           = (int32_t) tokens.size();
+        res.n_tokens          = (int32_t) seg.tokens.size();
+        res.no_speech_prob    = seg.no_speech_prob;
+        res.speaker_turn_next = seg.speaker_turn_next;
+        segments.push_back(res);
+
+        text.append(seg.text);
+        text.push_back('\0');
+        tokens.insert(tokens.end(), seg.tokens.begin(), seg.tokens.end());
+    }
+
+    // a token's text goes in once however often it was decoded
+    std::map<whisper_token, int32_t> offsets;
+    token_text.reserve(tokens.size());
+    for (const auto & token : tokens) {
+        auto it = offsets.find(token.id);
+        if (it == offsets.end()) {
+            it = offsets.emplace(token.id, (int32_t) text.size()).first;
+            text.append(ctx->vocab.token_str(token.id), ctx->vocab.token_len(token.id));
+            text.push_back('\0');
+        }
+        token_text.push_back(it->second);
+    }
+
+    results->n_segments = (int32_t) segments.size();
+    results->n_tokens   = (int32_t) tokens.size();
+    results->n_text     = (int32_t) text.size();
+    results->segments   = segments.data();
+    results->tokens     = tokens.data();
+    results->token_text = token_text.data();
+    results->text       = text.data();
+    results->lang_id    = state->lang_id;
+    results->lang_prob  = state->lang_prob;
+
+    return results->n_segments;
+}
+
+int whisper_full_get_results(struct whisper_context * ctx, struct whisper_results * results) {
+    return whisper_full_get_results_from_state(ctx, ctx->state, results);
+}
+
 float whisper_full_get_segment_no_speech_prob(struct whisper_context * ctx, int i_segment) {
     return ctx->state->result_all[i_segment].no_speech_prob;
 }
@@ -8062,6 +16245,43 @@ float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state *
     return state->result_all[i_segment].no_speech_prob;
 }
 
+int whisper_full_get_segment_n_fail_p(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].n_fail_p;
+}
+
+int whisper_full_get_segment_n_fail_p_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].n_fail_p;
+}
+
+int whisper_full_get_segment_n_fail_h(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].n_fail_h;
+}
+
+int whisper_full_get_segment_n_fail_h_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].n_fail_h;
+}
+
+float whisper_full_get_segment_confidence_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment) {
+    const whisper_segment & segment = state->result_all[i_segment];
+
+    double sum_logp = 0.0;
+    int    n_text   = 0;
+    for (const auto & token : segment.tokens) {
+        if (token.id < ctx->vocab.token_eot) {
+            sum_logp += std::log(std::max(token.p, 1e-6f));
+            n_text++;
+        }
+    }
+
+    const float p = n_text > 0 ? (float) std::exp(sum_logp/n_text) : 1.0f;
+
+    return p*(1.0f - std::clamp(segment.no_speech_prob, 0.0f, 1.0f))*std::ldexp(1.0f, -(segment.n_fail_p + segment.n_fail_h));
+}
+
+float whisper_full_get_segment_confidence(struct whisper_context * ctx, int i_segment) {
+    return whisper_full_get_segment_confidence_from_state(ctx, ctx->state, i_segment);
+}
+
 // =================================================================================================
 
 //
@@ -8243,6 +16463,10 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
     // when F16 is used, there is an extra work buffer of size N*N*sizeof(float)
     std::vector<uint8_t> buf(3llu*N_max*N_max*sizeof(float) + 3*ggml_tensor_overhead() + ggml_graph_overhead());
 
+    // one backend and one set of worker threads for all the runs
+    ggml_backend_ptr   backend { ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr) };
+    whisper_threadpool threadpool;
+
     // put a bunch of random data in the buffer
     for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
 
@@ -8298,12 +16522,12 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
             double tsum = 0.0;
 
             // heat-up
-            ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
+            ggml_graph_compute_helper(backend.get(), threadpool, gf, n_threads);
 
             for (int i = 0; i < n_max; ++i) {
                 const int64_t t0 = ggml_time_us();
 
-                ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
+                ggml_graph_compute_helper(backend.get(), threadpool, gf, n_threads);
 
                 const int64_t t1 = ggml_time_us();
 
@@ -8336,6 +16560,8 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
         s += strbuf;
     }
 
+    whisper_threadpool_free(threadpool);
+
     return s.c_str();
 }
 
@@ -8386,20 +16612,42 @@ static float voice_length(const std::string & text) {
     return res;
 }
 
-// average the fabs of the signal
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window) {
-    const int hw = n_samples_per_half_window;
+// samples per value of the signal energy (2 ms)
+static const int WHISPER_ENERGY_HOP = 32;
+
+// average of the fabs of the signal over +-WHISPER_ENERGY_HOP samples, one value per WHISPER_ENERGY_HOP samples
+// value j covers [(j - 1)*hop, (j + 1)*hop), i.e. the sums of two consecutive blocks, so the pass is linear
+static std::vector<float> get_signal_energy(const float * signal, int n_samples) {
+    const int hop = WHISPER_ENERGY_HOP;
+
+    const int n = (n_samples + hop - 1)/hop;
 
-    std::vector<float> result(n_samples);
+    std::vector<float> result(n);
 
-    for (int i = 0; i < n_samples; i++) {
-        float sum = 0;
-        for (int j = -hw; j <= hw; j++) {
-            if (i + j >= 0 && i + j < n_samples) {
-                sum += fabs(signal[i + j]);
+    float prev = 0.0f;
+
+    for (int j = 0; j < n; j++) {
+        const float * x  = signal + j*hop;
+        const int     nb = std::min(hop, n_samples - j*hop);
+
+        // independent lanes, so that the compiler can vectorize the sum without reassociating it
+        float acc[8] = { 0.0f };
+
+        int i = 0;
+        for (; i + 8 <= nb; i += 8) {
+            for (int l = 0; l < 8; l++) {
+                acc[l] += fabsf(x[i + l]);
             }
         }
-        result[i] = sum/(2*hw + 1);
+        for (; i < nb; i++) {
+            acc[0] += fabsf(x[i]);
+        }
+
+        const float cur = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+
+        result[j] = (prev + cur)/(2*hop);
+
+        prev = cur;
     }
 
     return result;
@@ -8422,13 +16670,20 @@ static void whisper_exp_compute_token_level_timestamps(
           struct whisper_state & state,
                            int   i_segment,
                          float   thold_pt,
-                         float   thold_ptsum) {
+                         float   thold_ptsum,
+                   const float * samples,
+                           int   n_samples) {
     auto & segment = state.result_all[i_segment];
     auto & tokens  = segment.tokens;
 
-    const int n_samples = state.energy.size();
+    if (state.energy.empty() && n_samples > 0) {
+        state.energy = get_signal_energy(samples, n_samples);
+    }
+
+    // energy values (WHISPER_ENERGY_HOP samples each)
+    const int n_energy = state.energy.size();
 
-    if (n_samples == 0) {
+    if (n_energy == 0) {
         WHISPER_LOG_ERROR("%s: no signal data available\n", __func__);
         return;
     }
@@ -8550,68 +16805,71 @@ static void whisper_exp_compute_token_level_timestamps(
     // VAD
     // expand or contract tokens based on voice activity
     {
-        const int hw = WHISPER_SAMPLE_RATE/8;
+        const int hop = WHISPER_ENERGY_HOP;
+        const int hw  = WHISPER_SAMPLE_RATE/8/hop;
+
+        const auto & energy = state.energy;
 
         for (int j = 0; j < n; j++) {
             if (tokens[j].id >= whisper_token_eot(&ctx)) {
                 continue;
             }
 
-            int s0 = timestamp_to_sample(tokens[j].t0, segment.t0, n_samples);
-            int s1 = timestamp_to_sample(tokens[j].t1, segment.t0, n_samples);
+            int s0 = timestamp_to_sample(tokens[j].t0, segment.t0, n_energy*hop)/hop;
+            int s1 = timestamp_to_sample(tokens[j].t1, segment.t0, n_energy*hop)/hop;
 
             const int ss0 = std::max(s0 - hw, 0);
-            const int ss1 = std::min(s1 + hw, n_samples);
+            const int ss1 = std::min(s1 + hw, n_energy);
 
             const int ns = ss1 - ss0;
 
             float sum = 0.0f;
 
             for (int k = ss0; k < ss1; k++) {
-                sum += state.energy[k];
+                sum += energy[k];
             }
 
             const float thold = 0.5*sum/ns;
 
             {
                 int k = s0;
-                if (state.energy[k] > thold && j > 0) {
-                    while (k > 0 && state.energy[k] > thold) {
+                if (energy[k] > thold && j > 0) {
+                    while (k > 0 && energy[k] > thold) {
                         k--;
                     }
-                    tokens[j].t0 = sample_to_timestamp(k, segment.t0);
+                    tokens[j].t0 = sample_to_timestamp(k*hop, segment.t0);
                     if (tokens[j].t0 < tokens[j - 1].t1) {
                         tokens[j].t0 = tokens[j - 1].t1;
                     } else {
                         s0 = k;
                     }
                 } else {
-                    while (state.energy[k] < thold && k < s1) {
+                    while (energy[k] < thold && k < s1) {
                         k++;
                     }
                     s0 = k;
-                    tokens[j].t0 = sample_to_timestamp(k, segment.t0);
+                    tokens[j].t0 = sample_to_timestamp(k*hop, segment.t0);
                 }
             }
 
             {
                 int k = s1;
-                if (state.energy[k] > thold) {
-                    while (k < n_samples - 1 && state.energy[k] > thold) {
+                if (energy[k] > thold) {
+                    while (k < n_energy - 1 && energy[k] > thold) {
                         k++;
                     }
-                    tokens[j].t1 = sample_to_timestamp(k, segment.t0);
+                    tokens[j].t1 = sample_to_timestamp(k*hop, segment.t0);
                     if (j < n - 1 && tokens[j].t1 > tokens[j + 1].t0) {
                         tokens[j].t1 = tokens[j + 1].t0;
                     } else {
                         s1 = k;
                     }
                 } else {
-                    while (state.energy[k] < thold && k > s0) {
+                    while (energy[k] < thold && k > s0) {
                         k--;
                     }
                     s1 = k;
-                    tokens[j].t1 = sample_to_timestamp(k, segment.t0);
+                    tokens[j].t1 = sample_to_timestamp(k*hop, segment.t0);
                 }
             }
         }
@@ -8674,29 +16932,37 @@ static std::vector<uint32_t> get_alignment_heads_by_layer(const whisper_context_
 // dtw + backtrace to return found path
 // based on
 // https://github.com/openai/whisper/blob/main/whisper/timing.py#L83
-static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
-    WHISPER_ASSERT(ggml_n_dims(x) == 2);
+//
+// x is [M][N] (N text tokens per audio frame). The path is written to
+// path as (i, j) pairs from the last step back to the first.
+static void dtw_and_backtrace(
+        const float * x, int64_t N, int64_t M,
+        std::vector<float> & cost, std::vector<int8_t> & trace, std::vector<int32_t> & path) {
+    const int64_t N1 = N + 1;
 
-    int64_t N = x->ne[0];
-    int64_t M = x->ne[1];
-    struct ggml_tensor * cost = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N + 1, M + 1);
-    struct ggml_tensor * trace = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, N + 1, M + 1);
+    // only the previous cost column is needed, the trace keeps the whole table
+    cost.assign(2*N1, INFINITY);
+    trace.assign(N1*(M + 1), -1);
 
-    cost = whisper_set_f32(cost, INFINITY);
-    trace = whisper_set_i32(trace, -1);
-    whisper_set_f32_nd(cost, 0, 0, 0, 0, 0.0);
+    float * prev = cost.data();
+    float * cur  = cost.data() + N1;
+    prev[0] = 0.0f;
 
     // dtw
     // supposedly can be optmized by computing diagonals in parallel ?
     // Not sure it is worth it since x will be GENERATED_TOKENS*1500 size at most.
     for (int64_t j = 1; j < M + 1; ++j) {
-        for (int64_t i = 1; i < N + 1; ++i) {
-            float c0 = whisper_get_f32_nd(cost, i - 1, j - 1, 0, 0);
-            float c1 = whisper_get_f32_nd(cost, i - 1, j, 0, 0);
-            float c2 = whisper_get_f32_nd(cost, i, j - 1, 0, 0);
+        const float * xj = x + (j - 1)*N;
+        int8_t      * tj = trace.data() + j*N1;
 
-            float c;
-            int32_t t;
+        cur[0] = INFINITY;
+        for (int64_t i = 1; i < N1; ++i) {
+            const float c0 = prev[i - 1];
+            const float c1 = cur[i - 1];
+            const float c2 = prev[i];
+
+            float  c;
+            int8_t t;
             if (c0 < c1 && c0 < c2) {
                 c = c0;
                 t = 0;
@@ -8708,30 +16974,28 @@ static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
                 t = 2;
             }
 
-            c = whisper_get_f32_nd(x, i - 1, j - 1, 0, 0) + c;
-            whisper_set_f32_nd(cost, i, j, 0, 0, c);
-            whisper_set_i32_nd(trace, i, j, 0, 0, t);
+            cur[i] = xj[i - 1] + c;
+            tj[i]  = t;
         }
+        std::swap(prev, cur);
     }
 
     // Backtrace
-    const int64_t BT_MAX_ROWS = N + M - 1;
-    struct ggml_tensor * bt = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, BT_MAX_ROWS, 2);
     // trace[0, :] = 2;
-    for (int64_t i = 0; i < M + 1; ++i)
-        whisper_set_i32_nd(trace, 0, i, 0, 0, 2);
-    //trace[:, 0] = 1;
-    for (int64_t i = 0; i < N + 1; ++i)
-        whisper_set_i32_nd(trace, i, 0, 0, 0, 1);
-    int bt_row_idx = BT_MAX_ROWS - 1;
+    for (int64_t j = 0; j < M + 1; ++j) {
+        trace[j*N1] = 2;
+    }
+    // trace[:, 0] = 1;
+    std::fill(trace.begin(), trace.begin() + N1, 1);
+
+    path.clear();
     int64_t i = N;
     int64_t j = M;
     while (i > 0 || j > 0) {
-        whisper_set_i32_nd(bt, bt_row_idx, 0, 0, 0, i - 1);
-        whisper_set_i32_nd(bt, bt_row_idx, 1, 0, 0, j - 1);
-        --bt_row_idx;
+        path.push_back(i - 1);
+        path.push_back(j - 1);
 
-        int32_t t = whisper_get_i32_nd(trace, i, j, 0, 0);
+        const int8_t t = trace[j*N1 + i];
         if (t == 0) {
             --i;
             --j;
@@ -8743,59 +17007,38 @@ static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
             WHISPER_ASSERT(0);
         }
     }
+}
 
-    // FIXME: manual clip/transpose might not be the most efficient way? (e.g. use ggml funcs)
-    // Clip + transpose
-    // This might not be entirely necessary for our case, but leaving it for now so output matrix
-    // is identical to dtw on openAI timing.py
-    const int64_t result_n_cols = BT_MAX_ROWS-bt_row_idx-1;
-    ggml_tensor * r = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, 2, result_n_cols);
-    for (int64_t i = 0; i < 2; ++i) {
-        for (int64_t j = 0; j < result_n_cols; ++j) {
-            int32_t v = whisper_get_i32_nd(bt, j+bt_row_idx+1, i, 0, 0);
-            whisper_set_i32_nd(r, i, j, 0, 0, v);
-        }
-    }
+// median of each row of n values with "reflect" padding, in place
+static void median_filter(float * data, int64_t n_rows, int64_t n, int filter_width, std::vector<float> & row, std::vector<float> & filter) {
+    WHISPER_ASSERT(filter_width < n);
+    WHISPER_ASSERT(filter_width % 2);
 
-    return r;
-}
+    const int64_t half = filter_width/2;
 
-struct median_filter_user_data {
-    int filter_width;
-};
+    row.resize(n);
+    filter.resize(filter_width);
 
-static void median_filter(struct ggml_tensor * dst , const struct ggml_tensor * a, int ith, int /*nth*/, void * userdata) {
-    if (ith != 0) {
-        return;
-    }
-    int filter_width = ((median_filter_user_data *) userdata)->filter_width;
-    WHISPER_ASSERT(filter_width < a->ne[2]);
-    WHISPER_ASSERT(filter_width % 2);
-    WHISPER_ASSERT(ggml_n_dims(a) == 3);
-    WHISPER_ASSERT(a->type == GGML_TYPE_F32);
-
-    std::vector<float> filter;
-    filter.reserve(filter_width);
-    for (int64_t i = 0; i < a->ne[0]; ++i) {
-        for (int64_t j = 0; j < a->ne[1]; ++j) {
-            for (int64_t k = 0; k < a->ne[2]; ++k) {
-                for (int64_t off = -filter_width/2; off <= filter_width/2; ++off) {
-                    // "reflect" padding
+    for (int64_t r = 0; r < n_rows; ++r) {
+        float * src = data + r*n;
+        for (int64_t k = 0; k < n; ++k) {
+            if (k >= half && k + half < n) {
+                std::copy(src + k - half, src + k + half + 1, filter.begin());
+            } else {
+                for (int64_t off = -half; off <= half; ++off) {
                     int64_t idx = k + off;
                     if (idx < 0) {
                         idx = -idx;
-                    } else if (idx >= a->ne[2]) {
-                        idx = 2*(a->ne[2] - 1) - idx;
+                    } else if (idx >= n) {
+                        idx = 2*(n - 1) - idx;
                     }
-
-                    filter.push_back(whisper_get_f32_nd(a, i, j, idx, 0));
+                    filter[off + half] = src[idx];
                 }
-                std::sort(filter.begin(), filter.end());
-                const float v = filter[filter.size()/2];
-                whisper_set_f32_nd(dst, i, j, k, 0, v);
-                filter.clear();
             }
+            std::nth_element(filter.begin(), filter.begin() + half, filter.end());
+            row[k] = filter[half];
         }
+        std::copy(row.begin(), row.end(), src);
     }
 }
 
@@ -8815,16 +17058,6 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     WHISPER_ASSERT(n_frames <= n_audio_ctx * 2);
     WHISPER_ASSERT(ctx->params.dtw_aheads_preset != WHISPER_AHEADS_NONE);
 
-    // FIXME: Allocating mem everytime we call this func
-    // Our ggml buffer should be pre-allocated somewhere during init and reused
-    // when we call this function
-    struct ggml_init_params gparams = {
-        /*.mem_size   =*/ ctx->params.dtw_mem_size,
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ false,
-    };
-    struct ggml_context * gctx = ggml_init(gparams);
-
     // Build token sequence that will be passed to decoder
     // sot + [lang] + text result + eot
     std::vector<whisper_token> tokens = { whisper_token_sot(ctx), };
@@ -8865,69 +17098,70 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     const auto n_tokens = state->aheads_cross_QKs->ne[0];
     const auto n_heads = state->aheads_cross_QKs->ne[2];
 
-    // Copy data from decoder buffer to a local CPU tensor, discarding unused audio
-    // tokens (i.e. discarding rows at the end of tensor)
-    // IN: Tensor with N_TOKENS*audio_ctx*N_ALIGNMENT_HEADS dims
-    // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
+    // Copy data from decoder buffer, discarding unused audio tokens, and normalize
+    // over the tokens - in original OpenAI code, this is done over dim=-2. The
+    // result is laid out so that the median filter runs over contiguous rows.
+    // IN: N_ALIGNMENT_HEADS*audio_ctx*N_TOKENS
+    // OUT: N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS
     WHISPER_ASSERT(state->aheads_cross_QKs->type == GGML_TYPE_F32);
     WHISPER_ASSERT(ggml_is_contiguous(state->aheads_cross_QKs));
-    ggml_tensor * w = ggml_new_tensor_3d(gctx, GGML_TYPE_F32, n_tokens, n_audio_tokens, n_heads);
     auto & data = state->aheads_cross_QKs_data;
     data.resize(n_tokens * n_audio_ctx * n_heads);
     ggml_backend_tensor_get(state->aheads_cross_QKs, data.data(), 0, sizeof(float) * n_tokens * n_audio_ctx * n_heads);
+
+    auto & dtw = state->dtw;
+    dtw.w.resize(n_heads * n_tokens * n_audio_tokens);
     for (int k = 0; k < n_heads; ++k) {
         for (int j = 0; j < n_audio_tokens; ++j) {
-            memcpy(
-                (char *) w->data + j * w->nb[1] + k * w->nb[2],
-                data.data() + j * n_tokens + k * n_tokens * n_audio_ctx,
-                n_tokens * sizeof(float)
-            );
-        }
-    }
-
-    // Normalize - in original OpenAI code, this is done over dim=-2. In this case,
-    // we already permuted N_TOKENS dimension to columns on last loop, becase ggml_norm
-    // operates over columns. Afterwards, permute to a shape that facilitates mean
-    // operation (after median filter)
-    // IN: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
-    // OUT: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    w = ggml_norm(gctx, w, 1e-9f);
-    w = ggml_permute(gctx, ggml_permute(gctx, w, 2, 1, 0 ,3), 0, 2, 1, 3);
-
-    // Pass median filter - this is done over AUDIO_TOKENS dimension.
-    // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    // OUT: Same dims
-    median_filter_user_data mf_user_data = {medfilt_width};
-    w = ggml_map_custom1(gctx, w, median_filter, 1, &mf_user_data);
+            const float * src = data.data() + j * n_tokens + k * n_tokens * n_audio_ctx;
 
-    // Take mean over columns, scale by -1, reshape to 2D tensor, remove SOT sequence and EOT
-    // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
-    // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS dims
-    w = ggml_mean(gctx, w);
-    w = ggml_scale(gctx, w, -1.0);
-    w = ggml_reshape_2d(gctx, w, w->ne[1], w->ne[2]);
+            double sum = 0.0;
+            for (int t = 0; t < n_tokens; ++t) {
+                sum += src[t];
+            }
+            const float mean = sum/n_tokens;
 
-    // Remove SOT sequence and EOT
-    // Out dimension is (N_TOKENS-sot_sequence_length-1)*N_AUDIO_TOKENS
-    w = ggml_view_2d(gctx, w, w->ne[0] - sot_sequence_length - 1, w->ne[1], w->nb[1], sot_sequence_length * w->nb[0]);
+            double sum2 = 0.0;
+            for (int t = 0; t < n_tokens; ++t) {
+                const float v = src[t] - mean;
+                sum2 += v*v;
+            }
+            const float scale = 1.0f/sqrtf(sum2/n_tokens + 1e-9f);
 
-    // Compute
-    struct ggml_cgraph * gf = ggml_new_graph(gctx);
-    ggml_build_forward_expand(gf, w);
+            float * dst = dtw.w.data() + (size_t) k * n_tokens * n_audio_tokens + j;
+            for (int t = 0; t < n_tokens; ++t) {
+                dst[(size_t) t * n_audio_tokens] = (src[t] - mean)*scale;
+            }
+        }
+    }
 
-    ggml_backend_ptr backend { ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr) };
-    ggml_backend_graph_compute(backend.get(), gf);
+    // Pass median filter - this is done over AUDIO_TOKENS dimension.
+    median_filter(dtw.w.data(), n_heads * n_tokens, n_audio_tokens, medfilt_width, dtw.row, dtw.filter);
+
+    // Take mean over heads, scale by -1 and remove SOT sequence and EOT
+    // OUT: N_AUDIO_TOKENS*(N_TOKENS-sot_sequence_length-1)
+    const int n_text = n_tokens - sot_sequence_length - 1;
+    dtw.x.resize((size_t) n_audio_tokens * n_text);
+    for (int j = 0; j < n_audio_tokens; ++j) {
+        for (int t = 0; t < n_text; ++t) {
+            double sum = 0.0;
+            for (int k = 0; k < n_heads; ++k) {
+                sum += dtw.w[((size_t) k * n_tokens + sot_sequence_length + t) * n_audio_tokens + j];
+            }
+            dtw.x[(size_t) j * n_text + t] = -(float) (sum/n_heads);
+        }
+    }
 
-    ggml_tensor * alignment = dtw_and_backtrace(gctx, w);
+    dtw_and_backtrace(dtw.x.data(), n_text, n_audio_tokens, dtw.cost, dtw.trace, dtw.path);
 
     // Place timestamps on segments
     int32_t last_v = 0;
     auto seg_i = state->result_all.begin() + i_segment;
     auto tok_i = seg_i->tokens.begin();
-    for (int i = 0; i < alignment->ne[1]; ++i) {
-        int32_t v = whisper_get_i32_nd(alignment, 0, i, 0, 0);
+    for (size_t p = dtw.path.size(); p > 0; p -= 2) {
+        int32_t v = dtw.path[p - 2];
         if (v != last_v) {
-            int32_t time_index = whisper_get_i32_nd(alignment, 1, i, 0, 0);
+            int32_t time_index = dtw.path[p - 1];
             int64_t timestamp = (time_index * 2) + seek; // Each index on DTW result = 20mS audio
             last_v = v;
 
@@ -8958,8 +17192,6 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
         }
         fprintf(stderr, "\n");
     }*/
-
-    ggml_free(gctx);
 }
 
 void whisper_log_set(ggml_log_callback log_callback, void * user_data) {
@@ -1,8 +1,11 @@
 #include "whisper.h"
 #include "common-whisper.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <string>
+#include <vector>
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -47,6 +50,35 @@ struct whisper_vad_segments * test_detect_timestamps(
     return timestamps;
 }
 
+// the audio fed in pieces gives the probabilities of whisper_vad_detect_speech() over all of it
+void test_feed(
+        struct whisper_vad_context * vctx,
+        struct whisper_vad_params params,
+        const float * pcmf32,
+        int n_samples) {
+    assert(whisper_vad_detect_speech(vctx, pcmf32, n_samples));
+    const std::vector<float> expected(whisper_vad_probs(vctx), whisper_vad_probs(vctx) + whisper_vad_n_probs(vctx));
+
+    whisper_vad_reset(vctx);
+    assert(whisper_vad_feed(vctx, params, pcmf32, -1) == -1);
+
+    // not a multiple of the window, so most windows span two calls
+    const int n_piece = 1000;
+
+    std::vector<float> probs;
+    for (int i = 0; i < n_samples; i += n_piece) {
+        const int n_probs = whisper_vad_feed(vctx, params, pcmf32 + i, std::min(n_piece, n_samples - i));
+        assert(n_probs >= 0);
+        probs.insert(probs.end(), whisper_vad_probs(vctx), whisper_vad_probs(vctx) + n_probs);
+    }
+
+    // the stream holds back the last partial window (512 samples at 16 kHz) that whisper_vad_detect_speech() pads
+    assert(probs.size() == expected.size() - (n_samples % 512 != 0 ? 1 : 0));
+    for (size_t i = 0; i < probs.size(); ++i) {
+        assert(std::fabs(probs[i] - expected[i]) < 1e-4f);
+    }
+}
+
 int main() {
     std::string vad_model_path = VAD_MODEL_PATH;
     std::string sample_path    = SAMPLE_PATH;
@@ -77,6 +109,10 @@ int main() {
     struct whisper_vad_segments * timestamps = test_detect_timestamps(vctx, params);
 
     whisper_vad_free_segments(timestamps);
+
+    // Test streaming in pieces against the whole buffer
+    test_feed(vctx, params, pcmf32.data(), pcmf32.size());
+
     whisper_vad_free(vctx);
 
     return 0;